@@ -0,0 +1,173 @@
+/**
+ * @file cache_bench.cpp  Benchmarks for TTLCache, ConnectionPool and
+ * DnsCachedResolver cache hits.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+
+#include "sas.h"
+#include "utils.h"
+#include "ttlcache.h"
+#include "connection_pool.h"
+#include "dnscachedresolver.h"
+
+namespace
+{
+  const int NUM_KEYS = 1024;
+
+  class IntFactory : public CacheFactory<int, int>
+  {
+  public:
+    std::shared_ptr<int> get(int key, int& ttl, SAS::TrailId trail)
+    {
+      ttl = 3600;
+      return std::make_shared<int>(key);
+    }
+  };
+
+  // A pool of dummy connections, so the benchmark measures the pool itself.
+  class IntConnectionPool : public ConnectionPool<int>
+  {
+  public:
+    IntConnectionPool(unsigned int thread_cache_size) :
+      ConnectionPool<int>(3600, false, DEFAULT_NUM_SHARDS, thread_cache_size)
+    {
+    }
+
+    ~IntConnectionPool()
+    {
+      destroy_connection_pool();
+    }
+
+  protected:
+    int create_connection(AddrInfo target) { return target.port; }
+    void destroy_connection(AddrInfo target, int conn) {}
+  };
+
+  AddrInfo target(int port)
+  {
+    AddrInfo ai;
+    ai.address.af = AF_INET;
+    inet_pton(AF_INET, "10.0.0.1", &ai.address.addr.ipv4);
+    ai.port = port;
+    ai.transport = IPPROTO_TCP;
+    return ai;
+  }
+}
+
+// Hits on a warm cache, spread over all the keys.
+static void BM_TTLCacheHit(benchmark::State& state)
+{
+  static IntFactory* factory;
+  static TTLCache<int, int>* cache;
+
+  if (state.thread_index() == 0)
+  {
+    factory = new IntFactory();
+    cache = new TTLCache<int, int>(factory);
+
+    for (int key = 0; key < NUM_KEYS; ++key)
+    {
+      int ttl;
+      cache->get(key, ttl, 0);
+    }
+  }
+
+  int key = state.thread_index();
+
+  for (auto _ : state)
+  {
+    int ttl;
+    benchmark::DoNotOptimize(cache->get(key, ttl, 0));
+    key = (key + 1) % NUM_KEYS;
+  }
+
+  if (state.thread_index() == 0)
+  {
+    delete cache;
+    delete factory;
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_TTLCacheHit)->ThreadRange(1, 64)->UseRealTime();
+
+// Getting and releasing a pooled connection, with and without the per-thread
+// cache of connections (the argument is the cache size).
+static void BM_ConnectionPoolGetRelease(benchmark::State& state)
+{
+  static IntConnectionPool* pool;
+
+  if (state.thread_index() == 0)
+  {
+    pool = new IntConnectionPool(state.range(0));
+  }
+
+  AddrInfo ai = target(1000 + (state.thread_index() % 4));
+
+  for (auto _ : state)
+  {
+    ConnectionHandle<int> conn = pool->get_connection(ai);
+    benchmark::DoNotOptimize(conn.get_connection());
+  }
+
+  if (state.thread_index() == 0)
+  {
+    delete pool;
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ConnectionPoolGetRelease)->Arg(0)->Arg(4)->ThreadRange(1, 64)->UseRealTime();
+
+// Queries answered from the DNS cache.  The resolver has no servers, so a miss
+// would fail rather than go to the network.
+static void BM_DnsCachedResolverHit(benchmark::State& state)
+{
+  static DnsCachedResolver* resolver;
+  static std::vector<std::string> domains;
+
+  if (state.thread_index() == 0)
+  {
+    resolver = new DnsCachedResolver("0.0.0.0");
+    domains.clear();
+
+    for (int ii = 0; ii < NUM_KEYS; ++ii)
+    {
+      std::string domain = "host" + std::to_string(ii) + ".example.com";
+      struct in_addr addr;
+      addr.s_addr = htonl(0x0a000000 + ii);
+      std::vector<DnsRRecord*> records;
+      records.push_back(new DnsARecord(domain, 3600, addr));
+      resolver->add_to_cache(domain, ns_t_a, records);
+      domains.push_back(domain);
+    }
+  }
+
+  size_t ii = state.thread_index();
+
+  for (auto _ : state)
+  {
+    benchmark::DoNotOptimize(resolver->dns_query(domains[ii], ns_t_a, 0));
+    ii = (ii + 1) % domains.size();
+  }
+
+  if (state.thread_index() == 0)
+  {
+    delete resolver;
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_DnsCachedResolverHit)->ThreadRange(1, 64)->UseRealTime();
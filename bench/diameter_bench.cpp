@@ -0,0 +1,349 @@
+/**
+ * @file diameter_bench.cpp  Benchmarks for building and decoding typical Cx
+ * and Rf Diameter messages.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+
+#include "diameterstack.h"
+
+// The freeDiameter configuration to load the dictionaries from.  This can be
+// overridden with the DIAMETER_BENCH_CONF environment variable.
+#ifndef DIAMETER_BENCH_CONF
+#define DIAMETER_BENCH_CONF "diameter_bench.conf"
+#endif
+
+namespace
+{
+  const uint32_t TGPP_VENDOR_ID = 10415;
+  const uint32_t CX_APPLICATION_ID = 16777216;
+  const uint32_t ACCOUNTING_APPLICATION_ID = 3;
+
+  const std::string DEST_REALM = "hss.example.com";
+  const std::string IMPI = "6505550001@example.com";
+  const std::string IMPU = "sip:6505550001@example.com";
+  const std::string SERVER_NAME = "sip:scscf.example.com:5054;transport=TCP";
+
+  // The dictionary objects the benchmarks use, on top of those in
+  // Diameter::Dictionary.
+  struct BenchDictionary : public Diameter::Dictionary
+  {
+    BenchDictionary() :
+      MULTIMEDIA_AUTH_REQUEST("3GPP/Multimedia-Auth-Request"),
+      SERVER_ASSIGNMENT_REQUEST("3GPP/Server-Assignment-Request"),
+      ACCOUNTING_REQUEST("Accounting-Request"),
+      PUBLIC_IDENTITY("3GPP", "Public-Identity"),
+      SIP_AUTH_DATA_ITEM("3GPP", "SIP-Auth-Data-Item"),
+      SIP_AUTHENTICATION_SCHEME("3GPP", "SIP-Authentication-Scheme"),
+      SIP_NUMBER_AUTH_ITEMS("3GPP", "SIP-Number-Auth-Items"),
+      SERVER_NAME("3GPP", "Server-Name"),
+      SERVER_ASSIGNMENT_TYPE("3GPP", "Server-Assignment-Type"),
+      USER_DATA_ALREADY_AVAILABLE("3GPP", "User-Data-Already-Available"),
+      ACCOUNTING_RECORD_TYPE("Accounting-Record-Type"),
+      ACCOUNTING_RECORD_NUMBER("Accounting-Record-Number"),
+      ORIGIN_STATE_ID("Origin-State-Id")
+    {}
+
+    const Diameter::Dictionary::Message MULTIMEDIA_AUTH_REQUEST;
+    const Diameter::Dictionary::Message SERVER_ASSIGNMENT_REQUEST;
+    const Diameter::Dictionary::Message ACCOUNTING_REQUEST;
+    const Diameter::Dictionary::AVP PUBLIC_IDENTITY;
+    const Diameter::Dictionary::AVP SIP_AUTH_DATA_ITEM;
+    const Diameter::Dictionary::AVP SIP_AUTHENTICATION_SCHEME;
+    const Diameter::Dictionary::AVP SIP_NUMBER_AUTH_ITEMS;
+    const Diameter::Dictionary::AVP SERVER_NAME;
+    const Diameter::Dictionary::AVP SERVER_ASSIGNMENT_TYPE;
+    const Diameter::Dictionary::AVP USER_DATA_ALREADY_AVAILABLE;
+    const Diameter::Dictionary::AVP ACCOUNTING_RECORD_TYPE;
+    const Diameter::Dictionary::AVP ACCOUNTING_RECORD_NUMBER;
+    const Diameter::Dictionary::AVP ORIGIN_STATE_ID;
+  };
+
+  // Configures the Diameter stack (without starting it) the first time it is
+  // called.
+  //
+  // @return the dictionary, or NULL if the stack couldn't be configured, in
+  //         which case the error is set.
+  BenchDictionary* bench_dictionary(std::string& error)
+  {
+    static BenchDictionary* dict = NULL;
+    static std::string setup_error;
+    static bool set_up = false;
+
+    if (!set_up)
+    {
+      set_up = true;
+      const char* conf = getenv("DIAMETER_BENCH_CONF");
+
+      try
+      {
+        Diameter::Stack::get_instance()->configure((conf != NULL) ? conf : DIAMETER_BENCH_CONF,
+                                                   NULL);
+        dict = new BenchDictionary();
+      }
+      catch (Diameter::Stack::Exception& e)
+      {
+        setup_error = std::string("Diameter setup failed at ") + e._func +
+                      " (" + std::to_string(e._rc) + ")";
+      }
+    }
+
+    error = setup_error;
+    return dict;
+  }
+
+  // The fields of the Cx requests, which are the same in every request.
+  void add_cx_fixed_avps(BenchDictionary* dict, Diameter::Message& msg)
+  {
+    Diameter::AVP vendor_specific_application_id(dict->VENDOR_SPECIFIC_APPLICATION_ID);
+    vendor_specific_application_id.add(Diameter::AVP(dict->VENDOR_ID).val_i32(TGPP_VENDOR_ID));
+    vendor_specific_application_id.add(Diameter::AVP(dict->AUTH_APPLICATION_ID).val_i32(CX_APPLICATION_ID));
+    msg.add(vendor_specific_application_id);
+    msg.add(Diameter::AVP(dict->AUTH_SESSION_STATE).val_i32(1));
+    msg.add_origin();
+    msg.add(Diameter::AVP(dict->DESTINATION_REALM).val_str(DEST_REALM));
+  }
+
+  void add_mar_avps(BenchDictionary* dict, Diameter::Message& msg)
+  {
+    msg.add(Diameter::AVP(dict->USER_NAME).val_str(IMPI));
+    msg.add(Diameter::AVP(dict->PUBLIC_IDENTITY).val_str(IMPU));
+    Diameter::AVP sip_auth_data_item(dict->SIP_AUTH_DATA_ITEM);
+    sip_auth_data_item.add(Diameter::AVP(dict->SIP_AUTHENTICATION_SCHEME).val_str("SIP Digest"));
+    msg.add(sip_auth_data_item);
+    msg.add(Diameter::AVP(dict->SIP_NUMBER_AUTH_ITEMS).val_i32(1));
+    msg.add(Diameter::AVP(dict->SERVER_NAME).val_str(SERVER_NAME));
+  }
+
+  void add_sar_avps(BenchDictionary* dict, Diameter::Message& msg)
+  {
+    msg.add(Diameter::AVP(dict->USER_NAME).val_str(IMPI));
+    msg.add(Diameter::AVP(dict->PUBLIC_IDENTITY).val_str(IMPU));
+    msg.add(Diameter::AVP(dict->SERVER_NAME).val_str(SERVER_NAME));
+    msg.add(Diameter::AVP(dict->SERVER_ASSIGNMENT_TYPE).val_i32(1));
+    msg.add(Diameter::AVP(dict->USER_DATA_ALREADY_AVAILABLE).val_i32(0));
+  }
+
+  void add_acr_fixed_avps(BenchDictionary* dict, Diameter::Message& msg)
+  {
+    msg.add_origin();
+    msg.add(Diameter::AVP(dict->DESTINATION_REALM).val_str(DEST_REALM));
+    msg.add(Diameter::AVP(dict->ACCT_APPLICATION_ID).val_i32(ACCOUNTING_APPLICATION_ID));
+  }
+
+  void add_acr_avps(BenchDictionary* dict, Diameter::Message& msg, int64_t record)
+  {
+    msg.add(Diameter::AVP(dict->ACCOUNTING_RECORD_TYPE).val_i32(2));
+    msg.add(Diameter::AVP(dict->ACCOUNTING_RECORD_NUMBER).val_i32(record));
+    msg.add(Diameter::AVP(dict->USER_NAME).val_str(IMPU));
+    msg.add(Diameter::AVP(dict->ACCT_INTERIM_INTERVAL).val_i32(300));
+    msg.add(Diameter::AVP(dict->ORIGIN_STATE_ID).val_u32(1));
+  }
+}
+
+// Building each request from scratch, as the Cx and Rf clients do.
+
+static void BM_DiameterBuildCxMAR(benchmark::State& state)
+{
+  std::string error;
+  BenchDictionary* dict = bench_dictionary(error);
+  if (dict == NULL)
+  {
+    state.SkipWithError(error.c_str());
+    return;
+  }
+
+  for (auto _ : state)
+  {
+    Diameter::Message msg(dict, dict->MULTIMEDIA_AUTH_REQUEST, NULL);
+    msg.add_new_session_id();
+    add_cx_fixed_avps(dict, msg);
+    add_mar_avps(dict, msg);
+    benchmark::DoNotOptimize(msg.fd_msg());
+  }
+}
+BENCHMARK(BM_DiameterBuildCxMAR);
+
+static void BM_DiameterBuildCxSAR(benchmark::State& state)
+{
+  std::string error;
+  BenchDictionary* dict = bench_dictionary(error);
+  if (dict == NULL)
+  {
+    state.SkipWithError(error.c_str());
+    return;
+  }
+
+  for (auto _ : state)
+  {
+    Diameter::Message msg(dict, dict->SERVER_ASSIGNMENT_REQUEST, NULL);
+    msg.add_new_session_id();
+    add_cx_fixed_avps(dict, msg);
+    add_sar_avps(dict, msg);
+    benchmark::DoNotOptimize(msg.fd_msg());
+  }
+}
+BENCHMARK(BM_DiameterBuildCxSAR);
+
+static void BM_DiameterBuildRfACR(benchmark::State& state)
+{
+  std::string error;
+  BenchDictionary* dict = bench_dictionary(error);
+  if (dict == NULL)
+  {
+    state.SkipWithError(error.c_str());
+    return;
+  }
+
+  int64_t record = 0;
+
+  for (auto _ : state)
+  {
+    Diameter::Message msg(dict, dict->ACCOUNTING_REQUEST, NULL);
+    msg.add_new_session_id();
+    add_acr_fixed_avps(dict, msg);
+    add_acr_avps(dict, msg, ++record);
+    benchmark::DoNotOptimize(msg.fd_msg());
+  }
+}
+BENCHMARK(BM_DiameterBuildRfACR);
+
+// Building each request from a template of its fixed AVPs.
+
+static void BM_DiameterTemplateCxMAR(benchmark::State& state)
+{
+  std::string error;
+  BenchDictionary* dict = bench_dictionary(error);
+  if (dict == NULL)
+  {
+    state.SkipWithError(error.c_str());
+    return;
+  }
+
+  Diameter::Message skeleton(dict, dict->MULTIMEDIA_AUTH_REQUEST, NULL);
+  add_cx_fixed_avps(dict, skeleton);
+  Diameter::MessageTemplate tmpl(skeleton);
+
+  for (auto _ : state)
+  {
+    Diameter::Message msg(dict, tmpl, NULL);
+    msg.add_new_session_id();
+    add_mar_avps(dict, msg);
+    benchmark::DoNotOptimize(msg.fd_msg());
+  }
+}
+BENCHMARK(BM_DiameterTemplateCxMAR);
+
+static void BM_DiameterTemplateCxSAR(benchmark::State& state)
+{
+  std::string error;
+  BenchDictionary* dict = bench_dictionary(error);
+  if (dict == NULL)
+  {
+    state.SkipWithError(error.c_str());
+    return;
+  }
+
+  Diameter::Message skeleton(dict, dict->SERVER_ASSIGNMENT_REQUEST, NULL);
+  add_cx_fixed_avps(dict, skeleton);
+  Diameter::MessageTemplate tmpl(skeleton);
+
+  for (auto _ : state)
+  {
+    Diameter::Message msg(dict, tmpl, NULL);
+    msg.add_new_session_id();
+    add_sar_avps(dict, msg);
+    benchmark::DoNotOptimize(msg.fd_msg());
+  }
+}
+BENCHMARK(BM_DiameterTemplateCxSAR);
+
+static void BM_DiameterTemplateRfACR(benchmark::State& state)
+{
+  std::string error;
+  BenchDictionary* dict = bench_dictionary(error);
+  if (dict == NULL)
+  {
+    state.SkipWithError(error.c_str());
+    return;
+  }
+
+  Diameter::Message skeleton(dict, dict->ACCOUNTING_REQUEST, NULL);
+  add_acr_fixed_avps(dict, skeleton);
+  Diameter::MessageTemplate tmpl(skeleton);
+  int64_t record = 0;
+
+  for (auto _ : state)
+  {
+    Diameter::Message msg(dict, tmpl, NULL);
+    msg.add_new_session_id();
+    add_acr_avps(dict, msg, ++record);
+    benchmark::DoNotOptimize(msg.fd_msg());
+  }
+}
+BENCHMARK(BM_DiameterTemplateRfACR);
+
+// Decoding a received MAR - parsing it and reading its AVPs, as the HSS
+// side does.
+static void BM_DiameterDecodeCxMAR(benchmark::State& state)
+{
+  std::string error;
+  BenchDictionary* dict = bench_dictionary(error);
+  if (dict == NULL)
+  {
+    state.SkipWithError(error.c_str());
+    return;
+  }
+
+  Diameter::Message mar(dict, dict->MULTIMEDIA_AUTH_REQUEST, NULL);
+  mar.add_new_session_id();
+  add_cx_fixed_avps(dict, mar);
+  add_mar_avps(dict, mar);
+  uint8_t* encoded;
+  size_t length;
+  fd_msg_bufferize(mar.fd_msg(), &encoded, &length);
+
+  for (auto _ : state)
+  {
+    uint8_t* buffer = (uint8_t*)malloc(length);
+    memcpy(buffer, encoded, length);
+    struct msg* fd_msg = NULL;
+    fd_msg_parse_buffer(&buffer, length, &fd_msg);
+    fd_msg_parse_dict(fd_msg, fd_g_config->cnf_dict, NULL);
+    Diameter::Message msg(dict, fd_msg, NULL);
+
+    boost::string_ref impi = msg.impi_ref();
+    boost::string_ref impu;
+    msg.get_str_from_avp(dict->PUBLIC_IDENTITY, impu);
+    boost::string_ref server_name;
+    msg.get_str_from_avp(dict->SERVER_NAME, server_name);
+
+    std::string scheme;
+    for (Diameter::AVP::iterator item = msg.begin(dict->SIP_AUTH_DATA_ITEM);
+         item != msg.end();
+         ++item)
+    {
+      item->get_str_from_avp(dict->SIP_AUTHENTICATION_SCHEME, scheme);
+    }
+
+    benchmark::DoNotOptimize(impi.data());
+    benchmark::DoNotOptimize(impu.data());
+    benchmark::DoNotOptimize(server_name.data());
+    benchmark::DoNotOptimize(scheme.data());
+  }
+
+  free(encoded);
+}
+BENCHMARK(BM_DiameterDecodeCxMAR);
@@ -0,0 +1,669 @@
+/**
+ * @file dns_load_harness.cpp  Load and latency harness for the DNS resolvers.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+// Runs a local UDP DNS server with configurable latency, loss and record set
+// sizes, and resolves against it with HttpResolver, DiameterResolver and
+// AstaireResolver (each with its own DnsCachedResolver) from a number of
+// threads.  For each resolver it reports, as a line of JSON:
+// -  the latency of resolving names that aren't cached (misses)
+// -  the latency of resolving cached names (hits)
+// -  the latency of resolving cached names when some of their targets are
+//    blacklisted, to show the cost of blacklist checks
+// -  the DnsCachedResolver's own statistics, including how long threads
+//    waited for queries issued by other threads and for replies.
+//
+// The server answers any name, as follows.
+// -  NAPTR: --naptr-records records for service AAA+D2T, replacing the name
+//    R with _diameter._tcp.R.
+// -  SRV: --srv-records records for targets srv<n>.<name>, port 3868.
+// -  A: one address for names beginning "srv", and --a-records addresses for
+//    anything else.
+// -  AAAA: no records.
+// Answers are cut short rather than exceeding 512 bytes, as the server
+// doesn't support TCP.
+//
+// Run with --help for the options.
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "astaire_resolver.h"
+#include "dnscachedresolver.h"
+#include "diameterresolver.h"
+#include "httpresolver.h"
+#include "latency_histogram.h"
+#include "utils.h"
+
+namespace
+{
+  struct Options
+  {
+    int threads = 16;
+    int names = 64;
+    int misses = 200;
+    int duration_s = 5;
+    int server_latency_us = 1000;
+    int loss_percent = 0;
+    int timeout_ms = 200;
+    int blacklist_percent = 25;
+    int a_records = 4;
+    int srv_records = 8;
+    int naptr_records = 4;
+    int ttl_s = 300;
+    int port = 15353;
+  };
+
+  const size_t MAX_UDP_RESPONSE = 512;
+  const uint16_t TYPE_A = 1;
+  const uint16_t TYPE_SRV = 33;
+  const uint16_t TYPE_NAPTR = 35;
+
+  uint64_t now_us()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+
+  /// A DNS server on the loopback interface that makes up its answers, and
+  /// sends them after a delay (or not at all).
+  class FakeDnsServer
+  {
+  public:
+    FakeDnsServer(const Options& options) :
+      _options(options), _fd(-1), _terminated(false)
+    {
+    }
+
+    ~FakeDnsServer()
+    {
+      stop();
+    }
+
+    bool start()
+    {
+      _fd = socket(AF_INET, SOCK_DGRAM, 0);
+      struct sockaddr_in addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_port = htons(_options.port);
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+      if ((_fd < 0) ||
+          (bind(_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0))
+      {
+        perror("Failed to bind DNS server socket");
+        return false;
+      }
+
+      return (pthread_create(&_thread, NULL, thread_fn, this) == 0);
+    }
+
+    void stop()
+    {
+      if (_fd >= 0)
+      {
+        _terminated = true;
+        pthread_join(_thread, NULL);
+        close(_fd);
+        _fd = -1;
+      }
+    }
+
+    uint64_t queries() const { return _queries.load(); }
+    uint64_t dropped() const { return _dropped.load(); }
+
+  private:
+    struct Response
+    {
+      struct sockaddr_in to;
+      std::string message;
+    };
+
+    static void* thread_fn(void* server)
+    {
+      ((FakeDnsServer*)server)->thread_fn();
+      return NULL;
+    }
+
+    // Receives queries, and sends the responses once they are due.
+    void thread_fn()
+    {
+      std::multimap<uint64_t, Response> pending;
+
+      while (!_terminated)
+      {
+        int timeout_ms = 10;
+        uint64_t now = now_us();
+
+        while ((!pending.empty()) && (pending.begin()->first <= now))
+        {
+          const Response& rsp = pending.begin()->second;
+          sendto(_fd,
+                 rsp.message.data(),
+                 rsp.message.size(),
+                 0,
+                 (const struct sockaddr*)&rsp.to,
+                 sizeof(rsp.to));
+          pending.erase(pending.begin());
+        }
+
+        if (!pending.empty())
+        {
+          timeout_ms = std::min((uint64_t)timeout_ms,
+                                (pending.begin()->first - now + 999) / 1000);
+        }
+
+        struct pollfd pfd = {_fd, POLLIN, 0};
+
+        if (poll(&pfd, 1, timeout_ms) <= 0)
+        {
+          continue;
+        }
+
+        char buf[MAX_UDP_RESPONSE];
+        Response rsp;
+        socklen_t addr_len = sizeof(rsp.to);
+        ssize_t len = recvfrom(_fd,
+                               buf,
+                               sizeof(buf),
+                               0,
+                               (struct sockaddr*)&rsp.to,
+                               &addr_len);
+        _queries.fetch_add(1);
+
+        if ((len <= 0) || (!answer(std::string(buf, len), rsp.message)))
+        {
+          continue;
+        }
+
+        if ((int)Utils::ThreadRandom::below(100) < _options.loss_percent)
+        {
+          _dropped.fetch_add(1);
+          continue;
+        }
+
+        pending.insert(std::make_pair(now_us() + _options.server_latency_us, rsp));
+      }
+    }
+
+    static void put16(std::string& msg, uint16_t value)
+    {
+      msg.push_back((char)(value >> 8));
+      msg.push_back((char)(value & 0xff));
+    }
+
+    static void put32(std::string& msg, uint32_t value)
+    {
+      put16(msg, value >> 16);
+      put16(msg, value & 0xffff);
+    }
+
+    static void put_name(std::string& msg, const std::string& name)
+    {
+      size_t start = 0;
+
+      while (start < name.size())
+      {
+        size_t end = name.find('.', start);
+        end = (end == std::string::npos) ? name.size() : end;
+        msg.push_back((char)(end - start));
+        msg.append(name, start, end - start);
+        start = end + 1;
+      }
+
+      msg.push_back('\0');
+    }
+
+    static void put_string(std::string& msg, const std::string& str)
+    {
+      msg.push_back((char)str.size());
+      msg.append(str);
+    }
+
+    // Builds the response to a query, returning false if it can't be parsed.
+    bool answer(const std::string& query, std::string& rsp)
+    {
+      if (query.size() < 12)
+      {
+        return false;
+      }
+
+      // Read the name and type from the (first) question.
+      std::string name;
+      size_t pos = 12;
+
+      while ((pos < query.size()) && (query[pos] != '\0'))
+      {
+        size_t label_len = (unsigned char)query[pos];
+
+        if (pos + 1 + label_len > query.size())
+        {
+          return false;
+        }
+
+        name += (name.empty() ? "" : ".") + query.substr(pos + 1, label_len);
+        pos += 1 + label_len;
+      }
+
+      if (pos + 5 > query.size())
+      {
+        return false;
+      }
+
+      uint16_t type = ((unsigned char)query[pos + 1] << 8) |
+                      (unsigned char)query[pos + 2];
+      size_t question_end = pos + 5;
+
+      std::vector<std::string> rdatas = records(name, type);
+
+      // The header (with the query's ID), then the question.
+      rsp = query.substr(0, 2);
+      put16(rsp, 0x8180);
+      put16(rsp, 1);
+      put16(rsp, 0);
+      put16(rsp, 0);
+      put16(rsp, 0);
+      rsp.append(query, 12, question_end - 12);
+
+      uint16_t answers = 0;
+
+      for (const std::string& rdata : rdatas)
+      {
+        // Each answer refers back to the name in the question.
+        if (rsp.size() + 12 + rdata.size() > MAX_UDP_RESPONSE)
+        {
+          break;
+        }
+
+        put16(rsp, 0xc00c);
+        put16(rsp, type);
+        put16(rsp, 1);
+        put32(rsp, _options.ttl_s);
+        put16(rsp, rdata.size());
+        rsp.append(rdata);
+        ++answers;
+      }
+
+      rsp[6] = (char)(answers >> 8);
+      rsp[7] = (char)(answers & 0xff);
+      return true;
+    }
+
+    // The record data for a name and type.
+    std::vector<std::string> records(const std::string& name, uint16_t type)
+    {
+      std::vector<std::string> rdatas;
+      uint32_t hash = std::hash<std::string>()(name);
+
+      if (type == TYPE_A)
+      {
+        int count = (name.compare(0, 3, "srv") == 0) ? 1 : _options.a_records;
+
+        for (int ii = 0; ii < count; ++ii)
+        {
+          std::string rdata;
+          put32(rdata, 0x0a000000 | ((hash + ii) & 0x00ffffff));
+          rdatas.push_back(rdata);
+        }
+      }
+      else if (type == TYPE_SRV)
+      {
+        for (int ii = 0; ii < _options.srv_records; ++ii)
+        {
+          std::string rdata;
+          put16(rdata, ii % 2);
+          put16(rdata, 10);
+          put16(rdata, 3868);
+          put_name(rdata, "srv" + std::to_string(ii) + "." + name);
+          rdatas.push_back(rdata);
+        }
+      }
+      else if (type == TYPE_NAPTR)
+      {
+        for (int ii = 0; ii < _options.naptr_records; ++ii)
+        {
+          std::string rdata;
+          put16(rdata, 10);
+          put16(rdata, ii);
+          put_string(rdata, "S");
+          put_string(rdata, "AAA+D2T");
+          put_string(rdata, "");
+          put_name(rdata, "_diameter._tcp." + name);
+          rdatas.push_back(rdata);
+        }
+      }
+
+      return rdatas;
+    }
+
+    const Options& _options;
+    int _fd;
+    pthread_t _thread;
+    std::atomic<bool> _terminated;
+    std::atomic<uint64_t> _queries{0};
+    std::atomic<uint64_t> _dropped{0};
+  };
+
+  /// Resolves a name with one of the resolvers under test, returning the
+  /// targets.
+  typedef std::function<void(const std::string&, std::vector<AddrInfo>&)> ResolveFn;
+
+  // A phase of the run, where each thread resolves names from a function of
+  // its thread index and iteration, until it has done `iterations` (if
+  // non-zero) or the end time has passed.
+  struct Phase
+  {
+    ResolveFn resolve;
+    std::function<std::string(int, int)> name;
+    int iterations;
+    uint64_t end_us;
+    LatencyHistogram latencies;
+  };
+
+  struct PhaseThread
+  {
+    Phase* phase;
+    int index;
+  };
+
+  void* phase_thread_fn(void* thread_ptr)
+  {
+    PhaseThread* thread = (PhaseThread*)thread_ptr;
+    Phase* phase = thread->phase;
+    std::vector<AddrInfo> targets;
+
+    for (int ii = 0;
+         (phase->iterations == 0) ? (now_us() < phase->end_us) : (ii < phase->iterations);
+         ++ii)
+    {
+      std::string name = phase->name(thread->index, ii);
+      uint64_t start = now_us();
+      phase->resolve(name, targets);
+      phase->latencies.record(now_us() - start);
+    }
+
+    return NULL;
+  }
+
+  void run_phase(Phase& phase, int num_threads, LatencyHistogram::Snapshot& result)
+  {
+    std::vector<pthread_t> threads(num_threads);
+    std::vector<PhaseThread> args(num_threads);
+
+    for (int ii = 0; ii < num_threads; ++ii)
+    {
+      args[ii].phase = &phase;
+      args[ii].index = ii;
+      pthread_create(&threads[ii], NULL, phase_thread_fn, &args[ii]);
+    }
+
+    for (pthread_t& thread : threads)
+    {
+      pthread_join(thread, NULL);
+    }
+
+    phase.latencies.snapshot(result);
+  }
+
+  // Runs the miss, hit and blacklist phases against a resolver, and prints
+  // the results.
+  void run_resolver(const char* resolver_name,
+                    const Options& options,
+                    DnsCachedResolver& dns,
+                    BaseResolver& resolver,
+                    ResolveFn resolve)
+  {
+    const std::string prefix = std::string(resolver_name) + ".";
+
+    // Misses: every name is different.
+    Phase misses;
+    misses.resolve = resolve;
+    misses.name = [&prefix](int thread, int ii)
+    {
+      return prefix + "m" + std::to_string(thread) + "-" + std::to_string(ii) + ".bench";
+    };
+    misses.iterations = options.misses;
+    LatencyHistogram::Snapshot miss_latencies;
+    run_phase(misses, options.threads, miss_latencies);
+
+    // Hits: a fixed set of names, which are resolved first to warm the
+    // cache.
+    std::function<std::string(int, int)> hit_name = [&prefix, &options](int thread, int ii)
+    {
+      return prefix + "h" + std::to_string((thread + ii) % options.names) + ".bench";
+    };
+    std::vector<AddrInfo> targets;
+    std::vector<AddrInfo> all_targets;
+
+    for (int ii = 0; ii < options.names; ++ii)
+    {
+      resolve(hit_name(0, ii), targets);
+      all_targets.insert(all_targets.end(), targets.begin(), targets.end());
+    }
+
+    Phase hits;
+    hits.resolve = resolve;
+    hits.name = hit_name;
+    hits.iterations = 0;
+    hits.end_us = now_us() + (uint64_t)options.duration_s * 1000000;
+    LatencyHistogram::Snapshot hit_latencies;
+    run_phase(hits, options.threads, hit_latencies);
+
+    // The same again, with some of the targets blacklisted.
+    for (const AddrInfo& target : all_targets)
+    {
+      if ((int)Utils::ThreadRandom::below(100) < options.blacklist_percent)
+      {
+        resolver.blacklist(target);
+      }
+    }
+
+    Phase blacklisted;
+    blacklisted.resolve = resolve;
+    blacklisted.name = hit_name;
+    blacklisted.iterations = 0;
+    blacklisted.end_us = now_us() + (uint64_t)options.duration_s * 1000000;
+    LatencyHistogram::Snapshot blacklisted_latencies;
+    run_phase(blacklisted, options.threads, blacklisted_latencies);
+    resolver.clear_blacklist();
+
+    DnsCachedResolver::Stats stats = dns.stats();
+    uint64_t timeouts = 0;
+
+    for (const DnsCachedResolver::Stats::Server& server : stats.servers)
+    {
+      timeouts += server.timeouts;
+    }
+
+    printf("{\"resolver\": \"%s\", \"threads\": %d, "
+           "\"miss_p50_us\": %lu, \"miss_p99_us\": %lu, "
+           "\"hit_p50_us\": %lu, \"hit_p99_us\": %lu, \"hit_p999_us\": %lu, "
+           "\"hits_per_s\": %.1f, "
+           "\"blacklisted_hit_p50_us\": %lu, \"blacklisted_hit_p99_us\": %lu, "
+           "\"blacklisted_hits_per_s\": %.1f, "
+           "\"dns_hits\": %lu, \"dns_misses\": %lu, \"dns_timeouts\": %lu, "
+           "\"pending_waits\": %lu, \"pending_wait_p99_us\": %lu, "
+           "\"reply_wait_p50_us\": %lu, \"reply_wait_p99_us\": %lu}\n",
+           resolver_name,
+           options.threads,
+           (unsigned long)miss_latencies.percentile_us(50),
+           (unsigned long)miss_latencies.percentile_us(99),
+           (unsigned long)hit_latencies.percentile_us(50),
+           (unsigned long)hit_latencies.percentile_us(99),
+           (unsigned long)hit_latencies.percentile_us(99.9),
+           (double)hit_latencies.count / options.duration_s,
+           (unsigned long)blacklisted_latencies.percentile_us(50),
+           (unsigned long)blacklisted_latencies.percentile_us(99),
+           (double)blacklisted_latencies.count / options.duration_s,
+           (unsigned long)stats.hits,
+           (unsigned long)stats.misses,
+           (unsigned long)timeouts,
+           (unsigned long)stats.pending_waits,
+           (unsigned long)stats.pending_query_waits.percentile_us(99),
+           (unsigned long)stats.reply_waits.percentile_us(50),
+           (unsigned long)stats.reply_waits.percentile_us(99));
+    fflush(stdout);
+  }
+
+  void usage(const char* name)
+  {
+    Options defaults;
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --threads=N            resolving threads (default %d)\n"
+            "  --names=N              cached names resolved in the hit phases (default %d)\n"
+            "  --misses=N             uncached names each thread resolves (default %d)\n"
+            "  --duration=S           seconds for each hit phase (default %d)\n"
+            "  --server-latency=US    delay before the server responds (default %d)\n"
+            "  --loss=PERCENT         queries the server doesn't answer (default %d)\n"
+            "  --timeout=MS           DNS query timeout (default %d)\n"
+            "  --blacklist=PERCENT    targets blacklisted in the last phase (default %d)\n"
+            "  --a-records=N          addresses per A record set (default %d)\n"
+            "  --srv-records=N        records per SRV set (default %d)\n"
+            "  --naptr-records=N      records per NAPTR set (default %d)\n"
+            "  --ttl=S                TTL of the records (default %d)\n"
+            "  --port=P               port for the DNS server (default %d)\n",
+            name,
+            defaults.threads,
+            defaults.names,
+            defaults.misses,
+            defaults.duration_s,
+            defaults.server_latency_us,
+            defaults.loss_percent,
+            defaults.timeout_ms,
+            defaults.blacklist_percent,
+            defaults.a_records,
+            defaults.srv_records,
+            defaults.naptr_records,
+            defaults.ttl_s,
+            defaults.port);
+  }
+
+  bool parse_options(int argc, char** argv, Options& options)
+  {
+    static const struct option long_options[] =
+    {
+      {"threads",        required_argument, NULL, 't'},
+      {"names",          required_argument, NULL, 'n'},
+      {"misses",         required_argument, NULL, 'm'},
+      {"duration",       required_argument, NULL, 'd'},
+      {"server-latency", required_argument, NULL, 'l'},
+      {"loss",           required_argument, NULL, 'L'},
+      {"timeout",        required_argument, NULL, 'T'},
+      {"blacklist",      required_argument, NULL, 'b'},
+      {"a-records",      required_argument, NULL, 'a'},
+      {"srv-records",    required_argument, NULL, 's'},
+      {"naptr-records",  required_argument, NULL, 'N'},
+      {"ttl",            required_argument, NULL, 'e'},
+      {"port",           required_argument, NULL, 'p'},
+      {"help",           no_argument,       NULL, 'h'},
+      {NULL,             0,                 NULL, 0},
+    };
+
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+    {
+      switch (opt)
+      {
+      case 't': options.threads = atoi(optarg); break;
+      case 'n': options.names = std::max(atoi(optarg), 1); break;
+      case 'm': options.misses = atoi(optarg); break;
+      case 'd': options.duration_s = std::max(atoi(optarg), 1); break;
+      case 'l': options.server_latency_us = atoi(optarg); break;
+      case 'L': options.loss_percent = atoi(optarg); break;
+      case 'T': options.timeout_ms = atoi(optarg); break;
+      case 'b': options.blacklist_percent = atoi(optarg); break;
+      case 'a': options.a_records = atoi(optarg); break;
+      case 's': options.srv_records = atoi(optarg); break;
+      case 'N': options.naptr_records = atoi(optarg); break;
+      case 'e': options.ttl_s = atoi(optarg); break;
+      case 'p': options.port = atoi(optarg); break;
+      default: return false;
+      }
+    }
+
+    return true;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  Options options;
+
+  if (!parse_options(argc, argv, options))
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  FakeDnsServer server(options);
+
+  if (!server.start())
+  {
+    return 1;
+  }
+
+  {
+    DnsCachedResolver dns("127.0.0.1", options.timeout_ms, DnsCachedResolver::NO_DNS_FILE, options.port);
+    HttpResolver resolver(&dns, AF_INET);
+    run_resolver("http", options, dns, resolver,
+                 [&resolver](const std::string& name, std::vector<AddrInfo>& targets)
+                 {
+                   resolver.resolve(name, 0, 5, targets, 0);
+                 });
+  }
+
+  {
+    DnsCachedResolver dns("127.0.0.1", options.timeout_ms, DnsCachedResolver::NO_DNS_FILE, options.port);
+    DiameterResolver resolver(&dns, AF_INET);
+    run_resolver("diameter", options, dns, resolver,
+                 [&resolver](const std::string& name, std::vector<AddrInfo>& targets)
+                 {
+                   int ttl;
+                   resolver.resolve(name, "", 5, targets, ttl);
+                 });
+  }
+
+  {
+    DnsCachedResolver dns("127.0.0.1", options.timeout_ms, DnsCachedResolver::NO_DNS_FILE, options.port);
+    AstaireResolver resolver(&dns, AF_INET);
+    run_resolver("astaire", options, dns, resolver,
+                 [&resolver](const std::string& name, std::vector<AddrInfo>& targets)
+                 {
+                   resolver.resolve(name, 5, targets, 0);
+                 });
+  }
+
+  server.stop();
+  fprintf(stderr,
+          "DNS server received %lu queries, and dropped %lu\n",
+          (unsigned long)server.queries(),
+          (unsigned long)server.dropped());
+  return 0;
+}
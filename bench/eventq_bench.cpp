@@ -0,0 +1,73 @@
+/**
+ * @file eventq_bench.cpp  Benchmarks for eventq.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include "eventq.h"
+
+// Each thread pushes an item and pops one, so every thread contends on the
+// same queue.
+static void BM_EventqPushPop(benchmark::State& state)
+{
+  static eventq<int>* q;
+
+  if (state.thread_index() == 0)
+  {
+    q = new eventq<int>();
+  }
+
+  for (auto _ : state)
+  {
+    int item = 0;
+    q->push(1);
+    q->pop(item);
+    benchmark::DoNotOptimize(item);
+  }
+
+  if (state.thread_index() == 0)
+  {
+    delete q;
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_EventqPushPop)->ThreadRange(1, 64)->UseRealTime();
+
+// As above, but a batch of items at a time.
+static void BM_EventqBatch(benchmark::State& state)
+{
+  static eventq<int>* q;
+  const size_t batch = state.range(0);
+
+  if (state.thread_index() == 0)
+  {
+    q = new eventq<int>();
+  }
+
+  std::vector<int> items(batch, 1);
+  std::vector<int> popped;
+
+  for (auto _ : state)
+  {
+    q->push_batch(items.begin(), items.end());
+    popped.clear();
+    q->pop_batch(popped, batch);
+    benchmark::DoNotOptimize(popped.data());
+  }
+
+  if (state.thread_index() == 0)
+  {
+    delete q;
+  }
+
+  state.SetItemsProcessed(state.iterations() * batch);
+}
+BENCHMARK(BM_EventqBatch)->Arg(16)->ThreadRange(1, 64)->UseRealTime();
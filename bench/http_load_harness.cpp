@@ -0,0 +1,491 @@
+/**
+ * @file http_load_harness.cpp  End-to-end load harness for HttpStack and
+ * HttpClient.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+// Drives an HttpStack with a closed loop of requests from a number of client
+// threads, and reports the throughput, latency percentiles and CPU used per
+// request.  For each request, the handler under test sends a request through
+// an HttpClient (and its HttpConnectionPool) to a stub HttpStack in the same
+// process, then reads and writes a record in a LocalStore.  A LoadMonitor is
+// applied to the stack under test.
+//
+// The handler's threading model is chosen with --model:
+//   inline     - a SpawningHandler, running tasks on the HttpStack threads
+//   pool       - a SpawningHandler wrapped in a HandlerThreadPool
+//   async      - as inline, but the downstream request uses the HttpClient's
+//                asynchronous interface and the reply is sent from its
+//                callback
+//   coroutine  - a CoroutineHandler (only when built with C++20)
+//
+// Run with --help for the other options.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "exception_handler.h"
+#include "health_checker.h"
+#include "httpclient.h"
+#include "http_request.h"
+#include "httpstack.h"
+#include "httpstack_utils.h"
+#include "httpstack_coroutine.h"
+#include "latency_histogram.h"
+#include "load_monitor.h"
+#include "localstore.h"
+#include "fakehttpresolver.hpp"
+
+namespace
+{
+  struct Options
+  {
+    std::string model = "pool";
+    int stack_threads = 4;
+    int worker_threads = 50;
+    int stub_threads = 2;
+    int client_threads = 16;
+    int duration_s = 10;
+    int warmup_s = 2;
+    int port = 19880;
+    int stub_port = 19881;
+    int target_latency_us = 100000;
+    int body_size = 64;
+  };
+
+  // What the tasks under test need.
+  struct Config
+  {
+    HttpClient* downstream;
+    std::string stub_server;
+    LocalStore* store;
+    std::string body;
+    mutable std::atomic<uint64_t> next_key;
+  };
+
+  uint64_t now_us()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+
+  uint64_t cpu_us()
+  {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+           usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+  }
+
+  // The stub that the handler under test calls out to.
+  class StubHandler : public HttpStack::HandlerInterface
+  {
+  public:
+    void process_request(HttpStack::Request& req, SAS::TrailId trail)
+    {
+      req.add_content(std::string("{\"ok\":true}"));
+      req.send_reply(200, trail);
+    }
+  };
+
+  // Reads and updates a record in the store, as a handler typically would
+  // after a downstream request.
+  HTTPCode update_store(const Config* cfg, SAS::TrailId trail)
+  {
+    std::string key = std::to_string(cfg->next_key.fetch_add(1) % 10000);
+    std::string data;
+    uint64_t cas = 0;
+    Store::Status status = cfg->store->get_data("load", key, data, cas, trail);
+
+    if ((status != Store::OK) && (status != Store::NOT_FOUND))
+    {
+      return 500;
+    }
+
+    status = cfg->store->set_data("load", key, cfg->body, cas, 300, trail);
+    return (status == Store::ERROR) ? 500 : 200;
+  }
+
+  class SyncTask : public HttpStackUtils::Task
+  {
+  public:
+    SyncTask(HttpStack::Request& req, const Config* cfg, SAS::TrailId trail) :
+      Task(req, trail), _cfg(cfg)
+    {}
+
+    void run()
+    {
+      HttpRequest downstream(_cfg->stub_server,
+                             "http",
+                             _cfg->downstream,
+                             HttpClient::RequestType::GET,
+                             "/stub");
+      downstream.set_sas_trail(trail());
+      HttpResponse rsp = downstream.send();
+      HTTPCode rc = rsp.get_rc();
+
+      if (rc == 200)
+      {
+        rc = update_store(_cfg, trail());
+      }
+
+      send_http_reply(rc);
+      delete this;
+    }
+
+  private:
+    const Config* _cfg;
+  };
+
+  class AsyncTask : public HttpStackUtils::Task
+  {
+  public:
+    AsyncTask(HttpStack::Request& req, const Config* cfg, SAS::TrailId trail) :
+      Task(req, trail),
+      _cfg(cfg),
+      _downstream(cfg->stub_server,
+                  "http",
+                  cfg->downstream,
+                  HttpClient::RequestType::GET,
+                  "/stub")
+    {}
+
+    void run()
+    {
+      _downstream.set_sas_trail(trail());
+      _downstream.send_async([this](HttpResponse rsp)
+      {
+        HTTPCode rc = rsp.get_rc();
+
+        if (rc == 200)
+        {
+          rc = update_store(_cfg, trail());
+        }
+
+        send_http_reply(rc);
+        delete this;
+      });
+    }
+
+  private:
+    const Config* _cfg;
+    HttpRequest _downstream;
+  };
+
+#if defined(__cpp_impl_coroutine)
+  class CoTask : public HttpStackUtils::CoroutineTask
+  {
+  public:
+    CoTask(HttpStack::Request& req, const Config* cfg, SAS::TrailId trail) :
+      CoroutineTask(req, trail), _cfg(cfg)
+    {}
+
+  protected:
+    HttpStackUtils::Coroutine execute()
+    {
+      HttpRequest downstream(_cfg->stub_server,
+                             "http",
+                             _cfg->downstream,
+                             HttpClient::RequestType::GET,
+                             "/stub");
+      downstream.set_sas_trail(trail());
+      HttpResponse rsp = co_await send_async(downstream);
+      HTTPCode rc = rsp.get_rc();
+
+      if (rc == 200)
+      {
+        rc = update_store(_cfg, trail());
+      }
+
+      send_http_reply(rc);
+    }
+
+  private:
+    const Config* _cfg;
+  };
+#endif
+
+  // The client threads, which each send requests one at a time for the
+  // duration of the run.  Only requests that complete after the warm up are
+  // recorded.
+  struct LoadState
+  {
+    HttpClient* client;
+    std::string server;
+    uint64_t record_from_us;
+    uint64_t end_us;
+    LatencyHistogram latencies;
+    std::atomic<uint64_t> errors;
+  };
+
+  void* client_thread_fn(void* state_ptr)
+  {
+    LoadState* state = (LoadState*)state_ptr;
+    uint64_t now = now_us();
+
+    while (now < state->end_us)
+    {
+      HttpRequest req(state->server,
+                      "http",
+                      state->client,
+                      HttpClient::RequestType::GET,
+                      "/load");
+      HTTPCode rc = req.send().get_rc();
+      uint64_t end = now_us();
+
+      if (end >= state->record_from_us)
+      {
+        if (rc == 200)
+        {
+          state->latencies.record(end - now);
+        }
+        else
+        {
+          state->errors.fetch_add(1);
+        }
+      }
+
+      now = end;
+    }
+
+    return NULL;
+  }
+
+  void usage(const char* name)
+  {
+    Options defaults;
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --model=inline|pool|async|coroutine  handler threading model (default %s)\n"
+            "  --stack-threads=N    HttpStack threads under test (default %d)\n"
+            "  --worker-threads=N   HandlerThreadPool threads, for the pool model (default %d)\n"
+            "  --stub-threads=N     HttpStack threads for the stub (default %d)\n"
+            "  --concurrency=N      client threads, each with one request outstanding (default %d)\n"
+            "  --duration=S         seconds to record for (default %d)\n"
+            "  --warmup=S           seconds to run before recording (default %d)\n"
+            "  --port=P             port for the stack under test (default %d)\n"
+            "  --stub-port=P        port for the stub (default %d)\n"
+            "  --target-latency=US  LoadMonitor target latency (default %d)\n"
+            "  --body-size=B        size of the records written to the store (default %d)\n",
+            name,
+            defaults.model.c_str(),
+            defaults.stack_threads,
+            defaults.worker_threads,
+            defaults.stub_threads,
+            defaults.client_threads,
+            defaults.duration_s,
+            defaults.warmup_s,
+            defaults.port,
+            defaults.stub_port,
+            defaults.target_latency_us,
+            defaults.body_size);
+  }
+
+  bool parse_options(int argc, char** argv, Options& options)
+  {
+    static const struct option long_options[] =
+    {
+      {"model",          required_argument, NULL, 'm'},
+      {"stack-threads",  required_argument, NULL, 's'},
+      {"worker-threads", required_argument, NULL, 'w'},
+      {"stub-threads",   required_argument, NULL, 'u'},
+      {"concurrency",    required_argument, NULL, 'c'},
+      {"duration",       required_argument, NULL, 'd'},
+      {"warmup",         required_argument, NULL, 'W'},
+      {"port",           required_argument, NULL, 'p'},
+      {"stub-port",      required_argument, NULL, 'P'},
+      {"target-latency", required_argument, NULL, 'l'},
+      {"body-size",      required_argument, NULL, 'b'},
+      {"help",           no_argument,       NULL, 'h'},
+      {NULL,             0,                 NULL, 0},
+    };
+
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+    {
+      switch (opt)
+      {
+      case 'm': options.model = optarg; break;
+      case 's': options.stack_threads = atoi(optarg); break;
+      case 'w': options.worker_threads = atoi(optarg); break;
+      case 'u': options.stub_threads = atoi(optarg); break;
+      case 'c': options.client_threads = atoi(optarg); break;
+      case 'd': options.duration_s = atoi(optarg); break;
+      case 'W': options.warmup_s = atoi(optarg); break;
+      case 'p': options.port = atoi(optarg); break;
+      case 'P': options.stub_port = atoi(optarg); break;
+      case 'l': options.target_latency_us = atoi(optarg); break;
+      case 'b': options.body_size = atoi(optarg); break;
+      default: return false;
+      }
+    }
+
+    return ((options.model == "inline") ||
+            (options.model == "pool") ||
+            (options.model == "async") ||
+            (options.model == "coroutine"));
+  }
+}
+
+int main(int argc, char** argv)
+{
+  Options options;
+
+  if (!parse_options(argc, argv, options))
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+#if !defined(__cpp_impl_coroutine)
+  if (options.model == "coroutine")
+  {
+    fprintf(stderr, "The coroutine model needs a C++20 build\n");
+    return 1;
+  }
+#endif
+
+  HealthChecker health_checker;
+  ExceptionHandler exception_handler(600, false, &health_checker);
+
+  // Set the LoadMonitor's rates high enough that it only throttles once the
+  // target latency is exceeded.
+  LoadMonitor load_monitor(options.target_latency_us, 1000, 1000.0, 10.0, 1000000.0);
+
+  // The stub.
+  StubHandler stub_handler;
+  HttpStack stub_stack(options.stub_threads, &exception_handler);
+  stub_stack.initialize();
+  stub_stack.bind_tcp_socket("127.0.0.1", options.stub_port);
+  stub_stack.register_handler("^/stub$", &stub_handler);
+  stub_stack.start();
+
+  // The stack under test, and its downstream client and store.
+  FakeHttpResolver resolver("127.0.0.1");
+  HttpClient downstream(false,
+                        &resolver,
+                        NULL,
+                        NULL,
+                        SASEvent::HttpLogLevel::NONE,
+                        NULL);
+
+  if ((options.model == "async") || (options.model == "coroutine"))
+  {
+    downstream.set_async_io_threads(2);
+  }
+
+  LocalStore store;
+  Config cfg;
+  cfg.downstream = &downstream;
+  cfg.stub_server = "127.0.0.1:" + std::to_string(options.stub_port);
+  cfg.store = &store;
+  cfg.body = std::string(options.body_size, 'x');
+  cfg.next_key = 0;
+
+  HttpStackUtils::SpawningHandler<SyncTask, Config> sync_handler(&cfg);
+  HttpStackUtils::SpawningHandler<AsyncTask, Config> async_handler(&cfg);
+#if defined(__cpp_impl_coroutine)
+  HttpStackUtils::CoroutineHandler<CoTask, Config> coroutine_handler(&cfg);
+#endif
+  HttpStackUtils::HandlerThreadPool pool(options.worker_threads, &exception_handler);
+  HttpStack::HandlerInterface* handler = &sync_handler;
+
+  if (options.model == "pool")
+  {
+    handler = pool.wrap(&sync_handler);
+  }
+  else if (options.model == "async")
+  {
+    handler = &async_handler;
+  }
+#if defined(__cpp_impl_coroutine)
+  else if (options.model == "coroutine")
+  {
+    handler = &coroutine_handler;
+  }
+#endif
+
+  HttpStack stack(options.stack_threads, &exception_handler, NULL, &load_monitor);
+  stack.initialize();
+  stack.bind_tcp_socket("127.0.0.1", options.port);
+  stack.register_handler("^/load$", handler);
+  stack.start();
+
+  // The load.
+  HttpClient client(false,
+                    &resolver,
+                    NULL,
+                    NULL,
+                    SASEvent::HttpLogLevel::NONE,
+                    NULL);
+  LoadState state;
+  state.client = &client;
+  state.server = "127.0.0.1:" + std::to_string(options.port);
+  state.record_from_us = now_us() + (uint64_t)options.warmup_s * 1000000;
+  state.end_us = state.record_from_us + (uint64_t)options.duration_s * 1000000;
+  state.errors = 0;
+
+  std::vector<pthread_t> threads(options.client_threads);
+
+  for (pthread_t& thread : threads)
+  {
+    pthread_create(&thread, NULL, client_thread_fn, &state);
+  }
+
+  // Measure the CPU used over the recorded period only.
+  struct timespec warmup = {options.warmup_s, 0};
+  nanosleep(&warmup, NULL);
+  uint64_t start_cpu_us = cpu_us();
+
+  for (pthread_t& thread : threads)
+  {
+    pthread_join(thread, NULL);
+  }
+
+  uint64_t used_cpu_us = cpu_us() - start_cpu_us;
+
+  stack.stop();
+  stack.wait_stopped();
+  stub_stack.stop();
+  stub_stack.wait_stopped();
+
+  LatencyHistogram::Snapshot snapshot;
+  state.latencies.snapshot(snapshot);
+  uint64_t completed = snapshot.count + state.errors.load();
+
+  // The CPU is for the whole process, so includes the client threads and the
+  // stub - compare it between runs rather than reading it as the cost of the
+  // stack alone.
+  printf("{\"model\": \"%s\", \"concurrency\": %d, \"duration_s\": %d, "
+         "\"requests\": %lu, \"errors\": %lu, \"requests_per_s\": %.1f, "
+         "\"p50_us\": %lu, \"p99_us\": %lu, \"p999_us\": %lu, "
+         "\"cpu_us_per_request\": %.1f}\n",
+         options.model.c_str(),
+         options.client_threads,
+         options.duration_s,
+         (unsigned long)snapshot.count,
+         (unsigned long)state.errors.load(),
+         (double)snapshot.count / options.duration_s,
+         (unsigned long)snapshot.percentile_us(50),
+         (unsigned long)snapshot.percentile_us(99),
+         (unsigned long)snapshot.percentile_us(99.9),
+         (completed > 0) ? (double)used_cpu_us / completed : 0.0);
+
+  return 0;
+}
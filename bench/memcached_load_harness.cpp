@@ -0,0 +1,1468 @@
+/**
+ * @file memcached_load_harness.cpp  Throughput and failover harness for
+ * TopologyNeutralMemcachedStore.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+// Drives a TopologyNeutralMemcachedStore from a number of threads with a mix
+// of reads, unconditional writes and read-modify-write (CAS) updates of a
+// small set of hot keys, and reports throughput and latency as lines of JSON.
+//
+// The store's target domain resolves to one address per replica.  By default
+// the replicas are embedded fake memcached servers, speaking the binary
+// protocol on 127.0.0.1, 127.0.0.2, and so on, and sharing one set of data
+// (as the proxies in front of a real cluster do).  Partway through the run
+// one replica can be made slow, dead (refusing connections) or hung
+// (accepting requests but never answering), so the results show the cost of
+// iterate_through_targets() retrying on the next replica and of the
+// replica being blacklisted.  Alternatively, --memcached runs against real
+// memcached instances, without the fault.
+//
+// Requests are sent with --mode:
+//   sync   - get_data and set_data, one request at a time per thread
+//   async  - get_data_async and set_data_async, with up to --depth requests
+//            outstanding per thread.  Writes read the record first, to get
+//            the CAS value to write with.
+//   multi  - as sync, but reads fetch --batch keys with get_data_multi
+//
+// Each second a line gives that second's throughput and latencies, so the
+// transient when the fault is injected can be seen.  At the end, a line for
+// each type of request gives its throughput, latencies and results before
+// and after the fault, and a final line gives the requests each replica
+// received (which shows the retries) and the hedged reads sent.
+//
+// Run with --help for the other options.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "astaire_resolver.h"
+#include "dnscachedresolver.h"
+#include "dnsrrecords.h"
+#include "hedge_monitor.h"
+#include "latency_histogram.h"
+#include "memcachedstore.h"
+#include "utils.h"
+
+namespace
+{
+  struct Options
+  {
+    int replicas = 3;
+    std::vector<std::string> memcached_ips;
+    int port = 21211;
+    std::string mode = "sync";
+    int threads = 16;
+    int depth = 8;
+    int batch = 16;
+    int duration_s = 20;
+    int keys = 10000;
+    int hot_keys = 16;
+    std::string key_size = "32";
+    std::string value_size = "64-2048";
+    int read_percent = 80;
+    int write_percent = 15;
+    int cas_percent = 5;
+    double hedge_percentile = 0.0;
+    std::string fault = "none";
+    int fault_replica = 0;
+    int fault_at_s = 10;
+    int slow_ms = 50;
+    int server_latency_us = 0;
+  };
+
+  const char* TABLE = "bench";
+  const int EXPIRY_S = 300;
+
+  uint64_t now_us()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+
+  // A distribution of sizes, given as a single size ("100"), a uniform range
+  // ("64-2048") or weighted sizes or ranges ("100:8,4000-8000:2").
+  class SizeDistribution
+  {
+  public:
+    bool parse(const std::string& spec)
+    {
+      _ranges.clear();
+      _total_weight = 0;
+      std::vector<std::string> parts;
+      Utils::split_string(spec, ',', parts, 0, true);
+
+      for (const std::string& part : parts)
+      {
+        Range range;
+        unsigned int weight = 1;
+        int matched = sscanf(part.c_str(), "%zu-%zu:%u", &range.min, &range.max, &weight);
+
+        if (matched < 2)
+        {
+          weight = 1;
+          matched = sscanf(part.c_str(), "%zu:%u", &range.min, &weight);
+          range.max = range.min;
+        }
+
+        if ((matched < 1) || (range.max < range.min) || (weight == 0))
+        {
+          return false;
+        }
+
+        _total_weight += weight;
+        range.cumulative_weight = _total_weight;
+        _ranges.push_back(range);
+      }
+
+      return !_ranges.empty();
+    }
+
+    size_t sample() const
+    {
+      uint32_t pick = Utils::ThreadRandom::below(_total_weight);
+      const Range* range = &_ranges.back();
+
+      for (const Range& r : _ranges)
+      {
+        if (pick < r.cumulative_weight)
+        {
+          range = &r;
+          break;
+        }
+      }
+
+      return range->min + Utils::ThreadRandom::below(range->max - range->min + 1);
+    }
+
+    size_t max() const
+    {
+      size_t max = 0;
+
+      for (const Range& r : _ranges)
+      {
+        max = std::max(max, r.max);
+      }
+
+      return max;
+    }
+
+  private:
+    struct Range
+    {
+      size_t min;
+      size_t max;
+      uint32_t cumulative_weight;
+    };
+
+    std::vector<Range> _ranges;
+    uint32_t _total_weight;
+  };
+
+  // A set of fake memcached replicas, each listening on its own loopback
+  // address, and all served by one thread from one set of data.  This is
+  // enough of the binary protocol for the store: GET(K)(Q), SET, ADD and
+  // DELETE (and their quiet forms), with CAS values and expiry, plus NOOP,
+  // VERSION and QUIT.
+  class FakeMemcachedServers
+  {
+  public:
+    enum Behaviour {NORMAL, SLOW, DEAD, HUNG};
+
+    FakeMemcachedServers(const Options& options) :
+      _options(options),
+      _replicas(options.replicas),
+      _next_conn_id(0),
+      _next_cas(0),
+      _terminated(false),
+      _started(false)
+    {
+    }
+
+    ~FakeMemcachedServers()
+    {
+      stop();
+    }
+
+    bool start()
+    {
+      for (size_t ii = 0; ii < _replicas.size(); ++ii)
+      {
+        _replicas[ii].requests = 0;
+        _replicas[ii].behaviour = NORMAL;
+        _replicas[ii].applied = NORMAL;
+
+        if (!listen_on(ii))
+        {
+          return false;
+        }
+      }
+
+      _started = (pthread_create(&_thread, NULL, thread_fn, this) == 0);
+      return _started;
+    }
+
+    void stop()
+    {
+      if (_started)
+      {
+        _terminated = true;
+        pthread_join(_thread, NULL);
+        _started = false;
+
+        for (std::pair<const uint64_t, Connection>& conn : _connections)
+        {
+          close(conn.second.fd);
+        }
+
+        _connections.clear();
+
+        for (Replica& replica : _replicas)
+        {
+          if (replica.listen_fd >= 0)
+          {
+            close(replica.listen_fd);
+            replica.listen_fd = -1;
+          }
+        }
+      }
+    }
+
+    /// The address of a replica.
+    static std::string address(size_t replica)
+    {
+      return "127.0.0." + std::to_string(replica + 1);
+    }
+
+    /// Change how a replica behaves (from any thread).
+    void set_behaviour(size_t replica, Behaviour behaviour)
+    {
+      _replicas[replica].behaviour = behaviour;
+    }
+
+    /// @return the number of requests a replica has received.
+    uint64_t requests(size_t replica) const
+    {
+      return _replicas[replica].requests.load();
+    }
+
+  private:
+    struct Replica
+    {
+      Replica() : listen_fd(-1) {}
+
+      int listen_fd;
+      std::atomic<uint64_t> requests;
+      std::atomic<int> behaviour;
+
+      // The behaviour the server thread has put into effect.
+      int applied;
+    };
+
+    struct Connection
+    {
+      int fd;
+      size_t replica;
+      std::string in;
+      std::string out;
+    };
+
+    struct Record
+    {
+      std::string value;
+      uint32_t flags;
+      uint64_t cas;
+      time_t expires;
+    };
+
+    static const uint8_t REQUEST_MAGIC = 0x80;
+    static const uint8_t RESPONSE_MAGIC = 0x81;
+    static const size_t HEADER_SIZE = 24;
+
+    enum Opcode
+    {
+      GET = 0x00, SET = 0x01, ADD = 0x02, DELETE = 0x04, QUIT = 0x07,
+      GETQ = 0x09, NOOP = 0x0a, VERSION = 0x0b, GETK = 0x0c, GETKQ = 0x0d,
+      SETQ = 0x11, ADDQ = 0x12, DELETEQ = 0x14
+    };
+
+    enum ResponseStatus
+    {
+      SUCCESS = 0x0000, KEY_NOT_FOUND = 0x0001, KEY_EXISTS = 0x0002,
+      UNKNOWN_COMMAND = 0x0081
+    };
+
+    // The longest relative expiry memcached accepts - longer expiries are
+    // absolute times.
+    static const time_t MAX_RELATIVE_EXPIRY = 60 * 60 * 24 * 30;
+
+    bool listen_on(size_t ii)
+    {
+      int fd = socket(AF_INET, SOCK_STREAM, 0);
+      int on = 1;
+      struct sockaddr_in addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_port = htons(_options.port);
+      inet_pton(AF_INET, address(ii).c_str(), &addr.sin_addr);
+
+      if ((fd < 0) ||
+          (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0) ||
+          (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) ||
+          (listen(fd, 128) != 0))
+      {
+        perror(("Failed to listen on " + address(ii)).c_str());
+
+        if (fd >= 0)
+        {
+          close(fd);
+        }
+
+        return false;
+      }
+
+      _replicas[ii].listen_fd = fd;
+      return true;
+    }
+
+    static void* thread_fn(void* servers)
+    {
+      ((FakeMemcachedServers*)servers)->thread_fn();
+      return NULL;
+    }
+
+    void thread_fn()
+    {
+      std::vector<struct pollfd> fds;
+      std::vector<uint64_t> fd_conns;
+
+      while (!_terminated)
+      {
+        apply_behaviours();
+        send_due_responses();
+
+        fds.clear();
+        fd_conns.clear();
+
+        for (size_t ii = 0; ii < _replicas.size(); ++ii)
+        {
+          if (_replicas[ii].listen_fd >= 0)
+          {
+            struct pollfd pfd = {_replicas[ii].listen_fd, POLLIN, 0};
+            fds.push_back(pfd);
+            fd_conns.push_back(UINT64_MAX - ii);
+          }
+        }
+
+        for (std::pair<const uint64_t, Connection>& conn : _connections)
+        {
+          struct pollfd pfd = {conn.second.fd,
+                               (short)(POLLIN | (conn.second.out.empty() ? 0 : POLLOUT)),
+                               0};
+          fds.push_back(pfd);
+          fd_conns.push_back(conn.first);
+        }
+
+        // Wake up for the next response that is due, and at least every 10ms
+        // to check for behaviour changes and termination.
+        int timeout_ms = 10;
+
+        if (!_pending.empty())
+        {
+          uint64_t now = now_us();
+          uint64_t due = _pending.begin()->first;
+          timeout_ms = std::min(timeout_ms, (due > now) ? (int)((due - now + 999) / 1000) : 0);
+        }
+
+        if (poll(fds.data(), fds.size(), timeout_ms) <= 0)
+        {
+          continue;
+        }
+
+        for (size_t ii = 0; ii < fds.size(); ++ii)
+        {
+          if (fds[ii].revents == 0)
+          {
+            continue;
+          }
+
+          if (fd_conns[ii] > UINT64_MAX - _replicas.size())
+          {
+            accept_connection(UINT64_MAX - fd_conns[ii]);
+          }
+          else
+          {
+            service_connection(fd_conns[ii], fds[ii].revents);
+          }
+        }
+      }
+    }
+
+    // Put changes of behaviour into effect.  A dead replica closes its
+    // listening socket and connections, so that new connections are refused.
+    void apply_behaviours()
+    {
+      for (size_t ii = 0; ii < _replicas.size(); ++ii)
+      {
+        Replica& replica = _replicas[ii];
+        int behaviour = replica.behaviour.load();
+
+        if (behaviour == replica.applied)
+        {
+          continue;
+        }
+
+        if (behaviour == DEAD)
+        {
+          close(replica.listen_fd);
+          replica.listen_fd = -1;
+
+          for (auto it = _connections.begin(); it != _connections.end(); )
+          {
+            if (it->second.replica == ii)
+            {
+              close(it->second.fd);
+              it = _connections.erase(it);
+            }
+            else
+            {
+              ++it;
+            }
+          }
+        }
+        else if (replica.applied == DEAD)
+        {
+          listen_on(ii);
+        }
+
+        replica.applied = behaviour;
+      }
+    }
+
+    void accept_connection(size_t replica)
+    {
+      int fd = accept(_replicas[replica].listen_fd, NULL, NULL);
+
+      if (fd >= 0)
+      {
+        Connection conn;
+        conn.fd = fd;
+        conn.replica = replica;
+        _connections[_next_conn_id++] = conn;
+      }
+    }
+
+    void service_connection(uint64_t id, short revents)
+    {
+      auto it = _connections.find(id);
+      Connection& conn = it->second;
+      bool closed = false;
+
+      if (revents & POLLIN)
+      {
+        char buf[16384];
+        ssize_t len = recv(conn.fd, buf, sizeof(buf), 0);
+
+        if (len <= 0)
+        {
+          closed = true;
+        }
+        else
+        {
+          conn.in.append(buf, len);
+          closed = !process_requests(id, conn);
+        }
+      }
+      else if (revents & (POLLERR | POLLHUP))
+      {
+        closed = true;
+      }
+
+      if ((!closed) && (!conn.out.empty()))
+      {
+        closed = !flush(conn);
+      }
+
+      if (closed)
+      {
+        close(conn.fd);
+        _connections.erase(it);
+      }
+    }
+
+    // Handles the complete requests on a connection, queueing their responses
+    // after the replica's latency.
+    //
+    // @return false if the connection should be closed.
+    bool process_requests(uint64_t id, Connection& conn)
+    {
+      Replica& replica = _replicas[conn.replica];
+      size_t offset = 0;
+      bool keep_open = true;
+      std::string responses;
+
+      while (conn.in.length() - offset >= HEADER_SIZE)
+      {
+        const uint8_t* header = (const uint8_t*)conn.in.data() + offset;
+
+        if (header[0] != REQUEST_MAGIC)
+        {
+          return false;
+        }
+
+        uint32_t body_length = read_uint(header + 8, 4);
+
+        if (conn.in.length() - offset < HEADER_SIZE + body_length)
+        {
+          break;
+        }
+
+        ++replica.requests;
+        keep_open = handle_request(header, responses);
+        offset += HEADER_SIZE + body_length;
+
+        if (!keep_open)
+        {
+          break;
+        }
+      }
+
+      conn.in.erase(0, offset);
+
+      if ((replica.applied != HUNG) && (!responses.empty()))
+      {
+        uint64_t delay_us = (replica.applied == SLOW) ?
+                              (uint64_t)_options.slow_ms * 1000 :
+                              (uint64_t)_options.server_latency_us;
+
+        if (delay_us == 0)
+        {
+          conn.out += responses;
+        }
+        else
+        {
+          _pending.insert(std::make_pair(now_us() + delay_us,
+                                         std::make_pair(id, responses)));
+        }
+      }
+
+      return keep_open;
+    }
+
+    void send_due_responses()
+    {
+      uint64_t now = now_us();
+
+      while ((!_pending.empty()) && (_pending.begin()->first <= now))
+      {
+        auto it = _connections.find(_pending.begin()->second.first);
+
+        if (it != _connections.end())
+        {
+          it->second.out += _pending.begin()->second.second;
+
+          if (!flush(it->second))
+          {
+            close(it->second.fd);
+            _connections.erase(it);
+          }
+        }
+
+        _pending.erase(_pending.begin());
+      }
+    }
+
+    // @return false if the connection has failed.
+    bool flush(Connection& conn)
+    {
+      ssize_t len = send(conn.fd, conn.out.data(), conn.out.length(), MSG_NOSIGNAL | MSG_DONTWAIT);
+
+      if (len < 0)
+      {
+        return ((errno == EAGAIN) || (errno == EWOULDBLOCK));
+      }
+
+      conn.out.erase(0, len);
+      return true;
+    }
+
+    // Handles one request, appending its response (if any).
+    //
+    // @return false if the connection should be closed.
+    bool handle_request(const uint8_t* header, std::string& responses)
+    {
+      uint8_t opcode = header[1];
+      uint16_t key_length = read_uint(header + 2, 2);
+      uint8_t extras_length = header[4];
+      uint32_t body_length = read_uint(header + 8, 4);
+      uint64_t cas = read_uint(header + 16, 8);
+      const char* extras = (const char*)header + HEADER_SIZE;
+      std::string key(extras + extras_length, key_length);
+      std::string value(extras + extras_length + key_length,
+                        body_length - extras_length - key_length);
+
+      switch (opcode)
+      {
+      case GET:
+      case GETQ:
+      case GETK:
+      case GETKQ:
+        {
+          bool quiet = ((opcode == GETQ) || (opcode == GETKQ));
+          bool with_key = ((opcode == GETK) || (opcode == GETKQ));
+          Record* record = find(key);
+
+          if (record != NULL)
+          {
+            std::string flags;
+            append_uint(flags, record->flags, 4);
+            append_response(responses, header, SUCCESS, record->cas, flags,
+                            with_key ? key : "", record->value);
+          }
+          else if (!quiet)
+          {
+            append_response(responses, header, KEY_NOT_FOUND, 0, "",
+                            with_key ? key : "", "Not found");
+          }
+        }
+        break;
+
+      case SET:
+      case SETQ:
+      case ADD:
+      case ADDQ:
+        {
+          bool quiet = ((opcode == SETQ) || (opcode == ADDQ));
+          bool add = ((opcode == ADD) || (opcode == ADDQ));
+          Record* record = find(key);
+          uint16_t status = SUCCESS;
+
+          if (extras_length < 8)
+          {
+            status = UNKNOWN_COMMAND;
+          }
+          else if (add && (record != NULL))
+          {
+            status = KEY_EXISTS;
+          }
+          else if ((cas != 0) && (record == NULL))
+          {
+            status = KEY_NOT_FOUND;
+          }
+          else if ((cas != 0) && (record->cas != cas))
+          {
+            status = KEY_EXISTS;
+          }
+          else
+          {
+            Record& stored = _data[key];
+            stored.value = value;
+            stored.flags = read_uint((const uint8_t*)extras, 4);
+            stored.cas = ++_next_cas;
+            stored.expires = expiry_time(read_uint((const uint8_t*)extras + 4, 4));
+            cas = stored.cas;
+          }
+
+          if ((!quiet) || (status != SUCCESS))
+          {
+            append_response(responses, header, status,
+                            (status == SUCCESS) ? cas : 0, "", "", "");
+          }
+        }
+        break;
+
+      case DELETE:
+      case DELETEQ:
+        {
+          uint16_t status = (_data.erase(key) > 0) ? SUCCESS : KEY_NOT_FOUND;
+
+          if ((opcode == DELETE) || (status != SUCCESS))
+          {
+            append_response(responses, header, status, 0, "", "", "");
+          }
+        }
+        break;
+
+      case NOOP:
+        append_response(responses, header, SUCCESS, 0, "", "", "");
+        break;
+
+      case VERSION:
+        append_response(responses, header, SUCCESS, 0, "", "", "1.4.0-fake");
+        break;
+
+      case QUIT:
+        append_response(responses, header, SUCCESS, 0, "", "", "");
+        return false;
+
+      default:
+        append_response(responses, header, UNKNOWN_COMMAND, 0, "", "", "Unknown command");
+        break;
+      }
+
+      return true;
+    }
+
+    // @return the record for a key, or NULL if there isn't one (or it has
+    //         expired).
+    Record* find(const std::string& key)
+    {
+      auto it = _data.find(key);
+
+      if (it == _data.end())
+      {
+        return NULL;
+      }
+
+      if ((it->second.expires != 0) && (it->second.expires <= time(NULL)))
+      {
+        _data.erase(it);
+        return NULL;
+      }
+
+      return &it->second;
+    }
+
+    static time_t expiry_time(uint32_t expiration)
+    {
+      if (expiration == 0)
+      {
+        return 0;
+      }
+
+      return (expiration <= MAX_RELATIVE_EXPIRY) ? time(NULL) + expiration : expiration;
+    }
+
+    static void append_response(std::string& out,
+                                const uint8_t* request,
+                                uint16_t status,
+                                uint64_t cas,
+                                const std::string& extras,
+                                const std::string& key,
+                                const std::string& value)
+    {
+      out.push_back((char)RESPONSE_MAGIC);
+      out.push_back((char)request[1]);
+      append_uint(out, key.length(), 2);
+      out.push_back((char)extras.length());
+      out.push_back((char)0);
+      append_uint(out, status, 2);
+      append_uint(out, extras.length() + key.length() + value.length(), 4);
+      out.append((const char*)request + 12, 4);
+      append_uint(out, cas, 8);
+      out += extras;
+      out += key;
+      out += value;
+    }
+
+    static uint64_t read_uint(const uint8_t* data, int bytes)
+    {
+      uint64_t value = 0;
+
+      for (int ii = 0; ii < bytes; ++ii)
+      {
+        value = (value << 8) | data[ii];
+      }
+
+      return value;
+    }
+
+    static void append_uint(std::string& out, uint64_t value, int bytes)
+    {
+      for (int ii = bytes - 1; ii >= 0; --ii)
+      {
+        out.push_back((char)((value >> (ii * 8)) & 0xff));
+      }
+    }
+
+    const Options& _options;
+    std::vector<Replica> _replicas;
+    std::map<uint64_t, Connection> _connections;
+    uint64_t _next_conn_id;
+
+    // Responses waiting for the replica's latency, keyed by when they are due,
+    // with the connection they are for.
+    std::multimap<uint64_t, std::pair<uint64_t, std::string>> _pending;
+
+    std::unordered_map<std::string, Record> _data;
+    uint64_t _next_cas;
+
+    pthread_t _thread;
+    std::atomic<bool> _terminated;
+    bool _started;
+  };
+
+  enum Op {READ, WRITE, CAS, NUM_OPS};
+  const char* OP_NAMES[NUM_OPS] = {"read", "write", "cas"};
+
+  // Results are counted separately before and after the fault is injected.
+  enum Phase {BEFORE_FAULT, AFTER_FAULT, NUM_PHASES};
+  const char* PHASE_NAMES[NUM_PHASES] = {"before_fault", "after_fault"};
+
+  struct LoadState
+  {
+    const Options* options;
+    TopologyNeutralMemcachedStore* store;
+    std::vector<std::string> keys;
+    SizeDistribution value_sizes;
+    std::string value_source;
+    uint64_t end_us;
+    std::atomic<int> phase;
+
+    // Latencies of each type of request, and counts of their results (by
+    // Store::Status) and of the keys they covered.
+    LatencyHistogram latencies[NUM_OPS];
+    std::atomic<uint64_t> results[NUM_OPS][NUM_PHASES][Store::ERROR + 1];
+    std::atomic<uint64_t> keys_done[NUM_OPS][NUM_PHASES];
+  };
+
+  // The outcome of a request - contention is a normal result of a CAS
+  // update, and a missing record of a read.
+  void record_result(LoadState* state, Op op, Store::Status status, uint64_t start_us, int keys = 1)
+  {
+    int phase = state->phase.load();
+    state->latencies[op].record(now_us() - start_us);
+    ++state->results[op][phase][status];
+    state->keys_done[op][phase] += keys;
+  }
+
+  Op choose_op(const Options& options)
+  {
+    int pick = (int)Utils::ThreadRandom::below(100);
+
+    if (pick < options.read_percent)
+    {
+      return READ;
+    }
+    else if (pick < options.read_percent + options.write_percent)
+    {
+      return WRITE;
+    }
+
+    return CAS;
+  }
+
+  const std::string& choose_key(LoadState* state, Op op)
+  {
+    uint32_t limit = (op == CAS) ? state->options->hot_keys : state->keys.size();
+    return state->keys[Utils::ThreadRandom::below(limit)];
+  }
+
+  std::string make_value(LoadState* state)
+  {
+    return state->value_source.substr(0, state->value_sizes.sample());
+  }
+
+  // Sends one request, or one batch of reads in multi mode, and waits for
+  // the result.
+  void run_sync_request(LoadState* state, Op op)
+  {
+    TopologyNeutralMemcachedStore* store = state->store;
+    uint64_t start = now_us();
+    std::string data;
+    uint64_t cas = 0;
+
+    if ((op == READ) && (state->options->mode == "multi"))
+    {
+      std::vector<std::string> keys;
+
+      for (int ii = 0; ii < state->options->batch; ++ii)
+      {
+        keys.push_back(choose_key(state, READ));
+      }
+
+      std::vector<Store::GetResult> results;
+      store->get_data_multi(TABLE, keys, results, 0, false);
+
+      // The batch fails if any of its keys fail.
+      Store::Status status = Store::OK;
+
+      for (const Store::GetResult& result : results)
+      {
+        if (result.status == Store::ERROR)
+        {
+          status = Store::ERROR;
+        }
+      }
+
+      record_result(state, op, status, start, keys.size());
+    }
+    else if (op == READ)
+    {
+      Store::Status status = store->get_data(TABLE, choose_key(state, op), data, cas,
+                                             0, false, Store::Format::HEX);
+      record_result(state, op, status, start);
+    }
+    else if (op == WRITE)
+    {
+      Store::Status status = store->set_data_without_cas(TABLE, choose_key(state, op),
+                                                         make_value(state), EXPIRY_S,
+                                                         0, false, Store::Format::HEX);
+      record_result(state, op, status, start);
+    }
+    else
+    {
+      const std::string& key = choose_key(state, op);
+      Store::Status status = store->get_data(TABLE, key, data, cas,
+                                             0, false, Store::Format::HEX);
+
+      if ((status == Store::OK) || (status == Store::NOT_FOUND))
+      {
+        status = store->set_data(TABLE, key, make_value(state), cas, EXPIRY_S,
+                                 0, false, Store::Format::HEX);
+      }
+
+      record_result(state, op, status, start);
+    }
+  }
+
+  // The requests a thread has outstanding in async mode.
+  struct Window
+  {
+    Window() : outstanding(0)
+    {
+      pthread_mutex_init(&lock, NULL);
+      pthread_cond_init(&cond, NULL);
+    }
+
+    ~Window()
+    {
+      pthread_cond_destroy(&cond);
+      pthread_mutex_destroy(&lock);
+    }
+
+    void acquire(int depth)
+    {
+      pthread_mutex_lock(&lock);
+
+      while (outstanding >= depth)
+      {
+        pthread_cond_wait(&cond, &lock);
+      }
+
+      ++outstanding;
+      pthread_mutex_unlock(&lock);
+    }
+
+    void release()
+    {
+      pthread_mutex_lock(&lock);
+      --outstanding;
+      pthread_cond_signal(&cond);
+      pthread_mutex_unlock(&lock);
+    }
+
+    void drain()
+    {
+      pthread_mutex_lock(&lock);
+
+      while (outstanding > 0)
+      {
+        pthread_cond_wait(&cond, &lock);
+      }
+
+      pthread_mutex_unlock(&lock);
+    }
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int outstanding;
+  };
+
+  // Starts one request without waiting for it.  Writes (and CAS updates)
+  // read the record first for its CAS value, and write from the read's
+  // callback.
+  void start_async_request(LoadState* state, Op op, Window* window)
+  {
+    uint64_t start = now_us();
+    std::string key = choose_key(state, op);
+
+    state->store->get_data_async(TABLE, key, 0, false, Store::Format::HEX,
+      [state, op, window, start, key](Store::Status status,
+                                      const std::string& data,
+                                      uint64_t cas)
+      {
+        if ((op == READ) ||
+            ((status != Store::OK) && (status != Store::NOT_FOUND)))
+        {
+          record_result(state, op, status, start);
+          window->release();
+          return;
+        }
+
+        state->store->set_data_async(TABLE, key, make_value(state), cas, EXPIRY_S,
+                                     0, false, Store::Format::HEX,
+          [state, op, window, start](Store::Status status)
+          {
+            record_result(state, op, status, start);
+            window->release();
+          });
+      });
+  }
+
+  void* load_thread_fn(void* state_ptr)
+  {
+    LoadState* state = (LoadState*)state_ptr;
+    const Options& options = *state->options;
+    Window window;
+
+    while (now_us() < state->end_us)
+    {
+      Op op = choose_op(options);
+
+      if (options.mode == "async")
+      {
+        window.acquire(options.depth);
+        start_async_request(state, op, &window);
+      }
+      else
+      {
+        run_sync_request(state, op);
+      }
+    }
+
+    // Wait for the outstanding requests, as their callbacks use the window.
+    window.drain();
+
+    return NULL;
+  }
+
+  void print_latencies(const LatencyHistogram::Snapshot& snapshot)
+  {
+    printf("\"p50_us\": %lu, \"p99_us\": %lu, \"p999_us\": %lu, \"max_us\": %lu",
+           (unsigned long)snapshot.percentile_us(50),
+           (unsigned long)snapshot.percentile_us(99),
+           (unsigned long)snapshot.percentile_us(99.9),
+           (unsigned long)snapshot.percentile_us(100));
+  }
+
+  void usage(const char* name)
+  {
+    Options defaults;
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --replicas=N          fake memcached replicas (default %d)\n"
+            "  --memcached=IP,...    use real memcached instances on these addresses instead\n"
+            "  --port=P              memcached port (default %d)\n"
+            "  --mode=sync|async|multi  how requests are sent (default %s)\n"
+            "  --threads=N           load threads (default %d)\n"
+            "  --depth=N             requests outstanding per thread, for async (default %d)\n"
+            "  --batch=N             keys per read, for multi (default %d)\n"
+            "  --duration=S          seconds to run for (default %d)\n"
+            "  --keys=N              keys in the key space (default %d)\n"
+            "  --hot-keys=N          keys the CAS updates contend on (default %d)\n"
+            "  --key-size=DIST       key sizes (default %s)\n"
+            "  --value-size=DIST     value sizes (default %s)\n"
+            "  --mix=R:W:C           percentages of reads, writes and CAS updates (default %d:%d:%d)\n"
+            "  --hedge=PERCENTILE    hedge reads after this percentile of latency (default off)\n"
+            "  --fault=none|slow|dead|hung  what happens to one replica (default %s)\n"
+            "  --fault-replica=N     which replica (default %d)\n"
+            "  --fault-at=S          seconds into the run (default %d)\n"
+            "  --slow-ms=MS          response delay of a slow replica (default %d)\n"
+            "  --server-latency=US   response delay of the other replicas (default %d)\n"
+            "A DIST is a size (100), a uniform range (64-2048) or weighted sizes and ranges\n"
+            "(100:8,4000-8000:2).\n",
+            name,
+            defaults.replicas,
+            defaults.port,
+            defaults.mode.c_str(),
+            defaults.threads,
+            defaults.depth,
+            defaults.batch,
+            defaults.duration_s,
+            defaults.keys,
+            defaults.hot_keys,
+            defaults.key_size.c_str(),
+            defaults.value_size.c_str(),
+            defaults.read_percent,
+            defaults.write_percent,
+            defaults.cas_percent,
+            defaults.fault.c_str(),
+            defaults.fault_replica,
+            defaults.fault_at_s,
+            defaults.slow_ms,
+            defaults.server_latency_us);
+  }
+
+  bool parse_options(int argc, char** argv, Options& options)
+  {
+    static const struct option long_options[] =
+    {
+      {"replicas",       required_argument, NULL, 'r'},
+      {"memcached",      required_argument, NULL, 'M'},
+      {"port",           required_argument, NULL, 'p'},
+      {"mode",           required_argument, NULL, 'm'},
+      {"threads",        required_argument, NULL, 't'},
+      {"depth",          required_argument, NULL, 'D'},
+      {"batch",          required_argument, NULL, 'b'},
+      {"duration",       required_argument, NULL, 'd'},
+      {"keys",           required_argument, NULL, 'k'},
+      {"hot-keys",       required_argument, NULL, 'H'},
+      {"key-size",       required_argument, NULL, 'K'},
+      {"value-size",     required_argument, NULL, 'V'},
+      {"mix",            required_argument, NULL, 'x'},
+      {"hedge",          required_argument, NULL, 'e'},
+      {"fault",          required_argument, NULL, 'f'},
+      {"fault-replica",  required_argument, NULL, 'F'},
+      {"fault-at",       required_argument, NULL, 'a'},
+      {"slow-ms",        required_argument, NULL, 's'},
+      {"server-latency", required_argument, NULL, 'l'},
+      {"help",           no_argument,       NULL, 'h'},
+      {NULL,             0,                 NULL, 0},
+    };
+
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+    {
+      switch (opt)
+      {
+      case 'r': options.replicas = atoi(optarg); break;
+      case 'M': Utils::split_string(optarg, ',', options.memcached_ips, 0, true); break;
+      case 'p': options.port = atoi(optarg); break;
+      case 'm': options.mode = optarg; break;
+      case 't': options.threads = atoi(optarg); break;
+      case 'D': options.depth = atoi(optarg); break;
+      case 'b': options.batch = atoi(optarg); break;
+      case 'd': options.duration_s = atoi(optarg); break;
+      case 'k': options.keys = atoi(optarg); break;
+      case 'H': options.hot_keys = atoi(optarg); break;
+      case 'K': options.key_size = optarg; break;
+      case 'V': options.value_size = optarg; break;
+      case 'x':
+        if (sscanf(optarg, "%d:%d:%d",
+                   &options.read_percent,
+                   &options.write_percent,
+                   &options.cas_percent) != 3)
+        {
+          return false;
+        }
+        break;
+      case 'e': options.hedge_percentile = atof(optarg); break;
+      case 'f': options.fault = optarg; break;
+      case 'F': options.fault_replica = atoi(optarg); break;
+      case 'a': options.fault_at_s = atoi(optarg); break;
+      case 's': options.slow_ms = atoi(optarg); break;
+      case 'l': options.server_latency_us = atoi(optarg); break;
+      default: return false;
+      }
+    }
+
+    if (!options.memcached_ips.empty())
+    {
+      options.replicas = options.memcached_ips.size();
+    }
+
+    return (((options.mode == "sync") ||
+             (options.mode == "async") ||
+             (options.mode == "multi")) &&
+            ((options.fault == "none") ||
+             (options.fault == "slow") ||
+             (options.fault == "dead") ||
+             (options.fault == "hung")) &&
+            (options.read_percent + options.write_percent + options.cas_percent == 100) &&
+            (options.replicas > 0) &&
+            (options.fault_replica >= 0) &&
+            (options.fault_replica < options.replicas) &&
+            (options.threads > 0) &&
+            (options.depth > 0) &&
+            (options.batch > 0) &&
+            (options.keys > 0) &&
+            (options.hot_keys > 0) &&
+            (options.hot_keys <= options.keys));
+  }
+
+  // Makes the keys, each padded to a size from the distribution.  Keys are
+  // limited to 250 bytes by memcached, including the table name.
+  bool make_keys(const Options& options, std::vector<std::string>& keys)
+  {
+    SizeDistribution sizes;
+
+    if (!sizes.parse(options.key_size))
+    {
+      return false;
+    }
+
+    size_t max_size = 250 - BaseMemcachedStore::get_fq_key(TABLE, "").length();
+
+    for (int ii = 0; ii < options.keys; ++ii)
+    {
+      std::string key = "k" + std::to_string(ii) + "-";
+      size_t size = sizes.sample();
+
+      if (size > max_size)
+      {
+        return false;
+      }
+
+      if (key.length() < size)
+      {
+        key.append(size - key.length(), 'x');
+      }
+
+      keys.push_back(key);
+    }
+
+    return true;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  Options options;
+
+  if (!parse_options(argc, argv, options))
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if ((!options.memcached_ips.empty()) && (options.fault != "none"))
+  {
+    fprintf(stderr, "Faults can only be injected into the fake replicas\n");
+    return 1;
+  }
+
+  LoadState* state = new LoadState();
+  state->options = &options;
+  state->phase = BEFORE_FAULT;
+
+  if ((!make_keys(options, state->keys)) ||
+      (!state->value_sizes.parse(options.value_size)))
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  state->value_source.assign(state->value_sizes.max(), 'v');
+
+  std::unique_ptr<FakeMemcachedServers> servers;
+  std::vector<std::string> replica_ips = options.memcached_ips;
+
+  if (replica_ips.empty())
+  {
+    servers.reset(new FakeMemcachedServers(options));
+
+    if (!servers->start())
+    {
+      return 1;
+    }
+
+    for (int ii = 0; ii < options.replicas; ++ii)
+    {
+      replica_ips.push_back(FakeMemcachedServers::address(ii));
+    }
+  }
+
+  // The target domain resolves to every replica.  The records are put in the
+  // cache, so the DNS server is never asked.
+  const std::string domain = "memcached.bench";
+  DnsCachedResolver dns_resolver("127.0.0.1");
+  std::vector<DnsRRecord*> records;
+
+  for (const std::string& ip : replica_ips)
+  {
+    struct in_addr addr;
+    inet_pton(AF_INET, ip.c_str(), &addr);
+    records.push_back(new DnsARecord(domain, 3600, addr));
+  }
+
+  dns_resolver.add_to_cache(domain, ns_t_a, records);
+  AstaireResolver resolver(&dns_resolver, AF_INET);
+
+  TopologyNeutralMemcachedStore store(domain + ":" + std::to_string(options.port),
+                                      &resolver,
+                                      false);
+  HedgeMonitor hedge_monitor;
+
+  if (options.hedge_percentile > 0)
+  {
+    store.set_hedged_reads(true, options.hedge_percentile, &hedge_monitor);
+  }
+
+  state->store = &store;
+
+  // Write every key first, so that reads find them.
+  for (const std::string& key : state->keys)
+  {
+    store.set_data_without_cas(TABLE, key, make_value(state), EXPIRY_S,
+                               0, false, Store::Format::HEX);
+  }
+
+  uint64_t start = now_us();
+  state->end_us = start + (uint64_t)options.duration_s * 1000000;
+  std::vector<pthread_t> threads(options.threads);
+
+  for (pthread_t& thread : threads)
+  {
+    pthread_create(&thread, NULL, load_thread_fn, state);
+  }
+
+  // Report each second, and inject the fault when it's due.
+  bool inject_fault = (servers && (options.fault != "none"));
+  LatencyHistogram::Snapshot previous;
+  LatencyHistogram::Snapshot at_fault[NUM_OPS];
+  memset(&previous, 0, sizeof(previous));
+  memset(at_fault, 0, sizeof(at_fault));
+  uint64_t previous_errors = 0;
+
+  for (int second = 1; second <= options.duration_s; ++second)
+  {
+    uint64_t due = start + (uint64_t)second * 1000000;
+    uint64_t now = now_us();
+
+    if (due > now)
+    {
+      struct timespec sleep = {(time_t)((due - now) / 1000000),
+                               (long)((due - now) % 1000000) * 1000};
+      nanosleep(&sleep, NULL);
+    }
+
+    // The interval's latencies, across all the types of request.
+    LatencyHistogram::Snapshot current;
+    memset(&current, 0, sizeof(current));
+    uint64_t errors = 0;
+
+    for (int op = 0; op < NUM_OPS; ++op)
+    {
+      LatencyHistogram::Snapshot snapshot;
+      state->latencies[op].snapshot(snapshot);
+      current.merge(snapshot);
+
+      if (inject_fault && (second == options.fault_at_s))
+      {
+        at_fault[op] = snapshot;
+      }
+
+      for (int phase = 0; phase < NUM_PHASES; ++phase)
+      {
+        errors += state->results[op][phase][Store::ERROR].load();
+      }
+    }
+
+    LatencyHistogram::Snapshot interval = current;
+    interval.subtract(previous);
+    previous = current;
+
+    printf("{\"second\": %d, \"fault\": %s, \"requests_per_s\": %lu, \"errors\": %lu, ",
+           second,
+           (state->phase.load() == AFTER_FAULT) ? "true" : "false",
+           (unsigned long)interval.count,
+           (unsigned long)(errors - previous_errors));
+    print_latencies(interval);
+    printf("}\n");
+    fflush(stdout);
+    previous_errors = errors;
+
+    if (inject_fault && (second == options.fault_at_s))
+    {
+      FakeMemcachedServers::Behaviour behaviour =
+        (options.fault == "slow") ? FakeMemcachedServers::SLOW :
+        (options.fault == "dead") ? FakeMemcachedServers::DEAD :
+                                    FakeMemcachedServers::HUNG;
+      servers->set_behaviour(options.fault_replica, behaviour);
+      state->phase = AFTER_FAULT;
+    }
+  }
+
+  for (pthread_t& thread : threads)
+  {
+    pthread_join(thread, NULL);
+  }
+
+  // A summary of each type of request in each phase.
+  bool fault_injected = (state->phase.load() == AFTER_FAULT);
+  int fault_s = fault_injected ? options.fault_at_s : options.duration_s;
+
+  for (int op = 0; op < NUM_OPS; ++op)
+  {
+    LatencyHistogram::Snapshot at_end;
+    state->latencies[op].snapshot(at_end);
+
+    for (int phase = 0; phase < (fault_injected ? NUM_PHASES : 1); ++phase)
+    {
+      LatencyHistogram::Snapshot latencies = at_end;
+      int phase_s = (phase == BEFORE_FAULT) ? fault_s : options.duration_s - fault_s;
+
+      if (fault_injected)
+      {
+        if (phase == BEFORE_FAULT)
+        {
+          latencies = at_fault[op];
+        }
+        else
+        {
+          latencies.subtract(at_fault[op]);
+        }
+      }
+
+      std::atomic<uint64_t>* results = state->results[op][phase];
+      printf("{\"op\": \"%s\", \"phase\": \"%s\", \"mode\": \"%s\", \"threads\": %d, "
+             "\"requests\": %lu, \"requests_per_s\": %.1f, \"keys_per_s\": %.1f, "
+             "\"ok\": %lu, \"not_found\": %lu, \"contention\": %lu, \"errors\": %lu, ",
+             OP_NAMES[op],
+             PHASE_NAMES[phase],
+             options.mode.c_str(),
+             options.threads,
+             (unsigned long)latencies.count,
+             (phase_s > 0) ? (double)latencies.count / phase_s : 0.0,
+             (phase_s > 0) ? (double)state->keys_done[op][phase].load() / phase_s : 0.0,
+             (unsigned long)results[Store::OK].load(),
+             (unsigned long)results[Store::NOT_FOUND].load(),
+             (unsigned long)results[Store::DATA_CONTENTION].load(),
+             (unsigned long)results[Store::ERROR].load());
+      print_latencies(latencies);
+      printf("}\n");
+    }
+  }
+
+  // The requests each replica received include retries from other replicas,
+  // so show where the load went after the fault.
+  if (servers)
+  {
+    printf("{\"replica_requests\": [");
+
+    for (int ii = 0; ii < options.replicas; ++ii)
+    {
+      printf("%s%lu", (ii == 0) ? "" : ", ", (unsigned long)servers->requests(ii));
+    }
+
+    printf("], ");
+  }
+  else
+  {
+    printf("{");
+  }
+
+  printf("\"hedges_sent\": %lu, \"hedges_won\": %lu}\n",
+         (unsigned long)hedge_monitor.hedges_sent(),
+         (unsigned long)hedge_monitor.hedges_won());
+
+  delete state;
+  return 0;
+}
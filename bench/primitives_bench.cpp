@@ -0,0 +1,203 @@
+/**
+ * @file primitives_bench.cpp  Benchmarks for WeightedSelector, BloomFilter,
+ * base64 and the Utils string helpers.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+#include <vector>
+
+#include "weightedselector.h"
+#include "bloom_filter.h"
+#include "base64.h"
+#include "utils.h"
+
+namespace
+{
+  struct Weighted
+  {
+    int get_weight() const { return weight; }
+    int weight;
+  };
+
+  std::vector<Weighted> weights(int num_items)
+  {
+    std::vector<Weighted> items(num_items);
+
+    for (int ii = 0; ii < num_items; ++ii)
+    {
+      items[ii].weight = 1 + (ii % 10);
+    }
+
+    return items;
+  }
+
+  std::string key(int ii)
+  {
+    return "sip:user" + std::to_string(ii) + "@example.com";
+  }
+}
+
+// Selecting every item in turn from a set of weighted items (the argument is
+// the number of items), as when ordering targets.
+static void BM_WeightedSelectorSelectAll(benchmark::State& state)
+{
+  const std::vector<Weighted> items = weights(state.range(0));
+
+  for (auto _ : state)
+  {
+    WeightedSelector<Weighted> selector(items);
+
+    for (size_t ii = 0; ii < items.size(); ++ii)
+    {
+      benchmark::DoNotOptimize(selector.select());
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * items.size());
+}
+BENCHMARK(BM_WeightedSelectorSelectAll)->Arg(4)->Arg(64)->ThreadRange(1, 64)->UseRealTime();
+
+static void BM_WeightedSelectorPermutation(benchmark::State& state)
+{
+  const std::vector<Weighted> items = weights(state.range(0));
+  WeightedSelector<Weighted> selector(items);
+  std::vector<int> order;
+
+  for (auto _ : state)
+  {
+    selector.permutation(order);
+    benchmark::DoNotOptimize(order.data());
+  }
+
+  state.SetItemsProcessed(state.iterations() * items.size());
+}
+BENCHMARK(BM_WeightedSelectorPermutation)->Arg(4)->Arg(64)->ThreadRange(1, 64)->UseRealTime();
+
+// Checking keys against a shared filter, half of which are in it.  The
+// argument is the layout.
+static void BM_BloomFilterCheck(benchmark::State& state)
+{
+  static BloomFilter* filter;
+  const int num_entries = 100000;
+
+  if (state.thread_index() == 0)
+  {
+    filter = BloomFilter::for_num_entries_and_fp_prob(
+                                     num_entries,
+                                     0.01,
+                                     (BloomFilter::Layout)state.range(0));
+
+    for (int ii = 0; ii < num_entries; ii += 2)
+    {
+      filter->add(key(ii));
+    }
+  }
+
+  std::vector<std::string> keys;
+
+  for (int ii = 0; ii < 1024; ++ii)
+  {
+    keys.push_back(key(ii * 97));
+  }
+
+  size_t ii = 0;
+
+  for (auto _ : state)
+  {
+    benchmark::DoNotOptimize(filter->check(keys[ii]));
+    ii = (ii + 1) % keys.size();
+  }
+
+  if (state.thread_index() == 0)
+  {
+    delete filter;
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_BloomFilterCheck)
+  ->Arg(BloomFilter::STANDARD)
+  ->Arg(BloomFilter::BLOCKED)
+  ->ThreadRange(1, 64)
+  ->UseRealTime();
+
+// Encoding and decoding (the argument is the number of bytes).
+static void BM_Base64Encode(benchmark::State& state)
+{
+  std::string data(state.range(0), '\x5a');
+  std::vector<char> out(base64_encoded_length(data.size()));
+
+  for (auto _ : state)
+  {
+    benchmark::DoNotOptimize(base64_encode_to((const unsigned char*)data.data(),
+                                              data.size(),
+                                              out.data()));
+  }
+
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_Base64Encode)->Arg(16)->Arg(1024)->ThreadRange(1, 64)->UseRealTime();
+
+static void BM_Base64Decode(benchmark::State& state)
+{
+  std::string encoded = base64_encode(std::string(state.range(0), '\x5a'));
+
+  for (auto _ : state)
+  {
+    benchmark::DoNotOptimize(base64_decode(encoded));
+  }
+
+  state.SetBytesProcessed(state.iterations() * encoded.size());
+}
+BENCHMARK(BM_Base64Decode)->Arg(16)->Arg(1024)->ThreadRange(1, 64)->UseRealTime();
+
+static void BM_UtilsSplitString(benchmark::State& state)
+{
+  const std::string line = " alpha,beta, gamma,delta,epsilon,zeta,eta,theta ";
+  std::vector<std::string> tokens;
+
+  for (auto _ : state)
+  {
+    tokens.clear();
+    Utils::split_string(line, ',', tokens, 0, true);
+    benchmark::DoNotOptimize(tokens.data());
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_UtilsSplitString)->ThreadRange(1, 64)->UseRealTime();
+
+static void BM_UtilsUrlEscape(benchmark::State& state)
+{
+  const std::string uri = "sip:+1 (650) 555-0100@example.com;user=phone?a=b&c=d";
+
+  for (auto _ : state)
+  {
+    benchmark::DoNotOptimize(Utils::url_escape(uri));
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_UtilsUrlEscape)->ThreadRange(1, 64)->UseRealTime();
+
+static void BM_UtilsRemoveVisualSeparators(benchmark::State& state)
+{
+  const std::string number = "+1-(650)-555.0100";
+
+  for (auto _ : state)
+  {
+    benchmark::DoNotOptimize(Utils::remove_visual_separators(number));
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_UtilsRemoveVisualSeparators)->ThreadRange(1, 64)->UseRealTime();
@@ -0,0 +1,83 @@
+/**
+ * @file snmp_bench.cpp  Benchmarks for the SNMP accumulator tables.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include "snmp_agent.h"
+#include "snmp_event_accumulator_table.h"
+#include "snmp_continuous_accumulator_table.h"
+
+namespace
+{
+  // The tables must be registered with an agent, which is set up once for
+  // all the benchmarks.
+  void setup_agent()
+  {
+    static bool setup = (snmp_setup("cpp_common_bench") == 0);
+    (void)setup;
+  }
+}
+
+// Every thread accumulates samples into one table, as request threads do.
+static void BM_EventAccumulate(benchmark::State& state)
+{
+  static SNMP::EventAccumulatorTable* table;
+
+  if (state.thread_index() == 0)
+  {
+    setup_agent();
+    table = SNMP::EventAccumulatorTable::create("bench_event", ".1.2.2.1");
+  }
+
+  uint32_t sample = state.thread_index();
+
+  for (auto _ : state)
+  {
+    table->accumulate(sample++ % 1000);
+  }
+
+  if (state.thread_index() == 0)
+  {
+    delete table;
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_EventAccumulate)->ThreadRange(1, 64)->UseRealTime();
+
+// The argument is whether the table is sharded.
+static void BM_ContinuousAccumulate(benchmark::State& state)
+{
+  static SNMP::ContinuousAccumulatorTable* table;
+
+  if (state.thread_index() == 0)
+  {
+    setup_agent();
+    table = (state.range(0) != 0) ?
+      SNMP::ContinuousAccumulatorTable::create_sharded("bench_continuous", ".1.2.2.2") :
+      SNMP::ContinuousAccumulatorTable::create("bench_continuous", ".1.2.2.2");
+  }
+
+  uint32_t sample = state.thread_index();
+
+  for (auto _ : state)
+  {
+    table->accumulate(sample++ % 1000);
+  }
+
+  if (state.thread_index() == 0)
+  {
+    delete table;
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ContinuousAccumulate)->Arg(0)->Arg(1)->ThreadRange(1, 64)->UseRealTime();
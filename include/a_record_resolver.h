@@ -54,6 +54,22 @@ public:
     return resolve_iter(host, port, trail, BaseResolver::ALL_LISTS);
   };
 
+  // As resolve_iter, but doesn't wait for the A record lookup.  The callback
+  // is passed the iterator - it is called on this thread if no DNS query is
+  // needed, and otherwise on the DNS client's I/O thread, so must not block.
+  virtual void resolve_iter_async(const std::string& host,
+                                  int port,
+                                  SAS::TrailId trail,
+                                  int allowed_host_state,
+                                  AddrIteratorCallback callback);
+  virtual void resolve_iter_async(const std::string& host,
+                                  int port,
+                                  SAS::TrailId trail,
+                                  AddrIteratorCallback callback)
+  {
+    resolve_iter_async(host, port, trail, BaseResolver::ALL_LISTS, callback);
+  };
+
   /// Default duration to blacklist hosts after we fail to connect to them.
   static const int DEFAULT_BLACKLIST_DURATION = 30;
   static const int DEFAULT_GRAYLIST_DURATION = 30;
@@ -61,6 +77,16 @@ public:
   static const int TRANSPORT = IPPROTO_TCP;
 
 private:
+  // If the host is an IP address, creates an iterator for it (which is empty
+  // if the address isn't allowed).
+  //
+  // @return whether the host is an IP address.
+  bool ip_address_iter(const std::string& host,
+                       int port,
+                       SAS::TrailId trail,
+                       int allowed_host_state,
+                       BaseAddrIterator*& addr_it);
+
   int _address_family;
   const int _default_port;
 };
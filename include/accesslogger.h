@@ -12,14 +12,36 @@
 #ifndef ACCESSLOGGER_H__
 #define ACCESSLOGGER_H__
 
+#include <pthread.h>
+#include <time.h>
+
+#include <atomic>
 #include <sstream>
+#include <vector>
 
 #include "logger.h"
+#include "latency_histogram.h"
 
+/// Writes the access log.
+///
+/// Logging a request doesn't write to the log file.  The line is formatted
+/// into a ring buffer belonging to the calling thread, and a background
+/// thread periodically writes the lines from all the threads' buffers in a
+/// batch.  If a thread's buffer is full the line is dropped rather than
+/// waiting for it to be written, and counted as a discard.
 class AccessLogger
 {
 public:
-  AccessLogger(const std::string& directory);
+  /// The default number of lines each thread's buffer holds.
+  static const unsigned int DEFAULT_BUFFER_LINES = 512;
+
+  /// @param directory    the directory to write the log files in.
+  /// @param buffer_lines the number of lines each thread's buffer holds.
+  AccessLogger(const std::string& directory,
+               unsigned int buffer_lines = DEFAULT_BUFFER_LINES);
+
+  /// Writes any lines that are still buffered.  No other threads may be
+  /// logging when the logger is destroyed.
   ~AccessLogger();
 
   void log(const std::string& url,
@@ -27,11 +49,99 @@ public:
            int rc,
            unsigned long latency_us);
 
+  /// Log a summary of the latencies of the requests to a route (or "-" if
+  /// the route is empty, i.e. for a default handler).
+  void log_latency_histogram(const std::string& route,
+                             const LatencyHistogram::Snapshot& snapshot);
+
+  /// Write all the buffered lines now, rather than waiting for the
+  /// background thread.
+  void flush();
+
+  /// @return the number of lines dropped because a buffer was full.
+  uint64_t discards() const { return _discards.load(); }
+
+  /// Write the log file through an io_uring writer (see
+  /// Logger::set_io_uring_writer).
+  void set_io_uring_writer(IoUringWriter* writer)
+  {
+    _logger->set_io_uring_writer(writer);
+  }
+
 private:
   static const int BUFFER_SIZE = 1000;
 
+  /// How often the background thread writes the buffered lines.
+  static const long DRAIN_INTERVAL_MS = 100;
+
+  // A formatted line, and when it was logged.
+  struct Entry
+  {
+    struct timespec time;
+    char line[BUFFER_SIZE];
+  };
+
+  // A thread's buffer of lines.  Only the owning thread adds lines (at
+  // `head`), and only the thread holding _drain_lock removes them (at `tail`),
+  // so neither needs a lock.  When the thread exits the ring is marked as
+  // closed, and freed once it is empty.
+  struct Ring
+  {
+    Ring(AccessLogger* logger, unsigned int capacity) :
+      logger(logger), entries(capacity), head(0), tail(0), closed(false)
+    {}
+
+    AccessLogger* logger;
+    std::vector<Entry> entries;
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    std::atomic<bool> closed;
+  };
+
+  // Returns the next free entry in the calling thread's ring, or NULL (having
+  // counted a discard) if it is full.  The entry is added to the ring by
+  // commit_entry().
+  Entry* start_entry(Ring*& ring);
+  static void commit_entry(Ring* ring);
+
+  // Returns the calling thread's ring, creating it if required.
+  Ring* thread_ring();
+
+  // Called when a thread with a ring exits.
+  static void thread_ring_destructor(void* ring);
+
+  // Writes the lines from all the rings to the log file.
+  void drain();
+
+  static void* drain_thread_fn(void* logger);
+  void drain_thread_fn();
+
   Logger* _logger;
+  unsigned int _buffer_lines;
+  pthread_key_t _ring_key;
+
+  // All the threads' rings, protected by _rings_lock.
+  std::vector<Ring*> _rings;
+  pthread_mutex_t _rings_lock;
+
+  // Held while draining the rings, so that flush() and the background thread
+  // don't both drain at once.
+  pthread_mutex_t _drain_lock;
+
+  std::atomic<uint64_t> _discards;
+
+  // The number of discards that have been reported in the log.
+  uint64_t _reported_discards;
+
+  // The background thread, and the condition used to stop it.
+  pthread_t _drain_thread;
+  pthread_mutex_t _terminate_lock;
+  pthread_cond_t _terminate_cond;
+  bool _terminated;
+
+  // Don't implement the following, to avoid copies of this instance.
+  AccessLogger(AccessLogger const&);
+  void operator=(AccessLogger const&);
 };
 
 #endif
-
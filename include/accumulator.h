@@ -55,18 +55,26 @@ public:
   virtual void reset();
 
 private:
+  /// Statistics being accumulated by one shard. The padding keeps each
+  /// shard's values off the cache lines of the values before it.
+  struct Shard {
+    char _padding[64];
+    std::atomic_uint_fast64_t _n;
+    std::atomic_uint_fast64_t _sigma;
+    std::atomic_uint_fast64_t _sigma_squared;
+    std::atomic_uint_fast64_t _lwm;
+    std::atomic_uint_fast64_t _hwm;
+  };
+
   /// Set of current statistics being accumulated.
   struct {
-    // We use a set of atomics here. This isn't perfect, as reads are not
+    // We use a set of atomics here, split across shards that are merged when
+    // the statistics are read. This isn't perfect, as reads are not
     // synchronized (e.g. we could read a value of _n that is more recent than
     // the value we read of _sigma). However, given that _n is likely to be
     // quite large and only out by 1 or 2, it's not expected to matter.
     std::atomic_uint_fast64_t _timestamp_us;
-    std::atomic_uint_fast64_t _n;
-    std::atomic_uint_fast64_t _sigma;
-    std::atomic_uint_fast64_t _sigma_squared;
-    std::atomic_uint_fast64_t _lwm;
-    std::atomic_uint_fast64_t _hwm;
+    Shard _shards[NUM_SHARDS];
   } _current;
 
   /// Set of statistics accumulated over the previous period.
@@ -14,6 +14,8 @@
 
 #include <pthread.h>
 
+#include <deque>
+#include <map>
 #include <string>
 #include <vector>
 #include <atomic>
@@ -35,6 +37,12 @@ class AlarmManager;
 /// Class which provides an agent thead to accept queued alarm requests from
 /// clients and forward them via ZMQ to snmpd (which will actually generate the
 /// inform message(s)).
+///
+/// Only the latest state of an alarm matters, so requests for an alarm that
+/// hasn't been sent yet are replaced by later ones, rather than queued behind
+/// them.  The agent sends all the waiting requests at once, without waiting
+/// for each reply before sending the next, so a storm of alarm changes
+/// doesn't back up behind the round trips to snmpd.
 
 class AlarmReqAgent
 {
@@ -45,7 +53,11 @@ public:
   };
 
   /// Queue an alarm request to be forwarded to snmpd.
-  void alarm_request(std::vector<std::string> req);
+  ///
+  /// @param key identifies the alarm the request is for.  If a request with
+  ///            the same key is still waiting to be sent, it is replaced.
+  /// @param req the parts of the request.
+  void alarm_request(const std::string& key, const std::vector<std::string>& req);
 
   // The AlarmManager is the only class allowed to create the AlarmReqAgent
   friend class AlarmManager;
@@ -57,7 +69,10 @@ private:
   enum
   {
     ZMQ_PORT = 6664,
-    MAX_REPLY_LEN = 16
+    MAX_REPLY_LEN = 16,
+
+    // The most requests sent before waiting for their replies.
+    MAX_IN_FLIGHT = 64
   };
 
   static void* agent_thread(void* alarm_req_agent);
@@ -70,6 +85,12 @@ private:
 
   void agent();
 
+  // Sends a request to snmpd, returning false if the socket has failed.
+  bool send_request(const std::vector<std::string>& req);
+
+  // Receives a reply from snmpd, returning false if the socket has failed.
+  bool recv_reply();
+
   pthread_t _thread;
 
   pthread_mutex_t _start_mutex;
@@ -78,7 +99,13 @@ private:
   void* _ctx;
   void* _sck;
 
-  eventq<std::vector<std::string> >* _req_q;
+  // The requests waiting to be sent (keyed on alarm), and the order in which
+  // they were queued, protected by _req_lock.
+  std::map<std::string, std::vector<std::string> > _pending_reqs;
+  std::deque<std::string> _pending_order;
+  pthread_mutex_t _req_lock;
+  pthread_cond_t _req_cond;
+  bool _terminated;
 };
 
 /// @class AlarmState
@@ -119,6 +146,9 @@ private:
   AlarmReqAgent* _alarm_req_agent;
   std::string _issuer;
   std::string _identifier;
+
+  // Identifies the alarm (rather than its state) to the AlarmReqAgent.
+  std::string _alarm_key;
 };
 
 /// @class BaseAlarm
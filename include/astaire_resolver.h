@@ -45,10 +45,28 @@ public:
                std::vector<AddrInfo>& targets,
                SAS::TrailId trail);
 
+  /// As resolve, but doesn't wait for the DNS lookup, and passes the callback
+  /// an iterator over the targets (which the callback takes ownership of).
+  /// The callback is called on this thread if no DNS query is needed, and
+  /// otherwise on the DNS client's I/O thread, so must not block.
+  ///
+  /// @param domain      - The domain name to resolve.
+  /// @param trail       - SAS trail ID.
+  /// @param callback    - Called with the iterator.
+  void resolve_iter_async(const std::string& domain,
+                          SAS::TrailId trail,
+                          AddrIteratorCallback callback);
+
   /// Default duration to blacklist hosts after we fail to connect to them.
   static const int DEFAULT_BLACKLIST_DURATION = 30;
 
 private:
+  /// Splits a host into the host name and port, using the default port if
+  /// there isn't one.
+  static void split_host(const std::string& host,
+                         std::string& host_without_port,
+                         int& port);
+
   int _address_family;
 };
 
@@ -0,0 +1,193 @@
+/**
+ * @file async_logger.h  Logger that writes to the log file on a background
+ * thread.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef ASYNC_LOGGER_H__
+#define ASYNC_LOGGER_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "logger.h"
+
+/// A Logger that doesn't write to the log file on the calling thread.
+///
+/// Each line is copied (with the time it was logged) into a ring buffer
+/// belonging to the calling thread, without taking any locks.  A background
+/// thread periodically writes the lines from all the threads' buffers in
+/// batches, with a writev per batch, cycling the log file as required.  If a
+/// thread's buffer is full the line is dropped rather than waiting for it to
+/// be written, and counted as a discard - so the memory used is bounded by
+/// the buffer size per logging thread.
+///
+/// Lines from one thread are written in order, but lines from different
+/// threads may be interleaved differently from the order they were logged
+/// in (by up to the drain interval).  Their timestamps are always those of
+/// when they were logged.
+///
+/// The backtrace functions write out the buffered lines before the
+/// backtrace, so the lines leading up to a crash aren't lost.
+///
+/// Because write() doesn't need serializing, Log::_write() doesn't take its
+/// lock for this logger - so it mustn't be destroyed while other threads
+/// might still be logging through it.
+class AsyncLogger : public Logger
+{
+public:
+  /// The default size of each thread's buffer, in bytes.
+  static const unsigned int DEFAULT_BUFFER_BYTES = 256 * 1024;
+
+  /// @param directory    the directory to write the log files in.
+  /// @param filename     the prefix of the log file names.
+  /// @param buffer_bytes the size of each thread's buffer.
+  AsyncLogger(const std::string& directory,
+              const std::string& filename,
+              unsigned int buffer_bytes = DEFAULT_BUFFER_BYTES);
+
+  /// Writes any lines that are still buffered.  No other threads may be
+  /// logging when the logger is destroyed.
+  virtual ~AsyncLogger();
+
+  virtual void write(const char* data);
+
+  /// Write all the buffered lines now, rather than waiting for the
+  /// background thread.
+  virtual void flush();
+  virtual void commit();
+
+  virtual void backtrace_simple(const char* data);
+  virtual void backtrace_advanced();
+
+  virtual bool is_async() const { return true; }
+
+  /// @return the number of lines dropped because a buffer was full.
+  uint64_t discards() const { return _discards.load(); }
+
+private:
+  /// How often the background thread writes the buffered lines.
+  static const long DRAIN_INTERVAL_MS = 100;
+
+  /// The most lines written in one batch.
+  static const int BATCH_LINES = 64;
+
+  static const int TIMESTAMP_SIZE = 32;
+
+  // Precedes each line in a ring.  A length of WRAP means the rest of the
+  // ring is unused, and the next line is at the start.
+  struct RecordHeader
+  {
+    struct timespec time;
+    uint32_t length;
+    uint32_t padding;
+  };
+
+  static const uint32_t WRAP = 0xFFFFFFFF;
+
+  // A thread's buffer of lines.  Each line is a RecordHeader followed by the
+  // line, padded to a multiple of 8 bytes.  Only the owning thread adds lines
+  // (at `head`), and only the thread draining the rings removes them (at
+  // `tail`), so neither needs a lock.  When the thread exits the ring is
+  // marked as closed, and freed once it is empty.
+  struct Ring
+  {
+    Ring(unsigned int capacity) :
+      data(new char[capacity]),
+      capacity(capacity),
+      head(0),
+      tail(0),
+      closed(false)
+    {}
+
+    ~Ring() { delete[] data; }
+
+    char* data;
+    const size_t capacity;
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    std::atomic<bool> closed;
+  };
+
+  // A batch of lines being written.  The lines are written straight from the
+  // rings, so the rings' tails aren't moved past them until they have been
+  // written.  This is kept on the stack, so must stay small.
+  struct Batch
+  {
+    Batch() : iovcnt(0), lines(0), num_rings(0) {}
+
+    struct iovec iov[BATCH_LINES * 2];
+    int iovcnt;
+    char timestamps[BATCH_LINES][TIMESTAMP_SIZE];
+    int lines;
+
+    // The time of the first line, which decides the file the batch goes in.
+    timestamp_t ts;
+
+    // The rings the lines came from, and where their tails move to once the
+    // batch has been written.
+    Ring* rings[BATCH_LINES];
+    uint64_t tails[BATCH_LINES];
+    int num_rings;
+  };
+
+  // The space a line takes up in a ring.
+  static size_t record_size(size_t length);
+
+  // Returns the calling thread's ring, creating it if required.
+  Ring* thread_ring();
+
+  // Called when a thread with a ring exits.
+  static void thread_ring_destructor(void* ring);
+
+  // Writes the lines from all the rings to the log file.  When crashing, this
+  // takes no locks and doesn't cycle the log file, so is only safe once no
+  // other threads are running.
+  void drain(bool crashing);
+
+  // Writes a batch and moves the tails of the rings it came from.
+  void write_batch(Batch& batch, bool crashing);
+
+  static void* drain_thread_fn(void* logger);
+  void drain_thread_fn();
+
+  unsigned int _buffer_bytes;
+  pthread_key_t _ring_key;
+
+  // All the threads' rings, protected by _rings_lock.
+  std::vector<Ring*> _rings;
+  pthread_mutex_t _rings_lock;
+
+  // Held while draining the rings, so that flush() and the background thread
+  // don't both drain at once.
+  pthread_mutex_t _drain_lock;
+
+  std::atomic<uint64_t> _discards;
+
+  // The number of discards that have been reported in the log.
+  uint64_t _reported_discards;
+
+  // The background thread, and the condition used to stop it.
+  pthread_t _drain_thread;
+  pthread_mutex_t _terminate_lock;
+  pthread_cond_t _terminate_cond;
+  bool _terminated;
+
+  // Don't implement the following, to avoid copies of this instance.
+  AsyncLogger(AsyncLogger const&);
+  void operator=(AsyncLogger const&);
+};
+
+#endif
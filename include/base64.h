@@ -23,11 +23,40 @@
 
  Renéyffenegger rene.nyffenegger@adp-gmbh.ch
 
+ This version has been altered from the original: the encoding and decoding
+ is done by table-driven functions that write to caller-provided buffers.
+
 */
 
+#include <stddef.h>
 #include <string>
 
 std::string base64_encode(unsigned char const* , unsigned int len);
 std::string base64_decode(std::string const& s);
 std::string base64_encode(const std::string& string_to_encode);
 bool is_base64(const std::string& encoded_string);
+
+// The number of characters that base64_encode_to writes for `len` bytes.
+inline size_t base64_encoded_length(size_t len)
+{
+  return ((len + 2) / 3) * 4;
+}
+
+// The most bytes that base64_decode_to can write for `len` characters.
+inline size_t base64_decoded_max_length(size_t len)
+{
+  return (len / 4) * 3 + 2;
+}
+
+// Encode `len` bytes (with padding) into `out`, which must have room for
+// base64_encoded_length(len) characters. No null terminator is written.
+//
+// @return the number of characters written.
+size_t base64_encode_to(const unsigned char* in, size_t len, char* out);
+
+// Decode base64 characters into `out`, which must have room for
+// base64_decoded_max_length(len) bytes. As for base64_decode, decoding stops
+// at the first '=' or character that isn't base64.
+//
+// @return the number of bytes written.
+size_t base64_decode_to(const char* in, size_t len, unsigned char* out);
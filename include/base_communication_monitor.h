@@ -12,7 +12,6 @@
 #ifndef BASE_COMMUNICATION_MONITOR_H__
 #define BASE_COMMUNICATION_MONITOR_H__
 
-#include <pthread.h>
 #include <string>
 #include <atomic>
 
@@ -26,6 +25,11 @@
 ///
 ///   - whenever an entity fails to communicate with a peer, the 
 ///     inform_failure() method should be called
+///
+/// These are called for every operation, so only count the result with a
+/// relaxed atomic increment.  Subclasses must make
+/// track_communication_changes() cheap when there's nothing to do, without
+/// taking locks.
 class BaseCommunicationMonitor
 {
 public:
@@ -48,7 +52,6 @@ protected:
 
   std::atomic<int> _succeeded;
   std::atomic<int> _failed;
-  pthread_mutex_t _lock;
 };
 
 #endif
@@ -12,6 +12,7 @@
 #ifndef BASERESOLVER_H__
 #define BASERESOLVER_H__
 
+#include <atomic>
 #include <list>
 #include <map>
 #include <vector>
@@ -19,7 +20,9 @@
 #include <boost/regex.hpp>
 #include <pthread.h>
 
+#include "block_pool.h"
 #include "log.h"
+#include "profiled_mutex.h"
 #include "dnscachedresolver.h"
 #include "ttlcache.h"
 #include "utils.h"
@@ -54,10 +57,73 @@ public:
 
   void clear_blacklist();
 
+  /// Sets how the NAPTR and SRV caches (whichever this resolver has) are
+  /// bounded - expired entries are served for `stale_window` seconds while
+  /// being refreshed in the background, and each cache keeps at most
+  /// `max_entries` entries (see TTLCache::serve_stale and
+  /// TTLCache::set_max_entries).  Either can be 0 to leave it unbounded.
+  ///
+  /// Must be called before the resolver is used, and not more than once.
+  void set_cache_limits(int stale_window, size_t max_entries);
+
+  /// Turns latency-aware target selection on or off (it is off by default).
+  ///
+  /// When it is on, each address has a moving average of its latency and a
+  /// count of its outstanding requests, fed by request_started and
+  /// request_completed.  Addresses in the same priority level are then
+  /// ordered by repeatedly picking two at random (in proportion to their
+  /// weights) and taking the one with less load - the "power of two
+  /// choices" - so a slow or busy address
+  /// gets less traffic than its weight alone would give it, but is never
+  /// starved of the traffic needed to notice that it has recovered.
+  void set_latency_aware_selection(bool enabled) {_latency_aware_selection = enabled;}
+  bool latency_aware_selection() const {return _latency_aware_selection;}
+
+  /// Turns target affinity on or off (it is off by default), which takes
+  /// precedence over latency-aware selection.
+  ///
+  /// When it is on, healthy addresses in the same priority level are ordered
+  /// by rendezvous hashing of the caller's affinity key (see
+  /// set_affinity_key) with each address, weighted as the SRV records are.
+  /// A caller therefore keeps using the same few addresses, and so keeps
+  /// reusing pooled connections to them, while the keys of many callers
+  /// spread evenly across all the addresses.  To bound the load, an address
+  /// with more than load_factor times the average number of outstanding
+  /// requests (see request_started) is moved behind the others until its
+  /// load drops.
+  void set_target_affinity(bool enabled, double load_factor = 1.25)
+  {
+    _affinity_load_factor = load_factor;
+    _target_affinity = enabled;
+  }
+  bool target_affinity() const {return _target_affinity;}
+
+  /// Sets the affinity key of the calling thread, for target affinity.
+  /// Callers with the same key are given the same addresses.  A key of 0
+  /// (the default) uses a key derived from the thread's ID.
+  static void set_affinity_key(uint64_t key) {_affinity_key = key;}
+
+  /// Indicates that a request has been sent to the given AddrInfo.  Each call
+  /// must be matched by a call to request_completed.
+  virtual void request_started(const AddrInfo& ai);
+
+  /// Indicates that a request to the given AddrInfo has completed (whether or
+  /// not it succeeded) after latency_us microseconds.
+  virtual void request_completed(const AddrInfo& ai, uint64_t latency_us);
+
+  /// Records the latency of a request to the given AddrInfo whose start
+  /// wasn't reported, for which there is no outstanding request to complete.
+  virtual void record_latency(const AddrInfo& ai, uint64_t latency_us);
+
   // LazyAResolveIter and LazySRVResolveIter must access the private host_state
   // method of BaseResolver, which it is desirable not to expose
   friend class LazyAResolveIter;
   friend class LazySRVResolveIter;
+  friend class DualStackAddrIterator;
+
+  /// Callback that is passed the iterator from an asynchronous resolution,
+  /// and takes ownership of it.
+  typedef std::function<void(BaseAddrIterator*)> AddrIteratorCallback;
 
   // Constants indicating the allowed host state values.
   static const int WHITELISTED = 0x01;
@@ -113,6 +179,13 @@ protected:
 
   /// Does an A/AAAA record resolution for the specified name, and returns an
   /// Iterator that lazily selects appropriate targets.
+  ///
+  /// If af is AF_UNSPEC, the A and AAAA records are both queried (in
+  /// parallel), and the iterator alternates between the IPv6 and IPv4
+  /// targets as RFC 8305 recommends, so that a broken path for one family
+  /// only costs a connection attempt before the other is tried.  IPv6 goes
+  /// first, unless its best target has been blacklisted or graylisted (e.g.
+  /// because connecting to it failed) and IPv4's hasn't.
   virtual BaseAddrIterator* a_resolve_iter(const std::string& hostname,
                                            int af,
                                            int port,
@@ -121,6 +194,18 @@ protected:
                                            SAS::TrailId trail,
                                            int allowed_host_state);
 
+  /// As a_resolve_iter, but doesn't wait for the DNS query.  The callback is
+  /// passed the iterator - it is called on this thread if the records are
+  /// cached, and otherwise on the DNS client's I/O thread, so must not block.
+  /// The resolver must not be destroyed while a resolution is outstanding.
+  void a_resolve_iter_async(const std::string& hostname,
+                            int af,
+                            int port,
+                            int transport,
+                            SAS::TrailId trail,
+                            int allowed_host_state,
+                            AddrIteratorCallback callback);
+
   /// Called to check whether the base resolver is happy with an address being
   /// used as a target. It is allowed to reject the address if the current state
   /// of the address is incompatible with the allowed host state.
@@ -161,15 +246,45 @@ protected:
     std::shared_ptr<NAPTRReplacement> get(std::string key, int& ttl, SAS::TrailId trail);
 
   private:
+    /// A NAPTR regexp field split into a compiled regular expression and the
+    /// replacement, or marked as invalid if it couldn't be parsed.
+    struct RegexReplace
+    {
+      bool valid;
+      boost::regex regex;
+      std::string replace;
+    };
+
     static bool compare_naptr_order_preference(DnsNaptrRecord* r1,
                                                DnsNaptrRecord* r2);
     bool parse_regex_replace(const std::string& regex_replace,
                              boost::regex& regex,
                              std::string& replace);
 
+    /// Returns the parsed form of a regexp field, parsing it only the first
+    /// time it is seen.
+    std::shared_ptr<const RegexReplace> get_regex_replace(const std::string& regexp);
+
+    /// Applies a regexp field to a domain, returning an empty string if the
+    /// field is invalid or doesn't match.  The result is remembered, so a
+    /// NAPTR record that is refreshed without changing costs a lookup.
+    std::string apply_regex_replace(const std::string& regexp,
+                                    const std::string& domain);
+
     std::map<std::string, int> _services;
     int _default_ttl;
     DnsCachedResolver* _dns_client;
+
+    /// The parsed regexp fields, and the results of applying them, keyed on
+    /// the regexp field (and domain).  Each is cleared if it grows beyond its
+    /// limit, to bound the memory used by many distinct records.  Protected
+    /// by _regex_lock, as the factory is called on many threads at once.
+    std::map<std::string, std::shared_ptr<const RegexReplace> > _regexes;
+    std::map<std::pair<std::string, std::string>, std::string> _replacements;
+    pthread_mutex_t _regex_lock;
+
+    static const size_t MAX_REGEXES = 1000;
+    static const size_t MAX_REPLACEMENTS = 10000;
   };
   NAPTRCacheFactory* _naptr_factory;
 
@@ -215,7 +330,63 @@ protected:
   typedef TTLCache<std::string, SRVPriorityList> SRVCache;
   SRVCache* _srv_cache;
 
-  /// The global hosts map holds a list of IP/transport/port combinations which
+  /// The SRVSelectionPlan holds what's needed to select targets from the
+  /// result of an SRV lookup for one address family - the SRVs at each
+  /// priority level and the addresses their targets resolve to.  It is built
+  /// once and shared by every request for the SRV name until it expires, so
+  /// that a request only has to pick a random order and check the state of
+  /// each host.
+  struct SRVSelectionPlan
+  {
+    struct PriorityLevel
+    {
+      PriorityLevel(const std::vector<SRV>& level_srvs) :
+        srvs(level_srvs),
+        selector(level_srvs),
+        addresses(level_srvs.size())
+      {
+      }
+
+      std::vector<SRV> srvs;
+
+      /// Holds the cumulative weights of the SRVs.  Each request takes a
+      /// weighted random permutation from it, which costs O(log n) per SRV.
+      WeightedSelector<SRV> selector;
+
+      /// The addresses of each SRV, with the port, weight and priority of the
+      /// SRV filled in but not the transport.
+      std::vector<std::vector<AddrInfo> > addresses;
+    };
+
+    /// The priority levels, highest priority first.
+    std::vector<PriorityLevel> levels;
+
+    /// The time the plan expires, which is the earliest expiry of the SRV and
+    /// A/AAAA records it was built from.
+    time_t expires;
+  };
+
+  /// Plans are keyed on the SRV name and address family.
+  typedef std::pair<std::string, int> SRVPlanKey;
+
+  /// Factory class to build selection plans from the SRV cache.
+  class SRVPlanCacheFactory : public CacheFactory<SRVPlanKey, SRVSelectionPlan>
+  {
+  public:
+    SRVPlanCacheFactory(BaseResolver* resolver);
+    virtual ~SRVPlanCacheFactory();
+
+    std::shared_ptr<SRVSelectionPlan> get(SRVPlanKey key, int& ttl, SAS::TrailId trail);
+
+  private:
+    BaseResolver* _resolver;
+  };
+  SRVPlanCacheFactory* _srv_plan_factory;
+
+  typedef TTLCache<SRVPlanKey, SRVSelectionPlan> SRVPlanCache;
+  SRVPlanCache* _srv_plan_cache;
+
+  /// The global hosts table holds a list of IP/transport/port combinations which
   /// have been blacklisted because the destination is unresponsive (either TCP
   /// connection attempts are failing or a UDP destination is unreachable).
   ///
@@ -235,15 +406,15 @@ protected:
   /// Private class to hold data and methods associated to an IP/transport/port
   /// combination in the blacklist system. Each Host is associated with exactly
   /// one such combination.
+  ///
+  /// The state is held in atomics so that it can be read without taking
+  /// _hosts_lock, but it is only changed with the lock held.
   class Host
   {
   public:
-    /// Constructor
-    /// @param blacklist_ttl The time in seconds for the host to remain on the
-    ///                      blacklist before moving to the graylist
-    /// @param graylist_ttl  The time in seconds for the host to remain on the
-    ///                      graylist before moving to the whitelist
-    Host(int blacklist_ttl, int graylist_ttl);
+    /// Constructor.  The Host starts off whitelisted.
+    /// @param ai The IP/transport/port combination
+    Host(const AddrInfo& ai);
 
     /// Destructor
     ~Host();
@@ -256,46 +427,194 @@ protected:
     /// Returns a string representation of the given state.
     static std::string state_to_string(State state);
 
+    /// The IP/transport/port combination of this Host.
+    const AddrInfo& addr_info() const {return _ai;}
+
     /// Returns the state of this Host at the given time in seconds since the
     /// epoch
     State get_state() {return get_state(time(NULL));}
     State get_state(time_t current_time);
 
+    /// Returns whether this Host is whitelisted at the given time.  This is a
+    /// single atomic load, as the graylist always expires last.
+    bool is_white(time_t current_time) const
+    {
+      return (current_time >= _graylist_expiry_time.load());
+    }
+
+    /// Places this Host on the blacklist for blacklist_ttl seconds, and then
+    /// on the graylist for graylist_ttl seconds.
+    void blacklist(int blacklist_ttl, int graylist_ttl);
+
+    /// Places this Host on the whitelist.
+    void whitelist();
+
     /// Indicates that this Host has been successfully contacted.
     void success();
 
     /// Indicates that this Host is selected for probing by the given user.
     void selected_for_probing(pthread_t user_id);
 
+    /// Track the requests outstanding to this Host and their latency.  These
+    /// don't need _hosts_lock - concurrent updates to the moving average may
+    /// lose a sample, which doesn't matter.
+    void request_started() {++_outstanding_requests;}
+    void request_completed(uint64_t latency_us);
+    void record_latency(uint64_t latency_us);
+
+    /// Returns the load on this Host - its average latency scaled by the
+    /// number of requests outstanding to it - where lower is better.
+    uint64_t load_score() const;
+
+    /// Returns the number of requests outstanding to this Host.
+    int outstanding_requests() const {return _outstanding_requests.load();}
+
   private:
+    /// The IP/transport/port combination, which never changes.
+    const AddrInfo _ai;
+
     /// The time in seconds since the epoch at which this Host is to be removed
     /// from the blacklist and placed onto the graylist.
-    time_t _blacklist_expiry_time;
+    std::atomic<time_t> _blacklist_expiry_time;
 
     /// The time in seconds since the epoch at which this Host is to be removed
-    /// from the graylist.
-    time_t _graylist_expiry_time;
+    /// from the graylist.  This is written last when the Host is blacklisted,
+    /// so a reader that sees it also sees the blacklist expiry time.
+    std::atomic<time_t> _graylist_expiry_time;
 
     /// Indicates that this Host is currently being probed.
-    bool _being_probed;
+    std::atomic<bool> _being_probed;
 
     /// The ID of the thread currently probing this Host.
     pthread_t _probing_user_id;
+
+    /// The moving average of the latency of requests to this Host, which is
+    /// zero until the first request completes (so new Hosts are favoured
+    /// until they have been measured).  Each sample has a weight of 1/8, as
+    /// for TCP's smoothed round trip time.
+    std::atomic<uint64_t> _latency_ewma_us;
+    static const int LATENCY_EWMA_SHIFT = 3;
+
+    /// The number of requests outstanding to this Host.  Requests started
+    /// before latency-aware selection was turned on weren't counted, so
+    /// their completions aren't counted out once this reaches zero.
+    std::atomic<int> _outstanding_requests;
+
+    // Don't implement the following, to avoid copies of this instance.
+    Host(Host const&);
+    void operator=(Host const&);
+  };
+
+  /// An open-addressed hash table of Hosts, searched with linear probing.
+  ///
+  /// Hosts are added with _hosts_lock held, and a slot, once filled, always
+  /// points to the same Host, so the table can be searched without the lock.
+  /// When the table gets too full it is replaced by a new one, which leaves
+  /// out the Hosts that are whitelisted with nothing outstanding, and is
+  /// grown if there are still too many Hosts.  So the table holds the Hosts
+  /// in use rather than every Host ever blacklisted.
+  ///
+  /// Threads may still be searching the old table, or using a Host they
+  /// found in it (and so start a request to a Host as it is left out), so
+  /// the old table and the Hosts left out are retired rather than freed.  A
+  /// retired Host is put back in the table if its address is added again, so
+  /// its counts carry on in the same object.  Retired tables are freed at a
+  /// later rebuild once RETIRED_HOSTS_GRACE_S has passed, along with their
+  /// Hosts unless they have requests outstanding (which are retired again).
+  struct HostTable
+  {
+    HostTable(size_t size);
+    ~HostTable();
+
+    size_t mask;
+    size_t count;
+    std::atomic<Host*>* slots;
+  };
+
+  /// The initial number of slots in the hosts table.  The table is rebuilt
+  /// when it is half full, and is grown if more than a quarter of it would
+  /// still be full.
+  static const size_t INITIAL_HOST_TABLE_SIZE = 64;
+
+  /// A replaced hosts table and the Hosts left out of its replacement.
+  struct RetiredHosts
+  {
+    time_t retired_at;
+    HostTable* table;
+    std::vector<Host*> hosts;
   };
 
-  pthread_mutex_t _hosts_lock;
-  typedef std::map<AddrInfo, Host> Hosts;
-  Hosts _hosts;
+  /// How long retired tables and Hosts are kept before they are freed.
+  /// Threads only use a Host they have found for the length of one call.
+  static const int RETIRED_HOSTS_GRACE_S = 60;
+
+  ProfiledMutex _hosts_lock;
+  std::atomic<HostTable*> _hosts;
+  std::vector<RetiredHosts> _retired_hosts;
+
+  /// Replaces the hosts table as described above.  _hosts_lock must be held.
+  void rebuild_host_table();
+
+  /// Removes the retired Host for the given AddrInfo from the retired Hosts,
+  /// returning NULL if there isn't one.  _hosts_lock must be held.
+  Host* take_retired_host(const AddrInfo& ai);
+
+  static size_t host_hash(const AddrInfo& ai);
+
+  /// Returns the Host for the given AddrInfo, or NULL if it has never been in
+  /// the blacklist system.  This doesn't need _hosts_lock.
+  Host* find_host(const AddrInfo& ai) const;
+
+  /// Returns the Host for the given AddrInfo, adding it (whitelisted) if it
+  /// isn't in the hosts table.  _hosts_lock must be held when calling this
+  /// method.
+  Host* add_host(const AddrInfo& ai);
 
   /// Returns the state of the Host associated with the given AddrInfo, if it is
-  /// in the blacklist system, and Host::State::WHITE otherwise. _hosts_lock
-  /// must be held when calling this method.
+  /// in the blacklist system, and Host::State::WHITE otherwise.  This doesn't
+  /// need _hosts_lock, but the state may change as soon as it returns.
   Host::State host_state(const AddrInfo& ai) {return host_state(ai, time(NULL));}
   Host::State host_state(const AddrInfo& ai, time_t current_time);
 
   /// Indicates that the calling thread is selected to probe the given AddrInfo.
-  /// _hosts_lock must be held when calling this method.
-  void select_for_probing(const AddrInfo& ai);
+  ///
+  /// @return whether the AddrInfo was graylisted and not already being
+  ///         probed, so is now being probed by this thread.
+  bool select_for_probing(const AddrInfo& ai);
+
+  /// Returns the Host to track the latency of the given AddrInfo, adding it
+  /// to the hosts table if necessary, or NULL if neither latency-aware
+  /// selection nor target affinity is on.
+  Host* latency_host(const AddrInfo& ai);
+
+  /// Returns the load score of the given AddrInfo (0 if nothing is known
+  /// about it).
+  uint64_t load_score(const AddrInfo& ai) const;
+
+  /// Orders addresses for latency-aware selection, best first.  Each position
+  /// is filled by picking two of the remaining addresses at random (with
+  /// replacement), in proportion to their weights, and taking the one with
+  /// the lower load score.
+  void order_by_load(std::vector<AddrInfo>& addrs, std::vector<double> weights) const;
+
+  /// Picks an index at random in proportion to the given weights, or
+  /// uniformly if all the weights are zero.
+  static size_t pick_weighted(const std::vector<double>& weights);
+
+  std::atomic<bool> _latency_aware_selection;
+
+  /// Orders addresses for target affinity, best first, by their rendezvous
+  /// hash with the calling thread's affinity key, putting any that are over
+  /// their share of the outstanding requests last.
+  void order_by_affinity(std::vector<AddrInfo>& addrs,
+                         const std::vector<double>& weights) const;
+
+  /// Returns the number of requests outstanding to the given AddrInfo.
+  int outstanding_requests(const AddrInfo& ai) const;
+
+  std::atomic<bool> _target_affinity;
+  double _affinity_load_factor;
+  static thread_local uint64_t _affinity_key;
 
   /// Helper function to create SAS logs if no targets were resolved. Says if
   /// this was because only whitelisted or blacklisted targets were requested,
@@ -323,12 +642,26 @@ protected:
                  std::vector<DnsResult>& results,
                  SAS::TrailId trail);
 
+  /// As above, but for records of any mix of types, which are all resolved
+  /// in parallel.
+  void dns_query(const std::vector<DnsCachedResolver::DnsQuery>& queries,
+                 std::map<DnsCachedResolver::DnsQuery, DnsResult>& results,
+                 SAS::TrailId trail);
+
   /// Helper function to perform SRV Record DNS Resolution via the SRV Cache and
   /// returns a pointer to an SRV Priority List for the given SRV name.
   std::shared_ptr<SRVPriorityList> get_srv_list(const std::string& srv_name,
                                                 int &ttl,
                                                 SAS::TrailId trail);
 
+  /// Returns the selection plan for the given SRV name and address family
+  /// from the plan cache, building it if necessary.  The TTL is set to the
+  /// remaining lifetime of the plan (or of the cached failure to build one).
+  std::shared_ptr<SRVSelectionPlan> get_srv_plan(const std::string& srv_name,
+                                                 int af,
+                                                 int& ttl,
+                                                 SAS::TrailId trail);
+
   int _default_blacklist_duration;
   int _default_graylist_duration;
 
@@ -346,30 +679,61 @@ public:
   BaseAddrIterator() {}
   virtual ~BaseAddrIterator() {}
 
+  /// An iterator is created for (almost) every request that resolves a
+  /// target, so iterators (including subclasses) are allocated from the
+  /// shared block pools rather than going through malloc each time.
+  static void* operator new(size_t size)
+  {
+    return BlockPool::allocate_sized(size);
+  }
+
+  static void operator delete(void* iter, size_t size)
+  {
+    BlockPool::release_sized(iter, size);
+  }
+
   /// Should return a vector containing at most num_requested_targets AddrInfo
   /// targets.
   virtual std::vector<AddrInfo> take(int num_requested_targets) = 0;
 
+  /// As take(), but replaces the contents of `targets` rather than returning a
+  /// new vector, so a caller taking targets repeatedly can reuse one vector.
+  /// The default implementation calls take().
+  virtual void take_into(int num_requested_targets,
+                         std::vector<AddrInfo>& targets);
+
   /// If any unused targets remain, sets the value of target to the next one and
   /// returns true. Otherwise returns false and leaves the value of target
   /// unchanged.
   virtual bool next(AddrInfo &target);
+
+private:
+  // The vector that next() takes targets into.
+  std::vector<AddrInfo> _next_targets;
 };
 
 // AddrInfo iterator that simply returns the targets it is given in sequence.
 class SimpleAddrIterator : public BaseAddrIterator
 {
 public:
-  SimpleAddrIterator(std::vector<AddrInfo> targets) : _targets(targets) {}
+  SimpleAddrIterator(std::vector<AddrInfo> targets) :
+    _targets(std::move(targets)),
+    _next_target(0)
+  {}
   virtual ~SimpleAddrIterator() {}
 
   /// Returns a vector containing the first num_requested_targets elements of
   /// _targets, or all the elements of _targets if num_requested_targets is
   /// greater than the size of _targets.
   virtual std::vector<AddrInfo> take(int num_requested_targets);
+  virtual void take_into(int num_requested_targets,
+                         std::vector<AddrInfo>& targets);
+  virtual bool next(AddrInfo& target);
 
 private:
+  // The targets, and the index of the first that hasn't been returned.
   std::vector<AddrInfo> _targets;
+  size_t _next_target;
 };
 
 // AddrInfo iterator that uses the blacklist system of a BaseResolver to lazily
@@ -390,6 +754,8 @@ public:
   /// selected based on their current state in the blacklist system of
   /// resolver.
   virtual std::vector<AddrInfo> take(int num_requested_targets);
+  virtual void take_into(int num_requested_targets,
+                         std::vector<AddrInfo>& targets);
 
 private:
   // A vector that initially contains the results of a DNS query. As results
@@ -413,6 +779,34 @@ private:
   bool _first_call;
 };
 
+// AddrInfo iterator that interleaves the IPv6 and IPv4 targets of a
+// dual-stack host (see BaseResolver::a_resolve_iter).  It takes ownership of
+// the iterators for each family, and takes targets from them lazily.
+class DualStackAddrIterator : public BaseAddrIterator
+{
+public:
+  DualStackAddrIterator(BaseResolver* resolver,
+                        BaseAddrIterator* ipv6_it,
+                        BaseAddrIterator* ipv4_it);
+  virtual ~DualStackAddrIterator();
+
+  virtual std::vector<AddrInfo> take(int num_requested_targets);
+  virtual bool next(AddrInfo& target);
+
+private:
+  // The iterators for each family (IPv6 first), the next target from each,
+  // and whether there is one.
+  BaseAddrIterator* _its[2];
+  AddrInfo _heads[2];
+  bool _has_head[2];
+
+  BaseResolver* _resolver;
+  bool _started;
+
+  // The index of the family to take the next target from.
+  int _turn;
+};
+
 // AddrInfo iterator that uses the blacklist system of a BaseResolver to lazily
 // select targets using SRV Record Resolution.
 class LazySRVResolveIter : public BaseAddrIterator
@@ -431,14 +825,15 @@ public:
   /// selected based on their current state in the blacklist system of
   /// resolver.
   std::vector<AddrInfo> take(int num_requested_targets);
+  void take_into(int num_requested_targets, std::vector<AddrInfo>& targets);
 
   /// Returns the smallest time to live found for the list of SRVs and various A
   /// Record DNS resolutions so far.
   int get_min_ttl();
 
 private:
-  /// Prepares a whole priority level by applying A/AAAA Record Resolution to
-  /// find the addresses for each SRV, and storing the results in
+  /// Prepares a whole priority level by looking up the state of the addresses
+  /// of each SRV in the selection plan, and storing the results in
   /// _whitelisted_addresses_by_srv and _unhealthy_addresses_by_srv. The order
   /// of the SRVs is random and based on the weights, and the order of addresses
   /// for an SRV is uniformly random.
@@ -453,6 +848,12 @@ private:
   /// there were no priority levels left to prepare
   bool prepare_priority_level();
 
+  /// Merges the addresses prepared for each SRV in the priority level into a
+  /// single list, ordered by affinity or load (see
+  /// BaseResolver::order_by_affinity and BaseResolver::order_by_load).  Each
+  /// address gets an equal share of the weight of its SRV.
+  void order_priority_level_by_load(const std::vector<const BaseResolver::SRV*>& srvs);
+
   /// If both blacklisted and whitelisted addresses were requested goes through
   /// the vectors returned by prepare_priority_level, adding whitelisted
   /// addresses to targets and black and gray addresses to _unhealthy_targets.
@@ -490,14 +891,13 @@ private:
   int _transport;
   std::string _srv_name;
 
-  // The smallest time to live found so far, from all DNS Resolutions. Updated
-  // by prepare_priority_level if the DNS resolution finds a smaller time to
-  // live.
+  // The remaining time to live of the selection plan, which covers all the
+  // DNS resolutions it was built from.
   int _ttl;
 
-  // Pointer to a map from priority levels to a vector of SRVs for that priority
-  // level.
-  std::shared_ptr<BaseResolver::SRVPriorityList> _srv_list;
+  // Pointer to the selection plan for the SRV name.  This is shared with other
+  // requests, so must not be modified.
+  std::shared_ptr<const BaseResolver::SRVSelectionPlan> _plan;
 
   SAS::TrailId _trail;
 
@@ -544,10 +944,10 @@ private:
   // subsequent calls to take the same unhealthy target is not returned twice.
   int _unhealthy_target_pos;
 
-  // An iterator to the priority level prepare_priority_level should look
-  // at. Goes through all priority levels in order of highest to lowest
-  // priority. Incremented by prepare_priority_level once it has finished
-  // searching the current priority level.
-  BaseResolver::SRVPriorityList::const_iterator _next_priority_level;
+  // The index of the priority level in the plan that prepare_priority_level
+  // should look at. Goes through all priority levels in order of highest to
+  // lowest priority. Incremented by prepare_priority_level once it has
+  // finished searching the current priority level.
+  size_t _next_priority_level;
 };
 #endif
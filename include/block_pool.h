@@ -0,0 +1,141 @@
+/**
+ * @file block_pool.h  Per-thread pools of fixed-size memory blocks.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef BLOCK_POOL_H__
+#define BLOCK_POOL_H__
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include <vector>
+
+/// A pool of fixed-size memory blocks, for objects that are allocated and
+/// freed at a high rate (such as per-request state), so that once the pool
+/// has warmed up they don't go through malloc and free.
+///
+/// Each thread keeps a free list of blocks, so allocating and releasing
+/// blocks doesn't normally take a lock. Blocks are often allocated on one
+/// thread and released on another (e.g. a request is allocated on a transport
+/// thread and freed on a worker thread), so when a thread's free list grows
+/// too long, half of it is moved to a shared list, which threads whose free
+/// lists are empty take blocks from.
+///
+/// Blocks are never returned to the system while the pool exists. The pool
+/// must not be destroyed while other threads are using it.
+class BlockPool
+{
+public:
+  /// The default maximum number of blocks each thread keeps.
+  static const unsigned int DEFAULT_THREAD_CACHE_SIZE = 256;
+
+  /// The largest size of block served by the shared pools (see
+  /// allocate_sized()).
+  static const size_t MAX_POOLED_SIZE = 4096;
+
+  /// @param block_size        the size of each block, in bytes.
+  /// @param thread_cache_size the maximum number of free blocks each thread
+  ///                          keeps (at least 2).
+  BlockPool(size_t block_size,
+            unsigned int thread_cache_size = DEFAULT_THREAD_CACHE_SIZE);
+  ~BlockPool();
+
+  /// Get a block, which is suitably aligned for any type. Throws
+  /// std::bad_alloc if the pool is empty and a new block can't be allocated.
+  void* allocate();
+
+  /// Return a block to the pool. It may be released on any thread, not just
+  /// the one that allocated it.
+  void release(void* block);
+
+  /// @return the size of the pool's blocks (the size specified, rounded up to
+  ///         the alignment of the blocks).
+  size_t block_size() const { return _block_size; }
+
+  /// Allocate memory from one of a set of pools shared by the process, each
+  /// of which holds blocks of a different power of two size. Allocations
+  /// larger than MAX_POOLED_SIZE use operator new. This is intended for class
+  /// specific operator new and delete implementations.
+  static void* allocate_sized(size_t size);
+
+  /// Release memory allocated by allocate_sized(). The size must be the same
+  /// as was passed to allocate_sized().
+  static void release_sized(void* block, size_t size);
+
+private:
+  // A free block, which is linked to the next free block.
+  struct FreeBlock
+  {
+    FreeBlock* next;
+  };
+
+  // A list of free blocks.
+  struct FreeList
+  {
+    FreeList() : head(NULL), count(0) {}
+
+    void push(FreeBlock* block)
+    {
+      block->next = head;
+      head = block;
+      ++count;
+    }
+
+    FreeBlock* pop()
+    {
+      FreeBlock* block = head;
+      head = block->next;
+      --count;
+      return block;
+    }
+
+    FreeBlock* head;
+    unsigned int count;
+  };
+
+  // A thread's free list.
+  struct ThreadCache
+  {
+    ThreadCache(BlockPool* pool) : pool(pool), blocks() {}
+
+    BlockPool* pool;
+    FreeList blocks;
+  };
+
+  // Returns the calling thread's cache, creating it if required.
+  ThreadCache* thread_cache();
+
+  // Called when a thread with a cache exits. Moves the cached blocks to the
+  // shared list, and deletes the cache.
+  static void thread_cache_destructor(void* cache);
+
+  // Moves up to `count` blocks from one list to another.
+  static void move_blocks(FreeList& from, FreeList& to, unsigned int count);
+
+  // Returns the shared pool that serves allocations of the given size (which
+  // must be no larger than MAX_POOLED_SIZE).
+  static BlockPool* pool_for_size(size_t size);
+
+  size_t _block_size;
+  unsigned int _thread_cache_size;
+  pthread_key_t _thread_cache_key;
+
+  // The shared list of free blocks, and all the threads' caches (so that they
+  // can be freed when the pool is destroyed), protected by _lock.
+  FreeList _shared;
+  std::vector<ThreadCache*> _thread_caches;
+  pthread_mutex_t _lock;
+
+  // Don't implement the following, to avoid copies of this instance.
+  BlockPool(BlockPool const&);
+  void operator=(BlockPool const&);
+};
+
+#endif
@@ -15,17 +15,41 @@
 #include "rapidjson/writer.h"
 #include "rapidjson/document.h"
 
+#include <atomic>
+#include <memory>
 #include <vector>
 
+#include "json_writer.h"
+#include "sip_hasher.h"
+
+/// A bloom filter. Items can be added and checked from many threads at once
+/// without any locking.
 class BloomFilter
 {
 public:
+  /// How the bits for an item are laid out in the bitmap.
+  enum Layout
+  {
+    /// The bits for an item are spread over the whole bitmap.
+    STANDARD,
+
+    /// The bits for an item all fall within one 64-byte block of the
+    /// bitmap, so checking an item touches one block rather than one cache
+    /// line per bit. This gives a slightly higher false positive rate for the
+    /// same size of bitmap.
+    BLOCKED
+  };
+
   /// Create a bloom filter by specifying the total bitmap size and the number
   /// of bits per key.
   ///
-  /// @param bitmap_size  - the total size of the bitmap.
+  /// @param bitmap_size  - the total size of the bitmap. For a blocked filter
+  ///                       this is rounded up to a whole number of blocks.
   /// @param bit_per_item - the number of bits that are used to store each item.
-  BloomFilter(uint64_t bitmap_size, uint32_t bits_per_item);
+  /// @param layout       - how the bits are laid out in the bitmap.
+  BloomFilter(uint64_t bitmap_size,
+              uint32_t bits_per_item,
+              Layout layout = STANDARD);
 
   /// Create a bloom filter for a given number of entries with a particular
   /// false positive probability.
@@ -34,10 +58,12 @@ public:
   ///                      Must be in the range 0.0 - 1.0 (not inclusive).
   /// @param fp_prob     - The false positive probability for the filter.
   ///                      Must be > 0.
+  /// @param layout      - How the bits are laid out in the bitmap.
   /// @return            - The constructed bloom filter, or nullptr if the
   ///                      arguments were unacceptable.
   static BloomFilter* for_num_entries_and_fp_prob(uint64_t num_entries,
-                                                  double fp_prob);
+                                                  double fp_prob,
+                                                  Layout layout = STANDARD);
 
   /// Construct a bloom filter from a JSON value.
   ///
@@ -46,11 +72,28 @@ public:
   ///               semantically invalid.
   static BloomFilter* from_json(const std::string& json);
 
+  /// Construct a bloom filter from its binary form (see to_binary).
+  ///
+  /// @param binary - The binary form of the filter.
+  /// @return       - The constructed bloom filter, or nullptr if the data was
+  ///                 invalid.
+  static BloomFilter* from_binary(const std::string& binary);
+
+  /// Copy a bloom filter. Items added to the original while it is being
+  /// copied may or may not be in the copy.
+  BloomFilter(const BloomFilter& other);
+
   /// Add an item to the bloom filter.
   ///
   /// @param item - The item to set.
   void add(const std::string& item);
 
+  /// Add several items to the bloom filter. This is quicker than adding them
+  /// one at a time, as they are hashed together.
+  ///
+  /// @param items - The items to set.
+  void add(const std::vector<std::string>& items);
+
   /// Check whether item is present in the bloom filter.
   ///
   /// @param key - The item to check.
@@ -58,11 +101,31 @@ public:
   ///              present (bloom filters can give false positives)
   bool check(const std::string& item);
 
+  /// Remove all the items from the bloom filter. Items added while it is
+  /// being cleared may or may not remain in it.
+  void clear();
+
+  /// Add all the items in another bloom filter to this one. The filters must
+  /// have the same size, bits per item, layout and hash keys - i.e. one must
+  /// be a copy or deserialized form of the other, or of a common original.
+  ///
+  /// @param other - The filter to merge in.
+  /// @return      - False if the filters aren't compatible (in which case this
+  ///                filter is unchanged).
+  bool merge(const BloomFilter& other);
+
   /// Serialize the bloom filter to JSON.
   ///
   /// @return - The json in string form.
   std::string to_json();
 
+  /// Serialize the bloom filter to a compact binary form, which is quicker to
+  /// read than the JSON form. This is a header (in network byte order)
+  /// followed by the raw bitmap.
+  ///
+  /// @return - The binary form of the filter.
+  std::string to_binary();
+
 protected:
   // Make the default constructor protected so that users can't default
   // construct a bloom filter, but the alternative constructors can construct an
@@ -70,9 +133,22 @@ protected:
   BloomFilter();
 
 private:
-  // The underlying bitmap that the bloom filter uses to store its data. This
-  // is arranged so that the 0th bit is the highest order bit in the 0th byte.
-  std::string _bitmap;
+  // Rotating filters check the same hashes against each of their
+  // generations.
+  friend class RotatingBloomFilter;
+
+  // The size of each block of a blocked filter.
+  static const uint32_t BLOCK_BYTES = 64;
+  static const uint32_t BLOCK_BITS = BLOCK_BYTES * 8;
+  static const uint32_t BLOCK_WORDS = BLOCK_BYTES / 8;
+
+  // The underlying bitmap that the bloom filter uses to store its data, as
+  // 64-bit words so that bits can be set atomically. This is arranged so
+  // that the 0th bit is the highest order bit in the 0th word, so that when
+  // the words are written out in network byte order the 0th bit is the
+  // highest order bit in the 0th byte.
+  std::unique_ptr<std::atomic<uint64_t>[]> _bitmap;
+  uint64_t _num_words;
 
   // The number of valid bits in the above bitmap. This is stored as a separate
   // variable in case the bitmap needs to contain a number of bits that is not
@@ -82,6 +158,8 @@ private:
   // The number of bits for each item.
   uint32_t _bits_per_item;
 
+  Layout _layout;
+
   // This bloom filter uses two independent SIP hashers. Each one is described
   // by a pair of 64-bit integer keys - k0 and k1.
   struct SipHashKeys
@@ -92,18 +170,53 @@ private:
 
   SipHashKeys sip_hashers[2];
 
-  // Calculate the SIP hash of a given item
-  //
-  // @param keys - The keys to initialize the SIP hasher with.
-  // @param item - The item to take the hash of.
+  // The SIP hashers for the above keys. These must be initialized (with
+  // init_hashers) whenever the keys are set.
+  SipHasher _hashers[2];
+  void init_hashers();
+
+  // Set the bits for an item, given its two SIP hashes.
+  void add_hash_values(uint64_t hash0, uint64_t hash1);
+
+  // Check whether the bits for an item are set, given its two SIP hashes.
+  bool check_hash_values(uint64_t hash0, uint64_t hash1);
+
+  // Calculate the two SIP hashes of an item. The hash values for each of its
+  // bits are formed from a linear combination of these (see hash_value), so
+  // we only ever perform two hashes, regardless of the number of bits per
+  // entry. The second hash is only calculated if it's needed.
+  void calculate_sip_hash_values(const std::string& item,
+                                 uint64_t& hash0,
+                                 uint64_t& hash1);
+
+  // Returns the hash value for bit `ii` of an item in a standard filter.
+  static uint64_t hash_value(uint64_t hash0, uint64_t hash1, uint32_t ii)
+  {
+    return (ii == 0) ? hash0 : (ii == 1) ? hash1 : hash0 + (hash1 * ii);
+  }
+
+  // Builds the mask of an item's bits within its block in a blocked filter.
+  // The first hash picks the block, and the second the bits within it.
   //
-  // @return     - The computed hash value.
-  uint64_t calculate_sip_hash_value(const SipHashKeys& keys,
-                                    const std::string& item);
+  // @param hash1 - The item's second hash value.
+  // @param mask  - Filled in with the mask, in the same layout as the bitmap.
+  void calculate_block_mask(uint64_t hash1, uint64_t mask[BLOCK_WORDS]);
+
+  // Returns the index of the first word of an item's block in a blocked
+  // filter.
+  uint64_t block_word(uint64_t hash0) const
+  {
+    return (hash0 % (_bitmap_size / BLOCK_BITS)) * BLOCK_WORDS;
+  }
+
+  // Allocates an empty bitmap big enough for _bitmap_size bits.
+  void allocate_bitmap();
 
-  // Calculate the hash values for a given item. This returns a vector
-  // containing `_bits_per_item` values.
-  std::vector<uint64_t> calculate_hash_values(const std::string& item);
+  // Utility functions to convert the bitmap to and from bytes, with the 0th
+  // bit the highest order bit in the 0th byte. Any bytes beyond the end of
+  // the bitmap are ignored, and any that are missing are treated as 0.
+  std::string bitmap_to_bytes() const;
+  void bitmap_from_bytes(const std::string& bytes);
 
   // Utility function to check whether a bit is set in the bitmap.
   // @param bit - the index of the bit to check.
@@ -119,7 +232,7 @@ private:
   // @param hasher - The hasher in question.
   // @param writer - A rapidjson writer to write to.
   void sip_hash_to_json(const SipHashKeys& hasher,
-                        rapidjson::Writer<rapidjson::StringBuffer>& writer);
+                        JsonStringWriter& writer);
 
   // Utility function to read a Sip Hasher from a JSON value.
   //
@@ -127,6 +240,10 @@ private:
   // @param hasher   - The hasher to read into.
   static void sip_hash_from_json(const rapidjson::Value& json_val,
                                  SipHashKeys& hasher);
+
+  // Don't implement the following, as a bloom filter can't be assigned
+  // atomically.
+  void operator=(BloomFilter const&);
 };
 
 #endif
@@ -0,0 +1,142 @@
+/**
+ * @file caching_store.h Definitions for the CachingStore class
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef CACHING_STORE_H__
+#define CACHING_STORE_H__
+
+#include <atomic>
+
+#include "store.h"
+#include "sharded_lru_cache.h"
+
+/// @class CachingStore
+///
+/// A Store that keeps the records it reads from another Store in a local
+/// cache, so hot records aren't fetched over the network every time.
+///
+/// Reads that miss the cache go to the underlying store, and the record and
+/// its CAS value are cached.  Writes and deletes always go to the underlying
+/// store, and remove the record from this node's cache, so that the next
+/// read fetches the new record and CAS value.  Writes from other nodes don't
+/// remove records from the cache, so each record is only cached for a short
+/// TTL, which bounds how stale a read can be.  A write that fails with
+/// DATA_CONTENTION also removes the record, so a caller retrying after
+/// contention reads the current record.
+///
+/// The CachingStore doesn't own the underlying store.
+class CachingStore : public Store
+{
+public:
+  static const int DEFAULT_TTL = 1;
+
+  /// @param store         - The store to cache records from.
+  /// @param memory_budget - How many bytes the cached records may use.
+  /// @param ttl           - How long (in seconds) to cache each record for.
+  CachingStore(Store* store,
+               size_t memory_budget,
+               int ttl = DEFAULT_TTL);
+  virtual ~CachingStore();
+
+  using Store::get_data;
+  using Store::set_data;
+  using Store::get_data_async;
+  using Store::set_data_async;
+
+  Store::Status get_data(const std::string& table,
+                         const std::string& key,
+                         std::string& data,
+                         uint64_t& cas,
+                         SAS::TrailId trail,
+                         bool log_body,
+                         Store::Format data_format) override;
+
+  Store::Status set_data(const std::string& table,
+                         const std::string& key,
+                         const std::string& data,
+                         uint64_t cas,
+                         int expiry,
+                         SAS::TrailId trail,
+                         bool log_body,
+                         Store::Format data_format) override;
+
+  Store::Status set_data_without_cas(const std::string& table,
+                                     const std::string& key,
+                                     const std::string& data,
+                                     int expiry,
+                                     SAS::TrailId trail,
+                                     bool log_body,
+                                     Store::Format data_format=Store::Format::HEX) override;
+
+  Store::Status delete_data(const std::string& table,
+                            const std::string& key,
+                            SAS::TrailId trail = 0) override;
+
+  void get_data_multi(const std::string& table,
+                      const std::vector<std::string>& keys,
+                      std::vector<Store::GetResult>& results,
+                      SAS::TrailId trail = 0,
+                      bool log_body = true,
+                      Store::Format data_format = Store::Format::HEX) override;
+
+  void set_data_multi(const std::string& table,
+                      const std::vector<Store::SetRequest>& requests,
+                      std::vector<Store::Status>& statuses,
+                      SAS::TrailId trail = 0,
+                      bool log_body = true,
+                      Store::Format data_format = Store::Format::HEX) override;
+
+  void get_data_async(const std::string& table,
+                      const std::string& key,
+                      SAS::TrailId trail,
+                      bool log_body,
+                      Store::Format data_format,
+                      Store::GetCallback callback) override;
+
+  void set_data_async(const std::string& table,
+                      const std::string& key,
+                      const std::string& data,
+                      uint64_t cas,
+                      int expiry,
+                      SAS::TrailId trail,
+                      bool log_body,
+                      Store::Format data_format,
+                      Store::SetCallback callback) override;
+
+  bool has_servers() override { return _store->has_servers(); }
+
+  /// @return how the cache has been used.
+  ShardedLruCache<std::string, Store::GetResult>::Stats cache_stats() const
+  {
+    return _cache.stats();
+  }
+
+private:
+  // Caches a record that was read, unless it was written (on this node)
+  // while it was being read.  `generation` is the value of _generation from
+  // before the read started.
+  void cache_record(const std::string& fqkey,
+                    const std::string& data,
+                    uint64_t cas,
+                    uint64_t generation);
+
+  // Removes a record from the cache after it has been written or deleted.
+  void invalidate(const std::string& fqkey);
+
+  Store* _store;
+  int _ttl;
+  ShardedLruCache<std::string, Store::GetResult> _cache;
+
+  // Incremented by each write, so that a read that overlaps a write doesn't
+  // cache the old record.
+  std::atomic<uint64_t> _generation;
+};
+
+#endif
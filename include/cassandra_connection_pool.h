@@ -33,7 +33,14 @@ class Client;
 class CassandraConnectionPool : public ConnectionPool<Client*>
 {
 public:
-  CassandraConnectionPool();
+  /// The protocols that the pool's clients can talk to Cassandra with.
+  enum Protocol
+  {
+    THRIFT,
+    CQL
+  };
+
+  CassandraConnectionPool(Protocol protocol = THRIFT);
 
   ~CassandraConnectionPool()
   {
@@ -47,6 +54,7 @@ protected:
   void destroy_connection(AddrInfo target, Client* conn) override;
 
   long _timeout_ms;
+  Protocol _protocol;
 };
 
 } // namespace CassandraStore
@@ -0,0 +1,183 @@
+/**
+ * @file cassandra_cursor.h  Cursors that page through the rows of a column
+ * family, or the columns of a row.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef CASSANDRA_CURSOR_H_
+#define CASSANDRA_CURSOR_H_
+
+#include <pthread.h>
+
+#include <exception>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "cassandra_store.h"
+
+namespace CassandraStore {
+
+/// Runs a page fetch on a background thread.
+class PageFetch
+{
+public:
+  PageFetch();
+
+  /// Waits for any fetch in progress, ignoring its result.
+  ~PageFetch();
+
+  /// Start running a fetch.  Only one fetch can be in progress at once.
+  void start(std::function<void()> fn);
+
+  /// Wait for the fetch in progress (if any) to finish, and throw any
+  /// exception it threw.
+  void wait();
+
+private:
+  static void* thread_fn(void* fetch);
+
+  pthread_t _thread;
+  bool _running;
+  std::function<void()> _fn;
+  std::exception_ptr _error;
+};
+
+/// Pages through the columns in a row, rather than reading them all at
+/// once.
+///
+/// If prefetching, the cursor reads the next page on a background thread
+/// while the caller works through the current one.  The client mustn't be
+/// used for anything else until the cursor is destroyed in that case.
+///
+/// Thrift exceptions are thrown from next(), as for the Client methods.
+/// Unlike get_columns_with_prefix(), a missing row isn't an error - the
+/// cursor just returns no columns.
+class ColumnCursor
+{
+public:
+  /// @param client            - The client to read with.
+  /// @param column_family     - The column family to read from.
+  /// @param key               - Row key.
+  /// @param prefix            - Only return the columns whose names begin
+  ///                            with this.  The prefix is removed from the
+  ///                            returned names.  Empty => all columns.
+  /// @param page_size         - The number of columns to read at a time.
+  /// @param consistency_level - Cassandra consistency level.
+  /// @param prefetch          - Whether to read the next page in the
+  ///                            background.
+  ColumnCursor(Client* client,
+               const std::string& column_family,
+               const std::string& key,
+               const std::string& prefix,
+               int32_t page_size,
+               cass::ConsistencyLevel::type consistency_level = cass::ConsistencyLevel::ONE,
+               bool prefetch = false);
+
+  /// Get the next column.
+  ///
+  /// @param column - (out) The column.
+  ///
+  /// @return whether there was another column.
+  bool next(cass::ColumnOrSuperColumn& column);
+
+private:
+  // Read the page after the last one read into _next_page.
+  void fetch();
+
+  Client* _client;
+  const std::string _column_family;
+  const std::string _key;
+  const std::string _prefix;
+  const int32_t _page_size;
+  const cass::ConsistencyLevel::type _consistency_level;
+  const bool _prefetch;
+
+  // The page being returned, and the next column to return from it.
+  std::vector<cass::ColumnOrSuperColumn> _page;
+  size_t _index;
+
+  // The page read after it, whether it's been read, and whether there might
+  // be any more pages after that.
+  std::vector<cass::ColumnOrSuperColumn> _next_page;
+  bool _fetched;
+  bool _more;
+
+  // Where the next page starts.  Each page after the first starts with the
+  // last column of the page before, which is skipped.
+  std::string _start;
+  bool _first;
+
+  // Declared last so that any fetch in progress finishes before the pages
+  // are destroyed.
+  PageFetch _fetch;
+};
+
+/// Pages through the rows of a column family (in token order), rather than
+/// reading them all at once - e.g. for audits or migrations.
+///
+/// Each row only has the columns picked out by the predicate, so for wide
+/// rows it is best to just read the keys here (with a predicate that picks
+/// out no columns, say), and use a ColumnCursor for each row.  Deleted rows
+/// that have no columns left are skipped.
+///
+/// Prefetching and exceptions are as for ColumnCursor.
+class RowCursor
+{
+public:
+  /// @param client            - The client to read with.
+  /// @param column_family     - The column family to read from.
+  /// @param predicate         - The columns to read from each row.
+  /// @param page_size         - The number of rows to read at a time.
+  /// @param consistency_level - Cassandra consistency level.
+  /// @param prefetch          - Whether to read the next page in the
+  ///                            background.
+  RowCursor(Client* client,
+            const std::string& column_family,
+            const cass::SlicePredicate& predicate,
+            int32_t page_size,
+            cass::ConsistencyLevel::type consistency_level = cass::ConsistencyLevel::ONE,
+            bool prefetch = false);
+
+  /// Get the next row.
+  ///
+  /// @param row - (out) The row's key and columns.
+  ///
+  /// @return whether there was another row.
+  bool next(cass::KeySlice& row);
+
+private:
+  // Read the page after the last one read into _next_page.
+  void fetch();
+
+  Client* _client;
+  const std::string _column_family;
+  const cass::SlicePredicate _predicate;
+  const int32_t _page_size;
+  const cass::ConsistencyLevel::type _consistency_level;
+  const bool _prefetch;
+
+  std::vector<cass::KeySlice> _page;
+  size_t _index;
+
+  std::vector<cass::KeySlice> _next_page;
+  bool _fetched;
+  bool _more;
+
+  // The key the next page starts at.  Each page after the first starts with
+  // the last row of the page before, which is skipped.
+  std::string _start;
+  bool _first;
+
+  PageFetch _fetch;
+};
+
+} // namespace CassandraStore
+
+#endif
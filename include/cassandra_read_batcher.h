@@ -0,0 +1,210 @@
+/**
+ * @file cassandra_read_batcher.h  Merges concurrent single-row reads from
+ * Cassandra into multiget_slice calls.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef CASSANDRA_READ_BATCHER_H_
+#define CASSANDRA_READ_BATCHER_H_
+
+#include <pthread.h>
+
+#include <atomic>
+#include <exception>
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "cassandra_store.h"
+
+namespace CassandraStore {
+
+/// Merges the get_slice calls that concurrent operations make for different
+/// rows of the same column family, with the same predicate, into combined
+/// multiget_slice calls.
+///
+/// This works in the same way as the WriteCoalescer.  A read from a node
+/// when no other read like it is in progress is sent straight away.  Reads
+/// that arrive while one is in progress are gathered into a single batch,
+/// which is sent when the read in progress completes, when it holds max_keys
+/// rows, or when the first read in it has waited max_delay_ms - whichever is
+/// first.
+///
+/// Each operation's get_slice call still returns its own row's columns (or
+/// none, if the row doesn't exist) - a failed batch fails every read in it
+/// with the same exception.  Reads are only batched with others to the same
+/// node at the same consistency level.
+///
+/// The first read in a batch sends it, on its own client - the other readers
+/// wait for it.
+class ReadBatcher
+{
+public:
+  typedef std::vector<cass::ColumnOrSuperColumn> Columns;
+
+  /// The counts of reads and the batches they were sent in.
+  struct Stats
+  {
+    uint64_t reads;
+    uint64_t batches;
+  };
+
+  /// @param max_delay_ms - The longest a read waits for others to batch
+  ///                       with.
+  /// @param max_keys     - The most rows to read in a batch.
+  ReadBatcher(unsigned int max_delay_ms, unsigned int max_keys);
+  ~ReadBatcher();
+
+  /// Read a row, batched with any concurrent reads.  This blocks until the
+  /// batch it is sent in completes.
+  ///
+  /// @param client - A client connected to the target, used if this read
+  ///                 sends the batch.
+  /// @param target - The node the client is connected to.
+  void get_slice(Client* client,
+                 const AddrInfo& target,
+                 Columns& columns,
+                 const std::string& key,
+                 const cass::ColumnParent& column_parent,
+                 const cass::SlicePredicate& predicate,
+                 const cass::ConsistencyLevel::type consistency_level);
+
+  /// Get the current counts.
+  void stats(Stats& stats) const;
+
+private:
+  // A batch of reads.
+  struct Batch
+  {
+    Batch();
+    ~Batch();
+
+    std::vector<std::string> keys;
+    unsigned int readers;
+    std::map<std::string, Columns> results;
+
+    // Signalled when the batch is closed to more reads, and when it has been
+    // sent.
+    pthread_cond_t cond;
+    bool closed;
+    bool done;
+    std::exception_ptr error;
+  };
+
+  // The reads of one kind from one node: how many batches are being sent,
+  // and the batch that reads are being gathered into (if any).
+  struct Queue
+  {
+    Queue() : in_flight(0), open() {}
+
+    unsigned int in_flight;
+    std::shared_ptr<Batch> open;
+  };
+
+  // Reads are batched if they're from the same node and column family, with
+  // the same predicate (see predicate_key) and consistency level.
+  typedef std::tuple<AddrInfo, std::string, std::string, cass::ConsistencyLevel::type> QueueKey;
+
+  // Describes a predicate, so that reads with the same predicate can be
+  // found.
+  static std::string predicate_key(const cass::SlicePredicate& predicate);
+
+  // Add a read of a row to a batch (listing each row only once).
+  static void add(Batch& batch, const std::string& key);
+
+  // Close a batch to more reads.  Called with the lock held.
+  void close(Queue& queue, Batch& batch);
+
+  const unsigned int _max_delay_ms;
+  const unsigned int _max_keys;
+
+  pthread_mutex_t _lock;
+  std::map<QueueKey, Queue> _queues;
+
+  std::atomic<uint64_t> _reads;
+  std::atomic<uint64_t> _batches;
+};
+
+/// A client that passes get_slice calls through a ReadBatcher, and
+/// everything else straight to the client it wraps.
+class BatchingClient : public Client
+{
+public:
+  BatchingClient(Client* client,
+                 ReadBatcher* batcher,
+                 const AddrInfo& target) :
+    _client(client),
+    _batcher(batcher),
+    _target(target)
+  {}
+
+  virtual ~BatchingClient() {}
+
+  bool is_connected() { return _client->is_connected(); }
+  void connect() { _client->connect(); }
+  void set_keyspace(const std::string& keyspace) { _client->set_keyspace(keyspace); }
+
+  void batch_mutate(const std::map<std::string, std::map<std::string, std::vector<cass::Mutation> > >& mutation_map,
+                    const cass::ConsistencyLevel::type consistency_level)
+  {
+    _client->batch_mutate(mutation_map, consistency_level);
+  }
+
+  void get_slice(std::vector<cass::ColumnOrSuperColumn>& _return,
+                 const std::string& key,
+                 const cass::ColumnParent& column_parent,
+                 const cass::SlicePredicate& predicate,
+                 const cass::ConsistencyLevel::type consistency_level)
+  {
+    _batcher->get_slice(_client,
+                        _target,
+                        _return,
+                        key,
+                        column_parent,
+                        predicate,
+                        consistency_level);
+  }
+
+  void multiget_slice(std::map<std::string, std::vector<cass::ColumnOrSuperColumn> >& _return,
+                      const std::vector<std::string>& keys,
+                      const cass::ColumnParent& column_parent,
+                      const cass::SlicePredicate& predicate,
+                      const cass::ConsistencyLevel::type consistency_level)
+  {
+    _client->multiget_slice(_return, keys, column_parent, predicate, consistency_level);
+  }
+
+  void remove(const std::string& key,
+              const cass::ColumnPath& column_path,
+              const int64_t timestamp,
+              const cass::ConsistencyLevel::type consistency_level)
+  {
+    _client->remove(key, column_path, timestamp, consistency_level);
+  }
+
+  void get_range_slices(std::vector<cass::KeySlice>& _return,
+                        const cass::ColumnParent& column_parent,
+                        const cass::SlicePredicate& predicate,
+                        const cass::KeyRange& range,
+                        const cass::ConsistencyLevel::type consistency_level)
+  {
+    _client->get_range_slices(_return, column_parent, predicate, range, consistency_level);
+  }
+
+private:
+  Client* _client;
+  ReadBatcher* _batcher;
+  const AddrInfo _target;
+};
+
+} // namespace CassandraStore
+
+#endif
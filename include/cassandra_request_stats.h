@@ -0,0 +1,117 @@
+/**
+ * @file cassandra_request_stats.h  Statistics about the requests a Cassandra
+ * store sends for one column family and request type.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef CASSANDRA_REQUEST_STATS_H__
+#define CASSANDRA_REQUEST_STATS_H__
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+#include "latency_histogram.h"
+
+/// Counts the requests a Cassandra store sends for one column family and
+/// request type (e.g. get_slice): how long they take, how often they fail,
+/// how often their failure makes the store retry the operation, and how
+/// often a read at consistency level TWO falls back to ONE.
+///
+/// As for LatencyHistogram, recording doesn't take a lock - the counts are
+/// split across shards used by different threads, and added up when read.
+class CassandraRequestStats
+{
+public:
+  /// The counts at a point in time.
+  struct Snapshot
+  {
+    uint64_t requests;
+    uint64_t failures;
+
+    /// Failed requests that made the store retry the operation.
+    uint64_t retries;
+
+    /// Reads at consistency level TWO that failed, so were tried again at
+    /// ONE.
+    uint64_t fallbacks;
+  };
+
+  /// @param name - The name of the column family and request type, e.g.
+  ///               "impu:get_slice".
+  CassandraRequestStats(const std::string& name);
+
+  const std::string& name() const { return _name; }
+
+  /// Record a request.
+  ///
+  /// @param latency_us - How long the request took.
+  /// @param failed     - Whether it threw an exception.
+  void record_request(uint64_t latency_us, bool failed)
+  {
+    _latency.record(latency_us);
+    Shard& shard = _shards[shard_index()];
+    shard.requests.fetch_add(1, std::memory_order_relaxed);
+
+    if (failed)
+    {
+      shard.failures.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  /// Record that a request's failure made the store retry the operation.
+  void record_retry()
+  {
+    _shards[shard_index()].retries.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  /// Record that a TWO read was tried again at ONE.
+  void record_fallback()
+  {
+    _shards[shard_index()].fallbacks.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  /// Get the current counts.
+  void snapshot(Snapshot& snapshot) const;
+
+  /// @return the latencies of the requests.
+  const LatencyHistogram& latency() const { return _latency; }
+
+private:
+  static const int NUM_SHARDS = 16;
+
+  // A set of counts, padded so that no two shards share a cache line.
+  struct Shard
+  {
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> failures;
+    std::atomic<uint64_t> retries;
+    std::atomic<uint64_t> fallbacks;
+    char padding[64];
+  };
+
+  // Returns the calling thread's shard, as for LatencyHistogram.
+  static int shard_index()
+  {
+    static std::atomic<unsigned int> next_shard(0);
+    static thread_local int shard = next_shard++ % NUM_SHARDS;
+    return shard;
+  }
+
+  const std::string _name;
+  LatencyHistogram _latency;
+  Shard _shards[NUM_SHARDS];
+
+  // Don't implement the following, to avoid copies of this instance.
+  CassandraRequestStats(CassandraRequestStats const&);
+  void operator=(CassandraRequestStats const&);
+};
+
+#endif
@@ -35,6 +35,13 @@
 #undef htonll
 #endif
 
+#include <pthread.h>
+
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <memory>
+
 #include "thrift/Thrift.h"
 #include "thrift/transport/TSocket.h"
 #include "thrift/transport/TTransport.h"
@@ -49,6 +56,13 @@
 #include "communicationmonitor.h"
 #include "a_record_resolver.h"
 #include "cassandra_connection_pool.h"
+#include "cassandra_request_stats.h"
+#include "snmp_cassandra_request_table.h"
+#include "snmp_latency_histogram_table.h"
+#include "retry_budget.h"
+#include "single_flight.h"
+
+class FiberPool;
 
 // Shortcut for the apache cassandra namespace.
 namespace cass = org::apache::cassandra;
@@ -58,6 +72,11 @@ namespace CassandraStore {
 // Forward declarations to break circular dependencies.
 class Operation;
 class Transaction;
+class WriteCoalescer;
+class ReadBatcher;
+
+/// Shares the columns read by concurrent identical HA reads.
+typedef SingleFlight<std::string, std::vector<cass::ColumnOrSuperColumn> > ReadCoalescer;
 
 /// Simple data structure to allow specifying a set of column names and values
 /// for a particular row (i.e. key in a column family). Useful when batching
@@ -338,6 +357,152 @@ enum ResultCode
 const std::string BOOLEAN_FALSE = std::string("\x00", 1);
 const std::string BOOLEAN_TRUE = std::string("\x01", 1);
 
+/// Runs HA reads speculatively.  A read is sent at consistency level TWO, and
+/// if it hasn't completed within a hedge delay, the same read is sent at
+/// consistency level ONE alongside it - and whichever completes first is
+/// used.  A TWO read that fails because too few replicas are up (or they time
+/// out) sends the ONE read straight away.  So a degraded cluster doesn't cost
+/// every read a full timeout before it falls back to ONE.
+///
+/// Each read is sent on its own connection, by one of a pool of threads -
+/// the thread running the operation just waits for the result.  A read that
+/// loses the race is left to complete in the background.
+class SpeculativeReads
+{
+public:
+  /// The counts of speculative reads.
+  struct Stats
+  {
+    uint64_t reads;
+
+    /// Reads where the TWO read, or the ONE read, succeeded first.
+    uint64_t two_wins;
+    uint64_t one_wins;
+
+    /// ONE reads sent because the hedge delay passed, or because the TWO read
+    /// failed before then.
+    uint64_t hedges;
+    uint64_t fallbacks;
+
+    /// Reads where every read failed.
+    uint64_t failures;
+  };
+
+  /// @param conn_pool         - The pool to get connections from.
+  /// @param keyspace          - The keyspace to use on new connections.
+  /// @param hedge_delay_ms    - How long to wait for the TWO read before
+  ///                            sending the ONE read.
+  /// @param num_threads       - The number of threads to send reads on.  Each
+  ///                            speculative read uses up to two at once.
+  /// @param exception_handler - The exception handler for the threads.
+  SpeculativeReads(CassandraConnectionPool* conn_pool,
+                   const std::string& keyspace,
+                   unsigned int hedge_delay_ms,
+                   unsigned int num_threads,
+                   ExceptionHandler* exception_handler);
+  ~SpeculativeReads();
+
+  bool start();
+  void stop();
+  void join();
+
+  /// Run a read speculatively.  Any exception is thrown as if the read had
+  /// been run directly - the ONE read's exception if it was sent, else the
+  /// TWO read's.
+  ///
+  /// @param target - The Cassandra node to send the reads to.
+  /// @param fn     - Runs the read on a client at a consistency level.  As
+  ///                 the read may outlive this call, it must own its
+  ///                 parameters.
+  /// @param result - (out) The result of the read that won.
+  /// @param trail  - SAS trail ID.
+  template <class T>
+  void read(const AddrInfo& target,
+            std::function<void(Client*, cass::ConsistencyLevel::type, T&)> fn,
+            T& result,
+            SAS::TrailId trail)
+  {
+    // Each read writes to its own result, so the loser can still write to
+    // its result after we've returned.
+    std::shared_ptr<std::vector<T> > results(new std::vector<T>(NUM_LEGS));
+
+    int winner = race(target,
+                      [fn, results](int leg,
+                                    Client* client,
+                                    cass::ConsistencyLevel::type consistency_level)
+                      {
+                        fn(client, consistency_level, (*results)[leg]);
+                      },
+                      trail);
+
+    std::swap(result, (*results)[winner]);
+  }
+
+  /// Get the current counts.
+  void stats(Stats& stats) const;
+
+private:
+  // The two reads in the race.
+  static const int TWO_LEG = 0;
+  static const int ONE_LEG = 1;
+  static const int NUM_LEGS = 2;
+
+  typedef std::function<void(int, Client*, cass::ConsistencyLevel::type)> LegFn;
+
+  // The state of a race, shared between the thread waiting for the result and
+  // the threads sending the reads.
+  struct Race
+  {
+    Race();
+    ~Race();
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool sent[NUM_LEGS];
+    bool done[NUM_LEGS];
+
+    // How each read failed, and whether the failure means the ONE read is
+    // worth sending.
+    std::exception_ptr error[NUM_LEGS];
+    bool retriable[NUM_LEGS];
+  };
+
+  // Send the reads, wait for the first to succeed (or for all to fail), and
+  // return which one it was.
+  int race(const AddrInfo& target, LegFn fn, SAS::TrailId trail);
+
+  // Send one of the reads, on one of the threads.
+  void send_leg(std::shared_ptr<Race> race,
+                int leg,
+                const AddrInfo& target,
+                LegFn fn,
+                SAS::TrailId trail);
+
+  // Run one of the reads.  This runs on one of the threads.
+  void run_leg(std::shared_ptr<Race> race,
+               int leg,
+               const AddrInfo& target,
+               LegFn fn,
+               SAS::TrailId trail);
+
+  static void exception_callback(std::function<void()> work)
+  {
+    // No recovery behaviour, as for the store's worker pool.
+  }
+
+  CassandraConnectionPool* _conn_pool;
+  const std::string _keyspace;
+  const unsigned int _hedge_delay_ms;
+  FunctorThreadPool _thread_pool;
+
+  std::atomic<uint64_t> _reads;
+  std::atomic<uint64_t> _two_wins;
+  std::atomic<uint64_t> _one_wins;
+  std::atomic<uint64_t> _hedges;
+  std::atomic<uint64_t> _fallbacks;
+  std::atomic<uint64_t> _failures;
+};
+
 class Store
 {
 public:
@@ -369,6 +534,14 @@ public:
                                     BaseCommunicationMonitor* comm_monitor = NULL,
                                     CassandraResolver* resolver = NULL);
 
+  /// Choose the protocol the store talks to Cassandra with.  The default is
+  /// Thrift.  This must be called before the store is used, and the port
+  /// passed to configure_connection() must be the one Cassandra serves that
+  /// protocol on.
+  ///
+  /// @param protocol          - The protocol to use.
+  virtual void configure_protocol(CassandraConnectionPool::Protocol protocol);
+
   /// Tests the store.
   ///
   /// Checks that the store can connect to Cassandra.  This method can be called
@@ -417,6 +590,110 @@ public:
                                  unsigned int num_threads,
                                  unsigned int max_queue = 0);
 
+  /// Run asynchronous requests on fibers rather than worker threads.  A
+  /// fiber waiting for Cassandra gives up its thread to other fibers, so a
+  /// few threads can have many requests in flight.
+  ///
+  /// This needs the CQL protocol (see configure_protocol()), whose
+  /// connections wait for Cassandra through the fiber pool - with Thrift,
+  /// the store falls back to the worker pool.  Operations must not hold a
+  /// lock while they talk to Cassandra, and the connection pool mustn't cap
+  /// connections (a fiber waiting for a connection would block its thread).
+  /// Transactions are called back on the fiber, so mustn't block for long.
+  ///
+  /// @param num_threads       - The number of threads to run fibers on.
+  /// @param max_fibers        - The most requests each thread runs at once.
+  ///                            Further requests are queued.  0 => no limit.
+  virtual void configure_fibers(unsigned int num_threads,
+                                unsigned int max_fibers = 0);
+
+  /// Run HA reads speculatively (see SpeculativeReads), rather than only
+  /// falling back to consistency level ONE once a TWO read has failed.  This
+  /// isn't used if the store runs requests on fibers, as waiting for the
+  /// reads would block the fiber's thread.
+  ///
+  /// @param hedge_delay_ms    - How long to wait for a TWO read before also
+  ///                            sending a ONE read.
+  /// @param num_threads       - The number of threads to send the reads on.
+  virtual void configure_speculative_reads(unsigned int hedge_delay_ms,
+                                           unsigned int num_threads);
+
+  /// Get the counts of speculative reads.
+  ///
+  /// @return whether the store runs speculative reads.
+  bool get_speculative_read_stats(SpeculativeReads::Stats& stats) const;
+
+  /// Merge the writes (batch_mutate calls) of concurrent operations into
+  /// combined writes (see WriteCoalescer).  Like speculative reads, this
+  /// isn't used if the store runs requests on fibers.
+  ///
+  /// @param max_delay_ms      - The longest a write waits for others to merge
+  ///                            with.
+  /// @param max_mutations     - The most mutations to merge into one write.
+  virtual void configure_write_coalescing(unsigned int max_delay_ms,
+                                          unsigned int max_mutations);
+
+  /// Merge the single-row reads (get_slice calls) of concurrent operations
+  /// into multi-row reads (see ReadBatcher).  Like speculative reads, this
+  /// isn't used if the store runs requests on fibers.
+  ///
+  /// @param max_delay_ms      - The longest a read waits for others to merge
+  ///                            with.
+  /// @param max_keys          - The most rows to read at once.
+  virtual void configure_read_batching(unsigned int max_delay_ms,
+                                       unsigned int max_keys);
+
+  /// Share HA reads (of the same columns of the same row) between concurrent
+  /// operations - an operation that makes a read that another is already
+  /// making waits for that read and gets a copy of its columns.  Like
+  /// speculative reads, this isn't used if the store runs requests on
+  /// fibers.
+  virtual void configure_read_coalescing();
+
+  /// Get the counts of reads sent and shared by read coalescing.
+  ///
+  /// @return whether the store coalesces reads.
+  bool get_coalesced_read_stats(SingleFlightStats& stats) const;
+
+  /// Reports statistics about the requests the store sends, for each column
+  /// family and request type (e.g. "impu:get_slice"), in SNMP tables: their
+  /// latencies, and how often they fail, make the store retry the operation,
+  /// or fall back from consistency level TWO to ONE.  Each column family and
+  /// request type is added to the tables when it is first used.  Reads run
+  /// speculatively aren't counted, and coalesced writes are counted once per
+  /// combined write.
+  ///
+  /// This should be called before the store is used, and the tables must be
+  /// destroyed before the store, as they read the stats it holds.
+  ///
+  /// @param table             - Table of the counts.
+  /// @param latency_table     - Table of the latency histograms.
+  void set_request_stats_tables(SNMP::CassandraRequestTable* table,
+                                SNMP::LatencyHistogramTable* latency_table);
+
+  /// Log operations that take longer than a threshold, with the requests
+  /// they sent and how long each took.  To avoid flooding the log when
+  /// Cassandra is struggling, only a few slow operations are logged each
+  /// second, and the number that weren't is logged with the next one that
+  /// is.
+  ///
+  /// @param threshold_ms      - Operations that take longer than this are
+  ///                            logged.  0 => don't log slow operations.
+  /// @param max_per_second    - The most slow operations to log each second.
+  void configure_slow_op_log(unsigned int threshold_ms,
+                             unsigned int max_per_second = 1);
+
+  /// Limit the operations that are retried (after a connection error or
+  /// timeout) to those allowed by a retry budget, which may be shared with
+  /// other clients of the same tier.  An operation whose retry is denied
+  /// fails with the error of its first attempt.
+  ///
+  /// This should be called before the store is used.
+  void set_retry_budget(RetryBudget* budget)
+  {
+    _retry_budget = budget;
+  }
+
   /// Start the store.
   ///
   /// Start any necessary worker threads.
@@ -434,7 +711,8 @@ public:
   virtual void wait_stopped();
 
   /// Perform an operation asynchronously.  The calling thread does not block.
-  /// Instead the operation is performed on a worker thread owned by the store.
+  /// Instead the operation is performed on a worker thread (or fiber) owned
+  /// by the store.
   ///
   /// The user must supply a transaction object in addition to the operation to
   /// run. When the operation is complete the worker thread calls back to the
@@ -477,6 +755,27 @@ private:
     }
   };
 
+  // Run an asynchronous operation and call back its transaction, then
+  // delete them both.
+  void process_async(Operation* op, Transaction* trx);
+
+  // A client that records the requests sent through it in the store's
+  // request stats.  Defined in cassandra_store.cpp.
+  class StatsClient;
+
+  // Returns the stats for a column family and request type, creating them if
+  // this is the first request, or NULL if stats aren't being kept.
+  CassandraRequestStats* request_stats(const std::string& column_family,
+                                       const char* request);
+
+  // Log an operation that took longer than the slow operation threshold, if
+  // that doesn't exceed the rate limit.
+  void log_slow_op(Operation* op,
+                   unsigned long duration_us,
+                   int attempts,
+                   ResultCode cass_result,
+                   const std::string& requests);
+
   // Private method that is used by do_sync() and connection_test()
   bool perform_op(Operation* op,
                   SAS::TrailId trail,
@@ -504,6 +803,50 @@ private:
   unsigned int _max_queue;
   Pool* _thread_pool;
 
+  // Fiber pool management, set up by configure_fibers().  The fiber pool is
+  // only created if the store uses CQL.
+  unsigned int _num_fiber_threads;
+  unsigned int _max_fibers;
+  FiberPool* _fiber_pool;
+
+  // Speculative read management, set up by configure_speculative_reads().
+  unsigned int _hedge_delay_ms;
+  unsigned int _num_speculative_threads;
+  SpeculativeReads* _speculative_reads;
+
+  // Write coalescing management, set up by configure_write_coalescing().
+  unsigned int _coalesce_delay_ms;
+  unsigned int _coalesce_max_mutations;
+  WriteCoalescer* _write_coalescer;
+
+  // Read batching management, set up by configure_read_batching().
+  unsigned int _batch_delay_ms;
+  unsigned int _batch_max_keys;
+  ReadBatcher* _read_batcher;
+
+  // Read coalescing management, set up by configure_read_coalescing().
+  bool _coalesce_reads;
+  ReadCoalescer* _read_coalescer;
+
+  // The stats for each column family and request type, if
+  // set_request_stats_tables() has been called.  They are added when they
+  // are first used, and never removed.
+  pthread_rwlock_t _request_stats_lock;
+  std::map<std::string, CassandraRequestStats*> _request_stats;
+  SNMP::CassandraRequestTable* _request_table;
+  SNMP::LatencyHistogramTable* _request_latency_table;
+
+  // Slow operation logging, set up by configure_slow_op_log().  The count of
+  // operations logged is reset each second.
+  unsigned long _slow_op_threshold_us;
+  unsigned int _slow_op_max_per_second;
+  std::atomic<unsigned long> _slow_op_second;
+  std::atomic<unsigned int> _slow_ops_logged;
+  std::atomic<unsigned long> _slow_ops_suppressed;
+
+  // The budget that retries come out of, or NULL if they aren't limited.
+  RetryBudget* _retry_budget;
+
   // Helper used to track local communication state, and issue/clear alarms
   // based upon recent activity.
   BaseCommunicationMonitor* _comm_monitor;
@@ -514,6 +857,7 @@ private:
   // requests a connection from the pool when it is needed, and returns it
   // when it is finished.
   CassandraConnectionPool* _conn_pool;
+  CassandraConnectionPool::Protocol _protocol;
 };
 
 /// Base class for transactions used to perform asynchronous operations.
@@ -569,6 +913,29 @@ private:
   Utils::StopWatch _stopwatch;
 };
 
+/// Transaction that calls a function when its operation completes, for
+/// callers (such as coroutines) that don't want to define a transaction class
+/// for each operation.
+class CallbackTransaction : public Transaction
+{
+public:
+  /// Called with the operation (which is deleted once this returns) and
+  /// whether it succeeded.
+  typedef std::function<void(Operation*, bool)> Callback;
+
+  CallbackTransaction(SAS::TrailId trail, Callback callback) :
+    Transaction(trail), _callback(callback)
+  {}
+
+  virtual ~CallbackTransaction() {}
+
+  void on_success(Operation* op) { _callback(op, true); }
+  void on_failure(Operation* op) { _callback(op, false); }
+
+private:
+  Callback _callback;
+};
+
 // Each operation involving the store is represented by an operation object.
 // This is the abstract base class for all such objects.
 class Operation
@@ -628,6 +995,16 @@ protected:
   /// If the operation hit an exception doing a cassandra operation, the error
   /// text describing the exception.
   std::string _cass_error_text;
+
+  /// Set by the store before it calls perform() - how to run HA reads
+  /// speculatively (or NULL if they aren't), and the node the client is
+  /// connected to.
+  SpeculativeReads* _speculative_reads;
+  AddrInfo _target;
+
+  /// Set by the store before it calls perform() - how to share HA reads with
+  /// other operations (or NULL if they aren't shared).
+  ReadCoalescer* _read_coalescer;
 };
 
 /// This is an abstract class that allows for HA get requests to be made.
@@ -636,6 +1013,9 @@ protected:
 /// subsequent time.
 /// This allows us to attempt a level TWO request, but fall back to level ONE if
 /// that fails.
+///
+/// If the store runs HA reads speculatively, the first request sends the
+/// level ONE request alongside the level TWO one if the TWO is slow.
 class HAOperation : public Operation
 {
 public:
@@ -718,6 +1098,36 @@ public:
                                        std::map<std::string, std::vector<cass::ColumnOrSuperColumn> >& columns,
                                        SAS::TrailId trail);
 private:
+  // Whether to run this request speculatively.
+  bool speculative();
+
+  // Make HA reads, without sharing them with other operations.
+  void read_columns(Client* client,
+                    const std::string& column_family,
+                    const std::string& key,
+                    const std::vector<std::string>& names,
+                    std::vector<cass::ColumnOrSuperColumn>& columns,
+                    SAS::TrailId trail);
+  void read_all_columns(Client* client,
+                        const std::string& column_family,
+                        const std::string& key,
+                        std::vector<cass::ColumnOrSuperColumn>& columns,
+                        SAS::TrailId trail);
+  void read_columns_with_prefix(Client* client,
+                                const std::string& column_family,
+                                const std::string& key,
+                                const std::string& prefix,
+                                std::vector<cass::ColumnOrSuperColumn>& columns,
+                                SAS::TrailId trail);
+
+  // Builds the key that identical reads share.  The parts are separated by
+  // NULs, which can't appear in column family names.
+  static std::string coalesce_key(const char* request,
+                                  const std::string& column_family,
+                                  const std::string& key,
+                                  const std::vector<std::string>& names);
+
+
   // This tracks whether we have alrady made a consistency level TWO request,
   // and hence whether our next request should be ONE.
   bool _consistency_two_tried;
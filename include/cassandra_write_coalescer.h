@@ -0,0 +1,196 @@
+/**
+ * @file cassandra_write_coalescer.h  Merges concurrent writes to Cassandra
+ * into combined batch_mutate calls.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef CASSANDRA_WRITE_COALESCER_H_
+#define CASSANDRA_WRITE_COALESCER_H_
+
+#include <pthread.h>
+
+#include <atomic>
+#include <exception>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "cassandra_store.h"
+
+namespace CassandraStore {
+
+/// Merges the batch_mutate calls that concurrent operations make into
+/// combined calls.
+///
+/// This works like a group commit.  A write to a node when no other write to
+/// it is in progress is sent straight away.  Writes that arrive while one is
+/// in progress are merged into a single batch, which is sent when the write
+/// in progress completes, when it holds max_mutations mutations, or when the
+/// first write in it has waited max_delay_ms - whichever is first.  So a
+/// lightly loaded store doesn't delay writes at all, and under load the
+/// number of calls to Cassandra is bounded.
+///
+/// Each operation's batch_mutate call still returns (or throws) when its own
+/// mutations have been written (or have failed) - a failed batch fails every
+/// write in it with the same exception.  Writes are only merged with others
+/// to the same node at the same consistency level.
+///
+/// The first write in a batch sends it, on its own client - the other
+/// writers wait for it.
+class WriteCoalescer
+{
+public:
+  typedef std::map<std::string, std::map<std::string, std::vector<cass::Mutation> > > MutationMap;
+
+  /// The counts of writes and the batches they were sent in.
+  struct Stats
+  {
+    uint64_t writes;
+    uint64_t batches;
+    uint64_t mutations;
+  };
+
+  /// @param max_delay_ms  - The longest a write waits for others to merge
+  ///                        with.
+  /// @param max_mutations - The most mutations to send in a batch.  A write
+  ///                        with more is sent in a batch on its own.
+  WriteCoalescer(unsigned int max_delay_ms, unsigned int max_mutations);
+  ~WriteCoalescer();
+
+  /// Write mutations, merged with any concurrent writes.  This blocks until
+  /// the batch they are sent in completes.
+  ///
+  /// @param client - A client connected to the target, used if this write
+  ///                 sends the batch.
+  /// @param target - The node the client is connected to.
+  void batch_mutate(Client* client,
+                    const AddrInfo& target,
+                    const MutationMap& mutation_map,
+                    const cass::ConsistencyLevel::type consistency_level);
+
+  /// Get the current counts.
+  void stats(Stats& stats) const;
+
+private:
+  // A batch of writes.
+  struct Batch
+  {
+    Batch();
+    ~Batch();
+
+    MutationMap mutations;
+    unsigned int num_mutations;
+
+    // Signalled when the batch is closed to more writes, and when it has been
+    // sent.
+    pthread_cond_t cond;
+    bool closed;
+    bool done;
+    std::exception_ptr error;
+  };
+
+  // The writes to one node at one consistency level: how many batches are
+  // being sent, and the batch that writes are being merged into (if any).
+  struct Queue
+  {
+    Queue() : in_flight(0), open() {}
+
+    unsigned int in_flight;
+    std::shared_ptr<Batch> open;
+  };
+
+  typedef std::pair<AddrInfo, cass::ConsistencyLevel::type> QueueKey;
+
+  // Merge mutations into a batch.
+  static void merge(Batch& batch, const MutationMap& mutation_map);
+
+  // Close a batch to more writes.  Called with the lock held.
+  void close(Queue& queue, Batch& batch);
+
+  const unsigned int _max_delay_ms;
+  const unsigned int _max_mutations;
+
+  pthread_mutex_t _lock;
+  std::map<QueueKey, Queue> _queues;
+
+  std::atomic<uint64_t> _writes;
+  std::atomic<uint64_t> _batches;
+  std::atomic<uint64_t> _mutations;
+};
+
+/// A client that passes batch_mutate calls through a WriteCoalescer, and
+/// everything else straight to the client it wraps.
+class CoalescingClient : public Client
+{
+public:
+  CoalescingClient(Client* client,
+                   WriteCoalescer* coalescer,
+                   const AddrInfo& target) :
+    _client(client),
+    _coalescer(coalescer),
+    _target(target)
+  {}
+
+  virtual ~CoalescingClient() {}
+
+  bool is_connected() { return _client->is_connected(); }
+  void connect() { _client->connect(); }
+  void set_keyspace(const std::string& keyspace) { _client->set_keyspace(keyspace); }
+
+  void batch_mutate(const std::map<std::string, std::map<std::string, std::vector<cass::Mutation> > >& mutation_map,
+                    const cass::ConsistencyLevel::type consistency_level)
+  {
+    _coalescer->batch_mutate(_client, _target, mutation_map, consistency_level);
+  }
+
+  void get_slice(std::vector<cass::ColumnOrSuperColumn>& _return,
+                 const std::string& key,
+                 const cass::ColumnParent& column_parent,
+                 const cass::SlicePredicate& predicate,
+                 const cass::ConsistencyLevel::type consistency_level)
+  {
+    _client->get_slice(_return, key, column_parent, predicate, consistency_level);
+  }
+
+  void multiget_slice(std::map<std::string, std::vector<cass::ColumnOrSuperColumn> >& _return,
+                      const std::vector<std::string>& keys,
+                      const cass::ColumnParent& column_parent,
+                      const cass::SlicePredicate& predicate,
+                      const cass::ConsistencyLevel::type consistency_level)
+  {
+    _client->multiget_slice(_return, keys, column_parent, predicate, consistency_level);
+  }
+
+  void remove(const std::string& key,
+              const cass::ColumnPath& column_path,
+              const int64_t timestamp,
+              const cass::ConsistencyLevel::type consistency_level)
+  {
+    _client->remove(key, column_path, timestamp, consistency_level);
+  }
+
+  void get_range_slices(std::vector<cass::KeySlice>& _return,
+                        const cass::ColumnParent& column_parent,
+                        const cass::SlicePredicate& predicate,
+                        const cass::KeyRange& range,
+                        const cass::ConsistencyLevel::type consistency_level)
+  {
+    _client->get_range_slices(_return, column_parent, predicate, range, consistency_level);
+  }
+
+private:
+  Client* _client;
+  WriteCoalescer* _coalescer;
+  const AddrInfo _target;
+};
+
+} // namespace CassandraStore
+
+#endif
@@ -13,6 +13,11 @@
 #define CHRONOSCONNECTION_H__
 
 #include <curl/curl.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
 #include "sas.h"
 
 #include "httpconnection.h"
@@ -56,9 +61,97 @@ public:
                              const std::string& opaque_data,
                              SAS::TrailId trail,
                              const std::map<std::string, uint32_t>& tags = EMPTY_TAGS);
+
+  /// A timer to create or update (with a PUT or POST), or delete, as part of
+  /// a batch.
+  struct TimerOperation
+  {
+    TimerOperation() :
+      type(HttpClient::RequestType::POST),
+      interval(0),
+      repeat_for(0),
+      rc(HTTP_OK)
+    {}
+
+    /// PUT, POST or DELETE.
+    HttpClient::RequestType type;
+
+    /// The ID of the timer to PUT or DELETE. On a successful PUT or POST
+    /// this is set to the ID that Chronos returns.
+    std::string identity;
+
+    uint32_t interval;
+    uint32_t repeat_for;
+    std::string callback_uri;
+    std::string opaque_data;
+    std::map<std::string, uint32_t> tags;
+
+    /// The result of the operation, set once the batch has been sent.
+    HTTPCode rc;
+  };
+
+  /// Callback that receives a batch of operations once they have all
+  /// completed. It is called on one of the HttpClient's I/O threads (or on
+  /// the sending thread if none of the operations needed sending), so it
+  /// mustn't block.
+  typedef std::function<void(std::vector<TimerOperation>&)> BatchCallback;
+
+  /// The most operations from a batch that are sent at once.
+  static const size_t MAX_BATCH_IN_FLIGHT = 64;
+
+  /// Sends a batch of timer operations, and waits for them all to complete.
+  /// Each operation's rc (and identity, for PUTs and POSTs) is filled in as
+  /// for the single timer methods.
+  ///
+  /// Chronos has no bulk API, so each operation is still its own HTTP
+  /// request, but they are sent concurrently (up to MAX_BATCH_IN_FLIGHT at a
+  /// time) and their bodies are all written into one buffer.
+  virtual void send_batch(std::vector<TimerOperation>& operations,
+                          SAS::TrailId trail);
+
+  /// Sends a batch of timer operations without blocking. The callback is
+  /// passed the operations once they have all completed. This connection
+  /// must exist until then.
+  virtual void send_batch_async(std::vector<TimerOperation> operations,
+                                SAS::TrailId trail,
+                                BatchCallback callback);
+
   std::string _callback_host;
 
 private:
+  // A batch of operations being sent. The bodies of the PUTs and POSTs are
+  // written one after another in `bodies`, with the body of operation ii
+  // from body_offsets[ii] to body_offsets[ii + 1]. body_data is the start
+  // of the bodies once they have all been written.
+  struct Batch
+  {
+    std::vector<TimerOperation> operations;
+    std::string bodies;
+    std::vector<size_t> body_offsets;
+    const char* body_data;
+    SAS::TrailId trail;
+    BatchCallback callback;
+
+    // The next operation to send, and the number that haven't completed.
+    std::atomic<size_t> next;
+    std::atomic<size_t> outstanding;
+  };
+
+  // Sends the next operation in a batch (completing any that don't need
+  // sending on the way).
+  void send_next_in_batch(std::shared_ptr<Batch> batch);
+
+  // Completes one operation in a batch, calling the callback if it was the
+  // last one. Returns whether it was.
+  bool finish_batch_operation(std::shared_ptr<Batch> batch);
+
+  // Appends the body of a PUT or POST to `body`.
+  void write_body(std::string& body,
+                  uint32_t expires,
+                  uint32_t repeat_for,
+                  const std::string& callback_uri,
+                  const std::string& opaque_data,
+                  const std::map<std::string, uint32_t>& tags);
   std::string create_body(uint32_t expires,
                           uint32_t repeat_for,
                           const std::string& callback_uri,
@@ -48,7 +48,14 @@ private:
   std::string _receiver;
   unsigned int _clear_confirm_ms;
   unsigned int _set_confirm_ms;
-  unsigned long _next_check;
+
+  // The time to next check the communication state.  The thread that does
+  // the check sets this to CHECKING while it does so, so that other threads
+  // don't also check.
+  std::atomic<unsigned long> _next_check;
+  static const unsigned long CHECKING = ~0UL;
+
+  // The state at the last check.  Only accessed by the thread checking.
   int _previous_state;
   // Setup the possible error states
   enum { NO_ERRORS, SOME_ERRORS, ONLY_ERRORS };
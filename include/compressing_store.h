@@ -0,0 +1,240 @@
+/**
+ * @file compressing_store.h Definitions for the CompressingStore class, and
+ * the codecs it uses.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef COMPRESSING_STORE_H__
+#define COMPRESSING_STORE_H__
+
+#include <atomic>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "store.h"
+
+/// @class StoreCodec
+///
+/// Compresses and decompresses record data.  Each codec has an ID, which is
+/// written with the data it compresses so that readers can tell which codec
+/// to decompress it with.  The ID must therefore identify the algorithm and
+/// any dictionary, and must never be reused for a different one.
+class StoreCodec
+{
+public:
+  StoreCodec(uint8_t id) : _id(id) {}
+  virtual ~StoreCodec() {}
+
+  uint8_t id() const { return _id; }
+
+  /// Compresses data.
+  ///
+  /// @return whether the data was compressed.
+  virtual bool compress(const std::string& data, std::string& compressed) const = 0;
+
+  /// Decompresses data.
+  ///
+  /// @param length - The length of the data before it was compressed.
+  /// @return whether the data was decompressed.
+  virtual bool decompress(const char* compressed,
+                          size_t compressed_length,
+                          size_t length,
+                          std::string& data) const = 0;
+
+private:
+  const uint8_t _id;
+};
+
+/// @class Lz4StoreCodec
+///
+/// Compresses records with LZ4, optionally with a dictionary.  A dictionary
+/// trained on typical records (or just a typical record) lets LZ4 compress
+/// small records well, as it can refer back to the dictionary's contents.
+class Lz4StoreCodec : public StoreCodec
+{
+public:
+  /// @param id         - The codec's ID (see StoreCodec).
+  /// @param dictionary - The dictionary, or empty for none.  Only the last
+  ///                     64KB are used.
+  Lz4StoreCodec(uint8_t id, const std::string& dictionary = "");
+
+  bool compress(const std::string& data, std::string& compressed) const override;
+
+  bool decompress(const char* compressed,
+                  size_t compressed_length,
+                  size_t length,
+                  std::string& data) const override;
+
+private:
+  std::string _dictionary;
+};
+
+/// @class CompressingStore
+///
+/// A Store that compresses the records it writes to another Store, and
+/// decompresses them when they are read.
+///
+/// Only records written with Store::Format::JSON are compressed, as these are
+/// the large text records that compress well - HEX records are usually small
+/// or already compact.  Records shorter than a minimum length aren't
+/// compressed either.
+///
+/// Compressed records start with a header that says which codec compressed
+/// them, and any other record is returned as it is.  This means that
+/// uncompressed records written before compression was turned on can still
+/// be read, and that a new codec can be rolled out while records written with
+/// the old one are still in the store, as long as readers know both.
+///
+/// The underlying store logs compressed records to SAS in hex.  It can't tell
+/// whether a record it reads is compressed, so if any codecs are known, it
+/// logs all the records it reads in hex.
+///
+/// The CompressingStore doesn't own the underlying store or the codecs.
+class CompressingStore : public Store
+{
+public:
+  static const size_t DEFAULT_MIN_LENGTH = 256;
+
+  /// @param store      - The store to write compressed records to.
+  /// @param codec      - The codec to compress records with, or NULL to
+  ///                     write them uncompressed (while still reading
+  ///                     compressed records).
+  /// @param codecs     - The other codecs that records might have been
+  ///                     written with.
+  /// @param min_length - Records shorter than this aren't compressed.
+  CompressingStore(Store* store,
+                   const StoreCodec* codec,
+                   const std::vector<const StoreCodec*>& codecs = {},
+                   size_t min_length = DEFAULT_MIN_LENGTH);
+  virtual ~CompressingStore();
+
+  using Store::get_data;
+  using Store::set_data;
+  using Store::get_data_async;
+  using Store::set_data_async;
+
+  Store::Status get_data(const std::string& table,
+                         const std::string& key,
+                         std::string& data,
+                         uint64_t& cas,
+                         SAS::TrailId trail,
+                         bool log_body,
+                         Store::Format data_format) override;
+
+  Store::Status set_data(const std::string& table,
+                         const std::string& key,
+                         const std::string& data,
+                         uint64_t cas,
+                         int expiry,
+                         SAS::TrailId trail,
+                         bool log_body,
+                         Store::Format data_format) override;
+
+  Store::Status set_data_without_cas(const std::string& table,
+                                     const std::string& key,
+                                     const std::string& data,
+                                     int expiry,
+                                     SAS::TrailId trail,
+                                     bool log_body,
+                                     Store::Format data_format=Store::Format::HEX) override;
+
+  Store::Status delete_data(const std::string& table,
+                            const std::string& key,
+                            SAS::TrailId trail = 0) override;
+
+  void get_data_multi(const std::string& table,
+                      const std::vector<std::string>& keys,
+                      std::vector<Store::GetResult>& results,
+                      SAS::TrailId trail = 0,
+                      bool log_body = true,
+                      Store::Format data_format = Store::Format::HEX) override;
+
+  void set_data_multi(const std::string& table,
+                      const std::vector<Store::SetRequest>& requests,
+                      std::vector<Store::Status>& statuses,
+                      SAS::TrailId trail = 0,
+                      bool log_body = true,
+                      Store::Format data_format = Store::Format::HEX) override;
+
+  void get_data_async(const std::string& table,
+                      const std::string& key,
+                      SAS::TrailId trail,
+                      bool log_body,
+                      Store::Format data_format,
+                      Store::GetCallback callback) override;
+
+  void set_data_async(const std::string& table,
+                      const std::string& key,
+                      const std::string& data,
+                      uint64_t cas,
+                      int expiry,
+                      SAS::TrailId trail,
+                      bool log_body,
+                      Store::Format data_format,
+                      Store::SetCallback callback) override;
+
+  bool has_servers() override { return _store->has_servers(); }
+
+  /// Counts of how well records have compressed.
+  struct Stats
+  {
+    /// The number of records written compressed, and their lengths before
+    /// and after compression.
+    uint64_t compressed;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+
+    /// The number of records written uncompressed, because they were too
+    /// short, weren't JSON, or didn't get any shorter.
+    uint64_t uncompressed;
+
+    /// @return the mean compression ratio (or 1.0 if nothing has been
+    /// compressed).
+    double ratio() const
+    {
+      return (bytes_out > 0) ? (double)bytes_in / bytes_out : 1.0;
+    }
+  };
+
+  Stats stats() const;
+
+private:
+  // The header of a compressed record is a magic number, the codec's ID, and
+  // the record's uncompressed length (big-endian).  The magic number starts
+  // with a NUL, which no JSON or text record does.
+  static const char MAGIC[3];
+  static const size_t HEADER_LENGTH = 8;
+
+  // Compresses a record if it should be, returning the data to write, and
+  // the format to log it in.
+  const std::string& encode(const std::string& data,
+                            Store::Format& data_format,
+                            std::string& encoded);
+
+  // The format the underlying store should log records it reads in.
+  Store::Format read_format(Store::Format data_format) const;
+
+  // Decompresses a record if it was compressed.
+  //
+  // @return whether the record could be read.
+  bool decode(const std::string& key, std::string& data) const;
+
+  Store* _store;
+  const StoreCodec* _codec;
+  std::map<uint8_t, const StoreCodec*> _codecs;
+  size_t _min_length;
+
+  std::atomic<uint64_t> _compressed;
+  std::atomic<uint64_t> _bytes_in;
+  std::atomic<uint64_t> _bytes_out;
+  std::atomic<uint64_t> _uncompressed;
+};
+
+#endif
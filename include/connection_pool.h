@@ -14,12 +14,23 @@
 #define CONNECTION_POOL_H__
 
 #include <map>
+#include <unordered_map>
 #include <deque>
+#include <vector>
 #include <forward_list>
+#include <algorithm>
+#include <atomic>
 #include <pthread.h>
+#include <errno.h>
 #include <time.h>
+#include <stdint.h>
 
 #include "log.h"
+#include "memory_accounting.h"
+#include "profiled_mutex.h"
+#include "profiling_span.h"
+#include "snmp_counter_table.h"
+#include "snmp_event_accumulator_table.h"
 
 // Required as AddrInfo is defined here
 #include "utils.h"
@@ -47,6 +58,22 @@ struct ConnectionInfo
     target(target),
     last_used_time_s(0)
   {
+    account()->charge(sizeof(ConnectionInfo<T>));
+  }
+
+  ~ConnectionInfo()
+  {
+    account()->credit(sizeof(ConnectionInfo<T>));
+  }
+
+private:
+  // Only the ConnectionInfo is counted, as what a connection owns is up to
+  // its type.
+  static MemoryAccount* account()
+  {
+    static MemoryAccount* account =
+                      MemoryAccount::get(MemoryAccount::CONNECTION_POOL);
+    return account;
   }
 };
 
@@ -56,11 +83,26 @@ struct ConnectionInfo
 ///
 /// Connections can be retrieved from and replaced in the pool, at the front of
 /// the slot. Connections that have gone unused for a while are removed
-/// periodically from the back of the slots.
+/// periodically from the back of the slots - either one at a time as
+/// connections are released, or by a background reaper thread if one has been
+/// started with start_idle_reaper().
+///
+/// The reaper thread can also create connections ahead of time - see prewarm()
+/// and set_min_idle().
 ///
 /// Retrieved connections are wrapped in ConnectionHandle objects, which, when
 /// destroyed, handle returning the connection to the pool.
 ///
+/// The number of connections can be capped, per target and in total, with
+/// set_connection_limits(). Callers that would exceed a cap wait for another
+/// connection to be released instead of creating one, and are given an
+/// invalid handle if none comes free in time.
+///
+/// To reduce lock contention, the slots are split across a number of shards
+/// (by a hash of their target), each with its own lock. The pool can also keep
+/// a small per-thread cache of released connections, which the releasing
+/// thread reuses before going to the shared slots.
+///
 /// This class should be subclassed for a specific connection type, with the
 /// subclass responsible for implementing the creation and destruction of the
 /// type T connection object when required by the pool.
@@ -72,17 +114,35 @@ class ConnectionPool
   friend class ConnectionHandle<T>;
 
   using Slot = std::deque<ConnectionInfo<T>*>;
-  using Pool = std::map<AddrInfo, Slot>;
+  using Pool = std::unordered_map<AddrInfo, Slot>;
 
 public:
-  ConnectionPool(time_t max_idle_time_s, bool free_on_error = false);
+  /// The default number of shards the pool's slots are split across.
+  static const unsigned int DEFAULT_NUM_SHARDS = 16;
+
+  /// The default interval between runs of the idle connection reaper.
+  static const unsigned long DEFAULT_REAPER_INTERVAL_MS = 1000;
+
+  /// @param max_idle_time_s how long a connection can go unused before it is
+  ///                        removed from the pool.
+  /// @param free_on_error whether one dead connection should trigger cleanup
+  ///                      of any others to the same target.
+  /// @param num_shards the number of independently locked shards to split the
+  ///                   slots across (0 is treated as 1).
+  /// @param thread_cache_size the maximum number of released connections that
+  ///                          each thread keeps for its own reuse (0 =>
+  ///                          no per-thread caching).
+  ConnectionPool(time_t max_idle_time_s,
+                 bool free_on_error = false,
+                 unsigned int num_shards = DEFAULT_NUM_SHARDS,
+                 unsigned int thread_cache_size = 0);
 
   /// The pool cannot be safely emptied in this destructor, as an implementation
   /// of the destroy_connection method is required to safely destroy type T
   /// connection objects. Subclass destructors should call the
   /// destroy_connection_pool method of this class to ensure the pool is
   /// destroyed correctly.
-  virtual ~ConnectionPool() {}
+  virtual ~ConnectionPool();
 
   /// Retrieves a connection for the given target from the pool if it exists,
   /// and creates one otherwise. Returns this connection wrapped in a
@@ -90,6 +150,60 @@ public:
   /// (virtual to allow for testing)
   virtual ConnectionHandle<T> get_connection(AddrInfo target);
 
+  /// Starts a background thread that removes all the connections that have
+  /// gone unused for more than the max idle time, every interval_ms. While the
+  /// reaper is running, releasing a connection doesn't check for idle
+  /// connections. The reaper is stopped by stop_idle_reaper() or
+  /// destroy_connection_pool().
+  ///
+  /// @return whether the reaper is running.
+  bool start_idle_reaper(unsigned long interval_ms = DEFAULT_REAPER_INTERVAL_MS);
+
+  /// Stops the idle connection reaper, if it is running.
+  void stop_idle_reaper();
+
+  /// Asks the reaper thread to create connections to the given target in the
+  /// background, until there are at least num_connections idle connections to
+  /// it in the pool. This starts the reaper if it isn't already running.
+  void prewarm(const AddrInfo& target, unsigned int num_connections);
+
+  /// Sets the minimum number of idle connections to the given target that the
+  /// pool keeps. The reaper thread creates connections to top the target up to
+  /// this level whenever it runs, and doesn't free idle connections below it.
+  /// This starts the reaper if it isn't already running.
+  ///
+  /// @param min_idle the minimum number of idle connections (0 => no minimum).
+  void set_min_idle(const AddrInfo& target, unsigned int min_idle);
+
+  /// Caps the number of connections the pool has open (whether idle or in
+  /// use). When a cap is reached, get_connection waits for a connection to the
+  /// target to be released, or for a connection to be destroyed so that a new
+  /// one can be created. If the wait times out, get_connection fails -
+  /// returning a handle for which is_valid() is false - rather than exceed
+  /// the cap, so callers must check the handle once caps are set. This must
+  /// be called before the pool is used.
+  ///
+  /// @param max_per_target the maximum number of connections to each target
+  ///                       (0 => no limit).
+  /// @param max_total the maximum number of connections to all targets
+  ///                  (0 => no limit).
+  /// @param wait_timeout_ms how long to wait for a connection when a cap has
+  ///                        been reached (negative => wait indefinitely).
+  void set_connection_limits(unsigned int max_per_target,
+                             unsigned int max_total,
+                             int wait_timeout_ms);
+
+  /// Sets the statistics tables updated when a connection cap is reached.
+  /// Either table can be null.
+  ///
+  /// @param saturated_table incremented each time a caller has to wait for a
+  ///                        connection, and again if the wait times out (so
+  ///                        the caller fails).
+  /// @param wait_time_table accumulates the time (in microseconds) that each
+  ///                        such caller waits.
+  void set_limit_statistics(SNMP::CounterTable* saturated_table,
+                            SNMP::EventAccumulatorTable* wait_time_table);
+
 protected:
   /// Creates a type T connection for the given target
   virtual T create_connection(AddrInfo target) = 0;
@@ -107,14 +221,166 @@ protected:
                                   bool return_to_pool);
 
 private:
+  /// A set of slots, and the lock that protects them.
+  struct Shard
+  {
+    Shard() : pool(), lock("connection_pool")
+    {
+    }
+
+    Pool pool;
+    ProfiledMutex lock;
+  };
+
+  /// A thread's cache of connections it has released, most recently released
+  /// first. The lock is only contended when the pool needs to look at every
+  /// thread's cache, which it does rarely.
+  struct ThreadCache
+  {
+    ThreadCache(ConnectionPool<T>* pool) : pool(pool), conns()
+    {
+      pthread_mutex_init(&lock, NULL);
+    }
+
+    ~ThreadCache()
+    {
+      pthread_mutex_destroy(&lock);
+    }
+
+    ConnectionPool<T>* pool;
+    std::deque<ConnectionInfo<T>*> conns;
+    pthread_mutex_t lock;
+  };
+
+  /// Returns the shard that holds the slot for the given target
+  Shard* shard_for(const AddrInfo& target);
+
+  /// Puts a connection back into its slot
+  void return_to_slot(ConnectionInfo<T>* conn_info_ptr);
+
+  /// Removes a connection to the given target from its slot, returning
+  /// nullptr if there isn't one
+  ConnectionInfo<T>* take_from_slot(const AddrInfo& target);
+
+  /// Returns whether a connection cap has been set
+  bool limits_enabled() const
+  {
+    return ((_max_conns_per_target > 0) || (_max_conns_total > 0));
+  }
+
+  /// Counts a new connection to the target, if that doesn't exceed a cap.
+  /// Returns whether the connection can be created. Must be called with
+  /// _limits_lock held.
+  bool reserve_connection(const AddrInfo& target);
+
+  /// Waits until there is an idle connection to the target or room to create
+  /// a new one, when a connection cap has been reached. Returns the idle
+  /// connection, or nullptr if the caller should create a connection (which
+  /// has already been counted). Sets timed_out (and returns nullptr) if the
+  /// wait times out, in which case no connection may be created.
+  ConnectionInfo<T>* wait_for_connection(const AddrInfo& target,
+                                         bool& timed_out);
+
+  /// Removes an idle connection to a target other than the given one (the
+  /// least recently used in its slot), returning nullptr if there isn't one
+  ConnectionInfo<T>* take_idle_connection_to_evict(const AddrInfo& target);
+
+  /// Wakes any callers waiting for a connection
+  void notify_limit_waiters();
+
+  /// Destroys a connection and its ConnectionInfo, and stops counting it
+  /// against the connection caps
+  void delete_connection(ConnectionInfo<T>* conn_info_ptr);
+
+  /// Returns the calling thread's cache, creating it if required. Returns
+  /// nullptr if per-thread caching is disabled.
+  ThreadCache* thread_cache();
+
+  /// Called when a thread with a cache exits. Moves the cached connections
+  /// back into their slots, and deletes the cache.
+  static void thread_cache_destructor(void* cache);
+
+  /// Removes all connections to the given target from every thread's cache,
+  /// adding them to the given list
+  void take_from_thread_caches(const AddrInfo& target,
+                               std::forward_list<ConnectionInfo<T>*>& conns);
+
   /// Removes one connection that has gone unused for more than the max idle
   /// time, if any such connections exist
   void free_old_connection();
 
-  Pool _conn_pool;
-  pthread_mutex_t _conn_pool_lock;
+  /// Removes all connections that have gone unused for more than the max idle
+  /// time, apart from those needed to keep the targets' minimum idle levels
+  void free_idle_connections(const std::map<AddrInfo, unsigned int>& min_idle);
+
+  /// Creates connections to bring each target up to the specified number of
+  /// idle connections, stopping early if the reaper of the given generation
+  /// is stopped
+  void top_up_connections(const std::map<AddrInfo, unsigned int>& targets,
+                          unsigned int generation);
+
+  /// Returns the number of idle connections to the target in its slot
+  size_t idle_connections(const AddrInfo& target);
+
+  /// Wakes the reaper thread to create connections, starting it if required
+  void wake_reaper();
+
+  /// Destroys a connection that has been removed from the pool for being idle
+  void destroy_idle_connection(ConnectionInfo<T>* conn_info_ptr,
+                               time_t current_time);
+
+  /// The reaper thread function, and the static wrapper passed to
+  /// pthread_create.  Each reaper thread is started with the reaper
+  /// generation, and runs until the generation changes.
+  struct ReaperArgs
+  {
+    ConnectionPool<T>* pool;
+    unsigned int generation;
+  };
+  static void* reaper_thread_fn(void* args);
+  void reaper_thread_func(unsigned int generation);
+
+  std::vector<Shard*> _shards;
   time_t _max_idle_time_s;
 
+  // Per-thread caching. Each thread's cache is stored in the _thread_cache_key
+  // thread local, and a list of all the caches is kept (protected by
+  // _thread_caches_lock) so that they can be emptied.
+  unsigned int _thread_cache_size;
+  pthread_key_t _thread_cache_key;
+  std::vector<ThreadCache*> _thread_caches;
+  pthread_mutex_t _thread_caches_lock;
+
+  // Idle connection reaper state. Whether the reaper is running, its thread,
+  // the wakeup flag, minimum idle levels and prewarm requests are protected
+  // by _reaper_lock (although _reaper_running is also read without it, to
+  // check whether to start the reaper). Stopping the reaper moves on the
+  // generation, which tells the thread to exit - so a thread that has been
+  // stopped exits even if a new reaper is started before it notices.
+  std::atomic<bool> _reaper_running;
+  std::atomic<unsigned int> _reaper_generation;
+  bool _reaper_wakeup;
+  std::map<AddrInfo, unsigned int> _min_idle;
+  std::map<AddrInfo, unsigned int> _prewarm_requests;
+  unsigned long _reaper_interval_ms;
+  pthread_t _reaper_thread;
+  pthread_mutex_t _reaper_lock;
+  pthread_cond_t _reaper_cond;
+
+  // Connection caps. The connection counts are only kept if a cap has been
+  // set, and are protected by _limits_lock. _limit_waiters is the number of
+  // callers waiting on _limits_cond for a connection.
+  unsigned int _max_conns_per_target;
+  unsigned int _max_conns_total;
+  int _limit_wait_timeout_ms;
+  std::unordered_map<AddrInfo, unsigned int> _conns_per_target;
+  unsigned int _conns_total;
+  std::atomic<int> _limit_waiters;
+  pthread_mutex_t _limits_lock;
+  pthread_cond_t _limits_cond;
+  SNMP::CounterTable* _saturated_table;
+  SNMP::EventAccumulatorTable* _limit_wait_table;
+
   // Whether one dead connection should trigger cleanup of any others to the
   // same target
   bool _free_on_error;
@@ -135,13 +401,19 @@ public:
   ConnectionHandle<T>& operator= (const ConnectionHandle<T>&) = delete;
 
   // Move constructors
-  ConnectionHandle<T>(ConnectionHandle<T>&& conn_handle);
+  ConnectionHandle(ConnectionHandle<T>&& conn_handle);
   ConnectionHandle<T>& operator= (ConnectionHandle<T>&&);
 
   // The destructor handles releasing the connection back into the pool.
   ~ConnectionHandle();
 
-  // Gets the connection object contained within _conn_info
+  // Whether the handle holds a connection. It doesn't if the pool's
+  // connection caps were reached and no connection came free in time (see
+  // ConnectionPool::set_connection_limits), or if it has been moved from.
+  bool is_valid() const { return (_conn_info_ptr != nullptr); }
+
+  // Gets the connection object contained within _conn_info. Must only be
+  // called on a valid handle.
   T get_connection();
 
   // Gets the AddrInfo object contained within _conn_info
@@ -165,62 +437,579 @@ private:
 };
 
 template<typename T>
-ConnectionPool<T>::ConnectionPool(time_t max_idle_time_s, bool free_on_error) :
+ConnectionPool<T>::ConnectionPool(time_t max_idle_time_s,
+                                  bool free_on_error,
+                                  unsigned int num_shards,
+                                  unsigned int thread_cache_size) :
+  _shards(),
   _max_idle_time_s(max_idle_time_s),
+  _thread_cache_size(thread_cache_size),
+  _thread_caches(),
+  _reaper_running(false),
+  _reaper_generation(0),
+  _reaper_wakeup(false),
+  _min_idle(),
+  _prewarm_requests(),
+  _reaper_interval_ms(DEFAULT_REAPER_INTERVAL_MS),
+  _max_conns_per_target(0),
+  _max_conns_total(0),
+  _limit_wait_timeout_ms(0),
+  _conns_per_target(),
+  _conns_total(0),
+  _limit_waiters(0),
+  _saturated_table(nullptr),
+  _limit_wait_table(nullptr),
   _free_on_error(free_on_error)
 {
-  pthread_mutex_init(&_conn_pool_lock, NULL);
+  for (unsigned int ii = 0; ii < std::max(num_shards, 1u); ++ii)
+  {
+    _shards.push_back(new Shard());
+  }
+
+  pthread_mutex_init(&_thread_caches_lock, NULL);
+
+  pthread_mutex_init(&_reaper_lock, NULL);
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&_reaper_cond, &cond_attr);
+
+  pthread_mutex_init(&_limits_lock, NULL);
+  pthread_cond_init(&_limits_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  if (_thread_cache_size > 0)
+  {
+    pthread_key_create(&_thread_cache_key, thread_cache_destructor);
+  }
+}
+
+template<typename T>
+ConnectionPool<T>::~ConnectionPool()
+{
+  // The reaper should have been stopped by destroy_connection_pool, but make
+  // sure it isn't left running.
+  stop_idle_reaper();
+
+  if (_thread_cache_size > 0)
+  {
+    // destroy_connection_pool wasn't called. Make sure exiting threads don't
+    // try to return their cached connections to this pool.
+    pthread_key_delete(_thread_cache_key);
+  }
+
+  for (Shard* shard : _shards)
+  {
+    delete shard; shard = nullptr;
+  }
+  _shards.clear();
+
+  pthread_mutex_destroy(&_thread_caches_lock);
+  pthread_cond_destroy(&_reaper_cond);
+  pthread_mutex_destroy(&_reaper_lock);
+  pthread_cond_destroy(&_limits_cond);
+  pthread_mutex_destroy(&_limits_lock);
+}
+
+template<typename T>
+bool ConnectionPool<T>::start_idle_reaper(unsigned long interval_ms)
+{
+  // Take the reaper lock so that concurrent calls (e.g. from prewarm) don't
+  // start two reapers. The reaper thread waits for the lock before it starts.
+  pthread_mutex_lock(&_reaper_lock);
+
+  if (!_reaper_running)
+  {
+    _reaper_interval_ms = (interval_ms > 0) ? interval_ms : 1;
+
+    ReaperArgs* args = new ReaperArgs();
+    args->pool = this;
+    args->generation = _reaper_generation;
+
+    int rc = pthread_create(&_reaper_thread, NULL, reaper_thread_fn, args);
+
+    if (rc == 0)
+    {
+      _reaper_running = true;
+    }
+    else
+    {
+      delete args; // LCOV_EXCL_LINE
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to start idle connection reaper (%d) - idle connections "
+                "will be freed as connections are released", rc);
+      // LCOV_EXCL_STOP
+    }
+  }
+
+  bool running = _reaper_running;
+
+  pthread_mutex_unlock(&_reaper_lock);
+
+  return running;
+}
+
+template<typename T>
+void ConnectionPool<T>::stop_idle_reaper()
+{
+  pthread_mutex_lock(&_reaper_lock);
+
+  if (!_reaper_running)
+  {
+    pthread_mutex_unlock(&_reaper_lock);
+    return;
+  }
+
+  // Only one caller sees the reaper running, so the thread is only joined
+  // once.
+  _reaper_running = false;
+  ++_reaper_generation;
+  pthread_t thread = _reaper_thread;
+  pthread_cond_broadcast(&_reaper_cond);
+  pthread_mutex_unlock(&_reaper_lock);
+
+  pthread_join(thread, NULL);
+}
+
+template<typename T>
+void* ConnectionPool<T>::reaper_thread_fn(void* args)
+{
+  ReaperArgs* reaper_args = (ReaperArgs*)args;
+  reaper_args->pool->reaper_thread_func(reaper_args->generation);
+  delete reaper_args;
+  return NULL;
+}
+
+template<typename T>
+void ConnectionPool<T>::prewarm(const AddrInfo& target,
+                                unsigned int num_connections)
+{
+  pthread_mutex_lock(&_reaper_lock);
+  unsigned int& requested = _prewarm_requests[target];
+  requested = std::max(requested, num_connections);
+  pthread_mutex_unlock(&_reaper_lock);
+
+  wake_reaper();
+}
+
+template<typename T>
+void ConnectionPool<T>::set_min_idle(const AddrInfo& target,
+                                     unsigned int min_idle)
+{
+  pthread_mutex_lock(&_reaper_lock);
+  if (min_idle > 0)
+  {
+    _min_idle[target] = min_idle;
+  }
+  else
+  {
+    _min_idle.erase(target);
+  }
+  pthread_mutex_unlock(&_reaper_lock);
+
+  wake_reaper();
+}
+
+template<typename T>
+void ConnectionPool<T>::set_connection_limits(unsigned int max_per_target,
+                                              unsigned int max_total,
+                                              int wait_timeout_ms)
+{
+  pthread_mutex_lock(&_limits_lock);
+  _max_conns_per_target = max_per_target;
+  _max_conns_total = max_total;
+  _limit_wait_timeout_ms = wait_timeout_ms;
+  pthread_mutex_unlock(&_limits_lock);
+}
+
+template<typename T>
+void ConnectionPool<T>::set_limit_statistics(SNMP::CounterTable* saturated_table,
+                                             SNMP::EventAccumulatorTable* wait_time_table)
+{
+  _saturated_table = saturated_table;
+  _limit_wait_table = wait_time_table;
+}
+
+template<typename T>
+void ConnectionPool<T>::wake_reaper()
+{
+  if (!_reaper_running)
+  {
+    start_idle_reaper();
+  }
+
+  pthread_mutex_lock(&_reaper_lock);
+  _reaper_wakeup = true;
+  pthread_cond_broadcast(&_reaper_cond);
+  pthread_mutex_unlock(&_reaper_lock);
+}
+
+template<typename T>
+void ConnectionPool<T>::reaper_thread_func(unsigned int generation)
+{
+  struct timespec next_run;
+  clock_gettime(CLOCK_MONOTONIC, &next_run);
+  bool reap = true;
+
+  pthread_mutex_lock(&_reaper_lock);
+
+  while (_reaper_generation == generation)
+  {
+    if (reap)
+    {
+      next_run.tv_sec += _reaper_interval_ms / 1000;
+      next_run.tv_nsec += (_reaper_interval_ms % 1000) * 1000000;
+      if (next_run.tv_nsec >= 1000000000)
+      {
+        next_run.tv_nsec -= 1000000000;
+        next_run.tv_sec += 1;
+      }
+    }
+
+    // Wait until it's time to reap idle connections, or until we're woken to
+    // create connections.
+    reap = false;
+    while ((_reaper_generation == generation) && (!_reaper_wakeup) && (!reap))
+    {
+      reap = (pthread_cond_timedwait(&_reaper_cond,
+                                     &_reaper_lock,
+                                     &next_run) == ETIMEDOUT);
+    }
+
+    if (_reaper_generation != generation)
+    {
+      break;
+    }
+
+    // Take copies of the connection targets, so that we don't hold the reaper
+    // lock while freeing or creating connections (which would hold up
+    // stop_idle_reaper, prewarm and set_min_idle).
+    _reaper_wakeup = false;
+    std::map<AddrInfo, unsigned int> min_idle = _min_idle;
+    std::map<AddrInfo, unsigned int> targets = _min_idle;
+    for (const std::pair<const AddrInfo, unsigned int>& request : _prewarm_requests)
+    {
+      unsigned int& wanted = targets[request.first];
+      wanted = std::max(wanted, request.second);
+    }
+    _prewarm_requests.clear();
+
+    pthread_mutex_unlock(&_reaper_lock);
+
+    if (reap)
+    {
+      free_idle_connections(min_idle);
+    }
+
+    top_up_connections(targets, generation);
+
+    pthread_mutex_lock(&_reaper_lock);
+  }
+
+  pthread_mutex_unlock(&_reaper_lock);
+}
+
+template<typename T>
+size_t ConnectionPool<T>::idle_connections(const AddrInfo& target)
+{
+  size_t idle = 0;
+  Shard* shard = shard_for(target);
+
+  shard->lock.lock();
+  typename Pool::iterator slot_it = shard->pool.find(target);
+  if (slot_it != shard->pool.end())
+  {
+    idle = slot_it->second.size();
+  }
+  shard->lock.unlock();
+
+  return idle;
+}
+
+template<typename T>
+void ConnectionPool<T>::top_up_connections(const std::map<AddrInfo, unsigned int>& targets,
+                                           unsigned int generation)
+{
+  for (const std::pair<const AddrInfo, unsigned int>& target : targets)
+  {
+    size_t idle = idle_connections(target.first);
+
+    if (idle < target.second)
+    {
+      TRC_DEBUG("Creating %d connections to target: %s",
+                (int)(target.second - idle),
+                target.first.address_and_port_to_string().c_str());
+    }
+
+    for (; (idle < target.second) && (_reaper_generation == generation); ++idle)
+    {
+      if (limits_enabled())
+      {
+        // Don't exceed the connection caps to create idle connections.
+        pthread_mutex_lock(&_limits_lock);
+        bool reserved = reserve_connection(target.first);
+        pthread_mutex_unlock(&_limits_lock);
+
+        if (!reserved)
+        {
+          TRC_DEBUG("Connection limit reached - not creating more connections to "
+                    "target: %s",
+                    target.first.address_and_port_to_string().c_str());
+          break;
+        }
+      }
+
+      ConnectionInfo<T>* conn_info_ptr =
+                 new ConnectionInfo<T>(create_connection(target.first), target.first);
+      conn_info_ptr->last_used_time_s = time(NULL);
+      return_to_slot(conn_info_ptr);
+      notify_limit_waiters();
+    }
+  }
 }
 
 template<typename T>
 void ConnectionPool<T>::destroy_connection_pool()
 {
-  pthread_mutex_lock(&_conn_pool_lock);
-  // Iterate over the slots in the pool. The typename keyword is required to
-  // clarify the type declaration to the compiler.
-  for (typename Pool::iterator slot_it = _conn_pool.begin();
-       slot_it != _conn_pool.end();
-       ++slot_it)
+  // Stop the reaper first, as it could otherwise be destroying connections at
+  // the same time.
+  stop_idle_reaper();
+
+  // Empty the thread caches into the slots, so they are destroyed below. The
+  // thread local is deleted, so the caches won't be used again.
+  if (_thread_cache_size > 0)
+  {
+    pthread_mutex_lock(&_thread_caches_lock);
+
+    for (ThreadCache* cache : _thread_caches)
+    {
+      for (ConnectionInfo<T>* conn_info : cache->conns)
+      {
+        return_to_slot(conn_info);
+      }
+
+      delete cache; cache = nullptr;
+    }
+    _thread_caches.clear();
+
+    pthread_key_delete(_thread_cache_key);
+    _thread_cache_size = 0;
+
+    pthread_mutex_unlock(&_thread_caches_lock);
+  }
+
+  for (Shard* shard : _shards)
+  {
+    shard->lock.lock();
+    // Iterate over the slots in the shard. The typename keyword is required to
+    // clarify the type declaration to the compiler.
+    for (typename Pool::iterator slot_it = shard->pool.begin();
+         slot_it != shard->pool.end();
+         ++slot_it)
+    {
+      // Iterate over the ConnectionInfo objects in the current slot. The
+      // typename keyword is required to clarify the type declaration to the
+      // compiler.
+      for (typename Slot::iterator conn_info_it = slot_it->second.begin();
+           conn_info_it != slot_it->second.end();
+           ++conn_info_it)
+      {
+        // Safely destroy the connection object contained in the current
+        // ConnectionInfo
+        destroy_connection((*conn_info_it)->target, (*conn_info_it)->conn);
+        // Destroy the current ConnectionInfo
+        delete *conn_info_it; *conn_info_it = NULL;
+      }
+    }
+    shard->pool.clear();
+    shard->lock.unlock();
+  }
+}
+
+template<typename T>
+typename ConnectionPool<T>::Shard* ConnectionPool<T>::shard_for(const AddrInfo& target)
+{
+  if (_shards.size() == 1)
+  {
+    return _shards[0];
+  }
+
+  // FNV-1a hash over the fields that AddrInfo::operator== compares.
+  uint32_t hash = 2166136261u;
+  const unsigned char* bytes = (const unsigned char*)&target.address.addr;
+  size_t len = (target.address.af == AF_INET6) ? sizeof(target.address.addr.ipv6) :
+                                                 sizeof(target.address.addr.ipv4);
+
+  for (size_t ii = 0; ii < len; ++ii)
+  {
+    hash = (hash ^ bytes[ii]) * 16777619u;
+  }
+
+  hash = (hash ^ (uint32_t)target.port) * 16777619u;
+  hash = (hash ^ (uint32_t)target.transport) * 16777619u;
+
+  return _shards[hash % _shards.size()];
+}
+
+template<typename T>
+void ConnectionPool<T>::return_to_slot(ConnectionInfo<T>* conn_info_ptr)
+{
+  Shard* shard = shard_for(conn_info_ptr->target);
+
+  shard->lock.lock();
+  shard->pool[conn_info_ptr->target].push_front(conn_info_ptr);
+  shard->lock.unlock();
+}
+
+template<typename T>
+ConnectionInfo<T>* ConnectionPool<T>::take_from_slot(const AddrInfo& target)
+{
+  ConnectionInfo<T>* conn_info_ptr = nullptr;
+  Shard* shard = shard_for(target);
+
+  shard->lock.lock();
+
+  typename Pool::iterator slot_it = shard->pool.find(target);
+
+  if ((slot_it != shard->pool.end()) && (!slot_it->second.empty()))
+  {
+    conn_info_ptr = slot_it->second.front();
+    slot_it->second.pop_front();
+    TRC_DEBUG("Found existing connection %p in pool", conn_info_ptr);
+  }
+
+  shard->lock.unlock();
+
+  return conn_info_ptr;
+}
+
+template<typename T>
+typename ConnectionPool<T>::ThreadCache* ConnectionPool<T>::thread_cache()
+{
+  if (_thread_cache_size == 0)
+  {
+    return nullptr;
+  }
+
+  ThreadCache* cache = (ThreadCache*)pthread_getspecific(_thread_cache_key);
+
+  if (cache == nullptr)
+  {
+    cache = new ThreadCache(this);
+    pthread_setspecific(_thread_cache_key, cache);
+
+    pthread_mutex_lock(&_thread_caches_lock);
+    _thread_caches.push_back(cache);
+    pthread_mutex_unlock(&_thread_caches_lock);
+  }
+
+  return cache;
+}
+
+template<typename T>
+void ConnectionPool<T>::thread_cache_destructor(void* cache_ptr)
+{
+  ThreadCache* cache = (ThreadCache*)cache_ptr;
+  ConnectionPool<T>* pool = cache->pool;
+
+  pthread_mutex_lock(&pool->_thread_caches_lock);
+  pool->_thread_caches.erase(std::remove(pool->_thread_caches.begin(),
+                                         pool->_thread_caches.end(),
+                                         cache),
+                             pool->_thread_caches.end());
+  pthread_mutex_unlock(&pool->_thread_caches_lock);
+
+  for (ConnectionInfo<T>* conn_info : cache->conns)
+  {
+    pool->return_to_slot(conn_info);
+  }
+
+  pool->notify_limit_waiters();
+
+  delete cache; cache = nullptr;
+}
+
+template<typename T>
+void ConnectionPool<T>::take_from_thread_caches(const AddrInfo& target,
+                                                std::forward_list<ConnectionInfo<T>*>& conns)
+{
+  pthread_mutex_lock(&_thread_caches_lock);
+
+  for (ThreadCache* cache : _thread_caches)
   {
-    // Iterate over the ConnectionInfo objects in the current slot. The typename
-    // keyword is required to clarify the type declaration to the compiler.
-    for (typename Slot::iterator conn_info_it = slot_it->second.begin();
-         conn_info_it != slot_it->second.end();
-         ++conn_info_it)
+    pthread_mutex_lock(&cache->lock);
+
+    for (typename std::deque<ConnectionInfo<T>*>::iterator it = cache->conns.begin();
+         it != cache->conns.end();)
     {
-      // Safely destroy the connection object contained in the current
-      // ConnectionInfo
-      destroy_connection((*conn_info_it)->target, (*conn_info_it)->conn);
-      // Destroy the current ConnectionInfo
-      delete *conn_info_it; *conn_info_it = NULL;
+      if ((*it)->target == target)
+      {
+        conns.push_front(*it);
+        it = cache->conns.erase(it);
+      }
+      else
+      {
+        ++it;
+      }
     }
+
+    pthread_mutex_unlock(&cache->lock);
   }
-  _conn_pool.clear();
-  pthread_mutex_unlock(&_conn_pool_lock);
+
+  pthread_mutex_unlock(&_thread_caches_lock);
 }
 
 template<typename T>
 ConnectionHandle<T> ConnectionPool<T>::get_connection(AddrInfo target)
 {
+  PROFILE_SPAN("connection_pool.get");
   TRC_DEBUG("Request for connection to IP: %s, port: %d",
             target.address.to_string().c_str(),
             target.port);
 
   ConnectionInfo<T>* conn_info_ptr = nullptr;
 
-  pthread_mutex_lock(&_conn_pool_lock);
+  ThreadCache* cache = thread_cache();
+
+  if (cache != nullptr)
+  {
+    // Look for a connection to the target that this thread released recently.
+    pthread_mutex_lock(&cache->lock);
+
+    for (typename std::deque<ConnectionInfo<T>*>::iterator it = cache->conns.begin();
+         it != cache->conns.end();
+         ++it)
+    {
+      if ((*it)->target == target)
+      {
+        conn_info_ptr = *it;
+        cache->conns.erase(it);
+        TRC_DEBUG("Found existing connection %p in thread cache", conn_info_ptr);
+        break;
+      }
+    }
 
-  typename Pool::iterator slot_it = _conn_pool.find(target);
+    pthread_mutex_unlock(&cache->lock);
+  }
 
-  if ((slot_it != _conn_pool.end()) && (!slot_it->second.empty()))
+  if (!conn_info_ptr)
   {
     // If there is a connection in the pool for the given AddrInfo, retrieve it
-    conn_info_ptr = slot_it->second.front();
-    slot_it->second.pop_front();
-    TRC_DEBUG("Found existing connection %p in pool", conn_info_ptr);
+    conn_info_ptr = take_from_slot(target);
   }
 
-  pthread_mutex_unlock(&_conn_pool_lock);
+  if ((!conn_info_ptr) && (limits_enabled()))
+  {
+    // We need a new connection, but only if that doesn't exceed the caps.
+    // Otherwise wait for one to be released.
+    bool timed_out = false;
+    conn_info_ptr = wait_for_connection(target, timed_out);
+
+    if (timed_out)
+    {
+      return ConnectionHandle<T>(nullptr, this);
+    }
+  }
 
   if (!conn_info_ptr)
   {
@@ -248,12 +1037,37 @@ void ConnectionPool<T>::release_connection(ConnectionInfo<T>* conn_info_ptr,
     // Update the last used time of the connection
     conn_info_ptr->last_used_time_s = time(NULL);
 
-    pthread_mutex_lock(&_conn_pool_lock);
+    // If callers are waiting for a connection, it goes straight back into the
+    // pool where they can get it.
+    ThreadCache* cache = (_limit_waiters == 0) ? thread_cache() : nullptr;
 
-    // Put the connection back into the pool.
-    _conn_pool[conn_info_ptr->target].push_front(conn_info_ptr);
+    if (cache != nullptr)
+    {
+      // Put the connection in this thread's cache. If that makes the cache
+      // too big, the least recently released connection in it goes back into
+      // the pool instead.
+      pthread_mutex_lock(&cache->lock);
+      cache->conns.push_front(conn_info_ptr);
+
+      if (cache->conns.size() > _thread_cache_size)
+      {
+        conn_info_ptr = cache->conns.back();
+        cache->conns.pop_back();
+      }
+      else
+      {
+        conn_info_ptr = nullptr;
+      }
+
+      pthread_mutex_unlock(&cache->lock);
+    }
 
-    pthread_mutex_unlock(&_conn_pool_lock);
+    if (conn_info_ptr != nullptr)
+    {
+      // Put the connection back into the pool.
+      return_to_slot(conn_info_ptr);
+      notify_limit_waiters();
+    }
   }
   else
   {
@@ -268,10 +1082,12 @@ void ConnectionPool<T>::release_connection(ConnectionInfo<T>* conn_info_ptr,
       // take
       std::forward_list<ConnectionInfo<T>*> conns_to_destroy;
 
-      pthread_mutex_lock(&_conn_pool_lock);
+      Shard* shard = shard_for(conn_info_ptr->target);
 
-      typename Pool::iterator slot_it = _conn_pool.find(conn_info_ptr->target);
-      if (slot_it != _conn_pool.end())
+      shard->lock.lock();
+
+      typename Pool::iterator slot_it = shard->pool.find(conn_info_ptr->target);
+      if (slot_it != shard->pool.end())
       {
         TRC_DEBUG("Freeing %d other connections", slot_it->second.size());
         while (!slot_it->second.empty())
@@ -282,22 +1098,30 @@ void ConnectionPool<T>::release_connection(ConnectionInfo<T>* conn_info_ptr,
         }
       }
 
-      pthread_mutex_unlock(&_conn_pool_lock);
+      shard->lock.unlock();
+
+      if (_thread_cache_size > 0)
+      {
+        // Connections to the target may also be in the threads' caches.
+        take_from_thread_caches(conn_info_ptr->target, conns_to_destroy);
+      }
 
       for (ConnectionInfo<T>* conn_info : conns_to_destroy)
       {
-        destroy_connection(conn_info->target, conn_info->conn);
-        delete conn_info; conn_info = nullptr;
+        delete_connection(conn_info);
       }
     }
 
     // Now safely destroy the connection and its associated ConnectionInfo
     // (which isn't in the pool, and hence wasn't destroyed above)
-    destroy_connection(conn_info_ptr->target, conn_info_ptr->conn);
-    delete conn_info_ptr; conn_info_ptr = nullptr;
+    delete_connection(conn_info_ptr);
   }
 
-  free_old_connection();
+  if (!_reaper_running)
+  {
+    // There's no reaper, so free idle connections as we go.
+    free_old_connection();
+  }
 }
 
 template<typename T>
@@ -306,58 +1130,425 @@ void ConnectionPool<T>::free_old_connection()
   time_t current_time = time(nullptr);
   ConnectionInfo<T>* conn_to_destroy = nullptr;
 
-  pthread_mutex_lock(&_conn_pool_lock);
+  ThreadCache* cache = thread_cache();
 
-  // Iterate over the slots
-  for (typename Pool::iterator slot_it = _conn_pool.begin();
-       slot_it != _conn_pool.end();
-       ++slot_it)
+  if (cache != nullptr)
   {
-    if (!slot_it->second.empty())
+    // Check the oldest connection in this thread's cache first.
+    pthread_mutex_lock(&cache->lock);
+
+    if ((!cache->conns.empty()) &&
+        (current_time > cache->conns.back()->last_used_time_s + _max_idle_time_s))
     {
-      // Connections are always checked in/out at the front of the slot, so the
-      // oldest one is at the back
-      ConnectionInfo<T>* oldest_conn_info_ptr = slot_it->second.back();
+      conn_to_destroy = cache->conns.back();
+      cache->conns.pop_back();
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+  }
+
+  // Iterate over the shards, taking each shard's lock in turn.
+  for (typename std::vector<Shard*>::iterator shard_it = _shards.begin();
+       (conn_to_destroy == nullptr) && (shard_it != _shards.end());
+       ++shard_it)
+  {
+    Shard* shard = *shard_it;
+
+    shard->lock.lock();
 
-      if (current_time > oldest_conn_info_ptr->last_used_time_s + _max_idle_time_s)
+    // Iterate over the slots
+    for (typename Pool::iterator slot_it = shard->pool.begin();
+         slot_it != shard->pool.end();
+         ++slot_it)
+    {
+      if (!slot_it->second.empty())
       {
-        // Mark the connection for destruction. Don't actually delete it behind
-        // the lock, as we don't know how long doing so will take
-        conn_to_destroy = oldest_conn_info_ptr;
-        slot_it->second.pop_back();
+        // Connections are always checked in/out at the front of the slot, so
+        // the oldest one is at the back
+        ConnectionInfo<T>* oldest_conn_info_ptr = slot_it->second.back();
 
-        // Delete the entire slot if it is now empty
-        if (slot_it->second.empty())
+        if (current_time > oldest_conn_info_ptr->last_used_time_s + _max_idle_time_s)
         {
-          _conn_pool.erase(slot_it);
+          // Mark the connection for destruction. Don't actually delete it
+          // behind the lock, as we don't know how long doing so will take
+          conn_to_destroy = oldest_conn_info_ptr;
+          slot_it->second.pop_back();
+
+          // Delete the entire slot if it is now empty
+          if (slot_it->second.empty())
+          {
+            shard->pool.erase(slot_it);
+          }
+
+          // We have an old connection to delete, so we stop here
+          break;
         }
-
-        // We have an old connection to delete, so we stop here
-        break;
       }
     }
-  }
 
-  pthread_mutex_unlock(&_conn_pool_lock);
+    shard->lock.unlock();
+  }
 
   if (conn_to_destroy)
   {
     // We have a connection marked for destruction. Destroy it.
-    if (Log::enabled(Log::DEBUG_LEVEL))
+    destroy_idle_connection(conn_to_destroy, current_time);
+  }
+}
+
+template<typename T>
+void ConnectionPool<T>::free_idle_connections(const std::map<AddrInfo, unsigned int>& min_idle)
+{
+  time_t current_time = time(nullptr);
+  std::forward_list<ConnectionInfo<T>*> conns_to_destroy;
+
+  for (Shard* shard : _shards)
+  {
+    shard->lock.lock();
+
+    for (typename Pool::iterator slot_it = shard->pool.begin();
+         slot_it != shard->pool.end();)
     {
-      /// Create strings required for debug logging
-      std::string addr_info_str = conn_to_destroy->target.address_and_port_to_string();
-      std::string current_time_str = ctime(&current_time);
-      std::string last_used_time_s_str = ctime(&(conn_to_destroy->last_used_time_s));
+      typename std::map<AddrInfo, unsigned int>::const_iterator min_it =
+                                                    min_idle.find(slot_it->first);
+      size_t keep = (min_it != min_idle.end()) ? min_it->second : 0;
+
+      // The oldest connections are at the back of the slot.
+      Slot& slot = slot_it->second;
+      while ((slot.size() > keep) &&
+             (current_time > slot.back()->last_used_time_s + _max_idle_time_s))
+      {
+        conns_to_destroy.push_front(slot.back());
+        slot.pop_back();
+      }
 
-      TRC_DEBUG("Free idle connection to target: %s (time now is %s, last used %s)",
-                addr_info_str.c_str(),
-                current_time_str.c_str(),
-                last_used_time_s_str.c_str());
+      if (slot.empty())
+      {
+        slot_it = shard->pool.erase(slot_it);
+      }
+      else
+      {
+        ++slot_it;
+      }
     }
 
-    destroy_connection(conn_to_destroy->target, conn_to_destroy->conn);
-    delete conn_to_destroy; conn_to_destroy = nullptr;
+    shard->lock.unlock();
+  }
+
+  if (_thread_cache_size > 0)
+  {
+    pthread_mutex_lock(&_thread_caches_lock);
+
+    for (ThreadCache* cache : _thread_caches)
+    {
+      pthread_mutex_lock(&cache->lock);
+
+      while ((!cache->conns.empty()) &&
+             (current_time > cache->conns.back()->last_used_time_s + _max_idle_time_s))
+      {
+        conns_to_destroy.push_front(cache->conns.back());
+        cache->conns.pop_back();
+      }
+
+      pthread_mutex_unlock(&cache->lock);
+    }
+
+    pthread_mutex_unlock(&_thread_caches_lock);
+  }
+
+  // Destroy the connections now that we've released the locks, as we don't
+  // know how long doing so will take.
+  for (ConnectionInfo<T>* conn_info : conns_to_destroy)
+  {
+    destroy_idle_connection(conn_info, current_time);
+  }
+}
+
+template<typename T>
+void ConnectionPool<T>::destroy_idle_connection(ConnectionInfo<T>* conn_info_ptr,
+                                                time_t current_time)
+{
+  if (TRC_ENABLED(Log::DEBUG_LEVEL))
+  {
+    /// Create strings required for debug logging
+    std::string addr_info_str = conn_info_ptr->target.address_and_port_to_string();
+    std::string current_time_str = ctime(&current_time);
+    std::string last_used_time_s_str = ctime(&(conn_info_ptr->last_used_time_s));
+
+    TRC_DEBUG("Free idle connection to target: %s (time now is %s, last used %s)",
+              addr_info_str.c_str(),
+              current_time_str.c_str(),
+              last_used_time_s_str.c_str());
+  }
+
+  delete_connection(conn_info_ptr);
+}
+
+template<typename T>
+void ConnectionPool<T>::delete_connection(ConnectionInfo<T>* conn_info_ptr)
+{
+  AddrInfo target = conn_info_ptr->target;
+
+  destroy_connection(conn_info_ptr->target, conn_info_ptr->conn);
+  delete conn_info_ptr; conn_info_ptr = nullptr;
+
+  if (limits_enabled())
+  {
+    pthread_mutex_lock(&_limits_lock);
+
+    typename std::unordered_map<AddrInfo, unsigned int>::iterator count_it =
+                                                   _conns_per_target.find(target);
+    if (count_it != _conns_per_target.end())
+    {
+      if (--count_it->second == 0)
+      {
+        _conns_per_target.erase(count_it);
+      }
+
+      --_conns_total;
+    }
+
+    // There may now be room for a waiting caller to create a connection.
+    if (_limit_waiters > 0)
+    {
+      pthread_cond_broadcast(&_limits_cond);
+    }
+
+    pthread_mutex_unlock(&_limits_lock);
+  }
+}
+
+template<typename T>
+bool ConnectionPool<T>::reserve_connection(const AddrInfo& target)
+{
+  if (!limits_enabled())
+  {
+    return true;
+  }
+
+  unsigned int& target_conns = _conns_per_target[target];
+
+  if (((_max_conns_per_target > 0) && (target_conns >= _max_conns_per_target)) ||
+      ((_max_conns_total > 0) && (_conns_total >= _max_conns_total)))
+  {
+    if (target_conns == 0)
+    {
+      _conns_per_target.erase(target);
+    }
+
+    return false;
+  }
+
+  ++target_conns;
+  ++_conns_total;
+  return true;
+}
+
+template<typename T>
+ConnectionInfo<T>* ConnectionPool<T>::wait_for_connection(const AddrInfo& target,
+                                                          bool& timed_out)
+{
+  ConnectionInfo<T>* conn_info_ptr = nullptr;
+  timed_out = false;
+
+  pthread_mutex_lock(&_limits_lock);
+
+  if (reserve_connection(target))
+  {
+    // There's room for a new connection.
+    pthread_mutex_unlock(&_limits_lock);
+    return nullptr;
+  }
+
+  pthread_mutex_unlock(&_limits_lock);
+
+  TRC_DEBUG("Connection limit reached for target: %s - waiting for a connection",
+            target.address_and_port_to_string().c_str());
+
+  if (_saturated_table != nullptr)
+  {
+    _saturated_table->increment();
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  struct timespec deadline = start;
+  deadline.tv_sec += _limit_wait_timeout_ms / 1000;
+  deadline.tv_nsec += (_limit_wait_timeout_ms % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000)
+  {
+    deadline.tv_nsec -= 1000000000;
+    deadline.tv_sec += 1;
+  }
+
+  // Idle connections to the target in other threads' caches can't be used by
+  // this thread, so move them back into the slot. While we're waiting,
+  // released connections go straight back into the slot.
+  ++_limit_waiters;
+
+  if (_thread_cache_size > 0)
+  {
+    std::forward_list<ConnectionInfo<T>*> cached;
+    take_from_thread_caches(target, cached);
+
+    for (ConnectionInfo<T>* conn_info : cached)
+    {
+      return_to_slot(conn_info);
+    }
+  }
+
+  pthread_mutex_lock(&_limits_lock);
+
+  // Check the slot with the limits lock held, so that we can't miss a
+  // connection being released (releasers wake us after returning the
+  // connection to the slot).
+  bool try_evict = true;
+  while (((conn_info_ptr = take_from_slot(target)) == nullptr) &&
+         (!reserve_connection(target)))
+  {
+    typename std::unordered_map<AddrInfo, unsigned int>::const_iterator count_it =
+                                                   _conns_per_target.find(target);
+    unsigned int target_conns = (count_it != _conns_per_target.end()) ?
+                                                          count_it->second : 0;
+
+    if ((try_evict) &&
+        ((_max_conns_per_target == 0) || (target_conns < _max_conns_per_target)))
+    {
+      // Only the total cap is stopping us creating a connection, so free an
+      // idle connection to another target (if there is one) to make room.
+      // The connection can't be destroyed with the limits lock held, so check
+      // the slot again afterwards before waiting.
+      try_evict = false;
+      pthread_mutex_unlock(&_limits_lock);
+      ConnectionInfo<T>* idle_conn_info = take_idle_connection_to_evict(target);
+      if (idle_conn_info != nullptr)
+      {
+        TRC_DEBUG("Freeing idle connection to target: %s to make room",
+                  idle_conn_info->target.address_and_port_to_string().c_str());
+        delete_connection(idle_conn_info);
+      }
+      pthread_mutex_lock(&_limits_lock);
+      continue;
+    }
+
+    if (timed_out)
+    {
+      // We've waited long enough. Fail the caller rather than exceed the cap,
+      // as timeouts happen in exactly the connection storms it's there to
+      // bound.
+      TRC_WARNING("Timed out waiting for a connection to target: %s",
+                  target.address_and_port_to_string().c_str());
+
+      if (_saturated_table != nullptr)
+      {
+        _saturated_table->increment();
+      }
+
+      break;
+    }
+
+    if (_limit_wait_timeout_ms < 0)
+    {
+      pthread_cond_wait(&_limits_cond, &_limits_lock);
+    }
+    else
+    {
+      timed_out = (pthread_cond_timedwait(&_limits_cond,
+                                          &_limits_lock,
+                                          &deadline) == ETIMEDOUT);
+    }
+
+    try_evict = true;
+  }
+
+  --_limit_waiters;
+
+  pthread_mutex_unlock(&_limits_lock);
+
+  if (_limit_wait_table != nullptr)
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    _limit_wait_table->accumulate((now.tv_sec - start.tv_sec) * 1000000 +
+                                  (now.tv_nsec - start.tv_nsec) / 1000);
+  }
+
+  return conn_info_ptr;
+}
+
+template<typename T>
+ConnectionInfo<T>* ConnectionPool<T>::take_idle_connection_to_evict(const AddrInfo& target)
+{
+  ConnectionInfo<T>* conn_info_ptr = nullptr;
+
+  for (Shard* shard : _shards)
+  {
+    shard->lock.lock();
+
+    for (typename Pool::iterator slot_it = shard->pool.begin();
+         slot_it != shard->pool.end();
+         ++slot_it)
+    {
+      // The least recently used connection is at the back of the slot.
+      if ((!(slot_it->first == target)) && (!slot_it->second.empty()))
+      {
+        conn_info_ptr = slot_it->second.back();
+        slot_it->second.pop_back();
+        break;
+      }
+    }
+
+    shard->lock.unlock();
+
+    if (conn_info_ptr != nullptr)
+    {
+      break;
+    }
+  }
+
+  if ((conn_info_ptr == nullptr) && (_thread_cache_size > 0))
+  {
+    // Idle connections may also be in the threads' caches.
+    pthread_mutex_lock(&_thread_caches_lock);
+
+    for (ThreadCache* cache : _thread_caches)
+    {
+      pthread_mutex_lock(&cache->lock);
+
+      for (typename std::deque<ConnectionInfo<T>*>::reverse_iterator it = cache->conns.rbegin();
+           it != cache->conns.rend();
+           ++it)
+      {
+        if (!((*it)->target == target))
+        {
+          conn_info_ptr = *it;
+          cache->conns.erase(std::next(it).base());
+          break;
+        }
+      }
+
+      pthread_mutex_unlock(&cache->lock);
+
+      if (conn_info_ptr != nullptr)
+      {
+        break;
+      }
+    }
+
+    pthread_mutex_unlock(&_thread_caches_lock);
+  }
+
+  return conn_info_ptr;
+}
+
+template<typename T>
+void ConnectionPool<T>::notify_limit_waiters()
+{
+  if (_limit_waiters > 0)
+  {
+    pthread_mutex_lock(&_limits_lock);
+    pthread_cond_broadcast(&_limits_cond);
+    pthread_mutex_unlock(&_limits_lock);
   }
 }
 
@@ -46,10 +46,18 @@ public:
   virtual void reset();
 
 private:
-  /// Current accumulated count.
+  /// The count of one shard. The padding keeps each shard's count off the
+  /// cache lines of the values before it.
+  struct Shard {
+    char _padding[64];
+    std::atomic_uint_fast64_t _count;
+  };
+
+  /// Current accumulated count, split across shards that are merged when the
+  /// count is read.
   struct {
     std::atomic_uint_fast64_t _timestamp_us;
-    std::atomic_uint_fast64_t _count;
+    Shard _shards[NUM_SHARDS];
   } _current;
 
   /// Count accumulated over the previous period.
@@ -0,0 +1,266 @@
+/**
+ * @file cql_client.h  A cassandra store client that uses the native (CQL)
+ * protocol.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef CQL_CLIENT_H_
+#define CQL_CLIENT_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "cassandra_store.h"
+
+namespace CassandraStore {
+
+/// A CQL statement, and the values to bind to its markers.  Values are passed
+/// in their serialized form - for the blob and text columns the store uses,
+/// this is just the bytes.
+struct CqlStatement
+{
+  std::string query;
+  std::vector<std::string> values;
+};
+
+/// A request to send over a CqlConnection, and its result.
+struct CqlRequest
+{
+  CqlRequest() :
+    consistency_level(cass::ConsistencyLevel::ONE),
+    page_size(0),
+    stream(-1),
+    error_code(0)
+  {}
+
+  /// The statements to execute.  A single statement is executed on its own,
+  /// and several are executed as an unlogged batch.
+  std::vector<CqlStatement> statements;
+
+  /// The partition key the statements act on, used to route the request to
+  /// the node that owns it.  Empty if the request isn't routed.
+  std::string routing_key;
+
+  cass::ConsistencyLevel::type consistency_level;
+
+  /// The number of rows to return at a time, or 0 to return them all.
+  int32_t page_size;
+
+  /// Set on a response to where the next page starts, or empty if there are
+  /// no more pages.  Sending the request again fetches the next page.
+  std::string paging_state;
+
+  /// The rows returned.  Null values are returned as empty strings.
+  std::vector<std::vector<std::string> > rows;
+
+  /// The stream the request was sent on, or -1 if it wasn't sent.
+  int stream;
+
+  /// The CQL error code the request failed with, or 0 if it succeeded.
+  int32_t error_code;
+  std::string error_text;
+};
+
+/// A connection to one Cassandra node over the native protocol (version 3).
+///
+/// Statements are prepared the first time they are used on the connection,
+/// and executed by ID after that.  Each request is sent on its own stream, so
+/// many requests can be sent before any response is read, and the responses
+/// can come back in any order.
+///
+/// The connection isn't thread-safe.  It throws a TTransportException (and
+/// closes) if it fails to send or receive, or receives something it can't
+/// parse.
+///
+/// The socket is non-blocking, and the connection waits for it with
+/// FiberPool::wait - so on a fiber, other fibers run while it waits for the
+/// node.
+class CqlConnection
+{
+public:
+  CqlConnection(const std::string& host,
+                uint16_t port,
+                int conn_timeout_ms,
+                int recv_timeout_ms,
+                int send_timeout_ms);
+  ~CqlConnection();
+
+  const std::string& host() const { return _host; }
+
+  /// Connect and start a CQL session.
+  void open();
+  void close();
+  bool is_open() const;
+
+  /// Set the keyspace that statements on this connection act on.
+  void use_keyspace(const std::string& keyspace);
+
+  /// Run an unprepared query, at consistency level ONE.
+  ///
+  /// @param rows - (out) The rows returned.  Null values are returned as
+  ///               empty strings.
+  void query(const std::string& cql,
+             std::vector<std::vector<std::string> >& rows);
+
+  /// Send requests, without waiting for their responses.  Any statement that
+  /// fails to prepare fails the requests it is in, which aren't sent.  At
+  /// most 32768 requests can be in flight at once.
+  void start(std::vector<CqlRequest*>& requests);
+
+  /// Wait for the responses to requests passed to start().  A request
+  /// whose statement the node has forgotten is prepared and sent again.
+  void finish(std::vector<CqlRequest*>& requests, bool reprepare = true);
+
+private:
+  struct Frame
+  {
+    uint8_t opcode;
+    int16_t stream;
+    std::string body;
+  };
+
+  // Prepare the statements in the requests that aren't yet prepared.
+  void prepare(std::vector<CqlRequest*>& requests);
+
+  void send(const std::string& frames);
+  void receive(Frame& frame);
+
+  // Read exactly length bytes, waiting for them as necessary.
+  void read_all(char* data, size_t length);
+
+  // Throw a TTransportException, closing the connection first as it is no
+  // longer usable.
+  void fail(const std::string& reason);
+
+  const std::string _host;
+  const uint16_t _port;
+  const int _conn_timeout_ms;
+  const int _recv_timeout_ms;
+  const int _send_timeout_ms;
+  int _fd;
+
+  // Bytes received but not yet read, starting at _read_offset.
+  std::string _read_buffer;
+  size_t _read_offset;
+
+  // The IDs of the statements prepared on this connection, by query.
+  std::map<std::string, std::string> _prepared;
+};
+
+/// A store client that talks to Cassandra over the native (CQL) protocol,
+/// rather than Thrift.
+///
+/// It translates the Thrift-shaped calls in the Client interface into CQL, so
+/// Operations run unchanged.  Each column family must have the layout that
+/// Cassandra gives to column families created through Thrift without column
+/// metadata - a partition key "key", a clustering column "column1" holding
+/// the column name, and a "value" column.  Deleting a slice of columns needs
+/// Cassandra 3.0 or later.
+///
+/// Requests for several rows (multiget_slice, and batch_mutate across rows)
+/// are sent all at once, and the client then waits for all the responses.
+///
+/// If the client is token-aware, it reads the token ring when it connects,
+/// and sends each request for a single row straight to the node that owns the
+/// row (on a connection it opens to that node), rather than through the node
+/// it connected to.  If a node can't be reached, requests for its rows go
+/// through the node it connected to, and it isn't tried again for a while.
+/// Token-awareness needs Cassandra's default Murmur3Partitioner.
+class CqlClient : public Client
+{
+public:
+  CqlClient(const std::string& host,
+            uint16_t port,
+            int conn_timeout_ms,
+            int recv_timeout_ms,
+            int send_timeout_ms,
+            bool token_aware = true);
+  ~CqlClient();
+
+  bool is_connected();
+  void connect();
+  void set_keyspace(const std::string& keyspace);
+  void batch_mutate(const std::map<std::string,
+                    std::map<std::string,
+                    std::vector<cass::Mutation> > >& mutation_map,
+                    const cass::ConsistencyLevel::type consistency_level);
+  void get_slice(std::vector<cass::ColumnOrSuperColumn>& _return,
+                 const std::string& key,
+                 const cass::ColumnParent& column_parent,
+                 const cass::SlicePredicate& predicate,
+                 const cass::ConsistencyLevel::type consistency_level);
+  void multiget_slice(std::map<std::string, std::vector<cass::ColumnOrSuperColumn> >& _return,
+                      const std::vector<std::string>& keys,
+                      const cass::ColumnParent& column_parent,
+                      const cass::SlicePredicate& predicate,
+                      const cass::ConsistencyLevel::type consistency_level);
+  void remove(const std::string& key,
+              const cass::ColumnPath& column_path,
+              const int64_t timestamp,
+              const cass::ConsistencyLevel::type consistency_level);
+  void get_range_slices(std::vector<cass::KeySlice> & _return,
+                        const cass::ColumnParent& column_parent,
+                        const cass::SlicePredicate& predicate,
+                        const cass::KeyRange& range,
+                        const cass::ConsistencyLevel::type consistency_level);
+
+  /// @return the token that Cassandra's Murmur3Partitioner gives a partition
+  /// key.
+  static int64_t murmur3_token(const std::string& key);
+
+private:
+  /// How long to wait before trying again to connect to a node that couldn't
+  /// be reached.
+  static const int PEER_RETRY_S = 30;
+
+  /// The most requests to send to one node before reading responses.
+  static const size_t MAX_IN_FLIGHT = 1024;
+
+  // Execute requests, each on the connection to the node that owns its row,
+  // and throw the first error any of them failed with.
+  void execute(std::vector<CqlRequest*>& requests);
+
+  // The connection to send a request for a row to.
+  CqlConnection* connection_for(const std::string& key);
+
+  // Read the token ring from the node we're connected to.
+  void load_ring();
+
+  // Close the connection to a node that has failed.
+  void drop_peer(CqlConnection* peer);
+
+  const std::string _host;
+  const uint16_t _port;
+  const int _conn_timeout_ms;
+  const int _recv_timeout_ms;
+  const int _send_timeout_ms;
+  const bool _token_aware;
+
+  std::string _keyspace;
+
+  // The connection to the node this client was created for.
+  CqlConnection* _connection;
+
+  // The node that owns each token.  A node owns the tokens from the one
+  // before its token (exclusive) up to its token (inclusive).
+  std::map<int64_t, std::string> _ring;
+
+  // Connections to the other nodes, and when to next try nodes that couldn't
+  // be reached.
+  std::map<std::string, CqlConnection*> _peers;
+  std::map<std::string, time_t> _failed_peers;
+};
+
+} // namespace CassandraStore
+
+#endif
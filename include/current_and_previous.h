@@ -16,6 +16,7 @@
 #include <map>
 #include <string>
 #include <atomic>
+#include "fast_clock.h"
 #include "logger.h"
 
 template <class T> class CurrentAndPrevious
@@ -34,47 +35,70 @@ public:
     b()
   {
     struct timespec now;
-    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    FastClock::cached_realtime(now);
     uint64_t time_now_ms = (now.tv_sec * 1000) + (now.tv_nsec / 1000000);
-    _tick = (now.tv_sec / (_interval_ms / 1000));
+    uint64_t tick = (now.tv_sec / (_interval_ms / 1000));
+    _tick = tick;
+    _next_tick_s = (tick + 1) * (_interval_ms / 1000);
     a.reset(time_now_ms, NULL);
     b.reset(time_now_ms - _interval_ms, NULL);
   }
 
   // Rolls the current period over into the previous period if necessary.
+  // This is called on every sample, so while the period hasn't ended it's
+  // just a load and compare.  When it has, only the thread that moves the
+  // tick on rolls the periods over, so two threads can't both reset the same
+  // period.
   void update_time(struct timespec now)
   {
+    if ((uint64_t)now.tv_sec < _next_tick_s.load(std::memory_order_acquire))
+    {
+      return;
+    }
+
     // Count of how many _interval periods have passed since the epoch
     uint64_t new_tick = (now.tv_sec / (_interval_ms / 1000));
+    uint64_t tick = _tick.load();
+
+    if ((new_tick <= tick) ||
+        (!_tick.compare_exchange_strong(tick, new_tick)))
+    {
+      // Another thread is rolling the periods over.
+      return;
+    }
 
     // Count of how many _interval periods have passed since the last change
-    uint32_t tick_difference = new_tick - _tick;
-    _tick = new_tick;
+    uint64_t tick_difference = new_tick - tick;
 
     if (tick_difference == 1)
     {
+      // Writers only ever use the current period, so the old previous period
+      // can be reset before it's handed back as the current one.
       T* tmp;
       tmp = previous.load();
       previous.store(current);
       tmp->reset(new_tick * _interval_ms, current.load());
       current.store(tmp);
     }
-    else if (tick_difference > 1)
+    else
     {
       current.load()->reset(new_tick * _interval_ms, current.load());
       previous.load()->reset((new_tick - 1) * _interval_ms, current.load());
     }
+
+    _next_tick_s.store((new_tick + 1) * (_interval_ms / 1000),
+                       std::memory_order_release);
   }
 
   T* get_current() {
     struct timespec now;
-    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    FastClock::cached_realtime(now);
     return get_current(now);
   }
 
   T* get_previous() {
     struct timespec now;
-    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    FastClock::cached_realtime(now);
     return get_previous(now);
   }
 
@@ -86,7 +110,11 @@ protected:
     std::atomic<T*> current;
     std::atomic<T*> previous;
     uint32_t _interval_ms;
-    uint32_t _tick;
+
+    // The current period (as a count of periods since the epoch), and the
+    // time in seconds that it ends.
+    std::atomic<uint64_t> _tick;
+    std::atomic<uint64_t> _next_tick_s;
     T a;
     T b;
 
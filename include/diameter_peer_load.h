@@ -0,0 +1,93 @@
+/**
+ * @file diameter_peer_load.h  Tracks the load on a Diameter peer.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef DIAMETER_PEER_LOAD_H__
+#define DIAMETER_PEER_LOAD_H__
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+namespace Diameter
+{
+
+/// The load on a Diameter peer: the requests sent to it that haven't been
+/// answered (or timed out) yet, and a moving average of how long it takes to
+/// answer them.
+///
+/// All the methods are thread-safe and lock-free.
+class PeerLoad
+{
+public:
+  PeerLoad(const std::string& host) :
+    _host(host),
+    _outstanding(0),
+    _latency_us(0),
+    _requests(0),
+    _timeouts(0)
+  {}
+
+  const std::string& host() const { return _host; }
+
+  /// Record a request being sent to the peer.
+  void request_sent()
+  {
+    _outstanding.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  /// Record a request to the peer completing.
+  ///
+  /// @param latency_us - How long the request took.  For a timeout, this is
+  ///                     the timeout.
+  /// @param timed_out  - Whether the request timed out.
+  void request_complete(uint64_t latency_us, bool timed_out);
+
+  /// Forget the outstanding requests, e.g. when the connection to the peer
+  /// is lost (and freeDiameter fails them over to other peers).
+  void reset_outstanding()
+  {
+    _outstanding.store(0, std::memory_order_relaxed);
+  }
+
+  int outstanding() const { return _outstanding.load(std::memory_order_relaxed); }
+  uint64_t latency_us() const { return _latency_us.load(std::memory_order_relaxed); }
+  uint64_t requests() const { return _requests.load(std::memory_order_relaxed); }
+  uint64_t timeouts() const { return _timeouts.load(std::memory_order_relaxed); }
+
+  /// An estimate of how long a new request would take the peer to answer,
+  /// used to compare peers: the average latency scaled by the requests
+  /// already waiting.
+  uint64_t load() const
+  {
+    uint64_t latency_us = this->latency_us();
+    return (uint64_t)(outstanding() + 1) * ((latency_us > 0) ? latency_us : 1);
+  }
+
+private:
+  // The weight given to each new latency in the moving average is
+  // 1/2^EWMA_SHIFT.
+  static const int EWMA_SHIFT = 3;
+
+  const std::string _host;
+  std::atomic<int> _outstanding;
+  std::atomic<uint64_t> _latency_us;
+  std::atomic<uint64_t> _requests;
+  std::atomic<uint64_t> _timeouts;
+
+  // Not copyable.
+  PeerLoad(PeerLoad const&);
+  void operator=(PeerLoad const&);
+};
+
+} // namespace Diameter
+
+#endif
@@ -12,8 +12,11 @@
 #ifndef DIAMETER_H__
 #define DIAMETER_H__
 
+#include <atomic>
+#include <memory>
 #include <string>
 #include <unordered_map>
+#include <boost/utility/string_ref.hpp>
 
 #include <freeDiameter/freeDiameter-host.h>
 #include <freeDiameter/libfdcore.h>
@@ -27,17 +30,23 @@
 #include "communicationmonitor.h"
 #include "exception_handler.h"
 #include "counter.h"
+#include "diameter_peer_load.h"
+#include "snmp_diameter_peer_load_table.h"
+#include "load_monitor.h"
+#include "threadpool.h"
 #include "snmp_counter_table.h"
 
 namespace Diameter
 {
 typedef std::function<void(bool, const std::string&, const std::string&)> PeerConnectionCB;
 typedef std::function<void(struct fd_list*)> RtOutCB;
+typedef std::function<void(const std::string&, unsigned long)> TsxLatencyCB;
 
 class Stack;
 class Transaction;
 class AVP;
 class Message;
+class MessageTemplate;
 
 class Dictionary
 {
@@ -118,9 +127,14 @@ public:
     {
       fd_dict_getval(dict(), &_avp_data);
     };
+    inline AVP(uint32_t vendor_id, uint32_t code) : Object(find(vendor_id, code))
+    {
+      fd_dict_getval(dict(), &_avp_data);
+    };
     static struct dict_object* find(const std::string avp);
     static struct dict_object* find(const std::string vendor, const std::string avp);
     static struct dict_object* find(const std::vector<std::string>& vendor, const std::string avp);
+    static struct dict_object* find(uint32_t vendor_id, uint32_t code);
 
     inline const struct dict_avp_data* avp_data() const { return &_avp_data; }
     inline enum dict_avp_basetype base_type() const { return _avp_data.avp_basetype; };
@@ -208,6 +222,13 @@ public:
     struct avp_hdr* hdr = avp_hdr();
     return std::string((char*)hdr->avp_value->os.data, hdr->avp_value->os.len);
   }
+  // Returns the value without copying it.  The reference is only valid while
+  // the message holding the AVP is.
+  inline boost::string_ref val_str_ref() const
+  {
+    struct avp_hdr* hdr = avp_hdr();
+    return boost::string_ref((char*)hdr->avp_value->os.data, hdr->avp_value->os.len);
+  }
   inline const uint8_t* val_os(size_t& len) const
   {
     struct avp_hdr* hdr = avp_hdr();
@@ -260,6 +281,7 @@ public:
   }
 
   bool get_str_from_avp(const Dictionary::AVP& type, std::string& str) const;
+  bool get_str_from_avp(const Dictionary::AVP& type, boost::string_ref& str) const;
   bool get_i32_from_avp(const Dictionary::AVP& type, int32_t& i32) const;
   bool get_u32_from_avp(const Dictionary::AVP& type, uint32_t& u32) const;
 
@@ -288,16 +310,17 @@ private:
 class Message
 {
 public:
-  inline Message(const Dictionary* dict, const Dictionary::Message& type, Stack* stack) : _dict(dict), _stack(stack), _free_on_delete(true), _master_msg(this), _result(0)
+  inline Message(const Dictionary* dict, const Dictionary::Message& type, Stack* stack) : _dict(dict), _stack(stack), _free_on_delete(true), _master_msg(this), _result(0), _avp_cache(new AVPCache())
   {
     fd_msg_new(type.dict(), MSGFL_ALLOC_ETEID, &_fd_msg);
   }
-  inline Message(const Dictionary* dict, const Dictionary::Message& type, const Dictionary::Application& appl, Stack* stack) : _dict(dict), _stack(stack), _free_on_delete(true), _master_msg(this), _result(0)
+  inline Message(const Dictionary* dict, const Dictionary::Message& type, const Dictionary::Application& appl, Stack* stack) : _dict(dict), _stack(stack), _free_on_delete(true), _master_msg(this), _result(0), _avp_cache(new AVPCache())
   {
     fd_msg_new_with_appl(type.dict(), appl.dict(), MSGFL_ALLOC_ETEID, &_fd_msg);
   }
-  inline Message(const Dictionary* dict, struct msg* msg, Stack* stack) : _dict(dict), _fd_msg(msg), _stack(stack),  _free_on_delete(true), _master_msg(this), _result(0) {};
-  inline Message(const Message& msg) : _dict(msg._dict), _fd_msg(msg._fd_msg), _stack(msg._stack),  _free_on_delete(false), _master_msg(msg._master_msg), _result(0) {};
+  inline Message(const Dictionary* dict, struct msg* msg, Stack* stack) : _dict(dict), _fd_msg(msg), _stack(stack),  _free_on_delete(true), _master_msg(this), _result(0), _avp_cache(new AVPCache()) {};
+  Message(const Dictionary* dict, const MessageTemplate& tmpl, Stack* stack);
+  inline Message(const Message& msg) : _dict(msg._dict), _fd_msg(msg._fd_msg), _stack(msg._stack),  _free_on_delete(false), _master_msg(msg._master_msg), _result(0), _avp_cache(msg._avp_cache) {};
   virtual ~Message();
   inline const Dictionary* dict() const {return _dict;}
   inline struct msg* fd_msg() const {return _fd_msg;}
@@ -311,26 +334,37 @@ public:
 
     // _msg will point to the answer once this function is done.
     fd_msg_new_answer_from_req(fd_g_config->cnf_dict, &_fd_msg, MSGFL_ANSW_NOSID);
+    _avp_cache.reset(new AVPCache());
     copy_session_id(msg);
     claim_ownership();
   }
 
   inline Message& copy_session_id(Message &msg)
   {
-    std::string str;
+    boost::string_ref str;
     msg.get_str_from_avp(dict()->SESSION_ID, str);
     add_session_id(str);
     return *this;
   }
 
-  // Add a Session-ID to a message (either a new one or a specified).
-  inline Message& add_new_session_id()
+  // Add a Session-ID to a message (either a new one or a specified).  New
+  // Session-IDs come from the SessionIdGenerator, rather than from a
+  // freeDiameter session.
+  Message& add_new_session_id();
+  inline Message& add_session_id(const std::string& session_id)
   {
-    fd_msg_new_session(_fd_msg, NULL, 0);
-    return *this;
+    return add_session_id(boost::string_ref(session_id));
+  }
+  Message& add_session_id(boost::string_ref session_id);
+
+  // Get the Session-ID, throwing an AVPException if there isn't one.  The
+  // string_ref variant doesn't copy it, and is only valid while the message
+  // is.
+  inline const std::string get_session_id()
+  {
+    return get_session_id_ref().to_string();
   }
-  Message& add_session_id(const std::string& session_id);
-  const std::string get_session_id();
+  boost::string_ref get_session_id_ref() const;
 
   inline Message& add_app_id(const Dictionary::Application::Type type,
                              const Dictionary::Vendor& vendor,
@@ -369,6 +403,7 @@ public:
   inline Message& add_origin()
   {
     fd_msg_add_origin(_fd_msg, 0);
+    _avp_cache->clear();
     return *this;
   }
   inline Message& set_result_code(const std::string result_code)
@@ -377,14 +412,21 @@ public:
     // result_code, although it is complicated to change the fd_msg_rescode_set function
     // to accept a const argument.
     fd_msg_rescode_set(_fd_msg, const_cast<char*>(result_code.c_str()), NULL, NULL, 1);
+    _avp_cache->clear();
     return *this;
   }
   inline Message& add(AVP& avp)
   {
     fd_msg_avp_add(_fd_msg, MSG_BRW_LAST_CHILD, avp.avp());
+    _avp_cache->clear();
     return *this;
   }
+  // These look AVPs up in a per-message index of the top-level AVPs, built
+  // on the first lookup, rather than scanning the message each time.  The
+  // string_ref variant doesn't copy the value - it is only valid while the
+  // message is.
   bool get_str_from_avp(const Dictionary::AVP& type, std::string& str) const;
+  bool get_str_from_avp(const Dictionary::AVP& type, boost::string_ref& str) const;
   bool get_i32_from_avp(const Dictionary::AVP& type, int32_t& i32) const;
   bool get_u32_from_avp(const Dictionary::AVP& type, uint32_t& i32) const;
   inline bool result_code(int32_t& result)
@@ -400,7 +442,11 @@ public:
   int32_t vendor_id() const;
   inline std::string impi() const
   {
-    std::string str;
+    return impi_ref().to_string();
+  }
+  inline boost::string_ref impi_ref() const
+  {
+    boost::string_ref str;
     get_str_from_avp(dict()->USER_NAME, str);
     return str;
   }
@@ -415,6 +461,10 @@ public:
   inline bool get_origin_realm(std::string& str) { return get_str_from_avp(_dict->ORIGIN_REALM, str); }
   inline bool get_destination_host(std::string& str) { return get_str_from_avp(_dict->DESTINATION_HOST, str); }
   inline bool get_destination_realm(std::string& str) { return get_str_from_avp(_dict->DESTINATION_REALM, str); }
+  inline bool get_origin_host(boost::string_ref& str) const { return get_str_from_avp(_dict->ORIGIN_HOST, str); }
+  inline bool get_origin_realm(boost::string_ref& str) const { return get_str_from_avp(_dict->ORIGIN_REALM, str); }
+  inline bool get_destination_host(boost::string_ref& str) const { return get_str_from_avp(_dict->DESTINATION_HOST, str); }
+  inline bool get_destination_realm(boost::string_ref& str) const { return get_str_from_avp(_dict->DESTINATION_REALM, str); }
   inline bool is_request() { return bool(msg_hdr()->msg_flags & CMD_FLAG_REQUEST); }
 
   inline AVP::iterator begin() const;
@@ -444,6 +494,27 @@ private:
   Message* _master_msg;
   int32_t _result;
 
+  // The first top-level AVP of each type (keyed by vendor and code), built
+  // on the first lookup.  Copies of a message share its freeDiameter message,
+  // so they share this too.  It is cleared whenever AVPs are added.
+  //
+  // The Session-ID is cached separately, and isn't cleared: AVPs are never
+  // removed, and the only AVP added ahead of it is a new Session-ID, which
+  // replaces it.
+  struct AVPCache
+  {
+    AVPCache() : built(false), first(), session_id() {}
+    inline void clear() { built = false; first.clear(); }
+
+    bool built;
+    std::unordered_map<uint64_t, struct avp*> first;
+    boost::string_ref session_id;
+  };
+  std::shared_ptr<AVPCache> _avp_cache;
+
+  // Find the first top-level AVP of a type, or NULL if there isn't one.
+  struct avp* find_avp(const Dictionary::AVP& type) const;
+
   inline struct msg_hdr* msg_hdr() const
   {
     struct msg_hdr* hdr;
@@ -452,6 +523,72 @@ private:
   }
 };
 
+/// Generates Session-IDs of the form <DiameterIdentity>;<high32>;<low32>
+/// (RFC 6733 section 8.8), without the string building and session table
+/// insert of creating a freeDiameter session.
+///
+/// Each thread takes a high 32 bits of its own from a shared counter (seeded
+/// from the time at startup, so they differ across restarts) and counts
+/// through the low 32 bits under it, taking a new high value when they wrap.
+/// No two threads ever use the same high value at once, so generating an ID
+/// only touches the thread's own counters.
+class SessionIdGenerator
+{
+public:
+  /// The most characters generate() adds after the identity.
+  static const size_t MAX_SUFFIX_LEN = 22;
+
+  /// Writes a new Session-ID into a buffer.
+  ///
+  /// @param identity     - The Diameter identity to prefix it with.
+  /// @param identity_len - The length of the identity.
+  /// @param buf          - The buffer, which isn't null-terminated.
+  /// @param buf_len      - The size of the buffer.
+  /// @return             - The length of the Session-ID, or 0 if it wouldn't
+  ///                       fit in the buffer.
+  static size_t generate(const char* identity,
+                         size_t identity_len,
+                         char* buf,
+                         size_t buf_len);
+
+private:
+  // Writes a number in decimal, returning the end of it.
+  static char* write_u32(char* buf, uint32_t value);
+
+  static std::atomic<uint32_t> _next_high;
+};
+
+/// A pre-built message skeleton, holding the AVPs that are the same in every
+/// request of a kind (application IDs, Auth-Session-State, origin,
+/// destination realm, ...).  Creating a message from a template copies the
+/// skeleton in one go, rather than building and adding those AVPs one by
+/// one.  Add the session ID and the per-request AVPs to the message as usual.
+///
+/// Templates aren't changed once built, so can be shared between threads.
+class MessageTemplate
+{
+public:
+  /// Builds a template from a message, which shouldn't have a Session-Id.
+  /// The message isn't needed once the template has been built.
+  MessageTemplate(const Message& msg);
+  ~MessageTemplate();
+
+  /// Creates a freeDiameter message from the template, which the caller owns
+  /// (see the Message(dict, tmpl, stack) constructor).  The message has its
+  /// own end-to-end identifier.
+  struct msg* instantiate() const;
+
+private:
+  // The skeleton, encoded.  freeDiameter takes ownership of the buffers it
+  // parses, so each message is parsed from a copy of this.
+  uint8_t* _buffer;
+  size_t _length;
+
+  // Don't implement the following, to avoid copies of this instance.
+  MessageTemplate(MessageTemplate const&);
+  void operator=(MessageTemplate const&);
+};
+
 class AVPException
 {
 public:
@@ -624,6 +761,28 @@ public:
   virtual void register_rt_out_cb(std::string listener_id,
                                   RtOutCB peer_connection_cb);
   virtual void unregister_rt_out_cb(std::string listener_id);
+
+  /// Registers a callback that is given the Diameter identity of the peer
+  /// each transaction was answered by (or timed out to), and the duration of
+  /// the transaction in microseconds.
+  virtual void register_tsx_latency_cb(std::string listener_id,
+                                       TsxLatencyCB tsx_latency_cb);
+  virtual void unregister_tsx_latency_cb(std::string listener_id);
+
+  /// Returns the load on a peer (identified by its Diameter identity),
+  /// starting to track it if this is the first request to the peer.  The
+  /// stack records each request sent to a peer, and each answer or timeout,
+  /// in its load.
+  PeerLoad* peer_load(const std::string& host);
+
+  /// Returns the load on a peer, or NULL if no requests have been sent to it.
+  PeerLoad* find_peer_load(const std::string& host);
+
+  /// Reports the load on each peer in an SNMP table.  Peers are added to the
+  /// table when the first request is sent to them.  The table must be
+  /// destroyed before the stack.
+  void set_peer_load_table(SNMP::DiameterPeerLoadTable* table) { _peer_load_table = table; }
+
   virtual void configure(std::string filename,
                          ExceptionHandler* exception_handler,
                          BaseCommunicationMonitor* comm_monitor = NULL,
@@ -637,6 +796,33 @@ public:
   virtual void register_handler(const Dictionary::Application& app,
                                 const Dictionary::Message& msg,
                                 HandlerInterface* handler);
+
+  /// As above, but if requests are processed on a worker pool (see
+  /// configure_request_pool()), the handler's requests are queued at the given
+  /// priority.  Handlers registered without a priority get NORMAL_PRIORITY.
+  virtual void register_handler(const Dictionary::Application& app,
+                                const Dictionary::Message& msg,
+                                HandlerInterface* handler,
+                                SIPEventPriorityLevel priority);
+
+  /// Pass requests to their handlers on a pool of worker threads, rather than
+  /// on freeDiameter's dispatch threads, so that a slow handler doesn't hold
+  /// up other requests.  Requests are served in priority order (e.g. so that
+  /// Cx requests go before Rf requests under load).
+  ///
+  /// Requests that arrive when the queue is full, or that the load monitor
+  /// doesn't admit, are answered with DIAMETER_TOO_BUSY straight away rather
+  /// than being passed to their handler.
+  ///
+  /// This must be called before start().
+  ///
+  /// @param num_threads  - The number of worker threads.
+  /// @param max_queue    - The most requests to queue.  0 => no limit.
+  /// @param load_monitor - If not NULL, the load monitor that admits requests.
+  ///                       The handlers must tell it when requests complete.
+  virtual void configure_request_pool(unsigned int num_threads,
+                                      unsigned int max_queue,
+                                      LoadMonitor* load_monitor = NULL);
   virtual void register_fallback_handler(const Dictionary::Application& app);
   virtual void start();
   virtual void stop();
@@ -644,9 +830,22 @@ public:
   virtual void close_connections();
   virtual void set_allow_connections() { _allow_connections = true; }
 
-  std::unordered_map<std::string, std::unordered_map<std::string, struct dict_object*>>& avp_map()
+  // The AVPs in the dictionary, indexed by name and by vendor ID and code.
+  // These are built when the stack is initialized, so looking AVPs up
+  // doesn't search the freeDiameter dictionary.
+  struct NamedAVP
+  {
+    std::string vendor;
+    struct dict_object* dict;
+  };
+  typedef std::unordered_map<std::string, std::vector<NamedAVP>> AVPsByName;
+  typedef std::unordered_map<uint64_t, struct dict_object*> AVPsByCode;
+
+  const AVPsByName& avps_by_name() const { return _avps_by_name; }
+  const AVPsByCode& avps_by_code() const { return _avps_by_code; }
+  static inline uint64_t avp_code_key(uint32_t vendor_id, uint32_t code)
   {
-    return _avp_map;
+    return ((uint64_t)vendor_id << 32) | code;
   }
 
   virtual void send(struct msg* fd_msg, SAS::TrailId trail);
@@ -655,6 +854,8 @@ public:
 
   virtual void report_tsx_result(int32_t rc);
   virtual void report_tsx_timeout();
+  virtual void report_tsx_latency(const std::string& peer, unsigned long duration_us);
+  bool tsx_latency_cbs_registered() const { return _tsx_latency_cbs_registered; }
 
   virtual bool add(Peer* peer);
   virtual void remove(Peer* peer);
@@ -701,10 +902,48 @@ private:
   std::map<std::string, RtOutCB> _rt_out_cbs;
   pthread_rwlock_t _rt_out_cbs_lock;
 
+  std::map<std::string, TsxLatencyCB> _tsx_latency_cbs;
+  pthread_rwlock_t _tsx_latency_cbs_lock;
+  std::atomic_bool _tsx_latency_cbs_registered;
+
   void fd_error_hook_cb(enum fd_hook_type type, struct msg* msg, struct peer_hdr* peer, void *other, struct fd_hook_permsgdata* pmd);
   static void fd_error_hook_cb(enum fd_hook_type type, struct msg* msg, struct peer_hdr* peer, void* other, struct fd_hook_permsgdata* pmd, void* stack_ptr);
 
   void set_trail_id(struct msg* fd_msg, SAS::TrailId trail);
+
+  // A request waiting on the request pool for its handler.
+  struct Request
+  {
+    HandlerInterface* handler;
+    struct msg* req;
+    SAS::TrailId trail;
+    SIPEventPriorityLevel priority;
+  };
+
+  class RequestPool : public ThreadPool<Request>
+  {
+  public:
+    using ThreadPool<Request>::ThreadPool;
+    virtual ~RequestPool() {}
+
+  private:
+    void process_work(Request& request)
+    {
+      request.handler->process_request(&request.req, request.trail);
+    }
+  };
+
+  static SIPEventPriorityLevel request_priority(const Request& request)
+  {
+    return request.priority;
+  }
+  static void request_exception_callback(Request request);
+
+  // Queue a request for the request pool, or reject it if overloaded.
+  void queue_request(HandlerInterface* handler,
+                     struct msg** req,
+                     SAS::TrailId trail);
+
   static void fd_sas_log_diameter_message(enum fd_hook_type type,
                                           struct msg * msg,
                                           struct peer_hdr * peer,
@@ -746,11 +985,29 @@ private:
   int _peer_count;
   int _connected_peer_count;
 
-  // Map of Vendor->AVP name->AVP dictionary
-  std::unordered_map<std::string, std::unordered_map<std::string, struct dict_object*>> _avp_map;
+  // The load on each peer that requests have been sent to.  Peers are added
+  // when they are first used, and never removed.
+  pthread_rwlock_t _peer_loads_lock;
+  std::map<std::string, PeerLoad*> _peer_loads;
+  SNMP::DiameterPeerLoadTable* _peer_load_table;
+
+  // The request pool, if configured, and the priority each handler was
+  // registered with.
+  unsigned int _request_pool_threads;
+  unsigned int _request_pool_max_queue;
+  LoadMonitor* _request_load_monitor;
+  RequestPool* _request_pool;
+  pthread_rwlock_t _handler_priorities_lock;
+  std::map<HandlerInterface*, SIPEventPriorityLevel> _handler_priorities;
+
+  // AVP name->the vendors that define an AVP of that name, and
+  // vendor ID and code->AVP dictionary.
+  AVPsByName _avps_by_name;
+  AVPsByCode _avps_by_code;
 
   void populate_avp_map();
   void populate_vendor_map(const std::string& vendor_name,
+                           uint32_t vendor_id,
                            struct dict_object* vendor_dict);
 
 };
@@ -0,0 +1,110 @@
+/**
+ * @file dns_cache_file.h  File that a DNS cache is saved to across restarts.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef DNS_CACHE_FILE_H__
+#define DNS_CACHE_FILE_H__
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "dnsrrecords.h"
+
+/// Reads and writes the file that DnsCachedResolver saves its cache entries
+/// to, so that a restarted process can use them rather than querying every
+/// record at once.
+///
+/// The file is a header followed by the entries, each with its records.
+/// Expiry times are absolute (in seconds since the epoch), so entries that
+/// have expired by the time the file is read are skipped.  Integers are in
+/// the byte order of the machine that wrote the file, and files with a
+/// different byte order (or version) are ignored.
+class DnsCacheFile
+{
+public:
+  /// A cache entry read from the file.  The records are owned by whoever
+  /// reads the file.
+  struct Entry
+  {
+    std::string domain;
+    int dnstype;
+    int expires;
+    std::vector<DnsRRecord*> records;
+  };
+
+  /// Builds up the contents of a file in memory, so that entries can be
+  /// added while the cache is locked and the file written once it isn't.
+  class Writer
+  {
+  public:
+    Writer();
+
+    /// Adds an entry and copies of its records.
+    void add_entry(const std::string& domain,
+                   int dnstype,
+                   int expires,
+                   const std::vector<DnsRRecord*>& records);
+
+    /// @return the number of entries added.
+    uint32_t count() const { return _count; }
+
+    /// Writes the file under a temporary name and renames it into place.
+    ///
+    /// @return whether the file was written.
+    bool write(const std::string& filename);
+
+  private:
+    void add_record(const std::string& domain, const DnsRRecord* record);
+
+    std::string _data;
+    uint32_t _count;
+  };
+
+  /// Reads the entries that haven't expired by `now` from a file.  A file
+  /// that is truncated or corrupt is read up to the first bad entry.
+  ///
+  /// @return false if the file couldn't be opened or isn't a cache file.
+  static bool read(const std::string& filename,
+                   int now,
+                   std::vector<Entry>& entries);
+
+private:
+  struct Header
+  {
+    uint32_t magic;
+    uint32_t version;
+    int64_t saved_at;
+    uint32_t count;
+    uint32_t reserved;
+  };
+
+  // The kind of record object, which sets what follows the common fields.
+  enum RecordKind
+  {
+    RECORD_OTHER = 0,
+    RECORD_A = 1,
+    RECORD_AAAA = 2,
+    RECORD_SRV = 3,
+    RECORD_NAPTR = 4,
+    RECORD_CNAME = 5
+  };
+
+  static const uint32_t MAGIC = 0x43534e44;
+  static const uint32_t VERSION = 1;
+
+  class Reader;
+  static DnsRRecord* read_record(Reader& reader,
+                                 const std::string& domain,
+                                 int now);
+};
+
+#endif
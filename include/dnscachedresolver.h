@@ -17,33 +17,69 @@
 #include <time.h>
 
 #include <map>
+#include <unordered_map>
 #include <list>
+#include <deque>
+#include <set>
 #include <vector>
 #include <memory>
+#include <atomic>
+#include <functional>
 
 #include <arpa/nameser.h>
 #include <ares.h>
 
 #include "utils.h"
+#include "expiry_wheel.h"
 #include "dnsrrecords.h"
+#include "dnsparser.h"
 #include "static_dns_cache.h"
+#include "latency_histogram.h"
+#include "profiled_mutex.h"
+#include "snmp_counter_table.h"
+#include "snmp_latency_histogram_table.h"
+#include "snmp_scalar.h"
 #include "sas.h"
 
 class DnsCachedResolver
 {
 public:
+  /// How queries are sent to the DNS servers.
+  ///
+  /// Queries are sent over UDP.  A truncated response (one too large for a
+  /// UDP datagram) is counted, and the query is re-sent over TCP, on a
+  /// connection to the server that is kept open for later queries.  The
+  /// domain is then remembered, so later queries for it go straight over
+  /// TCP.
+  struct Options
+  {
+    Options() : edns_payload_size(0) {}
+
+    /// If not zero, queries use EDNS0 to advertise that responses of up to
+    /// this many bytes can be sent over UDP (rather than the 512 bytes that
+    /// plain DNS allows), so fewer responses are truncated.
+    int edns_payload_size;
+
+    /// Domains known to have large answer sets, which are always queried
+    /// over TCP.
+    std::vector<std::string> tcp_domains;
+  };
+
   DnsCachedResolver(const std::vector<IP46Address>& dns_servers,
                     int timeout = DEFAULT_TIMEOUT,
                     const std::string& filename = NO_DNS_FILE,
-                    int port = DEFAULT_PORT);
+                    int port = DEFAULT_PORT,
+                    const Options& options = Options());
   DnsCachedResolver(const std::vector<std::string>& dns_servers,
                     int timeout = DEFAULT_TIMEOUT,
                     const std::string& filename = NO_DNS_FILE,
-                    int port = DEFAULT_PORT);
+                    int port = DEFAULT_PORT,
+                    const Options& options = Options());
   DnsCachedResolver(const std::string& dns_server,
                     int timeout = DEFAULT_TIMEOUT,
                     const std::string& filename = NO_DNS_FILE,
-                    int port = DEFAULT_PORT);
+                    int port = DEFAULT_PORT,
+                    const Options& options = Options());
   ~DnsCachedResolver();
 
   /// Queries a single DNS record.
@@ -57,6 +93,45 @@ public:
                  std::vector<DnsResult>& results,
                  SAS::TrailId trail);
 
+  /// A domain, and the type of record to query for it.
+  typedef std::pair<std::string, int> DnsQuery;
+
+  /// Queries records of any mix of types in parallel.  All the queries that
+  /// aren't answered from the cache are issued before waiting for any of the
+  /// responses, so this takes a single round trip however many types are
+  /// queried.  The results are indexed by the queries passed in.
+  void dns_query(const std::vector<DnsQuery>& queries,
+                 std::map<DnsQuery, DnsResult>& results,
+                 SAS::TrailId trail);
+
+  typedef std::function<void(std::vector<DnsResult>&&)> DnsCallback;
+
+  /// Queries multiple DNS records in parallel, without waiting for the
+  /// results.  The callback is passed the results (in the same order as the
+  /// domains).  It is called on this thread if all the results are cached,
+  /// and otherwise on the I/O thread, so must not block.
+  ///
+  /// If the I/O thread hasn't been started, the queries are done
+  /// synchronously (as for dns_query) before calling the callback.
+  void dns_query_async(const std::vector<std::string>& domains,
+                       int dnstype,
+                       DnsCallback callback,
+                       SAS::TrailId trail);
+
+  /// As above, but for records of any mix of types.  The callback is passed
+  /// the results in the same order as the queries.
+  void dns_query_async(const std::vector<DnsQuery>& queries,
+                       DnsCallback callback,
+                       SAS::TrailId trail);
+
+  /// Start an I/O thread that does all the DNS queries (rather than each
+  /// thread that queries using its own channel and waiting for its
+  /// responses).  The thread shares its queries between a small number of
+  /// channels, and waits for their responses with epoll.
+  ///
+  /// Must be called before any queries, and not more than once.
+  void start_io_thread(int num_channels = 1);
+
   /// Adds or updates an entry in the cache.
   void add_to_cache(const std::string& domain,
                     int dnstype,
@@ -72,6 +147,155 @@ public:
   // _dns_config_file.
   void reload_static_records();
 
+  /// Start re-resolving entries in the background before they expire.  An
+  /// entry is re-resolved if it is used when less than `percent` percent of
+  /// its TTL remains.  Entries that have expired are also re-resolved in the
+  /// background (rather than by the thread that finds them), and their old
+  /// records used until the new ones arrive.
+  ///
+  /// Must not be called more than once.
+  void start_refresh_ahead(int percent);
+
+  /// Counts of background refreshes.
+  struct RefreshStats
+  {
+    /// The number of entries re-resolved in the background.
+    uint64_t prefetches;
+
+    /// The number of re-resolved entries that were then used before they
+    /// were next refreshed.  The prefetch hit ratio is prefetch_hits /
+    /// prefetches.
+    uint64_t prefetch_hits;
+
+    /// The number of times expired records were returned, because a query
+    /// to refresh them was outstanding.
+    uint64_t stale_serves;
+  };
+
+  RefreshStats refresh_stats() const;
+
+  /// Set how long to back off re-querying a record after the DNS servers
+  /// time out or fail (SERVFAIL or REFUSED) for it.  The first failure backs
+  /// off for `min_s` seconds, and each subsequent failure doubles this, up
+  /// to `max_s` seconds, until the record is resolved.  While backing off,
+  /// queries for the record return its old records (if any) or no records,
+  /// without waiting for the DNS servers.
+  void set_failure_backoff(int min_s, int max_s);
+
+  /// Sets the statistics tables updated on DNS failures.  Either table can
+  /// be null.
+  ///
+  /// @param query_failures_table  incremented each time a query times out or
+  ///                              fails, and the record backs off.
+  /// @param server_failures_table incremented each time a DNS server is
+  ///                              found to be unresponsive.
+  void set_failure_statistics(SNMP::CounterTable* query_failures_table,
+                              SNMP::CounterTable* server_failures_table);
+
+  /// Sets the statistics tables updated as queries fall back to TCP.  Either
+  /// table can be null.
+  ///
+  /// @param truncated_table    incremented for each truncated UDP response.
+  /// @param tcp_queries_table  incremented for each query sent over TCP.
+  void set_transport_statistics(SNMP::CounterTable* truncated_table,
+                                SNMP::CounterTable* tcp_queries_table);
+
+  /// Statistics on how queries are answered, for sizing the cache and
+  /// spotting stalls.  The counts are totals since the resolver was created.
+  struct Stats
+  {
+    /// The number of queries answered from the static cache, and from
+    /// unexpired cache entries, and the number that needed a DNS lookup.
+    uint64_t static_hits;
+    uint64_t hits;
+    uint64_t misses;
+
+    /// The number of lookups that waited for a query already issued for the
+    /// same record (by another thread).
+    uint64_t pending_waits;
+
+    /// The number of UDP responses that were truncated (and so re-sent over
+    /// TCP), and the number of queries sent over TCP - both those re-sent
+    /// after truncation and those for domains that are queried over TCP.
+    uint64_t truncated_responses;
+    uint64_t tcp_queries;
+
+    /// The number of entries in the cache, and an estimate of the memory
+    /// they use.
+    uint64_t cache_entries;
+    uint64_t cache_bytes;
+
+    /// The time threads have spent blocked waiting for responses to their
+    /// own queries (in wait_for_replies), and for queries issued by other
+    /// threads.
+    LatencyHistogram::Snapshot reply_waits;
+    LatencyHistogram::Snapshot pending_query_waits;
+
+    /// The number of entries removed each time expired entries are removed
+    /// in a batch.  These are counts, not microseconds.
+    LatencyHistogram::Snapshot expiry_batch_sizes;
+
+    /// For each DNS server, the number of queries it answered and the number
+    /// it timed out on, and its round trip times.  Round trip times are only
+    /// known for answers from the first server tried, so are only recorded
+    /// for those.
+    struct Server
+    {
+      std::string server;
+      uint64_t responses;
+      uint64_t timeouts;
+      LatencyHistogram::Snapshot rtts;
+    };
+
+    std::vector<Server> servers;
+  };
+
+  Stats stats() const;
+
+  /// Sets the statistics updated on cache lookups and as the cache changes.
+  /// Any of them can be null.
+  ///
+  /// @param hits_table          incremented for each query answered from the
+  ///                            cache (including the static cache).
+  /// @param misses_table        incremented for each query that needs a DNS
+  ///                            lookup.
+  /// @param pending_waits_table incremented each time a lookup waits for a
+  ///                            query issued by another thread.
+  /// @param entries_scalar      set to the number of entries in the cache.
+  /// @param bytes_scalar        set to the estimated memory the cache uses.
+  void set_cache_statistics(SNMP::CounterTable* hits_table,
+                            SNMP::CounterTable* misses_table,
+                            SNMP::CounterTable* pending_waits_table,
+                            SNMP::U32Scalar* entries_scalar,
+                            SNMP::U32Scalar* bytes_scalar);
+
+  /// Adds the resolver's histograms to a table, as "reply_wait",
+  /// "pending_query_wait", "expiry_batch_size" (which counts entries, not
+  /// microseconds) and "server_rtt:<server>" for each DNS server.
+  void set_latency_histogram_table(SNMP::LatencyHistogramTable* table);
+
+  /// Saves the cache entries that haven't expired to a file, so that they
+  /// can be loaded by load_cache() when the process restarts.  The file is
+  /// written under a temporary name and renamed into place.
+  ///
+  /// @return whether the file was written.
+  bool save_cache(const std::string& filename);
+
+  /// Loads the entries that haven't expired from a file written by
+  /// save_cache(), except for any that are already cached.  The entries are
+  /// used straight away.  If refreshing ahead, each is re-resolved in the
+  /// background the first time it is used, so the restored records aren't
+  /// relied on for long but there is no burst of queries at startup.
+  ///
+  /// @return the number of entries loaded.
+  int load_cache(const std::string& filename);
+
+  /// Loads the cache from a file, and then saves it to the file every
+  /// `interval_s` seconds and when the resolver is destroyed.
+  ///
+  /// Must not be called more than once.
+  void start_cache_persistence(const std::string& filename, int interval_s);
+
   // The total timeout across all DNS requests over the wire (in milliseconds)
   static const int DEFAULT_TIMEOUT = 600;
 
@@ -85,15 +309,62 @@ public:
   // construct a resolver with no DNS file.
   static constexpr const char* NO_DNS_FILE = "";
 
+  // The most domains that are remembered as needing TCP after their
+  // responses were truncated.
+  static const size_t MAX_LEARNED_TCP_DOMAINS = 1000;
+
 private:
   void init(const std::vector<IP46Address>& dns_server);
   void init_from_server_ips(const std::vector<std::string>& dns_server);
 
+  struct DnsChannel;
+
+  /// Identifies one of a DnsChannel's c-ares channels to the I/O thread's
+  /// socket state callback.
+  struct AresChannelRef
+  {
+    DnsChannel* channel;
+    ares_channel* ares;
+  };
+
   struct DnsChannel
   {
+    /// The c-ares channels for queries over UDP and over TCP.  Each keeps
+    /// its sockets open between queries.
     ares_channel channel;
+    ares_channel tcp_channel;
+    AresChannelRef udp_ref;
+    AresChannelRef tcp_ref;
+
     DnsCachedResolver* resolver;
     int pending_queries;
+
+    // The servers (indexes into _dns_servers) the channel queries, in order,
+    // and the server health generation they were chosen for.  These are
+    // only changed when the channel has no pending queries.  If servers
+    // were moved to the end because they were unresponsive, the channel
+    // reorders its servers once they are due to be tried again.
+    int servers[MAX_DNS_SERVER_POLL];
+    int server_count;
+    int server_generation;
+    int reorder_at;
+  };
+
+  /// The health of a DNS server.  A server that has timed out is moved to
+  /// the end of the channels' server lists until `skip_until`, which backs
+  /// off exponentially while it keeps timing out.
+  struct DnsServerHealth
+  {
+    int failures;
+    int skip_until;
+  };
+
+  /// Statistics for a DNS server.
+  struct DnsServerStats
+  {
+    std::atomic<uint64_t> responses;
+    std::atomic<uint64_t> timeouts;
+    LatencyHistogram rtts;
   };
 
   class DnsTsx
@@ -106,10 +377,19 @@ private:
     void ares_callback(int status, int timeouts, unsigned char* abuf, int alen);
 
   private:
+    // Sends the query on the channel's UDP or TCP c-ares channel.
+    void send();
+
     DnsChannel* _channel;
     std::string _domain;
     int _dnstype;
     SAS::TrailId _trail;
+
+    // Whether the query is sent over TCP.
+    bool _tcp;
+
+    // Times the query, to measure the DNS server's round trip time.
+    Utils::StopWatch _stopwatch;
   };
 
   struct DnsCacheEntry
@@ -122,6 +402,17 @@ private:
     SAS::TrailId original_trail;
     std::vector<DnsRRecord*> records;
 
+    // Whether the outstanding query for this entry is a background refresh.
+    bool prefetching;
+
+    // The number of times in a row that the DNS servers have failed for this
+    // entry, which sets how long to back off before querying it again.
+    int failures;
+
+    // Whether the records were loaded from a saved cache file (rather than
+    // from a DNS response), so should be refreshed when first used.
+    bool restored;
+
     void update_timestamp() {
       struct timespec timespec;
       struct tm dt;
@@ -164,15 +455,83 @@ private:
 
   typedef std::shared_ptr<DnsCacheEntry> DnsCacheEntryPtr;
   typedef std::pair<int, std::string> DnsCacheKey;
-  typedef std::multimap<int, DnsCacheKey> DnsCacheExpiryList;
+  typedef ExpiryWheel<DnsCacheKey> DnsCacheExpiryList;
   typedef std::map<DnsCacheKey,
                    DnsCacheEntryPtr,
                    DnsCacheKeyCompare> DnsCache;
 
+  /// An immutable copy of a cache entry's results, published so that queries
+  /// can use them without taking the cache lock.  The records are shared with
+  /// the results of the queries.
+  struct DnsCacheSnapshot
+  {
+    std::string domain;
+    int dnstype;
+    int expires;
+    std::string original_time;
+    SAS::TrailId original_trail;
+    DnsRecordSetPtr records;
+
+    // When to re-resolve the entry if it's used (if refreshing ahead), and
+    // whether that has been requested.
+    int refresh_at;
+    mutable std::atomic<bool> refresh_requested;
+
+    // Whether these results came from a background refresh, and whether
+    // they have been used.
+    bool prefetched;
+    mutable std::atomic<bool> used;
+  };
+
+  typedef std::shared_ptr<const DnsCacheSnapshot> DnsCacheSnapshotPtr;
+
+  /// The published snapshots are keyed on RRTYPE and the lower case RRNAME,
+  /// and split across a number of shards, each with its own read/write lock.
+  class DnsCacheKeyHash
+  {
+  public:
+    size_t operator()(const DnsCacheKey& key) const
+    {
+      return std::hash<std::string>()(key.second) ^ ((size_t)key.first * 0x9e3779b9);
+    }
+  };
+
+  struct DnsCacheShard
+  {
+    pthread_rwlock_t lock;
+    std::unordered_map<DnsCacheKey, DnsCacheSnapshotPtr, DnsCacheKeyHash> snapshots;
+  };
+
+  static const int NUM_CACHE_SHARDS = 16;
+
+  static std::vector<DnsQuery> make_queries(const std::vector<std::string>& domains,
+                                            int dnstype);
+
+  /// Queries records of any mix of types, returning the results in the
+  /// order of the queries.
+  void ordered_dns_query(const std::vector<DnsQuery>& queries,
+                         std::vector<DnsResult>& results,
+                         SAS::TrailId trail);
+
+  /// Gets the results of queries from the static cache, and from cache entries
+  /// that haven't expired.  Returns the queries (for canonical domains) that
+  /// need a DNS lookup in cache_misses.
+  void get_cached_results(const std::vector<DnsQuery>& queries,
+                          std::map<std::string, std::string>& canonical_map,
+                          std::map<DnsQuery, DnsResult>& result_map,
+                          std::vector<DnsQuery>& cache_misses,
+                          SAS::TrailId trail);
+
+  /// Puts the results for each query (indexed by canonical domain and type)
+  /// in the order of the queries.
+  static void order_results(const std::vector<DnsQuery>& queries,
+                            const std::map<std::string, std::string>& canonical_map,
+                            const std::map<DnsQuery, DnsResult>& result_map,
+                            std::vector<DnsResult>& results);
+
   /// Performs the actual DNS query.
-  void inner_dns_query(const std::vector<std::string>& domains,
-                       int dnstype,
-                       std::map<std::string, DnsResult>& results,
+  void inner_dns_query(const std::vector<DnsQuery>& queries,
+                       std::map<DnsQuery, DnsResult>& results,
                        SAS::TrailId trail);
 
   void dns_response(const std::string& domain,
@@ -184,19 +543,134 @@ private:
 
   bool caching_enabled(int rrtype);
 
+  /// Looks up a published snapshot of a cache entry, and adds it to the
+  /// results.  Returns false if there isn't one, or if it has expired and
+  /// `allow_expired` is false.
+  bool get_published_result(const std::string& domain,
+                            int dnstype,
+                            bool allow_expired,
+                            std::map<DnsQuery, DnsResult>& results,
+                            SAS::TrailId trail);
+
+  /// Publishes a snapshot of a cache entry, replacing any previous one, or
+  /// removes the published snapshot.
+  void publish_cache_entry(DnsCacheEntryPtr ce);
+  void unpublish_cache_entry(const DnsCacheKey& key);
+
+  static DnsCacheKey published_key(const std::string& domain, int dnstype);
+  DnsCacheShard& cache_shard(const DnsCacheKey& key);
+
+  /// Queues an entry to be re-resolved by the refresh thread.
+  void request_refresh(const std::string& domain, int dnstype);
+
+  /// Re-resolves an entry, unless a query for it is already outstanding.
+  void refresh_cache_entry(const std::string& domain, int dnstype);
+
+  static void* refresh_thread_fn(void* resolver);
+  void refresh_thread_fn();
+
+  static void* persist_thread_fn(void* resolver);
+  void persist_thread_fn();
+  void stop_cache_persistence();
+
   DnsCacheEntryPtr get_cache_entry(const std::string& domain, int dnstype);
   DnsCacheEntryPtr create_cache_entry(const std::string& domain, int dnstype, SAS::TrailId trail);
   void add_to_expiry_list(DnsCacheEntryPtr ce);
   void expire_cache();
   void add_record_to_cache(DnsCacheEntryPtr ce, DnsRRecord* rr, SAS::TrailId trail);
+  void add_view_to_cache(DnsParser& parser,
+                         DnsCacheEntryPtr ce,
+                         const DnsRRecordView& view,
+                         SAS::TrailId trail);
   void clear_cache_entry(DnsCacheEntryPtr ce);
 
+  /// Increments a statistic, and the SNMP table that reports it (if set).
+  static void increment_stat(std::atomic<uint64_t>& stat, SNMP::CounterTable* table);
+
+  /// Updates the size of the cache when entries or records are added or
+  /// removed.  Must be called with the cache lock held.
+  void update_cache_size(int64_t entries, int64_t bytes);
+  static size_t entry_size(DnsCacheEntryPtr ce);
+  static size_t record_size(const DnsRRecord* rr);
+
+
+  bool issue_query(DnsCacheEntryPtr ce,
+                   const std::string& domain,
+                   int dnstype,
+                   SAS::TrailId trail,
+                   DnsChannel*& channel);
 
   DnsChannel* get_dns_channel();
+  DnsChannel* create_dns_channel(bool io_thread);
+  void init_ares_channel(DnsChannel* channel, bool tcp, bool io_thread);
+
+  /// Returns whether queries for a domain should be sent over TCP.
+  bool use_tcp(const std::string& domain);
+
+  /// Records that a UDP response for a domain was truncated, so later
+  /// queries for it are sent over TCP.
+  void record_truncation(const std::string& domain);
+
+  /// Picks the servers a channel queries, healthy ones first, and sets them
+  /// on the channel.
+  void set_channel_servers(DnsChannel* channel);
+
+  /// Updates a channel's servers if server health has changed since they
+  /// were picked, and the channel has no pending queries.
+  void prepare_channel(DnsChannel* channel);
+
+  /// Updates the health and statistics of the servers a query was sent to,
+  /// given how many of them timed out and how long the query took.
+  void record_server_results(DnsChannel* channel,
+                             int status,
+                             int timeouts,
+                             uint64_t elapsed_us);
+
+  /// Returns whether a query status means the DNS servers timed out or
+  /// failed, so the entry should back off.
+  static bool is_server_failure(int status);
+  int failure_backoff(int failures);
   void wait_for_replies(DnsChannel* channel);
   static void destroy_dns_channel(DnsChannel* channel);
 
-  struct ares_addr_node _ares_addrs[3];
+  /// An asynchronous query that is waiting for responses.
+  struct AsyncQuery
+  {
+    std::vector<DnsQuery> queries;
+    SAS::TrailId trail;
+    std::map<std::string, std::string> canonical_map;
+    std::map<DnsQuery, DnsResult> results;
+    std::vector<DnsQuery> misses;
+
+    // The number of responses the query is waiting for.
+    int outstanding;
+    DnsCallback callback;
+  };
+
+  /// Asynchronous queries waiting for responses, indexed on RRTYPE and the
+  /// lower case RRNAME.
+  typedef std::multimap<DnsCacheKey, AsyncQuery*> AsyncWaiters;
+
+  /// Calls the callback of an asynchronous query that has all its responses,
+  /// and deletes it.
+  void complete_async_query(AsyncQuery* query);
+
+  /// A query that the I/O thread is to issue.
+  struct IoRequest
+  {
+    std::string domain;
+    int dnstype;
+    SAS::TrailId trail;
+  };
+
+  void stop_io_thread();
+  static void io_sock_state_cb(void* data,
+                               ares_socket_t socket,
+                               int readable,
+                               int writable);
+  static void* io_thread_fn(void* resolver);
+  void io_thread_fn();
+
   std::vector<IP46Address> _dns_servers;
   int _port;
 
@@ -207,23 +681,126 @@ private:
   pthread_key_t _thread_local;
 
   /// The cache itself is held in a map indexed on RRTYPE and RRNAME, and a
-  /// multimap indexed on expiry time.
-  pthread_mutex_t _cache_lock;
+  /// multimap indexed on expiry time.  These are only used to update the
+  /// cache and to query records that aren't in it (or have expired), so
+  /// queries that hit the cache only take the lock on one of the shards of
+  /// published snapshots.
+  ProfiledMutex _cache_lock;
   pthread_cond_t _got_reply_cond;
   DnsCache _cache;
+  DnsCacheShard _shards[NUM_CACHE_SHARDS];
 
-  // The static cache contains hardcoded DNS records loaded from file.
+  // The static cache contains hardcoded DNS records loaded from file.  It
+  // swaps in reloaded records atomically, so needs no lock here.
   StaticDnsCache _static_cache;
 
-  // Expiry is done efficiently by storing pointers to cache entries in a
-  // multimap indexed on expiry time.
+  // Expiry is done efficiently by storing the keys of cache entries in a
+  // timer wheel, which is moved on once a second and expires the entries
+  // whose time has passed in a batch.
   DnsCacheExpiryList _cache_expiry_list;
+  std::vector<DnsCacheExpiryList::Item> _expired_keys;
+
+  /// Background refresh settings (a percentage of 0 means refreshing ahead is
+  /// disabled), the queue of entries to refresh (with a set of the ones
+  /// that are queued, so each is only queued once), and the thread that
+  /// refreshes them.
+  int _refresh_percent;
+  std::deque<DnsCacheKey> _refresh_queue;
+  std::set<DnsCacheKey> _refresh_queued;
+  pthread_mutex_t _refresh_lock;
+  pthread_cond_t _refresh_cond;
+  bool _refresh_terminated;
+  pthread_t _refresh_thread;
+
+  /// The I/O thread (if it's running), its channels, and the epoll set that
+  /// it waits on (which contains the channels' sockets and an eventfd that is
+  /// signalled when there are queries for it to issue), and the queries to
+  /// issue (protected by _io_lock).  The asynchronous queries waiting for
+  /// responses are protected by _cache_lock.
+  bool _io_thread_running;
+  std::vector<DnsChannel*> _io_channels;
+  int _io_epoll_fd;
+  int _io_event_fd;
+  std::map<int, AresChannelRef*> _io_sockets;
+  std::deque<IoRequest> _io_requests;
+  pthread_mutex_t _io_lock;
+  bool _io_terminated;
+  pthread_t _io_thread;
+  AsyncWaiters _async_waiters;
+
+  /// Backoff settings for entries that the DNS servers fail for, and the
+  /// health of each DNS server (protected by _server_lock).
+  /// _server_generation is incremented whenever a server becomes healthy or
+  /// unhealthy, so channels know to reorder their servers.
+  int _failure_backoff_min;
+  int _failure_backoff_max;
+  std::vector<DnsServerHealth> _server_health;
+  pthread_mutex_t _server_lock;
+  std::atomic<int> _server_generation;
+
+  SNMP::CounterTable* _query_failures_table;
+  SNMP::CounterTable* _server_failures_table;
+
+  /// The EDNS0 UDP payload size (or 0 not to use EDNS0), and the domains
+  /// that are queried over TCP (protected by _tcp_domains_lock), with how
+  /// many of them were learned from truncated responses.
+  int _edns_payload_size;
+  std::set<std::string> _tcp_domains;
+  size_t _learned_tcp_domains;
+  pthread_mutex_t _tcp_domains_lock;
+  std::atomic<uint64_t> _truncated_responses;
+  std::atomic<uint64_t> _tcp_queries;
+  SNMP::CounterTable* _truncated_table;
+  SNMP::CounterTable* _tcp_queries_table;
+
+  /// Statistics, and the SNMP tables they are reported in (if set).  The
+  /// size of the cache is protected by _cache_lock, but can be read without
+  /// it.
+  std::atomic<uint64_t> _static_hits;
+  std::atomic<uint64_t> _cache_hits;
+  std::atomic<uint64_t> _cache_misses;
+  std::atomic<uint64_t> _pending_waits;
+  std::atomic<uint64_t> _cache_entries;
+  std::atomic<uint64_t> _cache_bytes;
+  LatencyHistogram _reply_waits;
+  LatencyHistogram _pending_query_waits;
+  LatencyHistogram _expiry_batch_sizes;
+  std::vector<DnsServerStats*> _server_stats;
+
+  SNMP::CounterTable* _hits_table;
+  SNMP::CounterTable* _misses_table;
+  SNMP::CounterTable* _pending_waits_table;
+  SNMP::U32Scalar* _entries_scalar;
+  SNMP::U32Scalar* _bytes_scalar;
+
+  /// The file the cache is saved to periodically (if persistence has been
+  /// started), and the thread that saves it.
+  bool _persisting;
+  std::string _persist_file;
+  int _persist_interval;
+  pthread_mutex_t _persist_lock;
+  pthread_cond_t _persist_cond;
+  bool _persist_terminated;
+  pthread_t _persist_thread;
+
+  std::atomic<uint64_t> _prefetches;
+  std::atomic<uint64_t> _prefetch_hits;
+  std::atomic<uint64_t> _stale_serves;
 
   /// The default negative cache period is set to 5 minutes.
   /// @TODO - may make sense for this to be configured, or even different for
   /// each record type.
   static const int DEFAULT_NEGATIVE_CACHE_TTL = 300;
 
+  /// The default backoff for entries that the DNS servers fail for.
+  static const int DEFAULT_FAILURE_BACKOFF_MIN = 30;
+  static const int DEFAULT_FAILURE_BACKOFF_MAX = 300;
+
+  /// How long to skip an unresponsive DNS server for, the first time it
+  /// times out and at most.
+  static const int SERVER_BACKOFF_MIN = 5;
+  static const int SERVER_BACKOFF_MAX = 300;
+
   /// The time to keep records after they expire before freeing them.
   /// This provides a grace period if a DNS server becomes temporarily
   /// unresponsive, but doesn't risk leaking memory.
@@ -14,9 +14,28 @@
 
 #include <string>
 #include <list>
+#include <vector>
 
 #include "dnsrrecords.h"
 
+/// A resource record in a DNS message, decoded without copying anything out
+/// of the message.  The name and RDATA point into the message buffer, so a
+/// view is only valid while the buffer is.
+struct DnsRRecordView
+{
+  enum Section {ANSWER, AUTHORITY, ADDITIONAL};
+
+  Section section;
+
+  /// The encoded (and possibly compressed) RRNAME.
+  unsigned char* rrname;
+  int rrtype;
+  int rrclass;
+  int ttl;
+  unsigned char* rdata;
+  int rdlength;
+};
+
 class DnsParser
 {
 public:
@@ -24,8 +43,28 @@ public:
             int length);
   ~DnsParser();
 
+  /// Parses the message into records, which are held by the parser until
+  /// they are removed from its lists.
   bool parse();
 
+  /// Parses the message into views of its answers, authorities and
+  /// additional records (in that order), without creating any records.  The
+  /// vector is cleared first, so can be reused to parse many messages
+  /// without allocating.
+  bool parse_records(std::vector<DnsRRecordView>& records);
+
+  /// Creates a record from a view, decompressing its names.  Returns NULL if
+  /// the record's RDATA is malformed.
+  DnsRRecord* to_record(const DnsRRecordView& view);
+
+  /// Returns whether an encoded name is the given domain (ignoring case),
+  /// without decompressing it.
+  bool name_matches(unsigned char* name, const std::string& domain);
+
+  /// Decompresses an encoded name.  Returns an empty string if the name is
+  /// malformed.
+  std::string domain_name(unsigned char* name);
+
   std::list<DnsQuestion*>& questions() { return _questions; }
   std::list<DnsRRecord*>& answers() { return _answers; }
   std::list<DnsRRecord*>& authorities() { return _authorities; }
@@ -36,9 +75,12 @@ public:
 private:
   int parse_header(unsigned char* hptr);
   int parse_domain_name(unsigned char* nptr, std::string& name);
+  int skip_domain_name(unsigned char* nptr);
+  int walk_domain_name(unsigned char* nptr, std::string* name);
   int parse_character_string(unsigned char* sptr, std::string& cstring);
   int parse_question(unsigned char* qptr, DnsQuestion*& question);
   int parse_rr(unsigned char* rptr, DnsRRecord*& record);
+  int parse_rr_view(unsigned char* rptr, DnsRRecordView& view);
   int read_int16(unsigned char* p);
   int read_int32(unsigned char* p);
   int label_length(unsigned char* lptr);
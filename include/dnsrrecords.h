@@ -12,9 +12,13 @@
 #ifndef DNSRRECORDS_H__
 #define DNSRRECORDS_H__
 
+#include <stddef.h>
+
+#include <new>
 #include <string>
 #include <list>
 #include <vector>
+#include <memory>
 #include <sstream>
 #include <iomanip>
 
@@ -54,6 +58,19 @@ public:
     return new DnsRRecord(*this);
   }
 
+  /// The size of the record object, and a copy of it in the given memory
+  /// (which must be at least that size, and suitably aligned).  These are
+  /// used to copy sets of records into a single block of memory.
+  virtual size_t object_size() const
+  {
+    return sizeof(DnsRRecord);
+  }
+
+  virtual DnsRRecord* clone_into(void* buf) const
+  {
+    return new (buf) DnsRRecord(*this);
+  }
+
   virtual std::string to_string() const
   {
     std::ostringstream oss;
@@ -117,6 +134,16 @@ public:
     return new DnsARecord(*this);
   }
 
+  virtual size_t object_size() const
+  {
+    return sizeof(DnsARecord);
+  }
+
+  virtual DnsRRecord* clone_into(void* buf) const
+  {
+    return new (buf) DnsARecord(*this);
+  }
+
   virtual std::string to_string() const
   {
     std::ostringstream oss;
@@ -146,6 +173,16 @@ public:
     return new DnsAAAARecord(*this);
   }
 
+  virtual size_t object_size() const
+  {
+    return sizeof(DnsAAAARecord);
+  }
+
+  virtual DnsRRecord* clone_into(void* buf) const
+  {
+    return new (buf) DnsAAAARecord(*this);
+  }
+
   virtual std::string to_string() const
   {
     std::ostringstream oss;
@@ -186,6 +223,16 @@ public:
     return new DnsSrvRecord(*this);
   }
 
+  virtual size_t object_size() const
+  {
+    return sizeof(DnsSrvRecord);
+  }
+
+  virtual DnsRRecord* clone_into(void* buf) const
+  {
+    return new (buf) DnsSrvRecord(*this);
+  }
+
   virtual std::string to_string() const
   {
     std::ostringstream oss;
@@ -238,6 +285,16 @@ public:
     return new DnsNaptrRecord(*this);
   }
 
+  virtual size_t object_size() const
+  {
+    return sizeof(DnsNaptrRecord);
+  }
+
+  virtual DnsRRecord* clone_into(void* buf) const
+  {
+    return new (buf) DnsNaptrRecord(*this);
+  }
+
   virtual std::string to_string() const
   {
     std::ostringstream oss;
@@ -276,6 +333,16 @@ DnsCNAMERecord(const std::string& rrname, int ttl, const std::string& target) :
     return new DnsCNAMERecord(*this);
   }
 
+  virtual size_t object_size() const
+  {
+    return sizeof(DnsCNAMERecord);
+  }
+
+  virtual DnsRRecord* clone_into(void* buf) const
+  {
+    return new (buf) DnsCNAMERecord(*this);
+  }
+
   virtual std::string to_string() const
   {
     std::ostringstream oss;
@@ -309,10 +376,106 @@ private:
   const int _qclass;
 };
 
+class DnsRecordSet;
+typedef std::shared_ptr<const DnsRecordSet> DnsRecordSetPtr;
+
+/// An immutable set of DNS records, which can be shared between a cache and
+/// the results of queries on it.  The set owns the records, and frees them
+/// when it is destroyed.
+class DnsRecordSet
+{
+public:
+  /// Takes ownership of the records.
+  DnsRecordSet(std::vector<DnsRRecord*>&& records) :
+    _records(std::move(records)),
+    _block(NULL)
+  {}
+
+  ~DnsRecordSet()
+  {
+    for (std::vector<DnsRRecord*>::iterator i = _records.begin();
+         i != _records.end();
+         ++i)
+    {
+      if (_block == NULL)
+      {
+        delete *i;
+      }
+      else
+      {
+        (*i)->~DnsRRecord();
+      }
+    }
+
+    ::operator delete(_block);
+  }
+
+  /// Copies records into a new set, which holds all the copies in a single
+  /// block of memory.
+  static DnsRecordSetPtr copy(const std::vector<DnsRRecord*>& records)
+  {
+    std::shared_ptr<DnsRecordSet> set(new DnsRecordSet());
+    set->_records.reserve(records.size());
+
+    size_t size = 0;
+    for (std::vector<DnsRRecord*>::const_iterator i = records.begin();
+         i != records.end();
+         ++i)
+    {
+      size += aligned_size((*i)->object_size());
+    }
+
+    if (size > 0)
+    {
+      set->_block = (char*)::operator new(size);
+
+      // If a copy throws, the set's destructor frees the ones made so far.
+      char* next = set->_block;
+      for (std::vector<DnsRRecord*>::const_iterator i = records.begin();
+           i != records.end();
+           ++i)
+      {
+        set->_records.push_back((*i)->clone_into(next));
+        next += aligned_size((*i)->object_size());
+      }
+    }
+
+    return set;
+  }
+
+  const std::vector<DnsRRecord*>& records() const { return _records; }
+
+private:
+  DnsRecordSet() : _records(), _block(NULL) {}
+
+  static size_t aligned_size(size_t size)
+  {
+    const size_t alignment = alignof(max_align_t);
+    return ((size + alignment - 1) / alignment) * alignment;
+  }
+
+  std::vector<DnsRRecord*> _records;
+
+  // The memory holding the records, if they were copied into a single block
+  // (rather than allocated separately).
+  char* _block;
+
+  // Don't implement the following, to avoid copies of this instance.
+  DnsRecordSet(DnsRecordSet const&);
+  void operator=(DnsRecordSet const&);
+};
+
+/// The result of a DNS query.  Copies of a result share its records, which
+/// must not be modified (although the vector returned by records() can be
+/// reordered).
 class DnsResult
 {
 public:
+  /// Copies the records.
   DnsResult(const std::string& domain, int dnstype, const std::vector<DnsRRecord*>& records, int ttl);
+
+  /// Shares the records.
+  DnsResult(const std::string& domain, int dnstype, const DnsRecordSetPtr& records, int ttl);
   DnsResult(const std::string& domain, int dnstype, int ttl);
   DnsResult(const DnsResult &obj);
   DnsResult(DnsResult &&obj);
@@ -326,6 +489,9 @@ public:
 private:
   std::string _domain;
   int _dnstype;
+
+  // The records, which are owned by the shared record set.
+  DnsRecordSetPtr _record_set;
   std::vector<DnsRRecord*> _records;
   int _ttl;
 };
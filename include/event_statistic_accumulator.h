@@ -65,6 +65,55 @@ private:
   std::atomic_uint_fast64_t _lwm;
 };
 
+// Structure used to hold estimated percentiles.
+struct EventPercentiles
+{
+  uint_fast64_t p50;
+  uint_fast64_t p90;
+  uint_fast64_t p99;
+};
+
+// An EventStatisticAccumulator that also keeps a histogram of the samples, so
+// that it can estimate percentiles.  Samples are counted in buckets whose
+// width grows with the sample (eight buckets per power of two), so adding a
+// sample is a single atomic increment, the estimates are within about 6% of
+// the true values, and two histograms can be merged by adding their buckets.
+class EventPercentileAccumulator : public EventStatisticAccumulator
+{
+public:
+  EventPercentileAccumulator();
+  virtual ~EventPercentileAccumulator() {};
+
+  void accumulate(uint32_t sample);
+
+  // Estimate the percentiles of the samples, filling them in in the supplied
+  // EventPercentiles structure.
+  void get_percentiles(EventPercentiles &percentiles);
+
+  // Add the samples in another accumulator's histogram to this one's.  The
+  // other statistics aren't merged.
+  void merge(const EventPercentileAccumulator& other);
+
+  void reset(uint64_t periodstart, EventPercentileAccumulator* previous = NULL);
+
+private:
+  // Samples below 2^SUB_BUCKET_BITS each have their own bucket.  Above that,
+  // each power of two is split into 2^SUB_BUCKET_BITS buckets.
+  static const int SUB_BUCKET_BITS = 3;
+  static const int NUM_BUCKETS = (32 - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS;
+
+  // The bucket a sample is counted in.
+  static int bucket(uint32_t sample);
+
+  // The value reported for samples in a bucket - the middle of its range.
+  static uint_fast64_t bucket_value(int bucket);
+
+  // Estimate a percentile, given the number of samples in the histogram.
+  uint_fast64_t percentile(uint_fast64_t total, int percent);
+
+  std::atomic_uint_fast64_t _buckets[NUM_BUCKETS];
+};
+
 }
 
 #endif
@@ -15,16 +15,43 @@
 #include <pthread.h>
 #include <errno.h>
 #include <time.h>
+#include <stdint.h>
+
+#include <stdlib.h>
 
 #include <queue>
+#include <vector>
+#include <atomic>
+#include <utility>
+#include <iterator>
+#include <type_traits>
 
 #include "log.h"
+#include "profiled_mutex.h"
+#include "sip_event_priority.h"
 
 template<class T>
 class eventq
 {
 public:
 
+  // Metadata stored alongside each element by backends that support it.
+  struct Stamp
+  {
+    Stamp(uint64_t timestamp_us = 0, uint64_t deadline_us = 0) :
+      timestamp_us(timestamp_us),
+      deadline_us(deadline_us)
+    {}
+
+    // The time the element was pushed, in microseconds on the monotonic
+    // clock (zero if the element wasn't timestamped).
+    uint64_t timestamp_us;
+
+    // The time after which the element is no longer worth processing, on
+    // the same clock (zero if the element has no deadline).
+    uint64_t deadline_us;
+  };
+
   // Abstract base class adapter for queue-type containers that can be used to
   // back an eventq. The meaning of the 'front' of the container may vary by
   // implementation, but is intended to be the next element to be removed from
@@ -47,8 +74,88 @@ public:
     // Adds an element to the container.
     virtual void push(const T& value) = 0;
 
+    // Adds an element to the container by moving it in.  Backends that don't
+    // override this copy the element instead.
+    virtual void push(T&& value)
+    {
+      push(static_cast<const T&>(value));
+    }
+
     // Removes an element from the 'front' of the container.
     virtual void pop() = 0;
+
+    // Returns true if the container supports concurrent calls to try_push()
+    // and try_pop() without any external locking. The eventq uses this to
+    // skip its mutex on the fast path.
+    virtual bool is_lock_free()
+    {
+      return false;
+    }
+
+    // Adds an element to the container if there is space.
+    //
+    // @return whether the element was added.
+    virtual bool try_push(const T& value)
+    {
+      push(value);
+      return true;
+    }
+
+    // As above, but moving the element in.  If the element isn't added, it is
+    // left unchanged.
+    virtual bool try_push(T&& value)
+    {
+      push(std::move(value));
+      return true;
+    }
+
+    // Removes the element from the 'front' of the container, if there is one.
+    //
+    // @return whether an element was removed.
+    virtual bool try_pop(T& value)
+    {
+      if (empty())
+      {
+        return false;
+      }
+
+      value = copy_of(front());
+      pop();
+      return true;
+    }
+
+    // Adds an element to the container, along with its stamp (the time it
+    // was pushed and its deadline).  Backends that can't store stamps just
+    // add the element.
+    virtual void push_timestamped(const T& value, const Stamp& /*stamp*/)
+    {
+      push(value);
+    }
+
+    virtual void push_timestamped(T&& value, const Stamp& /*stamp*/)
+    {
+      push(std::move(value));
+    }
+
+    // As try_push(), but also storing the element's stamp.
+    virtual bool try_push_timestamped(const T& value, const Stamp& /*stamp*/)
+    {
+      return try_push(value);
+    }
+
+    virtual bool try_push_timestamped(T&& value, const Stamp& /*stamp*/)
+    {
+      return try_push(std::move(value));
+    }
+
+    // As try_pop(), but also returning the element's stamp.  The stamp is
+    // zero if the element was pushed without one, or if the backend can't
+    // store stamps.
+    virtual bool try_pop_timestamped(T& value, Stamp& stamp)
+    {
+      stamp = Stamp();
+      return try_pop(value);
+    }
   };
 
   // Implements Backend as a standard std::queue.
@@ -61,7 +168,7 @@ public:
 
     virtual const T& front()
     {
-      return _queue.front();
+      return _queue.front().first;
     }
 
     virtual bool empty()
@@ -76,7 +183,12 @@ public:
 
     virtual void push(const T& value)
     {
-      _queue.push(value);
+      push_timestamped(copy_of(value), Stamp());
+    }
+
+    virtual void push(T&& value)
+    {
+      push_timestamped(std::move(value), Stamp());
     }
 
     virtual void pop()
@@ -84,9 +196,460 @@ public:
       _queue.pop();
     }
 
+    virtual void push_timestamped(const T& value, const Stamp& stamp)
+    {
+      push_timestamped(copy_of(value), stamp);
+    }
+
+    virtual void push_timestamped(T&& value, const Stamp& stamp)
+    {
+      _queue.emplace(std::move(value), stamp);
+    }
+
+    virtual bool try_pop(T& value)
+    {
+      Stamp stamp;
+      return try_pop_timestamped(value, stamp);
+    }
+
+    virtual bool try_pop_timestamped(T& value, Stamp& stamp)
+    {
+      if (_queue.empty())
+      {
+        return false;
+      }
+
+      value = std::move(_queue.front().first);
+      stamp = _queue.front().second;
+      _queue.pop();
+      return true;
+    }
+
+  private:
+
+    // Each element is stored along with its stamp.
+    std::queue<std::pair<T, Stamp>> _queue;
+  };
+
+  // Implements Backend as a set of FIFO sub-queues, one per
+  // SIPEventPriorityLevel.  Elements are served either in strict priority
+  // order (higher priority levels always go first) or by weighted round
+  // robin, where each level can be served up to its weight's worth of
+  // elements before lower levels get a turn.
+  class PriorityBackend : public Backend
+  {
+  public:
+
+    static const int NUM_LEVELS = HIGH_PRIORITY_15 + 1;
+
+    // @param get_priority function that returns the priority of an element.
+    // @param weights if empty, levels are served in strict priority order.
+    //                Otherwise, the relative number of elements to serve from
+    //                each level (indexed by SIPEventPriorityLevel) when
+    //                several levels have elements waiting.  Missing or zero
+    //                weights are treated as 1.
+    PriorityBackend(SIPEventPriorityLevel (*get_priority)(const T&),
+                    const std::vector<unsigned int>& weights = {}) :
+      _get_priority(get_priority),
+      _weighted(!weights.empty()),
+      _size(0)
+    {
+      for (int level = 0; level < NUM_LEVELS; ++level)
+      {
+        _weights[level] = ((level < (int)weights.size()) && (weights[level] > 0)) ?
+                            weights[level] : 1;
+        _credits[level] = _weights[level];
+        _level_sizes[level] = 0;
+      }
+    }
+
+    virtual ~PriorityBackend() {}
+
+    virtual const T& front()
+    {
+      return _queues[select()].front().first;
+    }
+
+    virtual bool empty()
+    {
+      return (_size == 0);
+    }
+
+    virtual int size()
+    {
+      return _size;
+    }
+
+    // Returns the priority level an element is queued at.
+    SIPEventPriorityLevel priority(const T& value)
+    {
+      return (SIPEventPriorityLevel)clamp(_get_priority(value));
+    }
+
+    // Returns the number of elements at the specified priority level.  This
+    // may be called without holding the eventq lock.
+    int size(SIPEventPriorityLevel level)
+    {
+      return _level_sizes[level];
+    }
+
+    virtual void push(const T& value)
+    {
+      push_timestamped(copy_of(value), Stamp());
+    }
+
+    virtual void push(T&& value)
+    {
+      push_timestamped(std::move(value), Stamp());
+    }
+
+    virtual void pop()
+    {
+      int level = select();
+      _queues[level].pop();
+      --_level_sizes[level];
+      --_size;
+
+      if (_credits[level] > 0)
+      {
+        --_credits[level];
+      }
+    }
+
+    virtual void push_timestamped(const T& value, const Stamp& stamp)
+    {
+      push_timestamped(copy_of(value), stamp);
+    }
+
+    virtual void push_timestamped(T&& value, const Stamp& stamp)
+    {
+      int level = clamp(_get_priority(value));
+      _queues[level].emplace(std::move(value), stamp);
+      ++_level_sizes[level];
+      ++_size;
+    }
+
+    virtual bool try_pop_timestamped(T& value, Stamp& stamp)
+    {
+      if (empty())
+      {
+        return false;
+      }
+
+      std::pair<T, Stamp>& entry = _queues[select()].front();
+      value = std::move(entry.first);
+      stamp = entry.second;
+      pop();
+      return true;
+    }
+
+    virtual bool try_pop(T& value)
+    {
+      Stamp stamp;
+      return try_pop_timestamped(value, stamp);
+    }
+
+  private:
+
+    // Returns the level that should be served next.  Must only be called
+    // when the backend is non-empty.
+    int select()
+    {
+      if (_weighted)
+      {
+        // Serve the highest priority level that has credit left.
+        for (int level = NUM_LEVELS - 1; level >= 0; --level)
+        {
+          if ((!_queues[level].empty()) && (_credits[level] > 0))
+          {
+            return level;
+          }
+        }
+
+        // Every level with elements waiting has used up its credit, so start
+        // a new round.
+        for (int level = 0; level < NUM_LEVELS; ++level)
+        {
+          _credits[level] = _weights[level];
+        }
+      }
+
+      for (int level = NUM_LEVELS - 1; level >= 0; --level)
+      {
+        if (!_queues[level].empty())
+        {
+          return level;
+        }
+      }
+
+      return NORMAL_PRIORITY;
+    }
+
+    static int clamp(SIPEventPriorityLevel level)
+    {
+      return (level < NORMAL_PRIORITY) ? NORMAL_PRIORITY :
+             (level >= NUM_LEVELS) ? (NUM_LEVELS - 1) :
+                                     (int)level;
+    }
+
+    SIPEventPriorityLevel (*_get_priority)(const T&);
+    bool _weighted;
+
+    std::queue<std::pair<T, Stamp>> _queues[NUM_LEVELS];
+    unsigned int _weights[NUM_LEVELS];
+    unsigned int _credits[NUM_LEVELS];
+
+    // The sizes are atomic as they may be read by size(level) without the
+    // eventq lock.
+    std::atomic<int> _level_sizes[NUM_LEVELS];
+    std::atomic<int> _size;
+  };
+
+  // Implements Backend as a bounded multi-producer multi-consumer ring
+  // buffer, based on Dmitry Vyukov's algorithm. Each cell carries a sequence
+  // number that tells producers and consumers whether the cell is free or
+  // full for their current lap of the ring, so try_push() and try_pop()
+  // each need only a single CAS on the shared position.
+  //
+  // The ring's capacity is the queue's limit - the eventq's max_queue is not
+  // used with this backend.
+  class RingBackend : public Backend
+  {
+  public:
+
+    // @param capacity the number of elements the ring can hold. This is
+    //                 rounded up to a power of two.
+    RingBackend(unsigned int capacity) :
+      _buffer(NULL),
+      _mask(0),
+      _enqueue_pos(0),
+      _dequeue_pos(0)
+    {
+      size_t size = 2;
+      while (size < capacity)
+      {
+        size <<= 1;
+      }
+
+      _mask = size - 1;
+      _buffer = new Cell[size];
+
+      for (size_t ii = 0; ii < size; ++ii)
+      {
+        _buffer[ii].sequence.store(ii, std::memory_order_relaxed);
+      }
+    }
+
+    virtual ~RingBackend()
+    {
+      delete[] _buffer; _buffer = NULL;
+    }
+
+    // Returns the element at the dequeue position. This is only meaningful
+    // when there are no concurrent consumers.
+    virtual const T& front()
+    {
+      return _buffer[_dequeue_pos.load(std::memory_order_relaxed) & _mask].data;
+    }
+
+    virtual bool empty()
+    {
+      return (size() == 0);
+    }
+
+    // Returns the number of elements in the ring. When there are concurrent
+    // producers or consumers this is a snapshot, and may be slightly stale.
+    virtual int size()
+    {
+      size_t dequeue_pos = _dequeue_pos.load(std::memory_order_relaxed);
+      size_t enqueue_pos = _enqueue_pos.load(std::memory_order_relaxed);
+      return (enqueue_pos > dequeue_pos) ? (int)(enqueue_pos - dequeue_pos) : 0;
+    }
+
+    virtual void push(const T& value)
+    {
+      push(copy_of(value));
+    }
+
+    virtual void push(T&& value)
+    {
+      if (!try_push(std::move(value)))
+      {
+        TRC_ERROR("Discarding element pushed to full ring buffer");
+      }
+    }
+
+    virtual void pop()
+    {
+      T value;
+      try_pop(value);
+    }
+
+    virtual bool is_lock_free()
+    {
+      return true;
+    }
+
+    virtual bool try_push(const T& value)
+    {
+      return try_push_timestamped(value, Stamp());
+    }
+
+    virtual bool try_push(T&& value)
+    {
+      return try_push_timestamped(std::move(value), Stamp());
+    }
+
+    virtual bool try_pop(T& value)
+    {
+      Stamp stamp;
+      return try_pop_timestamped(value, stamp);
+    }
+
+    // The element is only copied once a cell has been claimed, so nothing is
+    // copied if the ring is full.
+    virtual bool try_push_timestamped(const T& value, const Stamp& stamp)
+    {
+      Cell* cell = claim_cell();
+
+      if (cell == nullptr)
+      {
+        return false;
+      }
+
+      cell->data = copy_of(value);
+      publish_cell(cell, stamp);
+      return true;
+    }
+
+    // As above, but moving the element in. If the ring is full the element is
+    // left unchanged.
+    virtual bool try_push_timestamped(T&& value, const Stamp& stamp)
+    {
+      Cell* cell = claim_cell();
+
+      if (cell == nullptr)
+      {
+        return false;
+      }
+
+      cell->data = std::move(value);
+      publish_cell(cell, stamp);
+      return true;
+    }
+
+    virtual bool try_pop_timestamped(T& value, Stamp& stamp)
+    {
+      Cell* cell;
+      size_t pos = _dequeue_pos.load(std::memory_order_relaxed);
+
+      while (true)
+      {
+        cell = &_buffer[pos & _mask];
+        size_t seq = cell->sequence.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if (diff == 0)
+        {
+          // The cell is full on this lap. Try to claim it.
+          if (_dequeue_pos.compare_exchange_weak(pos,
+                                                 pos + 1,
+                                                 std::memory_order_relaxed))
+          {
+            break;
+          }
+        }
+        else if (diff < 0)
+        {
+          // The cell hasn't been written on this lap, so the ring is empty.
+          return false;
+        }
+        else
+        {
+          // Another consumer claimed this cell. Move on.
+          pos = _dequeue_pos.load(std::memory_order_relaxed);
+        }
+      }
+
+      value = std::move(cell->data);
+      stamp = cell->stamp;
+
+      // Reset the cell so it doesn't hold on to any resources owned by the
+      // element, then release it to producers on the next lap.
+      cell->data = T();
+      cell->sequence.store(pos + _mask + 1, std::memory_order_release);
+      return true;
+    }
+
   private:
 
-    std::queue<T> _queue;
+    struct Cell
+    {
+      std::atomic<size_t> sequence;
+      T data;
+      Stamp stamp;
+    };
+
+    // Claim the cell at the enqueue position for a producer.
+    //
+    // @return the claimed cell, or nullptr if the ring is full.
+    Cell* claim_cell()
+    {
+      Cell* cell;
+      size_t pos = _enqueue_pos.load(std::memory_order_relaxed);
+      while (true)
+      {
+        cell = &_buffer[pos & _mask];
+        size_t seq = cell->sequence.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0)
+        {
+          // The cell is free on this lap. Try to claim it.
+          if (_enqueue_pos.compare_exchange_weak(pos,
+                                                 pos + 1,
+                                                 std::memory_order_relaxed))
+          {
+            break;
+          }
+        }
+        else if (diff < 0)
+        {
+          // The cell still holds an element from the previous lap, so the
+          // ring is full.
+          return nullptr;
+        }
+        else
+        {
+          // Another producer claimed this cell. Move on.
+          pos = _enqueue_pos.load(std::memory_order_relaxed);
+        }
+      }
+
+      return cell;
+    }
+
+    // Store an element's stamp in a claimed cell, then release the cell to
+    // consumers.
+    void publish_cell(Cell* cell, const Stamp& stamp)
+    {
+      // Only the producer that claimed the cell updates its sequence number,
+      // so it is still the claimed position.
+      size_t pos = cell->sequence.load(std::memory_order_relaxed);
+      cell->stamp = stamp;
+      cell->sequence.store(pos + 1, std::memory_order_release);
+    }
+
+    Cell* _buffer;
+    size_t _mask;
+
+    // The producer and consumer positions are padded onto separate cache
+    // lines so that producers and consumers don't contend on them.
+    char _pad0[64];
+    std::atomic<size_t> _enqueue_pos;
+    char _pad1[64];
+    std::atomic<size_t> _dequeue_pos;
+    char _pad2[64];
   };
 
   /// Create an event queue.
@@ -98,7 +661,10 @@ public:
     _writers(0),
     _readers(0),
     _terminated(false),
-    _deadlock_threshold(0)
+    _deadlock_threshold(0),
+    _service_delay_tracking(false),
+    _timestamps(false),
+    _m("eventq")
   {
 
     if (q)
@@ -110,13 +676,14 @@ public:
       _q = new eventq<T>::QueueBackend();
     }
 
-    pthread_mutex_init(&_m, NULL);
     pthread_condattr_t cond_attr;
     pthread_condattr_init(&cond_attr);
     pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
     pthread_cond_init(&_w_cond, &cond_attr);
     pthread_cond_init(&_r_cond, &cond_attr);
     pthread_condattr_destroy(&cond_attr);
+
+    _lock_free = _q->is_lock_free();
   }
 
   ~eventq()
@@ -146,7 +713,7 @@ public:
 
   void terminate(std::vector<T>& remaining_elts)
   {
-    pthread_mutex_lock(&_m);
+    _m.lock();
 
     _terminated = true;
 
@@ -159,21 +726,27 @@ public:
       pthread_cond_broadcast(&_r_cond);
     }
 
-    while (!_q->empty())
+    T item;
+    while (_q->try_pop(item))
+    {
+       remaining_elts.push_back(std::move(item));
+    }
+
+    // Draining the queue has made space, so wake any blocked writers.
+    if (_writers > 0)
     {
-       remaining_elts.push_back(_q->front());
-       _q->pop();
+      pthread_cond_broadcast(&_w_cond);
     }
 
-    pthread_mutex_unlock(&_m);
+    _m.unlock();
   }
 
   /// Indicates whether the queue has been terminated.
   bool is_terminated()
   {
-    pthread_mutex_lock(&_m);
+    _m.lock();
     bool terminated = _terminated;
-    pthread_mutex_unlock(&_m);
+    _m.unlock();
     return terminated;
   }
 
@@ -181,7 +754,7 @@ public:
   /// (in milliseconds).
   void set_deadlock_threshold(unsigned long threshold_ms)
   {
-    pthread_mutex_lock(&_m);
+    _m.lock();
 
     // Store the threshold.
     _deadlock_threshold = threshold_ms;
@@ -190,15 +763,119 @@ public:
     // detection is disabled.
     clock_gettime(CLOCK_MONOTONIC, &_service_time);
 
-    pthread_mutex_unlock(&_m);
+    _m.unlock();
   }
 
-  /// Returns the deadlocked state of the queue.
+  /// Enables timestamping of items as they are pushed, so that the timed pop
+  /// methods can report how long each item spent on the queue.  Timestamps
+  /// are only stored if the backend supports them (all the backends defined
+  /// here do).
+  void enable_timestamps()
+  {
+    _timestamps = true;
+  }
+
+  /// Returns the current time in microseconds on the monotonic clock, as
+  /// used for item timestamps.
+  static uint64_t timestamp_us()
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+  }
+
+  /// Returns a deadline the specified number of milliseconds from now, for
+  /// passing to push().
+  static uint64_t deadline_in(unsigned long timeout_ms)
+  {
+    return timestamp_us() + ((uint64_t)timeout_ms * 1000);
+  }
+
+  /// Returns whether the specified item deadline has passed.  A deadline of
+  /// zero means the item never expires.
+  ///
+  /// @param now_us the current time if the caller already has it (as
+  ///               returned by timestamp_us()), or zero to read the clock.
+  static bool expired(uint64_t deadline_us, uint64_t now_us = 0)
+  {
+    if (deadline_us == 0)
+    {
+      return false;
+    }
+
+    return (((now_us != 0) ? now_us : timestamp_us()) >= deadline_us);
+  }
+
+  /// Returns how long (in microseconds) it has been since the specified item
+  /// timestamp, or zero if there is no timestamp.
+  static unsigned long wait_since(uint64_t timestamp)
+  {
+    if (timestamp == 0)
+    {
+      return 0;
+    }
+
+    uint64_t now = timestamp_us();
+    return (now > timestamp) ? (unsigned long)(now - timestamp) : 0;
+  }
+
+  /// Enables tracking of how long the queue has been waiting to be serviced,
+  /// as returned by service_delay_ms().
+  void enable_service_delay_tracking()
+  {
+    _m.lock();
+
+    if (!tracking_service_time())
+    {
+      // We haven't been updating the service time, so start from now.
+      clock_gettime(CLOCK_MONOTONIC, &_service_time);
+    }
+
+    _service_delay_tracking = true;
+
+    _m.unlock();
+  }
+
+  /// Returns how long (in milliseconds) it has been since an item was last
+  /// removed from the queue, or since an item was pushed on to an empty
+  /// queue if that was more recent.  This is a lower bound on how long the
+  /// item at the front of the queue has been waiting.  Returns zero if the
+  /// queue is empty or service time tracking isn't enabled (by either
+  /// enable_service_delay_tracking() or set_deadlock_threshold()).
+  unsigned long service_delay_ms()
+  {
+    unsigned long delay_ms = 0;
+
+    _m.lock();
+
+    if ((tracking_service_time()) && (!_q->empty()))
+    {
+      struct timespec now;
+      if (clock_gettime(CLOCK_MONOTONIC, &now) == 0)
+      {
+        uint64_t service_time = (_service_time.tv_sec * 1000) +
+                                (_service_time.tv_nsec / 1000000);
+        uint64_t now_time = (now.tv_sec * 1000) +
+                            (now.tv_nsec / 1000000);
+
+        if (now_time > service_time)
+        {
+          delay_ms = now_time - service_time;
+        }
+      }
+    }
+
+    _m.unlock();
+
+    return delay_ms;
+  }
+
+  /// Returns the deadlocked state of the queue.
   bool is_deadlocked()
   {
     bool deadlocked = false;
 
-    pthread_mutex_lock(&_m);
+    _m.lock();
 
     if ((_deadlock_threshold > 0) &&
         (!_q->empty()))
@@ -219,7 +896,7 @@ public:
             ((now_time - service_time) > _deadlock_threshold))
         {
           TRC_ERROR("Queue is deadlocked - service delay %ld > threshold %ld",
-                    service_time - now_time, _deadlock_threshold);
+                    service_time - now_time, _deadlock_threshold.load());
           TRC_DEBUG("  Last service time = %d.%ld", _service_time.tv_sec, _service_time.tv_nsec);
           TRC_DEBUG("  Now = %d.%ld", now.tv_sec, now.tv_nsec);
           deadlocked = true;
@@ -227,7 +904,7 @@ public:
       }
     }
 
-    pthread_mutex_unlock(&_m);
+    _m.unlock();
 
     return deadlocked;
   }
@@ -235,22 +912,33 @@ public:
   /// Purges all the events currently in the queue.
   void purge()
   {
-    pthread_mutex_lock(&_m);
-    while (!_q->empty())
+    _m.lock();
+    T item;
+    while (_q->try_pop(item))
     {
-      _q->pop();
     }
-    pthread_mutex_unlock(&_m);
+    _m.unlock();
   }
 
   /// Push an item on to the event queue.
   ///
   /// This may block if the queue is full, and will fail if the queue is closed.
-  bool push(T item)
+  ///
+  /// @param deadline_us optional time (as returned by deadline_in()) after
+  ///                    which the item is no longer worth processing.  The
+  ///                    queue doesn't act on this itself - it is returned by
+  ///                    try_pop() and pop_batch() so that the consumer can
+  ///                    discard expired items (see expired()).
+  bool push(T item, uint64_t deadline_us = 0)
   {
+    if (_lock_free)
+    {
+      return push_lock_free(item, true, deadline_us);
+    }
+
     bool rc = false;
 
-    pthread_mutex_lock(&_m);
+    _m.lock();
 
     if (_open)
     {
@@ -260,15 +948,15 @@ public:
         {
           // Queue is full, so writer must block.
           ++_writers;
-          pthread_cond_wait(&_w_cond, &_m);
+          _m.cond_wait(&_w_cond);
           --_writers;
         }
       }
 
-      if ((_deadlock_threshold > 0) &&
+      if ((tracking_service_time()) &&
           (_q->empty()))
       {
-        // Deadlock detection is enabled, and we're about to push an item on
+        // Service time tracking is enabled, and we're about to push an item on
         // to an empty queue, so update the service time to the current time.
         // This is done to avoid false positives when the system has been idle
         // for a while.
@@ -276,7 +964,7 @@ public:
       }
 
       // Must be space on the queue now.
-      _q->push(item);
+      _q->push_timestamped(std::move(item), stamp(deadline_us));
 
       // Are there any readers waiting?
       if (_readers > 0)
@@ -287,7 +975,7 @@ public:
       rc = true;
     }
 
-    pthread_mutex_unlock(&_m);
+    _m.unlock();
 
     return rc;
   }
@@ -295,18 +983,25 @@ public:
   /// Push an item on to the event queue.
   ///
   /// This will not block, but may discard the event if the queue is full.
-  bool push_noblock(T item)
+  ///
+  /// @param deadline_us as for push().
+  bool push_noblock(T item, uint64_t deadline_us = 0)
   {
+    if (_lock_free)
+    {
+      return push_lock_free(item, false, deadline_us);
+    }
+
     bool rc = false;
 
-    pthread_mutex_lock(&_m);
+    _m.lock();
 
     if ((_open) && ((_max_queue == 0) || (_q->size() < _max_queue)))
     {
-      if ((_deadlock_threshold > 0) &&
+      if ((tracking_service_time()) &&
           (_q->empty()))
       {
-        // Deadlock detection is enabled, and we're about to push an item on
+        // Service time tracking is enabled, and we're about to push an item on
         // to an empty queue, so update the service time to the current time.
         // This is done to avoid false positives when the system has been idle
         // for a while.
@@ -314,7 +1009,7 @@ public:
       }
 
       // There is space on the queue.
-      _q->push(item);
+      _q->push_timestamped(std::move(item), stamp(deadline_us));
 
       // Are there any readers waiting?
       if (_readers > 0)
@@ -325,31 +1020,130 @@ public:
       rc = true;
     }
 
-    pthread_mutex_unlock(&_m);
+    _m.unlock();
 
     return rc;
   }
 
+  /// Push a batch of items on to the event queue.  This takes the lock and
+  /// wakes waiting readers once for the whole batch, rather than once per
+  /// item.
+  ///
+  /// This may block if the queue is full, and will fail if the queue is closed.
+  /// The items are copied from the range, unless it is a range of move
+  /// iterators (see std::make_move_iterator()).
+  ///
+  /// @param deadline_us as for push(), applied to every item in the batch.
+  template <class InputIt>
+  bool push_batch(InputIt begin, InputIt end, uint64_t deadline_us = 0)
+  {
+    if (_lock_free)
+    {
+      bool rc = true;
+
+      for (InputIt it = begin; (rc) && (it != end); ++it)
+      {
+        T item(*it);
+        rc = push_lock_free(item, true, deadline_us);
+      }
+
+      return rc;
+    }
+
+    bool rc = false;
+
+    _m.lock();
+
+    if (_open)
+    {
+      // The number of items pushed that waiting readers haven't yet been told
+      // about.
+      unsigned int unsignalled = 0;
+      Stamp batch_stamp = stamp(deadline_us);
+
+      for (InputIt it = begin; it != end; ++it)
+      {
+        if (_max_queue != 0)
+        {
+          while ((unsigned int)_q->size() >= _max_queue)
+          {
+            // Queue is full, so writer must block.  Wake readers for the
+            // items we've already pushed first, or they may never make space.
+            if ((unsignalled > 0) && (_readers > 0))
+            {
+              pthread_cond_broadcast(&_r_cond);
+            }
+            unsignalled = 0;
+
+            ++_writers;
+            _m.cond_wait(&_w_cond);
+            --_writers;
+          }
+        }
+
+        if ((tracking_service_time()) &&
+            (_q->empty()))
+        {
+          // See push().
+          clock_gettime(CLOCK_MONOTONIC, &_service_time);
+        }
+
+        _q->push_timestamped(*it, batch_stamp);
+        ++unsignalled;
+      }
+
+      // Are there any readers waiting?
+      if ((unsignalled > 0) && (_readers > 0))
+      {
+        if (unsignalled == 1)
+        {
+          pthread_cond_signal(&_r_cond);
+        }
+        else
+        {
+          pthread_cond_broadcast(&_r_cond);
+        }
+      }
+
+      rc = true;
+    }
+
+    _m.unlock();
+
+    return rc;
+  }
+
+  /// Construct an item from the arguments and push it on to the event queue.
+  /// This behaves in the same way as push().
+  template <class... Args>
+  bool emplace(Args&&... args)
+  {
+    return push(T(std::forward<Args>(args)...));
+  }
+
   /// Pop an item from the event queue, waiting indefinitely if it is empty.
   bool pop(T& item)
   {
-    pthread_mutex_lock(&_m);
+    if (_lock_free)
+    {
+      bool got_item;
+      return pop_lock_free(item, -1, got_item, nullptr, nullptr);
+    }
+
+    _m.lock();
 
     while ((_q->empty()) && (!_terminated))
     {
       // The queue is empty, so wait for something to arrive.
       ++_readers;
-      pthread_cond_wait(&_r_cond, &_m);
+      _m.cond_wait(&_r_cond);
       --_readers;
     }
 
-    if (!_q->empty())
+    Stamp item_stamp;
+    if (_q->try_pop_timestamped(item, item_stamp))
     {
-      // Something on the queue to receive.
-      item = _q->front();
-      _q->pop();
-
-      // Are there blocked writers?
+      // Something on the queue to receive.  Are there blocked writers?
       if ((_max_queue != 0) &&
           (_q->size() < _max_queue) &&
           (_writers > 0))
@@ -358,14 +1152,14 @@ public:
       }
     }
 
-    if (_deadlock_threshold > 0)
+    if (tracking_service_time())
     {
-      // Deadlock detection is enabled, so record the time we popped an
+      // Service time tracking is enabled, so record the time we popped an
       // item off the queue.
       clock_gettime(CLOCK_MONOTONIC, &_service_time);
     }
 
-    pthread_mutex_unlock(&_m);
+    _m.unlock();
 
     return !_terminated;
   }
@@ -376,8 +1170,219 @@ public:
   /// @param timeout Maximum time to wait in milliseconds.
   bool pop(T& item, int timeout)
   {
-    pthread_mutex_lock(&_m);
+    bool got_item;
+    return pop_internal(item, timeout, got_item, nullptr, nullptr);
+  }
+
+  /// Pop an item from the event queue if one arrives within the specified
+  /// timeout. Unlike pop(), the return code indicates whether an item was
+  /// actually received, so callers that wait with a finite timeout can tell
+  /// a timeout apart from a successful pop.
+  ///
+  /// @param timeout Maximum time to wait in milliseconds (0 => don't wait).
+  /// @param wait_us if non-null, set to how long (in microseconds) the item
+  ///                spent on the queue. This is zero unless timestamps have
+  ///                been enabled.
+  /// @param deadline_us if non-null, set to the item's deadline (zero if it
+  ///                    was pushed without one).
+  /// @return true if an item was received, false on timeout or termination.
+  bool try_pop(T& item,
+               int timeout,
+               unsigned long* wait_us = nullptr,
+               uint64_t* deadline_us = nullptr)
+  {
+    bool got_item;
+    pop_internal(item, timeout, got_item, wait_us, deadline_us);
+    return got_item;
+  }
+
+  /// Pop a batch of items from the event queue, waiting for the specified
+  /// timeout if the queue is empty.  Once there is at least one item on the
+  /// queue, this removes as many as it can (up to max_items) under a single
+  /// acquisition of the lock.
+  ///
+  /// @param items vector that the items are appended to.
+  /// @param max_items maximum number of items to remove.
+  /// @param timeout Maximum time to wait in milliseconds (-1 => no limit).
+  /// @param waits_us if non-null, how long (in microseconds) each item spent on
+  ///                 the queue is appended to this.  These are zero unless
+  ///                 timestamps have been enabled.
+  /// @param deadlines_us if non-null, each item's deadline is appended to this.
+  /// @return false if the queue has been terminated, true otherwise.
+  bool pop_batch(std::vector<T>& items,
+                 unsigned int max_items,
+                 int timeout = -1,
+                 std::vector<unsigned long>* waits_us = nullptr,
+                 std::vector<uint64_t>* deadlines_us = nullptr)
+  {
+    if (max_items == 0)
+    {
+      return !_terminated;
+    }
+
+    if (_lock_free)
+    {
+      T item;
+      bool got_item;
+      unsigned long wait_us = 0;
+      uint64_t deadline_us = 0;
+      bool rc = pop_lock_free(item, timeout, got_item, &wait_us, &deadline_us);
+
+      if (got_item)
+      {
+        items.push_back(std::move(item));
+        if (waits_us != nullptr)
+        {
+          waits_us->push_back(wait_us);
+        }
+        if (deadlines_us != nullptr)
+        {
+          deadlines_us->push_back(deadline_us);
+        }
+
+        unsigned int popped = 1;
+        Stamp item_stamp;
+        while ((popped < max_items) && (_q->try_pop_timestamped(item, item_stamp)))
+        {
+          items.push_back(std::move(item));
+          record_stamp(item_stamp, waits_us, deadlines_us);
+          ++popped;
+        }
+
+        if (popped > 1)
+        {
+          // pop_lock_free only woke one writer.  There may be space for more.
+          std::atomic_thread_fence(std::memory_order_seq_cst);
+
+          if (_writers > 0)
+          {
+            _m.lock();
+            pthread_cond_broadcast(&_w_cond);
+            _m.unlock();
+          }
+        }
+      }
+
+      return rc;
+    }
+
+    _m.lock();
+
+    wait_for_item(timeout);
+
+    unsigned int popped = 0;
+    T item;
+    Stamp item_stamp;
+    while ((popped < max_items) && (_q->try_pop_timestamped(item, item_stamp)))
+    {
+      items.push_back(std::move(item));
+      record_stamp(item_stamp, waits_us, deadlines_us);
+      ++popped;
+    }
+
+    if ((popped > 0) &&
+        (_max_queue != 0) &&
+        ((unsigned int)_q->size() < _max_queue) &&
+        (_writers > 0))
+    {
+      if (popped == 1)
+      {
+        pthread_cond_signal(&_w_cond);
+      }
+      else
+      {
+        pthread_cond_broadcast(&_w_cond);
+      }
+    }
+
+    if (tracking_service_time())
+    {
+      // Service time tracking is enabled, so record the time we popped an
+      // item off the queue.
+      clock_gettime(CLOCK_MONOTONIC, &_service_time);
+    }
 
+    _m.unlock();
+
+    return !_terminated;
+  }
+
+  /// Peek at the item at the front of the event queue.
+  T peek()
+  {
+    T item;
+    _m.lock();
+    if (!_q->empty())
+    {
+      item = _q->front();
+    }
+    _m.unlock();
+    return item;
+  }
+
+  int size() const
+  {
+    return _q->size();
+  }
+
+private:
+
+  // Common implementation of the timed pop methods.
+  //
+  // @param timeout Maximum time to wait in milliseconds.
+  // @param got_item Set to whether an item was removed from the queue.
+  // @param wait_us If non-null, set to how long the item spent on the queue.
+  // @param deadline_us If non-null, set to the item's deadline.
+  // @return false if the queue has been terminated, true otherwise.
+  bool pop_internal(T& item,
+                    int timeout,
+                    bool& got_item,
+                    unsigned long* wait_us,
+                    uint64_t* deadline_us)
+  {
+    if (_lock_free)
+    {
+      return pop_lock_free(item, timeout, got_item, wait_us, deadline_us);
+    }
+
+    got_item = false;
+
+    _m.lock();
+
+    wait_for_item(timeout);
+
+    Stamp item_stamp;
+    if (_q->try_pop_timestamped(item, item_stamp))
+    {
+      got_item = true;
+      report_stamp(item_stamp, wait_us, deadline_us);
+
+      if ((_max_queue != 0) &&
+          ((unsigned int)_q->size() < _max_queue) &&
+          (_writers > 0))
+      {
+        pthread_cond_signal(&_w_cond);
+      }
+    }
+
+    if (tracking_service_time())
+    {
+      // Service time tracking is enabled, so record the time we popped an
+      // item off the queue.
+      clock_gettime(CLOCK_MONOTONIC, &_service_time);
+    }
+
+    _m.unlock();
+
+    return !_terminated;
+  }
+
+  // Wait for the queue to be non-empty.  Must be called with the mutex held.
+  //
+  // @param timeout Maximum time to wait in milliseconds (-1 => no limit,
+  //                0 => don't wait).
+  void wait_for_item(int timeout)
+  {
     if ((_q->empty()) && (timeout != 0))
     {
       // The queue is empty and the timeout is non-zero, so wait for
@@ -402,7 +1407,7 @@ public:
         // The queue is empty, so wait for something to arrive.
         if (timeout != -1)
         {
-          int rc = pthread_cond_timedwait(&_r_cond, &_m, &attime);
+          int rc = _m.cond_timedwait(&_r_cond, &attime);
           if (rc == ETIMEDOUT)
           {
             break;
@@ -410,77 +1415,261 @@ public:
         }
         else
         {
-          pthread_cond_wait(&_r_cond, &_m);
+          _m.cond_wait(&_r_cond);
         }
       }
 
       --_readers;
     }
+  }
 
-    if (!_q->empty())
+  // Push implementation for lock-free backends. The element is pushed
+  // without taking the mutex, which is only needed to wake a parked reader,
+  // or to park this writer if the backend is full and we're allowed to block.
+  //
+  // The item is moved into the backend if the push succeeds.
+  bool push_lock_free(T& item, bool block, uint64_t deadline_us)
+  {
+    if (!_open)
     {
-      item = _q->front();
-      _q->pop();
+      return false;
+    }
 
-      if ((_max_queue != 0) &&
-          (_q->size() < _max_queue) &&
-          (_writers > 0))
+    Stamp item_stamp = stamp(deadline_us);
+
+    if (!_q->try_push_timestamped(std::move(item), item_stamp))
+    {
+      if (!block)
+      {
+        return false;
+      }
+
+      _m.lock();
+
+      // Register as a waiting writer before retrying, so that a reader that
+      // makes space after our retry is guaranteed to see us and signal.
+      ++_writers;
+
+      while (!_q->try_push_timestamped(std::move(item), item_stamp))
+      {
+        _m.cond_wait(&_w_cond);
+      }
+
+      --_writers;
+
+      _m.unlock();
+    }
+
+    // Pairs with the fence in pop_lock_free - either we see the reader's
+    // registration, or the reader sees our element when it retries.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (_readers > 0)
+    {
+      _m.lock();
+      pthread_cond_signal(&_r_cond);
+      _m.unlock();
+    }
+
+    if (tracking_service_time())
+    {
+      // We can't atomically tell whether the queue was empty before this
+      // push, so refresh the service time if there's only our element on it.
+      _m.lock();
+      if (_q->size() <= 1)
+      {
+        clock_gettime(CLOCK_MONOTONIC, &_service_time);
+      }
+      _m.unlock();
+    }
+
+    return true;
+  }
+
+  // Pop implementation for lock-free backends. The mutex is only taken to
+  // park this reader when the backend is empty, or to wake a parked writer.
+  //
+  // @param timeout Maximum time to wait in milliseconds (-1 => no limit).
+  // @param got_item Set to whether an item was removed from the queue.
+  // @param wait_us If non-null, set to how long the item spent on the queue.
+  // @param deadline_us If non-null, set to the item's deadline.
+  // @return false if the queue has been terminated, true otherwise.
+  bool pop_lock_free(T& item,
+                     int timeout,
+                     bool& got_item,
+                     unsigned long* wait_us,
+                     uint64_t* deadline_us)
+  {
+    Stamp item_stamp;
+    got_item = _q->try_pop_timestamped(item, item_stamp);
+
+    if ((!got_item) && (timeout != 0) && (!_terminated))
+    {
+      struct timespec attime;
+      if (timeout != -1)
       {
+        clock_gettime(CLOCK_MONOTONIC, &attime);
+        attime.tv_sec += timeout / 1000;
+        attime.tv_nsec += ((timeout % 1000) * 1000000);
+        if (attime.tv_nsec >= 1000000000)
+        {
+          attime.tv_nsec -= 1000000000;
+          attime.tv_sec += 1;
+        }
+      }
+
+      _m.lock();
+
+      // Register as a waiting reader before retrying, so that a writer that
+      // pushes after our retry is guaranteed to see us and signal.
+      ++_readers;
+
+      while ((!(got_item = _q->try_pop_timestamped(item, item_stamp))) &&
+             (!_terminated))
+      {
+        if (timeout != -1)
+        {
+          int rc = _m.cond_timedwait(&_r_cond, &attime);
+          if (rc == ETIMEDOUT)
+          {
+            got_item = _q->try_pop_timestamped(item, item_stamp);
+            break;
+          }
+        }
+        else
+        {
+          _m.cond_wait(&_r_cond);
+        }
+      }
+
+      --_readers;
+
+      _m.unlock();
+    }
+
+    if (got_item)
+    {
+      report_stamp(item_stamp, wait_us, deadline_us);
+
+      // Pairs with the fence in push_lock_free.
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+
+      if (_writers > 0)
+      {
+        _m.lock();
         pthread_cond_signal(&_w_cond);
+        _m.unlock();
       }
     }
 
-    if (_deadlock_threshold > 0)
+    if (tracking_service_time())
     {
-      // Deadlock detection is enabled, so record the time we popped an
-      // item off the queue.
+      _m.lock();
       clock_gettime(CLOCK_MONOTONIC, &_service_time);
+      _m.unlock();
     }
 
-    pthread_mutex_unlock(&_m);
-
     return !_terminated;
   }
 
-  /// Peek at the item at the front of the event queue.
-  T peek()
+  // The open and terminated flags, the reader and writer counts and the
+  // deadlock threshold are atomic as the lock-free paths read them without
+  // holding the mutex.
+  std::atomic<bool> _open;
+  unsigned int _max_queue;
+  eventq<T>::Backend* _q;
+  std::atomic<int> _writers;
+  std::atomic<int> _readers;
+  std::atomic<bool> _terminated;
+
+  // Whether the backend is lock-free, in which case push and pop use their
+  // lock-free fast paths.
+  bool _lock_free;
+
+  // Deadlock detection threshold (in milliseconds).  Zero means deadlock
+  // detection is disabled.
+  std::atomic<unsigned long> _deadlock_threshold;
+
+  // Whether service delay tracking has been enabled.
+  std::atomic<bool> _service_delay_tracking;
+
+  // Whether items are timestamped as they are pushed.
+  std::atomic<bool> _timestamps;
+
+  // Returns the stamp to push an item with.  The timestamp is zero (meaning
+  // no timestamp) if timestamps aren't enabled, which saves reading the clock.
+  Stamp stamp(uint64_t deadline_us) const
   {
-    T item;
-    pthread_mutex_lock(&_m);
-    if (!_q->empty())
+    return Stamp((_timestamps) ? timestamp_us() : 0, deadline_us);
+  }
+
+  // Report how long a popped item waited, and its deadline, to any non-null
+  // outputs.
+  static void report_stamp(const Stamp& item_stamp,
+                           unsigned long* wait_us,
+                           uint64_t* deadline_us)
+  {
+    if (wait_us != nullptr)
     {
-      item = _q->front();
+      *wait_us = wait_since(item_stamp.timestamp_us);
+    }
+
+    if (deadline_us != nullptr)
+    {
+      *deadline_us = item_stamp.deadline_us;
     }
-    pthread_mutex_unlock(&_m);
-    return item;
   }
 
-  int size() const
+  // As report_stamp(), but appending to vectors of waits and deadlines (if
+  // there are any).
+  static void record_stamp(const Stamp& item_stamp,
+                           std::vector<unsigned long>* waits_us,
+                           std::vector<uint64_t>* deadlines_us)
   {
-    return _q->size();
+    if (waits_us != nullptr)
+    {
+      waits_us->push_back(wait_since(item_stamp.timestamp_us));
+    }
+
+    if (deadlines_us != nullptr)
+    {
+      deadlines_us->push_back(item_stamp.deadline_us);
+    }
   }
 
-private:
+  // Returns a copy of a value.  The backends' copying push methods use this,
+  // so that they still compile when the element type is move-only (in which
+  // case elements can only be pushed by rvalue, and this is never called).
+  template <class U = T>
+  static typename std::enable_if<std::is_copy_constructible<U>::value, U>::type
+  copy_of(const T& value)
+  {
+    return value;
+  }
 
-  bool _open;
-  unsigned int _max_queue;
-  eventq<T>::Backend* _q;
-  int _writers;
-  int _readers;
-  bool _terminated;
+  template <class U = T>
+  static typename std::enable_if<!std::is_copy_constructible<U>::value, U>::type
+  copy_of(const T& /*value*/)
+  {
+    TRC_ERROR("Attempted to copy a move-only event queue element");
+    abort();
+  }
 
-  // Deadlock detection threshold (in milliseconds).  Zero means deadlock
-  // detection is disabled.
-  unsigned long _deadlock_threshold;
+  // Whether the service time needs to be maintained - either for deadlock
+  // detection or service delay tracking.
+  bool tracking_service_time() const
+  {
+    return ((_deadlock_threshold > 0) || (_service_delay_tracking));
+  }
 
   // The last time the queue was serviced (that is, an item was removed from
   // the queue).  Note that, to stop false positives after a period where
   // the queue is empty, the service time is reset whenever an item is placed
   // on to an empty queue.  Also, this field is only maintained when deadlock
-  // detection is enabled.
+  // detection or service delay tracking is enabled.
   struct timespec _service_time;
 
-  pthread_mutex_t _m;
+  ProfiledMutex _m;
   pthread_cond_t _w_cond;
   pthread_cond_t _r_cond;
 
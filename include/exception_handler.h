@@ -14,7 +14,9 @@
 
 #include <pthread.h>
 #include <setjmp.h>
+#include <sys/types.h>
 #include <atomic>
+#include <string>
 
 #include "health_checker.h"
 
@@ -35,7 +37,37 @@ public:
   /// Create a thread that kills the process after a random time
   void delayed_exit_thread();
 
+  /// Capture a compact minidump when an exception is hit, rather than forking
+  /// to dump a core file.  Forking a large process stalls all of its threads
+  /// while the page tables are copied, so instead this starts a small helper
+  /// process now, which writes the minidump on request while the process
+  /// carries on.  A minidump holds:
+  ///  - the stack of the thread that hit the exception
+  ///  - the name and state of every thread
+  ///  - the RAM trace buffers.
+  ///
+  /// This forks, so must be called early in startup, before any other
+  /// threads are started.
+  ///
+  /// @param directory where to write the minidumps.
+  /// @return whether the helper process was started.
+  bool enable_minidumps(const std::string& directory);
+
 private:
+  /// The most minidumps written by a process.
+  static const int MAX_MINIDUMPS = 10;
+
+  /// The most stack frames in a minidump.
+  static const int MAX_FRAMES = 64;
+
+  /// A request to the helper process to write a minidump.
+  struct MinidumpRequest
+  {
+    pid_t tid;
+    int num_frames;
+    void* frames[MAX_FRAMES];
+  };
+
   /// Called by a new thread when an exception is hit. Kills the
   /// process after a random time
   static void* delayed_exit_thread_func(void* det);
@@ -60,6 +92,22 @@ private:
   // won't dump another one (to avoid accidentally writing up lots of cores
   // simultaneously in the event of a systematic error).
   void dump_one_core();
+
+  // The socket to the minidump helper process (or -1 if minidumps aren't
+  // enabled), the helper's process ID and the number of minidumps requested.
+  int _minidump_fd;
+  pid_t _minidump_pid;
+  std::atomic<int> _minidumps;
+
+  // Ask the helper process for a minidump of the calling thread.  Like
+  // dump_one_core(), this must be async-signal-safe.
+  void request_minidump();
+
+  // Run by the helper process until the socket is closed.
+  static void minidump_helper(int fd, pid_t pid, const std::string& directory);
+  static void write_minidump(const MinidumpRequest& request,
+                             pid_t pid,
+                             const std::string& directory);
 };
 
 /// Stored environment
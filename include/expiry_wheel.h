@@ -0,0 +1,210 @@
+/**
+ * @file expiry_wheel.h  Hierarchical timer wheel for expiring cache entries.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef EXPIRY_WHEEL_H__
+#define EXPIRY_WHEEL_H__
+
+#include <time.h>
+
+#include <vector>
+
+/// Tracks when keys expire, to a granularity of one second, for caches that
+/// expire their entries in batches.
+///
+/// This is a hierarchical timer wheel.  The first level has a slot for each
+/// of the next 256 seconds, and each higher level has 64 slots that each
+/// cover all of the level below.  Adding a key is O(1), and each key is
+/// moved down at most once per level before it expires, so expiry is
+/// amortised O(1) per key.  Keys more than about two years in the future are
+/// kept in the last slot, and placed again when that slot is reached.
+///
+/// Keys aren't removed when their entry is updated or deleted, so a key may
+/// be in the wheel more than once.  The expiry time is returned with each
+/// expired key so that the cache can check it against the entry, and ignore
+/// keys that no longer apply.
+///
+/// This isn't thread-safe - the cache must protect it with its own lock.
+template <class K>
+class ExpiryWheel
+{
+public:
+  /// A key, and the time (in seconds since the epoch) at which it expires.
+  struct Item
+  {
+    time_t expiry;
+    K key;
+  };
+
+  ExpiryWheel() : _next(time(NULL)), _size(0) {}
+
+  /// Adds a key to expire at the given time.  If the time has already
+  /// passed, the key expires the next time the wheel is advanced.
+  void insert(time_t expiry, const K& key)
+  {
+    Item item = {expiry, key};
+    place(item);
+    ++_size;
+  }
+
+  /// @return whether advance() has any keys to return (or any time to pass)
+  ///         at the given time.  This is cheap, so can be checked on every
+  ///         lookup.
+  bool due(time_t now) const
+  {
+    return (now >= _next);
+  }
+
+  /// Moves the wheel on to the given time, appending all the keys that have
+  /// expired by then to `expired`.
+  void advance(time_t now, std::vector<Item>& expired)
+  {
+    if (_size == 0)
+    {
+      // Nothing to expire, so skip straight to the current time.
+      if (now >= _next)
+      {
+        _next = now + 1;
+      }
+      return;
+    }
+
+    while ((_next <= now) && (_size > 0))
+    {
+      int index = _next & (LEVEL0_SLOTS - 1);
+
+      // At the start of each turn of a level, move the keys in the next slot
+      // of the level above down into it.
+      if (index == 0)
+      {
+        for (int level = 1; level < NUM_LEVELS; ++level)
+        {
+          int slot = higher_slot(_next, level);
+          cascade(_higher[level - 1][slot]);
+
+          if (slot != 0)
+          {
+            break;
+          }
+        }
+      }
+
+      std::vector<Item>& slot = _level0[index];
+      _size -= slot.size();
+      expired.insert(expired.end(), slot.begin(), slot.end());
+      slot.clear();
+
+      ++_next;
+    }
+
+    if (_size == 0)
+    {
+      _next = now + 1;
+    }
+  }
+
+  /// @return the number of keys in the wheel.
+  size_t size() const { return _size; }
+
+  /// Removes all the keys.
+  void clear()
+  {
+    for (int ii = 0; ii < LEVEL0_SLOTS; ++ii)
+    {
+      _level0[ii].clear();
+    }
+
+    for (int level = 1; level < NUM_LEVELS; ++level)
+    {
+      for (int ii = 0; ii < HIGHER_SLOTS; ++ii)
+      {
+        _higher[level - 1][ii].clear();
+      }
+    }
+
+    _size = 0;
+  }
+
+private:
+  static const int LEVEL0_BITS = 8;
+  static const int LEVEL0_SLOTS = 1 << LEVEL0_BITS;
+  static const int HIGHER_BITS = 6;
+  static const int HIGHER_SLOTS = 1 << HIGHER_BITS;
+  static const int NUM_LEVELS = 4;
+
+  // The number of seconds covered by all the levels below `level`.
+  static time_t level_span(int level)
+  {
+    return (time_t)1 << (LEVEL0_BITS + (level - 1) * HIGHER_BITS);
+  }
+
+  // The slot that a time falls in at a level above the first.
+  static int higher_slot(time_t time, int level)
+  {
+    return (time >> (LEVEL0_BITS + (level - 1) * HIGHER_BITS)) & (HIGHER_SLOTS - 1);
+  }
+
+  // Puts an item in the slot for its expiry time.  The slots don't store the
+  // time, so they are picked from the item's expiry time relative to the next
+  // second to process.
+  void place(const Item& item)
+  {
+    time_t expiry = (item.expiry < _next) ? _next : item.expiry;
+    time_t delta = expiry - _next;
+
+    if (delta < LEVEL0_SLOTS)
+    {
+      _level0[expiry & (LEVEL0_SLOTS - 1)].push_back(item);
+      return;
+    }
+
+    for (int level = 1; level < NUM_LEVELS; ++level)
+    {
+      if (delta < level_span(level + 1))
+      {
+        _higher[level - 1][higher_slot(expiry, level)].push_back(item);
+        return;
+      }
+    }
+
+    // Too far in the future to place, so put it in the last slot to be
+    // reached, and place it again from there.
+    expiry = _next + level_span(NUM_LEVELS) - 1;
+    _higher[NUM_LEVELS - 2][higher_slot(expiry, NUM_LEVELS - 1)].push_back(item);
+  }
+
+  // Moves the items in a slot down to the levels below.  The slot swaps its
+  // memory with the scratch vector, so a wheel that has warmed up doesn't
+  // allocate.
+  void cascade(std::vector<Item>& slot)
+  {
+    _scratch.swap(slot);
+
+    for (typename std::vector<Item>::const_iterator i = _scratch.begin();
+         i != _scratch.end();
+         ++i)
+    {
+      place(*i);
+    }
+
+    _scratch.clear();
+  }
+
+  // The next second to process.  All the items that expire before it have
+  // been returned.
+  time_t _next;
+  size_t _size;
+
+  std::vector<Item> _level0[LEVEL0_SLOTS];
+  std::vector<Item> _higher[NUM_LEVELS - 1][HIGHER_SLOTS];
+  std::vector<Item> _scratch;
+};
+
+#endif
@@ -0,0 +1,147 @@
+/**
+ * @file fast_clock.h  Cheap monotonic and cached clocks.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef FAST_CLOCK_H__
+#define FAST_CLOCK_H__
+
+#include <stdint.h>
+#include <time.h>
+
+#include <atomic>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/// Clocks for measuring intervals and bucketing statistics that are cheaper
+/// to read than clock_gettime.
+///
+/// now_ns() reads the CPU's time stamp counter, scaled to nanoseconds, if the
+/// CPU has an invariant TSC (one that ticks at a constant rate on every core
+/// regardless of power state).  The scaling is calibrated against
+/// CLOCK_MONOTONIC during the first CALIBRATION_MS of the process, and
+/// CLOCK_MONOTONIC is used until then (and always if the TSC can't be used).
+/// The calibrated clock may drift from CLOCK_MONOTONIC by a few parts per
+/// million, so it is only suitable for measuring intervals.
+///
+/// The cached clocks are updated by a ticker thread (if one has been
+/// started), so reading them is just an atomic load.  Without the ticker they
+/// fall back to the kernel's coarse clocks.
+///
+/// In unit tests every clock is read with clock_gettime, so that tests can
+/// control time.
+namespace FastClock
+{
+  /// How long the TSC is calibrated over.
+  const uint64_t CALIBRATION_MS = 200;
+
+  // The state used to convert the TSC to nanoseconds, which doesn't change
+  // once `_tsc_calibrated` is set.
+  struct TscCalibration
+  {
+    uint64_t tsc0;
+    uint64_t ns0;
+
+    // Nanoseconds per tick, as a 32.32 fixed point number.
+    uint64_t mult;
+  };
+
+  extern std::atomic<bool> _tsc_calibrated;
+  extern TscCalibration _tsc_calibration;
+
+  // Reads CLOCK_MONOTONIC, calibrating the TSC if it's time to.
+  uint64_t _slow_now_ns();
+
+  /// @return the time on a monotonic clock, in nanoseconds.  The epoch is
+  ///         unspecified.
+  inline uint64_t now_ns()
+  {
+#if (defined(__x86_64__) && !defined(UNIT_TEST))
+    if (_tsc_calibrated.load(std::memory_order_acquire))
+    {
+      uint64_t ticks = __rdtsc() - _tsc_calibration.tsc0;
+      return _tsc_calibration.ns0 +
+             (uint64_t)(((unsigned __int128)ticks * _tsc_calibration.mult) >> 32);
+    }
+#endif
+
+    return _slow_now_ns();
+  }
+
+  /// @return the time on a monotonic clock, in microseconds.
+  inline uint64_t now_us()
+  {
+    return now_ns() / 1000;
+  }
+
+  extern std::atomic<bool> _ticker_running;
+  extern std::atomic<uint64_t> _cached_monotonic_us;
+  extern std::atomic<uint64_t> _cached_realtime_ms;
+
+  inline uint64_t _read_us(clockid_t clock)
+  {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+  }
+
+  /// @return the time on CLOCK_MONOTONIC in microseconds, accurate to the
+  ///         ticker interval (or to the kernel's coarse clock resolution if
+  ///         the ticker isn't running).
+  inline uint64_t cached_monotonic_us()
+  {
+#ifndef UNIT_TEST
+    if (_ticker_running.load(std::memory_order_relaxed))
+    {
+      return _cached_monotonic_us.load(std::memory_order_relaxed);
+    }
+#endif
+
+    return _read_us(CLOCK_MONOTONIC_COARSE);
+  }
+
+  /// @return the time on CLOCK_REALTIME in milliseconds, accurate to the
+  ///         ticker interval (or to the kernel's coarse clock resolution if
+  ///         the ticker isn't running).
+  inline uint64_t cached_realtime_ms()
+  {
+#ifndef UNIT_TEST
+    if (_ticker_running.load(std::memory_order_relaxed))
+    {
+      return _cached_realtime_ms.load(std::memory_order_relaxed);
+    }
+#endif
+
+    return _read_us(CLOCK_REALTIME_COARSE) / 1000;
+  }
+
+  /// Fills in `ts` with the time from cached_realtime_ms(), for code that
+  /// works with timespecs from CLOCK_REALTIME_COARSE.
+  inline void cached_realtime(struct timespec& ts)
+  {
+    uint64_t now_ms = cached_realtime_ms();
+    ts.tv_sec = now_ms / 1000;
+    ts.tv_nsec = (now_ms % 1000) * 1000000;
+  }
+
+  /// Start a thread that updates the cached clocks every `interval_ms`.
+  /// Does nothing if the ticker is already running.
+  void start_ticker(unsigned int interval_ms = 1);
+
+  /// Stop the ticker thread.  The cached clocks go back to reading the
+  /// coarse clocks.
+  void stop_ticker();
+
+  /// @return whether now_ns() is using the TSC.
+  bool using_tsc();
+}
+
+#endif
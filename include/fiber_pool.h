@@ -0,0 +1,145 @@
+/**
+ * @file fiber_pool.h  Runs functions as fibers on a few threads.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef FIBER_POOL_H__
+#define FIBER_POOL_H__
+
+#include <poll.h>
+#include <pthread.h>
+#include <ucontext.h>
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <map>
+#include <vector>
+
+/// Runs functions as fibers - each has its own stack, but they share a few
+/// threads.  A fiber that waits for a socket (with FiberPool::wait) gives up
+/// its thread until the socket is ready, and other fibers run meanwhile.  So
+/// code written in a blocking style, whose I/O goes through FiberPool::wait,
+/// can have many calls in progress without a thread for each.
+///
+/// Each thread waits for its fibers' sockets with epoll.  A fiber stays on the
+/// thread it started on.  Fibers are switched only when they wait, so code on
+/// a fiber mustn't block the thread any other way (for long), and mustn't hold
+/// a lock while it waits - another fiber on the same thread that tries to take
+/// the lock would block the thread forever.
+class FiberPool
+{
+public:
+  static const size_t DEFAULT_STACK_SIZE = 256 * 1024;
+
+  /// @param num_threads - The number of threads to run fibers on.
+  /// @param max_fibers  - The most fibers to run on each thread at once.
+  ///                      Further functions wait in a queue until a fiber
+  ///                      finishes.  0 => no limit.
+  /// @param stack_size  - The size of each fiber's stack.  The memory is
+  ///                      only used as the stack grows into it.
+  FiberPool(unsigned int num_threads,
+            unsigned int max_fibers = 0,
+            size_t stack_size = DEFAULT_STACK_SIZE);
+
+  /// Stops and joins the threads, if they are still running.
+  ~FiberPool();
+
+  /// Start the threads.
+  ///
+  /// @return whether the threads started.
+  bool start();
+
+  /// Stop the threads.  Functions that haven't started are discarded, and
+  /// each thread exits once its fibers have finished.
+  void stop();
+
+  /// Wait for the threads to exit.
+  void join();
+
+  /// Run a function on a fiber.  This doesn't block.
+  void run(std::function<void()> fn);
+
+  /// Wait until a socket is ready.  On a fiber, other fibers run meanwhile;
+  /// elsewhere, this just polls the socket.
+  ///
+  /// @param fd         - The socket.
+  /// @param events     - The events to wait for, as for poll (POLLIN and/or
+  ///                     POLLOUT).
+  /// @param timeout_ms - How long to wait for.
+  ///
+  /// @return the events that happened (which may include POLLERR or
+  ///         POLLHUP), or 0 if the wait timed out.
+  static short wait(int fd, short events, int timeout_ms);
+
+  /// @return whether the caller is running on a fiber.
+  static bool on_fiber();
+
+private:
+  struct Worker;
+
+  struct Fiber
+  {
+    ucontext_t context;
+    char* stack;
+    std::function<void()> fn;
+    Worker* worker;
+    bool finished;
+
+    // The socket the fiber is waiting for, and the events that woke it.
+    int fd;
+    short revents;
+    std::multimap<unsigned long, Fiber*>::iterator timer;
+  };
+
+  struct Worker
+  {
+    FiberPool* pool;
+    pthread_t thread;
+    int epoll_fd;
+    int event_fd;
+
+    // Functions waiting to run, protected by lock.
+    pthread_mutex_t lock;
+    std::deque<std::function<void()>> queue;
+
+    // The rest is only used by the worker's thread.
+    ucontext_t context;
+    std::deque<Fiber*> runnable;
+    std::multimap<unsigned long, Fiber*> timers;
+    std::vector<char*> free_stacks;
+    unsigned int num_fibers;
+  };
+
+  static void* worker_thread_fn(void* worker);
+  void worker_thread_fn(Worker* worker);
+  static void fiber_fn();
+
+  // Helpers for the worker threads.
+  void start_fibers(Worker* worker);
+  void wake(Fiber* fiber, short revents);
+  void finish_fiber(Worker* worker, Fiber* fiber);
+  char* allocate_stack(Worker* worker);
+
+  static unsigned long now_ms();
+
+  const unsigned int _num_threads;
+  const unsigned int _max_fibers;
+  const size_t _stack_size;
+
+  std::vector<Worker*> _workers;
+  std::atomic<unsigned int> _next_worker;
+  std::atomic<bool> _terminated;
+  bool _started;
+
+  // The fiber running on this thread, if any.
+  static thread_local Fiber* _current;
+};
+
+#endif
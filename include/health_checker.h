@@ -13,7 +13,14 @@
 #define HEALTH_CHECKER_H
 
 #include <atomic>
+#include <functional>
 #include <pthread.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "fast_clock.h"
 
 // Health-checking object which:
 //  - is notified when "healthy behaviour" happens (e.g. a 200 OK response)
@@ -21,12 +28,78 @@
 //  - checks every 60 seconds to see if an exception has been hit and
 //    no healthy behaviour has been seen since the last check, and
 //    aborts the process if so.
+//
+// It also decides whether the process is ready to take traffic (see
+// is_ready()), which load balancers can poll (e.g. through
+// HttpStackUtils::ReadinessHandler) to drain a degraded node before
+// requests to it time out.  The process isn't ready if:
+//  - a registered heartbeat has stalled - i.e. a worker thread or event loop
+//    has been busy with one thing for longer than its deadline
+//  - a registered latency source (such as a LoadMonitor's smoothed latency)
+//    is over its limit.
 class HealthChecker
 {
 public:
+  // Tracks whether a thread is making progress.  A worker calls beat() when
+  // it starts a piece of work and idle() when it waits for more, and an event
+  // loop calls beat() periodically (from a timer), so the thread has stalled
+  // if it's not idle and hasn't beaten within the deadline.  Both are just a
+  // relaxed atomic store of the cached time.
+  class Heartbeat
+  {
+  public:
+    void beat()
+    {
+      _busy_since_ms.store(FastClock::cached_monotonic_us() / 1000,
+                           std::memory_order_relaxed);
+    }
+
+    void idle()
+    {
+      _busy_since_ms.store(0, std::memory_order_relaxed);
+    }
+
+  private:
+    friend class HealthChecker;
+
+    Heartbeat(const std::string& name, unsigned int deadline_ms) :
+      _name(name),
+      _deadline_ms(deadline_ms),
+      _busy_since_ms(0)
+    {}
+
+    const std::string _name;
+    const unsigned int _deadline_ms;
+
+    // When the thread last started work or beat, or 0 if it is idle.
+    std::atomic<uint64_t> _busy_since_ms;
+  };
+
+  // Returns a latency in microseconds.
+  typedef std::function<uint64_t()> LatencySource;
+
   HealthChecker();
   virtual ~HealthChecker();
 
+  // Register a heartbeat for a thread, which must be unregistered before the
+  // HealthChecker is destroyed.
+  //
+  // @param name        describes the thread, for reporting stalls.
+  // @param deadline_ms how long the thread may be busy without beating
+  //                    before it counts as stalled.
+  Heartbeat* register_heartbeat(const std::string& name,
+                                unsigned int deadline_ms);
+  void unregister_heartbeat(Heartbeat* heartbeat);
+
+  // Report the process as not ready while a latency is over a limit.
+  void add_latency_check(const std::string& name,
+                         LatencySource source,
+                         uint64_t max_latency_us);
+
+  // Returns whether the process is ready to take traffic.  If not, `reason`
+  // is set to describe why.  This doesn't affect the exception checking.
+  bool is_ready(std::string& reason);
+
   // Virtual for mocking in UT
   virtual void health_check_passed();
   void hit_exception();
@@ -38,6 +111,19 @@ public:
   void main_thread_function();
   
 private:
+  struct LatencyCheck
+  {
+    std::string name;
+    LatencySource source;
+    uint64_t max_latency_us;
+  };
+
+  // The heartbeats and latency checks, protected by _signals_lock.  These
+  // are only read by is_ready(), so a lock is fine.
+  std::vector<Heartbeat*> _heartbeats;
+  std::vector<LatencyCheck> _latency_checks;
+  pthread_mutex_t _signals_lock;
+
   std::atomic_int _recent_passes;
   std::atomic_bool _hit_exception;
   std::atomic_bool _terminate;
@@ -0,0 +1,53 @@
+/**
+ * @file hedge_monitor.h
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef HEDGE_MONITOR_H__
+#define HEDGE_MONITOR_H__
+
+#include <stdint.h>
+
+#include <atomic>
+
+/// @class HedgeMonitor
+///
+/// Counts hedged requests - extra copies of a request sent to another peer
+/// because the first peer hasn't answered within the usual time - and how
+/// often the extra copy gets the answer first.
+///
+///   - whenever an entity sends a hedged request, the inform_hedge_sent()
+///     method should be called
+///
+///   - whenever the answer comes from a hedged request rather than the
+///     original one, the inform_hedge_won() method should be called
+class HedgeMonitor
+{
+public:
+  HedgeMonitor() : _sent(0), _won(0) {}
+  virtual ~HedgeMonitor() {}
+
+  /// Report that a hedged request was sent.
+  virtual void inform_hedge_sent() { ++_sent; }
+
+  /// Report that a hedged request answered first.
+  virtual void inform_hedge_won() { ++_won; }
+
+  /// @return the number of hedged requests sent.
+  uint64_t hedges_sent() const { return _sent; }
+
+  /// @return the number of hedged requests that answered first.
+  uint64_t hedges_won() const { return _won; }
+
+private:
+  std::atomic<uint64_t> _sent;
+  std::atomic<uint64_t> _won;
+};
+
+#endif
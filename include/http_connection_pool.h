@@ -16,6 +16,7 @@
 #include <curl/curl.h>
 
 #include "load_monitor.h"
+#include "latency_histogram.h"
 #include "snmp_ip_count_table.h"
 #include "connection_pool.h"
 
@@ -59,8 +60,49 @@ public:
   {
     // This call is important to properly destroy the connection pool
     destroy_connection_pool();
+    pthread_mutex_destroy(&_sockets_lock);
+
+    for (std::pair<const AddrInfo, TargetTimeouts*>& entry : _target_timeouts)
+    {
+      pthread_mutex_destroy(&entry.second->update_lock);
+      delete entry.second;
+    }
+
+    pthread_rwlock_destroy(&_timeouts_lock);
   }
 
+  // Switches the pool into HTTP/2 mode, where the CURL handles' connections
+  // are shared (by the multi handles that the handles are added to), so the
+  // statistic counts TCP connections rather than CURL handles. This must be
+  // called before the pool is used.
+  void set_http2(bool http2);
+
+  /// Derives each target's timeouts from the latencies of its recent
+  /// requests, so that a target that normally answers quickly is given up on
+  /// sooner when it gets stuck.  The request and connect timeouts are each
+  /// the 99th percentile latency of the target's recent requests (or
+  /// connection attempts) times `multiplier`, but no less than the minimum
+  /// and no more than the pool's fixed timeouts.  Targets use the fixed
+  /// timeouts until they have enough recent requests to go on.  This must be
+  /// called before the pool is used.
+  ///
+  /// @param multiplier             - The multiple of the 99th percentile to
+  ///                                 allow.  0 turns adaptive timeouts off
+  ///                                 (the default).
+  /// @param min_timeout_ms         - The shortest request timeout.
+  /// @param min_connect_timeout_ms - The shortest connect timeout.
+  void set_adaptive_timeouts(float multiplier,
+                             long min_timeout_ms,
+                             long min_connect_timeout_ms);
+
+  /// Sets the timeouts for a request to a target on one of the pool's
+  /// connections.
+  void set_request_timeouts(CURL* conn, const AddrInfo& target);
+
+  /// Records the latency of a request to a target (whether it succeeded or
+  /// not), and how long it took to connect if it opened a new connection.
+  void request_completed(CURL* conn, const AddrInfo& target, uint64_t latency_us);
+
 protected:
   CURL* create_connection(AddrInfo target) override;
 
@@ -87,7 +129,7 @@ protected:
   long calc_req_timeout_from_latency(int latency_us);
 
   // Callbacks that are uses when the user has specified that connections be
-  // made from a specific source address.
+  // made from a specific source address (and in HTTP/2 mode, see below).
   //
   // cURL allows the user to specify a callback that is called when cURL needs a
   // socket to connect with. If a source address is specified, we implement this
@@ -102,6 +144,59 @@ protected:
   curl_socket_t open_socket(curlsocktype purpose,
                             struct curl_sockaddr *address);
 
+  // Binds a socket to the source address, returning whether it succeeded.
+  bool bind_to_source_address(int fd, struct curl_sockaddr *address);
+
+  // Callbacks used in HTTP/2 mode to count the TCP connections to each target,
+  // as connections aren't tied to a single CURL handle. The IP address of
+  // each open socket is stored in _socket_ips, under _sockets_lock.
+  static int close_socket_fn(void* clientp, curl_socket_t fd);
+  int close_socket(curl_socket_t fd);
+
   std::string _source_address;
+  bool _http2;
+  pthread_mutex_t _sockets_lock;
+  std::map<curl_socket_t, std::string> _socket_ips;
+
+  // A target's recent latencies, and the timeouts derived from them.  The
+  // timeouts are recalculated from the latencies recorded since the last
+  // calculation, once there are enough of them.
+  struct TargetTimeouts
+  {
+    TargetTimeouts(long timeout_ms, long connect_timeout_ms);
+
+    LatencyHistogram latency;
+    LatencyHistogram connect_latency;
+
+    std::atomic<long> timeout_ms;
+    std::atomic<long> connect_timeout_ms;
+    std::atomic<uint64_t> next_update_ms;
+
+    // The histograms when the timeouts were last calculated, protected by
+    // update_lock.
+    pthread_mutex_t update_lock;
+    LatencyHistogram::Snapshot latency_base;
+    LatencyHistogram::Snapshot connect_latency_base;
+  };
+
+  // Returns a target's timeouts, creating them if this is its first request.
+  TargetTimeouts* target_timeouts(const AddrInfo& target);
+
+  // Recalculates a target's timeouts if it's time to.
+  void update_timeouts(TargetTimeouts* timeouts);
+  void update_timeout(const LatencyHistogram& latency,
+                      LatencyHistogram::Snapshot& base,
+                      long min_timeout_ms,
+                      long max_timeout_ms,
+                      std::atomic<long>& timeout_ms);
+
+  // Adaptive timeout settings (see set_adaptive_timeouts), and each target's
+  // timeouts.  Targets are added when they are first used, and never
+  // removed.
+  float _adaptive_multiplier;
+  long _min_timeout_ms;
+  long _min_connect_timeout_ms;
+  pthread_rwlock_t _timeouts_lock;
+  std::map<AddrInfo, TargetTimeouts*> _target_timeouts;
 };
 #endif
@@ -21,16 +21,67 @@ public:
                const std::string& body,
                const std::map<std::string, std::string>& headers);
 
+  HttpResponse(HTTPCode return_code,
+               std::string&& body,
+               std::map<std::string, std::string>&& headers);
+
   virtual ~HttpResponse();
 
   virtual HTTPCode get_rc();
-  virtual std::string get_body();
-  virtual std::map<std::string, std::string> get_headers();
+  virtual const std::string& get_body() const;
+  virtual const std::map<std::string, std::string>& get_headers() const;
+
+  // Move the body or headers out of the response, leaving them empty.
+  virtual std::string take_body();
+  virtual std::map<std::string, std::string> take_headers();
 
 private:
+  // HttpClient requires access to the constructor that takes unparsed headers
+  friend class HttpClient;
+
+  // Create a response whose headers are parsed when they are first asked
+  // for, as most callers don't look at them. The tag distinguishes this from
+  // the public constructors.
+  struct RawHeaders {};
+  HttpResponse(HTTPCode return_code,
+               std::string&& body,
+               std::string&& raw_headers,
+               RawHeaders);
+
+  void parse_headers() const;
+
   HTTPCode _rc;
   std::string _body;
-  std::map<std::string, std::string> _headers;
+
+  // The headers are parsed from _raw_headers on first use, so these are
+  // updated by the const accessors. This means that a response mustn't be
+  // accessed from several threads at once.
+  mutable std::map<std::string, std::string> _headers;
+  mutable std::string _raw_headers;
+  mutable bool _headers_parsed;
+};
+
+// A set of headers that is added to many requests, such as all the requests
+// created by an HttpConnection. The list of headers that cURL sends is built
+// once, when the template is created, and is then shared (read-only) by all
+// the requests that use the template, rather than being rebuilt for each one.
+class HttpRequestTemplate
+{
+public:
+  HttpRequestTemplate(const std::vector<std::string>& headers);
+  ~HttpRequestTemplate();
+
+  HttpRequestTemplate(const HttpRequestTemplate&) = delete;
+  HttpRequestTemplate& operator=(const HttpRequestTemplate&) = delete;
+
+  const std::vector<std::string>& get_headers() const { return _headers; }
+
+private:
+  // HttpClient requires access to the header list
+  friend class HttpClient;
+
+  std::vector<std::string> _headers;
+  struct curl_slist* _header_list;
 };
 
 class HttpRequest
@@ -63,16 +114,47 @@ public:
 
   // SET methods will overwrite any previous settings
   HttpRequest& set_body(const std::string& body);
+  HttpRequest& set_body(std::string&& body);
   HttpRequest& set_sas_trail(SAS::TrailId trail);
   HttpRequest& set_allowed_host_state(int allowed_host_state);
   HttpRequest& set_username(const std::string& username);
 
+  // Write the response body straight into the supplied buffer, rather than
+  // into the HttpResponse (whose body is then empty). The buffer's capacity
+  // is reused, so this avoids reallocating when the same buffer is used for
+  // many requests. For asynchronous requests, the buffer must exist until
+  // the callback is called.
+  HttpRequest& set_response_buffer(std::string* buffer);
+
+  // Send the body straight from the caller's memory, rather than copying it.
+  // The memory must exist until the request completes (for asynchronous
+  // requests, until the callback is called).
+  HttpRequest& set_body_buffer(const char* data, size_t length);
+
+  // Read the body from the provider as it is sent, rather than building it
+  // in memory first. If the size of the body isn't known, pass -1 and the
+  // body is sent with chunked encoding. Once the provider has been called,
+  // the request can't be tried again to another target, and requests with
+  // providers aren't hedged. The provider is copied, so anything it refers
+  // to must exist until the request completes.
+  HttpRequest& set_body_provider(HttpClient::BodyProvider provider,
+                                 long long size = -1);
+
+  // Add the template's headers to the request (as well as any added with
+  // add_header). The template is shared, so may be used by many requests at
+  // once.
+  HttpRequest& set_template(std::shared_ptr<const HttpRequestTemplate> request_template);
+
   // ADD methods
   HttpRequest& add_header(const std::string& header);
 
   // Sends the request and populates ret code, recv headers, and recv body
   HttpResponse send();
 
+  // Sends the request without blocking. The callback is passed the response
+  // once it has been received (see HttpClient::ResponseCallback).
+  void send_async(HttpClient::ResponseCallback callback);
+
 private:
   // member variables for storing the request information pre and post send
   std::string _server;
@@ -84,8 +166,14 @@ private:
 
   std::string _username;
   std::string _body;
+  const char* _body_data = NULL;
+  size_t _body_length = 0;
+  HttpClient::BodyProvider _body_provider;
+  long long _body_size = -1;
   std::vector<std::string> _headers;
   int _allowed_host_state = BaseResolver::ALL_LISTS;
+  std::string* _response_buffer = NULL;
+  std::shared_ptr<const HttpRequestTemplate> _template;
 };
 
 #endif
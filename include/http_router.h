@@ -0,0 +1,138 @@
+/**
+ * @file http_router.h  Maps request paths to the handlers registered for them.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef HTTP_ROUTER_H__
+#define HTTP_ROUTER_H__
+
+#include <regex.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+/// Finds which of a set of routes matches a request's path. Each route is
+/// identified by the order it was added in (0, 1, 2, ...), and if several
+/// routes match a path, the one that was added first wins.
+///
+/// Routes are stored in a trie of path segments, so finding a route takes time
+/// proportional to the length of the path rather than the number of routes.
+/// A route's segments are either literal, or parameters that match any
+/// segment. Regexes that can't be expressed as segments are compiled and
+/// tried in turn (like libevhtp's regex callbacks), but only if they were
+/// added before the best route in the trie.
+///
+/// Routes must all be added before the router is used. After that, it isn't
+/// changed, so can be used by several threads at once.
+class HttpRouter
+{
+public:
+  /// The names and (unescaped) values of the parameters in a matched path.
+  /// Parameters from regexes have no name.
+  typedef std::vector<std::pair<std::string, std::string>> Params;
+
+  static const int NO_MATCH = -1;
+
+  HttpRouter();
+  ~HttpRouter();
+
+  /// Adds a route whose segments are either literal or of the form "{name}",
+  /// which matches any non-empty segment, e.g. "/impi/{impi}/av".
+  ///
+  /// @return the route's ID, or NO_MATCH if the route isn't valid.
+  int add_route(const std::string& route);
+
+  /// Adds a POSIX extended regex, which matches any path that it matches part
+  /// of. Regexes that are anchored at both ends and whose segments are either
+  /// literal or match a whole segment ("[^/]*" or "[^/]+", optionally
+  /// bracketed), such as "^/impi/[^/]*/av$", are stored in the trie.
+  ///
+  /// @return the route's ID, or NO_MATCH if the regex can't be compiled.
+  int add_regex(const std::string& regex);
+
+  /// Finds the first route added that matches the path (which must not
+  /// include the query string).
+  ///
+  /// @param path   the path to match.
+  /// @param params filled in with the route's parameters.
+  /// @return the matching route's ID, or NO_MATCH if no route matches.
+  int match(const std::string& path, Params& params) const;
+
+private:
+  // A segment of a route.
+  struct Segment
+  {
+    enum Type {LITERAL, PARAM, OPTIONAL_PARAM} type;
+
+    // The literal text, or the name of a parameter.
+    std::string value;
+  };
+
+  // A node in the trie, reached by matching each segment of a route in turn.
+  // A parameter segment matches any non-empty segment, and an optional one
+  // matches any segment (including an empty one).
+  struct Node
+  {
+    Node() : id(NO_MATCH) {}
+
+    std::map<std::string, std::unique_ptr<Node>> literals;
+    std::unique_ptr<Node> param;
+    std::unique_ptr<Node> optional_param;
+
+    // The first route that ends at this node, and the names of its
+    // parameters.
+    int id;
+    std::vector<std::string> param_names;
+  };
+
+  // A regex that couldn't be added to the trie.
+  struct RegexRoute
+  {
+    int id;
+    regex_t regex;
+  };
+
+  // Adds a route of the specified segments to the trie.
+  void add_segments(const std::vector<Segment>& segments, int id);
+
+  // Parses a regex that can be stored in the trie into its segments, returning
+  // false if it can't be.
+  static bool parse_simple_regex(const std::string& regex,
+                                 std::vector<Segment>& segments);
+
+  // Matches the rest of the path, from the segment starting at `start`,
+  // against the node's children. This records the node of the earliest route
+  // that matches in `best`, and its parameter values (as the offset and length
+  // of each in the path) in best_values.
+  void match_node(const Node* node,
+                  const std::string& path,
+                  size_t start,
+                  std::vector<std::pair<size_t, size_t>>& values,
+                  const Node*& best,
+                  std::vector<std::pair<size_t, size_t>>& best_values) const;
+
+  // Records the node's route as the best match if it's the earliest so far.
+  static void match_route(const Node* node,
+                          const std::vector<std::pair<size_t, size_t>>& values,
+                          const Node*& best,
+                          std::vector<std::pair<size_t, size_t>>& best_values);
+
+  Node _root;
+  std::vector<RegexRoute*> _regexes;
+  int _next_id;
+
+  // Don't implement the following, to avoid copies of this instance.
+  HttpRouter(HttpRouter const&);
+  void operator=(HttpRouter const&);
+};
+
+#endif
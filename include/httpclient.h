@@ -12,21 +12,26 @@
 #pragma once
 
 #include <map>
+#include <set>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <pthread.h>
 
 #include <curl/curl.h>
 #include <sas.h>
 
-#include <boost/uuid/uuid.hpp>
-#include <boost/uuid/uuid_io.hpp>
-#include <boost/uuid/uuid_generators.hpp>
-
 #include "utils.h"
 #include "httpresolver.h"
 #include "load_monitor.h"
 #include "sasevent.h"
 #include "communicationmonitor.h"
 #include "snmp_ip_count_table.h"
+#include "snmp_counter_table.h"
 #include "http_connection_pool.h"
+#include "retry_budget.h"
+#include "single_flight.h"
 
 typedef long HTTPCode;
 static const long HTTP_OK = 200;
@@ -56,6 +61,9 @@ static const std::string BODY_OMITTED = "\r\n\r\n<Body present but not logged>";
 // the .cpp file.
 class HttpRequest;
 class HttpResponse;
+class HttpRequestTemplate;
+class FunctorThreadPool;
+class ExceptionHandler;
 
 /// Issues HTTP requests, supporting round-robin DNS load balancing.
 ///
@@ -66,6 +74,8 @@ public:
   friend class HttpConnectionPool;
   // HttpRequest requires access to the private send_request function
   friend class HttpRequest;
+  // HttpResponse requires access to the private parse_headers function
+  friend class HttpResponse;
 
   HttpClient(bool assert_user,
              HttpResolver* resolver,
@@ -89,11 +99,166 @@ public:
 
   static size_t string_store(void* ptr, size_t size, size_t nmemb, void* stream);
   static void cleanup_curl(void* curlptr);
-  static void cleanup_uuid(void* uuid_gen);
 
   /// Enum of HTTP request types, used when calling into send_request.
   enum struct RequestType {DELETE, PUT, POST, GET};
 
+  /// Callback that receives the response to an asynchronous request. It is
+  /// called on one of the client's I/O threads (or on the sending thread if
+  /// the request's URL is invalid), so it mustn't block.
+  typedef std::function<void(HttpResponse)> ResponseCallback;
+
+  /// Supplies the body of a request as it is sent. It is passed a buffer and
+  /// its size, and should copy up to that many bytes of the body into the
+  /// buffer, returning the number copied. It should return 0 at the end of
+  /// the body, or BODY_ABORT to fail the request. It is called on the thread
+  /// that sends the request (one of the I/O threads for an asynchronous
+  /// request).
+  typedef std::function<size_t(char* buffer, size_t size)> BodyProvider;
+  static const size_t BODY_ABORT = CURL_READFUNC_ABORT;
+
+  /// The default number of I/O threads used for asynchronous requests.
+  static const unsigned int DEFAULT_ASYNC_IO_THREADS = 1;
+
+  /// Sets the number of I/O threads used to send asynchronous requests. This
+  /// has no effect once the first asynchronous request has been sent.
+  void set_async_io_threads(unsigned int num_threads);
+
+  /// Moves traffic away from servers that report (in the
+  /// LoadMonitor::LOAD_HEADER header) that they are overloaded, before they
+  /// start rejecting requests. A server that reports a load of `threshold`
+  /// or more is blacklisted for `blacklist_s` seconds, so is only used if no
+  /// others are available. A threshold of 0 (the default) turns this off.
+  void set_peer_overload_threshold(float threshold, int blacklist_s)
+  {
+    _peer_overload_threshold = threshold;
+    _peer_overload_blacklist_s = blacklist_s;
+  }
+
+  /// Limits retries (after 503s, timeouts and I/O errors) to those allowed by
+  /// a retry budget, which may be shared with other clients of the same
+  /// tier.  A request whose retry is denied fails with the response to its
+  /// last attempt.  The extra request sent to hedge a request isn't limited,
+  /// but its retries are.  This should be called before the client is used.
+  void set_retry_budget(RetryBudget* budget)
+  {
+    _retry_budget = budget;
+  }
+
+  /// Turns coalesced GETs on or off (they are off by default).  When they
+  /// are on, a GET sent with HttpRequest::send that is identical (in its
+  /// URL, user and headers) to one already in flight waits for that GET and
+  /// shares its response, rather than being sent itself.  Only the GET that
+  /// is sent is logged to SAS.  GETs whose response is written to a buffer
+  /// set with HttpRequest::set_response_buffer aren't coalesced.
+  void set_coalesced_gets(bool enabled)
+  {
+    _coalesced_gets = enabled;
+  }
+
+  /// Get the counts of GETs sent and shared by coalesced GETs.
+  void coalesced_get_stats(SingleFlightStats& stats) const
+  {
+    _get_coalescer.stats(stats);
+  }
+
+  /// Derives each server's request and connect timeouts from its recent
+  /// latencies (see HttpConnectionPool::set_adaptive_timeouts), so that a
+  /// server that gets stuck is given up on sooner.  This should be called
+  /// before the client is used.
+  void set_adaptive_timeouts(float multiplier,
+                             long min_timeout_ms,
+                             long min_connect_timeout_ms)
+  {
+    _conn_pool.set_adaptive_timeouts(multiplier,
+                                     min_timeout_ms,
+                                     min_connect_timeout_ms);
+  }
+
+  /// Options for sending requests over HTTP/2.
+  struct Http2Options
+  {
+    Http2Options() :
+      max_concurrent_streams(100),
+      max_connections_per_target(1),
+      stream_stat_table(NULL)
+    {
+    }
+
+    /// The maximum number of requests in progress on each connection.
+    long max_concurrent_streams;
+
+    /// The maximum number of connections to each target from each I/O
+    /// thread. Requests beyond the connections' stream limits wait for a
+    /// stream to become free.
+    long max_connections_per_target;
+
+    /// Table counting the requests in progress to each IP address (may be
+    /// null).
+    SNMP::IPCountTable* stream_stat_table;
+  };
+
+  /// Sends requests over HTTP/2, with each target's requests multiplexed as
+  /// streams on a small number of connections. Synchronous requests are then
+  /// also sent by the I/O threads (the calling thread waits for the
+  /// response), so they share these connections, and the connection
+  /// statistics count TCP connections rather than CURL handles.
+  ///
+  /// HTTP requests are sent with HTTP/2 prior knowledge (h2c), and HTTPS
+  /// requests negotiate HTTP/2 with ALPN. This must be called before any
+  /// requests are sent.
+  void enable_http2(const Http2Options& options);
+
+  /// Options for hedging requests.
+  struct HedgingOptions
+  {
+    HedgingOptions() :
+      percentile(95),
+      hedges_fired_table(NULL),
+      hedges_won_table(NULL)
+    {
+    }
+
+    /// The percentile of response latency after which a request that hasn't
+    /// completed is hedged.
+    double percentile;
+
+    /// Tables counting the hedged requests sent, and the hedged requests
+    /// whose response was used (either may be null).
+    SNMP::CounterTable* hedges_fired_table;
+    SNMP::CounterTable* hedges_won_table;
+  };
+
+  /// Hedges idempotent (GET, PUT and DELETE) requests. If a request hasn't
+  /// completed within the configured percentile of response latency, it is
+  /// also sent to the next target, and whichever response arrives first is
+  /// used. Each request is hedged at most once.
+  ///
+  /// The delay is derived from the load monitor's smoothed latency, so this
+  /// has no effect if the client has no load monitor. Hedged requests are
+  /// sent by the I/O threads (synchronous ones too, with the calling thread
+  /// waiting for the response). This must be called before any requests are
+  /// sent.
+  void enable_hedging(const HedgingOptions& options);
+
+  /// The default number of HTTP messages that can wait to be logged to SAS
+  /// when SAS logging is deferred.
+  static const unsigned int DEFAULT_SAS_LOG_QUEUE = 1000;
+
+  /// Logs HTTP messages to SAS on a pool of worker threads, rather than on
+  /// the thread that completes the request. The message is handed over
+  /// without copying it, and the worker obscures the body (if required) and
+  /// builds and reports the event, so request latency doesn't depend on the
+  /// size of the messages. Only the addresses and ports (which are read from
+  /// the cURL handle) are gathered up front.
+  ///
+  /// If the workers fall behind by more than max_queue messages, logging
+  /// blocks until they catch up. This must be called before any requests are
+  /// sent.
+  void enable_deferred_sas_logging(unsigned int num_threads,
+                                   ExceptionHandler* exception_handler,
+                                   unsigned int max_queue = DEFAULT_SAS_LOG_QUEUE);
+
 private:
 
   /// Class used to record HTTP transactions.
@@ -122,6 +287,159 @@ private:
     int record_data(curl_infotype type, char *data, size_t size);
   };
 
+  /// The body of a request. This is either a buffer, which isn't copied so
+  /// must outlive the request, or a provider (if `provider` is set), which
+  /// is called to read the body as it's sent.
+  struct RequestBody
+  {
+    RequestBody() : data(NULL), length(0), size(-1) {}
+    RequestBody(const char* data, size_t length) :
+      data(data), length(length), size(-1) {}
+
+    bool empty() const { return (!provider) && (length == 0); }
+
+    const char* data;
+    size_t length;
+    BodyProvider provider;
+
+    // The size of the provider's body, or -1 if it isn't known (in which
+    // case the body is sent with chunked encoding).
+    long long size;
+  };
+
+  /// The state of a request that is being sent, which is carried across the
+  /// attempts to send it to each target.
+  struct RequestState
+  {
+    RequestState(RequestType request_type,
+                 const std::string& url,
+                 const RequestBody& body,
+                 const std::string& username,
+                 SAS::TrailId trail,
+                 const std::vector<std::string>& headers_to_add,
+                 std::string* doc,
+                 std::map<std::string, std::string>* response_headers,
+                 std::string* raw_headers,
+                 int allowed_host_state);
+    ~RequestState();
+
+    // The request.
+    RequestType request_type;
+    std::string url;
+    RequestBody body;
+    std::string username;
+    SAS::TrailId trail;
+    std::vector<std::string> headers_to_add;
+    std::shared_ptr<const HttpRequestTemplate> request_template;
+    int allowed_host_state;
+    std::string method_str;
+    std::string uuid_str;
+    std::string scheme;
+    std::string host;
+    int port;
+    std::string path;
+    bool host_is_ip;
+    bool async;
+
+    // The body of an asynchronous request is copied here if the caller
+    // doesn't own it. body_read is set once a provider has been read from,
+    // after which the body can't be sent to another target.
+    std::string own_body;
+    bool body_read;
+
+    // Where the response is stored. doc and raw_headers point at the
+    // caller's storage for synchronous requests (and doc does for
+    // asynchronous ones with a response buffer), and at own_doc and
+    // own_raw_headers otherwise. The headers are stored unparsed as they are
+    // received, and are only parsed into response_headers (if the caller
+    // supplied it) when the request completes.
+    std::string* doc;
+    std::map<std::string, std::string>* response_headers;
+    std::string* raw_headers;
+    std::string own_doc;
+    std::string own_raw_headers;
+
+    // The targets, and the outcome of the attempts so far.
+    BaseAddrIterator* target_it;
+    AddrInfo target;
+    int attempts;
+    int num_http_503_responses;
+    int num_http_504_responses;
+    int num_timeouts_or_io_errors;
+    CURLcode rc;
+    HTTPCode http_code;
+
+    // The headers, which are built once for all the attempts. The list starts
+    // with the headers that are specific to this request, and ends with
+    // shared headers (from the request template) that belong to someone
+    // else, so only the nodes up to extra_headers_end are freed.
+    struct curl_slist* extra_headers;
+    struct curl_slist* extra_headers_end;
+
+    // The current attempt.
+    std::unique_ptr<ConnectionHandle<CURL*>> conn_handle;
+    CURL* curl;
+    const char* remote_ip;
+    char remote_ip_buf[100];
+    curl_slist* host_resolve;
+    curl_slist* connect_to;
+    void* host_context;
+    Recorder recorder;
+    char errbuf[CURL_ERROR_SIZE];
+    SAS::Timestamp req_timestamp;
+    struct timespec sent_time;
+
+    // The callback for an asynchronous request.
+    ResponseCallback callback;
+
+    // Hedging. If the request hasn't completed by its hedge timer, a second
+    // RequestState (`hedge`) is sent to the next target. The hedge points
+    // back at the request with `hedge_primary`, and shares its targets.
+    // `finished` is set on either of them when its attempts have failed but
+    // the other's are still in progress.
+    bool hedgeable;
+    bool hedge_fired;
+    RequestState* hedge;
+    RequestState* hedge_primary;
+    bool finished;
+    bool hedge_timer_set;
+    std::multimap<unsigned long, RequestState*>::iterator hedge_timer;
+  };
+
+  /// A thread that drives a curl_multi handle to send asynchronous requests.
+  /// New requests are passed to the thread on its queue, and it is woken by
+  /// writing to its pipe.
+  struct AsyncIoThread
+  {
+    AsyncIoThread(HttpClient* client);
+    ~AsyncIoThread();
+
+    HttpClient* client;
+    CURLM* multi;
+    int wakeup_pipe[2];
+    pthread_t thread;
+    bool running;
+
+    // Protected by lock.
+    pthread_mutex_t lock;
+    std::deque<RequestState*> queue;
+    bool terminate;
+
+    // Only accessed on the thread. In HTTP/2 mode, the number of streams in
+    // use to each target is tracked, and attempts that would exceed the
+    // stream limit wait until a stream is free. `connected` holds the targets
+    // whose last request succeeded, so have a connection that is set up.
+    std::map<CURL*, RequestState*> in_flight;
+    std::map<AddrInfo, unsigned int> streams;
+    std::map<AddrInfo, std::deque<RequestState*>> waiting;
+    std::set<AddrInfo> connected;
+
+    // Only accessed on the thread. The hedge timers of the requests that
+    // might be hedged, keyed by when they expire (in ms, on the monotonic
+    // clock).
+    std::multimap<unsigned long, RequestState*> hedge_timers;
+  };
+
   static const int DEFAULT_HTTP_PORT = 80;
   static const int DEFAULT_HTTPS_PORT = 443;
 
@@ -135,6 +453,15 @@ private:
   /// @returns    The HttpResponse received.
   virtual HttpResponse send_request(const HttpRequest& req);
 
+  /// Sends the provided HTTP Request without blocking the calling thread. The
+  /// request is sent by one of the client's I/O threads, trying the targets
+  /// and retrying in the same way as send_request.
+  ///
+  /// @param req      The HttpRequest to send
+  /// @param callback Called with the HttpResponse received.
+  virtual void send_request_async(const HttpRequest& req,
+                                  ResponseCallback callback);
+
   /// Inner function to send an HTTP request.
   /// This is only a helper function, and should not be used directly. Instead,
   /// the send_request(const HttpRequest&) method should be used.
@@ -161,21 +488,131 @@ private:
                             std::map<std::string, std::string>* response_headers,
                             int allowed_host_state);
 
-  /// Helper function that builds the curl header in the set_curl_options
-  /// method.
-  struct curl_slist* build_headers(std::vector<std::string> headers_to_add,
-                                   bool has_body,
-                                   bool assert_user,
-                                   const std::string& username,
-                                   std::string uuid_str);
+  /// Sends a request, storing the response headers unparsed in raw_headers
+  /// (and parsed in response_headers, if it isn't null). This implements
+  /// both send_request functions. The request template (which may be null)
+  /// supplies headers that are shared with other requests.
+  HTTPCode send_request_raw(RequestType request_type,
+                            const std::string& url,
+                            const RequestBody& body,
+                            std::string& doc,
+                            const std::string& username,
+                            SAS::TrailId trail,
+                            const std::vector<std::string>& headers_to_add,
+                            std::map<std::string, std::string>* response_headers,
+                            std::string& raw_headers,
+                            int allowed_host_state,
+                            const std::shared_ptr<const HttpRequestTemplate>& request_template);
 
-  /// Helper function that sets the general curl options in send_request
-  void set_curl_options_general(CURL* curl, std::string body, std::string& doc);
+  /// Helper functions that implement send_request and send_request_async.
+  ///
+  /// prepare_request resolves the request's targets, returning false if the
+  /// URL can't be parsed. start_attempt picks the next target and sets up a
+  /// curl handle to send the request to it, returning false if there are no
+  /// more targets to try. complete_attempt processes the outcome of sending
+  /// the request, returning whether another target should be tried.
+  /// complete_request cleans up and returns the result of the request.
+  bool prepare_request(RequestState& state);
+  bool start_attempt(RequestState& state);
+  bool complete_attempt(RequestState& state, CURLcode rc);
+  HTTPCode complete_request(RequestState& state);
+
+  /// Cleans up an attempt that is abandoned when the client is destroyed.
+  void abandon_attempt(RequestState& state);
+
+  /// Returns the time since an attempt was sent, in microseconds.
+  static uint64_t attempt_latency_us(const RequestState& state);
+
+  /// Starts the I/O threads for asynchronous requests, if they aren't
+  /// running already.
+  void start_async_io_threads();
+
+  /// Stops the I/O threads, completing any outstanding asynchronous requests.
+  void stop_async_io_threads();
+
+  /// Starts the next attempt for an asynchronous request (or completes the
+  /// request if there are no more targets) on an I/O thread.
+  void start_async_attempt(AsyncIoThread* io_thread, RequestState* state);
+
+  /// Adds the current attempt for an asynchronous request to the I/O
+  /// thread's multi handle, or queues it if there is no free stream.
+  void add_async_attempt(AsyncIoThread* io_thread, RequestState* state);
+
+  /// Returns how many more requests can be sent to a target in HTTP/2 mode.
+  unsigned int free_streams(AsyncIoThread* io_thread, const AddrInfo& target);
+
+  /// Processes the outcome of an asynchronous attempt, then tries the next
+  /// target or completes the request.
+  void finish_async_attempt(AsyncIoThread* io_thread,
+                            RequestState* state,
+                            CURLcode rc);
+
+  /// Frees a stream to a target in HTTP/2 mode, starting a request that is
+  /// waiting for it.
+  void release_stream(AsyncIoThread* io_thread, const AddrInfo& target);
+
+  /// Handles a request (or its hedge) running out of targets or getting a
+  /// response. For a hedged request, the first response is used, and the
+  /// other side's attempt is cancelled.
+  void finish_async_request(AsyncIoThread* io_thread, RequestState* state);
+
+  /// Removes an asynchronous attempt from the I/O thread, without completing
+  /// the request.
+  void cancel_async_attempt(AsyncIoThread* io_thread, RequestState* state);
+
+  /// Completes an asynchronous request, calling its callback.
+  void complete_async_request(RequestState* state);
+
+  /// Returns whether a request of the given type should be hedged.
+  bool should_hedge(RequestType request_type);
+
+  /// Returns how long to wait for a response before hedging a request, in
+  /// milliseconds.
+  unsigned long hedge_delay_ms();
+
+  /// Starts or stops a request's hedge timer.
+  void set_hedge_timer(AsyncIoThread* io_thread, RequestState* state);
+  void cancel_hedge_timer(AsyncIoThread* io_thread, RequestState* state);
+
+  /// Sends the hedges for the requests whose hedge timers have expired, and
+  /// returns how long until the next timer expires (in milliseconds, at most
+  /// max_wait_ms).
+  int process_hedge_timers(AsyncIoThread* io_thread, int max_wait_ms);
+
+  /// Sends a request to its next target as a hedge.
+  void start_hedge(AsyncIoThread* io_thread, RequestState* state);
+
+  /// Gives an asynchronous request to one of the I/O threads.
+  void queue_async_request(RequestState* state);
+
+  /// Sends a request on an I/O thread, and waits for it to complete.
+  HTTPCode send_request_and_wait(RequestState* state);
+
+  /// Updates the count of requests in progress to the current attempt's IP
+  /// address, in HTTP/2 mode.
+  void update_stream_statistic(RequestState& state, bool started);
+
+  /// The I/O thread function, and the static wrapper passed to pthread_create.
+  static void* async_io_thread_fn(void* io_thread);
+  void async_io_thread_func(AsyncIoThread* io_thread);
+
+  /// Helper function that builds a request's headers, in prepare_request.
+  /// Only the headers that differ between requests are allocated; they're
+  /// followed by the request template's headers, or by _shared_headers if
+  /// there's no template.
+  void build_headers(RequestState& state);
+
+  /// Helper function that sets the general curl options in send_request. The
+  /// body isn't copied by curl, so must outlive the request.
+  void set_curl_options_general(CURL* curl, RequestState& state);
+
+  /// Returns the body of an HttpRequest, which refers to the request's
+  /// storage (or the caller's, if it supplied a buffer or provider).
+  static RequestBody request_body(const HttpRequest& req);
 
-  /// Helper function that sets response header curl options, if required, in
-  /// send_request
-  void set_curl_options_response(CURL* curl,
-                                 std::map<std::string, std::string>* response_headers);
+  /// Helper function that sets the response header curl options in
+  /// send_request.
+  void set_curl_options_response(CURL* curl, RequestState& state);
 
   /// Helper function that sets request-type specific curl options in
   /// send_request
@@ -195,21 +632,44 @@ private:
     (void) host_context;
   }
 
-  void sas_add_ip(SAS::Event& event, CURL* curl, CURLINFO info);
+  /// An HTTP request or response to be logged to SAS, possibly on another
+  /// thread - so everything needed from the cURL handle is read up front.
+  struct SasHttpMessage
+  {
+    SAS::TrailId trail;
+    int event_id;
+    uint32_t instance_id;
+    SAS::Timestamp timestamp;
+
+    std::string remote_ip;
+    long remote_port;
+    std::string local_ip;
+    long local_port;
+
+    /// The HTTP status code, for responses only (-1 for requests).
+    long http_rc;
+
+    std::string method_str;
+    std::string url;
+    std::string bytes;
+  };
 
-  void sas_add_port(SAS::Event& event, CURL* curl, CURLINFO info);
+  std::string sas_get_ip(CURL* curl, CURLINFO info);
 
-  void sas_add_ip_addrs_and_ports(SAS::Event& event,
-                                  CURL* curl);
+  long sas_get_port(CURL* curl, CURLINFO info);
+
+  void sas_get_ip_addrs_and_ports(SasHttpMessage& message, CURL* curl);
 
   // Check if the message has a body and obscure it if so.
   std::string get_obscured_message_to_log(const std::string& message);
 
+  /// Log a request or response. The message bytes are moved from rather than
+  /// copied.
   void sas_log_http_req(SAS::TrailId trail,
                         CURL* curl,
                         const std::string& method_str,
                         const std::string& url,
-                        const std::string& request_bytes,
+                        std::string& request_bytes,
                         SAS::Timestamp timestamp,
                         uint32_t instance_id);
 
@@ -218,9 +678,21 @@ private:
                         long http_rc,
                         const std::string& method_str,
                         const std::string& url,
-                        const std::string& response_bytes,
+                        std::string& response_bytes,
                         uint32_t instance_id);
 
+  /// Report a request or response, on a SAS logging thread if logging is
+  /// deferred.
+  void sas_report_http_message(std::shared_ptr<SasHttpMessage> message);
+
+  /// Build and report the event for a request or response.
+  void sas_build_http_event(const SasHttpMessage& message);
+
+  static void sas_log_exception_callback(std::function<void()> /*work*/)
+  {
+    // No recovery behaviour - the message just isn't logged.
+  }
+
   void sas_log_curl_error(SAS::TrailId trail,
                           const char* remote_ip_addr,
                           unsigned short remote_port,
@@ -247,7 +719,19 @@ private:
                           uint32_t instance_id);
 
   HTTPCode curl_code_to_http_code(CURL* curl, CURLcode code);
-  static size_t write_headers(void *ptr, size_t size, size_t nmemb, std::map<std::string, std::string> *headers);
+
+  /// cURL header callback. This stores each header line in the request's
+  /// raw_headers, and uses the Content-Length header (if there is one) to
+  /// size the buffer for the body.
+  static size_t store_header(void* ptr, size_t size, size_t nmemb, void* state);
+
+  /// cURL read callback that reads the request's body from its provider.
+  static size_t read_body(char* buffer, size_t size, size_t nitems, void* state);
+
+  /// Parses header lines, as stored by store_header, into a map. Header names
+  /// are lowercased, and whitespace is removed from names and values.
+  static void parse_headers(const std::string& raw_headers,
+                            std::map<std::string, std::string>& headers);
   static void host_port_from_server(const std::string& scheme,
                                     const std::string& server,
                                     std::string& host,
@@ -255,10 +739,7 @@ private:
   static std::string host_from_server(const std::string& scheme, const std::string& server);
   static int port_from_server(const std::string& scheme, const std::string& server);
 
-  boost::uuids::uuid get_random_uuid();
-
   const bool _assert_user;
-  pthread_key_t _uuid_thread_local;
 
   HttpResolver* _resolver;
   LoadMonitor* _load_monitor;
@@ -271,4 +752,47 @@ private:
   bool _should_omit_body;
   bool _log_display_address;
   std::string _server_display_address;
+
+  // The load reported by a server above which it is blacklisted, and for how
+  // long.
+  float _peer_overload_threshold;
+  int _peer_overload_blacklist_s;
+
+  // The budget that retries come out of, or NULL if they aren't limited.
+  RetryBudget* _retry_budget;
+
+  // A response shared by coalesced GETs.
+  struct CoalescedResponse
+  {
+    HTTPCode rc;
+    std::string body;
+    std::string raw_headers;
+  };
+
+  // Whether identical GETs share one request, and the GETs in flight, by
+  // their URL, user and headers.
+  std::atomic<bool> _coalesced_gets;
+  SingleFlight<std::string, CoalescedResponse> _get_coalescer;
+
+  // I/O threads for asynchronous requests. These are started when the first
+  // asynchronous request is sent, and requests are shared between them round
+  // robin. Protected by _async_lock.
+  pthread_mutex_t _async_lock;
+  unsigned int _num_async_io_threads;
+  std::vector<AsyncIoThread*> _async_io_threads;
+  unsigned int _next_async_io_thread;
+
+  // Whether requests are sent over HTTP/2, and how.
+  bool _http2;
+  Http2Options _http2_options;
+
+  // Whether requests are hedged, and how.
+  bool _hedging;
+  HedgingOptions _hedging_options;
+
+  // The headers that end the header list of a request without a template.
+  struct curl_slist* _shared_headers;
+
+  // The threads that log HTTP messages to SAS, if this is deferred.
+  FunctorThreadPool* _sas_log_pool;
 };
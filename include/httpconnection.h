@@ -12,6 +12,8 @@
 #pragma once
 
 #include <string>
+#include <vector>
+#include <memory>
 
 #include "httpclient.h"
 #include "http_request.h"
@@ -40,11 +42,25 @@ public:
   {
   }
 
+  /// Set headers to add to every request that this connection creates. The
+  /// headers are stored in a request template, which is shared by the
+  /// requests, so they aren't copied or rebuilt for each request.
+  void set_headers(const std::vector<std::string>& headers)
+  {
+    _request_template = std::make_shared<const HttpRequestTemplate>(headers);
+  }
+
   /// Create an HttpRequest with our server and scheme arguments
   HttpRequest create_request(HttpClient::RequestType method,
                              const std::string& path)
   {
     HttpRequest req(_server, _scheme, _client, method, path);
+
+    if (_request_template != nullptr)
+    {
+      req.set_template(_request_template);
+    }
+
     return req;
   }
 
@@ -53,4 +69,5 @@ protected:
   std::string _scheme;
   std::string _server;
   HttpClient* _client;
+  std::shared_ptr<const HttpRequestTemplate> _request_template;
 };
@@ -13,8 +13,13 @@
 #define HTTP_H__
 
 #include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
 #include <string>
 #include <set>
+#include <vector>
+#include <map>
+#include <atomic>
 
 #include <evhtp.h>
 
@@ -24,6 +29,14 @@
 #include "sas.h"
 #include "sasevent.h"
 #include "exception_handler.h"
+#include "thread_placement.h"
+#include "http_router.h"
+#include "latency_histogram.h"
+#include "snmp_latency_histogram_table.h"
+#include "snmp_latency_percentile_table.h"
+#include "sharded_lru_cache.h"
+#include "listener_handoff.h"
+#include "memory_accounting.h"
 
 class HttpStack
 {
@@ -41,13 +54,20 @@ public:
   class Request
   {
   public:
+    // HttpStack fills in the path parameters
+    friend class HttpStack;
+
     Request(HttpStack* stack, evhtp_request_t* req) :
       _method(htp_method_UNKNOWN),
       _rx_body_set(false),
       _req(req),
       _stack(stack),
       _stopwatch(),
-      _track_latency(true)
+      _track_latency(true),
+      _handler_load_monitor(NULL),
+      _route_id(HttpRouter::NO_MATCH),
+      _compression_cache_key(),
+      _memory_charge(memory_account(), sizeof(Request))
     {
       _stopwatch.start();
     }
@@ -75,6 +95,33 @@ public:
       return Utils::url_unescape(std::string(param != NULL ? param : ""));
     }
 
+    /// Get a parameter from the path, as matched by the handler's route (e.g.
+    /// "impi" for a handler registered with the route "/impi/{impi}/av").
+    /// Returns an empty string if there is no such parameter.
+    inline std::string path_param(const std::string& name) const
+    {
+      for (HttpRouter::Params::const_iterator it = _path_params.begin();
+           it != _path_params.end();
+           ++it)
+      {
+        if (it->first == name)
+        {
+          return it->second;
+        }
+      }
+
+      return "";
+    }
+
+    /// Get the index'th parameter from the path (counting from 0). This
+    /// includes the segments matched by wildcards such as "[^/]*" in the
+    /// regexes passed to register_handler. Returns an empty string if there
+    /// is no such parameter.
+    inline std::string path_param(size_t index) const
+    {
+      return (index < _path_params.size()) ? _path_params[index].second : "";
+    }
+
     inline std::string header(const std::string& name)
     {
       const char* val = evhtp_header_find(_req->headers_in, name.c_str());
@@ -86,6 +133,23 @@ public:
       evbuffer_add(_req->buffer_out, content.c_str(), content.length());
     }
 
+    /// Add content that the caller no longer needs. Large content is handed
+    /// to the response buffer without being copied, and freed once it has
+    /// been sent.
+    void add_content(std::string&& content);
+
+    /// Add content to the response without copying it. The data must remain
+    /// valid until the cleanup function is called (with the data, its length
+    /// and `arg`), which happens once it has been sent or the request is
+    /// freed, possibly on a different thread.
+    void add_content_reference(const char* data,
+                               size_t length,
+                               evbuffer_ref_cleanup_cb cleanup,
+                               void* arg)
+    {
+      evbuffer_add_reference(_req->buffer_out, data, length, cleanup, arg);
+    }
+
     void add_header(const std::string& name, const std::string& value)
     {
       evhtp_header_t* new_header = evhtp_header_new(name.c_str(),
@@ -94,6 +158,16 @@ public:
       evhtp_headers_add_header(_req->headers_out, new_header);
     }
 
+    /// Mark the response as one that only changes when what it describes
+    /// does (such as the current alarm list), so that if it is compressed
+    /// (see HttpStack::set_compression_options) the compressed body can be
+    /// reused until it changes.  The key names the response, and must be
+    /// the same for every request that gets it.
+    inline void set_compression_cache_key(const std::string& key)
+    {
+      _compression_cache_key = key;
+    }
+
     inline void set_track_latency(bool track_latency)
     {
       _track_latency = track_latency;
@@ -135,13 +209,40 @@ public:
     }
 
     void send_reply(int rc, SAS::TrailId trail);
+
+    /// Reject the request with a 503 because it can't be processed now (for
+    /// example, because the handler's thread pool is full), as if it had
+    /// been rejected by the stack's load monitor.
+    ///
+    /// @param retry_after_s the value of the Retry-After header to send.
+    void send_overload_reply(unsigned int retry_after_s, SAS::TrailId trail)
+    {
+      _stack->send_overload_reply(*this, retry_after_s, trail);
+    }
+
     inline evhtp_request_t* req() { return _req; }
 
-    void record_penalty() { _stack->record_penalty(); }
+    void record_penalty()
+    {
+      _stack->record_penalty();
+
+      if (_handler_load_monitor != NULL)
+      {
+        _handler_load_monitor->incr_penalties();
+      }
+    }
 
     std::string get_rx_message();
     std::string get_rx_header();
-    std::string get_rx_body();
+
+    /// Get the request body. This is copied out of the receive buffer the
+    /// first time it is called.
+    const std::string& get_rx_body();
+
+    /// Get the segments of the receive buffer that hold the request body,
+    /// without copying them. The segments are valid until the reply is sent
+    /// (and must not be modified).
+    std::vector<evbuffer_iovec> get_rx_body_segments();
 
     std::string get_tx_message(int rc);
     std::string get_tx_header(int rc);
@@ -200,6 +301,7 @@ public:
     std::string _rx_body;
     bool _rx_body_set;
     evhtp_request_t* _req;
+    HttpRouter::Params _path_params;
 
   private:
     HttpStack* _stack;
@@ -207,11 +309,41 @@ public:
     SasLogger* _sas_logger;
     bool _track_latency;
 
+    // The load monitor of the handler processing this request, if it has one
+    // (see HttpStack::set_handler_admission).
+    LoadMonitor* _handler_load_monitor;
+
+    // The ID of the route that matched this request, or NO_MATCH if it's for
+    // the default handler.
+    int _route_id;
+
+    // The key the compressed response is cached under, or empty if it isn't
+    // cached.
+    std::string _compression_cache_key;
+
+    // Counts the request in the HTTP_REQUESTS memory account while it (or a
+    // copy of it) exists.
+    MemoryCharge _memory_charge;
+
+    static MemoryAccount* memory_account()
+    {
+      static MemoryAccount* account =
+                          MemoryAccount::get(MemoryAccount::HTTP_REQUESTS);
+      return account;
+    }
+
     /// Utility method to convert an evbuffer to a C++ string.
     ///
     /// @param eb  - The evbuffer to convert
     /// @return    - A string containing a copy of the contents of the evbuffer.
     static std::string evbuffer_to_string(evbuffer* eb);
+
+    /// Content moved into add_content() that is shorter than this is copied,
+    /// as that is cheaper than tracking a reference to it.
+    static const size_t MIN_REFERENCED_CONTENT = 4096;
+
+    /// Frees a string added by add_content(std::string&&).
+    static void free_content(const void* data, size_t length, void* content);
   };
 
   class SasLogger
@@ -390,6 +522,17 @@ public:
     virtual void update_http_latency_us(unsigned long latency_us) = 0;
     virtual void incr_http_incoming_requests() = 0;
     virtual void incr_http_rejected_overload() = 0;
+
+    /// Called when a request is rejected due to overload, as well as
+    /// incr_http_rejected_overload(), with the route or regex of the handler
+    /// the request was for (or an empty string for the default handler).
+    virtual void incr_http_rejected_overload_for_route(const std::string& route) {}
+
+    /// Called with the latency of each request, as well as
+    /// update_http_latency_us(), with the route or regex of the handler the
+    /// request was for (or an empty string for the default handler).
+    virtual void update_http_latency_us_for_route(const std::string& route,
+                                                  unsigned long latency_us) {}
   };
 
   HttpStack(int num_threads,
@@ -399,16 +542,279 @@ public:
             StatsInterface* stats = NULL);
   virtual ~HttpStack();
 
+  /// Options for the stack's listening sockets and connections.
+  struct ConnectionOptions
+  {
+    ConnectionOptions() :
+      idle_timeout_ms(20000),
+      max_keepalive_requests(0),
+      listen_backlog(1024),
+      tcp_nodelay(false),
+      tcp_defer_accept_s(0),
+      max_body_size(0),
+      unix_listen_backlog(0),
+      unix_rcvbuf_bytes(0),
+      unix_sndbuf_bytes(0),
+      unix_socket_mode(0777),
+      unix_allowed_peer_uids()
+    {
+    }
+
+    /// How long a connection can go without receiving data (including
+    /// between requests on a kept-alive connection) before it is closed.
+    /// This also mitigates the Slowloris attack, so must be short enough
+    /// that single attackers can't block the server.
+    unsigned long idle_timeout_ms;
+
+    /// The number of requests after which a kept-alive connection is closed
+    /// (0 => no limit).
+    uint64_t max_keepalive_requests;
+
+    /// The backlog of each listening socket.
+    int listen_backlog;
+
+    /// Whether to disable Nagle's algorithm on TCP connections.
+    bool tcp_nodelay;
+
+    /// If non-zero, TCP connections aren't accepted until they have data to
+    /// read, or this many seconds have passed (TCP_DEFER_ACCEPT).
+    int tcp_defer_accept_s;
+
+    /// The largest request body accepted (0 => no limit).
+    uint64_t max_body_size;
+
+    /// The backlog of the unix socket (0 => listen_backlog).  Co-located
+    /// clients can open connections much faster than remote ones, so this
+    /// may need to be larger.
+    int unix_listen_backlog;
+
+    /// The receive and send buffer sizes of connections on the unix socket
+    /// (0 => the system defaults).
+    int unix_rcvbuf_bytes;
+    int unix_sndbuf_bytes;
+
+    /// The permissions of the unix socket.  The default lets any local
+    /// process (such as nginx) connect.
+    mode_t unix_socket_mode;
+
+    /// If not empty, connections on the unix socket are only accepted from
+    /// processes running as one of these users (checked with SO_PEERCRED),
+    /// so that requests from co-located components can be trusted without
+    /// further authentication.
+    std::set<uid_t> unix_allowed_peer_uids;
+  };
+
+  /// Set the options for the stack's sockets and connections.  Must be
+  /// called before initialize().  The options apply to both TCP and Unix
+  /// sockets, apart from the TCP specific ones.
+  void set_connection_options(const ConnectionOptions& options)
+  {
+    _connection_options = options;
+  }
+
+  /// Options for compressing response bodies.
+  struct CompressionOptions
+  {
+    CompressionOptions() :
+      min_size_bytes(0),
+      level(6),
+      cache_budget_bytes(1024 * 1024),
+      cache_ttl_s(300)
+    {
+    }
+
+    /// Bodies at least this long are gzipped, if the request's
+    /// Accept-Encoding allows it (0 => never compress).  Smaller bodies
+    /// aren't worth the CPU.
+    size_t min_size_bytes;
+
+    /// The zlib compression level (1 - 9).
+    int level;
+
+    /// The memory for caching the compressed bodies of responses that have a
+    /// compression cache key (0 => don't cache them), and how long an entry
+    /// is kept.
+    size_t cache_budget_bytes;
+    int cache_ttl_s;
+  };
+
+  /// Compress large response bodies for clients that accept it.  Must be
+  /// called before start().
+  ///
+  /// Bodies are compressed in send_reply(), so on the handler's thread
+  /// rather than the transport thread.  A response isn't compressed if the
+  /// handler set its Content-Encoding or Content-Length, or if compressing
+  /// it doesn't make it smaller.
+  void set_compression_options(const CompressionOptions& options);
+
+  /// The counts of compressed responses.
+  struct CompressionStats
+  {
+    uint64_t responses;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+
+    /// The responses whose compressed body came from the cache.
+    uint64_t cache_hits;
+  };
+
+  CompressionStats compression_stats() const;
+
+  /// Take over the listening sockets of the process this one is replacing,
+  /// which must be serving handoffs on `handoff_path` (see
+  /// serve_listener_handoff).  Must be called after initialize() and before
+  /// binding - the bind_*_socket() calls then use the inherited sockets
+  /// bound to the same addresses, rather than binding new ones, so that
+  /// connections aren't refused while the new process starts.  Once start()
+  /// has been called, the old process is told to stop accepting.
+  ///
+  /// @return whether any sockets were inherited.  If there is no process to
+  ///         take over from, this does nothing.
+  bool inherit_listeners(const std::string& handoff_path);
+
+  /// Hand the stack's listening sockets to a process that replaces this one
+  /// (see inherit_listeners).  Must be called after start().  Once the new
+  /// process is accepting on them, this stack stops accepting, and
+  /// `handed_off_cb` is called (on another thread) so that the process can
+  /// finish its requests in progress and exit.
+  void serve_listener_handoff(const std::string& handoff_path,
+                              std::function<void()> handed_off_cb);
+
+  /// Stop accepting new connections, while carrying on with the ones
+  /// already accepted.
+  void stop_accepting();
+
   virtual void initialize();
   virtual void bind_tcp_socket(const std::string& bind_address,
                                unsigned short port);
   virtual void bind_unix_socket(const std::string& bind_path);
+  /// Register a handler for the paths that match a POSIX extended regex.
+  /// Simple regexes, such as "^/impi/[^/]*/av$", are converted to routes (see
+  /// register_route), and the path segments that match their wildcards are
+  /// available from Request::path_param.
   virtual void register_handler(const char* path, HandlerInterface* handler);
+
+  /// Register a handler for a route, whose segments are either literal or of
+  /// the form "{name}", which matches any non-empty segment. For example, a
+  /// handler registered for "/impi/{impi}/av" can get the IMPI from
+  /// Request::path_param("impi").
+  ///
+  /// If a request matches several handlers (of either sort), the one that was
+  /// registered first processes it.
+  virtual void register_route(const std::string& route, HandlerInterface* handler);
   virtual void register_default_handler(HandlerInterface* handler);
+
+  /// Control how the handler's requests are admitted when overloaded.  They
+  /// must be admitted by the handler's own load monitor (if it has one), and
+  /// then by the stack's load monitor.  Each request takes `cost` tokens from
+  /// both, so expensive requests use more of the stack's budget, and a flood
+  /// of requests to one handler doesn't cause rejections for the others until
+  /// the stack as a whole is overloaded.
+  ///
+  /// Must be called before start().
+  ///
+  /// @param handler      the handler (registered with register_handler,
+  ///                     register_route or register_default_handler).
+  /// @param load_monitor the handler's load monitor, or NULL to use the
+  ///                     stack's only.  This is also told the latency of the
+  ///                     handler's requests, and penalties recorded for them.
+  /// @param cost         the number of tokens each request takes.
+  void set_handler_admission(HandlerInterface* handler,
+                             LoadMonitor* load_monitor,
+                             float cost = 1.0);
   virtual void start(evhtp_thread_init_cb init_cb = NULL);
+
+  /// Set the policy for placing the transport threads on cores.  Must be
+  /// called before start().  The threads are normally created by libevhtp, so
+  /// the placement is applied by each thread as it starts, and the policy's
+  /// stack size is not used (unless using SO_REUSEPORT listeners, when the
+  /// stack creates the threads itself).
+  void set_thread_placement(const ThreadPlacementPolicy& placement)
+  {
+    _placement = placement;
+  }
+
+  /// Give each transport thread its own listening socket (opened with
+  /// SO_REUSEPORT) and event base, so that the kernel spreads new connections
+  /// across the threads, rather than one thread accepting them all.  Must be
+  /// called before initialize().
+  ///
+  /// Only TCP sockets are bound on every thread - a unix socket is bound on
+  /// the first thread only.  The thread init callback passed to start() is
+  /// called on each thread with a NULL evthr_t.
+  void set_reuseport_listeners(bool reuseport)
+  {
+    _reuseport = reuseport;
+  }
+
+  /// Report the load of the stack's load monitor on every response (in the
+  /// LoadMonitor::LOAD_HEADER header), so that clients can move traffic
+  /// away from this node before it starts rejecting requests (see
+  /// HttpClient::set_peer_overload_threshold).
+  void set_load_feedback(bool load_feedback)
+  {
+    _load_feedback = load_feedback;
+  }
+
+  /// Report the progress of the transport threads' event loops to a health
+  /// checker, so that the process is reported as not ready while any of them
+  /// is blocked for longer than `stall_deadline_ms`.  Must be called before
+  /// start(), and the health checker must outlive the stack.
+  void set_health_checker(HealthChecker* health_checker,
+                          unsigned int stall_deadline_ms)
+  {
+    _health_checker = health_checker;
+    _stall_deadline_ms = stall_deadline_ms;
+  }
+
+  /// The number of connections accepted and requests received by a listener.
+  struct ListenerStats
+  {
+    uint64_t connections;
+    uint64_t requests;
+  };
+
+  /// Get the counts for each listener - one per transport thread when using
+  /// SO_REUSEPORT listeners, or a single one for the whole stack otherwise.
+  std::vector<ListenerStats> listener_stats() const;
+
+  /// Get the latencies of the requests to each route (or regex) that has a
+  /// handler, keyed by the route (or an empty string for the default handler).
+  std::map<std::string, LatencyHistogram::Snapshot> route_latencies() const;
+
+  /// Export the latencies of the requests to each route in an SNMP table.
+  /// The table must outlive the stack.
+  void set_latency_histogram_table(SNMP::LatencyHistogramTable* table);
+
+  /// Export percentiles of the latencies of the requests to each route in an
+  /// SNMP table. The table must outlive the stack.
+  void set_latency_percentile_table(SNMP::LatencyPercentileTable* table);
+
+  /// Write a summary of the latencies of the requests to each route to the
+  /// access log.
+  void log_route_latencies();
+
+  /// Write a summary of the latencies of the requests to each route to the
+  /// access log at most every `interval_s` seconds (0 => never, the default).
+  /// The summaries are written as requests complete, so are not written
+  /// while the stack is idle.
+  void set_latency_log_interval(unsigned int interval_s)
+  {
+    _latency_log_interval_ms = interval_s * 1000;
+    _next_latency_log_ms = Utils::get_time() + _latency_log_interval_ms;
+  }
+
   virtual void stop();
   virtual void wait_stopped();
   virtual void send_reply(Request& req, int rc, SAS::TrailId trail);
+
+  /// Reject a request that was admitted to a handler with a 503 and a
+  /// Retry-After header, count it as rejected for overload, and record a
+  /// penalty against the load monitors so that they admit fewer requests.
+  /// This doesn't block, so can be called on a transport thread.
+  virtual void send_overload_reply(Request& req,
+                                   unsigned int retry_after_s,
+                                   SAS::TrailId trail);
   virtual void record_penalty();
 
   void log(const std::string uri, std::string method, int rc, unsigned long latency_us)
@@ -425,11 +831,117 @@ public:
   static NullSasLogger NULL_SAS_LOGGER;
 
 private:
+  // An event base and the libevhtp instance that listens on it, with the
+  // thread that runs it, and counts of what it has received.
+  struct Listener
+  {
+    HttpStack* stack;
+    unsigned int index;
+    evbase_t* evbase;
+    evhtp_t* evhtp;
+    pthread_t thread;
+    std::atomic<uint64_t> connections;
+    std::atomic<uint64_t> requests;
+  };
+
   virtual void send_reply_internal(Request& req, int rc, SAS::TrailId trail);
-  static void handler_callback_fn(evhtp_request_t* req, void* handler_reg_param);
-  static void* event_base_thread_fn(void* http_stack_ptr);
-  void handler_callback(evhtp_request_t* req, HandlerInterface* handler);
-  void event_base_thread_fn();
+  static void dispatch_callback_fn(evhtp_request_t* req, void* listener_ptr);
+  static evhtp_res post_accept_fn(evhtp_connection_t* conn, void* listener_ptr);
+  void set_defer_accept(int fd);
+  bool setup_unix_connection(int fd);
+  static void* event_base_thread_fn(void* listener_ptr);
+  static void thread_init_fn(evhtp_t* evhtp, evthr_t* thr, void* http_stack_ptr);
+  int bind_reuseport_socket(Listener* listener,
+                            const addrinfo* addr,
+                            unsigned short port,
+                            const std::string& key);
+
+  // A listening socket, keyed by what it's bound to (for handing off), and
+  // the libevent listener accepting on it.
+  struct BoundSocket
+  {
+    std::string key;
+    int fd;
+    evbase_t* evbase;
+    struct evconnlistener* listener;
+  };
+
+  // Records the socket that a listener has just started accepting on.
+  void add_bound_socket(const std::string& key, Listener* listener);
+
+  // Takes the inherited socket with a key, returning -1 if there isn't one.
+  int take_inherited_socket(const std::string& key);
+
+  // Tells the process the sockets were inherited from that this one is
+  // accepting, closing any inherited sockets that weren't used.
+  void complete_inheritance();
+
+  static void disable_listener_fn(evutil_socket_t fd, short events, void* listener);
+  void dispatch_callback(evhtp_request_t* req);
+  void handler_callback(evhtp_request_t* req,
+                        HandlerInterface* handler,
+                        int route_id,
+                        HttpRouter::Params& path_params);
+
+  // Returns the route and latency histogram for a route ID (which may be
+  // NO_MATCH for the default handler).
+  const std::string& route(int route_id) const;
+  LatencyHistogram* route_latency(int route_id);
+
+  // Records the latency of a request in its route's histogram and stats, and
+  // logs the latencies if it's time to.
+  void record_route_latency(int route_id, unsigned long latency_us);
+
+  // Creates the latency histogram for a newly registered route.
+  void add_route_latency(int id);
+
+  // How a handler's requests are admitted (see set_handler_admission).
+  struct HandlerAdmission
+  {
+    LoadMonitor* load_monitor;
+    float cost;
+  };
+
+  // Checks whether a request can be admitted, returning NULL if it can, or the
+  // load monitor that rejected it.
+  LoadMonitor* admit_request(const HandlerAdmission* admission,
+                             SAS::TrailId trail);
+  void event_base_thread_fn(Listener* listener);
+
+  // A response body and its gzipped form, which is empty if compressing it
+  // doesn't make it smaller.
+  struct CompressedBody
+  {
+    std::string body;
+    std::string compressed;
+  };
+  typedef ShardedLruCache<std::string, CompressedBody> CompressionCache;
+
+  // Gzips the response body, if it should be.
+  void compress_reply(Request& req);
+  std::shared_ptr<const CompressedBody> compress_body(const char* body,
+                                                      size_t length,
+                                                      const std::string& cache_key);
+  static bool gzip(const char* data, size_t length, int level, std::string& out);
+  static void free_compressed_body(const void* data, size_t length, void* body);
+
+  // Whether an Accept-Encoding header (which may be NULL) allows gzip.
+  static bool accepts_gzip(const char* accept_encoding);
+
+  // A timer that beats a heartbeat from an event loop.  It's a chain of
+  // one-off events, so that libevent frees whichever is pending when the
+  // event base is freed - the timers themselves are freed with the stack.
+  struct HeartbeatTimer
+  {
+    HealthChecker::Heartbeat* heartbeat;
+    evbase_t* evbase;
+    struct timeval interval;
+  };
+
+  // Starts beating a heartbeat for the event loop running on `evbase`, if
+  // there is a health checker.
+  void start_heartbeat(evbase_t* evbase);
+  static void heartbeat_timer_fn(evutil_socket_t fd, short events, void* timer_ptr);
 
   // Don't implement the following, to avoid copies of this instance.
   HttpStack(HttpStack const&);
@@ -442,28 +954,70 @@ private:
   LoadMonitor* _load_monitor;
   StatsInterface* _stats;
 
-  evbase_t* _evbase;
-  evhtp_t* _evhtp;
-  pthread_t _event_base_thread;
+  // The listeners.  There is one for each transport thread if using
+  // SO_REUSEPORT listeners, and otherwise a single one whose connections are
+  // handed to libevhtp's thread pool.
+  bool _reuseport;
+  std::vector<Listener*> _listeners;
+
+  // Whether the load is reported on responses.
+  bool _load_feedback;
+  ConnectionOptions _connection_options;
+
+  // Transport thread placement, the next index to give to a transport thread,
+  // and the application's thread init callback (which is called after the
+  // placement is applied).
+  ThreadPlacementPolicy _placement;
+  std::atomic<unsigned int> _next_thread_index;
+  evhtp_thread_init_cb _thread_init_cb;
+
+  // Stall detection (see set_health_checker()), and the event loops' heartbeat
+  // timers, protected by _heartbeats_lock.
+  HealthChecker* _health_checker;
+  unsigned int _stall_deadline_ms;
+  std::vector<HeartbeatTimer*> _heartbeat_timers;
+  pthread_mutex_t _heartbeats_lock;
 
   static bool _ev_using_pthreads;
 
-  // Helper structure used to register handlers with libevhtp, while also
-  // allowing callbacks to get back to the HttpStack object.
-  struct HandlerRegistration
-  {
-    HttpStack* stack;
-    HandlerInterface* handler;
-
-    HandlerRegistration() : HandlerRegistration(nullptr, nullptr) {}
-    HandlerRegistration(HttpStack* stack_param, HandlerInterface* handler_param) :
-      stack(stack_param), handler(handler_param)
-    {}
-  };
-
-  // Active handler registrations - stored here so they can be freed when the
-  // stack is destroyed.
-  std::set<HandlerRegistration*> _handler_registrations;
+  // All requests are passed to libevhtp's general callback, which uses the
+  // router to find their handlers. The handlers (and the routes or regexes
+  // they were registered with) are indexed by the IDs of their routes.
+  HttpRouter _router;
+  std::vector<HandlerInterface*> _handlers;
+  std::vector<std::string> _routes;
+  HandlerInterface* _default_handler;
+
+  // The latencies of the requests to each route, indexed by route ID, and to
+  // the default handler, and the SNMP tables (if any) they are exported in.
+  std::vector<LatencyHistogram*> _route_latencies;
+  LatencyHistogram _default_latency;
+  SNMP::LatencyHistogramTable* _latency_table;
+  SNMP::LatencyPercentileTable* _percentile_table;
+
+  // How often to log the route latencies (0 => never), and when they are next
+  // due to be logged.
+  uint64_t _latency_log_interval_ms;
+  std::atomic<uint64_t> _next_latency_log_ms;
+
+  // Handlers that have their own admission settings.
+  std::map<HandlerInterface*, HandlerAdmission> _admissions;
+
+  // The listening sockets, the ones inherited from a previous process that
+  // haven't been used yet, and the connection to that process (or -1).
+  std::vector<BoundSocket> _bound_sockets;
+  ListenerHandoff::Sockets _inherited_sockets;
+  int _inheritance_conn;
+  ListenerHandoff* _handoff;
+
+  // Response compression, and the cache of compressed bodies (NULL if
+  // they aren't cached).
+  CompressionOptions _compression;
+  CompressionCache* _compression_cache;
+  std::atomic<uint64_t> _compressed_responses;
+  std::atomic<uint64_t> _compressed_bytes_in;
+  std::atomic<uint64_t> _compressed_bytes_out;
+  std::atomic<uint64_t> _compression_cache_hits;
 };
 
 #endif
@@ -0,0 +1,286 @@
+/**
+ * @file httpstack_coroutine.h Coroutine-based handlers for the HttpStack.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef HTTPSTACK_COROUTINE_H__
+#define HTTPSTACK_COROUTINE_H__
+
+// Coroutines need C++20, so this header is empty when built with an earlier
+// standard.
+#if defined(__cpp_impl_coroutine)
+
+#include <coroutine>
+#include <functional>
+#include <optional>
+#include <type_traits>
+
+#include <event2/event.h>
+
+#include "httpstack_utils.h"
+#include "http_request.h"
+#include "log.h"
+
+namespace HttpStackUtils
+{
+  class CoroutineTask;
+
+  /// @class Coroutine
+  ///
+  /// The return type of CoroutineTask::execute(). The coroutine doesn't start
+  /// until the task is run, and the task is deleted when it finishes.
+  class Coroutine
+  {
+  public:
+    struct promise_type;
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    struct promise_type
+    {
+      // The task whose coroutine this is. Set before the coroutine starts.
+      CoroutineTask* task = nullptr;
+
+      Coroutine get_return_object() { return Coroutine(Handle::from_promise(*this)); }
+      std::suspend_always initial_suspend() noexcept { return {}; }
+
+      // On completion, free the coroutine and then its task.
+      struct FinalAwaiter
+      {
+        bool await_ready() noexcept { return false; }
+        void await_suspend(Handle handle) noexcept;
+        void await_resume() noexcept {}
+      };
+
+      FinalAwaiter final_suspend() noexcept { return {}; }
+      void return_void() {}
+
+      // Exceptions propagate to whoever started or resumed the coroutine
+      // (the HttpStack, or the thread the coroutine was resumed on).
+      void unhandled_exception() { throw; }
+    };
+
+    Coroutine(Coroutine&& other) : _handle(other._handle) { other._handle = nullptr; }
+    Coroutine(const Coroutine&) = delete;
+    Coroutine& operator=(const Coroutine&) = delete;
+
+    ~Coroutine()
+    {
+      // If the coroutine was never started, free it.
+      if (_handle)
+      {
+        _handle.destroy();
+      }
+    }
+
+  private:
+    friend class CoroutineTask;
+
+    explicit Coroutine(Handle handle) : _handle(handle) {}
+
+    // Start the coroutine on behalf of the task, which then owns it.
+    void start(CoroutineTask* task)
+    {
+      Handle handle = _handle;
+      _handle = nullptr;
+      handle.promise().task = task;
+      handle.resume();
+    }
+
+    Handle _handle;
+  };
+
+  /// @class CallbackAwaitable
+  ///
+  /// Awaits an asynchronous operation that reports its result to a callback.
+  /// The operation is started when the coroutine suspends, and the coroutine
+  /// is resumed on the HttpStack thread that received the request once the
+  /// callback has been called (on whatever thread the operation uses).
+  ///
+  /// @tparam R the type of the result of the operation, which is the result
+  ///   of the co_await expression.
+  template <class R>
+  class CallbackAwaitable
+  {
+  public:
+    typedef std::function<void(R)> Callback;
+
+    /// @param start function that starts the operation, passing it the
+    ///   callback to call with the result (exactly once).
+    explicit CallbackAwaitable(std::function<void(Callback)> start) :
+      _start(std::move(start))
+    {}
+
+    bool await_ready() { return false; }
+
+    void await_suspend(Coroutine::Handle handle);
+
+    R await_resume() { return std::move(*_result); }
+
+  private:
+    std::function<void(Callback)> _start;
+    std::optional<R> _result;
+  };
+
+  /// @class CoroutineTask
+  ///
+  /// Base class for per-request tasks spawned by a CoroutineHandler. Rather
+  /// than registering a callback for each downstream operation, the task's
+  /// execute() coroutine co_awaits them, for example:
+  ///
+  ///   HttpStackUtils::Coroutine execute()
+  ///   {
+  ///     HttpResponse rsp = co_await send_async(request);
+  ///     ...
+  ///     send_http_reply(rsp.get_rc());
+  ///   }
+  ///
+  /// Other asynchronous operations can be awaited with a CallbackAwaitable,
+  /// e.g. a Cassandra operation (whose results must be taken from it in the
+  /// callback, as the store deletes it afterwards):
+  ///
+  ///   bool success = co_await CallbackAwaitable<bool>(
+  ///     [&](CallbackAwaitable<bool>::Callback callback)
+  ///     {
+  ///       CassandraStore::Operation* op = new GetRowOp(...);
+  ///       CassandraStore::Transaction* trx =
+  ///         new CassandraStore::CallbackTransaction(trail(),
+  ///           [&, callback](CassandraStore::Operation* op, bool success)
+  ///           {
+  ///             ... take the results from op ...
+  ///             callback(success);
+  ///           });
+  ///       store->do_async(op, trx);
+  ///     });
+  ///
+  /// While an operation is outstanding the task doesn't use a thread, so a
+  /// few HttpStack threads can serve many requests that are waiting on
+  /// downstream operations. The coroutine is always resumed on the HttpStack
+  /// thread that received the request. The task is deleted when the coroutine
+  /// finishes, so it must send a reply first.
+  class CoroutineTask : public Task
+  {
+  public:
+    CoroutineTask(HttpStack::Request& req, SAS::TrailId trail) :
+      Task(req, trail),
+      _evbase(((req.req() != NULL) && (req.req()->conn != NULL)) ?
+                req.req()->conn->evbase : NULL)
+    {}
+
+    virtual ~CoroutineTask() {}
+
+    /// Start the task's coroutine.
+    void run() final
+    {
+      Coroutine coroutine = execute();
+      coroutine.start(this);
+    }
+
+    /// Resume the coroutine on the HttpStack thread that received the
+    /// request. May be called on any thread.
+    void resume(std::coroutine_handle<> handle)
+    {
+      if (_evbase == NULL)
+      {
+        // There's no event base (e.g. in unit tests), so resume straight
+        // away.
+        handle.resume();
+        return;
+      }
+
+      struct timeval now = {0, 0};
+      if (event_base_once(_evbase,
+                          -1,
+                          EV_TIMEOUT,
+                          resume_callback,
+                          handle.address(),
+                          &now) != 0)
+      {
+        // LCOV_EXCL_START
+        TRC_ERROR("Failed to schedule coroutine on HTTP thread, resuming here");
+        handle.resume();
+        // LCOV_EXCL_STOP
+      }
+    }
+
+  protected:
+    /// The business logic of the task. Subclasses implement this as a
+    /// coroutine.
+    virtual Coroutine execute() = 0;
+
+    /// Send an HTTP request with the HttpClient's asynchronous interface.
+    ///
+    /// @return awaitable for the response. The request must remain valid
+    ///   until the response has been received.
+    CallbackAwaitable<HttpResponse> send_async(HttpRequest& req)
+    {
+      return CallbackAwaitable<HttpResponse>(
+        [&req](CallbackAwaitable<HttpResponse>::Callback callback)
+        {
+          req.send_async(callback);
+        });
+    }
+
+  private:
+    static void resume_callback(evutil_socket_t fd, short events, void* address)
+    {
+      std::coroutine_handle<>::from_address(address).resume();
+    }
+
+    // The event base of the HttpStack thread that received the request.
+    evbase_t* _evbase;
+  };
+
+  inline void Coroutine::promise_type::FinalAwaiter::await_suspend(Handle handle) noexcept
+  {
+    CoroutineTask* task = handle.promise().task;
+    handle.destroy();
+    delete task;
+  }
+
+  template <class R>
+  void CallbackAwaitable<R>::await_suspend(Coroutine::Handle handle)
+  {
+    CoroutineTask* task = handle.promise().task;
+
+    // Once the operation has started, the coroutine can be resumed (and this
+    // awaitable destroyed) at any time, so nothing must be touched after
+    // calling _start.
+    std::function<void(Callback)> start = std::move(_start);
+    start([this, task, handle](R result)
+    {
+      _result.emplace(std::move(result));
+      task->resume(handle);
+    });
+  }
+
+  /// @class CoroutineHandler
+  ///
+  /// A SpawningHandler whose tasks are coroutines (see CoroutineTask).
+  ///
+  /// @tparam T the type of the task, which must derive from CoroutineTask.
+  /// @tparam C the type of the handler's config.
+  template <class T, class C>
+  class CoroutineHandler : public SpawningHandler<T, C>
+  {
+    static_assert(std::is_base_of<CoroutineTask, T>::value,
+                  "CoroutineHandler tasks must derive from CoroutineTask");
+
+  public:
+    CoroutineHandler(const C* cfg, HttpStack::SasLogger* sas_logger = NULL) :
+      SpawningHandler<T, C>(cfg, sas_logger)
+    {}
+
+    virtual ~CoroutineHandler() {}
+  };
+
+} // namespace HttpStackUtils
+
+#endif
+
+#endif
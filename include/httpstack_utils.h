@@ -12,11 +12,15 @@
 #ifndef HTTPSTACK_UTILS_H__
 #define HTTPSTACK_UTILS_H__
 
+#include <functional>
+#include <memory>
+
 #include "httpstack.h"
 #include "threadpool.h"
 #include "zmq_lvc.h"
 #include "accumulator.h"
 #include "counter.h"
+#include "block_pool.h"
 
 namespace HttpStackUtils
 {
@@ -30,6 +34,8 @@ namespace HttpStackUtils
   /// processing when the callback is triggered.
   ///
   /// This class is an implementation of the handler part of this model.
+  /// Tasks derived from HttpStackUtils::Task are allocated from a BlockPool,
+  /// so spawning one per request doesn't normally need to call malloc.
   ///
   /// It takes two template parameters:
   /// @tparam T the type of the task.
@@ -94,6 +100,19 @@ namespace HttpStackUtils
     /// class should implement it with their specific business logic.
     virtual void run() = 0;
 
+    /// Tasks (including subclasses) are allocated from the shared block
+    /// pools, and their memory is reused when they are deleted (which
+    /// normally happens once the reply is sent).
+    static void* operator new(size_t size)
+    {
+      return BlockPool::allocate_sized(size);
+    }
+
+    static void operator delete(void* task, size_t size)
+    {
+      BlockPool::release_sized(task, size);
+    }
+
   protected:
     /// Send an HTTP reply. Calls through to Request::send_reply, picking up
     /// the trail ID from the task.
@@ -104,6 +123,17 @@ namespace HttpStackUtils
       _req.send_reply(status_code, trail());
     }
 
+    /// Send an HTTP reply with a body, which is handed to the HTTP stack
+    /// without being copied (see HttpStack::Request::add_content).
+    ///
+    /// @param status_code the HTTP status code to use on the reply.
+    /// @param body the body of the reply.
+    void send_http_reply(int status_code, std::string&& body)
+    {
+      _req.add_content(std::move(body));
+      send_http_reply(status_code);
+    }
+
     /// @return the trail ID associated with the request.
     inline SAS::TrailId trail() { return _trail; }
 
@@ -129,6 +159,84 @@ namespace HttpStackUtils
     }
   };
 
+  /// @class MetricsHandler
+  ///
+  /// Handler that serves pre-rendered metrics, such as the OpenMetrics text
+  /// from SNMP::Agent::get_open_metrics(), for scraping (e.g. on /metrics).
+  /// The text is sent without being copied, so a scrape costs very little
+  /// however many statistics there are.
+  ///
+  /// Example code:
+  ///   HttpStackUtils::MetricsHandler metrics_handler(
+  ///     []() { return SNMP::Agent::instance()->get_open_metrics(); });
+  ///   stack->register_handler("^/metrics$", &metrics_handler);
+  class MetricsHandler : public HttpStack::HandlerInterface
+  {
+  public:
+    /// Returns the latest rendered metrics, or NULL if there aren't any yet.
+    typedef std::function<std::shared_ptr<const std::string>()> Source;
+
+    MetricsHandler(Source source) : _source(source) {}
+
+    void process_request(HttpStack::Request& req, SAS::TrailId trail);
+
+    HttpStack::SasLogger* sas_logger(HttpStack::Request& req)
+    {
+      // Don't log any SAS events.
+      return &HttpStack::NULL_SAS_LOGGER;
+    }
+
+  private:
+    // Frees the reference to the metrics once they've been sent.
+    static void release_metrics(const void* data, size_t length, void* metrics);
+
+    Source _source;
+  };
+
+  /// @class ReadinessHandler
+  ///
+  /// Handler that reports whether the process is ready to take traffic,
+  /// according to a HealthChecker, for load balancers to poll (e.g. on
+  /// /ready).  It responds 200 if so, and 503 (with the reason in the body)
+  /// if not.  This doesn't block, so is answered promptly however loaded the
+  /// process is.
+  class ReadinessHandler : public HttpStack::HandlerInterface
+  {
+  public:
+    ReadinessHandler(HealthChecker* health_checker) :
+      _health_checker(health_checker)
+    {}
+
+    void process_request(HttpStack::Request& req, SAS::TrailId trail);
+
+    HttpStack::SasLogger* sas_logger(HttpStack::Request& req)
+    {
+      // Don't log any SAS events.
+      return &HttpStack::NULL_SAS_LOGGER;
+    }
+
+  private:
+    HealthChecker* _health_checker;
+  };
+
+  /// @class ProfileHandler
+  ///
+  /// Handler that serves the profiling spans recorded on each thread (see
+  /// profiling_span.h), e.g. on /profile.  By default they're sent in the
+  /// Chrome trace event format - with ?format=folded they're sent as folded
+  /// stacks, for flame graph tools.
+  class ProfileHandler : public HttpStack::HandlerInterface
+  {
+  public:
+    void process_request(HttpStack::Request& req, SAS::TrailId trail);
+
+    HttpStack::SasLogger* sas_logger(HttpStack::Request& req)
+    {
+      // Don't log any SAS events.
+      return &HttpStack::NULL_SAS_LOGGER;
+    }
+  };
+
   /// @class HandlerThreadPool
   ///
   /// The HttpStack has a limited number of transport threads so handlers
@@ -147,11 +255,31 @@ namespace HttpStackUtils
   class HandlerThreadPool
   {
   public:
+    /// @param lock_free_queue whether to use a lock-free ring buffer for the
+    ///        pool's work queue, so that HttpStack transport threads don't
+    ///        serialise on the queue lock. The ring holds max_queue requests
+    ///        (or DEFAULT_RING_CAPACITY if max_queue is zero).
+    /// @param reject_when_full whether to reject requests with a 503 (with a
+    ///        Retry-After header) when the work queue is full, rather than
+    ///        blocking the HttpStack transport thread (and so every
+    ///        connection on it) until there is room.  Only has an effect if
+    ///        the queue is bounded (max_queue is set or lock_free_queue is
+    ///        true).
     HandlerThreadPool(unsigned int num_threads,
                       ExceptionHandler* exception_handler,
-                      unsigned int max_queue = 0);
+                      unsigned int max_queue = 0,
+                      bool lock_free_queue = false,
+                      bool reject_when_full = false);
     ~HandlerThreadPool();
 
+    /// The capacity of the work queue ring buffer if lock_free_queue is set
+    /// and no max_queue is given.
+    static const unsigned int DEFAULT_RING_CAPACITY = 65536;
+
+    /// The Retry-After value (in seconds) sent on requests rejected because
+    /// the work queue is full.
+    static const unsigned int FULL_RETRY_AFTER_S = 1;
+
     /// Wrap a handler in a 'wrapper' object.  Requests passed to this
     /// wrapper will be processed on a worker thread.
     HttpStack::HandlerInterface* wrap(HttpStack::HandlerInterface* handler);
@@ -160,7 +288,8 @@ namespace HttpStackUtils
     /// @struct RequestParams
     ///
     /// Structure that is used for passing requests from the HttpStack transport
-    /// thread to the thread pool.
+    /// thread to the thread pool. These are allocated from a BlockPool, as one
+    /// is needed for every request.
     struct RequestParams
     {
       RequestParams(HttpStack::HandlerInterface* handler_param,
@@ -171,6 +300,16 @@ namespace HttpStackUtils
         trail(trail_param)
       {}
 
+      static void* operator new(size_t size)
+      {
+        return BlockPool::allocate_sized(size);
+      }
+
+      static void operator delete(void* params, size_t size)
+      {
+        BlockPool::release_sized(params, size);
+      }
+
       HttpStack::HandlerInterface* handler;
       HttpStack::Request request;
       SAS::TrailId trail;
@@ -195,7 +334,8 @@ namespace HttpStackUtils
       Pool(unsigned int num_threads,
            ExceptionHandler* exception_handler,
            void (*callback)(RequestParams*),
-           unsigned int max_queue = 0);
+           unsigned int max_queue = 0,
+           bool lock_free_queue = false);
 
       void process_work(RequestParams*& params);
     };
@@ -212,7 +352,7 @@ namespace HttpStackUtils
     class Wrapper : public HttpStack::HandlerInterface
     {
     public:
-      Wrapper(Pool* pool, HandlerInterface* handler);
+      Wrapper(Pool* pool, HandlerInterface* handler, bool reject_when_full);
       virtual ~Wrapper(){};
 
       /// Implementation of HandlerInterface::process_request(). This passes
@@ -229,11 +369,17 @@ namespace HttpStackUtils
 
       // The wrapped handler.
       HandlerInterface* _handler;
+
+      // Whether to reject requests, rather than block, when the pool is full.
+      bool _reject_when_full;
     };
 
     // The threadpool containing the worker threads.
     Pool _pool;
 
+    // Whether to reject requests, rather than block, when the pool is full.
+    bool _reject_when_full;
+
     // Vector of all the wrapper objects that have been allocated.  These are
     // owned by the HandlerThreadPool (which is responsible for freeing
     // them) and we use this vector to keep track of them.
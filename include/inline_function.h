@@ -0,0 +1,164 @@
+/**
+ * @file inline_function.h A move-only callable with inline storage.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef INLINE_FUNCTION_H__
+#define INLINE_FUNCTION_H__
+
+#include <stddef.h>
+
+#include <new>
+#include <utility>
+#include <type_traits>
+
+// A move-only wrapper for a callable object that takes no arguments and
+// returns nothing (like std::function<void()>).
+//
+// Unlike std::function, the callable is always stored inside the
+// InlineFunction itself, in a buffer of `Capacity` bytes, so constructing,
+// moving and destroying an InlineFunction never allocates memory. Trying to
+// store a callable that doesn't fit in the buffer is a compile-time error.
+//
+// Because InlineFunctions are move-only, the callable doesn't need to be
+// copyable (e.g. a lambda can capture a std::unique_ptr).
+template <size_t Capacity>
+class InlineFunction
+{
+public:
+  // Create an empty InlineFunction. Calling it does nothing.
+  InlineFunction() : _ops(nullptr) {}
+
+  // Create an InlineFunction that stores a copy of (or moves from) the
+  // specified callable.
+  template <class F,
+            class = typename std::enable_if<
+              !std::is_same<typename std::decay<F>::type,
+                            InlineFunction>::value>::type>
+  InlineFunction(F&& f) : _ops(nullptr)
+  {
+    typedef typename std::decay<F>::type Fn;
+    static_assert(sizeof(Fn) <= Capacity,
+                  "Callable is too large to store in this InlineFunction");
+    static_assert(alignof(Fn) <= alignof(Storage),
+                  "Callable is too strictly aligned to store in an InlineFunction");
+
+    new (&_storage) Fn(std::forward<F>(f));
+    _ops = &Ops<Fn>::table;
+  }
+
+  InlineFunction(InlineFunction&& other) : _ops(nullptr)
+  {
+    take(other);
+  }
+
+  InlineFunction& operator=(InlineFunction&& other)
+  {
+    if (this != &other)
+    {
+      reset();
+      take(other);
+    }
+
+    return *this;
+  }
+
+  InlineFunction(const InlineFunction&) = delete;
+  InlineFunction& operator=(const InlineFunction&) = delete;
+
+  ~InlineFunction()
+  {
+    reset();
+  }
+
+  // Call the stored callable. This is a no-op if the InlineFunction is empty.
+  void operator()()
+  {
+    if (_ops != nullptr)
+    {
+      _ops->invoke(&_storage);
+    }
+  }
+
+  // Returns whether the InlineFunction holds a callable.
+  explicit operator bool() const
+  {
+    return (_ops != nullptr);
+  }
+
+  // Destroy the stored callable (if any), leaving the InlineFunction empty.
+  void reset()
+  {
+    if (_ops != nullptr)
+    {
+      _ops->destroy(&_storage);
+      _ops = nullptr;
+    }
+  }
+
+private:
+  typedef typename std::aligned_storage<Capacity, alignof(max_align_t)>::type
+                                                                       Storage;
+
+  // The operations on a stored callable, which depend on its type.
+  struct OpsTable
+  {
+    void (*invoke)(void* storage);
+    void (*move)(void* to, void* from);
+    void (*destroy)(void* storage);
+  };
+
+  template <class Fn>
+  struct Ops
+  {
+    static void invoke(void* storage)
+    {
+      (*static_cast<Fn*>(storage))();
+    }
+
+    static void move(void* to, void* from)
+    {
+      new (to) Fn(std::move(*static_cast<Fn*>(from)));
+    }
+
+    static void destroy(void* storage)
+    {
+      static_cast<Fn*>(storage)->~Fn();
+    }
+
+    static const OpsTable table;
+  };
+
+  // Move the callable out of another InlineFunction, leaving it empty. This
+  // InlineFunction must be empty.
+  void take(InlineFunction& other)
+  {
+    if (other._ops != nullptr)
+    {
+      other._ops->move(&_storage, &other._storage);
+      _ops = other._ops;
+      other.reset();
+    }
+  }
+
+  Storage _storage;
+  const OpsTable* _ops;
+};
+
+template <size_t Capacity>
+template <class Fn>
+const typename InlineFunction<Capacity>::OpsTable
+  InlineFunction<Capacity>::Ops<Fn>::table =
+{
+  &InlineFunction<Capacity>::Ops<Fn>::invoke,
+  &InlineFunction<Capacity>::Ops<Fn>::move,
+  &InlineFunction<Capacity>::Ops<Fn>::destroy
+};
+
+#endif
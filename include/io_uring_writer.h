@@ -0,0 +1,170 @@
+/**
+ * @file io_uring_writer.h  Writes files through io_uring on a service thread.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef IO_URING_WRITER_H__
+#define IO_URING_WRITER_H__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <deque>
+#include <vector>
+
+struct iovec;
+
+/// Appends data to files without the calling thread waiting for the write.
+///
+/// Data is copied into a set of buffers, which are registered with an
+/// io_uring instance, and a service thread submits the filled buffers as
+/// chains of linked writes (so they complete in order) and handles their
+/// completions.  A caller only waits if every buffer is already waiting to be
+/// written.
+///
+/// Writes to the same file descriptor are written in the order they were
+/// queued.  They are written at the file's current position, so this is
+/// intended for files opened with O_APPEND, such as log files.  Call flush()
+/// before closing a file descriptor that has been written to.
+///
+/// If io_uring isn't supported by the kernel (or is disabled), available()
+/// returns false, and callers should write the files themselves.
+class IoUringWriter
+{
+public:
+  /// The default number of buffers, and their size in bytes.
+  static const unsigned int DEFAULT_BUFFERS = 16;
+  static const size_t DEFAULT_BUFFER_SIZE = 64 * 1024;
+
+  IoUringWriter(unsigned int num_buffers = DEFAULT_BUFFERS,
+                size_t buffer_size = DEFAULT_BUFFER_SIZE);
+
+  /// Writes everything that is queued, then stops the service thread.
+  ~IoUringWriter();
+
+  /// @return whether io_uring could be set up.  If not, write() and flush()
+  ///         do nothing.
+  bool available() const { return _ring_fd >= 0; }
+
+  /// Queue data to be appended to a file.  The data is copied, so can be
+  /// reused as soon as this returns.
+  void write(int fd, const char* data, size_t length);
+  void writev(int fd, const struct iovec* iov, int iovcnt);
+
+  /// Wait until everything queued so far has been written.
+  void flush();
+
+  /// @return the number of writes that failed.
+  uint64_t errors() const { return _errors.load(); }
+
+private:
+  // A registered buffer, and the file its contents are for.
+  struct Buffer
+  {
+    unsigned int index;
+    char* data;
+    size_t used;
+    int fd;
+  };
+
+  // The io_uring instance's mapped queues.
+  struct Ring
+  {
+    Ring();
+
+    void* sq_ptr;
+    size_t sq_size;
+    void* cq_ptr;
+    size_t cq_size;
+    void* sqes_ptr;
+    size_t sqes_size;
+
+    unsigned int* sq_head;
+    unsigned int* sq_tail;
+    unsigned int* sq_mask;
+    unsigned int* sq_array;
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    unsigned int entries;
+  };
+
+  // Sets up the io_uring instance and registers the buffers, returning
+  // whether this succeeded.
+  bool setup_ring(unsigned int entries);
+  void teardown_ring();
+
+  // Returns a buffer to copy data for `fd` into, with at least some space,
+  // waiting for one if required.  Called with _lock held.
+  Buffer* buffer_for(int fd);
+
+  // Moves the buffer being filled to the queue of buffers to write.  Called
+  // with _lock held.
+  void seal_current();
+
+  // Writes a chain of buffers, in order.
+  void write_buffers(std::vector<Buffer*>& buffers);
+
+  // Writes what's left of a buffer with write(2), after io_uring failed to
+  // write all of it.
+  void write_remainder(Buffer* buffer, size_t written);
+
+  static void* service_thread_fn(void* writer);
+  void service_thread_fn();
+
+  int _ring_fd;
+  Ring _ring;
+
+  // Whether the buffers are registered with the ring, whether it can write at
+  // a file's current position, and whether it has failed (in which case the
+  // service thread writes the buffers itself).
+  bool _fixed_buffers;
+  bool _current_position;
+  bool _ring_failed;
+
+  size_t _buffer_size;
+  char* _memory;
+  std::vector<Buffer> _buffers;
+
+  // The buffer being filled, the buffers waiting to be written (in order),
+  // and the free buffers, protected by _lock.  Buffers are counted as they
+  // are sealed and once they've been written, so flush() can tell when
+  // everything queued before it has been written.
+  Buffer* _current;
+  std::deque<Buffer*> _ready;
+  std::vector<Buffer*> _free;
+  uint64_t _sealed;
+  uint64_t _written;
+  bool _service_waiting;
+  bool _terminated;
+  pthread_mutex_t _lock;
+
+  // Serializes writes, and is held while a write waits for a free buffer.
+  pthread_mutex_t _write_lock;
+
+  // Signalled when there are buffers to write, when buffers are freed, and
+  // when buffers have been written.
+  pthread_cond_t _ready_cond;
+  pthread_cond_t _free_cond;
+  pthread_cond_t _written_cond;
+
+  std::atomic<uint64_t> _errors;
+
+  pthread_t _service_thread;
+
+  // Don't implement the following, to avoid copies of this instance.
+  IoUringWriter(IoUringWriter const&);
+  void operator=(IoUringWriter const&);
+};
+
+#endif
@@ -12,6 +12,8 @@
 #ifndef JSON_PARSE_UTILS_H_
 #define JSON_PARSE_UTILS_H_
 
+#include <boost/utility/string_ref.hpp>
+
 #include "rapidjson/writer.h"
 #include "rapidjson/stringbuffer.h"
 #include "rapidjson/document.h"
@@ -173,6 +175,17 @@ struct JsonFormatError
     (TARGET) = (NODE)[(ATTR_NAME)].GetBool();                                  \
 }
 
+// Get a string attribute as a boost::string_ref pointing into the document,
+// rather than copying it.  The string_ref is only valid while the document
+// (and for documents parsed in situ, the buffer) is.
+#define JSON_GET_STRING_REF_MEMBER(NODE, ATTR_NAME, TARGET)                    \
+{                                                                              \
+    JSON_ASSERT_CONTAINS((NODE), (ATTR_NAME));                                 \
+    JSON_ASSERT_STRING((NODE)[(ATTR_NAME)]);                                   \
+    (TARGET) = boost::string_ref((NODE)[(ATTR_NAME)].GetString(),              \
+                                 (NODE)[(ATTR_NAME)].GetStringLength());       \
+}
+
 #define JSON_SAFE_GET_STRING_MEMBER(NODE, ATTR_NAME, TARGET)                   \
 {                                                                              \
     if (((NODE).HasMember(ATTR_NAME)) &&                                       \
@@ -182,6 +195,16 @@ struct JsonFormatError
     }                                                                          \
 }
 
+#define JSON_SAFE_GET_STRING_REF_MEMBER(NODE, ATTR_NAME, TARGET)               \
+{                                                                              \
+    if (((NODE).HasMember(ATTR_NAME)) &&                                       \
+        ((NODE)[(ATTR_NAME)].IsString()))                                      \
+    {                                                                          \
+      (TARGET) = boost::string_ref((NODE)[(ATTR_NAME)].GetString(),            \
+                                   (NODE)[(ATTR_NAME)].GetStringLength());     \
+    }                                                                          \
+}
+
 #define JSON_SAFE_GET_INT_MEMBER(NODE, ATTR_NAME, TARGET)                      \
 {                                                                              \
     if (((NODE).HasMember(ATTR_NAME)) &&                                       \
@@ -227,6 +250,81 @@ struct JsonFormatError
     }                                                                          \
 }
 
+/// Parses JSON in place in a writable, null-terminated buffer (such as a
+/// Store::Buffer), rather than copying its strings into the document.  The
+/// parse overwrites the buffer and the document's strings point into it, so
+/// the buffer must outlive the document, and mustn't be shared with anything
+/// else that reads it.
+///
+/// @return whether the JSON was parsed successfully.
+template<typename B>
+bool parse_json_insitu(rapidjson::Document& doc, B& buffer)
+{
+  if (buffer.data() == NULL)
+  {
+    return false;
+  }
+
+  doc.ParseInsitu<0>(buffer.data());
+  return !doc.HasParseError();
+}
+
+/// A JSON document whose nodes are allocated from an arena belonging to the
+/// calling thread, rather than from a new memory pool per document.  The
+/// arena is reused from one document to the next, so (combined with parsing
+/// in situ, which stops the document copying its strings) parsing a
+/// document typically doesn't allocate at all.
+///
+/// The arena is shared by all the JsonArenaDocuments on a thread, and is only
+/// reset once none of them exist - so they must be destroyed on the thread
+/// that created them, and shouldn't be kept for long.
+///
+///   JsonArenaDocument json;
+///
+///   if (json.parse_insitu(buffer))
+///   {
+///     boost::string_ref name;
+///     JSON_GET_STRING_REF_MEMBER(json.doc(), "name", name);
+///     ...
+///   }
+class JsonArenaDocument
+{
+public:
+  /// The size of each thread's arena.  Documents that need more than this
+  /// allocate extra chunks, which are freed when the arena is reset.
+  static const size_t ARENA_SIZE = 64 * 1024;
+
+  JsonArenaDocument();
+  ~JsonArenaDocument();
+
+  rapidjson::Document& doc() { return _doc; }
+
+  /// Parses JSON in place in a writable, null-terminated buffer, as for
+  /// parse_json_insitu().
+  ///
+  /// @return whether the JSON was parsed successfully.
+  template<typename B>
+  bool parse_insitu(B& buffer)
+  {
+    return parse_json_insitu(_doc, buffer);
+  }
+
+  bool parse_insitu(char* json);
+
+private:
+  struct Arena;
+
+  // Returns the calling thread's arena, creating it if required.
+  static Arena* thread_arena();
+
+  Arena* _arena;
+  rapidjson::Document _doc;
+
+  // Don't implement the following, to avoid copies of this instance.
+  JsonArenaDocument(JsonArenaDocument const&);
+  void operator=(JsonArenaDocument const&);
+};
+
 template<typename T>
 void extract_json_string_array(rapidjson::Value& json,
                                const char* key,
@@ -246,8 +344,8 @@ void extract_json_string_array(rapidjson::Value& json,
   }
 }
 
-template<typename T>
-void write_json_string_array(rapidjson::Writer<rapidjson::StringBuffer>& writer,
+template<typename W, typename T>
+void write_json_string_array(W& writer,  //< any rapidjson::Writer
                              const char* key,
                              T& array)
 {
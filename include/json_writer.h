@@ -0,0 +1,136 @@
+/**
+ * @file json_writer.h  Output streams and reusable buffers for writing JSON.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef JSON_WRITER_H__
+#define JSON_WRITER_H__
+
+#include <stddef.h>
+
+#include <string>
+
+#include <boost/utility/string_ref.hpp>
+
+#include "rapidjson/writer.h"
+
+struct evbuffer;
+
+/// A rapidjson output stream that appends to a std::string.  Unlike
+/// rapidjson::StringBuffer, the JSON doesn't need copying out once it has
+/// been written - the string can be moved or swapped.
+class JsonStringStream
+{
+public:
+  typedef char Ch;
+
+  JsonStringStream(std::string& str) : _str(str) {}
+
+  void Put(char c) { _str.push_back(c); }
+  void Flush() {}
+
+private:
+  std::string& _str;
+};
+
+typedef rapidjson::Writer<JsonStringStream> JsonStringWriter;
+
+/// A rapidjson output stream that writes straight into an evbuffer (such as
+/// the body of an HTTP response), rather than building the JSON in a separate
+/// buffer first.  The JSON is added to the evbuffer in chunks, and the last
+/// chunk is added when the writer finishes the top-level value (or when the
+/// stream is destroyed).
+class JsonEvbufferStream
+{
+public:
+  typedef char Ch;
+
+  JsonEvbufferStream(struct evbuffer* buffer) : _buffer(buffer), _length(0) {}
+  ~JsonEvbufferStream() { Flush(); }
+
+  void Put(char c)
+  {
+    if (_length == sizeof(_chunk))
+    {
+      Flush();
+    }
+
+    _chunk[_length++] = c;
+  }
+
+  void Flush();
+
+private:
+  static const size_t CHUNK_SIZE = 4096;
+
+  struct evbuffer* _buffer;
+  char _chunk[CHUNK_SIZE];
+  size_t _length;
+
+  // Don't implement the following, to avoid copies of this instance.
+  JsonEvbufferStream(JsonEvbufferStream const&);
+  void operator=(JsonEvbufferStream const&);
+};
+
+typedef rapidjson::Writer<JsonEvbufferStream> JsonEvbufferWriter;
+
+/// A buffer for writing JSON into, which belongs to the calling thread and
+/// keeps its capacity from one use to the next, so that writing JSON doesn't
+/// normally allocate.  If the thread's buffer is already in use (because
+/// JsonWriteBuffers are nested) this uses a buffer of its own instead.
+///
+/// The JSON can be sent as the body of an HTTP request without copying it,
+/// with HttpRequest::set_body_buffer(view().data(), view().size()), as long
+/// as the JsonWriteBuffer outlives the request.
+///
+///   JsonWriteBuffer buffer;
+///   JsonStringWriter& writer = buffer.writer();
+///   writer.StartObject();
+///   ...
+///   writer.EndObject();
+///   do_something_with(buffer.view());
+class JsonWriteBuffer
+{
+public:
+  /// The most memory a thread's buffer keeps hold of between uses.
+  static const size_t MAX_RETAINED_SIZE = 1024 * 1024;
+
+  JsonWriteBuffer();
+  ~JsonWriteBuffer();
+
+  JsonStringWriter& writer() { return _writer; }
+
+  /// @return the JSON written so far.  This is only valid until more is
+  ///         written, or the buffer is released or destroyed.
+  boost::string_ref view() const
+  {
+    return boost::string_ref(_str->data(), _str->size());
+  }
+
+  /// Moves the JSON out of the buffer, which is left empty.  The thread's
+  /// buffer has to grow again after this, so only use this where the JSON
+  /// needs to outlive the JsonWriteBuffer.
+  std::string release();
+
+private:
+  // Returns the calling thread's buffer if it's not in use, and own
+  // otherwise.
+  static std::string* acquire(std::string& own);
+
+  std::string _own;
+  std::string* _str;
+  JsonStringStream _stream;
+  JsonStringWriter _writer;
+
+  // Don't implement the following, to avoid copies of this instance.
+  JsonWriteBuffer(JsonWriteBuffer const&);
+  void operator=(JsonWriteBuffer const&);
+};
+
+#endif
@@ -0,0 +1,103 @@
+/**
+ * @file keyword_table.h  Classification of strings from a fixed vocabulary.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef KEYWORD_TABLE_H__
+#define KEYWORD_TABLE_H__
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <initializer_list>
+#include <vector>
+
+/// Maps the strings of a fixed vocabulary (such as SIP methods) to values,
+/// for classifying strings that are seen on every message.
+///
+/// The table is a perfect hash on the string's length and first character,
+/// so a lookup is two array indexes and a single memcmp, however many
+/// keywords there are.  This needs the keywords to differ in length or in
+/// the low five bits of their first character, which holds for most
+/// upper-case vocabularies (as letters differ in those bits) and is checked
+/// when the table is built.
+///
+/// Build the table once, as a static, for example:
+///
+///   static const KeywordTable<Colour> COLOURS({{"RED", Colour::RED},
+///                                              {"BLUE", Colour::BLUE}},
+///                                             Colour::OTHER);
+///   Colour colour = COLOURS.lookup(str, len);
+template <class T, size_t MAX_LENGTH = 16>
+class KeywordTable
+{
+public:
+  struct Keyword
+  {
+    const char* name;
+    T value;
+  };
+
+  /// @param keywords - The vocabulary, of at most 255 keywords, each at most
+  ///                   MAX_LENGTH characters long.  The names must be string
+  ///                   literals (or otherwise outlive the table).
+  /// @param unknown  - The value of strings that aren't in the vocabulary.
+  KeywordTable(std::initializer_list<Keyword> keywords, T unknown) :
+    _keywords(keywords),
+    _unknown(unknown)
+  {
+    assert(_keywords.size() < 256);
+    memset(_slots, 0, sizeof(_slots));
+
+    for (size_t ii = 0; ii < _keywords.size(); ++ii)
+    {
+      size_t length = strlen(_keywords[ii].name);
+      assert((length > 0) && (length <= MAX_LENGTH));
+
+      uint8_t& slot = _slots[length][bucket(_keywords[ii].name[0])];
+      assert(slot == 0);
+      slot = ii + 1;
+    }
+  }
+
+  /// @return the value of the string, or the unknown value if it's not in
+  ///         the vocabulary.  Matching is case-sensitive.
+  T lookup(const char* str, size_t length) const
+  {
+    if ((length == 0) || (length > MAX_LENGTH))
+    {
+      return _unknown;
+    }
+
+    uint8_t slot = _slots[length][bucket(str[0])];
+
+    if ((slot == 0) || (memcmp(_keywords[slot - 1].name, str, length) != 0))
+    {
+      return _unknown;
+    }
+
+    return _keywords[slot - 1].value;
+  }
+
+private:
+  static size_t bucket(char first)
+  {
+    return (unsigned char)first & 0x1f;
+  }
+
+  std::vector<Keyword> _keywords;
+  T _unknown;
+
+  // The index (plus one) of the keyword with each length and first
+  // character bucket, or zero if there isn't one.
+  uint8_t _slots[MAX_LENGTH + 1][32];
+};
+
+#endif
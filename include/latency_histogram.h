@@ -0,0 +1,150 @@
+/**
+ * @file latency_histogram.h  Histograms of latencies with log-linear buckets.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef LATENCY_HISTOGRAM_H__
+#define LATENCY_HISTOGRAM_H__
+
+#include <stdint.h>
+
+#include <atomic>
+
+/// A histogram of latencies, which is cheap enough to record every request
+/// in.
+///
+/// The buckets are fixed and log-linear (as in HDR histograms): latencies
+/// below SUB_BUCKETS us each have their own bucket, and each power of two
+/// above that is split into SUB_BUCKETS equal buckets. So a bucket's range
+/// is at most 1/SUB_BUCKETS of its lower bound, which bounds the error of a
+/// percentile read from the histogram. The last bucket also counts any
+/// latencies of 2^32us or more. The memory used is fixed.
+///
+/// Recording a latency doesn't take a lock. The counts are split across a
+/// number of shards, each used by a different set of threads, so that
+/// threads recording at once don't contend on the same cache lines. Reading
+/// the histogram adds up the shards, so may not reflect latencies that are
+/// being recorded at the same time.
+class LatencyHistogram
+{
+public:
+  /// The number of buckets each power of two is split into.
+  static const int SUB_BUCKET_BITS = 3;
+  static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+
+  /// Enough buckets for latencies up to 2^32us.
+  static const int NUM_BUCKETS = SUB_BUCKETS + ((32 - SUB_BUCKET_BITS) * SUB_BUCKETS);
+
+  /// The counts in a histogram at a point in time.
+  struct Snapshot
+  {
+    uint64_t counts[NUM_BUCKETS];
+
+    /// The total number of latencies recorded, and their sum.
+    uint64_t count;
+    uint64_t sum_us;
+
+    /// Estimate a percentile of the latencies, as the upper bound of the
+    /// bucket that holds it.
+    ///
+    /// @param percentile the percentile (from 0 to 100).
+    /// @return the estimated latency in microseconds, or 0 if no latencies
+    ///         have been recorded.
+    uint64_t percentile_us(double percentile) const;
+
+    /// Add the counts from another snapshot (e.g. of another histogram) to
+    /// this one.
+    void merge(const Snapshot& other);
+
+    /// Remove the counts from an earlier snapshot of the same histogram,
+    /// leaving the latencies recorded between the two.
+    void subtract(const Snapshot& earlier);
+  };
+
+  LatencyHistogram();
+
+  /// Record a latency.
+  void record(uint64_t latency_us)
+  {
+    Shard& shard = _shards[shard_index()];
+    shard.counts[bucket(latency_us)].fetch_add(1, std::memory_order_relaxed);
+    shard.sum_us.fetch_add(latency_us, std::memory_order_relaxed);
+  }
+
+  /// Get the current counts.
+  void snapshot(Snapshot& snapshot) const;
+
+  /// @return the current count in one bucket.
+  uint64_t bucket_count(int bucket) const;
+
+  /// @return the bucket that a latency is counted in.
+  static int bucket(uint64_t latency_us)
+  {
+    if (latency_us < SUB_BUCKETS)
+    {
+      return (int)latency_us;
+    }
+
+    // Find the power of two, then the linear sub-bucket within it from the
+    // bits below the top one.
+    int exponent = 63 - __builtin_clzll(latency_us);
+    int index = SUB_BUCKETS +
+                ((exponent - SUB_BUCKET_BITS) * SUB_BUCKETS) +
+                (int)((latency_us >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+    return (index < NUM_BUCKETS) ? index : (NUM_BUCKETS - 1);
+  }
+
+  /// @return the (exclusive) upper bound of a bucket in microseconds, or
+  ///         UINT64_MAX for the last bucket.
+  static uint64_t bucket_limit_us(int bucket)
+  {
+    if (bucket >= NUM_BUCKETS - 1)
+    {
+      return UINT64_MAX;
+    }
+    else if (bucket < SUB_BUCKETS)
+    {
+      return bucket + 1;
+    }
+    else
+    {
+      int octave = (bucket - SUB_BUCKETS) / SUB_BUCKETS;
+      int sub_bucket = (bucket - SUB_BUCKETS) % SUB_BUCKETS;
+      return (uint64_t)(SUB_BUCKETS + sub_bucket + 1) << octave;
+    }
+  }
+
+private:
+  static const int NUM_SHARDS = 16;
+
+  // A set of counts. This is padded so that no two shards share a cache line.
+  struct Shard
+  {
+    std::atomic<uint64_t> counts[NUM_BUCKETS];
+    std::atomic<uint64_t> sum_us;
+    char padding[64];
+  };
+
+  // Returns the calling thread's shard. Threads are given shards in turn as
+  // they first record a latency.
+  static int shard_index()
+  {
+    static std::atomic<unsigned int> next_shard(0);
+    static thread_local int shard = next_shard++ % NUM_SHARDS;
+    return shard;
+  }
+
+  Shard _shards[NUM_SHARDS];
+
+  // Don't implement the following, to avoid copies of this instance.
+  LatencyHistogram(LatencyHistogram const&);
+  void operator=(LatencyHistogram const&);
+};
+
+#endif
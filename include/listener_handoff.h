@@ -0,0 +1,110 @@
+/**
+ * @file listener_handoff.h  Passes listening sockets from a process to the
+ * process replacing it.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef LISTENER_HANDOFF_H__
+#define LISTENER_HANDOFF_H__
+
+#include <pthread.h>
+
+#include <functional>
+#include <map>
+#include <string>
+
+/// Hands a process's listening sockets to the process that is replacing it,
+/// so that the sockets stay open across a restart and no connections are
+/// refused while the new process starts up.
+///
+/// The old process serves handoffs on a unix socket.  The new process
+/// connects to it (once it is ready to bind) and is sent each listening
+/// socket, named by a key, as SCM_RIGHTS ancillary data.  The new process
+/// then starts accepting on the sockets and confirms that it has, at which
+/// point the old process is told it can stop accepting and drain.  Until
+/// then both processes accept from the same sockets, so there is no gap.
+///
+/// If the new process fails before confirming, the old process carries on
+/// as normal.
+class ListenerHandoff
+{
+public:
+  /// Listening sockets, keyed by what they are bound to.
+  typedef std::map<std::string, int> Sockets;
+
+  /// Returns the sockets to hand off.  They stay owned by the caller.
+  typedef std::function<Sockets()> GetSocketsCallback;
+
+  /// Called (on the handoff thread) once the new process has started
+  /// accepting on the sockets.
+  typedef std::function<void()> HandedOffCallback;
+
+  /// How long the new process waits for the sockets.
+  static const int RECEIVE_TIMEOUT_MS = 5000;
+
+  /// @param path                - The unix socket to serve handoffs on.
+  /// @param get_sockets_cb      - Returns the sockets to hand off.
+  /// @param handed_off_cb       - Called once a handoff completes.
+  ListenerHandoff(const std::string& path,
+                  GetSocketsCallback get_sockets_cb,
+                  HandedOffCallback handed_off_cb);
+
+  /// Stops serving handoffs, abandoning any in progress.
+  virtual ~ListenerHandoff();
+
+  /// Starts serving handoffs.
+  ///
+  /// @return whether the unix socket could be bound.
+  bool start();
+
+  /// Gets the listening sockets from the process serving handoffs on a unix
+  /// socket.  If there is no such process, this returns straight away.
+  ///
+  /// @param path    - The unix socket.
+  /// @param sockets - (out) The sockets, which the caller now owns.
+  /// @return        - A connection to the old process, to pass to confirm()
+  ///                  once accepting on the sockets, or -1 if no sockets were
+  ///                  received.
+  static int receive(const std::string& path, Sockets& sockets);
+
+  /// Tells the old process that the new one is accepting on the sockets,
+  /// and closes the connection.
+  static void confirm(int conn);
+
+private:
+  static void* thread_fn(void* handoff);
+  void thread_fn();
+
+  // Hands the sockets off on a connection from a new process.
+  void serve(int conn);
+
+  // Sends and receives a message, with at most one file descriptor.
+  static bool send_message(int conn, const std::string& msg, int fd);
+  static bool recv_message(int conn, std::string& msg, int& fd);
+
+  const std::string _path;
+  GetSocketsCallback _get_sockets_cb;
+  HandedOffCallback _handed_off_cb;
+
+  // The socket handoffs are served on, and the connection being served (or
+  // -1).  They are shut down to stop the thread, so are protected by the
+  // lock.
+  pthread_mutex_t _lock;
+  int _listen_fd;
+  int _conn_fd;
+  bool _terminated;
+  pthread_t _thread;
+  bool _started;
+
+  // Don't implement the following, to avoid copies of this instance.
+  ListenerHandoff(ListenerHandoff const&);
+  void operator=(ListenerHandoff const&);
+};
+
+#endif
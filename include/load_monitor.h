@@ -14,10 +14,18 @@
 
 #include <time.h>
 #include <pthread.h>
+#include <atomic>
 #include "snmp_continuous_accumulator_table.h"
 #include "snmp_abstract_scalar.h"
+#include "snmp_success_fail_count_by_priority_and_scope_table.h"
+#include "latency_histogram.h"
+#include "profiled_mutex.h"
+#include "sip_event_priority.h"
 #include "sas.h"
 
+// A token bucket that can be used from many threads without a lock.  The
+// tokens are held as a fixed-point count, and the bucket is replenished by
+// whichever thread first sees that the (coarse) clock has moved on.
 class TokenBucket
 {
   public:
@@ -31,27 +39,38 @@ class TokenBucket
     // @returns      - Whether there was at least one token
     bool get_token();
 
+    // Tests if there are at least `count` tokens in the bucket, over and
+    // above `reserved` tokens that must be left in it. If there are, remove
+    // them.
+    // @param count    - The number of tokens needed
+    // @param reserved - The number of tokens that must be left in the bucket
+    // @returns        - Whether there were enough tokens
+    bool get_tokens(float count, float reserved = 0);
+
     // Updates the token replenishment rate
     // @param new_rate - The new rate to use
     void update_rate(float new_rate_s);
 
     // Get functions for member variables (used for logging)
-    inline float token_count() { return _tokens; }
-    inline float rate() { return _rate_s; }
+    inline float token_count() { return (float)_tokens.load() / TOKEN_SCALE; }
+    inline float rate() { return _rate_s.load(); }
     inline int max_size() { return _max_size; }
 
   private:
     // Replenishes the tokens in the bucket.
     void replenish_bucket();
 
+    // The tokens are counted in units of 1/TOKEN_SCALE of a token.
+    static const int64_t TOKEN_SCALE = 1000;
+
     // The number of tokens in the bucket (doesn't need to be a whole number).
-    float _tokens;
+    std::atomic<int64_t> _tokens;
 
     // The maximum number of tokens that can be in the bucket.
     int _max_size;
 
     // The rate at which tokens are refilled into the bucket (in tokens/second).
-    float _rate_s;
+    std::atomic<float> _rate_s;
 
     // The minimum possible value for the token refill rate (in tokens/second).
     float _min_rate_s;
@@ -60,13 +79,20 @@ class TokenBucket
     // If this is 0, then no maximum rate is applied.
     float _max_rate_s;
 
-    // When the bucket was last replenished (in microseconds since the epoch).
-    timespec _replenish_time_us;
+    // When the bucket was last replenished (in microseconds on the monotonic
+    // clock).
+    std::atomic<uint64_t> _replenish_time_us;
 };
 
+class Statistic;
+
 class LoadMonitor
 {
   public:
+    // The HTTP header used to report a node's load to its clients (see
+    // HttpStack::set_load_feedback), as its load() in thousandths.
+    static const char* const LOAD_HEADER;
+
     LoadMonitor(uint64_t target_latency_us,
                 int max_bucket_size,
                 float initial_rate_s,
@@ -76,9 +102,20 @@ class LoadMonitor
                 SNMP::AbstractScalar* smoothed_latency_scalar = NULL,
                 SNMP::AbstractScalar* target_latency_scalar = NULL,
                 SNMP::AbstractScalar* penalties_scalar = NULL,
-                SNMP::AbstractScalar* token_rate_scalar = NULL);
+                SNMP::AbstractScalar* token_rate_scalar = NULL,
+                SNMP::AbstractScalar* percentile_latency_scalar = NULL,
+                SNMP::SuccessFailCountByPriorityAndScopeTable* admission_by_priority_tbl = NULL);
     virtual ~LoadMonitor();
 
+    // Base the refill rate on a percentile of the latencies of the requests
+    // completed since it was last calculated, rather than their smoothed
+    // mean, so that the rate reacts to the tail latency. The latency used is
+    // reported through the percentile latency scalar.
+    //
+    // @param percentile - The percentile to use (from 0 to 100), or 0 to go
+    //                     back to using the smoothed mean.
+    void set_latency_percentile(double percentile);
+
     // Tests whether a request can be admitted.
     //
     // @param trail        - The SAS trail associated with this request
@@ -87,11 +124,56 @@ class LoadMonitor
     // @returns            - Whether the request can be admitted.
     virtual bool admit_request(SAS::TrailId trail, bool allow_anyway = false);
 
+    // Tests whether a request that costs more (or less) than a typical
+    // request can be admitted. The request takes `cost` tokens from the
+    // bucket rather than one.
+    //
+    // @param trail        - The SAS trail associated with this request
+    // @param cost         - The number of tokens the request needs
+    // @param allow_anyway - Whether the request should be allowed even if
+    //                       there aren't enough tokens
+    // @returns            - Whether the request can be admitted.
+    virtual bool admit_weighted_request(SAS::TrailId trail,
+                                        float cost,
+                                        bool allow_anyway = false);
+
+    // Tests whether a request of a given priority can be admitted. Requests
+    // of each priority can only use the tokens in the bucket above that
+    // priority's reserve (see set_priority_reserve), so lower priority
+    // requests are rejected first as the bucket empties. The attempts,
+    // admissions (successes) and rejections (failures) for each priority are
+    // counted in the admission by priority table, if there is one.
+    //
+    // @param trail        - The SAS trail associated with this request
+    // @param priority     - The priority of the request
+    // @param cost         - The number of tokens the request needs
+    // @param allow_anyway - Whether the request should be allowed even if
+    //                       there aren't enough tokens
+    // @returns            - Whether the request can be admitted.
+    virtual bool admit_priority_request(SAS::TrailId trail,
+                                        SIPEventPriorityLevel priority,
+                                        float cost = 1,
+                                        bool allow_anyway = false);
+
+    // Reserves a share of the bucket for requests of higher priorities than
+    // this one. A request of this priority is only admitted if at least
+    // `reserved_share` of the bucket's maximum size is left once it has
+    // taken its tokens. Lower priorities should have larger reserves. No
+    // priority has a reserve by default.
+    //
+    // @param priority       - The priority to set the reserve for
+    // @param reserved_share - The share of the bucket to leave (from 0 to 1)
+    void set_priority_reserve(SIPEventPriorityLevel priority,
+                              float reserved_share);
+
     // This is called after a request that the load monitor is interested in
     // completes successfully. It adds the latency of the request to the
     // smoothed mean of all request latencies. If REQUESTS_BEFORE_ADJUSTMENT
     // requests have completed then it recalculates the refill rate.
     //
+    // Neither this nor admit_request() takes the lock, except to recalculate
+    // the refill rate.
+    //
     // @param latency_us - How long the request took in microseconds
     // @param trail      - The SAS trail associated with this request
     virtual void request_complete(uint64_t latency_us, SAS::TrailId trail);
@@ -105,41 +187,90 @@ class LoadMonitor
 
     // Get functions for member variables (used for logging)
     virtual int get_target_latency_us() { return _target_latency_us; }
-    int get_current_latency_us() { return _smoothed_latency_us; }
+    int get_current_latency_us();
     float get_rate_limit() { return _bucket.rate(); }
 
+    // The latency that the rate was last adjusted on, as a proportion of the
+    // target latency - so above 1 when overloaded.
+    float load() { return _load.load(std::memory_order_relaxed); }
+
+    // Publish the rate limit, load (in thousandths) and penalties each time
+    // the rate is recalculated, e.g. so that other nodes can balance traffic
+    // away from this one before it starts rejecting requests. The statistic
+    // must outlive the load monitor.
+    void set_state_statistic(Statistic* statistic) { _state_statistic = statistic; }
+
+    // The latencies of all the completed requests, e.g. to export their
+    // percentiles in an SNMP::LatencyPercentileTable.
+    const LatencyHistogram& latencies() const { return _latencies; }
+
   private:
     // Updates the load monitor statistics
-    virtual void update_statistics();
+    virtual void update_statistics(uint64_t smoothed_latency_us,
+                                   uint64_t percentile_latency_us,
+                                   int penalties);
+
+    // Recalculates the refill rate from the requests completed since it was
+    // last calculated.  Must be called with the lock held.
+    void adjust_rate(uint64_t current_time_us, SAS::TrailId trail);
+
+    static const int NUM_SHARDS = 16;
+
+    // The latencies and rates of the requests completed since the refill rate
+    // was last calculated, split across shards so that completing threads
+    // don't contend. This is padded so that no two shards share a cache line.
+    struct CompletionShard
+    {
+      std::atomic<uint64_t> count;
+      std::atomic<uint64_t> latency_sum_us;
+
+      // The sum of the request rates, in thousandths of a request/second.
+      std::atomic<uint64_t> rate_sum_ms;
+      char padding[64];
+    };
+
+    // Sums the completions across the shards, optionally resetting them.
+    void read_completions(uint64_t& count,
+                          uint64_t& latency_sum_us,
+                          uint64_t& rate_sum_ms,
+                          bool reset);
+
+    // Returns the calling thread's shard.
+    static int shard_index()
+    {
+      static std::atomic<unsigned int> next_shard(0);
+      static thread_local int shard = next_shard++ % NUM_SHARDS;
+      return shard;
+    }
 
     // The underlying Token Bucket.
     TokenBucket _bucket;
 
-    // The smoothed mean of the request latencies (in microseconds)
-    uint64_t _smoothed_latency_us;
+    CompletionShard _completions[NUM_SHARDS];
+
+    // The distribution of the request latencies. This is recorded without
+    // holding the lock.
+    LatencyHistogram _latencies;
 
     // The latency (in microseconds) we expect the average request to take.
     // If the average latency is lower than this then we should accept more
     // work; if it's higher then we should accept less work.
     uint64_t _target_latency_us;
 
-    // The smoothed mean of the current rate we're completing requests (in
-    // requests/second).
-    float _smoothed_rate_s;
-
     // Number of accepted requests (reset when the rate is recalculated).
-    int _accepted;
+    std::atomic<int> _accepted;
 
     // Number of rejected requests (reset when the rate is recalculated).
-    int _rejected;
+    std::atomic<int> _rejected;
 
     // Number of requests where a different node has returned an overload
     // response (reset when the rate is recalculated).
-    int _penalties;
+    std::atomic<int> _penalties;
 
     // Number of requests processed since the refill rate was last calculated
-    // (reset when the rate is recalculated).
-    int _adjust_count;
+    // (reduced by the requests taken into account when the rate is
+    // recalculated).
+    std::atomic<int> _adjust_count;
 
     // Statistics tables for the load monitor statistics
     SNMP::AbstractContinuousAccumulatorTable* _token_rate_table;
@@ -147,13 +278,33 @@ class LoadMonitor
     SNMP::AbstractScalar* _target_latency_scalar;
     SNMP::AbstractScalar* _penalties_scalar;
     SNMP::AbstractScalar* _token_rate_scalar;
+    SNMP::AbstractScalar* _percentile_latency_scalar;
+    SNMP::SuccessFailCountByPriorityAndScopeTable* _admission_by_priority_table;
+    std::atomic<Statistic*> _state_statistic;
+
+    // The latency the rate was last adjusted on, as a proportion of the
+    // target latency.
+    std::atomic<float> _load;
+
+    // The share of the bucket reserved for higher priorities than each
+    // priority.
+    static const int NUM_PRIORITIES = HIGH_PRIORITY_15 + 1;
+    std::atomic<float> _priority_reserves[NUM_PRIORITIES];
+
+    // The percentile of the latencies that the refill rate is based on, or 0
+    // to use the smoothed mean. Protected by the lock.
+    double _latency_percentile;
+
+    // The latencies recorded when the refill rate was last calculated, so
+    // that the latencies since then can be found. Protected by the lock.
+    LatencyHistogram::Snapshot _last_latencies;
 
-    // This must be held when accessing any of this object's member variables.
-    pthread_mutex_t _lock;
+    // This must be held when recalculating the refill rate.
+    ProfiledMutex _lock;
 
     // Time in microseconds since the refill rate was last calculated (reset
     // when the rate is recalculated).
-    uint64_t _last_adjustment_time_us;
+    std::atomic<uint64_t> _last_adjustment_time_us;
 
     // Number of requests processed before each adjustment of token bucket rate
     const int REQUESTS_BEFORE_ADJUSTMENT = 20;
@@ -17,10 +17,23 @@
 
 #include "store.h"
 
+/// @class LocalStore
+///
+/// An in-memory Store, for use where there is no networked store (and in
+/// tests).  Records are split into shards by the hash of their key, each
+/// with its own lock, so threads using different keys rarely contend.
+///
+/// Expired records are removed when they are next read, and by a sweep that
+/// each operation on a shard advances a few records, so that records that
+/// aren't read again are removed without a background thread.
 class LocalStore : public Store
 {
 public:
-  LocalStore();
+  static const unsigned int DEFAULT_NUM_SHARDS = 16;
+
+  /// @param num_shards - The number of shards, which is rounded up to a
+  ///                     power of two.
+  LocalStore(unsigned int num_shards = DEFAULT_NUM_SHARDS);
   virtual ~LocalStore();
 
   void flush_all();
@@ -61,6 +74,20 @@ public:
   Store::Status delete_data(const std::string& table,
                             const std::string& key,
                             SAS::TrailId trail = 0) override;
+
+  void get_data_multi(const std::string& table,
+                      const std::vector<std::string>& keys,
+                      std::vector<Store::GetResult>& results,
+                      SAS::TrailId trail = 0,
+                      bool log_body = true,
+                      Store::Format data_format = Store::Format::HEX) override;
+
+  void set_data_multi(const std::string& table,
+                      const std::vector<Store::SetRequest>& requests,
+                      std::vector<Store::Status>& statuses,
+                      SAS::TrailId trail = 0,
+                      bool log_body = true,
+                      Store::Format data_format = Store::Format::HEX) override;
 private:
   Store::Status set_data_inner(const std::string& table,
                                const std::string& key,
@@ -75,13 +102,63 @@ private:
     uint32_t expiry;
     uint64_t cas;
   } Record;
+
+  // The number of records each operation on a shard checks for expiry.
+  static const int SWEEP_BATCH = 2;
+
+  // The size of a shard is padded to a multiple of the cache line size, and
+  // the shards are allocated on a cache line boundary, so that the locks of
+  // neighbouring shards don't share a line.
+  struct alignas(64) Shard
+  {
+    Shard() : db(), old_db(), sweep_key()
+    {
+      pthread_mutex_init(&lock, NULL);
+    }
+
+    ~Shard()
+    {
+      pthread_mutex_destroy(&lock);
+    }
+
+    pthread_mutex_t lock;
+    std::map<std::string, Record> db;
+
+    // The record each key had before its last update, for force_contention.
+    std::map<std::string, Record> old_db;
+
+    // The key the expiry sweep has reached.
+    std::string sweep_key;
+  };
+
+  Shard& shard_for(const std::string& fqkey);
+
+  // Read and write a record.  These must be called with the shard's lock
+  // held.
+  Store::Status get_record(std::map<std::string, Record>& db,
+                           const std::string& fqkey,
+                           std::string& data,
+                           uint64_t& cas,
+                           uint32_t now);
+  Store::Status set_record(Shard& shard,
+                           const std::string& fqkey,
+                           const std::string& data,
+                           uint64_t cas,
+                           bool check_cas,
+                           int expiry,
+                           uint32_t now);
+
+  // Removes up to SWEEP_BATCH expired records from a shard, continuing from
+  // where the last sweep of the shard stopped.  This must be called with the
+  // shard's lock held.
+  void sweep(Shard& shard, uint32_t now);
+
   bool _data_contention_flag;
-  pthread_mutex_t _db_lock;
-  std::map<std::string, Record> _db;
+  Shard* _shards;
+  unsigned int _num_shards;
   bool _force_error_on_set_flag;
   bool _force_error_on_get_flag;
   bool _force_error_on_delete_flag;
-  std::map<std::string, Record> _old_db;
 };
 
 
@@ -15,8 +15,14 @@
 
 #include "logger.h"
 #include <cstdarg>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <atomic>
+#include <string>
+#include <type_traits>
 
-#define TRC_RAMTRACE(level, ...) RamRecorder::record(level, __FILE__, __LINE__, ##__VA_ARGS__)
+#define TRC_RAMTRACE(level, ...) RamRecorder::record_binary(level, __FILE__, __LINE__, ##__VA_ARGS__)
 
 #define TRC_MAYBE_RAMTRACE(...)                                            \
 do {                                                                       \
@@ -25,8 +31,36 @@ do {                                                                       \
   }                                                                        \
 } while (0)
 
-#define TRC_LOG(level, ...) if (Log::enabled(level)) Log::write(level, __FILE__, __LINE__, ##__VA_ARGS__)
-#define TRC_BASE(level, ...) do { TRC_MAYBE_RAMTRACE(level, ##__VA_ARGS__); TRC_LOG(level, ##__VA_ARGS__); } while (0)
+// Log statements above this level are compiled out altogether (including
+// from the RAM trace), so their arguments are never evaluated.  Builds can
+// define this (e.g. -DTRC_COMPILED_LEVEL=4 to remove debug logs) - by default
+// every level is compiled in.
+#ifndef TRC_COMPILED_LEVEL
+#define TRC_COMPILED_LEVEL 5
+#endif
+
+// The level of the current source file.  Each use looks the file up once,
+// and just reads its level from then on.
+#define TRC_MODULE_LEVEL()                                                 \
+  ([]() -> Log::ModuleLevel* {                                             \
+    static Log::ModuleLevel* const trc_level = Log::module_level(__FILE__); \
+    return trc_level;                                                      \
+  }())
+
+// Whether logs at a level are enabled for the current source file, taking
+// account of any level set for the file with Log::setModuleLoggingLevel().
+#define TRC_ENABLED(level)                                                 \
+  (((level) <= TRC_COMPILED_LEVEL) &&                                      \
+   Log::enabled(level, TRC_MODULE_LEVEL()))
+
+#define TRC_LOG(level, ...) do { if (TRC_ENABLED(level)) Log::write(level, __FILE__, __LINE__, ##__VA_ARGS__); } while (0)
+#define TRC_BASE(level, ...)                                               \
+do {                                                                       \
+  if ((level) <= TRC_COMPILED_LEVEL) {                                     \
+    TRC_MAYBE_RAMTRACE(level, ##__VA_ARGS__);                              \
+    TRC_LOG(level, ##__VA_ARGS__);                                         \
+  }                                                                        \
+} while (0)
 
 #define TRC_ERROR(...) TRC_BASE(Log::ERROR_LEVEL, ##__VA_ARGS__)
 #define TRC_WARNING(...) TRC_BASE(Log::WARNING_LEVEL, ##__VA_ARGS__)
@@ -59,6 +93,31 @@ namespace Log
     return (level <= loggingLevel);
 #endif
   }
+
+  /// The logging level of a module (source file), or -1 to use the global
+  /// level.
+  typedef std::atomic<int> ModuleLevel;
+
+  /// Get the level of the module containing a file (named as in log lines,
+  /// i.e. without any directory).  The returned level lives for the rest of
+  /// the process.
+  ModuleLevel* module_level(const char* file);
+
+  /// Set the logging level of a module, overriding the global level for its
+  /// logs - e.g. to debug one module without turning on debug logs
+  /// everywhere.  A level of -1 removes the override.
+  void setModuleLoggingLevel(const std::string& module, int level);
+
+  inline bool enabled(int level, const ModuleLevel* module)
+  {
+#ifdef UNIT_TEST
+    return true;
+#else
+    int module_level = module->load(std::memory_order_relaxed);
+    return (level <= ((module_level < 0) ? loggingLevel : module_level));
+#endif
+  }
+
   void setLoggingLevel(int level);
   Logger* setLogger(Logger *log);
   void write(int level, const char *module, int line_number, const char *fmt, ...);
@@ -78,6 +137,105 @@ namespace RamRecorder
   void reset();
   void write(const char* buffer, size_t length);
   void dump(const std::string& output_dir);
+
+  /// Write the buffers of another process to a file, without stopping it (it
+  /// must allow this process to read its memory - see process_vm_readv).
+  /// The other process must be the one this process was forked from, so that
+  /// the formats of binary traces are at the same addresses in both - traces
+  /// from libraries it has loaded since the fork can't be formatted.
+  ///
+  /// @return false if the other process's memory couldn't be read.
+  bool dump_remote(pid_t pid, FILE* file);
+
+  /// The arguments to a trace recorded in binary, encoded as they are
+  /// passed.  Strings are copied (bounded by any precision in the format,
+  /// which is why the format is needed), and everything else is stored as
+  /// its raw value.  If the arguments don't fit, the rest are dropped.
+  class BinaryArgs
+  {
+  public:
+    static const size_t MAX_SIZE = 1024;
+
+    BinaryArgs(const char* format);
+
+    void add_signed(int64_t value);
+    void add_unsigned(uint64_t value);
+    void add_double(double value);
+    void add_string(const char* value);
+    void add_pointer(const void* value);
+    void add_unknown();
+
+    const char* data() const { return _data; }
+    size_t length() const { return _length; }
+
+  private:
+    // Moves through the format to the conversion that the next argument is
+    // for, if the last argument completed one.
+    void next_arg();
+
+    void add(uint8_t type, const void* value, size_t length);
+
+    const char* _format;
+    bool _need_spec;
+    bool _width_star;
+    bool _precision_star;
+    int _precision;
+
+    char _data[MAX_SIZE];
+    size_t _length;
+
+    // Set once an argument didn't fit.
+    bool _full;
+  };
+
+  inline void add_arg(BinaryArgs& args, const char* value) { args.add_string(value); }
+  inline void add_arg(BinaryArgs& args, char* value) { args.add_string(value); }
+
+  template<typename T>
+  inline typename std::enable_if<std::is_floating_point<T>::value>::type
+    add_arg(BinaryArgs& args, T value) { args.add_double(value); }
+
+  template<typename T>
+  inline typename std::enable_if<(std::is_integral<T>::value && std::is_signed<T>::value) ||
+                                 std::is_enum<T>::value>::type
+    add_arg(BinaryArgs& args, T value) { args.add_signed((int64_t)value); }
+
+  template<typename T>
+  inline typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value>::type
+    add_arg(BinaryArgs& args, T value) { args.add_unsigned(value); }
+
+  template<typename T>
+  inline void add_arg(BinaryArgs& args, T* value) { args.add_pointer((const void*)value); }
+
+  template<typename T>
+  inline typename std::enable_if<!std::is_arithmetic<T>::value &&
+                                 !std::is_enum<T>::value &&
+                                 !std::is_pointer<T>::value &&
+                                 !std::is_array<T>::value>::type
+    add_arg(BinaryArgs& args, const T&) { args.add_unknown(); }
+
+  inline void add_args(BinaryArgs&) {}
+
+  template<typename T, typename... Rest>
+  inline void add_args(BinaryArgs& args, const T& first, const Rest&... rest)
+  {
+    add_arg(args, first);
+    add_args(args, rest...);
+  }
+
+  void _record_binary(int level, const char* module, int lineno, const char* format, const BinaryArgs& args);
+
+  /// Record a trace without formatting it - the format and arguments are
+  /// stored, and only formatted if the buffer is dumped.  The module and
+  /// format must be string literals (as they are from the TRC_* macros), as
+  /// only pointers to them are kept.
+  template<typename... Args>
+  inline void record_binary(int level, const char* module, int lineno, const char* format, const Args&... args)
+  {
+    BinaryArgs binary_args(format);
+    add_args(binary_args, args...);
+    _record_binary(level, module, lineno, format, binary_args);
+  }
 }
 
 #endif
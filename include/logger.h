@@ -19,6 +19,11 @@
 #include <pthread.h>
 #include <atomic>
 
+#include "profiled_mutex.h"
+
+struct iovec;
+class IoUringWriter;
+
 /// Encodes the time as needed by the logger.
 typedef struct
 {
@@ -32,6 +37,14 @@ typedef struct
   int yday;
 } timestamp_t;
 
+/// Writes logs to stdout, or to a series of hourly files.
+///
+/// Lines are collected in a buffer and written to the file (opened with
+/// O_APPEND) a buffer at a time.  By default the buffer is written after
+/// each line if FLUSH_ON_WRITE is set, and the hour is checked on each line
+/// to decide when to cycle the file.  start_batching() switches to a
+/// lower-overhead mode, where a background thread writes the buffer
+/// periodically, cycles the file on the hour and optionally fdatasyncs it.
 class Logger
 {
 public:
@@ -44,8 +57,39 @@ public:
   int get_flags() const;
   void set_flags(int flags);
 
+  /// How durable to make the log file in batching mode.
+  enum Durability
+  {
+    // Leave the file for the kernel to write back.
+    NO_SYNC,
+
+    // fdatasync the file periodically.
+    PERIODIC_SYNC
+  };
+
+  /// Switch to batching mode, where lines are written when the buffer fills
+  /// or every flush_interval_ms (whichever is first) rather than on each
+  /// write - FLUSH_ON_WRITE is ignored.  A background thread writes the
+  /// buffer and cycles the log file on the hour, so lines aren't checked
+  /// against the hour as they are written.  With PERIODIC_SYNC, the thread
+  /// also fdatasyncs the file every sync_interval_ms if it has been written
+  /// to.  Call this at most once, before the logger is used.
+  void start_batching(long flush_interval_ms,
+                      Durability durability = NO_SYNC,
+                      long sync_interval_ms = 1000);
+
+  /// Write the log file through an io_uring writer, so that writing it
+  /// doesn't block the thread flushing the buffer.  The writer must outlive
+  /// the logger, and is ignored if io_uring isn't available.  Crash paths
+  /// (commit() and the backtraces) stop using the writer and write the file
+  /// directly, as the writer isn't safe to use from a signal handler.
+  void set_io_uring_writer(IoUringWriter* writer);
+
   virtual void write(const char* data);
   virtual void flush();
+
+  // Write out the buffer and sync the log file.  This is called from a signal
+  // handler, so isn't thread-safe.
   virtual void commit();
 
   // Dump a simple backtrace (using functionality available from within the
@@ -66,6 +110,10 @@ public:
   // threads are running - generally from a signal handler.
   virtual void backtrace_advanced();
 
+  // Whether write() only buffers the data for another thread to write, in
+  // which case callers don't need to serialize their calls to it.
+  virtual bool is_async() const { return false; }
+
   static void get_timestamp(timestamp_t& ts, struct timespec& timespec);
   static void format_timestamp(const timestamp_t& ts, char* buf, size_t len);
 
@@ -74,29 +122,90 @@ protected:
   virtual void gettime(struct timespec* ts);
 
   void get_timestamp(timestamp_t& ts);
+
+  // Write a batch of lines (already timestamped, if required) in as few
+  // system calls as possible, to the log file for the given time - cycling or
+  // opening the file if necessary.  If there is no log file, the lines are
+  // counted as discards.  The iovecs are updated as they are written.
+  void write_batch(struct iovec* iov,
+                   int iovcnt,
+                   int lines,
+                   const timestamp_t& ts);
+
+  // Write a batch of lines to the current log file (if any) without locking
+  // or cycling it.  As for backtrace_simple(), this is for use from signal
+  // handlers and is not thread-safe.
+  void write_batch_unlocked(struct iovec* iov, int iovcnt);
+
 private:
+  // Prepare to write to the log file at the given time, opening it if
+  // required and (outside batching mode) cycling it on the hour.  Called with
+  // the lock held.  Returns whether there is a log file to write to.
+  bool prepare_log_file(const timestamp_t& ts);
+
+  // Cycle or open the log file if required for the given time, and log any
+  // discards once a file is opened.  Called with the lock held.
+  void check_log_file(const timestamp_t& ts);
+
   void write_log_file(const char* data, const timestamp_t& ts);
+  void write_log_file(struct iovec* iov, int iovcnt);
   void cycle_log_file(const timestamp_t& ts);
 
+  // Add data to the buffer, writing the buffer out first if it won't fit.
+  void buffer_data(const char* data, size_t length);
+
+  // Write out the buffer.
+  void flush_buffer();
+
+  // Write data straight to the log file, closing it on error.
+  void write_fd(const char* data, size_t length);
+  void close_fd();
+
+  static void* batching_thread_fn(void* logger);
+  void batching_thread_fn();
+
   // Two methods to use with pthread_cleanup_push to release the lock if the logging thread is
   // forcibly killed.
   static void release_lock(void* logger) {((Logger*)logger)->release_lock();}
-  void release_lock() {pthread_mutex_unlock(&_lock);}
+  void release_lock() {_lock.unlock();}
 
   int _flags;
   int _last_hour;
   bool _rotate;
   struct timespec _last_rotate;
-  FILE* _fd;
+
+  // The log file, or -1 if there isn't one open.
+  int _fd;
+
+  // Lines waiting to be written to the log file.
+  char* _buffer;
+  size_t _buffered;
+
+  // Batching mode settings, and the background thread.
+  bool _batching;
+  long _flush_interval_ms;
+  Durability _durability;
+  long _sync_interval_ms;
+  bool _written_since_sync;
+  pthread_t _batching_thread;
+  pthread_cond_t _terminate_cond;
+  bool _terminated;
+
+  // The io_uring writer to write the log file through, if any.
+  IoUringWriter* _writer;
+
   int _discards;
   int _saved_errno;
   std::string _filename;
   std::string _directory;
-  pthread_mutex_t _lock;
+  ProfiledMutex _lock;
 
   /// Defines how frequently (in seconds) we will try to reopen a log
   /// file when we have previously failed to use it.
   const static double LOGFILE_RETRY_FREQUENCY;
+
+  /// The size of the buffer.
+  const static size_t BUFFER_SIZE = 65536;
 };
 
 
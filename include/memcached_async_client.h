@@ -0,0 +1,202 @@
+/**
+ * @file memcached_async_client.h  Non-blocking memcached binary protocol
+ * client.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef MEMCACHED_ASYNC_CLIENT_H__
+#define MEMCACHED_ASYNC_CLIENT_H__
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <unordered_map>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libmemcached/memcached.h>
+}
+
+#include "utils.h"
+
+/// Sends memcached requests without blocking the caller, using the binary
+/// protocol.  A single I/O thread owns the sockets and waits on all of them
+/// with epoll.  Each target has one connection, opened when it is first
+/// needed, and requests to a target are pipelined on it - they are written
+/// as soon as they are queued, without waiting for earlier responses.
+///
+/// A quiet request (see Request::quiet) is sent with the protocol's quiet
+/// variant of its command, so memcached only responds if it fails.  A no-op
+/// is sent after each run of quiet requests to a target, and its response
+/// shows that the quiet requests before it succeeded.
+///
+/// Results are reported with libmemcached's return codes, so callers can
+/// treat them like the results of the blocking API.  A target that doesn't
+/// respond within the timeout fails all the requests outstanding on its
+/// connection with MEMCACHED_TIMEOUT, and the connection is closed (as the
+/// stream can't be trusted after that).
+class MemcachedAsyncClient
+{
+public:
+  /// The commands that can be sent.
+  enum Opcode
+  {
+    GET = 0x00,
+    SET = 0x01,
+    ADD = 0x02,
+    DELETE = 0x04,
+    NOOP = 0x0a
+  };
+
+  struct Request
+  {
+    Request() : opcode(GET), cas(0), expiration(0), flags(0), quiet(false) {}
+
+    Opcode opcode;
+    std::string key;
+    std::string value;
+
+    /// For SET, the CAS value the record must have (or zero for none).
+    uint64_t cas;
+
+    /// For SET and ADD, the expiration (as passed to memcached_set).
+    uint32_t expiration;
+    uint32_t flags;
+
+    /// For SET, ADD and DELETE, whether to send the quiet command, which
+    /// memcached doesn't respond to unless it fails.  The callback is still
+    /// called, but the result has no CAS value.
+    bool quiet;
+  };
+
+  struct Result
+  {
+    memcached_return_t rc;
+
+    /// For GET, the record's value and CAS value.
+    std::string value;
+    uint64_t cas;
+  };
+
+  /// Called with the result of a request.  This is called on the I/O thread,
+  /// so mustn't block - it may send further requests.
+  typedef std::function<void(const Result&)> Callback;
+
+  /// @param timeout_ms     How long to wait for a response (including
+  ///                       connecting, if there isn't a connection).
+  /// @param source_address If not empty, the address to bind connections to.
+  MemcachedAsyncClient(int timeout_ms, const std::string& source_address = "");
+
+  /// Stops the I/O thread.  Any requests still outstanding fail with
+  /// MEMCACHED_ERROR.
+  ~MemcachedAsyncClient();
+
+  /// Queues a request to a target.  If the client is being destroyed, the
+  /// callback is called (with MEMCACHED_ERROR) before this returns.
+  void send(const AddrInfo& target, const Request& request, Callback callback);
+
+  /// Calls a function on the I/O thread after a delay, for example to send
+  /// another request if the first hasn't completed by then.  The function
+  /// mustn't block.  If the client is destroyed first, the function is called
+  /// then (when any requests it sends fail straight away).
+  void schedule(unsigned long delay_ms, std::function<void()> fn);
+
+private:
+  struct Pending
+  {
+    uint32_t opaque;
+    unsigned long deadline_ms;
+    bool quiet;
+    Callback callback;
+  };
+
+  struct Connection
+  {
+    AddrInfo target;
+    int fd;
+    bool connected;
+
+    // The events the connection's socket is registered for.
+    uint32_t events;
+
+    // Requests that have been queued, in the order they were sent.
+    std::deque<Pending> pending;
+
+    // Data waiting to be written, and data read that doesn't yet make up a
+    // whole response.
+    std::string out;
+    size_t out_offset;
+    std::string in;
+
+    // Whether a no-op needs to be sent to find out whether the quiet
+    // requests last sent succeeded.
+    bool needs_noop;
+  };
+
+  struct Queued
+  {
+    AddrInfo target;
+    Request request;
+    Callback callback;
+  };
+
+  struct Timer
+  {
+    unsigned long deadline_ms;
+    std::function<void()> fn;
+  };
+
+  static void* io_thread_fn(void* client);
+  void io_thread_fn();
+
+  // Helpers for the I/O thread.
+  void start_request(Queued& queued, unsigned long now_ms);
+  void send_noop(Connection* conn, unsigned long now_ms);
+  void run_timers(unsigned long now_ms);
+  void wake_io_thread();
+  Connection* get_connection(const AddrInfo& target);
+  bool open_connection(Connection* conn);
+  void write_connection(Connection* conn);
+  void read_connection(Connection* conn);
+  bool process_response(Connection* conn);
+  void update_events(Connection* conn);
+  void fail_connection(Connection* conn, memcached_return_t rc);
+
+  static void encode_request(const Request& request,
+                             uint32_t opaque,
+                             std::string& out);
+  static memcached_return_t status_to_rc(uint16_t status);
+  static unsigned long now_ms();
+
+  const int _timeout_ms;
+  const std::string _source_address;
+
+  // Requests waiting for the I/O thread, protected by _lock.
+  pthread_mutex_t _lock;
+  std::vector<Queued> _queue;
+  std::vector<Timer> _timer_queue;
+  bool _terminated;
+
+  // The rest is only used by the I/O thread.
+  pthread_t _io_thread;
+  int _epoll_fd;
+  int _event_fd;
+  uint32_t _next_opaque;
+  std::unordered_map<AddrInfo, Connection*> _connections;
+  std::map<int, Connection*> _connection_fds;
+
+  // Timers that have been scheduled, by the time they're due.
+  std::multimap<unsigned long, std::function<void()>> _timers;
+};
+
+#endif
@@ -46,6 +46,8 @@ public:
       REMOTE_SITE_MEMCACHED_CONNECTION_LATENCY_MS :
       LOCAL_SITE_MEMCACHED_CONNECTION_LATENCY_MS)
   {
+    // Free idle connections in the background, rather than on every release.
+    start_idle_reaper();
   }
 
   ~MemcachedConnectionPool()
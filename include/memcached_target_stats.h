@@ -0,0 +1,132 @@
+/**
+ * @file memcached_target_stats.h  Statistics about the requests sent to one
+ * memcached target.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef MEMCACHED_TARGET_STATS_H__
+#define MEMCACHED_TARGET_STATS_H__
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+#include "latency_histogram.h"
+
+/// Counts the requests a memcached store sends to one target: how long they
+/// take, how much data they carry, and how often they fail in a way that
+/// means the next target is tried, read a tombstone or hit CAS contention.
+///
+/// As for LatencyHistogram, recording doesn't take a lock - the counts are
+/// split across shards used by different threads, and added up when read.
+class MemcachedTargetStats
+{
+public:
+  /// The counts at a point in time.
+  struct Snapshot
+  {
+    uint64_t requests;
+
+    /// Requests that failed such that the request was tried on the next
+    /// target.
+    uint64_t retries;
+
+    /// Bytes of keys and values sent, and of values received.
+    uint64_t bytes_out;
+    uint64_t bytes_in;
+
+    /// Reads that found a tombstone.
+    uint64_t tombstones;
+
+    /// Writes that failed because the CAS value didn't match, or the record
+    /// already existed.
+    uint64_t contention;
+  };
+
+  /// @param name - The name of the target, e.g. "10.0.0.1:11211".
+  MemcachedTargetStats(const std::string& name);
+
+  const std::string& name() const { return _name; }
+
+  /// Record a request.
+  ///
+  /// @param latency_us - How long the request took.
+  /// @param bytes_out  - How many bytes of keys and values it sent.
+  /// @param retried    - Whether it failed, so the next target was tried.
+  void record_request(uint64_t latency_us, size_t bytes_out, bool retried)
+  {
+    _latency.record(latency_us);
+    Shard& shard = _shards[shard_index()];
+    shard.requests.fetch_add(1, std::memory_order_relaxed);
+    shard.bytes_out.fetch_add(bytes_out, std::memory_order_relaxed);
+
+    if (retried)
+    {
+      shard.retries.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  /// Record the values a request read.
+  void record_bytes_in(size_t bytes_in)
+  {
+    _shards[shard_index()].bytes_in.fetch_add(bytes_in, std::memory_order_relaxed);
+  }
+
+  /// Record that a read found a tombstone.
+  void record_tombstone()
+  {
+    _shards[shard_index()].tombstones.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  /// Record that a write hit CAS contention.
+  void record_contention()
+  {
+    _shards[shard_index()].contention.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  /// Get the current counts.
+  void snapshot(Snapshot& snapshot) const;
+
+  /// @return the latencies of the requests.
+  const LatencyHistogram& latency() const { return _latency; }
+
+private:
+  static const int NUM_SHARDS = 16;
+
+  // A set of counts, padded so that no two shards share a cache line.
+  struct Shard
+  {
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> retries;
+    std::atomic<uint64_t> bytes_out;
+    std::atomic<uint64_t> bytes_in;
+    std::atomic<uint64_t> tombstones;
+    std::atomic<uint64_t> contention;
+    char padding[64];
+  };
+
+  // Returns the calling thread's shard, as for LatencyHistogram.
+  static int shard_index()
+  {
+    static std::atomic<unsigned int> next_shard(0);
+    static thread_local int shard = next_shard++ % NUM_SHARDS;
+    return shard;
+  }
+
+  const std::string _name;
+  LatencyHistogram _latency;
+  Shard _shards[NUM_SHARDS];
+
+  // Don't implement the following, to avoid copies of this instance.
+  MemcachedTargetStats(MemcachedTargetStats const&);
+  void operator=(MemcachedTargetStats const&);
+};
+
+#endif
@@ -15,6 +15,10 @@
 
 #include <pthread.h>
 
+#include <atomic>
+#include <memory>
+
+#include <map>
 #include <sstream>
 #include <vector>
 
@@ -32,6 +36,15 @@ extern "C" {
 #include "communicationmonitor.h"
 #include "astaire_resolver.h"
 #include "memcached_connection_pool.h"
+#include "memcached_async_client.h"
+#include "latency_histogram.h"
+#include "hedge_monitor.h"
+#include "retry_budget.h"
+#include "memcached_target_stats.h"
+#include "snmp_memcached_target_table.h"
+#include "snmp_latency_histogram_table.h"
+#include "versioned_config.h"
+#include "single_flight.h"
 
 class BaseMemcachedStore : public Store
 {
@@ -43,6 +56,14 @@ public:
   // we expect there to be servers.
   bool has_servers() { return true; };
 
+  // Construct a fully qualified key from the specified table and key within
+  // that table.
+  static inline std::string get_fq_key(const std::string& table,
+                                       const std::string& key)
+  {
+    return table + "\\\\" + key;
+  }
+
 protected:
   // Whether this store is using the binary protocol (required for vbucket
   // support).
@@ -69,6 +90,12 @@ protected:
   // instead of using tombstones.
   int _tombstone_lifetime;
 
+  // How long to wait for memcached to respond (see the constructor).
+  int _poll_timeout_ms;
+
+  // The address to bind connections to, if not empty.
+  std::string _source_address;
+
   // Constructor. This is protected to prevent the BaseMemcachedStore from being
   // instantiated directly.
   BaseMemcachedStore(bool binary,
@@ -76,13 +103,23 @@ protected:
                      BaseCommunicationMonitor* comm_monitor,
                      const std::string& source_address = "");
 
-  // Perform a get request to a single replica.
+  // Perform a get request to a single replica.  The data is returned in the
+  // buffer libmemcached read it into, without being copied.
   memcached_return_t get_from_replica(memcached_st* replica,
                                       const char* key_ptr,
                                       const size_t key_len,
-                                      std::string& data,
+                                      Store::Buffer& data,
                                       uint64_t& cas);
 
+  // Perform a get request for several keys to a single replica.  The records
+  // found are added to `found`, keyed by their keys along with their CAS
+  // values - any other keys were not found (or not returned if the request
+  // failed).
+  memcached_return_t get_multi_from_replica(
+    memcached_st* replica,
+    const std::vector<std::string>& keys,
+    std::map<std::string, std::pair<std::string, uint64_t>>& found);
+
   // Add a record to memcached. This overwrites any tombstone record already
   // stored, but fails if any real data is stored.
   memcached_return_t add_overwriting_tombstone(memcached_st* replica,
@@ -94,13 +131,79 @@ protected:
                                                uint32_t flags,
                                                SAS::TrailId trail);
 
-  // Construct a fully qualified key from the specified table and key within
-  // that table.
-  static inline std::string get_fq_key(const std::string& table,
-                                       const std::string& key)
+  // Memcached uses a flexible mechanism for specifying expiration.
+  // - 0 indicates never expire.
+  // - <= MEMCACHED_EXPIRATION_MAXDELTA indicates a relative (delta) time.
+  // - > MEMCACHED_EXPIRATION_MAXDELTA indicates an absolute time.
+  // Absolute time is the only way to force immediate expiry.  Unfortunately,
+  // it's not reliable (e.g. as a result of NTP changes). Instead, we use
+  // relative time for future times (expiry > 0) and the earliest absolute
+  // time for immediate expiry (expiry == 0).
+  static inline time_t get_memcached_expiration(int expiry)
   {
-    return table + "\\\\" + key;
+    return (time_t)((expiry > 0) ? expiry : MEMCACHED_EXPIRATION_MAXDELTA + 1);
   }
+
+  // Check that a write isn't too big and log its start to SAS.
+  //
+  // @return false if the write is too big.
+  bool start_set(const std::string& fqkey,
+                 const std::string& data,
+                 uint64_t cas,
+                 int expiry,
+                 SAS::TrailId trail,
+                 bool log_body,
+                 Store::Format data_format);
+
+  // Turn the result of writing a key into a status, logging it to SAS, and
+  // tell the communication monitor how it went.
+  Store::Status set_status(const std::string& fqkey,
+                           memcached_return_t rc,
+                           const std::vector<AddrInfo>& targets,
+                           SAS::TrailId trail);
+
+  // Tell the communication monitor how a read went.
+  void record_get_result(memcached_return_t rc,
+                         const std::vector<AddrInfo>& targets);
+
+  // Turn the result of reading a key into a status, logging it to SAS.
+  // Tombstones are returned as NOT_FOUND.
+  Store::Status get_status(const std::string& fqkey,
+                           memcached_return_t rc,
+                           const char* data,
+                           size_t length,
+                           uint64_t& cas,
+                           SAS::TrailId trail,
+                           bool log_body,
+                           Store::Format data_format);
+
+  Store::Status get_status(const std::string& fqkey,
+                           memcached_return_t rc,
+                           const std::string& data,
+                           uint64_t& cas,
+                           SAS::TrailId trail,
+                           bool log_body,
+                           Store::Format data_format)
+  {
+    return get_status(fqkey, rc, data.data(), data.length(),
+                      cas, trail, log_body, data_format);
+  }
+
+  Store::Status get_status(const std::string& fqkey,
+                           memcached_return_t rc,
+                           const Store::Buffer& data,
+                           uint64_t& cas,
+                           SAS::TrailId trail,
+                           bool log_body,
+                           Store::Format data_format)
+  {
+    return get_status(fqkey, rc, data.data(), data.length(),
+                      cas, trail, log_body, data_format);
+  }
+
+  // Determine if for a given memcached return code it is worth retrying a
+  // request to a different server in the domain.
+  static bool can_retry_memcached_rc(memcached_return_t rc);
 };
 
 /// @class TopologyNeutralMemcachedStore
@@ -124,10 +227,12 @@ public:
                                 BaseCommunicationMonitor* comm_monitor = NULL,
                                 const std::string& source_address = "");
 
-  ~TopologyNeutralMemcachedStore() {}
+  ~TopologyNeutralMemcachedStore();
 
   using Store::get_data;
   using Store::set_data;
+  using Store::get_data_async;
+  using Store::set_data_async;
 
   /// Gets the data for the specified table and key.
   Store::Status get_data(const std::string& table,
@@ -138,6 +243,17 @@ public:
                          bool log_body,
                          Store::Format data_format);
 
+  /// Gets the data for the specified table and key, in the buffer it was
+  /// read into (so it isn't copied).  With hedged reads, the buffer takes
+  /// over the string the asynchronous client returns.
+  Store::Status get_data(const std::string& table,
+                         const std::string& key,
+                         Store::Buffer& data,
+                         uint64_t& cas,
+                         SAS::TrailId trail,
+                         bool log_body,
+                         Store::Format data_format);
+
   /// Sets the data for the specified table and key.
   Store::Status set_data(const std::string& table,
                          const std::string& key,
@@ -162,6 +278,122 @@ public:
                             const std::string& key,
                             SAS::TrailId trail = 0);
 
+  /// Gets the data for several keys in the specified table, in one multi-get
+  /// per target.  Keys not found on a target that fails are retried on the
+  /// next target.
+  void get_data_multi(const std::string& table,
+                      const std::vector<std::string>& keys,
+                      std::vector<Store::GetResult>& results,
+                      SAS::TrailId trail = 0,
+                      bool log_body = true,
+                      Store::Format data_format = Store::Format::HEX);
+
+  /// Gets the data for the specified table and key without blocking.  The
+  /// requests are sent by an I/O thread (started by the first asynchronous
+  /// request), which calls the callback.  Targets and retries are as for
+  /// get_data.
+  void get_data_async(const std::string& table,
+                      const std::string& key,
+                      SAS::TrailId trail,
+                      bool log_body,
+                      Store::Format data_format,
+                      Store::GetCallback callback);
+
+  /// Sets the data for the specified table and key without blocking, with the
+  /// same CAS and tombstone handling as set_data.
+  void set_data_async(const std::string& table,
+                      const std::string& key,
+                      const std::string& data,
+                      uint64_t cas,
+                      int expiry,
+                      SAS::TrailId trail,
+                      bool log_body,
+                      Store::Format data_format,
+                      Store::SetCallback callback);
+
+  /// Sets the data for several keys in the specified table.  The targets are
+  /// looked up once for all the keys, but each key is written separately, as
+  /// each write has its own CAS check.
+  void set_data_multi(const std::string& table,
+                      const std::vector<Store::SetRequest>& requests,
+                      std::vector<Store::Status>& statuses,
+                      SAS::TrailId trail = 0,
+                      bool log_body = true,
+                      Store::Format data_format = Store::Format::HEX);
+
+  /// Turns hedged reads on or off (they are off by default).  When they are
+  /// on, a GET that the first target hasn't answered within the given
+  /// percentile of recent GET latencies is also sent to the next target, and
+  /// the first definitive answer is used.  GETs then always use the
+  /// asynchronous client, with get_data waiting for the result.
+  ///
+  /// This should be called before the store is used.
+  ///
+  /// @param enabled    - Whether to hedge reads.
+  /// @param percentile - The percentile of GET latencies after which to
+  ///                     hedge.
+  /// @param monitor    - Object counting hedges, and how often they win.
+  void set_hedged_reads(bool enabled,
+                        double percentile = 95.0,
+                        HedgeMonitor* monitor = NULL);
+
+  /// Reports statistics about the requests sent to each target in SNMP
+  /// tables: their latencies, the bytes they send and receive, and how often
+  /// they are retried on the next target, read tombstones or hit CAS
+  /// contention.  Each target is added to the tables when a request is first
+  /// sent to it.  Requests sent by the asynchronous client aren't counted.
+  ///
+  /// This should be called before the store is used, and the tables must be
+  /// destroyed before the store, as they read the stats it holds.
+  ///
+  /// @param table         - Table of each target's counts.
+  /// @param latency_table - Table of each target's latency histogram.
+  void set_target_stats_tables(SNMP::MemcachedTargetTable* table,
+                               SNMP::LatencyHistogramTable* latency_table);
+
+  /// Limits the requests that are retried on the next target to those
+  /// allowed by a retry budget (which may be shared with other clients of
+  /// the same tier).  A request whose retry is denied fails with the result
+  /// of the last target it tried.  Hedged GETs aren't limited, as they
+  /// already send at most one extra request.
+  ///
+  /// This should be called before the store is used.
+  void set_retry_budget(RetryBudget* budget)
+  {
+    _retry_budget = budget;
+  }
+
+  /// Turns fire-and-forget writes on or off (they are off by default).
+  ///
+  /// When they are on, set_data_without_cas and delete_data (including
+  /// writing tombstones) send the binary protocol's quiet commands on the
+  /// asynchronous client's pipelined connection, and return OK without
+  /// waiting for memcached.  A write that fails isn't retried on the next
+  /// target - the target is blacklisted, and the failure is reported to the
+  /// communication monitor, when memcached's response arrives.
+  ///
+  /// Writes with a CAS check (including adds that overwrite tombstones)
+  /// need memcached's response, so always wait for it.
+  void set_noreply_writes(bool enabled)
+  {
+    _noreply_writes = enabled;
+  }
+
+  /// Turns coalesced reads on or off (they are off by default).  When they
+  /// are on, a synchronous GET of a key that another thread is already
+  /// reading waits for that GET and shares its result, rather than sending
+  /// its own.  Only the thread that sends the GET logs it to SAS.
+  void set_coalesced_reads(bool enabled)
+  {
+    _coalesced_reads = enabled;
+  }
+
+  /// Get the counts of GETs sent and shared by coalesced reads.
+  void coalesced_read_stats(SingleFlightStats& stats) const
+  {
+    _coalesced_gets.stats(stats);
+  }
+
 protected:
   typedef std::function<memcached_return_t(ConnectionHandle<memcached_st*>&)> memcached_func;
   typedef std::function<memcached_return_t(ConnectionHandle<memcached_st*>&, time_t)> memcached_store_func;
@@ -173,6 +405,22 @@ protected:
                          SAS::TrailId trail,
                          memcached_store_func f);
 
+  // Set some data with the provided method, to targets that have already
+  // been looked up.
+  Store::Status set_data(std::vector<AddrInfo>& targets,
+                         const std::string& fqkey,
+                         const std::string& data,
+                         int expiry,
+                         SAS::TrailId trail,
+                         memcached_store_func f);
+
+  // Get the method that writes data with a CAS check (or adds it, if the CAS
+  // is zero).  This refers to fqkey and data, so they must outlive it.
+  memcached_store_func cas_store_func(const std::string& fqkey,
+                                      const std::string& data,
+                                      uint64_t cas,
+                                      SAS::TrailId trail);
+
   // The domain name for the memcached proxies.
   std::string _target_domain;
 
@@ -184,9 +432,133 @@ protected:
 
   MemcachedConnectionPool _conn_pool;
 
-  // Determine if for a given memcached return code it is worth retrying a
-  // request to a different server in the domain.
-  static bool can_retry_memcached_rc(memcached_return_t rc);
+  // The state of an asynchronous get or set while it tries each target.
+  struct AsyncOperation
+  {
+    bool is_get;
+    std::string fqkey;
+    std::string data;
+
+    // The CAS value to write with, or that was read.
+    uint64_t cas;
+    time_t memcached_expiration;
+    SAS::TrailId trail;
+    bool log_body;
+    Store::Format data_format;
+    std::vector<AddrInfo> targets;
+    size_t target_index;
+    memcached_return_t rc;
+    Utils::StopWatch stopwatch;
+
+    // When adding a record, the CAS value of a tombstone being overwritten,
+    // and the result of the write that found existing data.
+    uint64_t tombstone_cas;
+    memcached_return_t store_rc;
+
+    Store::GetCallback get_callback;
+    Store::SetCallback set_callback;
+
+    // For a hedged GET, the requests still outstanding, whether a timer (or
+    // the step that starts the GET) holds the operation, whether the callback
+    // has been called, and the target that the hedge was sent to.  The
+    // operation is deleted once nothing holds it.
+    unsigned int outstanding;
+    bool held;
+    bool complete;
+    size_t hedge_index;
+  };
+
+  // Helpers for asynchronous requests.  These follow iterate_through_targets
+  // and add_overwriting_tombstone, but each step is started from the
+  // callback of the one before.
+  MemcachedAsyncClient* async_client();
+  void start_async_operation(AsyncOperation* op);
+  void start_async_attempt(AsyncOperation* op);
+  void async_store(AsyncOperation* op);
+  void async_store_complete(AsyncOperation* op,
+                            const MemcachedAsyncClient::Result& result);
+  void finish_async_attempt(AsyncOperation* op, memcached_return_t rc);
+  void complete_async_operation(AsyncOperation* op);
+  void report_async_result(AsyncOperation* op);
+
+  // Helpers for hedged GETs.  These run on the client's I/O thread.
+  void start_hedged_get(AsyncOperation* op);
+  void send_hedged_get(AsyncOperation* op);
+  void hedged_get_complete(AsyncOperation* op,
+                           size_t index,
+                           Utils::StopWatch& stopwatch,
+                           const MemcachedAsyncClient::Result& result);
+  void hedge_timer_popped(AsyncOperation* op);
+  void release_hedged_get(AsyncOperation* op);
+
+  // Returns how long to wait before hedging a GET, or 0 not to hedge (as
+  // there aren't enough recent latencies to go on, or the first target would
+  // time out first anyway).
+  unsigned long hedge_delay_ms();
+
+  // The client for asynchronous requests, created when it's first needed.
+  pthread_mutex_t _async_lock;
+  MemcachedAsyncClient* _async_client;
+
+  // Hedged read settings, and the latencies of GETs that the hedge delay is
+  // worked out from.  The delay is cached, and recalculated every second.
+  std::atomic<bool> _hedged_reads;
+  double _hedge_percentile;
+  HedgeMonitor* _hedge_monitor;
+  LatencyHistogram _get_latency;
+  std::atomic<unsigned long> _hedge_delay_us;
+  std::atomic<unsigned long> _hedge_delay_expiry_ms;
+
+  // The stats for each target, if set_target_stats_tables has been called.
+  // Targets are added when they are first used, and never removed.
+  pthread_rwlock_t _target_stats_lock;
+  std::map<AddrInfo, MemcachedTargetStats*> _target_stats;
+  SNMP::MemcachedTargetTable* _target_table;
+  SNMP::LatencyHistogramTable* _target_latency_table;
+
+  // The budget that retries on the next target come out of, or NULL if
+  // they aren't limited.
+  RetryBudget* _retry_budget;
+
+  // Whether set_data_without_cas and delete_data use quiet commands.
+  std::atomic<bool> _noreply_writes;
+
+  // Whether synchronous GETs of the same key share one request, and the
+  // GETs in flight, by fully qualified key.
+  std::atomic<bool> _coalesced_reads;
+  SingleFlight<std::string, Store::GetResult> _coalesced_gets;
+
+  // Sends a GET to the targets (hedging it if hedged reads are on).
+  Store::Status read_data(const std::string& table,
+                          const std::string& key,
+                          Store::Buffer& data,
+                          uint64_t& cas,
+                          SAS::TrailId trail,
+                          bool log_body,
+                          Format data_format);
+
+  // Sends a hedged GET with the asynchronous client and waits for it.
+  Store::Status get_data_hedged(const std::string& table,
+                                const std::string& key,
+                                std::string& data,
+                                uint64_t& cas,
+                                SAS::TrailId trail,
+                                bool log_body,
+                                Format data_format);
+
+  // Sends a quiet write to the first target, without waiting for the result.
+  Store::Status send_noreply(const MemcachedAsyncClient::Request& request,
+                             SAS::TrailId trail);
+
+  // Records that a request got a definitive answer from the target with the
+  // given index, and returns whether a failed request may be retried on the
+  // next target, according to the retry budget.
+  void record_answer(size_t target_index);
+  bool retry_allowed();
+
+  // Returns the stats for a target, creating them if this is the first
+  // request to it, or NULL if stats aren't being kept.
+  MemcachedTargetStats* target_stats(const AddrInfo& target);
 
   // Get the targets for the configured domain.
   bool get_targets(std::vector<AddrInfo>& targets, SAS::TrailId trail);
@@ -218,13 +590,170 @@ protected:
   //                             0);
   //     });
   //
-  // @param targets - The vector of targets to try.
-  // @param trail   - SAS trail ID.
-  // @param fn      - The subroutine to call on each target.
+  // Each request is counted in the target's stats (if stats are being kept).
+  // The caller can count what the request read in the stats of the target
+  // that gave the result.
+  //
+  // @param targets     - The vector of targets to try.
+  // @param trail       - SAS trail ID.
+  // @param fn          - The subroutine to call on each target.
+  // @param bytes_out   - The bytes of keys and values each request sends.
+  // @param answered_by - If not NULL, returns the stats of the target that
+  //                      gave the result (or NULL if stats aren't being kept,
+  //                      or there were no targets).
   memcached_return_t iterate_through_targets(
     std::vector<AddrInfo>& targets,
     SAS::TrailId trail,
-    memcached_func fn);
+    memcached_func fn,
+    size_t bytes_out = 0,
+    MemcachedTargetStats** answered_by = NULL);
+};
+
+/// @class TopologyAwareMemcachedStore
+///
+/// A memcached store that talks directly to the memcached servers that own
+/// each key, rather than going through an Astaire proxy.
+///
+/// Each key is hashed to a vbucket, and the MemcachedStoreView (built from
+/// the cluster config) gives the replicas that own each vbucket.  While the
+/// cluster is being resized, the view's read and write replicas include both
+/// the old and new owners of the vbuckets that are moving, so requests follow
+/// the moves without any extra work here.  The config is reread (and the
+/// view rebuilt) on SIGHUP.
+///
+/// - Reads try each read replica in turn until one gives a definitive answer.
+///   NOT_FOUND is only definitive for vbuckets that aren't moving, as the new
+///   owners of a moving vbucket may not have its records yet.
+/// - Writes with a CAS check go to the first write replica that responds
+///   (the primary), and if that succeeds the record is then written to the
+///   rest of the write replicas without a check.
+/// - Writes without a CAS check, and deletes, go to all the write replicas,
+///   and succeed if any of them do.
+class TopologyAwareMemcachedStore : public BaseMemcachedStore
+{
+public:
+  /// Constructor.
+  ///
+  /// @param config_reader  - Object that reads the cluster config.  This is
+  ///                         not owned by the store, and must outlive it.
+  /// @param remote_store   - Whether the servers are in a remote site.
+  /// @param comm_monitor   - Object tracking memcached communications.
+  /// @param source_address - If not empty, the address to bind connections to.
+  TopologyAwareMemcachedStore(MemcachedConfigReader* config_reader,
+                              bool remote_store,
+                              BaseCommunicationMonitor* comm_monitor = NULL,
+                              const std::string& source_address = "");
+
+  ~TopologyAwareMemcachedStore();
+
+  /// Rereads the cluster config and rebuilds the view.  This is called on
+  /// construction and on SIGHUP.
+  void update_config();
+
+  /// Whether there are any servers in the current config.
+  bool has_servers();
+
+  using Store::get_data;
+  using Store::set_data;
+
+  Store::Status get_data(const std::string& table,
+                         const std::string& key,
+                         std::string& data,
+                         uint64_t& cas,
+                         SAS::TrailId trail,
+                         bool log_body,
+                         Store::Format data_format);
+
+  Store::Status get_data(const std::string& table,
+                         const std::string& key,
+                         Store::Buffer& data,
+                         uint64_t& cas,
+                         SAS::TrailId trail,
+                         bool log_body,
+                         Store::Format data_format);
+
+  Store::Status set_data(const std::string& table,
+                         const std::string& key,
+                         const std::string& data,
+                         uint64_t cas,
+                         int expiry,
+                         SAS::TrailId trail,
+                         bool log_body,
+                         Store::Format data_format);
+
+  Store::Status set_data_without_cas(const std::string& table,
+                                     const std::string& key,
+                                     const std::string& data,
+                                     int expiry,
+                                     SAS::TrailId trail,
+                                     bool log_body,
+                                     Store::Format data_format);
+
+  Store::Status delete_data(const std::string& table,
+                            const std::string& key,
+                            SAS::TrailId trail = 0);
+
+private:
+  typedef std::function<memcached_return_t(ConnectionHandle<memcached_st*>&)> memcached_func;
+
+  // The number of vbuckets, and the number of replicas of each vbucket (when
+  // the cluster isn't being resized).
+  static const int NUM_VBUCKETS = 128;
+  static const int NUM_REPLICAS = 2;
+
+  // The replicas for each vbucket in the current view, as addresses.
+  struct Replicas
+  {
+    Replicas() :
+      read(NUM_VBUCKETS),
+      write(NUM_VBUCKETS),
+      moving(NUM_VBUCKETS, false),
+      tombstone_lifetime(0)
+    {
+    }
+
+    std::vector<std::vector<AddrInfo>> read;
+    std::vector<std::vector<AddrInfo>> write;
+
+    // Whether each vbucket is moving between replicas.
+    std::vector<bool> moving;
+
+    int tombstone_lifetime;
+  };
+
+  // Get the vbucket that a key belongs to.
+  static uint16_t vbucket_for_key(const std::string& fqkey);
+
+  // Get the current replicas.  The view may be replaced at any time, but
+  // the returned replicas stay valid.
+  std::shared_ptr<const Replicas> get_replicas();
+
+  // Convert servers from the config (of the form <address>:<port>) to
+  // addresses.  Servers that can't be parsed are skipped.
+  static std::vector<AddrInfo> servers_to_targets(const std::vector<std::string>& servers);
+
+  // Write some data to each replica with the given method, without a CAS
+  // check.
+  //
+  // @return the result from a replica that succeeded, or from the last
+  //         replica if none did.
+  memcached_return_t write_to_replicas(const std::vector<AddrInfo>& replicas,
+                                       SAS::TrailId trail,
+                                       memcached_func fn);
+
+  MemcachedConfigReader* _config_reader;
+
+  // The view of the cluster, which is only used when the config is updated.
+  MemcachedStoreView _view;
+
+  // The replicas from the current view.  The updater builds a new set of
+  // replicas and publishes it, so requests never wait for an update.
+  VersionedConfig<Replicas> _replicas;
+
+  MemcachedConnectionPool _conn_pool;
+
+  // Reloads the config on SIGHUP.
+  Updater<void, TopologyAwareMemcachedStore>* _updater;
 };
 
 #endif
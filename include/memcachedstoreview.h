@@ -51,7 +51,7 @@ public:
   }
 
   /// Calculates the replicas that currently own each vbucket.
-  const std::map<int, ReplicaList> current_replicas()
+  const std::map<int, ReplicaList>& current_replicas() const
   {
     return _current_replicas;
   }
@@ -59,15 +59,40 @@ public:
   /// Calculates the replicas that will own each vbucket after the current
   /// resize is complete. If there is no resize in progress, this returns an
   /// empty map.
-  const std::map<int, ReplicaList> new_replicas()
+  const std::map<int, ReplicaList>& new_replicas() const
   {
     return _new_replicas;
   }
 
+  /// Returns the read and write replica sets for each vbucket as server IDs.
+  /// A server keeps the same ID for the life of the view, even if it leaves
+  /// the cluster and rejoins, so these can be compared between updates.
+  const std::vector<int>& read_replica_ids(int vbucket) const { return _read_ids[vbucket]; };
+  const std::vector<int>& write_replica_ids(int vbucket) const { return _write_ids[vbucket]; };
+
+  /// Returns the name of the server with the given ID.
+  const std::string& server_name(int id) const { return _server_names[id]; };
+
 private:
   /// Converts the view into a string suitable for logging.
   std::string view_to_string();
-  void generate_ring_from_stable_servers();
+
+  /// Returns the ID of each of the servers, allocating IDs for servers that
+  /// haven't been seen before.
+  std::vector<int> intern_servers(const std::vector<std::string>& servers);
+
+  /// Returns the replica nodes (as indexes into the server list) for each
+  /// vbucket, for a ring of the given number of nodes.  These are cached, as
+  /// building a ring is expensive and the number of nodes rarely changes.
+  const std::vector<std::vector<int> >& ring_nodes(int nodes, int replicas);
+
+  /// Sets the replicas for a vbucket, updating the names only if the IDs
+  /// have changed.
+  ///
+  /// @return whether the IDs changed.
+  bool set_replicas(std::vector<int>& ids,
+                    ReplicaList& names,
+                    const std::vector<int>& new_ids);
 
   /// Converts a set of replicas into an ordered string suitable for logging.
   std::string replicas_to_string(const std::vector<std::string>& replicas);
@@ -77,19 +102,6 @@ private:
   std::vector<std::string> merge_servers(const std::vector<std::string>& list1,
                                          const std::vector<std::string>& list2);
 
-  /// Converts a vector of server indexes into a vector of server names.
-  ///
-  /// For example given an ids vector of [1, 3] and a name table of ["kermit",
-  /// "gonzo", "misspiggy"], this function returns ["kermit", "misspiggy"].
-  ///
-  /// @param ids          - A vector of replica indexes.
-  /// @param lookup_table - Table in which to look up the names.
-  ///
-  /// @return             - A vector of replica names.
-  static std::vector<std::string>
-    server_ids_to_names(const std::vector<int>& ids,
-                        const std::vector<std::string>& lookup_table);
-
   /// Calculates the ring used to generate the vbucket configurations.  The
   /// ring essentially maps each vbucket slot to a particular node which is
   /// the primary location for data records whose key hashes to that vbucket.
@@ -158,6 +170,28 @@ private:
 
   // A map storing the new replicas for each vbucket.
   std::map<int, ReplicaList> _new_replicas;
+
+  // The sets above (except _changes) as server IDs, indexed by vbucket.
+  // These are what are compared to work out which vbuckets an update
+  // affects.
+  std::vector<std::vector<int> > _read_ids;
+  std::vector<std::vector<int> > _write_ids;
+  std::vector<std::vector<int> > _current_ids;
+  std::vector<std::vector<int> > _new_ids;
+
+  // The names of the servers, indexed by ID, and the IDs of the servers.
+  std::vector<std::string> _server_names;
+  std::map<std::string, int> _server_ids;
+
+  // The config that the view was last updated from.  If an update has the
+  // same servers, there is nothing to recalculate.
+  bool _updated;
+  std::vector<std::string> _config_servers;
+  std::vector<std::string> _config_new_servers;
+
+  // Cached replica nodes from rings, keyed by the number of nodes and the
+  // number of replicas.  Only the rings used by the last update are kept.
+  std::map<std::pair<int, int>, std::vector<std::vector<int> > > _ring_nodes;
 };
 
 #endif
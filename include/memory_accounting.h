@@ -0,0 +1,231 @@
+/**
+ * @file memory_accounting.h  Counts the memory used by each subsystem.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef MEMORY_ACCOUNTING_H__
+#define MEMORY_ACCOUNTING_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+/// The memory used by one subsystem (such as the DNS cache), as the number
+/// of bytes and objects it has allocated and not yet freed.
+///
+/// Subsystems charge their account when they allocate the objects that
+/// their memory use grows with (cache entries, connections, table rows, ...)
+/// and credit it when they free them, with the size of the object plus an
+/// estimate of what it owns.  So the counts show where memory goes and
+/// which subsystems are growing, rather than matching RSS exactly.
+///
+/// Accounts are created on first use and never freed, so a pointer to one
+/// can be kept for the life of the process.  Charging and crediting are
+/// lock-free, and only touch a shard of the counts picked by the calling
+/// thread, so threads charging the same account (such as for every HTTP
+/// request) don't contend on one cache line.  The shards are summed when
+/// the account is read.
+class MemoryAccount
+{
+public:
+  /// The names of the cpp-common subsystems' accounts.  They are at most 16
+  /// characters, so that they can index SNMP tables.
+  static const char* const DNS_CACHE;
+  static const char* const TTL_CACHE;
+  static const char* const CONNECTION_POOL;
+  static const char* const RAM_RECORDER;
+  static const char* const SNMP_ROWS;
+  static const char* const HTTP_REQUESTS;
+
+  /// The counts of an account at one time.
+  struct Snapshot
+  {
+    std::string name;
+    int64_t bytes;
+    int64_t objects;
+
+    /// The most bytes the account has been seen to hold when it was read.
+    /// Summing the shards on every charge would reintroduce the contention
+    /// they avoid, so peaks between reads aren't seen.
+    int64_t peak_bytes;
+  };
+
+  /// Gets the account with a name, creating it if it doesn't exist.
+  static MemoryAccount* get(const std::string& name);
+
+  /// Gets all the accounts' counts, in the order they were created.
+  static std::vector<Snapshot> snapshot_all();
+
+  const std::string& name() const { return _name; }
+
+  /// Records an allocation of `bytes`, in `objects` objects.
+  inline void charge(int64_t bytes, int64_t objects = 1)
+  {
+    Shard& shard = _shards[shard_index()];
+    shard.bytes.fetch_add(bytes, std::memory_order_relaxed);
+    shard.objects.fetch_add(objects, std::memory_order_relaxed);
+  }
+
+  /// Records the freeing of `bytes`, in `objects` objects.
+  inline void credit(int64_t bytes, int64_t objects = 1)
+  {
+    Shard& shard = _shards[shard_index()];
+    shard.bytes.fetch_sub(bytes, std::memory_order_relaxed);
+    shard.objects.fetch_sub(objects, std::memory_order_relaxed);
+  }
+
+  Snapshot snapshot() const;
+
+private:
+  MemoryAccount(const std::string& name);
+
+  /// The number of shards of each account's counts.  Threads are spread
+  /// over them round-robin, so they only share a shard once there are more
+  /// threads than shards.
+  static const int NUM_SHARDS = 16;
+  static const size_t CACHE_LINE_SIZE = 64;
+
+  struct alignas(64) Shard
+  {
+    std::atomic<int64_t> bytes;
+    std::atomic<int64_t> objects;
+  };
+
+  // Returns the calling thread's shard.  A thread charging an object need
+  // not be the one that credits it, so a shard's counts may go negative -
+  // only their sum is meaningful.
+  static inline int shard_index()
+  {
+    static thread_local int index = -1;
+
+    if (index < 0)
+    {
+      index = next_shard_index();
+    }
+
+    return index;
+  }
+
+  static int next_shard_index();
+
+  const std::string _name;
+  Shard* _shards;
+
+  // Updated when the account is read.
+  mutable std::atomic<int64_t> _peak_bytes;
+
+  // Don't implement the following, to avoid copies of this instance.
+  MemoryAccount(MemoryAccount const&);
+  void operator=(MemoryAccount const&);
+};
+
+/// A charge to a memory account for as long as this exists, for counting an
+/// object by making this a member of it.  Copies of the object are charged
+/// too, so (unlike charging in the object's constructor) this stays right
+/// when the object is copyable.
+class MemoryCharge
+{
+public:
+  MemoryCharge(MemoryAccount* account, int64_t bytes) :
+    _account(account),
+    _bytes(bytes)
+  {
+    _account->charge(_bytes);
+  }
+
+  MemoryCharge(const MemoryCharge& other) :
+    _account(other._account),
+    _bytes(other._bytes)
+  {
+    _account->charge(_bytes);
+  }
+
+  ~MemoryCharge()
+  {
+    _account->credit(_bytes);
+  }
+
+  MemoryCharge& operator=(const MemoryCharge& other)
+  {
+    if (this != &other)
+    {
+      other._account->charge(other._bytes);
+      _account->credit(_bytes);
+      _account = other._account;
+      _bytes = other._bytes;
+    }
+
+    return *this;
+  }
+
+private:
+  MemoryAccount* _account;
+  int64_t _bytes;
+};
+
+/// An STL allocator that charges what it allocates to a memory account, so
+/// that a container's memory (including its nodes and buckets) is counted
+/// without changing the code that uses it.  Each allocation is counted as
+/// one object.
+///
+/// For example:
+///
+///     std::map<int, int, std::less<int>,
+///              AccountingAllocator<std::pair<const int, int> > >
+///       map(AccountingAllocator<std::pair<const int, int> >(account));
+template <class T>
+class AccountingAllocator
+{
+public:
+  typedef T value_type;
+
+  AccountingAllocator(MemoryAccount* account) : _account(account) {}
+
+  template <class U>
+  AccountingAllocator(const AccountingAllocator<U>& other) :
+    _account(other.account())
+  {
+  }
+
+  T* allocate(size_t n)
+  {
+    T* p = std::allocator<T>().allocate(n);
+    _account->charge(n * sizeof(T));
+    return p;
+  }
+
+  void deallocate(T* p, size_t n)
+  {
+    _account->credit(n * sizeof(T));
+    std::allocator<T>().deallocate(p, n);
+  }
+
+  MemoryAccount* account() const { return _account; }
+
+  template <class U>
+  bool operator==(const AccountingAllocator<U>& other) const
+  {
+    return _account == other.account();
+  }
+
+  template <class U>
+  bool operator!=(const AccountingAllocator<U>& other) const
+  {
+    return _account != other.account();
+  }
+
+private:
+  MemoryAccount* _account;
+};
+
+#endif
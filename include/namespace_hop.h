@@ -14,11 +14,133 @@
 extern "C" {
 #endif
 
+int create_connection_in_namespace(const char* host,
+                                   const char* port,
+                                   const char* socket_factory_path);
 int create_connection_in_signaling_namespace(const char* host, const char* port);
 int create_connection_in_management_namespace(const char* host, const char* port);
 
 #ifdef __cplusplus
 }
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+
+/// Keeps connections to hot targets open in advance, so that a connection in
+/// another namespace can be handed out without waiting for the round trip to
+/// clearwater-socket-factory and the TCP handshake.
+///
+/// A background thread tops up each added target's pool, and replaces
+/// connections that have been pooled for longer than MAX_IDLE_S (in case the
+/// far end times them out).  Connections that the far end has closed are
+/// discarded when they are taken from the pool.  If a target's pool is empty
+/// (or the target hasn't been added) the connection is made synchronously,
+/// as create_connection_in_namespace() does.
+///
+/// The background thread also makes connections for get_connection_async(),
+/// for callers that can't block.
+class NamespaceConnectionPool
+{
+public:
+  /// How long a connection is kept in a pool before being replaced.
+  static const int MAX_IDLE_S = 30;
+
+  /// How long to wait before retrying a target after failing to connect.
+  static const int RETRY_INTERVAL_MS = 1000;
+
+  /// Called with a new connection, or -1 if it couldn't be made.  The callee
+  /// owns the file descriptor.
+  typedef std::function<void(int fd)> Callback;
+
+  /// @param socket_factory_path the clearwater-socket-factory socket for the
+  ///                            namespace.
+  /// @param connections_per_target how many connections to keep open to each
+  ///                            added target.
+  NamespaceConnectionPool(const std::string& socket_factory_path,
+                          int connections_per_target);
+
+  /// Closes all the pooled connections.
+  virtual ~NamespaceConnectionPool();
+
+  /// Start keeping connections to this target open.
+  void add_target(const std::string& host, const std::string& port);
+
+  /// Stop keeping connections to this target open, closing any pooled ones.
+  void remove_target(const std::string& host, const std::string& port);
+
+  /// @return a connection to the target, or a negative value on failure.  The
+  ///         caller owns the file descriptor.
+  int get_connection(const std::string& host, const std::string& port);
+
+  /// Get a connection to the target without blocking.  If one is pooled the
+  /// callback is called immediately on this thread, and otherwise it is
+  /// called on the background thread once the connection has been made.
+  void get_connection_async(const std::string& host,
+                            const std::string& port,
+                            Callback callback);
+
+private:
+  struct PooledConnection
+  {
+    int fd;
+    time_t opened;
+  };
+
+  struct Target
+  {
+    Target() : connections(), retry_after_ms(0) {}
+
+    std::deque<PooledConnection> connections;
+
+    // When connecting to this target last failed, the time to retry from.
+    uint64_t retry_after_ms;
+  };
+
+  struct AsyncRequest
+  {
+    std::string host;
+    std::string port;
+    Callback callback;
+  };
+
+  // Takes a usable connection to the target from its pool, or returns -1 if
+  // there isn't one.  Must be called with _lock held.
+  int take_pooled_connection(const std::string& key);
+
+  // Closes the connections in a pool.  Must be called with _lock held.
+  static void close_connections(std::deque<PooledConnection>& connections);
+
+  // Makes a new connection to the target via the socket factory.
+  int connect(const std::string& host, const std::string& port);
+
+  static void* background_thread_fn(void* pool);
+  void background_thread_fn();
+
+  const std::string _socket_factory_path;
+  const size_t _connections_per_target;
+
+  // The targets' pools (keyed on "host:port") and the outstanding async
+  // requests, protected by _lock.
+  std::map<std::string, Target> _targets;
+  std::deque<AsyncRequest> _async_requests;
+  pthread_mutex_t _lock;
+
+  // Signalled when the background thread has work to do.
+  pthread_cond_t _cond;
+  bool _terminated;
+  pthread_t _background_thread;
+
+  // Don't implement the following, to avoid copies of this instance.
+  NamespaceConnectionPool(NamespaceConnectionPool const&);
+  void operator=(NamespaceConnectionPool const&);
+};
+
 #endif
 
 #endif
@@ -17,6 +17,7 @@
 // PDLog Classes contain the Description, Cause, Effect, and Action for a log
 //
 
+#include <stdint.h>
 #include <string>
 #include <syslog.h>
 
@@ -45,6 +46,14 @@
 // actions more readable.  Most of the derived classes are templates.
 // The paremeterized types being values that are output as a formatted string
 // in the Message field.
+//
+// Logs can be rate limited per log id, so that a failure storm doesn't flood
+// syslog (or spend CPU formatting logs that won't be written).  Each log id
+// has a token bucket - a log that finds the bucket empty is counted as
+// suppressed rather than formatted.  Once the background emitter has been
+// started, logs are also written to syslog on its thread rather than the
+// caller's, and it periodically logs a summary of how many times each log id
+// was suppressed ("occurred N more times in the last T seconds").
 class PDLogBase
 {
 public:
@@ -91,9 +100,53 @@ public:
   // Writes the description. cause, effect, and actions to syslog
   virtual void dcealog(const char* buf) const
   {
-    syslog(_severity, "%d - %s", _log_id, buf);
+    if (!queue_log(_log_id, _severity, buf))
+    {
+      syslog(_severity, "%d - %s", _log_id, buf);
+    }
   }
+
+  // Limits on how often a log id is written.  A rate of 0 means no limit.
+  struct Limits
+  {
+    Limits() : rate_per_sec(0), burst(1) {}
+    Limits(double rate_per_sec, unsigned int burst) :
+      rate_per_sec(rate_per_sec), burst(burst) {}
+
+    // The rate at which the log can be written in the long run.
+    double rate_per_sec;
+
+    // The number of logs that can be written at once, after a quiet period.
+    unsigned int burst;
+  };
+
+  // Sets the limits for log ids that don't have their own.
+  static void set_default_limits(const Limits& limits);
+
+  // Sets the limits for a log id.
+  static void set_limits(int log_id, const Limits& limits);
+
+  // Starts writing logs on a background thread, which also logs a summary of
+  // the suppressed logs every summary_interval_s seconds.  Logs are written
+  // inline until this is called.
+  static void start_emitter(unsigned int summary_interval_s = 60);
+
+  // Writes any queued logs (and suppression summaries) and stops the
+  // background thread.
+  static void stop_emitter();
+
+  // Returns the number of times a log id has been suppressed.
+  static uint64_t suppressed_count(int log_id);
+
 protected:
+  // Returns whether a log should be written, taking a token from its bucket
+  // if so.  The derived classes check this before formatting the log.
+  static bool should_log(int log_id, int severity);
+
+  // Queues a log to be written by the background emitter.  Returns false if
+  // the emitter isn't running, in which case the caller writes it.
+  static bool queue_log(int log_id, int severity, const char* buf);
+
   // Unique identity for a PDLog, e.g. CL_CPP_COMMON + 1
   int         _log_id;
 
@@ -121,6 +174,11 @@ public:
 
   virtual void log() const
   {
+    if (!should_log(_log_id, _severity))
+    {
+      return;
+    }
+
     // The format for the snprintf is defined by buf
     char buf[MAX_FORMAT_LINE];
     // The pragmas are used to avoid compiler warnings
@@ -153,6 +211,11 @@ public:
 
   virtual void log(T1 v1) const
   {
+    if (!should_log(_log_id, _severity))
+    {
+      return;
+    }
+
     // The format for the snprintf is defined by buf
     char buf[MAX_FORMAT_LINE];
     // The pragmas are used to avoid compiler warnings
@@ -185,6 +248,11 @@ public:
 
   virtual void log(T1 v1, T2 v2) const
   {
+    if (!should_log(_log_id, _severity))
+    {
+      return;
+    }
+
     char buf[MAX_FORMAT_LINE];
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wformat-security"
@@ -213,6 +281,11 @@ public:
 
   virtual void log(T1 v1, T2 v2, T3 v3) const
   {
+    if (!should_log(_log_id, _severity))
+    {
+      return;
+    }
+
     char buf[MAX_FORMAT_LINE];
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wformat-security"
@@ -242,6 +315,11 @@ public:
 
   virtual void log(T1 v1, T2 v2, T3 v3, T4 v4) const
   {
+    if (!should_log(_log_id, _severity))
+    {
+      return;
+    }
+
     char buf[MAX_FORMAT_LINE];
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wformat-security"
@@ -0,0 +1,235 @@
+/**
+ * @file profiled_mutex.h  A mutex that measures how long it is waited for and
+ * held.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef PROFILED_MUTEX_H__
+#define PROFILED_MUTEX_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <atomic>
+
+#include "fast_clock.h"
+#include "latency_histogram.h"
+
+namespace SNMP
+{
+  class LatencyHistogramTable;
+}
+
+/// The statistics of every ProfiledMutex with a given name (such as every
+/// eventq's lock).
+struct LockStats
+{
+  LockStats(const char* name) : name(name) {}
+
+  const char* name;
+
+  /// How long the lock was waited for, when it was contended.  The count is
+  /// the number of contended acquisitions.
+  LatencyHistogram wait;
+
+  /// How long the lock was held.  The count is the number of acquisitions.
+  LatencyHistogram hold;
+};
+
+/// Lock profiling is off until it is turned on with set_enabled, and costs a
+/// relaxed atomic load per lock while off.  Building with NO_LOCK_PROFILING
+/// removes it altogether.
+namespace LockProfiling
+{
+  /// Turns lock profiling on or off.
+  void set_enabled(bool enabled);
+
+  extern std::atomic<bool> _enabled;
+
+  inline bool enabled()
+  {
+    return _enabled.load(std::memory_order_relaxed);
+  }
+
+  /// @return the statistics for locks with the given name, which are created
+  ///         the first time the name is used and never destroyed.
+  LockStats* stats(const char* name);
+
+  /// Reports each lock's wait and hold times (in microseconds) in SNMP
+  /// tables, indexed by the lock's name.  Locks named later are added to the
+  /// tables as they are created.
+  void set_statistics_tables(SNMP::LatencyHistogramTable* wait_table,
+                             SNMP::LatencyHistogramTable* hold_table);
+}
+
+/// A pthread mutex that records, while lock profiling is enabled, how long it
+/// is waited for when contended and how long it is held, in the LockStats for
+/// its name.  Waiting on a condition variable with cond_wait or
+/// cond_timedwait doesn't count as holding the lock.  A recursive lock's hold
+/// time runs from its outermost lock to its outermost unlock.
+class ProfiledMutex
+{
+public:
+  /// @param name      - The name to gather statistics under, which must be a
+  ///                    string literal (or otherwise last for the life of the
+  ///                    process).
+  /// @param recursive - Whether the lock can be taken again by the thread
+  ///                    holding it.
+  explicit ProfiledMutex(const char* name, bool recursive = false)
+#ifndef NO_LOCK_PROFILING
+    : _stats(LockProfiling::stats(name)), _depth(0), _acquired_ns(0)
+#endif
+  {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+
+    if (recursive)
+    {
+      pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    }
+
+    pthread_mutex_init(&_mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+  }
+
+  ~ProfiledMutex()
+  {
+    pthread_mutex_destroy(&_mutex);
+  }
+
+  void lock()
+  {
+#ifndef NO_LOCK_PROFILING
+    if (LockProfiling::enabled())
+    {
+      if (pthread_mutex_trylock(&_mutex) == 0)
+      {
+        if (_depth++ == 0)
+        {
+          _acquired_ns = FastClock::now_ns();
+        }
+      }
+      else
+      {
+        uint64_t start_ns = FastClock::now_ns();
+        pthread_mutex_lock(&_mutex);
+        ++_depth;
+        _acquired_ns = FastClock::now_ns();
+        _stats->wait.record((_acquired_ns - start_ns) / 1000);
+      }
+
+      return;
+    }
+
+    pthread_mutex_lock(&_mutex);
+
+    if (_depth++ == 0)
+    {
+      _acquired_ns = 0;
+    }
+#else
+    pthread_mutex_lock(&_mutex);
+#endif
+  }
+
+  /// Takes the lock if it is free, as pthread_mutex_trylock.  A failed
+  /// attempt isn't counted as a wait.
+  ///
+  /// @return whether the lock was taken.
+  bool try_lock()
+  {
+    if (pthread_mutex_trylock(&_mutex) != 0)
+    {
+      return false;
+    }
+
+#ifndef NO_LOCK_PROFILING
+    if (_depth++ == 0)
+    {
+      _acquired_ns = LockProfiling::enabled() ? FastClock::now_ns() : 0;
+    }
+#endif
+
+    return true;
+  }
+
+  void unlock()
+  {
+#ifndef NO_LOCK_PROFILING
+    uint64_t acquired_ns = (--_depth == 0) ? _acquired_ns : 0;
+
+    if (acquired_ns != 0)
+    {
+      uint64_t released_ns = FastClock::now_ns();
+      pthread_mutex_unlock(&_mutex);
+      _stats->hold.record((released_ns - acquired_ns) / 1000);
+      return;
+    }
+#endif
+
+    pthread_mutex_unlock(&_mutex);
+  }
+
+  /// Waits on a condition variable (as pthread_cond_wait), with the lock held.
+  void cond_wait(pthread_cond_t* cond)
+  {
+    released_for_wait();
+    pthread_cond_wait(cond, &_mutex);
+    reacquired_after_wait();
+  }
+
+  /// Waits on a condition variable until a time (as pthread_cond_timedwait),
+  /// with the lock held.
+  ///
+  /// @return the result of pthread_cond_timedwait.
+  int cond_timedwait(pthread_cond_t* cond, const struct timespec* abstime)
+  {
+    released_for_wait();
+    int rc = pthread_cond_timedwait(cond, &_mutex, abstime);
+    reacquired_after_wait();
+    return rc;
+  }
+
+private:
+  void released_for_wait()
+  {
+#ifndef NO_LOCK_PROFILING
+    if (_acquired_ns != 0)
+    {
+      _stats->hold.record((FastClock::now_ns() - _acquired_ns) / 1000);
+    }
+#endif
+  }
+
+  void reacquired_after_wait()
+  {
+#ifndef NO_LOCK_PROFILING
+    _acquired_ns = LockProfiling::enabled() ? FastClock::now_ns() : 0;
+#endif
+  }
+
+  pthread_mutex_t _mutex;
+
+#ifndef NO_LOCK_PROFILING
+  LockStats* _stats;
+
+  // How many times the holder has taken the lock, and when it first took it
+  // (or zero if that wasn't profiled).  These are only accessed with the lock
+  // held.
+  uint32_t _depth;
+  uint64_t _acquired_ns;
+#endif
+
+  // Don't implement the following, to avoid copies of this instance.
+  ProfiledMutex(ProfiledMutex const&);
+  void operator=(ProfiledMutex const&);
+};
+
+#endif
@@ -0,0 +1,150 @@
+/**
+ * @file profiling_span.h  Lightweight timing of spans within a request.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef PROFILING_SPAN_H__
+#define PROFILING_SPAN_H__
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+#include "fast_clock.h"
+
+/// Records how long named spans of code take, so that the time spent on a
+/// request can be attributed to the subsystems it passes through (DNS,
+/// connection pools, HTTP, memcached, Cassandra, ...).
+///
+/// A span covers the rest of the scope it is declared in:
+///
+///   {
+///     PROFILE_SPAN("dns.query");
+///     ...
+///   }
+///
+/// Spans nest, and a span with no enclosing span on its thread is a root.
+/// Each root span is sampled at the configured rate (none by default), and
+/// the spans nested in a sampled root are sampled with it, so a sampled
+/// request is recorded in full.  A span that isn't sampled costs a couple of
+/// thread-local updates.
+///
+/// Each thread records its spans in its own ring of the last RING_SIZE
+/// spans, which the write_* functions read out.
+namespace Profiling
+{
+  /// The number of spans kept for each thread.
+  const size_t RING_SIZE = 4096;
+
+  /// A recorded span.
+  struct SpanRecord
+  {
+    const char* name;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    uint32_t depth;
+  };
+
+  /// Sets the fraction of root spans (from 0 to 1) that are sampled.
+  void set_sample_rate(double rate);
+
+  /// @return the fraction of root spans that are sampled.
+  double sample_rate();
+
+  /// Writes the recorded spans in the Chrome trace event format, which can be
+  /// loaded into chrome://tracing or Perfetto.
+  void write_chrome_trace(std::string& json);
+
+  /// Writes the recorded spans as folded stacks - one line for each stack of
+  /// spans, giving the time spent in the innermost span (excluding the spans
+  /// nested in it) in microseconds.  This is the input format of flame graph
+  /// tools.
+  void write_folded_stacks(std::string& out);
+
+  /// Discards the recorded spans.
+  void clear();
+
+  // The rest of this namespace is used by Span.
+
+  // Root spans are sampled if the top 32 bits of a random number are below
+  // this (so 2^32 samples everything).
+  extern std::atomic<uint64_t> _sample_threshold;
+
+  struct ThreadState
+  {
+    uint32_t depth;
+    bool sampled;
+  };
+
+  inline ThreadState& _thread_state()
+  {
+    static thread_local ThreadState state = {0, false};
+    return state;
+  }
+
+  // Decides whether to sample a root span.
+  bool _sample_root();
+
+  // Adds a span to the calling thread's ring.
+  void _record(const char* name, uint64_t start_ns, uint64_t end_ns, uint32_t depth);
+
+  /// A span, timed from its construction to its destruction.  Use
+  /// PROFILE_SPAN rather than constructing this directly.
+  class Span
+  {
+  public:
+    /// @param name - The span's name, which must be a string literal (or
+    ///               otherwise last for the life of the process).
+    explicit Span(const char* name) : _name(name), _start_ns(0)
+    {
+      ThreadState& state = _thread_state();
+
+      if (state.depth++ == 0)
+      {
+        state.sampled = ((_sample_threshold.load(std::memory_order_relaxed) != 0) &&
+                         (_sample_root()));
+      }
+
+      if (state.sampled)
+      {
+        _start_ns = FastClock::now_ns();
+      }
+    }
+
+    ~Span()
+    {
+      ThreadState& state = _thread_state();
+      --state.depth;
+
+      if (_start_ns != 0)
+      {
+        _record(_name, _start_ns, FastClock::now_ns(), state.depth);
+      }
+    }
+
+  private:
+    const char* _name;
+    uint64_t _start_ns;
+
+    // Don't implement the following, to avoid copies of this instance.
+    Span(Span const&);
+    void operator=(Span const&);
+  };
+}
+
+#define PROFILE_SPAN_CONCAT_INNER(A, B) A ## B
+#define PROFILE_SPAN_CONCAT(A, B) PROFILE_SPAN_CONCAT_INNER(A, B)
+
+/// Times the rest of the enclosing scope as a span.  The name must be a
+/// string literal.
+#define PROFILE_SPAN(NAME) \
+  Profiling::Span PROFILE_SPAN_CONCAT(_profile_span_, __LINE__)("" NAME "")
+
+#endif
@@ -12,54 +12,42 @@
 #ifndef RANDOM_UUID_H__
 #define RANDOM_UUID_H__
 
+#include <stddef.h>
+
 #include <boost/uuid/uuid.hpp>            // uuid class
-#include <boost/uuid/uuid_generators.hpp> // generators
-#include <fstream>
 
-/// Generator of random UUIDs.
-///
-/// This is a wrapper around the boost::uuids::random_generator, except that we
-/// explicitly use a pseudo random number generator (prng) that is just seeded
-/// from /dev/urandom as opposed to the default boost implementation that uses
-/// uninitialzed memory (and causes valgrind errors).
+/// Generator of random (version 4) UUIDs.
 ///
-/// This class has the same threadsafety as boost::uuids::random_generator. TO
-/// quote from
-/// http://www.boost.org/doc/libs/1_53_0/libs/uuid/uuid.html#Design%20notes
+/// The UUIDs are built from the calling thread's Utils::ThreadRandom
+/// generator, which is seeded from /dev/urandom the first time the thread
+/// uses it, so generating a UUID takes a few nanoseconds and never takes a
+/// lock or makes a system call.  The generator isn't cryptographic, so the
+/// UUIDs are unique but not unpredictable - don't use them as secrets.
 ///
-/// "All functions are re-entrant. Classes are as thread-safe as an int. That is
-/// an instance can not be shared between threads without proper
-/// synchronization."
+/// Instances hold no state, so can be shared freely between threads.
 class RandomUUIDGenerator
 {
 public:
-  RandomUUIDGenerator() : _prng()
-  {
-    // Get a seed value by reading from /dev/urandom.
-    uint32_t seed;
-    std::ifstream fin("/dev/urandom", std::ifstream::binary);
-    fin.read((char*)&seed, sizeof(seed));
-
-    // See the prng and create the boost UUID generator.
-    _prng.seed(seed);
-    _gen = new boost::uuids::random_generator(_prng);
-  }
+  /// The length of a formatted UUID, excluding the terminating NUL.
+  static const size_t STRING_LENGTH = 36;
 
-  ~RandomUUIDGenerator()
-  {
-    delete _gen; _gen = NULL;
-  }
+  /// Create a random UUID.
+  /// @return the UUID created.
+  boost::uuids::uuid operator() () { return generate(); }
 
   /// Create a random UUID.
   /// @return the UUID created.
-  boost::uuids::uuid operator() ()
-  {
-    return (*_gen)();
-  }
+  static boost::uuids::uuid generate();
+
+  /// Write a UUID in its standard lowercase 8-4-4-4-12 form.
+  ///
+  /// @param uuid the UUID to format.
+  /// @param buf  the buffer to write to, which must have room for
+  ///             STRING_LENGTH + 1 characters.  It is NUL-terminated.
+  static void format_to(const boost::uuids::uuid& uuid, char* buf);
 
-private:
-  boost::mt19937 _prng;
-  boost::uuids::random_generator* _gen;
+  /// Create a random UUID and write it to a buffer, as format_to().
+  static void generate_to(char* buf) { format_to(generate(), buf); }
 };
 
 #endif
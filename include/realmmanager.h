@@ -16,15 +16,27 @@
 
 #include "diameterstack.h"
 #include "diameterresolver.h"
+#include "latency_histogram.h"
+#include "snmp_latency_histogram_table.h"
 
 class RealmManager
 {
 public:
+  /// @param max_pending_connections - The most peers to be connecting to at
+  ///                                  once, or 0 for no limit.  Further
+  ///                                  peers are added as these connect or
+  ///                                  fail.
+  /// @param connect_latency_table   - If not NULL, the table to report the
+  ///                                  time taken to connect to each peer in.
+  ///                                  This must be destroyed before the
+  ///                                  RealmManager.
   RealmManager(Diameter::Stack* stack,
                std::string realm,
                std::string host,
                int max_peers,
-               DiameterResolver* resolver);
+               DiameterResolver* resolver,
+               int max_pending_connections = 0,
+               SNMP::LatencyHistogramTable* connect_latency_table = NULL);
   virtual ~RealmManager();
 
   void start();
@@ -34,15 +46,30 @@ public:
                           const std::string& host,
                           const std::string& realm);
 
+  /// Adjusts the routing scores of the candidate peers for a request, based
+  /// on their SRV priorities and then on their load - of the candidates with
+  /// the same score, those that are much more loaded than the others are
+  /// given a slightly lower score.
   void srv_priority_cb(struct fd_list* candidates);
 
+  /// Passes the latency of Diameter transactions to the resolver, so that it
+  /// can prefer faster peers when choosing which to connect to.
+  void tsx_latency_cb(const std::string& host, unsigned long duration_us);
+
   static const int DEFAULT_BLACKLIST_DURATION;
 
 private:
   void thread_function();
   static void* thread_function(void* realm_manager_ptr);
 
-  void manage_connections(int& ttl);
+  void manage_connections(const std::vector<AddrInfo>& targets);
+
+  // Records how long it took to connect to a peer, given when the connection
+  // attempt started.
+  void record_connect_latency(const std::string& host, uint64_t start_us);
+
+  // Bias the candidates' scores away from the more loaded peers.
+  void bias_by_load(struct fd_list* candidates);
 
   // We use a read/write lock to read and update the _peers map (defined below).
   // However, we read this map on every single Diameter message, so we want to
@@ -66,6 +93,25 @@ private:
   DiameterResolver* _resolver;
   std::map<std::string, Diameter::Peer*> _peers;
   volatile bool _terminating;
+
+  // Set (under the main thread lock) when the connections need managing
+  // again before the DNS TTL expires - because a peer failed, so the realm
+  // should be resolved again to replace it, or because a pending peer
+  // connected, so there is room to start connecting to another.
+  bool _peer_failed;
+  bool _peer_connected;
+
+  int _max_pending_connections;
+
+  // When the attempt to connect to each pending peer started.  Protected by
+  // the main thread lock.
+  std::map<std::string, uint64_t> _connect_start_us;
+
+  // The time taken to connect to each peer ever connected to, which are
+  // reported in the connect latency table.  Protected by the main thread
+  // lock.
+  SNMP::LatencyHistogramTable* _connect_latency_table;
+  std::map<std::string, LatencyHistogram*> _connect_latencies;
 };
 
 #endif
@@ -0,0 +1,232 @@
+/**
+ * @file replicated_store.h Definitions for the ReplicatedStore class
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef REPLICATED_STORE_H__
+#define REPLICATED_STORE_H__
+
+#include <pthread.h>
+
+#include <atomic>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "store.h"
+#include "latency_histogram.h"
+
+/// @class ReplicatedStore
+///
+/// A Store for geo-redundant deployments (see
+/// Utils::parse_multi_site_stores_arg), which serves requests from the local
+/// site's store and replicates writes to the remote sites' stores in the
+/// background, so that requests don't wait for a WAN round trip.
+///
+/// Reads, writes and deletes go to the local store.  Each successful write
+/// or delete is then queued for each remote site, and a thread per site
+/// applies the queued writes in batches (only applying the latest write of a
+/// key in each batch).  The CAS values of the sites' stores are independent,
+/// so remote writes don't do CAS checks.  A remote write that fails is
+/// retried, after a delay, up to `max_retries` times.
+///
+/// Each site's queue is bounded - a write that would overflow it is dropped
+/// (and counted), and the remote site is left with an old record until the
+/// key is next written.
+///
+/// The ReplicatedStore doesn't own the stores.
+class ReplicatedStore : public Store
+{
+public:
+  static const size_t DEFAULT_MAX_QUEUE = 10000;
+  static const size_t DEFAULT_MAX_BATCH = 100;
+  static const int DEFAULT_MAX_RETRIES = 3;
+  static const int DEFAULT_RETRY_DELAY_MS = 100;
+
+  /// @param local_store  - The store of the local site.
+  /// @param remote_stores - The stores of the remote sites.
+  /// @param max_queue    - How many writes may be queued for each remote
+  ///                       site.
+  /// @param max_batch    - How many queued writes are applied at once.
+  /// @param max_retries  - How many times a failed remote write is retried.
+  /// @param retry_delay_ms - How long to wait before retrying failed writes.
+  ReplicatedStore(Store* local_store,
+                  const std::vector<Store*>& remote_stores,
+                  size_t max_queue = DEFAULT_MAX_QUEUE,
+                  size_t max_batch = DEFAULT_MAX_BATCH,
+                  int max_retries = DEFAULT_MAX_RETRIES,
+                  int retry_delay_ms = DEFAULT_RETRY_DELAY_MS);
+
+  /// Stops replicating.  Writes that are still queued are dropped.
+  virtual ~ReplicatedStore();
+
+  using Store::get_data;
+  using Store::set_data;
+  using Store::get_data_async;
+  using Store::set_data_async;
+
+  Store::Status get_data(const std::string& table,
+                         const std::string& key,
+                         std::string& data,
+                         uint64_t& cas,
+                         SAS::TrailId trail,
+                         bool log_body,
+                         Store::Format data_format) override;
+
+  Store::Status get_data(const std::string& table,
+                         const std::string& key,
+                         Store::Buffer& data,
+                         uint64_t& cas,
+                         SAS::TrailId trail,
+                         bool log_body,
+                         Store::Format data_format) override;
+
+  Store::Status set_data(const std::string& table,
+                         const std::string& key,
+                         const std::string& data,
+                         uint64_t cas,
+                         int expiry,
+                         SAS::TrailId trail,
+                         bool log_body,
+                         Store::Format data_format) override;
+
+  Store::Status set_data_without_cas(const std::string& table,
+                                     const std::string& key,
+                                     const std::string& data,
+                                     int expiry,
+                                     SAS::TrailId trail,
+                                     bool log_body,
+                                     Store::Format data_format=Store::Format::HEX) override;
+
+  Store::Status delete_data(const std::string& table,
+                            const std::string& key,
+                            SAS::TrailId trail = 0) override;
+
+  void get_data_multi(const std::string& table,
+                      const std::vector<std::string>& keys,
+                      std::vector<Store::GetResult>& results,
+                      SAS::TrailId trail = 0,
+                      bool log_body = true,
+                      Store::Format data_format = Store::Format::HEX) override;
+
+  void set_data_multi(const std::string& table,
+                      const std::vector<Store::SetRequest>& requests,
+                      std::vector<Store::Status>& statuses,
+                      SAS::TrailId trail = 0,
+                      bool log_body = true,
+                      Store::Format data_format = Store::Format::HEX) override;
+
+  void get_data_async(const std::string& table,
+                      const std::string& key,
+                      SAS::TrailId trail,
+                      bool log_body,
+                      Store::Format data_format,
+                      Store::GetCallback callback) override;
+
+  void set_data_async(const std::string& table,
+                      const std::string& key,
+                      const std::string& data,
+                      uint64_t cas,
+                      int expiry,
+                      SAS::TrailId trail,
+                      bool log_body,
+                      Store::Format data_format,
+                      Store::SetCallback callback) override;
+
+  bool has_servers() override { return _local_store->has_servers(); }
+
+  /// How far a remote site's replica is behind.
+  struct ReplicationStats
+  {
+    /// The number of writes queued for the site.
+    size_t backlog;
+
+    /// How long (in milliseconds) the oldest queued write has been queued,
+    /// or 0 if there are none.
+    uint64_t lag_ms;
+
+    /// The number of writes dropped because the queue was full.
+    uint64_t dropped;
+
+    /// The number of writes that failed after all their retries.
+    uint64_t failed;
+  };
+
+  /// @return the replication statistics of the remote site with the given
+  ///         index (in the order the stores were passed to the constructor).
+  ReplicationStats replication_stats(size_t site) const;
+
+  /// @return how long each write to the remote site with the given index took
+  ///         to be applied after the local write, in microseconds.
+  const LatencyHistogram& replication_lag(size_t site) const
+  {
+    return _sites[site]->lag;
+  }
+
+private:
+  // A write (or delete) to replicate.
+  struct Write
+  {
+    std::string table;
+    std::string key;
+    std::string data;
+    int expiry;
+    bool is_delete;
+    uint64_t queued_us;
+    int attempts;
+  };
+
+  // A remote site, with its queue of writes and the thread that applies them.
+  struct Site
+  {
+    ReplicatedStore* replicated_store;
+    Store* store;
+    size_t index;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    std::deque<Write> queue;
+    pthread_t thread;
+    std::atomic<uint64_t> dropped;
+    std::atomic<uint64_t> failed;
+    LatencyHistogram lag;
+  };
+
+  // Queues a write that succeeded locally for each remote site.
+  void replicate(const std::string& table,
+                 const std::string& key,
+                 const std::string& data,
+                 int expiry,
+                 bool is_delete);
+
+  static void* replication_thread_fn(void* site);
+  void replication_thread_fn(Site* site);
+
+  // Applies a batch of writes to a remote site, and returns the ones that
+  // failed and should be retried.
+  void apply_batch(Site* site,
+                   std::vector<Write>& batch,
+                   std::vector<Write>& retries);
+
+  Store* _local_store;
+  std::vector<Site*> _sites;
+  size_t _max_queue;
+  size_t _max_batch;
+  int _max_retries;
+  int _retry_delay_ms;
+
+  // Read by the replication threads with their site's lock held, so is set
+  // with every site's lock held.
+  bool _terminated;
+
+  // Don't implement the following, to avoid copies of this instance.
+  ReplicatedStore(ReplicatedStore const&);
+  void operator=(ReplicatedStore const&);
+};
+
+#endif
@@ -0,0 +1,77 @@
+/**
+ * @file retry_budget.h  Limits retries to a fraction of successful requests.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef RETRY_BUDGET_H__
+#define RETRY_BUDGET_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+namespace SNMP
+{
+  class CounterTable;
+}
+
+/// A token bucket that limits how often clients retry requests.  Each
+/// request that succeeds at the first attempt adds a fraction of a token, and
+/// each retry takes a whole one, so retries are limited to that fraction of
+/// the successful requests.  When a downstream tier degrades, its successes
+/// dry up and so do the retries, rather than multiplying its load.
+///
+/// The bucket starts full, so that occasional failures can be retried before
+/// any requests have succeeded.  A budget can be shared by several clients
+/// (e.g. an HttpClient and a memcached store talking to the same tier), and
+/// is safe to use from any number of threads.
+class RetryBudget
+{
+public:
+  /// @param retry_ratio  - The retries allowed for each request that succeeds
+  ///                       at the first attempt (e.g. 0.1 for 10%).
+  /// @param max_retries  - The size of the bucket, which is the most retries
+  ///                       that can be made in a burst.
+  /// @param denied_table - Optional SNMP table counting the retries that were
+  ///                       denied.
+  RetryBudget(float retry_ratio = 0.1,
+              unsigned int max_retries = 100,
+              SNMP::CounterTable* denied_table = NULL);
+
+  /// Records a request that succeeded at the first attempt.
+  void first_attempt_succeeded();
+
+  /// Asks to retry a request, taking a token if one is available.
+  ///
+  /// @return whether the request may be retried.
+  bool try_retry();
+
+  /// @return the number of retries denied so far.
+  uint64_t denied_count() const
+  {
+    return _denied.load(std::memory_order_relaxed);
+  }
+
+private:
+  // Tokens are counted in thousandths, so fractional deposits add up.
+  static const int64_t TOKEN = 1000;
+
+  const int64_t _deposit;
+  const int64_t _capacity;
+  std::atomic<int64_t> _balance;
+  std::atomic<uint64_t> _denied;
+  SNMP::CounterTable* _denied_table;
+
+  // Don't implement the following, to avoid copies of this instance.
+  RetryBudget(RetryBudget const&);
+  void operator=(RetryBudget const&);
+};
+
+#endif
@@ -0,0 +1,114 @@
+/**
+ * @file rotating_bloom_filter.h  Bloom filter whose items expire.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef ROTATING_BLOOM_FILTER_H__
+#define ROTATING_BLOOM_FILTER_H__
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "bloom_filter.h"
+
+/// A bloom filter whose items expire, for tracking recently seen items (such
+/// as deleted registrations) without rebuilding the filter.
+///
+/// The filter is made up of a number of generations, each an ordinary bloom
+/// filter.  Items are added to the newest generation, and are checked against
+/// all of them.  Every `generation_ms` the oldest generation is cleared and
+/// becomes the newest, so an item expires between (generations - 1) and
+/// generations intervals after it was last added.  The generations are
+/// rotated by whichever thread adds or checks an item once the interval has
+/// passed - there's no timer thread.
+///
+/// Each generation is sized for the number of items added per interval, so
+/// the memory used is fixed, and the false positive probability is split
+/// between the generations so that the filter as a whole meets it.
+///
+/// As with BloomFilter, items can be added and checked from many threads at
+/// once without any locking.
+class RotatingBloomFilter
+{
+public:
+  /// Create a rotating bloom filter.
+  ///
+  /// @param entries_per_generation - The number of entries expected to be
+  ///                                 added in each interval.  Must be > 0.
+  /// @param fp_prob                - The false positive probability for the
+  ///                                 whole filter.  Must be in the range
+  ///                                 0.0 - 1.0 (not inclusive).
+  /// @param generations            - The number of generations.  Must be
+  ///                                 at least 2.
+  /// @param generation_ms          - How often the generations are rotated.
+  ///                                 Must be > 0.
+  /// @param layout                 - How the bits of each generation are laid
+  ///                                 out.
+  /// @return                       - The constructed filter, or nullptr if the
+  ///                                 arguments were unacceptable.
+  static RotatingBloomFilter* create(uint64_t entries_per_generation,
+                                     double fp_prob,
+                                     uint32_t generations,
+                                     uint64_t generation_ms,
+                                     BloomFilter::Layout layout = BloomFilter::STANDARD);
+
+  /// Add an item to the filter.
+  ///
+  /// @param item - The item to set.
+  void add(const std::string& item);
+
+  /// Add several items to the filter.
+  ///
+  /// @param items - The items to set.
+  void add(const std::vector<std::string>& items);
+
+  /// Check whether an item has been added to the filter and not yet expired.
+  ///
+  /// @param item - The item to check.
+  /// @return     - False if the item is not present. True if it *might* be
+  ///               present (bloom filters can give false positives)
+  bool check(const std::string& item);
+
+  /// Build an ordinary bloom filter holding all the items that are currently
+  /// in this one, for example to serialize with BloomFilter::to_json.  Items
+  /// in the copy don't expire.
+  ///
+  /// @return - The new filter, which the caller owns.
+  BloomFilter* snapshot();
+
+private:
+  RotatingBloomFilter(BloomFilter* first_generation,
+                      uint32_t generations,
+                      uint64_t generation_ms);
+
+  // Rotates the generations if the interval has passed.  Only one thread
+  // rotates them at a time; any others carry on with the old generations.
+  void maybe_rotate();
+
+  // The generations.  They're copies of the first, so they all have the same
+  // hash keys and each item only has to be hashed once.
+  std::vector<std::unique_ptr<BloomFilter>> _generations;
+
+  // The index of the newest generation.
+  std::atomic<uint32_t> _newest;
+
+  uint64_t _generation_us;
+
+  // When the generations are next due to be rotated, on the FastClock
+  // cached monotonic clock.
+  std::atomic<uint64_t> _next_rotation_us;
+
+  // Don't implement the following, to avoid copies of this instance.
+  RotatingBloomFilter(RotatingBloomFilter const&);
+  void operator=(RotatingBloomFilter const&);
+};
+
+#endif
@@ -0,0 +1,79 @@
+/**
+ * @file sas_event_sampler.h  Per-event sampling and rate limiting of SAS
+ * events.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef SAS_EVENT_SAMPLER_H__
+#define SAS_EVENT_SAMPLER_H__
+
+#include <stdint.h>
+
+#include <atomic>
+
+/// Decides whether to report SAS events on hot paths, so that high volume
+/// events can be sampled or rate limited (per event ID) while SAS is
+/// connected.  Callers check should_report() before building the event, so a
+/// suppressed event costs nothing beyond the check:
+///
+///   if (SASEventSampler::should_report(SASEvent::MEMCACHED_TRY_HOST))
+///   {
+///     SAS::Event attempt(trail, SASEvent::MEMCACHED_TRY_HOST, 0);
+///     ...
+///     SAS::report_event(attempt);
+///   }
+///
+/// Sampling is per event rather than per trail, so a trail may be missing
+/// the suppressed events - only configure this for events whose trails are
+/// still useful without them.  Events with no configuration are always
+/// reported.
+namespace SASEventSampler
+{
+  /// The most event IDs that can be configured.
+  const int MAX_EVENTS = 64;
+
+  extern std::atomic<bool> configured;
+
+  bool _should_report(int event_id);
+
+  /// @return whether to report an event with this ID.  Each call counts as
+  ///         an event for the purposes of sampling and rate limiting, so only
+  ///         call this once per event.
+  inline bool should_report(int event_id)
+  {
+#ifdef UNIT_TEST
+    // Always report events in unit tests, as they check for them.
+    (void)event_id;
+    return true;
+#else
+    return ((!configured.load(std::memory_order_relaxed)) ||
+            (_should_report(event_id)));
+#endif
+  }
+
+  /// Report one in every `one_in` events with this ID.  0 or 1 reports
+  /// every event.
+  ///
+  /// @return false if too many event IDs are already configured.
+  bool set_sample_rate(int event_id, uint32_t one_in);
+
+  /// Report at most `max_per_second` (sampled) events with this ID each
+  /// second.  0 removes the limit.
+  ///
+  /// @return false if too many event IDs are already configured.
+  bool set_rate_limit(int event_id, uint32_t max_per_second);
+
+  /// Report every event with this ID again.
+  void clear(int event_id);
+
+  /// @return the number of events with this ID that haven't been reported.
+  uint64_t suppressed(int event_id);
+}
+
+#endif
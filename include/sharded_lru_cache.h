@@ -0,0 +1,371 @@
+/**
+ * @file sharded_lru_cache.h  Concurrent LRU cache, split into shards.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef SHARDED_LRU_CACHE_H__
+#define SHARDED_LRU_CACHE_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <functional>
+#include <memory>
+#include <new>
+#include <unordered_map>
+
+#include <boost/functional/hash.hpp>
+
+/// A cache of values that the caller looks up and fills in itself (unlike
+/// TTLCache, which fills in entries from a factory), such as the results of
+/// store lookups.  Values are held by shared_ptr, so a value that is replaced
+/// or evicted stays valid for as long as callers hold it.
+///
+/// The cache is split into a power of two number of shards by the hash of the
+/// key, each with its own lock, hash table and LRU list, so threads using
+/// different keys rarely contend.  Each shard is allocated on its own cache
+/// lines, so that the locks of neighbouring shards don't share a line.
+///
+/// Each entry has a TTL, after which lookups no longer return it, and the
+/// cache has a memory budget, shared equally between the shards.  The size of
+/// an entry is given by a callback (plus a fixed overhead for the entry), and
+/// when a shard goes over its share of the budget it evicts its least
+/// recently used entries.
+template <class K, class V, class Hash = boost::hash<K> >
+class ShardedLruCache
+{
+public:
+  /// Returns the number of bytes an entry uses, not counting the overhead
+  /// of the entry itself.
+  typedef std::function<size_t(const K&, const V&)> SizeFn;
+
+  /// Counts of how the cache has been used.
+  struct Stats
+  {
+    uint64_t hits;
+    uint64_t misses;
+
+    /// The number of lookups that found an entry whose TTL had passed.
+    /// These are also counted as misses.
+    uint64_t expired;
+
+    /// The number of entries evicted to keep within the memory budget.
+    uint64_t evictions;
+
+    size_t entries;
+    size_t bytes;
+  };
+
+  /// The overhead charged for each entry on top of its size - the entry, and
+  /// roughly what the hash table uses for it.
+  static const size_t ENTRY_OVERHEAD = 64;
+
+  static const unsigned int DEFAULT_NUM_SHARDS = 16;
+
+  /// @param memory_budget the number of bytes the entries may use.
+  /// @param size_fn       returns the size of an entry.  If it is empty,
+  ///                      entries are only charged ENTRY_OVERHEAD.
+  /// @param num_shards    the number of shards, which is rounded up to a
+  ///                      power of two.
+  ShardedLruCache(size_t memory_budget,
+                  SizeFn size_fn = SizeFn(),
+                  unsigned int num_shards = DEFAULT_NUM_SHARDS) :
+    _size_fn(size_fn),
+    _num_shards(1),
+    _shard_bits(0)
+  {
+    while (_num_shards < num_shards)
+    {
+      _num_shards <<= 1;
+      ++_shard_bits;
+    }
+
+    void* memory;
+    if (posix_memalign(&memory, CACHE_LINE_SIZE, _num_shards * sizeof(Shard)) != 0)
+    {
+      throw std::bad_alloc(); // LCOV_EXCL_LINE
+    }
+
+    _shards = (Shard*)memory;
+
+    for (unsigned int ii = 0; ii < _num_shards; ++ii)
+    {
+      new (&_shards[ii]) Shard(memory_budget / _num_shards);
+    }
+  }
+
+  ~ShardedLruCache()
+  {
+    for (unsigned int ii = 0; ii < _num_shards; ++ii)
+    {
+      _shards[ii].~Shard();
+    }
+
+    free(_shards);
+  }
+
+  /// Looks up an entry, marking it as the most recently used in its shard.
+  ///
+  /// @return the value, or NULL if there is no entry for the key or its TTL
+  ///         has passed.
+  std::shared_ptr<const V> get(const K& key)
+  {
+    Shard& shard = shard_for(key);
+    std::shared_ptr<const V> value;
+
+    pthread_mutex_lock(&shard.lock);
+    typename Map::iterator i = shard.map.find(key);
+
+    if (i == shard.map.end())
+    {
+      ++shard.misses;
+    }
+    else if (i->second->expires <= time(NULL))
+    {
+      ++shard.misses;
+      ++shard.expired;
+      shard.remove(i);
+    }
+    else
+    {
+      ++shard.hits;
+      Node* node = i->second;
+      shard.unlink(node);
+      shard.push_front(node);
+      value = node->value;
+    }
+
+    pthread_mutex_unlock(&shard.lock);
+
+    return value;
+  }
+
+  /// Adds or replaces an entry, which lookups return for `ttl` seconds.  The
+  /// entry is the most recently used in its shard, and the shard's least
+  /// recently used entries are evicted if it goes over its budget (though the
+  /// new entry is kept even if it alone is over the budget).
+  void put(const K& key, std::shared_ptr<const V> value, int ttl)
+  {
+    size_t size = ENTRY_OVERHEAD + (_size_fn ? _size_fn(key, *value) : 0);
+    time_t expires = time(NULL) + ttl;
+    Shard& shard = shard_for(key);
+
+    pthread_mutex_lock(&shard.lock);
+    typename Map::iterator i = shard.map.find(key);
+    Node* node;
+
+    if (i != shard.map.end())
+    {
+      node = i->second;
+      shard.unlink(node);
+      shard.bytes -= node->size;
+    }
+    else
+    {
+      node = new Node(key);
+      shard.map.insert(std::make_pair(key, node));
+    }
+
+    node->value = value;
+    node->expires = expires;
+    node->size = size;
+    shard.bytes += size;
+    shard.push_front(node);
+
+    while ((shard.bytes > shard.budget) && (shard.head.prev != node))
+    {
+      ++shard.evictions;
+      shard.remove(shard.map.find(static_cast<Node*>(shard.head.prev)->key));
+    }
+
+    pthread_mutex_unlock(&shard.lock);
+  }
+
+  void put(const K& key, const V& value, int ttl)
+  {
+    put(key, std::make_shared<const V>(value), ttl);
+  }
+
+  /// Removes an entry.
+  ///
+  /// @return whether there was an entry for the key.
+  bool erase(const K& key)
+  {
+    Shard& shard = shard_for(key);
+    bool found = false;
+
+    pthread_mutex_lock(&shard.lock);
+    typename Map::iterator i = shard.map.find(key);
+
+    if (i != shard.map.end())
+    {
+      shard.remove(i);
+      found = true;
+    }
+
+    pthread_mutex_unlock(&shard.lock);
+
+    return found;
+  }
+
+  /// Removes all the entries.
+  void clear()
+  {
+    for (unsigned int ii = 0; ii < _num_shards; ++ii)
+    {
+      Shard& shard = _shards[ii];
+      pthread_mutex_lock(&shard.lock);
+      shard.clear();
+      pthread_mutex_unlock(&shard.lock);
+    }
+  }
+
+  /// @return the counts for all the shards.  Each shard is read separately,
+  ///         so these are only consistent if the cache isn't being changed.
+  Stats stats() const
+  {
+    Stats stats = {0, 0, 0, 0, 0, 0};
+
+    for (unsigned int ii = 0; ii < _num_shards; ++ii)
+    {
+      Shard& shard = _shards[ii];
+      pthread_mutex_lock(&shard.lock);
+      stats.hits += shard.hits;
+      stats.misses += shard.misses;
+      stats.expired += shard.expired;
+      stats.evictions += shard.evictions;
+      stats.entries += shard.map.size();
+      stats.bytes += shard.bytes;
+      pthread_mutex_unlock(&shard.lock);
+    }
+
+    return stats;
+  }
+
+  unsigned int num_shards() const { return _num_shards; }
+
+private:
+  static const size_t CACHE_LINE_SIZE = 64;
+
+  // The links of a shard's LRU list (most recently used first).
+  struct Link
+  {
+    Link() : prev(this), next(this) {}
+
+    Link* prev;
+    Link* next;
+  };
+
+  // An entry, which is linked into its shard's LRU list.
+  struct Node : public Link
+  {
+    Node(const K& k) : key(k), expires(0), size(0) {}
+
+    K key;
+    std::shared_ptr<const V> value;
+    time_t expires;
+    size_t size;
+  };
+
+  typedef std::unordered_map<K, Node*, Hash> Map;
+
+  // The size of a shard is padded to a multiple of the cache line size, and
+  // the shards are allocated on a cache line boundary.
+  struct alignas(64) Shard
+  {
+    Shard(size_t shard_budget) :
+      budget(shard_budget),
+      bytes(0),
+      hits(0),
+      misses(0),
+      expired(0),
+      evictions(0)
+    {
+      pthread_mutex_init(&lock, NULL);
+    }
+
+    ~Shard()
+    {
+      clear();
+      pthread_mutex_destroy(&lock);
+    }
+
+    void unlink(Link* node)
+    {
+      node->prev->next = node->next;
+      node->next->prev = node->prev;
+    }
+
+    void push_front(Link* node)
+    {
+      node->next = head.next;
+      node->prev = &head;
+      head.next->prev = node;
+      head.next = node;
+    }
+
+    void remove(typename Map::iterator i)
+    {
+      Node* node = i->second;
+      unlink(node);
+      bytes -= node->size;
+      map.erase(i);
+      delete node;
+    }
+
+    void clear()
+    {
+      while (head.next != &head)
+      {
+        Node* node = static_cast<Node*>(head.next);
+        unlink(node);
+        delete node;
+      }
+
+      map.clear();
+      bytes = 0;
+    }
+
+    mutable pthread_mutex_t lock;
+    Map map;
+
+    // The sentinel of the LRU list - head.next is the most recently used
+    // entry and head.prev the least.
+    Link head;
+
+    size_t budget;
+    size_t bytes;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t expired;
+    uint64_t evictions;
+  };
+
+  Shard& shard_for(const K& key)
+  {
+    // Take the shard from the top bits of a multiplicative hash, as the low
+    // bits are the ones the shard's hash table uses (and some hashes, such
+    // as those of integers, don't mix their bits).
+    uint64_t h = (uint64_t)Hash()(key) * 0x9e3779b97f4a7c15ULL;
+    return _shards[(_shard_bits == 0) ? 0 : (h >> (64 - _shard_bits))];
+  }
+
+  SizeFn _size_fn;
+  unsigned int _num_shards;
+  unsigned int _shard_bits;
+  Shard* _shards;
+
+  // Don't implement the following, to avoid copies of this instance.
+  ShardedLruCache(ShardedLruCache const&);
+  void operator=(ShardedLruCache const&);
+};
+
+#endif
@@ -0,0 +1,131 @@
+/**
+ * @file signal_dispatcher.h  Dispatches UNIX signals to callbacks through a
+ * signalfd.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef SIGNAL_DISPATCHER_H__
+#define SIGNAL_DISPATCHER_H__
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/signalfd.h>
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "signalhandler.h"
+
+/// Dispatches any number of UNIX signals to registered callbacks, through a
+/// single signalfd, rather than with a thread and semaphore per signal as
+/// SignalHandler does.
+///
+/// The signals are blocked, so they are only delivered through the fd.  This
+/// can either be polled from an existing event loop (calling dispatch() when
+/// it is readable), or by a thread of the dispatcher's own (see start()).
+///
+/// As signal masks are inherited by new threads, handlers must be added
+/// before the process creates any other threads, or the signals may be
+/// delivered to a thread that hasn't blocked them.
+class SignalDispatcher
+{
+public:
+  /// Called with the signal number and the info the signal was sent with.
+  typedef std::function<void(int, const struct signalfd_siginfo&)> Callback;
+
+  SignalDispatcher();
+
+  /// Stops the dispatcher's thread (if it is running) and closes the fd.
+  /// The signals stay blocked.
+  virtual ~SignalDispatcher();
+
+  /// Calls a callback whenever a signal is raised, blocking the signal.  A
+  /// signal may have several callbacks, which are called in the order they
+  /// were added.
+  ///
+  /// @return whether the signal could be added to the signalfd.
+  bool add_handler(int signum, Callback callback);
+
+  /// @return the signalfd, which is readable when there are signals to
+  ///         dispatch, or -1 if no handlers have been added.
+  int fd() const { return _fd; }
+
+  /// Calls the callbacks for the signals that have been raised, without
+  /// blocking.  Callbacks are called on the calling thread.
+  void dispatch();
+
+  /// Starts a thread that dispatches the signals as they are raised, for
+  /// processes without an event loop to poll the fd from.  Calling this
+  /// again once the thread is running does nothing.
+  ///
+  /// @return whether the thread is running.
+  bool start();
+
+private:
+  static void* dispatcher_thread(void* dispatcher);
+  void dispatcher_thread();
+
+  // The handlers, protected by the lock.  Callbacks are called without it
+  // held, so may add handlers.
+  pthread_mutex_t _lock;
+  std::map<int, std::vector<Callback> > _callbacks;
+  sigset_t _mask;
+  int _fd;
+
+  // Written to stop the dispatcher thread.
+  int _stop_fd;
+  pthread_t _thread;
+  bool _thread_running;
+
+  // Don't implement the following, to avoid copies of this instance.
+  SignalDispatcher(SignalDispatcher const&);
+  void operator=(SignalDispatcher const&);
+};
+
+/// A SignalWaiter fed by a SignalDispatcher, so that code that waits on a
+/// SignalHandler (such as Updater) can be moved onto the dispatcher without
+/// a thread per signal.
+class DispatchedSignalWaiter : public SignalWaiter
+{
+public:
+  /// @param dispatcher - The dispatcher to add a handler to.
+  /// @param signum     - The signal to wait for.
+  DispatchedSignalWaiter(SignalDispatcher* dispatcher, int signum);
+  virtual ~DispatchedSignalWaiter() {}
+
+  /// Waits for the signal to be raised, or for a second to pass.
+  ///
+  /// @return true if the signal was raised, false on timeout.
+  bool wait_for_signal();
+
+private:
+  // The number of times the signal has been raised.  This is shared with the
+  // dispatcher's callback, which can't be removed, so that the waiter can be
+  // destroyed before the dispatcher.
+  struct State
+  {
+    State();
+    ~State();
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint64_t raised;
+  };
+
+  std::shared_ptr<State> _state;
+
+  // Don't implement the following, to avoid copies of this instance.
+  DispatchedSignalWaiter(DispatchedSignalWaiter const&);
+  void operator=(DispatchedSignalWaiter const&);
+};
+
+#endif
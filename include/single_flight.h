@@ -0,0 +1,177 @@
+/**
+ * @file single_flight.h  Shares one call between concurrent identical reads.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef SINGLE_FLIGHT_H__
+#define SINGLE_FLIGHT_H__
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <exception>
+#include <map>
+#include <memory>
+
+/// The counts of calls made through a SingleFlight.
+struct SingleFlightStats
+{
+  /// The number of calls that were made downstream.
+  uint64_t calls;
+
+  /// The number of calls that instead shared the result of one already in
+  /// flight.
+  uint64_t merged;
+};
+
+/// Coalesces concurrent identical reads (such as many threads reading the
+/// same hot key at once) into one downstream call.
+///
+/// The first thread to ask for a key makes the call.  Threads that ask for
+/// the same key while it's in flight wait for it and get a copy of its
+/// result (or the exception it threw), rather than making their own.  Once
+/// the call completes, the next thread to ask for the key makes a new call,
+/// so a result is never older than the call that is in flight when it's
+/// asked for.
+///
+/// Only reads should be coalesced, and only when the callers would accept
+/// each other's results - the key must cover everything that affects the
+/// result.
+template <class Key, class Result>
+class SingleFlight
+{
+public:
+  SingleFlight() :
+    _calls(),
+    _num_calls(0),
+    _num_merged(0)
+  {
+    pthread_mutex_init(&_lock, NULL);
+  }
+
+  ~SingleFlight()
+  {
+    pthread_mutex_destroy(&_lock);
+  }
+
+  /// Gets the result for a key, sharing the call with any others for the key
+  /// that are in flight.
+  ///
+  /// @param key    - The key.
+  /// @param fn     - Makes the call, returning its result.  Any exception it
+  ///                 throws is rethrown to every caller sharing the call.
+  /// @param merged - (out, optional) Whether the result came from another
+  ///                 thread's call.
+  /// @return       - A copy of the result.
+  template <class Fn>
+  Result run(const Key& key, Fn fn, bool* merged = NULL)
+  {
+    pthread_mutex_lock(&_lock);
+
+    typename std::map<Key, std::shared_ptr<Call> >::iterator it = _calls.find(key);
+
+    if (it != _calls.end())
+    {
+      std::shared_ptr<Call> call = it->second;
+      ++_num_merged;
+
+      while (!call->done)
+      {
+        pthread_cond_wait(&call->cond, &_lock);
+      }
+
+      pthread_mutex_unlock(&_lock);
+
+      if (merged != NULL)
+      {
+        *merged = true;
+      }
+
+      if (call->error)
+      {
+        std::rethrow_exception(call->error);
+      }
+
+      return call->result;
+    }
+
+    std::shared_ptr<Call> call = std::make_shared<Call>();
+    _calls[key] = call;
+    ++_num_calls;
+    pthread_mutex_unlock(&_lock);
+
+    if (merged != NULL)
+    {
+      *merged = false;
+    }
+
+    try
+    {
+      call->result = fn();
+    }
+    catch (...)
+    {
+      call->error = std::current_exception();
+    }
+
+    pthread_mutex_lock(&_lock);
+    call->done = true;
+    _calls.erase(key);
+    pthread_cond_broadcast(&call->cond);
+    pthread_mutex_unlock(&_lock);
+
+    if (call->error)
+    {
+      std::rethrow_exception(call->error);
+    }
+
+    return call->result;
+  }
+
+  /// Get the current counts.
+  void stats(SingleFlightStats& stats) const
+  {
+    pthread_mutex_lock(&_lock);
+    stats.calls = _num_calls;
+    stats.merged = _num_merged;
+    pthread_mutex_unlock(&_lock);
+  }
+
+private:
+  // A call in flight.  The result is written by the thread making the call
+  // before it sets `done`, and only read after.
+  struct Call
+  {
+    Call() : done(false), result(), error()
+    {
+      pthread_cond_init(&cond, NULL);
+    }
+
+    ~Call()
+    {
+      pthread_cond_destroy(&cond);
+    }
+
+    bool done;
+    pthread_cond_t cond;
+    Result result;
+    std::exception_ptr error;
+  };
+
+  mutable pthread_mutex_t _lock;
+  std::map<Key, std::shared_ptr<Call> > _calls;
+  uint64_t _num_calls;
+  uint64_t _num_merged;
+
+  // Don't implement the following, to avoid copies of this instance.
+  SingleFlight(SingleFlight const&);
+  void operator=(SingleFlight const&);
+};
+
+#endif
@@ -0,0 +1,65 @@
+/**
+ * @file sip_hasher.h  Optimised SipHash implementation.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef SIP_HASHER_H__
+#define SIP_HASHER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/// Calculates 64-bit SipHashes with a fixed key.
+///
+/// This gives the same results as the reference siphash() (with an 8-byte
+/// output and the key's two halves in native byte order), but reads the input
+/// a word at a time, and works out the initial state from the key once rather
+/// than on every hash.
+class SipHasher
+{
+public:
+  /// The number of items that hash_many() works on at once.
+  static const size_t BATCH_SIZE = 2;
+
+  SipHasher();
+
+  /// @param k0, k1 - The two halves of the key.
+  SipHasher(uint64_t k0, uint64_t k1);
+
+  /// Calculates the SipHash-2-4 of some data.
+  uint64_t hash(const void* data, size_t length) const;
+
+  /// Calculates the SipHash-1-3 of some data. This has fewer rounds, so is
+  /// quicker, but has a smaller security margin - only use it where the
+  /// hashes don't need to resist deliberate collisions.
+  uint64_t hash_1_3(const void* data, size_t length) const;
+
+  /// Calculates the SipHash-2-4s of several items. The items are hashed
+  /// BATCH_SIZE at a time, with their rounds interleaved so the processor can
+  /// work on them in parallel, which is quicker than hashing them one by one
+  /// for short items of similar lengths.
+  ///
+  /// @param data    - The items to hash.
+  /// @param lengths - The lengths of the items.
+  /// @param count   - The number of items.
+  /// @param out     - Filled in with the hashes of the items.
+  void hash_many(const void* const* data,
+                 const size_t* lengths,
+                 size_t count,
+                 uint64_t* out) const;
+
+private:
+  // The state after the key has been mixed in.
+  uint64_t _v0;
+  uint64_t _v1;
+  uint64_t _v2;
+  uint64_t _v3;
+};
+
+#endif
@@ -10,6 +10,9 @@
  */
 
 #include <string>
+#include <map>
+#include <memory>
+#include <vector>
 #include "snmp_internal/snmp_includes.h"
 
 #ifndef CW_SNMP_AGENT_H
@@ -18,6 +21,8 @@
 namespace SNMP
 {
 
+class Row;
+
 class Agent
 {
 public:
@@ -33,20 +38,119 @@ public:
   void start(void);
   void stop(void);
   inline pthread_mutex_t& get_lock() { return _netsnmp_lock; }
+
+  // Rows are added to and removed from tables on the agent thread, in
+  // batches between requests, so the calling thread doesn't wait for the
+  // Net-SNMP lock.  Until the agent is started, they are added and removed
+  // immediately.
+  //
+  // Queues adding a row to a table, and returns immediately.
   void add_row_to_table(netsnmp_tdata* table, netsnmp_tdata_row* row);
+
+  // Removes a row from a table, returning once it has been removed (so the
+  // caller can then delete it).
   void remove_row_from_table(netsnmp_tdata* table, netsnmp_tdata_row* row);
 
+  // Queues removing a row from a table and then deleting it, and returns
+  // immediately.  The row is deleted on the agent thread.
+  void remove_and_delete_row(netsnmp_tdata* table, Row* row);
+
+  // Returns once all the changes queued so far have been made.
+  void wait_for_changes();
+
+  // Snapshot the columns of every table row every `interval_s` seconds on a
+  // background thread, and answer requests from the snapshots rather than
+  // the rows' live data - so the cost of a poll doesn't depend on how busy
+  // the rows are, at the cost of the values being up to `interval_s` old.
+  // Must be called before start().
+  void enable_snapshots(unsigned int interval_s);
+
+  // Also render the rows as OpenMetrics text each time they're snapshotted,
+  // for get_open_metrics().  Must be called before start(), and has no effect
+  // unless snapshots are enabled.
+  void enable_open_metrics();
+
+  // Returns the OpenMetrics text rendered from the latest snapshots, or NULL
+  // if none has been rendered yet.  The text isn't changed once rendered, so
+  // can be sent without copying it.
+  std::shared_ptr<const std::string> get_open_metrics() const;
+
 private:
   static Agent* _instance;
   std::string _name;
   pthread_t _thread;
   pthread_mutex_t _netsnmp_lock = PTHREAD_MUTEX_INITIALIZER;
 
+  // The rows in all the tables (mapped to their tables), and the one being
+  // snapshotted (which mustn't be removed until it's done), protected by
+  // _snapshot_lock.
+  unsigned int _snapshot_interval_s = 0;
+  pthread_t _snapshot_thread;
+  bool _snapshot_thread_running = false;
+  bool _snapshot_terminated = false;
+  std::map<Row*, netsnmp_tdata*> _rows;
+  Row* _snapshotting = NULL;
+  pthread_mutex_t _snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t _snapshot_cond;
+
+  // A queued change to a table.  If to_delete is set, the row is removed
+  // and then deleted.
+  struct RowChange
+  {
+    bool add;
+    netsnmp_tdata* table;
+    netsnmp_tdata_row* row;
+    Row* to_delete;
+  };
+
+  // The changes not yet made, and how many have been queued and made in
+  // total, protected by _changes_lock.  _changes_cond is signalled when
+  // changes have been made.  Changes are made by one thread at a time,
+  // holding _apply_lock.
+  std::vector<RowChange> _changes;
+  uint64_t _changes_queued = 0;
+  uint64_t _changes_made = 0;
+  bool _thread_running = false;
+  pthread_mutex_t _changes_lock = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t _changes_cond;
+  pthread_mutex_t _apply_lock = PTHREAD_MUTEX_INITIALIZER;
+
+  // Written to wake the agent thread when there are changes to make.
+  int _changes_fd;
+
   Agent(std::string name);
   ~Agent();
 
+  // Queues a change, waking the agent thread.
+  //
+  // @return the change's sequence number, or 0 if the agent thread isn't
+  //         running, in which case the caller should make the queued
+  //         changes.
+  uint64_t queue_change(const RowChange& change);
+
+  // Waits for a change to be made, given its sequence number (making the
+  // queued changes if that is 0).
+  void wait_for_change(uint64_t seq);
+
+  // Makes all the queued changes.
+  void make_changes(void);
+
+  // Stops snapshotting a row that is being removed, waiting for the
+  // snapshot thread to finish with it if need be.
+  void forget_row(Row* row);
+
   static void* thread_fn(void* snmp_handler);
   void thread_fn(void);
+  static void* snapshot_thread_fn(void* snmp_handler);
+  void snapshot_thread_fn(void);
+
+  // Renders the rows' latest snapshots as OpenMetrics text.  Called on the
+  // snapshot thread with _snapshot_lock held, which is released while
+  // rendering.
+  void render_open_metrics(void);
+
+  bool _open_metrics = false;
+  std::shared_ptr<const std::string> _open_metrics_text;
   static int logging_callback(int majorID, int minorID, void* serverarg, void* clientarg);
 };
 
@@ -56,7 +160,9 @@ private:
 // name - this is arbitrary, but should be spomething sensible (e.g. 'sprout', 'bono').
 int snmp_setup(const char* name);
 
-int init_snmp_handler_threads(const char* name);
+// Set up the SNMP handling threads.  If 'snapshot_interval_s' is non-zero, requests are answered
+// from snapshots of the tables taken at that interval (see SNMP::Agent::enable_snapshots).
+int init_snmp_handler_threads(const char* name, unsigned int snapshot_interval_s = 0);
 
 // Terminates the SNMP agent thread. 'name' should match the string passed to snmp_setup.
 void snmp_terminate(const char* name);
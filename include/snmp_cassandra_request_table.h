@@ -0,0 +1,53 @@
+/**
+ * @file snmp_cassandra_request_table.h
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+
+#include "cassandra_request_stats.h"
+
+#ifndef SNMP_CASSANDRA_REQUEST_TABLE_H
+#define SNMP_CASSANDRA_REQUEST_TABLE_H
+
+// This file contains the interface for tables that:
+//   - are indexed by a Cassandra column family and request type, e.g.
+//     "impu:get_slice"
+//   - report the counts in their CassandraRequestStats, as Counter32s:
+//     requests, failures, retries and consistency level fallbacks.
+//
+// To use such a table, create one, and add each request type's stats to it,
+// e.g.:
+//
+// CassandraRequestTable* table = CassandraRequestTable::create("cassandra_requests", ".1.2.3");
+// table->add_request_type(&stats);
+//
+// The stats must outlive the table.  They are read when the table is
+// queried, so recording requests doesn't touch the table.  The latencies of
+// each request type can be reported by adding the stats' histogram to a
+// LatencyHistogramTable.
+//
+// This is defined as an interface in order not to pollute the codebase with netsnmp include files
+// (which indiscriminately #define things like READ and WRITE).
+//
+namespace SNMP
+{
+
+class CassandraRequestTable
+{
+public:
+  CassandraRequestTable() {};
+  virtual ~CassandraRequestTable() {};
+
+  static CassandraRequestTable* create(std::string name, std::string oid);
+  virtual void add_request_type(const CassandraRequestStats* stats) = 0;
+};
+
+}
+#endif
@@ -36,6 +36,13 @@
 //
 // ContinuousAccumulatorTable* token_rate_table = ContinuousAccumulatorTable::create("token_rate", ".1.2.3");
 // token_rate_table->accumulate(2000);
+//
+// Tables that are accumulated into by many threads at once should be created
+// with `create_sharded` instead, which keeps the count and water marks per
+// thread (so accumulating doesn't contend on a shared cache line), and only
+// integrates the value over time once per clock tick.  The average and
+// variance may then be attributed to the wrong sample for up to one tick of
+// the coarse clock when samples arrive on several threads in the same tick.
 
 namespace SNMP
 {
@@ -46,6 +53,7 @@ public:
   virtual ~ContinuousAccumulatorTable() {};
 
   static ContinuousAccumulatorTable* create(std::string name, std::string oid);
+  static ContinuousAccumulatorTable* create_sharded(std::string name, std::string oid);
 
   // Accumulate a sample into the underlying statistics.
   virtual void accumulate(uint32_t sample) = 0;
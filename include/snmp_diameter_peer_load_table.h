@@ -0,0 +1,50 @@
+/**
+ * @file snmp_diameter_peer_load_table.h
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+
+#include "diameter_peer_load.h"
+
+#ifndef SNMP_DIAMETER_PEER_LOAD_TABLE_H
+#define SNMP_DIAMETER_PEER_LOAD_TABLE_H
+
+// This file contains the interface for tables that:
+//   - are indexed by the Diameter identity of a peer
+//   - report the load on the peer from its PeerLoad: the requests
+//     outstanding (Gauge32), the moving average latency in microseconds
+//     (Gauge32), and the requests completed and timed out (Counter32s).
+//
+// To use such a table, create one, and add each peer's load to it, e.g.:
+//
+// DiameterPeerLoadTable* table = DiameterPeerLoadTable::create("diameter_peer_load", ".1.2.3");
+// table->add_peer(&load);
+//
+// The loads must outlive the table.  They are read when the table is
+// queried, so recording requests doesn't touch the table.
+//
+// This is defined as an interface in order not to pollute the codebase with netsnmp include files
+// (which indiscriminately #define things like READ and WRITE).
+//
+namespace SNMP
+{
+
+class DiameterPeerLoadTable
+{
+public:
+  DiameterPeerLoadTable() {};
+  virtual ~DiameterPeerLoadTable() {};
+
+  static DiameterPeerLoadTable* create(std::string name, std::string oid);
+  virtual void add_peer(const Diameter::PeerLoad* load) = 0;
+};
+
+}
+#endif
@@ -23,6 +23,7 @@
 //   - are indexed by time period and scope (node type)
 //   - accumulate data samples over time
 //   - report a count of samples, mean sample value, variance, high-water-mark and low-water-mark
+//     (and optionally estimates of the 50th, 90th and 99th percentiles)
 //   - reset completely at the end of the period
 //
 // The thing sampled should be event related, i.e. size of a queue, latency
@@ -44,6 +45,10 @@ public:
 
   static EventAccumulatorByScopeTable* create(std::string name, std::string oid);
 
+  // Create a table that also reports the estimated 50th, 90th and 99th
+  // percentiles of the samples, in columns 8-10.
+  static EventAccumulatorByScopeTable* create_with_percentiles(std::string name, std::string oid);
+
   // Accumulate a sample into the underlying statistics.
   virtual void accumulate(uint32_t sample) = 0;
 
@@ -36,6 +36,18 @@ protected:
   virtual ~InfiniteBaseTable();
   virtual Value get_value(std::string, uint32_t, uint32_t, timespec) = 0;
 
+  // Gets the values of all the columns in a row, in column order starting
+  // from FIRST_COLUMN.  A GETBULK usually asks for every column of each row
+  // it walks, so the handler gets each row once per request and caches it.
+  // The default implementation calls get_value() for each column - tables
+  // that calculate all the columns together should override it.
+  virtual void get_row(std::string tag,
+                       uint32_t row,
+                       timespec now,
+                       std::vector<Value>& values);
+
+  static const uint32_t FIRST_COLUMN = 2;
+
 private:
   static const uint32_t MAX_TAG_LEN = 16;
   static const ssize_t SCRATCH_BUF_LEN = 128;
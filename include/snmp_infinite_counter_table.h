@@ -0,0 +1,66 @@
+/**
+ * @file snmp_infinite_counter_table.h
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdint.h>
+
+#include <string>
+
+#ifndef SNMP_INFINITE_COUNTER_TABLE_H
+#define SNMP_INFINITE_COUNTER_TABLE_H
+
+// This file contains the interface for tables which:
+//   - are indexed by scope (a tag of 1-16 A-Z characters) and time period
+//   - increment a single counter per scope over time
+//   - report a single column for each scope and time period with that count
+//
+// Unlike the *ByScopeTable tables, there are no row objects per scope.  The
+// counts for each period are kept in one array indexed by scope ID, and rows
+// are only built when they are read, so adding scopes (e.g. per peer) costs
+// one counter per period rather than a set of rows.
+//
+// Look up the ID of a scope once, then increment it on the hot path:
+//
+// InfiniteCounterTable* table = InfiniteCounterTable::create("peer_requests", ".1.2.3");
+// uint32_t peer = table->scope_id("PEERONE");
+// table->increment(peer);
+
+namespace SNMP
+{
+
+class InfiniteCounterTable
+{
+public:
+  InfiniteCounterTable() {};
+  virtual ~InfiniteCounterTable() {};
+
+  // The most scopes a table can count.  Increments to scopes beyond this are
+  // dropped.
+  static const uint32_t MAX_SCOPES = 256;
+
+  // Returned by scope_id() once MAX_SCOPES scopes are in use.
+  static const uint32_t NO_SCOPE = 0xFFFFFFFF;
+
+  static InfiniteCounterTable* create(std::string name, std::string oid);
+
+  // Get the ID of a scope, assigning it one if it doesn't have one yet.  This
+  // takes a lock, so callers should look IDs up once rather than per
+  // increment.
+  virtual uint32_t scope_id(const std::string& scope) = 0;
+
+  // Increment a scope's count.  This doesn't take any locks.
+  virtual void increment(uint32_t scope_id, uint32_t count = 1) = 0;
+
+  // Increment a scope's count, looking up its ID.
+  virtual void increment(const std::string& scope, uint32_t count = 1) = 0;
+};
+}
+
+#endif
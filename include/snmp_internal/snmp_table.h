@@ -12,11 +12,13 @@
 #include <vector>
 #include <map>
 #include <string>
+#include <memory>
 
 #include "snmp_agent.h"
 #include "snmp_row.h"
 #include "snmp_includes.h"
 #include "log.h"
+#include "memory_accounting.h"
 
 #ifndef SNMP_TABLE_H
 #define SNMP_TABLE_H
@@ -74,6 +76,12 @@ public:
 
   virtual ~Table()
   {
+    // Make sure there are no changes to this table still queued.
+    if (SNMP::Agent::instance() != NULL)
+    {
+      SNMP::Agent::instance()->wait_for_changes();
+    }
+
     if (_handler_reg)
     {
       netsnmp_unregister_handler(_handler_reg);
@@ -100,6 +108,13 @@ public:
     SNMP::Agent::instance()->remove_row_from_table(_table, row->get_netsnmp_row());
   };
 
+  // Remove a Row from the underlying table and delete it, without waiting
+  // for the row to be removed.
+  void remove_and_delete(T* row)
+  {
+    SNMP::Agent::instance()->remove_and_delete_row(_table, row);
+  };
+
 protected:
   std::string _name;
   oid _tbl_oid[64];
@@ -115,7 +130,7 @@ private:
                                       netsnmp_agent_request_info *reqinfo,
                                       netsnmp_request_info *requests)
   {
-    std::map<netsnmp_tdata_row*, SNMP::ColumnData> cache;
+    std::map<netsnmp_tdata_row*, std::shared_ptr<const SNMP::ColumnData>> cache;
     char buf[64];
 
     TRC_DEBUG("Starting handling batch of SNMP requests");
@@ -144,19 +159,27 @@ private:
       SNMP::Row* data = static_cast<SNMP::Row*>(row->data);
 
       // We need to get information a row at a time, and remember it - this avoids us reading column
-      // 1, and having the data change before we query column 2
-      if (cache.find(row) == cache.end())
+      // 1, and having the data change before we query column 2.  If the agent is taking snapshots
+      // of the rows, use the latest one rather than reading the live data.
+      std::shared_ptr<const SNMP::ColumnData>& columns = cache[row];
+      if (!columns)
       {
-        SNMP::ColumnData cd = data->get_columns();
-        cache[row] = cd;
+        columns = data->get_snapshot();
+
+        if (!columns)
+        {
+          columns.reset(new SNMP::ColumnData(data->get_columns()));
+        }
       }
-      
-      if (cache[row][table_info->colnum].size != 0)
+
+      SNMP::ColumnData::const_iterator column = columns->find(table_info->colnum);
+
+      if ((column != columns->end()) && (column->second.size != 0))
       {
         snmp_set_var_typed_value(requests->requestvb,
-                                 cache[row][table_info->colnum].type,
-                                 cache[row][table_info->colnum].value,
-                                 cache[row][table_info->colnum].size);
+                                 column->second.type,
+                                 column->second.value,
+                                 column->second.size);
       }
       else
       {
@@ -193,13 +216,18 @@ public:
       TRow* row = ii->second;
       Table<TRow>::remove(row);
       delete row;
+      memory_account()->credit(sizeof(TRow));
     }
   }
 
   void add(TRowKey key, TRow* row)
   {
     std::pair<TRowKey, TRow*> new_entry(key, row);
-    _map.insert(new_entry);
+
+    if (_map.insert(new_entry).second)
+    {
+      memory_account()->charge(sizeof(TRow));
+    }
 
     Table<TRow>::add(row);
   }
@@ -236,8 +264,8 @@ public:
     {
       TRow* row = _map.at(key);
       _map.erase(key);
-      Table<TRow>::remove(row);
-      delete row;
+      Table<TRow>::remove_and_delete(row);
+      memory_account()->credit(sizeof(TRow));
     }
   };
 
@@ -249,6 +277,14 @@ protected:
   void add(TRow* row) { Table<TRow>::add(row); };
   void remove(TRow* row) { Table<TRow>::remove(row); };
   std::map<TRowKey, TRow*> _map;
+
+private:
+  // The rows are counted in the SNMP_ROWS memory account.
+  static MemoryAccount* memory_account()
+  {
+    static MemoryAccount* account = MemoryAccount::get(MemoryAccount::SNMP_ROWS);
+    return account;
+  }
 };
 
 } // namespace SNMP
@@ -12,6 +12,10 @@
 #ifndef SNMP_IP_TIMED_BASED_COUNT_TABLE_H_
 #define SNMP_IP_TIMED_BASED_COUNT_TABLE_H_
 
+#include <string>
+
+#include "utils.h"
+
 namespace SNMP
 {
 
@@ -54,6 +58,14 @@ public:
   /// @param ip - The IP address to increment the stat for.
   virtual void increment(const std::string& ip) = 0;
 
+  /// Increment the count for the given IP, which must have been added by
+  /// calling `add_ip` (or the increment is ignored).  This avoids parsing the
+  /// address, so is cheaper on hot paths that already have it in binary form.
+  /// It takes no locks.
+  ///
+  /// @param ip - The IP address to increment the stat for.
+  virtual void increment(const IP46Address& ip) = 0;
+
 protected:
   IPTimeBasedCounterTable() {};
 };
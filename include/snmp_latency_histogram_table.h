@@ -0,0 +1,56 @@
+/**
+ * @file snmp_latency_histogram_table.h
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+
+#include "latency_histogram.h"
+
+#ifndef SNMP_LATENCY_HISTOGRAM_TABLE_H
+#define SNMP_LATENCY_HISTOGRAM_TABLE_H
+
+// This file contains the interface for tables that:
+//   - are indexed by a string and a histogram bucket
+//   - report the buckets of a LatencyHistogram for each value of the string
+//     index
+//   - report columns for the upper bound of the bucket (in microseconds, or
+//     4294967295 for the last bucket) and the number of latencies counted in
+//     it since the histogram was created.
+//
+// An example would be a table of the latencies of the requests to each of
+// an HTTP server's endpoints.
+//
+// To use such a table, create one, and add each histogram to it, e.g.:
+//
+// LatencyHistogramTable* table = LatencyHistogramTable::create("http_latency_histograms", ".1.2.3");
+// table->add_histogram("/impi/{impi}/av", &histogram);
+//
+// The histograms must outlive the table.  The counts are read from them when
+// the table is queried, so recording latencies doesn't touch the table.
+//
+// This is defined as an interface in order not to pollute the codebase with netsnmp include files
+// (which indiscriminately #define things like READ and WRITE).
+//
+namespace SNMP
+{
+
+class LatencyHistogramTable
+{
+public:
+  LatencyHistogramTable() {};
+  virtual ~LatencyHistogramTable() {};
+
+  static LatencyHistogramTable* create(std::string name, std::string oid);
+  virtual void add_histogram(std::string str_index,
+                             const LatencyHistogram* histogram) = 0;
+};
+
+}
+#endif
@@ -0,0 +1,63 @@
+/**
+ * @file snmp_latency_percentile_table.h
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include <vector>
+
+#include "latency_histogram.h"
+
+#ifndef SNMP_LATENCY_PERCENTILE_TABLE_H
+#define SNMP_LATENCY_PERCENTILE_TABLE_H
+
+// This file contains the interface for tables that:
+//   - are indexed by a string and a percentile
+//   - report configurable percentiles of a LatencyHistogram for each value
+//     of the string index
+//   - report columns for the percentile (in thousandths of a percent, so
+//     99900 is the 99.9th percentile), the latency at that percentile (in
+//     microseconds, or 4294967295 if it is in the histogram's last bucket)
+//     and the number of latencies the histogram has counted.
+//
+// The latencies are the upper bounds of the histogram's buckets, so are
+// within 1/LatencyHistogram::SUB_BUCKETS of the true percentile (and never
+// below it).  They cover all the latencies since the histogram was created.
+//
+// An example would be a table of the p99 and p99.9 latencies of each of an
+// HTTP server's endpoints:
+//
+// LatencyPercentileTable* table =
+//   LatencyPercentileTable::create("http_latency_percentiles", ".1.2.3", {99, 99.9});
+// table->add_histogram("/impi/{impi}/av", &histogram);
+//
+// The histograms must outlive the table.  The percentiles are calculated when
+// the table is queried, so recording latencies doesn't touch the table.
+//
+// This is defined as an interface in order not to pollute the codebase with netsnmp include files
+// (which indiscriminately #define things like READ and WRITE).
+//
+namespace SNMP
+{
+
+class LatencyPercentileTable
+{
+public:
+  LatencyPercentileTable() {};
+  virtual ~LatencyPercentileTable() {};
+
+  static LatencyPercentileTable* create(std::string name,
+                                        std::string oid,
+                                        const std::vector<double>& percentiles);
+  virtual void add_histogram(std::string str_index,
+                             const LatencyHistogram* histogram) = 0;
+};
+
+}
+#endif
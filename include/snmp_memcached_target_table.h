@@ -0,0 +1,52 @@
+/**
+ * @file snmp_memcached_target_table.h
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+
+#include "memcached_target_stats.h"
+
+#ifndef SNMP_MEMCACHED_TARGET_TABLE_H
+#define SNMP_MEMCACHED_TARGET_TABLE_H
+
+// This file contains the interface for tables that:
+//   - are indexed by the name of a memcached target (its address and port)
+//   - report the counts in the target's MemcachedTargetStats, as Counter32s:
+//     requests, retries, bytes sent, bytes received, tombstones read and CAS
+//     contention.
+//
+// To use such a table, create one, and add each target's stats to it, e.g.:
+//
+// MemcachedTargetTable* table = MemcachedTargetTable::create("memcached_targets", ".1.2.3");
+// table->add_target(&stats);
+//
+// The stats must outlive the table.  They are read when the table is
+// queried, so recording requests doesn't touch the table.  The latencies of
+// each target's requests can be reported by adding the stats' histogram to a
+// LatencyHistogramTable.
+//
+// This is defined as an interface in order not to pollute the codebase with netsnmp include files
+// (which indiscriminately #define things like READ and WRITE).
+//
+namespace SNMP
+{
+
+class MemcachedTargetTable
+{
+public:
+  MemcachedTargetTable() {};
+  virtual ~MemcachedTargetTable() {};
+
+  static MemcachedTargetTable* create(std::string name, std::string oid);
+  virtual void add_target(const MemcachedTargetStats* stats) = 0;
+};
+
+}
+#endif
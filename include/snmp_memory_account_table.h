@@ -0,0 +1,49 @@
+/**
+ * @file snmp_memory_account_table.h
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+
+#include "memory_accounting.h"
+
+#ifndef SNMP_MEMORY_ACCOUNT_TABLE_H
+#define SNMP_MEMORY_ACCOUNT_TABLE_H
+
+// This file contains the interface for tables that:
+//   - are indexed by the name of a memory account, e.g. "dns_cache"
+//   - report the account's counts, as Gauge32s: the kilobytes it holds, the
+//     objects it holds and the most kilobytes it has been seen to hold.
+//
+// To use such a table, create one, and add each account to it, e.g.:
+//
+// MemoryAccountTable* table = MemoryAccountTable::create("memory_accounts", ".1.2.3");
+// table->add_account(MemoryAccount::get(MemoryAccount::DNS_CACHE));
+//
+// The counts are read when the table is queried, so charging an account
+// doesn't touch the table.
+//
+// This is defined as an interface in order not to pollute the codebase with netsnmp include files
+// (which indiscriminately #define things like READ and WRITE).
+//
+namespace SNMP
+{
+
+class MemoryAccountTable
+{
+public:
+  MemoryAccountTable() {};
+  virtual ~MemoryAccountTable() {};
+
+  static MemoryAccountTable* create(std::string name, std::string oid);
+  virtual void add_account(const MemoryAccount* account) = 0;
+};
+
+}
+#endif
@@ -12,6 +12,7 @@
 #include <vector>
 #include <map>
 #include <string>
+#include <memory>
 #include <string.h>
 
 #include "log.h"
@@ -103,15 +104,33 @@ class Row
 {
 public:
   template<class T> friend class Table;
+  friend class Agent;
   Row();
 
   virtual ~Row();
 
   virtual ColumnData get_columns() = 0;
 
+  // Returns the columns as of the last snapshot taken by the SNMP agent (see
+  // Agent::enable_snapshots), or NULL if there isn't one.
+  std::shared_ptr<const ColumnData> get_snapshot() const
+  {
+    return std::atomic_load(&_snapshot);
+  }
+
+  // Replaces the snapshot with the current columns.
+  void take_snapshot()
+  {
+    std::shared_ptr<const ColumnData> snapshot(new ColumnData(get_columns()));
+    std::atomic_store(&_snapshot, snapshot);
+  }
+
 protected:
   netsnmp_tdata_row* _row;
   netsnmp_tdata_row* get_netsnmp_row() { return _row; };
+
+private:
+  std::shared_ptr<const ColumnData> _snapshot;
 };
 
 } // namespace SNMP
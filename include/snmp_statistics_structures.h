@@ -13,6 +13,7 @@
 #include <map>
 #include <string>
 #include <atomic>
+#include "fast_clock.h"
 #include "limits.h"
 
 #ifndef SNMP_STATISTICS_STRUCTURES_H
@@ -105,7 +106,7 @@ struct ContinuousStatistics
   void reset(uint64_t periodstart_ms, ContinuousStatistics* previous = NULL)
   {
     struct timespec now;
-    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    FastClock::cached_realtime(now);
 
     // At time 0, all incrementing values should be 0
     count.store(0);
@@ -0,0 +1,166 @@
+/**
+ * @file startup_orchestrator.h  Runs a process's startup steps concurrently,
+ * in dependency order, and times them.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef STARTUP_ORCHESTRATOR_H__
+#define STARTUP_ORCHESTRATOR_H__
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace SNMP
+{
+class U32Scalar;
+}
+
+/// Runs the steps of a process's startup (loading the DNS cache, building
+/// the memcached view, connecting to Cassandra, registering SNMP tables,
+/// initializing the HTTP stack, ...) on several threads at once.
+///
+/// Each step declares the steps it depends on, and is run as soon as they
+/// have all succeeded, so independent steps overlap rather than running one
+/// after another.  If a step fails, the steps that depend on it (directly or
+/// not) are skipped, but the others still run.
+///
+/// Every step is timed.  The timings are logged when the steps complete,
+/// along with the critical path - the chain of steps that the time to ready
+/// was spent waiting on, which is where to look to make startup faster - and
+/// are available as JSON and through SNMP.
+class StartupOrchestrator
+{
+public:
+  /// Runs a step, returning whether it succeeded.  Steps may also fail by
+  /// throwing.
+  typedef std::function<bool()> StepFn;
+
+  enum Outcome
+  {
+    NOT_RUN,
+    SUCCEEDED,
+    FAILED,
+    SKIPPED
+  };
+
+  /// How a step went, with its start and end times (in microseconds since
+  /// run() was called).
+  struct StepTiming
+  {
+    std::string name;
+    Outcome outcome;
+    uint64_t start_us;
+    uint64_t end_us;
+  };
+
+  StartupOrchestrator();
+  virtual ~StartupOrchestrator();
+
+  /// Adds a step.  Must be called before run().
+  ///
+  /// @param name       - The step's name, which must be unique (run() fails
+  ///                     if it isn't).
+  /// @param fn         - Runs the step.
+  /// @param depends_on - The names of the steps that must succeed before
+  ///                     this one is run.  They may be added after this one.
+  void add_step(const std::string& name,
+                StepFn fn,
+                const std::vector<std::string>& depends_on = std::vector<std::string>());
+
+  /// Runs the steps, returning once they have all completed (or been
+  /// skipped).
+  ///
+  /// @param num_threads - The most steps to run at once.
+  /// @return            - Whether every step succeeded.  This is false
+  ///                      without running any steps if two steps have the
+  ///                      same name, a dependency is missing or the
+  ///                      dependencies form a cycle.
+  bool run(unsigned int num_threads);
+
+  /// Export the time to ready (in milliseconds) through SNMP, once run()
+  /// completes.  The scalar must outlive the orchestrator's run().
+  void set_time_to_ready_scalar(SNMP::U32Scalar* scalar)
+  {
+    _time_to_ready_scalar = scalar;
+  }
+
+  /// @return how long run() took, in microseconds.
+  uint64_t time_to_ready_us() const { return _time_to_ready_us; }
+
+  /// @return the timings of the steps, in the order they were added.
+  std::vector<StepTiming> timings() const;
+
+  /// @return the timings, and the time to ready and critical path, as JSON.
+  std::string timings_json() const;
+
+private:
+  struct Step
+  {
+    std::string name;
+    StepFn fn;
+    std::vector<std::string> depends_on;
+
+    // The steps that depend on this one, and the number of this one's
+    // dependencies that haven't completed yet (and whether any failed).
+    std::vector<size_t> dependents;
+    size_t pending;
+    bool blocked;
+
+    Outcome outcome;
+    uint64_t start_us;
+    uint64_t end_us;
+  };
+
+  // Fills in the dependents of each step, returning false if a name is
+  // duplicated, a dependency doesn't exist or there's a cycle.
+  bool link_steps();
+
+  static void* worker_thread_fn(void* orchestrator);
+  void worker_thread_fn();
+
+  // Records that a step has completed, queuing or skipping the steps that
+  // were waiting for it.  Called with the lock held.
+  void step_complete(size_t index);
+
+  // The steps the time to ready was spent waiting on, in the order they ran.
+  std::vector<size_t> critical_path() const;
+
+  void log_timings() const;
+
+  static const char* outcome_str(Outcome outcome);
+
+  uint64_t now_us() const;
+
+  std::vector<Step> _steps;
+  std::map<std::string, size_t> _step_indexes;
+  bool _duplicate_names;
+
+  // The steps ready to run, and the number that haven't completed.  Both are
+  // protected by the lock.
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  std::deque<size_t> _ready;
+  size_t _incomplete;
+
+  uint64_t _run_start_us;
+  uint64_t _time_to_ready_us;
+  SNMP::U32Scalar* _time_to_ready_scalar;
+
+  // Don't implement the following, to avoid copies of this instance.
+  StartupOrchestrator(StartupOrchestrator const&);
+  void operator=(StartupOrchestrator const&);
+};
+
+#endif
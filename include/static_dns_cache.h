@@ -17,6 +17,8 @@
 #include <vector>
 
 #include "dnsrrecords.h"
+#include "static_dns_index.h"
+#include "versioned_config.h"
 
 class StaticDnsCache
 {
@@ -24,23 +26,47 @@ public:
   StaticDnsCache(const std::string filename = "");
   ~StaticDnsCache();
 
-  // Parse the _dns_config_file.
+  // Load the _dns_config_file, which is either JSON or an index compiled by
+  // compile_static_records().  The file is loaded into a new index, which
+  // replaces the old one atomically, so lookups aren't blocked by a reload.
   void reload_static_records();
 
-  // Returns the number of records in the static cache.
-  int size() {return _static_records.size();};
+  // Returns the number of hostnames in the static cache.
+  int size();
 
-  // Returns all DNS records from _static_records that match the given
-  // domain/type combination (_static_records are parsed from the
-  // _dns_config_file).
-  DnsResult get_static_dns_records(std::string domain, int dns_type);
+  // Returns all DNS records from the static cache that match the given
+  // domain/type combination.
+  DnsResult get_static_dns_records(const std::string& domain, int dns_type);
 
   // Resolves a CNAME record and returns the associated canonical domain.
-  std::string get_canonical_name(std::string domain);
+  std::string get_canonical_name(const std::string& domain);
+
+  // Compiles a JSON DNS config file into an index file, which loads faster
+  // than the JSON as it is mapped into memory rather than parsed.  The index
+  // file is replaced atomically.
+  //
+  // @return whether the index file was written.
+  static bool compile_static_records(const std::string& json_file,
+                                     const std::string& index_file);
 
 private:
+  // Parses a JSON DNS config file.
+  //
+  // @return false if the file is missing or isn't valid JSON, in which case
+  //         records is empty.
+  static bool parse_json_records(const std::string& filename,
+                                 std::map<std::string, std::vector<DnsRRecord*>>& records);
+
+  static void free_records(std::map<std::string, std::vector<DnsRRecord*>>& records);
+
+  // Returns the current index, or NULL if no records have been loaded.
+  StaticDnsIndexPtr index();
+
   std::string _dns_config_file;
-  std::map<std::string, std::vector<DnsRRecord*>> _static_records;
+
+  // The current index.  Lookups hold a reference to the index they use, so a
+  // reload never waits for them (or they for it).
+  VersionedConfig<StaticDnsIndex> _index;
 };
 
 #endif
@@ -0,0 +1,190 @@
+/**
+ * @file static_dns_index.h  Compiled, read-only index of static DNS records.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef STATIC_DNS_INDEX_H__
+#define STATIC_DNS_INDEX_H__
+
+#include <stdint.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "dnsrrecords.h"
+
+class StaticDnsIndex;
+typedef std::shared_ptr<const StaticDnsIndex> StaticDnsIndexPtr;
+
+/// An immutable index of static DNS records, held in a single block of memory
+/// that is either built from parsed records or mapped from a compiled index
+/// file.
+///
+/// The block holds a header, a minimal perfect hash of the hostnames (a
+/// displacement for each bucket of hostnames, and a table of slots), a table
+/// of records and a blob of hostnames and record data.  Looking up a hostname
+/// hashes it once, probes one slot and compares the name in place, so doesn't
+/// allocate memory or take a lock, and the index is loaded without creating
+/// an object for each record.
+///
+/// The layout uses the byte order of the machine that built it, so compiled
+/// files must be built on a machine with the same byte order (otherwise they
+/// are rejected when opened).
+class StaticDnsIndex
+{
+public:
+  /// A record in the index.  For an A record the data is the address (in
+  /// network byte order), and for a CNAME record it is the target.
+  struct Record
+  {
+    uint32_t rrtype;
+    uint32_t offset;
+    uint32_t length;
+  };
+
+  ~StaticDnsIndex();
+
+  /// Builds an index of the given records.  Only A and CNAME records are
+  /// supported - other records are ignored.
+  ///
+  /// @return the index, or NULL if it couldn't be built.
+  static StaticDnsIndexPtr build(const std::map<std::string, std::vector<DnsRRecord*>>& records);
+
+  /// Maps a compiled index file into memory and checks that it is valid.
+  /// The file must not be modified while it is mapped, so should be replaced
+  /// by renaming a new file over it (as write() does).
+  ///
+  /// @return the index, or NULL if the file couldn't be mapped or isn't a
+  ///         valid index.
+  static StaticDnsIndexPtr open(const std::string& filename);
+
+  /// @return whether a file starts with the header of a compiled index.
+  static bool is_index_file(const std::string& filename);
+
+  /// Writes the index to a file, which can later be opened with open().  The
+  /// file is written under a temporary name and renamed into place, so that
+  /// processes that have it mapped aren't affected.
+  ///
+  /// @return whether the file was written.
+  bool write(const std::string& filename) const;
+
+  /// @return the number of hostnames in the index.
+  size_t size() const { return header()->num_names; }
+
+  /// Finds the records for a hostname.
+  ///
+  /// @param records set to the hostname's records, which remain valid for
+  ///                the lifetime of the index.
+  /// @param count   set to the number of records.
+  /// @return whether the hostname is in the index.
+  bool find(const std::string& domain, const Record*& records, size_t& count) const;
+
+  /// @return the data of a record, which remains valid for the lifetime of
+  ///         the index.
+  const char* data(const Record& record) const
+  {
+    return _data + header()->strings_offset + record.offset;
+  }
+
+private:
+  // The header at the start of the block.  All the offsets are from the start
+  // of the block, except those in slots and records, which are from the
+  // start of the strings.
+  struct Header
+  {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seed_lo;
+    uint32_t seed_hi;
+    uint32_t num_names;
+    uint32_t num_buckets;
+    uint32_t num_slots;
+    uint32_t num_records;
+    uint32_t displacements_offset;
+    uint32_t slots_offset;
+    uint32_t records_offset;
+    uint32_t strings_offset;
+    uint32_t strings_length;
+    uint32_t total_length;
+  };
+
+  // A slot in the hash table.  Empty slots have a name offset of EMPTY_SLOT.
+  struct Slot
+  {
+    uint32_t name_offset;
+    uint32_t name_length;
+    uint32_t first_record;
+    uint32_t record_count;
+  };
+
+  static const uint32_t MAGIC = 0x534e4453;
+  static const uint32_t VERSION = 1;
+  static const uint32_t EMPTY_SLOT = 0xffffffff;
+
+  // The average number of hostnames in each bucket of the perfect hash.
+  static const uint32_t NAMES_PER_BUCKET = 4;
+
+  // The number of seeds to try before giving up on building the hash.
+  static const int MAX_SEEDS = 16;
+
+  // Takes ownership of a block of memory, which was either allocated with
+  // operator new (if the length to unmap is 0) or mapped.
+  StaticDnsIndex(char* data, size_t mapped_length);
+
+  const Header* header() const { return (const Header*)_data; }
+
+  const uint32_t* displacements() const
+  {
+    return (const uint32_t*)(_data + header()->displacements_offset);
+  }
+
+  const Slot* slots() const { return (const Slot*)(_data + header()->slots_offset); }
+
+  const Record* records() const
+  {
+    return (const Record*)(_data + header()->records_offset);
+  }
+
+  const char* strings() const { return _data + header()->strings_offset; }
+
+  // Checks that a block holds a valid index, so that lookups can't read
+  // outside it.
+  static bool validate(const char* data, size_t length);
+
+  // Hashes a hostname with a seed.  The bucket is picked from `h2`, and the
+  // slot for displacement d is (h1 + d * h2) mod the (power of two) number of
+  // slots - `h2` is odd so that every displacement gives a different slot.
+  static void hash(const char* name,
+                   size_t length,
+                   uint64_t seed,
+                   uint64_t& h1,
+                   uint64_t& h2);
+
+  // Assigns the hostnames to slots, picking a displacement for each bucket.
+  // Buckets are placed largest first, while the table is emptiest.
+  //
+  // @return whether every bucket could be placed with this seed.
+  static bool place_names(const std::vector<std::string>& names,
+                          uint64_t seed,
+                          uint32_t num_buckets,
+                          uint32_t num_slots,
+                          std::vector<uint32_t>& displacements,
+                          std::vector<uint32_t>& slot_names);
+
+  char* _data;
+  size_t _mapped_length;
+
+  // Don't implement the following, to avoid copies of this instance.
+  StaticDnsIndex(StaticDnsIndex const&);
+  void operator=(StaticDnsIndex const&);
+};
+
+#endif
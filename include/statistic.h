@@ -17,33 +17,60 @@
 #include <vector>
 
 #include <pthread.h>
+#include <stdint.h>
 
-#include "eventq.h"
 #include "zmq_lvc.h"
 
+/// A statistic published through the LastValueCache.  Every statistic in
+/// the process is published by one shared reporter thread, so reporting a
+/// value only records it and, if the statistic isn't already waiting to be
+/// published, queues the statistic for the reporter.
 class Statistic
 {
 public:
   Statistic(std::string statname, LastValueCache* lvc);
   ~Statistic();
 
-  void report_change(std::vector<std::string> new_value);
+  /// The most values that can be reported as numbers.
+  static const size_t MAX_VALUES = 8;
+
+  /// Report the latest value of the statistic, as a list of strings.
+  void report_change(const std::vector<std::string>& new_value);
+
+  /// Report the latest value of the statistic as a list of (at most
+  /// MAX_VALUES) numbers, which are published as decimal strings.  This
+  /// doesn't allocate, so suits statistics that are reported often.
+  void report_change(const uint64_t* new_value, size_t count);
 
   static int known_stats_count();
   static std::string *known_stats();
 
-  // Thread entry point for reporting thread.
-  static void* reporter_thread(void* p);
-
 private:
-  void reporter();
+  friend class StatisticReporter;
+
+  // Publish the latest value, if there is one.  Only called on the reporter
+  // thread.
+  void publish();
 
   std::string _statname;
   void *_publisher;
-  pthread_t _reporter;
-  eventq<std::vector<std::string> > _stat_q;  // input queue
 
-  static const int MAX_Q_DEPTH = 100;
+  // The latest value reported, waiting for the reporter thread to publish
+  // it.  A value reported before the previous one has been published
+  // replaces it, so only the latest value goes out.  Protected by _lock.
+  pthread_mutex_t _lock;
+  bool _pending;
+  bool _numeric;
+  uint64_t _values[MAX_VALUES];
+  size_t _num_values;
+  std::vector<std::string> _strings;
+
+  // The values being published, which are only used on the reporter thread.
+  std::vector<std::string> _published_strings;
+
+  // Don't implement the following, to avoid copies of this instance.
+  Statistic(Statistic const&);
+  void operator=(Statistic const&);
 };
 
 #endif
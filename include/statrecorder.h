@@ -12,6 +12,9 @@
 #ifndef STATRECORDER_H__
 #define STATRECORDER_H__
 
+#include <atomic>
+
+#include "fast_clock.h"
 #include "statistic.h"
 
 class StatRecorder
@@ -38,6 +41,20 @@ public:
   virtual void refreshed() = 0;
 
 protected:
+  /// The number of shards that recorders split their current values across,
+  /// so that threads recording at once don't contend on the same cache
+  /// lines. The shards are merged when the values are read.
+  static const int NUM_SHARDS = 16;
+
+  /// Returns the calling thread's shard. Threads are given shards in turn as
+  /// they first record a value.
+  static int shard_index()
+  {
+    static std::atomic<unsigned int> next_shard(0);
+    static thread_local int shard = next_shard++ % NUM_SHARDS;
+    return shard;
+  }
+
   /// Maximum value of a uint_fast64_t (assuming 2s-complement). There is a
   /// #define for this, but it's unavailable in C++.
   static const uint_fast64_t MAX_UINT_FAST64 = ~((uint_fast64_t)0);
@@ -50,13 +67,7 @@ protected:
   /// Get a timestamp in microseconds.
   inline uint_fast64_t get_timestamp_us()
   {
-    uint_fast64_t timestamp = 0;
-    struct timespec ts;
-    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
-    {
-      timestamp = (ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
-    }
-    return timestamp;
+    return FastClock::now_us();
   }
 
 private:
@@ -11,6 +11,12 @@
 
 #ifndef STORE_H_
 #define STORE_H_
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
 #include "sas.h"
 
 /// @class Store
@@ -43,6 +49,67 @@ public:
   /// -  If you change the enum you must also update the resource bundle.
   typedef enum {HEX=1, JSON=2} Format;
 
+  /// The result of reading one key with get_data_multi.
+  struct GetResult
+  {
+    Status status;
+    std::string data;
+    uint64_t cas;
+  };
+
+  /// A record's data, held in a reference-counted buffer so that it can be
+  /// passed around (and parsed in place) without being copied.  The data is
+  /// writable and is followed by a null terminator, as rapidjson's in-situ
+  /// parsing requires.  Copies of a Buffer share the same data.
+  class Buffer
+  {
+  public:
+    Buffer() : _length(0) {}
+
+    /// Wraps data that is already in a buffer, which `data` owns.
+    Buffer(std::shared_ptr<char> data, size_t length) :
+      _data(data), _length(length)
+    {
+    }
+
+    /// Takes over a string's data without copying it.
+    explicit Buffer(std::string&& data)
+    {
+      std::shared_ptr<std::string> owner =
+        std::make_shared<std::string>(std::move(data));
+      _length = owner->length();
+      _data = std::shared_ptr<char>(owner, &(*owner)[0]);
+    }
+
+    /// @return the data, or NULL if the buffer is empty.
+    char* data() const { return _length > 0 ? _data.get() : NULL; }
+    size_t length() const { return _length; }
+    bool empty() const { return _length == 0; }
+
+    /// @return a copy of the data.
+    std::string to_string() const
+    {
+      return empty() ? std::string() : std::string(_data.get(), _length);
+    }
+
+  private:
+    std::shared_ptr<char> _data;
+    size_t _length;
+  };
+
+  /// A write of one key with set_data_multi.
+  struct SetRequest
+  {
+    std::string key;
+    std::string data;
+
+    /// CAS value, as for set_data.
+    uint64_t cas;
+
+    /// Expiry period of the data (in seconds), as for set_data.
+    int expiry;
+  };
+
   /// Gets the data for the specified key in the specified namespace.
   ///
   /// @return            Status value indicating the result of the read.
@@ -115,6 +182,33 @@ public:
                           bool log_body,
                           Format data_format) = 0;
 
+  /// Gets the data for the specified key in the specified namespace, into a
+  /// reference-counted buffer rather than a string.  Stores that can hand
+  /// over the data they read without copying it override this - by default
+  /// it reads the data into a string, and the buffer takes over the string.
+  ///
+  /// @return            Status value indicating the result of the read.
+  /// @param table       Name of the table to retrive the data.
+  /// @param key         Key of the data record to retrieve.
+  /// @param data        Buffer to return the data.
+  /// @param cas         Variable to return the CAS value of the data.
+  /// @param trail       SAS Trail on which to log the data
+  /// @param log_body    Should we log the body to SAS?
+  /// @param data_format Data format for logging purposes
+  virtual Status get_data(const std::string& table,
+                          const std::string& key,
+                          Buffer& data,
+                          uint64_t& cas,
+                          SAS::TrailId trail = 0,
+                          bool log_body = true,
+                          Format data_format = Format::HEX)
+  {
+    std::string str;
+    Status status = get_data(table, key, str, cas, trail, log_body, data_format);
+    data = Buffer(std::move(str));
+    return status;
+  }
+
   /// Sets the data for the specified key in the specified namespace.
   ///
   /// @return         Status value indicating the result of the write.
@@ -203,6 +297,152 @@ public:
                                       bool log_body,
                                       Format data_format = Format::HEX) = 0;
 
+  /// Gets the data for several keys in the specified namespace.  Stores that
+  /// can read several keys in one request override this - by default it
+  /// reads each key in turn.
+  ///
+  /// @param table       Name of the table to retrieve the data.
+  /// @param keys        Keys of the data records to retrieve.
+  /// @param results     Returns the result for each key, in the same order as
+  ///                    `keys`.  The data and CAS value are only set for keys
+  ///                    whose status is OK.
+  /// @param trail       SAS Trail on which to log the data
+  /// @param log_body    Should we log the bodies to SAS?
+  /// @param data_format Data format for logging purposes
+  virtual void get_data_multi(const std::string& table,
+                              const std::vector<std::string>& keys,
+                              std::vector<GetResult>& results,
+                              SAS::TrailId trail = 0,
+                              bool log_body = true,
+                              Format data_format = Format::HEX)
+  {
+    results.resize(keys.size());
+
+    for (size_t ii = 0; ii < keys.size(); ++ii)
+    {
+      results[ii].cas = 0;
+      results[ii].status = get_data(table,
+                                    keys[ii],
+                                    results[ii].data,
+                                    results[ii].cas,
+                                    trail,
+                                    log_body,
+                                    data_format);
+    }
+  }
+
+  /// Sets the data for several keys in the specified namespace, with the same
+  /// CAS checks as set_data.  By default it writes each key in turn.
+  ///
+  /// @param table       Name of the table to store the data.
+  /// @param requests    The keys to write, with their data, CAS values and
+  ///                    expiry periods.
+  /// @param statuses    Returns the result of each write, in the same order as
+  ///                    `requests`.
+  /// @param trail       SAS Trail on which to log the data
+  /// @param log_body    Should we log the bodies to SAS?
+  /// @param data_format Data format for logging purposes
+  virtual void set_data_multi(const std::string& table,
+                              const std::vector<SetRequest>& requests,
+                              std::vector<Status>& statuses,
+                              SAS::TrailId trail = 0,
+                              bool log_body = true,
+                              Format data_format = Format::HEX)
+  {
+    statuses.resize(requests.size());
+
+    for (size_t ii = 0; ii < requests.size(); ++ii)
+    {
+      statuses[ii] = set_data(table,
+                              requests[ii].key,
+                              requests[ii].data,
+                              requests[ii].cas,
+                              requests[ii].expiry,
+                              trail,
+                              log_body,
+                              data_format);
+    }
+  }
+
+  /// Called with the result of get_data_async - the status, and the data and
+  /// CAS value if the status is OK.
+  typedef std::function<void(Status status,
+                             const std::string& data,
+                             uint64_t cas)> GetCallback;
+
+  /// Called with the result of set_data_async.
+  typedef std::function<void(Status status)> SetCallback;
+
+  /// Gets the data for the specified key without waiting for the store.
+  /// Stores that can do this override it - by default it calls get_data, and
+  /// then the callback before returning.  Otherwise the callback may be
+  /// called on another thread, so mustn't block.
+  ///
+  /// @param table       Name of the table to retrieve the data.
+  /// @param key         Key of the data record to retrieve.
+  /// @param trail       SAS Trail on which to log the data
+  /// @param log_body    Should we log the body to SAS?
+  /// @param data_format Data format for logging purposes
+  /// @param callback    Called with the result.
+  virtual void get_data_async(const std::string& table,
+                              const std::string& key,
+                              SAS::TrailId trail,
+                              bool log_body,
+                              Format data_format,
+                              GetCallback callback)
+  {
+    std::string data;
+    uint64_t cas = 0;
+    Status status = get_data(table, key, data, cas, trail, log_body, data_format);
+    callback(status, data, cas);
+  }
+
+  void get_data_async(const std::string& table,
+                      const std::string& key,
+                      SAS::TrailId trail,
+                      GetCallback callback)
+  {
+    get_data_async(table, key, trail, true, Format::HEX, callback);
+  }
+
+  /// Sets the data for the specified key without waiting for the store, with
+  /// the same CAS checks as set_data.  As for get_data_async, by default this
+  /// calls set_data and then the callback.
+  ///
+  /// @param table       Name of the table to store the data.
+  /// @param key         Key used to index the data within the table.
+  /// @param data        Data to store.
+  /// @param cas         CAS (Check-and-Set) value for the data, as for
+  ///                    set_data.
+  /// @param expiry      Expiry period of the data (in seconds).
+  /// @param trail       SAS Trail on which to log the data
+  /// @param log_body    Should we log the body to SAS?
+  /// @param data_format Data format for logging purposes
+  /// @param callback    Called with the result.
+  virtual void set_data_async(const std::string& table,
+                              const std::string& key,
+                              const std::string& data,
+                              uint64_t cas,
+                              int expiry,
+                              SAS::TrailId trail,
+                              bool log_body,
+                              Format data_format,
+                              SetCallback callback)
+  {
+    callback(set_data(table, key, data, cas, expiry, trail, log_body, data_format));
+  }
+
+  void set_data_async(const std::string& table,
+                      const std::string& key,
+                      const std::string& data,
+                      uint64_t cas,
+                      int expiry,
+                      SAS::TrailId trail,
+                      SetCallback callback)
+  {
+    set_data_async(table, key, data, cas, expiry, trail, true, Format::HEX, callback);
+  }
+
   /// Delete the data for the specified key in the specified namespace.
   ///
   /// @return         Status value indicating the result of the delete.
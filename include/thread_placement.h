@@ -0,0 +1,102 @@
+/**
+ * @file thread_placement.h
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef THREAD_PLACEMENT_H__
+#define THREAD_PLACEMENT_H__
+
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+// Policy describing where the threads of a pool should run, and what stack
+// size they should have.  The policy is applied when each thread is created,
+// based on the index of the thread in its pool:
+//
+// - no_placement() leaves threads to the scheduler (the default).
+// - pin_to_cores() pins thread i to the i'th core in the list (wrapping round
+//   if there are more threads than cores).
+// - numa_partitioned() divides the threads into one contiguous block per NUMA
+//   node, and allows each thread to run on any core of its node.
+// - spread() pins each thread to a single core, taking cores from each NUMA
+//   node in turn so that the threads are spread evenly across the nodes.
+//
+// The NUMA topology is read from sysfs when the policy is created.  If it
+// can't be read, all online cores are treated as a single node.
+class ThreadPlacementPolicy
+{
+public:
+  enum Mode
+  {
+    NONE,
+    PIN_TO_CORES,
+    NUMA_PARTITIONED,
+    SPREAD
+  };
+
+  ThreadPlacementPolicy();
+
+  static ThreadPlacementPolicy no_placement();
+  static ThreadPlacementPolicy pin_to_cores(const std::vector<int>& cores);
+  static ThreadPlacementPolicy numa_partitioned();
+  static ThreadPlacementPolicy spread();
+
+  // Set the stack size for the threads.  Zero (the default) means use the
+  // system default.
+  void set_stack_size(size_t stack_size);
+
+  Mode mode() const { return _mode; }
+  size_t stack_size() const { return _stack_size; }
+
+  // Fill in the attributes for creating a thread.  The attributes must already
+  // have been initialized with pthread_attr_init.
+  //
+  // @param attr the attributes to fill in.
+  // @param index the index of the thread within its pool.
+  // @param num_threads the number of threads in the pool.
+  // @return whether the attributes were successfully set.
+  bool set_attributes(pthread_attr_t* attr,
+                      unsigned int index,
+                      unsigned int num_threads) const;
+
+  // Apply the placement to the calling thread.  This is for threads that are
+  // created by other libraries, where we can't control the attributes.  The
+  // stack size can't be changed this way.
+  //
+  // @return whether the placement was successfully applied.
+  bool apply_to_current_thread(unsigned int index,
+                               unsigned int num_threads) const;
+
+private:
+  ThreadPlacementPolicy(Mode mode, const std::vector<int>& cores);
+
+  // Get the set of cores that a thread may run on.
+  //
+  // @return false if the thread shouldn't be restricted.
+  bool get_cpu_set(unsigned int index,
+                   unsigned int num_threads,
+                   cpu_set_t* cpus) const;
+
+  // Read the cores on each NUMA node.
+  static std::vector<std::vector<int>> read_numa_nodes();
+
+  // Parse a sysfs CPU list (e.g. "0-3,8-11").
+  static std::vector<int> parse_cpu_list(const std::string& list);
+
+  Mode _mode;
+  std::vector<int> _cores;
+  std::vector<std::vector<int>> _nodes;
+  size_t _stack_size;
+};
+
+#endif
@@ -10,11 +10,22 @@
  */
 
 #include <functional>
+#include <deque>
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <utility>
+#include <stdlib.h>
 
 #include <eventq.h>
 #include "exception_handler.h"
 #include <log.h>
 #include "snmp_event_accumulator_by_scope_table.h"
+#include "snmp_event_accumulator_table.h"
+#include "snmp_abstract_scalar.h"
+#include "utils.h"
+#include "thread_placement.h"
+#include "inline_function.h"
 
 #ifndef THREADPOOL_H__
 #define THREADPOOL_H__
@@ -29,6 +40,39 @@
 // - Call pool->stop() to stop the pool and terminate its threads.
 // - (optionally) Call pool->join() to wait until the pool is fully stopped.
 //
+// The pool can optionally run in work-stealing mode. In this mode each worker
+// thread has its own local deque of work items:
+//
+// - Work added by a worker thread (e.g. a work item that queues follow-on work)
+//   is placed on that worker's local deque, without touching the shared queue.
+// - Work added by any other thread is placed on a shared injection queue.
+// - A worker services its own deque first. If that is empty it tries to steal
+//   from the other workers' deques (starting from a randomly chosen victim),
+//   and only then goes idle. One idle worker blocks on the injection queue,
+//   and the rest park until work is pushed onto a local deque (or the worker
+//   watching the injection queue takes work and leaves it unwatched).
+//
+// Workers can also take work in batches. If set_max_batch_size() is called
+// with a value greater than one, each worker removes up to that many items
+// from the queue each time it wakes up and passes them to
+// process_work_batch(). By default that just calls process_work() on each item
+// in turn, but subclasses can override it to process the whole batch at once.
+//
+// The pool can record how long work items wait on the queue, and how long they
+// take to process, by calling set_latency_tables() before start().
+//
+// Work items can be given a deadline when they are added (see
+// eventq<T>::deadline_in()). Items whose deadline has passed by the time a
+// worker takes them off the queue are discarded without being processed. They
+// are counted (see expired_count()) and passed to the expiry callback, if one
+// has been set with set_expiry_callback().
+//
+// The pool can also be made elastic by calling set_elastic() before start().
+// An elastic pool starts another worker (up to a maximum) when work is added
+// while the queue is longer than a threshold, or hasn't been serviced for
+// longer than a threshold.  Workers that have been idle for a timeout exit
+// (down to a minimum).  Elastic mode is not supported in work-stealing mode.
+//
 // Note that start may only be called once. Once the pool has been stopped it
 // cannot be restarted.
 //
@@ -44,22 +88,140 @@ public:
   // @param max_queue the number of work items that can be queued waiting for a
   //                  free thread (0 => no limit).
   // @param queue_size_table an optional pointer to an SNMP table to track the
-  //                         size of the queue.
+  //                         size of the queue. In work-stealing mode this
+  //                         tracks the total size of the injection queue and
+  //                         all the workers' local deques.
+  // @param work_stealing whether the pool should run in work-stealing mode.
+  //                      When set, max_queue only limits the injection queue.
   ThreadPool(unsigned int num_threads,
              ExceptionHandler* exception_handler,
              void (*callback)(T),
              unsigned int max_queue = 0,
-             SNMP::EventAccumulatorByScopeTable* queue_size_table = nullptr) :
+             SNMP::EventAccumulatorByScopeTable* queue_size_table = nullptr,
+             bool work_stealing = false) :
+    ThreadPool(num_threads,
+               exception_handler,
+               callback,
+               nullptr,
+               max_queue,
+               queue_size_table,
+               work_stealing)
+  {}
+
+  // Create the thread pool with a specific queue backend.
+  //
+  // @param backend the backend for the pool's work queue (e.g. a
+  //                eventq<T>::RingBackend). The pool takes ownership of it.
+  //                May be nullptr, in which case the default backend is used.
+  // @param max_queue as for the other constructor. Note that some backends
+  //                  (such as RingBackend) impose their own limit instead.
+  //
+  // The other parameters are as for the other constructor.
+  ThreadPool(unsigned int num_threads,
+             ExceptionHandler* exception_handler,
+             void (*callback)(T),
+             typename eventq<T>::Backend* backend,
+             unsigned int max_queue,
+             SNMP::EventAccumulatorByScopeTable* queue_size_table = nullptr,
+             bool work_stealing = false) :
     _num_threads(num_threads),
     _exception_handler(exception_handler),
     _threads(0),
-    _queue(max_queue),
+    _queue(max_queue, true, backend),
     _callback(callback),
-    _queue_size_table(queue_size_table)
-  {}
+    _queue_size_table(queue_size_table),
+    _work_stealing(work_stealing),
+    _deques(),
+    _next_worker_index(0),
+    _parked_workers(0),
+    _poller_active(false),
+    _max_batch_size(1),
+    _priority_backend(nullptr),
+    _priority_queue_size_tables(),
+    _placement(),
+    _elastic(false),
+    _min_threads(num_threads),
+    _max_threads(num_threads),
+    _grow_queue_size(0),
+    _grow_delay_ms(0),
+    _idle_timeout_ms(0),
+    _thread_count_scalar(nullptr),
+    _live_threads(0),
+    _retired_threads(),
+    _queue_wait_table(nullptr),
+    _service_time_table(nullptr),
+    _expiry_callback(nullptr),
+    _expired_count(0),
+    _health_checker(nullptr),
+    _stall_deadline_ms(0)
+  {
+    pthread_mutex_init(&_threads_lock, NULL);
+    pthread_mutex_init(&_park_lock, NULL);
+    pthread_cond_init(&_park_cond, NULL);
+
+    if (_work_stealing)
+    {
+      pthread_key_create(&_worker_key, NULL);
+
+      for (unsigned int ii = 0; ii < _num_threads; ++ii)
+      {
+        _deques.push_back(new WorkerDeque(ii));
+      }
+    }
+  }
+
+  // Create the thread pool with a priority queue backend, so that work items
+  // are served according to their SIPEventPriorityLevel rather than strictly
+  // in the order they were added.
+  //
+  // @param backend the priority backend for the pool's work queue. The pool
+  //                takes ownership of it.
+  // @param priority_queue_size_tables optional SNMP tables to track the size
+  //                                   of each priority level's queue, indexed
+  //                                   by SIPEventPriorityLevel. Entries may be
+  //                                   nullptr, and the vector may be shorter
+  //                                   than the number of levels.
+  //
+  // The other parameters are as for the other constructors. If work_stealing
+  // is set, priority ordering only applies to the shared injection queue.
+  ThreadPool(unsigned int num_threads,
+             ExceptionHandler* exception_handler,
+             void (*callback)(T),
+             typename eventq<T>::PriorityBackend* backend,
+             unsigned int max_queue,
+             const std::vector<SNMP::EventAccumulatorByScopeTable*>& priority_queue_size_tables,
+             SNMP::EventAccumulatorByScopeTable* queue_size_table = nullptr,
+             bool work_stealing = false) :
+    ThreadPool(num_threads,
+               exception_handler,
+               callback,
+               (typename eventq<T>::Backend*)backend,
+               max_queue,
+               queue_size_table,
+               work_stealing)
+  {
+    _priority_backend = backend;
+    _priority_queue_size_tables = priority_queue_size_tables;
+  }
 
   // Destroy the thread pool.
-  virtual ~ThreadPool() {};
+  virtual ~ThreadPool()
+  {
+    if (_work_stealing)
+    {
+      for (WorkerDeque* deque : _deques)
+      {
+        delete deque;
+      }
+      _deques.clear();
+
+      pthread_key_delete(_worker_key);
+    }
+
+    pthread_cond_destroy(&_park_cond);
+    pthread_mutex_destroy(&_park_lock);
+    pthread_mutex_destroy(&_threads_lock);
+  };
 
   // Start the thread pool by creating the required number of worker threads.
   //
@@ -67,24 +229,17 @@ public:
   bool start()
   {
     bool success = true;
-    pthread_t thread_handle;
+
+    pthread_mutex_lock(&_threads_lock);
 
     for (unsigned int ii = 0; ii < _num_threads; ++ii)
     {
-      int rc = pthread_create(&thread_handle,
-                              NULL,
-                              static_worker_thread_func,
-                              this);
-      if (rc == 0)
-      {
-        _threads.push_back(thread_handle);
-      }
-      else
+      if (!create_worker(ii))
       {
         TRC_ERROR("Failed to create thread in thread pool");
 
         // Terminate the pool so that all existing threads will exit.
-        _queue.terminate();
+        terminate_queue();
         _threads.clear();
 
         success = false;
@@ -92,9 +247,121 @@ public:
       }
     }
 
+    update_thread_count_scalar();
+
+    pthread_mutex_unlock(&_threads_lock);
+
     return success;
   }
 
+  // Make the pool elastic. Must be called before start().
+  //
+  // @param min_threads the minimum number of worker threads.
+  // @param max_threads the maximum number of worker threads. The pool starts
+  //                    with the number of threads it was created with, limited
+  //                    to this range.
+  // @param grow_queue_size a worker is added if work is added while there are
+  //                        more than this many items queued (0 => disabled).
+  // @param grow_delay_ms a worker is added if work is added while the queue
+  //                      hasn't been serviced for more than this long
+  //                      (0 => disabled).
+  // @param idle_timeout_ms how long a worker must be idle before it exits.
+  // @param thread_count_scalar an optional SNMP scalar to report the current
+  //                            number of worker threads.
+  void set_elastic(unsigned int min_threads,
+                   unsigned int max_threads,
+                   unsigned int grow_queue_size,
+                   unsigned long grow_delay_ms,
+                   int idle_timeout_ms,
+                   SNMP::AbstractScalar* thread_count_scalar = nullptr)
+  {
+    if (_work_stealing)
+    {
+      TRC_WARNING("Elastic mode is not supported in work-stealing mode");
+      return;
+    }
+
+    _elastic = true;
+    _min_threads = (min_threads > 0) ? min_threads : 1;
+    _max_threads = std::max(max_threads, _min_threads);
+    _num_threads = std::min(std::max(_num_threads, _min_threads), _max_threads);
+    _grow_queue_size = grow_queue_size;
+    _grow_delay_ms = grow_delay_ms;
+    _idle_timeout_ms = (idle_timeout_ms > 0) ? idle_timeout_ms : 1;
+    _thread_count_scalar = thread_count_scalar;
+
+    if (_grow_delay_ms > 0)
+    {
+      _queue.enable_service_delay_tracking();
+    }
+  }
+
+  // Set SNMP tables to record the time (in microseconds) that work items spend
+  // waiting on the queue, and the time taken to process them. Must be called
+  // before start(). Either table may be nullptr.
+  //
+  // For batches, the processing time of each item is recorded as the average
+  // across the batch.
+  void set_latency_tables(SNMP::EventAccumulatorTable* queue_wait_table,
+                          SNMP::EventAccumulatorTable* service_time_table)
+  {
+    _queue_wait_table = queue_wait_table;
+    _service_time_table = service_time_table;
+
+    if (_queue_wait_table != nullptr)
+    {
+      _queue.enable_timestamps();
+    }
+  }
+
+  // Set a function to call on work items that are discarded because their
+  // deadline has passed. Must be called before start().
+  void set_expiry_callback(void (*expiry_callback)(T))
+  {
+    _expiry_callback = expiry_callback;
+  }
+
+  // Report the workers' progress to a health checker, so that the process is
+  // reported as not ready while any worker has been stuck on one piece of work
+  // for longer than the deadline. Must be called before start(), and the
+  // health checker must outlive the worker threads.
+  void set_health_checker(HealthChecker* health_checker,
+                          unsigned int stall_deadline_ms)
+  {
+    _health_checker = health_checker;
+    _stall_deadline_ms = stall_deadline_ms;
+  }
+
+  // Returns the number of work items that have been discarded because their
+  // deadline had passed.
+  uint64_t expired_count() const
+  {
+    return _expired_count;
+  }
+
+  // Returns the number of worker threads currently running.
+  unsigned int num_threads() const
+  {
+    return _live_threads;
+  }
+
+  // Set the maximum number of work items a worker takes from the queue at once.
+  // Must be called before start().
+  //
+  // @param max_batch_size the maximum batch size. 1 (the default) means work
+  //                       items are processed one at a time by process_work().
+  void set_max_batch_size(unsigned int max_batch_size)
+  {
+    _max_batch_size = (max_batch_size > 0) ? max_batch_size : 1;
+  }
+
+  // Set the policy for placing the worker threads on cores, and their stack
+  // size. Must be called before start().
+  void set_thread_placement(const ThreadPlacementPolicy& placement)
+  {
+    _placement = placement;
+  }
+
   // Stop the thread pool and shutdown the worker threads.  Work items on the
   // queue are not guaranteed to be processed.
   void stop()
@@ -103,45 +370,243 @@ public:
     // then terminate the queue. This will cause any idle worker threads (those
     // currently blocked getting work from the queue) to wake up and exit.
     _queue.purge();
-    _queue.terminate();
+
+    for (WorkerDeque* deque : _deques)
+    {
+      deque->clear();
+    }
+
+    terminate_queue();
   }
 
   // Wait for the threadpool to shutdown.
   void join()
   {
-    for (unsigned int ii = 0; ii < _threads.size(); ++ii)
+    // Take a copy of the thread handles, as in elastic mode they are updated
+    // by the worker threads.
+    pthread_mutex_lock(&_threads_lock);
+    std::vector<pthread_t> threads = _threads;
+    threads.insert(threads.end(), _retired_threads.begin(), _retired_threads.end());
+    _retired_threads.clear();
+    pthread_mutex_unlock(&_threads_lock);
+
+    for (unsigned int ii = 0; ii < threads.size(); ++ii)
     {
-      pthread_join(_threads[ii], NULL);
+      pthread_join(threads[ii], NULL);
     }
   }
 
   // Add a work item to the thread pool.
   //
   // @param work the work item to add.
-  void add_work(T& work)
+  // @param deadline_us optional deadline (from eventq<T>::deadline_in()) after
+  //                    which the work item is discarded rather than processed.
+  void add_work(T& work, uint64_t deadline_us = 0)
   {
-    _queue.push(work);
+    add_work(T(work), deadline_us);
+  }
+
+  // Add a work item to the thread pool by moving it into the pool. The work
+  // item is not copied on its way to the worker thread, so move-only types
+  // (such as std::unique_ptr) can be used as work items.
+  //
+  // @param work the work item to add.
+  // @param deadline_us as for the other add_work().
+  void add_work(T&& work, uint64_t deadline_us = 0)
+  {
+    // Find the work item's priority level before it's moved onto the queue.
+    int level = priority_level(work);
+
+    enqueue(std::move(work), deadline_us);
 
     if (_queue_size_table)
     {
-      _queue_size_table->accumulate(_queue.size());
+      _queue_size_table->accumulate(queue_size());
     }
+
+    accumulate_priority_queue_size(level);
+
+    maybe_grow();
   }
 
-  // Add a work item to the thread pool by moving it into the pool.
+  // Add a work item to the thread pool if there is room for it on the queue,
+  // without blocking. This lets a caller that mustn't block (such as an
+  // event loop) turn work away when the pool is saturated.
   //
-  // @param work the work item to add.
-  void add_work(T&& work)
+  // @param work the work item to add, which is copied onto the queue (so the
+  //             caller still has it if it isn't added).
+  // @param deadline_us as for add_work().
+  // @return whether the work item was added.
+  bool try_add_work(T& work, uint64_t deadline_us = 0)
   {
-    _queue.push(work);
+    int level = priority_level(work);
+    WorkerDeque* local = local_deque();
+
+    if (local != nullptr)
+    {
+      // Local deques are unbounded.
+      local->push(T(work), stamp(deadline_us));
+      wake_parked_workers(1);
+    }
+    else if (!_queue.push_noblock(T(work), deadline_us))
+    {
+      return false;
+    }
 
     if (_queue_size_table)
     {
-      _queue_size_table->accumulate(_queue.size());
+      _queue_size_table->accumulate(queue_size());
     }
+
+    accumulate_priority_queue_size(level);
+
+    maybe_grow();
+
+    return true;
+  }
+
+  // Construct a work item from the arguments, and add it to the thread pool.
+  template <class... Args>
+  void emplace_work(Args&&... args)
+  {
+    add_work(T(std::forward<Args>(args)...));
+  }
+
+  // Add a batch of work items to the thread pool. This takes the queue lock
+  // and wakes idle workers once for the whole batch.
+  //
+  // @param work the work items to add.
+  // @param deadline_us as for add_work(), applied to every item in the batch.
+  void add_work_batch(std::vector<T>& work, uint64_t deadline_us = 0)
+  {
+    add_work_range(work.begin(), work.end(), deadline_us);
+  }
+
+  // As above, but moving the work items into the pool. The vector is left
+  // holding moved-from items.
+  void add_work_batch(std::vector<T>&& work, uint64_t deadline_us = 0)
+  {
+    add_work_range(std::make_move_iterator(work.begin()),
+                   std::make_move_iterator(work.end()),
+                   deadline_us);
+  }
+
+  // Returns the number of work items waiting to be processed. In
+  // work-stealing mode this is summed across the injection queue and all the
+  // workers' local deques.
+  int queue_size() const
+  {
+    int size = _queue.size();
+
+    for (const WorkerDeque* deque : _deques)
+    {
+      size += deque->size.load(std::memory_order_relaxed);
+    }
+
+    return size;
   }
 
 private:
+  typedef typename eventq<T>::Stamp Stamp;
+
+  // A worker's local deque, used in work-stealing mode. The owning worker
+  // takes items from the front. Thieves take items from the back, as these
+  // are the items that would otherwise wait the longest.
+  struct WorkerDeque
+  {
+    WorkerDeque(unsigned int index) :
+      index(index),
+      items(),
+      size(0),
+      seed(index + 1)
+    {
+      pthread_mutex_init(&lock, NULL);
+    }
+
+    ~WorkerDeque()
+    {
+      pthread_mutex_destroy(&lock);
+    }
+
+    void push(T&& work, const Stamp& stamp)
+    {
+      pthread_mutex_lock(&lock);
+      items.emplace_back(std::move(work), stamp);
+      size.store(items.size(), std::memory_order_relaxed);
+      pthread_mutex_unlock(&lock);
+    }
+
+    bool pop_front(T& work, Stamp& stamp)
+    {
+      return pop(work, stamp, true);
+    }
+
+    bool pop_back(T& work, Stamp& stamp)
+    {
+      return pop(work, stamp, false);
+    }
+
+    void clear()
+    {
+      pthread_mutex_lock(&lock);
+      items.clear();
+      size.store(0, std::memory_order_relaxed);
+      pthread_mutex_unlock(&lock);
+    }
+
+    // The index of the worker that owns this deque.
+    unsigned int index;
+
+    pthread_mutex_t lock;
+
+    // Each item is stored with its stamp (see ThreadPool::stamp).
+    std::deque<std::pair<T, Stamp>> items;
+
+    // The number of items on the deque. This is maintained separately so that
+    // it can be read without taking the lock.
+    std::atomic<int> size;
+
+    // Seed used by the owning worker to choose steal victims. Only accessed by
+    // the owning worker.
+    unsigned int seed;
+
+  private:
+    bool pop(T& work, Stamp& stamp, bool front)
+    {
+      bool got_work = false;
+
+      // Check the size first so that we don't take the lock on an empty
+      // deque - thieves regularly probe deques that have nothing on them.
+      if (size.load(std::memory_order_relaxed) > 0)
+      {
+        pthread_mutex_lock(&lock);
+
+        if (!items.empty())
+        {
+          if (front)
+          {
+            work = std::move(items.front().first);
+            stamp = items.front().second;
+            items.pop_front();
+          }
+          else
+          {
+            work = std::move(items.back().first);
+            stamp = items.back().second;
+            items.pop_back();
+          }
+
+          size.store(items.size(), std::memory_order_relaxed);
+          got_work = true;
+        }
+
+        pthread_mutex_unlock(&lock);
+      }
+
+      return got_work;
+    }
+  };
+
   unsigned int _num_threads;
   ExceptionHandler* _exception_handler;
   std::vector<pthread_t> _threads;
@@ -153,6 +618,471 @@ private:
   // SNMP table to track the queue size
   SNMP::EventAccumulatorByScopeTable* _queue_size_table;
 
+  // Work-stealing state. The deques are indexed by worker, and each worker
+  // thread stores a pointer to its own deque in the _worker_key thread local.
+  bool _work_stealing;
+  std::vector<WorkerDeque*> _deques;
+  std::atomic<unsigned int> _next_worker_index;
+  pthread_key_t _worker_key;
+
+  // Idle workers in work-stealing mode. At most one idle worker (the poller)
+  // blocks on the injection queue, and the rest wait on _park_cond. Parked
+  // workers are signalled when work is pushed onto a local deque, when the
+  // poller takes work (so that another worker takes over watching the
+  // injection queue), and when the queue is terminated. _parked_workers is
+  // atomic so that pushers can skip taking _park_lock when no-one is parked.
+  pthread_mutex_t _park_lock;
+  pthread_cond_t _park_cond;
+  std::atomic<int> _parked_workers;
+  bool _poller_active;
+
+  // The maximum number of work items a worker takes from the queue at once.
+  unsigned int _max_batch_size;
+
+  // The queue's backend if it is a priority backend, plus the SNMP tables to
+  // track the size of each priority level.
+  typename eventq<T>::PriorityBackend* _priority_backend;
+  std::vector<SNMP::EventAccumulatorByScopeTable*> _priority_queue_size_tables;
+
+  // How to place the worker threads.
+  ThreadPlacementPolicy _placement;
+
+  // Elastic mode configuration (see set_elastic()).
+  bool _elastic;
+  unsigned int _min_threads;
+  unsigned int _max_threads;
+  unsigned int _grow_queue_size;
+  unsigned long _grow_delay_ms;
+  int _idle_timeout_ms;
+  SNMP::AbstractScalar* _thread_count_scalar;
+
+  // The number of running worker threads. This is only modified with the
+  // threads lock held, which also protects _threads and _retired_threads.
+  std::atomic<unsigned int> _live_threads;
+  pthread_mutex_t _threads_lock;
+
+  // Threads that have exited in elastic mode, but haven't been joined yet.
+  std::vector<pthread_t> _retired_threads;
+
+  // Create a worker thread. Must be called with the threads lock held.
+  //
+  // @param index the index of the thread, used for placement.
+  // @return whether the thread was successfully created.
+  bool create_worker(unsigned int index)
+  {
+    pthread_t thread_handle;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    _placement.set_attributes(&attr, index, _max_threads);
+
+    int rc = pthread_create(&thread_handle,
+                            &attr,
+                            static_worker_thread_func,
+                            this);
+    pthread_attr_destroy(&attr);
+
+    if ((rc != 0) && (_placement.mode() != ThreadPlacementPolicy::NONE))
+    {
+      // The placement may be invalid for this host (e.g. pinning to a core
+      // that doesn't exist). Fall back to the default attributes.
+      TRC_WARNING("Failed to create thread with placement (%d), using defaults",
+                  rc);
+      rc = pthread_create(&thread_handle,
+                          NULL,
+                          static_worker_thread_func,
+                          this);
+    }
+
+    if (rc == 0)
+    {
+      _threads.push_back(thread_handle);
+      ++_live_threads;
+    }
+
+    return (rc == 0);
+  }
+
+  // In elastic mode, add a worker thread if the queue has grown too long or
+  // hasn't been serviced for too long.
+  void maybe_grow()
+  {
+    if ((!_elastic) || (_live_threads >= _max_threads))
+    {
+      return;
+    }
+
+    if (((_grow_queue_size > 0) && ((unsigned int)queue_size() > _grow_queue_size)) ||
+        ((_grow_delay_ms > 0) && (_queue.service_delay_ms() > _grow_delay_ms)))
+    {
+      pthread_mutex_lock(&_threads_lock);
+
+      if ((_live_threads < _max_threads) && (!_queue.is_terminated()))
+      {
+        // Tidy up any threads that have exited since we last grew.
+        for (pthread_t thread : _retired_threads)
+        {
+          pthread_join(thread, NULL);
+        }
+        _retired_threads.clear();
+
+        if (create_worker(_live_threads))
+        {
+          TRC_DEBUG("Added thread to elastic thread pool (now %u threads)",
+                    _live_threads.load());
+          update_thread_count_scalar();
+        }
+        else
+        {
+          TRC_WARNING("Failed to add thread to elastic thread pool");
+        }
+      }
+
+      pthread_mutex_unlock(&_threads_lock);
+    }
+  }
+
+  // In elastic mode, decide whether an idle worker should exit.  If it should,
+  // this removes the calling thread from the pool's live threads.
+  //
+  // @return whether the calling worker should exit.
+  bool retire_worker()
+  {
+    bool retire = false;
+
+    pthread_mutex_lock(&_threads_lock);
+
+    if ((_live_threads > _min_threads) && (!_queue.is_terminated()))
+    {
+      pthread_t self = pthread_self();
+
+      for (typename std::vector<pthread_t>::iterator it = _threads.begin();
+           it != _threads.end();
+           ++it)
+      {
+        if (pthread_equal(*it, self))
+        {
+          _threads.erase(it);
+          _retired_threads.push_back(self);
+          --_live_threads;
+          retire = true;
+          break;
+        }
+      }
+
+      if (retire)
+      {
+        TRC_DEBUG("Removed idle thread from elastic thread pool (now %u threads)",
+                  _live_threads.load());
+        update_thread_count_scalar();
+      }
+    }
+
+    pthread_mutex_unlock(&_threads_lock);
+
+    return retire;
+  }
+
+  // Report the number of worker threads. Must be called with the threads lock
+  // held.
+  void update_thread_count_scalar()
+  {
+    if (_thread_count_scalar != nullptr)
+    {
+      _thread_count_scalar->set_value(_live_threads);
+    }
+  }
+
+  // Returns the priority level that a work item will be queued at, or -1 if
+  // the pool doesn't have a priority backend.
+  int priority_level(const T& work)
+  {
+    return (_priority_backend != nullptr) ? _priority_backend->priority(work) : -1;
+  }
+
+  // Record the size of the priority level that a work item was queued at.
+  // This is a no-op if the level is -1 (see priority_level()).
+  void accumulate_priority_queue_size(int level)
+  {
+    if ((level >= 0) &&
+        (level < (int)_priority_queue_size_tables.size()) &&
+        (_priority_queue_size_tables[level] != nullptr))
+    {
+      _priority_queue_size_tables[level]->accumulate(
+                          _priority_backend->size((SIPEventPriorityLevel)level));
+    }
+  }
+
+  // Add a range of work items to the thread pool (see add_work_batch()). The
+  // items are copied, unless the iterators are move iterators.
+  template <class InputIt>
+  void add_work_range(InputIt begin, InputIt end, uint64_t deadline_us)
+  {
+    // Find the work items' priority levels before they're moved onto the
+    // queue.
+    std::vector<int> levels;
+    if (_priority_backend != nullptr)
+    {
+      for (InputIt it = begin; it != end; ++it)
+      {
+        levels.push_back(priority_level(*it));
+      }
+    }
+
+    WorkerDeque* local = local_deque();
+
+    if (local != nullptr)
+    {
+      Stamp batch_stamp = stamp(deadline_us);
+
+      size_t num_items = 0;
+
+      for (InputIt it = begin; it != end; ++it)
+      {
+        local->push(T(*it), batch_stamp);
+        ++num_items;
+      }
+
+      wake_parked_workers(num_items);
+    }
+    else
+    {
+      _queue.push_batch(begin, end, deadline_us);
+    }
+
+    if (_queue_size_table)
+    {
+      _queue_size_table->accumulate(queue_size());
+    }
+
+    for (int level : levels)
+    {
+      accumulate_priority_queue_size(level);
+    }
+
+    maybe_grow();
+  }
+
+  // SNMP tables to track queue wait and service times.
+  SNMP::EventAccumulatorTable* _queue_wait_table;
+  SNMP::EventAccumulatorTable* _service_time_table;
+
+  // Expiry handling (see set_expiry_callback()).
+  void (*_expiry_callback)(T);
+  std::atomic<uint64_t> _expired_count;
+
+  // Stall detection (see set_health_checker()).  Each worker's heartbeat is
+  // thread local, so run_once() and run_batch() can find it.
+  HealthChecker* _health_checker;
+  unsigned int _stall_deadline_ms;
+  static thread_local HealthChecker::Heartbeat* _heartbeat;
+
+  void heartbeat_busy()
+  {
+    if (_heartbeat != nullptr)
+    {
+      _heartbeat->beat();
+    }
+  }
+
+  void heartbeat_idle()
+  {
+    if (_heartbeat != nullptr)
+    {
+      _heartbeat->idle();
+    }
+  }
+
+  // Returns the stamp to put on a work item added to a local deque. The
+  // timestamp is zero (meaning no timestamp) if we're not tracking queue wait
+  // times.
+  Stamp stamp(uint64_t deadline_us) const
+  {
+    return Stamp((_queue_wait_table != nullptr) ? eventq<T>::timestamp_us() : 0,
+                 deadline_us);
+  }
+
+  // Put a work item on the appropriate queue.
+  void enqueue(T&& work, uint64_t deadline_us)
+  {
+    WorkerDeque* local = local_deque();
+
+    if (local != nullptr)
+    {
+      local->push(std::move(work), stamp(deadline_us));
+      wake_parked_workers(1);
+    }
+    else
+    {
+      _queue.push(std::move(work), deadline_us);
+    }
+  }
+
+  // Terminate the queue, and wake any workers parked in work-stealing mode so
+  // that they see it.
+  void terminate_queue()
+  {
+    _queue.terminate();
+
+    pthread_mutex_lock(&_park_lock);
+    pthread_cond_broadcast(&_park_cond);
+    pthread_mutex_unlock(&_park_lock);
+  }
+
+  // Wake parked workers after work items have been pushed onto a local deque,
+  // so they can steal them - one for a single item, or all of them for more.
+  void wake_parked_workers(size_t num_items)
+  {
+    // This fence pairs with the one in get_work_stealing(), so that either
+    // we see the parking worker's count, or it sees the items we pushed.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if ((num_items == 0) ||
+        (_parked_workers.load(std::memory_order_relaxed) == 0))
+    {
+      return;
+    }
+
+    pthread_mutex_lock(&_park_lock);
+
+    if (num_items == 1)
+    {
+      pthread_cond_signal(&_park_cond);
+    }
+    else
+    {
+      pthread_cond_broadcast(&_park_cond);
+    }
+
+    pthread_mutex_unlock(&_park_lock);
+  }
+
+  // Returns whether any worker's local deque has work items on it.
+  bool local_work_available() const
+  {
+    for (const WorkerDeque* deque : _deques)
+    {
+      if (deque->size.load(std::memory_order_relaxed) > 0)
+      {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  // Discard a work item whose deadline has passed.
+  void expire(T& work)
+  {
+    ++_expired_count;
+
+    if (_expiry_callback != nullptr)
+    {
+      _expiry_callback(std::move(work));
+    }
+  }
+
+  // Returns the local deque of the calling thread, or nullptr if the pool is
+  // not in work-stealing mode or the caller is not one of its worker threads.
+  WorkerDeque* local_deque()
+  {
+    if (!_work_stealing)
+    {
+      return nullptr;
+    }
+
+    return (WorkerDeque*)pthread_getspecific(_worker_key);
+  }
+
+  // Get the next work item in work-stealing mode, blocking until one is
+  // available. If there is no work on the local deques, the worker either
+  // becomes the poller and blocks on the injection queue, or parks until it is
+  // woken (see _park_cond).
+  //
+  // @param wait_us set to how long the work item was queued for.
+  // @param deadline_us set to the work item's deadline.
+  // @return false if the pool has been terminated, true otherwise.
+  bool get_work_stealing(T& work, unsigned long& wait_us, uint64_t& deadline_us)
+  {
+    WorkerDeque* local = local_deque();
+    Stamp work_stamp;
+
+    while (true)
+    {
+      if ((local->pop_front(work, work_stamp)) ||
+          (steal(local, work, work_stamp)))
+      {
+        wait_us = eventq<T>::wait_since(work_stamp.timestamp_us);
+        deadline_us = work_stamp.deadline_us;
+        return true;
+      }
+
+      pthread_mutex_lock(&_park_lock);
+
+      if (!_poller_active)
+      {
+        _poller_active = true;
+        pthread_mutex_unlock(&_park_lock);
+
+        // This only returns without an item if the queue has been terminated.
+        bool got_work = _queue.try_pop(work, -1, &wait_us, &deadline_us);
+
+        // Hand the injection queue on to a parked worker.
+        pthread_mutex_lock(&_park_lock);
+        _poller_active = false;
+        pthread_cond_signal(&_park_cond);
+        pthread_mutex_unlock(&_park_lock);
+
+        return got_work;
+      }
+
+      ++_parked_workers;
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+
+      // Check for work pushed before we were counted as parked, as its pusher
+      // may not have woken anyone.
+      if ((!local_work_available()) && (!_queue.is_terminated()))
+      {
+        pthread_cond_wait(&_park_cond, &_park_lock);
+      }
+
+      --_parked_workers;
+      pthread_mutex_unlock(&_park_lock);
+
+      if (_queue.is_terminated())
+      {
+        return false;
+      }
+    }
+  }
+
+  // Try to steal a work item from another worker, starting with a randomly
+  // chosen victim and moving through the rest in order.
+  //
+  // @return whether a work item was stolen.
+  bool steal(WorkerDeque* thief, T& work, Stamp& stamp)
+  {
+    unsigned int num_deques = _deques.size();
+
+    if (num_deques <= 1)
+    {
+      return false;
+    }
+
+    unsigned int start = rand_r(&thief->seed) % num_deques;
+
+    for (unsigned int ii = 0; ii < num_deques; ++ii)
+    {
+      WorkerDeque* victim = _deques[(start + ii) % num_deques];
+
+      if ((victim != thief) && (victim->pop_back(work, stamp)))
+      {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
   // Static worker thread function that is passed into pthread_create.
   //
   // We can't use a mem_fun here as we can't convert the resulting mem_fun_t to
@@ -168,42 +1098,266 @@ private:
 
   // Take on work item off the queue an process it. This is called repeatedly by
   // the worker threads until it returns false (meaning the work queue has been
-  // closed).
+  // closed or, in elastic mode, that the worker should exit).
   //
   // This can also be used in UTs to control execution of the thread pool.
   bool run_once()
   {
     T work;
-    bool got_work = _queue.pop(work);
+    bool got_work;
+    bool keep_going;
+    unsigned long wait_us = 0;
+    uint64_t deadline_us = 0;
+
+    if (_work_stealing)
+    {
+      keep_going = got_work = get_work_stealing(work, wait_us, deadline_us);
+    }
+    else if (_elastic)
+    {
+      // Only wait for the idle timeout, so idle workers can exit.
+      got_work = _queue.try_pop(work, _idle_timeout_ms, &wait_us, &deadline_us);
+      keep_going = (got_work) ||
+                   ((!_queue.is_terminated()) && (!retire_worker()));
+    }
+    else
+    {
+      // Use the timed pop (with no timeout) to find out the work item's queue
+      // wait time and deadline.
+      keep_going = got_work = _queue.try_pop(work, -1, &wait_us, &deadline_us);
+    }
 
     if (got_work)
     {
+      if (_queue_wait_table != nullptr)
+      {
+        _queue_wait_table->accumulate(wait_us);
+      }
+
+      if (eventq<T>::expired(deadline_us))
+      {
+        expire(work);
+        return keep_going;
+      }
+
+      Utils::StopWatch stopwatch;
+      if (_service_time_table != nullptr)
+      {
+        stopwatch.start();
+      }
+
+      heartbeat_busy();
+
       CW_TRY
       {
         process_work(work);
       }
       CW_EXCEPT(_exception_handler)
       {
-        _callback(work);
+        _callback(std::move(work));
       }
       CW_END
+
+      heartbeat_idle();
+
+      unsigned long service_us;
+      if ((_service_time_table != nullptr) && (stopwatch.read(service_us)))
+      {
+        _service_time_table->accumulate(service_us);
+      }
+    }
+
+    return keep_going;
+  }
+
+  // Take a batch of work items off the queue and process them. As with
+  // run_once(), this returns false once the work queue has been closed.
+  //
+  // @param batch a vector to hold the batch. This is cleared before use.
+  // @param processed used to track how many items in the batch have been
+  //                  processed. This is owned by the caller (rather than being
+  //                  a local) so that it's still valid after an exception.
+  bool run_batch(std::vector<T>& batch, size_t& processed)
+  {
+    batch.clear();
+    processed = 0;
+
+    bool got_work;
+    std::vector<unsigned long> waits_us;
+    std::vector<uint64_t> deadlines_us;
+
+    if (_work_stealing)
+    {
+      T work;
+      unsigned long wait_us = 0;
+      uint64_t deadline_us = 0;
+      got_work = get_work_stealing(work, wait_us, deadline_us);
+
+      if (got_work)
+      {
+        batch.push_back(std::move(work));
+        waits_us.push_back(wait_us);
+        deadlines_us.push_back(deadline_us);
+
+        WorkerDeque* local = local_deque();
+        Stamp work_stamp;
+        while (batch.size() < _max_batch_size)
+        {
+          if (local->pop_front(work, work_stamp))
+          {
+            wait_us = eventq<T>::wait_since(work_stamp.timestamp_us);
+            deadline_us = work_stamp.deadline_us;
+          }
+          else if (!_queue.try_pop(work, 0, &wait_us, &deadline_us))
+          {
+            break;
+          }
+
+          batch.push_back(std::move(work));
+          waits_us.push_back(wait_us);
+          deadlines_us.push_back(deadline_us);
+        }
+      }
+    }
+    else if (_elastic)
+    {
+      // Only wait for the idle timeout, so idle workers can exit.
+      got_work = _queue.pop_batch(batch,
+                                  _max_batch_size,
+                                  _idle_timeout_ms,
+                                  &waits_us,
+                                  &deadlines_us);
+
+      if ((got_work) && (batch.empty()))
+      {
+        got_work = !retire_worker();
+      }
+    }
+    else
+    {
+      got_work = _queue.pop_batch(batch,
+                                  _max_batch_size,
+                                  -1,
+                                  &waits_us,
+                                  &deadlines_us);
+    }
+
+    if (!batch.empty())
+    {
+      if (_queue_wait_table != nullptr)
+      {
+        for (unsigned long wait_us : waits_us)
+        {
+          _queue_wait_table->accumulate(wait_us);
+        }
+      }
+
+      discard_expired(batch, deadlines_us);
+    }
+
+    if (!batch.empty())
+    {
+      Utils::StopWatch stopwatch;
+      if (_service_time_table != nullptr)
+      {
+        stopwatch.start();
+      }
+
+      heartbeat_busy();
+
+      CW_TRY
+      {
+        process_work_batch(batch, processed);
+      }
+      CW_EXCEPT(_exception_handler)
+      {
+        // Recover every item that hadn't been fully processed.
+        for (size_t ii = processed; ii < batch.size(); ++ii)
+        {
+          _callback(std::move(batch[ii]));
+        }
+      }
+      CW_END
+
+      heartbeat_idle();
+
+      unsigned long service_us;
+      if ((_service_time_table != nullptr) && (stopwatch.read(service_us)))
+      {
+        for (size_t ii = 0; ii < batch.size(); ++ii)
+        {
+          _service_time_table->accumulate(service_us / batch.size());
+        }
+      }
     }
 
     return got_work;
   }
 
+  // Remove any work items whose deadline has passed from a batch, keeping the
+  // rest in order.
+  //
+  // @param deadlines_us the deadline of each item in the batch.
+  void discard_expired(std::vector<T>& batch,
+                       const std::vector<uint64_t>& deadlines_us)
+  {
+    uint64_t now_us = 0;
+    size_t kept = 0;
+
+    for (size_t ii = 0; ii < batch.size(); ++ii)
+    {
+      if ((ii < deadlines_us.size()) && (deadlines_us[ii] != 0))
+      {
+        if (now_us == 0)
+        {
+          // Only read the clock once for the whole batch.
+          now_us = eventq<T>::timestamp_us();
+        }
+
+        if (eventq<T>::expired(deadlines_us[ii], now_us))
+        {
+          expire(batch[ii]);
+          continue;
+        }
+      }
+
+      if (kept != ii)
+      {
+        batch[kept] = std::move(batch[ii]);
+      }
+      ++kept;
+    }
+
+    batch.resize(kept);
+  }
+
   // Function executed by a single worker thread. This loops pulling work off
   // the queue and processing it.
   void worker_thread_func()
   {
     bool got_work;
+    std::vector<T> batch;
+    size_t processed = 0;
+
+    if (_work_stealing)
+    {
+      // Claim a local deque for this worker.
+      unsigned int index = _next_worker_index++;
+      pthread_setspecific(_worker_key, _deques[index % _deques.size()]);
+    }
+
+    if (_health_checker != nullptr)
+    {
+      _heartbeat = _health_checker->register_heartbeat("Worker thread",
+                                                       _stall_deadline_ms);
+    }
 
     // Startup hook.
     on_thread_startup();
 
     do
     {
-      got_work = run_once();
+      got_work = (_max_batch_size > 1) ? run_batch(batch, processed) : run_once();
 
       // If we haven't got any work then the queue must have been terminated,
       // which in turn means the threadpool has been shut down.  Exit the loop.
@@ -211,6 +1365,12 @@ private:
 
     // Shutdown hook.
     on_thread_shutdown();
+
+    if (_heartbeat != nullptr)
+    {
+      _health_checker->unregister_heartbeat(_heartbeat);
+      _heartbeat = nullptr;
+    }
   }
 
   // (Optional) thread startup hook.  This is called by each worker thread just
@@ -227,8 +1387,26 @@ private:
 
   // Process a work item. This method must be overridden by the subclass.
   virtual void process_work(T& work) = 0;
+
+  // (Optional) process a batch of work items.  This is only used if the
+  // maximum batch size has been set above one.
+  //
+  // Implementations must keep `processed` up to date with the number of items
+  // (from the start of the batch) that they have finished with.  If an
+  // exception is hit, the recovery callback is called for the remaining items.
+  //
+  // The default implementation calls process_work() on each item in turn.
+  virtual void process_work_batch(std::vector<T>& batch, size_t& processed)
+  {
+    for (; processed < batch.size(); ++processed)
+    {
+      process_work(batch[processed]);
+    }
+  }
 };
 
+template <class T>
+thread_local HealthChecker::Heartbeat* ThreadPool<T>::_heartbeat = nullptr;
 
 /// An alternative thread pool where the work items are callable objects. When a
 /// thread processes a work item it just calls the object. This allows thread
@@ -247,4 +1425,32 @@ public:
   }
 };
 
+/// The work item type for an InlineFunctorThreadPool. This can hold any
+/// callable object of up to 64 bytes (for example a lambda that captures up to
+/// eight pointers).
+typedef InlineFunction<64> InlineFunctor;
+
+/// A functor thread pool where the work items are InlineFunctors rather than
+/// std::functions. The callable objects are stored inline in the work items and
+/// moved through the pool, so adding and processing work never allocates
+/// memory (for example, std::function has to allocate to hold a lambda that
+/// captures more than a couple of pointers).
+///
+/// Adding a callable that is too large for an InlineFunctor is a compile-time
+/// error. Wrap it in a std::function (or capture a pointer to its state) in
+/// that case.
+class InlineFunctorThreadPool : public ThreadPool<InlineFunctor>
+{
+public:
+  /// Just use the `ThreadPool` constructor.
+  using ThreadPool<InlineFunctor>::ThreadPool;
+
+  virtual ~InlineFunctorThreadPool() {};
+
+  void process_work(InlineFunctor& callable)
+  {
+    callable();
+  }
+};
+
 #endif
@@ -30,8 +30,41 @@ public:
 
   void increment(uint32_t count = 1);
   void decrement(uint32_t count = 1);
+
+  /// Changes the number of timers by `delta` (which may be negative) in a
+  /// single update.
+  void apply_delta(int64_t delta);
+
   void get_statistics(int index, timespec now, SNMP::SimpleStatistics* stats);
 
+  /// Accumulates changes to a TimerCounter on the calling thread, and
+  /// applies them as one update when flushed (or destroyed) - so handling a
+  /// burst of timers costs one update rather than one per timer.  The
+  /// counter's statistics don't see the changes until they're flushed, so
+  /// batches should be short-lived (e.g. one burst of timer pops).
+  class Batch
+  {
+  public:
+    Batch(TimerCounter* counter) : _counter(counter), _delta(0) {}
+    ~Batch() { flush(); }
+
+    void increment(uint32_t count = 1) { _delta += count; }
+    void decrement(uint32_t count = 1) { _delta -= count; }
+
+    void flush()
+    {
+      if (_delta != 0)
+      {
+        _counter->apply_delta(_delta);
+        _delta = 0;
+      }
+    }
+
+  private:
+    TimerCounter* _counter;
+    int64_t _delta;
+  };
+
   CurrentAndPrevious<SNMP::ContinuousStatistics> five_second;
   CurrentAndPrevious<SNMP::ContinuousStatistics> five_minute;
 
@@ -39,7 +72,7 @@ private:
   void refresh_statistics(SNMP::ContinuousStatistics* current_data,
                           timespec now,
                           uint32_t interval_ms);
-  void write_statistics(SNMP::ContinuousStatistics* current_data, int value_delta);
+  void write_statistics(SNMP::ContinuousStatistics* current_data, int64_t value_delta);
   void read_statistics(SNMP::ContinuousStatistics* current_data,
                        SNMP::SimpleStatistics* return_data,
                        timespec now,
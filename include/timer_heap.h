@@ -12,10 +12,12 @@
 
 #include <stdint.h>
 #include <stddef.h>
-#include <vector>
-#include <boost/heap/d_ary_heap.hpp>
+#include <stdlib.h>
+#include <string.h>
 
-class TimerHeap;
+#include <new>
+
+class TimerHeapBase;
 class HeapableTimer;
 
 class PopsBefore
@@ -45,24 +47,55 @@ public:
   /// Heap which this timer is in, or NULL if it isn't currently in a heap.
   ///
   /// TimerHeap::insert is responsible for updating this field.
-  TimerHeap* _heap = nullptr;
+  TimerHeapBase* _heap = nullptr;
 
   // The current position of this timer in the heap's underlying array. The
   // TimerHeap is responsible for keeping this up-to-date as it moves the
   // timer around.
-  boost::heap::d_ary_heap<HeapableTimer*,
-                          boost::heap::arity<2>,
-                          boost::heap::mutable_<true>,
-                          boost::heap::compare<PopsBefore>>::handle_type _heap_handle;
+  size_t _heap_index = 0;
 };
 
-/// Wrapper around a heap data structure for storing timers efficiently.
-class TimerHeap : public boost::heap::d_ary_heap<HeapableTimer*,
-                                                 boost::heap::arity<2>,
-                                                 boost::heap::mutable_<true>,
-                                                 boost::heap::compare<PopsBefore>>
+/// The operations on a heap that a timer in it needs, whatever the heap's
+/// arity.
+class TimerHeapBase
 {
 public:
+  virtual ~TimerHeapBase() = default;
+
+  virtual void insert(HeapableTimer* t) = 0;
+  virtual bool remove(HeapableTimer* t) = 0;
+  virtual void rebalance(HeapableTimer* t) = 0;
+  virtual HeapableTimer* get_next_timer() = 0;
+};
+
+/// Heap data structure for storing timers efficiently.
+///
+/// Each entry in the heap holds the timer's pop time alongside the pointer
+/// to it, so comparing entries never has to look at the timers themselves.
+/// The pop time is read when the timer is inserted or rebalanced, so
+/// rebalance() must be called whenever it changes.
+///
+/// The heap is ARITY-ary (rather than binary), which makes it shallower, and
+/// the entries are laid out so that each node's children start on a cache
+/// line. Higher arities (4 or 8) are faster for large heaps.
+template <unsigned int ARITY>
+class BasicTimerHeap : public TimerHeapBase
+{
+  static_assert(ARITY >= 2, "A heap must have an arity of at least 2");
+
+public:
+  BasicTimerHeap() :
+    _entries(nullptr),
+    _size(0),
+    _capacity(0)
+  {}
+
+  virtual ~BasicTimerHeap()
+  {
+    clear();
+    free(_entries);
+  }
+
   /// Adds a timer to the heap. This doesn't take ownership of the timer's
   /// memory - this must be tracked, freed etc. outside of the heap. (The
   /// caller will usually wwant to do this anyway, so that they have a
@@ -75,8 +108,48 @@ public:
   {
     if (t->_heap != this)
     {
-      t->_heap_handle = push(t);
-      t->_heap = this;
+      reserve(_size + 1);
+      append(t);
+      sift_up(_size - 1);
+    }
+  }
+
+  /// Adds a range of timers to the heap. This is equivalent to inserting
+  /// each of them, but when there are a lot of them it rebuilds the heap in
+  /// one go, which is quicker.
+  ///
+  /// @param begin, end Iterators over the timers to insert.
+  template <class InputIterator>
+  void insert(InputIterator begin, InputIterator end)
+  {
+    size_t old_size = _size;
+
+    for (InputIterator it = begin; it != end; ++it)
+    {
+      if ((*it)->_heap != this)
+      {
+        reserve(_size + 1);
+        append(*it);
+      }
+    }
+
+    if (_size - old_size > old_size)
+    {
+      // Most of the heap is new, so rebuild it from the bottom up.
+      for (size_t ii = _size / ARITY + 1; ii > 0; --ii)
+      {
+        if (ii - 1 < _size)
+        {
+          sift_down(ii - 1);
+        }
+      }
+    }
+    else
+    {
+      for (size_t ii = old_size; ii < _size; ++ii)
+      {
+        sift_up(ii);
+      }
     }
   }
 
@@ -90,8 +163,17 @@ public:
   {
     if (t->_heap == this)
     {
-      erase(t->_heap_handle);
+      size_t index = t->_heap_index;
       t->_heap = nullptr;
+      --_size;
+
+      if (index != _size)
+      {
+        // Move the last entry into the gap, and then to the right place.
+        move_to(index, at(_size));
+        fix(index);
+      }
+
       return true;
     }
     else
@@ -103,15 +185,16 @@ public:
   /// Moves the timer up or down as necessary to ensure that this timer is
   /// larger than its parent and smaller than its children (i.e. to ensure the
   /// heap property). Should be called after any operation on a timer that
-  /// might have violated the heap property, such as:
-  ///
-  /// * swapping a timer from the bottom of the tree into an arbitrary position, as part of a delete operation
-  /// * changing a timer's pop time
+  /// might have violated the heap property, such as changing its pop time.
   ///
   /// @param t The timer to move to the right place in the heap.
   void rebalance(HeapableTimer* t)
   {
-    update(t->_heap_handle);
+    if (t->_heap == this)
+    {
+      at(t->_heap_index).pop_time = t->get_pop_time();
+      fix(t->_heap_index);
+    }
   }
 
   /// Returns the timer which will pop next, or NULL if the heap is empty.
@@ -128,11 +211,189 @@ public:
     }
     else
     {
-      return top();
+      return at(0).timer;
+    }
+  }
+
+  /// Removes and returns the timer which will pop next, if it pops at or
+  /// before `now`.
+  ///
+  /// @returns The timer, or NULL if no timers have popped.
+  HeapableTimer* pop_next(uint64_t now)
+  {
+    if ((!empty()) && (!pops_before(now, at(0).pop_time)))
+    {
+      HeapableTimer* t = at(0).timer;
+      remove(t);
+      return t;
+    }
+    else
+    {
+      return nullptr;
     }
   }
+
+  size_t size() const { return _size; }
+  bool empty() const { return (_size == 0); }
+
+  /// Removes all the timers from the heap. This does not free their memory.
+  void clear()
+  {
+    for (size_t ii = 0; ii < _size; ++ii)
+    {
+      at(ii).timer->_heap = nullptr;
+    }
+
+    _size = 0;
+  }
+
+private:
+  struct Entry
+  {
+    uint64_t pop_time;
+    HeapableTimer* timer;
+  };
+
+  static const size_t CACHE_LINE_SIZE = 64;
+
+  // The entries are stored after (ARITY - 1) unused ones, so that the first
+  // child of each node (at ARITY * index + 1) is at a multiple of ARITY in
+  // the array, and so at the start of a cache line when ARITY entries fill a
+  // whole number of cache lines.
+  static const size_t OFFSET = ARITY - 1;
+
+  // Compares two pop times, allowing for the times having overflowed (as
+  // Utils::overflow_less_than).
+  static bool pops_before(uint64_t a, uint64_t b)
+  {
+    return ((a - b) > ((uint64_t)1 << 63));
+  }
+
+  Entry& at(size_t index) { return _entries[index + OFFSET]; }
+
+  // Makes sure there's space for `size` entries.
+  void reserve(size_t size)
+  {
+    if (size > _capacity)
+    {
+      size_t capacity = (_capacity == 0) ? 64 : _capacity * 2;
+      void* entries = nullptr;
+
+      if (posix_memalign(&entries,
+                         CACHE_LINE_SIZE,
+                         (capacity + OFFSET) * sizeof(Entry)) != 0)
+      {
+        throw std::bad_alloc(); // LCOV_EXCL_LINE
+      }
+
+      if (_entries != nullptr)
+      {
+        memcpy(entries, _entries, (_size + OFFSET) * sizeof(Entry));
+        free(_entries);
+      }
+
+      _entries = (Entry*)entries;
+      _capacity = capacity;
+    }
+  }
+
+  // Adds a timer to the end of the array, without moving it into place.
+  void append(HeapableTimer* t)
+  {
+    Entry entry = {t->get_pop_time(), t};
+    t->_heap = this;
+    move_to(_size++, entry);
+  }
+
+  void move_to(size_t index, const Entry& entry)
+  {
+    at(index) = entry;
+    entry.timer->_heap_index = index;
+  }
+
+  // Moves the entry at `index` up or down to where it belongs.
+  void fix(size_t index)
+  {
+    if ((index > 0) &&
+        (pops_before(at(index).pop_time, at((index - 1) / ARITY).pop_time)))
+    {
+      sift_up(index);
+    }
+    else
+    {
+      sift_down(index);
+    }
+  }
+
+  void sift_up(size_t index)
+  {
+    Entry entry = at(index);
+
+    while (index > 0)
+    {
+      size_t parent = (index - 1) / ARITY;
+
+      if (!pops_before(entry.pop_time, at(parent).pop_time))
+      {
+        break;
+      }
+
+      move_to(index, at(parent));
+      index = parent;
+    }
+
+    move_to(index, entry);
+  }
+
+  void sift_down(size_t index)
+  {
+    Entry entry = at(index);
+
+    while (true)
+    {
+      size_t first_child = (index * ARITY) + 1;
+
+      if (first_child >= _size)
+      {
+        break;
+      }
+
+      size_t last_child = (first_child + ARITY < _size) ?
+                          first_child + ARITY : _size;
+      size_t earliest = first_child;
+
+      for (size_t child = first_child + 1; child < last_child; ++child)
+      {
+        if (pops_before(at(child).pop_time, at(earliest).pop_time))
+        {
+          earliest = child;
+        }
+      }
+
+      if (!pops_before(at(earliest).pop_time, entry.pop_time))
+      {
+        break;
+      }
+
+      move_to(index, at(earliest));
+      index = earliest;
+    }
+
+    move_to(index, entry);
+  }
+
+  Entry* _entries;
+  size_t _size;
+  size_t _capacity;
+
+  // Don't implement the following, to avoid copies of this instance.
+  BasicTimerHeap(BasicTimerHeap const&);
+  void operator=(BasicTimerHeap const&);
 };
 
+/// A binary timer heap.
+typedef BasicTimerHeap<2> TimerHeap;
+
 // Basic implementation of a timer which allows setting and updating the pop
 // time.
 class SimpleTimer : public HeapableTimer
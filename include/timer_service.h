@@ -0,0 +1,163 @@
+/**
+ * @file timer_service.h  Multi-threaded service that pops timers.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef TIMER_SERVICE_H__
+#define TIMER_SERVICE_H__
+
+#include <pthread.h>
+
+#include <functional>
+#include <vector>
+
+#include "threadpool.h"
+#include "thread_placement.h"
+#include "timer_heap.h"
+
+/// Pops timers on several threads at once.
+///
+/// A timer heap can only be used from one thread at a time, so a single heap
+/// with one pop thread caps how many timers can be handled.  The TimerService
+/// instead shards the timers over several heaps by their ID, each owned by
+/// its own pop thread, so only that thread ever touches the heap and it
+/// doesn't need locking.
+///
+/// Inserting, rebalancing and removing a timer queue a command for the pop
+/// thread of the timer's shard (so can be done from any thread), and the pop
+/// thread applies all the commands that have built up each time it wakes.
+/// The commands for a timer are applied in the order they were made, as they
+/// all go to the same shard.
+///
+/// When timers pop, the pop thread hands them to a thread pool in batches,
+/// to be passed to the pop callback.  Timers that are removed are passed to
+/// the removed callback on the pop thread once they're out of the heap.  For
+/// each insert of a timer exactly one of these is eventually called (unless
+/// the service is destroyed first), after which the service doesn't touch
+/// the timer, so the callbacks may free it.
+///
+/// Timers' pop times are in milliseconds on CLOCK_MONOTONIC, and are read on
+/// the pop thread when the timer is inserted or rebalanced - so changing a
+/// timer's pop time must be safe while the pop thread may be reading it.
+class TimerService
+{
+public:
+  /// Called (on a thread pool thread) with a batch of timers that have
+  /// popped.
+  typedef std::function<void(std::vector<HeapableTimer*>&)> PopCallback;
+
+  /// Called (on a pop thread) with a timer that has been removed.
+  typedef std::function<void(HeapableTimer*)> RemovedCallback;
+
+  static const size_t DEFAULT_MAX_BATCH = 100;
+
+  /// @param num_shards       - The number of shards, and so of pop threads.
+  /// @param pool             - The pool to run the pop callback on.  The
+  ///                           service doesn't own it.
+  /// @param pop_callback     - Called with the timers that pop.
+  /// @param removed_callback - Called with the timers that are removed.  May
+  ///                           be nullptr if nothing needs doing.
+  /// @param max_batch        - The most timers that are passed to one call of
+  ///                           the pop callback.
+  /// @param placement        - Where to run the pop threads (for example one
+  ///                           per core).
+  TimerService(unsigned int num_shards,
+               FunctorThreadPool* pool,
+               PopCallback pop_callback,
+               RemovedCallback removed_callback = nullptr,
+               size_t max_batch = DEFAULT_MAX_BATCH,
+               const ThreadPlacementPolicy& placement = ThreadPlacementPolicy());
+
+  /// Stops the pop threads.  Timers that are still in the service are
+  /// dropped without either callback being called.
+  virtual ~TimerService();
+
+  /// Adds a timer to the service.  Does nothing if the timer is already in
+  /// the service.
+  ///
+  /// @param id    - The timer's ID, which picks its shard.  The same ID must
+  ///                be passed whenever the timer is used.
+  /// @param timer - The timer.
+  void insert(uint64_t id, HeapableTimer* timer);
+
+  /// Moves a timer to the right place for its pop time.  Should be called
+  /// after changing the timer's pop time.
+  void rebalance(uint64_t id, HeapableTimer* timer);
+
+  /// Removes a timer from the service.  If the timer has already popped,
+  /// this does nothing.
+  void remove(uint64_t id, HeapableTimer* timer);
+
+  /// @return the number of timers in the service, as of when each pop
+  ///         thread last woke up.
+  size_t size() const;
+
+private:
+  enum Operation
+  {
+    INSERT,
+    REBALANCE,
+    REMOVE
+  };
+
+  struct Command
+  {
+    Operation operation;
+    HeapableTimer* timer;
+  };
+
+  // A shard of the timers, with its pop thread and the commands waiting for
+  // it.
+  struct Shard
+  {
+    TimerService* service;
+    unsigned int index;
+    pthread_t thread;
+
+    // Protects the commands and the size.  The heap is only used by the pop
+    // thread.
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    std::vector<Command> commands;
+    size_t size;
+
+    BasicTimerHeap<4> heap;
+  };
+
+  Shard* shard_for(uint64_t id) const;
+
+  void queue_command(uint64_t id, Operation operation, HeapableTimer* timer);
+
+  static void* pop_thread_fn(void* shard);
+  void pop_thread_fn(Shard* shard);
+
+  // Applies a batch of commands to a shard's heap.
+  void apply_commands(Shard* shard, std::vector<Command>& commands);
+
+  // Pops the timers that are due, and passes them to the pool.
+  void pop_timers(Shard* shard, uint64_t now_ms);
+
+  static uint64_t now_ms();
+
+  std::vector<Shard*> _shards;
+  FunctorThreadPool* _pool;
+  PopCallback _pop_callback;
+  RemovedCallback _removed_callback;
+  size_t _max_batch;
+
+  // Read by the pop threads with their shard's lock held, so is set with
+  // every shard's lock held.
+  bool _terminated;
+
+  // Don't implement the following, to avoid copies of this instance.
+  TimerService(TimerService const&);
+  void operator=(TimerService const&);
+};
+
+#endif
@@ -0,0 +1,159 @@
+/**
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+class TimerWheel;
+
+/// Interface for a timer which can be used in a TimerWheel. Subclasses should
+/// implement the get_pop_time method, plus whatever else they need for the
+/// information associated with a timer.
+class WheelableTimer
+{
+public:
+  virtual ~WheelableTimer() = default;
+
+  /// Time at which this timer pops. As for HeapableTimer, this doesn't
+  /// enforce a particular unit or epoch, but it must be consistent between
+  /// all the timers in the same wheel.
+  ///
+  /// @return Integer representing the pop time.
+  virtual uint64_t get_pop_time() const = 0;
+
+  /// Wheel which this timer is in, or NULL if it isn't currently in a wheel.
+  ///
+  /// TimerWheel::insert is responsible for updating this field.
+  TimerWheel* _wheel = nullptr;
+
+  // The list this timer is in (by level and slot of the wheel), and its
+  // neighbours in that list. The TimerWheel is responsible for keeping these
+  // up-to-date as it moves the timer around.
+  WheelableTimer* _wheel_prev = nullptr;
+  WheelableTimer* _wheel_next = nullptr;
+  int _wheel_level = 0;
+  int _wheel_slot = 0;
+};
+
+/// A hierarchical timer wheel, for storing large numbers of timers whose pop
+/// times only need to be accurate to a coarse resolution (e.g. registration
+/// and subscription timers).
+///
+/// Inserting, removing and rebalancing a timer take constant time (rather
+/// than O(log n) as in a TimerHeap), and don't touch any other timers.
+/// Finding the next timer moves the wheel on to the next occupied slot,
+/// spreading the timers in it out over the levels below, so each timer is
+/// moved at most once per level over its lifetime.
+///
+/// Each level of the wheel has 256 slots, each covering 256 times the
+/// range of a slot on the level below, and the bottom level's slots each
+/// cover `resolution`. Timers more than 2^32 resolutions ahead are kept in an
+/// overflow list until the wheel gets close enough to them.
+///
+/// Unlike the TimerHeap, pop times are compared as plain integers, so must
+/// not wrap.
+class TimerWheel
+{
+public:
+  /// @param resolution The range of pop times covered by each slot on the
+  ///                   bottom level. Timers in the same slot are searched to
+  ///                   find the next one, so this should be roughly the
+  ///                   precision that the timers need.
+  TimerWheel(uint64_t resolution = 1);
+
+  /// Adds a timer to the wheel. This doesn't take ownership of the timer's
+  /// memory.
+  ///
+  /// Does nothing if this timer is already in the wheel.
+  ///
+  /// @param t Timer to insert
+  void insert(WheelableTimer* t);
+
+  /// Removes a timer from the wheel. This does not free the timer's memory.
+  ///
+  /// @param t Timer to remove.
+  ///
+  /// @returns True if the timer was removed, False if the timer was not in
+  /// the wheel.
+  bool remove(WheelableTimer* t);
+
+  /// Moves the timer to the right place in the wheel. Should be called after
+  /// changing the timer's pop time.
+  ///
+  /// @param t The timer to move.
+  void rebalance(WheelableTimer* t);
+
+  /// Returns the timer which will pop next, or NULL if the wheel is empty.
+  ///
+  /// This does not remove the timer from the wheel. If this timer gets used,
+  /// the caller should call remove() on it.
+  WheelableTimer* get_next_timer();
+
+  /// Removes and returns the timer which will pop next, if it pops at or
+  /// before `now`.
+  ///
+  /// @returns The timer, or NULL if no timers have popped.
+  WheelableTimer* pop_next(uint64_t now);
+
+  size_t size() const { return _size; }
+  bool empty() const { return (_size == 0); }
+
+private:
+  static const int SLOT_BITS = 8;
+  static const int NUM_SLOTS = 1 << SLOT_BITS;
+  static const int NUM_LEVELS = 4;
+
+  // The timers that are too far ahead for the wheel are in this level's
+  // first slot.
+  static const int OVERFLOW_LEVEL = NUM_LEVELS;
+
+  // The slot (in units of the resolution) that a timer pops in.
+  uint64_t tick(const WheelableTimer* t) const
+  {
+    return t->get_pop_time() / _resolution;
+  }
+
+  // Adds a timer to the list for its slot.
+  void place(WheelableTimer* t);
+
+  // Removes a timer from its slot's list.
+  void unlink(WheelableTimer* t);
+
+  // Returns the first occupied slot on a level at or after `from`, or -1 if
+  // there isn't one.
+  int find_slot(int level, int from) const;
+
+  // Moves the timers in a slot to the right places for the current tick.
+  void cascade(int level, int slot);
+
+  const uint64_t _resolution;
+
+  // The current tick. Every timer in the wheel pops in this tick or later
+  // (timers inserted with earlier pop times are treated as popping in it).
+  // A timer is on the level of the highest group of SLOT_BITS in which its
+  // tick differs from this one.
+  uint64_t _current;
+
+  size_t _size;
+
+  WheelableTimer* _slots[NUM_LEVELS + 1][NUM_SLOTS];
+
+  // Which slots on each level have timers in, so that the next one can be
+  // found without looking through them all.
+  uint64_t _occupied[NUM_LEVELS][NUM_SLOTS / 64];
+
+  // Don't implement the following, to avoid copies of this instance.
+  TimerWheel(TimerWheel const&);
+  void operator=(TimerWheel const&);
+};
+
+#endif
@@ -13,11 +13,20 @@
 #define TTLCACHE_H__
 
 #include <pthread.h>
+#include <stdint.h>
 
+#include <atomic>
+#include <deque>
+#include <future>
 #include <map>
 #include <memory>
+#include <vector>
 
+#include <boost/functional/hash.hpp>
+
+#include "expiry_wheel.h"
 #include "log.h"
+#include "memory_accounting.h"
 
 /// Factory base class for cache.
 template <class K, class V>
@@ -33,139 +42,309 @@ public:
 /// concurrent calls to get for the same key will only result in a single call
 /// to the factory.
 ///
+/// The cache is split into shards by the hash of the key, each with its own
+/// read/write lock, so lookups of different keys rarely contend, and a hit
+/// only takes the read lock.  Threads waiting for an entry that is being
+/// populated wait for that entry alone, so aren't woken by other entries
+/// completing.
+///
+/// By default entries are evicted when their TTL passes, and the cache isn't
+/// bounded in size.  The cache can instead serve expired entries for a while
+/// (see serve_stale) and limit its number of entries (see set_max_entries).
+///
 /// When the destructor for the class used for Value is called, it must free all
 /// resources associated with that Value object, since that object is only
 /// accessed by shared_ptr's.
 template <class K, class V>
 class TTLCache
 {
-  /// The expiry list is a multimap indexed on expiry time (in seconds since
-  /// epoch).
-  typedef std::multimap<time_t, K> ExpiryList;
-  typedef typename ExpiryList::iterator ExpiryIterator;
+  /// Expiry times (in seconds since epoch) are tracked in a timer wheel.
+  typedef ExpiryWheel<K> ExpiryList;
+
+  /// The value an entry is populated with, which threads that find the entry
+  /// pending wait for.
+  typedef std::shared_future<std::shared_ptr<V> > Result;
 
   /// The cache itself is a map indexed on the key, where each entry contains
   /// a shared pointer to the value plus various housekeeping fields ...
-  /// -   state and lock fields used to ensure that each cache entry is only
+  /// -   state and result fields used to ensure that each cache entry is only
   ///     populated once even if multiple threads try to get it at the same
   ///     time
-  /// -   the iterator of the item in the expiry list (or expiry_list.end() if
-  ///     it is not yet in the list.
+  /// -   the expiry time of the entry (or 0 if it is not yet complete), and
+  ///     the time it is evicted, which is later if stale entries are served.
+  ///     An entry is only evicted when the expiry list reaches this time, so
+  ///     stale references to it in the expiry list are ignored.
+  /// -   whether the entry has been used since the clock hand last passed it,
+  ///     and whether it is being refreshed in the background.  These are
+  ///     atomic as they are set with only the read lock held.
   struct Entry
   {
+    Entry() :
+      state(PENDING),
+      expires(0),
+      evict_at(0),
+      referenced(false),
+      refreshing(false)
+    {
+    }
+
     enum {PENDING, COMPLETE} state;
-    ExpiryIterator expiry_i;
+    time_t expires;
+    time_t evict_at;
     std::shared_ptr<V> data_ptr;
+    Result result;
+    std::atomic<bool> referenced;
+    std::atomic<bool> refreshing;
   };
 
-  typedef std::map<K, Entry> KeyMap;
+  /// The entries are allocated through an AccountingAllocator, so that the
+  /// memory held by all TTL caches is counted in the TTL_CACHE account.
+  typedef AccountingAllocator<std::pair<const K, Entry> > KeyMapAllocator;
+  typedef std::map<K, Entry, std::less<K>, KeyMapAllocator> KeyMap;
   typedef typename KeyMap::iterator KeyMapIterator;
 
+  /// A shard of the cache, holding the entries whose keys hash to it.  The
+  /// lock must be held for reading when looking at the entries or expiry
+  /// list, and for writing when changing them.  It must not be held when
+  /// calling a factory get() method, but can be held when calling an evict()
+  /// method as these are assumed not to block.
+  struct Shard
+  {
+    Shard() :
+      cache(KeyMapAllocator(MemoryAccount::get(MemoryAccount::TTL_CACHE))),
+      has_clock_hand(false),
+      hits(0),
+      misses(0),
+      stale_hits(0),
+      refreshes(0),
+      capacity_evictions(0)
+    {
+    }
+
+    pthread_rwlock_t lock;
+    ExpiryList expiry_list;
+
+    /// The items taken off the expiry list when evicting entries.  This is
+    /// kept so that eviction doesn't allocate.
+    std::vector<typename ExpiryList::Item> expired;
+
+    KeyMap cache;
+
+    /// The key of the entry last evicted to make space.  The search for the
+    /// next entry to evict carries on from the entry after it.
+    K clock_hand;
+    bool has_clock_hand;
+
+    /// Counts for the stats, kept for each shard so that threads using
+    /// different shards don't share them.
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> stale_hits;
+    std::atomic<uint64_t> refreshes;
+    std::atomic<uint64_t> capacity_evictions;
+  };
+
+  static const int NUM_SHARDS = 8;
+
 public:
+  /// Counts of how the cache has been used.
+  struct Stats
+  {
+    /// The number of lookups that found a complete, unexpired entry.
+    uint64_t hits;
+
+    /// The number of lookups that had to populate an entry, or wait for it
+    /// to be populated.
+    uint64_t misses;
+
+    /// The number of lookups that were given an expired entry.
+    uint64_t stale_hits;
+
+    /// The number of entries refreshed in the background.
+    uint64_t refreshes;
+
+    /// The number of entries evicted to keep within the maximum size.
+    uint64_t capacity_evictions;
+  };
+
   /// factory is assumed to not be null.
   TTLCache(CacheFactory<K, V>* factory) :
     _factory(factory),
-    _lock(PTHREAD_MUTEX_INITIALIZER),
-    _expiry_list(),
-    _cache()
+    _stale_window(0),
+    _max_entries_per_shard(0),
+    _refresh_queue(),
+    _refresh_terminated(false)
   {
-    pthread_condattr_t cond_attr;
-    pthread_condattr_init(&cond_attr);
-    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
-    pthread_cond_init(&_result_available_cv, &cond_attr);
-    pthread_condattr_destroy(&cond_attr);
+    for (int ii = 0; ii < NUM_SHARDS; ++ii)
+    {
+      pthread_rwlock_init(&_shards[ii].lock, NULL);
+    }
+
+    pthread_mutex_init(&_refresh_lock, NULL);
+    pthread_cond_init(&_refresh_cond, NULL);
   }
 
   ~TTLCache()
   {
-    pthread_mutex_destroy(&_lock);
-    pthread_cond_destroy(&_result_available_cv);
+    if (_stale_window > 0)
+    {
+      pthread_mutex_lock(&_refresh_lock);
+      _refresh_terminated = true;
+      pthread_cond_signal(&_refresh_cond);
+      pthread_mutex_unlock(&_refresh_lock);
+      pthread_join(_refresh_thread, NULL);
+    }
+
+    pthread_cond_destroy(&_refresh_cond);
+    pthread_mutex_destroy(&_refresh_lock);
+
+    for (int ii = 0; ii < NUM_SHARDS; ++ii)
+    {
+      pthread_rwlock_destroy(&_shards[ii].lock);
+    }
+  }
+
+  /// Keeps entries for `stale_window` seconds after their TTL passes.  A
+  /// lookup of an expired entry in that window returns it straight away, and
+  /// queues it (once) to be refreshed by a background thread, so lookups
+  /// don't wait for the factory while the entry is repopulated.
+  ///
+  /// Must be called before the cache is used, and not more than once.
+  void serve_stale(int stale_window)
+  {
+    if (stale_window <= 0)
+    {
+      return;
+    }
+
+    int rc = pthread_create(&_refresh_thread, NULL, refresh_thread_fn, this);
+    if (rc != 0)
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to create cache refresh thread: %d", rc);
+      return;
+      // LCOV_EXCL_STOP
+    }
+
+    _stale_window = stale_window;
+  }
+
+  /// Limits the number of entries in the cache (0 means no limit).  When a
+  /// new entry would go over the limit, an entry that hasn't been used
+  /// recently is evicted, using the CLOCK algorithm - each entry is marked
+  /// when used, and the search for an entry to evict skips (and unmarks)
+  /// marked entries.  The limit is applied to each shard of the cache, so
+  /// is rounded up to a multiple of the number of shards.
+  void set_max_entries(size_t max_entries)
+  {
+    _max_entries_per_shard = (max_entries + NUM_SHARDS - 1) / NUM_SHARDS;
+  }
+
+  Stats stats() const
+  {
+    Stats stats = {0, 0, 0, 0, 0};
+
+    for (int ii = 0; ii < NUM_SHARDS; ++ii)
+    {
+      const Shard& shard = _shards[ii];
+      stats.hits += shard.hits.load();
+      stats.misses += shard.misses.load();
+      stats.stale_hits += shard.stale_hits.load();
+      stats.refreshes += shard.refreshes.load();
+      stats.capacity_evictions += shard.capacity_evictions.load();
+    }
+
+    return stats;
   }
 
   /// Get or create an entry in the cache.
   std::shared_ptr<V> get(K key, int& ttl, SAS::TrailId trail)
   {
     std::shared_ptr<V> data_ptr = NULL;
+    Shard& shard = shard_for(key);
 
-    // Take the lock. We need to lock anytime we do anything with cache
-    // entries
-    pthread_mutex_lock(&_lock);
+    // Most lookups find a complete entry, which only needs the read lock.
+    read_lock(shard);
+    KeyMapIterator kmi = shard.cache.find(key);
 
-    // Evict any old entries.
-    evict();
+    if ((kmi != shard.cache.end()) && (kmi->second.state == Entry::COMPLETE))
+    {
+      TRC_DEBUG("Cache entry is complete, returning now");
+      data_ptr = use_entry(shard, kmi);
+      pthread_rwlock_unlock(&shard.lock);
+      return data_ptr;
+    }
+
+    pthread_rwlock_unlock(&shard.lock);
 
-    // We need to hold the lock if we're looking at cache entries, as otherwise
-    // the evict method could be called which potentially destroys the entry.
-    // However, we can't hold the lock while we're actually getting the DNS
-    // record as this blocks for too long. Instead the logic is:
+    // Otherwise we need the write lock, and have to look again as the entry
+    // may have changed while we didn't hold a lock. However, we can't hold
+    // the lock while we're actually getting the DNS record as this blocks for
+    // too long. Instead the logic is:
     // - Look in the cache. The entry is either:
     //   - Not present:
-    //     - Create an entry in the cache with the state set to PENDING.
+    //     - Create an entry in the cache with the state set to PENDING, and
+    //       the result that it will be populated with.
     //     - Call out to the SRV factory to get the DNS result. We have to
     //       release the lock at this stage, so then attempt to reclaim it.
     //     - We've now got the DNS result - but as we'd released the lock we
     //       can no longer trust the entry we had at the start to still exist.
     //       Instead, re-get/create the entry in the cache, and set the expiry
     //       time and the state to COMPLETE.
-    //     - Release the lock.
+    //     - Release the lock, and set the result, which wakes the threads
+    //       waiting for it.
     //     - Return the shared_ptr to the DNS result.
     //   - Present in state pending:
-    //     - Wait on the condition variable. This releases the lock, then
-    //       reclaims it when it's next free.
-    //     - As we've released the lock we can't look at the entry we had at
-    //       the start. Instead we just start again. Also, we might have been
-    //       woken up spuriously, so we need to recheck anyway.
-    //   - Present in state complete:
+    //     - Take a copy of the entry's result, release the lock, and wait for
+    //       the result to be set.
+    //   - Present in state complete (it completed since we looked):
     //     - Store off the shared_ptr to the DNS result in the entry.
     //     - Release the lock.
     //     - Return the shared_ptr.
-    while (true)
+    pthread_rwlock_wrlock(&shard.lock);
+    evict(shard);
+    kmi = shard.cache.find(key);
+
+    if (kmi == shard.cache.end())
     {
-      KeyMapIterator kmi = _cache.find(key);
+      TRC_DEBUG("Entry not in cache, so create new entry");
+      ++shard.misses;
+      std::promise<std::shared_ptr<V> > promise;
+      populate_pending_cache_entry(shard, key, promise.get_future().share());
 
-      if (kmi == _cache.end())
+      pthread_rwlock_unlock(&shard.lock);
+      CW_IO_STARTS("Performing DNS query")
       {
-        TRC_DEBUG("Entry not in cache, so create new entry");
-        populate_pending_cache_entry(key);
-
-        pthread_mutex_unlock(&_lock);
-        CW_IO_STARTS("Performing DNS query")
-        {
-          data_ptr = _factory->get(key, ttl, trail);
-        }
-        CW_IO_COMPLETES()
-        pthread_mutex_lock(&_lock);
-
-        TRC_DEBUG("DNS query has returned, populate the cache entry");
-        populate_complete_cache_entry(key, ttl, data_ptr);
-        pthread_cond_broadcast(&_result_available_cv);
-
-        break;
+        data_ptr = _factory->get(key, ttl, trail);
       }
-      else
+      CW_IO_COMPLETES()
+      pthread_rwlock_wrlock(&shard.lock);
+
+      TRC_DEBUG("DNS query has returned, populate the cache entry");
+      populate_complete_cache_entry(shard, key, ttl, data_ptr);
+      pthread_rwlock_unlock(&shard.lock);
+
+      promise.set_value(data_ptr);
+    }
+    else if (kmi->second.state == Entry::PENDING)
+    {
+      TRC_DEBUG("Cache entry pending, so wait for the factory to complete");
+      ++shard.misses;
+      Result result = kmi->second.result;
+      pthread_rwlock_unlock(&shard.lock);
+
+      CW_IO_STARTS("Waiting for DNS query")
       {
-        TRC_DEBUG("Found the entry in the cache");
-        Entry& entry = kmi->second;
-
-        if (entry.state == Entry::PENDING)
-        {
-          TRC_DEBUG("Cache entry pending, so wait for the factory to complete");
-          CW_IO_STARTS("Waiting for DNS query")
-          {
-            pthread_cond_wait(&_result_available_cv, &_lock);
-          }
-          CW_IO_COMPLETES()
-        }
-        else
-        {
-          TRC_DEBUG("Cache entry is complete, returning now");
-          data_ptr = entry.data_ptr;
-          break;
-        }
+        data_ptr = result.get();
       }
+      CW_IO_COMPLETES()
+    }
+    else
+    {
+      TRC_DEBUG("Cache entry is complete, returning now");
+      data_ptr = use_entry(shard, kmi);
+      pthread_rwlock_unlock(&shard.lock);
     }
-
-    pthread_mutex_unlock(&_lock);
 
     return data_ptr;
   }
@@ -174,122 +353,291 @@ public:
   bool exists(K key)
   {
     bool rc = false;
-    pthread_mutex_lock(&_lock);
+    Shard& shard = shard_for(key);
+    read_lock(shard);
 
-    // Evict any old entries.
-    evict();
+    KeyMapIterator i = shard.cache.find(key);
 
-    KeyMapIterator i = _cache.find(key);
-
-    if (i != _cache.end())
+    if (i != shard.cache.end())
     {
       rc = true;
     }
 
-    pthread_mutex_unlock(&_lock);
+    pthread_rwlock_unlock(&shard.lock);
 
     return rc;
   }
 
   /// Returns the TTL of an item in the cache.  Returns zero if the item isn't
-  /// in the cache at all.
+  /// in the cache at all, and a negative TTL if it has expired but is still
+  /// being served.
   int ttl(K key)
   {
     int ttl = 0;
-    pthread_mutex_lock(&_lock);
-
-    // Evict any old entries.
-    evict();
+    Shard& shard = shard_for(key);
+    read_lock(shard);
 
-    KeyMapIterator i = _cache.find(key);
+    KeyMapIterator i = shard.cache.find(key);
 
-    if (i != _cache.end())
+    if (i != shard.cache.end())
     {
       Entry& entry = i->second;
-      if (entry.expiry_i != _expiry_list.end())
+      if (entry.expires != 0)
       {
-        ttl = entry.expiry_i->first - time(NULL);
+        ttl = entry.expires - time(NULL);
       }
     }
 
-    pthread_mutex_unlock(&_lock);
+    pthread_rwlock_unlock(&shard.lock);
 
     return ttl;
   }
 
 private:
 
-  void evict()
+  Shard& shard_for(const K& key)
+  {
+    return _shards[boost::hash<K>()(key) % NUM_SHARDS];
+  }
+
+  /// Locks a shard for reading.  If entries are due to be evicted, this
+  /// evicts them, and the shard is left locked for writing instead.  Either
+  /// way, the lock is released with pthread_rwlock_unlock.
+  void read_lock(Shard& shard)
+  {
+    pthread_rwlock_rdlock(&shard.lock);
+
+    if (shard.expiry_list.due(time(NULL)))
+    {
+      pthread_rwlock_unlock(&shard.lock);
+      pthread_rwlock_wrlock(&shard.lock);
+      evict(shard);
+    }
+  }
+
+  /// Returns the value of a complete entry, marking it as used, and queuing
+  /// it to be refreshed if it has expired.  The shard must be locked (for
+  /// reading or writing).
+  std::shared_ptr<V> use_entry(Shard& shard, KeyMapIterator kmi)
+  {
+    Entry& entry = kmi->second;
+
+    if (!entry.referenced.load(std::memory_order_relaxed))
+    {
+      entry.referenced.store(true, std::memory_order_relaxed);
+    }
+
+    if ((_stale_window > 0) && (entry.expires <= time(NULL)))
+    {
+      TRC_DEBUG("Cache entry has expired, serving it while it is refreshed");
+      ++shard.stale_hits;
+
+      if (!entry.refreshing.exchange(true))
+      {
+        request_refresh(kmi->first);
+      }
+    }
+    else
+    {
+      ++shard.hits;
+    }
+
+    return entry.data_ptr;
+  }
+
+  /// Evicts the entries in a shard that have expired.  This only does any
+  /// work once a second, when the expiry list moves on, and then evicts all
+  /// the entries that expired in that time as a batch.  The shard must be
+  /// locked for writing.
+  void evict(Shard& shard)
   {
     time_t now = time(NULL);
 
-    while ((!_expiry_list.empty()) && (_expiry_list.begin()->first <= now))
+    if (!shard.expiry_list.due(now))
     {
-      TRC_DEBUG("Current time is %d, expiry time of the entry at the head of "
-                "the expiry list is %d",
-                now, _expiry_list.begin()->first);
+      return;
+    }
 
-      ExpiryIterator i = _expiry_list.begin();
-      KeyMapIterator j = _cache.find(i->second);
+    shard.expiry_list.advance(now, shard.expired);
 
-      if (j != _cache.end())
+    for (typename std::vector<typename ExpiryList::Item>::const_iterator i = shard.expired.begin();
+         i != shard.expired.end();
+         ++i)
+    {
+      KeyMapIterator j = shard.cache.find(i->key);
+
+      // Check that the entry hasn't been repopulated with a later expiry
+      // time, and isn't being refreshed.
+      if ((j != shard.cache.end()) &&
+          (j->second.state == Entry::COMPLETE) &&
+          (j->second.evict_at == i->expiry) &&
+          (!j->second.refreshing.load()))
       {
-        // Set the expiry iterator to _expiry_list.end() as we are about to
-        // remove it from the expiry list.
-        Entry& entry = j->second;
-        entry.expiry_i = _expiry_list.end();
+        TRC_DEBUG("Current time is %d, evicting entry with expiry time %d",
+                  now, i->expiry);
 
         // Erasing the entry in the cache deletes this instance of the shared
         // pointer. This means new calls of get to the cache will get an
         // up-to-date version of V, but old calls won't have their shared
         // pointers overwritten until they've all finished with them.
-        _cache.erase(j);
+        shard.cache.erase(j);
       }
-      _expiry_list.erase(i);
+    }
+
+    shard.expired.clear();
+  }
+
+  /// Evicts an entry from a full shard to make space for a new one, searching
+  /// from the clock hand for a complete entry that hasn't been used since the
+  /// hand last passed it, and unmarking the used entries that it passes.
+  /// Entries that are pending or being refreshed are skipped, so if every
+  /// entry is in one of those states the shard is allowed to grow.  The
+  /// shard must be locked for writing.
+  void evict_for_space(Shard& shard)
+  {
+    KeyMapIterator i = shard.has_clock_hand ?
+                         shard.cache.upper_bound(shard.clock_hand) :
+                         shard.cache.begin();
+
+    // Two passes are enough to unmark every entry and come back round.
+    for (size_t ii = 0; ii < 2 * shard.cache.size(); ++ii, ++i)
+    {
+      if (i == shard.cache.end())
+      {
+        i = shard.cache.begin();
+      }
+
+      Entry& entry = i->second;
 
+      if ((entry.state != Entry::COMPLETE) || (entry.refreshing.load()))
+      {
+        continue;
+      }
+
+      if (entry.referenced.exchange(false))
+      {
+        continue;
+      }
+
+      TRC_DEBUG("Cache is full, evicting an entry that hasn't been used recently");
+      shard.clock_hand = i->first;
+      shard.has_clock_hand = true;
+      shard.cache.erase(i);
+      ++shard.capacity_evictions;
+      return;
     }
   }
 
   // Create a cache entry as a placeholder (by setting the state to pending).
-  void populate_pending_cache_entry(K& key)
+  void populate_pending_cache_entry(Shard& shard, K& key, Result result)
   {
-    Entry& entry = _cache[key];
+    if ((_max_entries_per_shard > 0) &&
+        (shard.cache.size() >= _max_entries_per_shard))
+    {
+      evict_for_space(shard);
+    }
+
+    Entry& entry = shard.cache[key];
     entry.state = Entry::PENDING;
-    entry.expiry_i = _expiry_list.end();
+    entry.expires = 0;
+    entry.evict_at = 0;
+    entry.result = result;
   }
 
   // Populate the cache entry with the DNS record. There's a chance that the
   // record has been deleted, so this might recreate the entry in the cache.
-  void populate_complete_cache_entry(K& key,
+  void populate_complete_cache_entry(Shard& shard,
+                                     const K& key,
                                      int ttl,
                                      std::shared_ptr<V> data_ptr)
   {
-    Entry& entry = _cache[key];
+    Entry& entry = shard.cache[key];
     entry.state = Entry::COMPLETE;
+    entry.result = Result();
+    entry.refreshing = false;
 
     // Add the entry to the expiry list.
     TRC_DEBUG("Adding entry to expiry list, TTL=%d, expiry time = %d",
               ttl,
               ttl + time(NULL));
 
-    entry.expiry_i = _expiry_list.insert(std::make_pair(ttl + time(NULL), key));
+    entry.expires = ttl + time(NULL);
+    entry.evict_at = entry.expires + _stale_window;
+    shard.expiry_list.insert(entry.evict_at, key);
     entry.data_ptr = data_ptr;
   }
 
+  /// Queues an expired entry to be refreshed by the refresh thread.
+  void request_refresh(const K& key)
+  {
+    pthread_mutex_lock(&_refresh_lock);
+    _refresh_queue.push_back(key);
+    pthread_cond_signal(&_refresh_cond);
+    pthread_mutex_unlock(&_refresh_lock);
+  }
+
+  /// Repopulates an entry from the factory, without holding any lock while
+  /// the factory is called.
+  void refresh_cache_entry(const K& key)
+  {
+    TRC_DEBUG("Refreshing expired cache entry");
+    int ttl = 0;
+    std::shared_ptr<V> data_ptr = _factory->get(key, ttl, 0);
+
+    Shard& shard = shard_for(key);
+    pthread_rwlock_wrlock(&shard.lock);
+    populate_complete_cache_entry(shard, key, ttl, data_ptr);
+    pthread_rwlock_unlock(&shard.lock);
+
+    ++shard.refreshes;
+  }
+
+  static void* refresh_thread_fn(void* cache)
+  {
+    ((TTLCache<K, V>*)cache)->refresh_thread_fn();
+    return NULL;
+  }
+
+  void refresh_thread_fn()
+  {
+    pthread_mutex_lock(&_refresh_lock);
+
+    while (!_refresh_terminated)
+    {
+      if (_refresh_queue.empty())
+      {
+        pthread_cond_wait(&_refresh_cond, &_refresh_lock);
+        continue;
+      }
+
+      K key = _refresh_queue.front();
+      _refresh_queue.pop_front();
+      pthread_mutex_unlock(&_refresh_lock);
+
+      refresh_cache_entry(key);
+
+      pthread_mutex_lock(&_refresh_lock);
+    }
+
+    pthread_mutex_unlock(&_refresh_lock);
+  }
+
   /// Factory object used to get cache data.
   CacheFactory<K, V>* _factory;
 
-  /// Lock protecting the global structures in the cache. This lock must be
-  /// held when accessing the global expiry list, key map structures, or cache
-  /// entries. It must not be held when calling a factory get() method, but can
-  /// be held when calling an evict() method as these are assumed not to block.
-  pthread_mutex_t _lock;
-
-  /// Condition variable to wait on while waiting for the DNS query to complete.
-  pthread_cond_t _result_available_cv;
+  Shard _shards[NUM_SHARDS];
 
-  ExpiryList _expiry_list;
+  /// How long expired entries are served for (0 if they aren't), and the
+  /// maximum number of entries in each shard (0 if there's no limit).
+  std::atomic<int> _stale_window;
+  std::atomic<size_t> _max_entries_per_shard;
 
-  KeyMap _cache;
+  /// The queue of expired entries for the refresh thread to refresh, which
+  /// is only started if stale entries are served.
+  std::deque<K> _refresh_queue;
+  pthread_mutex_t _refresh_lock;
+  pthread_cond_t _refresh_cond;
+  bool _refresh_terminated;
+  pthread_t _refresh_thread;
 };
 #endif
@@ -24,8 +24,11 @@
 #include <cctype>
 #include <string.h>
 #include <sstream>
+#include <stdio.h>
 #include <arpa/inet.h>
+#include <boost/utility/string_ref.hpp>
 
+#include "fast_clock.h"
 #include "log.h"
 
 struct IP46Address
@@ -78,24 +81,68 @@ struct IP46Address
     }
   }
 
-  /// Render the address as a string.
+  /// The size of buffer needed by format_to().
+  static const size_t MAX_STRING_SIZE = INET6_ADDRSTRLEN;
+
+  /// Render the address into a buffer of at least MAX_STRING_SIZE bytes,
+  /// without allocating.  IPv4 addresses are formatted directly, and IPv6
+  /// addresses with inet_ntop.
   ///
-  /// Note that inet_ntop (which this function uses under the covers) can
-  /// technically fail. In this situation this function returns the string
-  /// "unknown" (as it is inconvenient if it were allowed to fail).
-  std::string to_string()
+  /// Note that inet_ntop can technically fail. In this situation this
+  /// function writes the string "unknown" (as it is inconvenient if it were
+  /// allowed to fail).
+  ///
+  /// @return the length of the string (not including the null terminator).
+  size_t format_to(char* buf) const
   {
-    char buf[INET6_ADDRSTRLEN];
+    if (af == AF_INET)
+    {
+      const uint8_t* octets = (const uint8_t*)&addr.ipv4.s_addr;
+      char* p = buf;
 
-    if (inet_ntop(af, &addr, buf, sizeof(buf)) != NULL)
+      for (int ii = 0; ii < 4; ++ii)
+      {
+        uint8_t octet = octets[ii];
+
+        if (ii > 0)
+        {
+          *p++ = '.';
+        }
+
+        if (octet >= 100)
+        {
+          *p++ = '0' + (octet / 100);
+        }
+
+        if (octet >= 10)
+        {
+          *p++ = '0' + ((octet / 10) % 10);
+        }
+
+        *p++ = '0' + (octet % 10);
+      }
+
+      *p = '\0';
+      return p - buf;
+    }
+    else if (inet_ntop(af, &addr, buf, MAX_STRING_SIZE) != NULL)
     {
-      return buf;
+      return strlen(buf);
     }
     else
     {
-      return "unknown";
+      strcpy(buf, "unknown");
+      return strlen(buf);
     }
   }
+
+  /// Render the address as a string.
+  std::string to_string() const
+  {
+    char buf[MAX_STRING_SIZE];
+    size_t len = format_to(buf);
+    return std::string(buf, len);
+  }
 };
 
 struct AddrInfo
@@ -140,22 +187,90 @@ struct AddrInfo
     return !(operator==(rhs));
   }
 
-  std::string address_and_port_to_string() const
+  /// A packed form of the fields compared by operator==, for hashing.  The
+  /// port and transport are truncated to fit, so equal keys don't mean equal
+  /// AddrInfos - use operator== for that.
+  struct Key
   {
-    std::stringstream oss;
-    char buf[100];
+    /// IPv4 addresses use the first 4 bytes, and the rest are zero.
+    uint8_t address[16];
+    uint16_t port;
+    uint8_t transport;
+    uint8_t af;
+  };
+
+  void get_key(Key& key) const
+  {
+    memset(&key, 0, sizeof(key));
+
+    if (address.af == AF_INET)
+    {
+      memcpy(key.address, &address.addr.ipv4, sizeof(address.addr.ipv4));
+    }
+    else if (address.af == AF_INET6)
+    {
+      memcpy(key.address, &address.addr.ipv6, sizeof(address.addr.ipv6));
+    }
+
+    key.port = (uint16_t)port;
+    key.transport = (uint8_t)transport;
+    key.af = (uint8_t)address.af;
+  }
+
+  /// Hashes the fields compared by operator==.  All the bits of the result
+  /// are well mixed, so it can be used for open addressing or sharding.
+  size_t hash() const
+  {
+    Key key;
+    get_key(key);
+
+    uint64_t words[2];
+    uint32_t tail;
+    memcpy(words, &key, sizeof(words));
+    memcpy(&tail, (const char*)&key + sizeof(words), sizeof(tail));
+
+    uint64_t hash = (words[0] * 0x9e3779b97f4a7c15ULL) ^
+                    (words[1] * 0xc2b2ae3d27d4eb4fULL) ^
+                    (tail * 0x165667b19e3779f9ULL);
+    hash ^= hash >> 29;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 32;
+    return (size_t)hash;
+  }
+
+  /// The size of buffer needed by address_and_port_format_to() - an IPv6
+  /// address, two brackets, a colon and a port.
+  static const size_t MAX_ADDRESS_AND_PORT_SIZE = IP46Address::MAX_STRING_SIZE + 3 + 11;
+
+  /// Render the address and port into a buffer of at least
+  /// MAX_ADDRESS_AND_PORT_SIZE bytes, without allocating.
+  ///
+  /// @return the length of the string (not including the null terminator).
+  size_t address_and_port_format_to(char* buf) const
+  {
+    char* p = buf;
+
     if (address.af == AF_INET6)
     {
-      oss << "[";
+      *p++ = '[';
     }
-    oss << inet_ntop(address.af, &address.addr, buf, sizeof(buf));
+
+    p += address.format_to(p);
+
     if (address.af == AF_INET6)
     {
-      oss << "]";
+      *p++ = ']';
     }
 
-    oss << ":" << port;
-    return oss.str();
+    p += snprintf(p, MAX_ADDRESS_AND_PORT_SIZE - (p - buf), ":%d", port);
+    return p - buf;
+  }
+
+  std::string address_and_port_to_string() const
+  {
+    char buf[MAX_ADDRESS_AND_PORT_SIZE];
+    size_t len = address_and_port_format_to(buf);
+    return std::string(buf, len);
   }
 
   std::string to_string() const
@@ -183,6 +298,21 @@ struct AddrInfo
   }
 };
 
+static_assert(sizeof(AddrInfo::Key) == 20, "AddrInfo::Key should be packed");
+
+namespace std
+{
+  /// Allows AddrInfos to be used as keys in unordered containers.
+  template<>
+  struct hash<AddrInfo>
+  {
+    size_t operator()(const AddrInfo& ai) const
+    {
+      return ai.hash();
+    }
+  };
+}
+
 /// Overrides Google Test default print method to avoid compatibility issues
 /// with valgrind
 void PrintTo(const AddrInfo& ai, std::ostream* os);
@@ -222,27 +352,47 @@ namespace Utils
       std::string& server,
       std::string& path);
 
+  /// As above, but sets the components to views into the URL rather than
+  /// copying them.
+  bool parse_http_url(
+      boost::string_ref url,
+      boost::string_ref& scheme,
+      boost::string_ref& server,
+      boost::string_ref& path);
+
   std::string url_unescape(const std::string& s);
+
+  /// Unescapes a URL into a caller-provided buffer, which must be at least as
+  /// long as the URL.
+  ///
+  /// @return the length of the unescaped URL.
+  size_t url_unescape(boost::string_ref s, char* out);
+
+  // url_escape and xml_escape return a copy of the input (without building a
+  // new string) if it has nothing to escape.
   std::string quote_string(const std::string& s);
   std::string url_escape(const std::string& s);
 
   std::string xml_escape(const std::string& s);
   inline std::string xml_check_escape(const std::string& s)
   {
-    // XML escaping is inefficient. Only do it if the string contains any
-    // characters that require escaping.
-    if (s.find_first_of("&\"'<>") != std::string::npos)
-    {
-      return xml_escape(s);
-    }
-    else
-    {
-      return s;
-    }
+    // xml_escape already checks whether there is anything to escape first.
+    return xml_escape(s);
   }
 
   std::string strip_uri_scheme(const std::string& uri);
+
+  /// As above, but sets `stripped` to a view into the URI rather than copying
+  /// it.
+  void strip_uri_scheme(boost::string_ref uri, boost::string_ref& stripped);
+
   std::string remove_visual_separators(const std::string& number);
+
+  /// Removes the visual separators from a number into a caller-provided
+  /// buffer, which must be at least as long as the number.
+  ///
+  /// @return the length of the number without the separators.
+  size_t remove_visual_separators(boost::string_ref number, char* out);
   bool is_user_numeric(const std::string& user);
   bool is_user_numeric(const char* user, size_t user_len);
 
@@ -272,6 +422,22 @@ namespace Utils
     return ltrim(rtrim(s));
   }
 
+  // trim a view from both ends
+  inline boost::string_ref trim(boost::string_ref s)
+  {
+    while ((!s.empty()) && (isspace((unsigned char)s.front())))
+    {
+      s.remove_prefix(1);
+    }
+
+    while ((!s.empty()) && (isspace((unsigned char)s.back())))
+    {
+      s.remove_suffix(1);
+    }
+
+    return s;
+  }
+
   // Strip all whitespace from the string (using the same pattern as the trim
   // functions above - note that this modifies the passed in string)
   inline std::string& strip_whitespace(std::string& s)
@@ -282,46 +448,111 @@ namespace Utils
 
   // Helper function to prevent split_string from splitting on the
   // delimiter if it is enclosed by quotes
-  inline size_t find_unquoted(std::string str, char c, size_t offset = 0)
+  inline size_t find_unquoted(boost::string_ref str, char c, size_t offset = 0)
   {
     const char quoter = '"';
-    size_t quote = str.find(quoter, offset);
-    size_t next_quote = str.find(quoter, quote + 1);
-    size_t pos = str.find(c, offset);
+    bool quoted = false;
 
-    while (pos != std::string::npos)
+    for (size_t pos = offset; pos < str.size(); ++pos)
     {
-      if ((quote == std::string::npos) || (pos < quote))
+      if (str[pos] == quoter)
+      {
+        quoted = !quoted;
+      }
+      else if ((str[pos] == c) && (!quoted))
       {
-        // No more quotes
         return pos;
       }
-      else if (pos > quote)
+    }
+
+    // Either the character isn't there, or it only appears after a quote
+    // with no closing quote - call that not found.
+    return std::string::npos;
+  }
+
+  /// Splits a string into tokens one at a time, without copying them. The
+  /// tokens are views into the string, so are only valid while it is.
+  class StringTokenizer
+  {
+  public:
+    StringTokenizer(boost::string_ref str,  //< string to scan
+                    char delimiter,  //< delimiter to use
+                    bool check_for_quotes = false,  //< don't split on quoted delimiters?
+                    bool include_empty_tokens = false) : //< whether to return empty tokens
+      _str(str),
+      _delimiter(delimiter),
+      _check_for_quotes(check_for_quotes),
+      _include_empty_tokens(include_empty_tokens),
+      _pos(0),
+      _done(false)
+    {
+    }
+
+    /// Gets the next token.
+    ///
+    /// @return false if there are no more tokens.
+    bool next(boost::string_ref& token)
+    {
+      while (!_done)
       {
-        // Character appears after first quote
-        if (next_quote == std::string::npos)
+        size_t end = find_delimiter();
+
+        if (end == std::string::npos)
         {
-          // There is no closing quote - call that not found
-          return std::string::npos;
+          token = _str.substr(_pos);
+          _done = true;
         }
-        else if (pos > next_quote)
+        else
         {
-          // The character is not within these quotes
-          // Go again with updated quotes (not updated pos)
-          quote = str.find(quoter, next_quote + 1);
-          next_quote = str.find(quoter, quote + 1);
+          token = _str.substr(_pos, end - _pos);
+          _pos = end + 1;
         }
-        else
+
+        if ((!token.empty()) || (_include_empty_tokens))
         {
-          // Character is quoted. Try to find another
-          pos = str.find(c, next_quote + 1);
-          quote = str.find(quoter, next_quote + 1);
-          next_quote = str.find(quoter, quote + 1);
+          return true;
         }
       }
+
+      return false;
+    }
+
+    /// Gets the rest of the string as the final token, without splitting it
+    /// any further.
+    ///
+    /// @return false if there are no more tokens.
+    bool rest(boost::string_ref& token)
+    {
+      if (_done)
+      {
+        return false;
+      }
+
+      token = _str.substr(_pos);
+      _done = true;
+      return ((!token.empty()) || (_include_empty_tokens));
     }
-    return std::string::npos;
-  }
+
+  private:
+    // Returns the position of the next delimiter, or npos if there isn't one.
+    size_t find_delimiter() const
+    {
+      if (_check_for_quotes)
+      {
+        return find_unquoted(_str, _delimiter, _pos);
+      }
+
+      size_t end = _str.substr(_pos).find(_delimiter);
+      return (end == std::string::npos) ? end : _pos + end;
+    }
+
+    boost::string_ref _str;
+    char _delimiter;
+    bool _check_for_quotes;
+    bool _include_empty_tokens;
+    size_t _pos;
+    bool _done;
+  };
 
   /// Split the string s using delimiter and store the resulting tokens in order
   /// at the end of tokens.
@@ -334,53 +565,27 @@ namespace Utils
                     bool check_for_quotes = false,
                     bool include_empty_tokens = false) //< whether empty tokens are counted
   {
-    std::string token;
-
-    std::string s = str_in;
+    boost::string_ref s(str_in);
     if (trim)
     {
-      Utils::trim(s);
-    }
-
-    size_t token_start_pos = 0;
-    size_t token_end_pos;
-    if (check_for_quotes)
-    {
-      token_end_pos = Utils::find_unquoted(s, delimiter);
-    }
-    else
-    {
-      token_end_pos = s.find(delimiter);
+      s = Utils::trim(s);
     }
 
+    StringTokenizer tokenizer(s, delimiter, check_for_quotes, include_empty_tokens);
+    boost::string_ref token;
     int num_tokens = 0;
 
-    while ((token_end_pos != std::string::npos) &&
-           ((max_tokens == 0) ||
-            (num_tokens < (max_tokens-1))))
+    while (((max_tokens == 0) ||
+            (num_tokens < (max_tokens-1))) &&
+           (tokenizer.next(token)))
     {
-      token = s.substr(token_start_pos, token_end_pos - token_start_pos);
-      if ((token.length() > 0) || (include_empty_tokens))
-      {
-        tokens.push_back(token);
-        num_tokens++;
-      }
-
-      token_start_pos = token_end_pos + 1;
-      if (check_for_quotes)
-      {
-        token_end_pos = Utils::find_unquoted(s, delimiter, token_start_pos);
-      }
-      else
-      {
-        token_end_pos = s.find(delimiter, token_start_pos);
-      }
+      tokens.push_back(std::string(token.data(), token.size()));
+      num_tokens++;
     }
 
-    token = s.substr(token_start_pos);
-    if ((token.length() > 0) || (include_empty_tokens))
+    if (tokenizer.rest(token))
     {
-      tokens.push_back(token);
+      tokens.push_back(std::string(token.data(), token.size()));
     }
   }
 
@@ -393,6 +598,12 @@ namespace Utils
                        std::string& host,
                        int& port);
 
+  // As above, but sets the host to a view into the host/port string rather
+  // than copying it.
+  bool split_host_port(boost::string_ref host_port,
+                       boost::string_ref& host,
+                       int& port);
+
   /// Utility function to parse a target name to see if it is a valid IPv4 or IPv6 address.
   bool parse_ip_target(const std::string& target, IP46Address& address);
 
@@ -458,29 +669,68 @@ namespace Utils
     std::vector<double> _cdf;
   };
 
-  /// Measures time delay in microseconds
+  /// Generates pseudo-random numbers using xoshiro256**, with a generator for
+  /// each thread, so that (unlike rand()) callers on different threads don't
+  /// contend on a lock.  A thread's generator is seeded from /dev/urandom
+  /// (mixed with the time and the thread) the first time it is used, so
+  /// different threads and processes get independent sequences - but
+  /// xoshiro256** isn't a cryptographic generator, so the numbers aren't
+  /// suitable for anything that must be unpredictable.
+  ///
+  /// Instances are interchangeable (they all use the calling thread's
+  /// generator), and can be passed to standard algorithms such as
+  /// std::shuffle.
+  class ThreadRandom
+  {
+  public:
+    typedef uint64_t result_type;
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return UINT64_MAX; }
+
+    result_type operator() () { return next(); }
+
+    /// Returns the next number from the calling thread's generator.
+    static uint64_t next();
+
+    /// Returns a number in the range [0, limit) from the calling thread's
+    /// generator.  limit must be non-zero.
+    static uint32_t below(uint32_t limit)
+    {
+      // Scale the top 32 bits rather than taking a remainder, which avoids a
+      // division.
+      return ((next() >> 32) * limit) >> 32;
+    }
+
+    /// Returns a number in the range [0, 1) from the calling thread's
+    /// generator.
+    static double uniform()
+    {
+      return (next() >> 11) * (1.0 / (UINT64_C(1) << 53));
+    }
+
+  private:
+    static void seed(uint64_t* state);
+
+    static thread_local uint64_t _state[4];
+    static thread_local bool _seeded;
+  };
+
+  /// Measures time delay in microseconds, using FastClock so that starting
+  /// and reading it is cheap.
   class StopWatch
   {
   public:
-    inline StopWatch() : _ok(true), _running(true), _elapsed_us(0) {}
+    inline StopWatch() : _start_ns(0), _ok(true), _running(true), _elapsed_us(0) {}
 
     /// Starts the stop-watch, returning whether it was successful.  It's OK
     /// to ignore the return code - it will also be returned on read() and
     /// stop().
     inline bool start()
     {
-      _ok = (clock_gettime(CLOCK_MONOTONIC, &_start) == 0);
-
-      if (_ok)
-      {
-        _running = true;
-      }
-      else if (!_already_logged)
-      {
-        TRC_ERROR("Failed to get start timestamp: %s", strerror(errno));
-        _already_logged = true;
-      }
-
+      _start_ns = FastClock::now_ns();
+      _ok = true;
+      _running = true;
       return _ok;
     }
 
@@ -510,19 +760,11 @@ namespace Utils
 
       if (_running)
       {
-        struct timespec now;
-        _ok = (clock_gettime(CLOCK_MONOTONIC, &now) == 0);
-
-        if (_ok)
-        {
-          result_us = (now.tv_nsec - _start.tv_nsec) / 1000L +
-                      (now.tv_sec - _start.tv_sec) * 1000000L +
-                      _elapsed_us;
-        }
-        else
-        {
-          TRC_ERROR("Failed to get stop timestamp: %s", strerror(errno));
-        }
+        // The clock may step back very slightly when FastClock switches to
+        // the TSC, so don't let that wrap.
+        uint64_t now_ns = FastClock::now_ns();
+        result_us = ((now_ns > _start_ns) ? (now_ns - _start_ns) / 1000 : 0) +
+                    _elapsed_us;
       }
       else
       {
@@ -546,12 +788,10 @@ namespace Utils
 
 
   private:
-    struct timespec _start;
+    uint64_t _start_ns;
     bool _ok;
     bool _running;
     unsigned long _elapsed_us;
-
-    static bool _already_logged;
   };
 
   // Unique number generator.  Uses the current timestamp to generate deployment
@@ -618,19 +858,19 @@ namespace Utils
   };
 
   // Takes a string and reports what type of IP address it is
-  IPAddressType parse_ip_address(std::string address);
+  IPAddressType parse_ip_address(boost::string_ref address);
 
   // Takes an IP address and returns it suitable for use in a URI,
   // i.e, an IPv6 address will be returned in brackets.
   // If the optional port is passed, this will be appended if the address
   // doesn't include a port.
-  std::string uri_address(std::string address, int default_port = 0);
+  std::string uri_address(const std::string& address, int default_port = 0);
 
   // Removes the brackets from an IPv6 address - e.g. [::1] -> ::1
   std::string remove_brackets_from_ip(std::string address);
 
   // Does the passed in address have brackets?
-  bool is_bracketed_address(const std::string& address);
+  bool is_bracketed_address(boost::string_ref address);
 
   // Calculates a diameter timeout from the target latency.
   void calculate_diameter_timeout(int target_latency_us,
@@ -656,6 +896,48 @@ namespace Utils
   /// important that instances are destroyed in the opposite order they are
   /// created in. This means that hooks should only be stored on the stack and
   /// not on the heap.
+  /// The description of an I/O operation, which is only formatted if it is
+  /// needed - that is, if any IOHooks are registered on the thread.  It is
+  /// formatted at most once, however many hooks there are.
+  ///
+  /// The description is built by a callable returning a std::string, which
+  /// must outlive this object (the CW_IO_STARTS macro takes care of this).
+  class IODescription
+  {
+  public:
+    template <class F>
+    explicit IODescription(const F& fn) :
+      _fn(&fn),
+      _format(&format_fn<F>),
+      _formatted(false)
+    {
+    }
+
+    /// @return the description, formatting it if it hasn't been already.
+    const std::string& str()
+    {
+      if (!_formatted)
+      {
+        _str = _format(_fn);
+        _formatted = true;
+      }
+
+      return _str;
+    }
+
+  private:
+    template <class F>
+    static std::string format_fn(const void* fn)
+    {
+      return (*(const F*)fn)();
+    }
+
+    const void* _fn;
+    std::string (*_format)(const void*);
+    bool _formatted;
+    std::string _str;
+  };
+
   class IOHook
   {
   public:
@@ -682,11 +964,28 @@ namespace Utils
     /// @param reason - The reason for the I/O operation.
     static void io_completes(const std::string& reason);
 
+    /// As above, but the reason is only formatted if there are any hooks.
+    static void io_starts(IODescription& reason)
+    {
+      if (!_hooks.empty())
+      {
+        io_starts(reason.str());
+      }
+    }
+
+    static void io_completes(IODescription& reason)
+    {
+      if (!_hooks.empty())
+      {
+        io_completes(reason.str());
+      }
+    }
+
     /// No-op implementations of the two callbacks. This is useful for users of
     /// this class that don't want to do anything on one or other of the
     /// callbacks.
-    static void NOOP_ON_START(const std::string& reason) {};
-    static void NOOP_ON_COMPLETE(const std::string& reason) {};
+    static void NOOP_ON_START(const std::string& /*reason*/) {}
+    static void NOOP_ON_COMPLETE(const std::string& /*reason*/) {}
 
   private:
     static thread_local std::vector<IOHook*> _hooks;
@@ -721,6 +1020,11 @@ namespace Utils
     /// @param reason - The reason for the I/O operation.
     static void io_completes(const std::string& reason);
 
+    /// As above, for callers that don't have the reason to hand (the
+    /// IOMonitor doesn't use it).
+    static void io_starts() { _overt_io_depth++; }
+    static void io_completes() { _overt_io_depth--; }
+
     /// @return whether the thread is currently doing overt IO i.e. whether it
     /// has called CW_IO_STARTS (without a matching call to CW_IO_COMPLETES).
     static bool thread_doing_overt_io();
@@ -743,7 +1047,10 @@ namespace Utils
 } // namespace Utils
 
 /// Helper macros to make it easier to invoke an I/O hook, and that means the
-/// caller does not need to duplicate the reason string.
+/// caller does not need to duplicate the reason string.  The reason is only
+/// evaluated if an IOHook is registered on the thread, so it can be built
+/// from the request (e.g. "HTTP request to " + url) without costing anything
+/// when there are no hooks.
 ///
 /// Example:
 ///
@@ -754,13 +1061,14 @@ namespace Utils
 ///     CW_IO_COMPLETES()
 #define CW_IO_STARTS(REASON)                                                   \
   {                                                                            \
-    std::string description = REASON;                                          \
-    Utils::IOMonitor::io_starts(description);                                  \
+    auto describe_io = [&]() -> std::string { return REASON; };                \
+    Utils::IODescription description(describe_io);                             \
+    Utils::IOMonitor::io_starts();                                             \
     Utils::IOHook::io_starts(description);
 
 #define CW_IO_COMPLETES()                                                      \
     Utils::IOHook::io_completes(description);                                  \
-    Utils::IOMonitor::io_completes(description);                               \
+    Utils::IOMonitor::io_completes();                                          \
   }
 
 /// Helper macro to flag that a thread must call CW_IO_(STARTS|COMPLETES) when
@@ -0,0 +1,109 @@
+/**
+ * @file versioned_config.h  Holder for configuration that is replaced while
+ * it is in use.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef VERSIONED_CONFIG_H__
+#define VERSIONED_CONFIG_H__
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+
+/// Holds the current version of some configuration, which request threads
+/// read while a reload replaces it.
+///
+/// The configuration is immutable once published.  A reload builds the new
+/// configuration off to the side and then publishes it, and readers get a
+/// snapshot that stays valid for as long as they hold it, however many times
+/// the configuration is replaced meanwhile.  Readers never wait for a reload.
+///
+/// Each thread caches the last snapshot it read (for each type of
+/// configuration), so a read only touches the shared pointer when a new
+/// version has been published since that thread's last read.  This means
+/// an old version may be kept alive by an idle thread until it next reads
+/// the configuration.
+template <class T>
+class VersionedConfig
+{
+public:
+  typedef std::shared_ptr<const T> Snapshot;
+
+  VersionedConfig(Snapshot initial = Snapshot()) :
+    _current(initial),
+    _version(next_version())
+  {
+  }
+
+  /// @return the current configuration.
+  Snapshot get() const
+  {
+    uint64_t version = _version.load(std::memory_order_acquire);
+    ThreadCache& cache = thread_cache();
+
+    if ((cache.owner != this) || (cache.version != version))
+    {
+      cache.snapshot = std::atomic_load(&_current);
+      cache.owner = this;
+      cache.version = version;
+    }
+
+    return cache.snapshot;
+  }
+
+  /// Replace the configuration.  Readers that already have a snapshot carry
+  /// on using it.
+  void publish(Snapshot config)
+  {
+    std::atomic_store(&_current, config);
+    _version.store(next_version(), std::memory_order_release);
+  }
+
+  /// @return the version of the current configuration, which changes each
+  ///         time a configuration is published.
+  uint64_t version() const
+  {
+    return _version.load(std::memory_order_acquire);
+  }
+
+private:
+  // A thread's last snapshot, and the holder and version it came from.
+  struct ThreadCache
+  {
+    const VersionedConfig* owner;
+    uint64_t version;
+    Snapshot snapshot;
+  };
+
+  static ThreadCache& thread_cache()
+  {
+    static thread_local ThreadCache cache = {NULL, 0, Snapshot()};
+    return cache;
+  }
+
+  // Versions are unique across every holder of this type, so a thread's cache
+  // can't mistake a new holder (at the address of a deleted one) for the one
+  // it last read.
+  static uint64_t next_version()
+  {
+    static std::atomic<uint64_t> versions(0);
+    return versions.fetch_add(1, std::memory_order_relaxed) + 1;
+  }
+
+  Snapshot _current;
+  std::atomic<uint64_t> _version;
+
+  // Don't implement the following, to avoid copies of this instance.
+  VersionedConfig(VersionedConfig const&);
+  void operator=(VersionedConfig const&);
+};
+
+#endif
@@ -12,16 +12,66 @@
 #ifndef WILDCARD_UTILS_H_
 #define WILDCARD_UTILS_H_
 
+#include <memory>
 #include <string>
 
+#include <boost/regex.hpp>
+#include <boost/utility/string_ref.hpp>
+
 namespace WildcardUtils
 {
   // Checks if a string represents a wildcard URI.
-  bool is_wildcard_uri(const std::string& possible_wildcard);
+  bool is_wildcard_uri(boost::string_ref possible_wildcard);
+
+  // Checks if two URIs match, including wildcard checking.  Wildcards are
+  // compiled the first time they are seen, and the compiled forms cached.
+  bool check_users_equivalent(boost::string_ref wildcard_user,
+                              boost::string_ref specific_user);
+
+  /// A wildcard user of the form
+  ///
+  ///   <non wildcard part>!<regex>!<non wildcard part>
+  ///
+  /// split into its parts, so that it can be matched against many specific
+  /// users without being re-scanned.  The regex is only compiled if it needs
+  /// to be - one without any special characters is compared directly, and
+  /// ".*" matches anything.
+  class CompiledWildcard
+  {
+  public:
+    /// @param wildcard_user the wildcard user, without any parameters.
+    CompiledWildcard(boost::string_ref wildcard_user);
+
+    /// @return whether the user is a wildcard at all.
+    bool is_wildcard() const { return (_type != NOT_WILDCARD); }
+
+    /// Checks whether a specific user (without any parameters) matches the
+    /// wildcard.
+    bool matches(boost::string_ref specific_user) const;
+
+    /// @return roughly how much memory this uses.
+    size_t size() const;
+
+  private:
+    enum Type
+    {
+      NOT_WILDCARD,
+      ANY,
+      LITERAL,
+      REGEX,
+      INVALID_REGEX
+    };
+
+    std::string _prefix;
+    std::string _suffix;
+    std::string _middle;
+    Type _type;
+    boost::regex _regex;
+  };
 
-  // Checks if two URIs match, including wildcard checking.
-  bool check_users_equivalent(const std::string& wildcard_user,
-                              const std::string& specific_user);
+  /// Gets the compiled form of a wildcard user (without any parameters),
+  /// from the cache if possible.
+  std::shared_ptr<const CompiledWildcard> compile(boost::string_ref wildcard_user);
 
 } // namespace WildcardUtils
 
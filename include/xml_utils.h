@@ -18,22 +18,62 @@
 #include <vector>
 #include <memory>
 
+#include <boost/utility/string_ref.hpp>
+
 using namespace rapidxml;
 
 namespace XMLUtils
 {
   // Utility functions to parse out XML structures
   long parse_integer(xml_node<>* node,
-                     std::string description,
+                     const std::string& description,
                      long min_value,
                      long max_value);
   bool parse_bool(xml_node<>* node,
-                  std::string description);
+                  const std::string& description);
   std::string get_first_node_value(xml_node<>* node,
-                                   std::string name);
+                                   boost::string_ref name);
   std::string get_text_or_cdata(xml_node<>* node);
   bool does_child_node_exist(xml_node<>* parent_node,
-                             std::string child_node_name);
+                             boost::string_ref child_node_name);
+
+  // As above, but set `value` to a view of the node's value in the document
+  // rather than copying it.
+  void get_first_node_value(xml_node<>* node,
+                            boost::string_ref name,
+                            boost::string_ref& value);
+  void get_text_or_cdata(xml_node<>* node, boost::string_ref& value);
+
+  /// An XML document to parse into, which belongs to the calling thread and
+  /// is reused from one parse to the next.  An xml_document<> has a 64KB
+  /// memory pool built in, so this saves initialising one per parse (and
+  /// keeps it off the stack), and the pool is reset rather than freed when
+  /// the PooledDocument is destroyed.  Combined with the string_ref accessors
+  /// above, parsing typical documents then doesn't allocate at all.
+  ///
+  /// If the thread's document is already in use (because PooledDocuments are
+  /// nested) this uses a document of its own instead.  PooledDocuments must
+  /// be destroyed on the thread that created them.
+  ///
+  ///   XMLUtils::PooledDocument xml;
+  ///   xml.doc().parse<0>(buffer);   // may throw rapidxml::parse_error
+  ///   xml_node<>* root = xml.doc().first_node("Root");
+  class PooledDocument
+  {
+  public:
+    PooledDocument();
+    ~PooledDocument();
+
+    xml_document<>& doc() { return *_doc; }
+
+  private:
+    std::unique_ptr<xml_document<>> _own;
+    xml_document<>* _doc;
+
+    // Don't implement the following, to avoid copies of this instance.
+    PooledDocument(PooledDocument const&);
+    void operator=(PooledDocument const&);
+  };
 }
 
 /// Exception thrown internally during XML parsing.
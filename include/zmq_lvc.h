@@ -19,6 +19,20 @@
 
 #define ZMQ_NEW_SUBSCRIPTION_MARKER 1
 
+// Subscribing to this topic requests every cached statistic in one reply.
+// The reply has three parts - the topic, "OK", and a body that encodes each
+// statistic as:
+//
+//   part count              (2 bytes, network byte order)
+//   for each part:
+//     length                (4 bytes, network byte order)
+//     data                  (length bytes)
+//
+// The parts of each statistic are those it is published with, so start with
+// its name and status.  Statistics with no cached value are encoded as just
+// their name and "OK".
+#define ZMQ_DUMP_ALL_TOPIC "_dump_all"
+
 // This folder has to exist and be writable by the running process.
 #define ZMQ_IPC_FOLDER_PATH "/var/run/clearwater/stats/"
 
@@ -52,6 +66,7 @@ public:
 private:
   void clear_cache(void *entry);
   void replay_cache(void *entry);
+  void dump_cache();
 
   void **_subscriber;
   void *_publisher;
@@ -0,0 +1,88 @@
+# Microbenchmarks for the cpp-common primitives, using Google Benchmark, and
+# load harnesses for HttpStack and HttpClient, the DNS resolvers and the
+# memcached store.
+#
+# Build with
+#   ROOT=${ROOT} MODULE_DIR=${MODULE_DIR} BUILD_DIR=${BUILD_DIR} make -f ${MODULE_DIR}/cpp-common/makefiles/cpp-common-bench.mk
+# and run the "bench_json" target to write the results as JSON (to
+# ${BUILD_DIR}/cpp_common_bench.json), which can be diffed between builds with
+# Google Benchmark's compare.py.  BENCH_ARGS is passed to the benchmarks, e.g.
+# BENCH_ARGS=--benchmark_filter=Eventq to run a subset.
+#
+# The load harnesses are run by hand (see --help), and print their results as
+# lines of JSON.
+TARGETS := cpp_common_bench http_load_harness dns_load_harness memcached_load_harness
+
+# The benchmarks link against all of cpp-common, apart from the alarm header
+# tool, which has its own main().
+CPP_COMMON_SOURCES := $(filter-out alarm_header.cpp,$(notdir $(wildcard ${MODULE_DIR}/cpp-common/src/*.cpp)))
+
+cpp_common_bench_SOURCES := eventq_bench.cpp \
+                            cache_bench.cpp \
+                            primitives_bench.cpp \
+                            snmp_bench.cpp \
+                            diameter_bench.cpp \
+                            ${CPP_COMMON_SOURCES}
+
+cpp_common_bench_CPPFLAGS := -I${MODULE_DIR}/cpp-common/include \
+                             -I${MODULE_DIR}/rapidjson/include \
+                             -I${MODULE_DIR}/sas-client/include \
+                             -O2 \
+                             -DNDEBUG \
+                             -DDIAMETER_BENCH_CONF=\"${MODULE_DIR}/cpp-common/bench/diameter_bench.conf\"
+
+cpp_common_bench_LDFLAGS := -lbenchmark_main \
+                            -lbenchmark \
+                            -lpthread \
+                            -lrt \
+                            -lcares \
+                            -lcurl \
+                            -levent \
+                            -levent_pthreads \
+                            -levhtp \
+                            -lmemcached \
+                            -lzmq \
+                            -lboost_regex \
+                            -lboost_system \
+                            -lthrift \
+                            -lcassandra \
+                            -lfdcore \
+                            -lfdproto \
+                            -lsas \
+                            -llz4 \
+                            -lz \
+                            $(shell net-snmp-config --netsnmp-agent-libs)
+
+http_load_harness_SOURCES := http_load_harness.cpp \
+                             ${CPP_COMMON_SOURCES}
+
+http_load_harness_CPPFLAGS := ${cpp_common_bench_CPPFLAGS} \
+                              -I${MODULE_DIR}/cpp-common/test_utils
+
+http_load_harness_LDFLAGS := $(filter-out -lbenchmark_main -lbenchmark,${cpp_common_bench_LDFLAGS})
+
+dns_load_harness_SOURCES := dns_load_harness.cpp \
+                            ${CPP_COMMON_SOURCES}
+
+dns_load_harness_CPPFLAGS := ${cpp_common_bench_CPPFLAGS}
+
+dns_load_harness_LDFLAGS := ${http_load_harness_LDFLAGS}
+
+memcached_load_harness_SOURCES := memcached_load_harness.cpp \
+                                  ${CPP_COMMON_SOURCES}
+
+memcached_load_harness_CPPFLAGS := ${cpp_common_bench_CPPFLAGS}
+
+memcached_load_harness_LDFLAGS := ${http_load_harness_LDFLAGS}
+
+# Add cpp-common/src and cpp-common/bench as VPATH so build will find modules
+# there.
+VPATH = ${MODULE_DIR}/cpp-common/src:${MODULE_DIR}/cpp-common/bench
+
+include ${ROOT}/build-infra/cpp.mk
+
+.PHONY: bench_json
+bench_json: ${BUILD_DIR}/bin/cpp_common_bench
+	${BUILD_DIR}/bin/cpp_common_bench --benchmark_out=${BUILD_DIR}/cpp_common_bench.json \
+	                                  --benchmark_out_format=json \
+	                                  ${BENCH_ARGS}
@@ -12,6 +12,7 @@
 // C++ re-implementation of Ruby cw_stat tool.
 // Runs significantly faster - useful on heavily-loaded cacti systems.
 // Usage: cw_stat <service> <statname>
+//        cw_stat <service> --all
 // Compile: g++ -o cw_stat cw_stat.cpp -lzmq
 
 #include <string>
@@ -20,8 +21,13 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <arpa/inet.h>
 #include <zmq.h>
 
+// The topic that requests every statistic in one reply.  This must match
+// ZMQ_DUMP_ALL_TOPIC in zmq_lvc.h.
+#define DUMP_ALL_TOPIC "_dump_all"
+
 // Gets a block of messages from the specified host, for the specified
 // statistic.
 // Return true on success, false on failure.
@@ -246,22 +252,65 @@ void render_astaire_connections(std::vector<std::string>& msgs)
   }
 }
 
-int main(int argc, char** argv)
+// Render every value of a statistic that this program doesn't know the
+// format of.
+void render_raw_stat(std::vector<std::string>& msgs)
 {
-  // Check arguments.
-  if (argc != 3)
+  for (int msg_idx = 2; msg_idx < (int)msgs.size(); msg_idx++)
   {
-    fprintf(stderr, "Usage: %s <service> <statname>\n", argv[0]);
-    return 1;
+    printf("value[%d]:%s\n", msg_idx - 2, msgs[msg_idx].c_str());
   }
+}
 
-  // Get messages from the server.
-  std::vector<std::string> msgs;
-  if (!get_msgs(argv[1], argv[2], msgs))
+// Split the body of a dump of every statistic into the messages of each
+// statistic.  See ZMQ_DUMP_ALL_TOPIC in zmq_lvc.h for the encoding.
+// Return true on success, false if the dump is malformed.
+bool decode_dump(const std::string& dump,
+                 std::vector<std::vector<std::string> >& stats)
+{
+  size_t offset = 0;
+
+  while (offset < dump.size())
   {
-    return 2;
+    uint16_t count_n;
+    if (dump.size() - offset < sizeof(count_n))
+    {
+      return false;
+    }
+    memcpy(&count_n, dump.data() + offset, sizeof(count_n));
+    offset += sizeof(count_n);
+
+    std::vector<std::string> msgs;
+    for (int ii = 0; ii < ntohs(count_n); ii++)
+    {
+      uint32_t length_n;
+      if (dump.size() - offset < sizeof(length_n))
+      {
+        return false;
+      }
+      memcpy(&length_n, dump.data() + offset, sizeof(length_n));
+      offset += sizeof(length_n);
+
+      uint32_t length = ntohl(length_n);
+      if (dump.size() - offset < length)
+      {
+        return false;
+      }
+      msgs.push_back(dump.substr(offset, length));
+      offset += length;
+    }
+
+    stats.push_back(msgs);
   }
 
+  return true;
+}
+
+// Render a statistic, given the messages it was published with.  If
+// render_unknown is set, statistics this program doesn't know the format of
+// are rendered as a list of values, rather than reported as errors.
+void render_stat(std::vector<std::string>& msgs, bool render_unknown)
+{
   // The messages start with the statistic name and "OK" (hopefully).
   //
   // Note that a homestead provisioning node can in principle have multiple
@@ -321,11 +370,19 @@ int main(int argc, char** argv)
     {
       render_astaire_connections(msgs);
     }
+    else if (render_unknown)
+    {
+      render_raw_stat(msgs);
+    }
     else
     {
       fprintf(stderr, "Unknown statistic \"%s\"\n", msgs[0].c_str());
     }
   }
+  else if (msgs.empty())
+  {
+    fprintf(stderr, "Empty response\n");
+  }
   else if (msgs.size() == 1)
   {
     fprintf(stderr, "Incomplete response \"%s\"\n", msgs[0].c_str());
@@ -334,6 +391,53 @@ int main(int argc, char** argv)
   {
     fprintf(stderr, "Error response \"%s\" for statistic \"%s\"\n", msgs[1].c_str(), msgs[0].c_str());
   }
+}
+
+int main(int argc, char** argv)
+{
+  // Check arguments.
+  if (argc != 3)
+  {
+    fprintf(stderr, "Usage: %s <service> <statname>\n", argv[0]);
+    fprintf(stderr, "       %s <service> --all\n", argv[0]);
+    return 1;
+  }
+
+  bool all = (strcmp(argv[2], "--all") == 0);
+  char dump_all_topic[] = DUMP_ALL_TOPIC;
+
+  // Get messages from the server.
+  std::vector<std::string> msgs;
+  if (!get_msgs(argv[1], all ? dump_all_topic : argv[2], msgs))
+  {
+    return 2;
+  }
+
+  if (!all)
+  {
+    render_stat(msgs, false);
+    return 0;
+  }
+
+  // Every statistic arrives in one reply.  Render each in turn, headed by its
+  // name.
+  std::vector<std::vector<std::string> > stats;
+  if ((msgs.size() < 3) ||
+      (msgs[1] != "OK") ||
+      (!decode_dump(msgs[2], stats)))
+  {
+    fprintf(stderr, "Invalid response to request for all statistics\n");
+    return 2;
+  }
+
+  for (size_t ii = 0; ii < stats.size(); ii++)
+  {
+    if (!stats[ii].empty())
+    {
+      printf("[%s]\n", stats[ii][0].c_str());
+    }
+    render_stat(stats[ii], true);
+  }
 
   return 0;
 }
@@ -57,30 +57,66 @@ BaseAddrIterator* ARecordResolver::resolve_iter(const std::string& host,
             host.c_str(), port, _address_family);
 
   port = (port != 0) ? port : _default_port;
-  AddrInfo ai;
 
-  if (Utils::parse_ip_target(host, ai.address))
+  if (!ip_address_iter(host, port, trail, allowed_host_state, addr_it))
   {
-    // The name is already an IP address so no DNS resolution is possible.
-    TRC_DEBUG("Target is an IP address");
-    ai.port = port;
-    ai.transport = TRANSPORT;
+    int dummy_ttl = 0;
+    addr_it = a_resolve_iter(
+      host, _address_family, port, TRANSPORT, dummy_ttl, trail, allowed_host_state);
+  }
 
-    std::vector<AddrInfo> targets;
+  return addr_it;
+}
 
-    if (select_address(ai, trail, allowed_host_state))
-    {
-      targets.push_back(ai);
-    }
+void ARecordResolver::resolve_iter_async(const std::string& host,
+                                         int port,
+                                         SAS::TrailId trail,
+                                         int allowed_host_state,
+                                         AddrIteratorCallback callback)
+{
+  BaseAddrIterator* addr_it;
+
+  TRC_DEBUG("ARecordResolver::resolve_iter_async for host %s, port %d, family %d",
+            host.c_str(), port, _address_family);
 
-    addr_it = new SimpleAddrIterator(targets);
+  port = (port != 0) ? port : _default_port;
+
+  if (ip_address_iter(host, port, trail, allowed_host_state, addr_it))
+  {
+    callback(addr_it);
   }
   else
   {
-    int dummy_ttl = 0;
-    addr_it = a_resolve_iter(
-      host, _address_family, port, TRANSPORT, dummy_ttl, trail, allowed_host_state);
+    a_resolve_iter_async(
+      host, _address_family, port, TRANSPORT, trail, allowed_host_state, callback);
   }
+}
 
-  return addr_it;
+bool ARecordResolver::ip_address_iter(const std::string& host,
+                                      int port,
+                                      SAS::TrailId trail,
+                                      int allowed_host_state,
+                                      BaseAddrIterator*& addr_it)
+{
+  AddrInfo ai;
+
+  if (!Utils::parse_ip_target(host, ai.address))
+  {
+    return false;
+  }
+
+  // The name is already an IP address so no DNS resolution is possible.
+  TRC_DEBUG("Target is an IP address");
+  ai.port = port;
+  ai.transport = TRANSPORT;
+
+  std::vector<AddrInfo> targets;
+
+  if (select_address(ai, trail, allowed_host_state))
+  {
+    targets.push_back(ai);
+  }
+
+  addr_it = new SimpleAddrIterator(targets);
+  return true;
 }
@@ -11,16 +11,65 @@
 
 #include <stdio.h>
 
+#include <algorithm>
+#include <string>
+
 #include "accesslogger.h"
 
-AccessLogger::AccessLogger(const std::string& directory)
+const unsigned int AccessLogger::DEFAULT_BUFFER_LINES;
+const long AccessLogger::DRAIN_INTERVAL_MS;
+
+AccessLogger::AccessLogger(const std::string& directory,
+                           unsigned int buffer_lines) :
+  _buffer_lines(std::max(buffer_lines, 1u)),
+  _rings(),
+  _discards(0),
+  _reported_discards(0),
+  _terminated(false)
 {
+  // The lines are timestamped when they are logged rather than when they are
+  // written, and each batch is flushed as it is written.
   _logger = new Logger(directory, std::string("access"));
-  _logger->set_flags(Logger::ADD_TIMESTAMPS|Logger::FLUSH_ON_WRITE);
+  _logger->set_flags(Logger::FLUSH_ON_WRITE);
+
+  pthread_key_create(&_ring_key, thread_ring_destructor);
+  pthread_mutex_init(&_rings_lock, NULL);
+  pthread_mutex_init(&_drain_lock, NULL);
+  pthread_mutex_init(&_terminate_lock, NULL);
+
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&_terminate_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  pthread_create(&_drain_thread, NULL, drain_thread_fn, this);
 }
 
 AccessLogger::~AccessLogger()
 {
+  pthread_mutex_lock(&_terminate_lock);
+  _terminated = true;
+  pthread_cond_signal(&_terminate_cond);
+  pthread_mutex_unlock(&_terminate_lock);
+  pthread_join(_drain_thread, NULL);
+
+  // Stop the threads' rings being passed to the destructor when they exit,
+  // then write whatever is left and free the rings.
+  pthread_key_delete(_ring_key);
+  drain();
+
+  for (std::vector<Ring*>::iterator it = _rings.begin();
+       it != _rings.end();
+       ++it)
+  {
+    delete *it;
+  }
+
+  pthread_cond_destroy(&_terminate_cond);
+  pthread_mutex_destroy(&_terminate_lock);
+  pthread_mutex_destroy(&_drain_lock);
+  pthread_mutex_destroy(&_rings_lock);
   delete _logger;
 }
 
@@ -29,13 +78,205 @@ void AccessLogger::log(const std::string& uri,
                        int rc,
                        unsigned long latency_us)
 {
-  char buf[BUFFER_SIZE];
-  snprintf(buf, sizeof(buf),
-           "%d %s %s %ld.%6.6ld seconds\n",
-           rc,
-           method.c_str(),
-           uri.c_str(),
-           latency_us / 1000000,
-           latency_us % 1000000);
-  _logger->write(buf);
+  Ring* ring;
+  Entry* entry = start_entry(ring);
+
+  if (entry != NULL)
+  {
+    snprintf(entry->line, sizeof(entry->line),
+             "%d %s %s %ld.%6.6ld seconds\n",
+             rc,
+             method.c_str(),
+             uri.c_str(),
+             latency_us / 1000000,
+             latency_us % 1000000);
+    commit_entry(ring);
+  }
+}
+
+void AccessLogger::log_latency_histogram(const std::string& route,
+                                         const LatencyHistogram::Snapshot& snapshot)
+{
+  Ring* ring;
+  Entry* entry = start_entry(ring);
+
+  if (entry != NULL)
+  {
+    snprintf(entry->line, sizeof(entry->line),
+             "LATENCY %s count=%lu p50=%luus p90=%luus p99=%luus p999=%luus\n",
+             route.empty() ? "-" : route.c_str(),
+             (unsigned long)snapshot.count,
+             (unsigned long)snapshot.percentile_us(50),
+             (unsigned long)snapshot.percentile_us(90),
+             (unsigned long)snapshot.percentile_us(99),
+             (unsigned long)snapshot.percentile_us(99.9));
+    commit_entry(ring);
+  }
+}
+
+AccessLogger::Entry* AccessLogger::start_entry(Ring*& ring)
+{
+  ring = thread_ring();
+  uint64_t head = ring->head.load(std::memory_order_relaxed);
+
+  if (head - ring->tail.load(std::memory_order_acquire) >= ring->entries.size())
+  {
+    // The ring is full, so drop the line rather than wait.
+    ++_discards;
+    return NULL;
+  }
+
+  Entry* entry = &ring->entries[head % ring->entries.size()];
+  clock_gettime(CLOCK_REALTIME, &entry->time);
+  return entry;
+}
+
+void AccessLogger::commit_entry(Ring* ring)
+{
+  ring->head.store(ring->head.load(std::memory_order_relaxed) + 1,
+                   std::memory_order_release);
+}
+
+AccessLogger::Ring* AccessLogger::thread_ring()
+{
+  Ring* ring = (Ring*)pthread_getspecific(_ring_key);
+
+  if (ring == NULL)
+  {
+    ring = new Ring(this, _buffer_lines);
+    pthread_setspecific(_ring_key, ring);
+
+    pthread_mutex_lock(&_rings_lock);
+    _rings.push_back(ring);
+    pthread_mutex_unlock(&_rings_lock);
+  }
+
+  return ring;
+}
+
+void AccessLogger::thread_ring_destructor(void* ring_ptr)
+{
+  // The ring may still hold lines, so leave it to be freed once it's been
+  // drained.
+  ((Ring*)ring_ptr)->closed = true;
+}
+
+void AccessLogger::flush()
+{
+  drain();
+}
+
+void AccessLogger::drain()
+{
+  pthread_mutex_lock(&_drain_lock);
+
+  pthread_mutex_lock(&_rings_lock);
+  std::vector<Ring*> rings = _rings;
+  pthread_mutex_unlock(&_rings_lock);
+
+  std::string batch;
+  std::vector<Ring*> finished;
+
+  for (std::vector<Ring*>::iterator it = rings.begin();
+       it != rings.end();
+       ++it)
+  {
+    Ring* ring = *it;
+
+    // Check whether the ring is closed before reading the lines, so that we
+    // don't miss any added just before its thread exited.
+    bool closed = ring->closed.load();
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+
+    for (; tail != head; ++tail)
+    {
+      const Entry& entry = ring->entries[tail % ring->entries.size()];
+
+      timestamp_t ts;
+      struct timespec time = entry.time;
+      char timestamp[100];
+      Logger::get_timestamp(ts, time);
+      Logger::format_timestamp(ts, timestamp, sizeof(timestamp));
+
+      batch.append(timestamp);
+      batch.append(" ");
+      batch.append(entry.line);
+    }
+
+    ring->tail.store(tail, std::memory_order_release);
+
+    if (closed)
+    {
+      finished.push_back(ring);
+    }
+  }
+
+  uint64_t discards = _discards.load();
+
+  if (discards != _reported_discards)
+  {
+    char discard_msg[100];
+    snprintf(discard_msg, sizeof(discard_msg),
+             "%lu access logs discarded\n",
+             (unsigned long)(discards - _reported_discards));
+    batch.append(discard_msg);
+    _reported_discards = discards;
+  }
+
+  if (!batch.empty())
+  {
+    _logger->write(batch.c_str());
+  }
+
+  if (!finished.empty())
+  {
+    pthread_mutex_lock(&_rings_lock);
+
+    for (std::vector<Ring*>::iterator it = finished.begin();
+         it != finished.end();
+         ++it)
+    {
+      _rings.erase(std::remove(_rings.begin(), _rings.end(), *it), _rings.end());
+      delete *it;
+    }
+
+    pthread_mutex_unlock(&_rings_lock);
+  }
+
+  pthread_mutex_unlock(&_drain_lock);
+}
+
+void* AccessLogger::drain_thread_fn(void* logger)
+{
+  ((AccessLogger*)logger)->drain_thread_fn();
+  return NULL;
+}
+
+void AccessLogger::drain_thread_fn()
+{
+  struct timespec end_wait;
+  clock_gettime(CLOCK_MONOTONIC, &end_wait);
+
+  pthread_mutex_lock(&_terminate_lock);
+
+  while (!_terminated)
+  {
+    end_wait.tv_nsec += DRAIN_INTERVAL_MS * 1000000;
+    end_wait.tv_sec += end_wait.tv_nsec / 1000000000;
+    end_wait.tv_nsec %= 1000000000;
+
+    pthread_cond_timedwait(&_terminate_cond, &_terminate_lock, &end_wait);
+
+    if (!_terminated)
+    {
+      // Don't hold the lock while writing, so that the destructor isn't held
+      // up.
+      pthread_mutex_unlock(&_terminate_lock);
+      drain();
+      pthread_mutex_lock(&_terminate_lock);
+    }
+  }
+
+  pthread_mutex_unlock(&_terminate_lock);
 }
@@ -9,6 +9,7 @@
  * Metaswitch Networks in a separate written agreement.
  */
 
+#include <algorithm>
 #include <vector>
 
 #include "accumulator.h"
@@ -16,25 +17,26 @@
 /// Accumulate a sample into our results.
 void Accumulator::accumulate(unsigned long sample)
 {
-  // Update the basic counters and samples.
-  _current._n++;
-  _current._sigma += sample;
-  _current._sigma_squared += sample * sample;
+  // Update the basic counters and samples in this thread's shard.
+  Shard& shard = _current._shards[shard_index()];
+  shard._n.fetch_add(1, std::memory_order_relaxed);
+  shard._sigma.fetch_add(sample, std::memory_order_relaxed);
+  shard._sigma_squared.fetch_add(sample * sample, std::memory_order_relaxed);
 
   // Update the low- and high-water marks.  In each case, we get the current
   // value, decide whether a change is required and then atomically swap it
   // if so, repeating if it was changed in the meantime.  Note that
   // compare_exchange_weak loads the current value into the expected value
   // parameter (lwm or hwm below) if the compare fails.
-  uint_fast64_t lwm = _current._lwm.load();
+  uint_fast64_t lwm = shard._lwm.load(std::memory_order_relaxed);
   while ((sample < lwm) &&
-	 (!_current._lwm.compare_exchange_weak(lwm, sample)))
+	 (!shard._lwm.compare_exchange_weak(lwm, sample)))
   {
     // Do nothing.
   }
-  uint_fast64_t hwm = _current._hwm.load();
+  uint_fast64_t hwm = shard._hwm.load(std::memory_order_relaxed);
   while ((sample > hwm) &&
-	 (!_current._hwm.compare_exchange_weak(hwm, sample)))
+	 (!shard._hwm.compare_exchange_weak(hwm, sample)))
   {
     // Do nothing.
   }
@@ -69,11 +71,14 @@ void Accumulator::reset()
   // Get the timestamp now.
   _current._timestamp_us.store(get_timestamp_us());
   // Reset everything else to 0.
-  _current._n.store(0);
-  _current._sigma.store(0);
-  _current._sigma_squared.store(0);
-  _current._lwm.store(MAX_UINT_FAST64);
-  _current._hwm.store(0);
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    _current._shards[ii]._n.store(0);
+    _current._shards[ii]._sigma.store(0);
+    _current._shards[ii]._sigma_squared.store(0);
+    _current._shards[ii]._lwm.store(MAX_UINT_FAST64);
+    _current._shards[ii]._hwm.store(0);
+  }
   _last._n = 0;
   _last._mean = 0;
   _last._variance = 0;
@@ -85,10 +90,24 @@ void Accumulator::reset()
 /// them as the last set of statistics.
 void Accumulator::read(uint_fast64_t period_us)
 {
-  // Read the basic statistics, and replace them with 0.
-  uint_fast64_t n = _current._n.exchange(0);
-  uint_fast64_t sigma = _current._sigma.exchange(0);
-  uint_fast64_t sigma_squared = _current._sigma_squared.exchange(0);
+  // Read the basic statistics from each shard, and replace them with 0.
+  // Merge the low- and high-water marks at the same time.
+  uint_fast64_t n = 0;
+  uint_fast64_t sigma = 0;
+  uint_fast64_t sigma_squared = 0;
+  uint_fast64_t lwm = MAX_UINT_FAST64;
+  uint_fast64_t hwm = 0;
+
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    Shard& shard = _current._shards[ii];
+    n += shard._n.exchange(0);
+    sigma += shard._sigma.exchange(0);
+    sigma_squared += shard._sigma_squared.exchange(0);
+    lwm = std::min(lwm, (uint_fast64_t)shard._lwm.exchange(MAX_UINT_FAST64));
+    hwm = std::max(hwm, (uint_fast64_t)shard._hwm.exchange(0));
+  }
+
   // Scale n by the period.
   _last._n = n * period_us / _target_period_us;
   // Calculate the mean in the obvious way (avoiding division by 0.
@@ -96,24 +115,21 @@ void Accumulator::read(uint_fast64_t period_us)
   _last._mean = mean;
   // Calculate variance as mean of squares minus square of mean.
   _last._variance = (n > 0) ? ((sigma_squared / n) - (mean * mean)) : 0;
-  // Read low- and high-water marks, fixing low-water mark to 0 if there were
-  // no samples in the period.
-  uint_fast64_t lwm = _current._lwm.exchange(MAX_UINT_FAST64);
+  // Report low- and high-water marks, fixing low-water mark to 0 if there
+  // were no samples in the period.
   _last._lwm = (n > 0) ? lwm : 0;
-  _last._hwm = _current._hwm.exchange(0);
+  _last._hwm = hwm;
 }
 
 /// Callback whenever the accumulated statistics are refreshed.  Passes
 /// values to zeroMQ.
 void StatisticAccumulator::refreshed()
 {
-  // Simply construct a vector of mean, variance and water marks and pass it
-  // to zeroMQ.
-  std::vector<std::string> values;
-  values.push_back(std::to_string(get_mean()));
-  values.push_back(std::to_string(get_variance()));
-  values.push_back(std::to_string(get_lwm()));
-  values.push_back(std::to_string(get_hwm()));
-  values.push_back(std::to_string(get_n()));
-  _statistic.report_change(values);
+  // Simply pass the mean, variance, water marks and count to zeroMQ.
+  uint64_t values[] = { get_mean(),
+                        get_variance(),
+                        get_lwm(),
+                        get_hwm(),
+                        get_n() };
+  _statistic.report_change(values, sizeof(values) / sizeof(values[0]));
 }
@@ -24,6 +24,7 @@ AlarmState::AlarmState(AlarmReqAgent* alarm_req_agent,
   _issuer(issuer)
 {
   _identifier = std::to_string(index) + "." + std::to_string(severity);
+  _alarm_key = issuer + ":" + std::to_string(index);
 }
 
 void AlarmState::issue()
@@ -32,7 +33,7 @@ void AlarmState::issue()
   req.push_back("issue-alarm");
   req.push_back(_issuer);
   req.push_back(_identifier);
-  _alarm_req_agent->alarm_request(req);
+  _alarm_req_agent->alarm_request(_alarm_key, req);
 
   TRC_STATUS("%s issued %s alarm", _issuer.c_str(), _identifier.c_str());
 }
@@ -259,9 +260,15 @@ void AlarmReRaiser::reraise_alarms()
   TRC_INFO("Thread to reraise alarms terminating");
 }
 
-AlarmReqAgent::AlarmReqAgent() : _ctx(NULL), _sck(NULL), _req_q(NULL)
+AlarmReqAgent::AlarmReqAgent() :
+  _ctx(NULL),
+  _sck(NULL),
+  _pending_reqs(),
+  _pending_order(),
+  _terminated(false)
 {
-  _req_q = new eventq<std::vector<std::string> >(MAX_Q_DEPTH);
+  pthread_mutex_init(&_req_lock, NULL);
+  pthread_cond_init(&_req_cond, NULL);
 
   pthread_mutex_init(&_start_mutex, NULL);
   pthread_cond_init(&_start_cond, NULL);
@@ -283,25 +290,51 @@ AlarmReqAgent::AlarmReqAgent() : _ctx(NULL), _sck(NULL), _req_q(NULL)
     // LCOV_EXCL_START - No mock for pthread_create
     TRC_ERROR("AlarmReqAgent: error creating thread %s", strerror(rc));
     zmq_clean_ctx();
-    delete _req_q; _req_q = NULL;
+    _terminated = true;
     // LCOV_EXCL_STOP
   }
 }
 
 AlarmReqAgent::~AlarmReqAgent()
 {
-  _req_q->terminate();
+  pthread_mutex_lock(&_req_lock);
+  _terminated = true;
+  pthread_cond_signal(&_req_cond);
+  pthread_mutex_unlock(&_req_lock);
+
   zmq_clean_ctx();
   pthread_join(_thread, NULL);
-  delete _req_q; _req_q = NULL;
+
+  pthread_cond_destroy(&_req_cond);
+  pthread_mutex_destroy(&_req_lock);
 }
 
-void AlarmReqAgent::alarm_request(std::vector<std::string> req)
+void AlarmReqAgent::alarm_request(const std::string& key,
+                                  const std::vector<std::string>& req)
 {
-  if (!_req_q->push_noblock(req))
+  pthread_mutex_lock(&_req_lock);
+
+  std::map<std::string, std::vector<std::string> >::iterator it =
+                                                      _pending_reqs.find(key);
+
+  if (it != _pending_reqs.end())
+  {
+    // Only the latest state of the alarm needs sending.
+    TRC_DEBUG("AlarmReqAgent: replacing queued request for %s", key.c_str());
+    it->second = req;
+  }
+  else if (_pending_reqs.size() >= MAX_Q_DEPTH)
   {
     TRC_DEBUG("AlarmReqAgent: queue overflowed");
   }
+  else if (!_terminated)
+  {
+    _pending_reqs[key] = req;
+    _pending_order.push_back(key);
+    pthread_cond_signal(&_req_cond);
+  }
+
+  pthread_mutex_unlock(&_req_lock);
 }
 
 void* AlarmReqAgent::agent_thread(void* alarm_req_agent)
@@ -325,7 +358,10 @@ bool AlarmReqAgent::zmq_init_ctx()
 
 bool AlarmReqAgent::zmq_init_sck()
 {
-  _sck = zmq_socket(_ctx, ZMQ_REQ);
+  // Use a DEALER socket rather than a REQ socket, so that more than one
+  // request can be outstanding.  snmpd's REP socket needs each request to
+  // start with an empty delimiter, which send_request() adds.
+  _sck = zmq_socket(_ctx, ZMQ_DEALER);
   if (_sck == NULL)
   {
     TRC_ERROR("AlarmReqAgent: zmq_socket failed: %s", zmq_strerror(errno));
@@ -399,28 +435,103 @@ void AlarmReqAgent::agent()
     return;
   }
 
-  std::vector<std::string> req;
+  std::vector<std::vector<std::string> > reqs;
 
-  char reply[MAX_REPLY_LEN];
+  pthread_mutex_lock(&_req_lock);
 
-  while (_req_q && _req_q->pop(req))
+  while (true)
   {
-    TRC_DEBUG("AlarmReqAgent: servicing request queue");
+    while ((!_terminated) && (_pending_order.empty()))
+    {
+      pthread_cond_wait(&_req_cond, &_req_lock);
+    }
 
-    for (std::vector<std::string>::iterator it = req.begin(); it != req.end(); it++)
+    if (_terminated)
     {
-      if (zmq_send(_sck, it->c_str(), it->size(), ((it + 1) != req.end()) ? ZMQ_SNDMORE : 0) == -1)
-      {
-        if (errno != ETERM)
-        {
-          TRC_ERROR("AlarmReqAgent: zmq_send failed: %s", zmq_strerror(errno));
-        }
+      break;
+    }
+
+    // Take all the waiting requests (up to the in-flight limit) in the order
+    // they were queued.
+    while ((!_pending_order.empty()) && (reqs.size() < MAX_IN_FLIGHT))
+    {
+      std::map<std::string, std::vector<std::string> >::iterator it =
+                                      _pending_reqs.find(_pending_order.front());
+      reqs.push_back(std::vector<std::string>());
+      reqs.back().swap(it->second);
+      _pending_reqs.erase(it);
+      _pending_order.pop_front();
+    }
+
+    pthread_mutex_unlock(&_req_lock);
+
+    TRC_DEBUG("AlarmReqAgent: sending %zu requests", reqs.size());
+    bool ok = true;
+
+    for (std::vector<std::vector<std::string> >::const_iterator it = reqs.begin();
+         (ok) && (it != reqs.end());
+         ++it)
+    {
+      ok = send_request(*it);
+    }
+
+    for (size_t ii = 0; (ok) && (ii < reqs.size()); ++ii)
+    {
+      ok = recv_reply();
+    }
+
+    reqs.clear();
+
+    if (!ok)
+    {
+      zmq_clean_sck();
+      return;
+    }
 
-        zmq_clean_sck();
-        return;
+    pthread_mutex_lock(&_req_lock);
+  }
+
+  pthread_mutex_unlock(&_req_lock);
+  zmq_clean_sck();
+}
+
+bool AlarmReqAgent::send_request(const std::vector<std::string>& req)
+{
+  if (zmq_send(_sck, "", 0, ZMQ_SNDMORE) == -1)
+  {
+    if (errno != ETERM)
+    {
+      TRC_ERROR("AlarmReqAgent: zmq_send failed: %s", zmq_strerror(errno));
+    }
+
+    return false;
+  }
+
+  for (std::vector<std::string>::const_iterator it = req.begin(); it != req.end(); it++)
+  {
+    if (zmq_send(_sck, it->c_str(), it->size(), ((it + 1) != req.end()) ? ZMQ_SNDMORE : 0) == -1)
+    {
+      if (errno != ETERM)
+      {
+        TRC_ERROR("AlarmReqAgent: zmq_send failed: %s", zmq_strerror(errno));
       }
+
+      return false;
     }
+  }
+
+  return true;
+}
 
+bool AlarmReqAgent::recv_reply()
+{
+  // Each reply is the empty delimiter followed by the reply itself.
+  char reply[MAX_REPLY_LEN];
+  int more;
+  size_t more_size = sizeof(more);
+
+  do
+  {
     if (zmq_recv(_sck, &reply, sizeof(reply), 0) == -1)
     {
       if (errno != ETERM)
@@ -428,11 +539,18 @@ void AlarmReqAgent::agent()
         TRC_ERROR("AlarmReqAgent: zmq_recv failed: %s", zmq_strerror(errno));
       }
 
-      zmq_clean_sck();
-      return;
+      return false;
+    }
+
+    if (zmq_getsockopt(_sck, ZMQ_RCVMORE, &more, &more_size) == -1)
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("AlarmReqAgent: zmq_getsockopt failed: %s", zmq_strerror(errno));
+      return false;
+      // LCOV_EXCL_STOP
     }
   }
+  while (more);
 
-  zmq_clean_sck();
+  return true;
 }
-
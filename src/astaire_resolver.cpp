@@ -47,13 +47,7 @@ void AstaireResolver::resolve(const std::string& host,
             host.c_str(), _address_family);
 
   targets.clear();
-
-  // Check if host contains a port. Otherwise use the default PORT.
-  if (!Utils::split_host_port(host, host_without_port, port))
-  {
-    host_without_port = host;
-    port = PORT;
-  }
+  split_host(host, host_without_port, port);
 
   if (Utils::parse_ip_target(host_without_port, ai.address))
   {
@@ -75,3 +69,48 @@ void AstaireResolver::resolve(const std::string& host,
               trail);
   }
 }
+
+void AstaireResolver::resolve_iter_async(const std::string& host,
+                                         SAS::TrailId trail,
+                                         AddrIteratorCallback callback)
+{
+  std::string host_without_port;
+  int port;
+  AddrInfo ai;
+
+  TRC_DEBUG("AstaireResolver::resolve_iter_async for host %s, family %d",
+            host.c_str(), _address_family);
+
+  split_host(host, host_without_port, port);
+
+  if (Utils::parse_ip_target(host_without_port, ai.address))
+  {
+    // The name is already an IP address, so no DNS resolution is possible.
+    TRC_DEBUG("Target is an IP address");
+    ai.port = port;
+    ai.transport = TRANSPORT;
+    callback(new SimpleAddrIterator(std::vector<AddrInfo>(1, ai)));
+  }
+  else
+  {
+    a_resolve_iter_async(host_without_port,
+                         _address_family,
+                         port,
+                         TRANSPORT,
+                         trail,
+                         BaseResolver::ALL_LISTS,
+                         callback);
+  }
+}
+
+void AstaireResolver::split_host(const std::string& host,
+                                 std::string& host_without_port,
+                                 int& port)
+{
+  // Check if host contains a port. Otherwise use the default PORT.
+  if (!Utils::split_host_port(host, host_without_port, port))
+  {
+    host_without_port = host;
+    port = PORT;
+  }
+}
@@ -0,0 +1,378 @@
+/**
+ * @file async_logger.cpp  Logger that writes to the log file on a background
+ * thread.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "async_logger.h"
+
+const unsigned int AsyncLogger::DEFAULT_BUFFER_BYTES;
+const long AsyncLogger::DRAIN_INTERVAL_MS;
+const int AsyncLogger::BATCH_LINES;
+const int AsyncLogger::TIMESTAMP_SIZE;
+const uint32_t AsyncLogger::WRAP;
+
+AsyncLogger::AsyncLogger(const std::string& directory,
+                         const std::string& filename,
+                         unsigned int buffer_bytes) :
+  Logger(directory, filename),
+  _rings(),
+  _discards(0),
+  _reported_discards(0),
+  _terminated(false)
+{
+  // Make sure the buffer holds at least one full length log line, and keep
+  // the records in it 8-byte aligned.
+  _buffer_bytes = (std::max(buffer_bytes, 16384u) + 7) & ~7u;
+
+  pthread_key_create(&_ring_key, thread_ring_destructor);
+  pthread_mutex_init(&_rings_lock, NULL);
+  pthread_mutex_init(&_drain_lock, NULL);
+  pthread_mutex_init(&_terminate_lock, NULL);
+
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&_terminate_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  pthread_create(&_drain_thread, NULL, drain_thread_fn, this);
+}
+
+AsyncLogger::~AsyncLogger()
+{
+  pthread_mutex_lock(&_terminate_lock);
+  _terminated = true;
+  pthread_cond_signal(&_terminate_cond);
+  pthread_mutex_unlock(&_terminate_lock);
+  pthread_join(_drain_thread, NULL);
+
+  // Stop the threads' rings being passed to the destructor when they exit,
+  // then write whatever is left and free the rings.
+  pthread_key_delete(_ring_key);
+  drain(false);
+
+  for (std::vector<Ring*>::iterator it = _rings.begin();
+       it != _rings.end();
+       ++it)
+  {
+    delete *it;
+  }
+
+  pthread_cond_destroy(&_terminate_cond);
+  pthread_mutex_destroy(&_terminate_lock);
+  pthread_mutex_destroy(&_drain_lock);
+  pthread_mutex_destroy(&_rings_lock);
+}
+
+void AsyncLogger::write(const char* data)
+{
+  Ring* ring = thread_ring();
+  size_t length = strlen(data);
+  size_t size = record_size(length);
+
+  uint64_t head = ring->head.load(std::memory_order_relaxed);
+  uint64_t tail = ring->tail.load(std::memory_order_acquire);
+
+  // Lines aren't split across the end of the ring, so skip to the start if
+  // this one doesn't fit.
+  size_t remaining = ring->capacity - (head % ring->capacity);
+  size_t skip = (remaining < size) ? remaining : 0;
+
+  if (head + skip + size - tail > ring->capacity)
+  {
+    // The ring is full, so drop the line rather than wait.
+    ++_discards;
+    return;
+  }
+
+  RecordHeader header;
+
+  if (skip >= sizeof(header))
+  {
+    header.length = WRAP;
+    memcpy(ring->data + (head % ring->capacity), &header, sizeof(header));
+  }
+
+  head += skip;
+  char* record = ring->data + (head % ring->capacity);
+
+  gettime(&header.time);
+  header.length = length;
+  header.padding = 0;
+  memcpy(record, &header, sizeof(header));
+  memcpy(record + sizeof(header), data, length);
+
+  ring->head.store(head + size, std::memory_order_release);
+}
+
+size_t AsyncLogger::record_size(size_t length)
+{
+  return (sizeof(RecordHeader) + length + 7) & ~(size_t)7;
+}
+
+AsyncLogger::Ring* AsyncLogger::thread_ring()
+{
+  Ring* ring = (Ring*)pthread_getspecific(_ring_key);
+
+  if (ring == NULL)
+  {
+    ring = new Ring(_buffer_bytes);
+    pthread_setspecific(_ring_key, ring);
+
+    pthread_mutex_lock(&_rings_lock);
+    _rings.push_back(ring);
+    pthread_mutex_unlock(&_rings_lock);
+  }
+
+  return ring;
+}
+
+void AsyncLogger::thread_ring_destructor(void* ring_ptr)
+{
+  // The ring may still hold lines, so leave it to be freed once it's been
+  // drained.
+  ((Ring*)ring_ptr)->closed = true;
+}
+
+void AsyncLogger::flush()
+{
+  drain(false);
+  Logger::flush();
+}
+
+void AsyncLogger::commit()
+{
+  drain(false);
+  Logger::commit();
+}
+
+// LCOV_EXCL_START Only used in exceptional signal handlers - not hit in UT
+
+void AsyncLogger::backtrace_simple(const char* data)
+{
+  // Write out what was logged before the crash first, so it isn't lost.
+  drain(true);
+  Logger::backtrace_simple(data);
+}
+
+void AsyncLogger::backtrace_advanced()
+{
+  drain(true);
+  Logger::backtrace_advanced();
+}
+
+// LCOV_EXCL_STOP
+
+void AsyncLogger::drain(bool crashing)
+{
+  // When crashing, read the list of rings without taking the lock (and
+  // without copying it, which would allocate).
+  std::vector<Ring*> rings;
+  std::vector<Ring*> finished;
+
+  if (!crashing)
+  {
+    pthread_mutex_lock(&_drain_lock);
+
+    pthread_mutex_lock(&_rings_lock);
+    rings = _rings;
+    pthread_mutex_unlock(&_rings_lock);
+  }
+
+  const std::vector<Ring*>& to_drain = crashing ? _rings : rings;
+  bool timestamps = ((get_flags() & ADD_TIMESTAMPS) != 0);
+  Batch batch;
+
+  for (std::vector<Ring*>::const_iterator it = to_drain.begin();
+       it != to_drain.end();
+       ++it)
+  {
+    Ring* ring = *it;
+
+    // Check whether the ring is closed before reading the lines, so that we
+    // don't miss any added just before its thread exited.
+    bool closed = ring->closed.load();
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    bool in_batch = false;
+
+    while (tail != head)
+    {
+      size_t offset = tail % ring->capacity;
+      size_t remaining = ring->capacity - offset;
+      RecordHeader header;
+
+      if (remaining >= sizeof(header))
+      {
+        memcpy(&header, ring->data + offset, sizeof(header));
+      }
+
+      if ((remaining < sizeof(header)) || (header.length == WRAP))
+      {
+        // The next line is at the start of the ring.
+        tail += remaining;
+        continue;
+      }
+
+      timestamp_t ts;
+      Logger::get_timestamp(ts, header.time);
+
+      // Each batch goes in one file, so start a new one on the hour.
+      if ((batch.lines == BATCH_LINES) ||
+          ((batch.lines > 0) &&
+           ((ts.hour != batch.ts.hour) ||
+            (ts.yday != batch.ts.yday) ||
+            (ts.year != batch.ts.year))))
+      {
+        write_batch(batch, crashing);
+        in_batch = false;
+      }
+
+      if (batch.lines == 0)
+      {
+        batch.ts = ts;
+      }
+
+      if (!in_batch)
+      {
+        batch.rings[batch.num_rings++] = ring;
+        in_batch = true;
+      }
+
+      if (timestamps)
+      {
+        char* timestamp = batch.timestamps[batch.lines];
+        Logger::format_timestamp(ts, timestamp, TIMESTAMP_SIZE - 1);
+        size_t timestamp_len = strlen(timestamp);
+        timestamp[timestamp_len++] = ' ';
+
+        batch.iov[batch.iovcnt].iov_base = timestamp;
+        batch.iov[batch.iovcnt].iov_len = timestamp_len;
+        ++batch.iovcnt;
+      }
+
+      batch.iov[batch.iovcnt].iov_base = ring->data + offset + sizeof(header);
+      batch.iov[batch.iovcnt].iov_len = header.length;
+      ++batch.iovcnt;
+      ++batch.lines;
+
+      tail += record_size(header.length);
+      batch.tails[batch.num_rings - 1] = tail;
+    }
+
+    if (!in_batch)
+    {
+      // None of this ring's lines are waiting to be written.
+      ring->tail.store(tail, std::memory_order_release);
+    }
+
+    if ((closed) && (!crashing))
+    {
+      finished.push_back(ring);
+    }
+  }
+
+  write_batch(batch, crashing);
+
+  if (!crashing)
+  {
+    uint64_t discards = _discards.load();
+
+    if (discards != _reported_discards)
+    {
+      char discard_msg[100];
+      snprintf(discard_msg, sizeof(discard_msg),
+               "%lu logs discarded as the log buffer was full\n",
+               (unsigned long)(discards - _reported_discards));
+      Logger::write(discard_msg);
+      _reported_discards = discards;
+    }
+
+    if (!finished.empty())
+    {
+      pthread_mutex_lock(&_rings_lock);
+
+      for (std::vector<Ring*>::iterator it = finished.begin();
+           it != finished.end();
+           ++it)
+      {
+        _rings.erase(std::remove(_rings.begin(), _rings.end(), *it), _rings.end());
+        delete *it;
+      }
+
+      pthread_mutex_unlock(&_rings_lock);
+    }
+
+    pthread_mutex_unlock(&_drain_lock);
+  }
+}
+
+void AsyncLogger::write_batch(Batch& batch, bool crashing)
+{
+  if (batch.lines > 0)
+  {
+    if (crashing)
+    {
+      Logger::write_batch_unlocked(batch.iov, batch.iovcnt);
+    }
+    else
+    {
+      Logger::write_batch(batch.iov, batch.iovcnt, batch.lines, batch.ts);
+    }
+  }
+
+  for (int ii = 0; ii < batch.num_rings; ++ii)
+  {
+    batch.rings[ii]->tail.store(batch.tails[ii], std::memory_order_release);
+  }
+
+  batch.iovcnt = 0;
+  batch.lines = 0;
+  batch.num_rings = 0;
+}
+
+void* AsyncLogger::drain_thread_fn(void* logger)
+{
+  ((AsyncLogger*)logger)->drain_thread_fn();
+  return NULL;
+}
+
+void AsyncLogger::drain_thread_fn()
+{
+  struct timespec end_wait;
+  clock_gettime(CLOCK_MONOTONIC, &end_wait);
+
+  pthread_mutex_lock(&_terminate_lock);
+
+  while (!_terminated)
+  {
+    end_wait.tv_nsec += DRAIN_INTERVAL_MS * 1000000;
+    end_wait.tv_sec += end_wait.tv_nsec / 1000000000;
+    end_wait.tv_nsec %= 1000000000;
+
+    pthread_cond_timedwait(&_terminate_cond, &_terminate_lock, &end_wait);
+
+    if (!_terminated)
+    {
+      // Don't hold the lock while writing, so that the destructor isn't held
+      // up.
+      pthread_mutex_unlock(&_terminate_lock);
+      drain(false);
+      pthread_mutex_lock(&_terminate_lock);
+    }
+  }
+
+  pthread_mutex_unlock(&_terminate_lock);
+}
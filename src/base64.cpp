@@ -23,102 +23,146 @@
 
    Renéyffenegger rene.nyffenegger@adp-gmbh.ch
 
+   This version has been altered from the original: the encoding and decoding
+   is done by table-driven functions that write to caller-provided buffers,
+   rather than appending to a string a character at a time.
+
 */
 
 #include "base64.h"
-#include <iostream>
 
-static const std::string base64_chars =
+#include <algorithm>
+
+static const char base64_chars[] =
              "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
              "abcdefghijklmnopqrstuvwxyz"
              "0123456789+/";
 
+// Marks characters that aren't base64 in the decoding table.
+static const unsigned char INVALID = 0xff;
 
-static inline bool is_base64(unsigned char c) {
-  return (isalnum(c) || (c == '+') || (c == '/'));
-}
+// Maps each character to its 6-bit value, or INVALID.
+struct DecodeTable
+{
+  DecodeTable()
+  {
+    std::fill(values, values + 256, INVALID);
 
-std::string base64_encode(unsigned char const* bytes_to_encode, unsigned int in_len) {
-  std::string ret;
-  int i = 0;
-  int j = 0;
-  unsigned char char_array_3[3];
-  unsigned char char_array_4[4];
-
-  while (in_len--) {
-    char_array_3[i++] = *(bytes_to_encode++);
-    if (i == 3) {
-      char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
-      char_array_4[1] = ((char_array_3[0] & 0x03) << 4) + ((char_array_3[1] & 0xf0) >> 4);
-      char_array_4[2] = ((char_array_3[1] & 0x0f) << 2) + ((char_array_3[2] & 0xc0) >> 6);
-      char_array_4[3] = char_array_3[2] & 0x3f;
-
-      for(i = 0; (i <4) ; i++)
-        ret += base64_chars[char_array_4[i]];
-      i = 0;
+    for (unsigned char ii = 0; ii < 64; ++ii)
+    {
+      values[(unsigned char)base64_chars[ii]] = ii;
     }
   }
 
-  if (i)
-  {
-    for(j = i; j < 3; j++)
-      char_array_3[j] = '\0';
+  unsigned char values[256];
+};
 
-    char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
-    char_array_4[1] = ((char_array_3[0] & 0x03) << 4) + ((char_array_3[1] & 0xf0) >> 4);
-    char_array_4[2] = ((char_array_3[1] & 0x0f) << 2) + ((char_array_3[2] & 0xc0) >> 6);
-    char_array_4[3] = char_array_3[2] & 0x3f;
-
-    for (j = 0; (j < i + 1); j++)
-      ret += base64_chars[char_array_4[j]];
+// Returns the decoding table. This is built on first use, so it is safe to
+// decode from other static initializers.
+static const unsigned char* decode_values()
+{
+  static const DecodeTable decode_table;
+  return decode_table.values;
+}
 
-    while((i++ < 3))
-      ret += '=';
+size_t base64_encode_to(const unsigned char* in, size_t len, char* out)
+{
+  char* start = out;
+  const unsigned char* end = in + (len - (len % 3));
 
+  // Encode each full group of 3 bytes as 4 characters.
+  for (; in != end; in += 3, out += 4)
+  {
+    unsigned int group = (in[0] << 16) | (in[1] << 8) | in[2];
+    out[0] = base64_chars[(group >> 18) & 0x3f];
+    out[1] = base64_chars[(group >> 12) & 0x3f];
+    out[2] = base64_chars[(group >> 6) & 0x3f];
+    out[3] = base64_chars[group & 0x3f];
   }
 
-  return ret;
+  // Encode any remaining bytes, and pad the output.
+  if (len % 3 != 0)
+  {
+    unsigned int group = in[0] << 16;
+
+    if (len % 3 == 2)
+    {
+      group |= in[1] << 8;
+    }
+
+    out[0] = base64_chars[(group >> 18) & 0x3f];
+    out[1] = base64_chars[(group >> 12) & 0x3f];
+    out[2] = (len % 3 == 2) ? base64_chars[(group >> 6) & 0x3f] : '=';
+    out[3] = '=';
+    out += 4;
+  }
 
+  return out - start;
 }
 
-std::string base64_decode(std::string const& encoded_string) {
-  int in_len = encoded_string.size();
-  int i = 0;
-  int j = 0;
-  int in_ = 0;
-  unsigned char char_array_4[4], char_array_3[3];
-  std::string ret;
-
-  while (in_len-- && ( encoded_string[in_] != '=') && is_base64(encoded_string[in_])) {
-    char_array_4[i++] = encoded_string[in_]; in_++;
-    if (i ==4) {
-      for (i = 0; i <4; i++)
-        char_array_4[i] = base64_chars.find(char_array_4[i]);
-
-      char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-      char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-      char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
-
-      for (i = 0; (i < 3); i++)
-        ret += char_array_3[i];
-      i = 0;
+size_t base64_decode_to(const char* in, size_t len, unsigned char* out)
+{
+  const unsigned char* values = decode_values();
+  unsigned char* start = out;
+  size_t ii = 0;
+
+  // Decode each full group of 4 characters as 3 bytes, until we hit the end
+  // or a character that isn't base64 (including padding).
+  for (; ii + 4 <= len; ii += 4, out += 3)
+  {
+    unsigned char a = values[(unsigned char)in[ii]];
+    unsigned char b = values[(unsigned char)in[ii + 1]];
+    unsigned char c = values[(unsigned char)in[ii + 2]];
+    unsigned char d = values[(unsigned char)in[ii + 3]];
+
+    if ((a | b | c | d) == INVALID)
+    {
+      break;
     }
+
+    unsigned int group = (a << 18) | (b << 12) | (c << 6) | d;
+    out[0] = (unsigned char)(group >> 16);
+    out[1] = (unsigned char)(group >> 8);
+    out[2] = (unsigned char)group;
   }
 
-  if (i) {
-    for (j = i; j <4; j++)
-      char_array_4[j] = 0;
+  // Decode the valid characters in the last (partial) group. Each one after
+  // the first completes another byte.
+  unsigned int group = 0;
+  int chars = 0;
 
-    for (j = 0; j <4; j++)
-      char_array_4[j] = base64_chars.find(char_array_4[j]);
+  for (; (ii < len) && (chars < 4); ++ii, ++chars)
+  {
+    unsigned char value = values[(unsigned char)in[ii]];
 
-    char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-    char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-    char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
+    if (value == INVALID)
+    {
+      break;
+    }
 
-    for (j = 0; (j < i - 1); j++) ret += char_array_3[j];
+    group |= value << (18 - (chars * 6));
+  }
+
+  for (int jj = 0; jj < chars - 1; ++jj)
+  {
+    *out++ = (unsigned char)(group >> (16 - (jj * 8)));
   }
 
+  return out - start;
+}
+
+std::string base64_encode(unsigned char const* bytes_to_encode, unsigned int in_len) {
+  std::string ret(base64_encoded_length(in_len), '\0');
+  base64_encode_to(bytes_to_encode, in_len, &ret[0]);
+  return ret;
+}
+
+std::string base64_decode(std::string const& encoded_string) {
+  std::string ret(base64_decoded_max_length(encoded_string.size()), '\0');
+  size_t len = base64_decode_to(encoded_string.data(),
+                                encoded_string.size(),
+                                (unsigned char*)&ret[0]);
+  ret.resize(len);
   return ret;
 }
 
@@ -130,10 +174,10 @@ std::string base64_encode(const std::string& string_to_encode) {
 }
 
 // This function is an addition to the original source code.
-#include <algorithm>
-
 bool is_base64(const std::string& encoded_string)
 {
+  const unsigned char* values = decode_values();
   return std::all_of(encoded_string.begin(), encoded_string.end(),
-                     [](char c) { return (is_base64(c) || c == '='); });
+                     [values](char c) { return ((values[(unsigned char)c] != INVALID) ||
+                                                (c == '=')); });
 }
@@ -15,22 +15,20 @@ BaseCommunicationMonitor::BaseCommunicationMonitor() :
   _succeeded(0),
   _failed(0)
 {
-  pthread_mutex_init(&_lock, NULL);
 }
 
 BaseCommunicationMonitor::~BaseCommunicationMonitor()
 {
-  pthread_mutex_destroy(&_lock);
 }
 
 void BaseCommunicationMonitor::inform_success(unsigned long now_ms)
 {
-  _succeeded++;
+  _succeeded.fetch_add(1, std::memory_order_relaxed);
   track_communication_changes(now_ms);
 }
 
 void BaseCommunicationMonitor::inform_failure(unsigned long now_ms)
 {
-  _failed++;
+  _failed.fetch_add(1, std::memory_order_relaxed);
   track_communication_changes(now_ms);
 }
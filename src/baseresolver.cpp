@@ -39,27 +39,71 @@ void BaseResolver::add_target_to_log_string(std::string& log_string,
   log_string += addr.address_and_port_to_string() + " (" + state + ")";
 }
 
+thread_local uint64_t BaseResolver::_affinity_key = 0;
+
 BaseResolver::BaseResolver(DnsCachedResolver* dns_client) :
   _naptr_factory(),
   _naptr_cache(),
   _srv_factory(),
   _srv_cache(),
-  _hosts(),
+  _srv_plan_factory(),
+  _srv_plan_cache(),
+  _hosts_lock("resolver_hosts"),
+  _hosts(new HostTable(INITIAL_HOST_TABLE_SIZE)),
+  _latency_aware_selection(false),
+  _target_affinity(false),
+  _affinity_load_factor(1.25),
   _dns_client(dns_client)
 {
 }
 
 BaseResolver::~BaseResolver()
 {
+  // The Hosts are only deleted along with the current table (or the lists
+  // of Hosts left out of it), as the retired tables point to the same Hosts.
+  HostTable* hosts = _hosts.load();
+
+  for (size_t ii = 0; ii <= hosts->mask; ++ii)
+  {
+    delete hosts->slots[ii].load();
+  }
+
+  delete hosts;
+
+  for (std::vector<RetiredHosts>::iterator i = _retired_hosts.begin();
+       i != _retired_hosts.end();
+       ++i)
+  {
+    for (std::vector<Host*>::iterator j = i->hosts.begin();
+         j != i->hosts.end();
+         ++j)
+    {
+      delete *j;
+    }
+
+    delete i->table;
+  }
 }
 
 // Removes all the entries from the blacklist.
 void BaseResolver::clear_blacklist()
 {
   TRC_DEBUG("Clear blacklist");
-  pthread_mutex_lock(&_hosts_lock);
-  _hosts.clear();
-  pthread_mutex_unlock(&_hosts_lock);
+  _hosts_lock.lock();
+
+  HostTable* hosts = _hosts.load();
+
+  for (size_t ii = 0; ii <= hosts->mask; ++ii)
+  {
+    Host* host = hosts->slots[ii].load();
+
+    if (host != NULL)
+    {
+      host->whitelist();
+    }
+  }
+
+  _hosts_lock.unlock();
 }
 
 // Creates the cache for storing NAPTR results.
@@ -78,6 +122,11 @@ void BaseResolver::create_srv_cache()
   TRC_DEBUG("Create SRV cache");
   _srv_factory = new SRVCacheFactory(DEFAULT_TTL, _dns_client);
   _srv_cache = new SRVCache(_srv_factory);
+
+  // Create the factory and cache for the selection plans built from the SRV
+  // cache.
+  _srv_plan_factory = new SRVPlanCacheFactory(this);
+  _srv_plan_cache = new SRVPlanCache(_srv_plan_factory);
 }
 
 /// Creates the blacklist of address/port/transport triplets.
@@ -85,11 +134,31 @@ void BaseResolver::create_blacklist(int blacklist_duration, int graylist_duratio
 {
   // Create the blacklist (no factory required).
   TRC_DEBUG("Create black list");
-  pthread_mutex_init(&_hosts_lock, NULL);
   _default_blacklist_duration = blacklist_duration;
   _default_graylist_duration = graylist_duration;
 }
 
+void BaseResolver::set_cache_limits(int stale_window, size_t max_entries)
+{
+  TRC_STATUS("Serving stale NAPTR/SRV cache entries for %ds, with at most %ld entries",
+             stale_window,
+             max_entries);
+
+  if (_naptr_cache != NULL)
+  {
+    _naptr_cache->serve_stale(stale_window);
+    _naptr_cache->set_max_entries(max_entries);
+  }
+
+  if (_srv_cache != NULL)
+  {
+    _srv_cache->serve_stale(stale_window);
+    _srv_cache->set_max_entries(max_entries);
+    _srv_plan_cache->serve_stale(stale_window);
+    _srv_plan_cache->set_max_entries(max_entries);
+  }
+}
+
 void BaseResolver::destroy_naptr_cache()
 {
   TRC_DEBUG("Destroy NAPTR cache");
@@ -100,6 +169,8 @@ void BaseResolver::destroy_naptr_cache()
 void BaseResolver::destroy_srv_cache()
 {
   TRC_DEBUG("Destroy SRV cache");
+  delete _srv_plan_cache;
+  delete _srv_plan_factory;
   delete _srv_cache;
   delete _srv_factory;
 }
@@ -109,7 +180,6 @@ void BaseResolver::destroy_blacklist()
   TRC_DEBUG("Destroy blacklist");
   _default_blacklist_duration = 0;
   _default_graylist_duration = 0;
-  pthread_mutex_destroy(&_hosts_lock);
 }
 
 /// This algorithm selects a number of targets (IP address/port/transport
@@ -186,6 +256,28 @@ BaseAddrIterator* BaseResolver::a_resolve_iter(const std::string& hostname,
                                                SAS::TrailId trail,
                                                int allowed_host_state)
 {
+  if (af == AF_UNSPEC)
+  {
+    std::vector<DnsCachedResolver::DnsQuery> queries;
+    queries.push_back(DnsCachedResolver::DnsQuery(hostname, ns_t_aaaa));
+    queries.push_back(DnsCachedResolver::DnsQuery(hostname, ns_t_a));
+    std::map<DnsCachedResolver::DnsQuery, DnsResult> results;
+    _dns_client->dns_query(queries, results, trail);
+
+    DnsResult& ipv6_result = results.at(queries[0]);
+    DnsResult& ipv4_result = results.at(queries[1]);
+    ttl = std::min(ipv6_result.ttl(), ipv4_result.ttl());
+
+    TRC_DEBUG("Found %ld AAAA and %ld A records, creating dual-stack iterator",
+              ipv6_result.records().size(),
+              ipv4_result.records().size());
+
+    return new DualStackAddrIterator(
+      this,
+      new LazyAResolveIter(ipv6_result, this, port, transport, trail, allowed_host_state),
+      new LazyAResolveIter(ipv4_result, this, port, transport, trail, allowed_host_state));
+  }
+
   DnsResult result = _dns_client->dns_query(hostname, (af == AF_INET) ? ns_t_a : ns_t_aaaa, trail);
   ttl = result.ttl();
 
@@ -194,6 +286,54 @@ BaseAddrIterator* BaseResolver::a_resolve_iter(const std::string& hostname,
   return new LazyAResolveIter(result, this, port, transport, trail, allowed_host_state);
 }
 
+void BaseResolver::a_resolve_iter_async(const std::string& hostname,
+                                        int af,
+                                        int port,
+                                        int transport,
+                                        SAS::TrailId trail,
+                                        int allowed_host_state,
+                                        AddrIteratorCallback callback)
+{
+  if (af == AF_UNSPEC)
+  {
+    std::vector<DnsCachedResolver::DnsQuery> queries;
+    queries.push_back(DnsCachedResolver::DnsQuery(hostname, ns_t_aaaa));
+    queries.push_back(DnsCachedResolver::DnsQuery(hostname, ns_t_a));
+
+    _dns_client->dns_query_async(
+      queries,
+      [this, port, transport, trail, allowed_host_state, callback]
+      (std::vector<DnsResult>&& results)
+      {
+        TRC_DEBUG("Found %ld AAAA and %ld A records, creating dual-stack iterator",
+                  results[0].records().size(),
+                  results[1].records().size());
+
+        callback(new DualStackAddrIterator(
+          this,
+          new LazyAResolveIter(results[0], this, port, transport, trail, allowed_host_state),
+          new LazyAResolveIter(results[1], this, port, transport, trail, allowed_host_state)));
+      },
+      trail);
+    return;
+  }
+
+  std::vector<std::string> domains(1, hostname);
+
+  _dns_client->dns_query_async(
+    domains,
+    (af == AF_INET) ? ns_t_a : ns_t_aaaa,
+    [this, port, transport, trail, allowed_host_state, callback]
+    (std::vector<DnsResult>&& results)
+    {
+      DnsResult& result = results.front();
+      TRC_DEBUG("Found %ld A/AAAA records, creating iterator", result.records().size());
+
+      callback(new LazyAResolveIter(result, this, port, transport, trail, allowed_host_state));
+    },
+    trail);
+}
+
 /// Converts a DNS A or AAAA record to an IP46Address structure.
 IP46Address BaseResolver::to_ip46(const DnsRRecord* rr)
 {
@@ -224,10 +364,9 @@ void BaseResolver::blacklist(const AddrInfo& ai,
   std::string ai_str = ai.to_string();
   TRC_DEBUG("Add %s to blacklist for %d seconds, graylist for %d seconds",
             ai_str.c_str(), blacklist_ttl, graylist_ttl);
-  pthread_mutex_lock(&_hosts_lock);
-  _hosts.erase(ai);
-  _hosts.emplace(ai, Host(blacklist_ttl, graylist_ttl));
-  pthread_mutex_unlock(&_hosts_lock);
+  _hosts_lock.lock();
+  add_host(ai)->blacklist(blacklist_ttl, graylist_ttl);
+  _hosts_lock.unlock();
 }
 
 BaseResolver::NAPTRCacheFactory::NAPTRCacheFactory(const std::map<std::string, int>& services,
@@ -237,10 +376,12 @@ BaseResolver::NAPTRCacheFactory::NAPTRCacheFactory(const std::map<std::string, i
   _default_ttl(default_ttl),
   _dns_client(dns_client)
 {
+  pthread_mutex_init(&_regex_lock, NULL);
 }
 
 BaseResolver::NAPTRCacheFactory::~NAPTRCacheFactory()
 {
+  pthread_mutex_destroy(&_regex_lock);
 }
 
 std::shared_ptr<BaseResolver::NAPTRReplacement> BaseResolver::NAPTRCacheFactory::get(std::string key,
@@ -304,21 +445,10 @@ std::shared_ptr<BaseResolver::NAPTRReplacement> BaseResolver::NAPTRCacheFactory:
         if ((replacement == "") &&
             (naptr->regexp() != ""))
         {
-          // Record has no replacement value, but does have a regular expression.
-          boost::regex regex;
-          std::string replace;
-          if (parse_regex_replace(naptr->regexp(), regex, replace))
-          {
-            // We have a valid regex so try to match it to the original
-            // queried domain to generate a new key.  Note that going straight
-            // to replace is okay.  We haven't set the format_no_copy flag so
-            // parts of the string that do not match the regex will not be
-            // copied, so no match means we end up with an empty string.
-            replacement = boost::regex_replace(key,
-                                               regex,
-                                               replace,
-                                               boost::regex_constants::format_first_only);
-          }
+          // Record has no replacement value, but does have a regular
+          // expression, so try to match it to the original queried domain to
+          // generate a new key.
+          replacement = apply_regex_replace(naptr->regexp(), key);
         }
 
         // Update ttl with the expiry of this record, so if we do get
@@ -362,6 +492,83 @@ std::shared_ptr<BaseResolver::NAPTRReplacement> BaseResolver::NAPTRCacheFactory:
   return repl;
 }
 
+std::shared_ptr<const BaseResolver::NAPTRCacheFactory::RegexReplace>
+  BaseResolver::NAPTRCacheFactory::get_regex_replace(const std::string& regexp)
+{
+  pthread_mutex_lock(&_regex_lock);
+  std::map<std::string, std::shared_ptr<const RegexReplace> >::const_iterator i =
+                                                          _regexes.find(regexp);
+  std::shared_ptr<const RegexReplace> regex_replace =
+                                   (i != _regexes.end()) ? i->second : nullptr;
+  pthread_mutex_unlock(&_regex_lock);
+
+  if (regex_replace == nullptr)
+  {
+    // Parse the field without the lock, as compiling a regular expression
+    // can be slow.  If another thread parses it at the same time, the second
+    // copy is simply discarded.
+    std::shared_ptr<RegexReplace> parsed = std::make_shared<RegexReplace>();
+    parsed->valid = parse_regex_replace(regexp, parsed->regex, parsed->replace);
+    regex_replace = parsed;
+
+    pthread_mutex_lock(&_regex_lock);
+    if (_regexes.size() >= MAX_REGEXES)
+    {
+      TRC_DEBUG("Too many NAPTR regular expressions, clearing the cache of them");
+      _regexes.clear();
+    }
+    _regexes.insert(std::make_pair(regexp, regex_replace));
+    pthread_mutex_unlock(&_regex_lock);
+  }
+
+  return regex_replace;
+}
+
+std::string BaseResolver::NAPTRCacheFactory::apply_regex_replace(const std::string& regexp,
+                                                                 const std::string& domain)
+{
+  std::pair<std::string, std::string> key(regexp, domain);
+  std::string replacement;
+  bool found = false;
+
+  pthread_mutex_lock(&_regex_lock);
+  std::map<std::pair<std::string, std::string>, std::string>::const_iterator i =
+                                                          _replacements.find(key);
+  if (i != _replacements.end())
+  {
+    replacement = i->second;
+    found = true;
+  }
+  pthread_mutex_unlock(&_regex_lock);
+
+  if (!found)
+  {
+    std::shared_ptr<const RegexReplace> regex_replace = get_regex_replace(regexp);
+
+    if (regex_replace->valid)
+    {
+      // Note that going straight to replace is okay.  We haven't set the
+      // format_no_copy flag so parts of the string that do not match the regex
+      // will not be copied, so no match means we end up with an empty string.
+      replacement = boost::regex_replace(domain,
+                                         regex_replace->regex,
+                                         regex_replace->replace,
+                                         boost::regex_constants::format_first_only);
+    }
+
+    pthread_mutex_lock(&_regex_lock);
+    if (_replacements.size() >= MAX_REPLACEMENTS)
+    {
+      TRC_DEBUG("Too many NAPTR replacements, clearing the cache of them");
+      _replacements.clear();
+    }
+    _replacements.insert(std::make_pair(key, replacement));
+    pthread_mutex_unlock(&_regex_lock);
+  }
+
+  return replacement;
+}
+
 bool BaseResolver::NAPTRCacheFactory::parse_regex_replace(const std::string& regex_replace,
                                                           boost::regex& regex,
                                                           std::string& replace)
@@ -482,12 +689,112 @@ bool BaseResolver::SRVCacheFactory::compare_srv_priority(DnsRRecord* r1,
   return (((DnsSrvRecord*)r1)->priority() < ((DnsSrvRecord*)r2)->priority());
 }
 
-BaseResolver::Host::Host(int blacklist_ttl, int graylist_ttl) :
-  _being_probed(false)
+BaseResolver::SRVPlanCacheFactory::SRVPlanCacheFactory(BaseResolver* resolver) :
+  _resolver(resolver)
+{
+}
+
+BaseResolver::SRVPlanCacheFactory::~SRVPlanCacheFactory()
+{
+}
+
+std::shared_ptr<BaseResolver::SRVSelectionPlan> BaseResolver::SRVPlanCacheFactory::get(SRVPlanKey key,
+                                                                                      int& ttl,
+                                                                                      SAS::TrailId trail)
+{
+  const std::string& srv_name = key.first;
+  int af = key.second;
+  TRC_DEBUG("SRV plan cache factory called for %s", srv_name.c_str());
+
+  // The TTL returned from the SRV cache is only set if the entry had to be
+  // populated, so use the remaining TTL of the entry instead.
+  int srv_ttl;
+  std::shared_ptr<SRVPriorityList> srv_list =
+                                 _resolver->get_srv_list(srv_name, srv_ttl, trail);
+  ttl = _resolver->_srv_cache->ttl(srv_name);
+
+  if (srv_list == nullptr)
+  {
+    // Cache the failure for as long as the SRV cache does.
+    return nullptr;
+  }
+
+  std::shared_ptr<SRVSelectionPlan> plan = std::make_shared<SRVSelectionPlan>();
+  plan->levels.reserve(srv_list->size());
+
+  // Collect the targets of the SRVs at every priority level, so that they
+  // can all be resolved in one batch.
+  int a_type = (af == AF_INET) ? ns_t_a : ns_t_aaaa;
+  std::vector<DnsCachedResolver::DnsQuery> a_queries;
+  std::map<DnsCachedResolver::DnsQuery, DnsResult> a_results;
+
+  for (SRVPriorityList::const_iterator i = srv_list->begin();
+       i != srv_list->end();
+       ++i)
+  {
+    plan->levels.push_back(SRVSelectionPlan::PriorityLevel(i->second));
+
+    for (size_t ii = 0; ii < i->second.size(); ++ii)
+    {
+      DnsCachedResolver::DnsQuery query(i->second[ii].target, a_type);
+
+      if (std::find(a_queries.begin(), a_queries.end(), query) == a_queries.end())
+      {
+        a_queries.push_back(query);
+      }
+    }
+  }
+
+  TRC_VERBOSE("Do A record look-ups for %ld SRV targets", a_queries.size());
+  _resolver->dns_query(a_queries, a_results, trail);
+
+  for (size_t ii = 0; ii < plan->levels.size(); ++ii)
+  {
+    SRVSelectionPlan::PriorityLevel& level = plan->levels[ii];
+
+    for (size_t jj = 0; jj < level.srvs.size(); ++jj)
+    {
+      const SRV& srv = level.srvs[jj];
+      DnsResult& a_result =
+                 a_results.at(DnsCachedResolver::DnsQuery(srv.target, a_type));
+      TRC_DEBUG("SRV %s:%d returned %ld IP addresses",
+                srv.target.c_str(),
+                srv.port,
+                a_result.records().size());
+
+      AddrInfo ai;
+      ai.port = srv.port;
+      ai.weight = srv.weight;
+      ai.priority = srv.priority;
+
+      std::vector<AddrInfo>& addresses = level.addresses[jj];
+      addresses.reserve(a_result.records().size());
+
+      for (size_t kk = 0; kk < a_result.records().size(); ++kk)
+      {
+        ai.address = _resolver->to_ip46(a_result.records()[kk]);
+        addresses.push_back(ai);
+      }
+
+      // The plan is only valid until the first of its records expires.
+      ttl = std::min(ttl, a_result.ttl());
+    }
+  }
+
+  ttl = std::max(ttl, 0);
+  plan->expires = time(NULL) + ttl;
+
+  return plan;
+}
+
+BaseResolver::Host::Host(const AddrInfo& ai) :
+  _ai(ai),
+  _blacklist_expiry_time(0),
+  _graylist_expiry_time(0),
+  _being_probed(false),
+  _latency_ewma_us(0),
+  _outstanding_requests(0)
 {
-  time_t current_time = time(NULL);
-  _blacklist_expiry_time = current_time + blacklist_ttl;
-  _graylist_expiry_time = current_time + blacklist_ttl + graylist_ttl;
 }
 
 BaseResolver::Host::~Host()
@@ -536,13 +843,26 @@ BaseResolver::Host::State BaseResolver::Host::get_state(time_t current_time)
   }
 }
 
+void BaseResolver::Host::blacklist(int blacklist_ttl, int graylist_ttl)
+{
+  time_t current_time = time(NULL);
+  _being_probed = false;
+  _blacklist_expiry_time = current_time + blacklist_ttl;
+  _graylist_expiry_time = current_time + blacklist_ttl + graylist_ttl;
+}
+
+void BaseResolver::Host::whitelist()
+{
+  _being_probed = false;
+  _blacklist_expiry_time = 0;
+  _graylist_expiry_time = 0;
+}
+
 void BaseResolver::Host::success()
 {
   if (get_state() != State::BLACK)
   {
-    _being_probed = false;
-    _blacklist_expiry_time = 0;
-    _graylist_expiry_time = 0;
+    whitelist();
   }
 }
 
@@ -555,34 +875,255 @@ void BaseResolver::Host::selected_for_probing(pthread_t user_id)
   }
 }
 
-BaseResolver::Host::State BaseResolver::host_state(const AddrInfo& ai,
-                                                   time_t current_time)
+void BaseResolver::Host::record_latency(uint64_t latency_us)
 {
-  Host::State state;
-  Hosts::iterator i = _hosts.find(ai);
-  std::string ai_str;
+  // The first sample sets the average, so that a new Host isn't treated as
+  // being fast until it has been averaged up.
+  int64_t average = _latency_ewma_us.load();
+
+  if (average == 0)
+  {
+    average = latency_us;
+  }
+  else
+  {
+    average += ((int64_t)latency_us - average) >> LATENCY_EWMA_SHIFT;
+  }
+
+  _latency_ewma_us = std::max(average, (int64_t)1);
+}
+
+void BaseResolver::Host::request_completed(uint64_t latency_us)
+{
+  int outstanding = _outstanding_requests.load();
+
+  while ((outstanding > 0) &&
+         (!_outstanding_requests.compare_exchange_weak(outstanding, outstanding - 1)))
+  {
+  }
+
+  record_latency(latency_us);
+}
+
+uint64_t BaseResolver::Host::load_score() const
+{
+  return _latency_ewma_us.load() * (_outstanding_requests.load() + 1);
+}
 
-  if (Log::enabled(Log::DEBUG_LEVEL))
+BaseResolver::HostTable::HostTable(size_t size) :
+  mask(size - 1),
+  count(0),
+  slots(new std::atomic<Host*>[size])
+{
+  for (size_t ii = 0; ii < size; ++ii)
   {
-    ai_str = ai.to_string();
+    slots[ii] = NULL;
   }
+}
+
+BaseResolver::HostTable::~HostTable()
+{
+  delete[] slots;
+}
+
+size_t BaseResolver::host_hash(const AddrInfo& ai)
+{
+  // Only the low bits are used to pick a slot, but AddrInfo::hash mixes all
+  // of them.
+  return ai.hash();
+}
+
+BaseResolver::Host* BaseResolver::find_host(const AddrInfo& ai) const
+{
+  const HostTable* hosts = _hosts.load();
 
-  if (i != _hosts.end())
+  // The table always has empty slots, so the search ends at one if the host
+  // isn't in it.
+  for (size_t ii = host_hash(ai) & hosts->mask;
+       ;
+       ii = (ii + 1) & hosts->mask)
   {
-    state = i->second.get_state(current_time);
-    if (state == Host::State::WHITE)
+    Host* host = hosts->slots[ii].load();
+
+    if ((host == NULL) || (host->addr_info() == ai))
     {
-      TRC_DEBUG("%s graylist time elapsed", ai_str.c_str());
-      _hosts.erase(i);
+      return host;
     }
   }
-  else
+}
+
+BaseResolver::Host* BaseResolver::add_host(const AddrInfo& ai)
+{
+  Host* host = find_host(ai);
+
+  if (host != NULL)
+  {
+    return host;
+  }
+
+  HostTable* hosts = _hosts.load();
+
+  if ((hosts->count + 1) * 2 > hosts->mask + 1)
+  {
+    rebuild_host_table();
+    hosts = _hosts.load();
+  }
+
+  // If the Host was left out of an earlier table, put it back, as threads
+  // may still be counting requests against it.
+  host = take_retired_host(ai);
+
+  if (host == NULL)
+  {
+    // The Host is constructed before it is stored in the slot, so a thread
+    // that finds it sees it complete.
+    host = new Host(ai);
+  }
+
+  size_t ii = host_hash(ai) & hosts->mask;
+
+  while (hosts->slots[ii].load() != NULL)
+  {
+    ii = (ii + 1) & hosts->mask;
+  }
+
+  hosts->slots[ii] = host;
+  ++hosts->count;
+
+  return host;
+}
+
+void BaseResolver::rebuild_host_table()
+{
+  HostTable* hosts = _hosts.load();
+  time_t now = time(NULL);
+
+  RetiredHosts old;
+  old.retired_at = now;
+  old.table = hosts;
+
+  // Free what was retired long enough ago that no thread can still be
+  // searching it.  A Host with requests still outstanding is retired again
+  // instead, so that their completions are counted against it if it is put
+  // back.
+  std::vector<RetiredHosts>::iterator retired = _retired_hosts.begin();
+
+  while ((retired != _retired_hosts.end()) &&
+         (retired->retired_at + RETIRED_HOSTS_GRACE_S <= now))
+  {
+    for (std::vector<Host*>::iterator i = retired->hosts.begin();
+         i != retired->hosts.end();
+         ++i)
+    {
+      if ((*i)->outstanding_requests() != 0)
+      {
+        old.hosts.push_back(*i);
+      }
+      else
+      {
+        delete *i;
+      }
+    }
+
+    delete retired->table;
+    ++retired;
+  }
+
+  _retired_hosts.erase(_retired_hosts.begin(), retired);
+
+  // Work out which Hosts to keep.  A Host that is whitelisted with no
+  // requests outstanding has nothing worth keeping (other than its latency
+  // average, which is kept if it is put back while retired, and otherwise
+  // just measured again).
+  std::vector<Host*> kept;
+
+  for (size_t ii = 0; ii <= hosts->mask; ++ii)
+  {
+    Host* host = hosts->slots[ii].load();
+
+    if (host != NULL)
+    {
+      if ((host->is_white(now)) && (host->outstanding_requests() == 0))
+      {
+        old.hosts.push_back(host);
+      }
+      else
+      {
+        kept.push_back(host);
+      }
+    }
+  }
+
+  size_t size = hosts->mask + 1;
+
+  while ((kept.size() + 1) * 4 > size)
+  {
+    size *= 2;
+  }
+
+  // The new table is only published once it is complete.
+  HostTable* new_hosts = new HostTable(size);
+
+  for (std::vector<Host*>::iterator i = kept.begin(); i != kept.end(); ++i)
+  {
+    size_t jj = host_hash((*i)->addr_info()) & new_hosts->mask;
+
+    while (new_hosts->slots[jj].load() != NULL)
+    {
+      jj = (jj + 1) & new_hosts->mask;
+    }
+
+    new_hosts->slots[jj] = *i;
+    ++new_hosts->count;
+  }
+
+  TRC_DEBUG("Rebuilt hosts table with %ld slots, keeping %ld hosts and retiring %ld",
+            new_hosts->mask + 1,
+            kept.size(),
+            old.hosts.size());
+  _retired_hosts.push_back(old);
+  _hosts = new_hosts;
+}
+
+BaseResolver::Host* BaseResolver::take_retired_host(const AddrInfo& ai)
+{
+  for (std::vector<RetiredHosts>::iterator i = _retired_hosts.begin();
+       i != _retired_hosts.end();
+       ++i)
+  {
+    for (std::vector<Host*>::iterator j = i->hosts.begin();
+         j != i->hosts.end();
+         ++j)
+    {
+      if ((*j)->addr_info() == ai)
+      {
+        Host* host = *j;
+        i->hosts.erase(j);
+        return host;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+BaseResolver::Host::State BaseResolver::host_state(const AddrInfo& ai,
+                                                   time_t current_time)
+{
+  Host* host = find_host(ai);
+  Host::State state;
+
+  if ((host == NULL) || (host->is_white(current_time)))
   {
-    state = Host::State::WHITE;
+    // This is the common case, so doesn't log anything.
+    return Host::State::WHITE;
   }
 
-  if (Log::enabled(Log::DEBUG_LEVEL))
+  state = host->get_state(current_time);
+
+  if (TRC_ENABLED(Log::DEBUG_LEVEL))
   {
+    std::string ai_str = ai.to_string();
     std::string state_str = Host::state_to_string(state);
     TRC_DEBUG("%s has state: %s", ai_str.c_str(), state_str.c_str());
   }
@@ -598,8 +1139,6 @@ bool BaseResolver::select_address(const AddrInfo& addr,
   const bool whitelisted_allowed = allowed_host_state & BaseResolver::WHITELISTED;
   const bool blacklisted_allowed = allowed_host_state & BaseResolver::BLACKLISTED;
 
-  pthread_mutex_lock(&_hosts_lock);
-
   BaseResolver::Host::State state = host_state(addr);
 
   switch (state)
@@ -612,10 +1151,12 @@ bool BaseResolver::select_address(const AddrInfo& addr,
     allowed = whitelisted_allowed;
 
     // If the address is allowed, we need to mark it as being probed (so that
-    // further requests do not consider it to whitelisted).
-    if (allowed)
+    // further requests do not consider it to whitelisted).  Another thread
+    // may have got there first, in which case it is being probed.
+    if ((allowed) && (!select_for_probing(addr)))
     {
-      select_for_probing(addr);
+      state = BaseResolver::Host::State::GRAY_PROBING;
+      allowed = blacklisted_allowed;
     }
     break;
 
@@ -635,8 +1176,6 @@ bool BaseResolver::select_address(const AddrInfo& addr,
     // LCOV_EXCL_STOP
   }
 
-  pthread_mutex_unlock(&_hosts_lock);
-
   std::string host_state_str = BaseResolver::Host::state_to_string(state);
   std::string addr_str = addr.address_and_port_to_string();
 
@@ -666,36 +1205,233 @@ bool BaseResolver::select_address(const AddrInfo& addr,
 
 void BaseResolver::success(const AddrInfo& ai)
 {
-  if (Log::enabled(Log::DEBUG_LEVEL))
+  if (TRC_ENABLED(Log::DEBUG_LEVEL))
   {
     std::string ai_str = ai.to_string();
     TRC_DEBUG("Successful response from  %s", ai_str.c_str());
   }
 
-  pthread_mutex_lock(&_hosts_lock);
+  // Whitelisted hosts don't need to change state, so the lock is only taken
+  // for hosts that are blacklisted or graylisted.
+  Host* host = find_host(ai);
+
+  if ((host != NULL) && (!host->is_white(time(NULL))))
+  {
+    _hosts_lock.lock();
+    host->success();
+    _hosts_lock.unlock();
+  }
+}
 
-  Hosts::iterator i = _hosts.find(ai);
+bool BaseResolver::select_for_probing(const AddrInfo& ai)
+{
+  Host* host = find_host(ai);
+  bool selected = false;
 
-  if (i != _hosts.end())
+  if (host != NULL)
   {
-    i->second.success();
+    _hosts_lock.lock();
+
+    if (host->get_state() == Host::State::GRAY_NOT_PROBING)
+    {
+      std::string ai_str = ai.to_string();
+      TRC_DEBUG("%s selected for probing", ai_str.c_str());
+      host->selected_for_probing(pthread_self());
+      selected = true;
+    }
+
+    _hosts_lock.unlock();
   }
 
-  pthread_mutex_unlock(&_hosts_lock);
+  return selected;
 }
 
-void BaseResolver::select_for_probing(const AddrInfo& ai)
+BaseResolver::Host* BaseResolver::latency_host(const AddrInfo& ai)
 {
-  Hosts::iterator i = _hosts.find(ai);
+  if ((!_latency_aware_selection) && (!_target_affinity))
+  {
+    return NULL;
+  }
 
-  if (i != _hosts.end())
+  Host* host = find_host(ai);
+
+  if (host == NULL)
   {
-    std::string ai_str = ai.to_string();
-    TRC_DEBUG("%s selected for probing", ai_str.c_str());
-    i->second.selected_for_probing(pthread_self());
+    _hosts_lock.lock();
+    host = add_host(ai);
+    _hosts_lock.unlock();
+  }
+
+  return host;
+}
+
+void BaseResolver::request_started(const AddrInfo& ai)
+{
+  Host* host = latency_host(ai);
+
+  if (host != NULL)
+  {
+    host->request_started();
+  }
+}
+
+void BaseResolver::request_completed(const AddrInfo& ai, uint64_t latency_us)
+{
+  Host* host = latency_host(ai);
+
+  if (host != NULL)
+  {
+    host->request_completed(latency_us);
+  }
+}
+
+void BaseResolver::record_latency(const AddrInfo& ai, uint64_t latency_us)
+{
+  Host* host = latency_host(ai);
+
+  if (host != NULL)
+  {
+    host->record_latency(latency_us);
   }
 }
 
+uint64_t BaseResolver::load_score(const AddrInfo& ai) const
+{
+  Host* host = find_host(ai);
+  return (host != NULL) ? host->load_score() : 0;
+}
+
+size_t BaseResolver::pick_weighted(const std::vector<double>& weights)
+{
+  double total = 0;
+
+  for (size_t ii = 0; ii < weights.size(); ++ii)
+  {
+    total += weights[ii];
+  }
+
+  if (total <= 0)
+  {
+    return Utils::ThreadRandom::below(weights.size());
+  }
+
+  double s = total * Utils::ThreadRandom::uniform();
+
+  for (size_t ii = 0; ii < weights.size(); ++ii)
+  {
+    if (s < weights[ii])
+    {
+      return ii;
+    }
+
+    s -= weights[ii];
+  }
+
+  // Rounding may leave a little weight over, which belongs to the last
+  // address with a non-zero weight.
+  size_t last = weights.size() - 1;
+
+  while ((last > 0) && (weights[last] <= 0))
+  {
+    --last;
+  }
+
+  return last;
+}
+
+void BaseResolver::order_by_load(std::vector<AddrInfo>& addrs,
+                                 std::vector<double> weights) const
+{
+  std::vector<AddrInfo> ordered;
+  ordered.reserve(addrs.size());
+
+  while (!addrs.empty())
+  {
+    // The two picks may be the same address, which is what stops the most
+    // loaded address from being starved - it still comes first in
+    // proportion to the square of its share of the weight, so its average
+    // latency is kept up to date.
+    size_t choice = pick_weighted(weights);
+    size_t other = pick_weighted(weights);
+
+    if (load_score(addrs[other]) < load_score(addrs[choice]))
+    {
+      choice = other;
+    }
+
+    ordered.push_back(addrs[choice]);
+    addrs.erase(addrs.begin() + choice);
+    weights.erase(weights.begin() + choice);
+  }
+
+  addrs.swap(ordered);
+}
+
+int BaseResolver::outstanding_requests(const AddrInfo& ai) const
+{
+  Host* host = find_host(ai);
+  return (host != NULL) ? host->outstanding_requests() : 0;
+}
+
+void BaseResolver::order_by_affinity(std::vector<AddrInfo>& addrs,
+                                     const std::vector<double>& weights) const
+{
+  uint64_t key = _affinity_key;
+
+  if (key == 0)
+  {
+    key = std::hash<pthread_t>()(pthread_self());
+  }
+
+  // Score each address by weighted rendezvous hashing - -weight / ln(u),
+  // where u is a hash of the key and the address in (0, 1) - so each address
+  // comes first for a share of the keys in proportion to its weight, and
+  // adding or removing an address only moves the keys that it gains or loses.
+  std::vector<std::pair<double, AddrInfo>> scored;
+  scored.reserve(addrs.size());
+  int total_outstanding = 0;
+
+  for (size_t ii = 0; ii < addrs.size(); ++ii)
+  {
+    uint64_t hash = (addrs[ii].hash() ^ key) * 0x9e3779b97f4a7c15ULL;
+    hash ^= hash >> 29;
+    double u = ((hash >> 11) + 0.5) / (double)(1ULL << 53);
+    double weight = (weights[ii] > 0) ? weights[ii] : 1e-9;
+    scored.push_back(std::make_pair(-weight / log(u), addrs[ii]));
+    total_outstanding += outstanding_requests(addrs[ii]);
+  }
+
+  std::stable_sort(scored.begin(),
+                   scored.end(),
+                   [](const std::pair<double, AddrInfo>& a,
+                      const std::pair<double, AddrInfo>& b)
+                   {
+                     return a.first > b.first;
+                   });
+
+  // Bound the load - an address that already has more than its share of the
+  // outstanding requests (allowing for this one) goes after the others, in
+  // the same order, so its keys spill onto the next addresses in their
+  // orders.
+  double limit = ceil(_affinity_load_factor * (total_outstanding + 1) / addrs.size());
+  std::vector<AddrInfo> overloaded;
+  addrs.clear();
+
+  for (size_t ii = 0; ii < scored.size(); ++ii)
+  {
+    if (outstanding_requests(scored[ii].second) + 1 > limit)
+    {
+      overloaded.push_back(scored[ii].second);
+    }
+    else
+    {
+      addrs.push_back(scored[ii].second);
+    }
+  }
+
+  addrs.insert(addrs.end(), overloaded.begin(), overloaded.end());
+}
+
 // If no targets were resolved in either a_resolve_iter or srv_resolve_iter and
 // SAS logs are being taken, this code is called
 void BaseResolver::no_targets_resolved_logging(const std::string name,
@@ -729,6 +1465,13 @@ void BaseResolver::dns_query(std::vector<std::string>& domains,
   _dns_client->dns_query(domains, dnstype, results, trail);
 }
 
+void BaseResolver::dns_query(const std::vector<DnsCachedResolver::DnsQuery>& queries,
+                             std::map<DnsCachedResolver::DnsQuery, DnsResult>& results,
+                             SAS::TrailId trail)
+{
+  _dns_client->dns_query(queries, results, trail);
+}
+
 std::shared_ptr<BaseResolver::SRVPriorityList> BaseResolver::get_srv_list(const std::string& srv_name,
                                                                           int &ttl,
                                                                           SAS::TrailId trail)
@@ -736,14 +1479,43 @@ std::shared_ptr<BaseResolver::SRVPriorityList> BaseResolver::get_srv_list(const
   return _srv_cache->get(srv_name, ttl, trail);
 }
 
+std::shared_ptr<BaseResolver::SRVSelectionPlan> BaseResolver::get_srv_plan(const std::string& srv_name,
+                                                                          int af,
+                                                                          int& ttl,
+                                                                          SAS::TrailId trail)
+{
+  SRVPlanKey key(srv_name, af);
+  std::shared_ptr<SRVSelectionPlan> plan = _srv_plan_cache->get(key, ttl, trail);
+
+  if (plan != nullptr)
+  {
+    ttl = std::max((int)(plan->expires - time(NULL)), 0);
+  }
+  else
+  {
+    ttl = _srv_plan_cache->ttl(key);
+  }
+
+  return plan;
+}
+
+void BaseAddrIterator::take_into(int num_requested_targets,
+                                 std::vector<AddrInfo>& targets)
+{
+  targets = take(num_requested_targets);
+}
+
 bool BaseAddrIterator::next(AddrInfo &target)
 {
   bool value_set;
-  std::vector<AddrInfo> next_one = take(1);
 
-  if (!next_one.empty())
+  // Reuse the same vector for every call, so this doesn't allocate once the
+  // first target has been returned.
+  take_into(1, _next_targets);
+
+  if (!_next_targets.empty())
   {
-    target = next_one.front();
+    target = _next_targets.front();
     value_set = true;
   }
   else
@@ -756,20 +1528,103 @@ bool BaseAddrIterator::next(AddrInfo &target)
 
 std::vector<AddrInfo> SimpleAddrIterator::take(int num_requested_targets)
 {
-  // Determine the number of elements to be returned, and create an iterator
-  // pointing to the location at which to split _targets.
-  int num_targets_to_return = std::min(num_requested_targets, int(_targets.size()));
-  std::vector<AddrInfo>::iterator targets_it = _targets.begin();
-  std::advance(targets_it, num_targets_to_return);
+  std::vector<AddrInfo> targets;
+  take_into(num_requested_targets, targets);
+  return targets;
+}
+
+void SimpleAddrIterator::take_into(int num_requested_targets,
+                                   std::vector<AddrInfo>& targets)
+{
+  // Return the next num_requested_targets elements of _targets (or as many as
+  // are left), and move past them.
+  size_t num_targets_to_return = std::min((size_t)std::max(num_requested_targets, 0),
+                                          _targets.size() - _next_target);
+  targets.assign(_targets.begin() + _next_target,
+                 _targets.begin() + _next_target + num_targets_to_return);
+  _next_target += num_targets_to_return;
+}
+
+bool SimpleAddrIterator::next(AddrInfo& target)
+{
+  if (_next_target == _targets.size())
+  {
+    return false;
+  }
+
+  target = _targets[_next_target++];
+  return true;
+}
+
+DualStackAddrIterator::DualStackAddrIterator(BaseResolver* resolver,
+                                             BaseAddrIterator* ipv6_it,
+                                             BaseAddrIterator* ipv4_it) :
+  _resolver(resolver),
+  _started(false),
+  _turn(0)
+{
+  _its[0] = ipv6_it;
+  _its[1] = ipv4_it;
+  _has_head[0] = false;
+  _has_head[1] = false;
+}
+
+DualStackAddrIterator::~DualStackAddrIterator()
+{
+  delete _its[0]; _its[0] = NULL;
+  delete _its[1]; _its[1] = NULL;
+}
+
+std::vector<AddrInfo> DualStackAddrIterator::take(int num_requested_targets)
+{
+  std::vector<AddrInfo> targets;
+  AddrInfo target;
 
-  // Set targets to the first actual_num_requested_targets elements of _targets, and
-  // remove those elements from _targets.
-  std::vector<AddrInfo> targets(_targets.begin(), targets_it);
-  _targets = std::vector<AddrInfo>(targets_it, _targets.end());
+  while (((int)targets.size() < num_requested_targets) && (next(target)))
+  {
+    targets.push_back(target);
+  }
 
   return targets;
 }
 
+bool DualStackAddrIterator::next(AddrInfo& target)
+{
+  if (!_started)
+  {
+    _started = true;
+    _has_head[0] = _its[0]->next(_heads[0]);
+    _has_head[1] = _its[1]->next(_heads[1]);
+
+    // Start with IPv6, unless it has failed recently and IPv4 hasn't.  The
+    // blacklist system remembers which of the host's addresses have failed,
+    // so this sticks to IPv4 while IPv6 is broken.
+    if ((_has_head[0]) &&
+        (_has_head[1]) &&
+        (_resolver->host_state(_heads[0]) != BaseResolver::Host::State::WHITE) &&
+        (_resolver->host_state(_heads[1]) == BaseResolver::Host::State::WHITE))
+    {
+      TRC_DEBUG("Trying IPv4 first, as IPv6 has failed recently");
+      _turn = 1;
+    }
+  }
+
+  for (int ii = 0; ii < 2; ++ii)
+  {
+    int index = _turn;
+    _turn = 1 - _turn;
+
+    if (_has_head[index])
+    {
+      target = _heads[index];
+      _has_head[index] = _its[index]->next(_heads[index]);
+      return true;
+    }
+  }
+
+  return false;
+}
+
 LazyAResolveIter::LazyAResolveIter(DnsResult& dns_result,
                                    BaseResolver* resolver,
                                    int port,
@@ -801,10 +1656,35 @@ LazyAResolveIter::LazyAResolveIter(DnsResult& dns_result,
   }
 
   // Shuffle the results for load balancing purposes
-  std::random_shuffle(_unused_results.begin(), _unused_results.end());
+  std::shuffle(_unused_results.begin(), _unused_results.end(), Utils::ThreadRandom());
+
+  if (_resolver->target_affinity())
+  {
+    // Order the results by affinity instead.  Results are taken from the
+    // back, so the best goes last.
+    _resolver->order_by_affinity(_unused_results,
+                                 std::vector<double>(_unused_results.size(), 1.0));
+    std::reverse(_unused_results.begin(), _unused_results.end());
+  }
+  else if (_resolver->latency_aware_selection())
+  {
+    // Order the results by load instead.  Results are taken from the back,
+    // so the best goes last.
+    _resolver->order_by_load(_unused_results,
+                             std::vector<double>(_unused_results.size(), 1.0));
+    std::reverse(_unused_results.begin(), _unused_results.end());
+  }
 }
 
 std::vector<AddrInfo> LazyAResolveIter::take(int num_requested_targets)
+{
+  std::vector<AddrInfo> targets;
+  take_into(num_requested_targets, targets);
+  return targets;
+}
+
+void LazyAResolveIter::take_into(int num_requested_targets,
+                                 std::vector<AddrInfo>& targets)
 {
   TRC_DEBUG("Attempting to get %d targets for host:%s. allowed_host_state = %d",
             num_requested_targets,
@@ -816,13 +1696,10 @@ std::vector<AddrInfo> LazyAResolveIter::take(int num_requested_targets)
   const bool blacklisted_allowed = _allowed_host_state & BaseResolver::BLACKLISTED;
 
   // Vector of targets to be returned
-  std::vector<AddrInfo> targets;
+  targets.clear();
+  targets.reserve(num_requested_targets);
   std::string targets_log_str;
 
-  // This lock must be held to safely call the host_state method of
-  // BaseResolver.
-  pthread_mutex_lock(&(_resolver->_hosts_lock));
-
   // If there are any graylisted records, and we're set to return whitelisted
   // records, the Iterator should return one first, and then no more.
   if (_first_call && whitelisted_allowed)
@@ -834,10 +1711,10 @@ std::vector<AddrInfo> LazyAResolveIter::take(int num_requested_targets)
          result_it != _unused_results.rend();
          ++result_it)
     {
-      if (_resolver->host_state(*result_it) == BaseResolver::Host::State::GRAY_NOT_PROBING)
+      if ((_resolver->host_state(*result_it) == BaseResolver::Host::State::GRAY_NOT_PROBING) &&
+          (_resolver->select_for_probing(*result_it)))
       {
         // Add the record to the targets list.
-        _resolver->select_for_probing(*result_it);
         targets.push_back(*result_it);
 
         // Update logging.
@@ -864,7 +1741,6 @@ std::vector<AddrInfo> LazyAResolveIter::take(int num_requested_targets)
   {
     AddrInfo result = _unused_results.back();
     _unused_results.pop_back();
-    std::string target = result.address_and_port_to_string() + ";";
 
     if (_resolver->host_state(result) == BaseResolver::Host::State::WHITE)
     {
@@ -915,8 +1791,6 @@ std::vector<AddrInfo> LazyAResolveIter::take(int num_requested_targets)
     }
   }
 
-  pthread_mutex_unlock(&(_resolver->_hosts_lock));
-
   // If the targets vector does not yet contain enough targets, add unhealthy
   // targets. If only whitelisted or only blacklisted targets were requested,
   // the unhealthy results vector is empty.
@@ -954,8 +1828,6 @@ std::vector<AddrInfo> LazyAResolveIter::take(int num_requested_targets)
   }
 
   _first_call = false;
-
-  return targets;
 }
 
 LazySRVResolveIter::LazySRVResolveIter(BaseResolver* resolver,
@@ -983,18 +1855,18 @@ LazySRVResolveIter::LazySRVResolveIter(BaseResolver* resolver,
   _whitelisted_allowed = allowed_host_state & BaseResolver::WHITELISTED;
   _blacklisted_allowed = allowed_host_state & BaseResolver::BLACKLISTED;
 
-  // Finds and loads the relevant SRV priority list from the cache.  This
-  // returns a shared pointer, so the list will not be deleted until we have
-  // finished with it, but the Cache can still update the entry once the list
+  // Finds and loads the relevant selection plan from the cache.  This
+  // returns a shared pointer, so the plan will not be deleted until we have
+  // finished with it, but the Cache can still update the entry once the plan
   // has expired.
-  _srv_list = _resolver->get_srv_list(srv_name, _ttl, trail);
+  _plan = _resolver->get_srv_plan(srv_name, af, _ttl, trail);
 
-  if (_srv_list != nullptr)
-  {
-    TRC_DEBUG("Found SRV records at %ld priority levels", _srv_list->size());
+  // prepare_priority_level will initially look at the highest priority level.
+  _next_priority_level = 0;
 
-    // prepare_priority_level will initially look at the highest priority level.
-    _next_priority_level = _srv_list->begin();
+  if (_plan != nullptr)
+  {
+    TRC_DEBUG("Found SRV records at %ld priority levels", _plan->levels.size());
   }
   else
   {
@@ -1004,8 +1876,16 @@ LazySRVResolveIter::LazySRVResolveIter(BaseResolver* resolver,
 
 std::vector<AddrInfo> LazySRVResolveIter::take(int num_requested_targets)
 {
-  // The vector of targets to be returned.
   std::vector<AddrInfo> targets;
+  take_into(num_requested_targets, targets);
+  return targets;
+}
+
+void LazySRVResolveIter::take_into(int num_requested_targets,
+                                   std::vector<AddrInfo>& targets)
+{
+  // The vector of targets to be returned.
+  targets.clear();
 
   // Reserve sufficient space for targets that it will never need to be
   // reallocated.
@@ -1025,7 +1905,7 @@ std::vector<AddrInfo> LazySRVResolveIter::take(int num_requested_targets)
 
   // Checks whether a list of SRV Records was found by DNS Resolution. If it
   // wasn't, an empty vector will be returned.
-  if (_srv_list != nullptr)
+  if (_plan != nullptr)
   {
     while (num_targets_to_find > 0)
     {
@@ -1111,8 +1991,6 @@ std::vector<AddrInfo> LazySRVResolveIter::take(int num_requested_targets)
       _resolver->no_targets_resolved_logging(_srv_name, _trail, _whitelisted_allowed, _blacklisted_allowed);
     }
   }
-
-  return targets;
 }
 
 int LazySRVResolveIter::get_min_ttl()
@@ -1122,9 +2000,13 @@ int LazySRVResolveIter::get_min_ttl()
 
 bool LazySRVResolveIter::prepare_priority_level()
 {
-  if (_next_priority_level != _srv_list->end())
+  if (_next_priority_level < _plan->levels.size())
   {
-    TRC_VERBOSE("Processing %d SRVs with priority %d", _next_priority_level->second.size(), _next_priority_level->first);
+    const BaseResolver::SRVSelectionPlan::PriorityLevel& level =
+                                           _plan->levels[_next_priority_level];
+    TRC_VERBOSE("Processing %d SRVs with priority %d",
+                level.srvs.size(),
+                level.srvs.front().priority);
 
     // Clear the data member vectors that need to be reused for the new priority
     // level
@@ -1136,75 +2018,47 @@ bool LazySRVResolveIter::prepare_priority_level()
     _current_srv = 0;
 
     std::vector<const BaseResolver::SRV*> srvs;
-    srvs.reserve(_next_priority_level->second.size());
-
-    // Build a cumulative weighted tree for this priority level. This will use
-    // the weights of the SRVs in this priority level to put them in a random
-    // permutation, where an SRV is more likely to be close to the front if it
-    // has a higher weight. This is used for load balancing purposes, as a
-    // request will be sent to the first SRV if possible.
-    WeightedSelector<BaseResolver::SRV> selector(_next_priority_level->second);
-
-    // Select entries while there are any with non-zero weights.
-    while (selector.total_weight() > 0)
+    std::vector<const std::vector<AddrInfo>*> srv_addresses;
+    srvs.reserve(level.srvs.size());
+    srv_addresses.reserve(level.srvs.size());
+
+    // Use the cumulative weighted tree for this priority level from the plan
+    // to put the SRVs in a random permutation, where an SRV is more likely to
+    // be close to the front if it has a higher weight. This is used for load
+    // balancing purposes, as a request will be sent to the first SRV if
+    // possible.
+    std::vector<int> order;
+    level.selector.permutation(order);
+
+    for (size_t kk = 0; kk < order.size(); ++kk)
     {
-      int ii = selector.select();
+      int ii = order[kk];
       TRC_DEBUG("Selected SRV %s:%d, weight = %d",
-                _next_priority_level->second[ii].target.c_str(),
-                _next_priority_level->second[ii].port,
-                _next_priority_level->second[ii].weight);
-      srvs.push_back(&_next_priority_level->second[ii]);
-    }
-
-    // Do A/AAAA record look-ups for the selected SRV targets.
-    std::vector<std::string> a_targets;
-    std::vector<DnsResult> a_results;
-    a_targets.reserve(srvs.size());
-    a_results.reserve(srvs.size());
-
-    for (size_t ii = 0; ii < srvs.size(); ++ii)
-    {
-      a_targets.push_back(srvs[ii]->target);
+                level.srvs[ii].target.c_str(),
+                level.srvs[ii].port,
+                level.srvs[ii].weight);
+      srvs.push_back(&level.srvs[ii]);
+      srv_addresses.push_back(&level.addresses[ii]);
     }
 
-    TRC_VERBOSE("Do A record look-ups for %ld SRVs", a_targets.size());
-    _resolver->dns_query(a_targets,
-                         (_af == AF_INET) ? ns_t_a : ns_t_aaaa,
-                         a_results,
-                         _trail);
-
     // Give each 2D vector an empty vector corresponding to each SRV record.
     _whitelisted_addresses_by_srv.resize(srvs.size());
     _unhealthy_addresses_by_srv.resize(srvs.size());
 
     for (size_t ii = 0; ii < srvs.size(); ++ii)
     {
-      DnsResult& a_result = a_results[ii];
-      TRC_DEBUG("SRV %s:%d returned %ld IP addresses",
-                srvs[ii]->target.c_str(),
-                srvs[ii]->port,
-                a_result.records().size());
+      const std::vector<AddrInfo>& addresses = *srv_addresses[ii];
       std::vector<AddrInfo> &whitelisted_addresses = _whitelisted_addresses_by_srv[ii];
       std::vector<AddrInfo> &unhealthy_addresses = _unhealthy_addresses_by_srv[ii];
 
-      // This lock must be held to safely call the host_state method of
-      // BaseResolver.
-      pthread_mutex_lock(&(_resolver->_hosts_lock));
-
-      // Creates a template address info object. Each iteration of the for loop
-      // adds a copy with the correct address to a *_addresses vector.
-      AddrInfo ai;
-      ai.transport = _transport;
-      ai.port = srvs[ii]->port;
-      ai.weight = srvs[ii]->weight;
-      ai.priority = srvs[ii]->priority;
-
-      for (size_t jj = 0; jj < a_result.records().size(); ++jj)
+      for (size_t jj = 0; jj < addresses.size(); ++jj)
       {
-        ai.address = _resolver->to_ip46(a_result.records()[jj]);
+        // The plan's addresses are shared between transports, so fill in the
+        // transport on a copy.
+        AddrInfo ai = addresses[jj];
+        ai.transport = _transport;
 
         BaseResolver::Host::State addr_state = _resolver->host_state(ai);
-        std::string target = "[" + ai.address_and_port_to_string() + "] ";
 
         // If whitelisted targets are requested, the first unprobed graylisted
         // target reached will be selected for probing and put at the start of
@@ -1256,16 +2110,18 @@ bool LazySRVResolveIter::prepare_priority_level()
             unhealthy_addresses.push_back(ai);
           }
         }
-
-        // Take the smallest ttl returned so far.
-        _ttl = std::min(_ttl, a_result.ttl());
       }
 
-      pthread_mutex_unlock(&(_resolver->_hosts_lock));
-
       // Randomize the order of both vectors.
-      std::random_shuffle(whitelisted_addresses.begin(), whitelisted_addresses.end());
-      std::random_shuffle(unhealthy_addresses.begin(), unhealthy_addresses.end());
+      std::shuffle(whitelisted_addresses.begin(), whitelisted_addresses.end(), Utils::ThreadRandom());
+      std::shuffle(unhealthy_addresses.begin(), unhealthy_addresses.end(), Utils::ThreadRandom());
+    }
+
+    if (((_resolver->latency_aware_selection()) ||
+         (_resolver->target_affinity())) &&
+        (!srvs.empty()))
+    {
+      order_priority_level_by_load(srvs);
     }
 
     // The next time prepare_priority_level is called it will prepare the next
@@ -1282,6 +2138,45 @@ bool LazySRVResolveIter::prepare_priority_level()
   }
 }
 
+void LazySRVResolveIter::order_priority_level_by_load(const std::vector<const BaseResolver::SRV*>& srvs)
+{
+  std::vector<AddrInfo> whitelisted_addresses;
+  std::vector<double> weights;
+  std::vector<AddrInfo> unhealthy_addresses;
+
+  for (size_t ii = 0; ii < srvs.size(); ++ii)
+  {
+    std::vector<AddrInfo>& srv_whitelisted = _whitelisted_addresses_by_srv[ii];
+    std::vector<AddrInfo>& srv_unhealthy = _unhealthy_addresses_by_srv[ii];
+
+    for (size_t jj = 0; jj < srv_whitelisted.size(); ++jj)
+    {
+      whitelisted_addresses.push_back(srv_whitelisted[jj]);
+      weights.push_back((double)srvs[ii]->weight / srv_whitelisted.size());
+    }
+
+    unhealthy_addresses.insert(unhealthy_addresses.end(),
+                               srv_unhealthy.begin(),
+                               srv_unhealthy.end());
+  }
+
+  // Addresses are taken from the back of the lists, so the best goes last.
+  if (_resolver->target_affinity())
+  {
+    _resolver->order_by_affinity(whitelisted_addresses, weights);
+  }
+  else
+  {
+    _resolver->order_by_load(whitelisted_addresses, weights);
+  }
+  std::reverse(whitelisted_addresses.begin(), whitelisted_addresses.end());
+  std::shuffle(unhealthy_addresses.begin(), unhealthy_addresses.end(), Utils::ThreadRandom());
+
+  TRC_DEBUG("Ordered %ld whitelisted addresses", whitelisted_addresses.size());
+  _whitelisted_addresses_by_srv.assign(1, whitelisted_addresses);
+  _unhealthy_addresses_by_srv.assign(1, unhealthy_addresses);
+}
+
 int LazySRVResolveIter::get_from_priority_level(std::vector<AddrInfo> &targets,
                                                 int num_targets_to_find,
                                                 const int num_requested_targets,
@@ -1302,12 +2197,7 @@ int LazySRVResolveIter::get_from_priority_level(std::vector<AddrInfo> &targets,
     BaseResolver::add_target_to_log_string(targets_log_str,
                                            _unprobed_gray_target,
                                            "graylisted");
-
-    // This lock must be held to safely call the select_for_probing method of
-    // BaseResolver.
-    pthread_mutex_lock(&(_resolver->_hosts_lock));
     _resolver->select_for_probing(_unprobed_gray_target);
-    pthread_mutex_unlock(&(_resolver->_hosts_lock));
 
     _gray_found = false;
     --num_targets_to_find;
@@ -1331,10 +2221,6 @@ int LazySRVResolveIter::get_from_priority_level(std::vector<AddrInfo> &targets,
   // next time this function is called.
   while ((num_targets_to_find > 0) && (!priority_level_complete()))
   {
-    // This lock must be held to safely call the host_state method of
-    // BaseResolver.
-    pthread_mutex_lock(&(_resolver->_hosts_lock));
-
     // If we're at the end of the SRV Records, start from the beginning. This
     // lets get_from_priority_level pause the for loop if it finds enough
     // targets before reaching the end of the SRV Records and resume when it is
@@ -1414,10 +2300,6 @@ int LazySRVResolveIter::get_from_priority_level(std::vector<AddrInfo> &targets,
         _unhealthy_targets.push_back(ai);
       }
     }
-
-    // host_state no longer needs to be called, so this lock can be
-    // released.
-    pthread_mutex_unlock(&(_resolver->_hosts_lock));
   }
 
   if (targets.size() > 0)
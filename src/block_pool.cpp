@@ -0,0 +1,185 @@
+/**
+ * @file block_pool.cpp  Per-thread pools of fixed-size memory blocks.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+#include <new>
+
+#include "block_pool.h"
+
+const unsigned int BlockPool::DEFAULT_THREAD_CACHE_SIZE;
+const size_t BlockPool::MAX_POOLED_SIZE;
+
+// The smallest size of block served by the shared pools.
+static const size_t MIN_POOLED_SIZE = 64;
+
+BlockPool::BlockPool(size_t block_size, unsigned int thread_cache_size) :
+  _block_size(block_size),
+  _thread_cache_size(std::max(thread_cache_size, 2u)),
+  _shared(),
+  _thread_caches()
+{
+  // Blocks must be able to hold the free list link, and be aligned for any
+  // type.
+  const size_t alignment = alignof(max_align_t);
+  _block_size = std::max(_block_size, sizeof(FreeBlock));
+  _block_size = ((_block_size + alignment - 1) / alignment) * alignment;
+
+  pthread_key_create(&_thread_cache_key, thread_cache_destructor);
+  pthread_mutex_init(&_lock, NULL);
+}
+
+BlockPool::~BlockPool()
+{
+  // Stop the threads' caches being passed to the destructor when they exit,
+  // then free all the blocks.
+  pthread_key_delete(_thread_cache_key);
+
+  for (std::vector<ThreadCache*>::iterator it = _thread_caches.begin();
+       it != _thread_caches.end();
+       ++it)
+  {
+    move_blocks((*it)->blocks, _shared, (*it)->blocks.count);
+    delete *it;
+  }
+
+  while (_shared.count > 0)
+  {
+    ::operator delete(_shared.pop());
+  }
+
+  pthread_mutex_destroy(&_lock);
+}
+
+void* BlockPool::allocate()
+{
+  ThreadCache* cache = thread_cache();
+
+  if (cache->blocks.count == 0)
+  {
+    // Refill half the cache from the shared list.
+    pthread_mutex_lock(&_lock);
+    move_blocks(_shared, cache->blocks, _thread_cache_size / 2);
+    pthread_mutex_unlock(&_lock);
+
+    if (cache->blocks.count == 0)
+    {
+      return ::operator new(_block_size);
+    }
+  }
+
+  return cache->blocks.pop();
+}
+
+void BlockPool::release(void* block)
+{
+  if (block == NULL)
+  {
+    return;
+  }
+
+  ThreadCache* cache = thread_cache();
+
+  if (cache->blocks.count >= _thread_cache_size)
+  {
+    // The cache is full, so move half of it to the shared list for other
+    // threads to use.
+    pthread_mutex_lock(&_lock);
+    move_blocks(cache->blocks, _shared, _thread_cache_size / 2);
+    pthread_mutex_unlock(&_lock);
+  }
+
+  cache->blocks.push((FreeBlock*)block);
+}
+
+BlockPool::ThreadCache* BlockPool::thread_cache()
+{
+  ThreadCache* cache = (ThreadCache*)pthread_getspecific(_thread_cache_key);
+
+  if (cache == NULL)
+  {
+    cache = new ThreadCache(this);
+    pthread_setspecific(_thread_cache_key, cache);
+
+    pthread_mutex_lock(&_lock);
+    _thread_caches.push_back(cache);
+    pthread_mutex_unlock(&_lock);
+  }
+
+  return cache;
+}
+
+void BlockPool::thread_cache_destructor(void* cache_ptr)
+{
+  ThreadCache* cache = (ThreadCache*)cache_ptr;
+  BlockPool* pool = cache->pool;
+
+  pthread_mutex_lock(&pool->_lock);
+  pool->_thread_caches.erase(std::remove(pool->_thread_caches.begin(),
+                                         pool->_thread_caches.end(),
+                                         cache),
+                             pool->_thread_caches.end());
+  move_blocks(cache->blocks, pool->_shared, cache->blocks.count);
+  pthread_mutex_unlock(&pool->_lock);
+
+  delete cache;
+}
+
+void BlockPool::move_blocks(FreeList& from, FreeList& to, unsigned int count)
+{
+  while ((count > 0) && (from.count > 0))
+  {
+    to.push(from.pop());
+    --count;
+  }
+}
+
+BlockPool* BlockPool::pool_for_size(size_t size)
+{
+  // One pool for each power of two from MIN_POOLED_SIZE to MAX_POOLED_SIZE.
+  // These are never destroyed, as objects may be freed while the process is
+  // exiting.
+  static BlockPool* pools[] = {new BlockPool(64),
+                               new BlockPool(128),
+                               new BlockPool(256),
+                               new BlockPool(512),
+                               new BlockPool(1024),
+                               new BlockPool(2048),
+                               new BlockPool(4096)};
+
+  size_t index = 0;
+  for (size_t pool_size = MIN_POOLED_SIZE; pool_size < size; pool_size *= 2)
+  {
+    ++index;
+  }
+
+  return pools[index];
+}
+
+void* BlockPool::allocate_sized(size_t size)
+{
+  if (size > MAX_POOLED_SIZE)
+  {
+    return ::operator new(size);
+  }
+
+  return pool_for_size(size)->allocate();
+}
+
+void BlockPool::release_sized(void* block, size_t size)
+{
+  if (size > MAX_POOLED_SIZE)
+  {
+    ::operator delete(block);
+    return;
+  }
+
+  pool_for_size(size)->release(block);
+}
@@ -12,9 +12,11 @@
 #include <random>
 #include <cassert>
 #include <memory>
+#include <algorithm>
+#include <string.h>
 
 #include "bloom_filter.h"
-#include "siphash.h"
+#include "sip_hasher.h"
 #include "log.h"
 #include "json_parse_utils.h"
 #include "rapidjson/error/en.h"
@@ -28,20 +30,87 @@ static const char* JSON_HASH0 = "hash0";
 static const char* JSON_HASH1 = "hash1";
 static const char* JSON_K0 = "k0";
 static const char* JSON_K1 = "k1";
+static const char* JSON_FORMAT = "format";
+static const char* JSON_FORMAT_BLOCKED = "blocked";
 
 // Macro that works out how many bytes are needed to store a given number of
 // bits.
 #define NUM_BYTES_FOR_BITS(X) (((X) + 7) / 8)
 
-BloomFilter::BloomFilter() {}
+const uint32_t BloomFilter::BLOCK_BYTES;
+const uint32_t BloomFilter::BLOCK_BITS;
+const uint32_t BloomFilter::BLOCK_WORDS;
 
-BloomFilter::BloomFilter(uint64_t bitmap_size, uint32_t bits_per_item) :
-  _bitmap(NUM_BYTES_FOR_BITS(bitmap_size), 0),
+// Magic number at the start of the binary form of a filter, followed by the
+// version of the format.
+static const char BINARY_MAGIC[] = {'B', 'L', 'M', 'F'};
+static const uint8_t BINARY_VERSION = 1;
+
+// The size of the binary form's header: the magic number, version, layout,
+// bits per item, bitmap size and hash keys.
+static const size_t BINARY_HEADER_SIZE = sizeof(BINARY_MAGIC) + 1 + 1 + 4 + 8 + (4 * 8);
+
+// Utility functions to read and write integers in network byte order.
+static void write_uint(std::string& out, uint64_t value, int bytes)
+{
+  for (int ii = bytes - 1; ii >= 0; --ii)
+  {
+    out.push_back((char)((value >> (ii * 8)) & 0xFF));
+  }
+}
+
+static uint64_t read_uint(const char* in, int bytes)
+{
+  uint64_t value = 0;
+
+  for (int ii = 0; ii < bytes; ++ii)
+  {
+    value = (value << 8) | (uint8_t)in[ii];
+  }
+
+  return value;
+}
+
+BloomFilter::BloomFilter() :
+  _num_words(0),
+  _layout(STANDARD)
+{}
+
+BloomFilter::BloomFilter(const BloomFilter& other) :
+  _bitmap_size(other._bitmap_size),
+  _bits_per_item(other._bits_per_item),
+  _layout(other._layout)
+{
+  sip_hashers[0] = other.sip_hashers[0];
+  sip_hashers[1] = other.sip_hashers[1];
+  init_hashers();
+  allocate_bitmap();
+
+  for (uint64_t ii = 0; ii < _num_words; ++ii)
+  {
+    _bitmap[ii].store(other._bitmap[ii].load(std::memory_order_relaxed),
+                      std::memory_order_relaxed);
+  }
+}
+
+BloomFilter::BloomFilter(uint64_t bitmap_size,
+                         uint32_t bits_per_item,
+                         Layout layout) :
   _bitmap_size(bitmap_size),
-  _bits_per_item(bits_per_item)
+  _bits_per_item(bits_per_item),
+  _layout(layout)
 {
-  TRC_DEBUG("Create bloom filter with %lu bits, %u bits per item",
-            bitmap_size, bits_per_item);
+  if (_layout == BLOCKED)
+  {
+    _bitmap_size = std::max(((_bitmap_size + BLOCK_BITS - 1) / BLOCK_BITS) * BLOCK_BITS,
+                            (uint64_t)BLOCK_BITS);
+  }
+
+  allocate_bitmap();
+
+  TRC_DEBUG("Create %sbloom filter with %lu bits, %u bits per item",
+            (_layout == BLOCKED) ? "blocked " : "",
+            _bitmap_size, bits_per_item);
 
   // Initialize the SIP hashers.
   std::mt19937_64 rng(time(0));
@@ -49,6 +118,7 @@ BloomFilter::BloomFilter(uint64_t bitmap_size, uint32_t bits_per_item) :
   sip_hashers[0].k1 = rng();
   sip_hashers[1].k0 = rng();
   sip_hashers[1].k1 = rng();
+  init_hashers();
 
   TRC_DEBUG("SipHash keys: [(%lu,%lu), (%lu,%lu)]",
             sip_hashers[0].k0,
@@ -58,7 +128,8 @@ BloomFilter::BloomFilter(uint64_t bitmap_size, uint32_t bits_per_item) :
 }
 
 BloomFilter* BloomFilter::for_num_entries_and_fp_prob(uint64_t num_entries,
-                                                     double fp_prob)
+                                                     double fp_prob,
+                                                     Layout layout)
 {
   // Check that the inputs to the function are acceptable.
   if ((fp_prob <= 0.0) || (fp_prob >= 1.0))
@@ -83,133 +154,289 @@ BloomFilter* BloomFilter::for_num_entries_and_fp_prob(uint64_t num_entries,
   double factor = -1.0 * log(fp_prob) / (log(2) * log(2));
   uint64_t bitmap_size = num_entries * factor;
 
-  return new BloomFilter(bitmap_size, bits_per_item);
+  return new BloomFilter(bitmap_size, bits_per_item, layout);
 }
 
 void BloomFilter::add(const std::string& item)
 {
   TRC_DEBUG("Add %s to the bloom filter", item.c_str());
 
-  std::vector<uint64_t> hash_values = calculate_hash_values(item);
+  uint64_t hash0;
+  uint64_t hash1;
+  calculate_sip_hash_values(item, hash0, hash1);
+  add_hash_values(hash0, hash1);
+}
 
-  for (uint64_t h: hash_values)
+void BloomFilter::add(const std::vector<std::string>& items)
+{
+  TRC_DEBUG("Add %lu items to the bloom filter", items.size());
+
+  // Hash the items a chunk at a time, so the hashers can work on several at
+  // once.
+  static const size_t CHUNK_SIZE = 64;
+  const void* data[CHUNK_SIZE];
+  size_t lengths[CHUNK_SIZE];
+  uint64_t hash0s[CHUNK_SIZE];
+  uint64_t hash1s[CHUNK_SIZE] = {0};
+  bool need_hash1 = ((_bits_per_item > 1) || (_layout == BLOCKED));
+
+  for (size_t start = 0; start < items.size(); start += CHUNK_SIZE)
   {
-    set_bit(h % _bitmap_size);
+    size_t count = std::min(CHUNK_SIZE, items.size() - start);
+
+    for (size_t ii = 0; ii < count; ++ii)
+    {
+      data[ii] = items[start + ii].data();
+      lengths[ii] = items[start + ii].length();
+    }
+
+    _hashers[0].hash_many(data, lengths, count, hash0s);
+
+    if (need_hash1)
+    {
+      _hashers[1].hash_many(data, lengths, count, hash1s);
+    }
+
+    for (size_t ii = 0; ii < count; ++ii)
+    {
+      add_hash_values(hash0s[ii], hash1s[ii]);
+    }
+  }
+}
+
+void BloomFilter::add_hash_values(uint64_t hash0, uint64_t hash1)
+{
+  if (_layout == BLOCKED)
+  {
+    uint64_t mask[BLOCK_WORDS];
+    calculate_block_mask(hash1, mask);
+    uint64_t block = block_word(hash0);
+
+    for (uint32_t ii = 0; ii < BLOCK_WORDS; ++ii)
+    {
+      if (mask[ii] != 0)
+      {
+        _bitmap[block + ii].fetch_or(mask[ii], std::memory_order_relaxed);
+      }
+    }
+  }
+  else
+  {
+    for (uint32_t ii = 0; ii < _bits_per_item; ++ii)
+    {
+      set_bit(hash_value(hash0, hash1, ii) % _bitmap_size);
+    }
   }
 }
 
 bool BloomFilter::check(const std::string& item)
+{
+  uint64_t hash0;
+  uint64_t hash1;
+  calculate_sip_hash_values(item, hash0, hash1);
+  bool present = check_hash_values(hash0, hash1);
+
+  TRC_DEBUG("%s is %sin bloom filter", item.c_str(), present ? "" : "not ");
+  return present;
+}
+
+bool BloomFilter::check_hash_values(uint64_t hash0, uint64_t hash1)
 {
   bool present = true;
 
-  std::vector<uint64_t> hash_values = calculate_hash_values(item);
+  if (_layout == BLOCKED)
+  {
+    // Check all the bits at once, a word at a time. The item is present if
+    // none of the bits in its mask are missing from the block.
+    uint64_t mask[BLOCK_WORDS];
+    calculate_block_mask(hash1, mask);
+    uint64_t block = block_word(hash0);
+    uint64_t missing = 0;
+
+    for (uint32_t ii = 0; ii < BLOCK_WORDS; ++ii)
+    {
+      missing |= (mask[ii] & ~_bitmap[block + ii].load(std::memory_order_relaxed));
+    }
 
-  for (uint64_t h: hash_values)
+    present = (missing == 0);
+  }
+  else
   {
-    // If any of the required bits are not set, then this item definitely isn't
-    // in the bloom filter.
-    if (!is_bit_set(h % _bitmap_size))
+    for (uint32_t ii = 0; ii < _bits_per_item; ++ii)
     {
-      present = false;
-      break;
+      // If any of the required bits are not set, then this item definitely
+      // isn't in the bloom filter.
+      if (!is_bit_set(hash_value(hash0, hash1, ii) % _bitmap_size))
+      {
+        present = false;
+        break;
+      }
     }
   }
 
-  TRC_DEBUG("%s is %sin bloom filter", item.c_str(), present ? "" : "not ");
   return present;
 }
 
-uint64_t BloomFilter::calculate_sip_hash_value(const SipHashKeys& keys,
-                                               const std::string& item)
+void BloomFilter::clear()
+{
+  for (uint64_t ii = 0; ii < _num_words; ++ii)
+  {
+    _bitmap[ii].store(0, std::memory_order_relaxed);
+  }
+}
+
+void BloomFilter::init_hashers()
 {
-  // The reference C implementation of SipHash takes a 16-byte array. Form this
-  // by concatenating the two keys with native byte ordering.
-  uint8_t key[16];
-  memcpy(key, &keys.k0, 8);
-  memcpy(key + 8, &keys.k1, 8);
-
-  // Similarly the result is returned as a 8-byte array. Interpret this as a
-  // 64-bit uint in native byte ordering.
-  uint64_t hash_value;
-  siphash((uint8_t*)item.c_str(),
-          item.length(),
-          key,
-          (uint8_t*)&hash_value,
-          sizeof(hash_value));
-
-  return hash_value;
+  _hashers[0] = SipHasher(sip_hashers[0].k0, sip_hashers[0].k1);
+  _hashers[1] = SipHasher(sip_hashers[1].k0, sip_hashers[1].k1);
 }
 
-std::vector<uint64_t> BloomFilter::calculate_hash_values(const std::string& item)
+void BloomFilter::calculate_sip_hash_values(const std::string& item,
+                                            uint64_t& hash0,
+                                            uint64_t& hash1)
 {
-  TRC_DEBUG("Calculate hash values for %s", item.c_str());
+  hash0 = _hashers[0].hash(item.data(), item.length());
+  hash1 = ((_bits_per_item > 1) || (_layout == BLOCKED)) ?
+          _hashers[1].hash(item.data(), item.length()) : 0;
+}
 
-  std::vector<uint64_t> hash_values(_bits_per_item);
+void BloomFilter::calculate_block_mask(uint64_t hash1, uint64_t mask[BLOCK_WORDS])
+{
+  memset(mask, 0, BLOCK_BYTES);
+
+  // Double hash within the block. The step is odd, so the first BLOCK_BITS
+  // bits are all different.
+  uint32_t start = hash1 & 0xFFFFFFFF;
+  uint32_t step = (hash1 >> 32) | 1;
 
-  // The first two hash values are calculated by taking a SIP hash of the item.
-  // Subsequent hash values are formed from a linear combination of the first
-  // two hash values. This means we only ever perform two hashes, regardless of
-  // the number of bits per entry, which is good for performance.
   for (uint32_t ii = 0; ii < _bits_per_item; ++ii)
   {
-    if (ii < 2)
-    {
-      hash_values[ii] = calculate_sip_hash_value(sip_hashers[ii], item);
-    }
-    else
+    uint32_t bit = (start + (step * ii)) % BLOCK_BITS;
+    mask[bit / 64] |= (1ULL << (63 - (bit % 64)));
+  }
+}
+
+bool BloomFilter::is_bit_set(uint64_t bit)
+{
+  uint64_t word_index = bit / 64;
+  uint32_t bit_index = 63 - (bit % 64);
+
+  return ((_bitmap[word_index].load(std::memory_order_relaxed) &
+           (1ULL << bit_index)) != 0);
+}
+
+void BloomFilter::set_bit(uint64_t bit)
+{
+  uint64_t word_index = bit / 64;
+  uint64_t mask = 1ULL << (63 - (bit % 64));
+
+  // Skip the atomic write if the bit is already set, which it often will be
+  // in a well-filled filter.
+  if ((_bitmap[word_index].load(std::memory_order_relaxed) & mask) == 0)
+  {
+    _bitmap[word_index].fetch_or(mask, std::memory_order_relaxed);
+  }
+}
+
+bool BloomFilter::merge(const BloomFilter& other)
+{
+  if ((_bitmap_size != other._bitmap_size) ||
+      (_bits_per_item != other._bits_per_item) ||
+      (_layout != other._layout) ||
+      (memcmp(sip_hashers, other.sip_hashers, sizeof(sip_hashers)) != 0))
+  {
+    TRC_WARNING("Can't merge incompatible bloom filters");
+    return false;
+  }
+
+  for (uint64_t ii = 0; ii < _num_words; ++ii)
+  {
+    // Only write the words that gain bits, so that merging mostly similar
+    // filters doesn't dirty every cache line.
+    uint64_t bits = other._bitmap[ii].load(std::memory_order_relaxed);
+
+    if ((bits & ~_bitmap[ii].load(std::memory_order_relaxed)) != 0)
     {
-      hash_values[ii] = hash_values[0] + hash_values[1] * ii;
+      _bitmap[ii].fetch_or(bits, std::memory_order_relaxed);
     }
-
-    TRC_DEBUG("Hash value #%d = %lu", ii, hash_values[ii]);
   }
 
-  return hash_values;
+  return true;
 }
 
-bool BloomFilter::is_bit_set(uint64_t bit)
+void BloomFilter::allocate_bitmap()
+{
+  _num_words = (_bitmap_size + 63) / 64;
+  _bitmap.reset(new std::atomic<uint64_t>[_num_words]);
+
+  for (uint64_t ii = 0; ii < _num_words; ++ii)
+  {
+    _bitmap[ii].store(0, std::memory_order_relaxed);
+  }
+}
+
+std::string BloomFilter::bitmap_to_bytes() const
 {
-  TRC_DEBUG("Checking bit %lu", bit);
+  std::string bytes;
+  bytes.reserve(_num_words * 8);
 
-  uint64_t byte_index = bit / 8;
-  uint32_t bit_index = 7 - (bit % 8);
+  for (uint64_t ii = 0; ii < _num_words; ++ii)
+  {
+    write_uint(bytes, _bitmap[ii].load(std::memory_order_relaxed), 8);
+  }
 
-  return ((_bitmap[byte_index] & (0x01 << bit_index)) != 0);
+  bytes.resize(NUM_BYTES_FOR_BITS(_bitmap_size));
+  return bytes;
 }
 
-void BloomFilter::set_bit(uint64_t bit)
+void BloomFilter::bitmap_from_bytes(const std::string& bytes)
 {
-  TRC_DEBUG("Setting bit %lu", bit);
+  allocate_bitmap();
 
-  uint64_t byte_index = bit / 8;
-  uint32_t bit_index = 7 - (bit % 8);
+  std::string padded = bytes;
+  padded.resize(_num_words * 8, 0);
 
-  _bitmap[byte_index] |= (0x01 << bit_index);
+  for (uint64_t ii = 0; ii < _num_words; ++ii)
+  {
+    _bitmap[ii].store(read_uint(padded.data() + (ii * 8), 8),
+                      std::memory_order_relaxed);
+  }
 }
 
 std::string BloomFilter::to_json()
 {
-  rapidjson::StringBuffer sb;
-  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+  // Write the JSON straight into the string that's returned, rather than
+  // copying it out of a separate buffer.  Most of it is the bitmap.
+  std::string bitmap = base64_encode(bitmap_to_bytes());
+  std::string json;
+  json.reserve(bitmap.size() + 256);
+  JsonStringStream stream(json);
+  JsonStringWriter writer(stream);
 
   writer.StartObject();
   {
     writer.String(JSON_BITMAP);
-    std::string bitmap = base64_encode(_bitmap);
     writer.String(bitmap.c_str());
 
     writer.String(JSON_TOTAL_BITS); writer.Uint64(_bitmap_size);
     writer.String(JSON_BITS_PER_ENTRY); writer.Uint(_bits_per_item);
     writer.String(JSON_HASH0); sip_hash_to_json(sip_hashers[0], writer);
     writer.String(JSON_HASH1); sip_hash_to_json(sip_hashers[1], writer);
+
+    // Standard filters don't have a format, so that they can still be read by
+    // older code.
+    if (_layout == BLOCKED)
+    {
+      writer.String(JSON_FORMAT); writer.String(JSON_FORMAT_BLOCKED);
+    }
   }
   writer.EndObject();
 
-  return sb.GetString();
+  return json;
 }
 
 void BloomFilter::sip_hash_to_json(const SipHashKeys& hasher,
-                                   rapidjson::Writer<rapidjson::StringBuffer>& writer)
+                                   JsonStringWriter& writer)
 {
   writer.StartObject();
   {
@@ -253,7 +480,7 @@ BloomFilter* BloomFilter::from_json(const std::string& json)
       return nullptr;
     }
 
-    filter->_bitmap = base64_decode(bitmap_base64);
+    std::string bitmap = base64_decode(bitmap_base64);
 
     // Get the remaining trivial members.
     JSON_GET_UINT_64_MEMBER(doc, JSON_TOTAL_BITS, filter->_bitmap_size);
@@ -262,6 +489,33 @@ BloomFilter* BloomFilter::from_json(const std::string& json)
                                                               filter->sip_hashers[0]);
     JSON_ASSERT_CONTAINS(doc, JSON_HASH1); sip_hash_from_json(doc[JSON_HASH1],
                                                               filter->sip_hashers[1]);
+    filter->init_hashers();
+
+    if (doc.HasMember(JSON_FORMAT))
+    {
+      std::string format;
+      JSON_GET_STRING_MEMBER(doc, JSON_FORMAT, format);
+
+      if (format != JSON_FORMAT_BLOCKED)
+      {
+        TRC_INFO("Unknown bloom filter format %s", format.c_str());
+        return nullptr;
+      }
+
+      // The bitmap must be a whole number of blocks, all of which are
+      // present.
+      if ((filter->_bitmap_size == 0) ||
+          (filter->_bitmap_size % BLOCK_BITS != 0) ||
+          (bitmap.size() < NUM_BYTES_FOR_BITS(filter->_bitmap_size)))
+      {
+        TRC_INFO("Invalid blocked bloom filter size %lu", filter->_bitmap_size);
+        return nullptr;
+      }
+
+      filter->_layout = BLOCKED;
+    }
+
+    filter->bitmap_from_bytes(bitmap);
   }
   catch(JsonFormatError err)
   {
@@ -273,6 +527,72 @@ BloomFilter* BloomFilter::from_json(const std::string& json)
   return filter.release();
 }
 
+std::string BloomFilter::to_binary()
+{
+  std::string binary(BINARY_MAGIC, sizeof(BINARY_MAGIC));
+  binary.reserve(BINARY_HEADER_SIZE + NUM_BYTES_FOR_BITS(_bitmap_size));
+
+  write_uint(binary, BINARY_VERSION, 1);
+  write_uint(binary, _layout, 1);
+  write_uint(binary, _bits_per_item, 4);
+  write_uint(binary, _bitmap_size, 8);
+  write_uint(binary, sip_hashers[0].k0, 8);
+  write_uint(binary, sip_hashers[0].k1, 8);
+  write_uint(binary, sip_hashers[1].k0, 8);
+  write_uint(binary, sip_hashers[1].k1, 8);
+  binary.append(bitmap_to_bytes());
+
+  return binary;
+}
+
+BloomFilter* BloomFilter::from_binary(const std::string& binary)
+{
+  if ((binary.size() < BINARY_HEADER_SIZE) ||
+      (memcmp(binary.data(), BINARY_MAGIC, sizeof(BINARY_MAGIC)) != 0))
+  {
+    TRC_INFO("Invalid binary bloom filter");
+    return nullptr;
+  }
+
+  const char* data = binary.data() + sizeof(BINARY_MAGIC);
+  uint8_t version = read_uint(data, 1);
+  uint8_t layout = read_uint(data + 1, 1);
+
+  if ((version != BINARY_VERSION) || (layout > BLOCKED))
+  {
+    TRC_INFO("Unsupported binary bloom filter version %u, layout %u",
+             version, layout);
+    return nullptr;
+  }
+
+  std::unique_ptr<BloomFilter> filter(new BloomFilter());
+  filter->_layout = (Layout)layout;
+  filter->_bits_per_item = read_uint(data + 2, 4);
+  filter->_bitmap_size = read_uint(data + 6, 8);
+  filter->sip_hashers[0].k0 = read_uint(data + 14, 8);
+  filter->sip_hashers[0].k1 = read_uint(data + 22, 8);
+  filter->sip_hashers[1].k0 = read_uint(data + 30, 8);
+  filter->sip_hashers[1].k1 = read_uint(data + 38, 8);
+  filter->init_hashers();
+
+  // The bitmap must all be present (and for a blocked filter, be a whole
+  // number of blocks).
+  size_t bitmap_bytes = binary.size() - BINARY_HEADER_SIZE;
+
+  if ((filter->_bitmap_size == 0) ||
+      (bitmap_bytes != NUM_BYTES_FOR_BITS(filter->_bitmap_size)) ||
+      ((filter->_layout == BLOCKED) &&
+       (filter->_bitmap_size % BLOCK_BITS != 0)))
+  {
+    TRC_INFO("Invalid binary bloom filter size %lu", filter->_bitmap_size);
+    return nullptr;
+  }
+
+  filter->bitmap_from_bytes(binary.substr(BINARY_HEADER_SIZE));
+
+  return filter.release();
+}
+
 void BloomFilter::sip_hash_from_json(const rapidjson::Value& json_val,
                                      SipHashKeys& hasher)
 {
@@ -0,0 +1,284 @@
+/**
+ * @file caching_store.cpp Store that caches records from another Store.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include <vector>
+
+#include "log.h"
+#include "caching_store.h"
+#include "memcachedstore.h"
+
+CachingStore::CachingStore(Store* store,
+                           size_t memory_budget,
+                           int ttl) :
+  _store(store),
+  _ttl(ttl),
+  _cache(memory_budget,
+         [](const std::string& key, const Store::GetResult& record) {
+           return key.length() + record.data.length();
+         }),
+  _generation(0)
+{
+  TRC_DEBUG("Created caching store (budget %lu bytes, TTL %ds)",
+            memory_budget, ttl);
+}
+
+CachingStore::~CachingStore()
+{
+}
+
+Store::Status CachingStore::get_data(const std::string& table,
+                                     const std::string& key,
+                                     std::string& data,
+                                     uint64_t& cas,
+                                     SAS::TrailId trail,
+                                     bool log_body,
+                                     Store::Format data_format)
+{
+  std::string fqkey = BaseMemcachedStore::get_fq_key(table, key);
+  std::shared_ptr<const Store::GetResult> record = _cache.get(fqkey);
+
+  if (record)
+  {
+    TRC_DEBUG("Found key %s in cache, CAS = %ld", fqkey.c_str(), record->cas);
+    data = record->data;
+    cas = record->cas;
+    return Store::Status::OK;
+  }
+
+  uint64_t generation = _generation;
+  Store::Status status = _store->get_data(table,
+                                          key,
+                                          data,
+                                          cas,
+                                          trail,
+                                          log_body,
+                                          data_format);
+
+  if (status == Store::Status::OK)
+  {
+    cache_record(fqkey, data, cas, generation);
+  }
+
+  return status;
+}
+
+Store::Status CachingStore::set_data(const std::string& table,
+                                     const std::string& key,
+                                     const std::string& data,
+                                     uint64_t cas,
+                                     int expiry,
+                                     SAS::TrailId trail,
+                                     bool log_body,
+                                     Store::Format data_format)
+{
+  Store::Status status = _store->set_data(table,
+                                          key,
+                                          data,
+                                          cas,
+                                          expiry,
+                                          trail,
+                                          log_body,
+                                          data_format);
+  invalidate(BaseMemcachedStore::get_fq_key(table, key));
+  return status;
+}
+
+Store::Status CachingStore::set_data_without_cas(const std::string& table,
+                                                 const std::string& key,
+                                                 const std::string& data,
+                                                 int expiry,
+                                                 SAS::TrailId trail,
+                                                 bool log_body,
+                                                 Store::Format data_format)
+{
+  Store::Status status = _store->set_data_without_cas(table,
+                                                      key,
+                                                      data,
+                                                      expiry,
+                                                      trail,
+                                                      log_body,
+                                                      data_format);
+  invalidate(BaseMemcachedStore::get_fq_key(table, key));
+  return status;
+}
+
+Store::Status CachingStore::delete_data(const std::string& table,
+                                        const std::string& key,
+                                        SAS::TrailId trail)
+{
+  Store::Status status = _store->delete_data(table, key, trail);
+  invalidate(BaseMemcachedStore::get_fq_key(table, key));
+  return status;
+}
+
+void CachingStore::get_data_multi(const std::string& table,
+                                  const std::vector<std::string>& keys,
+                                  std::vector<Store::GetResult>& results,
+                                  SAS::TrailId trail,
+                                  bool log_body,
+                                  Store::Format data_format)
+{
+  results.resize(keys.size());
+
+  // Fill in the keys that are cached, and read the rest from the underlying
+  // store in one go.
+  std::vector<std::string> missed_keys;
+  std::vector<size_t> missed_indexes;
+
+  for (size_t ii = 0; ii < keys.size(); ++ii)
+  {
+    std::shared_ptr<const Store::GetResult> record =
+      _cache.get(BaseMemcachedStore::get_fq_key(table, keys[ii]));
+
+    if (record)
+    {
+      results[ii].status = Store::Status::OK;
+      results[ii].data = record->data;
+      results[ii].cas = record->cas;
+    }
+    else
+    {
+      missed_keys.push_back(keys[ii]);
+      missed_indexes.push_back(ii);
+    }
+  }
+
+  TRC_DEBUG("Found %d of %d keys in cache",
+            keys.size() - missed_keys.size(), keys.size());
+
+  if (missed_keys.empty())
+  {
+    return;
+  }
+
+  uint64_t generation = _generation;
+  std::vector<Store::GetResult> missed_results;
+  _store->get_data_multi(table,
+                         missed_keys,
+                         missed_results,
+                         trail,
+                         log_body,
+                         data_format);
+
+  for (size_t ii = 0; ii < missed_keys.size(); ++ii)
+  {
+    Store::GetResult& result = missed_results[ii];
+
+    if (result.status == Store::Status::OK)
+    {
+      cache_record(BaseMemcachedStore::get_fq_key(table, missed_keys[ii]),
+                   result.data,
+                   result.cas,
+                   generation);
+    }
+
+    results[missed_indexes[ii]] = result;
+  }
+}
+
+void CachingStore::set_data_multi(const std::string& table,
+                                  const std::vector<Store::SetRequest>& requests,
+                                  std::vector<Store::Status>& statuses,
+                                  SAS::TrailId trail,
+                                  bool log_body,
+                                  Store::Format data_format)
+{
+  _store->set_data_multi(table,
+                         requests,
+                         statuses,
+                         trail,
+                         log_body,
+                         data_format);
+
+  for (std::vector<Store::SetRequest>::const_iterator i = requests.begin();
+       i != requests.end();
+       ++i)
+  {
+    invalidate(BaseMemcachedStore::get_fq_key(table, i->key));
+  }
+}
+
+void CachingStore::get_data_async(const std::string& table,
+                                  const std::string& key,
+                                  SAS::TrailId trail,
+                                  bool log_body,
+                                  Store::Format data_format,
+                                  Store::GetCallback callback)
+{
+  std::string fqkey = BaseMemcachedStore::get_fq_key(table, key);
+  std::shared_ptr<const Store::GetResult> record = _cache.get(fqkey);
+
+  if (record)
+  {
+    TRC_DEBUG("Found key %s in cache, CAS = %ld", fqkey.c_str(), record->cas);
+    callback(Store::Status::OK, record->data, record->cas);
+    return;
+  }
+
+  uint64_t generation = _generation;
+
+  _store->get_data_async(table, key, trail, log_body, data_format,
+                         [this, fqkey, generation, callback](Store::Status status,
+                                                             const std::string& data,
+                                                             uint64_t cas) {
+    if (status == Store::Status::OK)
+    {
+      cache_record(fqkey, data, cas, generation);
+    }
+
+    callback(status, data, cas);
+  });
+}
+
+void CachingStore::set_data_async(const std::string& table,
+                                  const std::string& key,
+                                  const std::string& data,
+                                  uint64_t cas,
+                                  int expiry,
+                                  SAS::TrailId trail,
+                                  bool log_body,
+                                  Store::Format data_format,
+                                  Store::SetCallback callback)
+{
+  std::string fqkey = BaseMemcachedStore::get_fq_key(table, key);
+
+  _store->set_data_async(table, key, data, cas, expiry, trail, log_body, data_format,
+                         [this, fqkey, callback](Store::Status status) {
+    invalidate(fqkey);
+    callback(status);
+  });
+}
+
+void CachingStore::cache_record(const std::string& fqkey,
+                                const std::string& data,
+                                uint64_t cas,
+                                uint64_t generation)
+{
+  Store::GetResult record = {Store::Status::OK, data, cas};
+  _cache.put(fqkey, record, _ttl);
+
+  // If there's been a write since the read started, it may have removed
+  // this key before we added it, so the record may be out of date - remove
+  // it again.  A write after this check removes it itself.
+  if (_generation != generation)
+  {
+    TRC_DEBUG("Key %s may have been written while it was read", fqkey.c_str());
+    _cache.erase(fqkey);
+  }
+}
+
+void CachingStore::invalidate(const std::string& fqkey)
+{
+  // Count the write before removing the key - see cache_record.
+  ++_generation;
+  _cache.erase(fqkey);
+}
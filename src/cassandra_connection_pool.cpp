@@ -12,6 +12,7 @@
 
 #include "cassandra_connection_pool.h"
 #include "cassandra_store.h"
+#include "cql_client.h"
 
 namespace CassandraStore
 {
@@ -25,9 +26,12 @@ static const int TSOCKET_SEND_TIMEOUT_MS = 250;
 static const double MAX_IDLE_TIME_S = 60;
 
 // LCOV_EXCL_START - UTs do not cover the creation/deletion on Clients
-CassandraConnectionPool::CassandraConnectionPool() :
-  ConnectionPool<Client*>(MAX_IDLE_TIME_S, true)
+CassandraConnectionPool::CassandraConnectionPool(Protocol protocol) :
+  ConnectionPool<Client*>(MAX_IDLE_TIME_S, true),
+  _protocol(protocol)
 {
+  // Free idle connections in the background, rather than on every release.
+  start_idle_reaper();
 }
 
 Client* CassandraConnectionPool::create_connection(AddrInfo target)
@@ -39,6 +43,15 @@ Client* CassandraConnectionPool::create_connection(AddrInfo target)
                                     buf,
                                     sizeof(buf));
 
+  if (_protocol == CQL)
+  {
+    return new CqlClient(std::string(remote_ip),
+                         target.port,
+                         TSOCKET_CONN_TIMEOUT_MS,
+                         TSOCKET_RECV_TIMEOUT_MS,
+                         TSOCKET_SEND_TIMEOUT_MS);
+  }
+
   boost::shared_ptr<TSocket> socket =
     boost::shared_ptr<TSocket>(new TSocket(std::string(remote_ip), target.port));
   socket->setConnTimeout(TSOCKET_CONN_TIMEOUT_MS);
@@ -0,0 +1,335 @@
+/**
+ * @file cassandra_cursor.cpp  Cursors that page through the rows of a column
+ * family, or the columns of a row.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string.h>
+
+#include "log.h"
+#include "cassandra_cursor.h"
+
+using namespace org::apache::cassandra;
+
+namespace CassandraStore
+{
+
+//
+// PageFetch methods
+//
+
+PageFetch::PageFetch() :
+  _running(false),
+  _fn(),
+  _error()
+{
+}
+
+PageFetch::~PageFetch()
+{
+  if (_running)
+  {
+    pthread_join(_thread, NULL);
+  }
+}
+
+void PageFetch::start(std::function<void()> fn)
+{
+  _fn = fn;
+  _error = std::exception_ptr();
+
+  int rc = pthread_create(&_thread, NULL, thread_fn, this);
+
+  if (rc == 0)
+  {
+    _running = true;
+  }
+  else
+  {
+    // LCOV_EXCL_START
+    TRC_WARNING("Failed to start page fetch thread: %s - fetching inline",
+                strerror(rc));
+    thread_fn(this);
+    // LCOV_EXCL_STOP
+  }
+}
+
+void PageFetch::wait()
+{
+  if (_running)
+  {
+    pthread_join(_thread, NULL);
+    _running = false;
+  }
+
+  if (_error)
+  {
+    std::exception_ptr error = _error;
+    _error = std::exception_ptr();
+    std::rethrow_exception(error);
+  }
+}
+
+void* PageFetch::thread_fn(void* fetch)
+{
+  PageFetch* f = (PageFetch*)fetch;
+
+  try
+  {
+    f->_fn();
+  }
+  catch(...)
+  {
+    f->_error = std::current_exception();
+  }
+
+  return NULL;
+}
+
+//
+// ColumnCursor methods
+//
+
+ColumnCursor::ColumnCursor(Client* client,
+                           const std::string& column_family,
+                           const std::string& key,
+                           const std::string& prefix,
+                           int32_t page_size,
+                           ConsistencyLevel::type consistency_level,
+                           bool prefetch) :
+  _client(client),
+  _column_family(column_family),
+  _key(key),
+  _prefix(prefix),
+  _page_size(page_size),
+  _consistency_level(consistency_level),
+  _prefetch(prefetch),
+  _page(),
+  _index(0),
+  _next_page(),
+  _fetched(false),
+  _more(true),
+  _start(prefix),
+  _first(true),
+  _fetch()
+{
+  if (_prefetch)
+  {
+    _fetch.start([this]() { fetch(); });
+  }
+}
+
+bool ColumnCursor::next(ColumnOrSuperColumn& column)
+{
+  while (_index >= _page.size())
+  {
+    if (_prefetch)
+    {
+      _fetch.wait();
+    }
+    else
+    {
+      fetch();
+    }
+
+    if (!_fetched)
+    {
+      // There are no more pages.
+      return false;
+    }
+
+    _page.swap(_next_page);
+    _next_page.clear();
+    _index = 0;
+    _fetched = false;
+
+    if ((_prefetch) && (_more))
+    {
+      _fetch.start([this]() { fetch(); });
+    }
+  }
+
+  column = _page[_index++];
+  column.column.name = column.column.name.substr(_prefix.length());
+  return true;
+}
+
+void ColumnCursor::fetch()
+{
+  if (!_more)
+  {
+    return;
+  }
+
+  // After the first page, read one more column than we need, as the page
+  // starts with the last column we've already returned.
+  int32_t count = _first ? _page_size : _page_size + 1;
+
+  SliceRange sr;
+  sr.start = _start;
+
+  if (!_prefix.empty())
+  {
+    // Increment the last character of the prefix to get the end of the
+    // range, as for get_columns_with_prefix().
+    sr.finish = _prefix;
+    *sr.finish.rbegin() = (*sr.finish.rbegin() + 1);
+  }
+
+  sr.count = count;
+
+  SlicePredicate sp;
+  sp.slice_range = sr;
+  sp.__isset.slice_range = true;
+
+  ColumnParent cparent;
+  cparent.column_family = _column_family;
+
+  _next_page.clear();
+  _client->get_slice(_next_page, _key, cparent, sp, _consistency_level);
+
+  _more = ((int32_t)_next_page.size() == count);
+
+  if ((!_first) &&
+      (!_next_page.empty()) &&
+      (_next_page.front().column.name == _start))
+  {
+    _next_page.erase(_next_page.begin());
+  }
+
+  if (!_next_page.empty())
+  {
+    _start = _next_page.back().column.name;
+  }
+
+  _first = false;
+  _fetched = true;
+}
+
+//
+// RowCursor methods
+//
+
+RowCursor::RowCursor(Client* client,
+                     const std::string& column_family,
+                     const SlicePredicate& predicate,
+                     int32_t page_size,
+                     ConsistencyLevel::type consistency_level,
+                     bool prefetch) :
+  _client(client),
+  _column_family(column_family),
+  _predicate(predicate),
+  _page_size(page_size),
+  _consistency_level(consistency_level),
+  _prefetch(prefetch),
+  _page(),
+  _index(0),
+  _next_page(),
+  _fetched(false),
+  _more(true),
+  _start(),
+  _first(true),
+  _fetch()
+{
+  if (_prefetch)
+  {
+    _fetch.start([this]() { fetch(); });
+  }
+}
+
+bool RowCursor::next(KeySlice& row)
+{
+  while (_index >= _page.size())
+  {
+    if (_prefetch)
+    {
+      _fetch.wait();
+    }
+    else
+    {
+      fetch();
+    }
+
+    if (!_fetched)
+    {
+      // There are no more pages.
+      return false;
+    }
+
+    _page.swap(_next_page);
+    _next_page.clear();
+    _index = 0;
+    _fetched = false;
+
+    if ((_prefetch) && (_more))
+    {
+      _fetch.start([this]() { fetch(); });
+    }
+  }
+
+  row = _page[_index++];
+  return true;
+}
+
+void RowCursor::fetch()
+{
+  if (!_more)
+  {
+    return;
+  }
+
+  // After the first page, read one more row than we need, as the page starts
+  // with the last row we've already returned.
+  int32_t count = _first ? _page_size : _page_size + 1;
+
+  KeyRange range;
+  range.start_key = _start;
+  range.__isset.start_key = true;
+  range.end_key = "";
+  range.__isset.end_key = true;
+  range.count = count;
+
+  ColumnParent cparent;
+  cparent.column_family = _column_family;
+
+  std::vector<KeySlice> rows;
+  _client->get_range_slices(rows, cparent, _predicate, range, _consistency_level);
+
+  _more = ((int32_t)rows.size() == count);
+
+  // Skip the row we've already returned, and rows that have been deleted
+  // (which Cassandra returns with no columns until they are compacted away).
+  // If the predicate picks out no columns, every row has none, so only skip
+  // empty rows if it picks out some.
+  bool no_columns =
+    ((_predicate.__isset.column_names) && (_predicate.column_names.empty())) ||
+    ((_predicate.__isset.slice_range) && (_predicate.slice_range.count == 0));
+  _next_page.clear();
+
+  for (std::vector<KeySlice>::iterator it = rows.begin();
+       it != rows.end();
+       ++it)
+  {
+    if (((_first) || (it->key != _start)) &&
+        ((no_columns) || (!it->columns.empty())))
+    {
+      _next_page.push_back(*it);
+    }
+  }
+
+  if (!rows.empty())
+  {
+    _start = rows.back().key;
+  }
+
+  _first = false;
+  _fetched = true;
+}
+
+} // namespace CassandraStore
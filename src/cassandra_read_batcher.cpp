@@ -0,0 +1,265 @@
+/**
+ * @file cassandra_read_batcher.cpp  Merges concurrent single-row reads from
+ * Cassandra into multiget_slice calls.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <errno.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include "log.h"
+#include "cassandra_read_batcher.h"
+
+namespace CassandraStore
+{
+
+ReadBatcher::Batch::Batch() :
+  keys(),
+  readers(0),
+  results(),
+  closed(false),
+  done(false),
+  error()
+{
+  // Use the monotonic clock for the delay.
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+}
+
+ReadBatcher::Batch::~Batch()
+{
+  pthread_cond_destroy(&cond);
+}
+
+ReadBatcher::ReadBatcher(unsigned int max_delay_ms,
+                         unsigned int max_keys) :
+  _max_delay_ms(max_delay_ms),
+  _max_keys(max_keys),
+  _queues(),
+  _reads(0),
+  _batches(0)
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+ReadBatcher::~ReadBatcher()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+void ReadBatcher::get_slice(Client* client,
+                            const AddrInfo& target,
+                            Columns& columns,
+                            const std::string& key,
+                            const cass::ColumnParent& column_parent,
+                            const cass::SlicePredicate& predicate,
+                            const cass::ConsistencyLevel::type consistency_level)
+{
+  _reads.fetch_add(1, std::memory_order_relaxed);
+
+  QueueKey queue_key(target,
+                     column_parent.column_family,
+                     predicate_key(predicate),
+                     consistency_level);
+  std::shared_ptr<Batch> batch;
+
+  pthread_mutex_lock(&_lock);
+  Queue& queue = _queues[queue_key];
+
+  if (queue.open != NULL)
+  {
+    // Join the open batch, and wait for whoever opened it to send it.
+    batch = queue.open;
+    add(*batch, key);
+
+    if (batch->keys.size() >= _max_keys)
+    {
+      close(queue, *batch);
+    }
+
+    while (!batch->done)
+    {
+      pthread_cond_wait(&batch->cond, &_lock);
+    }
+
+    std::exception_ptr error = batch->error;
+    pthread_mutex_unlock(&_lock);
+
+    if (error)
+    {
+      std::rethrow_exception(error);
+    }
+
+    // The batch's results aren't changed once it's done.
+    std::map<std::string, Columns>::const_iterator it = batch->results.find(key);
+    columns = (it != batch->results.end()) ? it->second : Columns();
+    return;
+  }
+
+  batch.reset(new Batch());
+  add(*batch, key);
+
+  if ((queue.in_flight > 0) && (batch->keys.size() < _max_keys))
+  {
+    // Another batch is being sent, so let other reads join this one until
+    // that batch completes, this one fills up or the delay expires.
+    queue.open = batch;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += _max_delay_ms / 1000;
+    deadline.tv_nsec += (_max_delay_ms % 1000) * 1000000;
+
+    if (deadline.tv_nsec >= 1000000000)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+
+    while ((!batch->closed) &&
+           (_queues[queue_key].in_flight > 0) &&
+           (pthread_cond_timedwait(&batch->cond, &_lock, &deadline) != ETIMEDOUT))
+    {
+    }
+
+    if (!batch->closed)
+    {
+      close(_queues[queue_key], *batch);
+    }
+  }
+
+  // Send the batch.  Look the queue up again, as it may have been removed
+  // while we waited.
+  _queues[queue_key].in_flight++;
+  pthread_mutex_unlock(&_lock);
+
+  _batches.fetch_add(1, std::memory_order_relaxed);
+  TRC_DEBUG("Sending batch of %lu reads from %s",
+            batch->keys.size(), column_parent.column_family.c_str());
+
+  std::exception_ptr error;
+
+  try
+  {
+    if (batch->keys.size() == 1)
+    {
+      // No reads of other rows joined, so this is just a get_slice.
+      client->get_slice(columns, key, column_parent, predicate, consistency_level);
+
+      if (batch->readers > 1)
+      {
+        // Other reads of the same row joined, so share the columns with them.
+        batch->results[key] = columns;
+      }
+    }
+    else
+    {
+      client->multiget_slice(batch->results,
+                             batch->keys,
+                             column_parent,
+                             predicate,
+                             consistency_level);
+
+      std::map<std::string, Columns>::const_iterator it = batch->results.find(key);
+      columns = (it != batch->results.end()) ? it->second : Columns();
+    }
+  }
+  catch(...)
+  {
+    error = std::current_exception();
+  }
+
+  pthread_mutex_lock(&_lock);
+
+  batch->done = true;
+  batch->error = error;
+  pthread_cond_broadcast(&batch->cond);
+
+  Queue& sent_queue = _queues[queue_key];
+  sent_queue.in_flight--;
+
+  if (sent_queue.open != NULL)
+  {
+    // Let whoever opened the next batch send it.
+    pthread_cond_broadcast(&sent_queue.open->cond);
+  }
+  else if (sent_queue.in_flight == 0)
+  {
+    _queues.erase(queue_key);
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  if (error)
+  {
+    std::rethrow_exception(error);
+  }
+}
+
+void ReadBatcher::stats(Stats& stats) const
+{
+  stats.reads = _reads.load(std::memory_order_relaxed);
+  stats.batches = _batches.load(std::memory_order_relaxed);
+}
+
+std::string ReadBatcher::predicate_key(const cass::SlicePredicate& predicate)
+{
+  // Length-prefix the strings, as they may hold anything.
+  std::string key;
+
+  if (predicate.__isset.column_names)
+  {
+    key.append("names");
+
+    for (const std::string& name : predicate.column_names)
+    {
+      key.append(" ").append(std::to_string(name.length())).append(":").append(name);
+    }
+  }
+
+  if (predicate.__isset.slice_range)
+  {
+    const cass::SliceRange& range = predicate.slice_range;
+    key.append("range ")
+       .append(std::to_string(range.start.length())).append(":").append(range.start)
+       .append(std::to_string(range.finish.length())).append(":").append(range.finish)
+       .append(range.reversed ? " reversed " : " ")
+       .append(std::to_string(range.count));
+  }
+
+  return key;
+}
+
+void ReadBatcher::add(Batch& batch, const std::string& key)
+{
+  batch.readers++;
+
+  if (std::find(batch.keys.begin(), batch.keys.end(), key) == batch.keys.end())
+  {
+    batch.keys.push_back(key);
+  }
+}
+
+void ReadBatcher::close(Queue& queue, Batch& batch)
+{
+  if (queue.open.get() == &batch)
+  {
+    queue.open.reset();
+  }
+
+  batch.closed = true;
+  pthread_cond_broadcast(&batch.cond);
+}
+
+} // namespace CassandraStore
@@ -0,0 +1,41 @@
+/**
+ * @file cassandra_request_stats.cpp  Statistics about the requests a
+ * Cassandra store sends for one column family and request type.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "cassandra_request_stats.h"
+
+const int CassandraRequestStats::NUM_SHARDS;
+
+CassandraRequestStats::CassandraRequestStats(const std::string& name) :
+  _name(name)
+{
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    _shards[ii].requests = 0;
+    _shards[ii].failures = 0;
+    _shards[ii].retries = 0;
+    _shards[ii].fallbacks = 0;
+  }
+}
+
+void CassandraRequestStats::snapshot(Snapshot& snapshot) const
+{
+  snapshot = Snapshot();
+
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    const Shard& shard = _shards[ii];
+    snapshot.requests += shard.requests.load(std::memory_order_relaxed);
+    snapshot.failures += shard.failures.load(std::memory_order_relaxed);
+    snapshot.retries += shard.retries.load(std::memory_order_relaxed);
+    snapshot.fallbacks += shard.fallbacks.load(std::memory_order_relaxed);
+  }
+}
@@ -11,9 +11,17 @@
  */
 
 #include <boost/format.hpp>
+#include <cxxabi.h>
+#include <stdlib.h>
 #include <time.h>
 
+#include <typeinfo>
+
 #include "cassandra_store.h"
+#include "cassandra_write_coalescer.h"
+#include "cassandra_read_batcher.h"
+#include "fiber_pool.h"
+#include "profiling_span.h"
 #include "sasevent.h"
 #include "sas.h"
 
@@ -74,6 +82,10 @@ HAOperation::HAOperation() :
 // to the consistency level ONE attempt, as we've already spent a chunk of our
 // latency budget on the previous attempt, and we want to make sure we can
 // return a result in a timely fashion.
+//
+// If the store runs HA reads speculatively, the ha_ methods instead hand the
+// first call to SpeculativeReads, and only use this macro for further calls
+// (which go straight to ONE as above).
 #define HA(CLIENT, METHOD, TRAIL_ID, ...)                                      \
         bool success = false;                                                  \
         if (!_consistency_two_tried)                                           \
@@ -104,6 +116,41 @@ HAOperation::HAOperation() :
           CLIENT->METHOD(__VA_ARGS__, ConsistencyLevel::ONE);                  \
         }
 
+bool HAOperation::speculative()
+{
+  if ((_speculative_reads == NULL) || (_consistency_two_tried))
+  {
+    return false;
+  }
+
+  _consistency_two_tried = true;
+  return true;
+}
+
+std::string HAOperation::coalesce_key(const char* request,
+                                      const std::string& column_family,
+                                      const std::string& key,
+                                      const std::vector<std::string>& names)
+{
+  // The row key and names are length-prefixed, as they may hold anything.
+  std::string coalesce_key(request);
+  coalesce_key.push_back('\0');
+  coalesce_key.append(column_family);
+  coalesce_key.push_back('\0');
+  coalesce_key.append(std::to_string(key.length()));
+  coalesce_key.push_back(':');
+  coalesce_key.append(key);
+
+  for (const std::string& name : names)
+  {
+    coalesce_key.append(std::to_string(name.length()));
+    coalesce_key.push_back(':');
+    coalesce_key.append(name);
+  }
+
+  return coalesce_key;
+}
+
 void HAOperation::
 ha_get_columns(Client* client,
                const std::string& column_family,
@@ -112,6 +159,43 @@ ha_get_columns(Client* client,
                std::vector<cass::ColumnOrSuperColumn>& columns,
                SAS::TrailId trail)
 {
+  if (_read_coalescer != NULL)
+  {
+    columns = _read_coalescer->run(coalesce_key("get_columns", column_family, key, names),
+                                   [&]() {
+      std::vector<ColumnOrSuperColumn> result;
+      read_columns(client, column_family, key, names, result, trail);
+      return result;
+    });
+    return;
+  }
+
+  read_columns(client, column_family, key, names, columns, trail);
+}
+
+void HAOperation::
+read_columns(Client* client,
+             const std::string& column_family,
+             const std::string& key,
+             const std::vector<std::string>& names,
+             std::vector<cass::ColumnOrSuperColumn>& columns,
+             SAS::TrailId trail)
+{
+  if (speculative())
+  {
+    _speculative_reads->read<std::vector<ColumnOrSuperColumn> >(
+      _target,
+      [column_family, key, names](Client* c,
+                                  ConsistencyLevel::type consistency_level,
+                                  std::vector<ColumnOrSuperColumn>& result)
+      {
+        c->get_columns(column_family, key, names, result, consistency_level);
+      },
+      columns,
+      trail);
+    return;
+  }
+
   HA(client, get_columns, trail, column_family, key, names, columns);
 }
 
@@ -123,6 +207,46 @@ ha_get_columns_with_prefix(Client* client,
                            std::vector<ColumnOrSuperColumn>& columns,
                            SAS::TrailId trail)
 {
+  if (_read_coalescer != NULL)
+  {
+    columns = _read_coalescer->run(coalesce_key("get_columns_with_prefix",
+                                                column_family,
+                                                key,
+                                                {prefix}),
+                                   [&]() {
+      std::vector<ColumnOrSuperColumn> result;
+      read_columns_with_prefix(client, column_family, key, prefix, result, trail);
+      return result;
+    });
+    return;
+  }
+
+  read_columns_with_prefix(client, column_family, key, prefix, columns, trail);
+}
+
+void HAOperation::
+read_columns_with_prefix(Client* client,
+                         const std::string& column_family,
+                         const std::string& key,
+                         const std::string& prefix,
+                         std::vector<ColumnOrSuperColumn>& columns,
+                         SAS::TrailId trail)
+{
+  if (speculative())
+  {
+    _speculative_reads->read<std::vector<ColumnOrSuperColumn> >(
+      _target,
+      [column_family, key, prefix](Client* c,
+                                   ConsistencyLevel::type consistency_level,
+                                   std::vector<ColumnOrSuperColumn>& result)
+      {
+        c->get_columns_with_prefix(column_family, key, prefix, result, consistency_level);
+      },
+      columns,
+      trail);
+    return;
+  }
+
   HA(client, get_columns_with_prefix, trail, column_family, key, prefix, columns);
 }
 
@@ -135,6 +259,21 @@ ha_multiget_columns_with_prefix(Client* client,
                                 std::map<std::string, std::vector<ColumnOrSuperColumn> >& columns,
                                 SAS::TrailId trail)
 {
+  if (speculative())
+  {
+    _speculative_reads->read<std::map<std::string, std::vector<ColumnOrSuperColumn> > >(
+      _target,
+      [column_family, keys, prefix](Client* c,
+                                    ConsistencyLevel::type consistency_level,
+                                    std::map<std::string, std::vector<ColumnOrSuperColumn> >& result)
+      {
+        c->multiget_columns_with_prefix(column_family, keys, prefix, result, consistency_level);
+      },
+      columns,
+      trail);
+    return;
+  }
+
   HA(client, multiget_columns_with_prefix, trail, column_family, keys, prefix, columns);
 }
 
@@ -145,10 +284,321 @@ ha_get_all_columns(Client* client,
                    std::vector<ColumnOrSuperColumn>& columns,
                    SAS::TrailId trail)
 {
+  if (_read_coalescer != NULL)
+  {
+    columns = _read_coalescer->run(coalesce_key("get_row",
+                                                column_family,
+                                                key,
+                                                std::vector<std::string>()),
+                                   [&]() {
+      std::vector<ColumnOrSuperColumn> result;
+      read_all_columns(client, column_family, key, result, trail);
+      return result;
+    });
+    return;
+  }
+
+  read_all_columns(client, column_family, key, columns, trail);
+}
+
+void HAOperation::
+read_all_columns(Client* client,
+                 const std::string& column_family,
+                 const std::string& key,
+                 std::vector<ColumnOrSuperColumn>& columns,
+                 SAS::TrailId trail)
+{
+  if (speculative())
+  {
+    _speculative_reads->read<std::vector<ColumnOrSuperColumn> >(
+      _target,
+      [column_family, key](Client* c,
+                           ConsistencyLevel::type consistency_level,
+                           std::vector<ColumnOrSuperColumn>& result)
+      {
+        c->get_row(column_family, key, result, consistency_level);
+      },
+      columns,
+      trail);
+    return;
+  }
+
   HA(client, get_row, trail, column_family, key, columns);
 }
 
 
+//
+// SpeculativeReads methods
+//
+
+SpeculativeReads::Race::Race()
+{
+  pthread_mutex_init(&lock, NULL);
+
+  // Use the monotonic clock for the hedge delay.
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  for (int leg = 0; leg < NUM_LEGS; ++leg)
+  {
+    sent[leg] = false;
+    done[leg] = false;
+    retriable[leg] = false;
+  }
+}
+
+SpeculativeReads::Race::~Race()
+{
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&lock);
+}
+
+SpeculativeReads::SpeculativeReads(CassandraConnectionPool* conn_pool,
+                                   const std::string& keyspace,
+                                   unsigned int hedge_delay_ms,
+                                   unsigned int num_threads,
+                                   ExceptionHandler* exception_handler) :
+  _conn_pool(conn_pool),
+  _keyspace(keyspace),
+  _hedge_delay_ms(hedge_delay_ms),
+  _thread_pool(num_threads,
+               exception_handler,
+               exception_callback),
+  _reads(0),
+  _two_wins(0),
+  _one_wins(0),
+  _hedges(0),
+  _fallbacks(0),
+  _failures(0)
+{
+}
+
+SpeculativeReads::~SpeculativeReads()
+{
+}
+
+bool SpeculativeReads::start()
+{
+  return _thread_pool.start();
+}
+
+void SpeculativeReads::stop()
+{
+  _thread_pool.stop();
+}
+
+void SpeculativeReads::join()
+{
+  _thread_pool.join();
+}
+
+void SpeculativeReads::stats(Stats& stats) const
+{
+  stats.reads = _reads.load(std::memory_order_relaxed);
+  stats.two_wins = _two_wins.load(std::memory_order_relaxed);
+  stats.one_wins = _one_wins.load(std::memory_order_relaxed);
+  stats.hedges = _hedges.load(std::memory_order_relaxed);
+  stats.fallbacks = _fallbacks.load(std::memory_order_relaxed);
+  stats.failures = _failures.load(std::memory_order_relaxed);
+}
+
+int SpeculativeReads::race(const AddrInfo& target,
+                           LegFn fn,
+                           SAS::TrailId trail)
+{
+  std::shared_ptr<Race> race(new Race());
+  _reads.fetch_add(1, std::memory_order_relaxed);
+
+  struct timespec hedge_time;
+  clock_gettime(CLOCK_MONOTONIC, &hedge_time);
+  hedge_time.tv_sec += _hedge_delay_ms / 1000;
+  hedge_time.tv_nsec += (_hedge_delay_ms % 1000) * 1000000;
+
+  if (hedge_time.tv_nsec >= 1000000000)
+  {
+    hedge_time.tv_sec++;
+    hedge_time.tv_nsec -= 1000000000;
+  }
+
+  race->sent[TWO_LEG] = true;
+  send_leg(race, TWO_LEG, target, fn, trail);
+
+  int winner = -1;
+  bool send_one = false;
+
+  pthread_mutex_lock(&race->lock);
+
+  while (true)
+  {
+    if ((race->done[TWO_LEG]) && (!race->error[TWO_LEG]))
+    {
+      winner = TWO_LEG;
+      break;
+    }
+    else if ((race->done[ONE_LEG]) && (!race->error[ONE_LEG]))
+    {
+      winner = ONE_LEG;
+      break;
+    }
+    else if (race->sent[ONE_LEG])
+    {
+      if ((race->done[TWO_LEG]) && (race->done[ONE_LEG]))
+      {
+        // Both reads failed.
+        break;
+      }
+
+      pthread_cond_wait(&race->cond, &race->lock);
+    }
+    else if (race->done[TWO_LEG])
+    {
+      // The TWO read failed before the hedge delay.  Only send the ONE read
+      // if the failure was down to the consistency level.
+      if (!race->retriable[TWO_LEG])
+      {
+        break;
+      }
+
+      _fallbacks.fetch_add(1, std::memory_order_relaxed);
+      send_one = true;
+    }
+    else if (pthread_cond_timedwait(&race->cond,
+                                    &race->lock,
+                                    &hedge_time) == ETIMEDOUT)
+    {
+      if (!race->done[TWO_LEG])
+      {
+        TRC_DEBUG("TWO read is slow - sending ONE read");
+        _hedges.fetch_add(1, std::memory_order_relaxed);
+        send_one = true;
+      }
+    }
+
+    if (send_one)
+    {
+      send_one = false;
+      race->sent[ONE_LEG] = true;
+      pthread_mutex_unlock(&race->lock);
+      send_leg(race, ONE_LEG, target, fn, trail);
+      pthread_mutex_lock(&race->lock);
+    }
+  }
+
+  std::exception_ptr error = race->sent[ONE_LEG] ?
+                               race->error[ONE_LEG] : race->error[TWO_LEG];
+
+  pthread_mutex_unlock(&race->lock);
+
+  if (winner == TWO_LEG)
+  {
+    _two_wins.fetch_add(1, std::memory_order_relaxed);
+  }
+  else if (winner == ONE_LEG)
+  {
+    _one_wins.fetch_add(1, std::memory_order_relaxed);
+  }
+  else
+  {
+    _failures.fetch_add(1, std::memory_order_relaxed);
+    std::rethrow_exception(error);
+  }
+
+  return winner;
+}
+
+void SpeculativeReads::send_leg(std::shared_ptr<Race> race,
+                                int leg,
+                                const AddrInfo& target,
+                                LegFn fn,
+                                SAS::TrailId trail)
+{
+  _thread_pool.add_work([this, race, leg, target, fn, trail]()
+  {
+    run_leg(race, leg, target, fn, trail);
+  });
+}
+
+void SpeculativeReads::run_leg(std::shared_ptr<Race> race,
+                               int leg,
+                               const AddrInfo& target,
+                               LegFn fn,
+                               SAS::TrailId trail)
+{
+  std::exception_ptr error;
+  bool retriable = false;
+
+  // As in Store::perform_op, get a client and make sure it's connected.
+  ConnectionHandle<Client*> conn_handle = _conn_pool->get_connection(target);
+
+  try
+  {
+    if (!conn_handle.is_valid())
+    {
+      // The connection caps were reached and no connection came free in
+      // time.  Treat it as a timeout, so another node is tried but this one
+      // isn't blacklisted.
+      throw TimedOutException();
+    }
+
+    Client* client = conn_handle.get_connection();
+
+    if (!client->is_connected())
+    {
+      client->connect();
+      client->set_keyspace(_keyspace);
+    }
+
+    fn(leg,
+       client,
+       (leg == TWO_LEG) ? ConsistencyLevel::TWO : ConsistencyLevel::ONE);
+  }
+  catch(TTransportException& te)
+  {
+    // Don't reuse the connection.
+    conn_handle.set_return_to_pool(false);
+    error = std::current_exception();
+  }
+  catch(UnavailableException& ue)
+  {
+    error = std::current_exception();
+    retriable = true;
+
+    if (leg == TWO_LEG)
+    {
+      TRC_DEBUG("Failed speculative TWO read. Try ONE");
+      SAS::Event event(trail, SASEvent::CASS_REQUEST_TWO_FAIL, 0);
+      SAS::report_event(event);
+    }
+  }
+  catch(TimedOutException& te)
+  {
+    error = std::current_exception();
+    retriable = true;
+
+    if (leg == TWO_LEG)
+    {
+      TRC_DEBUG("Failed speculative TWO read. Try ONE");
+      SAS::Event event(trail, SASEvent::CASS_REQUEST_TWO_FAIL, 1);
+      SAS::report_event(event);
+    }
+  }
+  catch(...)
+  {
+    error = std::current_exception();
+  }
+
+  pthread_mutex_lock(&race->lock);
+  race->done[leg] = true;
+  race->error[leg] = error;
+  race->retriable[leg] = retriable;
+  pthread_cond_broadcast(&race->cond);
+  pthread_mutex_unlock(&race->lock);
+}
+
+
 //
 // Client methods
 //
@@ -253,9 +703,34 @@ Store::Store(const std::string& keyspace) :
   _num_threads(0),
   _max_queue(0),
   _thread_pool(NULL),
+  _num_fiber_threads(0),
+  _max_fibers(0),
+  _fiber_pool(NULL),
+  _hedge_delay_ms(0),
+  _num_speculative_threads(0),
+  _speculative_reads(NULL),
+  _coalesce_delay_ms(0),
+  _coalesce_max_mutations(0),
+  _write_coalescer(NULL),
+  _batch_delay_ms(0),
+  _batch_max_keys(0),
+  _read_batcher(NULL),
+  _coalesce_reads(false),
+  _read_coalescer(NULL),
+  _request_stats(),
+  _request_table(NULL),
+  _request_latency_table(NULL),
+  _slow_op_threshold_us(0),
+  _slow_op_max_per_second(0),
+  _slow_op_second(0),
+  _slow_ops_logged(0),
+  _slow_ops_suppressed(0),
+  _retry_budget(NULL),
   _comm_monitor(NULL),
-  _conn_pool(new CassandraConnectionPool())
+  _conn_pool(new CassandraConnectionPool()),
+  _protocol(CassandraConnectionPool::THRIFT)
 {
+  pthread_rwlock_init(&_request_stats_lock, NULL);
 }
 
 void Store::configure_connection(std::string cass_hostname,
@@ -273,6 +748,16 @@ void Store::configure_connection(std::string cass_hostname,
 }
 
 
+void Store::configure_protocol(CassandraConnectionPool::Protocol protocol)
+{
+  TRC_STATUS("Configuring store protocol: %s",
+             (protocol == CassandraConnectionPool::CQL) ? "CQL" : "Thrift");
+  delete _conn_pool;
+  _conn_pool = new CassandraConnectionPool(protocol);
+  _protocol = protocol;
+}
+
+
 ResultCode Store::connection_test()
 {
   TRC_DEBUG("Testing cassandra connection");
@@ -302,6 +787,186 @@ void Store::configure_workers(ExceptionHandler* exception_handler,
 }
 
 
+void Store::configure_fibers(unsigned int num_threads,
+                             unsigned int max_fibers)
+{
+  TRC_STATUS("Configuring store fiber pool");
+  TRC_STATUS("  Threads:   %u", num_threads);
+  TRC_STATUS("  Max Fibers: %u", max_fibers);
+  _num_fiber_threads = num_threads;
+  _max_fibers = max_fibers;
+}
+
+
+void Store::configure_speculative_reads(unsigned int hedge_delay_ms,
+                                        unsigned int num_threads)
+{
+  TRC_STATUS("Configuring store speculative reads");
+  TRC_STATUS("  Hedge Delay: %ums", hedge_delay_ms);
+  TRC_STATUS("  Threads:     %u", num_threads);
+  _hedge_delay_ms = hedge_delay_ms;
+  _num_speculative_threads = num_threads;
+}
+
+
+bool Store::get_speculative_read_stats(SpeculativeReads::Stats& stats) const
+{
+  if (_speculative_reads == NULL)
+  {
+    return false;
+  }
+
+  _speculative_reads->stats(stats);
+  return true;
+}
+
+
+void Store::configure_write_coalescing(unsigned int max_delay_ms,
+                                       unsigned int max_mutations)
+{
+  TRC_STATUS("Configuring store write coalescing");
+  TRC_STATUS("  Max Delay:     %ums", max_delay_ms);
+  TRC_STATUS("  Max Mutations: %u", max_mutations);
+  _coalesce_delay_ms = max_delay_ms;
+  _coalesce_max_mutations = max_mutations;
+}
+
+
+void Store::configure_read_batching(unsigned int max_delay_ms,
+                                    unsigned int max_keys)
+{
+  TRC_STATUS("Configuring store read batching");
+  TRC_STATUS("  Max Delay: %ums", max_delay_ms);
+  TRC_STATUS("  Max Keys:  %u", max_keys);
+  _batch_delay_ms = max_delay_ms;
+  _batch_max_keys = max_keys;
+}
+
+
+void Store::configure_read_coalescing()
+{
+  TRC_STATUS("Configuring store read coalescing");
+  _coalesce_reads = true;
+}
+
+
+bool Store::get_coalesced_read_stats(SingleFlightStats& stats) const
+{
+  if (_read_coalescer == NULL)
+  {
+    return false;
+  }
+
+  _read_coalescer->stats(stats);
+  return true;
+}
+
+
+void Store::set_request_stats_tables(SNMP::CassandraRequestTable* table,
+                                     SNMP::LatencyHistogramTable* latency_table)
+{
+  _request_table = table;
+  _request_latency_table = latency_table;
+}
+
+
+void Store::configure_slow_op_log(unsigned int threshold_ms,
+                                  unsigned int max_per_second)
+{
+  TRC_STATUS("Configuring store slow operation log");
+  TRC_STATUS("  Threshold:      %ums", threshold_ms);
+  TRC_STATUS("  Max Per Second: %u", max_per_second);
+  _slow_op_threshold_us = threshold_ms * 1000UL;
+  _slow_op_max_per_second = max_per_second;
+}
+
+
+CassandraRequestStats* Store::request_stats(const std::string& column_family,
+                                            const char* request)
+{
+  if (_request_table == NULL)
+  {
+    return NULL;
+  }
+
+  std::string name = column_family + ":" + request;
+  CassandraRequestStats* stats = NULL;
+
+  // Request types are only added the first time they're used, so usually
+  // only the read lock is needed.
+  pthread_rwlock_rdlock(&_request_stats_lock);
+  std::map<std::string, CassandraRequestStats*>::iterator i = _request_stats.find(name);
+
+  if (i != _request_stats.end())
+  {
+    stats = i->second;
+  }
+
+  pthread_rwlock_unlock(&_request_stats_lock);
+
+  if (stats == NULL)
+  {
+    pthread_rwlock_wrlock(&_request_stats_lock);
+    CassandraRequestStats*& entry = _request_stats[name];
+
+    if (entry == NULL)
+    {
+      entry = new CassandraRequestStats(name);
+      TRC_DEBUG("Adding stats for Cassandra requests %s", name.c_str());
+      _request_table->add_request_type(entry);
+
+      if (_request_latency_table != NULL)
+      {
+        _request_latency_table->add_histogram(name, &entry->latency());
+      }
+    }
+
+    stats = entry;
+    pthread_rwlock_unlock(&_request_stats_lock);
+  }
+
+  return stats;
+}
+
+
+void Store::log_slow_op(Operation* op,
+                        unsigned long duration_us,
+                        int attempts,
+                        ResultCode cass_result,
+                        const std::string& requests)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  unsigned long second = now.tv_sec;
+
+  if (_slow_op_second.exchange(second) != second)
+  {
+    _slow_ops_logged = 0;
+  }
+
+  if (_slow_ops_logged++ >= _slow_op_max_per_second)
+  {
+    _slow_ops_suppressed++;
+    return;
+  }
+
+  // Name the operation by its class.
+  int status = 0;
+  char* demangled = abi::__cxa_demangle(typeid(*op).name(), NULL, NULL, &status);
+  std::string op_name = (status == 0) ? demangled : typeid(*op).name();
+  free(demangled);
+
+  TRC_WARNING("Slow Cassandra operation %s took %luus (%d attempts, rc=%d, "
+              "%lu slow operations not logged): %s",
+              op_name.c_str(),
+              duration_us,
+              attempts,
+              cass_result,
+              _slow_ops_suppressed.exchange(0),
+              requests.c_str());
+}
+
+
 ResultCode Store::start()
 {
   ResultCode rc = OK;
@@ -326,6 +991,84 @@ ResultCode Store::start()
     }
   }
 
+  // Start the fiber pool.  Only CQL connections wait through it, so with
+  // Thrift a fiber would block its thread for the whole request.
+  if (_num_fiber_threads > 0)
+  {
+    if (_protocol == CassandraConnectionPool::CQL)
+    {
+      _fiber_pool = new FiberPool(_num_fiber_threads, _max_fibers);
+
+      if (!_fiber_pool->start())
+      {
+        rc = RESOURCE_ERROR; // LCOV_EXCL_LINE
+      }
+    }
+    else
+    {
+      TRC_WARNING("Store fibers need the CQL protocol - using worker threads");
+    }
+  }
+
+  // Start the speculative read threads.
+  if (_num_speculative_threads > 0)
+  {
+    if (_fiber_pool == NULL)
+    {
+      _speculative_reads = new SpeculativeReads(_conn_pool,
+                                                _keyspace,
+                                                _hedge_delay_ms,
+                                                _num_speculative_threads,
+                                                _exception_handler);
+
+      if (!_speculative_reads->start())
+      {
+        rc = RESOURCE_ERROR; // LCOV_EXCL_LINE
+      }
+    }
+    else
+    {
+      TRC_WARNING("Store speculative reads can't be used with fibers");
+    }
+  }
+
+  if (_coalesce_max_mutations > 0)
+  {
+    if (_fiber_pool == NULL)
+    {
+      _write_coalescer = new WriteCoalescer(_coalesce_delay_ms,
+                                            _coalesce_max_mutations);
+    }
+    else
+    {
+      TRC_WARNING("Store write coalescing can't be used with fibers");
+    }
+  }
+
+  if (_batch_max_keys > 0)
+  {
+    if (_fiber_pool == NULL)
+    {
+      _read_batcher = new ReadBatcher(_batch_delay_ms, _batch_max_keys);
+    }
+    else
+    {
+      TRC_WARNING("Store read batching can't be used with fibers");
+    }
+  }
+
+  if (_coalesce_reads)
+  {
+    if (_fiber_pool == NULL)
+    {
+      _read_coalescer = new ReadCoalescer();
+    }
+    else
+    {
+      TRC_WARNING("Store read coalescing can't be used with fibers");
+    }
+  }
+
   return rc;
 }
 
@@ -337,6 +1080,11 @@ void Store::stop()
   {
     _thread_pool->stop();
   }
+
+  if (_fiber_pool != NULL)
+  {
+    _fiber_pool->stop();
+  }
 }
 
 
@@ -349,12 +1097,38 @@ void Store::wait_stopped()
 
     delete _thread_pool; _thread_pool = NULL;
   }
+
+  if (_fiber_pool != NULL)
+  {
+    _fiber_pool->join();
+
+    delete _fiber_pool; _fiber_pool = NULL;
+  }
+
+  // Only stop the speculative reads once the worker threads (which may be
+  // waiting for them) have exited.
+  if (_speculative_reads != NULL)
+  {
+    _speculative_reads->stop();
+    _speculative_reads->join();
+
+    delete _speculative_reads; _speculative_reads = NULL;
+  }
+
+  delete _write_coalescer; _write_coalescer = NULL;
+  delete _read_batcher; _read_batcher = NULL;
+  delete _read_coalescer; _read_coalescer = NULL;
 }
 
 
 Store::~Store()
 {
-  if (_thread_pool != NULL)
+  if ((_thread_pool != NULL) ||
+      (_fiber_pool != NULL) ||
+      (_speculative_reads != NULL) ||
+      (_write_coalescer != NULL) ||
+      (_read_batcher != NULL) ||
+      (_read_coalescer != NULL))
   {
     // It is only safe to destroy the store once the thread pool has been deleted
     // (as the pool stores a pointer to the store). Make sure this is the case.
@@ -363,18 +1137,218 @@ Store::~Store()
   }
 
   delete _conn_pool; _conn_pool = NULL;
+
+  for (std::map<std::string, CassandraRequestStats*>::iterator i = _request_stats.begin();
+       i != _request_stats.end();
+       ++i)
+  {
+    delete i->second;
+  }
+
+  pthread_rwlock_destroy(&_request_stats_lock);
 }
 
 
+// Time a call on the wrapped client and record it, rethrowing any exception
+// it throws.
+#define STATS_CALL(COLUMN_FAMILY, REQUEST, CONSISTENCY_LEVEL, CALL)             \
+        Utils::StopWatch stopwatch;                                            \
+        stopwatch.start();                                                     \
+        std::exception_ptr error;                                              \
+        try                                                                    \
+        {                                                                      \
+          CALL;                                                                \
+        }                                                                      \
+        catch(...)                                                             \
+        {                                                                      \
+          error = std::current_exception();                                    \
+        }                                                                      \
+        unsigned long latency_us = 0;                                          \
+        stopwatch.read(latency_us);                                            \
+        record(COLUMN_FAMILY, REQUEST, CONSISTENCY_LEVEL, latency_us, error);  \
+        if (error)                                                             \
+        {                                                                      \
+          std::rethrow_exception(error);                                       \
+        }
+
+// A client that times the requests sent through it, and records them in the
+// store's stats for their column family and request type.  It also keeps a
+// description of each request if the store logs slow operations.
+class Store::StatsClient : public Client
+{
+public:
+  StatsClient(Store* store, Client* client, bool describe) :
+    _store(store),
+    _client(client),
+    _describe(describe),
+    _failed(NULL),
+    _two_failed(NULL),
+    _requests()
+  {}
+
+  virtual ~StatsClient() {}
+
+  bool is_connected() { return _client->is_connected(); }
+  void connect() { _client->connect(); }
+  void set_keyspace(const std::string& keyspace) { _client->set_keyspace(keyspace); }
+
+  void batch_mutate(const std::map<std::string, std::map<std::string, std::vector<Mutation> > >& mutation_map,
+                    const ConsistencyLevel::type consistency_level)
+  {
+    // Batches that write to more than one column family are counted together.
+    std::string column_family;
+
+    for (std::map<std::string, std::map<std::string, std::vector<Mutation> > >::const_iterator row = mutation_map.begin();
+         row != mutation_map.end();
+         ++row)
+    {
+      for (std::map<std::string, std::vector<Mutation> >::const_iterator cf = row->second.begin();
+           cf != row->second.end();
+           ++cf)
+      {
+        if (column_family.empty())
+        {
+          column_family = cf->first;
+        }
+        else if (column_family != cf->first)
+        {
+          column_family = "*";
+        }
+      }
+    }
+
+    STATS_CALL(column_family, "batch_mutate", consistency_level,
+               _client->batch_mutate(mutation_map, consistency_level));
+  }
+
+  void get_slice(std::vector<ColumnOrSuperColumn>& _return,
+                 const std::string& key,
+                 const ColumnParent& column_parent,
+                 const SlicePredicate& predicate,
+                 const ConsistencyLevel::type consistency_level)
+  {
+    STATS_CALL(column_parent.column_family, "get_slice", consistency_level,
+               _client->get_slice(_return, key, column_parent, predicate, consistency_level));
+  }
+
+  void multiget_slice(std::map<std::string, std::vector<ColumnOrSuperColumn> >& _return,
+                      const std::vector<std::string>& keys,
+                      const ColumnParent& column_parent,
+                      const SlicePredicate& predicate,
+                      const ConsistencyLevel::type consistency_level)
+  {
+    STATS_CALL(column_parent.column_family, "multiget_slice", consistency_level,
+               _client->multiget_slice(_return, keys, column_parent, predicate, consistency_level));
+  }
+
+  void remove(const std::string& key,
+              const ColumnPath& column_path,
+              const int64_t timestamp,
+              const ConsistencyLevel::type consistency_level)
+  {
+    STATS_CALL(column_path.column_family, "remove", consistency_level,
+               _client->remove(key, column_path, timestamp, consistency_level));
+  }
+
+  void get_range_slices(std::vector<KeySlice>& _return,
+                        const ColumnParent& column_parent,
+                        const SlicePredicate& predicate,
+                        const KeyRange& range,
+                        const ConsistencyLevel::type consistency_level)
+  {
+    STATS_CALL(column_parent.column_family, "get_range_slices", consistency_level,
+               _client->get_range_slices(_return, column_parent, predicate, range, consistency_level));
+  }
+
+  /// The stats for the request that failed the operation, if it failed.
+  CassandraRequestStats* failed() const { return _failed; }
+
+  /// The requests sent, if describing them.
+  const std::string& requests() const { return _requests; }
+
+private:
+  // Record a request that took latency_us.  If it failed, error is the
+  // exception it threw.
+  void record(const std::string& column_family,
+              const char* request,
+              ConsistencyLevel::type consistency_level,
+              unsigned long latency_us,
+              std::exception_ptr error)
+  {
+    CassandraRequestStats* stats = _store->request_stats(column_family, request);
+    bool failed = (bool)error;
+
+    if (stats != NULL)
+    {
+      stats->record_request(latency_us, failed);
+
+      // A request at consistency level ONE straight after the same request
+      // failed at TWO is the HA fallback.
+      if ((consistency_level == ConsistencyLevel::ONE) &&
+          (_two_failed == stats))
+      {
+        stats->record_fallback();
+      }
+    }
+
+    _failed = failed ? stats : NULL;
+    _two_failed = NULL;
+
+    if ((failed) && (consistency_level == ConsistencyLevel::TWO))
+    {
+      try
+      {
+        std::rethrow_exception(error);
+      }
+      catch(UnavailableException&)
+      {
+        _two_failed = stats;
+      }
+      catch(TimedOutException&)
+      {
+        _two_failed = stats;
+      }
+      catch(...)
+      {
+      }
+    }
+
+    if (_describe)
+    {
+      _requests.append((boost::format("%s%s:%s@%d=%luus%s")
+                        % (_requests.empty() ? "" : ", ")
+                        % column_family
+                        % request
+                        % consistency_level
+                        % latency_us
+                        % (failed ? "(failed)" : "")).str());
+    }
+  }
+
+  Store* _store;
+  Client* _client;
+  bool _describe;
+  CassandraRequestStats* _failed;
+  CassandraRequestStats* _two_failed;
+  std::string _requests;
+};
+
 bool Store::perform_op(Operation* op,
                        SAS::TrailId trail,
                        ResultCode& cass_result,
                        std::string& cass_error_text)
 {
+  PROFILE_SPAN("cassandra.perform");
   bool success = false;
   bool retry = true;
   int attempt_count = 0;
 
+  // Only time the operation's requests if something uses the timings.
+  bool record_stats = (_request_table != NULL) || (_slow_op_threshold_us > 0);
+  std::string requests;
+  Utils::StopWatch stopwatch;
+  stopwatch.start();
+
   // Resolve the host
   BaseAddrIterator* target_it = _resolver->resolve_iter(_cass_hostname,
                                                         _cass_port,
@@ -390,6 +1364,7 @@ bool Store::perform_op(Operation* op,
   {
     cass_result = OK;
     attempt_count++;
+    CassandraRequestStats* failed_request = NULL;
 
     // Both Cassandra timeouts and connection errors should result in a retry
     retry = false;
@@ -401,6 +1376,12 @@ bool Store::perform_op(Operation* op,
     // exceptions and turn them into return codes and error text.
     try
     {
+      if (!conn_handle.is_valid())
+      {
+        // As in run_leg, a connection cap being reached is a timeout.
+        throw TimedOutException();
+      }
+
       // Ensure the client is connected and perform the operation
       Client* client = conn_handle.get_connection();
 
@@ -411,7 +1392,48 @@ bool Store::perform_op(Operation* op,
         client->set_keyspace(_keyspace);
       }
 
-      success = op->perform(client, trail);
+      op->_speculative_reads = _speculative_reads;
+      op->_target = target;
+      op->_read_coalescer = _read_coalescer;
+
+      // Pass the operation's requests through the stats client, its reads
+      // through the batcher and its writes through the coalescer, as
+      // configured.  The stats client is innermost, so that it times the
+      // combined reads and writes that are sent.
+      StatsClient stats_client(this, client, (_slow_op_threshold_us > 0));
+
+      if (record_stats)
+      {
+        client = &stats_client;
+      }
+
+      BatchingClient batching_client(client, _read_batcher, target);
+
+      if (_read_batcher != NULL)
+      {
+        client = &batching_client;
+      }
+
+      try
+      {
+        if (_write_coalescer != NULL)
+        {
+          CoalescingClient coalescing_client(client, _write_coalescer, target);
+          success = op->perform(&coalescing_client, trail);
+        }
+        else
+        {
+          success = op->perform(client, trail);
+        }
+      }
+      catch(...)
+      {
+        failed_request = stats_client.failed();
+        requests.append((attempt_count > 1) ? "; " : "").append(stats_client.requests());
+        throw;
+      }
+
+      requests.append((attempt_count > 1) ? "; " : "").append(stats_client.requests());
     }
     catch(TTransportException& te)
     {
@@ -493,6 +1515,36 @@ bool Store::perform_op(Operation* op,
     {
       _resolver->success(target);
     }
+
+    if (_retry_budget != NULL)
+    {
+      if (!retry)
+      {
+        if (attempt_count == 1)
+        {
+          _retry_budget->first_attempt_succeeded();
+        }
+      }
+      else if ((attempt_count < 2) && (!_retry_budget->try_retry()))
+      {
+        TRC_DEBUG("Not retrying as the retry budget is exhausted");
+        retry = false;
+      }
+    }
+
+    if ((retry) && (attempt_count < 2) && (failed_request != NULL))
+    {
+      failed_request->record_retry();
+    }
+  }
+
+  unsigned long duration_us = 0;
+
+  if ((_slow_op_threshold_us > 0) &&
+      (stopwatch.read(duration_us)) &&
+      (duration_us > _slow_op_threshold_us))
+  {
+    log_slow_op(op, duration_us, attempt_count, cass_result, requests);
   }
 
   return success;
@@ -551,14 +1603,26 @@ bool Store::do_sync(Operation* op, SAS::TrailId trail)
 
 void Store::do_async(Operation*& op, Transaction*& trx)
 {
-  if (_thread_pool == NULL)
+  if (_fiber_pool != NULL)
   {
-    TRC_ERROR("Can't process async operation as no thread pool has been configured");
-    assert(!"Can't process async operation as no thread pool has been configured");
+    Operation* fiber_op = op;
+    Transaction* fiber_trx = trx;
+    _fiber_pool->run([this, fiber_op, fiber_trx]()
+    {
+      process_async(fiber_op, fiber_trx);
+    });
   }
+  else
+  {
+    if (_thread_pool == NULL)
+    {
+      TRC_ERROR("Can't process async operation as no thread pool has been configured");
+      assert(!"Can't process async operation as no thread pool has been configured");
+    }
 
-  std::pair<Operation*, Transaction*> params(op, trx);
-  _thread_pool->add_work(params);
+    std::pair<Operation*, Transaction*> params(op, trx);
+    _thread_pool->add_work(params);
+  }
 
   // The caller no longer owns the operation or transaction, so null them out.
   op = NULL;
@@ -587,18 +1651,20 @@ Store::Pool::~Pool() {}
 
 void Store::Pool::process_work(std::pair<Operation*, Transaction*>& params)
 {
-  bool success = false;
+  _store->process_async(params.first, params.second);
+}
+
 
-  // Extract the operation and transaction.
-  Operation* op = params.first;
-  Transaction* trx = params.second;
+void Store::process_async(Operation* op, Transaction* trx)
+{
+  bool success = false;
 
   // Run the operation.  Catch all exceptions to stop an error from killing the
   // worker thread.
   try
   {
     trx->start_timer();
-    success = _store->do_sync(op, trx->trail);
+    success = do_sync(op, trx->trail);
   }
   // LCOV_EXCL_START Transaction catches all exceptions so the thread pool
   // fallback code is never triggered.
@@ -620,8 +1686,8 @@ void Store::Pool::process_work(std::pair<Operation*, Transaction*>& params)
   }
 
   // We own the transaction and operation so have to free them.
-  delete trx; trx = NULL;
-  delete op; op = NULL;
+  delete trx;
+  delete op;
 }
 
 
@@ -629,7 +1695,13 @@ void Store::Pool::process_work(std::pair<Operation*, Transaction*>& params)
 // Operation methods.
 //
 
-Operation::Operation() : _cass_status(OK), _cass_error_text() {}
+Operation::Operation() :
+  _cass_status(OK),
+  _cass_error_text(),
+  _speculative_reads(NULL),
+  _target(),
+  _read_coalescer(NULL)
+{}
 
 ResultCode Operation::get_result_code()
 {
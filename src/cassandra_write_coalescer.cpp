@@ -0,0 +1,213 @@
+/**
+ * @file cassandra_write_coalescer.cpp  Merges concurrent writes to Cassandra
+ * into combined batch_mutate calls.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <errno.h>
+#include <time.h>
+
+#include "log.h"
+#include "cassandra_write_coalescer.h"
+
+namespace CassandraStore
+{
+
+WriteCoalescer::Batch::Batch() :
+  mutations(),
+  num_mutations(0),
+  closed(false),
+  done(false),
+  error()
+{
+  // Use the monotonic clock for the delay.
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+}
+
+WriteCoalescer::Batch::~Batch()
+{
+  pthread_cond_destroy(&cond);
+}
+
+WriteCoalescer::WriteCoalescer(unsigned int max_delay_ms,
+                               unsigned int max_mutations) :
+  _max_delay_ms(max_delay_ms),
+  _max_mutations(max_mutations),
+  _queues(),
+  _writes(0),
+  _batches(0),
+  _mutations(0)
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+WriteCoalescer::~WriteCoalescer()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+void WriteCoalescer::batch_mutate(Client* client,
+                                  const AddrInfo& target,
+                                  const MutationMap& mutation_map,
+                                  const cass::ConsistencyLevel::type consistency_level)
+{
+  _writes.fetch_add(1, std::memory_order_relaxed);
+
+  QueueKey key(target, consistency_level);
+  std::shared_ptr<Batch> batch;
+
+  pthread_mutex_lock(&_lock);
+  Queue& queue = _queues[key];
+
+  if (queue.open != NULL)
+  {
+    // Join the open batch, and wait for whoever opened it to send it.
+    batch = queue.open;
+    merge(*batch, mutation_map);
+
+    if (batch->num_mutations >= _max_mutations)
+    {
+      close(queue, *batch);
+    }
+
+    while (!batch->done)
+    {
+      pthread_cond_wait(&batch->cond, &_lock);
+    }
+
+    std::exception_ptr error = batch->error;
+    pthread_mutex_unlock(&_lock);
+
+    if (error)
+    {
+      std::rethrow_exception(error);
+    }
+
+    return;
+  }
+
+  batch.reset(new Batch());
+  merge(*batch, mutation_map);
+
+  if ((queue.in_flight > 0) && (batch->num_mutations < _max_mutations))
+  {
+    // Another batch is being sent, so let other writes join this one until
+    // that batch completes, this one fills up or the delay expires.
+    queue.open = batch;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += _max_delay_ms / 1000;
+    deadline.tv_nsec += (_max_delay_ms % 1000) * 1000000;
+
+    if (deadline.tv_nsec >= 1000000000)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+
+    while ((!batch->closed) &&
+           (_queues[key].in_flight > 0) &&
+           (pthread_cond_timedwait(&batch->cond, &_lock, &deadline) != ETIMEDOUT))
+    {
+    }
+
+    if (!batch->closed)
+    {
+      close(_queues[key], *batch);
+    }
+  }
+
+  // Send the batch.  Look the queue up again, as it may have been removed
+  // while we waited.
+  _queues[key].in_flight++;
+  pthread_mutex_unlock(&_lock);
+
+  _batches.fetch_add(1, std::memory_order_relaxed);
+  _mutations.fetch_add(batch->num_mutations, std::memory_order_relaxed);
+  TRC_DEBUG("Sending batch of %u mutations", batch->num_mutations);
+
+  std::exception_ptr error;
+
+  try
+  {
+    client->batch_mutate(batch->mutations, consistency_level);
+  }
+  catch(...)
+  {
+    error = std::current_exception();
+  }
+
+  pthread_mutex_lock(&_lock);
+
+  batch->done = true;
+  batch->error = error;
+  pthread_cond_broadcast(&batch->cond);
+
+  Queue& sent_queue = _queues[key];
+  sent_queue.in_flight--;
+
+  if (sent_queue.open != NULL)
+  {
+    // Let whoever opened the next batch send it.
+    pthread_cond_broadcast(&sent_queue.open->cond);
+  }
+  else if (sent_queue.in_flight == 0)
+  {
+    _queues.erase(key);
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  if (error)
+  {
+    std::rethrow_exception(error);
+  }
+}
+
+void WriteCoalescer::stats(Stats& stats) const
+{
+  stats.writes = _writes.load(std::memory_order_relaxed);
+  stats.batches = _batches.load(std::memory_order_relaxed);
+  stats.mutations = _mutations.load(std::memory_order_relaxed);
+}
+
+void WriteCoalescer::merge(Batch& batch, const MutationMap& mutation_map)
+{
+  for (MutationMap::const_iterator row = mutation_map.begin();
+       row != mutation_map.end();
+       ++row)
+  {
+    for (std::map<std::string, std::vector<cass::Mutation> >::const_iterator cf = row->second.begin();
+         cf != row->second.end();
+         ++cf)
+    {
+      std::vector<cass::Mutation>& mutations = batch.mutations[row->first][cf->first];
+      mutations.insert(mutations.end(), cf->second.begin(), cf->second.end());
+      batch.num_mutations += cf->second.size();
+    }
+  }
+}
+
+void WriteCoalescer::close(Queue& queue, Batch& batch)
+{
+  if (queue.open.get() == &batch)
+  {
+    queue.open.reset();
+  }
+
+  batch.closed = true;
+  pthread_cond_broadcast(&batch.cond);
+}
+
+} // namespace CassandraStore
@@ -9,10 +9,11 @@
  * Metaswitch Networks in a separate written agreement.
  */
 
+#include <pthread.h>
+#include <algorithm>
 #include <string>
 #include <map>
-#include "rapidjson/writer.h"
-#include "rapidjson/stringbuffer.h"
+#include "json_writer.h"
 
 #include "utils.h"
 #include "log.h"
@@ -23,6 +24,7 @@
 #include "chronosconnection.h"
 
 const std::map<std::string, uint32_t> ChronosConnection::EMPTY_TAGS = std::map<std::string, uint32_t>();
+const size_t ChronosConnection::MAX_BATCH_IN_FLIGHT;
 
 ChronosConnection::ChronosConnection(std::string callback_host,
                                      HttpConnection* http) :
@@ -151,14 +153,189 @@ HTTPCode ChronosConnection::send_post(std::string& post_identity,
   return send_post(post_identity, timer_interval, timer_interval, callback_uri, opaque_data, trail, tags);
 }
 
+void ChronosConnection::send_batch(std::vector<TimerOperation>& operations,
+                                   SAS::TrailId trail)
+{
+  pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+  bool done = false;
+
+  send_batch_async(std::move(operations),
+                   trail,
+                   [&](std::vector<TimerOperation>& completed)
+                   {
+                     pthread_mutex_lock(&lock);
+                     operations = std::move(completed);
+                     done = true;
+                     pthread_cond_signal(&cond);
+                     pthread_mutex_unlock(&lock);
+                   });
+
+  pthread_mutex_lock(&lock);
+
+  while (!done)
+  {
+    pthread_cond_wait(&cond, &lock);
+  }
+
+  pthread_mutex_unlock(&lock);
+
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&lock);
+}
+
+void ChronosConnection::send_batch_async(std::vector<TimerOperation> operations,
+                                         SAS::TrailId trail,
+                                         BatchCallback callback)
+{
+  if (operations.empty())
+  {
+    callback(operations);
+    return;
+  }
+
+  std::shared_ptr<Batch> batch = std::make_shared<Batch>();
+  batch->operations = std::move(operations);
+  batch->trail = trail;
+  batch->callback = std::move(callback);
+  batch->next = 0;
+  batch->outstanding = batch->operations.size();
+
+  // Write all the bodies up front, so that they don't move once the requests
+  // are pointing at them.
+  batch->body_offsets.reserve(batch->operations.size() + 1);
+
+  for (std::vector<TimerOperation>::const_iterator it = batch->operations.begin();
+       it != batch->operations.end();
+       ++it)
+  {
+    batch->body_offsets.push_back(batch->bodies.size());
+
+    if (it->type != HttpClient::RequestType::DELETE)
+    {
+      write_body(batch->bodies,
+                 it->interval,
+                 it->repeat_for,
+                 it->callback_uri,
+                 it->opaque_data,
+                 it->tags);
+    }
+  }
+
+  batch->body_offsets.push_back(batch->bodies.size());
+  batch->body_data = batch->bodies.data();
+
+  size_t in_flight = std::min(batch->operations.size(), MAX_BATCH_IN_FLIGHT);
+
+  for (size_t ii = 0; ii < in_flight; ++ii)
+  {
+    send_next_in_batch(batch);
+  }
+}
+
+void ChronosConnection::send_next_in_batch(std::shared_ptr<Batch> batch)
+{
+  // Once the last operation has finished, the batch's operations belong to
+  // the callback, so get the number of them first.
+  size_t count = batch->body_offsets.size() - 1;
+  size_t index;
+
+  while ((index = batch->next++) < count)
+  {
+    TimerOperation& op = batch->operations[index];
+    std::string path = "/timers";
+
+    if (op.type != HttpClient::RequestType::POST)
+    {
+      if (op.identity == "")
+      {
+        // As in send_delete, don't bother sending this to Chronos, as it will
+        // just reject it.
+        TRC_ERROR("Can't update or delete a timer with an empty timer id");
+        op.rc = HTTP_BADMETHOD;
+
+        if (finish_batch_operation(batch))
+        {
+          return;
+        }
+
+        continue;
+      }
+
+      path += "/" + Utils::url_escape(op.identity);
+    }
+
+    HttpRequest req = _http->create_request(op.type, path);
+    req.set_sas_trail(batch->trail);
+
+    if (op.type != HttpClient::RequestType::DELETE)
+    {
+      size_t offset = batch->body_offsets[index];
+      req.set_body_buffer(batch->body_data + offset,
+                          batch->body_offsets[index + 1] - offset);
+    }
+
+    req.send_async([this, batch, index](HttpResponse resp)
+    {
+      TimerOperation& op = batch->operations[index];
+      op.rc = resp.get_rc();
+
+      if ((op.rc == HTTP_OK) && (op.type != HttpClient::RequestType::DELETE))
+      {
+        std::string timer_url = get_location_header(resp.get_headers());
+
+        if (timer_url != "")
+        {
+          op.identity = timer_url;
+        }
+        else
+        {
+          op.rc = HTTP_BAD_REQUEST;
+        }
+      }
+
+      // Keep the batch's requests in flight, then complete this one.
+      send_next_in_batch(batch);
+      finish_batch_operation(batch);
+    });
+
+    return;
+  }
+}
+
+bool ChronosConnection::finish_batch_operation(std::shared_ptr<Batch> batch)
+{
+  if (--batch->outstanding == 0)
+  {
+    batch->callback(batch->operations);
+    return true;
+  }
+
+  return false;
+}
+
 std::string ChronosConnection::create_body(uint32_t interval,
                                            uint32_t repeat_for,
                                            const std::string& path,
                                            const std::string& opaque_data,
                                            const std::map<std::string, uint32_t>& tags)
 {
-  rapidjson::StringBuffer sb;
-  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+  // Write the body straight into the string that's returned, rather than
+  // copying it out of a separate buffer.
+  std::string body;
+  write_body(body, interval, repeat_for, path, opaque_data, tags);
+  return body;
+}
+
+void ChronosConnection::write_body(std::string& body,
+                                   uint32_t interval,
+                                   uint32_t repeat_for,
+                                   const std::string& path,
+                                   const std::string& opaque_data,
+                                   const std::map<std::string, uint32_t>& tags)
+{
+  JsonStringStream stream(body);
+  JsonStringWriter writer(stream);
 
   writer.StartObject();
   {
@@ -212,8 +389,6 @@ std::string ChronosConnection::create_body(uint32_t interval,
     writer.EndObject();
   }
   writer.EndObject();
-
-  return sb.GetString();
 }
 
 std::string ChronosConnection::get_location_header(std::map<std::string, std::string> headers)
@@ -10,9 +10,12 @@
  */
 
 #include "communicationmonitor.h"
+#include "fast_clock.h"
 #include "log.h"
 #include "cpp_common_pd_definitions.h"
 
+const unsigned long CommunicationMonitor::CHECKING;
+
 CommunicationMonitor::CommunicationMonitor(Alarm* alarm,
                                            std::string sender,
                                            std::string receiver,
@@ -24,9 +27,9 @@ CommunicationMonitor::CommunicationMonitor(Alarm* alarm,
   _receiver(receiver),
   _clear_confirm_ms(clear_confirm_sec * 1000),
   _set_confirm_ms(set_confirm_sec * 1000),
+  _next_check(current_time_ms() + _set_confirm_ms),
   _previous_state(0)
 {
-  _next_check = current_time_ms() + _set_confirm_ms;
 }
 
 CommunicationMonitor::~CommunicationMonitor()
@@ -37,130 +40,122 @@ CommunicationMonitor::~CommunicationMonitor()
 void CommunicationMonitor::track_communication_changes(unsigned long now_ms)
 {
   now_ms = now_ms ? now_ms : current_time_ms();
-
-  if (now_ms > _next_check)
+  unsigned long next_check = _next_check.load(std::memory_order_relaxed);
+
+  // If the current time has passed our monitor interval time, see if we are
+  // the lucky thread that gets to check for an alarm condition.  If another
+  // thread is already checking, _next_check is CHECKING so we don't get
+  // here, and if another thread has just checked the exchange fails.
+  if ((now_ms > next_check) &&
+      (_next_check.compare_exchange_strong(next_check,
+                                           CHECKING,
+                                           std::memory_order_acquire)))
   {
-    // Current time has passed our monitor interval time, so take the lock
-    // and see if we are the lucky thread that gets to check for an alarm
-    // condition.
-    pthread_mutex_lock(&_lock);
-
-    // If current time is still past the monitor interval time we are the
-    // the lucky one, otherwise somebody beat us to the punch (so just drop
-    // the lock and return).
-    if (now_ms > _next_check)
+    // Grab the current counts and reset them to zero in a lockless manner.
+    unsigned int succeeded = _succeeded.exchange(0, std::memory_order_relaxed);
+    unsigned int failed = _failed.exchange(0, std::memory_order_relaxed);
+    TRC_DEBUG("Checking communication changes - successful attempts %d, failures %d",
+              succeeded, failed);
+
+    int _new_state = 0;
+    // Determine the new error state based on the results.
+    // States:
+    // NO_ERRORS: At least one success and no failures
+    // SOME_ERRORS: At least one success and at least one failure
+    // ONLY_ERRORS: No successes and at least one failure
+    if ((succeeded != 0) && (failed == 0))
+    {
+      _new_state = NO_ERRORS;
+    }
+    else if ((succeeded != 0) && (failed != 0))
+    {
+      _new_state = SOME_ERRORS;
+    }
+    else if ((succeeded == 0) && (failed != 0))
     {
-      // Grab the current counts and reset them to zero in a lockless manner.
-      unsigned int succeeded = _succeeded.fetch_and(0);
-      unsigned int failed = _failed.fetch_and(0);
-      TRC_DEBUG("Checking communication changes - successful attempts %d, failures %d",
-                succeeded, failed);
-
-      int _new_state = 0;
-      // Determine the new error state based on the results.
-      // States:
-      // NO_ERRORS: At least one success and no failures
-      // SOME_ERRORS: At least one success and at least one failure
-      // ONLY_ERRORS: No successes and at least one failure
-      if ((succeeded != 0) && (failed == 0))
-      {
-        _new_state = NO_ERRORS;
-      }
-      else if ((succeeded != 0) && (failed != 0))
-      {
-        _new_state = SOME_ERRORS;
-      }
-      else if ((succeeded == 0) && (failed != 0))
-      {
-        _new_state = ONLY_ERRORS;
-      }
-
-      // Check if we need to raise any logs/alarms. We do so if:
-      // - We are currently in the NO_ERRORS or SOME_ERRORS states, and
-      //   we have seen a change in state in the last 'set_confirm' ms.
-      // - We are currently in the ONLY_ERRORS state, and we have
-      //   seen a change of state in the last 'clear_confirm' ms.
-      switch (_previous_state)
-      {
-        case NO_ERRORS:
-          switch (_new_state)
-          {
-            case NO_ERRORS: // No change in state. Ensure alarm is cleared.
-              _alarm->clear();
-              break;
-
-            case SOME_ERRORS:
-              CL_CM_CONNECTION_PARTIAL_ERROR.log(_sender.c_str(),
-                                                 _receiver.c_str());
-              _alarm->clear();
-              break;
-
-            case ONLY_ERRORS:
-              CL_CM_CONNECTION_ERRORED.log(_sender.c_str(),
-                                           _receiver.c_str());
-              _alarm->set();
-              break;
-          }
-          break;
-        case SOME_ERRORS:
-          switch (_new_state)
-          {
-            case NO_ERRORS:
-              CL_CM_CONNECTION_CLEARED.log(_sender.c_str(),
-                                           _receiver.c_str());
-              _alarm->clear();
-              break;
-
-            case SOME_ERRORS: // No change in state. Ensure alarm is cleared.
-              _alarm->clear();
-              break;
-
-            case ONLY_ERRORS:
-              CL_CM_CONNECTION_ERRORED.log(_sender.c_str(),
-                                           _receiver.c_str());
-              _alarm->set();
-              break;
-          }
-          break;
-        case ONLY_ERRORS:
-          switch (_new_state)
-          {
-            case NO_ERRORS:
-              CL_CM_CONNECTION_CLEARED.log(_sender.c_str(),
-                                           _receiver.c_str());
-              _alarm->clear();
-              break;
-
-            case SOME_ERRORS:
-              CL_CM_CONNECTION_PARTIAL_ERROR.log(_sender.c_str(),
-                                                 _receiver.c_str());
-              _alarm->clear();
-              break;
-
-            case ONLY_ERRORS: // No change in state. Ensure alarm is raised.
-              _alarm->set();
-              break;
-          }
-          break;
-      }
-
-      // Set the previous state to the new state, as operation is finished.
-      _previous_state = _new_state;
-
-      // Set the next check interval.
-      _next_check = (_new_state == ONLY_ERRORS) ? now_ms + _clear_confirm_ms :
-                                                  now_ms + _set_confirm_ms;
+      _new_state = ONLY_ERRORS;
     }
 
-    pthread_mutex_unlock(&_lock);
+    // Check if we need to raise any logs/alarms. We do so if:
+    // - We are currently in the NO_ERRORS or SOME_ERRORS states, and
+    //   we have seen a change in state in the last 'set_confirm' ms.
+    // - We are currently in the ONLY_ERRORS state, and we have
+    //   seen a change of state in the last 'clear_confirm' ms.
+    switch (_previous_state)
+    {
+      case NO_ERRORS:
+        switch (_new_state)
+        {
+          case NO_ERRORS: // No change in state. Ensure alarm is cleared.
+            _alarm->clear();
+            break;
+
+          case SOME_ERRORS:
+            CL_CM_CONNECTION_PARTIAL_ERROR.log(_sender.c_str(),
+                                               _receiver.c_str());
+            _alarm->clear();
+            break;
+
+          case ONLY_ERRORS:
+            CL_CM_CONNECTION_ERRORED.log(_sender.c_str(),
+                                         _receiver.c_str());
+            _alarm->set();
+            break;
+        }
+        break;
+      case SOME_ERRORS:
+        switch (_new_state)
+        {
+          case NO_ERRORS:
+            CL_CM_CONNECTION_CLEARED.log(_sender.c_str(),
+                                         _receiver.c_str());
+            _alarm->clear();
+            break;
+
+          case SOME_ERRORS: // No change in state. Ensure alarm is cleared.
+            _alarm->clear();
+            break;
+
+          case ONLY_ERRORS:
+            CL_CM_CONNECTION_ERRORED.log(_sender.c_str(),
+                                         _receiver.c_str());
+            _alarm->set();
+            break;
+        }
+        break;
+      case ONLY_ERRORS:
+        switch (_new_state)
+        {
+          case NO_ERRORS:
+            CL_CM_CONNECTION_CLEARED.log(_sender.c_str(),
+                                         _receiver.c_str());
+            _alarm->clear();
+            break;
+
+          case SOME_ERRORS:
+            CL_CM_CONNECTION_PARTIAL_ERROR.log(_sender.c_str(),
+                                               _receiver.c_str());
+            _alarm->clear();
+            break;
+
+          case ONLY_ERRORS: // No change in state. Ensure alarm is raised.
+            _alarm->set();
+            break;
+        }
+        break;
+    }
+
+    // Set the previous state to the new state, as operation is finished.
+    _previous_state = _new_state;
+
+    // Set the next check interval, which lets other threads check again.
+    _next_check.store((_new_state == ONLY_ERRORS) ? now_ms + _clear_confirm_ms :
+                                                     now_ms + _set_confirm_ms,
+                      std::memory_order_release);
   }
 }
 
 unsigned long CommunicationMonitor::current_time_ms()
 {
-  struct timespec ts;
-
-  clock_gettime(CLOCK_MONOTONIC, &ts);
-
-  return ts.tv_sec * 1000 + (ts.tv_nsec / 1000000);
+  return FastClock::now_ns() / 1000000;
 }
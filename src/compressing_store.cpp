@@ -0,0 +1,419 @@
+/**
+ * @file compressing_store.cpp Store that compresses records written to another
+ * Store.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include <vector>
+
+#include <lz4.h>
+
+#include "log.h"
+#include "compressing_store.h"
+
+/// LZ4 can only refer back this far, so only the end of a dictionary is used.
+static const size_t MAX_LZ4_DICTIONARY = 64 * 1024;
+
+Lz4StoreCodec::Lz4StoreCodec(uint8_t id, const std::string& dictionary) :
+  StoreCodec(id),
+  _dictionary(dictionary.length() > MAX_LZ4_DICTIONARY ?
+                dictionary.substr(dictionary.length() - MAX_LZ4_DICTIONARY) :
+                dictionary)
+{
+}
+
+bool Lz4StoreCodec::compress(const std::string& data,
+                             std::string& compressed) const
+{
+  if (data.length() > LZ4_MAX_INPUT_SIZE)
+  {
+    return false;
+  }
+
+  compressed.resize(LZ4_compressBound(data.length()));
+  int length;
+
+  if (_dictionary.empty())
+  {
+    length = LZ4_compress_default(data.data(),
+                                  &compressed[0],
+                                  data.length(),
+                                  compressed.length());
+  }
+  else
+  {
+    // Loading the dictionary hashes it, which costs about as much as
+    // compressing a record of the same length - this is cheap enough for the
+    // dictionaries of a few KB that work best for small records.
+    LZ4_stream_t* stream = LZ4_createStream();
+    LZ4_loadDict(stream, _dictionary.data(), _dictionary.length());
+    length = LZ4_compress_fast_continue(stream,
+                                        data.data(),
+                                        &compressed[0],
+                                        data.length(),
+                                        compressed.length(),
+                                        1);
+    LZ4_freeStream(stream);
+  }
+
+  if (length <= 0)
+  {
+    return false;
+  }
+
+  compressed.resize(length);
+  return true;
+}
+
+bool Lz4StoreCodec::decompress(const char* compressed,
+                               size_t compressed_length,
+                               size_t length,
+                               std::string& data) const
+{
+  // LZ4 can't expand data by more than a factor of 255, so anything claiming
+  // to is corrupt - don't allocate space for it.
+  if ((compressed_length > LZ4_MAX_INPUT_SIZE) ||
+      (length > compressed_length * 255))
+  {
+    return false;
+  }
+
+  data.resize(length);
+
+  if (length == 0)
+  {
+    return true;
+  }
+
+  int rc;
+
+  if (_dictionary.empty())
+  {
+    rc = LZ4_decompress_safe(compressed,
+                             &data[0],
+                             compressed_length,
+                             length);
+  }
+  else
+  {
+    rc = LZ4_decompress_safe_usingDict(compressed,
+                                       &data[0],
+                                       compressed_length,
+                                       length,
+                                       _dictionary.data(),
+                                       _dictionary.length());
+  }
+
+  return (rc == (int)length);
+}
+
+const char CompressingStore::MAGIC[3] = {'\0', 'C', 'Z'};
+const size_t CompressingStore::HEADER_LENGTH;
+
+CompressingStore::CompressingStore(Store* store,
+                                   const StoreCodec* codec,
+                                   const std::vector<const StoreCodec*>& codecs,
+                                   size_t min_length) :
+  _store(store),
+  _codec(codec),
+  _codecs(),
+  _min_length(min_length),
+  _compressed(0),
+  _bytes_in(0),
+  _bytes_out(0),
+  _uncompressed(0)
+{
+  if (_codec != NULL)
+  {
+    _codecs[_codec->id()] = _codec;
+  }
+
+  for (std::vector<const StoreCodec*>::const_iterator i = codecs.begin();
+       i != codecs.end();
+       ++i)
+  {
+    _codecs[(*i)->id()] = *i;
+  }
+
+  TRC_DEBUG("Created compressing store (codec %d, %d codecs known)",
+            (_codec != NULL) ? _codec->id() : -1, _codecs.size());
+}
+
+CompressingStore::~CompressingStore()
+{
+}
+
+Store::Status CompressingStore::get_data(const std::string& table,
+                                         const std::string& key,
+                                         std::string& data,
+                                         uint64_t& cas,
+                                         SAS::TrailId trail,
+                                         bool log_body,
+                                         Store::Format data_format)
+{
+  Store::Status status = _store->get_data(table,
+                                          key,
+                                          data,
+                                          cas,
+                                          trail,
+                                          log_body,
+                                          read_format(data_format));
+
+  if ((status == Store::Status::OK) && (!decode(key, data)))
+  {
+    status = Store::Status::ERROR;
+  }
+
+  return status;
+}
+
+Store::Status CompressingStore::set_data(const std::string& table,
+                                         const std::string& key,
+                                         const std::string& data,
+                                         uint64_t cas,
+                                         int expiry,
+                                         SAS::TrailId trail,
+                                         bool log_body,
+                                         Store::Format data_format)
+{
+  std::string encoded;
+  const std::string& to_write = encode(data, data_format, encoded);
+  return _store->set_data(table,
+                          key,
+                          to_write,
+                          cas,
+                          expiry,
+                          trail,
+                          log_body,
+                          data_format);
+}
+
+Store::Status CompressingStore::set_data_without_cas(const std::string& table,
+                                                     const std::string& key,
+                                                     const std::string& data,
+                                                     int expiry,
+                                                     SAS::TrailId trail,
+                                                     bool log_body,
+                                                     Store::Format data_format)
+{
+  std::string encoded;
+  const std::string& to_write = encode(data, data_format, encoded);
+  return _store->set_data_without_cas(table,
+                                      key,
+                                      to_write,
+                                      expiry,
+                                      trail,
+                                      log_body,
+                                      data_format);
+}
+
+Store::Status CompressingStore::delete_data(const std::string& table,
+                                            const std::string& key,
+                                            SAS::TrailId trail)
+{
+  return _store->delete_data(table, key, trail);
+}
+
+void CompressingStore::get_data_multi(const std::string& table,
+                                      const std::vector<std::string>& keys,
+                                      std::vector<Store::GetResult>& results,
+                                      SAS::TrailId trail,
+                                      bool log_body,
+                                      Store::Format data_format)
+{
+  _store->get_data_multi(table,
+                         keys,
+                         results,
+                         trail,
+                         log_body,
+                         read_format(data_format));
+
+  for (size_t ii = 0; ii < results.size(); ++ii)
+  {
+    if ((results[ii].status == Store::Status::OK) &&
+        (!decode(keys[ii], results[ii].data)))
+    {
+      results[ii].status = Store::Status::ERROR;
+    }
+  }
+}
+
+void CompressingStore::set_data_multi(const std::string& table,
+                                      const std::vector<Store::SetRequest>& requests,
+                                      std::vector<Store::Status>& statuses,
+                                      SAS::TrailId trail,
+                                      bool log_body,
+                                      Store::Format data_format)
+{
+  std::vector<Store::SetRequest> encoded_requests = requests;
+  Store::Format encoded_format = data_format;
+
+  for (std::vector<Store::SetRequest>::iterator i = encoded_requests.begin();
+       i != encoded_requests.end();
+       ++i)
+  {
+    // Compressed records are logged in hex, so if any record is compressed
+    // they all are.
+    Store::Format format = data_format;
+    std::string encoded;
+
+    encode(i->data, format, encoded);
+
+    if (format != data_format)
+    {
+      i->data.swap(encoded);
+      encoded_format = format;
+    }
+  }
+
+  _store->set_data_multi(table,
+                         encoded_requests,
+                         statuses,
+                         trail,
+                         log_body,
+                         encoded_format);
+}
+
+void CompressingStore::get_data_async(const std::string& table,
+                                      const std::string& key,
+                                      SAS::TrailId trail,
+                                      bool log_body,
+                                      Store::Format data_format,
+                                      Store::GetCallback callback)
+{
+  _store->get_data_async(table, key, trail, log_body, read_format(data_format),
+                         [this, key, callback](Store::Status status,
+                                               const std::string& data,
+                                               uint64_t cas) {
+    if (status != Store::Status::OK)
+    {
+      callback(status, data, cas);
+      return;
+    }
+
+    std::string decoded = data;
+
+    if (decode(key, decoded))
+    {
+      callback(status, decoded, cas);
+    }
+    else
+    {
+      callback(Store::Status::ERROR, std::string(), 0);
+    }
+  });
+}
+
+void CompressingStore::set_data_async(const std::string& table,
+                                      const std::string& key,
+                                      const std::string& data,
+                                      uint64_t cas,
+                                      int expiry,
+                                      SAS::TrailId trail,
+                                      bool log_body,
+                                      Store::Format data_format,
+                                      Store::SetCallback callback)
+{
+  std::string encoded;
+  const std::string& to_write = encode(data, data_format, encoded);
+  _store->set_data_async(table,
+                         key,
+                         to_write,
+                         cas,
+                         expiry,
+                         trail,
+                         log_body,
+                         data_format,
+                         callback);
+}
+
+CompressingStore::Stats CompressingStore::stats() const
+{
+  Stats stats = {_compressed, _bytes_in, _bytes_out, _uncompressed};
+  return stats;
+}
+
+const std::string& CompressingStore::encode(const std::string& data,
+                                            Store::Format& data_format,
+                                            std::string& encoded)
+{
+  std::string compressed;
+
+  if ((_codec == NULL) ||
+      (data_format != Store::Format::JSON) ||
+      (data.length() < _min_length) ||
+      (!_codec->compress(data, compressed)) ||
+      (compressed.length() + HEADER_LENGTH >= data.length()))
+  {
+    ++_uncompressed;
+    return data;
+  }
+
+  uint32_t length = data.length();
+  encoded.reserve(HEADER_LENGTH + compressed.length());
+  encoded.assign(MAGIC, sizeof(MAGIC));
+  encoded.push_back((char)_codec->id());
+  encoded.push_back((char)(length >> 24));
+  encoded.push_back((char)(length >> 16));
+  encoded.push_back((char)(length >> 8));
+  encoded.push_back((char)length);
+  encoded.append(compressed);
+
+  ++_compressed;
+  _bytes_in += data.length();
+  _bytes_out += encoded.length();
+
+  data_format = Store::Format::HEX;
+  return encoded;
+}
+
+Store::Format CompressingStore::read_format(Store::Format data_format) const
+{
+  return _codecs.empty() ? data_format : Store::Format::HEX;
+}
+
+bool CompressingStore::decode(const std::string& key, std::string& data) const
+{
+  if ((data.length() < HEADER_LENGTH) ||
+      (data.compare(0, sizeof(MAGIC), MAGIC, sizeof(MAGIC)) != 0))
+  {
+    // Not compressed.
+    return true;
+  }
+
+  uint8_t id = data[sizeof(MAGIC)];
+  std::map<uint8_t, const StoreCodec*>::const_iterator codec = _codecs.find(id);
+
+  if (codec == _codecs.end())
+  {
+    TRC_ERROR("Record %s was compressed with unknown codec %d",
+              key.c_str(), id);
+    return false;
+  }
+
+  const unsigned char* header = (const unsigned char*)data.data() + sizeof(MAGIC) + 1;
+  size_t length = ((uint32_t)header[0] << 24) |
+                  ((uint32_t)header[1] << 16) |
+                  ((uint32_t)header[2] << 8) |
+                  (uint32_t)header[3];
+  std::string decompressed;
+
+  if (!codec->second->decompress(data.data() + HEADER_LENGTH,
+                                 data.length() - HEADER_LENGTH,
+                                 length,
+                                 decompressed))
+  {
+    TRC_ERROR("Failed to decompress record %s (codec %d)", key.c_str(), id);
+    return false;
+  }
+
+  data.swap(decompressed);
+  return true;
+}
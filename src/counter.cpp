@@ -15,8 +15,8 @@
 /// Increase the current count by 1.
 void Counter::increment(void)
 {
-  // Update the basic counters and samples.
-  _current._count++;
+  // Update this thread's shard of the count.
+  _current._shards[shard_index()]._count.fetch_add(1, std::memory_order_relaxed);
   // Refresh the statistics, if required.
   refresh();
 }
@@ -47,7 +47,11 @@ void Counter::reset()
   // Get the timestamp now.
   _current._timestamp_us.store(get_timestamp_us());
   // Reset everything else to 0.
-  _current._count.store(0);
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    _current._shards[ii]._count.store(0);
+  }
+
   _last._count = 0;
 }
 
@@ -55,8 +59,14 @@ void Counter::reset()
 /// it as the last set of statistics.
 void Counter::read(uint_fast64_t period_us)
 {
-  // Read the basic statistics, and replace them with 0.
-  uint_fast64_t count = _current._count.exchange(0);
+  // Read the count from each shard, and replace it with 0.
+  uint_fast64_t count = 0;
+
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    count += _current._shards[ii]._count.exchange(0);
+  }
+
   _last._count = count ;
 }
 
@@ -64,8 +74,7 @@ void Counter::read(uint_fast64_t period_us)
 /// values to zeroMQ.
 void StatisticCounter::refreshed()
 {
-  // Simply construct a vector of count only and pass it to zeroMQ.
-  std::vector<std::string> values;
-  values.push_back(std::to_string(get_count()));
-  _statistic.report_change(values);
+  // Simply pass the count to zeroMQ.
+  uint64_t values[] = { get_count() };
+  _statistic.report_change(values, 1);
 }
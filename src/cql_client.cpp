@@ -0,0 +1,1972 @@
+/**
+ * @file cql_client.cpp  A cassandra store client that uses the native (CQL)
+ * protocol.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <set>
+
+#include "log.h"
+#include "cql_client.h"
+#include "fiber_pool.h"
+
+using namespace apache::thrift;
+using namespace apache::thrift::transport;
+using namespace org::apache::cassandra;
+
+namespace CassandraStore
+{
+
+//
+// Native protocol encoding
+//
+
+static const uint8_t CQL_VERSION = 0x03;
+static const uint8_t CQL_RESPONSE = 0x80;
+static const size_t CQL_HEADER_LENGTH = 9;
+static const uint32_t CQL_MAX_FRAME_LENGTH = 256 * 1024 * 1024;
+
+// How much to read from the socket at once.
+static const size_t CQL_READ_SIZE = 64 * 1024;
+
+// Opcodes.
+static const uint8_t CQL_ERROR = 0x00;
+static const uint8_t CQL_STARTUP = 0x01;
+static const uint8_t CQL_READY = 0x02;
+static const uint8_t CQL_QUERY = 0x07;
+static const uint8_t CQL_RESULT = 0x08;
+static const uint8_t CQL_PREPARE = 0x09;
+static const uint8_t CQL_EXECUTE = 0x0A;
+static const uint8_t CQL_BATCH = 0x0D;
+
+// Result kinds.
+static const int32_t CQL_RESULT_ROWS = 0x0002;
+static const int32_t CQL_RESULT_PREPARED = 0x0004;
+
+// Query flags.
+static const uint8_t CQL_FLAG_VALUES = 0x01;
+static const uint8_t CQL_FLAG_SKIP_METADATA = 0x02;
+static const uint8_t CQL_FLAG_PAGE_SIZE = 0x04;
+static const uint8_t CQL_FLAG_PAGING_STATE = 0x08;
+
+// Rows metadata flags.
+static const int32_t CQL_ROWS_GLOBAL_TABLES_SPEC = 0x0001;
+static const int32_t CQL_ROWS_HAS_MORE_PAGES = 0x0002;
+static const int32_t CQL_ROWS_NO_METADATA = 0x0004;
+
+static const uint8_t CQL_BATCH_UNLOGGED = 0x01;
+static const uint8_t CQL_BATCH_PREPARED = 0x01;
+
+// Error codes.
+static const int32_t CQL_SERVER_ERROR = 0x0000;
+static const int32_t CQL_PROTOCOL_ERROR = 0x000A;
+static const int32_t CQL_UNAVAILABLE = 0x1000;
+static const int32_t CQL_OVERLOADED = 0x1001;
+static const int32_t CQL_IS_BOOTSTRAPPING = 0x1002;
+static const int32_t CQL_TRUNCATE_ERROR = 0x1003;
+static const int32_t CQL_WRITE_TIMEOUT = 0x1100;
+static const int32_t CQL_READ_TIMEOUT = 0x1200;
+static const int32_t CQL_UNPREPARED = 0x2500;
+
+// The error code a request is given if it couldn't be sent.
+static const int32_t CQL_NOT_SENT = -1;
+
+// How many rows to read at a time when scanning a range of rows.
+static const int32_t RANGE_PAGE_SIZE = 1000;
+
+static void append_byte(std::string& buf, uint8_t value)
+{
+  buf.push_back((char)value);
+}
+
+static void append_short(std::string& buf, uint16_t value)
+{
+  buf.push_back((char)(value >> 8));
+  buf.push_back((char)value);
+}
+
+static void append_int(std::string& buf, int32_t value)
+{
+  uint32_t u = value;
+  buf.push_back((char)(u >> 24));
+  buf.push_back((char)(u >> 16));
+  buf.push_back((char)(u >> 8));
+  buf.push_back((char)u);
+}
+
+static void append_string(std::string& buf, const std::string& value)
+{
+  append_short(buf, value.length());
+  buf.append(value);
+}
+
+static void append_long_string(std::string& buf, const std::string& value)
+{
+  append_int(buf, value.length());
+  buf.append(value);
+}
+
+static void append_values(std::string& buf, const std::vector<std::string>& values)
+{
+  append_short(buf, values.size());
+
+  for (std::vector<std::string>::const_iterator it = values.begin();
+       it != values.end();
+       ++it)
+  {
+    append_long_string(buf, *it);
+  }
+}
+
+static std::string encode_int(int32_t value)
+{
+  std::string buf;
+  append_int(buf, value);
+  return buf;
+}
+
+static std::string encode_bigint(int64_t value)
+{
+  std::string buf;
+  append_int(buf, (int32_t)((uint64_t)value >> 32));
+  append_int(buf, (int32_t)value);
+  return buf;
+}
+
+static std::string encode_list(const std::vector<std::string>& values)
+{
+  std::string buf;
+  append_int(buf, values.size());
+
+  for (std::vector<std::string>::const_iterator it = values.begin();
+       it != values.end();
+       ++it)
+  {
+    append_long_string(buf, *it);
+  }
+
+  return buf;
+}
+
+// The frame header, for a body of the given length.
+static void append_header(std::string& buf,
+                          int16_t stream,
+                          uint8_t opcode,
+                          size_t length)
+{
+  append_byte(buf, CQL_VERSION);
+  append_byte(buf, 0);
+  append_short(buf, stream);
+  append_byte(buf, opcode);
+  append_int(buf, length);
+}
+
+static uint16_t cql_consistency(ConsistencyLevel::type consistency_level)
+{
+  switch (consistency_level)
+  {
+  case ConsistencyLevel::ANY:           return 0x0000;
+  case ConsistencyLevel::ONE:           return 0x0001;
+  case ConsistencyLevel::TWO:           return 0x0002;
+  case ConsistencyLevel::THREE:         return 0x0003;
+  case ConsistencyLevel::QUORUM:        return 0x0004;
+  case ConsistencyLevel::ALL:           return 0x0005;
+  case ConsistencyLevel::LOCAL_QUORUM:  return 0x0006;
+  case ConsistencyLevel::EACH_QUORUM:   return 0x0007;
+  case ConsistencyLevel::SERIAL:        return 0x0008;
+  case ConsistencyLevel::LOCAL_SERIAL:  return 0x0009;
+  case ConsistencyLevel::LOCAL_ONE:     return 0x000A;
+  default:                              return 0x0001; // LCOV_EXCL_LINE
+  }
+}
+
+/// Reads the values in a response body.  Any attempt to read past the end of
+/// the body sets the reader's error flag, and returns zero or empty values.
+class CqlReader
+{
+public:
+  CqlReader(const std::string& body) :
+    _data(body.data()),
+    _remaining(body.length()),
+    _error(false)
+  {}
+
+  bool error() const { return _error; }
+
+  uint16_t read_short()
+  {
+    const unsigned char* p = (const unsigned char*)take(2);
+    return (p != NULL) ? ((p[0] << 8) | p[1]) : 0;
+  }
+
+  int32_t read_int()
+  {
+    const unsigned char* p = (const unsigned char*)take(4);
+    return (p != NULL) ?
+      (int32_t)(((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+                ((uint32_t)p[2] << 8) | (uint32_t)p[3]) : 0;
+  }
+
+  std::string read_string()
+  {
+    size_t length = read_short();
+    const char* p = take(length);
+    return (p != NULL) ? std::string(p, length) : std::string();
+  }
+
+  /// Read a [bytes] value.  A null value is read as an empty string.
+  std::string read_bytes()
+  {
+    int32_t length = read_int();
+
+    if (length <= 0)
+    {
+      return std::string();
+    }
+
+    const char* p = take(length);
+    return (p != NULL) ? std::string(p, length) : std::string();
+  }
+
+  std::string read_short_bytes()
+  {
+    return read_string();
+  }
+
+  /// Skip over a column type.
+  void skip_option()
+  {
+    uint16_t id = read_short();
+
+    switch (id)
+    {
+    case 0x0000:
+      // Custom type, named by a string.
+      read_string();
+      break;
+
+    case 0x0020:
+    case 0x0022:
+      // List or set.
+      skip_option();
+      break;
+
+    case 0x0021:
+      // Map.
+      skip_option();
+      skip_option();
+      break;
+
+    case 0x0030:
+    {
+      // User defined type: keyspace, name, and the name and type of each
+      // field.
+      read_string();
+      read_string();
+      uint16_t fields = read_short();
+
+      for (uint16_t ii = 0; (ii < fields) && (!_error); ++ii)
+      {
+        read_string();
+        skip_option();
+      }
+    }
+    break;
+
+    case 0x0031:
+    {
+      // Tuple.
+      uint16_t elements = read_short();
+
+      for (uint16_t ii = 0; (ii < elements) && (!_error); ++ii)
+      {
+        skip_option();
+      }
+    }
+    break;
+
+    default:
+      // A native type, with no more to it.
+      break;
+    }
+  }
+
+private:
+  const char* take(size_t length)
+  {
+    if ((_error) || (length > _remaining))
+    {
+      _error = true;
+      return NULL;
+    }
+
+    const char* p = _data;
+    _data += length;
+    _remaining -= length;
+    return p;
+  }
+
+  const char* _data;
+  size_t _remaining;
+  bool _error;
+};
+
+// Read a ROWS result.  Returns false if it can't be parsed.
+static bool read_rows(CqlReader& reader,
+                      std::vector<std::vector<std::string> >& rows,
+                      std::string& paging_state)
+{
+  int32_t flags = reader.read_int();
+  int32_t columns = reader.read_int();
+  paging_state.clear();
+
+  if (flags & CQL_ROWS_HAS_MORE_PAGES)
+  {
+    paging_state = reader.read_bytes();
+  }
+
+  if (!(flags & CQL_ROWS_NO_METADATA))
+  {
+    if (flags & CQL_ROWS_GLOBAL_TABLES_SPEC)
+    {
+      reader.read_string();
+      reader.read_string();
+    }
+
+    for (int32_t ii = 0; (ii < columns) && (!reader.error()); ++ii)
+    {
+      if (!(flags & CQL_ROWS_GLOBAL_TABLES_SPEC))
+      {
+        reader.read_string();
+        reader.read_string();
+      }
+
+      reader.read_string();
+      reader.skip_option();
+    }
+  }
+
+  int32_t count = reader.read_int();
+
+  if ((reader.error()) || (columns < 0) || (count < 0))
+  {
+    return false;
+  }
+
+  rows.clear();
+  rows.reserve(count);
+
+  for (int32_t ii = 0; (ii < count) && (!reader.error()); ++ii)
+  {
+    rows.push_back(std::vector<std::string>(columns));
+    std::vector<std::string>& row = rows.back();
+
+    for (int32_t jj = 0; jj < columns; ++jj)
+    {
+      row[jj] = reader.read_bytes();
+    }
+  }
+
+  return !reader.error();
+}
+
+// Throw the Thrift exception that matches a CQL error, so that the store
+// handles it as it would the same error from a Thrift client.
+static void throw_error(int32_t code, const std::string& text)
+{
+  TRC_DEBUG("CQL request failed: 0x%04x %s", code, text.c_str());
+
+  switch (code)
+  {
+  case CQL_NOT_SENT:
+  case CQL_PROTOCOL_ERROR:
+    throw TTransportException(TTransportException::CORRUPTED_DATA, text);
+
+  case CQL_WRITE_TIMEOUT:
+  case CQL_READ_TIMEOUT:
+  case CQL_TRUNCATE_ERROR:
+    throw TimedOutException();
+
+  case CQL_SERVER_ERROR:
+  case CQL_UNAVAILABLE:
+  case CQL_OVERLOADED:
+  case CQL_IS_BOOTSTRAPPING:
+    throw UnavailableException();
+
+  default:
+  {
+    // Syntax, authorization and configuration errors, and any we don't
+    // recognise.
+    InvalidRequestException ire;
+    ire.why = text;
+    throw ire;
+  }
+  }
+}
+
+//
+// CqlConnection methods
+//
+
+// LCOV_EXCL_START real clients are not tested in UT.
+CqlConnection::CqlConnection(const std::string& host,
+                             uint16_t port,
+                             int conn_timeout_ms,
+                             int recv_timeout_ms,
+                             int send_timeout_ms) :
+  _host(host),
+  _port(port),
+  _conn_timeout_ms(conn_timeout_ms),
+  _recv_timeout_ms(recv_timeout_ms),
+  _send_timeout_ms(send_timeout_ms),
+  _fd(-1),
+  _read_buffer(),
+  _read_offset(0),
+  _prepared()
+{
+}
+
+CqlConnection::~CqlConnection()
+{
+  close();
+}
+
+void CqlConnection::open()
+{
+  TRC_DEBUG("Opening CQL connection to %s:%d", _host.c_str(), _port);
+  close();
+  _prepared.clear();
+
+  // Resolve the host.  This is normally an IP address, so doesn't block.
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* addrs = NULL;
+  std::string port = std::to_string(_port);
+  int rc = getaddrinfo(_host.c_str(), port.c_str(), &hints, &addrs);
+
+  if ((rc != 0) || (addrs == NULL))
+  {
+    throw TTransportException(TTransportException::NOT_OPEN,
+                              "Failed to resolve " + _host + ": " + gai_strerror(rc));
+  }
+
+  _fd = socket(addrs->ai_family,
+               SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+               addrs->ai_protocol);
+
+  if (_fd < 0)
+  {
+    freeaddrinfo(addrs);
+    throw TTransportException(TTransportException::NOT_OPEN,
+                              std::string("Failed to create socket: ") + strerror(errno));
+  }
+
+  int one = 1;
+  setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  rc = connect(_fd, addrs->ai_addr, addrs->ai_addrlen);
+  freeaddrinfo(addrs);
+
+  if ((rc != 0) && (errno != EINPROGRESS))
+  {
+    std::string error = strerror(errno);
+    close();
+    throw TTransportException(TTransportException::NOT_OPEN,
+                              "Failed to connect to " + _host + ": " + error);
+  }
+
+  if (rc != 0)
+  {
+    if (FiberPool::wait(_fd, POLLOUT, _conn_timeout_ms) == 0)
+    {
+      close();
+      throw TTransportException(TTransportException::TIMED_OUT,
+                                "Timed out connecting to " + _host);
+    }
+
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    getsockopt(_fd, SOL_SOCKET, SO_ERROR, &error, &error_len);
+
+    if (error != 0)
+    {
+      close();
+      throw TTransportException(TTransportException::NOT_OPEN,
+                                "Failed to connect to " + _host + ": " + strerror(error));
+    }
+  }
+
+  std::string body;
+  append_short(body, 1);
+  append_string(body, "CQL_VERSION");
+  append_string(body, "3.0.0");
+
+  std::string frame;
+  append_header(frame, 0, CQL_STARTUP, body.length());
+  frame.append(body);
+  send(frame);
+
+  Frame response;
+  receive(response);
+
+  if (response.opcode == CQL_ERROR)
+  {
+    CqlReader reader(response.body);
+    reader.read_int();
+    fail("Failed to start CQL session: " + reader.read_string());
+  }
+  else if (response.opcode != CQL_READY)
+  {
+    // Most likely the node wants us to authenticate, which we don't support.
+    fail("Unexpected response to CQL STARTUP");
+  }
+}
+
+void CqlConnection::close()
+{
+  if (_fd >= 0)
+  {
+    ::close(_fd);
+    _fd = -1;
+  }
+
+  _read_buffer.clear();
+  _read_offset = 0;
+}
+
+bool CqlConnection::is_open() const
+{
+  return (_fd >= 0);
+}
+
+void CqlConnection::use_keyspace(const std::string& keyspace)
+{
+  std::vector<std::vector<std::string> > rows;
+  query("USE \"" + keyspace + "\"", rows);
+
+  // Statements are prepared against the keyspace in use.
+  _prepared.clear();
+}
+
+void CqlConnection::query(const std::string& cql,
+                          std::vector<std::vector<std::string> >& rows)
+{
+  std::string body;
+  append_long_string(body, cql);
+  append_short(body, cql_consistency(ConsistencyLevel::ONE));
+  append_byte(body, 0);
+
+  std::string frame;
+  append_header(frame, 0, CQL_QUERY, body.length());
+  frame.append(body);
+  send(frame);
+
+  Frame response;
+  receive(response);
+  CqlReader reader(response.body);
+
+  if (response.opcode == CQL_ERROR)
+  {
+    int32_t code = reader.read_int();
+    throw_error(code, reader.read_string());
+  }
+  else if (response.opcode != CQL_RESULT)
+  {
+    fail("Unexpected response to CQL QUERY");
+  }
+
+  rows.clear();
+
+  if (reader.read_int() == CQL_RESULT_ROWS)
+  {
+    std::string paging_state;
+
+    if (!read_rows(reader, rows, paging_state))
+    {
+      fail("Failed to parse CQL rows");
+    }
+  }
+}
+
+void CqlConnection::prepare(std::vector<CqlRequest*>& requests)
+{
+  // Find the queries we haven't prepared, and prepare them all at once.
+  std::vector<std::string> queries;
+
+  for (std::vector<CqlRequest*>::iterator it = requests.begin();
+       it != requests.end();
+       ++it)
+  {
+    for (std::vector<CqlStatement>::iterator st = (*it)->statements.begin();
+         st != (*it)->statements.end();
+         ++st)
+    {
+      if ((_prepared.find(st->query) == _prepared.end()) &&
+          (std::find(queries.begin(), queries.end(), st->query) == queries.end()))
+      {
+        queries.push_back(st->query);
+      }
+    }
+  }
+
+  if (queries.empty())
+  {
+    return;
+  }
+
+  std::string frames;
+
+  for (size_t ii = 0; ii < queries.size(); ++ii)
+  {
+    TRC_DEBUG("Preparing CQL statement: %s", queries[ii].c_str());
+    std::string body;
+    append_long_string(body, queries[ii]);
+    append_header(frames, ii, CQL_PREPARE, body.length());
+    frames.append(body);
+  }
+
+  send(frames);
+
+  for (size_t ii = 0; ii < queries.size(); ++ii)
+  {
+    Frame response;
+    receive(response);
+
+    if ((response.stream < 0) || ((size_t)response.stream >= queries.size()))
+    {
+      fail("Unexpected CQL stream");
+    }
+
+    const std::string& query = queries[response.stream];
+    CqlReader reader(response.body);
+
+    if ((response.opcode == CQL_RESULT) &&
+        (reader.read_int() == CQL_RESULT_PREPARED))
+    {
+      std::string id = reader.read_short_bytes();
+
+      if (reader.error())
+      {
+        fail("Failed to parse CQL prepared statement ID");
+      }
+
+      _prepared[query] = id;
+    }
+    else if (response.opcode == CQL_ERROR)
+    {
+      // Fail the requests that use this statement.
+      int32_t code = reader.read_int();
+      std::string text = reader.read_string();
+      TRC_WARNING("Failed to prepare CQL statement %s: %s",
+                  query.c_str(), text.c_str());
+
+      for (std::vector<CqlRequest*>::iterator it = requests.begin();
+           it != requests.end();
+           ++it)
+      {
+        for (std::vector<CqlStatement>::iterator st = (*it)->statements.begin();
+             st != (*it)->statements.end();
+             ++st)
+        {
+          if (st->query == query)
+          {
+            (*it)->error_code = code;
+            (*it)->error_text = text;
+          }
+        }
+      }
+    }
+    else
+    {
+      fail("Unexpected response to CQL PREPARE");
+    }
+  }
+}
+
+void CqlConnection::start(std::vector<CqlRequest*>& requests)
+{
+  prepare(requests);
+
+  std::string frames;
+  int16_t stream = 0;
+
+  for (std::vector<CqlRequest*>::iterator it = requests.begin();
+       it != requests.end();
+       ++it)
+  {
+    CqlRequest* request = *it;
+    request->stream = -1;
+    request->rows.clear();
+
+    if ((request->error_code != 0) || (request->statements.empty()))
+    {
+      continue;
+    }
+
+    std::string body;
+    uint8_t opcode;
+
+    if (request->statements.size() == 1)
+    {
+      const CqlStatement& statement = request->statements.front();
+      uint8_t flags = CQL_FLAG_SKIP_METADATA;
+
+      if (!statement.values.empty())
+      {
+        flags |= CQL_FLAG_VALUES;
+      }
+
+      if (request->page_size > 0)
+      {
+        flags |= CQL_FLAG_PAGE_SIZE;
+      }
+
+      if (!request->paging_state.empty())
+      {
+        flags |= CQL_FLAG_PAGING_STATE;
+      }
+
+      opcode = CQL_EXECUTE;
+      append_string(body, _prepared[statement.query]);
+      append_short(body, cql_consistency(request->consistency_level));
+      append_byte(body, flags);
+
+      if (flags & CQL_FLAG_VALUES)
+      {
+        append_values(body, statement.values);
+      }
+
+      if (flags & CQL_FLAG_PAGE_SIZE)
+      {
+        append_int(body, request->page_size);
+      }
+
+      if (flags & CQL_FLAG_PAGING_STATE)
+      {
+        append_long_string(body, request->paging_state);
+      }
+    }
+    else
+    {
+      opcode = CQL_BATCH;
+      append_byte(body, CQL_BATCH_UNLOGGED);
+      append_short(body, request->statements.size());
+
+      for (std::vector<CqlStatement>::const_iterator st = request->statements.begin();
+           st != request->statements.end();
+           ++st)
+      {
+        append_byte(body, CQL_BATCH_PREPARED);
+        append_string(body, _prepared[st->query]);
+        append_values(body, st->values);
+      }
+
+      append_short(body, cql_consistency(request->consistency_level));
+      append_byte(body, 0);
+    }
+
+    request->stream = stream++;
+    append_header(frames, request->stream, opcode, body.length());
+    frames.append(body);
+  }
+
+  if (!frames.empty())
+  {
+    send(frames);
+  }
+}
+
+void CqlConnection::finish(std::vector<CqlRequest*>& requests, bool reprepare)
+{
+  // Index the requests by the stream they were sent on.
+  std::vector<CqlRequest*> streams;
+
+  for (std::vector<CqlRequest*>::iterator it = requests.begin();
+       it != requests.end();
+       ++it)
+  {
+    if ((*it)->stream >= 0)
+    {
+      streams.resize(std::max(streams.size(), (size_t)(*it)->stream + 1));
+      streams[(*it)->stream] = *it;
+    }
+  }
+
+  size_t outstanding = std::count_if(streams.begin(),
+                                     streams.end(),
+                                     [](CqlRequest* r) { return r != NULL; });
+  std::vector<CqlRequest*> unprepared;
+
+  while (outstanding > 0)
+  {
+    Frame response;
+    receive(response);
+
+    if ((response.stream < 0) ||
+        ((size_t)response.stream >= streams.size()) ||
+        (streams[response.stream] == NULL))
+    {
+      fail("Unexpected CQL stream");
+    }
+
+    CqlRequest* request = streams[response.stream];
+    streams[response.stream] = NULL;
+    --outstanding;
+
+    CqlReader reader(response.body);
+
+    if (response.opcode == CQL_ERROR)
+    {
+      request->error_code = reader.read_int();
+      request->error_text = reader.read_string();
+
+      if ((request->error_code == CQL_UNPREPARED) && (reprepare))
+      {
+        // The node has forgotten the statement, perhaps because it
+        // restarted - prepare it again.
+        unprepared.push_back(request);
+      }
+    }
+    else if (response.opcode == CQL_RESULT)
+    {
+      if ((reader.read_int() == CQL_RESULT_ROWS) &&
+          (!read_rows(reader, request->rows, request->paging_state)))
+      {
+        fail("Failed to parse CQL rows");
+      }
+    }
+    else
+    {
+      fail("Unexpected response to CQL request");
+    }
+  }
+
+  if (!unprepared.empty())
+  {
+    for (std::vector<CqlRequest*>::iterator it = unprepared.begin();
+         it != unprepared.end();
+         ++it)
+    {
+      (*it)->error_code = 0;
+      (*it)->error_text.clear();
+
+      for (std::vector<CqlStatement>::iterator st = (*it)->statements.begin();
+           st != (*it)->statements.end();
+           ++st)
+      {
+        _prepared.erase(st->query);
+      }
+    }
+
+    start(unprepared);
+    finish(unprepared, false);
+  }
+}
+
+void CqlConnection::send(const std::string& frames)
+{
+  if (_fd < 0)
+  {
+    throw TTransportException(TTransportException::NOT_OPEN,
+                              "CQL connection to " + _host + " is closed");
+  }
+
+  size_t sent = 0;
+
+  while (sent < frames.length())
+  {
+    ssize_t rc = ::send(_fd,
+                        frames.data() + sent,
+                        frames.length() - sent,
+                        MSG_NOSIGNAL);
+
+    if (rc >= 0)
+    {
+      sent += rc;
+    }
+    else if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+    {
+      if (FiberPool::wait(_fd, POLLOUT, _send_timeout_ms) == 0)
+      {
+        close();
+        throw TTransportException(TTransportException::TIMED_OUT,
+                                  "Timed out sending to " + _host);
+      }
+    }
+    else if (errno != EINTR)
+    {
+      std::string error = strerror(errno);
+      close();
+      throw TTransportException(TTransportException::UNKNOWN,
+                                "Failed to send to " + _host + ": " + error);
+    }
+  }
+}
+
+void CqlConnection::receive(Frame& frame)
+{
+  uint8_t header[CQL_HEADER_LENGTH];
+  read_all((char*)header, sizeof(header));
+
+  uint32_t length = ((uint32_t)header[5] << 24) |
+                    ((uint32_t)header[6] << 16) |
+                    ((uint32_t)header[7] << 8) |
+                    (uint32_t)header[8];
+
+  if ((header[0] != (CQL_RESPONSE | CQL_VERSION)) ||
+      (length > CQL_MAX_FRAME_LENGTH))
+  {
+    fail("Invalid CQL frame header");
+  }
+
+  frame.stream = (int16_t)((header[2] << 8) | header[3]);
+  frame.opcode = header[4];
+  frame.body.resize(length);
+
+  if (length > 0)
+  {
+    read_all(&frame.body[0], length);
+  }
+}
+
+void CqlConnection::read_all(char* data, size_t length)
+{
+  if (_fd < 0)
+  {
+    throw TTransportException(TTransportException::NOT_OPEN,
+                              "CQL connection to " + _host + " is closed");
+  }
+
+  while (length > 0)
+  {
+    size_t buffered = _read_buffer.length() - _read_offset;
+
+    if (buffered > 0)
+    {
+      size_t n = std::min(buffered, length);
+      memcpy(data, _read_buffer.data() + _read_offset, n);
+      _read_offset += n;
+      data += n;
+      length -= n;
+      continue;
+    }
+
+    // The buffer is empty, so refill it.  Large reads go straight to their
+    // destination instead.
+    char* dest = data;
+    size_t size = length;
+
+    if (length < CQL_READ_SIZE)
+    {
+      _read_buffer.resize(CQL_READ_SIZE);
+      dest = &_read_buffer[0];
+      size = CQL_READ_SIZE;
+    }
+
+    ssize_t rc = recv(_fd, dest, size, 0);
+    _read_buffer.resize(((rc > 0) && (dest != data)) ? rc : 0);
+    _read_offset = 0;
+
+    if (rc > 0)
+    {
+      if (dest == data)
+      {
+        data += rc;
+        length -= rc;
+      }
+    }
+    else if (rc == 0)
+    {
+      close();
+      throw TTransportException(TTransportException::END_OF_FILE,
+                                _host + " closed the CQL connection");
+    }
+    else if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+    {
+      if (FiberPool::wait(_fd, POLLIN, _recv_timeout_ms) == 0)
+      {
+        close();
+        throw TTransportException(TTransportException::TIMED_OUT,
+                                  "Timed out receiving from " + _host);
+      }
+    }
+    else if (errno != EINTR)
+    {
+      std::string error = strerror(errno);
+      close();
+      throw TTransportException(TTransportException::UNKNOWN,
+                                "Failed to receive from " + _host + ": " + error);
+    }
+  }
+}
+
+void CqlConnection::fail(const std::string& reason)
+{
+  TRC_WARNING("CQL connection to %s:%d failed: %s",
+              _host.c_str(), _port, reason.c_str());
+  close();
+  throw TTransportException(TTransportException::CORRUPTED_DATA, reason);
+}
+
+//
+// CqlClient methods
+//
+
+// The layout of the tables the client reads and writes.
+static const std::string SELECT_COLUMNS = "SELECT column1, value, writetime(value), ttl(value)";
+static const std::string SELECT_KEYS_AND_COLUMNS = "SELECT key, column1, value, writetime(value), ttl(value)";
+
+// Quote a table name, so that its case is kept.
+static std::string table(const std::string& column_family)
+{
+  std::string quoted = "\"";
+
+  for (std::string::const_iterator it = column_family.begin();
+       it != column_family.end();
+       ++it)
+  {
+    if (*it == '"')
+    {
+      quoted.push_back('"');
+    }
+
+    quoted.push_back(*it);
+  }
+
+  quoted.push_back('"');
+  return quoted;
+}
+
+static void invalid_request(const std::string& why)
+{
+  InvalidRequestException ire;
+  ire.why = why;
+  throw ire;
+}
+
+// Add the conditions on column names for a slice range.  A Thrift slice is
+// inclusive at both ends, and an empty bound means the slice is unbounded at
+// that end.
+static void add_slice_bounds(const std::string& start,
+                             const std::string& finish,
+                             bool reversed,
+                             CqlStatement& statement)
+{
+  const std::string& lower = reversed ? finish : start;
+  const std::string& upper = reversed ? start : finish;
+
+  if (!lower.empty())
+  {
+    statement.query += " AND column1 >= ?";
+    statement.values.push_back(lower);
+  }
+
+  if (!upper.empty())
+  {
+    statement.query += " AND column1 <= ?";
+    statement.values.push_back(upper);
+  }
+}
+
+// Build the statement that reads the columns a predicate picks from a row.
+// Returns false if the predicate picks no columns, so there is nothing to
+// read.
+static bool select_slice(const std::string& column_family,
+                         const std::string& key,
+                         const SlicePredicate& predicate,
+                         CqlStatement& statement)
+{
+  statement.query = SELECT_COLUMNS + " FROM " + table(column_family) + " WHERE key = ?";
+  statement.values.push_back(key);
+
+  if (predicate.__isset.column_names)
+  {
+    if (predicate.column_names.empty())
+    {
+      return false;
+    }
+
+    statement.query += " AND column1 IN ?";
+    statement.values.push_back(encode_list(predicate.column_names));
+  }
+  else if (predicate.__isset.slice_range)
+  {
+    const SliceRange& range = predicate.slice_range;
+
+    if (range.count <= 0)
+    {
+      return false;
+    }
+
+    add_slice_bounds(range.start, range.finish, range.reversed, statement);
+
+    if (range.reversed)
+    {
+      statement.query += " ORDER BY column1 DESC";
+    }
+
+    statement.query += " LIMIT ?";
+    statement.values.push_back(encode_int(range.count));
+  }
+  else
+  {
+    invalid_request("SlicePredicate has neither column_names nor slice_range");
+  }
+
+  return true;
+}
+
+// Convert the values from a row into a column.
+static void to_column(const std::vector<std::string>& row,
+                      size_t first,
+                      ColumnOrSuperColumn& cosc)
+{
+  Column& column = cosc.column;
+  column.name = row[first];
+  column.value = row[first + 1];
+  column.__isset.value = true;
+
+  const std::string& timestamp = row[first + 2];
+
+  if (timestamp.length() == 8)
+  {
+    const unsigned char* p = (const unsigned char*)timestamp.data();
+    uint64_t value = 0;
+
+    for (int ii = 0; ii < 8; ++ii)
+    {
+      value = (value << 8) | p[ii];
+    }
+
+    column.timestamp = (int64_t)value;
+    column.__isset.timestamp = true;
+  }
+
+  // The TTL is null if the column doesn't expire.
+  const std::string& ttl = row[first + 3];
+
+  if (ttl.length() == 4)
+  {
+    const unsigned char* p = (const unsigned char*)ttl.data();
+    column.ttl = (int32_t)(((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+                           ((uint32_t)p[2] << 8) | (uint32_t)p[3]);
+    column.__isset.ttl = true;
+  }
+
+  cosc.__isset.column = true;
+}
+
+// Remove the columns that a predicate doesn't pick from a row read in full.
+static void filter_columns(const SlicePredicate& predicate,
+                           std::vector<ColumnOrSuperColumn>& columns)
+{
+  std::vector<ColumnOrSuperColumn> picked;
+
+  if (predicate.__isset.column_names)
+  {
+    std::set<std::string> names(predicate.column_names.begin(),
+                                predicate.column_names.end());
+
+    for (std::vector<ColumnOrSuperColumn>::iterator it = columns.begin();
+         it != columns.end();
+         ++it)
+    {
+      if (names.find(it->column.name) != names.end())
+      {
+        picked.push_back(*it);
+      }
+    }
+  }
+  else
+  {
+    const SliceRange& range = predicate.slice_range;
+    const std::string& lower = range.reversed ? range.finish : range.start;
+    const std::string& upper = range.reversed ? range.start : range.finish;
+
+    for (std::vector<ColumnOrSuperColumn>::iterator it = columns.begin();
+         it != columns.end();
+         ++it)
+    {
+      if (((lower.empty()) || (it->column.name >= lower)) &&
+          ((upper.empty()) || (it->column.name <= upper)))
+      {
+        picked.push_back(*it);
+      }
+    }
+
+    if (range.reversed)
+    {
+      std::reverse(picked.begin(), picked.end());
+    }
+
+    if ((range.count >= 0) && (picked.size() > (size_t)range.count))
+    {
+      picked.resize(range.count);
+    }
+  }
+
+  columns.swap(picked);
+}
+
+CqlClient::CqlClient(const std::string& host,
+                     uint16_t port,
+                     int conn_timeout_ms,
+                     int recv_timeout_ms,
+                     int send_timeout_ms,
+                     bool token_aware) :
+  _host(host),
+  _port(port),
+  _conn_timeout_ms(conn_timeout_ms),
+  _recv_timeout_ms(recv_timeout_ms),
+  _send_timeout_ms(send_timeout_ms),
+  _token_aware(token_aware),
+  _keyspace(),
+  _connection(new CqlConnection(host,
+                                port,
+                                conn_timeout_ms,
+                                recv_timeout_ms,
+                                send_timeout_ms)),
+  _ring(),
+  _peers(),
+  _failed_peers()
+{
+}
+
+CqlClient::~CqlClient()
+{
+  for (std::map<std::string, CqlConnection*>::iterator it = _peers.begin();
+       it != _peers.end();
+       ++it)
+  {
+    delete it->second;
+  }
+
+  delete _connection; _connection = NULL;
+}
+
+bool CqlClient::is_connected()
+{
+  return _connection->is_open();
+}
+
+void CqlClient::connect()
+{
+  _connection->open();
+
+  if (_token_aware)
+  {
+    load_ring();
+  }
+}
+
+void CqlClient::set_keyspace(const std::string& keyspace)
+{
+  _keyspace = keyspace;
+  _connection->use_keyspace(keyspace);
+
+  for (std::map<std::string, CqlConnection*>::iterator it = _peers.begin();
+       it != _peers.end();
+       ++it)
+  {
+    it->second->use_keyspace(keyspace);
+  }
+}
+
+void CqlClient::batch_mutate(const std::map<std::string, std::map<std::string, std::vector<Mutation> > >& mutation_map,
+                             const ConsistencyLevel::type consistency_level)
+{
+  // Each row's mutations are sent as one batch.  Thrift only makes the
+  // mutations to each row atomic, and so does an unlogged batch.
+  std::vector<CqlRequest> requests(mutation_map.size());
+  std::vector<CqlRequest>::iterator request = requests.begin();
+
+  for (std::map<std::string, std::map<std::string, std::vector<Mutation> > >::const_iterator row = mutation_map.begin();
+       row != mutation_map.end();
+       ++row, ++request)
+  {
+    const std::string& key = row->first;
+    request->routing_key = key;
+    request->consistency_level = consistency_level;
+
+    for (std::map<std::string, std::vector<Mutation> >::const_iterator cf = row->second.begin();
+         cf != row->second.end();
+         ++cf)
+    {
+      for (std::vector<Mutation>::const_iterator mutation = cf->second.begin();
+           mutation != cf->second.end();
+           ++mutation)
+      {
+        if ((mutation->__isset.column_or_supercolumn) &&
+            (mutation->column_or_supercolumn.__isset.column))
+        {
+          const Column& column = mutation->column_or_supercolumn.column;
+          CqlStatement statement;
+          statement.query = "INSERT INTO " + table(cf->first) +
+                            " (key, column1, value) VALUES (?, ?, ?)"
+                            " USING TIMESTAMP ? AND TTL ?";
+          statement.values.push_back(key);
+          statement.values.push_back(column.name);
+          statement.values.push_back(column.value);
+          statement.values.push_back(encode_bigint(column.__isset.timestamp ?
+                                                     column.timestamp :
+                                                     Store::generate_timestamp()));
+          statement.values.push_back(encode_int(column.__isset.ttl ? column.ttl : 0));
+          request->statements.push_back(statement);
+        }
+        else if (mutation->__isset.deletion)
+        {
+          const Deletion& deletion = mutation->deletion;
+
+          if (deletion.__isset.super_column)
+          {
+            invalid_request("Super columns are not supported over CQL");
+          }
+
+          CqlStatement statement;
+          statement.query = "DELETE FROM " + table(cf->first) +
+                            " USING TIMESTAMP ? WHERE key = ?";
+          statement.values.push_back(encode_bigint(deletion.__isset.timestamp ?
+                                                     deletion.timestamp :
+                                                     Store::generate_timestamp()));
+          statement.values.push_back(key);
+
+          if (!deletion.__isset.predicate)
+          {
+            // Delete the whole row.
+            request->statements.push_back(statement);
+          }
+          else if (deletion.predicate.__isset.column_names)
+          {
+            statement.query += " AND column1 = ?";
+
+            for (std::vector<std::string>::const_iterator name = deletion.predicate.column_names.begin();
+                 name != deletion.predicate.column_names.end();
+                 ++name)
+            {
+              request->statements.push_back(statement);
+              request->statements.back().values.push_back(*name);
+            }
+          }
+          else
+          {
+            const SliceRange& range = deletion.predicate.slice_range;
+            add_slice_bounds(range.start, range.finish, range.reversed, statement);
+            request->statements.push_back(statement);
+          }
+        }
+        else
+        {
+          invalid_request("Only column insertions and deletions are supported over CQL");
+        }
+      }
+    }
+  }
+
+  std::vector<CqlRequest*> to_execute;
+
+  for (request = requests.begin(); request != requests.end(); ++request)
+  {
+    to_execute.push_back(&(*request));
+  }
+
+  execute(to_execute);
+}
+
+void CqlClient::get_slice(std::vector<ColumnOrSuperColumn>& _return,
+                          const std::string& key,
+                          const ColumnParent& column_parent,
+                          const SlicePredicate& predicate,
+                          const ConsistencyLevel::type consistency_level)
+{
+  _return.clear();
+
+  CqlRequest request;
+  request.routing_key = key;
+  request.consistency_level = consistency_level;
+  request.statements.resize(1);
+
+  if (!select_slice(column_parent.column_family,
+                    key,
+                    predicate,
+                    request.statements.front()))
+  {
+    return;
+  }
+
+  std::vector<CqlRequest*> requests(1, &request);
+  execute(requests);
+
+  _return.resize(request.rows.size());
+
+  for (size_t ii = 0; ii < request.rows.size(); ++ii)
+  {
+    to_column(request.rows[ii], 0, _return[ii]);
+  }
+}
+
+void CqlClient::multiget_slice(std::map<std::string, std::vector<ColumnOrSuperColumn> >& _return,
+                               const std::vector<std::string>& keys,
+                               const ColumnParent& column_parent,
+                               const SlicePredicate& predicate,
+                               const ConsistencyLevel::type consistency_level)
+{
+  _return.clear();
+
+  // Read each row with its own request, and send them all at once.  As
+  // through Thrift, every key is in the result, even if it has no columns.
+  std::set<std::string> unique_keys(keys.begin(), keys.end());
+  std::vector<CqlRequest> requests(unique_keys.size());
+  std::vector<CqlRequest*> to_execute;
+  std::vector<CqlRequest>::iterator request = requests.begin();
+
+  for (std::set<std::string>::const_iterator key = unique_keys.begin();
+       key != unique_keys.end();
+       ++key, ++request)
+  {
+    _return[*key];
+    request->routing_key = *key;
+    request->consistency_level = consistency_level;
+    request->statements.resize(1);
+
+    if (select_slice(column_parent.column_family,
+                     *key,
+                     predicate,
+                     request->statements.front()))
+    {
+      to_execute.push_back(&(*request));
+    }
+  }
+
+  if (to_execute.empty())
+  {
+    return;
+  }
+
+  execute(to_execute);
+
+  for (request = requests.begin(); request != requests.end(); ++request)
+  {
+    std::vector<ColumnOrSuperColumn>& columns = _return[request->routing_key];
+    columns.resize(request->rows.size());
+
+    for (size_t ii = 0; ii < request->rows.size(); ++ii)
+    {
+      to_column(request->rows[ii], 0, columns[ii]);
+    }
+  }
+}
+
+void CqlClient::remove(const std::string& key,
+                       const ColumnPath& column_path,
+                       const int64_t timestamp,
+                       const ConsistencyLevel::type consistency_level)
+{
+  if (column_path.__isset.super_column)
+  {
+    invalid_request("Super columns are not supported over CQL");
+  }
+
+  CqlRequest request;
+  request.routing_key = key;
+  request.consistency_level = consistency_level;
+  request.statements.resize(1);
+
+  CqlStatement& statement = request.statements.front();
+  statement.query = "DELETE FROM " + table(column_path.column_family) +
+                    " USING TIMESTAMP ? WHERE key = ?";
+  statement.values.push_back(encode_bigint(timestamp));
+  statement.values.push_back(key);
+
+  if (column_path.__isset.column)
+  {
+    statement.query += " AND column1 = ?";
+    statement.values.push_back(column_path.column);
+  }
+
+  std::vector<CqlRequest*> requests(1, &request);
+  execute(requests);
+}
+
+void CqlClient::get_range_slices(std::vector<KeySlice>& _return,
+                                 const ColumnParent& column_parent,
+                                 const SlicePredicate& predicate,
+                                 const KeyRange& range,
+                                 const ConsistencyLevel::type consistency_level)
+{
+  _return.clear();
+
+  if (range.__isset.row_filter)
+  {
+    invalid_request("Row filters are not supported over CQL");
+  }
+
+  if ((!predicate.__isset.column_names) && (!predicate.__isset.slice_range))
+  {
+    invalid_request("SlicePredicate has neither column_names nor slice_range");
+  }
+
+  // Scan the rows in token order, a page at a time.  As through Thrift, the
+  // start and end keys are inclusive, and the start token is exclusive.
+  CqlRequest request;
+  request.consistency_level = consistency_level;
+  request.page_size = RANGE_PAGE_SIZE;
+  request.statements.resize(1);
+
+  CqlStatement& statement = request.statements.front();
+  statement.query = SELECT_KEYS_AND_COLUMNS + " FROM " + table(column_parent.column_family);
+  const char* conjunction = " WHERE ";
+
+  if ((range.__isset.start_key) && (!range.start_key.empty()))
+  {
+    statement.query += conjunction;
+    statement.query += "token(key) >= token(?)";
+    statement.values.push_back(range.start_key);
+    conjunction = " AND ";
+  }
+  else if (range.__isset.start_token)
+  {
+    statement.query += conjunction;
+    statement.query += "token(key) > ?";
+    statement.values.push_back(encode_bigint(strtoll(range.start_token.c_str(), NULL, 10)));
+    conjunction = " AND ";
+  }
+
+  if ((range.__isset.end_key) && (!range.end_key.empty()))
+  {
+    statement.query += conjunction;
+    statement.query += "token(key) <= token(?)";
+    statement.values.push_back(range.end_key);
+  }
+  else if (range.__isset.end_token)
+  {
+    statement.query += conjunction;
+    statement.query += "token(key) <= ?";
+    statement.values.push_back(encode_bigint(strtoll(range.end_token.c_str(), NULL, 10)));
+  }
+
+  bool done = (range.count <= 0);
+
+  while (!done)
+  {
+    std::vector<CqlRequest*> requests(1, &request);
+    execute(requests);
+
+    for (std::vector<std::vector<std::string> >::iterator row = request.rows.begin();
+         row != request.rows.end();
+         ++row)
+    {
+      const std::string& key = (*row)[0];
+
+      if ((_return.empty()) || (_return.back().key != key))
+      {
+        if (_return.size() == (size_t)range.count)
+        {
+          done = true;
+          break;
+        }
+
+        _return.push_back(KeySlice());
+        _return.back().key = key;
+      }
+
+      _return.back().columns.push_back(ColumnOrSuperColumn());
+      to_column(*row, 1, _return.back().columns.back());
+    }
+
+    done = done || (request.paging_state.empty());
+  }
+
+  for (std::vector<KeySlice>::iterator it = _return.begin();
+       it != _return.end();
+       ++it)
+  {
+    filter_columns(predicate, it->columns);
+  }
+}
+
+void CqlClient::execute(std::vector<CqlRequest*>& requests)
+{
+  // Group the requests by the connection to send them on.
+  std::map<CqlConnection*, std::vector<CqlRequest*> > groups;
+
+  for (std::vector<CqlRequest*>::iterator it = requests.begin();
+       it != requests.end();
+       ++it)
+  {
+    groups[connection_for((*it)->routing_key)].push_back(*it);
+  }
+
+  // Send the requests to every node before reading any responses, so that
+  // they are all in flight at once.  Only MAX_IN_FLIGHT requests are sent to
+  // each node in each round.
+  //
+  // If a peer fails, its requests are sent through our own connection
+  // instead.  This is safe even if they reached the peer, as the writes
+  // carry their timestamps.  If our own connection fails, the exception is
+  // passed to the store, which destroys this client and its connections.
+  std::vector<CqlRequest*> failed;
+
+  for (size_t offset = 0; !groups.empty(); offset += MAX_IN_FLIGHT)
+  {
+    std::map<CqlConnection*, std::vector<CqlRequest*> > round;
+
+    for (std::map<CqlConnection*, std::vector<CqlRequest*> >::iterator group = groups.begin();
+         group != groups.end();)
+    {
+      std::vector<CqlRequest*>& pending = group->second;
+      size_t end = std::min(offset + MAX_IN_FLIGHT, pending.size());
+      round[group->first].assign(pending.begin() + offset, pending.begin() + end);
+
+      if (end == pending.size())
+      {
+        groups.erase(group++);
+      }
+      else
+      {
+        ++group;
+      }
+    }
+
+    for (int phase = 0; phase < 2; ++phase)
+    {
+      for (std::map<CqlConnection*, std::vector<CqlRequest*> >::iterator it = round.begin();
+           it != round.end();)
+      {
+        try
+        {
+          if (phase == 0)
+          {
+            it->first->start(it->second);
+          }
+          else
+          {
+            it->first->finish(it->second);
+          }
+
+          ++it;
+        }
+        catch (TTransportException& te)
+        {
+          if (it->first == _connection)
+          {
+            throw;
+          }
+
+          TRC_WARNING("Failed to send CQL requests to %s: %s",
+                      it->first->host().c_str(), te.what());
+          failed.insert(failed.end(), it->second.begin(), it->second.end());
+
+          std::map<CqlConnection*, std::vector<CqlRequest*> >::iterator group =
+            groups.find(it->first);
+
+          if (group != groups.end())
+          {
+            size_t end = std::min(offset + MAX_IN_FLIGHT, group->second.size());
+            failed.insert(failed.end(), group->second.begin() + end, group->second.end());
+            groups.erase(group);
+          }
+
+          drop_peer(it->first);
+          round.erase(it++);
+        }
+      }
+    }
+  }
+
+  for (size_t offset = 0; offset < failed.size(); offset += MAX_IN_FLIGHT)
+  {
+    std::vector<CqlRequest*> retry(failed.begin() + offset,
+                                   failed.begin() + std::min(offset + MAX_IN_FLIGHT,
+                                                             failed.size()));
+
+    for (std::vector<CqlRequest*>::iterator it = retry.begin();
+         it != retry.end();
+         ++it)
+    {
+      (*it)->error_code = 0;
+      (*it)->error_text.clear();
+    }
+
+    _connection->start(retry);
+    _connection->finish(retry);
+  }
+
+  for (std::vector<CqlRequest*>::iterator it = requests.begin();
+       it != requests.end();
+       ++it)
+  {
+    if ((*it)->error_code != 0)
+    {
+      throw_error((*it)->error_code, (*it)->error_text);
+    }
+  }
+}
+
+CqlConnection* CqlClient::connection_for(const std::string& key)
+{
+  if ((_ring.empty()) || (key.empty()))
+  {
+    return _connection;
+  }
+
+  std::map<int64_t, std::string>::const_iterator owner =
+    _ring.lower_bound(murmur3_token(key));
+
+  if (owner == _ring.end())
+  {
+    // The ring wraps around.
+    owner = _ring.begin();
+  }
+
+  const std::string& host = owner->second;
+
+  if (host == _host)
+  {
+    return _connection;
+  }
+
+  std::map<std::string, CqlConnection*>::iterator peer = _peers.find(host);
+
+  if (peer != _peers.end())
+  {
+    return peer->second;
+  }
+
+  std::map<std::string, time_t>::iterator failed = _failed_peers.find(host);
+
+  if (failed != _failed_peers.end())
+  {
+    if (time(NULL) < failed->second)
+    {
+      return _connection;
+    }
+
+    _failed_peers.erase(failed);
+  }
+
+  CqlConnection* connection = new CqlConnection(host,
+                                                _port,
+                                                _conn_timeout_ms,
+                                                _recv_timeout_ms,
+                                                _send_timeout_ms);
+
+  try
+  {
+    connection->open();
+
+    if (!_keyspace.empty())
+    {
+      connection->use_keyspace(_keyspace);
+    }
+  }
+  catch (TException& te)
+  {
+    TRC_WARNING("Failed to connect to Cassandra node %s: %s",
+                host.c_str(), te.what());
+    delete connection;
+    _failed_peers[host] = time(NULL) + PEER_RETRY_S;
+    return _connection;
+  }
+
+  TRC_DEBUG("Connected to Cassandra node %s", host.c_str());
+  _peers[host] = connection;
+  return connection;
+}
+
+// Add a node's tokens, which are a set of strings, to the ring.
+static void add_tokens(std::map<int64_t, std::string>& ring,
+                       const std::string& tokens,
+                       const std::string& host)
+{
+  CqlReader reader(tokens);
+  int32_t count = reader.read_int();
+
+  for (int32_t ii = 0; (ii < count) && (!reader.error()); ++ii)
+  {
+    std::string token = reader.read_bytes();
+    ring[strtoll(token.c_str(), NULL, 10)] = host;
+  }
+}
+
+void CqlClient::load_ring()
+{
+  _ring.clear();
+
+  try
+  {
+    std::vector<std::vector<std::string> > rows;
+    _connection->query("SELECT partitioner, tokens FROM system.local", rows);
+
+    if ((rows.size() != 1) ||
+        (rows[0][0].find("Murmur3Partitioner") == std::string::npos))
+    {
+      TRC_WARNING("Cassandra doesn't use the Murmur3Partitioner - not routing by token");
+      return;
+    }
+
+    add_tokens(_ring, rows[0][1], _host);
+
+    _connection->query("SELECT peer, rpc_address, tokens FROM system.peers", rows);
+
+    for (std::vector<std::vector<std::string> >::iterator row = rows.begin();
+         row != rows.end();
+         ++row)
+    {
+      // Clients should connect to a node's RPC address, unless it listens on
+      // all addresses.
+      std::string address = (*row)[1];
+
+      if ((address.empty()) ||
+          (address == std::string(4, '\0')) ||
+          (address == std::string(16, '\0')))
+      {
+        address = (*row)[0];
+      }
+
+      char buf[INET6_ADDRSTRLEN];
+      int af = (address.length() == 4) ? AF_INET : AF_INET6;
+
+      if (((address.length() != 4) && (address.length() != 16)) ||
+          (inet_ntop(af, address.data(), buf, sizeof(buf)) == NULL))
+      {
+        continue;
+      }
+
+      add_tokens(_ring, (*row)[2], buf);
+    }
+  }
+  catch (InvalidRequestException& ire)
+  {
+    TRC_WARNING("Failed to read the Cassandra token ring (%s) - not routing by token",
+                ire.why.c_str());
+    _ring.clear();
+    return;
+  }
+
+  TRC_DEBUG("Read %d tokens in the Cassandra token ring", _ring.size());
+}
+
+void CqlClient::drop_peer(CqlConnection* peer)
+{
+  _failed_peers[peer->host()] = time(NULL) + PEER_RETRY_S;
+  _peers.erase(peer->host());
+  delete peer;
+}
+// LCOV_EXCL_STOP
+
+// Cassandra's version of MurmurHash3_x64_128.
+static inline uint64_t rotl64(uint64_t v, int n)
+{
+  return (v << n) | (v >> (64 - n));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+static inline uint64_t get_block(const uint8_t* p)
+{
+  uint64_t block = 0;
+
+  for (int ii = 7; ii >= 0; --ii)
+  {
+    block = (block << 8) | p[ii];
+  }
+
+  return block;
+}
+
+int64_t CqlClient::murmur3_token(const std::string& key)
+{
+  const uint64_t c1 = 0x87c37b91114253d5ULL;
+  const uint64_t c2 = 0x4cf5ad432745937fULL;
+  const uint8_t* data = (const uint8_t*)key.data();
+  const size_t length = key.length();
+  const size_t blocks = length / 16;
+  uint64_t h1 = 0;
+  uint64_t h2 = 0;
+  uint64_t k1;
+  uint64_t k2;
+
+  for (size_t ii = 0; ii < blocks; ++ii)
+  {
+    k1 = get_block(data + ii * 16);
+    k2 = get_block(data + ii * 16 + 8);
+
+    k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+
+    k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+  }
+
+  // Unlike the reference implementation, Cassandra sign-extends the bytes of
+  // the tail, so we must too to agree with it on which node owns a key.
+  const int8_t* tail = (const int8_t*)(data + blocks * 16);
+  k1 = 0;
+  k2 = 0;
+
+  switch (length & 15)
+  {
+  case 15: k2 ^= (uint64_t)(int64_t)tail[14] << 48; // Fall through
+  case 14: k2 ^= (uint64_t)(int64_t)tail[13] << 40; // Fall through
+  case 13: k2 ^= (uint64_t)(int64_t)tail[12] << 32; // Fall through
+  case 12: k2 ^= (uint64_t)(int64_t)tail[11] << 24; // Fall through
+  case 11: k2 ^= (uint64_t)(int64_t)tail[10] << 16; // Fall through
+  case 10: k2 ^= (uint64_t)(int64_t)tail[9] << 8;   // Fall through
+  case 9:  k2 ^= (uint64_t)(int64_t)tail[8];
+           k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+           // Fall through
+  case 8:  k1 ^= (uint64_t)(int64_t)tail[7] << 56;  // Fall through
+  case 7:  k1 ^= (uint64_t)(int64_t)tail[6] << 48;  // Fall through
+  case 6:  k1 ^= (uint64_t)(int64_t)tail[5] << 40;  // Fall through
+  case 5:  k1 ^= (uint64_t)(int64_t)tail[4] << 32;  // Fall through
+  case 4:  k1 ^= (uint64_t)(int64_t)tail[3] << 24;  // Fall through
+  case 3:  k1 ^= (uint64_t)(int64_t)tail[2] << 16;  // Fall through
+  case 2:  k1 ^= (uint64_t)(int64_t)tail[1] << 8;   // Fall through
+  case 1:  k1 ^= (uint64_t)(int64_t)tail[0];
+           k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+           break;
+  default: break;
+  }
+
+  h1 ^= length;
+  h2 ^= length;
+  h1 += h2;
+  h2 += h1;
+  h1 = fmix64(h1);
+  h2 = fmix64(h2);
+  h1 += h2;
+
+  // The token is the first half of the hash, except that the minimum value is
+  // reserved.
+  int64_t token = (int64_t)h1;
+  return (token == INT64_MIN) ? INT64_MAX : token;
+}
+
+} // namespace CassandraStore
@@ -0,0 +1,51 @@
+/**
+ * @file diameter_peer_load.cpp  Tracks the load on a Diameter peer.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "diameter_peer_load.h"
+
+namespace Diameter
+{
+
+void PeerLoad::request_complete(uint64_t latency_us, bool timed_out)
+{
+  // Requests that were outstanding when the count was reset still complete,
+  // so don't let it go negative.
+  int outstanding = _outstanding.load(std::memory_order_relaxed);
+  while ((outstanding > 0) &&
+         (!_outstanding.compare_exchange_weak(outstanding,
+                                              outstanding - 1,
+                                              std::memory_order_relaxed)))
+  {
+  }
+
+  _requests.fetch_add(1, std::memory_order_relaxed);
+
+  if (timed_out)
+  {
+    _timeouts.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Update the moving average.  The first latency seeds it.
+  uint64_t average = _latency_us.load(std::memory_order_relaxed);
+  uint64_t new_average;
+
+  do
+  {
+    new_average = (average == 0) ?
+      latency_us :
+      average - (average >> EWMA_SHIFT) + (latency_us >> EWMA_SHIFT);
+  }
+  while (!_latency_us.compare_exchange_weak(average,
+                                            new_average,
+                                            std::memory_order_relaxed));
+}
+
+} // namespace Diameter
@@ -9,6 +9,9 @@
  * Metaswitch Networks in a separate written agreement.
  */
 
+#include <string.h>
+#include <time.h>
+
 #include "diameterstack.h"
 #include "log.h"
 #include "sasevent.h"
@@ -20,7 +23,8 @@ Stack* Stack::INSTANCE = &DEFAULT_INSTANCE;
 Stack Stack::DEFAULT_INSTANCE;
 struct fd_hook_data_hdl* Stack::_sas_cb_data_hdl = NULL;
 
-Stack::Stack() : _initialized(false),
+Stack::Stack() : _tsx_latency_cbs_registered(false),
+                 _initialized(false),
                  _allow_connections(true),
                  _callback_handler(NULL),
                  _callback_fallback_handler(NULL),
@@ -29,18 +33,48 @@ Stack::Stack() : _initialized(false),
                  _realm_counter(NULL),
                  _host_counter(NULL),
                  _peer_count(-1),
-                 _connected_peer_count(-1)
+                 _connected_peer_count(-1),
+                 _peer_loads(),
+                 _peer_load_table(NULL),
+                 _request_pool_threads(0),
+                 _request_pool_max_queue(0),
+                 _request_load_monitor(NULL),
+                 _request_pool(NULL),
+                 _handler_priorities()
 {
   pthread_mutex_init(&_peer_counts_lock, NULL);
+  pthread_rwlock_init(&_handler_priorities_lock, NULL);
+  pthread_rwlock_init(&_peer_loads_lock, NULL);
   pthread_rwlock_init(&_peer_connection_cbs_lock, NULL);
   pthread_rwlock_init(&_rt_out_cbs_lock, NULL);
+  pthread_rwlock_init(&_tsx_latency_cbs_lock, NULL);
 }
 
 Stack::~Stack()
 {
+  if (_request_pool != NULL)
+  {
+    // LCOV_EXCL_START - the stack is always stopped before it's destroyed
+    _request_pool->stop();
+    _request_pool->join();
+    delete _request_pool; _request_pool = NULL;
+    // LCOV_EXCL_STOP
+  }
+
   pthread_mutex_destroy(&_peer_counts_lock);
+  pthread_rwlock_destroy(&_handler_priorities_lock);
+
+  for (std::map<std::string, PeerLoad*>::iterator load = _peer_loads.begin();
+       load != _peer_loads.end();
+       ++load)
+  {
+    delete load->second;
+  }
+
+  pthread_rwlock_destroy(&_peer_loads_lock);
   pthread_rwlock_destroy(&_peer_connection_cbs_lock);
   pthread_rwlock_destroy(&_rt_out_cbs_lock);
+  pthread_rwlock_destroy(&_tsx_latency_cbs_lock);
 }
 
 void Stack::initialize()
@@ -165,6 +199,77 @@ void Stack::unregister_rt_out_cb(std::string listener_id)
   pthread_rwlock_unlock(&_rt_out_cbs_lock);
 }
 
+void Stack::register_tsx_latency_cb(std::string listener_id,
+                                    TsxLatencyCB tsx_latency_cb)
+{
+  pthread_rwlock_wrlock(&_tsx_latency_cbs_lock);
+  _tsx_latency_cbs[listener_id] = tsx_latency_cb;
+  _tsx_latency_cbs_registered = true;
+  pthread_rwlock_unlock(&_tsx_latency_cbs_lock);
+}
+
+void Stack::unregister_tsx_latency_cb(std::string listener_id)
+{
+  pthread_rwlock_wrlock(&_tsx_latency_cbs_lock);
+  _tsx_latency_cbs.erase(listener_id);
+  _tsx_latency_cbs_registered = !_tsx_latency_cbs.empty();
+  pthread_rwlock_unlock(&_tsx_latency_cbs_lock);
+}
+
+PeerLoad* Stack::peer_load(const std::string& host)
+{
+  PeerLoad* load = find_peer_load(host);
+
+  if (load == NULL)
+  {
+    pthread_rwlock_wrlock(&_peer_loads_lock);
+    PeerLoad*& entry = _peer_loads[host];
+
+    if (entry == NULL)
+    {
+      TRC_DEBUG("Tracking load on Diameter peer %s", host.c_str());
+      entry = new PeerLoad(host);
+
+      if (_peer_load_table != NULL)
+      {
+        _peer_load_table->add_peer(entry);
+      }
+    }
+
+    load = entry;
+    pthread_rwlock_unlock(&_peer_loads_lock);
+  }
+
+  return load;
+}
+
+PeerLoad* Stack::find_peer_load(const std::string& host)
+{
+  PeerLoad* load = NULL;
+
+  pthread_rwlock_rdlock(&_peer_loads_lock);
+  std::map<std::string, PeerLoad*>::const_iterator entry = _peer_loads.find(host);
+  if (entry != _peer_loads.end())
+  {
+    load = entry->second;
+  }
+  pthread_rwlock_unlock(&_peer_loads_lock);
+
+  return load;
+}
+
+void Stack::report_tsx_latency(const std::string& peer, unsigned long duration_us)
+{
+  pthread_rwlock_rdlock(&_tsx_latency_cbs_lock);
+  for (std::map<std::string, TsxLatencyCB>::const_iterator cb = _tsx_latency_cbs.begin();
+       cb != _tsx_latency_cbs.end();
+       ++cb)
+  {
+    (cb->second)(peer, duration_us);
+  }
+  pthread_rwlock_unlock(&_tsx_latency_cbs_lock);
+}
+
 void Stack::populate_avp_map()
 {
   fd_list* vendor_sentinel;
@@ -178,7 +283,9 @@ void Stack::populate_avp_map()
     struct dict_vendor_data vendor_data;
     fd_dict_getval(vendor_dict, &vendor_data);
 
-    populate_vendor_map(vendor_data.vendor_name, vendor_dict);
+    populate_vendor_map(vendor_data.vendor_name,
+                        vendor_data.vendor_id,
+                        vendor_dict);
   }
 
   // Repeat for vendor 0 (which isn't found by fd_dict_getlistof).
@@ -191,10 +298,11 @@ void Stack::populate_avp_map()
                  &vendor_dict,
                  ENOENT);
 
-  populate_vendor_map("", vendor_dict);
+  populate_vendor_map("", vendor_id, vendor_dict);
 }
 
 void Stack::populate_vendor_map(const std::string& vendor_name,
+                                uint32_t vendor_id,
                                 struct dict_object* vendor_dict)
 {
   fd_list* avp_sentinel;
@@ -209,8 +317,12 @@ void Stack::populate_vendor_map(const std::string& vendor_name,
     struct dict_avp_data avp_data;
     fd_dict_getval(avp_dict, &avp_data);
 
-    // Add this AVP to this vendor's map entry.
-    _avp_map[vendor_name][avp_data.avp_name] = avp_dict;
+    // Index this AVP by name and by code.
+    NamedAVP named_avp;
+    named_avp.vendor = vendor_name;
+    named_avp.dict = avp_dict;
+    _avps_by_name[avp_data.avp_name].push_back(named_avp);
+    _avps_by_code[avp_code_key(vendor_id, avp_data.avp_code)] = avp_dict;
   }
 }
 
@@ -355,6 +467,14 @@ void Stack::fd_peer_hook_cb(enum fd_hook_type type,
 
     std::string host = peer->info.pi_diamid;
 
+    // Any requests outstanding on the old connection have been failed over
+    // to other peers.
+    PeerLoad* load = find_peer_load(host);
+    if (load != NULL)
+    {
+      load->reset_outstanding();
+    }
+
     pthread_rwlock_rdlock(&_peer_connection_cbs_lock);
     for (std::map<std::string, PeerConnectionCB>::const_iterator cb = _peer_connection_cbs.begin();
          cb != _peer_connection_cbs.end();
@@ -495,6 +615,73 @@ void Stack::register_handler(const Dictionary::Application& app,
   }
 }
 
+void Stack::register_handler(const Dictionary::Application& app,
+                             const Dictionary::Message& msg,
+                             HandlerInterface* handler,
+                             SIPEventPriorityLevel priority)
+{
+  pthread_rwlock_wrlock(&_handler_priorities_lock);
+  _handler_priorities[handler] = priority;
+  pthread_rwlock_unlock(&_handler_priorities_lock);
+
+  register_handler(app, msg, handler);
+}
+
+void Stack::configure_request_pool(unsigned int num_threads,
+                                   unsigned int max_queue,
+                                   LoadMonitor* load_monitor)
+{
+  TRC_STATUS("Configuring Diameter request pool");
+  TRC_STATUS("  Threads:   %u", num_threads);
+  TRC_STATUS("  Max Queue: %u", max_queue);
+  _request_pool_threads = num_threads;
+  _request_pool_max_queue = max_queue;
+  _request_load_monitor = load_monitor;
+}
+
+void Stack::queue_request(HandlerInterface* handler,
+                          struct msg** req,
+                          SAS::TrailId trail)
+{
+  // Check the queue before the load monitor, so that requests we reject for
+  // the queue being full don't use up the load monitor's tokens.
+  if (((_request_pool_max_queue > 0) &&
+       (_request_pool->queue_size() >= (int)_request_pool_max_queue)) ||
+      ((_request_load_monitor != NULL) &&
+       (!_request_load_monitor->admit_request(trail))))
+  {
+    TRC_DEBUG("Rejecting Diameter request on trail %lu - overloaded", trail);
+    fd_msg_new_answer_from_req(fd_g_config->cnf_dict, req, 0);
+    fd_msg_rescode_set(*req, (char*)"DIAMETER_TOO_BUSY", NULL, NULL, 1);
+    send(*req, trail);
+    return;
+  }
+
+  Request request;
+  request.handler = handler;
+  request.req = *req;
+  request.trail = trail;
+  request.priority = NORMAL_PRIORITY;
+
+  pthread_rwlock_rdlock(&_handler_priorities_lock);
+  std::map<HandlerInterface*, SIPEventPriorityLevel>::const_iterator priority =
+    _handler_priorities.find(handler);
+  if (priority != _handler_priorities.end())
+  {
+    request.priority = priority->second;
+  }
+  pthread_rwlock_unlock(&_handler_priorities_lock);
+
+  _request_pool->add_work(std::move(request));
+}
+
+void Stack::request_exception_callback(Request request)
+{
+  // The handler owned the request once it was called, so there's nothing to
+  // tidy up - the exception handler has already logged the exception.
+  TRC_ERROR("Exception processing Diameter request on trail %lu", request.trail); // LCOV_EXCL_LINE
+}
+
 void Stack::register_fallback_handler(const Dictionary::Application &app)
 {
   // Register a fallback callback for messages of an unexpected type to our application
@@ -536,6 +723,18 @@ int Stack::request_callback_fn(struct msg** req,
     trail = SAS::new_trail(0);
     TRC_WARNING("No per-message data found - allocated new trail ID: %lu", trail);
   }
+  Stack* stack = get_instance();
+
+  if (stack->_request_pool != NULL)
+  {
+    // Queue the request for a worker thread, which passes it to the handler.
+    TRC_DEBUG("Queue diameter request on trail %lu", trail);
+    stack->queue_request(handler, req, trail);
+    *req = NULL;
+    *act = DISP_ACT_CONT;
+    return 0;
+  }
+
   TRC_DEBUG("Invoke diameter request handler on trail %lu", trail);
 
   // Pass the request to the registered handler.
@@ -569,6 +768,21 @@ void Stack::start()
 {
   initialize();
   TRC_STATUS("Starting Diameter stack");
+
+  if ((_request_pool_threads > 0) && (_request_pool == NULL))
+  {
+    // Start the request pool before freeDiameter, so it's ready for the first
+    // request.  The pool's own queue is unbounded - queue_request() enforces
+    // the limit, so that freeDiameter's threads never block on it.
+    _request_pool = new RequestPool(_request_pool_threads,
+                                    _exception_handler,
+                                    request_exception_callback,
+                                    new eventq<Request>::PriorityBackend(request_priority),
+                                    0,
+                                    std::vector<SNMP::EventAccumulatorByScopeTable*>());
+    _request_pool->start();
+  }
+
   int rc = fd_core_start();
   if (rc != 0)
   {
@@ -591,6 +805,11 @@ void Stack::stop()
       (void)fd_disp_unregister(&_callback_fallback_handler, NULL);
     }
 
+    if (_request_pool != NULL)
+    {
+      _request_pool->stop();
+    }
+
     if (_peer_cb_hdlr)
     {
       pthread_rwlock_rdlock(&_peer_connection_cbs_lock);
@@ -651,6 +870,13 @@ void Stack::wait_stopped()
       throw Exception("fd_core_wait_shutdown_complete", rc); // LCOV_EXCL_LINE
     }
     fd_log_handler_unregister();
+
+    if (_request_pool != NULL)
+    {
+      _request_pool->join();
+      delete _request_pool; _request_pool = NULL;
+    }
+
     _initialized = false;
     _peer_count = -1;
     _connected_peer_count = -1;
@@ -930,6 +1156,12 @@ void Stack::fd_sas_log_diameter_message(enum fd_hook_type type,
     // Sent request / answer. Use the trail ID that the diameter stack set on
     // the message (if available) or create a new one if not.
     TRC_DEBUG("Processing a sent diameter message");
+
+    if ((hdr->msg_flags & CMD_FLAG_REQUEST) && (peer != NULL))
+    {
+      stack->peer_load(peer->info.pi_diamid)->request_sent();
+    }
+
     if (pmd != NULL)
     {
       trail = pmd->trail;
@@ -1051,16 +1283,19 @@ struct dict_object* Dictionary::AVP::find(const std::string avp)
 struct dict_object* Dictionary::AVP::find(const std::string vendor, const std::string avp)
 {
   Stack* stack = Stack::get_instance();
-  std::unordered_map<std::string, std::unordered_map<std::string, struct dict_object*>>::iterator vendor_entry;
-  vendor_entry = stack->avp_map().find(vendor);
-  if (vendor_entry != stack->avp_map().end())
-  {
-    // Found the vendor, now find the AVP
-    std::unordered_map<std::string, struct dict_object*>::iterator avp_entry;
-    avp_entry = vendor_entry->second.find(avp);
-    if (avp_entry != vendor_entry->second.end())
+  Stack::AVPsByName::const_iterator avp_entry = stack->avps_by_name().find(avp);
+  if (avp_entry != stack->avps_by_name().end())
+  {
+    // Found the AVP name - now find the vendor (there are only ever a few
+    // vendors for each name).
+    for (std::vector<Stack::NamedAVP>::const_iterator named_avp = avp_entry->second.begin();
+         named_avp != avp_entry->second.end();
+         ++named_avp)
     {
-      return avp_entry->second;
+      if (named_avp->vendor == vendor)
+      {
+        return named_avp->dict;
+      }
     }
   }
   return NULL;
@@ -1068,15 +1303,27 @@ struct dict_object* Dictionary::AVP::find(const std::string vendor, const std::s
 
 struct dict_object* Dictionary::AVP::find(const std::vector<std::string>& vendors, const std::string avp)
 {
+  // Look the name up once, and then pick the first of the vendors that
+  // defines it.
   struct dict_object* dict = NULL;
-  for (std::vector<std::string>::const_iterator vendor = vendors.begin();
-       vendor != vendors.end();
-       ++vendor)
+  Stack* stack = Stack::get_instance();
+  Stack::AVPsByName::const_iterator avp_entry = stack->avps_by_name().find(avp);
+  if (avp_entry != stack->avps_by_name().end())
   {
-    dict = find(*vendor, avp);
-    if (dict != NULL)
+    for (std::vector<std::string>::const_iterator vendor = vendors.begin();
+         (vendor != vendors.end()) && (dict == NULL);
+         ++vendor)
     {
-      break;
+      for (std::vector<Stack::NamedAVP>::const_iterator named_avp = avp_entry->second.begin();
+           named_avp != avp_entry->second.end();
+           ++named_avp)
+      {
+        if (named_avp->vendor == *vendor)
+        {
+          dict = named_avp->dict;
+          break;
+        }
+      }
     }
   }
 
@@ -1087,6 +1334,18 @@ struct dict_object* Dictionary::AVP::find(const std::vector<std::string>& vendor
   return dict;
 }
 
+struct dict_object* Dictionary::AVP::find(uint32_t vendor_id, uint32_t code)
+{
+  Stack* stack = Stack::get_instance();
+  Stack::AVPsByCode::const_iterator avp_entry =
+    stack->avps_by_code().find(Stack::avp_code_key(vendor_id, code));
+  if (avp_entry == stack->avps_by_code().end())
+  {
+    throw Diameter::Stack::Exception("AVP code", code);
+  }
+  return avp_entry->second;
+}
+
 Dictionary::Dictionary() :
   SESSION_ID("Session-Id"),
   VENDOR_SPECIFIC_APPLICATION_ID("Vendor-Specific-Application-Id"),
@@ -1132,6 +1391,33 @@ void Transaction::on_response(void* data, struct msg** rsp)
   stack->report_tsx_result(rc);
 
   tsx->stop_timer();
+
+  // Record the answer against the peer we received it from (which isn't the
+  // Origin-Host if it came through an agent).
+  unsigned long duration_us;
+  bool got_duration = tsx->get_duration(duration_us);
+  DiamId_t source;
+  size_t source_len;
+
+  if ((got_duration) &&
+      (fd_msg_source_get(*rsp, &source, &source_len) == 0) &&
+      (source != NULL))
+  {
+    stack->peer_load(std::string((const char*)source, source_len))->request_complete(duration_us, false);
+  }
+
+  // Report how long the peer that answered took.  This is only worked out if
+  // anyone is listening, to avoid searching the answer for its Origin-Host.
+  if ((got_duration) && (stack->tsx_latency_cbs_registered()))
+  {
+    std::string origin_host;
+
+    if (msg.get_origin_host(origin_host))
+    {
+      stack->report_tsx_latency(origin_host, duration_us);
+    }
+  }
+
   tsx->on_response(msg);
   delete tsx;
   // Null out the message so that freeDiameter doesn't try to send it on.
@@ -1171,6 +1457,21 @@ void Transaction::on_timeout(void* data, DiamId_t to, size_t to_len, struct msg*
   stack->report_tsx_timeout();
 
   tsx->stop_timer();
+
+  // A timeout counts as a transaction that took as long as the timeout.
+  unsigned long duration_us;
+
+  if ((to != NULL) && (tsx->get_duration(duration_us)))
+  {
+    std::string host((const char*)to, to_len);
+    stack->peer_load(host)->request_complete(duration_us, true);
+
+    if (stack->tsx_latency_cbs_registered())
+    {
+      stack->report_tsx_latency(host, duration_us);
+    }
+  }
+
   tsx->on_timeout();
   delete tsx;
   // Null out the message so that freeDiameter doesn't try to send it on.
@@ -1193,6 +1494,21 @@ bool AVP::get_str_from_avp(const Dictionary::AVP& type, std::string& str) const
   }
 }
 
+// As above, but refer to the value rather than copying it.
+bool AVP::get_str_from_avp(const Dictionary::AVP& type, boost::string_ref& str) const
+{
+  AVP::iterator avps = begin(type);
+  if (avps != end())
+  {
+    str = avps->val_str_ref();
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+}
+
 // Given an AVP type, search an AVP for a child of this type. If one exists, return true
 // and set i32 to the integer value of the child AVP. Otherwise return false.
 bool AVP::get_i32_from_avp(const Dictionary::AVP& type, int32_t& i32) const
@@ -1295,19 +1611,24 @@ AVP& AVP::val_json(const std::vector<std::string>& vendors,
             TRC_ERROR("Invalid NULL in JSON block, ignoring");
             break;
           case rapidjson::kArrayType:
+          {
+            // Look the AVP up once for all the values.
+            Diameter::Dictionary::AVP new_dict(vendors, std::string(it->name.GetString(),
+                                                                    it->name.GetStringLength()));
             for (rapidjson::Value::ConstValueIterator ary_it = it->value.Begin();
                  ary_it != it->value.End();
                  ++ary_it)
             {
-              Diameter::Dictionary::AVP new_dict(vendors, it->name.GetString());
               Diameter::AVP avp(new_dict);
               add(avp.val_json(vendors, new_dict, *ary_it));
             }
             break;
+          }
           case rapidjson::kStringType:
           case rapidjson::kNumberType:
           case rapidjson::kObjectType:
-            Diameter::Dictionary::AVP new_dict(vendors, it->name.GetString());
+            Diameter::Dictionary::AVP new_dict(vendors, std::string(it->name.GetString(),
+                                                                    it->name.GetStringLength()));
             Diameter::AVP avp(new_dict);
             add(avp.val_json(vendors, new_dict, it->value));
             break;
@@ -1324,6 +1645,19 @@ AVP& AVP::val_json(const std::vector<std::string>& vendors,
   return *this;
 }
 
+Message::Message(const Dictionary* dict,
+                 const MessageTemplate& tmpl,
+                 Stack* stack) :
+  _dict(dict),
+  _fd_msg(tmpl.instantiate()),
+  _stack(stack),
+  _free_on_delete(true),
+  _master_msg(this),
+  _result(0),
+  _avp_cache(new AVPCache())
+{
+}
+
 Message::~Message()
 {
   if (_free_on_delete)
@@ -1342,16 +1676,57 @@ void Message::operator=(Message const& msg)
   _fd_msg = msg._fd_msg;
   _free_on_delete = false;
   _master_msg = msg._master_msg;
+  _avp_cache = msg._avp_cache;
+}
+
+struct avp* Message::find_avp(const Dictionary::AVP& type) const
+{
+  if (!_avp_cache->built)
+  {
+    // Index the top-level AVPs in a single pass, keeping the first of each
+    // type.
+    msg_or_avp* avp = NULL;
+    fd_msg_browse_internal(_fd_msg, MSG_BRW_FIRST_CHILD, &avp, NULL);
+    while (avp != NULL)
+    {
+      struct avp_hdr* hdr;
+      fd_msg_avp_hdr((struct avp*)avp, &hdr);
+      uint64_t key = ((uint64_t)hdr->avp_vendor << 32) | hdr->avp_code;
+      _avp_cache->first.insert(std::make_pair(key, (struct avp*)avp));
+      fd_msg_browse_internal(avp, MSG_BRW_NEXT, &avp, NULL);
+    }
+    _avp_cache->built = true;
+  }
+
+  const struct dict_avp_data* avp_data = type.avp_data();
+  uint64_t key = ((uint64_t)avp_data->avp_vendor << 32) | avp_data->avp_code;
+  std::unordered_map<uint64_t, struct avp*>::const_iterator it = _avp_cache->first.find(key);
+  return (it != _avp_cache->first.end()) ? it->second : NULL;
 }
 
 // Given an AVP type, search a Diameter message for an AVP of this type. If one exists,
 // return true and set str to the string value of this AVP. Otherwise return false.
 bool Message::get_str_from_avp(const Dictionary::AVP& type, std::string& str) const
 {
-  AVP::iterator avps = begin(type);
-  if (avps != end())
+  struct avp* avp = find_avp(type);
+  if (avp != NULL)
   {
-    str = avps->val_str();
+    str = AVP(avp).val_str();
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+}
+
+// As above, but refer to the value rather than copying it.
+bool Message::get_str_from_avp(const Dictionary::AVP& type, boost::string_ref& str) const
+{
+  struct avp* avp = find_avp(type);
+  if (avp != NULL)
+  {
+    str = AVP(avp).val_str_ref();
     return true;
   }
   else
@@ -1364,10 +1739,10 @@ bool Message::get_str_from_avp(const Dictionary::AVP& type, std::string& str) co
 // return true and set i32 to the integer value of this AVP. Otherwise return false.
 bool Message::get_i32_from_avp(const Dictionary::AVP& type, int32_t& i32) const
 {
-  AVP::iterator avps = begin(type);
-  if (avps != end())
+  struct avp* avp = find_avp(type);
+  if (avp != NULL)
   {
-    i32 = avps->val_i32();
+    i32 = AVP(avp).val_i32();
     return true;
   }
   else
@@ -1380,10 +1755,10 @@ bool Message::get_i32_from_avp(const Dictionary::AVP& type, int32_t& i32) const
 // return true and set u32 to the integer value of this AVP. Otherwise return false.
 bool Message::get_u32_from_avp(const Dictionary::AVP& type, uint32_t& u32) const
 {
-  AVP::iterator avps = begin(type);
-  if (avps != end())
+  struct avp* avp = find_avp(type);
+  if (avp != NULL)
   {
-    u32 = avps->val_i32();
+    u32 = AVP(avp).val_i32();
     return true;
   }
   else
@@ -1399,12 +1774,13 @@ bool Message::get_u32_from_avp(const Dictionary::AVP& type, uint32_t& u32) const
 bool Message::experimental_result(int32_t& experimental_result_code, uint32_t& vendor_id) const
 {
   bool found_experimental_result = false;
-  AVP::iterator avps = begin(dict()->EXPERIMENTAL_RESULT);
-  if (avps != end())
+  struct avp* avp = find_avp(dict()->EXPERIMENTAL_RESULT);
+  if (avp != NULL)
   {
-    AVP::iterator code = avps->begin(dict()->EXPERIMENTAL_RESULT_CODE);
-    AVP::iterator vendor = avps->begin(dict()->VENDOR_ID);
-    if (code != avps->end() && vendor != avps->end())
+    AVP experimental_result(avp);
+    AVP::iterator code = experimental_result.begin(dict()->EXPERIMENTAL_RESULT_CODE);
+    AVP::iterator vendor = experimental_result.begin(dict()->VENDOR_ID);
+    if (code != experimental_result.end() && vendor != experimental_result.end())
     {
       experimental_result_code = code->val_i32();
       vendor_id = vendor->val_u32();
@@ -1421,11 +1797,12 @@ bool Message::experimental_result(int32_t& experimental_result_code, uint32_t& v
 int32_t Message::vendor_id() const
 {
   int32_t vendor_id = 0;
-  AVP::iterator avps = begin(dict()->VENDOR_SPECIFIC_APPLICATION_ID);
-  if (avps != end())
+  struct avp* avp = find_avp(dict()->VENDOR_SPECIFIC_APPLICATION_ID);
+  if (avp != NULL)
   {
-    AVP::iterator avps2 = avps->begin(dict()->VENDOR_ID);
-    if (avps2 != avps->end())
+    AVP vendor_specific_application_id(avp);
+    AVP::iterator avps2 = vendor_specific_application_id.begin(dict()->VENDOR_ID);
+    if (avps2 != vendor_specific_application_id.end())
     {
       vendor_id = avps2->val_i32();
       TRC_DEBUG("Got Vendor-Id %d", vendor_id);
@@ -1434,29 +1811,166 @@ int32_t Message::vendor_id() const
   return vendor_id;
 }
 
-Message& Message::add_session_id(const std::string& session_id)
+Message& Message::add_new_session_id()
+{
+  // Identities are FQDNs, so nearly always fit - fall back to a freeDiameter
+  // session for any that don't.
+  static thread_local char buf[256 + SessionIdGenerator::MAX_SUFFIX_LEN];
+  size_t len = SessionIdGenerator::generate(fd_g_config->cnf_diamid,
+                                            fd_g_config->cnf_diamid_len,
+                                            buf,
+                                            sizeof(buf));
+
+  if (len == 0)
+  {
+    // LCOV_EXCL_START - identities are never this long in the UTs
+    fd_msg_new_session(_fd_msg, NULL, 0);
+    _avp_cache->clear();
+    _avp_cache->session_id = boost::string_ref();
+    return *this;
+    // LCOV_EXCL_STOP
+  }
+
+  // The Session-ID goes first (RFC 6733 section 8.8).  freeDiameter copies
+  // the value, so the buffer can be reused straight away.
+  Diameter::AVP session_id_avp(dict()->SESSION_ID);
+  session_id_avp.val_os((uint8_t*)buf, len);
+  fd_msg_avp_add(_fd_msg, MSG_BRW_FIRST_CHILD, session_id_avp.avp());
+  _avp_cache->clear();
+  _avp_cache->session_id = session_id_avp.val_str_ref();
+  return *this;
+}
+
+Message& Message::add_session_id(boost::string_ref session_id)
 {
   Diameter::AVP session_id_avp(dict()->SESSION_ID);
-  session_id_avp.val_str(session_id);
+  session_id_avp.val_os((uint8_t*)session_id.data(), session_id.length());
   add(session_id_avp);
   return *this;
 }
 
-const std::string Message::get_session_id()
+std::atomic<uint32_t> SessionIdGenerator::_next_high((uint32_t)time(NULL));
+
+size_t SessionIdGenerator::generate(const char* identity,
+                                    size_t identity_len,
+                                    char* buf,
+                                    size_t buf_len)
 {
-  Diameter::AVP::iterator avps = begin((dict())->SESSION_ID);
+  // The high 32 bits this thread owns, and the next low 32 bits to use.
+  static thread_local bool have_high = false;
+  static thread_local uint32_t high;
+  static thread_local uint32_t low;
 
-  if (avps != end())
+  if (identity_len + MAX_SUFFIX_LEN > buf_len)
   {
-    return avps->val_str();
+    return 0;
   }
-  else
+
+  if ((!have_high) || (low == 0))
+  {
+    // First use on this thread, or the low bits have wrapped.
+    high = _next_high.fetch_add(1, std::memory_order_relaxed);
+    low = 0;
+    have_high = true;
+  }
+
+  char* end = buf;
+  memcpy(end, identity, identity_len);
+  end += identity_len;
+  *end++ = ';';
+  end = write_u32(end, high);
+  *end++ = ';';
+  end = write_u32(end, low++);
+
+  return end - buf;
+}
+
+char* SessionIdGenerator::write_u32(char* buf, uint32_t value)
+{
+  // Write the digits backwards into a scratch buffer, then copy them out.
+  char digits[10];
+  char* start = digits + sizeof(digits);
+
+  do
+  {
+    *--start = '0' + (value % 10);
+    value /= 10;
+  }
+  while (value != 0);
+
+  size_t len = digits + sizeof(digits) - start;
+  memcpy(buf, start, len);
+  return buf + len;
+}
+
+MessageTemplate::MessageTemplate(const Message& msg) :
+  _buffer(NULL),
+  _length(0)
+{
+  int rc = fd_msg_bufferize(msg.fd_msg(), &_buffer, &_length);
+  if (rc != 0)
   {
-    TRC_ERROR("No Session-ID found in request");
-    throw Diameter::AVPException("Session-ID");
+    throw Diameter::Stack::Exception("fd_msg_bufferize", rc); // LCOV_EXCL_LINE
   }
 }
 
+MessageTemplate::~MessageTemplate()
+{
+  free(_buffer);
+}
+
+struct msg* MessageTemplate::instantiate() const
+{
+  uint8_t* buffer = (uint8_t*)malloc(_length);
+  memcpy(buffer, _buffer, _length);
+
+  // On success, the message takes ownership of the buffer.
+  struct msg* msg = NULL;
+  int rc = fd_msg_parse_buffer(&buffer, _length, &msg);
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START - the template was encoded by freeDiameter
+    free(buffer);
+    throw Diameter::Stack::Exception("fd_msg_parse_buffer", rc);
+    // LCOV_EXCL_STOP
+  }
+
+  rc = fd_msg_parse_dict(msg, fd_g_config->cnf_dict, NULL);
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START - the template's AVPs came from the dictionary
+    fd_msg_free(msg);
+    throw Diameter::Stack::Exception("fd_msg_parse_dict", rc);
+    // LCOV_EXCL_STOP
+  }
+
+  // The encoded end-to-end identifier is the one allocated when the
+  // template's message was built, so allocate a new one.
+  struct msg_hdr* hdr;
+  fd_msg_hdr(msg, &hdr);
+  hdr->msg_eteid = fd_msg_eteid_get();
+
+  return msg;
+}
+
+boost::string_ref Message::get_session_id_ref() const
+{
+  if (_avp_cache->session_id.data() == NULL)
+  {
+    struct avp* avp = find_avp(dict()->SESSION_ID);
+
+    if (avp == NULL)
+    {
+      TRC_ERROR("No Session-ID found in request");
+      throw Diameter::AVPException("Session-ID");
+    }
+
+    _avp_cache->session_id = Diameter::AVP(avp).val_str_ref();
+  }
+
+  return _avp_cache->session_id;
+}
+
 void Message::send(SAS::TrailId trail)
 {
   TRC_VERBOSE("Sending Diameter message of type %u", command_code());
@@ -0,0 +1,436 @@
+/**
+ * @file dns_cache_file.cpp  File that a DNS cache is saved to across restarts.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stddef.h>
+
+#include <fstream>
+#include <iterator>
+
+#include "log.h"
+#include "dns_cache_file.h"
+
+const uint32_t DnsCacheFile::MAGIC;
+const uint32_t DnsCacheFile::VERSION;
+
+namespace
+{
+  template <class T>
+  void append(std::string& data, T value)
+  {
+    data.append((const char*)&value, sizeof(value));
+  }
+
+  // Strings are written with a 16-bit length, which is plenty for DNS names
+  // and NAPTR fields.
+  void append_string(std::string& data, const std::string& value)
+  {
+    uint16_t length = (value.size() > UINT16_MAX) ? UINT16_MAX : value.size();
+    append(data, length);
+    data.append(value, 0, length);
+  }
+}
+
+/// Reads the fields of the file, checking that each lies within it.  Once a
+/// read fails, all subsequent reads fail.
+class DnsCacheFile::Reader
+{
+public:
+  Reader(const std::string& data) : _data(data), _offset(0), _ok(true) {}
+
+  template <class T>
+  bool read(T& value)
+  {
+    if ((!_ok) || (_data.size() - _offset < sizeof(value)))
+    {
+      _ok = false;
+      return false;
+    }
+
+    memcpy(&value, _data.data() + _offset, sizeof(value));
+    _offset += sizeof(value);
+    return true;
+  }
+
+  bool read_string(std::string& value)
+  {
+    uint16_t length;
+
+    if ((!read(length)) || (_data.size() - _offset < length))
+    {
+      _ok = false;
+      return false;
+    }
+
+    value.assign(_data, _offset, length);
+    _offset += length;
+    return true;
+  }
+
+  void fail() { _ok = false; }
+  bool ok() const { return _ok; }
+
+private:
+  const std::string& _data;
+  size_t _offset;
+  bool _ok;
+};
+
+DnsCacheFile::Writer::Writer() :
+  _count(0)
+{
+  Header header = {MAGIC, VERSION, time(NULL), 0, 0};
+  append(_data, header);
+}
+
+void DnsCacheFile::Writer::add_entry(const std::string& domain,
+                                     int dnstype,
+                                     int expires,
+                                     const std::vector<DnsRRecord*>& records)
+{
+  append(_data, (uint16_t)dnstype);
+  append_string(_data, domain);
+  append(_data, (int64_t)expires);
+  append(_data, (uint16_t)records.size());
+
+  for (std::vector<DnsRRecord*>::const_iterator i = records.begin();
+       i != records.end();
+       ++i)
+  {
+    add_record(domain, *i);
+  }
+
+  ++_count;
+}
+
+void DnsCacheFile::Writer::add_record(const std::string& domain,
+                                      const DnsRRecord* record)
+{
+  const DnsARecord* a;
+  const DnsAAAARecord* aaaa;
+  const DnsSrvRecord* srv;
+  const DnsNaptrRecord* naptr;
+  const DnsCNAMERecord* cname;
+
+  // The kind of record is found from its class rather than its type, as a
+  // record object of a known type may have been created without its data.
+  uint8_t kind = RECORD_OTHER;
+
+  if ((a = dynamic_cast<const DnsARecord*>(record)) != NULL)
+  {
+    kind = RECORD_A;
+  }
+  else if ((aaaa = dynamic_cast<const DnsAAAARecord*>(record)) != NULL)
+  {
+    kind = RECORD_AAAA;
+  }
+  else if ((srv = dynamic_cast<const DnsSrvRecord*>(record)) != NULL)
+  {
+    kind = RECORD_SRV;
+  }
+  else if ((naptr = dynamic_cast<const DnsNaptrRecord*>(record)) != NULL)
+  {
+    kind = RECORD_NAPTR;
+  }
+  else if ((cname = dynamic_cast<const DnsCNAMERecord*>(record)) != NULL)
+  {
+    kind = RECORD_CNAME;
+  }
+
+  append(_data, kind);
+  append(_data, (uint16_t)record->rrtype());
+  append(_data, (uint16_t)record->rrclass());
+  append(_data, (int64_t)record->expires());
+
+  // Most records are for the entry's domain, so an empty name is written for
+  // them.
+  append_string(_data, (record->rrname() == domain) ? "" : record->rrname());
+
+  switch (kind)
+  {
+  case RECORD_A:
+    append(_data, a->address());
+    break;
+
+  case RECORD_AAAA:
+    append(_data, aaaa->address());
+    break;
+
+  case RECORD_SRV:
+    append(_data, (uint16_t)srv->priority());
+    append(_data, (uint16_t)srv->weight());
+    append(_data, (uint16_t)srv->port());
+    append_string(_data, srv->target());
+    break;
+
+  case RECORD_NAPTR:
+    append(_data, (uint16_t)naptr->order());
+    append(_data, (uint16_t)naptr->preference());
+    append_string(_data, naptr->flags());
+    append_string(_data, naptr->service());
+    append_string(_data, naptr->regexp());
+    append_string(_data, naptr->replacement());
+    break;
+
+  case RECORD_CNAME:
+    append_string(_data, cname->target());
+    break;
+
+  default:
+    break;
+  }
+}
+
+bool DnsCacheFile::Writer::write(const std::string& filename)
+{
+  memcpy(&_data[offsetof(Header, count)], &_count, sizeof(_count));
+
+  std::string tmp_filename = filename + ".tmp";
+
+  {
+    std::ofstream fs(tmp_filename.c_str(), std::ios::binary | std::ios::trunc);
+    fs.write(_data.data(), _data.size());
+    fs.close();
+
+    if (!fs)
+    {
+      TRC_ERROR("Unable to write DNS cache file %s", tmp_filename.c_str());
+      unlink(tmp_filename.c_str());
+      return false;
+    }
+  }
+
+  if (rename(tmp_filename.c_str(), filename.c_str()) != 0)
+  {
+    TRC_ERROR("Unable to rename DNS cache file to %s: %s",
+              filename.c_str(),
+              strerror(errno));
+    unlink(tmp_filename.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+bool DnsCacheFile::read(const std::string& filename,
+                        int now,
+                        std::vector<Entry>& entries)
+{
+  std::ifstream fs(filename.c_str(), std::ios::binary);
+
+  if (!fs)
+  {
+    TRC_DEBUG("No DNS cache file %s", filename.c_str());
+    return false;
+  }
+
+  std::string data((std::istreambuf_iterator<char>(fs)),
+                   std::istreambuf_iterator<char>());
+  Reader reader(data);
+  Header header;
+
+  if ((!reader.read(header)) ||
+      (header.magic != MAGIC) ||
+      (header.version != VERSION))
+  {
+    TRC_WARNING("Ignoring DNS cache file %s, which isn't a valid cache file",
+                filename.c_str());
+    return false;
+  }
+
+  for (uint32_t ii = 0; ii < header.count; ++ii)
+  {
+    uint16_t dnstype;
+    std::string domain;
+    int64_t expires;
+    uint16_t num_records;
+
+    if ((!reader.read(dnstype)) ||
+        (!reader.read_string(domain)) ||
+        (!reader.read(expires)) ||
+        (!reader.read(num_records)))
+    {
+      break;
+    }
+
+    Entry entry;
+    entry.domain = domain;
+    entry.dnstype = dnstype;
+    entry.expires = expires;
+
+    for (uint16_t jj = 0; (jj < num_records) && (reader.ok()); ++jj)
+    {
+      DnsRRecord* record = read_record(reader, domain, now);
+
+      if (record != NULL)
+      {
+        entry.records.push_back(record);
+      }
+    }
+
+    if (!reader.ok())
+    {
+      for (DnsRRecord* record : entry.records)
+      {
+        delete record;
+      }
+      break;
+    }
+
+    if (expires > now)
+    {
+      entries.push_back(entry);
+    }
+    else
+    {
+      for (DnsRRecord* record : entry.records)
+      {
+        delete record;
+      }
+    }
+  }
+
+  if (!reader.ok())
+  {
+    TRC_WARNING("DNS cache file %s is truncated or corrupt - read %d of %d entries",
+                filename.c_str(),
+                entries.size(),
+                header.count);
+  }
+
+  return true;
+}
+
+/// Reads a record, returning it with its remaining TTL, or NULL if it has
+/// expired or couldn't be read.
+DnsRRecord* DnsCacheFile::read_record(Reader& reader,
+                                      const std::string& domain,
+                                      int now)
+{
+  uint8_t kind;
+  uint16_t rrtype;
+  uint16_t rrclass;
+  int64_t expires;
+  std::string rrname;
+
+  if ((!reader.read(kind)) ||
+      (!reader.read(rrtype)) ||
+      (!reader.read(rrclass)) ||
+      (!reader.read(expires)) ||
+      (!reader.read_string(rrname)))
+  {
+    return NULL;
+  }
+
+  if (rrname.empty())
+  {
+    rrname = domain;
+  }
+
+  int ttl = expires - now;
+  DnsRRecord* record = NULL;
+
+  switch (kind)
+  {
+  case RECORD_A:
+    {
+      struct in_addr address;
+      if (reader.read(address))
+      {
+        record = new DnsARecord(rrname, ttl, address);
+      }
+    }
+    break;
+
+  case RECORD_AAAA:
+    {
+      struct in6_addr address;
+      if (reader.read(address))
+      {
+        record = new DnsAAAARecord(rrname, ttl, address);
+      }
+    }
+    break;
+
+  case RECORD_SRV:
+    {
+      uint16_t priority;
+      uint16_t weight;
+      uint16_t port;
+      std::string target;
+      if ((reader.read(priority)) &&
+          (reader.read(weight)) &&
+          (reader.read(port)) &&
+          (reader.read_string(target)))
+      {
+        record = new DnsSrvRecord(rrname, ttl, priority, weight, port, target);
+      }
+    }
+    break;
+
+  case RECORD_NAPTR:
+    {
+      uint16_t order;
+      uint16_t preference;
+      std::string flags;
+      std::string service;
+      std::string regexp;
+      std::string replacement;
+      if ((reader.read(order)) &&
+          (reader.read(preference)) &&
+          (reader.read_string(flags)) &&
+          (reader.read_string(service)) &&
+          (reader.read_string(regexp)) &&
+          (reader.read_string(replacement)))
+      {
+        record = new DnsNaptrRecord(rrname,
+                                    ttl,
+                                    order,
+                                    preference,
+                                    flags,
+                                    service,
+                                    regexp,
+                                    replacement);
+      }
+    }
+    break;
+
+  case RECORD_CNAME:
+    {
+      std::string target;
+      if (reader.read_string(target))
+      {
+        record = new DnsCNAMERecord(rrname, ttl, target);
+      }
+    }
+    break;
+
+  case RECORD_OTHER:
+    record = new DnsRRecord(rrname, rrtype, rrclass, ttl);
+    break;
+
+  default:
+    // Unknown kind, so the rest of the file can't be read.
+    TRC_DEBUG("Unknown record kind %d in DNS cache file", kind);
+    reader.fail();
+    break;
+  }
+
+  if ((record != NULL) && (ttl <= 0))
+  {
+    delete record;
+    record = NULL;
+  }
+
+  return record;
+}
@@ -13,7 +13,11 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <poll.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
+#include <algorithm>
 #include <sstream>
 #include <iomanip>
 #include <fstream>
@@ -22,9 +26,15 @@
 #include "dnsparser.h"
 #include "dnscachedresolver.h"
 #include "static_dns_cache.h"
+#include "dns_cache_file.h"
+#include "profiling_span.h"
 #include "sas.h"
 #include "sasevent.h"
 #include "cpp_common_pd_definitions.h"
+#include "memory_accounting.h"
+
+const int DnsCachedResolver::SERVER_BACKOFF_MIN;
+const int DnsCachedResolver::SERVER_BACKOFF_MAX;
 
 DnsResult::DnsResult(const std::string& domain,
                      int dnstype,
@@ -32,47 +42,43 @@ DnsResult::DnsResult(const std::string& domain,
                      int ttl) :
   _domain(domain),
   _dnstype(dnstype),
+  _record_set(),
   _records(),
   _ttl(ttl)
 {
-  // Clone the records to the result.
-  for (std::vector<DnsRRecord*>::const_iterator i = records.begin();
-       i != records.end();
-       ++i)
-  {
-    _records.push_back((*i)->clone());
-  }
+  // Copy the records into a record set belonging to the result.
+  _record_set = DnsRecordSet::copy(records);
+  _records = _record_set->records();
+}
+
+DnsResult::DnsResult(const std::string& domain,
+                     int dnstype,
+                     const DnsRecordSetPtr& records,
+                     int ttl) :
+  _domain(domain),
+  _dnstype(dnstype),
+  _record_set(records),
+  _records(records->records()),
+  _ttl(ttl)
+{
 }
 
 DnsResult::DnsResult(const DnsResult &res) :
   _domain(res._domain),
   _dnstype(res._dnstype),
-  _records(),
+  _record_set(res._record_set),
+  _records(res._records),
   _ttl(res._ttl)
 {
-  // Clone the records to the result.
-  for (std::vector<DnsRRecord*>::const_iterator i = res._records.begin();
-       i != res._records.end();
-       ++i)
-  {
-    _records.push_back((*i)->clone());
-  }
 }
 
 DnsResult::DnsResult(DnsResult &&res) :
-  _domain(res._domain),
+  _domain(std::move(res._domain)),
   _dnstype(res._dnstype),
-  _records(),
+  _record_set(std::move(res._record_set)),
+  _records(std::move(res._records)),
   _ttl(res._ttl)
 {
-  // Copy the records, then remove them from the source.
-  for (std::vector<DnsRRecord*>::const_iterator i = res._records.begin();
-       i != res._records.end();
-       ++i)
-  {
-    _records.push_back(*i);
-  }
-
   res._records.clear();
 }
 
@@ -81,6 +87,7 @@ DnsResult::DnsResult(const std::string& domain,
                      int ttl) :
   _domain(domain),
   _dnstype(dnstype),
+  _record_set(),
   _records(),
   _ttl(ttl)
 {
@@ -88,17 +95,72 @@ DnsResult::DnsResult(const std::string& domain,
 
 DnsResult::~DnsResult()
 {
-  while (!_records.empty())
-  {
-    delete _records.back();
-    _records.pop_back();
-  }
 }
 
 void DnsCachedResolver::init(const std::vector<IP46Address>& dns_servers)
 {
   _dns_servers = dns_servers;
-  _cache_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+  _refresh_percent = 0;
+  _refresh_terminated = false;
+  _prefetches = 0;
+  _prefetch_hits = 0;
+  _stale_serves = 0;
+  pthread_mutex_init(&_refresh_lock, NULL);
+  pthread_cond_init(&_refresh_cond, NULL);
+
+  _io_thread_running = false;
+  _io_terminated = false;
+  _io_epoll_fd = -1;
+  _io_event_fd = -1;
+  pthread_mutex_init(&_io_lock, NULL);
+
+  _failure_backoff_min = DEFAULT_FAILURE_BACKOFF_MIN;
+  _failure_backoff_max = DEFAULT_FAILURE_BACKOFF_MAX;
+  DnsServerHealth healthy = {0, 0};
+  _server_health.assign(_dns_servers.size(), healthy);
+  pthread_mutex_init(&_server_lock, NULL);
+  _server_generation = 0;
+  _query_failures_table = NULL;
+  _server_failures_table = NULL;
+
+  _learned_tcp_domains = 0;
+  pthread_mutex_init(&_tcp_domains_lock, NULL);
+  _truncated_responses = 0;
+  _tcp_queries = 0;
+  _truncated_table = NULL;
+  _tcp_queries_table = NULL;
+
+  _static_hits = 0;
+  _cache_hits = 0;
+  _cache_misses = 0;
+  _pending_waits = 0;
+  _cache_entries = 0;
+  _cache_bytes = 0;
+  _hits_table = NULL;
+  _misses_table = NULL;
+  _pending_waits_table = NULL;
+  _entries_scalar = NULL;
+  _bytes_scalar = NULL;
+
+  for (size_t ii = 0; ii < _dns_servers.size(); ++ii)
+  {
+    DnsServerStats* stats = new DnsServerStats();
+    stats->responses = 0;
+    stats->timeouts = 0;
+    _server_stats.push_back(stats);
+  }
+
+  _persisting = false;
+  _persist_interval = 0;
+  _persist_terminated = false;
+  pthread_mutex_init(&_persist_lock, NULL);
+
+  for (int ii = 0; ii < NUM_CACHE_SHARDS; ++ii)
+  {
+    pthread_rwlock_init(&_shards[ii].lock, NULL);
+  }
+
   TRC_DEBUG("Timeout = %d", _timeout);
 
   // Initialize the ares library.  This might have already been done by curl
@@ -113,6 +175,7 @@ void DnsCachedResolver::init(const std::vector<IP46Address>& dns_servers)
   pthread_condattr_init(&cond_attr);
   pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
   pthread_cond_init(&_got_reply_cond, &cond_attr);
+  pthread_cond_init(&_persist_cond, &cond_attr);
   pthread_condattr_destroy(&cond_attr);
 }
 
@@ -156,11 +219,15 @@ void DnsCachedResolver::init_from_server_ips(const std::vector<std::string>& dns
 DnsCachedResolver::DnsCachedResolver(const std::vector<IP46Address>& dns_servers,
                                      int timeout,
                                      const std::string& filename,
-                                     int port) :
+                                     int port,
+                                     const Options& options) :
   _port(port),
   _timeout(timeout),
+  _cache_lock("dns_cache", true),
   _cache(),
-  _static_cache(filename)
+  _static_cache(filename),
+  _edns_payload_size(options.edns_payload_size),
+  _tcp_domains(options.tcp_domains.begin(), options.tcp_domains.end())
 {
   init(dns_servers);
 }
@@ -168,11 +235,15 @@ DnsCachedResolver::DnsCachedResolver(const std::vector<IP46Address>& dns_servers
 DnsCachedResolver::DnsCachedResolver(const std::vector<std::string>& dns_servers,
                                      int timeout,
                                      const std::string& filename,
-                                     int port) :
+                                     int port,
+                                     const Options& options) :
   _port(port),
   _timeout(timeout),
+  _cache_lock("dns_cache", true),
   _cache(),
-  _static_cache(filename)
+  _static_cache(filename),
+  _edns_payload_size(options.edns_payload_size),
+  _tcp_domains(options.tcp_domains.begin(), options.tcp_domains.end())
 {
   init_from_server_ips(dns_servers);
 }
@@ -180,17 +251,43 @@ DnsCachedResolver::DnsCachedResolver(const std::vector<std::string>& dns_servers
 DnsCachedResolver::DnsCachedResolver(const std::string& dns_server,
                                      int timeout,
                                      const std::string& filename,
-                                     int port) :
+                                     int port,
+                                     const Options& options) :
   _port(port),
   _timeout(timeout),
+  _cache_lock("dns_cache", true),
   _cache(),
-  _static_cache(filename)
+  _static_cache(filename),
+  _edns_payload_size(options.edns_payload_size),
+  _tcp_domains(options.tcp_domains.begin(), options.tcp_domains.end())
 {
   init_from_server_ips({dns_server});
 }
 
 DnsCachedResolver::~DnsCachedResolver()
 {
+  if (_persisting)
+  {
+    // Stop saving the cache periodically, and save it one last time.
+    stop_cache_persistence();
+    save_cache(_persist_file);
+  }
+
+  if (_refresh_percent != 0)
+  {
+    // Stop the refresh thread (which destroys its DNS channel as it exits).
+    pthread_mutex_lock(&_refresh_lock);
+    _refresh_terminated = true;
+    pthread_cond_signal(&_refresh_cond);
+    pthread_mutex_unlock(&_refresh_lock);
+    pthread_join(_refresh_thread, NULL);
+  }
+
+  if (_io_thread_running)
+  {
+    stop_io_thread();
+  }
+
   DnsChannel* channel = (DnsChannel*)pthread_getspecific(_thread_local);
   if (channel != NULL)
   {
@@ -201,13 +298,286 @@ DnsCachedResolver::~DnsCachedResolver()
 
   // Clear the cache.
   clear();
+
+  for (int ii = 0; ii < NUM_CACHE_SHARDS; ++ii)
+  {
+    pthread_rwlock_destroy(&_shards[ii].lock);
+  }
+
+  pthread_cond_destroy(&_refresh_cond);
+  pthread_mutex_destroy(&_refresh_lock);
+  pthread_mutex_destroy(&_io_lock);
+  pthread_mutex_destroy(&_server_lock);
+  pthread_mutex_destroy(&_tcp_domains_lock);
+  pthread_cond_destroy(&_persist_cond);
+  pthread_mutex_destroy(&_persist_lock);
+
+  for (std::vector<DnsServerStats*>::iterator i = _server_stats.begin();
+       i != _server_stats.end();
+       ++i)
+  {
+    delete *i;
+  }
+}
+
+void DnsCachedResolver::start_refresh_ahead(int percent)
+{
+  TRC_STATUS("Refreshing DNS cache entries with less than %d%% of their TTL remaining",
+             percent);
+  _refresh_percent = percent;
+
+  int rc = pthread_create(&_refresh_thread, NULL, refresh_thread_fn, this);
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to create DNS refresh thread: %d", rc);
+    _refresh_percent = 0;
+    // LCOV_EXCL_STOP
+  }
+}
+
+void DnsCachedResolver::set_failure_backoff(int min_s, int max_s)
+{
+  _failure_backoff_min = min_s;
+  _failure_backoff_max = std::max(min_s, max_s);
+}
+
+void DnsCachedResolver::set_failure_statistics(SNMP::CounterTable* query_failures_table,
+                                               SNMP::CounterTable* server_failures_table)
+{
+  _query_failures_table = query_failures_table;
+  _server_failures_table = server_failures_table;
+}
+
+void DnsCachedResolver::set_transport_statistics(SNMP::CounterTable* truncated_table,
+                                                 SNMP::CounterTable* tcp_queries_table)
+{
+  _truncated_table = truncated_table;
+  _tcp_queries_table = tcp_queries_table;
+}
+
+DnsCachedResolver::Stats DnsCachedResolver::stats() const
+{
+  Stats stats;
+  stats.static_hits = _static_hits.load();
+  stats.hits = _cache_hits.load();
+  stats.misses = _cache_misses.load();
+  stats.pending_waits = _pending_waits.load();
+  stats.truncated_responses = _truncated_responses.load();
+  stats.tcp_queries = _tcp_queries.load();
+  stats.cache_entries = _cache_entries.load();
+  stats.cache_bytes = _cache_bytes.load();
+  _reply_waits.snapshot(stats.reply_waits);
+  _pending_query_waits.snapshot(stats.pending_query_waits);
+  _expiry_batch_sizes.snapshot(stats.expiry_batch_sizes);
+
+  stats.servers.resize(_dns_servers.size());
+  for (size_t ii = 0; ii < _dns_servers.size(); ++ii)
+  {
+    IP46Address server = _dns_servers[ii];
+    stats.servers[ii].server = server.to_string();
+    stats.servers[ii].responses = _server_stats[ii]->responses.load();
+    stats.servers[ii].timeouts = _server_stats[ii]->timeouts.load();
+    _server_stats[ii]->rtts.snapshot(stats.servers[ii].rtts);
+  }
+
+  return stats;
+}
+
+void DnsCachedResolver::set_cache_statistics(SNMP::CounterTable* hits_table,
+                                             SNMP::CounterTable* misses_table,
+                                             SNMP::CounterTable* pending_waits_table,
+                                             SNMP::U32Scalar* entries_scalar,
+                                             SNMP::U32Scalar* bytes_scalar)
+{
+  _hits_table = hits_table;
+  _misses_table = misses_table;
+  _pending_waits_table = pending_waits_table;
+
+  _cache_lock.lock();
+  _entries_scalar = entries_scalar;
+  _bytes_scalar = bytes_scalar;
+  update_cache_size(0, 0);
+  _cache_lock.unlock();
+}
+
+void DnsCachedResolver::set_latency_histogram_table(SNMP::LatencyHistogramTable* table)
+{
+  table->add_histogram("reply_wait", &_reply_waits);
+  table->add_histogram("pending_query_wait", &_pending_query_waits);
+  table->add_histogram("expiry_batch_size", &_expiry_batch_sizes);
+
+  for (size_t ii = 0; ii < _dns_servers.size(); ++ii)
+  {
+    table->add_histogram("server_rtt:" + _dns_servers[ii].to_string(),
+                         &_server_stats[ii]->rtts);
+  }
+}
+
+void DnsCachedResolver::increment_stat(std::atomic<uint64_t>& stat,
+                                       SNMP::CounterTable* table)
+{
+  ++stat;
+
+  if (table != NULL)
+  {
+    table->increment();
+  }
+}
+
+DnsCachedResolver::RefreshStats DnsCachedResolver::refresh_stats() const
+{
+  RefreshStats stats;
+  stats.prefetches = _prefetches.load();
+  stats.prefetch_hits = _prefetch_hits.load();
+  stats.stale_serves = _stale_serves.load();
+  return stats;
+}
+
+bool DnsCachedResolver::save_cache(const std::string& filename)
+{
+  DnsCacheFile::Writer writer;
+  int now = time(NULL);
+
+  // Copy the entries while the cache is locked, and write the file once it
+  // isn't.
+  _cache_lock.lock();
+
+  for (DnsCache::const_iterator i = _cache.begin();
+       i != _cache.end();
+       ++i)
+  {
+    const DnsCacheEntryPtr& ce = i->second;
+
+    // Entries that are backing off after the DNS servers failed aren't
+    // saved, as any records they have are being kept past their TTL.
+    if ((ce->expires > now) && (ce->failures == 0))
+    {
+      writer.add_entry(ce->domain, ce->dnstype, ce->expires, ce->records);
+    }
+  }
+
+  _cache_lock.unlock();
+
+  if (!writer.write(filename))
+  {
+    return false;
+  }
+
+  TRC_DEBUG("Saved %d DNS cache entries to %s", writer.count(), filename.c_str());
+  return true;
+}
+
+int DnsCachedResolver::load_cache(const std::string& filename)
+{
+  std::vector<DnsCacheFile::Entry> entries;
+
+  if (!DnsCacheFile::read(filename, time(NULL), entries))
+  {
+    return 0;
+  }
+
+  int loaded = 0;
+  _cache_lock.lock();
+
+  for (std::vector<DnsCacheFile::Entry>::iterator i = entries.begin();
+       i != entries.end();
+       ++i)
+  {
+    if (get_cache_entry(i->domain, i->dnstype) != NULL)
+    {
+      // The entry has been cached since the file was written, so its records
+      // are newer.
+      for (DnsRRecord* record : i->records)
+      {
+        delete record;
+      }
+      continue;
+    }
+
+    DnsCacheEntryPtr ce = create_cache_entry(i->domain, i->dnstype, 0);
+
+    for (DnsRRecord* record : i->records)
+    {
+      add_record_to_cache(ce, record, 0);
+    }
+
+    ce->expires = i->expires;
+    ce->restored = true;
+    add_to_expiry_list(ce);
+    publish_cache_entry(ce);
+    ++loaded;
+  }
+
+  _cache_lock.unlock();
+
+  TRC_STATUS("Loaded %d DNS cache entries from %s", loaded, filename.c_str());
+  return loaded;
+}
+
+void DnsCachedResolver::start_cache_persistence(const std::string& filename,
+                                                int interval_s)
+{
+  TRC_STATUS("Saving the DNS cache to %s every %ds", filename.c_str(), interval_s);
+  load_cache(filename);
+
+  _persist_file = filename;
+  _persist_interval = interval_s;
+  _persisting = true;
+
+  int rc = pthread_create(&_persist_thread, NULL, persist_thread_fn, this);
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to create DNS cache persistence thread: %d", rc);
+    _persisting = false;
+    // LCOV_EXCL_STOP
+  }
+}
+
+void DnsCachedResolver::stop_cache_persistence()
+{
+  pthread_mutex_lock(&_persist_lock);
+  _persist_terminated = true;
+  pthread_cond_signal(&_persist_cond);
+  pthread_mutex_unlock(&_persist_lock);
+  pthread_join(_persist_thread, NULL);
+}
+
+void* DnsCachedResolver::persist_thread_fn(void* resolver)
+{
+  ((DnsCachedResolver*)resolver)->persist_thread_fn();
+  return NULL;
+}
+
+void DnsCachedResolver::persist_thread_fn()
+{
+  struct timespec next_save;
+  clock_gettime(CLOCK_MONOTONIC, &next_save);
+  next_save.tv_sec += _persist_interval;
+
+  pthread_mutex_lock(&_persist_lock);
+
+  while (!_persist_terminated)
+  {
+    if (pthread_cond_timedwait(&_persist_cond, &_persist_lock, &next_save) != ETIMEDOUT)
+    {
+      continue;
+    }
+
+    pthread_mutex_unlock(&_persist_lock);
+    save_cache(_persist_file);
+    pthread_mutex_lock(&_persist_lock);
+
+    next_save.tv_sec += _persist_interval;
+  }
+
+  pthread_mutex_unlock(&_persist_lock);
 }
 
 void DnsCachedResolver::reload_static_records()
 {
-  pthread_mutex_lock(&_cache_lock);
   _static_cache.reload_static_records();
-  pthread_mutex_unlock(&_cache_lock);
 }
 
 DnsResult DnsCachedResolver::dns_query(const std::string& domain,
@@ -230,89 +600,357 @@ void DnsCachedResolver::dns_query(const std::vector<std::string>& domains,
                                   std::vector<DnsResult>& results,
                                   SAS::TrailId trail)
 {
-  // This will contain all of the domains we need to query the cache or perform
-  // a DNS lookup for.
-  std::vector<std::string> domains_to_query;
+  ordered_dns_query(make_queries(domains, dnstype), results, trail);
+}
+
+void DnsCachedResolver::dns_query(const std::vector<DnsQuery>& queries,
+                                  std::map<DnsQuery, DnsResult>& results,
+                                  SAS::TrailId trail)
+{
+  std::vector<DnsResult> ordered_results;
+  ordered_dns_query(queries, ordered_results, trail);
+
+  for (size_t ii = 0; ii < queries.size(); ++ii)
+  {
+    results.insert(std::make_pair(queries[ii], std::move(ordered_results[ii])));
+  }
+}
+
+std::vector<DnsCachedResolver::DnsQuery> DnsCachedResolver::make_queries(const std::vector<std::string>& domains,
+                                                                         int dnstype)
+{
+  std::vector<DnsQuery> queries;
+  queries.reserve(domains.size());
+
+  for (const std::string& domain : domains)
+  {
+    queries.push_back(DnsQuery(domain, dnstype));
+  }
+
+  return queries;
+}
+
+void DnsCachedResolver::ordered_dns_query(const std::vector<DnsQuery>& queries,
+                                          std::vector<DnsResult>& results,
+                                          SAS::TrailId trail)
+{
+  PROFILE_SPAN("dns.query");
+
+  if (_io_thread_running)
+  {
+    // The queries are done by the I/O thread, so wait for it to call back.
+    struct
+    {
+      pthread_mutex_t lock;
+      pthread_cond_t cond;
+      bool done;
+      std::vector<DnsResult> results;
+    } wait;
+    pthread_mutex_init(&wait.lock, NULL);
+    pthread_cond_init(&wait.cond, NULL);
+    wait.done = false;
+
+    dns_query_async(queries,
+                    [&wait](std::vector<DnsResult>&& async_results)
+                    {
+                      pthread_mutex_lock(&wait.lock);
+                      wait.results = std::move(async_results);
+                      wait.done = true;
+                      pthread_cond_signal(&wait.cond);
+                      pthread_mutex_unlock(&wait.lock);
+                    },
+                    trail);
+
+    pthread_mutex_lock(&wait.lock);
+    CW_IO_STARTS("DNS query")
+    {
+      while (!wait.done)
+      {
+        pthread_cond_wait(&wait.cond, &wait.lock);
+      }
+    }
+    CW_IO_COMPLETES()
+    pthread_mutex_unlock(&wait.lock);
+
+    pthread_cond_destroy(&wait.cond);
+    pthread_mutex_destroy(&wait.lock);
+
+    for (std::vector<DnsResult>::iterator i = wait.results.begin();
+         i != wait.results.end();
+         ++i)
+    {
+      results.push_back(std::move(*i));
+    }
+
+    return;
+  }
 
   // Maps domain passed in -> canonical domain
   std::map<std::string, std::string> canonical_map;
 
-  // Maps canonical domain -> result of DNS query
-  std::map<std::string, DnsResult> result_map;
+  // Maps canonical domain and type -> result of DNS query
+  std::map<DnsQuery, DnsResult> result_map;
+
+  // The queries that need a DNS lookup.
+  std::vector<DnsQuery> cache_misses;
+
+  get_cached_results(queries, canonical_map, result_map, cache_misses, trail);
+
+  // Now perform any DNS lookups we still need to do.
+  if (!cache_misses.empty())
+  {
+    _cache_lock.lock();
+    inner_dns_query(cache_misses, result_map, trail);
+    _cache_lock.unlock();
+  }
+
+  order_results(queries, canonical_map, result_map, results);
+}
 
-  pthread_mutex_lock(&_cache_lock);
+void DnsCachedResolver::get_cached_results(const std::vector<DnsQuery>& queries,
+                                           std::map<std::string, std::string>& canonical_map,
+                                           std::map<DnsQuery, DnsResult>& result_map,
+                                           std::vector<DnsQuery>& cache_misses,
+                                           SAS::TrailId trail)
+{
+  // This will contain all of the queries we need to check the cache or
+  // perform a DNS lookup for.
+  std::vector<DnsQuery> queries_to_check;
 
-  // First, check the _static_records map to see if there are any static records
+  // First, check the static cache to see if there are any static records
   // to use in preference to an actual DNS lookup (these are specified in the
   // _dns_config_file)
-  for (const std::string& domain : domains)
+  for (const DnsQuery& query : queries)
   {
-    TRC_DEBUG("Searching for DNS record matching %s in the static cache", domain.c_str());
+    const std::string& domain = query.first;
+    int dnstype = query.second;
+    TRC_DEBUG("Searching for DNS record matching %s type %d in the static cache",
+              domain.c_str(),
+              dnstype);
 
     // There may be some CNAME records in the static DNS cache that we should
     // be using.
     std::string canonical_domain = _static_cache.get_canonical_name(domain);
     canonical_map.insert(std::pair<std::string,std::string>(domain, canonical_domain));
 
+    DnsQuery canonical_query(canonical_domain, dnstype);
     DnsResult static_result = _static_cache.get_static_dns_records(canonical_domain, dnstype);
     if (!static_result.records().empty())
     {
       // There were some DNS records in the static cache - we use these in
       // preference to a DNS lookup.
       TRC_DEBUG("%s found in the static cache", canonical_domain.c_str());
-      result_map.insert(std::pair<std::string, DnsResult>(canonical_domain, static_result));
+      result_map.insert(std::pair<DnsQuery, DnsResult>(canonical_query, static_result));
+      increment_stat(_static_hits, _hits_table);
     }
     else
     {
       // The static cache didn't have any records that matched, so we'll need
       // to do a DNS lookup.
       TRC_DEBUG("%s not found in the static cache", canonical_domain.c_str());
-      domains_to_query.push_back(canonical_domain);
+      queries_to_check.push_back(canonical_query);
     }
   }
 
-  // Now perform any DNS lookups we still need to do.
-  inner_dns_query(domains_to_query, dnstype, result_map, trail);
+  // Next use any results in the cache that haven't expired.  This doesn't
+  // need the cache lock.
+  for (const DnsQuery& query : queries_to_check)
+  {
+    if (result_map.count(query) != 0)
+    {
+      continue;
+    }
 
-  // The vector of results must match the order of domains passed in.
-  for (const std::string& domain : domains)
+    if (get_published_result(query.first, query.second, false, result_map, trail))
+    {
+      increment_stat(_cache_hits, _hits_table);
+    }
+    else
+    {
+      increment_stat(_cache_misses, _misses_table);
+      cache_misses.push_back(query);
+    }
+  }
+}
+
+void DnsCachedResolver::order_results(const std::vector<DnsQuery>& queries,
+                                      const std::map<std::string, std::string>& canonical_map,
+                                      const std::map<DnsQuery, DnsResult>& result_map,
+                                      std::vector<DnsResult>& results)
+{
+  // The vector of results must match the order of queries passed in.
+  for (const DnsQuery& query : queries)
   {
     // The results map is indexed by canonical domain rather than the domain
     // from the initial query.
-    std::string canonical_domain = canonical_map.at(domain);
-    if (result_map.count(canonical_domain) > 0)
+    DnsQuery canonical_query(canonical_map.at(query.first), query.second);
+    if (result_map.count(canonical_query) > 0)
     {
-      TRC_DEBUG("Found result for query %s (canonical domain: %s)",
-                domain.c_str(),
-                canonical_domain.c_str());
-      results.push_back(result_map.at(canonical_domain));
+      TRC_DEBUG("Found result for query %s type %d (canonical domain: %s)",
+                query.first.c_str(),
+                query.second,
+                canonical_query.first.c_str());
+      results.push_back(result_map.at(canonical_query));
     }
   }
-
-  pthread_mutex_unlock(&_cache_lock);
 }
 
-void DnsCachedResolver::inner_dns_query(const std::vector<std::string>& domains,
+void DnsCachedResolver::dns_query_async(const std::vector<std::string>& domains,
                                         int dnstype,
-                                        std::map<std::string, DnsResult>& results,
+                                        DnsCallback callback,
+                                        SAS::TrailId trail)
+{
+  dns_query_async(make_queries(domains, dnstype), callback, trail);
+}
+
+void DnsCachedResolver::dns_query_async(const std::vector<DnsQuery>& queries,
+                                        DnsCallback callback,
+                                        SAS::TrailId trail)
+{
+  if (!_io_thread_running)
+  {
+    // There's no I/O thread, so do the queries on this thread.
+    std::vector<DnsResult> results;
+    ordered_dns_query(queries, results, trail);
+    callback(std::move(results));
+    return;
+  }
+
+  AsyncQuery* query = new AsyncQuery();
+  query->queries = queries;
+  query->trail = trail;
+  query->outstanding = 0;
+  query->callback = callback;
+
+  get_cached_results(queries,
+                     query->canonical_map,
+                     query->results,
+                     query->misses,
+                     trail);
+
+  if (!query->misses.empty())
+  {
+    _cache_lock.lock();
+
+    // Expire any cache entries that have passed their TTL.
+    expire_cache();
+
+    DnsChannel* no_channel = NULL;
+    time_t now = time(NULL);
+
+    for (std::vector<DnsQuery>::const_iterator miss = query->misses.begin();
+         miss != query->misses.end();
+         ++miss)
+    {
+      // Work out whether to query the domain, and whether to wait for the
+      // result, as for the synchronous interface, but only wait for the
+      // domains that need it.
+      const std::string& domain = miss->first;
+      int dnstype = miss->second;
+      DnsCacheEntryPtr ce = get_cache_entry(domain, dnstype);
+      bool wait = false;
+
+      if (ce == NULL)
+      {
+        TRC_DEBUG("No entry found in cache for %s - create one pending query",
+                  domain.c_str());
+        ce = create_cache_entry(domain, dnstype, trail);
+        wait = issue_query(ce, domain, dnstype, trail, no_channel);
+      }
+      else if (ce->expires <= now)
+      {
+        if (ce->pending_query)
+        {
+          TRC_DEBUG("Expired entry found in cache for %s - query already in progress",
+                    domain.c_str());
+          wait = ce->records.empty();
+
+          if (wait)
+          {
+            increment_stat(_pending_waits, _pending_waits_table);
+          }
+        }
+        else if ((_refresh_percent != 0) && (!ce->records.empty()))
+        {
+          TRC_DEBUG("Expired entry found in cache for %s - refreshing it in the background",
+                    domain.c_str());
+          request_refresh(domain, dnstype);
+        }
+        else
+        {
+          TRC_DEBUG("Expired entry found in cache for %s - query it", domain.c_str());
+          wait = issue_query(ce, domain, dnstype, trail, no_channel);
+        }
+      }
+
+      if (wait)
+      {
+        _async_waiters.insert(std::make_pair(published_key(domain, dnstype), query));
+        ++query->outstanding;
+      }
+    }
+
+    bool complete = (query->outstanding == 0);
+    _cache_lock.unlock();
+
+    if (!complete)
+    {
+      // The query completes when the last response arrives.
+      return;
+    }
+  }
+
+  complete_async_query(query);
+}
+
+void DnsCachedResolver::complete_async_query(AsyncQuery* query)
+{
+  for (std::vector<DnsQuery>::const_iterator miss = query->misses.begin();
+       miss != query->misses.end();
+       ++miss)
+  {
+    // Use whatever is in the cache, even if it's expired.
+    if ((query->results.count(*miss) == 0) &&
+        (!get_published_result(miss->first, miss->second, true, query->results, query->trail)))
+    {
+      TRC_DEBUG("Return empty result set for %s", miss->first.c_str());
+      query->results.insert(std::pair<DnsQuery, DnsResult>(*miss,
+                                                           DnsResult(miss->first,
+                                                                     miss->second,
+                                                                     0)));
+    }
+  }
+
+  std::vector<DnsResult> results;
+  order_results(query->queries, query->canonical_map, query->results, results);
+  query->callback(std::move(results));
+  delete query;
+}
+
+void DnsCachedResolver::inner_dns_query(const std::vector<DnsQuery>& queries,
+                                        std::map<DnsQuery, DnsResult>& results,
                                         SAS::TrailId trail)
 {
   DnsChannel* channel = NULL;
 
   // We don't lock on cache_lock here because the wrapper function dns_query()
-  // already has the lock
+  // already has the lock.  It has already used the results of any of the
+  // domains that have valid entries in the cache.
 
   // Expire any cache entries that have passed their TTL.
   expire_cache();
 
   bool wait_for_query_result = false;
-  // First see if any of the domains need to be queried.
-  for (std::vector<std::string>::const_iterator domain = domains.begin();
-       domain != domains.end();
-       ++domain)
+  // First see if any of the domains need to be queried.  All the queries
+  // (whatever their types) are issued before waiting for any of them.
+  for (std::vector<DnsQuery>::const_iterator query = queries.begin();
+       query != queries.end();
+       ++query)
   {
-    TRC_VERBOSE("Check cache for %s type %d", domain->c_str(), dnstype);
-    DnsCacheEntryPtr ce = get_cache_entry(*domain, dnstype);
+    const std::string& domain = query->first;
+    int dnstype = query->second;
+    TRC_VERBOSE("Check cache for %s type %d", domain.c_str(), dnstype);
+    DnsCacheEntryPtr ce = get_cache_entry(domain, dnstype);
     time_t now = time(NULL);
     bool do_query = false;
     if (ce == NULL)
@@ -321,7 +959,7 @@ void DnsCachedResolver::inner_dns_query(const std::vector<std::string>& domains,
 
       // Create an empty record for this cache entry.
       TRC_DEBUG("Create cache entry pending query");
-      ce = create_cache_entry(*domain, dnstype, trail);
+      ce = create_cache_entry(domain, dnstype, trail);
       do_query = true;
       wait_for_query_result = true;
     }
@@ -342,6 +980,13 @@ void DnsCachedResolver::inner_dns_query(const std::vector<std::string>& domains,
           wait_for_query_result = true;
         }
       }
+      else if ((_refresh_percent != 0) && (!ce->records.empty()))
+      {
+        // Leave the refresh thread to update the entry, and use the old
+        // records until it does.
+        TRC_DEBUG("Expired entry found in cache - refreshing it in the background");
+        request_refresh(domain, dnstype);
+      }
       else
       {
         TRC_DEBUG("Expired entry found in cache - starting asynchronous query to update it");
@@ -356,23 +1001,7 @@ void DnsCachedResolver::inner_dns_query(const std::vector<std::string>& domains,
 
     if (do_query)
     {
-      if (channel == NULL)
-      {
-        // Get a DNS channel to issue any queries.
-        channel = get_dns_channel();
-      }
-
-      if (channel != NULL)
-      {
-        // DNS server is configured, so create a Transaction for the query
-        // and execute it.  Mark the entry as pending and take the lock on
-        // it before doing this to prevent any other threads sending the
-        // same query.
-        TRC_DEBUG("Create and execute DNS query transaction");
-        ce->pending_query = true;
-        DnsTsx* tsx = new DnsTsx(channel, *domain, dnstype, trail);
-        tsx->execute();
-      }
+      issue_query(ce, domain, dnstype, trail, channel);
     }
   }
 
@@ -382,71 +1011,73 @@ void DnsCachedResolver::inner_dns_query(const std::vector<std::string>& domains,
     // entry in the cache, so wait for the replies before processing the
     // request further.
     TRC_DEBUG("Wait for query responses");
-    pthread_mutex_unlock(&_cache_lock);
+    _cache_lock.unlock();
     CW_IO_STARTS("DNS query")
     {
       wait_for_replies(channel);
     }
     CW_IO_COMPLETES()
-    pthread_mutex_lock(&_cache_lock);
+    _cache_lock.lock();
     TRC_DEBUG("Received all query responses");
   }
 
   // We should now have responses for everything (unless another thread was
   // already doing a query), so loop collecting the responses.
-  for (std::vector<std::string>::const_iterator i = domains.begin();
-       i != domains.end();
+  for (std::vector<DnsQuery>::const_iterator i = queries.begin();
+       i != queries.end();
        ++i)
   {
-    DnsCacheEntryPtr ce = get_cache_entry(*i, dnstype);
+    const std::string& domain = i->first;
+    int dnstype = i->second;
+    DnsCacheEntryPtr ce = get_cache_entry(domain, dnstype);
 
     // If we found the cache entry, check whether it is still pending a query.
-    while ((ce != NULL) && (ce->pending_query) && wait_for_query_result)
+    if ((ce != NULL) && (ce->pending_query) && wait_for_query_result)
     {
-      // We must release the global lock and let the other thread finish
-      // the query.
-      TRC_DEBUG("Waiting for (non-cached) DNS query for %s", i->c_str());
-      CW_IO_STARTS("DNS pending query")
+      increment_stat(_pending_waits, _pending_waits_table);
+      Utils::StopWatch stopwatch;
+      stopwatch.start();
+
+      while ((ce != NULL) && (ce->pending_query))
       {
-        pthread_cond_wait(&_got_reply_cond, &_cache_lock);
+        // We must release the global lock and let the other thread finish
+        // the query.
+        TRC_DEBUG("Waiting for (non-cached) DNS query for %s", domain.c_str());
+        CW_IO_STARTS("DNS pending query")
+        {
+          _cache_lock.cond_wait(&_got_reply_cond);
+        }
+        CW_IO_COMPLETES()
+        ce = get_cache_entry(domain, dnstype);
+        TRC_DEBUG("Reawoken from wait for %s type %d", domain.c_str(), dnstype);
+      }
+
+      unsigned long waited_us;
+      if (stopwatch.read(waited_us))
+      {
+        _pending_query_waits.record(waited_us);
       }
-      CW_IO_COMPLETES()
-      ce = get_cache_entry(*i, dnstype);
-      TRC_DEBUG("Reawoken from wait for %s type %d", i->c_str(), dnstype);
     }
 
     if (ce != NULL)
     {
       // Can now pull the information from the cache entry in to the results.
-      TRC_DEBUG("Pulling %d records from cache for %s %s",
-                ce->records.size(),
-                ce->domain.c_str(),
-                DnsRRecord::rrtype_to_string(ce->dnstype).c_str());
-
-      SAS::Event event(trail, SASEvent::DNS_CACHE_USED, 0);
-      event.add_static_param(ce->records.size());
-      event.add_static_param(ce->original_trail);
-      event.add_var_param(ce->domain);
-      event.add_var_param(ce->original_time);
-      SAS::report_event(event);
-      int expiry = ce->expires - time(NULL);
-      if (expiry < 0)
+      // We might use an expired DNS record to avoid the latency of waiting for
+      // a response.  If the entry has no results yet (because there are no
+      // DNS servers), return an empty result set.
+      if (!get_published_result(domain, dnstype, true, results, trail))
       {
-        // We might have used an expired DNS record to avoid the latency of
-        // waiting for a response - if so, don't report a negative TTL.
-        expiry = 0;
+        TRC_DEBUG("No results in cache entry - return empty result set");
+        results.insert(std::pair<DnsQuery, DnsResult>(*i, DnsResult(ce->domain,
+                                                                    ce->dnstype,
+                                                                    0)));
       }
-
-      results.insert(std::pair<std::string, DnsResult>(*i, DnsResult(ce->domain,
-                                                                     ce->dnstype,
-                                                                     ce->records,
-                                                                     expiry)));
     }
     else
     {
       // This shouldn't happen, but if it does, return an empty result set.
       TRC_DEBUG("Return empty result set");
-      results.insert(std::pair<std::string, DnsResult>(*i, DnsResult(*i, dnstype, 0)));
+      results.insert(std::pair<DnsQuery, DnsResult>(*i, DnsResult(domain, dnstype, 0)));
     }
   }
 }
@@ -458,7 +1089,7 @@ void DnsCachedResolver::add_to_cache(const std::string& domain,
                                      int dnstype,
                                      std::vector<DnsRRecord*>& records)
 {
-  pthread_mutex_lock(&_cache_lock);
+  _cache_lock.lock();
   // We don't have a trail ID available as this is test code - use trail ID 0.
   SAS::TrailId no_trail = 0;
 
@@ -487,17 +1118,18 @@ void DnsCachedResolver::add_to_cache(const std::string& domain,
 
   records.clear();
 
-  // Finally make sure the record is in the expiry list.
+  // Finally make sure the record is in the expiry list, and publish it.
   add_to_expiry_list(ce);
+  publish_cache_entry(ce);
 
-  pthread_mutex_unlock(&_cache_lock);
+  _cache_lock.unlock();
 }
 
 /// Renders the current contents of the cache to a displayable string.
 std::string DnsCachedResolver::display_cache()
 {
   std::ostringstream oss;
-  pthread_mutex_lock(&_cache_lock);
+  _cache_lock.lock();
   expire_cache();
   int now = time(NULL);
   for (DnsCache::const_iterator i = _cache.begin();
@@ -516,13 +1148,22 @@ std::string DnsCachedResolver::display_cache()
       oss << (*j)->to_string() << std::endl;
     }
   }
-  pthread_mutex_unlock(&_cache_lock);
+  _cache_lock.unlock();
   return oss.str();
 }
 
 /// Clears the cache.
 void DnsCachedResolver::clear()
 {
+  _cache_lock.lock();
+
+  for (int ii = 0; ii < NUM_CACHE_SHARDS; ++ii)
+  {
+    pthread_rwlock_wrlock(&_shards[ii].lock);
+    _shards[ii].snapshots.clear();
+    pthread_rwlock_unlock(&_shards[ii].lock);
+  }
+
   TRC_DEBUG("Clearing %d cache entries", _cache.size());
   while (!_cache.empty())
   {
@@ -532,8 +1173,11 @@ void DnsCachedResolver::clear()
               ce->domain.c_str(),
               DnsRRecord::rrtype_to_string(ce->dnstype).c_str());
     clear_cache_entry(ce);
+    update_cache_size(-1, -(int64_t)entry_size(ce));
     _cache.erase(i);
   }
+
+  _cache_lock.unlock();
 }
 
 /// Handles a DNS response from the server.
@@ -544,7 +1188,7 @@ void DnsCachedResolver::dns_response(const std::string& domain,
                                      int alen,
                                      SAS::TrailId trail)
 {
-  pthread_mutex_lock(&_cache_lock);
+  _cache_lock.lock();
 
   TRC_DEBUG("Received DNS response for %s type %s - status is %d (%s)",
              domain.c_str(),
@@ -573,47 +1217,55 @@ void DnsCachedResolver::dns_response(const std::string& domain,
       SAS::report_event(event);
     }
 
-    // Create a message parser and parse the message.
+    // Create a message parser and parse the message into views of its
+    // records.  Only the records that are cached are then created.  The
+    // views are kept for each thread, so this doesn't normally allocate.
+    static thread_local std::vector<DnsRRecordView> views;
     DnsParser parser(abuf, alen);
 
-    if (parser.parse())
+    if (parser.parse_records(views))
     {
       // Parsing was successful, so clear out any old records, then process
       // the answers and additional data.
       clear_cache_entry(ce);
-      TRC_DEBUG("DNS response for %s - response contains %d answers",
+      ce->failures = 0;
+      TRC_DEBUG("DNS response for %s - response contains %d records",
                  domain.c_str(),
-                 parser.answers().size());
+                 views.size());
 
-      while (!parser.answers().empty())
+      for (std::vector<DnsRRecordView>::const_iterator view = views.begin();
+           view != views.end();
+           ++view)
       {
-        DnsRRecord* rr = parser.answers().front();
-        parser.answers().pop_front();
-        if ((rr->rrtype() == ns_t_a) ||
-            (rr->rrtype() == ns_t_aaaa))
+        if (view->section != DnsRRecordView::ANSWER)
+        {
+          continue;
+        }
+
+        if ((view->rrtype == ns_t_a) ||
+            (view->rrtype == ns_t_aaaa))
         {
           // A/AAAA record, so check that RRNAME matches the question
           // (or a CNAME).
-          if ((strcasecmp(rr->rrname().c_str(), domain.c_str()) == 0) ||
-              (strcasecmp(rr->rrname().c_str(), canonical_domain.c_str()) == 0))
+          if ((parser.name_matches(view->rrname, domain)) ||
+              (parser.name_matches(view->rrname, canonical_domain)))
           {
             // RRNAME matches, so add this record to the cache entry.
-            add_record_to_cache(ce, rr, trail);
+            add_view_to_cache(parser, ce, *view, trail);
           }
           else
           {
             TRC_DEBUG("Ignoring A/AAAA record for %s (expecting domain %s)",
-                      rr->rrname().c_str(), domain.c_str());
-            delete rr;
+                      parser.domain_name(view->rrname).c_str(), domain.c_str());
           }
         }
-        else if ((rr->rrtype() == ns_t_srv) ||
-                 (rr->rrtype() == ns_t_naptr))
+        else if ((view->rrtype == ns_t_srv) ||
+                 (view->rrtype == ns_t_naptr))
         {
           // SRV or NAPTR record, so add it to the cache entry.
-          add_record_to_cache(ce, rr, trail);
+          add_view_to_cache(parser, ce, *view, trail);
         }
-        else if (rr->rrtype() == ns_t_cname)
+        else if (view->rrtype == ns_t_cname)
         {
           // Store off the CNAME value, so that if we see subsequent A
           // records for the pointed-to name, we'll recognise them.
@@ -625,7 +1277,7 @@ void DnsCachedResolver::dns_response(const std::string& domain,
           //
           // RFC 1034 mandates this format, so this should be fine.
 
-          canonical_domain = ((DnsCNAMERecord*)rr)->target();
+          canonical_domain = parser.domain_name(view->rdata);
           TRC_DEBUG("CNAME record pointing at %s - treating this as equivalent to %s",
                     canonical_domain.c_str(),
                     domain.c_str());
@@ -633,28 +1285,26 @@ void DnsCachedResolver::dns_response(const std::string& domain,
         else
         {
           TRC_WARNING("Ignoring %s record in DNS answer - only CNAME, A, AAAA, NAPTR and SRV are supported",
-                      DnsRRecord::rrtype_to_string(rr->rrtype()).c_str());
-          delete rr;
+                      DnsRRecord::rrtype_to_string(view->rrtype).c_str());
         }
       }
 
       // Process any additional records returned in the response, creating
       // or updating cache entries.  First we sort the records by cache key.
       std::map<DnsCacheKey, std::list<DnsRRecord*> > sorted;
-      while (!parser.additional().empty())
+      for (std::vector<DnsRRecordView>::const_iterator view = views.begin();
+           view != views.end();
+           ++view)
       {
-        DnsRRecord* rr = parser.additional().front();
-        parser.additional().pop_front();
-        if (caching_enabled(rr->rrtype()))
-        {
-          // Caching is enabled for this record type, so add it to sorted
-          // structure.
-          sorted[std::make_pair(rr->rrtype(), rr->rrname())].push_back(rr);
-        }
-        else
+        // Only create the records that caching is enabled for.
+        if ((view->section == DnsRRecordView::ADDITIONAL) &&
+            (caching_enabled(view->rrtype)))
         {
-          // Caching not enabled for this record, so delete it.
-          delete rr;
+          DnsRRecord* rr = parser.to_record(*view);
+          if (rr != NULL)
+          {
+            sorted[std::make_pair(rr->rrtype(), rr->rrname())].push_back(rr);
+          }
         }
       }
 
@@ -681,8 +1331,10 @@ void DnsCachedResolver::dns_response(const std::string& domain,
           add_record_to_cache(ace, *j, trail);
         }
 
-        // Finally make sure the record is in the expiry list.
+        // Finally make sure the record is in the expiry list, and publish
+        // it.
         add_to_expiry_list(ace);
+        publish_cache_entry(ace);
       }
     }
   }
@@ -711,30 +1363,25 @@ void DnsCachedResolver::dns_response(const std::string& domain,
       }
 
       clear_cache_entry(ce);
+      ce->failures = 0;
 
+      static thread_local std::vector<DnsRRecordView> views;
       DnsParser parser(abuf, alen);
-      if (parser.parse())
+      if (parser.parse_records(views))
       {
-        while (!parser.authorities().empty())
+        for (std::vector<DnsRRecordView>::const_iterator view = views.begin();
+             view != views.end();
+             ++view)
         {
-          DnsRRecord* rr = parser.authorities().front();
-          parser.authorities().pop_front();
-
-          if (rr->rrtype() == ns_t_soa)
+          if ((view->section == DnsRRecordView::AUTHORITY) &&
+              (view->rrtype == ns_t_soa))
           {
             // Clamp the expiry time to be no more than the default TTL from now
-            int max_expires = DEFAULT_NEGATIVE_CACHE_TTL + time(NULL);
-            ce->expires = std::min(rr->expires(), max_expires);
-
-            // We must delete any records we remove from the parser
-            delete rr;
+            int now = time(NULL);
+            int max_expires = DEFAULT_NEGATIVE_CACHE_TTL + now;
+            ce->expires = std::min(view->ttl + now, max_expires);
             break;
           }
-          else
-          {
-            // We must delete any records we remove from the parser
-            delete rr;
-          }
         }
       }
     }
@@ -749,7 +1396,28 @@ void DnsCachedResolver::dns_response(const std::string& domain,
         SAS::report_event(event);
       }
 
-      ce->expires = 30 + time(NULL);
+      if (is_server_failure(status))
+      {
+        // The DNS servers timed out or failed, so back off querying this
+        // entry, for longer each time this happens.  Until then, queries
+        // use the old records (if there are any) without waiting.
+        ++ce->failures;
+        int backoff = failure_backoff(ce->failures);
+        TRC_DEBUG("DNS servers failed %d times for %s - back off for %ds",
+                  ce->failures,
+                  domain.c_str(),
+                  backoff);
+        ce->expires = backoff + time(NULL);
+
+        if (_query_failures_table != NULL)
+        {
+          _query_failures_table->increment();
+        }
+      }
+      else
+      {
+        ce->expires = 30 + time(NULL);
+      }
     }
   }
 
@@ -762,24 +1430,326 @@ void DnsCachedResolver::dns_response(const std::string& domain,
     ce->expires = DEFAULT_NEGATIVE_CACHE_TTL + time(NULL);
   }
 
-  // Add the record to the expiry list.
+  // Add the record to the expiry list, and publish the new results.
+  ce->restored = false;
   add_to_expiry_list(ce);
+  publish_cache_entry(ce);
 
   // Flag that the cache entry is no longer pending a query, and release
   // the lock on the cache entry.
   ce->pending_query = false;
+  ce->prefetching = false;
 
   // Another thread may be waiting for our query to finish, so
   // broadcast a signal to wake it up.
   pthread_cond_broadcast(&_got_reply_cond);
 
-  pthread_mutex_unlock(&_cache_lock);
+  // Asynchronous queries may be waiting for it too.  Complete any that now
+  // have all their results once the lock has been released.
+  std::vector<AsyncQuery*> completed;
+  std::pair<AsyncWaiters::iterator, AsyncWaiters::iterator> waiters =
+    _async_waiters.equal_range(published_key(domain, dnstype));
+
+  for (AsyncWaiters::iterator i = waiters.first; i != waiters.second; ++i)
+  {
+    if (--i->second->outstanding == 0)
+    {
+      completed.push_back(i->second);
+    }
+  }
+
+  _async_waiters.erase(waiters.first, waiters.second);
+
+  _cache_lock.unlock();
+
+  for (std::vector<AsyncQuery*>::iterator i = completed.begin();
+       i != completed.end();
+       ++i)
+  {
+    complete_async_query(*i);
+  }
+}
+
+/// Returns true if the specified RR type should be cached.
+bool DnsCachedResolver::caching_enabled(int rrtype)
+{
+  return (rrtype == ns_t_a) || (rrtype == ns_t_aaaa) || (rrtype == ns_t_srv) || (rrtype == ns_t_naptr);
+}
+
+/// Returns the key of the published snapshot for a domain name and NS type.
+DnsCachedResolver::DnsCacheKey DnsCachedResolver::published_key(const std::string& domain,
+                                                                int dnstype)
+{
+  std::string lower_domain = domain;
+  std::transform(lower_domain.begin(),
+                 lower_domain.end(),
+                 lower_domain.begin(),
+                 ::tolower);
+  return std::make_pair(dnstype, lower_domain);
+}
+
+DnsCachedResolver::DnsCacheShard& DnsCachedResolver::cache_shard(const DnsCacheKey& key)
+{
+  return _shards[DnsCacheKeyHash()(key) % NUM_CACHE_SHARDS];
+}
+
+bool DnsCachedResolver::get_published_result(const std::string& domain,
+                                             int dnstype,
+                                             bool allow_expired,
+                                             std::map<DnsQuery, DnsResult>& results,
+                                             SAS::TrailId trail)
+{
+  DnsCacheKey key = published_key(domain, dnstype);
+  DnsCacheShard& shard = cache_shard(key);
+  DnsCacheSnapshotPtr snapshot;
+
+  pthread_rwlock_rdlock(&shard.lock);
+  std::unordered_map<DnsCacheKey, DnsCacheSnapshotPtr, DnsCacheKeyHash>::const_iterator i =
+    shard.snapshots.find(key);
+
+  if (i != shard.snapshots.end())
+  {
+    snapshot = i->second;
+  }
+  pthread_rwlock_unlock(&shard.lock);
+
+  int now = time(NULL);
+  int expiry = (snapshot != NULL) ? snapshot->expires - now : 0;
+
+  if ((snapshot == NULL) ||
+      ((expiry <= 0) && (!allow_expired)))
+  {
+    return false;
+  }
+
+  if ((snapshot->prefetched) && (!snapshot->used.exchange(true)))
+  {
+    ++_prefetch_hits;
+  }
+
+  if (expiry <= 0)
+  {
+    if (!snapshot->records->records().empty())
+    {
+      ++_stale_serves;
+    }
+  }
+  else if ((_refresh_percent != 0) &&
+           (now >= snapshot->refresh_at) &&
+           (!snapshot->records->records().empty()) &&
+           (!snapshot->refresh_requested.exchange(true)))
+  {
+    // The entry is about to expire, so refresh it in the background.
+    request_refresh(snapshot->domain, snapshot->dnstype);
+  }
+
+  TRC_DEBUG("Pulling %d records from cache for %s %s",
+            snapshot->records->records().size(),
+            snapshot->domain.c_str(),
+            DnsRRecord::rrtype_to_string(snapshot->dnstype).c_str());
+
+  SAS::Event event(trail, SASEvent::DNS_CACHE_USED, 0);
+  event.add_static_param(snapshot->records->records().size());
+  event.add_static_param(snapshot->original_trail);
+  event.add_var_param(snapshot->domain);
+  event.add_var_param(snapshot->original_time);
+  SAS::report_event(event);
+
+  if (expiry < 0)
+  {
+    // We might have used an expired DNS record to avoid the latency of
+    // waiting for a response - if so, don't report a negative TTL.
+    expiry = 0;
+  }
+
+  results.insert(std::pair<DnsQuery, DnsResult>(DnsQuery(domain, dnstype),
+                                                DnsResult(snapshot->domain,
+                                                          snapshot->dnstype,
+                                                          snapshot->records,
+                                                          expiry)));
+  return true;
+}
+
+/// Publishes a snapshot of a cache entry.  The records are copied once here
+/// (into a single block of memory), and then shared by the results of all the
+/// queries that use them.
+void DnsCachedResolver::publish_cache_entry(DnsCacheEntryPtr ce)
+{
+  std::shared_ptr<DnsCacheSnapshot> snapshot = std::make_shared<DnsCacheSnapshot>();
+  snapshot->domain = ce->domain;
+  snapshot->dnstype = ce->dnstype;
+  snapshot->expires = ce->expires;
+  snapshot->original_time = ce->original_time;
+  snapshot->original_trail = ce->original_trail;
+  snapshot->records = DnsRecordSet::copy(ce->records);
+  snapshot->refresh_requested = false;
+  snapshot->prefetched = ce->prefetching;
+  snapshot->used = false;
+
+  // Refresh the entry if it's used when less than _refresh_percent of its
+  // remaining TTL is left.  Records restored from a file are refreshed the
+  // first time they're used.
+  int now = time(NULL);
+  if (ce->restored)
+  {
+    snapshot->refresh_at = now;
+  }
+  else
+  {
+    snapshot->refresh_at = (ce->expires > now) ?
+                             ce->expires - ((ce->expires - now) * _refresh_percent) / 100 :
+                             ce->expires;
+  }
+
+  DnsCacheKey key = published_key(ce->domain, ce->dnstype);
+  DnsCacheShard& shard = cache_shard(key);
+
+  pthread_rwlock_wrlock(&shard.lock);
+  shard.snapshots[key] = snapshot;
+  pthread_rwlock_unlock(&shard.lock);
+}
+
+void DnsCachedResolver::request_refresh(const std::string& domain, int dnstype)
+{
+  DnsCacheKey key = std::make_pair(dnstype, domain);
+
+  pthread_mutex_lock(&_refresh_lock);
+
+  if (_refresh_queued.insert(key).second)
+  {
+    _refresh_queue.push_back(key);
+    pthread_cond_signal(&_refresh_cond);
+  }
+
+  pthread_mutex_unlock(&_refresh_lock);
+}
+
+void DnsCachedResolver::refresh_cache_entry(const std::string& domain, int dnstype)
+{
+  DnsChannel* channel = NULL;
+
+  _cache_lock.lock();
+  DnsCacheEntryPtr ce = get_cache_entry(domain, dnstype);
+
+  if ((ce != NULL) && (!ce->pending_query))
+  {
+    TRC_DEBUG("Refreshing DNS cache entry for %s type %d", domain.c_str(), dnstype);
+
+    if (issue_query(ce, domain, dnstype, 0, channel))
+    {
+      ce->prefetching = true;
+      ++_prefetches;
+    }
+  }
+
+  _cache_lock.unlock();
+
+  if (channel != NULL)
+  {
+    // The query was issued on this thread's channel, so the response is
+    // processed (and the cache updated) while we wait.
+    wait_for_replies(channel);
+  }
+}
+
+/// Issues a query for a cache entry.  If there is no I/O thread, the query
+/// is issued on this thread's channel (which is returned, and must be
+/// waited on).  Returns false if there are no DNS servers.
+bool DnsCachedResolver::issue_query(DnsCacheEntryPtr ce,
+                                    const std::string& domain,
+                                    int dnstype,
+                                    SAS::TrailId trail,
+                                    DnsChannel*& channel)
+{
+  if (_io_thread_running)
+  {
+    if (_io_channels.empty())
+    {
+      return false;
+    }
+
+    // Mark the entry as pending to prevent any other threads sending the
+    // same query, and pass the query to the I/O thread.
+    TRC_DEBUG("Pass DNS query to I/O thread");
+    ce->pending_query = true;
+
+    IoRequest request;
+    request.domain = domain;
+    request.dnstype = dnstype;
+    request.trail = trail;
+
+    pthread_mutex_lock(&_io_lock);
+    _io_requests.push_back(request);
+    pthread_mutex_unlock(&_io_lock);
+
+    uint64_t wake = 1;
+    if (write(_io_event_fd, &wake, sizeof(wake)) < 0)
+    {
+      TRC_WARNING("Failed to wake DNS I/O thread: %d", errno); // LCOV_EXCL_LINE
+    }
+
+    return true;
+  }
+
+  if (channel == NULL)
+  {
+    // Get a DNS channel to issue any queries.
+    channel = get_dns_channel();
+  }
+
+  if (channel == NULL)
+  {
+    return false;
+  }
+
+  // DNS server is configured, so create a Transaction for the query
+  // and execute it.  Mark the entry as pending and take the lock on
+  // it before doing this to prevent any other threads sending the
+  // same query.
+  TRC_DEBUG("Create and execute DNS query transaction");
+  ce->pending_query = true;
+  DnsTsx* tsx = new DnsTsx(channel, domain, dnstype, trail);
+  tsx->execute();
+  return true;
+}
+
+void* DnsCachedResolver::refresh_thread_fn(void* resolver)
+{
+  ((DnsCachedResolver*)resolver)->refresh_thread_fn();
+  return NULL;
+}
+
+void DnsCachedResolver::refresh_thread_fn()
+{
+  pthread_mutex_lock(&_refresh_lock);
+
+  while (!_refresh_terminated)
+  {
+    if (_refresh_queue.empty())
+    {
+      pthread_cond_wait(&_refresh_cond, &_refresh_lock);
+      continue;
+    }
+
+    DnsCacheKey key = _refresh_queue.front();
+    _refresh_queue.pop_front();
+    _refresh_queued.erase(key);
+
+    pthread_mutex_unlock(&_refresh_lock);
+    refresh_cache_entry(key.second, key.first);
+    pthread_mutex_lock(&_refresh_lock);
+  }
+
+  pthread_mutex_unlock(&_refresh_lock);
 }
 
-/// Returns true if the specified RR type should be cached.
-bool DnsCachedResolver::caching_enabled(int rrtype)
+void DnsCachedResolver::unpublish_cache_entry(const DnsCacheKey& key)
 {
-  return (rrtype == ns_t_a) || (rrtype == ns_t_aaaa) || (rrtype == ns_t_srv) || (rrtype == ns_t_naptr);
+  DnsCacheShard& shard = cache_shard(key);
+
+  pthread_rwlock_wrlock(&shard.lock);
+  shard.snapshots.erase(key);
+  pthread_rwlock_unlock(&shard.lock);
 }
 
 /// Finds an existing cache entry for the specified domain name and NS type.
@@ -805,10 +1775,14 @@ DnsCachedResolver::DnsCacheEntryPtr DnsCachedResolver::create_cache_entry(const
   ce->dnstype = dnstype;
   ce->expires = 0;
   ce->pending_query = false;
+  ce->prefetching = false;
+  ce->failures = 0;
+  ce->restored = false;
   ce->original_trail = trail;
   ce->update_timestamp();
 
   _cache[std::make_pair(dnstype, domain)] = ce;
+  update_cache_size(1, entry_size(ce));
 
   return ce;
 }
@@ -827,7 +1801,7 @@ void DnsCachedResolver::add_to_expiry_list(DnsCacheEntryPtr ce)
   TRC_DEBUG("Adding %s to cache expiry list with deletion time of %d",
             ce->domain.c_str(),
             ce->expires + EXTRA_INVALID_TIME);
-  _cache_expiry_list.insert(std::make_pair(ce->expires + EXTRA_INVALID_TIME, std::make_pair(ce->dnstype, ce->domain)));
+  _cache_expiry_list.insert(ce->expires + EXTRA_INVALID_TIME, std::make_pair(ce->dnstype, ce->domain));
 }
 
 /// Scans for expired cache entries.  In most case records are created then
@@ -835,35 +1809,53 @@ void DnsCachedResolver::add_to_expiry_list(DnsCacheEntryPtr ce)
 /// to move the record in the expiry list we allow a single record to be
 /// reference multiple times in the expiry list, but only expire it when
 /// the last reference is reached.
+///
+/// This only does any work once a second, when the expiry list moves on.
 void DnsCachedResolver::expire_cache()
 {
   int now = time(NULL);
 
-  while ((!_cache_expiry_list.empty()) &&
-         (_cache_expiry_list.begin()->first <= now))
+  if (!_cache_expiry_list.due(now))
+  {
+    return;
+  }
+
+  _cache_expiry_list.advance(now, _expired_keys);
+  int expired = 0;
+
+  for (std::vector<DnsCacheExpiryList::Item>::const_iterator i = _expired_keys.begin();
+       i != _expired_keys.end();
+       ++i)
   {
-    std::multimap<int, DnsCacheKey>::iterator i = _cache_expiry_list.begin();
-    TRC_DEBUG("Removing record for %s (type %d, expiry time %d) from the expiry list", i->second.second.c_str(), i->second.first, i->first);
+    TRC_DEBUG("Removing record for %s (type %d, expiry time %d) from the expiry list", i->key.second.c_str(), i->key.first, i->expiry);
 
     // Check that the record really is due for expiry and hasn't been
     // refreshed or already deleted.
-    DnsCache::iterator j = _cache.find(i->second);
+    DnsCache::iterator j = _cache.find(i->key);
     if (j != _cache.end())
     {
       DnsCacheEntryPtr ce = j->second;
 
-      if (ce->expires + EXTRA_INVALID_TIME == i->first)
+      if (ce->expires + EXTRA_INVALID_TIME == i->expiry)
       {
         // Record really is ready to expire, so remove it from the main cache
         // map.
         TRC_DEBUG("Expiring record for %s (type %d) from the DNS cache", ce->domain.c_str(), ce->dnstype);
+        unpublish_cache_entry(published_key(ce->domain, ce->dnstype));
         clear_cache_entry(ce);
+        update_cache_size(-1, -(int64_t)entry_size(ce));
         _cache.erase(j);
+        ++expired;
       }
     }
+  }
 
-    _cache_expiry_list.erase(i);
+  if (!_expired_keys.empty())
+  {
+    _expiry_batch_sizes.record(expired);
   }
+
+  _expired_keys.clear();
 }
 
 /// Clears all the records from a cache entry.
@@ -871,10 +1863,12 @@ void DnsCachedResolver::clear_cache_entry(DnsCacheEntryPtr ce)
 {
   while (!ce->records.empty())
   {
+    update_cache_size(0, -(int64_t)record_size(ce->records.back()));
     delete ce->records.back();
     ce->records.pop_back();
   }
   ce->expires = 0;
+  ce->restored = false;
 }
 
 /// Adds a DNS RR to a cache entry.
@@ -893,46 +1887,107 @@ void DnsCachedResolver::add_record_to_cache(DnsCacheEntryPtr ce,
     ce->expires = rr->expires();
   }
   ce->records.push_back(rr);
+  update_cache_size(0, record_size(rr));
+}
+
+void DnsCachedResolver::update_cache_size(int64_t entries, int64_t bytes)
+{
+  _cache_entries += entries;
+  _cache_bytes += bytes;
+
+  static MemoryAccount* account = MemoryAccount::get(MemoryAccount::DNS_CACHE);
+  account->charge(bytes, entries);
+
+  if (_entries_scalar != NULL)
+  {
+    _entries_scalar->set_value(_cache_entries.load());
+  }
+
+  if (_bytes_scalar != NULL)
+  {
+    _bytes_scalar->set_value(_cache_bytes.load());
+  }
+}
+
+/// Estimates the memory used by a cache entry (not including its records).
+size_t DnsCachedResolver::entry_size(DnsCacheEntryPtr ce)
+{
+  return sizeof(DnsCacheEntry) + ce->domain.size();
+}
+
+/// Estimates the memory used by a record.
+size_t DnsCachedResolver::record_size(const DnsRRecord* rr)
+{
+  return rr->object_size() + rr->rrname().size();
+}
+
+/// Creates a record from a view of it in a response, and adds it to a cache
+/// entry.
+void DnsCachedResolver::add_view_to_cache(DnsParser& parser,
+                                          DnsCacheEntryPtr ce,
+                                          const DnsRRecordView& view,
+                                          SAS::TrailId trail)
+{
+  DnsRRecord* rr = parser.to_record(view);
+
+  if (rr != NULL)
+  {
+    add_record_to_cache(ce, rr, trail);
+  }
 }
 
 /// Waits for replies to outstanding DNS queries on the specified channel.
 void DnsCachedResolver::wait_for_replies(DnsChannel* channel)
 {
+  Utils::StopWatch stopwatch;
+  stopwatch.start();
+
+  // The channel's UDP and TCP c-ares channels are waited on together.
+  ares_channel ares_channels[2] = {channel->channel, channel->tcp_channel};
+
   // Wait until the expected number of results has been returned.
   while (channel->pending_queries > 0)
   {
-    // Call into ares to get details of the sockets it's using.
-    ares_socket_t scks[ARES_GETSOCK_MAXNUM];
-    int rw_bits = ares_getsock(channel->channel, scks, ARES_GETSOCK_MAXNUM);
-
-    // Translate these sockets into pollfd structures.
+    // Call into ares to get details of the sockets it's using, and translate
+    // these sockets into pollfd structures, remembering which channel each
+    // belongs to.
     int num_fds = 0;
-    struct pollfd fds[ARES_GETSOCK_MAXNUM];
-    for (int fd_idx = 0; fd_idx < ARES_GETSOCK_MAXNUM; fd_idx++)
+    struct pollfd fds[2 * ARES_GETSOCK_MAXNUM];
+    ares_channel fd_channels[2 * ARES_GETSOCK_MAXNUM];
+    struct timeval tv;
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+
+    for (int ch = 0; ch < 2; ch++)
     {
-      struct pollfd* fd = &fds[fd_idx];
-      fd->fd = scks[fd_idx];
-      fd->events = 0;
-      fd->revents = 0;
-      if (ARES_GETSOCK_READABLE(rw_bits, fd_idx))
-      {
-        fd->events |= POLLRDNORM | POLLIN;
-      }
-      if (ARES_GETSOCK_WRITABLE(rw_bits, fd_idx))
-      {
-        fd->events |= POLLWRNORM | POLLOUT;
-      }
-      if (fd->events != 0)
+      ares_socket_t scks[ARES_GETSOCK_MAXNUM];
+      int rw_bits = ares_getsock(ares_channels[ch], scks, ARES_GETSOCK_MAXNUM);
+
+      for (int fd_idx = 0; fd_idx < ARES_GETSOCK_MAXNUM; fd_idx++)
       {
-        num_fds++;
+        struct pollfd* fd = &fds[num_fds];
+        fd->fd = scks[fd_idx];
+        fd->events = 0;
+        fd->revents = 0;
+        if (ARES_GETSOCK_READABLE(rw_bits, fd_idx))
+        {
+          fd->events |= POLLRDNORM | POLLIN;
+        }
+        if (ARES_GETSOCK_WRITABLE(rw_bits, fd_idx))
+        {
+          fd->events |= POLLWRNORM | POLLOUT;
+        }
+        if (fd->events != 0)
+        {
+          fd_channels[num_fds] = ares_channels[ch];
+          num_fds++;
+        }
       }
-    }
 
-    // Calculate the timeout.
-    struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = 0;
-    (void)ares_timeout(channel->channel, NULL, &tv);
+      // Calculate the timeout, which is the earliest of the two channels'.
+      struct timeval max_tv = tv;
+      (void)ares_timeout(ares_channels[ch], &max_tv, &tv);
+    }
 
     // Wait for events on these file descriptors.
     if (poll(fds, num_fds, tv.tv_sec * 1000 + tv.tv_usec / 1000) != 0)
@@ -946,7 +2001,7 @@ void DnsCachedResolver::wait_for_replies(DnsChannel* channel)
           // Call into ares to notify it of the event.  The interface requires
           // that we pass separate file descriptors for read and write events
           // or ARES_SOCKET_BAD if no event has occurred.
-          ares_process_fd(channel->channel,
+          ares_process_fd(fd_channels[fd_idx],
                           fd->revents & (POLLRDNORM | POLLIN) ? fd->fd : ARES_SOCKET_BAD,
                           fd->revents & (POLLWRNORM | POLLOUT) ? fd->fd : ARES_SOCKET_BAD);
         }
@@ -956,8 +2011,15 @@ void DnsCachedResolver::wait_for_replies(DnsChannel* channel)
     {
       // No events, so just call into ares with no file descriptor to let it handle timeouts.
       ares_process_fd(channel->channel, ARES_SOCKET_BAD, ARES_SOCKET_BAD);
+      ares_process_fd(channel->tcp_channel, ARES_SOCKET_BAD, ARES_SOCKET_BAD);
     }
   }
+
+  unsigned long waited_us;
+  if (stopwatch.read(waited_us))
+  {
+    _reply_waits.record(waited_us);
+  }
 }
 
 DnsCachedResolver::DnsChannel* DnsCachedResolver::get_dns_channel()
@@ -965,6 +2027,25 @@ DnsCachedResolver::DnsChannel* DnsCachedResolver::get_dns_channel()
   // Get the channel from the thread-local data, or create a new one if none
   // found.
   DnsChannel* channel = (DnsChannel*)pthread_getspecific(_thread_local);
+
+  if (channel == NULL)
+  {
+    channel = create_dns_channel(false);
+
+    if (channel != NULL)
+    {
+      pthread_setspecific(_thread_local, channel);
+    }
+  }
+
+  return channel;
+}
+
+/// Creates a DNS channel, or returns NULL if there are no DNS servers.  The
+/// sockets of channels used by the I/O thread are added to its epoll set.
+DnsCachedResolver::DnsChannel* DnsCachedResolver::create_dns_channel(bool io_thread)
+{
+  DnsChannel* channel = NULL;
   size_t server_count = _dns_servers.size();
   if (server_count > MAX_DNS_SERVER_POLL)
   {
@@ -974,70 +2055,463 @@ DnsCachedResolver::DnsChannel* DnsCachedResolver::get_dns_channel()
     server_count = MAX_DNS_SERVER_POLL;
   }
 
-  if ((channel == NULL) &&
-      (server_count > 0))
+  if (server_count > 0)
   {
     channel = new DnsChannel;
     channel->pending_queries = 0;
     channel->resolver = this;
-    struct ares_options options;
-
-    options.flags = ARES_FLAG_STAYOPEN;
-    // At start of day large deployments make a large number of DNS requests, allow a low
-    // number of DNS servers more time to complete.
-    options.timeout = _timeout / server_count;
-    options.tries = 1;
-    options.ndots = 0;
-    options.udp_port = _port;
-    // We must use ares_set_servers rather than setting it in the options for IPv6 support.
-    options.servers = NULL;
-    options.nservers = 0;
-    ares_init_options(&channel->channel,
-                      &options,
-                      ARES_OPT_FLAGS |
-                      ARES_OPT_TIMEOUTMS |
-                      ARES_OPT_TRIES |
-                      ARES_OPT_NDOTS |
-                      ARES_OPT_UDP_PORT |
-                      ARES_OPT_SERVERS);
-
-    // Convert our vector of IP46Addresses into the linked list of
-    // ares_addr_nodes which ares_set_servers takes.
+    channel->server_count = server_count;
+    init_ares_channel(channel, false, io_thread);
+    init_ares_channel(channel, true, io_thread);
+    set_channel_servers(channel);
+  }
+
+  return channel;
+}
+
+/// Creates one of a channel's c-ares channels.
+void DnsCachedResolver::init_ares_channel(DnsChannel* channel, bool tcp, bool io_thread)
+{
+  struct ares_options options;
+
+  // Keep sockets open between queries, so the TCP channel's connections are
+  // reused.  Truncated UDP responses are passed back to us (rather than
+  // c-ares retrying them over TCP itself), so we can count them and send
+  // them to the TCP channel.
+  options.flags = ARES_FLAG_STAYOPEN | (tcp ? ARES_FLAG_USEVC : ARES_FLAG_IGNTC);
+  // At start of day large deployments make a large number of DNS requests, allow a low
+  // number of DNS servers more time to complete.
+  options.timeout = _timeout / channel->server_count;
+  options.tries = 1;
+  options.ndots = 0;
+  options.udp_port = _port;
+  options.tcp_port = _port;
+  // We must use ares_set_servers rather than setting it in the options for IPv6 support.
+  options.servers = NULL;
+  options.nservers = 0;
+  int optmask = ARES_OPT_FLAGS |
+                ARES_OPT_TIMEOUTMS |
+                ARES_OPT_TRIES |
+                ARES_OPT_NDOTS |
+                ARES_OPT_UDP_PORT |
+                ARES_OPT_TCP_PORT |
+                ARES_OPT_SERVERS;
+
+  if ((!tcp) && (_edns_payload_size > 0))
+  {
+    options.flags |= ARES_FLAG_EDNS;
+    options.ednspsz = _edns_payload_size;
+    optmask |= ARES_OPT_EDNSPSZ;
+  }
+
+  AresChannelRef* ref = tcp ? &channel->tcp_ref : &channel->udp_ref;
+  ref->channel = channel;
+  ref->ares = tcp ? &channel->tcp_channel : &channel->channel;
+
+  if (io_thread)
+  {
+    options.sock_state_cb = io_sock_state_cb;
+    options.sock_state_cb_data = ref;
+    optmask |= ARES_OPT_SOCK_STATE_CB;
+  }
+
+  ares_init_options(ref->ares, &options, optmask);
+}
+
+bool DnsCachedResolver::use_tcp(const std::string& domain)
+{
+  pthread_mutex_lock(&_tcp_domains_lock);
+  bool tcp = (_tcp_domains.count(domain) != 0);
+  pthread_mutex_unlock(&_tcp_domains_lock);
+
+  return tcp;
+}
+
+void DnsCachedResolver::record_truncation(const std::string& domain)
+{
+  increment_stat(_truncated_responses, _truncated_table);
+
+  pthread_mutex_lock(&_tcp_domains_lock);
+
+  if ((_learned_tcp_domains < MAX_LEARNED_TCP_DOMAINS) &&
+      (_tcp_domains.insert(domain).second))
+  {
+    TRC_INFO("DNS response for %s was truncated - query it over TCP from now on",
+             domain.c_str());
+    ++_learned_tcp_domains;
+  }
+
+  pthread_mutex_unlock(&_tcp_domains_lock);
+}
+
+void DnsCachedResolver::set_channel_servers(DnsChannel* channel)
+{
+  int now = time(NULL);
+  int count = 0;
+  channel->reorder_at = 0;
+
+  pthread_mutex_lock(&_server_lock);
+  channel->server_generation = _server_generation;
+
+  // Use the healthy servers first (in the configured order), then any that
+  // are being skipped, so there is always somewhere to send queries.
+  for (int pass = 0; pass < 2; ++pass)
+  {
     for (size_t ii = 0;
-         ii < server_count;
-         ii++)
+         (ii < _dns_servers.size()) && (count < channel->server_count);
+         ++ii)
     {
-      IP46Address server = _dns_servers[ii];
-      struct ares_addr_node* ares_addr = &_ares_addrs[ii];
-      memset(ares_addr, 0, sizeof(struct ares_addr_node));
-      if (ii > 0)
+      bool healthy = (now >= _server_health[ii].skip_until);
+
+      if (healthy == (pass == 0))
       {
-        int prev_idx = ii - 1;
-        _ares_addrs[prev_idx].next = ares_addr;
+        channel->servers[count++] = ii;
+
+        if ((!healthy) &&
+            ((channel->reorder_at == 0) ||
+             (_server_health[ii].skip_until < channel->reorder_at)))
+        {
+          channel->reorder_at = _server_health[ii].skip_until;
+        }
       }
+    }
+  }
+  pthread_mutex_unlock(&_server_lock);
+
+  // Convert the servers into the linked list of ares_addr_nodes which
+  // ares_set_servers takes (which copies it).
+  struct ares_addr_node ares_addrs[MAX_DNS_SERVER_POLL];
+  for (int ii = 0; ii < count; ii++)
+  {
+    const IP46Address& server = _dns_servers[channel->servers[ii]];
+    struct ares_addr_node* ares_addr = &ares_addrs[ii];
+    memset(ares_addr, 0, sizeof(struct ares_addr_node));
+    if (ii > 0)
+    {
+      int prev_idx = ii - 1;
+      ares_addrs[prev_idx].next = ares_addr;
+    }
+
+    ares_addr->family = server.af;
+    if (server.af == AF_INET)
+    {
+      memcpy(&ares_addr->addr.addr4, &server.addr.ipv4, sizeof(ares_addr->addr.addr4));
+    }
+    else
+    {
+      memcpy(&ares_addr->addr.addr6, &server.addr.ipv6, sizeof(ares_addr->addr.addr6));
+    }
+  }
+
+  ares_set_servers(channel->channel, ares_addrs);
+  ares_set_servers(channel->tcp_channel, ares_addrs);
+}
+
+void DnsCachedResolver::prepare_channel(DnsChannel* channel)
+{
+  if ((channel->pending_queries == 0) &&
+      ((channel->server_generation != _server_generation) ||
+       ((channel->reorder_at != 0) && (time(NULL) >= channel->reorder_at))))
+  {
+    TRC_DEBUG("DNS server health has changed - reorder the channel's servers");
+    set_channel_servers(channel);
+  }
+}
+
+void DnsCachedResolver::record_server_results(DnsChannel* channel,
+                                              int status,
+                                              int timeouts,
+                                              uint64_t elapsed_us)
+{
+  if ((status == ARES_EDESTRUCTION) || (status == ARES_ECANCELLED))
+  {
+    return;
+  }
+
+  // The channel tries its servers in turn, so the first `timeouts` servers
+  // didn't respond.  If the query then got an answer, it came from the next
+  // server.
+  int now = time(NULL);
+  std::vector<int> failed;
+
+  pthread_mutex_lock(&_server_lock);
+
+  for (int ii = 0; (ii < timeouts) && (ii < channel->server_count); ++ii)
+  {
+    ++_server_stats[channel->servers[ii]]->timeouts;
+    DnsServerHealth& health = _server_health[channel->servers[ii]];
+
+    if (now >= health.skip_until)
+    {
+      ++health.failures;
+      int backoff = std::min(SERVER_BACKOFF_MIN << std::min(health.failures - 1, 16),
+                             SERVER_BACKOFF_MAX);
+      health.skip_until = now + backoff;
+      failed.push_back(channel->servers[ii]);
+      ++_server_generation;
+    }
+  }
+
+  if ((timeouts < channel->server_count) &&
+      ((status == ARES_SUCCESS) ||
+       (status == ARES_ENOTFOUND) ||
+       (status == ARES_ENODATA)))
+  {
+    // The time it took to answer is only known if it was the first server
+    // tried - otherwise the query's time includes time waiting for others.
+    DnsServerStats* stats = _server_stats[channel->servers[timeouts]];
+    ++stats->responses;
+
+    if (timeouts == 0)
+    {
+      stats->rtts.record(elapsed_us);
+    }
+
+    DnsServerHealth& health = _server_health[channel->servers[timeouts]];
+
+    if (health.failures > 0)
+    {
+      TRC_STATUS("DNS server %s is responding again",
+                 _dns_servers[channel->servers[timeouts]].to_string().c_str());
+      health.failures = 0;
+      health.skip_until = 0;
+      ++_server_generation;
+    }
+  }
+
+  pthread_mutex_unlock(&_server_lock);
+
+  for (std::vector<int>::const_iterator i = failed.begin(); i != failed.end(); ++i)
+  {
+    TRC_WARNING("DNS server %s is not responding - skipping it",
+                _dns_servers[*i].to_string().c_str());
+
+    if (_server_failures_table != NULL)
+    {
+      _server_failures_table->increment();
+    }
+  }
+}
+
+bool DnsCachedResolver::is_server_failure(int status)
+{
+  return ((status == ARES_ETIMEOUT) ||
+          (status == ARES_ESERVFAIL) ||
+          (status == ARES_EREFUSED) ||
+          (status == ARES_ECONNREFUSED));
+}
+
+int DnsCachedResolver::failure_backoff(int failures)
+{
+  int backoff = _failure_backoff_min;
+
+  for (int ii = 1; (ii < failures) && (backoff < _failure_backoff_max); ++ii)
+  {
+    backoff *= 2;
+  }
+
+  return std::min(backoff, _failure_backoff_max);
+}
+
+void DnsCachedResolver::start_io_thread(int num_channels)
+{
+  TRC_STATUS("Starting DNS I/O thread with %d channels", num_channels);
+
+  _io_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  _io_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = _io_event_fd;
+  epoll_ctl(_io_epoll_fd, EPOLL_CTL_ADD, _io_event_fd, &event);
+
+  for (int ii = 0; ii < num_channels; ++ii)
+  {
+    DnsChannel* channel = create_dns_channel(true);
+
+    if (channel != NULL)
+    {
+      _io_channels.push_back(channel);
+    }
+  }
+
+  _io_thread_running = true;
+
+  int rc = pthread_create(&_io_thread, NULL, io_thread_fn, this);
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to create DNS I/O thread: %d", rc);
+    _io_thread_running = false;
+    // LCOV_EXCL_STOP
+  }
+}
+
+void DnsCachedResolver::stop_io_thread()
+{
+  pthread_mutex_lock(&_io_lock);
+  _io_terminated = true;
+  pthread_mutex_unlock(&_io_lock);
+
+  uint64_t wake = 1;
+  if (write(_io_event_fd, &wake, sizeof(wake)) < 0)
+  {
+    TRC_WARNING("Failed to wake DNS I/O thread: %d", errno); // LCOV_EXCL_LINE
+  }
+
+  pthread_join(_io_thread, NULL);
+
+  // Fail any queries that the thread didn't get to, and then any that are
+  // still outstanding (which ares_destroy does), so that no one is left
+  // waiting for them.
+  for (std::deque<IoRequest>::const_iterator i = _io_requests.begin();
+       i != _io_requests.end();
+       ++i)
+  {
+    dns_response(i->domain, i->dnstype, ARES_EDESTRUCTION, NULL, 0, i->trail);
+  }
+  _io_requests.clear();
+
+  for (std::vector<DnsChannel*>::iterator i = _io_channels.begin();
+       i != _io_channels.end();
+       ++i)
+  {
+    destroy_dns_channel(*i);
+  }
+  _io_channels.clear();
+
+  close(_io_event_fd);
+  close(_io_epoll_fd);
+}
+
+/// Called by c-ares when a channel used by the I/O thread opens, closes, or
+/// changes what it's waiting for on a socket.
+void DnsCachedResolver::io_sock_state_cb(void* data,
+                                         ares_socket_t socket,
+                                         int readable,
+                                         int writable)
+{
+  AresChannelRef* ref = (AresChannelRef*)data;
+  DnsCachedResolver* resolver = ref->channel->resolver;
+
+  struct epoll_event event;
+  event.events = (readable ? (uint32_t)EPOLLIN : 0) |
+                 (writable ? (uint32_t)EPOLLOUT : 0);
+  event.data.fd = socket;
+
+  if (event.events == 0)
+  {
+    epoll_ctl(resolver->_io_epoll_fd, EPOLL_CTL_DEL, socket, &event);
+    resolver->_io_sockets.erase(socket);
+  }
+  else if (resolver->_io_sockets.count(socket) == 0)
+  {
+    epoll_ctl(resolver->_io_epoll_fd, EPOLL_CTL_ADD, socket, &event);
+    resolver->_io_sockets[socket] = ref;
+  }
+  else
+  {
+    epoll_ctl(resolver->_io_epoll_fd, EPOLL_CTL_MOD, socket, &event);
+  }
+}
+
+void* DnsCachedResolver::io_thread_fn(void* resolver)
+{
+  ((DnsCachedResolver*)resolver)->io_thread_fn();
+  return NULL;
+}
+
+void DnsCachedResolver::io_thread_fn()
+{
+  static const int MAX_EVENTS = 64;
+  struct epoll_event events[MAX_EVENTS];
+  size_t next_channel = 0;
+
+  while (true)
+  {
+    // Issue any new queries, sharing them between the channels.
+    std::deque<IoRequest> requests;
+
+    pthread_mutex_lock(&_io_lock);
+    bool terminated = _io_terminated;
+    if (!terminated)
+    {
+      requests.swap(_io_requests);
+    }
+    pthread_mutex_unlock(&_io_lock);
 
-      ares_addr->family = server.af;
-      if (server.af == AF_INET)
+    if (terminated)
+    {
+      break;
+    }
+
+    for (std::deque<IoRequest>::const_iterator i = requests.begin();
+         i != requests.end();
+         ++i)
+    {
+      DnsChannel* channel = _io_channels[next_channel++ % _io_channels.size()];
+      DnsTsx* tsx = new DnsTsx(channel, i->domain, i->dnstype, i->trail);
+      tsx->execute();
+    }
+
+    // Wait until a socket is ready, a query times out, or there are more
+    // queries to issue.
+    int timeout_ms = 1000;
+    for (std::vector<DnsChannel*>::const_iterator i = _io_channels.begin();
+         i != _io_channels.end();
+         ++i)
+    {
+      struct timeval max_tv = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+      struct timeval tv;
+      ares_timeout((*i)->channel, &max_tv, &tv);
+      ares_timeout((*i)->tcp_channel, &tv, &tv);
+      timeout_ms = std::min(timeout_ms, (int)(tv.tv_sec * 1000 + tv.tv_usec / 1000));
+    }
+
+    int num_events = epoll_wait(_io_epoll_fd, events, MAX_EVENTS, timeout_ms);
+
+    for (int ii = 0; ii < num_events; ++ii)
+    {
+      int fd = events[ii].data.fd;
+
+      if (fd == _io_event_fd)
       {
-        memcpy(&ares_addr->addr.addr4, &server.addr.ipv4, sizeof(ares_addr->addr.addr4));
+        uint64_t count;
+        if (read(_io_event_fd, &count, sizeof(count)) < 0)
+        {
+          // Nothing to do - the eventfd is just used to wake us up.
+        }
+        continue;
       }
-      else
+
+      std::map<int, AresChannelRef*>::const_iterator channel = _io_sockets.find(fd);
+
+      if (channel != _io_sockets.end())
       {
-        memcpy(&ares_addr->addr.addr6, &server.addr.ipv6, sizeof(ares_addr->addr.addr6));
+        // Call into ares to notify it of the event.  The interface requires
+        // that we pass separate file descriptors for read and write events
+        // or ARES_SOCKET_BAD if no event has occurred.
+        ares_process_fd(*channel->second->ares,
+                        (events[ii].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) ? fd : ARES_SOCKET_BAD,
+                        (events[ii].events & EPOLLOUT) ? fd : ARES_SOCKET_BAD);
       }
     }
 
-    ares_set_servers(channel->channel, _ares_addrs);
-
-    pthread_setspecific(_thread_local, channel);
+    // Let ares handle any timeouts.
+    for (std::vector<DnsChannel*>::const_iterator i = _io_channels.begin();
+         i != _io_channels.end();
+         ++i)
+    {
+      ares_process_fd((*i)->channel, ARES_SOCKET_BAD, ARES_SOCKET_BAD);
+      ares_process_fd((*i)->tcp_channel, ARES_SOCKET_BAD, ARES_SOCKET_BAD);
+    }
   }
-
-  return channel;
 }
 
 void DnsCachedResolver::destroy_dns_channel(DnsChannel* channel)
 {
   ares_destroy(channel->channel);
+  ares_destroy(channel->tcp_channel);
   delete channel;
 }
 
@@ -1045,7 +2519,8 @@ DnsCachedResolver::DnsTsx::DnsTsx(DnsChannel* channel, const std::string& domain
   _channel(channel),
   _domain(domain),
   _dnstype(dnstype),
-  _trail(trail)
+  _trail(trail),
+  _tcp(false)
 {
 }
 
@@ -1059,7 +2534,9 @@ void DnsCachedResolver::DnsTsx::execute()
   // synchronously on the same thread. _cache_lock has to be recursive
   // to account for this (and it's slightly cleaner to increment
   // pending_queries first, to stop it going negative).
+  _channel->resolver->prepare_channel(_channel);
   ++_channel->pending_queries;
+  _stopwatch.start();
 
   if (_trail != 0)
   {
@@ -1073,7 +2550,19 @@ void DnsCachedResolver::DnsTsx::execute()
              _domain.c_str(),
              DnsRRecord::rrtype_to_string(_dnstype).c_str());
 
-  ares_query(_channel->channel,
+  _tcp = _channel->resolver->use_tcp(_domain);
+  send();
+}
+
+void DnsCachedResolver::DnsTsx::send()
+{
+  if (_tcp)
+  {
+    increment_stat(_channel->resolver->_tcp_queries,
+                   _channel->resolver->_tcp_queries_table);
+  }
+
+  ares_query(_tcp ? _channel->tcp_channel : _channel->channel,
              _domain.c_str(),
              ns_c_in,
              _dnstype,
@@ -1103,6 +2592,23 @@ void DnsCachedResolver::DnsTsx::ares_callback(int status, int timeouts, unsigned
     SAS::report_event(event);
   }
 
+  unsigned long elapsed_us = 0;
+  _stopwatch.read(elapsed_us);
+  _channel->resolver->record_server_results(_channel, status, timeouts, elapsed_us);
+
+  // Check the TC bit of a UDP response.  If it's set, the answer is
+  // incomplete, so send the query again over TCP.
+  if ((!_tcp) && (abuf != NULL) && (alen > 2) && (abuf[2] & 0x02))
+  {
+    TRC_DEBUG("DNS response for %s was truncated - retry over TCP",
+              _domain.c_str());
+    _channel->resolver->record_truncation(_domain);
+    _tcp = true;
+    _stopwatch.start();
+    send();
+    return;
+  }
+
   _channel->resolver->dns_response(_domain, _dnstype, status, abuf, alen, _trail);
   --_channel->pending_queries;
   delete this;
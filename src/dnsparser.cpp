@@ -12,6 +12,7 @@
 #include <sstream>
 #include <iomanip>
 #include <exception>
+#include <algorithm>
 
 #include <memory.h>
 #include <ctype.h>
@@ -136,18 +137,45 @@ int DnsParser::parse_header(unsigned char* hptr)
 }
 
 int DnsParser::parse_domain_name(unsigned char *nptr, std::string& name)
+{
+  return walk_domain_name(nptr, &name);
+}
+
+int DnsParser::skip_domain_name(unsigned char *nptr)
+{
+  return walk_domain_name(nptr, NULL);
+}
+
+/// Walks an encoded domain name, decompressing it into `name` (if that isn't
+/// NULL), and returns its encoded length.  Throws if the name is malformed.
+int DnsParser::walk_domain_name(unsigned char *nptr, std::string* name)
 {
   int compressed_length = 0;
   unsigned char* lptr = nptr;
 
+  // Pointers may only refer to names before the part of the name that
+  // contains them, so names can't loop.
+  unsigned char* segment = nptr;
+
+  if (nptr > _data_end)
+  {
+    throw std::exception();
+  }
+
   if (*lptr == 0)
   {
     // Already at the root domain, so just return a single dot.
-    name = ".";
+    if (name != NULL)
+    {
+      *name = ".";
+    }
     return 1;
   }
 
-  name = "";
+  if (name != NULL)
+  {
+    name->clear();
+  }
 
   do
   {
@@ -164,17 +192,20 @@ int DnsParser::parse_domain_name(unsigned char *nptr, std::string& name)
       {
         throw std::exception();
       }
-      name.append((const char *)(lptr + 1), length);
+      if (name != NULL)
+      {
+        name->append((const char *)(lptr + 1), length);
+      }
       lptr += length + 1;
-      if (*lptr != 0)
+      if ((*lptr != 0) && (name != NULL))
       {
-        name.append(".");
+        name->append(".");
       }
     }
     else if ((offset = label_offset(lptr)) != -1)
     {
       // Offset field.
-      if (offset > (lptr - _data))
+      if (offset >= (segment - _data))
       {
         // Forward references are not allowed.
         throw std::exception();
@@ -186,6 +217,7 @@ int DnsParser::parse_domain_name(unsigned char *nptr, std::string& name)
         compressed_length = lptr - nptr + 2;
       }
       lptr = _data + offset;
+      segment = lptr;
     }
     else
     {
@@ -201,11 +233,99 @@ int DnsParser::parse_domain_name(unsigned char *nptr, std::string& name)
     compressed_length = lptr - nptr + 1;
   }
 
-  TRC_DEBUG("Parsed domain name = %s, encoded length = %d", name.c_str(), compressed_length);
+  if (name != NULL)
+  {
+    TRC_DEBUG("Parsed domain name = %s, encoded length = %d", name->c_str(), compressed_length);
+  }
 
   return compressed_length;
 }
 
+bool DnsParser::name_matches(unsigned char* nptr, const std::string& domain)
+{
+  unsigned char* lptr = nptr;
+  unsigned char* segment = nptr;
+  size_t pos = 0;
+
+  if ((nptr > _data_end) || (domain.empty()))
+  {
+    return false;
+  }
+
+  if (*lptr == 0)
+  {
+    return (domain == ".");
+  }
+
+  do
+  {
+    if (lptr > _data_end)
+    {
+      return false;
+    }
+    int length;
+    int offset;
+    if ((length = label_length(lptr)) != -1)
+    {
+      if (lptr + length + 1 > _data_end)
+      {
+        return false;
+      }
+
+      // Match the separator before this label, then the label itself.
+      if (pos != 0)
+      {
+        if ((pos >= domain.size()) || (domain[pos] != '.'))
+        {
+          return false;
+        }
+        ++pos;
+      }
+
+      if ((domain.size() - pos < (size_t)length) ||
+          (strncasecmp(domain.c_str() + pos, (const char*)(lptr + 1), length) != 0))
+      {
+        return false;
+      }
+
+      pos += length;
+      lptr += length + 1;
+    }
+    else if ((offset = label_offset(lptr)) != -1)
+    {
+      if (offset >= (segment - _data))
+      {
+        return false;
+      }
+      lptr = _data + offset;
+      segment = lptr;
+    }
+    else
+    {
+      return false;
+    }
+  }
+  while (*lptr != 0);
+
+  return (pos == domain.size());
+}
+
+std::string DnsParser::domain_name(unsigned char* nptr)
+{
+  std::string name;
+
+  try
+  {
+    parse_domain_name(nptr, name);
+  }
+  catch (const std::exception& e)
+  {
+    name.clear();
+  }
+
+  return name;
+}
+
 int DnsParser::parse_character_string(unsigned char* sptr, std::string& cstring)
 {
   if (sptr + *sptr > _data_end)
@@ -230,110 +350,195 @@ int DnsParser::parse_question(unsigned char* qptr, DnsQuestion*& question)
 
 int DnsParser::parse_rr(unsigned char* rptr, DnsRRecord*& rr)
 {
-  // Parse the common RR fields.
-  std::string rrname;
-  int nlength = parse_domain_name(rptr, rrname);
-  if (rptr + RR_HDR_FIXED_SIZE > _data_end)
+  DnsRRecordView view;
+  int length = parse_rr_view(rptr, view);
+
+  rr = to_record(view);
+  if (rr == NULL)
+  {
+    throw std::exception();
+  }
+
+  return length;
+}
+
+int DnsParser::parse_rr_view(unsigned char* rptr, DnsRRecordView& view)
+{
+  // Parse the common RR fields, skipping over the name.
+  int nlength = skip_domain_name(rptr);
+  if (rptr + nlength + RR_HDR_FIXED_SIZE - 1 > _data_end)
   {
     throw std::exception();
   }
-  int rrtype = read_int16(rptr + nlength + RRTYPE_OFFSET);
-  int rrclass = read_int16(rptr + nlength + RRCLASS_OFFSET);
-  int ttl = read_int32(rptr + nlength + TTL_OFFSET);
-  int rdlength = read_int16(rptr + nlength + RDLENGTH_OFFSET);
-  unsigned char* rdata = rptr + nlength + RR_HDR_FIXED_SIZE;
+  view.rrname = rptr;
+  view.rrtype = read_int16(rptr + nlength + RRTYPE_OFFSET);
+  view.rrclass = read_int16(rptr + nlength + RRCLASS_OFFSET);
+  view.ttl = read_int32(rptr + nlength + TTL_OFFSET);
+  view.rdlength = read_int16(rptr + nlength + RDLENGTH_OFFSET);
+  view.rdata = rptr + nlength + RR_HDR_FIXED_SIZE;
 
   // Check the length of the variable part of the record doesn't overflow
   // the buffer.
-  if (rdata + rdlength - 1 > _data_end)
+  if (view.rdata + view.rdlength - 1 > _data_end)
   {
     throw std::exception();
   }
 
-  TRC_DEBUG("Resource Record NAME=%s TYPE=%s CLASS=%s TTL=%d RDLENGTH=%d",
-            rrname.c_str(),
-            DnsRRecord::rrtype_to_string(rrtype).c_str(),
-            DnsRRecord::rrclass_to_string(rrclass).c_str(),
-            ttl, rdlength);
+  return nlength + RR_HDR_FIXED_SIZE + view.rdlength;
+}
 
-  // Process the variant parts of the record.
-  if ((rrclass == ns_c_in) && (rrtype == ns_t_a))
+DnsRRecord* DnsParser::to_record(const DnsRRecordView& view)
+{
+  DnsRRecord* rr = NULL;
+
+  try
   {
-    TRC_DEBUG("Parse A record RDATA");
-    if (rdlength < (int)sizeof(struct in_addr))
+    std::string rrname;
+    parse_domain_name(view.rrname, rrname);
+
+    TRC_DEBUG("Resource Record NAME=%s TYPE=%s CLASS=%s TTL=%d RDLENGTH=%d",
+              rrname.c_str(),
+              DnsRRecord::rrtype_to_string(view.rrtype).c_str(),
+              DnsRRecord::rrclass_to_string(view.rrclass).c_str(),
+              view.ttl, view.rdlength);
+
+    // Process the variant parts of the record.
+    if ((view.rrclass == ns_c_in) && (view.rrtype == ns_t_a))
     {
-      throw std::exception();
+      TRC_DEBUG("Parse A record RDATA");
+      if (view.rdlength < (int)sizeof(struct in_addr))
+      {
+        throw std::exception();
+      }
+      struct in_addr address;
+      memcpy((char*)&address, view.rdata, sizeof(struct in_addr));
+      rr = (DnsRRecord*)new DnsARecord(rrname, view.ttl, address);
     }
-    struct in_addr address;
-    memcpy((char*)&address, rdata, sizeof(struct in_addr));
-    rr = (DnsRRecord*)new DnsARecord(rrname, ttl, address);
-  }
-  else if ((rrclass == ns_c_in) && (rrtype == ns_t_aaaa))
-  {
-    TRC_DEBUG("Parse AAAA record RDATA");
-    if (rdlength < (int)sizeof(struct in6_addr))
+    else if ((view.rrclass == ns_c_in) && (view.rrtype == ns_t_aaaa))
     {
-      throw std::exception();
+      TRC_DEBUG("Parse AAAA record RDATA");
+      if (view.rdlength < (int)sizeof(struct in6_addr))
+      {
+        throw std::exception();
+      }
+      struct in6_addr address;
+      memcpy((char*)&address, view.rdata, sizeof(struct in6_addr));
+      rr = (DnsRRecord*)new DnsAAAARecord(rrname, view.ttl, address);
     }
-    struct in6_addr address;
-    memcpy((char*)&address, rdata, sizeof(struct in6_addr));
-    rr = (DnsRRecord*)new DnsAAAARecord(rrname, ttl, address);
-  }
-  else if ((rrclass == ns_c_in) && (rrtype == ns_t_srv))
-  {
-    TRC_DEBUG("Parse SRV record RDATA");
-    if (rdlength < SRV_FIXED_SIZE)
+    else if ((view.rrclass == ns_c_in) && (view.rrtype == ns_t_srv))
     {
-      throw std::exception();
+      TRC_DEBUG("Parse SRV record RDATA");
+      if (view.rdlength < SRV_FIXED_SIZE)
+      {
+        throw std::exception();
+      }
+      int priority = read_int16(view.rdata + SRV_PRIORITY_OFFSET);
+      int weight = read_int16(view.rdata + SRV_WEIGHT_OFFSET);
+      int port = read_int16(view.rdata + SRV_PORT_OFFSET);
+      std::string target;
+      int target_len = parse_domain_name(view.rdata + SRV_TARGET_OFFSET, target);
+      if (view.rdlength < SRV_TARGET_OFFSET + target_len)
+      {
+        throw std::exception();
+      }
+      rr = (DnsRRecord*)new DnsSrvRecord(rrname, view.ttl, priority, weight, port, target);
     }
-    int priority = read_int16(rdata + SRV_PRIORITY_OFFSET);
-    int weight = read_int16(rdata + SRV_WEIGHT_OFFSET);
-    int port = read_int16(rdata + SRV_PORT_OFFSET);
-    std::string target;
-    int target_len = parse_domain_name(rdata + SRV_TARGET_OFFSET, target);
-    if (rdlength < SRV_TARGET_OFFSET + target_len)
+    else if ((view.rrclass == ns_c_in) && (view.rrtype == ns_t_naptr))
     {
-      throw std::exception();
+      TRC_DEBUG("Parse NAPTR record RDATA");
+      if (view.rdlength < NAPTR_FIXED_SIZE)
+      {
+        throw std::exception();
+      }
+      int order = read_int16(view.rdata + NAPTR_ORDER_OFFSET);
+      int preference = read_int16(view.rdata + NAPTR_PREFERENCE_OFFSET);
+      int offset = NAPTR_FLAGS_OFFSET;
+      std::string flags;
+      offset += parse_character_string(view.rdata + offset, flags);
+      std::string services;
+      offset += parse_character_string(view.rdata + offset, services);
+      std::string regexp;
+      offset += parse_character_string(view.rdata + offset, regexp);
+      std::string replacement;
+      offset += parse_domain_name(view.rdata + offset, replacement);
+      if (view.rdlength < offset)
+      {
+        throw std::exception();
+      }
+      rr = (DnsRRecord*)new DnsNaptrRecord(rrname, view.ttl, order, preference, flags, services, regexp, replacement);
     }
-    rr = (DnsRRecord*)new DnsSrvRecord(rrname, ttl, priority, weight, port, target);
-  }
-  else if ((rrclass == ns_c_in) && (rrtype == ns_t_naptr))
-  {
-    TRC_DEBUG("Parse NAPTR record RDATA");
-    if (rdlength < NAPTR_FIXED_SIZE)
+    else if ((view.rrclass == ns_c_in) && (view.rrtype == ns_t_cname))
     {
-      throw std::exception();
+      TRC_DEBUG("Parse CNAME record RDATA");
+      std::string target;
+      parse_domain_name(view.rdata, target);
+      rr = new DnsCNAMERecord(rrname, view.ttl, target);
     }
-    int order = read_int16(rdata + NAPTR_ORDER_OFFSET);
-    int preference = read_int16(rdata + NAPTR_PREFERENCE_OFFSET);
-    int offset = NAPTR_FLAGS_OFFSET;
-    std::string flags;
-    offset += parse_character_string(rdata + offset, flags);
-    std::string services;
-    offset += parse_character_string(rdata + offset, services);
-    std::string regexp;
-    offset += parse_character_string(rdata + offset, regexp);
-    std::string replacement;
-    offset += parse_domain_name(rdata + offset, replacement);
-    if (rdlength < offset)
+    else
     {
-      throw std::exception();
+      rr = new DnsRRecord(rrname, view.rrtype, view.rrclass, view.ttl);
     }
-    rr = (DnsRRecord*)new DnsNaptrRecord(rrname, ttl, order, preference, flags, services, regexp, replacement);
   }
-  else if ((rrclass == ns_c_in) && (rrtype == ns_t_cname))
+  catch (const std::exception& e)
+  {
+    TRC_DEBUG("Malformed %s record", DnsRRecord::rrtype_to_string(view.rrtype).c_str());
+    delete rr;
+    rr = NULL;
+  }
+
+  return rr;
+}
+
+bool DnsParser::parse_records(std::vector<DnsRRecordView>& records)
+{
+  bool rc = true;
+  unsigned char* rptr = _data;
+
+  records.clear();
+
+  try
   {
-    TRC_DEBUG("Parse CNAME record RDATA");
-    std::string target;
-    parse_domain_name(rdata, target);
-    rr = new DnsCNAMERecord(rrname, ttl, target);
+    rptr += parse_header(rptr);
+    // Each record takes at least RR_HDR_FIXED_SIZE + 1 bytes, so don't trust
+    // the counts in the header any further than that.
+    records.reserve(std::min(_an_count + _ns_count + _ar_count,
+                             _length / (RR_HDR_FIXED_SIZE + 1)));
+
+    // Skip the question(s).
+    for (int ii = 0; ii < _qd_count; ++ii)
+    {
+      int nlength = skip_domain_name(rptr);
+      if (rptr + nlength + Q_FIXED_SIZE - 1 > _data_end)
+      {
+        throw std::exception();
+      }
+      rptr += nlength + Q_FIXED_SIZE;
+    }
+
+    // Parse the answers, NS records and additional records.
+    static const DnsRRecordView::Section sections[] = {DnsRRecordView::ANSWER,
+                                                       DnsRRecordView::AUTHORITY,
+                                                       DnsRRecordView::ADDITIONAL};
+    int counts[] = {_an_count, _ns_count, _ar_count};
+
+    for (int section = 0; section < 3; ++section)
+    {
+      for (int ii = 0; ii < counts[section]; ++ii)
+      {
+        DnsRRecordView view;
+        view.section = sections[section];
+        rptr += parse_rr_view(rptr, view);
+        records.push_back(view);
+      }
+    }
   }
-  else
+  catch (const std::exception& e)
   {
-    rr = new DnsRRecord(rrname, rrtype, rrclass, ttl);
+    TRC_ERROR("Failed to parse DNS message");
+    rc = false;
   }
 
-  return nlength + RR_HDR_FIXED_SIZE + rdlength;
+  return rc;
 }
 
 int DnsParser::read_int16(unsigned char* p)
@@ -94,4 +94,110 @@ void EventStatisticAccumulator::reset(uint64_t periodstart, EventStatisticAccumu
   _hwm = 0;
 }
 
+const int EventPercentileAccumulator::SUB_BUCKET_BITS;
+const int EventPercentileAccumulator::NUM_BUCKETS;
+
+EventPercentileAccumulator::EventPercentileAccumulator() :
+  EventStatisticAccumulator()
+{
+  reset(0);
+}
+
+void EventPercentileAccumulator::accumulate(uint32_t sample)
+{
+  EventStatisticAccumulator::accumulate(sample);
+  _buckets[bucket(sample)].fetch_add(1, std::memory_order_relaxed);
+}
+
+int EventPercentileAccumulator::bucket(uint32_t sample)
+{
+  if (sample < (1u << SUB_BUCKET_BITS))
+  {
+    return sample;
+  }
+
+  // Keep the top SUB_BUCKET_BITS bits below the most significant bit to pick
+  // the bucket within this power of two.
+  int shift = (31 - __builtin_clz(sample)) - SUB_BUCKET_BITS;
+  return ((shift + 1) << SUB_BUCKET_BITS) +
+         (sample >> shift) - (1 << SUB_BUCKET_BITS);
+}
+
+uint_fast64_t EventPercentileAccumulator::bucket_value(int bucket)
+{
+  if (bucket < (1 << SUB_BUCKET_BITS))
+  {
+    return bucket;
+  }
+
+  int shift = (bucket >> SUB_BUCKET_BITS) - 1;
+  uint_fast64_t lowest = (uint_fast64_t)((bucket & ((1 << SUB_BUCKET_BITS) - 1)) +
+                                         (1 << SUB_BUCKET_BITS)) << shift;
+  return lowest + (((uint_fast64_t)1 << shift) - 1) / 2;
+}
+
+uint_fast64_t EventPercentileAccumulator::percentile(uint_fast64_t total, int percent)
+{
+  // The rank of the sample at this percentile, counting from 1.
+  uint_fast64_t rank = ((total * percent) + 99) / 100;
+  uint_fast64_t seen = 0;
+
+  for (int ii = 0; ii < NUM_BUCKETS; ++ii)
+  {
+    seen += _buckets[ii].load(std::memory_order_relaxed);
+
+    if (seen >= rank)
+    {
+      return bucket_value(ii);
+    }
+  }
+
+  // Samples were added while we were reading the buckets.
+  return bucket_value(NUM_BUCKETS - 1); // LCOV_EXCL_LINE
+}
+
+void EventPercentileAccumulator::get_percentiles(EventPercentiles &percentiles)
+{
+  // Count the samples from the buckets, rather than using the count of
+  // events, so that the ranks are consistent with the histogram.
+  uint_fast64_t total = 0;
+
+  for (int ii = 0; ii < NUM_BUCKETS; ++ii)
+  {
+    total += _buckets[ii].load(std::memory_order_relaxed);
+  }
+
+  if (total > 0)
+  {
+    percentiles.p50 = percentile(total, 50);
+    percentiles.p90 = percentile(total, 90);
+    percentiles.p99 = percentile(total, 99);
+  }
+  else
+  {
+    percentiles.p50 = 0;
+    percentiles.p90 = 0;
+    percentiles.p99 = 0;
+  }
+}
+
+void EventPercentileAccumulator::merge(const EventPercentileAccumulator& other)
+{
+  for (int ii = 0; ii < NUM_BUCKETS; ++ii)
+  {
+    _buckets[ii].fetch_add(other._buckets[ii].load(std::memory_order_relaxed),
+                           std::memory_order_relaxed);
+  }
+}
+
+void EventPercentileAccumulator::reset(uint64_t periodstart, EventPercentileAccumulator* previous)
+{
+  EventStatisticAccumulator::reset(periodstart, previous);
+
+  for (int ii = 0; ii < NUM_BUCKETS; ++ii)
+  {
+    _buckets[ii].store(0, std::memory_order_relaxed);
+  }
+}
+
 }
@@ -12,9 +12,17 @@
 #include <pthread.h>
 #include <setjmp.h>
 #include <unistd.h>
+#include <algorithm>
 #include <cstdlib>
 #include <signal.h>
 #include <string.h>
+#include <dirent.h>
+#include <execinfo.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
 
 #include "exception_handler.h"
 #include "health_checker.h"
@@ -28,16 +36,77 @@ ExceptionHandler::ExceptionHandler(int ttl,
   _ttl(ttl),
   _attempt_quiesce(attempt_quiesce),
   _health_checker(health_checker),
-  _dumped_core(false)
+  _dumped_core(false),
+  _minidump_fd(-1),
+  _minidump_pid(-1),
+  _minidumps(0)
 {
   pthread_key_create(&_jmp_buf, NULL);
 }
 
 ExceptionHandler::~ExceptionHandler()
 {
+  if (_minidump_fd >= 0)
+  {
+    // The helper exits once its socket is closed.
+    close(_minidump_fd);
+    waitpid(_minidump_pid, NULL, 0);
+  }
+
   pthread_key_delete(_jmp_buf);
 }
 
+const int ExceptionHandler::MAX_MINIDUMPS;
+const int ExceptionHandler::MAX_FRAMES;
+
+bool ExceptionHandler::enable_minidumps(const std::string& directory)
+{
+  // The first call to backtrace() loads libgcc_s (allocating as it does), so
+  // make it now rather than from request_minidump(), where the crash may
+  // have happened inside malloc or the dynamic loader.
+  void* frames[1];
+  backtrace(frames, 1);
+
+  // Each request is one message, so it's never read in pieces.
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) != 0)
+  {
+    TRC_ERROR("Failed to create minidump socket: %d", errno); // LCOV_EXCL_LINE
+    return false;                                             // LCOV_EXCL_LINE
+  }
+
+  pid_t pid = getpid();
+  pid_t rc = fork();
+
+  if (rc < 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to start minidump helper: %d", errno);
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+    // LCOV_EXCL_STOP
+  }
+  else if (rc == 0)
+  {
+    // In the helper process.
+    close(fds[0]);
+    minidump_helper(fds[1], pid, directory);
+    _exit(0);
+  }
+
+  close(fds[1]);
+
+  // Let the helper read our memory (for the RAM trace buffers) if ptrace is
+  // restricted to ancestors.
+  prctl(PR_SET_PTRACER, rc, 0, 0, 0);
+
+  _minidump_fd = fds[0];
+  _minidump_pid = rc;
+  TRC_STATUS("Started minidump helper process %d", rc);
+  return true;
+}
+
 void ExceptionHandler::handle_exception()
 {
   // Check if there's a stored jmp_buf on the thread and handle if there is
@@ -45,7 +114,14 @@ void ExceptionHandler::handle_exception()
 
   if (env != NULL)
   {
-    dump_one_core();
+    if (_minidump_fd >= 0)
+    {
+      request_minidump();
+    }
+    else
+    {
+      dump_one_core();
+    }
 
     // Let the health check know that an exception has occurred
     _health_checker->hit_exception();
@@ -130,3 +206,153 @@ void ExceptionHandler::dump_one_core()
     fprintf(stderr, "Not dumping core file - core has already been dumped for this process\n");
   }
 }
+
+// Ask the minidump helper to write a minidump.  The stack is captured here,
+// but everything else is left to the helper, so the calling thread is only
+// held up briefly and the others not at all.
+//
+// This function may be called from a signal handler so must only use async-safe
+// functions, and must not use the standard TRC_ macros (which may take locks).
+// backtrace() isn't async-safe the first time it's called, but
+// enable_minidumps() has already called it.
+void ExceptionHandler::request_minidump()
+{
+  if (_minidumps++ >= MAX_MINIDUMPS)
+  {
+    fprintf(stderr, "Not writing minidump - %d have already been written for this process\n",
+            MAX_MINIDUMPS);
+    return;
+  }
+
+  MinidumpRequest request;
+  request.tid = syscall(SYS_gettid);
+  request.num_frames = backtrace(request.frames, MAX_FRAMES);
+
+  if (send(_minidump_fd, &request, sizeof(request), MSG_NOSIGNAL) != sizeof(request))
+  {
+    char buf[256];
+    fprintf(stderr, "Unable to request a minidump. Error: %d %s\n",
+            errno, strerror_r(errno, buf, sizeof(buf)));
+  }
+}
+
+void ExceptionHandler::minidump_helper(int fd, pid_t pid, const std::string& directory)
+{
+  // Don't outlive the process, and don't handle its signals.
+  prctl(PR_SET_PDEATHSIG, SIGKILL, 0, 0, 0);
+  prctl(PR_SET_NAME, "minidump", 0, 0, 0);
+  signal(SIGQUIT, SIG_DFL);
+  signal(SIGABRT, SIG_DFL);
+  signal(SIGSEGV, SIG_DFL);
+
+  MinidumpRequest request;
+
+  while (recv(fd, &request, sizeof(request), 0) == sizeof(request))
+  {
+    write_minidump(request, pid, directory);
+  }
+}
+
+// Write a minidump.  This runs in the helper process, which doesn't log (as it
+// would contend with the process for the log files).
+void ExceptionHandler::write_minidump(const MinidumpRequest& request,
+                                      pid_t pid,
+                                      const std::string& directory)
+{
+  std::string file_name = directory + "/minidump." + std::to_string(pid) + "." +
+                          std::to_string(time(NULL)) + "." +
+                          std::to_string(request.tid) + ".txt";
+  FILE* file = fopen(file_name.c_str(), "w");
+
+  if (file == NULL)
+  {
+    return;
+  }
+
+  fprintf(file, "MINIDUMP\n========\n");
+  fprintf(file, "Exception on thread %d of process %d\n\n", request.tid, pid);
+
+  // The helper was forked from the process, so the addresses on the stack can
+  // be resolved here.
+  fprintf(file, "STACK\n=====\n");
+  fflush(file);
+  backtrace_symbols_fd(request.frames,
+                       std::min(std::max(request.num_frames, 0), (int)MAX_FRAMES),
+                       fileno(file));
+  fprintf(file, "\n");
+
+  // Reading the threads' states from /proc doesn't stop them.
+  fprintf(file, "THREADS\n=======\n");
+  std::string task_dir = "/proc/" + std::to_string(pid) + "/task";
+  DIR* tasks = opendir(task_dir.c_str());
+
+  if (tasks != NULL)
+  {
+    struct dirent* task;
+
+    while ((task = readdir(tasks)) != NULL)
+    {
+      if (task->d_name[0] == '.')
+      {
+        continue;
+      }
+
+      std::string task_path = task_dir + "/" + task->d_name;
+      char stat[512] = "";
+      char wchan[128] = "";
+
+      FILE* stat_file = fopen((task_path + "/stat").c_str(), "r");
+      if (stat_file != NULL)
+      {
+        if (fgets(stat, sizeof(stat), stat_file) == NULL)
+        {
+          stat[0] = '\0';
+        }
+        fclose(stat_file);
+      }
+
+      FILE* wchan_file = fopen((task_path + "/wchan").c_str(), "r");
+      if (wchan_file != NULL)
+      {
+        if (fgets(wchan, sizeof(wchan), wchan_file) == NULL)
+        {
+          wchan[0] = '\0';
+        }
+        fclose(wchan_file);
+      }
+
+      // The stat line is "<tid> (<name>) <state> ...".
+      char* name_end = strrchr(stat, ')');
+      char state = ((name_end != NULL) && (name_end[1] == ' ')) ? name_end[2] : '?';
+      char* name_start = strchr(stat, '(');
+
+      if ((name_start != NULL) && (name_end != NULL) && (name_end > name_start))
+      {
+        *name_end = '\0';
+        ++name_start;
+      }
+      else
+      {
+        name_start = (char*)"?";
+      }
+
+      fprintf(file, "%s%s %-16s %c %s\n",
+              (atoi(task->d_name) == request.tid) ? "*" : " ",
+              task->d_name,
+              name_start,
+              state,
+              wchan);
+    }
+
+    closedir(tasks);
+  }
+
+  fprintf(file, "\n");
+
+  if (!RamRecorder::dump_remote(pid, file))
+  {
+    fprintf(file, "RAM BUFFER\n==========\nFailed to read RAM buffer: %d\n", errno);
+  }
+
+  fclose(file);
+}
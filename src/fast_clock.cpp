@@ -0,0 +1,225 @@
+/**
+ * @file fast_clock.cpp  Cheap monotonic and cached clocks.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+#include "fast_clock.h"
+#include "log.h"
+
+namespace FastClock
+{
+  std::atomic<bool> _tsc_calibrated(false);
+  TscCalibration _tsc_calibration;
+
+  std::atomic<bool> _ticker_running(false);
+  std::atomic<uint64_t> _cached_monotonic_us(0);
+  std::atomic<uint64_t> _cached_realtime_ms(0);
+
+  namespace
+  {
+    uint64_t monotonic_ns()
+    {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+    }
+
+#if (defined(__x86_64__) && !defined(UNIT_TEST))
+    bool invariant_tsc()
+    {
+      unsigned int eax, ebx, ecx, edx;
+      return ((__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) &&
+              ((edx & (1 << 8)) != 0));
+    }
+
+    // Reads the TSC and CLOCK_MONOTONIC at (as near as possible) the same
+    // moment.  The TSC is read between two reads of the clock, keeping the
+    // closest of a few attempts, as reading the clock can occasionally be
+    // slow (and always is the first time).
+    void read_tsc_and_ns(uint64_t& tsc, uint64_t& ns)
+    {
+      uint64_t best_gap = UINT64_MAX;
+
+      for (int ii = 0; ii < 5; ++ii)
+      {
+        uint64_t before = monotonic_ns();
+        uint64_t ticks = __rdtsc();
+        uint64_t after = monotonic_ns();
+
+        if (after - before < best_gap)
+        {
+          best_gap = after - before;
+          tsc = ticks;
+          ns = before + (best_gap / 2);
+        }
+      }
+    }
+
+    // The point the calibration is measured from, taken when the library is
+    // loaded.  Before then (i.e. from other static initializers) the TSC
+    // isn't used.
+    struct CalibrationStart
+    {
+      CalibrationStart() : usable(invariant_tsc()), tsc(0), ns(0)
+      {
+        read_tsc_and_ns(tsc, ns);
+      }
+
+      bool usable;
+      uint64_t tsc;
+      uint64_t ns;
+    };
+
+    CalibrationStart calibration_start;
+    pthread_mutex_t calibration_lock = PTHREAD_MUTEX_INITIALIZER;
+
+    void calibrate()
+    {
+      pthread_mutex_lock(&calibration_lock);
+
+      if (!_tsc_calibrated.load(std::memory_order_relaxed))
+      {
+        uint64_t tsc;
+        uint64_t ns;
+        read_tsc_and_ns(tsc, ns);
+        uint64_t ticks = tsc - calibration_start.tsc;
+
+        // Anchor the TSC clock at the current time, so that it carries on
+        // from CLOCK_MONOTONIC.
+        _tsc_calibration.mult =
+          (uint64_t)((((unsigned __int128)(ns - calibration_start.ns)) << 32) / ticks);
+        _tsc_calibration.tsc0 = tsc;
+        _tsc_calibration.ns0 = ns;
+        _tsc_calibrated.store(true, std::memory_order_release);
+
+        TRC_STATUS("Using the TSC for timing - %lu ticks per microsecond",
+                   (unsigned long)(ticks * 1000 / (ns - calibration_start.ns)));
+      }
+
+      pthread_mutex_unlock(&calibration_lock);
+    }
+#endif
+
+    pthread_t ticker_thread;
+    pthread_mutex_t ticker_lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t ticker_cond;
+    bool ticker_terminated = false;
+    unsigned int ticker_interval_ms = 1;
+
+    void update_cached_clocks()
+    {
+      _cached_monotonic_us.store(_read_us(CLOCK_MONOTONIC), std::memory_order_relaxed);
+      _cached_realtime_ms.store(_read_us(CLOCK_REALTIME) / 1000, std::memory_order_relaxed);
+    }
+
+    void* ticker_fn(void*)
+    {
+      struct timespec next_tick;
+      clock_gettime(CLOCK_MONOTONIC, &next_tick);
+
+      pthread_mutex_lock(&ticker_lock);
+
+      while (!ticker_terminated)
+      {
+        update_cached_clocks();
+
+        next_tick.tv_nsec += ticker_interval_ms * 1000000L;
+        next_tick.tv_sec += next_tick.tv_nsec / 1000000000;
+        next_tick.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&ticker_cond, &ticker_lock, &next_tick);
+      }
+
+      pthread_mutex_unlock(&ticker_lock);
+      return NULL;
+    }
+  }
+
+  uint64_t _slow_now_ns()
+  {
+    uint64_t now = monotonic_ns();
+
+#if (defined(__x86_64__) && !defined(UNIT_TEST))
+    if ((calibration_start.usable) &&
+        (calibration_start.ns != 0) &&
+        (now - calibration_start.ns >= CALIBRATION_MS * 1000000))
+    {
+      calibrate();
+    }
+#endif
+
+    return now;
+  }
+
+  bool using_tsc()
+  {
+    return _tsc_calibrated.load();
+  }
+
+  void start_ticker(unsigned int interval_ms)
+  {
+    pthread_mutex_lock(&ticker_lock);
+
+    if (!_ticker_running.load())
+    {
+      ticker_interval_ms = (interval_ms > 0) ? interval_ms : 1;
+      ticker_terminated = false;
+
+      pthread_condattr_t cond_attr;
+      pthread_condattr_init(&cond_attr);
+      pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+      pthread_cond_init(&ticker_cond, &cond_attr);
+      pthread_condattr_destroy(&cond_attr);
+
+      // Fill in the cached clocks before they are used.
+      update_cached_clocks();
+
+      if (pthread_create(&ticker_thread, NULL, ticker_fn, NULL) == 0)
+      {
+        _ticker_running.store(true);
+      }
+      else
+      {
+        // LCOV_EXCL_START
+        TRC_ERROR("Failed to start the clock ticker thread");
+        pthread_cond_destroy(&ticker_cond);
+        // LCOV_EXCL_STOP
+      }
+    }
+
+    pthread_mutex_unlock(&ticker_lock);
+  }
+
+  void stop_ticker()
+  {
+    pthread_mutex_lock(&ticker_lock);
+
+    if (!_ticker_running.load())
+    {
+      pthread_mutex_unlock(&ticker_lock);
+      return;
+    }
+
+    ticker_terminated = true;
+    pthread_cond_signal(&ticker_cond);
+    pthread_mutex_unlock(&ticker_lock);
+
+    pthread_join(ticker_thread, NULL);
+
+    pthread_mutex_lock(&ticker_lock);
+    _ticker_running.store(false);
+    pthread_cond_destroy(&ticker_cond);
+    pthread_mutex_unlock(&ticker_lock);
+  }
+}
@@ -0,0 +1,442 @@
+/**
+ * @file fiber_pool.cpp  Runs functions as fibers on a few threads.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "fiber_pool.h"
+
+// The most events to handle per call to epoll_wait.
+static const int MAX_EVENTS = 64;
+
+// The most stacks each thread keeps for reuse once their fibers finish.
+static const size_t MAX_FREE_STACKS = 64;
+
+// The guard page below each stack, which catches stack overflows.
+static const size_t GUARD_SIZE = 4096;
+
+thread_local FiberPool::Fiber* FiberPool::_current = NULL;
+
+FiberPool::FiberPool(unsigned int num_threads,
+                     unsigned int max_fibers,
+                     size_t stack_size) :
+  _num_threads(num_threads),
+  _max_fibers(max_fibers),
+  _stack_size(stack_size),
+  _workers(),
+  _next_worker(0),
+  _terminated(false),
+  _started(false)
+{
+  for (unsigned int ii = 0; ii < _num_threads; ++ii)
+  {
+    Worker* worker = new Worker();
+    worker->pool = this;
+    worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    worker->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    worker->num_fibers = 0;
+    pthread_mutex_init(&worker->lock, NULL);
+
+    // The event FD is the only one registered without a fiber.
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->event_fd, &event);
+
+    _workers.push_back(worker);
+  }
+}
+
+FiberPool::~FiberPool()
+{
+  if (_started)
+  {
+    stop();
+    join();
+  }
+
+  for (std::vector<Worker*>::iterator it = _workers.begin();
+       it != _workers.end();
+       ++it)
+  {
+    Worker* worker = *it;
+
+    for (std::vector<char*>::iterator stack = worker->free_stacks.begin();
+         stack != worker->free_stacks.end();
+         ++stack)
+    {
+      munmap(*stack, GUARD_SIZE + _stack_size);
+    }
+
+    close(worker->event_fd);
+    close(worker->epoll_fd);
+    pthread_mutex_destroy(&worker->lock);
+    delete worker;
+  }
+}
+
+bool FiberPool::start()
+{
+  for (std::vector<Worker*>::iterator it = _workers.begin();
+       it != _workers.end();
+       ++it)
+  {
+    int rc = pthread_create(&(*it)->thread, NULL, worker_thread_fn, *it);
+
+    if (rc != 0)
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to start fiber thread: %s", strerror(rc));
+      stop();
+
+      for (std::vector<Worker*>::iterator started = _workers.begin();
+           started != it;
+           ++started)
+      {
+        pthread_join((*started)->thread, NULL);
+      }
+
+      return false;
+      // LCOV_EXCL_STOP
+    }
+  }
+
+  _started = true;
+  return true;
+}
+
+void FiberPool::stop()
+{
+  _terminated = true;
+
+  for (std::vector<Worker*>::iterator it = _workers.begin();
+       it != _workers.end();
+       ++it)
+  {
+    uint64_t one = 1;
+    ssize_t rc = write((*it)->event_fd, &one, sizeof(one));
+    (void)rc;
+  }
+}
+
+void FiberPool::join()
+{
+  if (_started)
+  {
+    for (std::vector<Worker*>::iterator it = _workers.begin();
+         it != _workers.end();
+         ++it)
+    {
+      pthread_join((*it)->thread, NULL);
+    }
+
+    _started = false;
+  }
+}
+
+void FiberPool::run(std::function<void()> fn)
+{
+  if (_terminated)
+  {
+    TRC_WARNING("Fiber pool has stopped - discarding work");
+    return;
+  }
+
+  Worker* worker = _workers[_next_worker++ % _workers.size()];
+
+  pthread_mutex_lock(&worker->lock);
+  worker->queue.push_back(std::move(fn));
+  pthread_mutex_unlock(&worker->lock);
+
+  uint64_t one = 1;
+  ssize_t rc = write(worker->event_fd, &one, sizeof(one));
+  (void)rc;
+}
+
+short FiberPool::wait(int fd, short events, int timeout_ms)
+{
+  Fiber* fiber = _current;
+
+  if (fiber == NULL)
+  {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = events;
+    pfd.revents = 0;
+    int rc;
+
+    do
+    {
+      rc = poll(&pfd, 1, timeout_ms);
+    }
+    while ((rc < 0) && (errno == EINTR));
+
+    return (rc > 0) ? pfd.revents : ((rc < 0) ? POLLERR : 0);
+  }
+
+  Worker* worker = fiber->worker;
+  struct epoll_event event;
+  event.events = ((events & POLLIN) ? (uint32_t)EPOLLIN : 0) |
+                 ((events & POLLOUT) ? (uint32_t)EPOLLOUT : 0);
+  event.data.ptr = fiber;
+
+  if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)
+  {
+    TRC_WARNING("Failed to wait for socket %d: %s", fd, strerror(errno)); // LCOV_EXCL_LINE
+    return POLLERR; // LCOV_EXCL_LINE
+  }
+
+  fiber->fd = fd;
+  fiber->revents = 0;
+  fiber->timer = (timeout_ms >= 0) ?
+    worker->timers.insert(std::make_pair(now_ms() + timeout_ms, fiber)) :
+    worker->timers.end();
+
+  // Switch back to the worker, which resumes us once the socket is ready or
+  // the timeout expires.
+  swapcontext(&fiber->context, &worker->context);
+
+  return fiber->revents;
+}
+
+bool FiberPool::on_fiber()
+{
+  return (_current != NULL);
+}
+
+void* FiberPool::worker_thread_fn(void* worker)
+{
+  Worker* w = (Worker*)worker;
+  w->pool->worker_thread_fn(w);
+  return NULL;
+}
+
+void FiberPool::worker_thread_fn(Worker* worker)
+{
+  struct epoll_event events[MAX_EVENTS];
+
+  while (true)
+  {
+    if (!_terminated)
+    {
+      start_fibers(worker);
+    }
+    else
+    {
+      pthread_mutex_lock(&worker->lock);
+      worker->queue.clear();
+      pthread_mutex_unlock(&worker->lock);
+
+      if (worker->num_fibers == 0)
+      {
+        break;
+      }
+    }
+
+    // Run the fibers that are ready, until they finish or wait.
+    while (!worker->runnable.empty())
+    {
+      Fiber* fiber = worker->runnable.front();
+      worker->runnable.pop_front();
+
+      _current = fiber;
+      swapcontext(&worker->context, &fiber->context);
+      _current = NULL;
+
+      if (fiber->finished)
+      {
+        finish_fiber(worker, fiber);
+      }
+    }
+
+    // Wait for a fiber's socket, its timeout, or more work.
+    int timeout_ms = -1;
+
+    if (!worker->timers.empty())
+    {
+      unsigned long now = now_ms();
+      unsigned long due = worker->timers.begin()->first;
+      timeout_ms = (due > now) ? (int)(due - now) : 0;
+    }
+
+    int num_events = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, timeout_ms);
+
+    for (int ii = 0; ii < num_events; ++ii)
+    {
+      Fiber* fiber = (Fiber*)events[ii].data.ptr;
+
+      if (fiber == NULL)
+      {
+        uint64_t count;
+        ssize_t rc = read(worker->event_fd, &count, sizeof(count));
+        (void)rc;
+      }
+      else
+      {
+        uint32_t e = events[ii].events;
+        wake(fiber,
+             ((e & EPOLLIN) ? POLLIN : 0) |
+             ((e & EPOLLOUT) ? POLLOUT : 0) |
+             ((e & EPOLLERR) ? POLLERR : 0) |
+             ((e & EPOLLHUP) ? POLLHUP : 0));
+      }
+    }
+
+    unsigned long now = now_ms();
+
+    while ((!worker->timers.empty()) &&
+           (worker->timers.begin()->first <= now))
+    {
+      wake(worker->timers.begin()->second, 0);
+    }
+  }
+}
+
+void FiberPool::fiber_fn()
+{
+  Fiber* fiber = _current;
+
+  try
+  {
+    fiber->fn();
+  }
+  // LCOV_EXCL_START
+  catch (...)
+  {
+    TRC_ERROR("Unhandled exception on fiber");
+  }
+  // LCOV_EXCL_STOP
+
+  // Free anything the function holds while we're still on its stack, then
+  // return to the worker (the context's uc_link).
+  fiber->fn = nullptr;
+  fiber->finished = true;
+}
+
+void FiberPool::start_fibers(Worker* worker)
+{
+  std::deque<std::function<void()>> fns;
+
+  pthread_mutex_lock(&worker->lock);
+
+  while ((!worker->queue.empty()) &&
+         ((_max_fibers == 0) || (worker->num_fibers + fns.size() < _max_fibers)))
+  {
+    fns.push_back(std::move(worker->queue.front()));
+    worker->queue.pop_front();
+  }
+
+  pthread_mutex_unlock(&worker->lock);
+
+  for (std::deque<std::function<void()>>::iterator it = fns.begin();
+       it != fns.end();
+       ++it)
+  {
+    char* stack = allocate_stack(worker);
+
+    if (stack == NULL)
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to allocate fiber stack - running work on the fiber thread");
+      (*it)();
+      continue;
+      // LCOV_EXCL_STOP
+    }
+
+    Fiber* fiber = new Fiber();
+    fiber->stack = stack;
+    fiber->fn = std::move(*it);
+    fiber->worker = worker;
+    fiber->finished = false;
+    fiber->fd = -1;
+    fiber->revents = 0;
+    fiber->timer = worker->timers.end();
+
+    getcontext(&fiber->context);
+    fiber->context.uc_stack.ss_sp = stack + GUARD_SIZE;
+    fiber->context.uc_stack.ss_size = _stack_size;
+    fiber->context.uc_link = &worker->context;
+    makecontext(&fiber->context, fiber_fn, 0);
+
+    worker->runnable.push_back(fiber);
+    ++worker->num_fibers;
+  }
+}
+
+void FiberPool::wake(Fiber* fiber, short revents)
+{
+  Worker* worker = fiber->worker;
+  epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, fiber->fd, NULL);
+
+  if (fiber->timer != worker->timers.end())
+  {
+    worker->timers.erase(fiber->timer);
+    fiber->timer = worker->timers.end();
+  }
+
+  fiber->fd = -1;
+  fiber->revents = revents;
+  worker->runnable.push_back(fiber);
+}
+
+void FiberPool::finish_fiber(Worker* worker, Fiber* fiber)
+{
+  if (worker->free_stacks.size() < MAX_FREE_STACKS)
+  {
+    worker->free_stacks.push_back(fiber->stack);
+  }
+  else
+  {
+    munmap(fiber->stack, GUARD_SIZE + _stack_size);
+  }
+
+  delete fiber;
+  --worker->num_fibers;
+}
+
+char* FiberPool::allocate_stack(Worker* worker)
+{
+  if (!worker->free_stacks.empty())
+  {
+    char* stack = worker->free_stacks.back();
+    worker->free_stacks.pop_back();
+    return stack;
+  }
+
+  void* stack = mmap(NULL,
+                     GUARD_SIZE + _stack_size,
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+                     -1,
+                     0);
+
+  if (stack == MAP_FAILED)
+  {
+    return NULL; // LCOV_EXCL_LINE
+  }
+
+  mprotect(stack, GUARD_SIZE, PROT_NONE);
+  return (char*)stack;
+}
+
+unsigned long FiberPool::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -10,6 +10,7 @@
  */
 
 
+#include <algorithm>
 #include <cassert>
 #include "time.h"
 
@@ -17,6 +18,8 @@
 #include "log.h"
 
 HealthChecker::HealthChecker() :
+  _heartbeats(),
+  _latency_checks(),
   _recent_passes(0),
   _hit_exception(false),
   _terminate(false)
@@ -29,14 +32,99 @@ HealthChecker::HealthChecker() :
   pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
   pthread_cond_init(&_condvar, &cond_attr);
   pthread_condattr_destroy(&cond_attr);
+
+  pthread_mutex_init(&_signals_lock, NULL);
 }
 
 HealthChecker::~HealthChecker()
 {
+  pthread_mutex_destroy(&_signals_lock);
   pthread_cond_destroy(&_condvar);
   pthread_mutex_destroy(&_condvar_lock);
 }
 
+HealthChecker::Heartbeat* HealthChecker::register_heartbeat(const std::string& name,
+                                                            unsigned int deadline_ms)
+{
+  Heartbeat* heartbeat = new Heartbeat(name, deadline_ms);
+
+  pthread_mutex_lock(&_signals_lock);
+  _heartbeats.push_back(heartbeat);
+  pthread_mutex_unlock(&_signals_lock);
+
+  return heartbeat;
+}
+
+void HealthChecker::unregister_heartbeat(Heartbeat* heartbeat)
+{
+  pthread_mutex_lock(&_signals_lock);
+  _heartbeats.erase(std::remove(_heartbeats.begin(), _heartbeats.end(), heartbeat),
+                    _heartbeats.end());
+  pthread_mutex_unlock(&_signals_lock);
+
+  delete heartbeat;
+}
+
+void HealthChecker::add_latency_check(const std::string& name,
+                                      LatencySource source,
+                                      uint64_t max_latency_us)
+{
+  LatencyCheck check;
+  check.name = name;
+  check.source = source;
+  check.max_latency_us = max_latency_us;
+
+  pthread_mutex_lock(&_signals_lock);
+  _latency_checks.push_back(check);
+  pthread_mutex_unlock(&_signals_lock);
+}
+
+bool HealthChecker::is_ready(std::string& reason)
+{
+  bool ready = true;
+  uint64_t now_ms = FastClock::cached_monotonic_us() / 1000;
+
+  pthread_mutex_lock(&_signals_lock);
+
+  for (std::vector<Heartbeat*>::const_iterator it = _heartbeats.begin();
+       (ready) && (it != _heartbeats.end());
+       ++it)
+  {
+    uint64_t busy_since_ms = (*it)->_busy_since_ms.load(std::memory_order_relaxed);
+
+    if ((busy_since_ms != 0) &&
+        (now_ms > busy_since_ms + (*it)->_deadline_ms))
+    {
+      reason = (*it)->_name + " stalled for " +
+               std::to_string(now_ms - busy_since_ms) + "ms";
+      ready = false;
+    }
+  }
+
+  for (std::vector<LatencyCheck>::const_iterator it = _latency_checks.begin();
+       (ready) && (it != _latency_checks.end());
+       ++it)
+  {
+    uint64_t latency_us = it->source();
+
+    if (latency_us > it->max_latency_us)
+    {
+      reason = it->name + " latency " + std::to_string(latency_us) +
+               "us is over " + std::to_string(it->max_latency_us) + "us";
+      ready = false;
+    }
+  }
+
+  pthread_mutex_unlock(&_signals_lock);
+
+  if (!ready)
+  {
+    TRC_DEBUG("Not ready: %s", reason.c_str());
+  }
+
+  return ready;
+}
+
 void HealthChecker::hit_exception()
 {
   _hit_exception = true;
@@ -22,8 +22,17 @@ HttpConnectionPool::HttpConnectionPool(LoadMonitor* load_monitor,
   _stat_table(stat_table),
   _connection_timeout_ms(remote_connection ? REMOTE_CONNECTION_LATENCY_MS :
                                              LOCAL_CONNECTION_LATENCY_MS),
-  _source_address(source_address)
+  _source_address(source_address),
+  _http2(false),
+  _socket_ips(),
+  _adaptive_multiplier(0),
+  _min_timeout_ms(0),
+  _min_connect_timeout_ms(0),
+  _target_timeouts()
 {
+  pthread_mutex_init(&_sockets_lock, NULL);
+  pthread_rwlock_init(&_timeouts_lock, NULL);
+
   if (timeout_ms != -1)
   {
     _timeout_ms = timeout_ms;
@@ -36,6 +45,9 @@ HttpConnectionPool::HttpConnectionPool(LoadMonitor* load_monitor,
                                                               DEFAULT_LATENCY_US);
     TRC_STATUS("Connection pool will use calculated response timeout of %ldms", _timeout_ms);
   }
+
+  // Free idle connections in the background, rather than on every release.
+  start_idle_reaper();
 }
 
 CURL* HttpConnectionPool::create_connection(AddrInfo target)
@@ -80,9 +92,19 @@ CURL* HttpConnectionPool::create_connection(AddrInfo target)
 
   curl_easy_setopt(conn, CURLOPT_VERBOSE, 1L);
 
+  if (_http2)
+  {
+    // Connections outlive the CURL handle that opened them, so count them as
+    // their sockets are opened and closed. open_socket also binds the socket
+    // to the source address, if there is one.
+    curl_easy_setopt(conn, CURLOPT_OPENSOCKETFUNCTION, &HttpConnectionPool::open_socket_fn);
+    curl_easy_setopt(conn, CURLOPT_OPENSOCKETDATA, this);
+    curl_easy_setopt(conn, CURLOPT_CLOSESOCKETFUNCTION, &HttpConnectionPool::close_socket_fn);
+    curl_easy_setopt(conn, CURLOPT_CLOSESOCKETDATA, this);
+  }
   // If we've been asked to connect from a specific address, get cURL to ask us
   // when starting up a new socket.
-  if (!_source_address.empty())
+  else if (!_source_address.empty())
   {
     // LCOV_EXCL_START - we don't test sending from a source address in UT. This
     // is tested in clearwater-fv-test instead.
@@ -91,7 +113,10 @@ CURL* HttpConnectionPool::create_connection(AddrInfo target)
     // LCOV_EXCL_STOP
   }
 
-  increment_statistic(target, conn);
+  if (!_http2)
+  {
+    increment_statistic(target, conn);
+  }
 
   return conn;
 }
@@ -136,9 +161,18 @@ void HttpConnectionPool::decrement_statistic(AddrInfo target, CURL* conn)
   }
 }
 
+void HttpConnectionPool::set_http2(bool http2)
+{
+  _http2 = http2;
+}
+
 void HttpConnectionPool::destroy_connection(AddrInfo target, CURL* conn)
 {
-  decrement_statistic(target, conn);
+  if (!_http2)
+  {
+    decrement_statistic(target, conn);
+  }
+
   curl_slist *host_resolve = NULL;
   curl_easy_getinfo(conn, CURLINFO_PRIVATE, &host_resolve);
   if (host_resolve != NULL)
@@ -162,6 +196,9 @@ void HttpConnectionPool::release_connection(ConnectionInfo<CURL*>* conn_info,
     curl_easy_setopt(conn, CURLOPT_CUSTOMREQUEST, NULL);
     curl_easy_setopt(conn, CURLOPT_WRITEHEADER, NULL);
     curl_easy_setopt(conn, CURLOPT_POSTFIELDS, NULL);
+    curl_easy_setopt(conn, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)-1);
+    curl_easy_setopt(conn, CURLOPT_READFUNCTION, NULL);
+    curl_easy_setopt(conn, CURLOPT_READDATA, NULL);
     curl_easy_setopt(conn, CURLOPT_HEADERFUNCTION, NULL);
     curl_easy_setopt(conn, CURLOPT_POST, 0);
   }
@@ -173,8 +210,140 @@ long HttpConnectionPool::calc_req_timeout_from_latency(int latency_us)
   return _connection_timeout_ms + std::max(1, (latency_us * TIMEOUT_LATENCY_MULTIPLIER) / 1000);
 }
 
-// LCOV_EXCL_START - we don't test sending from a source address in UT. This
-// is tested in clearwater-fv-test instead.
+HttpConnectionPool::TargetTimeouts::TargetTimeouts(long timeout_ms,
+                                                   long connect_timeout_ms) :
+  timeout_ms(timeout_ms),
+  connect_timeout_ms(connect_timeout_ms),
+  next_update_ms(0)
+{
+  pthread_mutex_init(&update_lock, NULL);
+  memset(&latency_base, 0, sizeof(latency_base));
+  memset(&connect_latency_base, 0, sizeof(connect_latency_base));
+}
+
+void HttpConnectionPool::set_adaptive_timeouts(float multiplier,
+                                               long min_timeout_ms,
+                                               long min_connect_timeout_ms)
+{
+  _adaptive_multiplier = multiplier;
+  _min_timeout_ms = min_timeout_ms;
+  _min_connect_timeout_ms = min_connect_timeout_ms;
+}
+
+HttpConnectionPool::TargetTimeouts*
+  HttpConnectionPool::target_timeouts(const AddrInfo& target)
+{
+  pthread_rwlock_rdlock(&_timeouts_lock);
+  std::map<AddrInfo, TargetTimeouts*>::iterator it = _target_timeouts.find(target);
+  TargetTimeouts* timeouts = (it != _target_timeouts.end()) ? it->second : NULL;
+  pthread_rwlock_unlock(&_timeouts_lock);
+
+  if (timeouts == NULL)
+  {
+    pthread_rwlock_wrlock(&_timeouts_lock);
+    TargetTimeouts*& entry = _target_timeouts[target];
+
+    if (entry == NULL)
+    {
+      entry = new TargetTimeouts(_timeout_ms, _connection_timeout_ms);
+    }
+
+    timeouts = entry;
+    pthread_rwlock_unlock(&_timeouts_lock);
+  }
+
+  return timeouts;
+}
+
+void HttpConnectionPool::set_request_timeouts(CURL* conn, const AddrInfo& target)
+{
+  if (_adaptive_multiplier <= 0)
+  {
+    // The fixed timeouts were set when the connection was created.
+    return;
+  }
+
+  TargetTimeouts* timeouts = target_timeouts(target);
+  curl_easy_setopt(conn, CURLOPT_TIMEOUT_MS, timeouts->timeout_ms.load());
+  curl_easy_setopt(conn, CURLOPT_CONNECTTIMEOUT_MS, timeouts->connect_timeout_ms.load());
+}
+
+void HttpConnectionPool::request_completed(CURL* conn,
+                                           const AddrInfo& target,
+                                           uint64_t latency_us)
+{
+  if (_adaptive_multiplier <= 0)
+  {
+    return;
+  }
+
+  TargetTimeouts* timeouts = target_timeouts(target);
+  timeouts->latency.record(latency_us);
+
+  long num_connects = 0;
+  double connect_s = 0;
+
+  if ((curl_easy_getinfo(conn, CURLINFO_NUM_CONNECTS, &num_connects) == CURLE_OK) &&
+      (num_connects > 0) &&
+      (curl_easy_getinfo(conn, CURLINFO_CONNECT_TIME, &connect_s) == CURLE_OK) &&
+      (connect_s > 0))
+  {
+    timeouts->connect_latency.record((uint64_t)(connect_s * 1000000));
+  }
+
+  update_timeouts(timeouts);
+}
+
+void HttpConnectionPool::update_timeouts(TargetTimeouts* timeouts)
+{
+  static const uint64_t UPDATE_INTERVAL_MS = 1000;
+
+  uint64_t now_ms = Utils::get_time();
+
+  if ((now_ms < timeouts->next_update_ms.load(std::memory_order_relaxed)) ||
+      (pthread_mutex_trylock(&timeouts->update_lock) != 0))
+  {
+    return;
+  }
+
+  timeouts->next_update_ms = now_ms + UPDATE_INTERVAL_MS;
+  update_timeout(timeouts->latency,
+                 timeouts->latency_base,
+                 _min_timeout_ms,
+                 _timeout_ms,
+                 timeouts->timeout_ms);
+  update_timeout(timeouts->connect_latency,
+                 timeouts->connect_latency_base,
+                 _min_connect_timeout_ms,
+                 _connection_timeout_ms,
+                 timeouts->connect_timeout_ms);
+  pthread_mutex_unlock(&timeouts->update_lock);
+}
+
+void HttpConnectionPool::update_timeout(const LatencyHistogram& latency,
+                                        LatencyHistogram::Snapshot& base,
+                                        long min_timeout_ms,
+                                        long max_timeout_ms,
+                                        std::atomic<long>& timeout_ms)
+{
+  // The fewest latencies to calculate the timeout from, so that the 99th
+  // percentile means something.
+  static const uint64_t MIN_SAMPLES = 100;
+
+  LatencyHistogram::Snapshot snapshot;
+  latency.snapshot(snapshot);
+  LatencyHistogram::Snapshot recent = snapshot;
+  recent.subtract(base);
+
+  if (recent.count >= MIN_SAMPLES)
+  {
+    long new_timeout_ms =
+      (long)(recent.percentile_us(99) * _adaptive_multiplier / 1000);
+    timeout_ms = std::min(std::max(new_timeout_ms, min_timeout_ms), max_timeout_ms);
+    base = snapshot;
+  }
+}
+
 curl_socket_t HttpConnectionPool::open_socket_fn(void *clientp,
                                                  curlsocktype purpose,
                                                  struct curl_sockaddr *address)
@@ -190,10 +359,49 @@ curl_socket_t HttpConnectionPool::open_socket(curlsocktype purpose,
 
   if (fd <= 0)
   {
+    // LCOV_EXCL_START
     TRC_ERROR("Error creating socket %d (%s)", errno, strerror(errno));
     return -1;
+    // LCOV_EXCL_STOP
+  }
+
+  if ((!_source_address.empty()) && (!bind_to_source_address(fd, address)))
+  {
+    // LCOV_EXCL_START - see bind_to_source_address
+    close(fd);
+    return -1;
+    // LCOV_EXCL_STOP
+  }
+
+  if (_http2)
+  {
+    char buf[100];
+    const void* addr = (address->family == AF_INET) ?
+           (const void*)&((struct sockaddr_in*)&address->addr)->sin_addr :
+           (const void*)&((struct sockaddr_in6*)&address->addr)->sin6_addr;
+    const char* ip_address = inet_ntop(address->family, addr, buf, sizeof(buf));
+
+    if (ip_address != NULL)
+    {
+      pthread_mutex_lock(&_sockets_lock);
+      _socket_ips[fd] = ip_address;
+      pthread_mutex_unlock(&_sockets_lock);
+
+      if (_stat_table)
+      {
+        _stat_table->get(ip_address)->increment();
+      }
+    }
   }
 
+  return fd;
+}
+
+// LCOV_EXCL_START - we don't test sending from a source address in UT. This
+// is tested in clearwater-fv-test instead.
+bool HttpConnectionPool::bind_to_source_address(int fd,
+                                                struct curl_sockaddr *address)
+{
   TRC_DEBUG("Bind socket %d to address %s", fd, _source_address.c_str());
 
   struct sockaddr_storage sa_storage = {0};
@@ -225,16 +433,43 @@ curl_socket_t HttpConnectionPool::open_socket(curlsocktype purpose,
     {
       TRC_ERROR("Error %d (%s) trying to bind to address %s in family %d",
                 errno, strerror(errno), _source_address.c_str(), address->family);
-      return -1;
+      return false;
     }
   }
   else
   {
     TRC_ERROR("inet_pton() returned %d when parsing address %s in family %d",
               rc, _source_address.c_str(), address->family);
-    return -1;
+    return false;
   }
 
-  return fd;
+  return true;
 }
 // LCOV_EXCL_STOP
+
+int HttpConnectionPool::close_socket_fn(void* clientp, curl_socket_t fd)
+{
+  HttpConnectionPool* pool = static_cast<HttpConnectionPool*>(clientp);
+  return pool->close_socket(fd);
+}
+
+int HttpConnectionPool::close_socket(curl_socket_t fd)
+{
+  std::string ip_address;
+
+  pthread_mutex_lock(&_sockets_lock);
+  std::map<curl_socket_t, std::string>::iterator it = _socket_ips.find(fd);
+  if (it != _socket_ips.end())
+  {
+    ip_address = it->second;
+    _socket_ips.erase(it);
+  }
+  pthread_mutex_unlock(&_sockets_lock);
+
+  if ((_stat_table) && (!ip_address.empty()))
+  {
+    _stat_table->get(ip_address)->decrement();
+  }
+
+  return close(fd);
+}
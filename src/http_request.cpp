@@ -26,6 +26,35 @@ HttpRequest::~HttpRequest() {}
 HttpRequest& HttpRequest::set_body(const std::string& body)
 {
   _body = body;
+  _body_data = NULL;
+  _body_provider = nullptr;
+  return *this;
+}
+
+HttpRequest& HttpRequest::set_body(std::string&& body)
+{
+  _body = std::move(body);
+  _body_data = NULL;
+  _body_provider = nullptr;
+  return *this;
+}
+
+HttpRequest& HttpRequest::set_body_buffer(const char* data, size_t length)
+{
+  _body.clear();
+  _body_data = data;
+  _body_length = length;
+  _body_provider = nullptr;
+  return *this;
+}
+
+HttpRequest& HttpRequest::set_body_provider(HttpClient::BodyProvider provider,
+                                            long long size)
+{
+  _body.clear();
+  _body_data = NULL;
+  _body_provider = std::move(provider);
+  _body_size = size;
   return *this;
 }
 
@@ -47,6 +76,19 @@ HttpRequest& HttpRequest::set_username(const std::string& username)
   return *this;
 }
 
+HttpRequest& HttpRequest::set_response_buffer(std::string* buffer)
+{
+  _response_buffer = buffer;
+  return *this;
+}
+
+HttpRequest& HttpRequest::set_template(
+                  std::shared_ptr<const HttpRequestTemplate> request_template)
+{
+  _template = std::move(request_template);
+  return *this;
+}
+
 ///
 // ADD methods
 ///
@@ -64,6 +106,34 @@ HttpResponse HttpRequest::send()
   return _client->send_request(*this);
 }
 
+void HttpRequest::send_async(HttpClient::ResponseCallback callback)
+{
+  _client->send_request_async(*this, std::move(callback));
+}
+
+///
+// HTTP Request Template Object
+///
+HttpRequestTemplate::HttpRequestTemplate(const std::vector<std::string>& headers) :
+  _headers(headers),
+  _header_list(NULL)
+{
+  for (std::vector<std::string>::const_iterator i = _headers.begin();
+       i != _headers.end();
+       ++i)
+  {
+    _header_list = curl_slist_append(_header_list, (*i).c_str());
+  }
+
+  // Stop cURL adding `Expect: 100-continue` (see HttpClient::HttpClient).
+  _header_list = curl_slist_append(_header_list, "Expect:");
+}
+
+HttpRequestTemplate::~HttpRequestTemplate()
+{
+  curl_slist_free_all(_header_list); _header_list = NULL;
+}
+
 ///
 // HTTP Response Object
 ///
@@ -73,7 +143,29 @@ HttpResponse::HttpResponse(
                 const std::map<std::string, std::string>& headers) :
     _rc(return_code),
     _body(body),
-    _headers(headers)
+    _headers(headers),
+    _headers_parsed(true)
+    {}
+
+HttpResponse::HttpResponse(
+                HTTPCode return_code,
+                std::string&& body,
+                std::map<std::string, std::string>&& headers) :
+    _rc(return_code),
+    _body(std::move(body)),
+    _headers(std::move(headers)),
+    _headers_parsed(true)
+    {}
+
+HttpResponse::HttpResponse(
+                HTTPCode return_code,
+                std::string&& body,
+                std::string&& raw_headers,
+                RawHeaders) :
+    _rc(return_code),
+    _body(std::move(body)),
+    _raw_headers(std::move(raw_headers)),
+    _headers_parsed(false)
     {}
 
 HttpResponse::~HttpResponse() {}
@@ -86,12 +178,34 @@ HTTPCode HttpResponse::get_rc()
   return _rc;
 }
 
-std::string HttpResponse::get_body()
+const std::string& HttpResponse::get_body() const
 {
   return _body;
 }
 
-std::map<std::string, std::string> HttpResponse::get_headers()
+const std::map<std::string, std::string>& HttpResponse::get_headers() const
 {
+  parse_headers();
   return _headers;
 }
+
+std::string HttpResponse::take_body()
+{
+  return std::move(_body);
+}
+
+std::map<std::string, std::string> HttpResponse::take_headers()
+{
+  parse_headers();
+  return std::move(_headers);
+}
+
+void HttpResponse::parse_headers() const
+{
+  if (!_headers_parsed)
+  {
+    HttpClient::parse_headers(_raw_headers, _headers);
+    _raw_headers.clear();
+    _headers_parsed = true;
+  }
+}
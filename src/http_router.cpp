@@ -0,0 +1,362 @@
+/**
+ * @file http_router.cpp  Maps request paths to the handlers registered for them.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <cstring>
+
+#include "http_router.h"
+#include "utils.h"
+#include "log.h"
+
+// The characters that have a special meaning in an extended regex.
+static const char* REGEX_SPECIAL_CHARS = ".[]()*+?{}|^$\\";
+
+HttpRouter::HttpRouter() :
+  _root(),
+  _regexes(),
+  _next_id(0)
+{
+}
+
+HttpRouter::~HttpRouter()
+{
+  for (std::vector<RegexRoute*>::iterator it = _regexes.begin();
+       it != _regexes.end();
+       ++it)
+  {
+    regfree(&(*it)->regex);
+    delete *it;
+  }
+}
+
+int HttpRouter::add_route(const std::string& route)
+{
+  if (route.empty() || (route[0] != '/'))
+  {
+    TRC_ERROR("Invalid HTTP route %s", route.c_str());
+    return NO_MATCH;
+  }
+
+  std::vector<Segment> segments;
+  std::vector<std::string> parts;
+  Utils::split_string(route.substr(1), '/', parts, 0, false, false, true);
+
+  for (std::vector<std::string>::const_iterator part = parts.begin();
+       part != parts.end();
+       ++part)
+  {
+    Segment segment;
+
+    if ((part->size() > 2) && ((*part)[0] == '{') && ((*part)[part->size() - 1] == '}'))
+    {
+      segment.type = Segment::PARAM;
+      segment.value = part->substr(1, part->size() - 2);
+    }
+    else
+    {
+      segment.type = Segment::LITERAL;
+      segment.value = *part;
+    }
+
+    if (segment.value.find_first_of("{}") != std::string::npos)
+    {
+      TRC_ERROR("Invalid HTTP route %s", route.c_str());
+      return NO_MATCH;
+    }
+
+    segments.push_back(segment);
+  }
+
+  int id = _next_id++;
+  add_segments(segments, id);
+  TRC_DEBUG("Added HTTP route %s (%d)", route.c_str(), id);
+
+  return id;
+}
+
+int HttpRouter::add_regex(const std::string& regex)
+{
+  std::vector<Segment> segments;
+
+  if (parse_simple_regex(regex, segments))
+  {
+    int id = _next_id++;
+    add_segments(segments, id);
+    TRC_DEBUG("Added HTTP route %s (%d)", regex.c_str(), id);
+
+    return id;
+  }
+
+  // The regex can't be stored in the trie, so compile it. Use the same flags
+  // as libevhtp's regex callbacks.
+  RegexRoute* regex_route = new RegexRoute();
+
+  if (regcomp(&regex_route->regex, regex.c_str(), REG_EXTENDED | REG_NOSUB) != 0)
+  {
+    TRC_ERROR("Invalid HTTP route regex %s", regex.c_str());
+    delete regex_route; regex_route = NULL;
+    return NO_MATCH;
+  }
+
+  regex_route->id = _next_id++;
+  _regexes.push_back(regex_route);
+  TRC_DEBUG("Added HTTP route regex %s (%d)", regex.c_str(), regex_route->id);
+
+  return regex_route->id;
+}
+
+void HttpRouter::add_segments(const std::vector<Segment>& segments, int id)
+{
+  Node* node = &_root;
+  std::vector<std::string> param_names;
+
+  for (std::vector<Segment>::const_iterator segment = segments.begin();
+       segment != segments.end();
+       ++segment)
+  {
+    std::unique_ptr<Node>* child;
+
+    switch (segment->type)
+    {
+    case Segment::LITERAL:
+      child = &node->literals[segment->value];
+      break;
+
+    case Segment::PARAM:
+      child = &node->param;
+      param_names.push_back(segment->value);
+      break;
+
+    case Segment::OPTIONAL_PARAM:
+    default:
+      child = &node->optional_param;
+      param_names.push_back(segment->value);
+      break;
+    }
+
+    if (*child == nullptr)
+    {
+      child->reset(new Node());
+    }
+
+    node = child->get();
+  }
+
+  // If an earlier route has the same segments, it always matches first.
+  if (node->id == NO_MATCH)
+  {
+    node->id = id;
+    node->param_names = param_names;
+  }
+}
+
+bool HttpRouter::parse_simple_regex(const std::string& regex,
+                                    std::vector<Segment>& segments)
+{
+  // The regex must match the whole path, so must be anchored at both ends.
+  if ((regex.size() < 3) ||
+      (regex[0] != '^') ||
+      (regex[1] != '/') ||
+      (regex[regex.size() - 1] != '$') ||
+      (regex[regex.size() - 2] == '\\'))
+  {
+    return false;
+  }
+
+  // The wildcards that match a whole segment. These contain slashes, so the
+  // regex can't just be split into segments first.
+  static const struct
+  {
+    const char* regex;
+    Segment::Type type;
+  } WILDCARDS[] = {{"[^/]+", Segment::PARAM},
+                   {"([^/]+)", Segment::PARAM},
+                   {"[^/]*", Segment::OPTIONAL_PARAM},
+                   {"([^/]*)", Segment::OPTIONAL_PARAM}};
+
+  size_t end = regex.size() - 1;
+  size_t pos = 2;
+
+  while (true)
+  {
+    Segment segment;
+    segment.type = Segment::LITERAL;
+
+    for (size_t ii = 0; ii < sizeof(WILDCARDS) / sizeof(WILDCARDS[0]); ++ii)
+    {
+      size_t length = strlen(WILDCARDS[ii].regex);
+
+      if ((regex.compare(pos, length, WILDCARDS[ii].regex) == 0) &&
+          ((pos + length == end) || (regex[pos + length] == '/')))
+      {
+        segment.type = WILDCARDS[ii].type;
+        pos += length;
+        break;
+      }
+    }
+
+    // Anything else must be a literal segment.
+    while ((segment.type == Segment::LITERAL) &&
+           (pos < end) &&
+           (regex[pos] != '/'))
+    {
+      char c = regex[pos++];
+
+      if ((c == '\\') &&
+          (pos < end) &&
+          (strchr(REGEX_SPECIAL_CHARS, regex[pos]) != NULL))
+      {
+        // An escaped special character is literal.
+        segment.value.push_back(regex[pos++]);
+      }
+      else if (strchr(REGEX_SPECIAL_CHARS, c) != NULL)
+      {
+        return false;
+      }
+      else
+      {
+        segment.value.push_back(c);
+      }
+    }
+
+    segments.push_back(segment);
+
+    if (pos == end)
+    {
+      break;
+    }
+
+    // Skip the slash.
+    pos++;
+  }
+
+  // libevhtp also tries regexes against the path without its last segment,
+  // which a regex that ends with an empty segment could match, so leave those
+  // as regexes.
+  if ((segments.back().type == Segment::LITERAL) &&
+      (segments.back().value.empty()))
+  {
+    return false;
+  }
+
+  return true;
+}
+
+int HttpRouter::match(const std::string& path, Params& params) const
+{
+  const Node* best = NULL;
+  std::vector<std::pair<size_t, size_t>> values;
+  std::vector<std::pair<size_t, size_t>> best_values;
+
+  if ((!path.empty()) && (path[0] == '/'))
+  {
+    match_node(&_root, path, 1, values, best, best_values);
+  }
+
+  // Regexes that were added before the best route in the trie would have been
+  // tried first, so check them.
+  for (std::vector<RegexRoute*>::const_iterator it = _regexes.begin();
+       it != _regexes.end();
+       ++it)
+  {
+    if ((best != NULL) && ((*it)->id > best->id))
+    {
+      break;
+    }
+
+    if (regexec(&(*it)->regex, path.c_str(), 0, NULL, 0) == 0)
+    {
+      params.clear();
+      return (*it)->id;
+    }
+  }
+
+  if (best == NULL)
+  {
+    return NO_MATCH;
+  }
+
+  params.clear();
+  params.reserve(best_values.size());
+
+  for (size_t ii = 0; ii < best_values.size(); ++ii)
+  {
+    params.push_back(
+      std::make_pair(best->param_names[ii],
+                     Utils::url_unescape(path.substr(best_values[ii].first,
+                                                     best_values[ii].second))));
+  }
+
+  return best->id;
+}
+
+void HttpRouter::match_node(const Node* node,
+                            const std::string& path,
+                            size_t start,
+                            std::vector<std::pair<size_t, size_t>>& values,
+                            const Node*& best,
+                            std::vector<std::pair<size_t, size_t>>& best_values) const
+{
+  size_t end = path.find('/', start);
+  bool last = (end == std::string::npos);
+  end = last ? path.size() : end;
+  size_t length = end - start;
+
+  // Try the literal segment first, then the parameters. All of them have to
+  // be tried, as a route that was added earlier may be found on any of them.
+  std::map<std::string, std::unique_ptr<Node>>::const_iterator literal =
+    node->literals.find(path.substr(start, length));
+
+  if (literal != node->literals.end())
+  {
+    if (last)
+    {
+      match_route(literal->second.get(), values, best, best_values);
+    }
+    else
+    {
+      match_node(literal->second.get(), path, end + 1, values, best, best_values);
+    }
+  }
+
+  const Node* params[] = {(length > 0) ? node->param.get() : NULL,
+                          node->optional_param.get()};
+
+  for (size_t ii = 0; ii < 2; ++ii)
+  {
+    if (params[ii] != NULL)
+    {
+      values.push_back(std::make_pair(start, length));
+
+      if (last)
+      {
+        match_route(params[ii], values, best, best_values);
+      }
+      else
+      {
+        match_node(params[ii], path, end + 1, values, best, best_values);
+      }
+
+      values.pop_back();
+    }
+  }
+}
+
+void HttpRouter::match_route(const Node* node,
+                             const std::vector<std::pair<size_t, size_t>>& values,
+                             const Node*& best,
+                             std::vector<std::pair<size_t, size_t>>& best_values)
+{
+  if ((node->id != NO_MATCH) && ((best == NULL) || (node->id < best->id)))
+  {
+    best = node;
+    best_values = values;
+  }
+}
@@ -13,19 +13,31 @@
 #include <cassert>
 #include <iostream>
 #include <map>
+#include <algorithm>
+#include <cmath>
+#include <fcntl.h>
+#include <strings.h>
+#include <unistd.h>
 
 #include "cpp_common_pd_definitions.h"
 #include "utils.h"
 #include "log.h"
 #include "sas.h"
+#include "sas_event_sampler.h"
 #include "httpclient.h"
 #include "http_request.h"
 #include "load_monitor.h"
+#include "profiling_span.h"
 #include "random_uuid.h"
+#include "threadpool.h"
 
 /// Maximum number of targets to try connecting to.
 static const int MAX_TARGETS = 5;
 
+/// Largest response body that we make room for up front, based on its
+/// Content-Length header.
+static const unsigned long long MAX_RESERVED_BODY_SIZE = 16 * 1024 * 1024;
+
 /// Create an HTTP client object.
 ///
 /// @param assert_user Assert user in header?
@@ -56,11 +68,32 @@ HttpClient::HttpClient(bool assert_user,
   _conn_pool(load_monitor, stat_table, remote_connection, timeout_ms, source_address),
   _should_omit_body(should_omit_body),
   _log_display_address(log_display_address),
-  _server_display_address(server_display_address)
+  _server_display_address(server_display_address),
+  _peer_overload_threshold(0),
+  _peer_overload_blacklist_s(0),
+  _retry_budget(NULL),
+  _coalesced_gets(false),
+  _get_coalescer(),
+  _num_async_io_threads(DEFAULT_ASYNC_IO_THREADS),
+  _async_io_threads(),
+  _next_async_io_thread(0),
+  _http2(false),
+  _http2_options(),
+  _hedging(false),
+  _hedging_options(),
+  _shared_headers(NULL),
+  _sas_log_pool(NULL)
 {
-  pthread_key_create(&_uuid_thread_local, cleanup_uuid);
   pthread_mutex_init(&_lock, NULL);
+  pthread_mutex_init(&_async_lock, NULL);
   curl_global_init(CURL_GLOBAL_DEFAULT);
+
+  // By default cURL will add `Expect: 100-continue` to certain requests. This
+  // causes the HTTP stack to send 100 Continue responses, which messes up the
+  // SAS call flow. To prevent this add an empty Expect header, which stops
+  // cURL from adding its own. This is shared by all requests (and every
+  // request template adds its own copy).
+  _shared_headers = curl_slist_append(_shared_headers, "Expect:");
 }
 
 /// Create an HTTP client object.
@@ -83,16 +116,19 @@ HttpClient::HttpClient(bool assert_user,
 
 HttpClient::~HttpClient()
 {
-  RandomUUIDGenerator* uuid_gen =
-    (RandomUUIDGenerator*)pthread_getspecific(_uuid_thread_local);
+  // Stop the I/O threads first, as they use the rest of the client.
+  stop_async_io_threads();
+  pthread_mutex_destroy(&_async_lock);
 
-  if (uuid_gen != NULL)
+  if (_sas_log_pool != NULL)
   {
-    pthread_setspecific(_uuid_thread_local, NULL);
-    cleanup_uuid(uuid_gen); uuid_gen = NULL;
+    // Any messages still waiting to be logged are dropped.
+    _sas_log_pool->stop();
+    _sas_log_pool->join();
+    delete _sas_log_pool; _sas_log_pool = NULL;
   }
 
-  pthread_key_delete(_uuid_thread_local);
+  curl_slist_free_all(_shared_headers); _shared_headers = NULL;
 }
 
 // Map the CURLcode into a sensible HTTP return code.
@@ -151,22 +187,76 @@ HttpResponse HttpClient::send_request(const HttpRequest& req)
 {
   std::string url = req._scheme + "://" + req._server + req._path;
 
+  if ((_coalesced_gets) &&
+      (req._method == RequestType::GET) &&
+      (req._response_buffer == NULL))
+  {
+    // GETs are identical if they are sent to the same URL, by the same user,
+    // with the same headers, to the same servers.
+    std::string key = std::to_string(req._allowed_host_state) + " " + url + "\n" + req._username;
+
+    if (req._template != NULL)
+    {
+      for (const std::string& header : req._template->get_headers())
+      {
+        key.append("\n").append(header);
+      }
+    }
+
+    for (const std::string& header : req._headers)
+    {
+      key.append("\n").append(header);
+    }
+
+    bool merged;
+    CoalescedResponse response = _get_coalescer.run(key, [&]() {
+      CoalescedResponse sent;
+      sent.rc = send_request_raw(req._method,
+                                 url,
+                                 request_body(req),
+                                 sent.body,
+                                 req._username,
+                                 req._trail,
+                                 req._headers,
+                                 NULL,
+                                 sent.raw_headers,
+                                 req._allowed_host_state,
+                                 req._template);
+      return sent;
+    }, &merged);
+
+    if (merged)
+    {
+      TRC_DEBUG("Shared in-flight GET to %s", url.c_str());
+    }
+
+    return HttpResponse(response.rc,
+                        std::move(response.body),
+                        std::move(response.raw_headers),
+                        HttpResponse::RawHeaders());
+  }
+
   std::string body;
-  std::map<std::string, std::string> headers;
-
-  HTTPCode rc = send_request(req._method,
-                             url,
-                             req._body,
-                             body,
-                             req._username,
-                             req._trail,
-                             req._headers,
-                             &headers,
-                             req._allowed_host_state);
+  std::string raw_headers;
+
+  // The headers are left for the HttpResponse to parse if they're wanted.
+  HTTPCode rc = send_request_raw(req._method,
+                                 url,
+                                 request_body(req),
+                                 (req._response_buffer != NULL) ?
+                                   *req._response_buffer : body,
+                                 req._username,
+                                 req._trail,
+                                 req._headers,
+                                 NULL,
+                                 raw_headers,
+                                 req._allowed_host_state,
+                                 req._template);
 
   return HttpResponse(rc,
-                      body,
-                      headers);
+                      std::move(body),
+                      std::move(raw_headers),
+                      HttpResponse::RawHeaders());
 }
 
 /// Build and send a request; return the HTTPCode and store any returned data
@@ -180,109 +270,430 @@ HTTPCode HttpClient::send_request(RequestType request_type,
                                   std::map<std::string, std::string>* response_headers,
                                   int allowed_host_state)
 {
-  HTTPCode http_code;
-  CURLcode rc;
+  std::string raw_headers;
+
+  return send_request_raw(request_type,
+                          url,
+                          RequestBody(body.data(), body.size()),
+                          doc,
+                          username,
+                          trail,
+                          headers_to_add,
+                          response_headers,
+                          raw_headers,
+                          allowed_host_state,
+                          std::shared_ptr<const HttpRequestTemplate>());
+}
+
+HTTPCode HttpClient::send_request_raw(RequestType request_type,
+                                      const std::string& url,
+                                      const RequestBody& body,
+                                      std::string& doc,
+                                      const std::string& username,
+                                      SAS::TrailId trail,
+                                      const std::vector<std::string>& headers_to_add,
+                                      std::map<std::string, std::string>* response_headers,
+                                      std::string& raw_headers,
+                                      int allowed_host_state,
+                                      const std::shared_ptr<const HttpRequestTemplate>& request_template)
+{
+  if ((_http2) || (should_hedge(request_type)))
+  {
+    // Send the request on an I/O thread, so that it shares the multiplexed
+    // connections, or can be hedged.
+    RequestState* state = new RequestState(request_type,
+                                           url,
+                                           body,
+                                           username,
+                                           trail,
+                                           headers_to_add,
+                                           &doc,
+                                           response_headers,
+                                           &raw_headers,
+                                           allowed_host_state);
+    state->request_template = request_template;
+    state->async = true;
+
+    if (!prepare_request(*state))
+    {
+      delete state; state = NULL;
+      return HTTP_BAD_REQUEST;
+    }
+
+    return send_request_and_wait(state);
+  }
+
+  RequestState state(request_type,
+                     url,
+                     body,
+                     username,
+                     trail,
+                     headers_to_add,
+                     &doc,
+                     response_headers,
+                     &raw_headers,
+                     allowed_host_state);
+  state.request_template = request_template;
+
+  if (!prepare_request(state))
+  {
+    return HTTP_BAD_REQUEST;
+  }
+
+  while (start_attempt(state))
+  {
+    CURLcode rc;
+
+    CW_IO_STARTS("HTTP request to " + url)
+    {
+      PROFILE_SPAN("http.curl_perform");
+      rc = curl_easy_perform(state.curl);
+    }
+    CW_IO_COMPLETES()
+
+    if (!complete_attempt(state, rc))
+    {
+      break;
+    }
+  }
+
+  return complete_request(state);
+}
+
+/// Build and send a request without blocking; the response is passed to the
+/// callback
+void HttpClient::send_request_async(const HttpRequest& req,
+                                    ResponseCallback callback)
+{
+  std::string url = req._scheme + "://" + req._server + req._path;
+
+  RequestState* state = new RequestState(req._method,
+                                         url,
+                                         request_body(req),
+                                         req._username,
+                                         req._trail,
+                                         req._headers,
+                                         req._response_buffer,
+                                         NULL,
+                                         NULL,
+                                         req._allowed_host_state);
+  state->request_template = req._template;
+
+  // The request may be destroyed before it is sent, so take a copy of its
+  // body unless the caller owns the body.
+  if ((!req._body_provider) && (req._body_data == NULL))
+  {
+    state->own_body = req._body;
+    state->body = RequestBody(state->own_body.data(), state->own_body.size());
+  }
+
+  state->async = true;
+  state->callback = std::move(callback);
+
+  if (!prepare_request(*state))
+  {
+    state->http_code = HTTP_BAD_REQUEST;
+    complete_async_request(state);
+    return;
+  }
+
+  queue_async_request(state);
+}
+
+HTTPCode HttpClient::send_request_and_wait(RequestState* state)
+{
+  std::string url = state->url;
+  pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+  bool done = false;
+  HTTPCode http_code = HTTP_SERVER_ERROR;
+
+  // The response body and headers are written straight to the caller's
+  // storage, so we only need the return code from the callback.
+  state->callback = [&](HttpResponse rsp)
+  {
+    pthread_mutex_lock(&lock);
+    http_code = rsp.get_rc();
+    done = true;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+  };
+
+  queue_async_request(state);
+
+  CW_IO_STARTS("HTTP request to " + url)
+  {
+    pthread_mutex_lock(&lock);
+    while (!done)
+    {
+      pthread_cond_wait(&cond, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+  }
+  CW_IO_COMPLETES()
+
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&lock);
+
+  return http_code;
+}
+
+void HttpClient::queue_async_request(RequestState* state)
+{
+  start_async_io_threads();
+
+  pthread_mutex_lock(&_async_lock);
+
+  if (_async_io_threads.empty())
+  {
+    // LCOV_EXCL_START - only hit if we can't create threads
+    pthread_mutex_unlock(&_async_lock);
+    TRC_ERROR("No I/O threads available to send HTTP request to %s", state->url.c_str());
+    state->http_code = HTTP_SERVER_ERROR;
+    complete_async_request(state);
+    return;
+    // LCOV_EXCL_STOP
+  }
+
+  AsyncIoThread* io_thread = _async_io_threads[_next_async_io_thread];
+  _next_async_io_thread = (_next_async_io_thread + 1) % _async_io_threads.size();
+
+  pthread_mutex_lock(&io_thread->lock);
+  io_thread->queue.push_back(state);
+  pthread_mutex_unlock(&io_thread->lock);
+
+  pthread_mutex_unlock(&_async_lock);
+
+  // Wake the thread to pick up the request.
+  char wakeup = 0;
+  if (write(io_thread->wakeup_pipe[1], &wakeup, 1) < 0)
+  {
+    TRC_DEBUG("Failed to wake HTTP I/O thread (%d)", errno); // LCOV_EXCL_LINE
+  }
+}
+
+HttpClient::RequestState::RequestState(RequestType request_type,
+                                       const std::string& url,
+                                       const RequestBody& body,
+                                       const std::string& username,
+                                       SAS::TrailId trail,
+                                       const std::vector<std::string>& headers_to_add,
+                                       std::string* doc,
+                                       std::map<std::string, std::string>* response_headers,
+                                       std::string* raw_headers,
+                                       int allowed_host_state) :
+  request_type(request_type),
+  url(url),
+  body(body),
+  username(username),
+  trail(trail),
+  headers_to_add(headers_to_add),
+  allowed_host_state(allowed_host_state),
+  port(0),
+  host_is_ip(false),
+  async(false),
+  body_read(false),
+  doc((doc != NULL) ? doc : &own_doc),
+  response_headers(response_headers),
+  raw_headers((raw_headers != NULL) ? raw_headers : &own_raw_headers),
+  target_it(NULL),
+  attempts(0),
+  num_http_503_responses(0),
+  num_http_504_responses(0),
+  num_timeouts_or_io_errors(0),
+  // Track the IP addresses we're connecting to.  If we fail, we failed to
+  // resolve the host, so default to that.
+  rc(CURLE_COULDNT_RESOLVE_HOST),
+  http_code(HTTP_NOT_FOUND),
+  extra_headers(NULL),
+  extra_headers_end(NULL),
+  curl(NULL),
+  remote_ip(NULL),
+  host_resolve(NULL),
+  connect_to(NULL),
+  host_context(NULL),
+  req_timestamp(0),
+  hedgeable(false),
+  hedge_fired(false),
+  hedge(NULL),
+  hedge_primary(NULL),
+  finished(false),
+  hedge_timer_set(false)
+{
+  errbuf[0] = '\0';
+}
+
+HttpClient::RequestState::~RequestState()
+{
+  // A hedge shares its request's targets.
+  if (hedge_primary == NULL)
+  {
+    delete target_it; target_it = NULL;
+  }
+
+  // Detach the shared headers before freeing our own.
+  if (extra_headers_end != NULL)
+  {
+    extra_headers_end->next = NULL;
+  }
 
+  curl_slist_free_all(extra_headers); extra_headers = NULL;
+}
+
+bool HttpClient::prepare_request(RequestState& state)
+{
   // Get the request method for logging purposes.
-  std::string method_str = request_type_to_string(request_type);
+  state.method_str = request_type_to_string(state.request_type);
 
   // Create a UUID to use for SAS correlation.
-  boost::uuids::uuid uuid = get_random_uuid();
-  std::string uuid_str = boost::uuids::to_string(uuid);
+  char uuid_buf[RandomUUIDGenerator::STRING_LENGTH + 1];
+  RandomUUIDGenerator::generate_to(uuid_buf);
+  state.uuid_str.assign(uuid_buf, RandomUUIDGenerator::STRING_LENGTH);
 
   // Now log the marker to SAS. Flag that SAS should not reactivate the trail
   // group as a result of associations on this marker (doing so after the call
   // ends means it will take a long time to be searchable in SAS).
-  SAS::Marker corr_marker(trail, MARKER_ID_VIA_BRANCH_PARAM, 0);
-  corr_marker.add_var_param(uuid_str);
+  SAS::Marker corr_marker(state.trail, MARKER_ID_VIA_BRANCH_PARAM, 0);
+  corr_marker.add_var_param(state.uuid_str);
   SAS::report_marker(corr_marker, SAS::Marker::Scope::Trace, false);
 
-  std::string scheme;
+  // Construct the headers, which are the same for every attempt.
+  build_headers(state);
+
   std::string server;
-  std::string path;
-  if (!Utils::parse_http_url(url, scheme, server, path))
+  if (!Utils::parse_http_url(state.url, state.scheme, server, state.path))
   {
     TRC_ERROR("%s could not be parsed as a URL : fatal",
-              url.c_str());
-    return HTTP_BAD_REQUEST;
+              state.url.c_str());
+    return false;
   }
 
-  std::string host = host_from_server(scheme, server);
-  int port = port_from_server(scheme, server);
+  state.host = host_from_server(state.scheme, server);
+  state.port = port_from_server(state.scheme, server);
 
   // Resolve the host, and check whether it was an IP address all along.
-  BaseAddrIterator* target_it = _resolver->resolve_iter(host, port, trail, allowed_host_state);
+  state.target_it = _resolver->resolve_iter(state.host,
+                                            state.port,
+                                            state.trail,
+                                            state.allowed_host_state);
   IP46Address dummy_address;
-  bool host_is_ip = Utils::parse_ip_target(host, dummy_address);
-
-  // Track the number of HTTP 503 and 504 responses and the number of timeouts
-  // or I/O errors.
-  int num_http_503_responses = 0;
-  int num_http_504_responses = 0;
-  int num_timeouts_or_io_errors = 0;
+  state.host_is_ip = Utils::parse_ip_target(state.host, dummy_address);
 
-  // Track the IP addresses we're connecting to.  If we fail, we failed to
-  // resolve the host, so default to that.
-  const char *remote_ip = NULL;
-  rc = CURLE_COULDNT_RESOLVE_HOST;
-  http_code = HTTP_NOT_FOUND;
+  // A body that's read from a provider can only be sent once, so can't be
+  // hedged.
+  state.hedgeable = (state.async) &&
+                    (should_hedge(state.request_type)) &&
+                    (!state.body.provider);
 
-  AddrInfo target;
+  return true;
+}
 
+bool HttpClient::start_attempt(RequestState& state)
+{
   // Iterate over the targets returned by target_it until a successful
   // connection is made, a specified number of failures is reached, or the
   // targets are exhausted. If only one target is available, it should be tried
   // twice.
   //
   // Note that we need to accurately track how many attempts we have actually
-  // made, even if we break out of the loop early (so we generate accurate
-  // logs). For this reason we increment the counter as soon as we start a loop
-  // and assume that we will try a host on each iteration. This is not perfect,
-  // but it's better than incrementing the counter mid-way through the loop
-  // (when actually trying the host) and risking not incrementing the counter
-  // for some reason, which would give an infinite loop.
-  int attempts = 0;
-  while (target_it->next(target) || attempts == 1)
+  // made, even if we stop early (so we generate accurate logs). For this
+  // reason we increment the counter as soon as we start an attempt and assume
+  // that we will try a host on each attempt. This is not perfect, but it's
+  // better than incrementing the counter mid-way through the attempt (when
+  // actually trying the host) and risking not incrementing the counter for
+  // some reason, which would give an infinite loop.
+  //
+  // A body that's read from a provider can't be sent again, so once any of
+  // it has been read we can't try another target.
+  if ((state.body_read) ||
+      (!(state.target_it->next(state.target) || state.attempts == 1)))
+  {
+    return false;
+  }
+
+  if ((state.attempts > 0) &&
+      (_retry_budget != NULL) &&
+      (!_retry_budget->try_retry()))
+  {
+    TRC_DEBUG("Not retrying %s as the retry budget is exhausted",
+              state.url.c_str());
+    return false;
+  }
+
+  state.attempts++;
+
+  // Get a curl handle and the associated pool entry
+  state.conn_handle.reset(
+        new ConnectionHandle<CURL*>(_conn_pool.get_connection(state.target)));
+
+  if (!state.conn_handle->is_valid())
   {
-    attempts++;
+    // The connection caps were reached and no connection came free in time.
+    // Fail this attempt as overloaded, and try the next target (if any).
+    TRC_DEBUG("No connection available to %s", state.url.c_str());
+    state.conn_handle.reset();
+    state.rc = CURLE_OPERATION_TIMEDOUT;
+    state.http_code = HTTP_SERVER_UNAVAILABLE;
+    return start_attempt(state);
+  }
 
-    // Get a curl handle and the associated pool entry
-    ConnectionHandle<CURL*> conn_handle = _conn_pool.get_connection(target);
-    CURL* curl = conn_handle.get_connection();
+  CURL* curl = state.conn_handle->get_connection();
+  state.curl = curl;
+  _conn_pool.set_request_timeouts(curl, state.target);
 
-    // Construct and add extra headers
-    struct curl_slist* extra_headers = build_headers(headers_to_add,
-                                                     !body.empty(),
-                                                     _assert_user,
-                                                     username,
-                                                     uuid_str);
+  // Add the headers
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, state.extra_headers);
 
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, extra_headers);
+  // Set general curl options
+  set_curl_options_general(curl, state);
 
-    // Set general curl options
-    set_curl_options_general(curl, body, doc);
+  // Set response header curl options.
+  set_curl_options_response(curl, state);
 
-    // Set response header curl options. We always want to catch the headers,
-    // even if the caller isn't interested.
-    std::map<std::string, std::string> internal_rsp_hdrs;
+  // Set request-type specific curl options
+  set_curl_options_request(curl, state.request_type);
 
-    if (!response_headers)
-    {
-      response_headers = &internal_rsp_hdrs;
-    }
+  // Convert the target IP address into a string and tell curl to resolve to that.
+  state.remote_ip = inet_ntop(state.target.address.af,
+                              &state.target.address.addr,
+                              state.remote_ip_buf,
+                              sizeof(state.remote_ip_buf));
 
-    set_curl_options_response(curl, response_headers);
+  if (_http2)
+  {
+    // HTTPS negotiates HTTP/2 with ALPN. Plain HTTP servers must support
+    // HTTP/2 without an upgrade. Wait for an existing connection to the target
+    // rather than opening a new one, so that requests are multiplexed on it.
+    curl_easy_setopt(curl,
+                     CURLOPT_HTTP_VERSION,
+                     (state.scheme == "https") ? CURL_HTTP_VERSION_2TLS :
+                                                 CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+  }
 
-    // Set request-type specific curl options
-    set_curl_options_request(curl, request_type);
+  if (state.async)
+  {
+    // Handles that are added to a multi handle share its DNS cache, so we
+    // can't use CURLOPT_RESOLVE as below (attempts to the same host at
+    // different IPs would overwrite each other's entries). Instead tell curl
+    // to connect to the IP, which only affects this handle.
+    curl_easy_setopt(curl, CURLOPT_RESOLVE, NULL);
 
-    // Convert the target IP address into a string and tell curl to resolve to that.
-    char buf[100];
-    remote_ip = inet_ntop(target.address.af,
-                          &target.address.addr,
-                          buf,
-                          sizeof(buf));
+    if (!state.host_is_ip)
+    {
+      std::string ip = (state.target.address.af == AF_INET6) ?
+                         std::string("[") + state.remote_ip + "]" :
+                         std::string(state.remote_ip);
+      std::string connect_to = state.host + ":" + std::to_string(state.port) +
+                               ":" + ip + ":" + std::to_string(state.port);
+      state.connect_to = curl_slist_append(NULL, connect_to.c_str());
+      TRC_DEBUG("Set CURLOPT_CONNECT_TO: %s", connect_to.c_str());
+    }
 
+    curl_easy_setopt(curl, CURLOPT_CONNECT_TO, state.connect_to);
+  }
+  else
+  {
     // We want curl's DNS cache to contain exactly one entry: for the host and
     // IP that we're currently processing.
     //
@@ -298,256 +709,325 @@ HTTPCode HttpClient::send_request(RequestType request_type,
     // At this point then, we retrieve the value previously stored - if any.
     // (We may be here for the very first time, or the previous query may have
     // been direct to an IP address, so we may not find anything).
-    curl_slist *host_resolve = NULL;
-    curl_easy_getinfo(curl, CURLINFO_PRIVATE, &host_resolve);
+    state.host_resolve = NULL;
+    curl_easy_getinfo(curl, CURLINFO_PRIVATE, &state.host_resolve);
     curl_easy_setopt(curl, CURLOPT_PRIVATE, NULL);
 
     // Add the new entry - except in the case where the host is already an IP
     // address.
-    if (!host_is_ip)
+    if (!state.host_is_ip)
     {
       std::string resolve_addr =
-        host + ":" + std::to_string(port) + ":" + remote_ip;
-      host_resolve = curl_slist_append(host_resolve, resolve_addr.c_str());
+        state.host + ":" + std::to_string(state.port) + ":" + state.remote_ip;
+      state.host_resolve = curl_slist_append(state.host_resolve, resolve_addr.c_str());
       TRC_DEBUG("Set CURLOPT_RESOLVE: %s", resolve_addr.c_str());
     }
-    if (host_resolve != NULL)
+    if (state.host_resolve != NULL)
     {
-      curl_easy_setopt(curl, CURLOPT_RESOLVE, host_resolve);
+      curl_easy_setopt(curl, CURLOPT_RESOLVE, state.host_resolve);
     }
+  }
 
-    // Set the curl target URL
-    std::string curl_target = scheme + "://" + host + ":" + std::to_string(port) + path;
-    curl_easy_setopt(curl, CURLOPT_URL, curl_target.c_str());
+  // Set the curl target URL
+  std::string curl_target = state.scheme + "://" + state.host + ":" +
+                            std::to_string(state.port) + state.path;
+  curl_easy_setopt(curl, CURLOPT_URL, curl_target.c_str());
 
-    // Create and register an object to record the HTTP transaction.
-    Recorder recorder;
-    curl_easy_setopt(curl, CURLOPT_DEBUGDATA, &recorder);
+  // Register an object to record the HTTP transaction.
+  state.recorder.request.clear();
+  state.recorder.response.clear();
+  curl_easy_setopt(curl, CURLOPT_DEBUGDATA, &state.recorder);
 
-    // Add a buffer to store error information
-    char errbuf[CURL_ERROR_SIZE];
-    errbuf[0] = '\0';
-    curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errbuf);
+  // Add a buffer to store error information
+  state.errbuf[0] = '\0';
+  curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, state.errbuf);
 
-    // Set host-specific curl options
-    void* host_context = set_curl_options_host(curl, host, port);
+  // Set host-specific curl options
+  state.host_context = set_curl_options_host(curl, state.host, state.port);
 
-    // Get the current timestamp before calling into curl.  This is because we
-    // can't log the request to SAS until after curl_easy_perform has returned.
-    // This could be a long time if the server is being slow, and we want to log
-    // the request with the right timestamp.
-    SAS::Timestamp req_timestamp = SAS::get_current_timestamp();
+  // Get the current timestamp before calling into curl.  This is because we
+  // can't log the request to SAS until after curl has finished sending it.
+  // This could be a long time if the server is being slow, and we want to log
+  // the request with the right timestamp.
+  state.req_timestamp = SAS::get_current_timestamp();
 
-    // Send the request.
-    doc.clear();
-    TRC_DEBUG("Sending HTTP request : %s (trying %s)", url.c_str(), remote_ip);
+  // Send the request.
+  state.doc->clear();
+  TRC_DEBUG("Sending HTTP request : %s (trying %s)", state.url.c_str(), state.remote_ip);
 
-    struct timespec timespec;
-    clock_gettime(CLOCK_REALTIME, &timespec);
+  clock_gettime(CLOCK_REALTIME, &state.sent_time);
+  _resolver->request_started(state.target);
 
-    CW_IO_STARTS("HTTP request to " + url)
-    {
-      rc = curl_easy_perform(curl);
-    }
-    CW_IO_COMPLETES()
+  return true;
+}
 
-    // If a request was sent, log it to SAS.
-    if (recorder.request.length() > 0)
-    {
-      sas_log_http_req(trail, curl, method_str, url, recorder.request, req_timestamp, 0);
-    }
+uint64_t HttpClient::attempt_latency_us(const RequestState& state)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  int64_t latency_us = ((int64_t)(now.tv_sec - state.sent_time.tv_sec) * 1000000) +
+                       ((now.tv_nsec - state.sent_time.tv_nsec) / 1000);
+  return std::max(latency_us, (int64_t)0);
+}
+
+bool HttpClient::complete_attempt(RequestState& state, CURLcode rc)
+{
+  CURL* curl = state.curl;
+  const std::string& url = state.url;
+  const char* remote_ip = state.remote_ip;
+  SAS::TrailId trail = state.trail;
+  bool try_next_target = true;
+
+  state.rc = rc;
+
+  // Failed attempts count too, as a target that is failing slowly is as bad
+  // as one that is succeeding slowly.
+  uint64_t latency_us = attempt_latency_us(state);
+  _resolver->request_completed(state.target, latency_us);
+  _conn_pool.request_completed(curl, state.target, latency_us);
+
+  // If a request was sent, log it to SAS. This takes the recorded request
+  // (and response, below) rather than copying it.
+  if (state.recorder.request.length() > 0)
+  {
+    sas_log_http_req(trail, curl, state.method_str, url, state.recorder.request, state.req_timestamp, 0);
+  }
+
+  // Clean up from setting up the DNS cache this time round.
+  if (state.host_resolve != NULL)
+  {
+    curl_slist_free_all(state.host_resolve);
+    state.host_resolve = NULL;
+  }
 
-    // Clean up from setting up the DNS cache this time round.
-    if (host_resolve != NULL)
+  if (state.connect_to != NULL)
+  {
+    curl_easy_setopt(curl, CURLOPT_CONNECT_TO, NULL);
+    curl_slist_free_all(state.connect_to);
+    state.connect_to = NULL;
+  }
+
+  // Prepare to remove the DNS entry from curl's cache next time round, if
+  // necessary
+  if ((!state.async) && (!state.host_is_ip))
+  {
+    std::string resolve_remove_addr =
+      std::string("-") + state.host + ":" + std::to_string(state.port);
+    curl_slist* host_resolve = curl_slist_append(NULL, resolve_remove_addr.c_str());
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, host_resolve);
+  }
+
+  // Log the result of the request.
+  long http_rc = 0;
+  if (rc == CURLE_OK)
+  {
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_rc);
+    sas_log_http_rsp(trail, curl, http_rc, state.method_str, url, state.recorder.response, 0);
+    TRC_DEBUG("Received HTTP response: status=%d, doc=%s", http_rc, state.doc->c_str());
+    if (http_rc >= 400)
     {
-      curl_slist_free_all(host_resolve);
-      host_resolve = NULL;
+      TRC_VERBOSE("Received HTTP response %d from server %s for URL %s",
+                http_rc,
+                remote_ip,
+                url.c_str());
     }
 
-    // Prepare to remove the DNS entry from curl's cache next time round, if
-    // necessary
-    if (!host_is_ip)
+  }
+  else
+  {
+    const char* error = curl_easy_strerror(rc);
+    struct tm dt;
+    gmtime_r(&state.sent_time.tv_sec, &dt);
+
+    TRC_WARNING("%s failed at server %s : %d: %s - %s trail: %d sent at: "
+                "%2.2d-%2.2d-%4.4d %2.2d:%2.2d:%2.2d.%3.3d UTC ",
+                url.c_str(),
+                remote_ip,
+                rc,
+                error,
+                state.errbuf,
+                trail,
+                dt.tm_mday, (dt.tm_mon+1), (dt.tm_year + 1900),
+                dt.tm_hour, dt.tm_min, dt.tm_min, (int)(state.sent_time.tv_nsec / 1000000));
+
+    sas_log_curl_error(trail,
+                       remote_ip,
+                       state.target.port,
+                       state.method_str,
+                       url,
+                       rc,
+                       0,
+                       strlen(state.errbuf) > 0 ? state.errbuf : error);
+  }
+
+  state.http_code = curl_code_to_http_code(curl, rc);
+
+  // Clean up any memory allocated by set_curl_options_host
+  cleanup_host_context(state.host_context);
+  state.host_context = NULL;
+
+  // Update the connection recycling and retry algorithms.
+  if ((rc == CURLE_OK) && !(http_rc >= 400))
+  {
+    // Success!
+    _resolver->success(state.target);
+    try_next_target = false;
+
+    if ((state.attempts == 1) &&
+        (state.hedge_primary == NULL) &&
+        (_retry_budget != NULL))
     {
-      std::string resolve_remove_addr =
-        std::string("-") + host + ":" + std::to_string(port);
-      host_resolve = curl_slist_append(NULL, resolve_remove_addr.c_str());
-      curl_easy_setopt(curl, CURLOPT_PRIVATE, host_resolve);
+      _retry_budget->first_attempt_succeeded();
     }
 
-    // Log the result of the request.
-    long http_rc = 0;
-    if (rc == CURLE_OK)
+    if (_peer_overload_threshold > 0)
     {
-      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_rc);
-      sas_log_http_rsp(trail, curl, http_rc, method_str, url, recorder.response, 0);
-      TRC_DEBUG("Received HTTP response: status=%d, doc=%s", http_rc, doc.c_str());
-      if (http_rc >= 400)
+      std::map<std::string, std::string> response_headers;
+      parse_headers(*state.raw_headers, response_headers);
+      std::map<std::string, std::string>::iterator load_header =
+                                  response_headers.find("x-load");
+
+      if ((load_header != response_headers.end()) &&
+          (atoi(load_header->second.c_str()) >= _peer_overload_threshold * 1000))
       {
-        TRC_VERBOSE("Received HTTP response %d from server %s for URL %s",
-                  http_rc,
-                  remote_ip,
-                  url.c_str());
+        // The server is close to overload, so send it less traffic.
+        TRC_DEBUG("Blacklisting server reporting load %s",
+                  load_header->second.c_str());
+        _resolver->blacklist(state.target, _peer_overload_blacklist_s);
       }
-
     }
-    else
+  }
+  else
+  {
+    // If we failed to even to establish an HTTP connection or recieved a 503
+    // with a Retry-After header, blacklist this IP address.
+    if ((!(http_rc >= 400)) &&
+        (rc != CURLE_REMOTE_FILE_NOT_FOUND) &&
+        (rc != CURLE_REMOTE_ACCESS_DENIED))
     {
-      const char* error = curl_easy_strerror(rc);
-      struct tm dt;
-      gmtime_r(&timespec.tv_sec, &dt);
-
-      TRC_WARNING("%s failed at server %s : %d: %s - %s trail: %d sent at: "
-                  "%2.2d-%2.2d-%4.4d %2.2d:%2.2d:%2.2d.%3.3d UTC ",
-                  url.c_str(),
-                  remote_ip,
-                  rc,
-                  error,
-                  errbuf,
-                  trail,
-                  dt.tm_mday, (dt.tm_mon+1), (dt.tm_year + 1900),
-                  dt.tm_hour, dt.tm_min, dt.tm_min, (int)(timespec.tv_nsec / 1000000));
-
-      sas_log_curl_error(trail,
-                         remote_ip,
-                         target.port,
-                         method_str,
-                         url,
-                         rc,
-                         0,
-                         strlen(errbuf) > 0 ? errbuf : error);
-    }
-
-    http_code = curl_code_to_http_code(curl, rc);
-
-    // At this point, we are finished with the curl object, so it is safe to
-    // free the headers
-    curl_slist_free_all(extra_headers);
-
-    // Clean up any memory allocated by set_curl_options_host
-    cleanup_host_context(host_context);
-
-    // Update the connection recycling and retry algorithms.
-    if ((rc == CURLE_OK) && !(http_rc >= 400))
-    {
-      // Success!
-      _resolver->success(target);
-      break;
+      // The CURL connection should not be returned to the pool
+      TRC_DEBUG("Blacklist on connection failure");
+      state.conn_handle->set_return_to_pool(false);
+      _resolver->blacklist(state.target);
     }
-    else
+    else if (http_rc == 503)
     {
-      // If we failed to even to establish an HTTP connection or recieved a 503
-      // with a Retry-After header, blacklist this IP address.
-      if ((!(http_rc >= 400)) &&
-          (rc != CURLE_REMOTE_FILE_NOT_FOUND) &&
-          (rc != CURLE_REMOTE_ACCESS_DENIED))
-      {
-        // The CURL connection should not be returned to the pool
-        TRC_DEBUG("Blacklist on connection failure");
-        conn_handle.set_return_to_pool(false);
-        _resolver->blacklist(target);
-      }
-      else if (http_rc == 503)
+      // Check for a Retry-After header on 503 responses and if present with
+      // a valid value (i.e. an integer) blacklist the host for the given
+      // number of seconds.
+      TRC_DEBUG("Have 503 failure");
+      std::map<std::string, std::string> response_headers;
+      parse_headers(*state.raw_headers, response_headers);
+      std::map<std::string, std::string>::iterator retry_after_header =
+                                  response_headers.find("retry-after");
+      int retry_after = 0;
+
+      if (retry_after_header != response_headers.end())
       {
-        // Check for a Retry-After header on 503 responses and if present with
-        // a valid value (i.e. an integer) blacklist the host for the given
-        // number of seconds.
-        TRC_DEBUG("Have 503 failure");
-        std::map<std::string, std::string>::iterator retry_after_header =
-                                          response_headers->find("retry-after");
-        int retry_after = 0;
-
-        if (retry_after_header != response_headers->end())
-        {
-          TRC_DEBUG("Try to parse retry after value");
-          std::string retry_after_val = retry_after_header->second;
-          retry_after = atoi(retry_after_val.c_str());
-
-          // Log if we failed to parse the Retry-After header here
-          if (retry_after == 0)
-          {
-            TRC_WARNING("Failed to parse Retry-After value: %s", retry_after_val.c_str());
-            sas_log_bad_retry_after_value(trail, retry_after_val, 0);
-          }
-        }
+        TRC_DEBUG("Try to parse retry after value");
+        std::string retry_after_val = retry_after_header->second;
+        retry_after = atoi(retry_after_val.c_str());
 
-        if (retry_after > 0)
-        {
-          // The CURL connection should not be returned to the pool
-          TRC_DEBUG("Have retry after value %d", retry_after);
-          conn_handle.set_return_to_pool(false);
-          _resolver->blacklist(target, retry_after);
-        }
-        else
+        // Log if we failed to parse the Retry-After header here
+        if (retry_after == 0)
         {
-          _resolver->success(target);
+          TRC_WARNING("Failed to parse Retry-After value: %s", retry_after_val.c_str());
+          sas_log_bad_retry_after_value(trail, retry_after_val, 0);
         }
       }
+
+      if (retry_after > 0)
+      {
+        // The CURL connection should not be returned to the pool
+        TRC_DEBUG("Have retry after value %d", retry_after);
+        state.conn_handle->set_return_to_pool(false);
+        _resolver->blacklist(state.target, retry_after);
+      }
       else
       {
-        _resolver->success(target);
+        _resolver->success(state.target);
       }
+    }
+    else
+    {
+      _resolver->success(state.target);
+    }
 
-      // Determine the failure mode and update the correct counter.
-      bool fatal_http_error = false;
+    // Determine the failure mode and update the correct counter.
+    bool fatal_http_error = false;
 
-      if (http_rc >= 400)
+    if (http_rc >= 400)
+    {
+      if (http_rc == 503)
       {
-        if (http_rc == 503)
-        {
-          num_http_503_responses++;
-        }
-        // LCOV_EXCL_START fakecurl doesn't let us return custom return codes.
-        else if (http_rc == 504)
-        {
-          num_http_504_responses++;
-        }
-        else
-        {
-          fatal_http_error = true;
-        }
-        // LCOV_EXCL_STOP
+        state.num_http_503_responses++;
       }
-      else if ((rc == CURLE_REMOTE_FILE_NOT_FOUND) ||
-               (rc == CURLE_REMOTE_ACCESS_DENIED))
+      // LCOV_EXCL_START fakecurl doesn't let us return custom return codes.
+      else if (http_rc == 504)
       {
-        fatal_http_error = true;
+        state.num_http_504_responses++;
       }
-      else if ((rc == CURLE_OPERATION_TIMEDOUT) ||
-               (rc == CURLE_SEND_ERROR) ||
-               (rc == CURLE_RECV_ERROR))
+      else
       {
-        num_timeouts_or_io_errors++;
+        fatal_http_error = true;
       }
+      // LCOV_EXCL_STOP
+    }
+    else if ((rc == CURLE_REMOTE_FILE_NOT_FOUND) ||
+             (rc == CURLE_REMOTE_ACCESS_DENIED))
+    {
+      fatal_http_error = true;
+    }
+    else if ((rc == CURLE_OPERATION_TIMEDOUT) ||
+             (rc == CURLE_SEND_ERROR) ||
+             (rc == CURLE_RECV_ERROR))
+    {
+      state.num_timeouts_or_io_errors++;
+    }
 
-      // Decide whether to keep trying.
-      if ((num_http_503_responses + num_timeouts_or_io_errors >= 2) ||
-          (num_http_504_responses >= 1) ||
-          fatal_http_error)
-      {
-        // Make a SAS log so that its clear that we have stopped retrying
-        // deliberately.
-        HttpErrorResponseTypes reason = fatal_http_error ?
-                                        HttpErrorResponseTypes::Permanent :
-                                        HttpErrorResponseTypes::Temporary;
-        sas_log_http_abort(trail, reason, 0);
-        break;
-      }
+    // Decide whether to keep trying.
+    if ((state.num_http_503_responses + state.num_timeouts_or_io_errors >= 2) ||
+        (state.num_http_504_responses >= 1) ||
+        fatal_http_error)
+    {
+      // Make a SAS log so that its clear that we have stopped retrying
+      // deliberately.
+      HttpErrorResponseTypes reason = fatal_http_error ?
+                                      HttpErrorResponseTypes::Permanent :
+                                      HttpErrorResponseTypes::Temporary;
+      sas_log_http_abort(trail, reason, 0);
+      try_next_target = false;
     }
   }
 
-  delete target_it;
+  // We're finished with the connection, so release it.
+  state.conn_handle.reset();
+  state.curl = NULL;
+
+  return try_next_target;
+}
+
+HTTPCode HttpClient::complete_request(RequestState& state)
+{
+  delete state.target_it; state.target_it = NULL;
+
+  if (state.response_headers != NULL)
+  {
+    parse_headers(*state.raw_headers, *state.response_headers);
+  }
 
-  if (attempts == 0)
+  if (state.attempts == 0)
   {
     // We didn't even attempt to contact a server, so produce a SAS log saying so.
-    TRC_INFO("Failed to resolve hostname for %s to %s", method_str.c_str(), url.c_str());
-    SAS::Event event(trail,
+    TRC_INFO("Failed to resolve hostname for %s to %s", state.method_str.c_str(), state.url.c_str());
+    SAS::Event event(state.trail,
                      ((_sas_log_level == SASEvent::HttpLogLevel::PROTOCOL) ?
                        SASEvent::HTTP_HOSTNAME_DID_NOT_RESOLVE :
                        SASEvent::HTTP_HOSTNAME_DID_NOT_RESOLVE_DETAIL),
                      0);
-    event.add_var_param(method_str);
-    event.add_var_param(Utils::url_unescape(url));
+    event.add_var_param(state.method_str);
+    event.add_var_param(Utils::url_unescape(state.url));
     SAS::report_event(event);
   }
 
@@ -557,8 +1037,8 @@ HTTPCode HttpClient::send_request(RequestType request_type,
   //  - the error is a 504, which means that the node downsteam of the node
   //    we're connecting to currently has reported that it is overloaded/was
   //    unresponsive.
-  if (((num_http_503_responses >= 2) ||
-       (num_http_504_responses >= 1)) &&
+  if (((state.num_http_503_responses >= 2) ||
+       (state.num_http_504_responses >= 1)) &&
       (_load_monitor != NULL))
   {
     _load_monitor->incr_penalties();
@@ -570,13 +1050,13 @@ HTTPCode HttpClient::send_request(RequestType request_type,
   assert(rv == 0);
   unsigned long now_ms = tp.tv_sec * 1000 + (tp.tv_nsec / 1000000);
 
-  if (rc == CURLE_OK)
+  if (state.rc == CURLE_OK)
   {
     if (_comm_monitor)
     {
       // If both attempts fail due to overloaded downstream nodes, consider
       // it a communication failure.
-      if (num_http_503_responses >= 2)
+      if (state.num_http_503_responses >= 2)
       {
         _comm_monitor->inform_failure(now_ms); // LCOV_EXCL_LINE - No UT for 503 fails
       }
@@ -594,158 +1074,938 @@ HTTPCode HttpClient::send_request(RequestType request_type,
     }
   }
 
-  return http_code;
+  return state.http_code;
 }
 
-struct curl_slist* HttpClient::build_headers(std::vector<std::string> headers_to_add,
-                                             bool has_body,
-                                             bool assert_user,
-                                             const std::string& username,
-                                             std::string uuid_str)
+void HttpClient::abandon_attempt(RequestState& state)
 {
-  struct curl_slist* extra_headers = NULL;
+  // The time so far is a lower bound on the attempt's latency (and an
+  // attempt is abandoned when another target responded first).
+  _resolver->request_completed(state.target, attempt_latency_us(state));
 
-  if (has_body)
+  if (state.connect_to != NULL)
   {
-    extra_headers = curl_slist_append(extra_headers, "Content-Type: application/json");
+    curl_easy_setopt(state.curl, CURLOPT_CONNECT_TO, NULL);
+    curl_slist_free_all(state.connect_to);
+    state.connect_to = NULL;
   }
 
-  // Add the UUID for SAS correlation to the HTTP message.
-  extra_headers = curl_slist_append(extra_headers,
-                                    (SASEvent::HTTP_BRANCH_HEADER_NAME + ": " + uuid_str).c_str());
+  cleanup_host_context(state.host_context);
+  state.host_context = NULL;
 
-  // By default cURL will add `Expect: 100-continue` to certain requests. This
-  // causes the HTTP stack to send 100 Continue responses, which messes up the
-  // SAS call flow. To prevent this add an empty Expect header, which stops
-  // cURL from adding its own.
-  extra_headers = curl_slist_append(extra_headers, "Expect:");
+  // We don't know what state the connection is in, so don't reuse it.
+  state.conn_handle->set_return_to_pool(false);
+  state.conn_handle.reset();
+  state.curl = NULL;
 
+  state.rc = CURLE_ABORTED_BY_CALLBACK;
+  state.http_code = HTTP_SERVER_UNAVAILABLE;
+}
 
-  // Add in any extra headers
-  for (std::vector<std::string>::const_iterator i = headers_to_add.begin();
-       i != headers_to_add.end();
-       ++i)
+void HttpClient::set_async_io_threads(unsigned int num_threads)
+{
+  pthread_mutex_lock(&_async_lock);
+  _num_async_io_threads = std::max(num_threads, 1u);
+  pthread_mutex_unlock(&_async_lock);
+}
+
+void HttpClient::enable_http2(const Http2Options& options)
+{
+  TRC_STATUS("Sending HTTP requests over HTTP/2 (%ld streams per connection, "
+             "%ld connections per target)",
+             options.max_concurrent_streams,
+             options.max_connections_per_target);
+  _http2 = true;
+  _http2_options = options;
+  _conn_pool.set_http2(true);
+}
+
+void HttpClient::enable_hedging(const HedgingOptions& options)
+{
+  if (_load_monitor == NULL)
   {
-    extra_headers = curl_slist_append(extra_headers, (*i).c_str());
+    TRC_WARNING("Not hedging HTTP requests, as there is no load monitor");
+    return;
   }
 
-  // Add the user's identity (if required).
-  if (assert_user)
+  if ((options.percentile <= 0) || (options.percentile >= 100))
   {
-    extra_headers = curl_slist_append(extra_headers,
-                                      ("X-XCAP-Asserted-Identity: " + username).c_str());
+    TRC_ERROR("Not hedging HTTP requests, as the percentile (%f) is invalid",
+              options.percentile);
+    return;
   }
-  return extra_headers;
+
+  TRC_STATUS("Hedging idempotent HTTP requests that take longer than the "
+             "%.1fth percentile of latency",
+             options.percentile);
+  _hedging = true;
+  _hedging_options = options;
 }
 
-void HttpClient::set_curl_options_general(CURL* curl,
-                                          std::string body,
-                                          std::string& doc)
+void HttpClient::enable_deferred_sas_logging(unsigned int num_threads,
+                                             ExceptionHandler* exception_handler,
+                                             unsigned int max_queue)
 {
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &doc);
+  if (_sas_log_pool != NULL)
+  {
+    return; // LCOV_EXCL_LINE
+  }
+
+  FunctorThreadPool* pool = new FunctorThreadPool(num_threads,
+                                                  exception_handler,
+                                                  sas_log_exception_callback,
+                                                  max_queue);
 
-  if (!body.empty())
+  if (!pool->start())
   {
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.c_str());
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to start SAS logging threads - logging HTTP messages inline");
+    pool->stop();
+    pool->join();
+    delete pool;
+    return;
+    // LCOV_EXCL_STOP
   }
+
+  TRC_STATUS("Logging HTTP messages to SAS on %u threads", num_threads);
+  _sas_log_pool = pool;
 }
 
-void HttpClient::set_curl_options_response(CURL* curl,
-                               std::map<std::string, std::string>* response_headers)
+bool HttpClient::should_hedge(RequestType request_type)
 {
-  // If response_headers is not null, the headers returned by the curl request
-  // should be stored there.
-  if (response_headers)
-  {
-    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, &HttpClient::write_headers);
-    curl_easy_setopt(curl, CURLOPT_WRITEHEADER, response_headers);
-  }
+  return ((_hedging) && (request_type != RequestType::POST));
 }
 
-void HttpClient::set_curl_options_request(CURL* curl, RequestType request_type)
+unsigned long HttpClient::hedge_delay_ms()
 {
-  switch (request_type)
+  // The load monitor only tracks the mean latency, so estimate the percentile
+  // by assuming that latencies are exponentially distributed. Before any
+  // requests have completed, use the target latency instead.
+  double latency_us = _load_monitor->get_current_latency_us();
+
+  if (latency_us <= 0)
   {
-  case RequestType::DELETE:
-    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
-    break;
-  case RequestType::PUT:
-    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PUT");
-    break;
-  case RequestType::POST:
-    curl_easy_setopt(curl, CURLOPT_POST, 1);
-    break;
-  case RequestType::GET:
-    curl_easy_setopt(curl, CURLOPT_HTTPGET, 1);
-    break;
+    latency_us = _load_monitor->get_target_latency_us();
   }
+
+  double delay_us = -log(1 - (_hedging_options.percentile / 100)) * latency_us;
+
+  return std::max(1ul, (unsigned long)(delay_us / 1000));
 }
 
-/// cURL helper - write data into string.
-size_t HttpClient::string_store(void* ptr, size_t size, size_t nmemb, void* stream)
+void HttpClient::set_hedge_timer(AsyncIoThread* io_thread, RequestState* state)
 {
-  ((std::string*)stream)->append((char*)ptr, size * nmemb);
-  return (size * nmemb);
+  cancel_hedge_timer(io_thread, state);
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  unsigned long now_ms = now.tv_sec * 1000 + (now.tv_nsec / 1000000);
+
+  state->hedge_timer =
+    io_thread->hedge_timers.insert(std::make_pair(now_ms + hedge_delay_ms(), state));
+  state->hedge_timer_set = true;
+}
+
+void HttpClient::cancel_hedge_timer(AsyncIoThread* io_thread, RequestState* state)
+{
+  if (state->hedge_timer_set)
+  {
+    io_thread->hedge_timers.erase(state->hedge_timer);
+    state->hedge_timer_set = false;
+  }
+}
+
+int HttpClient::process_hedge_timers(AsyncIoThread* io_thread, int max_wait_ms)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  unsigned long now_ms = now.tv_sec * 1000 + (now.tv_nsec / 1000000);
+
+  while ((!io_thread->hedge_timers.empty()) &&
+         (io_thread->hedge_timers.begin()->first <= now_ms))
+  {
+    RequestState* state = io_thread->hedge_timers.begin()->second;
+    io_thread->hedge_timers.erase(io_thread->hedge_timers.begin());
+    state->hedge_timer_set = false;
+
+    start_hedge(io_thread, state);
+  }
+
+  if (io_thread->hedge_timers.empty())
+  {
+    return max_wait_ms;
+  }
+
+  return (int)std::min((unsigned long)max_wait_ms,
+                       io_thread->hedge_timers.begin()->first - now_ms);
+}
+
+void HttpClient::start_hedge(AsyncIoThread* io_thread, RequestState* state)
+{
+  state->hedge_fired = true;
+
+  RequestState* hedge = new RequestState(state->request_type,
+                                         state->url,
+                                         state->body,
+                                         state->username,
+                                         state->trail,
+                                         state->headers_to_add,
+                                         NULL,
+                                         NULL,
+                                         NULL,
+                                         state->allowed_host_state);
+  hedge->async = true;
+  hedge->method_str = state->method_str;
+  hedge->request_template = state->request_template;
+  hedge->uuid_str = state->uuid_str;
+  build_headers(*hedge);
+  hedge->scheme = state->scheme;
+  hedge->host = state->host;
+  hedge->port = state->port;
+  hedge->path = state->path;
+  hedge->host_is_ip = state->host_is_ip;
+  hedge->target_it = state->target_it;
+  hedge->hedge_primary = state;
+
+  if (!start_attempt(*hedge))
+  {
+    TRC_DEBUG("No other targets to hedge HTTP request to %s", state->url.c_str());
+    delete hedge; hedge = NULL;
+    return;
+  }
+
+  TRC_DEBUG("Hedging HTTP request to %s (trying %s)",
+            state->url.c_str(),
+            hedge->remote_ip);
+
+  if (_hedging_options.hedges_fired_table != NULL)
+  {
+    _hedging_options.hedges_fired_table->increment();
+  }
+
+  state->hedge = hedge;
+  add_async_attempt(io_thread, hedge);
+}
+
+void HttpClient::update_stream_statistic(RequestState& state, bool started)
+{
+  if ((_http2) &&
+      (_http2_options.stream_stat_table != NULL) &&
+      (state.remote_ip != NULL))
+  {
+    if (started)
+    {
+      _http2_options.stream_stat_table->get(state.remote_ip)->increment();
+    }
+    else
+    {
+      _http2_options.stream_stat_table->get(state.remote_ip)->decrement();
+    }
+  }
+}
+
+HttpClient::AsyncIoThread::AsyncIoThread(HttpClient* client) :
+  client(client),
+  multi(curl_multi_init()),
+  running(false),
+  queue(),
+  terminate(false),
+  in_flight(),
+  streams(),
+  waiting(),
+  connected()
+{
+  wakeup_pipe[0] = -1;
+  wakeup_pipe[1] = -1;
+  pthread_mutex_init(&lock, NULL);
+}
+
+HttpClient::AsyncIoThread::~AsyncIoThread()
+{
+  curl_multi_cleanup(multi);
+
+  if (wakeup_pipe[0] != -1)
+  {
+    close(wakeup_pipe[0]);
+    close(wakeup_pipe[1]);
+  }
+
+  pthread_mutex_destroy(&lock);
+}
+
+void HttpClient::start_async_io_threads()
+{
+  pthread_mutex_lock(&_async_lock);
+
+  while (_async_io_threads.size() < _num_async_io_threads)
+  {
+    AsyncIoThread* io_thread = new AsyncIoThread(this);
+
+    if ((_http2) && (io_thread->multi != NULL))
+    {
+      // Multiplex requests to the same target over a limited number of
+      // connections. Requests that can't get a stream wait in the multi
+      // handle until one is free.
+      curl_multi_setopt(io_thread->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+      curl_multi_setopt(io_thread->multi,
+                        CURLMOPT_MAX_HOST_CONNECTIONS,
+                        _http2_options.max_connections_per_target);
+#if LIBCURL_VERSION_NUM >= 0x074300
+      curl_multi_setopt(io_thread->multi,
+                        CURLMOPT_MAX_CONCURRENT_STREAMS,
+                        _http2_options.max_concurrent_streams);
+#endif
+    }
+
+    if ((io_thread->multi == NULL) ||
+        (pipe2(io_thread->wakeup_pipe, O_NONBLOCK | O_CLOEXEC) != 0) ||
+        (pthread_create(&io_thread->thread, NULL, async_io_thread_fn, io_thread) != 0))
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to start HTTP I/O thread (%d)", errno);
+      delete io_thread; io_thread = NULL;
+      break;
+      // LCOV_EXCL_STOP
+    }
+
+    io_thread->running = true;
+    _async_io_threads.push_back(io_thread);
+  }
+
+  pthread_mutex_unlock(&_async_lock);
 }
 
-size_t HttpClient::write_headers(void *ptr, size_t size, size_t nmemb, std::map<std::string, std::string> *headers)
+void HttpClient::stop_async_io_threads()
 {
-  char* headerLine = reinterpret_cast<char *>(ptr);
+  pthread_mutex_lock(&_async_lock);
+
+  for (AsyncIoThread* io_thread : _async_io_threads)
+  {
+    pthread_mutex_lock(&io_thread->lock);
+    io_thread->terminate = true;
+    pthread_mutex_unlock(&io_thread->lock);
+
+    char wakeup = 0;
+    if (write(io_thread->wakeup_pipe[1], &wakeup, 1) < 0)
+    {
+      TRC_DEBUG("Failed to wake HTTP I/O thread (%d)", errno); // LCOV_EXCL_LINE
+    }
 
-  // convert to string
-  std::string headerString(headerLine, (size * nmemb));
+    pthread_join(io_thread->thread, NULL);
+    delete io_thread; io_thread = NULL;
+  }
+
+  _async_io_threads.clear();
+
+  pthread_mutex_unlock(&_async_lock);
+}
 
-  std::string key;
-  std::string val;
+void* HttpClient::async_io_thread_fn(void* io_thread)
+{
+  AsyncIoThread* thread = (AsyncIoThread*)io_thread;
+  thread->client->async_io_thread_func(thread);
+  return NULL;
+}
 
-  // find colon
-  size_t colon_loc = headerString.find(":");
-  if (colon_loc == std::string::npos)
+void HttpClient::start_async_attempt(AsyncIoThread* io_thread,
+                                     RequestState* state)
+{
+  if (start_attempt(*state))
   {
-    key = headerString;
-    val = "";
+    // Hedge the request if this attempt takes too long, unless it has been
+    // hedged already.
+    if ((state->hedgeable) && (!state->hedge_fired))
+    {
+      set_hedge_timer(io_thread, state);
+    }
+
+    add_async_attempt(io_thread, state);
   }
   else
   {
-    key = headerString.substr(0, colon_loc);
-    val = headerString.substr(colon_loc + 1, std::string::npos);
+    // There are no more targets to try.
+    finish_async_request(io_thread, state);
+  }
+}
+
+void HttpClient::add_async_attempt(AsyncIoThread* io_thread,
+                                   RequestState* state)
+{
+  if ((_http2) && (free_streams(io_thread, state->target) == 0))
+  {
+    TRC_DEBUG("No free streams to %s - queueing request", state->remote_ip);
+    io_thread->waiting[state->target].push_back(state);
+    return;
   }
 
-  // Lowercase the key (for consistency) and remove spaces
-  std::transform(key.begin(), key.end(), key.begin(), ::tolower);
-  key.erase(std::remove_if(key.begin(), key.end(), ::isspace), key.end());
-  val.erase(std::remove_if(val.begin(), val.end(), ::isspace), val.end());
+  if (_http2)
+  {
+    io_thread->streams[state->target]++;
+  }
 
-  TRC_DEBUG("Received header %s with value %s", key.c_str(), val.c_str());
-  TRC_DEBUG("Header pointer: %p", headers);
-  (*headers)[key] = val;
+  CURLMcode mrc = curl_multi_add_handle(io_thread->multi, state->curl);
 
-  return size * nmemb;
+  if (mrc == CURLM_OK)
+  {
+    io_thread->in_flight[state->curl] = state;
+    update_stream_statistic(*state, true);
+  }
+  else
+  {
+    // LCOV_EXCL_START - curl only rejects handles it is already using
+    TRC_ERROR("Failed to add HTTP request to %s to multi handle: %s",
+              state->url.c_str(),
+              curl_multi_strerror(mrc));
+    finish_async_attempt(io_thread, state, CURLE_FAILED_INIT);
+    // LCOV_EXCL_STOP
+  }
 }
 
-void HttpClient::cleanup_uuid(void *uuid_gen)
+unsigned int HttpClient::free_streams(AsyncIoThread* io_thread,
+                                      const AddrInfo& target)
 {
-  delete (RandomUUIDGenerator*)uuid_gen; uuid_gen = NULL;
+  // Until a connection to the target has carried a response, only send one
+  // request to it. cURL applies the connection timeout to the whole of any
+  // request that waits for a connection to be set up, so requests queued
+  // behind the first one would otherwise time out if the server took longer
+  // than that to respond.
+  unsigned int limit = 1;
+
+  if (io_thread->connected.count(target) > 0)
+  {
+    limit = (unsigned int)(_http2_options.max_concurrent_streams *
+                           _http2_options.max_connections_per_target);
+  }
+
+  unsigned int streams = io_thread->streams[target];
+  return (streams < limit) ? (limit - streams) : 0;
 }
 
-boost::uuids::uuid HttpClient::get_random_uuid()
+void HttpClient::finish_async_attempt(AsyncIoThread* io_thread,
+                                      RequestState* state,
+                                      CURLcode rc)
 {
-  // Get the factory from thread local data (creating it if it doesn't exist).
-  RandomUUIDGenerator* uuid_gen;
-  uuid_gen =
-    (RandomUUIDGenerator*)pthread_getspecific(_uuid_thread_local);
+  if (_http2)
+  {
+    if (rc == CURLE_OK)
+    {
+      io_thread->connected.insert(state->target);
+    }
+    else
+    {
+      io_thread->connected.erase(state->target);
+    }
+
+    release_stream(io_thread, state->target);
+  }
 
-  if (uuid_gen == NULL)
+  if (complete_attempt(*state, rc))
+  {
+    start_async_attempt(io_thread, state);
+  }
+  else
   {
-    uuid_gen = new RandomUUIDGenerator();
-    pthread_setspecific(_uuid_thread_local, uuid_gen);
+    finish_async_request(io_thread, state);
   }
+}
+
+void HttpClient::release_stream(AsyncIoThread* io_thread, const AddrInfo& target)
+{
+  io_thread->streams[target]--;
+
+  // Start the requests that are waiting for the streams that are now free.
+  // This looks up the queue each time round, as starting a request can fail
+  // and recurse back into this function.
+  while (true)
+  {
+    std::map<AddrInfo, std::deque<RequestState*>>::iterator waiting_it =
+                                                  io_thread->waiting.find(target);
+
+    if ((waiting_it == io_thread->waiting.end()) ||
+        (free_streams(io_thread, target) == 0))
+    {
+      break;
+    }
+
+    RequestState* next_state = waiting_it->second.front();
+    waiting_it->second.pop_front();
+
+    if (waiting_it->second.empty())
+    {
+      io_thread->waiting.erase(waiting_it);
+    }
 
-  // _uuid_gen_ is a pointer to a callable object that returns a UUID.
-  return (*uuid_gen)();
+    add_async_attempt(io_thread, next_state);
+  }
 }
 
-void HttpClient::sas_add_ip(SAS::Event& event, CURL* curl, CURLINFO info)
+void HttpClient::finish_async_request(AsyncIoThread* io_thread,
+                                      RequestState* state)
+{
+  RequestState* primary = (state->hedge_primary != NULL) ?
+                                                  state->hedge_primary : state;
+  RequestState* hedge = primary->hedge;
+
+  cancel_hedge_timer(io_thread, primary);
+
+  if (hedge != NULL)
+  {
+    RequestState* other = (state == primary) ? hedge : primary;
+
+    if ((state->rc != CURLE_OK) && (!other->finished))
+    {
+      // These attempts failed, but the other side's are still in progress,
+      // so wait for its response.
+      state->finished = true;
+      return;
+    }
+
+    if (!other->finished)
+    {
+      // We've got a response, so the other side's attempt isn't needed.
+      cancel_async_attempt(io_thread, other);
+    }
+
+    if (state == hedge)
+    {
+      TRC_DEBUG("Using response to hedged HTTP request to %s", state->url.c_str());
+
+      if ((state->rc == CURLE_OK) &&
+          (_hedging_options.hedges_won_table != NULL))
+      {
+        _hedging_options.hedges_won_table->increment();
+      }
+
+      *primary->doc = std::move(*hedge->doc);
+      *primary->raw_headers = std::move(*hedge->raw_headers);
+      primary->rc = hedge->rc;
+      primary->http_code = hedge->http_code;
+    }
+
+    // Count the hedge's attempts along with the request's, so that the
+    // request's outcome reflects both.
+    primary->attempts += hedge->attempts;
+    primary->num_http_503_responses += hedge->num_http_503_responses;
+    primary->num_http_504_responses += hedge->num_http_504_responses;
+    primary->num_timeouts_or_io_errors += hedge->num_timeouts_or_io_errors;
+
+    primary->hedge = NULL;
+    delete hedge; hedge = NULL;
+  }
+
+  primary->http_code = complete_request(*primary);
+  complete_async_request(primary);
+}
+
+void HttpClient::cancel_async_attempt(AsyncIoThread* io_thread,
+                                      RequestState* state)
+{
+  std::map<CURL*, RequestState*>::iterator it = io_thread->in_flight.find(state->curl);
+
+  if (it != io_thread->in_flight.end())
+  {
+    curl_multi_remove_handle(io_thread->multi, state->curl);
+    io_thread->in_flight.erase(it);
+    update_stream_statistic(*state, false);
+    abandon_attempt(*state);
+
+    if (_http2)
+    {
+      release_stream(io_thread, state->target);
+    }
+  }
+  else
+  {
+    // The attempt is waiting for a stream.
+    std::map<AddrInfo, std::deque<RequestState*>>::iterator waiting_it =
+                                          io_thread->waiting.find(state->target);
+
+    if (waiting_it != io_thread->waiting.end())
+    {
+      std::deque<RequestState*>& waiting = waiting_it->second;
+      waiting.erase(std::remove(waiting.begin(), waiting.end(), state),
+                    waiting.end());
+
+      if (waiting.empty())
+      {
+        io_thread->waiting.erase(waiting_it);
+      }
+    }
+
+    abandon_attempt(*state);
+  }
+}
+
+void HttpClient::complete_async_request(RequestState* state)
+{
+  if (state->callback)
+  {
+    // A response that was written to the caller's storage isn't passed to
+    // the callback as well.
+    state->callback(HttpResponse(state->http_code,
+                                 (state->doc == &state->own_doc) ?
+                                   std::move(state->own_doc) : std::string(),
+                                 (state->raw_headers == &state->own_raw_headers) ?
+                                   std::move(state->own_raw_headers) : std::string(),
+                                 HttpResponse::RawHeaders()));
+  }
+
+  delete state; state = NULL;
+}
+
+void HttpClient::async_io_thread_func(AsyncIoThread* io_thread)
+{
+  bool terminate = false;
+
+  while (!terminate)
+  {
+    // Pick up any new requests.
+    std::deque<RequestState*> new_requests;
+
+    pthread_mutex_lock(&io_thread->lock);
+    new_requests.swap(io_thread->queue);
+    terminate = io_thread->terminate;
+    pthread_mutex_unlock(&io_thread->lock);
+
+    for (RequestState* state : new_requests)
+    {
+      if (!terminate)
+      {
+        start_async_attempt(io_thread, state);
+      }
+      else
+      {
+        // We're being destroyed, so don't start the request.
+        state->rc = CURLE_ABORTED_BY_CALLBACK;
+        state->http_code = HTTP_SERVER_UNAVAILABLE;
+        complete_async_request(state);
+      }
+    }
+
+    if (terminate)
+    {
+      break;
+    }
+
+    // Send and receive whatever data we can without blocking.
+    int running_handles = 0;
+    curl_multi_perform(io_thread->multi, &running_handles);
+
+    // Process the attempts that have finished, moving on to the next target
+    // if an attempt failed.
+    CURLMsg* msg;
+    int msgs_left = 0;
+    while ((msg = curl_multi_info_read(io_thread->multi, &msgs_left)) != NULL)
+    {
+      if (msg->msg == CURLMSG_DONE)
+      {
+        CURL* curl = msg->easy_handle;
+        CURLcode rc = msg->data.result;
+        curl_multi_remove_handle(io_thread->multi, curl);
+
+        std::map<CURL*, RequestState*>::iterator it = io_thread->in_flight.find(curl);
+        if (it != io_thread->in_flight.end())
+        {
+          RequestState* state = it->second;
+          io_thread->in_flight.erase(it);
+          update_stream_statistic(*state, false);
+          finish_async_attempt(io_thread, state, rc);
+        }
+      }
+    }
+
+    // Send any hedges that are due.
+    int wait_ms = process_hedge_timers(io_thread, 1000);
+
+    // Wait for activity on the requests' sockets, to be woken for a new
+    // request, or for the next hedge to be due.
+    struct curl_waitfd wakeup_fd;
+    wakeup_fd.fd = io_thread->wakeup_pipe[0];
+    wakeup_fd.events = CURL_WAIT_POLLIN;
+    wakeup_fd.revents = 0;
+    int numfds = 0;
+
+    CW_IO_STARTS("Waiting for HTTP responses")
+    {
+      curl_multi_wait(io_thread->multi, &wakeup_fd, 1, wait_ms, &numfds);
+    }
+    CW_IO_COMPLETES()
+
+    if (wakeup_fd.revents != 0)
+    {
+      char buf[64];
+      while (read(io_thread->wakeup_pipe[0], buf, sizeof(buf)) > 0)
+      {
+      }
+    }
+  }
+
+  // We're being destroyed, so abandon any requests still in flight, or
+  // waiting for a stream.
+  std::vector<RequestState*> abandoned_requests;
+  std::vector<RequestState*> abandoned_hedges;
+
+  for (std::pair<CURL* const, RequestState*>& entry : io_thread->in_flight)
+  {
+    curl_multi_remove_handle(io_thread->multi, entry.first);
+    update_stream_statistic(*entry.second, false);
+    ((entry.second->hedge_primary != NULL) ?
+       abandoned_hedges : abandoned_requests).push_back(entry.second);
+  }
+
+  for (std::pair<const AddrInfo, std::deque<RequestState*>>& entry : io_thread->waiting)
+  {
+    for (RequestState* state : entry.second)
+    {
+      ((state->hedge_primary != NULL) ?
+         abandoned_hedges : abandoned_requests).push_back(state);
+    }
+  }
+
+  io_thread->in_flight.clear();
+  io_thread->waiting.clear();
+  io_thread->hedge_timers.clear();
+
+  // A hedge is simply deleted, along with the request if that was waiting for
+  // the hedge's response.
+  for (RequestState* hedge : abandoned_hedges)
+  {
+    TRC_DEBUG("Abandoning hedged HTTP request to %s", hedge->url.c_str());
+    abandon_attempt(*hedge);
+
+    RequestState* primary = hedge->hedge_primary;
+    primary->hedge = NULL;
+    delete hedge; hedge = NULL;
+
+    if (primary->finished)
+    {
+      complete_async_request(primary);
+    }
+  }
+
+  for (RequestState* state : abandoned_requests)
+  {
+    TRC_DEBUG("Abandoning HTTP request to %s", state->url.c_str());
+    abandon_attempt(*state);
+
+    // Any hedge that is left has already failed.
+    delete state->hedge; state->hedge = NULL;
+    complete_async_request(state);
+  }
+}
+
+void HttpClient::build_headers(RequestState& state)
+{
+  struct curl_slist* extra_headers = NULL;
+
+  if (!state.body.empty())
+  {
+    extra_headers = curl_slist_append(extra_headers, "Content-Type: application/json");
+  }
+
+  // If a provider's body has an unknown size, send it in chunks. HTTP/2
+  // frames the body itself, so doesn't need (or allow) this.
+  if ((state.body.provider) && (state.body.size < 0) && (!_http2))
+  {
+    extra_headers = curl_slist_append(extra_headers, "Transfer-Encoding: chunked");
+  }
+
+  // Add the UUID for SAS correlation to the HTTP message. The header is
+  // formatted on the stack, as cURL takes its own copy.
+  char branch_header[128];
+  snprintf(branch_header,
+           sizeof(branch_header),
+           "%s: %s",
+           SASEvent::HTTP_BRANCH_HEADER_NAME.c_str(),
+           state.uuid_str.c_str());
+  extra_headers = curl_slist_append(extra_headers, branch_header);
+
+  // Add in any extra headers
+  for (std::vector<std::string>::const_iterator i = state.headers_to_add.begin();
+       i != state.headers_to_add.end();
+       ++i)
+  {
+    extra_headers = curl_slist_append(extra_headers, (*i).c_str());
+  }
+
+  // Add the user's identity (if required).
+  if (_assert_user)
+  {
+    extra_headers = curl_slist_append(extra_headers,
+                                      ("X-XCAP-Asserted-Identity: " + state.username).c_str());
+  }
+
+  if (extra_headers == NULL)
+  {
+    // LCOV_EXCL_START - cURL only fails to build a list if it runs out of memory
+    TRC_WARNING("Failed to build headers for HTTP request to %s",
+                state.url.c_str());
+    return;
+    // LCOV_EXCL_STOP
+  }
+
+  // Follow this request's headers with the shared ones.
+  struct curl_slist* end = extra_headers;
+
+  while (end->next != NULL)
+  {
+    end = end->next;
+  }
+
+  end->next = (state.request_template != nullptr) ?
+                state.request_template->_header_list : _shared_headers;
+
+  state.extra_headers = extra_headers;
+  state.extra_headers_end = end;
+}
+
+void HttpClient::set_curl_options_general(CURL* curl, RequestState& state)
+{
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, state.doc);
+
+  if (state.body.provider)
+  {
+    // cURL reads the body from the provider as it sends it. The request type
+    // (set later) replaces the POST method if necessary.
+    curl_easy_setopt(curl, CURLOPT_POST, 1);
+    curl_easy_setopt(curl, CURLOPT_READFUNCTION, &HttpClient::read_body);
+    curl_easy_setopt(curl, CURLOPT_READDATA, &state);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)state.body.size);
+  }
+  else if (state.body.length > 0)
+  {
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)state.body.length);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, state.body.data);
+  }
+}
+
+HttpClient::RequestBody HttpClient::request_body(const HttpRequest& req)
+{
+  if (req._body_provider)
+  {
+    RequestBody body;
+    body.provider = req._body_provider;
+    body.size = req._body_size;
+    return body;
+  }
+  else if (req._body_data != NULL)
+  {
+    return RequestBody(req._body_data, req._body_length);
+  }
+
+  return RequestBody(req._body.data(), req._body.size());
+}
+
+void HttpClient::set_curl_options_response(CURL* curl, RequestState& state)
+{
+  // We always want to catch the response headers, even if the caller isn't
+  // interested, as we check 503 responses for a Retry-After header.
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, &HttpClient::store_header);
+  curl_easy_setopt(curl, CURLOPT_WRITEHEADER, &state);
+}
+
+void HttpClient::set_curl_options_request(CURL* curl, RequestType request_type)
+{
+  switch (request_type)
+  {
+  case RequestType::DELETE:
+    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
+    break;
+  case RequestType::PUT:
+    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PUT");
+    break;
+  case RequestType::POST:
+    curl_easy_setopt(curl, CURLOPT_POST, 1);
+    break;
+  case RequestType::GET:
+    curl_easy_setopt(curl, CURLOPT_HTTPGET, 1);
+    break;
+  }
+}
+
+/// cURL helper - write data into string.
+size_t HttpClient::string_store(void* ptr, size_t size, size_t nmemb, void* stream)
+{
+  ((std::string*)stream)->append((char*)ptr, size * nmemb);
+  return (size * nmemb);
+}
+
+size_t HttpClient::read_body(char* buffer, size_t size, size_t nitems, void* state)
+{
+  RequestState* request_state = (RequestState*)state;
+  request_state->body_read = true;
+
+  return request_state->body.provider(buffer, size * nitems);
+}
+
+size_t HttpClient::store_header(void* ptr, size_t size, size_t nmemb, void* state)
+{
+  RequestState* request_state = (RequestState*)state;
+  const char* line = (const char*)ptr;
+  size_t length = size * nmemb;
+
+  request_state->raw_headers->append(line, length);
+
+  // If the response says how long its body is, make room for it now, rather
+  // than growing the buffer as the body arrives. Don't trust very large
+  // lengths though.
+  static const char CONTENT_LENGTH[] = "content-length:";
+  static const size_t CONTENT_LENGTH_LEN = sizeof(CONTENT_LENGTH) - 1;
+
+  if ((length > CONTENT_LENGTH_LEN) &&
+      (strncasecmp(line, CONTENT_LENGTH, CONTENT_LENGTH_LEN) == 0))
+  {
+    std::string value(line + CONTENT_LENGTH_LEN, length - CONTENT_LENGTH_LEN);
+    unsigned long long content_length = strtoull(value.c_str(), NULL, 10);
+
+    if ((content_length > 0) && (content_length <= MAX_RESERVED_BODY_SIZE))
+    {
+      request_state->doc->reserve(request_state->doc->size() + content_length);
+    }
+  }
+
+  return length;
+}
+
+void HttpClient::parse_headers(const std::string& raw_headers,
+                               std::map<std::string, std::string>& headers)
+{
+  size_t start = 0;
+
+  while (start < raw_headers.size())
+  {
+    size_t end = raw_headers.find('\n', start);
+    end = (end == std::string::npos) ? raw_headers.size() : end + 1;
+
+    std::string key;
+    std::string val;
+
+    // find colon
+    size_t colon_loc = raw_headers.find(':', start);
+    if ((colon_loc == std::string::npos) || (colon_loc >= end))
+    {
+      key = raw_headers.substr(start, end - start);
+      val = "";
+    }
+    else
+    {
+      key = raw_headers.substr(start, colon_loc - start);
+      val = raw_headers.substr(colon_loc + 1, end - colon_loc - 1);
+    }
+
+    // Lowercase the key (for consistency) and remove spaces
+    std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+    key.erase(std::remove_if(key.begin(), key.end(), ::isspace), key.end());
+    val.erase(std::remove_if(val.begin(), val.end(), ::isspace), val.end());
+
+    TRC_DEBUG("Received header %s with value %s", key.c_str(), val.c_str());
+    headers[key] = val;
+
+    start = end;
+  }
+}
+
+std::string HttpClient::sas_get_ip(CURL* curl, CURLINFO info)
 {
   char* ip;
 
@@ -754,43 +2014,43 @@ void HttpClient::sas_add_ip(SAS::Event& event, CURL* curl, CURLINFO info)
     if ((_log_display_address) && (info == CURLINFO_PRIMARY_IP))
     {
       // The HttpClient is configured to log an address other than the server
-      event.add_var_param(_server_display_address);
+      return _server_display_address;
     }
     else
     {
-      event.add_var_param(ip);
+      return ip;
     }
   }
   else
   {
-    event.add_var_param("unknown"); // LCOV_EXCL_LINE FakeCurl cannot fail the getinfo call.
+    return "unknown"; // LCOV_EXCL_LINE FakeCurl cannot fail the getinfo call.
   }
 }
 
-void HttpClient::sas_add_port(SAS::Event& event, CURL* curl, CURLINFO info)
+long HttpClient::sas_get_port(CURL* curl, CURLINFO info)
 {
   long port;
 
   if (curl_easy_getinfo(curl, info, &port) == CURLE_OK)
   {
-    event.add_static_param(port);
+    return port;
   }
   else
   {
-    event.add_static_param(0); // LCOV_EXCL_LINE FakeCurl cannot fail the getinfo call.
+    return 0; // LCOV_EXCL_LINE FakeCurl cannot fail the getinfo call.
   }
 }
 
-void HttpClient::sas_add_ip_addrs_and_ports(SAS::Event& event,
-                                                CURL* curl)
+void HttpClient::sas_get_ip_addrs_and_ports(SasHttpMessage& message,
+                                            CURL* curl)
 {
-  // Add the remote IP and port.
-  sas_add_ip(event, curl, CURLINFO_PRIMARY_IP);
-  sas_add_port(event, curl, CURLINFO_PRIMARY_PORT);
+  // Get the remote IP and port.
+  message.remote_ip = sas_get_ip(curl, CURLINFO_PRIMARY_IP);
+  message.remote_port = sas_get_port(curl, CURLINFO_PRIMARY_PORT);
 
-  // Now add the local IP and port.
-  sas_add_ip(event, curl, CURLINFO_LOCAL_IP);
-  sas_add_port(event, curl, CURLINFO_LOCAL_PORT);
+  // Now get the local IP and port.
+  message.local_ip = sas_get_ip(curl, CURLINFO_LOCAL_IP);
+  message.local_port = sas_get_port(curl, CURLINFO_LOCAL_PORT);
 }
 
 std::string HttpClient::get_obscured_message_to_log(const std::string& message)
@@ -816,7 +2076,7 @@ void HttpClient::sas_log_http_req(SAS::TrailId trail,
                                   CURL* curl,
                                   const std::string& method_str,
                                   const std::string& url,
-                                  const std::string& request_bytes,
+                                  std::string& request_bytes,
                                   SAS::Timestamp timestamp,
                                   uint32_t instance_id)
 {
@@ -824,25 +2084,22 @@ void HttpClient::sas_log_http_req(SAS::TrailId trail,
   {
     int event_id = ((_sas_log_level == SASEvent::HttpLogLevel::PROTOCOL) ?
                     SASEvent::TX_HTTP_REQ : SASEvent::TX_HTTP_REQ_DETAIL);
-    SAS::Event event(trail, event_id, instance_id);
-
-    sas_add_ip_addrs_and_ports(event, curl);
 
-    if (!_should_omit_body)
-    {
-      event.add_var_param(request_bytes);
-    }
-    else
+    if (SASEventSampler::should_report(event_id))
     {
-      std::string message_to_log = get_obscured_message_to_log(request_bytes);
-      event.add_var_param(message_to_log);
+      std::shared_ptr<SasHttpMessage> message(new SasHttpMessage());
+      message->trail = trail;
+      message->event_id = event_id;
+      message->instance_id = instance_id;
+      message->timestamp = timestamp;
+      sas_get_ip_addrs_and_ports(*message, curl);
+      message->http_rc = -1;
+      message->method_str = method_str;
+      message->url = url;
+      message->bytes.swap(request_bytes);
+
+      sas_report_http_message(message);
     }
-
-    event.add_var_param(method_str);
-    event.add_var_param(Utils::url_unescape(url));
-
-    event.set_timestamp(timestamp);
-    SAS::report_event(event);
   }
 }
 
@@ -851,33 +2108,74 @@ void HttpClient::sas_log_http_rsp(SAS::TrailId trail,
                                   long http_rc,
                                   const std::string& method_str,
                                   const std::string& url,
-                                  const std::string& response_bytes,
+                                  std::string& response_bytes,
                                   uint32_t instance_id)
 {
   if (_sas_log_level != SASEvent::HttpLogLevel::NONE)
   {
     int event_id = ((_sas_log_level == SASEvent::HttpLogLevel::PROTOCOL) ?
                     SASEvent::RX_HTTP_RSP : SASEvent::RX_HTTP_RSP_DETAIL);
-    SAS::Event event(trail, event_id, instance_id);
 
-    sas_add_ip_addrs_and_ports(event, curl);
-    event.add_static_param(http_rc);
-
-    if (!_should_omit_body)
-    {
-      event.add_var_param(response_bytes);
-    }
-    else
+    if (SASEventSampler::should_report(event_id))
     {
-      std::string message_to_log = get_obscured_message_to_log(response_bytes);
-      event.add_var_param(message_to_log);
+      // Timestamp the event now, in case it is built later.
+      std::shared_ptr<SasHttpMessage> message(new SasHttpMessage());
+      message->trail = trail;
+      message->event_id = event_id;
+      message->instance_id = instance_id;
+      message->timestamp = SAS::get_current_timestamp();
+      sas_get_ip_addrs_and_ports(*message, curl);
+      message->http_rc = http_rc;
+      message->method_str = method_str;
+      message->url = url;
+      message->bytes.swap(response_bytes);
+
+      sas_report_http_message(message);
     }
+  }
+}
 
-    event.add_var_param(method_str);
-    event.add_var_param(Utils::url_unescape(url));
+void HttpClient::sas_report_http_message(std::shared_ptr<SasHttpMessage> message)
+{
+  if (_sas_log_pool != NULL)
+  {
+    _sas_log_pool->add_work([this, message]() { sas_build_http_event(*message); });
+  }
+  else
+  {
+    sas_build_http_event(*message);
+  }
+}
 
-    SAS::report_event(event);
+void HttpClient::sas_build_http_event(const SasHttpMessage& message)
+{
+  SAS::Event event(message.trail, message.event_id, message.instance_id);
+
+  event.add_var_param(message.remote_ip);
+  event.add_static_param(message.remote_port);
+  event.add_var_param(message.local_ip);
+  event.add_static_param(message.local_port);
+
+  if (message.http_rc >= 0)
+  {
+    event.add_static_param(message.http_rc);
+  }
+
+  if (!_should_omit_body)
+  {
+    event.add_var_param(message.bytes);
   }
+  else
+  {
+    std::string message_to_log = get_obscured_message_to_log(message.bytes);
+    event.add_var_param(message_to_log);
+  }
+
+  event.add_var_param(message.method_str);
+  event.add_var_param(Utils::url_unescape(message.url));
+
+  event.set_timestamp(message.timestamp);
+  SAS::report_event(event);
 }
 
 void HttpClient::sas_log_http_abort(SAS::TrailId trail,
@@ -936,19 +2234,19 @@ void HttpClient::host_port_from_server(const std::string& scheme,
                                        std::string& host,
                                        int& port)
 {
-  std::string server_copy = server;
-  Utils::trim(server_copy);
+  // Work on a view of the server, so that only the host is copied.
+  boost::string_ref server_ref = Utils::trim(boost::string_ref(server));
   size_t colon_idx;
-  if (((server_copy[0] != '[') ||
-       (server_copy[server_copy.length() - 1] != ']')) &&
-      ((colon_idx = server_copy.find_last_of(':')) != std::string::npos))
+  if ((!Utils::is_bracketed_address(server_ref)) &&
+      ((colon_idx = server_ref.rfind(':')) != boost::string_ref::npos))
   {
-    host = server_copy.substr(0, colon_idx);
-    port = stoi(server_copy.substr(colon_idx + 1));
+    boost::string_ref port_ref = server_ref.substr(colon_idx + 1);
+    host.assign(server_ref.data(), colon_idx);
+    port = stoi(std::string(port_ref.data(), port_ref.size()));
   }
   else
   {
-    host = server_copy;
+    host.assign(server_ref.data(), server_ref.size());
     port = (scheme == "https") ? DEFAULT_HTTPS_PORT : DEFAULT_HTTP_PORT;
   }
 }
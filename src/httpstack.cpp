@@ -12,9 +12,16 @@
 #include "httpstack.h"
 #include <cstring>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <event2/listener.h>
+#include <unistd.h>
+#include <cerrno>
 #include <climits>
 #include <algorithm>
+#include <zlib.h>
 #include "log.h"
+#include "profiling_span.h"
 
 const std::string BODY_OMITTED = "<Body present but not logged>";
 
@@ -34,20 +41,64 @@ HttpStack::HttpStack(int num_threads,
   _access_logger(access_logger),
   _load_monitor(load_monitor),
   _stats(stats),
-  _evbase(nullptr),
-  _evhtp(nullptr)
+  _reuseport(false),
+  _listeners(),
+  _load_feedback(false),
+  _connection_options(),
+  _placement(),
+  _next_thread_index(0),
+  _thread_init_cb(NULL),
+  _health_checker(NULL),
+  _stall_deadline_ms(0),
+  _heartbeat_timers(),
+  _router(),
+  _handlers(),
+  _routes(),
+  _default_handler(NULL),
+  _route_latencies(),
+  _default_latency(),
+  _latency_table(NULL),
+  _percentile_table(NULL),
+  _latency_log_interval_ms(0),
+  _next_latency_log_ms(0),
+  _admissions(),
+  _bound_sockets(),
+  _inherited_sockets(),
+  _inheritance_conn(-1),
+  _handoff(NULL),
+  _compression(),
+  _compression_cache(NULL),
+  _compressed_responses(0),
+  _compressed_bytes_in(0),
+  _compressed_bytes_out(0),
+  _compression_cache_hits(0)
 {
   TRC_STATUS("Constructing HTTP stack with %d threads", _num_threads);
+  pthread_mutex_init(&_heartbeats_lock, NULL);
 }
 
 HttpStack::~HttpStack()
 {
-  for(std::set<HandlerRegistration*>::iterator reg = _handler_registrations.begin();
-      reg != _handler_registrations.end();
-      ++reg)
+  delete _handoff; _handoff = NULL;
+
+  for (std::vector<LatencyHistogram*>::iterator it = _route_latencies.begin();
+       it != _route_latencies.end();
+       ++it)
+  {
+    delete *it;
+  }
+
+  for (std::vector<HeartbeatTimer*>::iterator it = _heartbeat_timers.begin();
+       it != _heartbeat_timers.end();
+       ++it)
   {
-    delete *reg;
+    _health_checker->unregister_heartbeat((*it)->heartbeat);
+    delete *it;
   }
+
+  pthread_mutex_destroy(&_heartbeats_lock);
+
+  delete _compression_cache; _compression_cache = NULL;
 }
 
 void HttpStack::Request::send_reply(int rc, SAS::TrailId trail)
@@ -71,9 +122,213 @@ void HttpStack::send_reply_internal(Request& req, int rc, SAS::TrailId trail)
   log(std::string(req.req()->uri->path->full), req.method_as_str(), rc, latency_us);
   req.sas_log_tx_http_rsp(trail, rc, 0);
 
+  if ((_load_feedback) && (_load_monitor != NULL))
+  {
+    req.add_header(LoadMonitor::LOAD_HEADER,
+                   std::to_string((int)(_load_monitor->load() * 1000)));
+  }
+
+  // Compress after logging, so that SAS sees the uncompressed body.
+  compress_reply(req);
+
   evhtp_send_reply(req.req(), rc);
 }
 
+void HttpStack::set_compression_options(const CompressionOptions& options)
+{
+  _compression = options;
+
+  delete _compression_cache; _compression_cache = NULL;
+
+  if ((_compression.min_size_bytes > 0) && (_compression.cache_budget_bytes > 0))
+  {
+    _compression_cache = new CompressionCache(
+      _compression.cache_budget_bytes,
+      [](const std::string& key, const CompressedBody& body)
+      {
+        return key.length() + body.body.length() + body.compressed.length();
+      });
+  }
+}
+
+HttpStack::CompressionStats HttpStack::compression_stats() const
+{
+  CompressionStats stats;
+  stats.responses = _compressed_responses.load();
+  stats.bytes_in = _compressed_bytes_in.load();
+  stats.bytes_out = _compressed_bytes_out.load();
+  stats.cache_hits = _compression_cache_hits.load();
+  return stats;
+}
+
+void HttpStack::compress_reply(Request& req)
+{
+  evhtp_request_t* evreq = req.req();
+  size_t length = evbuffer_get_length(evreq->buffer_out);
+
+  if ((_compression.min_size_bytes == 0) ||
+      (length < _compression.min_size_bytes) ||
+      (evhtp_header_find(evreq->headers_out, "Content-Encoding") != NULL) ||
+      (evhtp_header_find(evreq->headers_out, "Content-Length") != NULL) ||
+      (!accepts_gzip(evhtp_header_find(evreq->headers_in, "Accept-Encoding"))))
+  {
+    return;
+  }
+
+  // The body is usually in a single chunk already, so this rarely copies.
+  const char* body = (const char*)evbuffer_pullup(evreq->buffer_out, -1);
+  std::shared_ptr<const CompressedBody> compressed =
+    compress_body(body, length, req._compression_cache_key);
+
+  if (compressed->compressed.empty())
+  {
+    return;
+  }
+
+  // Send the compressed body straight from the (possibly cached) copy,
+  // keeping it alive until it has been sent.
+  evbuffer_drain(evreq->buffer_out, length);
+  evbuffer_add_reference(evreq->buffer_out,
+                         compressed->compressed.data(),
+                         compressed->compressed.length(),
+                         free_compressed_body,
+                         new std::shared_ptr<const CompressedBody>(compressed));
+  req.add_header("Content-Encoding", "gzip");
+  req.add_header("Vary", "Accept-Encoding");
+
+  _compressed_responses++;
+  _compressed_bytes_in += length;
+  _compressed_bytes_out += compressed->compressed.length();
+}
+
+std::shared_ptr<const HttpStack::CompressedBody> HttpStack::compress_body(
+                                                   const char* body,
+                                                   size_t length,
+                                                   const std::string& cache_key)
+{
+  bool cacheable = ((_compression_cache != NULL) && (!cache_key.empty()));
+
+  if (cacheable)
+  {
+    // The cached body is only used if the response hasn't changed since it
+    // was compressed.  Comparing them is much cheaper than compressing.
+    std::shared_ptr<const CompressedBody> cached = _compression_cache->get(cache_key);
+
+    if ((cached != NULL) &&
+        (cached->body.length() == length) &&
+        (memcmp(cached->body.data(), body, length) == 0))
+    {
+      _compression_cache_hits++;
+      return cached;
+    }
+  }
+
+  std::shared_ptr<CompressedBody> compressed = std::make_shared<CompressedBody>();
+
+  if ((!gzip(body, length, _compression.level, compressed->compressed)) ||
+      (compressed->compressed.length() >= length))
+  {
+    compressed->compressed.clear();
+  }
+
+  if (cacheable)
+  {
+    TRC_DEBUG("Caching compressed response %s", cache_key.c_str());
+    compressed->body.assign(body, length);
+    _compression_cache->put(cache_key, compressed, _compression.cache_ttl_s);
+  }
+
+  return compressed;
+}
+
+bool HttpStack::gzip(const char* data, size_t length, int level, std::string& out)
+{
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+
+  // A window of 15 bits, plus 16 for a gzip rather than zlib wrapper.
+  if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+  {
+    TRC_WARNING("Failed to initialize zlib"); // LCOV_EXCL_LINE
+    return false; // LCOV_EXCL_LINE
+  }
+
+  out.resize(deflateBound(&stream, length));
+  stream.next_in = (Bytef*)data;
+  stream.avail_in = length;
+  stream.next_out = (Bytef*)&out[0];
+  stream.avail_out = out.length();
+
+  // The output buffer is big enough for the whole body, so this finishes in
+  // one call.
+  int rc = deflate(&stream, Z_FINISH);
+  out.resize(stream.total_out);
+  deflateEnd(&stream);
+
+  return (rc == Z_STREAM_END);
+}
+
+void HttpStack::free_compressed_body(const void* data, size_t length, void* body)
+{
+  delete (std::shared_ptr<const CompressedBody>*)body;
+}
+
+bool HttpStack::accepts_gzip(const char* accept_encoding)
+{
+  if (accept_encoding == NULL)
+  {
+    return false;
+  }
+
+  // The header is a list of codings, each with an optional weight (e.g.
+  // "gzip;q=0.8, *;q=0").  gzip is allowed if it's listed with a non-zero
+  // weight, or if it isn't listed and "*" is.
+  bool gzip_listed = false;
+  bool gzip_allowed = false;
+  bool any_allowed = false;
+
+  std::vector<std::string> codings;
+  Utils::split_string(accept_encoding, ',', codings, 0, true);
+
+  for (std::vector<std::string>::iterator it = codings.begin();
+       it != codings.end();
+       ++it)
+  {
+    std::string coding = *it;
+    float weight = 1.0;
+    size_t semicolon = coding.find(';');
+
+    if (semicolon != std::string::npos)
+    {
+      std::string params = coding.substr(semicolon + 1);
+      coding = coding.substr(0, semicolon);
+      Utils::trim(params);
+
+      if ((params.length() > 2) &&
+          ((params[0] == 'q') || (params[0] == 'Q')) &&
+          (params[1] == '='))
+      {
+        weight = atof(params.c_str() + 2);
+      }
+    }
+
+    Utils::trim(coding);
+    std::transform(coding.begin(), coding.end(), coding.begin(), ::tolower);
+
+    if ((coding == "gzip") || (coding == "x-gzip"))
+    {
+      gzip_listed = true;
+      gzip_allowed = (weight > 0);
+    }
+    else if (coding == "*")
+    {
+      any_allowed = (weight > 0);
+    }
+  }
+
+  return gzip_listed ? gzip_allowed : any_allowed;
+}
+
 
 void HttpStack::send_reply(Request& req,
                            int rc,
@@ -81,7 +336,7 @@ void HttpStack::send_reply(Request& req,
 {
   send_reply_internal(req, rc, trail);
   // Resume the request to actually send it.  This matches the function to pause the request in
-  // HttpStack::handler_callback_fn.
+  // HttpStack::handler_callback.
   evhtp_request_resume(req.req());
 
   // Update the latency stats and throttling algorithm if it's appropriate for
@@ -94,10 +349,159 @@ void HttpStack::send_reply(Request& req,
       _load_monitor->request_complete(latency_us, trail);
     }
 
+    if (req._handler_load_monitor != NULL)
+    {
+      req._handler_load_monitor->request_complete(latency_us, trail);
+    }
+
     if (_stats != NULL)
     {
       _stats->update_http_latency_us(latency_us);
     }
+
+    record_route_latency(req._route_id, latency_us);
+  }
+}
+
+void HttpStack::send_overload_reply(Request& req,
+                                    unsigned int retry_after_s,
+                                    SAS::TrailId trail)
+{
+  TRC_DEBUG("Rejecting request for URL %s, args %s with 503 as the handler is saturated",
+            req.req()->uri->path->full,
+            req.req()->uri->query_raw);
+
+  if (_load_monitor != NULL)
+  {
+    req.sas_log_overload(trail,
+                         503,
+                         _load_monitor->get_target_latency_us(),
+                         _load_monitor->get_current_latency_us(),
+                         _load_monitor->get_rate_limit(),
+                         0);
+  }
+
+  // The request was rejected without being processed, so its latency would
+  // only make the load monitors think we're less loaded than we are.
+  // Instead, tell them to back off.
+  req.set_track_latency(false);
+  req.record_penalty();
+
+  req.add_header("Retry-After", std::to_string(retry_after_s));
+  req.send_reply(503, trail);
+
+  if (_stats != NULL)
+  {
+    _stats->incr_http_rejected_overload();
+    _stats->incr_http_rejected_overload_for_route(route(req._route_id));
+  }
+}
+
+const std::string& HttpStack::route(int route_id) const
+{
+  static const std::string DEFAULT_ROUTE = "";
+  return (route_id != HttpRouter::NO_MATCH) ? _routes[route_id] : DEFAULT_ROUTE;
+}
+
+LatencyHistogram* HttpStack::route_latency(int route_id)
+{
+  return (route_id != HttpRouter::NO_MATCH) ?
+           _route_latencies[route_id] : &_default_latency;
+}
+
+void HttpStack::record_route_latency(int route_id, unsigned long latency_us)
+{
+  route_latency(route_id)->record(latency_us);
+
+  if (_stats != NULL)
+  {
+    _stats->update_http_latency_us_for_route(route(route_id), latency_us);
+  }
+
+  if (_latency_log_interval_ms != 0)
+  {
+    // Only the thread that moves the next log time on writes the log.
+    uint64_t now_ms = Utils::get_time();
+    uint64_t next_ms = _next_latency_log_ms.load();
+
+    if ((now_ms >= next_ms) &&
+        (_next_latency_log_ms.compare_exchange_strong(next_ms,
+                                                      now_ms + _latency_log_interval_ms)))
+    {
+      log_route_latencies();
+    }
+  }
+}
+
+std::map<std::string, LatencyHistogram::Snapshot> HttpStack::route_latencies() const
+{
+  std::map<std::string, LatencyHistogram::Snapshot> latencies;
+
+  for (size_t id = 0; id < _route_latencies.size(); ++id)
+  {
+    if (_route_latencies[id] != NULL)
+    {
+      _route_latencies[id]->snapshot(latencies[_routes[id]]);
+    }
+  }
+
+  if (_default_handler != NULL)
+  {
+    _default_latency.snapshot(latencies[route(HttpRouter::NO_MATCH)]);
+  }
+
+  return latencies;
+}
+
+void HttpStack::set_latency_histogram_table(SNMP::LatencyHistogramTable* table)
+{
+  _latency_table = table;
+
+  for (size_t id = 0; id < _route_latencies.size(); ++id)
+  {
+    if (_route_latencies[id] != NULL)
+    {
+      _latency_table->add_histogram(_routes[id], _route_latencies[id]);
+    }
+  }
+
+  if (_default_handler != NULL)
+  {
+    _latency_table->add_histogram(route(HttpRouter::NO_MATCH), &_default_latency);
+  }
+}
+
+void HttpStack::set_latency_percentile_table(SNMP::LatencyPercentileTable* table)
+{
+  _percentile_table = table;
+
+  for (size_t id = 0; id < _route_latencies.size(); ++id)
+  {
+    if (_route_latencies[id] != NULL)
+    {
+      _percentile_table->add_histogram(_routes[id], _route_latencies[id]);
+    }
+  }
+
+  if (_default_handler != NULL)
+  {
+    _percentile_table->add_histogram(route(HttpRouter::NO_MATCH), &_default_latency);
+  }
+}
+
+void HttpStack::log_route_latencies()
+{
+  if (_access_logger != NULL)
+  {
+    std::map<std::string, LatencyHistogram::Snapshot> latencies = route_latencies();
+
+    for (std::map<std::string, LatencyHistogram::Snapshot>::const_iterator it =
+           latencies.begin();
+         it != latencies.end();
+         ++it)
+    {
+      _access_logger->log_latency_histogram(it->first, it->second);
+    }
   }
 }
 
@@ -113,48 +517,130 @@ void HttpStack::initialize()
     _ev_using_pthreads = true;
   }
 
-  if (!_evbase)
+  if (_listeners.empty())
   {
-    _evbase = event_base_new();
-  }
+    // With SO_REUSEPORT listeners, each transport thread runs its own event
+    // base.  Otherwise a single event base accepts connections and libevhtp
+    // hands them to its thread pool.
+    int num_listeners = _reuseport ? std::max(_num_threads, 1) : 1;
 
-  if (!_evhtp)
-  {
-    _evhtp = evhtp_new(_evbase, NULL);
+    for (int ii = 0; ii < num_listeners; ++ii)
+    {
+      Listener* listener = new Listener();
+      listener->stack = this;
+      listener->index = ii;
+      listener->evbase = event_base_new();
+      listener->evhtp = evhtp_new(listener->evbase, NULL);
+      listener->connections = 0;
+      listener->requests = 0;
+
+      // Set a buffer read timeout (20s by default) to mitigate the Slowloris
+      // vulnerability. This is short enough that single attackers should be
+      // unable to block the server. We don't want to set it too short to
+      // ensure multiple sites can still talk to each other with latency
+      // involved.
+      unsigned long idle_timeout_ms = _connection_options.idle_timeout_ms;
+      struct timeval recv_timeo;
+      recv_timeo.tv_sec = idle_timeout_ms / 1000;
+      recv_timeo.tv_usec = (idle_timeout_ms % 1000) * 1000;
+      evhtp_set_timeouts(listener->evhtp, &recv_timeo, NULL);
+
+      if (_connection_options.max_keepalive_requests != 0)
+      {
+        evhtp_set_max_keepalive_requests(listener->evhtp,
+                                         _connection_options.max_keepalive_requests);
+      }
+
+      if (_connection_options.max_body_size != 0)
+      {
+        evhtp_set_max_body_size(listener->evhtp,
+                                _connection_options.max_body_size);
+      }
 
-    // Set a buffer read timeout of 20s to mitigate the Slowloris
-    // vulnerability. This is short enough that single attackers should be
-    // unable to block the server. We don't want to set it too short to ensure
-    // multiple sites can still talk to each other with latency involved.
-    struct timeval recv_timeo = { .tv_sec = 20, .tv_usec = 0 };
-    evhtp_set_timeouts(_evhtp, &recv_timeo, NULL);
+      // Every request is passed to the general callback, which finds its
+      // handler using our router rather than libevhtp's callbacks (which try
+      // each regex in turn).
+      evhtp_set_gencb(listener->evhtp, dispatch_callback_fn, listener);
+      evhtp_set_post_accept_cb(listener->evhtp, post_accept_fn, listener);
+
+      _listeners.push_back(listener);
+    }
   }
 }
 
 void HttpStack::register_handler(const char* path,
                                  HttpStack::HandlerInterface* handler)
 {
-  HandlerRegistration* reg = new HandlerRegistration(this, handler);
-  _handler_registrations.insert(reg);
+  int id = _router.add_regex(path);
+
+  if (id == HttpRouter::NO_MATCH)
+  {
+    throw Exception("regcomp", 0); // LCOV_EXCL_LINE
+  }
+
+  _handlers.resize(id + 1);
+  _handlers[id] = handler;
+  _routes.resize(id + 1);
+  _routes[id] = path;
+  add_route_latency(id);
+}
+
+void HttpStack::register_route(const std::string& route,
+                               HttpStack::HandlerInterface* handler)
+{
+  int id = _router.add_route(route);
 
-  evhtp_callback_t* cb = evhtp_set_regex_cb(_evhtp,
-                                            path,
-                                            handler_callback_fn,
-                                            (void*)reg);
-  if (cb == NULL)
+  if (id == HttpRouter::NO_MATCH)
   {
-    throw Exception("evhtp_set_cb", 0); // LCOV_EXCL_LINE
+    throw Exception("register_route", 0);
   }
+
+  _handlers.resize(id + 1);
+  _handlers[id] = handler;
+  _routes.resize(id + 1);
+  _routes[id] = route;
+  add_route_latency(id);
 }
 
 void HttpStack::register_default_handler(HttpStack::HandlerInterface* handler)
 {
-  HandlerRegistration* reg = new HandlerRegistration(this, handler);
-  _handler_registrations.insert(reg);
+  if ((_default_handler == NULL) && (_latency_table != NULL))
+  {
+    _latency_table->add_histogram(route(HttpRouter::NO_MATCH), &_default_latency);
+  }
+
+  if ((_default_handler == NULL) && (_percentile_table != NULL))
+  {
+    _percentile_table->add_histogram(route(HttpRouter::NO_MATCH), &_default_latency);
+  }
+
+  _default_handler = handler;
+}
+
+void HttpStack::add_route_latency(int id)
+{
+  _route_latencies.resize(id + 1, NULL);
+  _route_latencies[id] = new LatencyHistogram();
+
+  if (_latency_table != NULL)
+  {
+    _latency_table->add_histogram(_routes[id], _route_latencies[id]);
+  }
 
-  evhtp_set_gencb(_evhtp,
-                  handler_callback_fn,
-                  (void*)reg);
+  if (_percentile_table != NULL)
+  {
+    _percentile_table->add_histogram(_routes[id], _route_latencies[id]);
+  }
+}
+
+void HttpStack::set_handler_admission(HttpStack::HandlerInterface* handler,
+                                      LoadMonitor* load_monitor,
+                                      float cost)
+{
+  HandlerAdmission admission;
+  admission.load_monitor = load_monitor;
+  admission.cost = cost;
+  _admissions[handler] = admission;
 }
 
 void HttpStack::bind_tcp_socket(const std::string& bind_address,
@@ -195,9 +681,58 @@ void HttpStack::bind_tcp_socket(const std::string& bind_address,
     full_bind_address = "ipv6:" + full_bind_address;
   }
 
+  if (_reuseport)
+  {
+    // Each listener needs its own socket, bound to the same address with
+    // SO_REUSEPORT, so we have to create them ourselves.
+    int rc = error_num;
+
+    for (std::vector<Listener*>::iterator it = _listeners.begin();
+         (rc == 0) && (it != _listeners.end());
+         ++it)
+    {
+      std::string key = "tcp:" + full_bind_address + ":" + std::to_string(port) +
+                        "#" + std::to_string((*it)->index);
+      rc = bind_reuseport_socket(*it, servinfo, port, key);
+    }
+
+    if (servinfo != NULL)
+    {
+      freeaddrinfo(servinfo);
+    }
+
+    if (rc != 0)
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to bind SO_REUSEPORT sockets with address %s and port %d",
+                full_bind_address.c_str(),
+                port);
+      throw Exception("evhtp_accept_socket (tcp)", rc);
+      // LCOV_EXCL_STOP
+    }
+
+    return;
+  }
+
   freeaddrinfo(servinfo);
 
-  int rc = evhtp_bind_socket(_evhtp, full_bind_address.c_str(), port, 1024);
+  std::string key = "tcp:" + full_bind_address + ":" + std::to_string(port);
+  evhtp_t* evhtp = _listeners[0]->evhtp;
+  int fd = take_inherited_socket(key);
+  int rc;
+
+  if (fd >= 0)
+  {
+    rc = evhtp_accept_socket(evhtp, fd, _connection_options.listen_backlog);
+  }
+  else
+  {
+    rc = evhtp_bind_socket(evhtp,
+                           full_bind_address.c_str(),
+                           port,
+                           _connection_options.listen_backlog);
+  }
+
   if (rc != 0)
   {
     // LCOV_EXCL_START
@@ -208,19 +743,128 @@ void HttpStack::bind_tcp_socket(const std::string& bind_address,
     // LCOV_EXCL_STOP
   }
 
+  set_defer_accept(evconnlistener_get_fd(evhtp->server));
+  add_bound_socket(key, _listeners[0]);
+}
+
+void HttpStack::set_defer_accept(int fd)
+{
+  int defer_accept_s = _connection_options.tcp_defer_accept_s;
+
+  if ((defer_accept_s != 0) &&
+      (setsockopt(fd,
+                  IPPROTO_TCP,
+                  TCP_DEFER_ACCEPT,
+                  &defer_accept_s,
+                  sizeof(defer_accept_s)) != 0))
+  {
+    TRC_WARNING("Failed to set TCP_DEFER_ACCEPT on HTTP socket: %d", errno);
+  }
+}
+
+int HttpStack::bind_reuseport_socket(Listener* listener,
+                                     const addrinfo* addr,
+                                     unsigned short port,
+                                     const std::string& key)
+{
+  int fd = take_inherited_socket(key);
+
+  if (fd >= 0)
+  {
+    int rc = evhtp_accept_socket(listener->evhtp,
+                                 fd,
+                                 _connection_options.listen_backlog);
+    if (rc != 0)
+    {
+      close(fd); // LCOV_EXCL_LINE
+      return rc; // LCOV_EXCL_LINE
+    }
+
+    add_bound_socket(key, listener);
+    return 0;
+  }
+
+  sockaddr_storage sa;
+  memcpy(&sa, addr->ai_addr, addr->ai_addrlen);
+
+  if (addr->ai_family == AF_INET6)
+  {
+    ((sockaddr_in6*)&sa)->sin6_port = htons(port);
+  }
+  else
+  {
+    ((sockaddr_in*)&sa)->sin_port = htons(port);
+  }
+
+  fd = socket(addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+  {
+    return errno; // LCOV_EXCL_LINE
+  }
+
+  int on = 1;
+  if ((setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0) ||
+      (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0) ||
+      (bind(fd, (sockaddr*)&sa, addr->ai_addrlen) != 0))
+  {
+    int rc = errno;
+    TRC_ERROR("Failed to bind SO_REUSEPORT socket for HTTP thread %u: %d",
+              listener->index,
+              rc);
+    close(fd);
+    return rc;
+  }
+
+  set_defer_accept(fd);
+
+  // libevhtp listens on the socket, and closes it when it's unbound.
+  int rc = evhtp_accept_socket(listener->evhtp,
+                               fd,
+                               _connection_options.listen_backlog);
+  if (rc != 0)
+  {
+    close(fd); // LCOV_EXCL_LINE
+  }
+  else
+  {
+    add_bound_socket(key, listener);
+  }
+
+  return rc;
 }
 
 void HttpStack::bind_unix_socket(const std::string& bind_path)
 {
   TRC_STATUS("Binding HTTP unix socket: path=%s", bind_path.c_str());
 
-  // libevhtp does not correctly remove any old socket before creating a new
-  // one, so we have to do this ourselves.
-  ::remove(bind_path.c_str());
-
   std::string full_bind_address = "unix:" + bind_path;
 
-  int rc = evhtp_bind_socket(_evhtp, full_bind_address.c_str(), 0, 1024);
+  // With SO_REUSEPORT listeners, unix sockets are only bound on the first
+  // listener (the kernel can't spread their connections across sockets).
+  int backlog = (_connection_options.unix_listen_backlog != 0) ?
+                  _connection_options.unix_listen_backlog :
+                  _connection_options.listen_backlog;
+  int fd = take_inherited_socket(full_bind_address);
+  int rc;
+
+  if (fd >= 0)
+  {
+    // The inherited socket is still bound to the path, so mustn't be
+    // removed.
+    rc = evhtp_accept_socket(_listeners[0]->evhtp, fd, backlog);
+  }
+  else
+  {
+    // libevhtp does not correctly remove any old socket before creating a
+    // new one, so we have to do this ourselves.
+    ::remove(bind_path.c_str());
+
+    rc = evhtp_bind_socket(_listeners[0]->evhtp,
+                           full_bind_address.c_str(),
+                           0,
+                           backlog);
+  }
+
   if (rc != 0)
   {
     // LCOV_EXCL_START
@@ -230,21 +874,183 @@ void HttpStack::bind_unix_socket(const std::string& bind_path)
     // LCOV_EXCL_STOP
   }
 
-  // Socket needs to be world-writeable for nginx to use it
-  chmod(bind_path.c_str(), 0777);
+  add_bound_socket(full_bind_address, _listeners[0]);
+
+  // By default the socket is world-writeable, so that nginx can use it.
+  chmod(bind_path.c_str(), _connection_options.unix_socket_mode);
+}
+
+bool HttpStack::inherit_listeners(const std::string& handoff_path)
+{
+  _inheritance_conn = ListenerHandoff::receive(handoff_path, _inherited_sockets);
+  return (_inheritance_conn >= 0);
+}
+
+void HttpStack::serve_listener_handoff(const std::string& handoff_path,
+                                       std::function<void()> handed_off_cb)
+{
+  delete _handoff;
+  _handoff = new ListenerHandoff(
+    handoff_path,
+    [this]()
+    {
+      ListenerHandoff::Sockets sockets;
+
+      for (std::vector<BoundSocket>::const_iterator it = _bound_sockets.begin();
+           it != _bound_sockets.end();
+           ++it)
+      {
+        sockets[it->key] = it->fd;
+      }
+
+      return sockets;
+    },
+    [this, handed_off_cb]()
+    {
+      stop_accepting();
+
+      if (handed_off_cb)
+      {
+        handed_off_cb();
+      }
+    });
+
+  if (!_handoff->start())
+  {
+    TRC_ERROR("Failed to serve listener handoffs on %s", handoff_path.c_str());
+  }
+}
+
+void HttpStack::stop_accepting()
+{
+  TRC_STATUS("Stopping accepting HTTP connections");
+
+  // The listeners belong to their event loops, so disable them from there.
+  struct timeval now = {0, 0};
+
+  for (std::vector<BoundSocket>::iterator it = _bound_sockets.begin();
+       it != _bound_sockets.end();
+       ++it)
+  {
+    event_base_once(it->evbase, -1, EV_TIMEOUT, disable_listener_fn, it->listener, &now);
+  }
+}
+
+void HttpStack::disable_listener_fn(evutil_socket_t fd, short events, void* listener)
+{
+  evconnlistener_disable((struct evconnlistener*)listener);
+}
+
+void HttpStack::add_bound_socket(const std::string& key, Listener* listener)
+{
+  // libevhtp keeps the listener for the socket it was last told to accept on.
+  BoundSocket socket;
+  socket.key = key;
+  socket.fd = evconnlistener_get_fd(listener->evhtp->server);
+  socket.evbase = listener->evbase;
+  socket.listener = listener->evhtp->server;
+  _bound_sockets.push_back(socket);
+}
+
+int HttpStack::take_inherited_socket(const std::string& key)
+{
+  ListenerHandoff::Sockets::iterator it = _inherited_sockets.find(key);
+
+  if (it == _inherited_sockets.end())
+  {
+    return -1;
+  }
+
+  TRC_STATUS("Using inherited listening socket %s", key.c_str());
+  int fd = it->second;
+  _inherited_sockets.erase(it);
+  return fd;
+}
+
+void HttpStack::complete_inheritance()
+{
+  if (_inheritance_conn < 0)
+  {
+    return;
+  }
+
+  // Sockets this process hasn't bound (such as those of SO_REUSEPORT
+  // listeners beyond this process's thread count) are closed - connections
+  // waiting on them are lost.
+  for (ListenerHandoff::Sockets::const_iterator it = _inherited_sockets.begin();
+       it != _inherited_sockets.end();
+       ++it)
+  {
+    TRC_WARNING("Closing unused inherited listening socket %s", it->first.c_str());
+    close(it->second);
+  }
+
+  _inherited_sockets.clear();
+
+  ListenerHandoff::confirm(_inheritance_conn);
+  _inheritance_conn = -1;
 }
 
 // start() should only be called *after* the appropriate bind_*_socket() function
 // has been called
 void HttpStack::start(evhtp_thread_init_cb init_cb)
 {
-  int rc = evhtp_use_threads(_evhtp, init_cb, _num_threads, this);
+  _thread_init_cb = init_cb;
+
+  if (_reuseport)
+  {
+    // Each listener's event loop is a transport thread, so create them with
+    // the placement ourselves.
+    for (std::vector<Listener*>::iterator it = _listeners.begin();
+         it != _listeners.end();
+         ++it)
+    {
+      pthread_attr_t attr;
+      pthread_attr_init(&attr);
+      _placement.set_attributes(&attr, (*it)->index, _listeners.size());
+
+      int rc = pthread_create(&(*it)->thread, &attr, event_base_thread_fn, *it);
+      pthread_attr_destroy(&attr);
+
+      if ((rc != 0) && (_placement.mode() != ThreadPlacementPolicy::NONE))
+      {
+        // The placement may be invalid for this host, so fall back to the
+        // default attributes.
+        TRC_WARNING("Failed to create HTTP thread with placement (%d), using defaults",
+                    rc);
+        rc = pthread_create(&(*it)->thread, NULL, event_base_thread_fn, *it);
+      }
+
+      if (rc != 0)
+      {
+        // LCOV_EXCL_START
+        TRC_ERROR("pthread_create failed in HTTPStack creation");
+        throw Exception("pthread_create", rc);
+        // LCOV_EXCL_STOP
+      }
+    }
+
+    complete_inheritance();
+    return;
+  }
+
+  // Only interpose our own init callback if there's placement to apply or
+  // a heartbeat to start.
+  evhtp_thread_init_cb cb = init_cb;
+  if ((_placement.mode() != ThreadPlacementPolicy::NONE) ||
+      (_health_checker != NULL))
+  {
+    cb = thread_init_fn;
+  }
+
+  Listener* listener = _listeners[0];
+  int rc = evhtp_use_threads(listener->evhtp, cb, _num_threads, this);
   if (rc != 0)
   {
     throw Exception("evhtp_use_threads", rc); // LCOV_EXCL_LINE
   }
 
-  rc = pthread_create(&_event_base_thread, NULL, event_base_thread_fn, this);
+  rc = pthread_create(&listener->thread, NULL, event_base_thread_fn, listener);
   if (rc != 0)
   {
     // LCOV_EXCL_START
@@ -252,36 +1058,223 @@ void HttpStack::start(evhtp_thread_init_cb init_cb)
     throw Exception("pthread_create", rc);
     // LCOV_EXCL_STOP
   }
+
+  complete_inheritance();
+}
+
+std::vector<HttpStack::ListenerStats> HttpStack::listener_stats() const
+{
+  std::vector<ListenerStats> stats;
+  stats.reserve(_listeners.size());
+
+  for (std::vector<Listener*>::const_iterator it = _listeners.begin();
+       it != _listeners.end();
+       ++it)
+  {
+    ListenerStats listener_stats;
+    listener_stats.connections = (*it)->connections.load();
+    listener_stats.requests = (*it)->requests.load();
+    stats.push_back(listener_stats);
+  }
+
+  return stats;
 }
 
 void HttpStack::stop()
 {
   TRC_STATUS("Stopping HTTP stack");
-  event_base_loopbreak(_evbase);
-  evhtp_unbind_socket(_evhtp);
+
+  // Stop handing off the sockets before they're closed.
+  delete _handoff; _handoff = NULL;
+
+  for (std::vector<Listener*>::iterator it = _listeners.begin();
+       it != _listeners.end();
+       ++it)
+  {
+    event_base_loopbreak((*it)->evbase);
+    evhtp_unbind_socket((*it)->evhtp);
+  }
 }
 
 void HttpStack::wait_stopped()
 {
   TRC_STATUS("Waiting for HTTP stack to stop");
-  pthread_join(_event_base_thread, NULL);
-  evhtp_free(_evhtp);
-  _evhtp = NULL;
-  event_base_free(_evbase);
-  _evbase = NULL;
+
+  for (std::vector<Listener*>::iterator it = _listeners.begin();
+       it != _listeners.end();
+       ++it)
+  {
+    pthread_join((*it)->thread, NULL);
+    evhtp_free((*it)->evhtp);
+    event_base_free((*it)->evbase);
+    delete *it;
+  }
+
+  _listeners.clear();
+
+  // The event loops have all stopped, so they shouldn't count as stalled.
+  pthread_mutex_lock(&_heartbeats_lock);
+
+  for (std::vector<HeartbeatTimer*>::iterator it = _heartbeat_timers.begin();
+       it != _heartbeat_timers.end();
+       ++it)
+  {
+    (*it)->heartbeat->idle();
+  }
+
+  pthread_mutex_unlock(&_heartbeats_lock);
+}
+
+void HttpStack::dispatch_callback_fn(evhtp_request_t* req, void* listener_ptr)
+{
+  Listener* listener = (Listener*)listener_ptr;
+  listener->requests++;
+  listener->stack->dispatch_callback(req);
+}
+
+evhtp_res HttpStack::post_accept_fn(evhtp_connection_t* conn, void* listener_ptr)
+{
+  Listener* listener = (Listener*)listener_ptr;
+  listener->connections++;
+
+  if ((listener->stack->_connection_options.tcp_nodelay) &&
+      (conn->saddr != NULL) &&
+      ((conn->saddr->sa_family == AF_INET) || (conn->saddr->sa_family == AF_INET6)))
+  {
+    int on = 1;
+    setsockopt(conn->sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  }
+
+  if ((conn->saddr != NULL) &&
+      (conn->saddr->sa_family == AF_UNIX) &&
+      (!listener->stack->setup_unix_connection(conn->sock)))
+  {
+    // Returning an error makes libevhtp close the connection.
+    return EVHTP_RES_ERROR;
+  }
+
+  return EVHTP_RES_OK;
+}
+
+// Applies the unix socket options to a new connection, returning false if
+// the connection should be rejected.
+bool HttpStack::setup_unix_connection(int fd)
+{
+  const ConnectionOptions& options = _connection_options;
+
+  if (!options.unix_allowed_peer_uids.empty())
+  {
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0)
+    {
+      TRC_WARNING("Rejecting unix socket connection - failed to get peer credentials: %d",
+                  errno);
+      return false;
+    }
+
+    if (options.unix_allowed_peer_uids.find(cred.uid) ==
+        options.unix_allowed_peer_uids.end())
+    {
+      TRC_WARNING("Rejecting unix socket connection from pid %d with uid %d",
+                  cred.pid, cred.uid);
+      return false;
+    }
+  }
+
+  if ((options.unix_rcvbuf_bytes != 0) &&
+      (setsockopt(fd,
+                  SOL_SOCKET,
+                  SO_RCVBUF,
+                  &options.unix_rcvbuf_bytes,
+                  sizeof(options.unix_rcvbuf_bytes)) != 0))
+  {
+    TRC_WARNING("Failed to set SO_RCVBUF on unix socket connection: %d", errno);
+  }
+
+  if ((options.unix_sndbuf_bytes != 0) &&
+      (setsockopt(fd,
+                  SOL_SOCKET,
+                  SO_SNDBUF,
+                  &options.unix_sndbuf_bytes,
+                  sizeof(options.unix_sndbuf_bytes)) != 0))
+  {
+    TRC_WARNING("Failed to set SO_SNDBUF on unix socket connection: %d", errno);
+  }
+
+  return true;
 }
 
-void HttpStack::handler_callback_fn(evhtp_request_t* req, void* handler_reg_param)
+void HttpStack::dispatch_callback(evhtp_request_t* req)
 {
-  HandlerRegistration* handler_reg =
-    static_cast<HandlerRegistration*>(handler_reg_param);
-  handler_reg->stack->handler_callback(req, handler_reg->handler);
+  HttpRouter::Params path_params;
+  int id = _router.match(req->uri->path->full, path_params);
+  HandlerInterface* handler = (id != HttpRouter::NO_MATCH) ?
+                                _handlers[id] : _default_handler;
+
+  if (handler == NULL)
+  {
+    // No handler matches, so reject the request as libevhtp would.
+    TRC_DEBUG("No handler for URL %s", req->uri->path->full);
+    evhtp_send_reply(req, EVHTP_RES_NOTFOUND);
+    return;
+  }
+
+  handler_callback(req, handler, id, path_params);
+}
+
+LoadMonitor* HttpStack::admit_request(const HandlerAdmission* admission,
+                                      SAS::TrailId trail)
+{
+  // The handler's load monitor is checked first, so that its requests don't
+  // use the stack's tokens if it's overloaded itself.
+  LoadMonitor* load_monitors[] = {(admission != NULL) ?
+                                    admission->load_monitor : NULL,
+                                  _load_monitor};
+  float cost = (admission != NULL) ? admission->cost : 1;
+
+  for (size_t ii = 0; ii < 2; ++ii)
+  {
+    LoadMonitor* load_monitor = load_monitors[ii];
+
+    if (load_monitor != NULL)
+    {
+      bool admitted = (cost == 1) ?
+                        load_monitor->admit_request(trail) :
+                        load_monitor->admit_weighted_request(trail, cost);
+
+      if (!admitted)
+      {
+        return load_monitor;
+      }
+    }
+  }
+
+  return NULL;
 }
 
 void HttpStack::handler_callback(evhtp_request_t* req,
-                                 HttpStack::HandlerInterface* handler)
+                                 HttpStack::HandlerInterface* handler,
+                                 int route_id,
+                                 HttpRouter::Params& path_params)
 {
   Request request(this, req);
+  request._path_params.swap(path_params);
+  request._route_id = route_id;
+
+  const HandlerAdmission* admission = NULL;
+  if (!_admissions.empty())
+  {
+    std::map<HandlerInterface*, HandlerAdmission>::const_iterator it =
+      _admissions.find(handler);
+
+    if (it != _admissions.end())
+    {
+      admission = &it->second;
+      request._handler_load_monitor = admission->load_monitor;
+    }
+  }
 
   // Call into the handler to request a SAS logger that can be used to log
   // this request.  Then actually log the request.
@@ -295,7 +1288,9 @@ void HttpStack::handler_callback(evhtp_request_t* req,
     _stats->incr_http_incoming_requests();
   }
 
-  if ((_load_monitor == NULL) || _load_monitor->admit_request(trail))
+  LoadMonitor* rejected_by = admit_request(admission, trail);
+
+  if (rejected_by == NULL)
   {
     // Pause the request processing (which stops it from being cancelled), as we
     // may process this request asynchronously.  The
@@ -306,6 +1301,7 @@ void HttpStack::handler_callback(evhtp_request_t* req,
     TRC_VERBOSE("Process request for URL %s, args %s",
                 req->uri->path->full,
                 req->uri->query_raw);
+    PROFILE_SPAN("http.handler");
 
     CW_TRY
     {
@@ -333,28 +1329,89 @@ void HttpStack::handler_callback(evhtp_request_t* req,
 
     request.sas_log_overload(trail,
                              503,
-                             _load_monitor->get_target_latency_us(),
-                             _load_monitor->get_current_latency_us(),
-                             _load_monitor->get_rate_limit(),
+                             rejected_by->get_target_latency_us(),
+                             rejected_by->get_current_latency_us(),
+                             rejected_by->get_rate_limit(),
                              0);
     send_reply_internal(request, 503, trail);
 
     if (_stats != NULL)
     {
       _stats->incr_http_rejected_overload();
+      _stats->incr_http_rejected_overload_for_route(route(route_id));
     }
   }
 }
 
-void* HttpStack::event_base_thread_fn(void* http_stack_ptr)
+// Called by libevhtp on each transport thread as it starts, if there is thread
+// placement to apply or a heartbeat to start.
+void HttpStack::thread_init_fn(evhtp_t* evhtp, evthr_t* thr, void* http_stack_ptr)
+{
+  HttpStack* stack = (HttpStack*)http_stack_ptr;
+  unsigned int index = stack->_next_thread_index++;
+  stack->_placement.apply_to_current_thread(index, stack->_num_threads);
+  stack->start_heartbeat(evthr_get_base(thr));
+
+  if (stack->_thread_init_cb != NULL)
+  {
+    stack->_thread_init_cb(evhtp, thr, http_stack_ptr);
+  }
+}
+
+void* HttpStack::event_base_thread_fn(void* listener_ptr)
 {
-  ((HttpStack*)http_stack_ptr)->event_base_thread_fn();
+  Listener* listener = (Listener*)listener_ptr;
+  listener->stack->event_base_thread_fn(listener);
   return NULL;
 }
 
-void HttpStack::event_base_thread_fn()
+void HttpStack::event_base_thread_fn(Listener* listener)
+{
+  if ((_reuseport) && (_thread_init_cb != NULL))
+  {
+    // There's no libevhtp thread pool, so this is the transport thread.
+    _thread_init_cb(listener->evhtp, NULL, this);
+  }
+
+  start_heartbeat(listener->evbase);
+  event_base_loop(listener->evbase, 0);
+}
+
+void HttpStack::start_heartbeat(evbase_t* evbase)
+{
+  if (_health_checker == NULL)
+  {
+    return;
+  }
+
+  // Beat several times per deadline, so a loop that's keeping up is never
+  // close to it.
+  unsigned long interval_ms = std::max(_stall_deadline_ms / 4, 1u);
+
+  HeartbeatTimer* timer = new HeartbeatTimer();
+  timer->heartbeat = _health_checker->register_heartbeat("HTTP event loop",
+                                                         _stall_deadline_ms);
+  timer->evbase = evbase;
+  timer->interval.tv_sec = interval_ms / 1000;
+  timer->interval.tv_usec = (interval_ms % 1000) * 1000;
+
+  pthread_mutex_lock(&_heartbeats_lock);
+  _heartbeat_timers.push_back(timer);
+  pthread_mutex_unlock(&_heartbeats_lock);
+
+  heartbeat_timer_fn(-1, EV_TIMEOUT, timer);
+}
+
+void HttpStack::heartbeat_timer_fn(evutil_socket_t fd, short events, void* timer_ptr)
 {
-  event_base_loop(_evbase, 0);
+  HeartbeatTimer* timer = (HeartbeatTimer*)timer_ptr;
+  timer->heartbeat->beat();
+  event_base_once(timer->evbase,
+                  -1,
+                  EV_TIMEOUT,
+                  heartbeat_timer_fn,
+                  timer,
+                  &timer->interval);
 }
 
 void HttpStack::record_penalty()
@@ -365,15 +1422,71 @@ void HttpStack::record_penalty()
   }
 }
 
-std::string HttpStack::Request::get_rx_body()
+const size_t HttpStack::Request::MIN_REFERENCED_CONTENT;
+
+void HttpStack::Request::add_content(std::string&& content)
+{
+  if (content.length() < MIN_REFERENCED_CONTENT)
+  {
+    evbuffer_add(_req->buffer_out, content.c_str(), content.length());
+    return;
+  }
+
+  // Move the content into a string that lives until the buffer has been sent.
+  std::string* owned = new std::string(std::move(content));
+  evbuffer_add_reference(_req->buffer_out,
+                         owned->data(),
+                         owned->length(),
+                         free_content,
+                         owned);
+}
+
+void HttpStack::Request::free_content(const void* data,
+                                      size_t length,
+                                      void* content)
+{
+  delete (std::string*)content;
+}
+
+const std::string& HttpStack::Request::get_rx_body()
 {
   if (!_rx_body_set)
   {
     _rx_body = evbuffer_to_string(_req->buffer_in);
+    _rx_body_set = true;
   }
   return _rx_body;
 }
 
+std::vector<evbuffer_iovec> HttpStack::Request::get_rx_body_segments()
+{
+  std::vector<evbuffer_iovec> segments;
+
+  if (_rx_body_set)
+  {
+    // The body has already been copied out (or was supplied directly).
+    if (!_rx_body.empty())
+    {
+      evbuffer_iovec segment;
+      segment.iov_base = (void*)_rx_body.data();
+      segment.iov_len = _rx_body.length();
+      segments.push_back(segment);
+    }
+
+    return segments;
+  }
+
+  int num_segments = evbuffer_peek(_req->buffer_in, -1, NULL, NULL, 0);
+
+  if (num_segments > 0)
+  {
+    segments.resize(num_segments);
+    evbuffer_peek(_req->buffer_in, -1, NULL, &segments[0], num_segments);
+  }
+
+  return segments;
+}
+
 std::string HttpStack::Request::get_tx_body()
 {
   return evbuffer_to_string(_req->buffer_out);
@@ -410,13 +1523,13 @@ std::string HttpStack::Request::get_tx_message(int rc)
 
 std::string HttpStack::Request::evbuffer_to_string(evbuffer* eb)
 {
-  std::string s;
-  size_t len = evbuffer_get_length(eb);
-  void* buf = evbuffer_pullup(eb, len);
+  // Copy the contents out rather than pulling them up, which would rearrange
+  // the buffer (and copy any referenced content into it).
+  std::string s(evbuffer_get_length(eb), '\0');
 
-  if (buf != NULL)
+  if (!s.empty())
   {
-    s.assign((char*)buf, len);
+    evbuffer_copyout(eb, &s[0], s.length());
   }
 
   return s;
@@ -11,6 +11,7 @@
  */
 
 #include "httpstack_utils.h"
+#include "profiling_span.h"
 
 namespace HttpStackUtils
 {
@@ -25,16 +26,105 @@ namespace HttpStackUtils
     req.send_reply(200, trail);
   }
 
+  //
+  // MetricsHandler methods.
+  //
+  void MetricsHandler::process_request(HttpStack::Request& req,
+                                       SAS::TrailId trail)
+  {
+    std::shared_ptr<const std::string> metrics = _source();
+
+    if (!metrics)
+    {
+      // Nothing has been rendered yet.
+      req.set_track_latency(false);
+      req.send_reply(503, trail);
+      return;
+    }
+
+    // Hold a reference to the metrics until they've been sent.
+    std::shared_ptr<const std::string>* reference =
+      new std::shared_ptr<const std::string>(metrics);
+    req.add_content_reference(metrics->data(),
+                              metrics->length(),
+                              release_metrics,
+                              reference);
+    req.add_header("Content-Type",
+                   "application/openmetrics-text; version=1.0.0; charset=utf-8");
+    req.set_track_latency(false);
+    req.send_reply(200, trail);
+  }
+
+  void MetricsHandler::release_metrics(const void* data,
+                                       size_t length,
+                                       void* metrics)
+  {
+    delete (std::shared_ptr<const std::string>*)metrics;
+  }
+
+  //
+  // ReadinessHandler methods.
+  //
+  void ReadinessHandler::process_request(HttpStack::Request& req,
+                                         SAS::TrailId trail)
+  {
+    std::string reason;
+
+    if (_health_checker->is_ready(reason))
+    {
+      req.add_content("OK");
+      req.set_track_latency(false);
+      req.send_reply(200, trail);
+    }
+    else
+    {
+      req.add_content(reason);
+      req.set_track_latency(false);
+      req.send_reply(503, trail);
+    }
+  }
+
+  //
+  // ProfileHandler methods.
+  //
+  void ProfileHandler::process_request(HttpStack::Request& req,
+                                       SAS::TrailId trail)
+  {
+    std::string body;
+
+    if (req.param("format") == "folded")
+    {
+      Profiling::write_folded_stacks(body);
+      req.add_header("Content-Type", "text/plain");
+    }
+    else
+    {
+      Profiling::write_chrome_trace(body);
+      req.add_header("Content-Type", "application/json");
+    }
+
+    req.add_content(std::move(body));
+    req.set_track_latency(false);
+    req.send_reply(200, trail);
+  }
+
   //
   // HandlerThreadPool methods.
   //
+  const unsigned int HandlerThreadPool::DEFAULT_RING_CAPACITY;
+  const unsigned int HandlerThreadPool::FULL_RETRY_AFTER_S;
+
   HandlerThreadPool::HandlerThreadPool(unsigned int num_threads,
                                        ExceptionHandler* exception_handler,
-                                       unsigned int max_queue) :
+                                       unsigned int max_queue,
+                                       bool lock_free_queue,
+                                       bool reject_when_full) :
     _pool(num_threads,
           exception_handler,
           &exception_callback,
-          max_queue),
+          max_queue,
+          lock_free_queue),
+    _reject_when_full(reject_when_full),
     _wrappers()
   {
     _pool.start();
@@ -45,7 +135,7 @@ namespace HttpStackUtils
   {
     // Create a new wrapper around the specific handler and record it in
     // the wrappers vector.
-    Wrapper* wrapper = new Wrapper(&_pool, handler);
+    Wrapper* wrapper = new Wrapper(&_pool, handler, _reject_when_full);
     _wrappers.push_back(wrapper);
     return wrapper;
   }
@@ -70,8 +160,17 @@ namespace HttpStackUtils
   HandlerThreadPool::Pool::Pool(unsigned int num_threads,
                                 ExceptionHandler* exception_handler,
                                 void (*callback)(HttpStackUtils::HandlerThreadPool::RequestParams*),
-                                unsigned int max_queue) :
-    ThreadPool<RequestParams*>(num_threads, exception_handler, callback, max_queue)
+                                unsigned int max_queue,
+                                bool lock_free_queue) :
+    ThreadPool<RequestParams*>(num_threads,
+                               exception_handler,
+                               callback,
+                               lock_free_queue ?
+                                 new eventq<RequestParams*>::RingBackend(
+                                   (max_queue != 0) ? max_queue :
+                                                      DEFAULT_RING_CAPACITY) :
+                                 nullptr,
+                               max_queue)
   {}
 
   // This function defines how the worker threads process received requests.
@@ -80,13 +179,15 @@ namespace HttpStackUtils
   void HandlerThreadPool::Pool::
     process_work(HttpStackUtils::HandlerThreadPool::RequestParams*& params)
   {
+    PROFILE_SPAN("http.pool_handler");
     params->handler->process_request(params->request, params->trail);
     delete params; params = NULL;
   }
 
   HandlerThreadPool::Wrapper::Wrapper(Pool* pool,
-                                      HandlerInterface* handler) :
-    _pool(pool), _handler(handler)
+                                      HandlerInterface* handler,
+                                      bool reject_when_full) :
+    _pool(pool), _handler(handler), _reject_when_full(reject_when_full)
   {}
 
   // Implementation of HandlerInterface::process_request().  This builds a
@@ -98,7 +199,18 @@ namespace HttpStackUtils
   {
     HandlerThreadPool::RequestParams* params =
       new HandlerThreadPool::RequestParams(_handler, req, trail);
-    _pool->add_work(params);
+
+    if (!_reject_when_full)
+    {
+      _pool->add_work(params);
+    }
+    else if (!_pool->try_add_work(params))
+    {
+      // The pool is saturated.  Reject the request now, rather than blocking
+      // this transport thread until there's room.
+      delete params; params = NULL;
+      req.send_overload_reply(FULL_RETRY_AFTER_S, trail);
+    }
   }
 
   // Implementation of HandlerInterface::sas_logger().  Simply call the
@@ -0,0 +1,548 @@
+/**
+ * @file io_uring_writer.cpp  Writes files through io_uring on a service thread.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "io_uring_writer.h"
+
+const unsigned int IoUringWriter::DEFAULT_BUFFERS;
+const size_t IoUringWriter::DEFAULT_BUFFER_SIZE;
+
+// There's no glibc wrapper for the io_uring system calls.
+static int io_uring_setup(unsigned int entries, struct io_uring_params* params)
+{
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int ring_fd,
+                          unsigned int to_submit,
+                          unsigned int min_complete,
+                          unsigned int flags)
+{
+  return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int ring_fd, unsigned int opcode, void* arg, unsigned int nr_args)
+{
+  return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+IoUringWriter::Ring::Ring() :
+  sq_ptr(MAP_FAILED),
+  sq_size(0),
+  cq_ptr(MAP_FAILED),
+  cq_size(0),
+  sqes_ptr(MAP_FAILED),
+  sqes_size(0),
+  sq_head(NULL),
+  sq_tail(NULL),
+  sq_mask(NULL),
+  sq_array(NULL),
+  cq_head(NULL),
+  cq_tail(NULL),
+  cq_mask(NULL),
+  sqes(NULL),
+  cqes(NULL),
+  entries(0)
+{
+}
+
+IoUringWriter::IoUringWriter(unsigned int num_buffers, size_t buffer_size) :
+  _ring_fd(-1),
+  _ring(),
+  _fixed_buffers(false),
+  _current_position(false),
+  _ring_failed(false),
+  _buffer_size(std::max(buffer_size, (size_t)4096)),
+  _memory(NULL),
+  _buffers(std::max(num_buffers, 2u)),
+  _current(NULL),
+  _ready(),
+  _free(),
+  _sealed(0),
+  _written(0),
+  _service_waiting(false),
+  _terminated(false),
+  _errors(0)
+{
+  pthread_mutex_init(&_write_lock, NULL);
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_ready_cond, NULL);
+  pthread_cond_init(&_free_cond, NULL);
+  pthread_cond_init(&_written_cond, NULL);
+
+  if (posix_memalign((void**)&_memory, 4096, _buffers.size() * _buffer_size) != 0)
+  {
+    _memory = NULL; // LCOV_EXCL_LINE
+    return;         // LCOV_EXCL_LINE
+  }
+
+  for (unsigned int ii = 0; ii < _buffers.size(); ++ii)
+  {
+    _buffers[ii].index = ii;
+    _buffers[ii].data = _memory + ii * _buffer_size;
+    _buffers[ii].used = 0;
+    _buffers[ii].fd = -1;
+    _free.push_back(&_buffers[ii]);
+  }
+
+  if (!setup_ring(_buffers.size()))
+  {
+    teardown_ring();
+    return;
+  }
+
+  if (pthread_create(&_service_thread, NULL, service_thread_fn, this) != 0)
+  {
+    teardown_ring(); // LCOV_EXCL_LINE
+  }
+}
+
+IoUringWriter::~IoUringWriter()
+{
+  if (available())
+  {
+    pthread_mutex_lock(&_lock);
+    _terminated = true;
+    pthread_cond_signal(&_ready_cond);
+    pthread_mutex_unlock(&_lock);
+
+    pthread_join(_service_thread, NULL);
+    teardown_ring();
+  }
+
+  free(_memory);
+
+  pthread_cond_destroy(&_written_cond);
+  pthread_cond_destroy(&_free_cond);
+  pthread_cond_destroy(&_ready_cond);
+  pthread_mutex_destroy(&_lock);
+  pthread_mutex_destroy(&_write_lock);
+}
+
+bool IoUringWriter::setup_ring(unsigned int entries)
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  _ring_fd = io_uring_setup(entries, &params);
+
+  if (_ring_fd < 0)
+  {
+    // io_uring isn't supported or is disabled.
+    return false;
+  }
+
+  _ring.entries = params.sq_entries;
+  _ring.sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  _ring.cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+  bool single_mmap = ((params.features & IORING_FEAT_SINGLE_MMAP) != 0);
+
+  if (single_mmap)
+  {
+    _ring.sq_size = std::max(_ring.sq_size, _ring.cq_size);
+    _ring.cq_size = _ring.sq_size;
+  }
+
+  _ring.sq_ptr = mmap(NULL, _ring.sq_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQ_RING);
+
+  if (_ring.sq_ptr == MAP_FAILED)
+  {
+    return false; // LCOV_EXCL_LINE
+  }
+
+  if (single_mmap)
+  {
+    _ring.cq_ptr = _ring.sq_ptr;
+  }
+  else
+  {
+    _ring.cq_ptr = mmap(NULL, _ring.cq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_CQ_RING);
+
+    if (_ring.cq_ptr == MAP_FAILED)
+    {
+      return false; // LCOV_EXCL_LINE
+    }
+  }
+
+  _ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  _ring.sqes_ptr = mmap(NULL, _ring.sqes_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQES);
+
+  if (_ring.sqes_ptr == MAP_FAILED)
+  {
+    return false; // LCOV_EXCL_LINE
+  }
+
+  char* sq = (char*)_ring.sq_ptr;
+  _ring.sq_head = (unsigned int*)(sq + params.sq_off.head);
+  _ring.sq_tail = (unsigned int*)(sq + params.sq_off.tail);
+  _ring.sq_mask = (unsigned int*)(sq + params.sq_off.ring_mask);
+  _ring.sq_array = (unsigned int*)(sq + params.sq_off.array);
+  _ring.sqes = (struct io_uring_sqe*)_ring.sqes_ptr;
+
+  char* cq = (char*)_ring.cq_ptr;
+  _ring.cq_head = (unsigned int*)(cq + params.cq_off.head);
+  _ring.cq_tail = (unsigned int*)(cq + params.cq_off.tail);
+  _ring.cq_mask = (unsigned int*)(cq + params.cq_off.ring_mask);
+  _ring.cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+  // Older kernels can't write at the file's current position (which is
+  // needed for pipes, such as stdout), but for files opened with O_APPEND the
+  // offset is ignored anyway.
+  _current_position = ((params.features & IORING_FEAT_RW_CUR_POS) != 0);
+
+  // Registering the buffers saves the kernel mapping them on every write, but
+  // can fail if the memory lock limit is low - in which case use plain writes.
+  std::vector<struct iovec> iovs(_buffers.size());
+
+  for (unsigned int ii = 0; ii < _buffers.size(); ++ii)
+  {
+    iovs[ii].iov_base = _buffers[ii].data;
+    iovs[ii].iov_len = _buffer_size;
+  }
+
+  _fixed_buffers = (io_uring_register(_ring_fd,
+                                      IORING_REGISTER_BUFFERS,
+                                      iovs.data(),
+                                      iovs.size()) == 0);
+  return true;
+}
+
+void IoUringWriter::teardown_ring()
+{
+  if (_ring.sqes_ptr != MAP_FAILED)
+  {
+    munmap(_ring.sqes_ptr, _ring.sqes_size);
+  }
+
+  if ((_ring.cq_ptr != MAP_FAILED) && (_ring.cq_ptr != _ring.sq_ptr))
+  {
+    munmap(_ring.cq_ptr, _ring.cq_size);
+  }
+
+  if (_ring.sq_ptr != MAP_FAILED)
+  {
+    munmap(_ring.sq_ptr, _ring.sq_size);
+  }
+
+  _ring = Ring();
+
+  if (_ring_fd >= 0)
+  {
+    close(_ring_fd);
+    _ring_fd = -1;
+  }
+}
+
+void IoUringWriter::write(int fd, const char* data, size_t length)
+{
+  struct iovec iov;
+  iov.iov_base = (void*)data;
+  iov.iov_len = length;
+  writev(fd, &iov, 1);
+}
+
+void IoUringWriter::writev(int fd, const struct iovec* iov, int iovcnt)
+{
+  if (!available())
+  {
+    return;
+  }
+
+  // Hold the write lock throughout, so that if this has to wait for a free
+  // buffer part way through, no other write can get in first.
+  pthread_mutex_lock(&_write_lock);
+  pthread_mutex_lock(&_lock);
+
+  for (int ii = 0; ii < iovcnt; ++ii)
+  {
+    const char* data = (const char*)iov[ii].iov_base;
+    size_t length = iov[ii].iov_len;
+
+    while (length > 0)
+    {
+      Buffer* buffer = buffer_for(fd);
+      size_t copy = std::min(length, _buffer_size - buffer->used);
+      memcpy(buffer->data + buffer->used, data, copy);
+      buffer->used += copy;
+      data += copy;
+      length -= copy;
+    }
+  }
+
+  // Only wake the service thread if it's waiting - otherwise it's busy
+  // writing, and will pick this up (with anything else queued meanwhile) when
+  // it's done.
+  if (_service_waiting)
+  {
+    pthread_cond_signal(&_ready_cond);
+  }
+
+  pthread_mutex_unlock(&_lock);
+  pthread_mutex_unlock(&_write_lock);
+}
+
+void IoUringWriter::flush()
+{
+  if (!available())
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&_lock);
+
+  seal_current();
+  uint64_t target = _sealed;
+  pthread_cond_signal(&_ready_cond);
+
+  while (_written < target)
+  {
+    pthread_cond_wait(&_written_cond, &_lock);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+IoUringWriter::Buffer* IoUringWriter::buffer_for(int fd)
+{
+  while (true)
+  {
+    if (_current != NULL)
+    {
+      if (_current->used == 0)
+      {
+        _current->fd = fd;
+        return _current;
+      }
+      else if ((_current->fd == fd) && (_current->used < _buffer_size))
+      {
+        return _current;
+      }
+
+      // The buffer is full, or is for another file.
+      seal_current();
+      pthread_cond_signal(&_ready_cond);
+    }
+
+    if (!_free.empty())
+    {
+      _current = _free.back();
+      _free.pop_back();
+      _current->fd = fd;
+      _current->used = 0;
+      return _current;
+    }
+
+    // Every buffer is waiting to be written.
+    pthread_cond_wait(&_free_cond, &_lock);
+  }
+}
+
+void IoUringWriter::seal_current()
+{
+  if ((_current != NULL) && (_current->used > 0))
+  {
+    _ready.push_back(_current);
+    _current = NULL;
+    ++_sealed;
+  }
+}
+
+void* IoUringWriter::service_thread_fn(void* writer)
+{
+  ((IoUringWriter*)writer)->service_thread_fn();
+  return NULL;
+}
+
+void IoUringWriter::service_thread_fn()
+{
+  std::vector<Buffer*> batch;
+  batch.reserve(_ring.entries);
+
+  pthread_mutex_lock(&_lock);
+
+  while (true)
+  {
+    while ((!_terminated) &&
+           (_ready.empty()) &&
+           ((_current == NULL) || (_current->used == 0)))
+    {
+      _service_waiting = true;
+      pthread_cond_wait(&_ready_cond, &_lock);
+      _service_waiting = false;
+    }
+
+    // Write whatever has been queued, including a partly filled buffer.
+    seal_current();
+
+    if (_ready.empty())
+    {
+      // Terminated, and everything has been written.
+      break;
+    }
+
+    while ((!_ready.empty()) && (batch.size() < _ring.entries))
+    {
+      batch.push_back(_ready.front());
+      _ready.pop_front();
+    }
+
+    pthread_mutex_unlock(&_lock);
+    write_buffers(batch);
+    pthread_mutex_lock(&_lock);
+
+    for (std::vector<Buffer*>::iterator it = batch.begin();
+         it != batch.end();
+         ++it)
+    {
+      (*it)->used = 0;
+      (*it)->fd = -1;
+      _free.push_back(*it);
+    }
+
+    _written += batch.size();
+    batch.clear();
+
+    pthread_cond_broadcast(&_free_cond);
+    pthread_cond_broadcast(&_written_cond);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void IoUringWriter::write_buffers(std::vector<Buffer*>& buffers)
+{
+  unsigned int count = buffers.size();
+
+  if (_ring_failed)
+  {
+    // LCOV_EXCL_START
+    for (unsigned int ii = 0; ii < count; ++ii)
+    {
+      write_remainder(buffers[ii], 0);
+    }
+
+    return;
+    // LCOV_EXCL_STOP
+  }
+  unsigned int tail = *_ring.sq_tail;
+  unsigned int mask = *_ring.sq_mask;
+
+  // Link the writes, so each starts once the previous one has completed.  If
+  // one fails (or is short), the rest are cancelled.
+  for (unsigned int ii = 0; ii < count; ++ii)
+  {
+    unsigned int slot = (tail + ii) & mask;
+    struct io_uring_sqe* sqe = &_ring.sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+
+    sqe->opcode = _fixed_buffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = buffers[ii]->fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffers[ii]->data;
+    sqe->len = buffers[ii]->used;
+    sqe->off = _current_position ? (uint64_t)-1 : 0;
+    sqe->buf_index = _fixed_buffers ? buffers[ii]->index : 0;
+    sqe->flags = (ii + 1 < count) ? IOSQE_IO_LINK : 0;
+    sqe->user_data = ii;
+
+    _ring.sq_array[slot] = slot;
+  }
+
+  __atomic_store_n(_ring.sq_tail, tail + count, __ATOMIC_RELEASE);
+
+  // Submit the writes and wait for them all to complete.
+  std::vector<int> results(count, -ECANCELED);
+  unsigned int to_submit = count;
+  unsigned int completed = 0;
+
+  while (completed < count)
+  {
+    int rc = io_uring_enter(_ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS);
+
+    if (rc < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+
+      // LCOV_EXCL_START The ring is unusable, so write what's left (and
+      // everything from now on) ourselves.  The results of any writes that
+      // haven't completed are left as cancelled.
+      _ring_failed = true;
+      break;
+      // LCOV_EXCL_STOP
+    }
+
+    to_submit -= std::min((unsigned int)rc, to_submit);
+
+    unsigned int head = *_ring.cq_head;
+    unsigned int cq_tail = __atomic_load_n(_ring.cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != cq_tail)
+    {
+      struct io_uring_cqe* cqe = &_ring.cqes[head & *_ring.cq_mask];
+
+      if (cqe->user_data < count)
+      {
+        results[cqe->user_data] = cqe->res;
+      }
+
+      ++head;
+      ++completed;
+    }
+
+    __atomic_store_n(_ring.cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  // Finish any writes that didn't complete, in order.
+  for (unsigned int ii = 0; ii < count; ++ii)
+  {
+    if ((results[ii] < 0) || ((size_t)results[ii] < buffers[ii]->used))
+    {
+      write_remainder(buffers[ii], (results[ii] > 0) ? results[ii] : 0);
+    }
+  }
+}
+
+void IoUringWriter::write_remainder(Buffer* buffer, size_t written)
+{
+  while (written < buffer->used)
+  {
+    ssize_t rc = ::write(buffer->fd, buffer->data + written, buffer->used - written);
+
+    if (rc < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+
+      ++_errors;
+      return;
+    }
+
+    written += rc;
+  }
+}
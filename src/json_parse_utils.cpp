@@ -0,0 +1,70 @@
+/**
+ * @file json_parse_utils.cpp  Utilities for parsing JSON documents.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <memory>
+
+#include "json_parse_utils.h"
+
+const size_t JsonArenaDocument::ARENA_SIZE;
+
+// A thread's arena.  The buffer comes first so that it's suitably aligned for
+// the allocator, which uses it as its first chunk.
+struct JsonArenaDocument::Arena
+{
+  Arena() : allocator(buffer, sizeof(buffer)), users(0) {}
+
+  char buffer[ARENA_SIZE];
+  rapidjson::MemoryPoolAllocator<> allocator;
+
+  // The number of JsonArenaDocuments using the arena.
+  int users;
+};
+
+JsonArenaDocument::JsonArenaDocument() :
+  _arena(thread_arena()),
+  _doc(&_arena->allocator)
+{
+  ++_arena->users;
+}
+
+JsonArenaDocument::~JsonArenaDocument()
+{
+  // The allocator doesn't free individual nodes, so _doc doesn't use it when
+  // it's destroyed, and it's safe to reset the arena now.  This frees any
+  // extra chunks, and leaves the buffer ready for the next document.
+  if (--_arena->users == 0)
+  {
+    _arena->allocator.Clear();
+  }
+}
+
+bool JsonArenaDocument::parse_insitu(char* json)
+{
+  if (json == NULL)
+  {
+    return false;
+  }
+
+  _doc.ParseInsitu<0>(json);
+  return !_doc.HasParseError();
+}
+
+JsonArenaDocument::Arena* JsonArenaDocument::thread_arena()
+{
+  static thread_local std::unique_ptr<Arena> arena;
+
+  if (!arena)
+  {
+    arena.reset(new Arena());
+  }
+
+  return arena.get();
+}
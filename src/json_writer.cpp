@@ -0,0 +1,81 @@
+/**
+ * @file json_writer.cpp  Output streams and reusable buffers for writing JSON.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <event2/buffer.h>
+
+#include "json_writer.h"
+
+const size_t JsonEvbufferStream::CHUNK_SIZE;
+const size_t JsonWriteBuffer::MAX_RETAINED_SIZE;
+
+namespace
+{
+  // The calling thread's buffer, and whether a JsonWriteBuffer is using it.
+  struct ThreadBuffer
+  {
+    ThreadBuffer() : str(), in_use(false) {}
+
+    std::string str;
+    bool in_use;
+  };
+
+  thread_local ThreadBuffer thread_buffer;
+}
+
+void JsonEvbufferStream::Flush()
+{
+  if (_length > 0)
+  {
+    evbuffer_add(_buffer, _chunk, _length);
+    _length = 0;
+  }
+}
+
+JsonWriteBuffer::JsonWriteBuffer() :
+  _own(),
+  _str(acquire(_own)),
+  _stream(*_str),
+  _writer(_stream)
+{
+}
+
+JsonWriteBuffer::~JsonWriteBuffer()
+{
+  if (_str == &thread_buffer.str)
+  {
+    // Don't keep hold of a lot of memory because of one large document.
+    if (thread_buffer.str.capacity() > MAX_RETAINED_SIZE)
+    {
+      std::string().swap(thread_buffer.str);
+    }
+
+    thread_buffer.in_use = false;
+  }
+}
+
+std::string JsonWriteBuffer::release()
+{
+  std::string json;
+  json.swap(*_str);
+  return json;
+}
+
+std::string* JsonWriteBuffer::acquire(std::string& own)
+{
+  if (thread_buffer.in_use)
+  {
+    return &own;
+  }
+
+  thread_buffer.in_use = true;
+  thread_buffer.str.clear();
+  return &thread_buffer.str;
+}
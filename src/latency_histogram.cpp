@@ -0,0 +1,106 @@
+/**
+ * @file latency_histogram.cpp  Histograms of latencies with log-linear buckets.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "latency_histogram.h"
+
+const int LatencyHistogram::SUB_BUCKET_BITS;
+const int LatencyHistogram::SUB_BUCKETS;
+const int LatencyHistogram::NUM_BUCKETS;
+const int LatencyHistogram::NUM_SHARDS;
+
+LatencyHistogram::LatencyHistogram()
+{
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    for (int jj = 0; jj < NUM_BUCKETS; ++jj)
+    {
+      _shards[ii].counts[jj] = 0;
+    }
+
+    _shards[ii].sum_us = 0;
+  }
+}
+
+void LatencyHistogram::snapshot(Snapshot& snapshot) const
+{
+  snapshot.count = 0;
+  snapshot.sum_us = 0;
+
+  for (int jj = 0; jj < NUM_BUCKETS; ++jj)
+  {
+    snapshot.counts[jj] = bucket_count(jj);
+    snapshot.count += snapshot.counts[jj];
+  }
+
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    snapshot.sum_us += _shards[ii].sum_us.load(std::memory_order_relaxed);
+  }
+}
+
+uint64_t LatencyHistogram::bucket_count(int bucket) const
+{
+  uint64_t count = 0;
+
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    count += _shards[ii].counts[bucket].load(std::memory_order_relaxed);
+  }
+
+  return count;
+}
+
+uint64_t LatencyHistogram::Snapshot::percentile_us(double percentile) const
+{
+  if (count == 0)
+  {
+    return 0;
+  }
+
+  // Find the first bucket at which the cumulative count reaches the
+  // percentile.
+  double target = (percentile / 100) * count;
+  uint64_t cumulative = 0;
+
+  for (int jj = 0; jj < NUM_BUCKETS; ++jj)
+  {
+    cumulative += counts[jj];
+
+    if ((counts[jj] != 0) && (cumulative >= target))
+    {
+      return bucket_limit_us(jj);
+    }
+  }
+
+  return bucket_limit_us(NUM_BUCKETS - 1); // LCOV_EXCL_LINE
+}
+
+void LatencyHistogram::Snapshot::merge(const Snapshot& other)
+{
+  for (int jj = 0; jj < NUM_BUCKETS; ++jj)
+  {
+    counts[jj] += other.counts[jj];
+  }
+
+  count += other.count;
+  sum_us += other.sum_us;
+}
+
+void LatencyHistogram::Snapshot::subtract(const Snapshot& earlier)
+{
+  for (int jj = 0; jj < NUM_BUCKETS; ++jj)
+  {
+    counts[jj] -= earlier.counts[jj];
+  }
+
+  count -= earlier.count;
+  sum_us -= earlier.sum_us;
+}
@@ -0,0 +1,407 @@
+/**
+ * @file listener_handoff.cpp  Passes listening sockets from a process to the
+ * process replacing it.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "listener_handoff.h"
+#include "log.h"
+
+// The messages of the handoff protocol.  The connection is SOCK_SEQPACKET,
+// so each message arrives whole.
+//  - The new process sends HANDOFF.
+//  - The old process sends one message per socket, holding its key, with
+//    the socket as ancillary data, and then END.
+//  - The new process sends STARTED once it's accepting on the sockets (or
+//    closes the connection if it fails).
+static const std::string HANDOFF = "HANDOFF";
+static const std::string END = "END";
+static const std::string STARTED = "STARTED";
+
+static const size_t MAX_MESSAGE = 1024;
+
+static bool make_address(const std::string& path, struct sockaddr_un& addr)
+{
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_LOCAL;
+
+  if (path.length() >= sizeof(addr.sun_path))
+  {
+    TRC_ERROR("Listener handoff socket path is too long: %s", path.c_str());
+    return false;
+  }
+
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  return true;
+}
+
+ListenerHandoff::ListenerHandoff(const std::string& path,
+                                 GetSocketsCallback get_sockets_cb,
+                                 HandedOffCallback handed_off_cb) :
+  _path(path),
+  _get_sockets_cb(get_sockets_cb),
+  _handed_off_cb(handed_off_cb),
+  _listen_fd(-1),
+  _conn_fd(-1),
+  _terminated(false),
+  _started(false)
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+ListenerHandoff::~ListenerHandoff()
+{
+  pthread_mutex_lock(&_lock);
+  _terminated = true;
+
+  // Shutting the sockets down wakes the thread from accept() or recvmsg().
+  if (_listen_fd >= 0)
+  {
+    shutdown(_listen_fd, SHUT_RDWR);
+  }
+
+  if (_conn_fd >= 0)
+  {
+    shutdown(_conn_fd, SHUT_RDWR);
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  if (_started)
+  {
+    pthread_join(_thread, NULL);
+  }
+
+  if (_listen_fd >= 0)
+  {
+    close(_listen_fd);
+    ::remove(_path.c_str());
+  }
+
+  pthread_mutex_destroy(&_lock);
+}
+
+bool ListenerHandoff::start()
+{
+  struct sockaddr_un addr;
+
+  if (!make_address(_path, addr))
+  {
+    return false;
+  }
+
+  int fd = socket(AF_LOCAL, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+  if (fd < 0)
+  {
+    TRC_ERROR("Failed to create listener handoff socket: %d", errno); // LCOV_EXCL_LINE
+    return false; // LCOV_EXCL_LINE
+  }
+
+  // Only this user's processes may take the sockets.
+  ::remove(_path.c_str());
+  mode_t old_umask = umask(0077);
+  int rc = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+  umask(old_umask);
+
+  if ((rc != 0) || (listen(fd, 1) != 0))
+  {
+    TRC_ERROR("Failed to bind listener handoff socket %s: %d",
+              _path.c_str(),
+              errno);
+    close(fd);
+    return false;
+  }
+
+  _listen_fd = fd;
+
+  rc = pthread_create(&_thread, NULL, thread_fn, this);
+
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to create listener handoff thread: %d", rc);
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  _started = true;
+  TRC_STATUS("Serving listener handoffs on %s", _path.c_str());
+  return true;
+}
+
+void* ListenerHandoff::thread_fn(void* handoff)
+{
+  ((ListenerHandoff*)handoff)->thread_fn();
+  return NULL;
+}
+
+void ListenerHandoff::thread_fn()
+{
+  while (true)
+  {
+    int conn = accept4(_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+    pthread_mutex_lock(&_lock);
+
+    if (_terminated)
+    {
+      pthread_mutex_unlock(&_lock);
+
+      if (conn >= 0)
+      {
+        close(conn);
+      }
+
+      break;
+    }
+
+    if (conn < 0)
+    {
+      pthread_mutex_unlock(&_lock);
+
+      if (errno != EINTR)
+      {
+        TRC_WARNING("Failed to accept listener handoff connection: %d", errno); // LCOV_EXCL_LINE
+        usleep(100000); // LCOV_EXCL_LINE
+      }
+
+      continue;
+    }
+
+    _conn_fd = conn;
+    pthread_mutex_unlock(&_lock);
+
+    serve(conn);
+
+    pthread_mutex_lock(&_lock);
+    _conn_fd = -1;
+    pthread_mutex_unlock(&_lock);
+
+    close(conn);
+  }
+}
+
+void ListenerHandoff::serve(int conn)
+{
+  std::string msg;
+  int fd = -1;
+
+  if ((!recv_message(conn, msg, fd)) || (msg != HANDOFF))
+  {
+    TRC_WARNING("Unexpected listener handoff request");
+    return;
+  }
+
+  Sockets sockets = _get_sockets_cb();
+  TRC_STATUS("Handing off %lu listening sockets", sockets.size());
+
+  for (Sockets::const_iterator it = sockets.begin(); it != sockets.end(); ++it)
+  {
+    TRC_DEBUG("Handing off listening socket %s (%d)", it->first.c_str(), it->second);
+
+    if (!send_message(conn, it->first, it->second))
+    {
+      return;
+    }
+  }
+
+  if (!send_message(conn, END, -1))
+  {
+    return; // LCOV_EXCL_LINE
+  }
+
+  // Keep accepting until the new process is too.
+  if ((!recv_message(conn, msg, fd)) || (msg != STARTED))
+  {
+    TRC_WARNING("New process didn't start accepting on the handed off sockets");
+    return;
+  }
+
+  TRC_STATUS("Listening sockets handed off");
+  _handed_off_cb();
+}
+
+int ListenerHandoff::receive(const std::string& path, Sockets& sockets)
+{
+  struct sockaddr_un addr;
+
+  if (!make_address(path, addr))
+  {
+    return -1;
+  }
+
+  int conn = socket(AF_LOCAL, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+  if (conn < 0)
+  {
+    TRC_ERROR("Failed to create listener handoff socket: %d", errno); // LCOV_EXCL_LINE
+    return -1; // LCOV_EXCL_LINE
+  }
+
+  if (connect(conn, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+  {
+    // Nothing to take over from.
+    TRC_DEBUG("No listener handoff at %s: %d", path.c_str(), errno);
+    close(conn);
+    return -1;
+  }
+
+  struct timeval timeout;
+  timeout.tv_sec = RECEIVE_TIMEOUT_MS / 1000;
+  timeout.tv_usec = (RECEIVE_TIMEOUT_MS % 1000) * 1000;
+  setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  Sockets received;
+  bool complete = false;
+
+  if (send_message(conn, HANDOFF, -1))
+  {
+    std::string key;
+    int fd;
+
+    while (recv_message(conn, key, fd))
+    {
+      if (fd >= 0)
+      {
+        TRC_DEBUG("Received listening socket %s (%d)", key.c_str(), fd);
+        received[key] = fd;
+      }
+      else if (key == END)
+      {
+        complete = true;
+        break;
+      }
+    }
+  }
+
+  if (!complete)
+  {
+    TRC_ERROR("Failed to receive listening sockets from %s", path.c_str());
+
+    for (Sockets::const_iterator it = received.begin(); it != received.end(); ++it)
+    {
+      close(it->second);
+    }
+
+    close(conn);
+    return -1;
+  }
+
+  TRC_STATUS("Received %lu listening sockets from %s", received.size(), path.c_str());
+
+  // Don't time out waiting to confirm - the caller may take a while to
+  // start.
+  timeout.tv_sec = 0;
+  timeout.tv_usec = 0;
+  setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  sockets.insert(received.begin(), received.end());
+  return conn;
+}
+
+void ListenerHandoff::confirm(int conn)
+{
+  if (!send_message(conn, STARTED, -1))
+  {
+    TRC_WARNING("Failed to confirm listener handoff"); // LCOV_EXCL_LINE
+  }
+
+  close(conn);
+}
+
+// As recv_file_descriptor in namespace_hop.cpp, the file descriptor is
+// carried as SCM_RIGHTS ancillary data.
+bool ListenerHandoff::send_message(int conn, const std::string& msg, int fd)
+{
+  struct iovec iov[1];
+  iov[0].iov_base = (void*)msg.data();
+  iov[0].iov_len = msg.length();
+
+  char ctrl_buf[CMSG_SPACE(sizeof(int))];
+  memset(ctrl_buf, 0, sizeof(ctrl_buf));
+
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = iov;
+  message.msg_iovlen = 1;
+
+  if (fd >= 0)
+  {
+    message.msg_control = ctrl_buf;
+    message.msg_controllen = sizeof(ctrl_buf);
+
+    struct cmsghdr* control_message = CMSG_FIRSTHDR(&message);
+    control_message->cmsg_level = SOL_SOCKET;
+    control_message->cmsg_type = SCM_RIGHTS;
+    control_message->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(control_message), &fd, sizeof(int));
+  }
+
+  if (::sendmsg(conn, &message, MSG_NOSIGNAL) < 0)
+  {
+    TRC_WARNING("Failed to send listener handoff message: %d", errno);
+    return false;
+  }
+
+  return true;
+}
+
+bool ListenerHandoff::recv_message(int conn, std::string& msg, int& fd)
+{
+  char data[MAX_MESSAGE];
+
+  struct iovec iov[1];
+  iov[0].iov_base = data;
+  iov[0].iov_len = sizeof(data);
+
+  char ctrl_buf[CMSG_SPACE(sizeof(int))];
+  memset(ctrl_buf, 0, sizeof(ctrl_buf));
+
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_control = ctrl_buf;
+  message.msg_controllen = sizeof(ctrl_buf);
+  message.msg_iov = iov;
+  message.msg_iovlen = 1;
+
+  ssize_t len = ::recvmsg(conn, &message, MSG_CMSG_CLOEXEC);
+
+  if (len <= 0)
+  {
+    // The other process has gone away, or timed out.
+    return false;
+  }
+
+  msg.assign(data, len);
+  fd = -1;
+
+  for (struct cmsghdr* control_message = CMSG_FIRSTHDR(&message);
+       control_message != NULL;
+       control_message = CMSG_NXTHDR(&message, control_message))
+  {
+    if ((control_message->cmsg_level == SOL_SOCKET) &&
+        (control_message->cmsg_type == SCM_RIGHTS))
+    {
+      memcpy(&fd, CMSG_DATA(control_message), sizeof(int));
+    }
+  }
+
+  return true;
+}
@@ -9,60 +9,105 @@
  * Metaswitch Networks in a separate written agreement.
  */
 
+#include <algorithm>
+
+#include "fast_clock.h"
 #include "load_monitor.h"
 #include "log.h"
 #include "snmp_continuous_accumulator_table.h"
 #include "snmp_scalar.h"
 #include "sasevent.h"
+#include "sas_event_sampler.h"
+#include "statistic.h"
+
+const char* const LoadMonitor::LOAD_HEADER = "X-Load";
+
+const int64_t TokenBucket::TOKEN_SCALE;
+const int LoadMonitor::NUM_SHARDS;
+const int LoadMonitor::NUM_PRIORITIES;
+
+// The time in microseconds on the cached monotonic clock, which is precise
+// enough for replenishing the bucket and much cheaper to read.
+static uint64_t coarse_time_us()
+{
+  return FastClock::cached_monotonic_us();
+}
 
 TokenBucket::TokenBucket(int initial_size,
                          float initial_rate_s,
                          float min_rate_s,
                          float max_rate_s) :
-  _tokens(initial_size),
+  _tokens((int64_t)initial_size * TOKEN_SCALE),
   _max_size(initial_size),
   _rate_s(initial_rate_s),
   _min_rate_s(min_rate_s),
-  _max_rate_s(max_rate_s)
+  _max_rate_s(max_rate_s),
+  _replenish_time_us(coarse_time_us())
 {
-  clock_gettime(CLOCK_MONOTONIC, &_replenish_time_us);
 }
 
 bool TokenBucket::get_token()
+{
+  return get_tokens(1);
+}
+
+bool TokenBucket::get_tokens(float count, float reserved)
 {
   replenish_bucket();
-  bool rc = (_tokens >= 1);
 
-  if (rc)
+  int64_t needed = (int64_t)(count * TOKEN_SCALE);
+  int64_t floor = (int64_t)(reserved * TOKEN_SCALE);
+  int64_t tokens = _tokens.load();
+
+  // Note that compare_exchange_weak loads the current value into tokens if
+  // the compare fails.
+  while (tokens - needed >= floor)
   {
-    _tokens -= 1;
+    if (_tokens.compare_exchange_weak(tokens, tokens - needed))
+    {
+      return true;
+    }
   }
 
-  return rc;
+  return false;
 }
 
 void TokenBucket::update_rate(float new_rate_s)
 {
   // The new rate must be greater than the min rate, and less than the
   // max rate (if set).
-  _rate_s = (new_rate_s > _min_rate_s) ? new_rate_s : _min_rate_s;
-  _rate_s = ((_max_rate_s != 0) && (_rate_s > _max_rate_s)) ? _max_rate_s : _rate_s;
+  float rate_s = (new_rate_s > _min_rate_s) ? new_rate_s : _min_rate_s;
+  rate_s = ((_max_rate_s != 0) && (rate_s > _max_rate_s)) ? _max_rate_s : rate_s;
+  _rate_s.store(rate_s);
 }
 
 void TokenBucket::replenish_bucket()
 {
-  timespec new_replenish_time_us;
-  clock_gettime(CLOCK_MONOTONIC, &new_replenish_time_us);
-
-  float timediff_us = ((new_replenish_time_us.tv_nsec - _replenish_time_us.tv_nsec) /
-                       1000.0) +
-                      ((new_replenish_time_us.tv_sec - _replenish_time_us.tv_sec) *
-                       1000000.0);
+  uint64_t new_replenish_time_us = coarse_time_us();
+  uint64_t replenish_time_us = _replenish_time_us.load();
+
+  // Only the thread that moves the replenish time on adds the tokens for the
+  // time that's passed, so they're only added once.  The clock is coarse, so
+  // this only happens every few milliseconds.
+  if ((new_replenish_time_us <= replenish_time_us) ||
+      (!_replenish_time_us.compare_exchange_strong(replenish_time_us,
+                                                   new_replenish_time_us)))
+  {
+    return;
+  }
 
   // The rate is in tokens/sec, and the timediff is in usec.
-  float new_tokens = ((_rate_s * timediff_us) / 1000000.0);
-  _tokens = (new_tokens > _max_size) ? _max_size : new_tokens + _tokens;
-  _replenish_time_us = new_replenish_time_us;
+  uint64_t timediff_us = new_replenish_time_us - replenish_time_us;
+  int64_t new_tokens = (int64_t)((_rate_s.load() * timediff_us * TOKEN_SCALE) /
+                                 1000000.0);
+  int64_t max_tokens = (int64_t)_max_size * TOKEN_SCALE;
+  int64_t tokens = _tokens.load();
+
+  while (!_tokens.compare_exchange_weak(tokens,
+                                        std::min(tokens + new_tokens, max_tokens)))
+  {
+    // Do nothing.
+  }
 }
 
 LoadMonitor::LoadMonitor(uint64_t init_target_latency_us,
@@ -74,14 +119,15 @@ LoadMonitor::LoadMonitor(uint64_t init_target_latency_us,
                          SNMP::AbstractScalar* smoothed_latency_scalar,
                          SNMP::AbstractScalar* target_latency_scalar,
                          SNMP::AbstractScalar* penalties_scalar,
-                         SNMP::AbstractScalar* token_rate_scalar) :
+                         SNMP::AbstractScalar* token_rate_scalar,
+                         SNMP::AbstractScalar* percentile_latency_scalar,
+                         SNMP::SuccessFailCountByPriorityAndScopeTable* admission_by_priority_table) :
   _bucket(max_bucket_size,
           init_token_rate_s,
           init_min_token_rate_s,
           init_max_token_rate_s),
-  _smoothed_latency_us(0),
+  _completions(),
   _target_latency_us(init_target_latency_us),
-  _smoothed_rate_s(0),
   _accepted(0),
   _rejected(0),
   _penalties(0),
@@ -90,7 +136,14 @@ LoadMonitor::LoadMonitor(uint64_t init_target_latency_us,
   _smoothed_latency_scalar(smoothed_latency_scalar),
   _target_latency_scalar(target_latency_scalar),
   _penalties_scalar(penalties_scalar),
-  _token_rate_scalar(token_rate_scalar)
+  _token_rate_scalar(token_rate_scalar),
+  _percentile_latency_scalar(percentile_latency_scalar),
+  _admission_by_priority_table(admission_by_priority_table),
+  _state_statistic(NULL),
+  _load(0),
+  _latency_percentile(0),
+  _last_latencies(),
+  _lock("load_monitor", true)
 {
   std::string max_token_fill_rate = (init_max_token_rate_s == 0) ?
     "No maximum" :
@@ -103,252 +156,412 @@ LoadMonitor::LoadMonitor(uint64_t init_target_latency_us,
   TRC_STATUS("   Min token fill rate/s     : %f", init_min_token_rate_s);
   TRC_STATUS("   Max token fill rate/s     : %s", max_token_fill_rate.c_str());
 
-  // Create the lock
-  pthread_mutexattr_t attrs;
-  pthread_mutexattr_init(&attrs);
-  pthread_mutexattr_settype(&attrs, PTHREAD_MUTEX_RECURSIVE);
-  pthread_mutex_init(&_lock, &attrs);
-  pthread_mutexattr_destroy(&attrs);
+  for (int ii = 0; ii < NUM_PRIORITIES; ++ii)
+  {
+    _priority_reserves[ii] = 0;
+  }
 
   // Get the current time
-  timespec current_time;
-  clock_gettime(CLOCK_MONOTONIC_COARSE, &current_time);
-  _last_adjustment_time_us = (current_time.tv_sec * 1000000) +
-                             (current_time.tv_nsec / 1000);
+  _last_adjustment_time_us = coarse_time_us();
 
   // As this statistics reporting is continuous, we should
   // publish the statistics when initialised.
-  update_statistics();
+  update_statistics(0, 0, 0);
 }
 
 LoadMonitor::~LoadMonitor()
 {
-  // Destroy the lock
-  pthread_mutex_destroy(&_lock);
+}
+
+void LoadMonitor::set_latency_percentile(double percentile)
+{
+  _lock.lock();
+  TRC_STATUS("Basing the token fill rate on the %s latency",
+             (percentile > 0) ? (std::to_string(percentile) + " percentile").c_str() :
+                                "smoothed mean");
+  _latency_percentile = percentile;
+  _latencies.snapshot(_last_latencies);
+  _lock.unlock();
 }
 
 bool LoadMonitor::admit_request(SAS::TrailId trail, bool allow_anyway)
 {
-  pthread_mutex_lock(&_lock);
+  return admit_weighted_request(trail, 1, allow_anyway);
+}
+
+void LoadMonitor::set_priority_reserve(SIPEventPriorityLevel priority,
+                                       float reserved_share)
+{
+  if ((priority < NORMAL_PRIORITY) || (priority >= NUM_PRIORITIES))
+  {
+    TRC_WARNING("Can't reserve tokens for invalid priority %d", priority);
+    return;
+  }
+
+  TRC_STATUS("Reserving %f of the token bucket for requests above priority %d",
+             reserved_share, priority);
+  _priority_reserves[priority] = reserved_share;
+}
+
+bool LoadMonitor::admit_weighted_request(SAS::TrailId trail,
+                                         float cost,
+                                         bool allow_anyway)
+{
+  return admit_priority_request(trail, NORMAL_PRIORITY, cost, allow_anyway);
+}
+
+bool LoadMonitor::admit_priority_request(SAS::TrailId trail,
+                                         SIPEventPriorityLevel priority,
+                                         float cost,
+                                         bool allow_anyway)
+{
+  int level = (priority < NORMAL_PRIORITY) ? NORMAL_PRIORITY :
+              (priority >= NUM_PRIORITIES) ? (NUM_PRIORITIES - 1) :
+                                             (int)priority;
+  float reserved = _priority_reserves[level].load(std::memory_order_relaxed) *
+                   _bucket.max_size();
 
-  if (_bucket.get_token() || allow_anyway)
+  if (_admission_by_priority_table != NULL)
+  {
+    _admission_by_priority_table->increment_attempts(level);
+  }
+
+  if (_bucket.get_tokens(cost, reserved) || allow_anyway)
   {
     // Admit the request - we either got a token from the bucket, or we're
     // meant to accept the request anyway.
-    _accepted += 1;
+    _accepted.fetch_add(1, std::memory_order_relaxed);
 
-    SAS::Event accept(trail, SASEvent::LOAD_MONITOR_ACCEPTED_REQUEST, 0);
-    accept.add_static_param(_bucket.rate());
-    accept.add_static_param(_bucket.token_count());
-    SAS::report_event(accept);
+    if (_admission_by_priority_table != NULL)
+    {
+      _admission_by_priority_table->increment_successes(level);
+    }
+
+    if (SASEventSampler::should_report(SASEvent::LOAD_MONITOR_ACCEPTED_REQUEST))
+    {
+      SAS::Event accept(trail, SASEvent::LOAD_MONITOR_ACCEPTED_REQUEST, 0);
+      accept.add_static_param(_bucket.rate());
+      accept.add_static_param(_bucket.token_count());
+      SAS::report_event(accept);
+    }
 
-    pthread_mutex_unlock(&_lock);
     return true;
   }
   else
   {
     // Insufficient tokens in the bucket so reject the request.
-    _rejected += 1;
-
-    float accepted_percent = (_accepted + _rejected == 0) ?
-                             100.0 :
-                             100 * ((float)_accepted / (_accepted + _rejected));
-    timespec current_time;
-    clock_gettime(CLOCK_MONOTONIC_COARSE, &current_time);
-    uint64_t time_passed_us = ((current_time.tv_sec * 1000000) +
-                               (current_time.tv_nsec / 1000)) -
-                              _last_adjustment_time_us;
-
-    SAS::Event event(trail, SASEvent::LOAD_MONITOR_REJECTED_REQUEST, 0);
-    event.add_static_param(_bucket.rate());
-    event.add_static_param(accepted_percent);
-    event.add_static_param(time_passed_us);
-    SAS::report_event(event);
-
-    pthread_mutex_unlock(&_lock);
+    _rejected.fetch_add(1, std::memory_order_relaxed);
+
+    if (_admission_by_priority_table != NULL)
+    {
+      _admission_by_priority_table->increment_failures(level);
+    }
+
+    if (SASEventSampler::should_report(SASEvent::LOAD_MONITOR_REJECTED_REQUEST))
+    {
+      int accepted = _accepted.load(std::memory_order_relaxed);
+      int rejected = _rejected.load(std::memory_order_relaxed);
+      float accepted_percent = (accepted + rejected == 0) ?
+                               100.0 :
+                               100 * ((float)accepted / (accepted + rejected));
+      uint64_t time_passed_us = coarse_time_us() - _last_adjustment_time_us.load();
+
+      SAS::Event event(trail, SASEvent::LOAD_MONITOR_REJECTED_REQUEST, 0);
+      event.add_static_param(_bucket.rate());
+      event.add_static_param(accepted_percent);
+      event.add_static_param(time_passed_us);
+      SAS::report_event(event);
+    }
+
     return false;
   }
 }
 
 void LoadMonitor::incr_penalties()
 {
-  pthread_mutex_lock(&_lock);
-  _penalties += 1;
-  pthread_mutex_unlock(&_lock);
+  _penalties.fetch_add(1, std::memory_order_relaxed);
+}
+
+int LoadMonitor::get_current_latency_us()
+{
+  uint64_t count;
+  uint64_t latency_sum_us;
+  uint64_t rate_sum_ms;
+  read_completions(count, latency_sum_us, rate_sum_ms, false);
+
+  return (count != 0) ? (latency_sum_us / count) : 0;
+}
+
+void LoadMonitor::read_completions(uint64_t& count,
+                                   uint64_t& latency_sum_us,
+                                   uint64_t& rate_sum_ms,
+                                   bool reset)
+{
+  count = 0;
+  latency_sum_us = 0;
+  rate_sum_ms = 0;
+
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    CompletionShard& shard = _completions[ii];
+
+    if (reset)
+    {
+      count += shard.count.exchange(0);
+      latency_sum_us += shard.latency_sum_us.exchange(0);
+      rate_sum_ms += shard.rate_sum_ms.exchange(0);
+    }
+    else
+    {
+      count += shard.count.load();
+      latency_sum_us += shard.latency_sum_us.load();
+      rate_sum_ms += shard.rate_sum_ms.load();
+    }
+  }
 }
 
 void LoadMonitor::request_complete(uint64_t latency_us,
                                    SAS::TrailId trail)
 {
-  pthread_mutex_lock(&_lock);
-  _smoothed_latency_us = (_smoothed_latency_us * _adjust_count + latency_us) /
-                         (_adjust_count + 1);
-
-  timespec current_time;
-  clock_gettime(CLOCK_MONOTONIC_COARSE, &current_time);
-  uint64_t current_time_us = (current_time.tv_sec * 1000000) +
-                             (current_time.tv_nsec / 1000);
+  _latencies.record(latency_us);
 
-  uint64_t us_passed = current_time_us - _last_adjustment_time_us;
+  uint64_t current_time_us = coarse_time_us();
+  uint64_t last_adjustment_time_us = _last_adjustment_time_us.load();
+  uint64_t us_passed = (current_time_us > last_adjustment_time_us) ?
+                       current_time_us - last_adjustment_time_us :
+                       0;
   float current_rate_s = (us_passed != 0) ?
                          REQUESTS_BEFORE_ADJUSTMENT * 1000000/us_passed :
                          0;
-  _smoothed_rate_s = (_smoothed_rate_s * _adjust_count + current_rate_s) /
-                     (_adjust_count + 1);
 
-  _adjust_count += 1;
+  // Add this request to the calling thread's shard, to be merged with the
+  // others when the rate is recalculated.
+  CompletionShard& shard = _completions[shard_index()];
+  shard.latency_sum_us.fetch_add(latency_us, std::memory_order_relaxed);
+  shard.rate_sum_ms.fetch_add((uint64_t)(current_rate_s * 1000),
+                              std::memory_order_relaxed);
+  shard.count.fetch_add(1, std::memory_order_relaxed);
 
-  if (_adjust_count >= REQUESTS_BEFORE_ADJUSTMENT)
+  int adjust_count = _adjust_count.fetch_add(1) + 1;
+
+  if (adjust_count >= REQUESTS_BEFORE_ADJUSTMENT)
   {
-    // We've seen the right number of requests.
-    SAS::Event recalculate(trail, SASEvent::LOAD_MONITOR_RECALCULATE_RATE, 0);
-    recalculate.add_static_param(REQUESTS_BEFORE_ADJUSTMENT);
-    SAS::report_event(recalculate);
-
-    // This algorithm is based on the Welsh and Culler "Adaptive Overload
-    // Control for Busy Internet Servers" paper, although based on a smoothed
-    // mean latency, rather than the 90th percentile as per the paper.
-    // Also, the additive increase is scaled as a proportion of the maximum
-    // bucket size, rather than an absolute number as per the paper.
-    float err = ((float)(_smoothed_latency_us) - _target_latency_us) /
-                 _target_latency_us;
-    TRC_INFO("Rate adjustment calculation inputs: "
-             "err %f, smoothed latency %lu, target latency %lu",
-             err, _smoothed_latency_us, _target_latency_us);
-
-    if (err > DECREASE_THRESHOLD || _penalties > 0)
+    // We've seen the right number of requests.  Only one thread recalculates
+    // the rate - if another thread already is, this request will be taken
+    // into account by it or by the next recalculation.
+    if (_lock.try_lock())
     {
-      // Latency is above where we want it to be, or we are getting overload
-      // responses from downstream nodes, so adjust the rate downwards by a
-      // multiplicative factor
-      float old_rate_s = _bucket.rate();
-      _bucket.update_rate(_bucket.rate() / DECREASE_FACTOR);
-
-      if (_penalties > 0)
-      {
-        SAS::Event decrease(trail, SASEvent::LOAD_MONITOR_DECREASE_PENALTIES, 0);
-        decrease.add_static_param(_bucket.rate());
-        decrease.add_static_param(old_rate_s);
-        SAS::report_event(decrease);
-      }
-      else
+      if (_adjust_count.load() >= REQUESTS_BEFORE_ADJUSTMENT)
       {
-        SAS::Event decrease(trail, SASEvent::LOAD_MONITOR_DECREASE_RATE, 0);
-        decrease.add_static_param(_bucket.rate());
-        decrease.add_static_param(old_rate_s);
-        decrease.add_static_param(_smoothed_latency_us);
-        decrease.add_static_param(_target_latency_us);
-        SAS::report_event(decrease);
+        adjust_rate(current_time_us, trail);
       }
 
-      TRC_INFO("Maximum incoming request rate/second decreased to %f from %f "
-               "(based on a smoothed mean latency of %dus, a target latency of "
-               "%dus and %d overload responses).",
-               _bucket.rate(),
-               old_rate_s,
-               _smoothed_latency_us,
-               _target_latency_us,
-               _penalties);
+      _lock.unlock();
     }
-    else if (err < INCREASE_THRESHOLD)
-    {
-      // Our latency is below the threshold, so increasing our permitted request
-      // rate would be sensible. Before doing that, we check that we're using a
-      // significant proportion of our current rate - if we're allowing 100
-      // requests/sec, and we get 1 request/sec because it's a quiet period,
-      // then it's going to be handled quickly, but that's not sufficient
-      // evidence to increase our rate.
-      float threshold_rate_s = _bucket.rate() * PERCENTAGE_BEFORE_ADJUSTMENT;
-
-      if (_smoothed_rate_s > threshold_rate_s)
-      {
-        float old_rate_s = _bucket.rate();
-        float new_rate_s = _bucket.rate() +
-                           (-1 * err * _bucket.max_size() * INCREASE_FACTOR);
-        _bucket.update_rate(new_rate_s);
-
-        SAS::Event increase(trail, SASEvent::LOAD_MONITOR_INCREASE_RATE, 0);
-        increase.add_static_param(_bucket.rate());
-        increase.add_static_param(old_rate_s);
-        increase.add_static_param(_smoothed_latency_us);
-        increase.add_static_param(_target_latency_us);
-        SAS::report_event(increase);
-
-        TRC_INFO("Maximum incoming request rate/second increased to %f from %f "
-                 "(based on a smoothed mean latency of %dus and a target "
-                 "latency of %dus).",
-                 _bucket.rate(),
-                 old_rate_s,
-                 _smoothed_latency_us,
-                 _target_latency_us);
-      }
-      else
-      {
-        SAS::Event unchanged_threshold(trail,
-                                       SASEvent::LOAD_MONITOR_UNCHANGED_THRESHOLD,
-                                       0);
-        unchanged_threshold.add_static_param(_bucket.rate());
-        unchanged_threshold.add_static_param(_smoothed_latency_us);
-        unchanged_threshold.add_static_param(_target_latency_us);
-        unchanged_threshold.add_static_param(_smoothed_rate_s);
-        unchanged_threshold.add_static_param(threshold_rate_s);
-        SAS::report_event(unchanged_threshold);
-
-        TRC_INFO("Maximum incoming request rate/second unchanged at %f (current "
-                  "request rate is %f requests/sec, minimum threshold for a "
-                  "change is %f requests/sec).",
-                  _bucket.rate(),
-                  _smoothed_rate_s,
-                  threshold_rate_s);
-      }
-    }
-    else
+  }
+  else
+  {
+    if (SASEventSampler::should_report(SASEvent::LOAD_MONITOR_UNADJUSTED))
     {
-      SAS::Event unchanged(trail, SASEvent::LOAD_MONITOR_UNCHANGED_RATE, 0);
+      uint64_t count;
+      uint64_t latency_sum_us;
+      uint64_t rate_sum_ms;
+      read_completions(count, latency_sum_us, rate_sum_ms, false);
+
+      SAS::Event unchanged(trail, SASEvent::LOAD_MONITOR_UNADJUSTED, 0);
+      unchanged.add_static_param(adjust_count);
+      unchanged.add_static_param(REQUESTS_BEFORE_ADJUSTMENT);
       unchanged.add_static_param(_bucket.rate());
+      unchanged.add_static_param((count != 0) ? ((float)rate_sum_ms / count / 1000) : 0);
+      unchanged.add_static_param((count != 0) ? (latency_sum_us / count) : 0);
+      unchanged.add_static_param(latency_us);
+      unchanged.add_static_param(_target_latency_us);
       SAS::report_event(unchanged);
-
-      TRC_DEBUG("Maximum incoming request rate/second is unchanged at %f.",
-                _bucket.rate());
     }
 
-    update_statistics();
+    TRC_DEBUG("Not recalculating rate as we haven't processed %d requests yet "
+              "(only %d).",
+              REQUESTS_BEFORE_ADJUSTMENT,
+              adjust_count);
+  }
+}
+
+void LoadMonitor::adjust_rate(uint64_t current_time_us, SAS::TrailId trail)
+{
+  // Merge the requests completed on all the threads since the rate was last
+  // recalculated.
+  uint64_t count;
+  uint64_t latency_sum_us;
+  uint64_t rate_sum_ms;
+  read_completions(count, latency_sum_us, rate_sum_ms, true);
+  _adjust_count.fetch_sub(count);
+
+  if (count == 0)
+  {
+    // Another thread hasn't finished adding its request to the shards yet.
+    return; // LCOV_EXCL_LINE
+  }
+
+  uint64_t smoothed_latency_us = latency_sum_us / count;
+  float smoothed_rate_s = (float)rate_sum_ms / count / 1000;
+  int penalties = _penalties.load();
+
+  // The latency the rate is adjusted on.
+  uint64_t latency_us = smoothed_latency_us;
+  uint64_t percentile_latency_us = 0;
+
+  if (_latency_percentile > 0)
+  {
+    LatencyHistogram::Snapshot latencies;
+    _latencies.snapshot(latencies);
+
+    LatencyHistogram::Snapshot period_latencies = latencies;
+    period_latencies.subtract(_last_latencies);
+    _last_latencies = latencies;
+
+    percentile_latency_us = period_latencies.percentile_us(_latency_percentile);
+    latency_us = percentile_latency_us;
+  }
+
+  _load.store((float)latency_us / _target_latency_us, std::memory_order_relaxed);
+
+  SAS::Event recalculate(trail, SASEvent::LOAD_MONITOR_RECALCULATE_RATE, 0);
+  recalculate.add_static_param(REQUESTS_BEFORE_ADJUSTMENT);
+  SAS::report_event(recalculate);
 
-    // Reset counts
-    _last_adjustment_time_us = current_time_us;
-    _adjust_count = 0;
-    _accepted = 0;
-    _rejected = 0;
-    _penalties = 0;
-    _smoothed_latency_us = 0;
-    _smoothed_rate_s = 0;
+  // This algorithm is based on the Welsh and Culler "Adaptive Overload
+  // Control for Busy Internet Servers" paper, although by default based on a
+  // smoothed mean latency, rather than the 90th percentile as per the paper.
+  // Also, the additive increase is scaled as a proportion of the maximum
+  // bucket size, rather than an absolute number as per the paper.
+  float err = ((float)(latency_us) - _target_latency_us) /
+               _target_latency_us;
+  TRC_INFO("Rate adjustment calculation inputs: "
+           "err %f, smoothed latency %lu, percentile latency %lu, target latency %lu",
+           err, smoothed_latency_us, percentile_latency_us, _target_latency_us);
+
+  if (err > DECREASE_THRESHOLD || penalties > 0)
+  {
+    // Latency is above where we want it to be, or we are getting overload
+    // responses from downstream nodes, so adjust the rate downwards by a
+    // multiplicative factor
+    float old_rate_s = _bucket.rate();
+    _bucket.update_rate(_bucket.rate() / DECREASE_FACTOR);
+
+    if (penalties > 0)
+    {
+      SAS::Event decrease(trail, SASEvent::LOAD_MONITOR_DECREASE_PENALTIES, 0);
+      decrease.add_static_param(_bucket.rate());
+      decrease.add_static_param(old_rate_s);
+      SAS::report_event(decrease);
+    }
+    else
+    {
+      SAS::Event decrease(trail, SASEvent::LOAD_MONITOR_DECREASE_RATE, 0);
+      decrease.add_static_param(_bucket.rate());
+      decrease.add_static_param(old_rate_s);
+      decrease.add_static_param(latency_us);
+      decrease.add_static_param(_target_latency_us);
+      SAS::report_event(decrease);
+    }
+
+    TRC_INFO("Maximum incoming request rate/second decreased to %f from %f "
+             "(based on a latency of %dus, a target latency of "
+             "%dus and %d overload responses).",
+             _bucket.rate(),
+             old_rate_s,
+             latency_us,
+             _target_latency_us,
+             penalties);
+  }
+  else if (err < INCREASE_THRESHOLD)
+  {
+    // Our latency is below the threshold, so increasing our permitted request
+    // rate would be sensible. Before doing that, we check that we're using a
+    // significant proportion of our current rate - if we're allowing 100
+    // requests/sec, and we get 1 request/sec because it's a quiet period,
+    // then it's going to be handled quickly, but that's not sufficient
+    // evidence to increase our rate.
+    float threshold_rate_s = _bucket.rate() * PERCENTAGE_BEFORE_ADJUSTMENT;
+
+    if (smoothed_rate_s > threshold_rate_s)
+    {
+      float old_rate_s = _bucket.rate();
+      float new_rate_s = _bucket.rate() +
+                         (-1 * err * _bucket.max_size() * INCREASE_FACTOR);
+      _bucket.update_rate(new_rate_s);
+
+      SAS::Event increase(trail, SASEvent::LOAD_MONITOR_INCREASE_RATE, 0);
+      increase.add_static_param(_bucket.rate());
+      increase.add_static_param(old_rate_s);
+      increase.add_static_param(latency_us);
+      increase.add_static_param(_target_latency_us);
+      SAS::report_event(increase);
+
+      TRC_INFO("Maximum incoming request rate/second increased to %f from %f "
+               "(based on a latency of %dus and a target "
+               "latency of %dus).",
+               _bucket.rate(),
+               old_rate_s,
+               latency_us,
+               _target_latency_us);
+    }
+    else
+    {
+      SAS::Event unchanged_threshold(trail,
+                                     SASEvent::LOAD_MONITOR_UNCHANGED_THRESHOLD,
+                                     0);
+      unchanged_threshold.add_static_param(_bucket.rate());
+      unchanged_threshold.add_static_param(latency_us);
+      unchanged_threshold.add_static_param(_target_latency_us);
+      unchanged_threshold.add_static_param(smoothed_rate_s);
+      unchanged_threshold.add_static_param(threshold_rate_s);
+      SAS::report_event(unchanged_threshold);
+
+      TRC_INFO("Maximum incoming request rate/second unchanged at %f (current "
+                "request rate is %f requests/sec, minimum threshold for a "
+                "change is %f requests/sec).",
+                _bucket.rate(),
+                smoothed_rate_s,
+                threshold_rate_s);
+    }
   }
   else
   {
-    SAS::Event unchanged(trail, SASEvent::LOAD_MONITOR_UNADJUSTED, 0);
-    unchanged.add_static_param(_adjust_count);
-    unchanged.add_static_param(REQUESTS_BEFORE_ADJUSTMENT);
+    SAS::Event unchanged(trail, SASEvent::LOAD_MONITOR_UNCHANGED_RATE, 0);
     unchanged.add_static_param(_bucket.rate());
-    unchanged.add_static_param(_smoothed_rate_s);
-    unchanged.add_static_param(_smoothed_latency_us);
-    unchanged.add_static_param(latency_us);
-    unchanged.add_static_param(_target_latency_us);
     SAS::report_event(unchanged);
 
-    TRC_DEBUG("Not recalculating rate as we haven't processed %d requests yet "
-              "(only %d).",
-              REQUESTS_BEFORE_ADJUSTMENT,
-              _adjust_count);
+    TRC_DEBUG("Maximum incoming request rate/second is unchanged at %f.",
+              _bucket.rate());
   }
 
-  pthread_mutex_unlock(&_lock);
+  update_statistics(smoothed_latency_us, percentile_latency_us, penalties);
+
+  Statistic* state_statistic = _state_statistic.load();
+
+  if (state_statistic != NULL)
+  {
+    uint64_t state[] = {(uint64_t)_bucket.rate(),
+                        (uint64_t)(_load.load() * 1000),
+                        (uint64_t)penalties};
+    state_statistic->report_change(state, 3);
+  }
+
+  // Reset counts
+  _last_adjustment_time_us.store(current_time_us);
+  _accepted.store(0);
+  _rejected.store(0);
+  _penalties.fetch_sub(penalties);
 }
 
-void LoadMonitor::update_statistics()
+void LoadMonitor::update_statistics(uint64_t smoothed_latency_us,
+                                    uint64_t percentile_latency_us,
+                                    int penalties)
 {
   if (_smoothed_latency_scalar != NULL)
   {
-    _smoothed_latency_scalar->set_value(_smoothed_latency_us);
+    _smoothed_latency_scalar->set_value(smoothed_latency_us);
   }
 
   if (_target_latency_scalar != NULL)
@@ -358,7 +571,7 @@ void LoadMonitor::update_statistics()
 
   if (_penalties_scalar != NULL)
   {
-    _penalties_scalar->set_value(_penalties);
+    _penalties_scalar->set_value(penalties);
   }
 
   if (_token_rate_table != NULL)
@@ -370,4 +583,9 @@ void LoadMonitor::update_statistics()
   {
     _token_rate_scalar->set_value(_bucket.rate());
   }
+
+  if (_percentile_latency_scalar != NULL)
+  {
+    _percentile_latency_scalar->set_value(percentile_latency_us);
+  }
 }
@@ -14,41 +14,82 @@
 #include <map>
 #include <list>
 #include <string>
+#include <vector>
+
+#include <functional>
+#include <new>
 
 #include <time.h>
 #include <stdint.h>
+#include <stdlib.h>
 
 #include "log.h"
 #include "localstore.h"
 
 
-LocalStore::LocalStore() :
+const unsigned int LocalStore::DEFAULT_NUM_SHARDS;
+
+LocalStore::LocalStore(unsigned int num_shards) :
   _data_contention_flag(false),
-  _db_lock(PTHREAD_MUTEX_INITIALIZER),
-  _db(),
+  _shards(NULL),
+  _num_shards(1),
   _force_error_on_set_flag(false),
   _force_error_on_get_flag(false),
-  _force_error_on_delete_flag(false),
-  _old_db()
+  _force_error_on_delete_flag(false)
 {
-  TRC_DEBUG("Created local store");
+  while (_num_shards < num_shards)
+  {
+    _num_shards <<= 1;
+  }
+
+  void* memory;
+  if (posix_memalign(&memory, alignof(Shard), _num_shards * sizeof(Shard)) != 0)
+  {
+    throw std::bad_alloc(); // LCOV_EXCL_LINE
+  }
+
+  _shards = (Shard*)memory;
+
+  for (unsigned int ii = 0; ii < _num_shards; ++ii)
+  {
+    new (&_shards[ii]) Shard();
+  }
+
+  TRC_DEBUG("Created local store with %u shards", _num_shards);
 }
 
 
 LocalStore::~LocalStore()
 {
   flush_all();
-  pthread_mutex_destroy(&_db_lock);
+
+  for (unsigned int ii = 0; ii < _num_shards; ++ii)
+  {
+    _shards[ii].~Shard();
+  }
+
+  free(_shards);
 }
 
 
 void LocalStore::flush_all()
 {
-  pthread_mutex_lock(&_db_lock);
   TRC_DEBUG("Flushing local store");
-  _db.clear();
-  _old_db.clear();
-  pthread_mutex_unlock(&_db_lock);
+
+  for (unsigned int ii = 0; ii < _num_shards; ++ii)
+  {
+    Shard& shard = _shards[ii];
+    pthread_mutex_lock(&shard.lock);
+    shard.db.clear();
+    shard.old_db.clear();
+    shard.sweep_key.clear();
+    pthread_mutex_unlock(&shard.lock);
+  }
+}
+
+LocalStore::Shard& LocalStore::shard_for(const std::string& fqkey)
+{
+  return _shards[std::hash<std::string>()(fqkey) & (_num_shards - 1)];
 }
 
 //This function sets a flag to true that tells the program to simulate data
@@ -92,7 +133,7 @@ Store::Status LocalStore::get_data(const std::string& table,
                                    Format data_format)
 {
   TRC_DEBUG("get_data table=%s key=%s", table.c_str(), key.c_str());
-  Store::Status status = Store::Status::NOT_FOUND;
+  Store::Status status;
 
   // This is for the purpose of testing data GETs failing.  If the flag is set
   // to true, then we'll just return an error.
@@ -105,46 +146,24 @@ Store::Status LocalStore::get_data(const std::string& table,
 
   // Calculate the fully qualified key.
   std::string fqkey = table + "\\\\" + key;
+  Shard& shard = shard_for(fqkey);
+  uint32_t now = time(NULL);
 
-  pthread_mutex_lock(&_db_lock);
+  pthread_mutex_lock(&shard.lock);
 
   // This is for the purposes of testing data contention. If the flag is set to
-  // true _db_in_use will become a reference to _old_db the out-of-date
+  // true _db_in_use will become a reference to old_db the out-of-date
   // database we constructed in set_data().
-  std::map<std::string, Record>& _db_in_use = _data_contention_flag ? _old_db : _db;
+  std::map<std::string, Record>& _db_in_use = _data_contention_flag ? shard.old_db : shard.db;
   if (_data_contention_flag)
   {
     _data_contention_flag = false;
   }
 
-  uint32_t now = time(NULL);
-
-  TRC_DEBUG("Search store for key %s", fqkey.c_str());
+  status = get_record(_db_in_use, fqkey, data, cas, now);
+  sweep(shard, now);
 
-  std::map<std::string, Record>::iterator i = _db_in_use.find(fqkey);
-  if (i != _db_in_use.end())
-  {
-    // Found an existing record, so check the expiry.
-    Record& r = i->second;
-    TRC_DEBUG("Found record, expiry = %ld (now = %ld)", r.expiry, now);
-    if (r.expiry < now)
-    {
-      // Record has expired, so remove it from the map and return not found.
-      TRC_DEBUG("Record has expired, remove it from store");
-      _db_in_use.erase(i);
-    }
-    else
-    {
-      // Record has not expired, so return the data and the cas value.
-      TRC_DEBUG("Record has not expired, return %d bytes of data with CAS = %ld",
-                r.data.length(), r.cas);
-      data = r.data;
-      cas = r.cas;
-      status = Store::Status::OK;
-    }
-  }
-
-  pthread_mutex_unlock(&_db_lock);
+  pthread_mutex_unlock(&shard.lock);
 
   TRC_DEBUG("get_data status = %d", status);
 
@@ -189,7 +208,7 @@ Store::Status LocalStore::set_data_inner(const std::string& table,
                                          int expiry,
                                          SAS::TrailId trail)
 {
-  Store::Status status = Store::Status::DATA_CONTENTION;
+  Store::Status status;
 
   if (data.length() > Store::MAX_DATA_LENGTH)
   {
@@ -210,16 +229,198 @@ Store::Status LocalStore::set_data_inner(const std::string& table,
 
   // Calculate the fully qualified key.
   std::string fqkey = table + "\\\\" + key;
+  Shard& shard = shard_for(fqkey);
+  uint32_t now = time(NULL);
+
+  pthread_mutex_lock(&shard.lock);
+
+  status = set_record(shard, fqkey, data, cas, check_cas, expiry, now);
+  sweep(shard, now);
+
+  pthread_mutex_unlock(&shard.lock);
+  return status;
+}
 
-  pthread_mutex_lock(&_db_lock);
+Store::Status LocalStore::delete_data(const std::string& table,
+                                      const std::string& key,
+                                      SAS::TrailId trail)
+{
+  TRC_DEBUG("delete_data table=%s key=%s",
+            table.c_str(), key.c_str());
+
+  // This is for the purpose of testing data DELETEs failing.  If the flag is set
+  // to true, then we'll just return an error.
+  if (_force_error_on_delete_flag)
+  {
+    TRC_DEBUG("Force an error on the DELETE");
+    _force_error_on_delete_flag = false;
+
+    return Store::Status::ERROR;
+  }
+
+  Store::Status status = Store::Status::OK;
+
+  // Calculate the fully qualified key.
+  std::string fqkey = table + "\\\\" + key;
+  Shard& shard = shard_for(fqkey);
+
+  pthread_mutex_lock(&shard.lock);
+
+  shard.db.erase(fqkey);
+  sweep(shard, time(NULL));
+
+  pthread_mutex_unlock(&shard.lock);
+
+  return status;
+}
+
+void LocalStore::get_data_multi(const std::string& table,
+                                const std::vector<std::string>& keys,
+                                std::vector<Store::GetResult>& results,
+                                SAS::TrailId trail,
+                                bool log_body,
+                                Store::Format data_format)
+{
+  TRC_DEBUG("get_data_multi table=%s for %d keys", table.c_str(), keys.size());
+  results.resize(keys.size());
+
+  // A forced error fails the whole request.
+  if (_force_error_on_get_flag)
+  {
+    TRC_DEBUG("Force an error on the GET");
+    _force_error_on_get_flag = false;
+
+    for (Store::GetResult& result : results)
+    {
+      result.status = Store::Status::ERROR;
+      result.cas = 0;
+    }
+
+    return;
+  }
+
+  bool use_old_db = _data_contention_flag;
+  _data_contention_flag = false;
 
   uint32_t now = time(NULL);
 
+  // Each key is read under its own shard's lock, so (unlike a read from
+  // memcached) the records aren't read at a single point in time.
+  for (size_t ii = 0; ii < keys.size(); ++ii)
+  {
+    std::string fqkey = table + "\\\\" + keys[ii];
+    Shard& shard = shard_for(fqkey);
+
+    pthread_mutex_lock(&shard.lock);
+
+    results[ii].cas = 0;
+    results[ii].status = get_record(use_old_db ? shard.old_db : shard.db,
+                                    fqkey,
+                                    results[ii].data,
+                                    results[ii].cas,
+                                    now);
+    sweep(shard, now);
+
+    pthread_mutex_unlock(&shard.lock);
+  }
+}
+
+void LocalStore::set_data_multi(const std::string& table,
+                                const std::vector<Store::SetRequest>& requests,
+                                std::vector<Store::Status>& statuses,
+                                SAS::TrailId trail,
+                                bool log_body,
+                                Store::Format data_format)
+{
+  TRC_DEBUG("set_data_multi table=%s for %d keys", table.c_str(), requests.size());
+  statuses.resize(requests.size());
+
+  // A forced error fails the whole request.
+  bool force_error = _force_error_on_set_flag;
+  _force_error_on_set_flag = false;
+
+  uint32_t now = time(NULL);
+
+  for (size_t ii = 0; ii < requests.size(); ++ii)
+  {
+    const Store::SetRequest& request = requests[ii];
+
+    if ((force_error) || (request.data.length() > Store::MAX_DATA_LENGTH))
+    {
+      statuses[ii] = Store::Status::ERROR;
+    }
+    else
+    {
+      std::string fqkey = table + "\\\\" + request.key;
+      Shard& shard = shard_for(fqkey);
+
+      pthread_mutex_lock(&shard.lock);
+
+      statuses[ii] = set_record(shard,
+                                fqkey,
+                                request.data,
+                                request.cas,
+                                true,
+                                request.expiry,
+                                now);
+      sweep(shard, now);
+
+      pthread_mutex_unlock(&shard.lock);
+    }
+  }
+}
+
+Store::Status LocalStore::get_record(std::map<std::string, Record>& db,
+                                     const std::string& fqkey,
+                                     std::string& data,
+                                     uint64_t& cas,
+                                     uint32_t now)
+{
+  Store::Status status = Store::Status::NOT_FOUND;
+
+  TRC_DEBUG("Search store for key %s", fqkey.c_str());
+
+  std::map<std::string, Record>::iterator i = db.find(fqkey);
+  if (i != db.end())
+  {
+    // Found an existing record, so check the expiry.
+    Record& r = i->second;
+    TRC_DEBUG("Found record, expiry = %ld (now = %ld)", r.expiry, now);
+    if (r.expiry < now)
+    {
+      // Record has expired, so remove it from the map and return not found.
+      TRC_DEBUG("Record has expired, remove it from store");
+      db.erase(i);
+    }
+    else
+    {
+      // Record has not expired, so return the data and the cas value.
+      TRC_DEBUG("Record has not expired, return %d bytes of data with CAS = %ld",
+                r.data.length(), r.cas);
+      data = r.data;
+      cas = r.cas;
+      status = Store::Status::OK;
+    }
+  }
+
+  return status;
+}
+
+Store::Status LocalStore::set_record(Shard& shard,
+                                     const std::string& fqkey,
+                                     const std::string& data,
+                                     uint64_t cas,
+                                     bool check_cas,
+                                     int expiry,
+                                     uint32_t now)
+{
+  Store::Status status = Store::Status::DATA_CONTENTION;
+
   TRC_DEBUG("Search store for key %s", fqkey.c_str());
 
-  std::map<std::string, Record>::iterator i = _db.find(fqkey);
+  std::map<std::string, Record>::iterator i = shard.db.find(fqkey);
 
-  if (i != _db.end())
+  if (i != shard.db.end())
   {
     // Found an existing record, so check the expiry and CAS value.
     Record& r = i->second;
@@ -234,9 +435,9 @@ Store::Status LocalStore::set_data_inner(const std::string& table,
       // CAS matches, or record has expired and CAS is zero), or we aren't
       // checking CAS values so update the record.
 
-      // This writes data this is one update out-of-date to _old_db. This is for
+      // This writes data this is one update out-of-date to old_db. This is for
       // the purposes of simulating data contention in Unit Testing.
-      _old_db[fqkey] = r;
+      shard.old_db[fqkey] = r;
 
       r.data = data;
       r.cas = check_cas ? ++cas : (r.cas + 1);
@@ -249,7 +450,7 @@ Store::Status LocalStore::set_data_inner(const std::string& table,
   else if (cas == 0)
   {
     // No existing record and supplied CAS is zero, so add a new record.
-    Record& r = _db[fqkey];
+    Record& r = shard.db[fqkey];
     r.data = data;
     r.cas = 1;
     r.expiry = (expiry == 0) ? 0 : (uint32_t)expiry + now;
@@ -258,53 +459,60 @@ Store::Status LocalStore::set_data_inner(const std::string& table,
               r.cas, r.expiry, now);
   }
 
-  pthread_mutex_unlock(&_db_lock);
   return status;
 }
 
-Store::Status LocalStore::delete_data(const std::string& table,
-                                      const std::string& key,
-                                      SAS::TrailId trail)
+void LocalStore::sweep(Shard& shard, uint32_t now)
 {
-  TRC_DEBUG("delete_data table=%s key=%s",
-            table.c_str(), key.c_str());
+  std::map<std::string, Record>::iterator i = shard.db.upper_bound(shard.sweep_key);
 
-  // This is for the purpose of testing data DELETEs failing.  If the flag is set
-  // to true, then we'll just return an error.
-  if (_force_error_on_delete_flag)
+  for (int ii = 0; (ii < SWEEP_BATCH) && (!shard.db.empty()); ++ii)
   {
-    TRC_DEBUG("Force an error on the DELETE");
-    _force_error_on_delete_flag = false;
+    if (i == shard.db.end())
+    {
+      // Start again from the beginning next time.
+      shard.sweep_key.clear();
+      return;
+    }
 
-    return Store::Status::ERROR;
+    if (i->second.expiry < now)
+    {
+      TRC_DEBUG("Sweep removing expired record %s", i->first.c_str());
+      shard.sweep_key = i->first;
+      i = shard.db.erase(i);
+    }
+    else
+    {
+      shard.sweep_key = i->first;
+      ++i;
+    }
   }
-
-  Store::Status status = Store::Status::OK;
-
-  // Calculate the fully qualified key.
-  std::string fqkey = table + "\\\\" + key;
-
-  pthread_mutex_lock(&_db_lock);
-
-  _db.erase(fqkey);
-
-  pthread_mutex_unlock(&_db_lock);
-
-  return status;
 }
 
 void LocalStore::swap_dbs(LocalStore* rhs)
 {
-  // Grab both DB locks. Technically this could cause a deadlock (if another
-  // thread calls swap_dbs on the rhs) but we only use this in test code
-  // anyway.
-  pthread_mutex_lock(&_db_lock);
-  pthread_mutex_lock(&rhs->_db_lock);
+  // Both stores must have the same shards, so that each key is in the same
+  // shard in both.
+  assert(_num_shards == rhs->_num_shards);
+
+  // Grab both locks for each shard. Technically this could cause a deadlock
+  // (if another thread calls swap_dbs on the rhs) but we only use this in
+  // test code anyway.
+  for (unsigned int ii = 0; ii < _num_shards; ++ii)
+  {
+    Shard& shard = _shards[ii];
+    Shard& rhs_shard = rhs->_shards[ii];
 
-  std::swap(_db, rhs->_db);
-  std::swap(_old_db, rhs->_old_db);
+    pthread_mutex_lock(&shard.lock);
+    pthread_mutex_lock(&rhs_shard.lock);
 
-  pthread_mutex_unlock(&rhs->_db_lock);
-  pthread_mutex_unlock(&_db_lock);
+    std::swap(shard.db, rhs_shard.db);
+    std::swap(shard.old_db, rhs_shard.old_db);
+    shard.sweep_key.clear();
+    rhs_shard.sweep_key.clear();
+
+    pthread_mutex_unlock(&rhs_shard.lock);
+    pthread_mutex_unlock(&shard.lock);
+  }
 }
 
@@ -16,7 +16,14 @@
 #include <pthread.h>
 #include <algorithm>
 #include <time.h>
+#include <atomic>
+#include <map>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <sys/uio.h>
 #include "log.h"
+#include "memory_accounting.h"
 
 const char* log_level[] = {"Error", "Warning", "Status", "Info", "Verbose", "Debug"};
 
@@ -25,9 +32,24 @@ const char* log_level[] = {"Error", "Warning", "Status", "Info", "Verbose", "Deb
 namespace Log
 {
   static Logger logger_static;
-  static Logger *logger = &logger_static;
+  static std::atomic<Logger*> logger(&logger_static);
   static pthread_mutex_t serialization_lock = PTHREAD_MUTEX_INITIALIZER;
   int loggingLevel = 4;
+
+  // The modules that have been logged from or had their level set, protected
+  // by module_lock.  Their levels are never freed, as log statements keep
+  // pointers to them.
+  static pthread_mutex_t module_lock = PTHREAD_MUTEX_INITIALIZER;
+  static std::map<std::string, ModuleLevel*>* module_levels = NULL;
+
+  // The highest level set for any module.
+  static std::atomic<int> max_module_level(-1);
+
+  static const char* module_name(const char* file)
+  {
+    const char* name = strrchr(file, '/');
+    return (name != NULL) ? name + 1 : file;
+  }
 }
 
 void Log::setLoggingLevel(int level)
@@ -43,19 +65,74 @@ void Log::setLoggingLevel(int level)
   Log::loggingLevel = level;
 }
 
+Log::ModuleLevel* Log::module_level(const char* file)
+{
+  std::string name = module_name(file);
+
+  pthread_mutex_lock(&Log::module_lock);
+
+  // This may be called during static initialization, so create the map on
+  // first use.
+  if (Log::module_levels == NULL)
+  {
+    Log::module_levels = new std::map<std::string, ModuleLevel*>();
+  }
+
+  ModuleLevel*& level = (*Log::module_levels)[name];
+
+  if (level == NULL)
+  {
+    level = new ModuleLevel(-1);
+  }
+
+  ModuleLevel* result = level;
+  pthread_mutex_unlock(&Log::module_lock);
+
+  return result;
+}
+
+void Log::setModuleLoggingLevel(const std::string& module, int level)
+{
+  if (level > DEBUG_LEVEL)
+  {
+    level = DEBUG_LEVEL;
+  }
+  else if (level < 0)
+  {
+    level = -1;
+  }
+
+  module_level(module.c_str())->store(level);
+
+  // Recalculate the highest level, which Log::_write checks against.
+  pthread_mutex_lock(&Log::module_lock);
+  int max_level = -1;
+
+  for (std::map<std::string, ModuleLevel*>::const_iterator it = Log::module_levels->begin();
+       it != Log::module_levels->end();
+       ++it)
+  {
+    max_level = std::max(max_level, it->second->load());
+  }
+
+  Log::max_module_level = max_level;
+  pthread_mutex_unlock(&Log::module_lock);
+}
+
 // Note that the caller is responsible for deleting the previous
-// Logger if it is allocated on the heap.
+// Logger if it is allocated on the heap.  Writes to an asynchronous Logger
+// aren't serialized with this, so the caller must also make sure no other
+// threads are still logging through it first.
 
 // Returns the previous Logger (e.g. so it can be stored off and reset).
 Logger* Log::setLogger(Logger *log)
 {
   pthread_mutex_lock(&Log::serialization_lock);
-  Logger* old = Log::logger;
-  Log::logger = log;
-  if (Log::logger != NULL)
+  if (log != NULL)
   {
-    Log::logger->set_flags(Logger::FLUSH_ON_WRITE|Logger::ADD_TIMESTAMPS);
+    log->set_flags(Logger::FLUSH_ON_WRITE|Logger::ADD_TIMESTAMPS);
   }
+  Logger* old = Log::logger.exchange(log);
   pthread_mutex_unlock(&Log::serialization_lock);
   return old;
 }
@@ -70,22 +147,16 @@ void Log::write(int level, const char *module, int line_number, const char *fmt,
 
 static void release_lock(void* notused) { pthread_mutex_unlock(&Log::serialization_lock); } // LCOV_EXCL_LINE
 
-static void log_helper(char* logline,
-                int& written,
-                int& truncated,
-                int level,
-                const char *module,
-                int line_number,
-                const char* context,
-                const char *fmt,
-                va_list args)
+// Writes the start of a log line, before the message itself.  Returns the
+// length written.
+static int log_prefix(char* logline,
+                      pthread_t thread,
+                      int level,
+                      const char *module,
+                      int line_number,
+                      const char* context)
 {
-  written = 0;
-  truncated = 0;
-
-  pthread_t thread = pthread_self();
-
-  written = snprintf(logline, MAX_LOGLINE -2, "[%lx] %s ", thread, log_level[level]);
+  int written = snprintf(logline, MAX_LOGLINE -2, "[%lx] %s ", thread, log_level[level]);
   int bytes_available = MAX_LOGLINE - written - 2;
 
   // If no module is supplied then all the information in the log is supplied in the fmt
@@ -119,12 +190,26 @@ static void log_helper(char* logline,
     }
   }
 
-  // snprintf and vsnprintf return the bytes that would have been
-  // written if their second argument was large enough, so we need to
-  // reduce the size of written to compensate if it is too large.
-  written = std::min(written, MAX_LOGLINE - 1);
+  // snprintf returns the bytes that would have been written if its second
+  // argument was large enough, so we need to reduce the size of written to
+  // compensate if it is too large.
+  return std::min(written, MAX_LOGLINE - 1);
+}
+
+static void log_helper(char* logline,
+                int& written,
+                int& truncated,
+                int level,
+                const char *module,
+                int line_number,
+                const char* context,
+                const char *fmt,
+                va_list args)
+{
+  truncated = 0;
+  written = log_prefix(logline, pthread_self(), level, module, line_number, context);
 
-  bytes_available = MAX_LOGLINE - written - 1;
+  int bytes_available = MAX_LOGLINE - written - 1;
   written += vsnprintf(logline + written, bytes_available, fmt, args);
 
   if (written > (MAX_LOGLINE - 1))
@@ -141,13 +226,48 @@ static void log_helper(char* logline,
 
 void Log::_write(int level, const char *module, int line_number, const char *fmt, va_list args)
 {
-  if (level > Log::loggingLevel)
+  // The TRC_* macros have already checked the level for the module, but
+  // direct callers haven't.
+  if ((level > Log::loggingLevel) &&
+      (level > Log::max_module_level.load(std::memory_order_relaxed)))
+  {
+    return;
+  }
+
+  char logline[MAX_LOGLINE];
+  int written;
+  int truncated;
+
+  log_helper(logline, written, truncated, level, module, line_number, nullptr, fmt, args);
+
+  // Add a null termination.
+  logline[written] = '\0';
+
+  char truncated_msg[128];
+
+  if (truncated > 0)
+  {
+    snprintf(truncated_msg, 128, "Previous log was truncated by %d characters\n", truncated);
+  }
+
+  Logger* logger = Log::logger.load();
+
+  if ((logger != NULL) && (logger->is_async()))
   {
+    // The logger just buffers the line for its own thread to write, so there
+    // is no need to serialize the write.
+    logger->write(logline);
+    if (truncated > 0)
+    {
+      logger->write(truncated_msg);
+    }
+
     return;
   }
 
   pthread_mutex_lock(&Log::serialization_lock);
-  if (!Log::logger)
+  logger = Log::logger.load();
+  if (!logger)
   {
     // LCOV_EXCL_START
     pthread_mutex_unlock(&Log::serialization_lock);
@@ -157,21 +277,10 @@ void Log::_write(int level, const char *module, int line_number, const char *fmt
 
   pthread_cleanup_push(release_lock, 0);
 
-  char logline[MAX_LOGLINE];
-  int written;
-  int truncated;
-
-  log_helper(logline, written, truncated, level, module, line_number, nullptr, fmt, args);
-
-  // Add a null termination.
-  logline[written] = '\0';
-
-  Log::logger->write(logline);
+  logger->write(logline);
   if (truncated > 0)
   {
-    char buf[128];
-    snprintf(buf, 128, "Previous log was truncated by %d characters\n", truncated);
-    Log::logger->write(buf);
+    logger->write(truncated_msg);
   }
 
   pthread_cleanup_pop(0);
@@ -201,7 +310,7 @@ void Log::backtrace(const char *fmt, ...)
   logline[written] = '\n';
   logline[written+1] = '\0';
 
-  Log::logger->backtrace_simple(logline);
+  Log::logger.load()->backtrace_simple(logline);
 }
 
 void Log::backtrace_adv()
@@ -211,7 +320,7 @@ void Log::backtrace_adv()
     return;
   }
 
-  Log::logger->backtrace_advanced();
+  Log::logger.load()->backtrace_advanced();
 }
 
 void Log::commit()
@@ -221,71 +330,892 @@ void Log::commit()
     return;
   }
 
-  Log::logger->commit();
+  Log::logger.load()->commit();
 }
 
 // LCOV_EXCL_STOP
 
-// 20 MB RAM Bufffer
-#define RAM_BUFFER_SIZE 20971520
+// 1 MB RAM buffer per recording thread
+#define RAM_BUFFER_SIZE 1048576
 
 namespace RamRecorder
 {
+  // Precedes each line in a buffer.  A length of WRAP means the rest of the
+  // buffer is unused, and the next line is at the start.
+  struct RecordHeader
+  {
+    struct timespec time;
+    uint32_t length;
+    uint32_t type;
+  };
+
+  static const uint32_t WRAP = 0xFFFFFFFF;
+
+  // The types of line: formatted text, or a BinaryRecord followed by the
+  // encoded arguments.
+  static const uint32_t TEXT = 0;
+  static const uint32_t BINARY = 1;
+
+  struct BinaryRecord
+  {
+    const char* module;
+    const char* format;
+    pthread_t thread;
+    int32_t level;
+    int32_t lineno;
+  };
+
+  // The types of encoded argument.  Each is a type byte followed by the
+  // value - an 8 byte number, or (for strings) a 2 byte length and the
+  // characters.
+  static const uint8_t ARG_SIGNED = 0;
+  static const uint8_t ARG_UNSIGNED = 1;
+  static const uint8_t ARG_DOUBLE = 2;
+  static const uint8_t ARG_STRING = 3;
+  static const uint8_t ARG_POINTER = 4;
+  static const uint8_t ARG_UNKNOWN = 5;
+
+  // A conversion in a printf format string.
+  struct FormatSpec
+  {
+    // Where the conversion starts (the '%') and ends.
+    const char* start;
+    const char* end;
+
+    const char* flags;
+    size_t flags_len;
+    int width;
+    bool width_star;
+    int precision;
+    bool precision_star;
+    char length[3];
+    char conversion;
+  };
+
+  // Finds the next conversion in a format string, treating "%%" as a
+  // conversion of '%'.  If there are no more, the conversion is 0 and start
+  // and end point at the end of the format.
+  static void next_spec(const char* format, FormatSpec& spec)
+  {
+    spec.width = -1;
+    spec.width_star = false;
+    spec.precision = -1;
+    spec.precision_star = false;
+    spec.length[0] = '\0';
+    spec.conversion = '\0';
+
+    const char* p = strchr(format, '%');
+
+    if (p == NULL)
+    {
+      spec.start = format + strlen(format);
+      spec.end = spec.start;
+      spec.flags = spec.start;
+      spec.flags_len = 0;
+      return;
+    }
+
+    spec.start = p++;
+
+    spec.flags = p;
+    while ((*p != '\0') && (strchr("-+ #0'", *p) != NULL))
+    {
+      ++p;
+    }
+    spec.flags_len = p - spec.flags;
+
+    if (*p == '*')
+    {
+      spec.width_star = true;
+      ++p;
+    }
+    else if ((*p >= '0') && (*p <= '9'))
+    {
+      spec.width = strtol(p, (char**)&p, 10);
+    }
+
+    if (*p == '.')
+    {
+      ++p;
+
+      if (*p == '*')
+      {
+        spec.precision_star = true;
+        ++p;
+      }
+      else
+      {
+        spec.precision = strtol(p, (char**)&p, 10);
+      }
+    }
+
+    size_t length_len = 0;
+    while ((*p != '\0') && (strchr("hlLqjzt", *p) != NULL))
+    {
+      if (length_len < sizeof(spec.length) - 1)
+      {
+        spec.length[length_len++] = *p;
+      }
+      ++p;
+    }
+    spec.length[length_len] = '\0';
+
+    spec.conversion = *p;
+
+    if (*p != '\0')
+    {
+      ++p;
+    }
+
+    spec.end = p;
+  }
+
+  // A thread's buffer.  The lines in it are between `tail` and `head`, which
+  // only the owning thread moves - it moves the tail on over the oldest lines
+  // to make room for new ones.  So recording doesn't need a lock, and dump()
+  // can read the buffer while it is being written by checking afterwards
+  // which lines were overwritten while it was reading.
+  //
+  // Buffers aren't freed when their threads exit, so that dump() still has
+  // their lines, but are reused by new threads.
+  struct Buffer
+  {
+    Buffer() : data(new char[RAM_BUFFER_SIZE]), head(0), tail(0), in_use(true) {}
+
+    char* data;
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    bool in_use;
+  };
+
+  // All the buffers, protected by `lock`.  The lock is only taken when a
+  // thread first records, when it exits and when dumping.
   static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  static std::vector<Buffer*> buffers;
+
+  static pthread_once_t buffer_key_once = PTHREAD_ONCE_INIT;
+  static pthread_key_t buffer_key;
 
-  static char buffer[RAM_BUFFER_SIZE];
+  // Lines recorded before this time (in nanoseconds) were cleared by reset().
+  static std::atomic<uint64_t> reset_time_ns(0);
 
-  // These pointers represent the start and end of our sliding window across the
-  // buffer.
-  static char* window_start = buffer;
-  static char* window_end = buffer;
   bool record_everything = false;
-}
 
-void RamRecorder::recordEverything()
-{
-  RamRecorder::record_everything = true;
+  static void release_buffer(void* buffer)
+  {
+    pthread_mutex_lock(&RamRecorder::lock);
+    ((Buffer*)buffer)->in_use = false;
+    pthread_mutex_unlock(&RamRecorder::lock);
+  }
+
+  static void create_buffer_key()
+  {
+    pthread_key_create(&buffer_key, release_buffer);
+  }
+
+  // Returns the calling thread's buffer, taking over an unused one or
+  // creating one if required.
+  static Buffer* thread_buffer()
+  {
+    pthread_once(&buffer_key_once, create_buffer_key);
+    Buffer* buffer = (Buffer*)pthread_getspecific(buffer_key);
+
+    if (buffer == NULL)
+    {
+      pthread_mutex_lock(&RamRecorder::lock);
+
+      for (std::vector<Buffer*>::iterator it = buffers.begin();
+           it != buffers.end();
+           ++it)
+      {
+        if (!(*it)->in_use)
+        {
+          buffer = *it;
+          buffer->in_use = true;
+          break;
+        }
+      }
+
+      if (buffer == NULL)
+      {
+        buffer = new Buffer();
+        buffers.push_back(buffer);
+
+        // Buffers are reused rather than freed, so are never credited.
+        MemoryAccount::get(MemoryAccount::RAM_RECORDER)->charge(sizeof(Buffer) +
+                                                                RAM_BUFFER_SIZE);
+      }
+
+      pthread_mutex_unlock(&RamRecorder::lock);
+      pthread_setspecific(buffer_key, buffer);
+    }
+
+    return buffer;
+  }
+
+  // The space a line takes up in a buffer.
+  static size_t record_size(size_t length)
+  {
+    return (sizeof(RecordHeader) + length + 7) & ~(size_t)7;
+  }
+
+  // The space taken up by the line (or unused space) at a position in a
+  // buffer.  Sets `header` if there is a line there.
+  static size_t space_at(const char* data, uint64_t pos, RecordHeader& header, bool& is_line)
+  {
+    size_t offset = pos % RAM_BUFFER_SIZE;
+    size_t remaining = RAM_BUFFER_SIZE - offset;
+    is_line = false;
+
+    if (remaining < sizeof(header))
+    {
+      return remaining;
+    }
+
+    memcpy(&header, data + offset, sizeof(header));
+
+    if (header.length == WRAP)
+    {
+      return remaining;
+    }
+
+    is_line = true;
+    return record_size(header.length);
+  }
+
+  static void append(const struct timespec& time, uint32_t type, const char* line, size_t length)
+  {
+    size_t size = record_size(length);
+
+    if (size > RAM_BUFFER_SIZE / 2)
+    {
+      return; // LCOV_EXCL_LINE
+    }
+
+    Buffer* buffer = thread_buffer();
+    uint64_t head = buffer->head.load(std::memory_order_relaxed);
+    uint64_t tail = buffer->tail.load(std::memory_order_relaxed);
+
+    // Lines aren't split across the end of the buffer, so skip to the start
+    // if this one doesn't fit.
+    size_t remaining = RAM_BUFFER_SIZE - (head % RAM_BUFFER_SIZE);
+    size_t skip = (remaining < size) ? remaining : 0;
+
+    // Make room by dropping the oldest lines.  The tail must be moved on
+    // before they're overwritten, so that dump() can tell they were.
+    RecordHeader header;
+    bool is_line;
+
+    while ((tail < head) && (head + skip + size - tail > RAM_BUFFER_SIZE))
+    {
+      tail += space_at(buffer->data, tail, header, is_line);
+    }
+
+    buffer->tail.store(tail, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    if (skip >= sizeof(header))
+    {
+      header.length = WRAP;
+      memcpy(buffer->data + (head % RAM_BUFFER_SIZE), &header, sizeof(header));
+    }
+
+    head += skip;
+    char* record = buffer->data + (head % RAM_BUFFER_SIZE);
+
+    header.time = time;
+    header.length = length;
+    header.type = type;
+    memcpy(record, &header, sizeof(header));
+    memcpy(record + sizeof(header), line, length);
+
+    buffer->head.store(head + size, std::memory_order_release);
+  }
+
+  // A line read from a buffer when dumping.
+  struct Line
+  {
+    struct timespec time;
+    uint32_t type;
+    const char* data;
+    size_t length;
+
+    bool operator<(const Line& other) const
+    {
+      return ((time.tv_sec < other.time.tv_sec) ||
+              ((time.tv_sec == other.time.tv_sec) &&
+               (time.tv_nsec < other.time.tv_nsec)));
+    }
+  };
+
+  // Find the lines in a copy of a buffer, given the buffer's head from before
+  // it was copied and its tail from after (so any lines that were overwritten
+  // while it was being copied are skipped).
+  static void parse_lines(const char* copy,
+                          uint64_t head,
+                          uint64_t tail,
+                          uint64_t reset_ns,
+                          std::vector<Line>& lines)
+  {
+    while (tail < head)
+    {
+      RecordHeader header;
+      bool is_line;
+      size_t space = space_at(copy, tail, header, is_line);
+
+      if ((is_line) &&
+          ((uint64_t)header.time.tv_sec * 1000000000 + header.time.tv_nsec >= reset_ns))
+      {
+        Line line;
+        line.time = header.time;
+        line.type = header.type;
+        line.data = copy + (tail % RAM_BUFFER_SIZE) + sizeof(header);
+        line.length = header.length;
+        lines.push_back(line);
+      }
+
+      tail += space;
+    }
+  }
+
+  // Copy the lines currently in a buffer, skipping any that are overwritten
+  // while they're being copied.
+  static void snapshot(const Buffer* buffer, char* copy, std::vector<Line>& lines)
+  {
+    uint64_t head = buffer->head.load(std::memory_order_acquire);
+    memcpy(copy, buffer->data, RAM_BUFFER_SIZE);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint64_t tail = buffer->tail.load(std::memory_order_relaxed);
+    parse_lines(copy, head, tail, reset_time_ns.load(), lines);
+  }
+
+  // Read memory from another process.
+  static bool read_remote(pid_t pid, const void* remote, void* local, size_t length)
+  {
+    struct iovec local_iov;
+    local_iov.iov_base = local;
+    local_iov.iov_len = length;
+
+    struct iovec remote_iov;
+    remote_iov.iov_base = (void*)remote;
+    remote_iov.iov_len = length;
+
+    return (process_vm_readv(pid, &local_iov, 1, &remote_iov, 1, 0) == (ssize_t)length);
+  }
+
+  // As snapshot(), but for a buffer in another process.
+  static bool snapshot_remote(pid_t pid,
+                              const Buffer* remote,
+                              uint64_t reset_ns,
+                              char* copy,
+                              std::vector<Line>& lines)
+  {
+    // Only the buffer's fields are read, so it's never constructed here.
+    alignas(Buffer) char fields[sizeof(Buffer)];
+    const Buffer* buffer = (const Buffer*)fields;
+
+    if (!read_remote(pid, remote, fields, sizeof(fields)))
+    {
+      return false;
+    }
+
+    uint64_t head = buffer->head.load(std::memory_order_relaxed);
+
+    if ((!read_remote(pid, buffer->data, copy, RAM_BUFFER_SIZE)) ||
+        (!read_remote(pid, remote, fields, sizeof(fields))))
+    {
+      return false;
+    }
+
+    parse_lines(copy, head, buffer->tail.load(std::memory_order_relaxed), reset_ns, lines);
+    return true;
+  }
 }
 
-void RamRecorder::_record(int level, const char* module, int lineno, const char* context, const char* format, va_list args)
+namespace RamRecorder
 {
-  int truncated;
+  // Reads the encoded arguments of a binary record.
+  class ArgReader
+  {
+  public:
+    ArgReader(const char* data, size_t length) : _data(data), _end(data + length) {}
+
+    // Returns false if there are no more arguments.
+    bool next(uint8_t& type, uint64_t& value, const char*& str, size_t& str_len)
+    {
+      if (_data >= _end)
+      {
+        return false;
+      }
+
+      type = *_data++;
+
+      if (type == ARG_STRING)
+      {
+        uint16_t len;
+        memcpy(&len, _data, sizeof(len));
+        str = _data + sizeof(len);
+        str_len = len;
+        _data += sizeof(len) + len;
+      }
+      else if (type != ARG_UNKNOWN)
+      {
+        memcpy(&value, _data, sizeof(value));
+        _data += sizeof(value);
+      }
+
+      return true;
+    }
+
+  private:
+    const char* _data;
+    const char* _end;
+  };
+
+  // Convert an encoded integer to the type the format says it was passed as.
+  static long long signed_value(uint64_t value, const char* length)
+  {
+    if (strcmp(length, "hh") == 0)
+    {
+      return (signed char)value;
+    }
+    else if (strcmp(length, "h") == 0)
+    {
+      return (short)value;
+    }
+    else if (length[0] == '\0')
+    {
+      return (int)value;
+    }
+
+    return (long long)value;
+  }
+
+  static unsigned long long unsigned_value(uint64_t value, const char* length)
+  {
+    if (strcmp(length, "hh") == 0)
+    {
+      return (unsigned char)value;
+    }
+    else if (strcmp(length, "h") == 0)
+    {
+      return (unsigned short)value;
+    }
+    else if (length[0] == '\0')
+    {
+      return (unsigned int)value;
+    }
+
+    return (unsigned long long)value;
+  }
+
+  // Formats the message of a binary record as vsnprintf would have when it
+  // was recorded, a conversion at a time.  Conversions without a suitable
+  // argument are written as "<?>".  Returns the length written.
+  static size_t format_binary(const char* format,
+                              const char* data,
+                              size_t length,
+                              char* out,
+                              size_t size)
+  {
+    ArgReader reader(data, length);
+    size_t written = 0;
+    FormatSpec spec;
+
+    while (written + 1 < size)
+    {
+      next_spec(format, spec);
+
+      // Copy the text before the conversion.
+      size_t text_len = std::min((size_t)(spec.start - format), size - 1 - written);
+      memcpy(out + written, format, text_len);
+      written += text_len;
+      format = spec.end;
+
+      if ((spec.conversion == '\0') || (written + 1 >= size))
+      {
+        break;
+      }
+
+      if (spec.conversion == '%')
+      {
+        out[written++] = '%';
+        continue;
+      }
+
+      uint8_t type = ARG_UNKNOWN;
+      uint64_t value = 0;
+      const char* str = NULL;
+      size_t str_len = 0;
+
+      int width = spec.width;
+      bool left = false;
+
+      if ((spec.width_star) &&
+          (reader.next(type, value, str, str_len)) &&
+          ((type == ARG_SIGNED) || (type == ARG_UNSIGNED)))
+      {
+        int star = (int)value;
+        left = (star < 0);
+        width = left ? -star : star;
+      }
+
+      int precision = spec.precision;
+
+      if ((spec.precision_star) &&
+          (reader.next(type, value, str, str_len)) &&
+          ((type == ARG_SIGNED) || (type == ARG_UNSIGNED)))
+      {
+        precision = ((int)value < 0) ? -1 : (int)value;
+      }
+
+      // Rebuild the conversion without any '*'s, and with the length
+      // modifier of the type the argument is passed to snprintf as.
+      char conversion[64];
+      int pos = snprintf(conversion, sizeof(conversion), "%%%.*s%s",
+                         (int)std::min(spec.flags_len, (size_t)8), spec.flags,
+                         left ? "-" : "");
+
+      if (width >= 0)
+      {
+        pos += snprintf(conversion + pos, sizeof(conversion) - pos, "%d", width);
+      }
+
+      if (precision >= 0)
+      {
+        pos += snprintf(conversion + pos, sizeof(conversion) - pos, ".%d", precision);
+      }
+
+      bool have_arg = reader.next(type, value, str, str_len);
+      bool is_integer = (have_arg) && ((type == ARG_SIGNED) || (type == ARG_UNSIGNED));
+      int rc = -1;
+
+      switch (spec.conversion)
+      {
+      case 'd':
+      case 'i':
+        if (is_integer)
+        {
+          snprintf(conversion + pos, sizeof(conversion) - pos, "lld");
+          rc = snprintf(out + written, size - written, conversion,
+                        signed_value(value, spec.length));
+        }
+        break;
+
+      case 'o':
+      case 'u':
+      case 'x':
+      case 'X':
+        if (is_integer)
+        {
+          snprintf(conversion + pos, sizeof(conversion) - pos, "ll%c", spec.conversion);
+          rc = snprintf(out + written, size - written, conversion,
+                        unsigned_value(value, spec.length));
+        }
+        break;
+
+      case 'c':
+        if (is_integer)
+        {
+          snprintf(conversion + pos, sizeof(conversion) - pos, "c");
+          rc = snprintf(out + written, size - written, conversion, (int)value);
+        }
+        break;
+
+      case 'e':
+      case 'E':
+      case 'f':
+      case 'F':
+      case 'g':
+      case 'G':
+      case 'a':
+      case 'A':
+        if ((have_arg) && (type == ARG_DOUBLE))
+        {
+          double d;
+          memcpy(&d, &value, sizeof(d));
+          snprintf(conversion + pos, sizeof(conversion) - pos, "%c", spec.conversion);
+          rc = snprintf(out + written, size - written, conversion, d);
+        }
+        break;
 
+      case 's':
+        if ((have_arg) && (type == ARG_STRING))
+        {
+          std::string s(str, str_len);
+          snprintf(conversion + pos, sizeof(conversion) - pos, "s");
+          rc = snprintf(out + written, size - written, conversion, s.c_str());
+        }
+        break;
+
+      case 'p':
+        if ((is_integer) || ((have_arg) && (type == ARG_POINTER)))
+        {
+          snprintf(conversion + pos, sizeof(conversion) - pos, "p");
+          rc = snprintf(out + written, size - written, conversion, (void*)value);
+        }
+        break;
+
+      case 'n':
+        rc = 0;
+        break;
+
+      default:
+        break;
+      }
+
+      if (rc < 0)
+      {
+        rc = snprintf(out + written, size - written, "<?>");
+      }
+
+      written += std::min((size_t)rc, size - 1 - written);
+    }
+
+    out[written] = '\0';
+    return written;
+  }
+  // Write lines from the buffers to a dump file, in the order they were
+  // recorded in.
+  static void write_lines(FILE* file, std::vector<Line>& lines)
   {
-    // Space for the log line, and space for the timestamp
-    char logline[MAX_LOGLINE + 100];
+    std::stable_sort(lines.begin(), lines.end());
 
-    // Fill out the timestamp
-    int timestamp_length;
+    if (lines.empty())
+    {
+      // No bufffered data
+      fprintf(file, "No recorded logs\n");
+    }
 
+    for (std::vector<Line>::iterator it = lines.begin();
+         it != lines.end();
+         ++it)
     {
       timestamp_t ts;
-      struct timespec timespec;
-      clock_gettime(CLOCK_REALTIME, &timespec);
-      Logger::get_timestamp(ts, timespec);
-      Logger::format_timestamp(ts, logline, 100);
-      timestamp_length = strlen(logline);
+      char timestamp[100];
+      Logger::get_timestamp(ts, it->time);
+      Logger::format_timestamp(ts, timestamp, sizeof(timestamp));
+      fprintf(file, "%s ", timestamp);
 
-      logline[timestamp_length] = ' ';
-      timestamp_length += 1;
+      if (it->type == BINARY)
+      {
+        BinaryRecord binary;
+        memcpy(&binary, it->data, sizeof(binary));
+
+        char logline[MAX_LOGLINE];
+        int written = log_prefix(logline, binary.thread, binary.level, binary.module, binary.lineno, NULL);
+        written += format_binary(binary.format,
+                                 it->data + sizeof(binary),
+                                 it->length - sizeof(binary),
+                                 logline + written,
+                                 MAX_LOGLINE - written - 1);
+        logline[written++] = '\n';
+        fwrite(logline, sizeof(char), written, file);
+      }
+      else
+      {
+        fwrite(it->data, sizeof(char), it->length, file);
+      }
     }
+  }
+}
 
-    // Fill out the log line
-    int logline_length;
+const size_t RamRecorder::BinaryArgs::MAX_SIZE;
 
-    log_helper(logline + timestamp_length, logline_length, truncated, level, module, lineno, context, format, args);
+RamRecorder::BinaryArgs::BinaryArgs(const char* format) :
+  _format(format),
+  _need_spec(true),
+  _width_star(false),
+  _precision_star(false),
+  _precision(-1),
+  _length(0),
+  _full(false)
+{
+}
 
-    RamRecorder::write(logline, logline_length + timestamp_length);
+void RamRecorder::BinaryArgs::next_arg()
+{
+  if (_need_spec)
+  {
+    FormatSpec spec;
+
+    do
+    {
+      next_spec(_format, spec);
+      _format = spec.end;
+    }
+    while (spec.conversion == '%');
+
+    _width_star = spec.width_star;
+    _precision_star = spec.precision_star;
+    _precision = spec.precision;
+    _need_spec = false;
+  }
+}
+
+void RamRecorder::BinaryArgs::add(uint8_t type, const void* value, size_t length)
+{
+  if ((_full) || (_length + 1 + length > MAX_SIZE))
+  {
+    // Drop this and any later arguments, so that they don't get out of step
+    // with the format.
+    _full = true;
+    return;
   }
 
+  _data[_length++] = type;
+  memcpy(_data + _length, value, length);
+  _length += length;
+}
+
+void RamRecorder::BinaryArgs::add_signed(int64_t value)
+{
+  next_arg();
+
+  if (_width_star)
+  {
+    _width_star = false;
+  }
+  else if (_precision_star)
+  {
+    _precision_star = false;
+    _precision = (value < 0) ? -1 : (int)value;
+  }
+  else
+  {
+    _need_spec = true;
+  }
+
+  add(ARG_SIGNED, &value, sizeof(value));
+}
+
+void RamRecorder::BinaryArgs::add_unsigned(uint64_t value)
+{
+  next_arg();
+
+  if (_width_star)
+  {
+    _width_star = false;
+  }
+  else if (_precision_star)
+  {
+    _precision_star = false;
+    _precision = (int)value;
+  }
+  else
+  {
+    _need_spec = true;
+  }
+
+  add(ARG_UNSIGNED, &value, sizeof(value));
+}
+
+void RamRecorder::BinaryArgs::add_double(double value)
+{
+  next_arg();
+  _need_spec = true;
+  add(ARG_DOUBLE, &value, sizeof(value));
+}
+
+void RamRecorder::BinaryArgs::add_string(const char* value)
+{
+  next_arg();
+  _need_spec = true;
+
+  if (value == NULL)
+  {
+    value = "(null)";
+  }
+
+  // The string needn't be null-terminated if the format gives a precision.
+  size_t len = (_precision >= 0) ? strnlen(value, _precision) : strlen(value);
+
+  // Truncate long strings to fit, rather than dropping them.
+  uint16_t encoded_len = 0;
+  size_t header_len = 1 + sizeof(encoded_len);
+
+  if ((!_full) && (_length + header_len < MAX_SIZE))
+  {
+    len = std::min(len, std::min(MAX_SIZE - _length - header_len, (size_t)0xFFFF));
+  }
+
+  encoded_len = len;
+
+  if ((_full) || (_length + header_len + len > MAX_SIZE))
+  {
+    _full = true;
+    return;
+  }
+
+  _data[_length++] = ARG_STRING;
+  memcpy(_data + _length, &encoded_len, sizeof(encoded_len));
+  _length += sizeof(encoded_len);
+  memcpy(_data + _length, value, len);
+  _length += len;
+}
+
+void RamRecorder::BinaryArgs::add_pointer(const void* value)
+{
+  next_arg();
+  _need_spec = true;
+  add(ARG_POINTER, &value, sizeof(value));
+}
+
+void RamRecorder::BinaryArgs::add_unknown()
+{
+  next_arg();
+  _need_spec = true;
+  add(ARG_UNKNOWN, NULL, 0);
+}
+
+void RamRecorder::recordEverything()
+{
+  RamRecorder::record_everything = true;
+}
+
+void RamRecorder::_record(int level, const char* module, int lineno, const char* context, const char* format, va_list args)
+{
+  // The line is timestamped when it's dumped.
+  struct timespec timespec;
+  clock_gettime(CLOCK_REALTIME, &timespec);
+
+  char logline[MAX_LOGLINE];
+  int logline_length;
+  int truncated;
+
+  log_helper(logline, logline_length, truncated, level, module, lineno, context, format, args);
+
+  append(timespec, TEXT, logline, logline_length);
+
   if (truncated)
   {
     char buf[128];
     int len = snprintf(buf, 128, "Earlier log was truncated by %d characters\n", truncated);
-    RamRecorder::write(buf, len);
+    append(timespec, TEXT, buf, len);
   }
 }
 
+void RamRecorder::_record_binary(int level, const char* module, int lineno, const char* format, const BinaryArgs& args)
+{
+  // Just store the format and arguments - they're formatted when they're
+  // dumped.
+  struct timespec timespec;
+  clock_gettime(CLOCK_REALTIME, &timespec);
+
+  BinaryRecord binary;
+  binary.module = module;
+  binary.format = format;
+  binary.thread = pthread_self();
+  binary.level = level;
+  binary.lineno = lineno;
+
+  char record[sizeof(binary) + BinaryArgs::MAX_SIZE];
+  memcpy(record, &binary, sizeof(binary));
+  memcpy(record + sizeof(binary), args.data(), args.length());
+
+  append(timespec, BINARY, record, sizeof(binary) + args.length());
+}
+
 void RamRecorder::record(int level, const char* module, int lineno, const char* format, ...)
 {
   va_list args;
@@ -305,78 +1235,19 @@ void RamRecorder::record_with_context(int level, const char* module, int lineno,
 void RamRecorder::reset()
 {
   RamRecorder::record_everything = false;
-  pthread_mutex_lock(&RamRecorder::lock);
-  window_end = buffer;
-  window_start = buffer;
-  pthread_mutex_unlock(&RamRecorder::lock);
+
+  // The buffers can only be cleared by their own threads, so just ignore
+  // anything recorded before now.
+  struct timespec timespec;
+  clock_gettime(CLOCK_REALTIME, &timespec);
+  reset_time_ns = (uint64_t)timespec.tv_sec * 1000000000 + timespec.tv_nsec;
 }
 
 void RamRecorder::write(const char* message, size_t length)
 {
-  pthread_mutex_lock(&RamRecorder::lock);
-  const char* buffer_end = buffer + RAM_BUFFER_SIZE;
-
-  while (length > 0)
-  {
-    // How much space is left in the buffer
-    size_t bytes_left_in_buffer = buffer_end - window_end;
-
-    // How much we should write in this iteration
-    size_t bytes_to_write = std::min(length, bytes_left_in_buffer);
-
-    // Write until the end of the buffer
-    memcpy(window_end, message, bytes_to_write);
-
-    // We've got less to write now
-    length -= bytes_to_write;
-
-    // We've also got less in the message buffer to write
-    message += bytes_to_write;
-
-    if (bytes_to_write == bytes_left_in_buffer)
-    {
-      // We've reached the end of the buffer.
-
-      // Reset the end of the buffer to cycle round
-      char* new_window_end = buffer;
-
-      if ((window_end < window_start) ||
-          (window_start == new_window_end))
-      {
-        // The end has caught back up with the start,
-        // or is about to
-        window_start = buffer + 1;
-      }
-
-      window_end = new_window_end;
-    }
-    else
-    {
-      // There's still some room left. Just move the pointer along
-      char* new_window_end = window_end + bytes_to_write;
-
-      if (window_end < window_start)
-      {
-        // The end of the window has cycled round and is catching up with the start
-
-        if (new_window_end >= window_start)
-        {
-          // It's caught up with the start. Move the start on
-          window_start = new_window_end + 1;
-
-          if (window_start >= buffer_end)
-          {
-            // The start's got to the end. Move it back to the start
-            window_start = buffer;
-          }
-        }
-      }
-
-      window_end = new_window_end;
-    }
-  }
-
-  pthread_mutex_unlock(&RamRecorder::lock);
+  struct timespec timespec;
+  clock_gettime(CLOCK_REALTIME, &timespec);
+  append(timespec, TEXT, message, length);
 }
 
 void RamRecorder::dump(const std::string& output_dir)
@@ -389,34 +1260,21 @@ void RamRecorder::dump(const std::string& output_dir)
   {
     fprintf(file, "RAM BUFFER\n==========\n");
 
+    // Copy the lines out of each thread's buffer, then merge them into the
+    // order they were recorded in.
     pthread_mutex_lock(&RamRecorder::lock);
+    std::vector<Buffer*> to_dump = buffers;
+    pthread_mutex_unlock(&RamRecorder::lock);
 
-    if (window_end == window_start)
-    {
-      // No bufffered data
-      fprintf(file, "No recorded logs\n");
-    }
-    else if (window_end > window_start)
-    {
-      fwrite(window_start,
-             sizeof(char),
-             window_end - window_start,
-             file);
-    }
-    else
+    std::vector<char> copies(to_dump.size() * RAM_BUFFER_SIZE);
+    std::vector<Line> lines;
+
+    for (size_t ii = 0; ii < to_dump.size(); ++ii)
     {
-      const char* end = buffer + RAM_BUFFER_SIZE;
-      fwrite(window_start,
-             sizeof(char),
-             end - window_start,
-             file);
-      fwrite(buffer,
-             sizeof(char),
-             window_end - buffer,
-             file);
+      snapshot(to_dump[ii], &copies[ii * RAM_BUFFER_SIZE], lines);
     }
 
-    pthread_mutex_unlock(&RamRecorder::lock);
+    write_lines(file, lines);
 
     fprintf(file, "==========\n");
 
@@ -427,3 +1285,45 @@ void RamRecorder::dump(const std::string& output_dir)
     TRC_ERROR("Failed to open file to dump RAM buffer!\n");
   }
 }
+
+bool RamRecorder::dump_remote(pid_t pid, FILE* file)
+{
+  // The other process was forked from this one, so its list of buffers and
+  // reset time are at the same addresses as ours.  Only the list's fields are
+  // read, so it's never constructed here.
+  alignas(std::vector<Buffer*>) char list[sizeof(std::vector<Buffer*>)];
+  const std::vector<Buffer*>* remote_buffers = (const std::vector<Buffer*>*)list;
+  uint64_t reset_ns;
+
+  if ((!read_remote(pid, &buffers, list, sizeof(list))) ||
+      (!read_remote(pid, &reset_time_ns, &reset_ns, sizeof(reset_ns))))
+  {
+    return false;
+  }
+
+  std::vector<Buffer*> to_dump(remote_buffers->size());
+
+  if ((!to_dump.empty()) &&
+      (!read_remote(pid,
+                    remote_buffers->data(),
+                    to_dump.data(),
+                    to_dump.size() * sizeof(Buffer*))))
+  {
+    return false;
+  }
+
+  fprintf(file, "RAM BUFFER\n==========\n");
+
+  std::vector<char> copies(to_dump.size() * RAM_BUFFER_SIZE);
+  std::vector<Line> lines;
+
+  for (size_t ii = 0; ii < to_dump.size(); ++ii)
+  {
+    snapshot_remote(pid, to_dump[ii], reset_ns, &copies[ii * RAM_BUFFER_SIZE], lines);
+  }
+
+  write_lines(file, lines);
+
+  fprintf(file, "==========\n");
+  return true;
+}
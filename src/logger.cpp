@@ -15,6 +15,8 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include <errno.h>
 #include <stdio.h>
 #include <pthread.h>
@@ -28,20 +30,31 @@
 #include <set>
 #include <list>
 #include <queue>
+#include <algorithm>
 #include <string>
 
 #include "logger.h"
+#include "io_uring_writer.h"
 
 const double Logger::LOGFILE_RETRY_FREQUENCY = 5.0;
+const size_t Logger::BUFFER_SIZE;
 
 Logger::Logger() :
   _flags(ADD_TIMESTAMPS),
   _last_hour(0),
   _rotate(false),
   _last_rotate({0}),
-  _fd(stdout)
+  _fd(STDOUT_FILENO),
+  _buffer(new char[BUFFER_SIZE]),
+  _buffered(0),
+  _batching(false),
+  _written_since_sync(false),
+  _terminated(false),
+  _writer(NULL),
+  _discards(0),
+  _saved_errno(0),
+  _lock("logger")
 {
-  pthread_mutex_init(&_lock, NULL);
 }
 
 
@@ -50,18 +63,47 @@ Logger::Logger(const std::string& directory, const std::string& filename) :
   _last_hour(0),
   _rotate(true),
   _last_rotate({0}),
-  _fd(NULL),
+  _fd(-1),
+  _buffer(new char[BUFFER_SIZE]),
+  _buffered(0),
+  _batching(false),
+  _written_since_sync(false),
+  _terminated(false),
+  _writer(NULL),
   _discards(0),
   _saved_errno(0),
   _filename(filename),
-  _directory(directory)
+  _directory(directory),
+  _lock("logger")
 {
-  pthread_mutex_init(&_lock, NULL);
 }
 
 
 Logger::~Logger()
 {
+  if (_batching)
+  {
+    _lock.lock();
+    _terminated = true;
+    pthread_cond_signal(&_terminate_cond);
+    _lock.unlock();
+
+    pthread_join(_batching_thread, NULL);
+    pthread_cond_destroy(&_terminate_cond);
+  }
+
+  flush_buffer();
+
+  if (_rotate)
+  {
+    close_fd();
+  }
+  else if (_writer != NULL)
+  {
+    _writer->flush();
+  }
+
+  delete[] _buffer;
 }
 
 
@@ -71,12 +113,115 @@ int Logger::get_flags() const
 }
 
 
+void Logger::set_io_uring_writer(IoUringWriter* writer)
+{
+  _lock.lock();
+  _writer = ((writer != NULL) && (writer->available())) ? writer : NULL;
+  _lock.unlock();
+}
+
+
 void Logger::set_flags(int flags)
 {
   _flags = flags;
 }
 
 
+void Logger::start_batching(long flush_interval_ms,
+                            Durability durability,
+                            long sync_interval_ms)
+{
+  _flush_interval_ms = std::max(flush_interval_ms, 1L);
+  _durability = durability;
+  _sync_interval_ms = std::max(sync_interval_ms, 1L);
+  _written_since_sync = false;
+  _terminated = false;
+
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&_terminate_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  _batching = true;
+  pthread_create(&_batching_thread, NULL, batching_thread_fn, this);
+}
+
+
+void* Logger::batching_thread_fn(void* logger)
+{
+  ((Logger*)logger)->batching_thread_fn();
+  return NULL;
+}
+
+
+void Logger::batching_thread_fn()
+{
+  struct timespec end_wait;
+  clock_gettime(CLOCK_MONOTONIC, &end_wait);
+  struct timespec last_sync = end_wait;
+
+  _lock.lock();
+
+  while (!_terminated)
+  {
+    end_wait.tv_nsec += (_flush_interval_ms % 1000) * 1000000;
+    end_wait.tv_sec += _flush_interval_ms / 1000 + end_wait.tv_nsec / 1000000000;
+    end_wait.tv_nsec %= 1000000000;
+
+    _lock.cond_timedwait(&_terminate_cond, &end_wait);
+
+    if (_terminated)
+    {
+      break;
+    }
+
+    // Write out what's been logged, then cycle the file if the hour has
+    // changed (or reopen it if it couldn't be opened).
+    flush_buffer();
+
+    timestamp_t ts;
+    get_timestamp(ts);
+    check_log_file(ts);
+
+    if ((_durability == PERIODIC_SYNC) && (_written_since_sync) && (_fd >= 0))
+    {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      long since_sync_ms = (now.tv_sec - last_sync.tv_sec) * 1000 +
+                           (now.tv_nsec - last_sync.tv_nsec) / 1000000;
+
+      if (since_sync_ms >= _sync_interval_ms)
+      {
+        // Sync a duplicate of the file descriptor, so that the lock needn't
+        // be held while syncing (and the file can be cycled meanwhile).
+        int fd = dup(_fd);
+        _written_since_sync = false;
+        last_sync = now;
+        _lock.unlock();
+
+        if (fd >= 0)
+        {
+          // Anything queued on the io_uring writer must be written before it
+          // can be synced.
+          if (_writer != NULL)
+          {
+            _writer->flush();
+          }
+
+          fdatasync(fd);
+          close(fd);
+        }
+
+        _lock.lock();
+      }
+    }
+  }
+
+  _lock.unlock();
+}
+
+
 void Logger::gettime(struct timespec* ts)
 {
   clock_gettime(CLOCK_REALTIME, ts);
@@ -99,12 +244,67 @@ void Logger::write(const char* data)
 
   // Take the lock and push a cleanup handler to release it if this thread is
   // forcibly killed while writing to the log file.
-  pthread_mutex_lock(&_lock);
+  _lock.lock();
+  pthread_cleanup_push(Logger::release_lock, this);
+
+  if (prepare_log_file(ts))
+  {
+    // We have a valid log file open, so write the log.
+    write_log_file(data, ts);
+  }
+  else
+  {
+    // No valid log file, so count this as a discard.
+    ++_discards;
+  }
+
+  pthread_cleanup_pop(0);
+  _lock.unlock();
+}
+
+
+/// Writes a batch of logs to the logfile, cycling or opening the log file
+/// when necessary.
+void Logger::write_batch(struct iovec* iov,
+                         int iovcnt,
+                         int lines,
+                         const timestamp_t& ts)
+{
+  _lock.lock();
   pthread_cleanup_push(Logger::release_lock, this);
 
+  if (prepare_log_file(ts))
+  {
+    write_log_file(iov, iovcnt);
+  }
+  else
+  {
+    _discards += lines;
+  }
+
+  pthread_cleanup_pop(0);
+  _lock.unlock();
+}
+
+
+bool Logger::prepare_log_file(const timestamp_t& ts)
+{
+  // In batching mode the background thread cycles the file on the hour, so
+  // there's only anything to do here if there's no file open yet.
+  if ((!_batching) || (_fd < 0))
+  {
+    check_log_file(ts);
+  }
+
+  return (_fd >= 0);
+}
+
+
+void Logger::check_log_file(const timestamp_t& ts)
+{
   bool cycle_log_file_required = false;
 
-  if (_fd == NULL)
+  if (_fd < 0)
   {
     // When there is no valid log file, try to open one frequently to
     // ensure that as few logs are lost as possible.
@@ -139,7 +339,7 @@ void Logger::write(const char* data)
     cycle_log_file(ts);
     gettime_monotonic(&_last_rotate);
 
-    if ((_fd != NULL) &&
+    if ((_fd >= 0) &&
         (_discards != 0))
     {
       char discard_msg[100];
@@ -152,19 +352,6 @@ void Logger::write(const char* data)
     }
   }
 
-  if (_fd != NULL)
-  {
-    // We have a valid log file open, so write the log.
-    write_log_file(data, ts);
-  }
-  else
-  {
-    // No valid log file, so count this as a discard.
-    ++_discards;
-  }
-
-  pthread_cleanup_pop(0);
-  pthread_mutex_unlock(&_lock);
 }
 
 
@@ -205,33 +392,161 @@ void Logger::write_log_file(const char *data, const timestamp_t& ts)
   {
     char timestamp[100];
     format_timestamp(ts, timestamp, sizeof(timestamp));
-    fprintf(_fd, "%s ", timestamp);
+    size_t len = strlen(timestamp);
+    timestamp[len++] = ' ';
+    buffer_data(timestamp, len);
+  }
+
+  buffer_data(data, strlen(data));
+
+  // In batching mode the buffer is written by the background thread.  Logs
+  // to stdout are always written straight away.
+  if ((!_batching) &&
+      ((_flags & FLUSH_ON_WRITE) || (!_rotate)))
+  {
+    flush_buffer();
+  }
+}
+
+
+/// Writes a batch of logs to the file with a single writev where possible.
+void Logger::write_log_file(struct iovec* iov, int iovcnt)
+{
+  // Anything already buffered must go first.
+  flush_buffer();
+
+  if ((_writer != NULL) && (_fd >= 0))
+  {
+    // The writer copies the lines, so there's nothing left to write.
+    _writer->writev(_fd, iov, iovcnt);
+    _written_since_sync = true;
+    return;
   }
 
-  // Write the log to the current file.
-  fputs(data, _fd);
+  while ((iovcnt > 0) && (_fd >= 0))
+  {
+    ssize_t written = writev(_fd, iov, std::min(iovcnt, IOV_MAX));
+
+    if (written < 0)
+    {
+      // LCOV_EXCL_START
+      if (errno == EINTR)
+      {
+        continue;
+      }
+
+      close_fd();
+      return;
+      // LCOV_EXCL_STOP
+    }
+
+    _written_since_sync = true;
+
+    // Skip over what was written, which may end part way through an iovec.
+    while ((iovcnt > 0) && ((size_t)written >= iov->iov_len))
+    {
+      written -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
+
+    if (iovcnt > 0)
+    {
+      iov->iov_base = (char*)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+}
 
-  if (_flags & FLUSH_ON_WRITE)
+
+void Logger::buffer_data(const char* data, size_t length)
+{
+  if (_buffered + length > BUFFER_SIZE)
   {
-    fflush(_fd);
+    flush_buffer();
   }
 
-  if (ferror(_fd))
+  if (length > BUFFER_SIZE)
   {
     // LCOV_EXCL_START
-    fclose(_fd);
-    _fd = NULL;
+    write_fd(data, length);
+    return;
     // LCOV_EXCL_STOP
   }
+
+  memcpy(_buffer + _buffered, data, length);
+  _buffered += length;
 }
 
 
-void Logger::cycle_log_file(const timestamp_t& ts)
+void Logger::flush_buffer()
+{
+  if (_buffered > 0)
+  {
+    write_fd(_buffer, _buffered);
+    _buffered = 0;
+  }
+}
+
+
+void Logger::write_fd(const char* data, size_t length)
+{
+  if ((_writer != NULL) && (_fd >= 0) && (length > 0))
+  {
+    _writer->write(_fd, data, length);
+    _written_since_sync = true;
+    return;
+  }
+
+  while ((length > 0) && (_fd >= 0))
+  {
+    ssize_t written = ::write(_fd, data, length);
+
+    if (written < 0)
+    {
+      // LCOV_EXCL_START
+      if (errno == EINTR)
+      {
+        continue;
+      }
+
+      close_fd();
+      return;
+      // LCOV_EXCL_STOP
+    }
+
+    data += written;
+    length -= written;
+    _written_since_sync = true;
+  }
+}
+
+
+void Logger::close_fd()
 {
-  if (_fd != NULL)
+  if (_fd >= 0)
   {
-    fclose(_fd);
+    if (_writer != NULL)
+    {
+      // The writer may still have data queued for this file.
+      _writer->flush();
+    }
+
+    if (_fd != STDOUT_FILENO)
+    {
+      close(_fd);
+    }
+
+    _fd = -1;
   }
+}
+
+
+void Logger::cycle_log_file(const timestamp_t& ts)
+{
+  // Anything buffered belongs in the old file.
+  flush_buffer();
+  close_fd();
 
   std::string prefix = _directory + "/" + _filename + "_";
   char time_date_stamp[100];
@@ -242,7 +557,7 @@ void Logger::cycle_log_file(const timestamp_t& ts)
           ts.hour);
   std::string full_path = prefix + time_date_stamp + ".txt";
 
-  _fd = fopen(full_path.c_str(), "a");
+  _fd = open(full_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
 
   // Set up /var/log/<component>/<component>_current.txt as a symlink
   // If this fails, there's not much we can do, it's not like we can drop
@@ -256,7 +571,7 @@ void Logger::cycle_log_file(const timestamp_t& ts)
     // We don't get a helpful symlink.
   }
 
-  if (_fd == NULL)
+  if (_fd < 0)
   {
     // Failed to open logfile, so save errno until we can log it.
     _saved_errno = errno;
@@ -279,23 +594,25 @@ void Logger::cycle_log_file(const timestamp_t& ts)
 // function is not thread-safe.
 void Logger::backtrace_simple(const char* data)
 {
-  // If the file exists, dump a header and then the backtrace.
-  if (_fd != NULL)
-  {
-    fprintf(_fd, "\n%s", data);
-    fprintf(_fd, "\nBasic stack dump:\n");
-    fflush(_fd);
-    void *stack[MAX_BACKTRACE_STACK_ENTRIES];
-    size_t num_entries = ::backtrace(stack, MAX_BACKTRACE_STACK_ENTRIES);
-    backtrace_symbols_fd(stack, num_entries, fileno(_fd));
-    fprintf(_fd, "\n");
+  // Write out whatever is buffered first, then if the file exists, dump a
+  // header and then the backtrace.  The io_uring writer takes locks, so
+  // write directly from here on.
+  _writer = NULL;
+  flush_buffer();
 
-    fflush(_fd);
+  if (_fd >= 0)
+  {
+    static const char header[] = "\nBasic stack dump:\n";
+    write_fd("\n", 1);
+    write_fd(data, strlen(data));
+    write_fd(header, sizeof(header) - 1);
 
-    if (ferror(_fd))
+    if (_fd >= 0)
     {
-      fclose(_fd);
-      _fd = NULL;
+      void *stack[MAX_BACKTRACE_STACK_ENTRIES];
+      size_t num_entries = ::backtrace(stack, MAX_BACKTRACE_STACK_ENTRIES);
+      backtrace_symbols_fd(stack, num_entries, _fd);
+      write_fd("\n", 1);
     }
   }
 }
@@ -309,8 +626,12 @@ void Logger::backtrace_simple(const char* data)
 // _not_ safe to call from signal handlers, so this function is not thread-safe.
 void Logger::backtrace_advanced()
 {
-  // If the file exists, dump a header and then the backtrace.
-  if (_fd != NULL)
+  // Write out whatever is buffered first, then if the file exists, dump a
+  // header and then the backtrace.
+  _writer = NULL;
+  flush_buffer();
+
+  if (_fd >= 0)
   {
     // Dumping might not work (e.g. because gdb isn't installed), but it gives
     // much better output.  We need to swap some file descriptors around before
@@ -348,29 +669,39 @@ void Logger::backtrace_advanced()
     close(fd1);
 
     // Also print a message to the logfile saying what just happened.
+    char msg[200];
+
     if (rc != 0)
     {
-      fprintf(_fd, "\nAdvanced stack dump failed: gdb returned %d\n\n", rc);
+      snprintf(msg, sizeof(msg), "\nAdvanced stack dump failed: gdb returned %d\n\n", rc);
     }
     else
     {
-      fprintf(_fd, "\nAdvanced stack dump written to stderr (with timestamp %s)\n\n",
-              timestamp);
+      snprintf(msg, sizeof(msg), "\nAdvanced stack dump written to stderr (with timestamp %s)\n\n",
+               timestamp);
     }
 
-    fflush(_fd);
-
-    if (ferror(_fd))
-    {
-      fclose(_fd);
-      _fd = NULL;
-    }
+    write_fd(msg, strlen(msg));
   }
 }
 
+// Write a batch of lines to the current log file (if any) without locking or
+// cycling it.  This is called from signal handlers, so is not thread-safe.
+void Logger::write_batch_unlocked(struct iovec* iov, int iovcnt)
+{
+  _writer = NULL;
+  write_log_file(iov, iovcnt);
+}
+
 void Logger::commit()
 {
-  fsync(fileno(_fd));
+  _writer = NULL;
+  flush_buffer();
+
+  if (_fd >= 0)
+  {
+    fsync(_fd);
+  }
 }
 
 // LCOV_EXCL_STOP
@@ -378,5 +709,7 @@ void Logger::commit()
 
 void Logger::flush()
 {
-  fflush(_fd);
+  _lock.lock();
+  flush_buffer();
+  _lock.unlock();
 }
@@ -0,0 +1,802 @@
+/**
+ * @file memcached_async_client.cpp  Non-blocking memcached binary protocol
+ * client.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "log.h"
+#include "memcached_async_client.h"
+
+namespace
+{
+  // The binary protocol's magic bytes, and the length of its header.
+  const uint8_t REQUEST_MAGIC = 0x80;
+  const uint8_t RESPONSE_MAGIC = 0x81;
+  const size_t HEADER_LENGTH = 24;
+
+  // Setting this bit in a command's opcode gives its quiet variant.
+  const uint8_t QUIET_OPCODE_BIT = 0x10;
+
+  // Protocol fields are big-endian.
+  void append_uint(std::string& out, uint64_t value, int bytes)
+  {
+    for (int ii = bytes - 1; ii >= 0; --ii)
+    {
+      out.push_back((char)((value >> (ii * 8)) & 0xff));
+    }
+  }
+
+  uint64_t read_uint(const char* data, int bytes)
+  {
+    uint64_t value = 0;
+
+    for (int ii = 0; ii < bytes; ++ii)
+    {
+      value = (value << 8) | (uint8_t)data[ii];
+    }
+
+    return value;
+  }
+}
+
+MemcachedAsyncClient::MemcachedAsyncClient(int timeout_ms,
+                                           const std::string& source_address) :
+  _timeout_ms(timeout_ms),
+  _source_address(source_address),
+  _lock(PTHREAD_MUTEX_INITIALIZER),
+  _terminated(false),
+  _next_opaque(1)
+{
+  _epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  _event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = _event_fd;
+  epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _event_fd, &event);
+
+  int rc = pthread_create(&_io_thread, NULL, io_thread_fn, this);
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to create memcached I/O thread: %d", rc);
+    _terminated = true;
+    // LCOV_EXCL_STOP
+  }
+}
+
+MemcachedAsyncClient::~MemcachedAsyncClient()
+{
+  pthread_mutex_lock(&_lock);
+  bool running = !_terminated;
+  _terminated = true;
+  pthread_mutex_unlock(&_lock);
+
+  if (running)
+  {
+    wake_io_thread();
+    pthread_join(_io_thread, NULL);
+  }
+
+  // Fail the requests that the thread didn't get to, and those that are
+  // still outstanding, so that no one is left waiting for them.  Then run
+  // the timers, so that no one is left waiting for them either.
+  std::vector<Queued> queue;
+  std::vector<Timer> timer_queue;
+  pthread_mutex_lock(&_lock);
+  queue.swap(_queue);
+  timer_queue.swap(_timer_queue);
+  pthread_mutex_unlock(&_lock);
+
+  Result result = {MEMCACHED_ERROR, "", 0};
+
+  for (std::vector<Queued>::iterator i = queue.begin(); i != queue.end(); ++i)
+  {
+    i->callback(result);
+  }
+
+  for (std::unordered_map<AddrInfo, Connection*>::iterator i = _connections.begin();
+       i != _connections.end();
+       ++i)
+  {
+    fail_connection(i->second, MEMCACHED_ERROR);
+    delete i->second;
+  }
+
+  for (std::vector<Timer>::iterator i = timer_queue.begin();
+       i != timer_queue.end();
+       ++i)
+  {
+    _timers.insert(std::make_pair(i->deadline_ms, i->fn));
+  }
+
+  run_timers(ULONG_MAX);
+
+  close(_event_fd);
+  close(_epoll_fd);
+  pthread_mutex_destroy(&_lock);
+}
+
+void MemcachedAsyncClient::send(const AddrInfo& target,
+                                const Request& request,
+                                Callback callback)
+{
+  pthread_mutex_lock(&_lock);
+
+  if (_terminated)
+  {
+    pthread_mutex_unlock(&_lock);
+    Result result = {MEMCACHED_ERROR, "", 0};
+    callback(result);
+    return;
+  }
+
+  Queued queued = {target, request, callback};
+  _queue.push_back(queued);
+  bool wake = ((_queue.size() + _timer_queue.size()) == 1);
+  pthread_mutex_unlock(&_lock);
+
+  // The thread takes the whole queue each time it wakes, so it only needs
+  // waking for the first request queued.
+  if (wake)
+  {
+    wake_io_thread();
+  }
+}
+
+void MemcachedAsyncClient::schedule(unsigned long delay_ms,
+                                    std::function<void()> fn)
+{
+  pthread_mutex_lock(&_lock);
+
+  if (_terminated)
+  {
+    pthread_mutex_unlock(&_lock);
+    fn();
+    return;
+  }
+
+  Timer timer = {now_ms() + delay_ms, fn};
+  _timer_queue.push_back(timer);
+  bool wake = ((_queue.size() + _timer_queue.size()) == 1);
+  pthread_mutex_unlock(&_lock);
+
+  if (wake)
+  {
+    wake_io_thread();
+  }
+}
+
+void MemcachedAsyncClient::wake_io_thread()
+{
+  uint64_t value = 1;
+  if (write(_event_fd, &value, sizeof(value)) < 0)
+  {
+    TRC_WARNING("Failed to wake memcached I/O thread: %d", errno); // LCOV_EXCL_LINE
+  }
+}
+
+void* MemcachedAsyncClient::io_thread_fn(void* client)
+{
+  ((MemcachedAsyncClient*)client)->io_thread_fn();
+  return NULL;
+}
+
+void MemcachedAsyncClient::io_thread_fn()
+{
+  static const int MAX_EVENTS = 64;
+  struct epoll_event events[MAX_EVENTS];
+
+  while (true)
+  {
+    std::vector<Queued> queue;
+    std::vector<Timer> timer_queue;
+
+    pthread_mutex_lock(&_lock);
+    bool terminated = _terminated;
+    queue.swap(_queue);
+    timer_queue.swap(_timer_queue);
+    pthread_mutex_unlock(&_lock);
+
+    for (std::vector<Timer>::iterator i = timer_queue.begin();
+         i != timer_queue.end();
+         ++i)
+    {
+      _timers.insert(std::make_pair(i->deadline_ms, i->fn));
+    }
+
+    if (terminated)
+    {
+      // Leave the requests for the destructor to fail.
+      pthread_mutex_lock(&_lock);
+      _queue.insert(_queue.begin(), queue.begin(), queue.end());
+      pthread_mutex_unlock(&_lock);
+      break;
+    }
+
+    // Add the new requests to their connections, then write them all, so
+    // that requests queued together for a target go in as few writes as
+    // possible.
+    unsigned long now = now_ms();
+
+    for (std::vector<Queued>::iterator i = queue.begin(); i != queue.end(); ++i)
+    {
+      start_request(*i, now);
+    }
+
+    for (std::unordered_map<AddrInfo, Connection*>::iterator i = _connections.begin();
+         i != _connections.end();
+         ++i)
+    {
+      Connection* conn = i->second;
+
+      if (conn->needs_noop)
+      {
+        send_noop(conn, now);
+      }
+
+      if ((conn->connected) && (conn->out_offset < conn->out.size()))
+      {
+        write_connection(conn);
+      }
+    }
+
+    // Wait until a socket is ready, a request or timer times out, or there
+    // are more requests.  Requests on a connection all have the same
+    // timeout, so the oldest one times out first.
+    now = now_ms();
+    int timeout_ms = 1000;
+
+    if (!_timers.empty())
+    {
+      unsigned long deadline = _timers.begin()->first;
+      timeout_ms = std::min(timeout_ms,
+                            (deadline > now) ? (int)(deadline - now) : 0);
+    }
+
+    for (std::unordered_map<AddrInfo, Connection*>::iterator i = _connections.begin();
+         i != _connections.end();
+         ++i)
+    {
+      Connection* conn = i->second;
+
+      if (!conn->pending.empty())
+      {
+        unsigned long deadline = conn->pending.front().deadline_ms;
+        timeout_ms = std::min(timeout_ms,
+                              (deadline > now) ? (int)(deadline - now) : 0);
+      }
+    }
+
+    int num_events = epoll_wait(_epoll_fd, events, MAX_EVENTS, timeout_ms);
+
+    for (int ii = 0; ii < num_events; ++ii)
+    {
+      int fd = events[ii].data.fd;
+
+      if (fd == _event_fd)
+      {
+        uint64_t count;
+        if (read(_event_fd, &count, sizeof(count)) < 0)
+        {
+          // Nothing to do - the eventfd is just used to wake us up.
+        }
+        continue;
+      }
+
+      // The connection may have been closed by an earlier event.
+      std::map<int, Connection*>::iterator c = _connection_fds.find(fd);
+
+      if (c == _connection_fds.end())
+      {
+        continue;
+      }
+
+      Connection* conn = c->second;
+
+      if (!conn->connected)
+      {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+
+        if ((error != 0) || (events[ii].events & (EPOLLERR | EPOLLHUP)))
+        {
+          TRC_DEBUG("Failed to connect to memcached at %s: %s",
+                    conn->target.address_and_port_to_string().c_str(),
+                    strerror(error));
+          fail_connection(conn, MEMCACHED_CONNECTION_FAILURE);
+          continue;
+        }
+
+        if (events[ii].events & EPOLLOUT)
+        {
+          TRC_DEBUG("Connected to memcached at %s",
+                    conn->target.address_and_port_to_string().c_str());
+          conn->connected = true;
+        }
+      }
+
+      if (conn->connected)
+      {
+        if (events[ii].events & EPOLLOUT)
+        {
+          write_connection(conn);
+        }
+
+        if ((conn->fd == fd) &&
+            (events[ii].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+        {
+          read_connection(conn);
+        }
+      }
+    }
+
+    // Fail the connections whose oldest request has timed out.
+    now = now_ms();
+
+    for (std::unordered_map<AddrInfo, Connection*>::iterator i = _connections.begin();
+         i != _connections.end();
+         ++i)
+    {
+      Connection* conn = i->second;
+
+      if ((!conn->pending.empty()) &&
+          (conn->pending.front().deadline_ms <= now))
+      {
+        TRC_DEBUG("Request to memcached at %s timed out",
+                  conn->target.address_and_port_to_string().c_str());
+        fail_connection(conn, MEMCACHED_TIMEOUT);
+      }
+    }
+
+    run_timers(now);
+  }
+}
+
+/// Runs the timers that are due.  The timers may schedule more timers, which
+/// are queued, so don't run until the next time round.
+void MemcachedAsyncClient::run_timers(unsigned long now_ms)
+{
+  while ((!_timers.empty()) && (_timers.begin()->first <= now_ms))
+  {
+    std::function<void()> fn = _timers.begin()->second;
+    _timers.erase(_timers.begin());
+    fn();
+  }
+}
+
+void MemcachedAsyncClient::start_request(Queued& queued, unsigned long now_ms)
+{
+  Connection* conn = get_connection(queued.target);
+
+  if ((conn->fd < 0) && (!open_connection(conn)))
+  {
+    Result result = {MEMCACHED_CONNECTION_FAILURE, "", 0};
+    queued.callback(result);
+    return;
+  }
+
+  Pending pending = {_next_opaque++,
+                     now_ms + _timeout_ms,
+                     queued.request.quiet,
+                     queued.callback};
+  encode_request(queued.request, pending.opaque, conn->out);
+  conn->pending.push_back(pending);
+  conn->needs_noop = queued.request.quiet;
+}
+
+/// Sends a no-op after quiet requests, so that their success is known when
+/// its response comes back.
+void MemcachedAsyncClient::send_noop(Connection* conn, unsigned long now_ms)
+{
+  Request request;
+  request.opcode = NOOP;
+
+  Pending pending = {_next_opaque++,
+                     now_ms + _timeout_ms,
+                     false,
+                     [](const Result& result) {}};
+  encode_request(request, pending.opaque, conn->out);
+  conn->pending.push_back(pending);
+  conn->needs_noop = false;
+}
+
+MemcachedAsyncClient::Connection*
+MemcachedAsyncClient::get_connection(const AddrInfo& target)
+{
+  std::unordered_map<AddrInfo, Connection*>::iterator i = _connections.find(target);
+
+  if (i != _connections.end())
+  {
+    return i->second;
+  }
+
+  Connection* conn = new Connection();
+  conn->target = target;
+  conn->fd = -1;
+  conn->connected = false;
+  conn->events = 0;
+  conn->out_offset = 0;
+  conn->needs_noop = false;
+  _connections[target] = conn;
+
+  return conn;
+}
+
+bool MemcachedAsyncClient::open_connection(Connection* conn)
+{
+  const IP46Address& address = conn->target.address;
+  int fd = socket(address.af, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+  if (fd < 0)
+  {
+    TRC_WARNING("Failed to create memcached socket: %s", strerror(errno)); // LCOV_EXCL_LINE
+    return false; // LCOV_EXCL_LINE
+  }
+
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  struct sockaddr_storage sa_storage = {0};
+  struct sockaddr_storage source_storage = {0};
+  socklen_t sa_size;
+  int rc = 1;
+
+  if (address.af == AF_INET)
+  {
+    struct sockaddr_in* sa = (struct sockaddr_in*)&sa_storage;
+    sa_size = sizeof(*sa);
+    sa->sin_family = AF_INET;
+    sa->sin_port = htons(conn->target.port);
+    sa->sin_addr = address.addr.ipv4;
+
+    if (!_source_address.empty())
+    {
+      struct sockaddr_in* source = (struct sockaddr_in*)&source_storage;
+      source->sin_family = AF_INET;
+      rc = inet_pton(AF_INET, _source_address.c_str(), &source->sin_addr);
+    }
+  }
+  else
+  {
+    struct sockaddr_in6* sa = (struct sockaddr_in6*)&sa_storage;
+    sa_size = sizeof(*sa);
+    sa->sin6_family = AF_INET6;
+    sa->sin6_port = htons(conn->target.port);
+    sa->sin6_addr = address.addr.ipv6;
+
+    if (!_source_address.empty())
+    {
+      struct sockaddr_in6* source = (struct sockaddr_in6*)&source_storage;
+      source->sin6_family = AF_INET6;
+      rc = inet_pton(AF_INET6, _source_address.c_str(), &source->sin6_addr);
+    }
+  }
+
+  if ((!_source_address.empty()) &&
+      ((rc != 1) ||
+       (bind(fd, (const struct sockaddr*)&source_storage, sa_size) != 0)))
+  {
+    TRC_ERROR("Failed to bind memcached socket to %s", _source_address.c_str());
+    close(fd);
+    return false;
+  }
+
+  if ((connect(fd, (const struct sockaddr*)&sa_storage, sa_size) != 0) &&
+      (errno != EINPROGRESS))
+  {
+    TRC_DEBUG("Failed to connect to memcached at %s: %s",
+              conn->target.address_and_port_to_string().c_str(),
+              strerror(errno));
+    close(fd);
+    return false;
+  }
+
+  // Wait for the socket to be writable, which is when the connect completes.
+  conn->fd = fd;
+  conn->connected = false;
+  conn->events = EPOLLIN | EPOLLOUT;
+  _connection_fds[fd] = conn;
+
+  struct epoll_event event;
+  event.events = conn->events;
+  event.data.fd = fd;
+  epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &event);
+
+  return true;
+}
+
+void MemcachedAsyncClient::write_connection(Connection* conn)
+{
+  while (conn->out_offset < conn->out.size())
+  {
+    ssize_t sent = ::send(conn->fd,
+                          conn->out.data() + conn->out_offset,
+                          conn->out.size() - conn->out_offset,
+                          MSG_NOSIGNAL);
+
+    if (sent > 0)
+    {
+      conn->out_offset += sent;
+    }
+    else if ((sent < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+    {
+      break;
+    }
+    else if ((sent < 0) && (errno == EINTR))
+    {
+      continue;
+    }
+    else
+    {
+      TRC_DEBUG("Failed to write to memcached at %s: %s",
+                conn->target.address_and_port_to_string().c_str(),
+                strerror(errno));
+      fail_connection(conn, MEMCACHED_CONNECTION_FAILURE);
+      return;
+    }
+  }
+
+  if (conn->out_offset == conn->out.size())
+  {
+    conn->out.clear();
+    conn->out_offset = 0;
+  }
+
+  update_events(conn);
+}
+
+void MemcachedAsyncClient::read_connection(Connection* conn)
+{
+  bool closed = false;
+  char buffer[16384];
+
+  while (true)
+  {
+    ssize_t received = recv(conn->fd, buffer, sizeof(buffer), 0);
+
+    if (received > 0)
+    {
+      conn->in.append(buffer, received);
+    }
+    else if ((received < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+    {
+      break;
+    }
+    else if ((received < 0) && (errno == EINTR))
+    {
+      continue;
+    }
+    else
+    {
+      closed = true;
+      break;
+    }
+  }
+
+  // Handle the responses that were read before the connection closed.
+  int fd = conn->fd;
+
+  while ((conn->fd == fd) && (process_response(conn)))
+  {
+  }
+
+  if ((closed) && (conn->fd == fd))
+  {
+    TRC_DEBUG("Memcached at %s closed the connection",
+              conn->target.address_and_port_to_string().c_str());
+    fail_connection(conn, MEMCACHED_CONNECTION_FAILURE);
+  }
+}
+
+/// Takes a response off the front of the connection's input, and passes it
+/// to the oldest request's callback.
+///
+/// @return whether there was a complete response.
+bool MemcachedAsyncClient::process_response(Connection* conn)
+{
+  if (conn->in.size() < HEADER_LENGTH)
+  {
+    return false;
+  }
+
+  const char* header = conn->in.data();
+  uint16_t key_length = read_uint(header + 2, 2);
+  uint8_t extras_length = read_uint(header + 4, 1);
+  uint16_t status = read_uint(header + 6, 2);
+  uint32_t body_length = read_uint(header + 8, 4);
+  uint32_t opaque = read_uint(header + 12, 4);
+  uint64_t cas = read_uint(header + 16, 8);
+
+  if (conn->in.size() < HEADER_LENGTH + body_length)
+  {
+    return false;
+  }
+
+  // Responses come back in the order the requests were sent, and quiet
+  // requests only get a response if they fail, so the quiet requests before
+  // the one this is for succeeded.
+  while ((!conn->pending.empty()) &&
+         (conn->pending.front().quiet) &&
+         (conn->pending.front().opaque != opaque))
+  {
+    Callback callback = conn->pending.front().callback;
+    conn->pending.pop_front();
+    Result result = {MEMCACHED_SUCCESS, "", 0};
+    callback(result);
+  }
+
+  // This must now be for the oldest request.
+  if (((uint8_t)header[0] != RESPONSE_MAGIC) ||
+      (conn->pending.empty()) ||
+      (conn->pending.front().opaque != opaque) ||
+      ((size_t)key_length + extras_length > body_length))
+  {
+    TRC_WARNING("Unexpected response from memcached at %s",
+                conn->target.address_and_port_to_string().c_str());
+    fail_connection(conn, MEMCACHED_PROTOCOL_ERROR);
+    return false;
+  }
+
+  Result result;
+  result.rc = status_to_rc(status);
+  result.cas = cas;
+
+  if (result.rc == MEMCACHED_SUCCESS)
+  {
+    size_t value_offset = HEADER_LENGTH + extras_length + key_length;
+    result.value.assign(conn->in, value_offset, HEADER_LENGTH + body_length - value_offset);
+  }
+
+  conn->in.erase(0, HEADER_LENGTH + body_length);
+
+  Callback callback = conn->pending.front().callback;
+  conn->pending.pop_front();
+  callback(result);
+
+  return true;
+}
+
+void MemcachedAsyncClient::update_events(Connection* conn)
+{
+  uint32_t events = EPOLLIN;
+
+  if ((!conn->connected) || (conn->out_offset < conn->out.size()))
+  {
+    events |= EPOLLOUT;
+  }
+
+  if (events != conn->events)
+  {
+    struct epoll_event event;
+    event.events = events;
+    event.data.fd = conn->fd;
+    epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+    conn->events = events;
+  }
+}
+
+/// Closes a connection and fails the requests outstanding on it.  The
+/// connection is reopened for the next request to its target.
+void MemcachedAsyncClient::fail_connection(Connection* conn,
+                                           memcached_return_t rc)
+{
+  if (conn->fd >= 0)
+  {
+    epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    _connection_fds.erase(conn->fd);
+    close(conn->fd);
+  }
+
+  conn->fd = -1;
+  conn->connected = false;
+  conn->events = 0;
+  conn->out.clear();
+  conn->out_offset = 0;
+  conn->in.clear();
+  conn->needs_noop = false;
+
+  // The callbacks may send more requests, so take the requests off the
+  // connection first.
+  std::deque<Pending> pending;
+  pending.swap(conn->pending);
+
+  Result result = {rc, "", 0};
+
+  for (std::deque<Pending>::iterator i = pending.begin();
+       i != pending.end();
+       ++i)
+  {
+    i->callback(result);
+  }
+}
+
+void MemcachedAsyncClient::encode_request(const Request& request,
+                                          uint32_t opaque,
+                                          std::string& out)
+{
+  // Only stores have the flags and expiration as extras, and a value.
+  bool store = ((request.opcode == SET) || (request.opcode == ADD));
+  uint8_t extras_length = store ? 8 : 0;
+  size_t value_length = store ? request.value.length() : 0;
+
+  uint8_t opcode = request.opcode;
+
+  if ((request.quiet) && (request.opcode != GET) && (request.opcode != NOOP))
+  {
+    opcode |= QUIET_OPCODE_BIT;
+  }
+
+  out.push_back((char)REQUEST_MAGIC);
+  out.push_back((char)opcode);
+  append_uint(out, request.key.length(), 2);
+  append_uint(out, extras_length, 1);
+  append_uint(out, 0, 1);                     // Data type
+  append_uint(out, 0, 2);                     // vbucket
+  append_uint(out, extras_length + request.key.length() + value_length, 4);
+  append_uint(out, opaque, 4);
+  append_uint(out, (request.opcode == SET) ? request.cas : 0, 8);
+
+  if (extras_length != 0)
+  {
+    append_uint(out, request.flags, 4);
+    append_uint(out, request.expiration, 4);
+  }
+
+  out.append(request.key);
+  out.append(request.value, 0, value_length);
+}
+
+/// Converts a binary protocol status to the code libmemcached would return
+/// for it.
+memcached_return_t MemcachedAsyncClient::status_to_rc(uint16_t status)
+{
+  switch (status)
+  {
+  case 0x0000:
+    return MEMCACHED_SUCCESS;
+
+  case 0x0001:
+    return MEMCACHED_NOTFOUND;
+
+  case 0x0002:
+    return MEMCACHED_DATA_EXISTS;
+
+  case 0x0003:
+    return MEMCACHED_E2BIG;
+
+  case 0x0005:
+    return MEMCACHED_NOTSTORED;
+
+  default:
+    return MEMCACHED_SERVER_ERROR;
+  }
+}
+
+unsigned long MemcachedAsyncClient::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,45 @@
+/**
+ * @file memcached_target_stats.cpp  Statistics about the requests sent to one
+ * memcached target.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "memcached_target_stats.h"
+
+const int MemcachedTargetStats::NUM_SHARDS;
+
+MemcachedTargetStats::MemcachedTargetStats(const std::string& name) :
+  _name(name)
+{
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    _shards[ii].requests = 0;
+    _shards[ii].retries = 0;
+    _shards[ii].bytes_out = 0;
+    _shards[ii].bytes_in = 0;
+    _shards[ii].tombstones = 0;
+    _shards[ii].contention = 0;
+  }
+}
+
+void MemcachedTargetStats::snapshot(Snapshot& snapshot) const
+{
+  snapshot = Snapshot();
+
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    const Shard& shard = _shards[ii];
+    snapshot.requests += shard.requests.load(std::memory_order_relaxed);
+    snapshot.retries += shard.retries.load(std::memory_order_relaxed);
+    snapshot.bytes_out += shard.bytes_out.load(std::memory_order_relaxed);
+    snapshot.bytes_in += shard.bytes_in.load(std::memory_order_relaxed);
+    snapshot.tombstones += shard.tombstones.load(std::memory_order_relaxed);
+    snapshot.contention += shard.contention.load(std::memory_order_relaxed);
+  }
+}
@@ -23,6 +23,7 @@
 #include <fstream>
 #include <iomanip>
 #include <algorithm>
+#include <future>
 #include <time.h>
 
 #include "log.h"
@@ -30,6 +31,8 @@
 #include "updater.h"
 #include "memcachedstoreview.h"
 #include "memcachedstore.h"
+#include "profiling_span.h"
+#include "sas_event_sampler.h"
 
 
 /// The data used in memcached to represent a tombstone.
@@ -42,7 +45,9 @@ BaseMemcachedStore::BaseMemcachedStore(bool binary,
   _binary(binary),
   _options(),
   _comm_monitor(comm_monitor),
-  _tombstone_lifetime(200)
+  _tombstone_lifetime(200),
+  _poll_timeout_ms(remote_store ? 300 : 100),
+  _source_address(source_address)
 {
   // Set up the fixed options for memcached.  See also the options configured
   // on the MemcachedConnectionPool (including the connect timeout).
@@ -58,7 +63,7 @@ BaseMemcachedStore::BaseMemcachedStore(bool binary,
   //   to connect and access one replica and then succeed in accessing another.
   // - For a remote store, we need to allow the same time + 100ms latency in
   //   each direction.
-  _options += (remote_store) ? " --POLL-TIMEOUT=300" : " --POLL-TIMEOUT=100";
+  _options += " --POLL-TIMEOUT=" + std::to_string(_poll_timeout_ms);
   _options += (_binary) ? " --BINARY-PROTOCOL" : "";
 
   if (!source_address.empty())
@@ -87,7 +92,7 @@ static void log_targets(std::vector<AddrInfo> targets)
 memcached_return_t BaseMemcachedStore::get_from_replica(memcached_st* replica,
                                                         const char* key_ptr,
                                                         const size_t key_len,
-                                                        std::string& data,
+                                                        Store::Buffer& data,
                                                         uint64_t& cas)
 {
   memcached_return_t rc = MEMCACHED_ERROR;
@@ -119,11 +124,27 @@ memcached_return_t BaseMemcachedStore::get_from_replica(memcached_st* replica,
       // Found a record, so exit the read loop.
       TRC_DEBUG("Found record on replica");
 
-      // Copy the record into a string. std::string::assign copies its
-      // arguments when used with a char*, so we can free the result
-      // afterwards.
-      data.assign(memcached_result_value(&result),
-                  memcached_result_length(&result));
+      // Take the record's buffer from the result rather than copying it.
+      // libmemcached allocates it with malloc (as we don't set our own
+      // allocators), and null-terminates it when it is taken.  An empty
+      // record (a tombstone) has no buffer to take.
+      size_t length = memcached_result_length(&result);
+      char* value = (length > 0) ? memcached_result_take_value(&result) : NULL;
+
+      if (value != NULL)
+      {
+        data = Store::Buffer(std::shared_ptr<char>(value, free), length);
+      }
+      else if (length > 0)
+      {
+        // libmemcached couldn't null-terminate the value, so copy it instead.
+        data = Store::Buffer(std::string(memcached_result_value(&result), length));
+      }
+      else
+      {
+        data = Store::Buffer();
+      }
+
       cas = memcached_result_cas(&result);
     }
 
@@ -134,6 +155,67 @@ memcached_return_t BaseMemcachedStore::get_from_replica(memcached_st* replica,
 }
 
 
+memcached_return_t BaseMemcachedStore::get_multi_from_replica(
+  memcached_st* replica,
+  const std::vector<std::string>& keys,
+  std::map<std::string, std::pair<std::string, uint64_t>>& found)
+{
+  memcached_return_t rc = MEMCACHED_SUCCESS;
+
+  if (keys.empty())
+  {
+    return rc;
+  }
+
+  std::vector<const char*> key_ptrs;
+  std::vector<size_t> key_lens;
+
+  for (const std::string& key : keys)
+  {
+    key_ptrs.push_back(key.data());
+    key_lens.push_back(key.length());
+  }
+
+  CW_IO_STARTS("Memcached GET for " + std::to_string(keys.size()) + " keys")
+  {
+    rc = memcached_mget(replica, key_ptrs.data(), key_lens.data(), keys.size());
+  }
+  CW_IO_COMPLETES()
+
+  if (memcached_success(rc))
+  {
+    // Fetch the records until there are no more.  Keys that aren't found are
+    // simply not returned.
+    TRC_DEBUG("Fetch results");
+    memcached_result_st result;
+    memcached_result_create(replica, &result);
+
+    CW_IO_STARTS("Memcached GET fetch results for " + std::to_string(keys.size()) + " keys")
+    {
+      while (memcached_fetch_result(replica, &result, &rc) != NULL)
+      {
+        std::string key(memcached_result_key_value(&result),
+                        memcached_result_key_length(&result));
+        found[key] = std::make_pair(std::string(memcached_result_value(&result),
+                                                memcached_result_length(&result)),
+                                    memcached_result_cas(&result));
+      }
+    }
+    CW_IO_COMPLETES()
+
+    memcached_result_free(&result);
+
+    if ((rc == MEMCACHED_END) || (rc == MEMCACHED_NOTFOUND))
+    {
+      TRC_DEBUG("Found %d of %d records on replica", found.size(), keys.size());
+      rc = MEMCACHED_SUCCESS;
+    }
+  }
+
+  return rc;
+}
+
+
 memcached_return_t BaseMemcachedStore::add_overwriting_tombstone(memcached_st* replica,
                                                                  const char* key_ptr,
                                                                  const size_t key_len,
@@ -194,7 +276,7 @@ memcached_return_t BaseMemcachedStore::add_overwriting_tombstone(memcached_st* r
       // A record with this key already exists. If it is a tombstone, we need
       // to overwrite it. Get the record to see what it is.
       memcached_return_t get_rc;
-      std::string existing_data;
+      Store::Buffer existing_data;
 
       TRC_DEBUG("Existing data prevented the ADD/CAS."
                 "Issue GET to see if we need to overwrite a tombstone");
@@ -202,7 +284,7 @@ memcached_return_t BaseMemcachedStore::add_overwriting_tombstone(memcached_st* r
 
       if (memcached_success(get_rc))
       {
-        if (existing_data != TOMBSTONE)
+        if (!existing_data.empty())
         {
           // The existing record is not a tombstone.  We mustn't overwrite
           // this, so break out of the loop and return the original return code
@@ -277,17 +359,111 @@ TopologyNeutralMemcachedStore(const std::string& target_domain,
   _target_domain(target_domain),
   _resolver(resolver),
   _attempts(2),
-  _conn_pool(60, _options, remote_store)
+  _conn_pool(60, _options, remote_store),
+  _async_lock(PTHREAD_MUTEX_INITIALIZER),
+  _async_client(NULL),
+  _hedged_reads(false),
+  _hedge_percentile(95.0),
+  _hedge_monitor(NULL),
+  _hedge_delay_us(0),
+  _hedge_delay_expiry_ms(0),
+  _target_stats(),
+  _target_table(NULL),
+  _target_latency_table(NULL),
+  _retry_budget(NULL),
+  _noreply_writes(false),
+  _coalesced_reads(false),
+  _coalesced_gets()
+{
+  pthread_rwlock_init(&_target_stats_lock, NULL);
+}
+
+TopologyNeutralMemcachedStore::~TopologyNeutralMemcachedStore()
 {
+  // This fails any outstanding asynchronous requests, which needs the rest of
+  // the store.
+  delete _async_client;
+  _async_client = NULL;
+  pthread_mutex_destroy(&_async_lock);
+
+  for (std::map<AddrInfo, MemcachedTargetStats*>::iterator i = _target_stats.begin();
+       i != _target_stats.end();
+       ++i)
+  {
+    delete i->second;
+  }
+
+  pthread_rwlock_destroy(&_target_stats_lock);
+}
+
+void TopologyNeutralMemcachedStore::set_target_stats_tables(
+                                   SNMP::MemcachedTargetTable* table,
+                                   SNMP::LatencyHistogramTable* latency_table)
+{
+  _target_table = table;
+  _target_latency_table = latency_table;
+}
+
+MemcachedTargetStats* TopologyNeutralMemcachedStore::target_stats(
+                                                       const AddrInfo& target)
+{
+  if (_target_table == NULL)
+  {
+    return NULL;
+  }
+
+  MemcachedTargetStats* stats = NULL;
+
+  // Targets are only added the first time they're used, so usually only the
+  // read lock is needed.
+  pthread_rwlock_rdlock(&_target_stats_lock);
+  std::map<AddrInfo, MemcachedTargetStats*>::iterator i = _target_stats.find(target);
+
+  if (i != _target_stats.end())
+  {
+    stats = i->second;
+  }
+
+  pthread_rwlock_unlock(&_target_stats_lock);
+
+  if (stats == NULL)
+  {
+    pthread_rwlock_wrlock(&_target_stats_lock);
+    MemcachedTargetStats*& entry = _target_stats[target];
+
+    if (entry == NULL)
+    {
+      entry = new MemcachedTargetStats(target.address_and_port_to_string());
+      TRC_DEBUG("Adding stats for memcached target %s", entry->name().c_str());
+      _target_table->add_target(entry);
+
+      if (_target_latency_table != NULL)
+      {
+        _target_latency_table->add_histogram(entry->name(), &entry->latency());
+      }
+    }
+
+    stats = entry;
+    pthread_rwlock_unlock(&_target_stats_lock);
+  }
+
+  return stats;
 }
 
 memcached_return_t TopologyNeutralMemcachedStore::iterate_through_targets(
     std::vector<AddrInfo>& targets,
     SAS::TrailId trail,
-    std::function<memcached_return_t(ConnectionHandle<memcached_st*>&)> fn)
+    std::function<memcached_return_t(ConnectionHandle<memcached_st*>&)> fn,
+    size_t bytes_out,
+    MemcachedTargetStats** answered_by)
 {
   memcached_return_t rc = MEMCACHED_SUCCESS;
 
+  if (answered_by != NULL)
+  {
+    *answered_by = NULL;
+  }
+
   for (size_t ii = 0; ii < targets.size(); ++ii)
   {
     AddrInfo& target = targets[ii];
@@ -295,27 +471,72 @@ memcached_return_t TopologyNeutralMemcachedStore::iterate_through_targets(
     TRC_DEBUG("Try server IP %s, port %d",
               target.address.to_string().c_str(),
               target.port);
-    SAS::Event attempt(trail, SASEvent::MEMCACHED_TRY_HOST, 0);
-    attempt.add_var_param(target.address.to_string());
-    attempt.add_static_param(target.port);
-    SAS::report_event(attempt);
+
+    if (SASEventSampler::should_report(SASEvent::MEMCACHED_TRY_HOST))
+    {
+      SAS::Event attempt(trail, SASEvent::MEMCACHED_TRY_HOST, 0);
+      attempt.add_var_param(target.address.to_string());
+      attempt.add_static_param(target.port);
+      SAS::report_event(attempt);
+    }
 
     ConnectionHandle<memcached_st*> conn = _conn_pool.get_connection(target);
 
-    // This is where we actually talk to memcached.
+    if (!conn.is_valid())
+    {
+      // The connection caps were reached and no connection came free in
+      // time.  That says nothing about the target, so try the next one
+      // without blacklisting it.
+      TRC_DEBUG("No connection available to target");
+      rc = MEMCACHED_TIMEOUT;
+
+      if ((ii + 1 < targets.size()) && (!retry_allowed()))
+      {
+        break;
+      }
+
+      continue;
+    }
+
+    // This is where we actually talk to memcached.  The time it takes feeds
+    // the resolver's latency-aware target selection.
+    Utils::StopWatch stopwatch;
+    stopwatch.start();
+    _resolver->request_started(target);
+
     rc = fn(conn);
 
+    unsigned long latency_us = 0;
+    stopwatch.read(latency_us);
+    _resolver->request_completed(target, latency_us);
+
     TRC_DEBUG("libmemcached returned %d", rc);
 
+    MemcachedTargetStats* stats = target_stats(target);
+
+    if (stats != NULL)
+    {
+      stats->record_request(latency_us,
+                            bytes_out,
+                            (!memcached_success(rc)) && (can_retry_memcached_rc(rc)));
+    }
+
+    if (answered_by != NULL)
+    {
+      *answered_by = stats;
+    }
+
     if (memcached_success(rc))
     {
       // Success - nothing more to do.
+      record_answer(ii);
       break;
     }
     else if (!can_retry_memcached_rc(rc))
     {
       // This return code means it is not worth retrying to another server.
       TRC_DEBUG("Return code means the request should not be retried");
+      record_answer(ii);
       break;
     }
     else
@@ -324,12 +545,32 @@ memcached_return_t TopologyNeutralMemcachedStore::iterate_through_targets(
       // particular target which means we should blacklist it.
       TRC_DEBUG("Blacklisting target");
       _resolver->blacklist(target);
+
+      if ((ii + 1 < targets.size()) && (!retry_allowed()))
+      {
+        break;
+      }
     }
   }
 
   return rc;
 }
 
+void TopologyNeutralMemcachedStore::record_answer(size_t target_index)
+{
+  // Only answers from the first target earn retries, as those from later
+  // targets were retries themselves.
+  if ((target_index == 0) && (_retry_budget != NULL))
+  {
+    _retry_budget->first_attempt_succeeded();
+  }
+}
+
+bool TopologyNeutralMemcachedStore::retry_allowed()
+{
+  return ((_retry_budget == NULL) || (_retry_budget->try_retry()));
+}
+
 Store::Status TopologyNeutralMemcachedStore::get_data(const std::string& table,
                                                       const std::string& key,
                                                       std::string& data,
@@ -337,16 +578,115 @@ Store::Status TopologyNeutralMemcachedStore::get_data(const std::string& table,
                                                       SAS::TrailId trail,
                                                       bool log_body,
                                                       Format data_format)
+{
+  if ((_hedged_reads) && (!_coalesced_reads))
+  {
+    return get_data_hedged(table, key, data, cas, trail, log_body, data_format);
+  }
+
+  Store::Buffer buffer;
+  Store::Status status = get_data(table, key, buffer, cas, trail, log_body, data_format);
+  data = buffer.to_string();
+  return status;
+}
+
+Store::Status TopologyNeutralMemcachedStore::get_data(const std::string& table,
+                                                      const std::string& key,
+                                                      Store::Buffer& data,
+                                                      uint64_t& cas,
+                                                      SAS::TrailId trail,
+                                                      bool log_body,
+                                                      Format data_format)
+{
+  if (!_coalesced_reads)
+  {
+    return read_data(table, key, data, cas, trail, log_body, data_format);
+  }
+
+  // Each caller gets its own copy of the data, as callers may parse their
+  // buffers in place.
+  bool merged;
+  Store::GetResult result =
+    _coalesced_gets.run(get_fq_key(table, key), [&]() {
+      Store::GetResult get_result;
+      Store::Buffer buffer;
+      get_result.status = read_data(table,
+                                    key,
+                                    buffer,
+                                    get_result.cas,
+                                    trail,
+                                    log_body,
+                                    data_format);
+      get_result.data = buffer.to_string();
+      return get_result;
+    }, &merged);
+
+  if (merged)
+  {
+    TRC_DEBUG("Shared in-flight GET from table %s for key %s", table.c_str(), key.c_str());
+  }
+
+  data = Store::Buffer(std::move(result.data));
+  cas = result.cas;
+  return result.status;
+}
+
+Store::Status TopologyNeutralMemcachedStore::get_data_hedged(const std::string& table,
+                                                             const std::string& key,
+                                                             std::string& data,
+                                                             uint64_t& cas,
+                                                             SAS::TrailId trail,
+                                                             bool log_body,
+                                                             Format data_format)
+{
+  // Hedged reads need the asynchronous client, so send the GET with that
+  // and wait for it.
+  Store::Status status;
+  std::promise<void> done;
+
+  get_data_async(table, key, trail, log_body, data_format,
+                 [&](Store::Status result_status,
+                     const std::string& result_data,
+                     uint64_t result_cas) {
+    status = result_status;
+    data = result_data;
+    cas = result_cas;
+    done.set_value();
+  });
+
+  done.get_future().wait();
+  return status;
+}
+
+Store::Status TopologyNeutralMemcachedStore::read_data(const std::string& table,
+                                                       const std::string& key,
+                                                       Store::Buffer& data,
+                                                       uint64_t& cas,
+                                                       SAS::TrailId trail,
+                                                       bool log_body,
+                                                       Format data_format)
 {
   Store::Status status;
   std::vector<AddrInfo> targets;
   memcached_return_t rc;
 
+  if (_hedged_reads)
+  {
+    // The asynchronous client returns the data in a string, so the buffer
+    // takes that over.
+    std::string str;
+    status = get_data_hedged(table, key, str, cas, trail, log_body, data_format);
+    data = Store::Buffer(std::move(str));
+    return status;
+  }
+
+  PROFILE_SPAN("memcached.get");
   TRC_DEBUG("Start GET from table %s for key %s", table.c_str(), key.c_str());
 
   std::string fqkey = get_fq_key(table, key);
 
-  if (trail != 0)
+  if ((trail != 0) &&
+      (SASEventSampler::should_report(SASEvent::MEMCACHED_GET_START)))
   {
     SAS::Event start(trail, SASEvent::MEMCACHED_GET_START, 0);
     start.add_var_param(fqkey);
@@ -364,6 +704,7 @@ Store::Status TopologyNeutralMemcachedStore::get_data(const std::string& table,
   //
   // The code that does the GET operation is passed as a lambda that captures
   // all necessary variables by reference.
+  MemcachedTargetStats* stats;
   rc = iterate_through_targets(targets, trail,
                                [&](ConnectionHandle<memcached_st*>& conn_handle) {
      return get_from_replica(conn_handle.get_connection(),
@@ -371,11 +712,63 @@ Store::Status TopologyNeutralMemcachedStore::get_data(const std::string& table,
                              fqkey.length(),
                              data,
                              cas);
-  });
+  }, fqkey.length(), &stats);
+
+  if ((stats != NULL) && (memcached_success(rc)))
+  {
+    if (data.empty())
+    {
+      stats->record_tombstone();
+    }
+    else
+    {
+      stats->record_bytes_in(data.length());
+    }
+  }
+
+  status = get_status(fqkey, rc, data, cas, trail, log_body, data_format);
+
+  record_get_result(rc, targets);
+
+  return status;
+}
+
+void BaseMemcachedStore::record_get_result(memcached_return_t rc,
+                                           const std::vector<AddrInfo>& targets)
+{
+  if ((memcached_success(rc)) || (rc == MEMCACHED_NOTFOUND))
+  {
+    if (_comm_monitor)
+    {
+      _comm_monitor->inform_success();
+    }
+  }
+  else
+  {
+    log_targets(targets);
+
+    if (_comm_monitor)
+    {
+      _comm_monitor->inform_failure();
+    }
+  }
+}
+
+Store::Status BaseMemcachedStore::get_status(const std::string& fqkey,
+                                             memcached_return_t rc,
+                                             const char* data,
+                                             size_t length,
+                                             uint64_t& cas,
+                                             SAS::TrailId trail,
+                                             bool log_body,
+                                             Format data_format)
+{
+  Store::Status status;
 
   if (memcached_success(rc))
   {
-    if (data != TOMBSTONE)
+    // Tombstones are empty records.
+    if (length != TOMBSTONE.length())
     {
       if (trail != 0)
       {
@@ -390,21 +783,24 @@ Store::Status TopologyNeutralMemcachedStore::get_data(const std::string& table,
           event = SASEvent::MEMCACHED_GET_WITHOUT_DATA_SUCCESS;
         }
 
-        SAS::Event got_data(trail, event, 0);
-        got_data.add_var_param(fqkey);
-        got_data.add_static_param(cas);
-
-        if (log_body)
+        if (SASEventSampler::should_report(event))
         {
-          got_data.add_var_param(data);
-          got_data.add_static_param(data_format);
-        }
+          SAS::Event got_data(trail, event, 0);
+          got_data.add_var_param(fqkey);
+          got_data.add_static_param(cas);
+
+          if (log_body)
+          {
+            got_data.add_var_param(length, (const uint8_t*)data);
+            got_data.add_static_param(data_format);
+          }
 
-        SAS::report_event(got_data);
+          SAS::report_event(got_data);
+        }
       }
 
-      TRC_DEBUG("Read %d bytes from table %s key %s, CAS = %ld",
-                data.length(), table.c_str(), key.c_str(), cas);
+      TRC_DEBUG("Read %d bytes from key %s, CAS = %ld",
+                length, fqkey.c_str(), cas);
       status = Store::OK;
     }
     else
@@ -419,16 +815,10 @@ Store::Status TopologyNeutralMemcachedStore::get_data(const std::string& table,
 
       // We have read a tombstone. Return NOT_FOUND to the caller, and also
       // zero out the CAS (returning a zero CAS makes the interface cleaner).
-      TRC_DEBUG("Read tombstone from table %s key %s, CAS = %ld",
-                table.c_str(), key.c_str(), cas);
+      TRC_DEBUG("Read tombstone from key %s, CAS = %ld", fqkey.c_str(), cas);
       cas = 0;
       status = Store::NOT_FOUND;
     }
-
-    if (_comm_monitor)
-    {
-      _comm_monitor->inform_success();
-    }
   }
   else if (rc == MEMCACHED_NOTFOUND)
   {
@@ -442,11 +832,6 @@ Store::Status TopologyNeutralMemcachedStore::get_data(const std::string& table,
     }
 
     status = Store::Status::NOT_FOUND;
-
-    if (_comm_monitor)
-    {
-      _comm_monitor->inform_success();
-    }
   }
   else
   {
@@ -461,13 +846,7 @@ Store::Status TopologyNeutralMemcachedStore::get_data(const std::string& table,
     TRC_VERBOSE("Failed to read data from %s with error %s",
                 fqkey.c_str(),
                 memcached_strerror(NULL, rc));
-    log_targets(targets);
     status = Store::Status::ERROR;
-
-    if (_comm_monitor)
-    {
-      _comm_monitor->inform_failure();
-    }
   }
 
   return status;
@@ -487,6 +866,28 @@ Store::Status TopologyNeutralMemcachedStore::set_data(const std::string& table,
 
   std::string fqkey = get_fq_key(table, key);
 
+  if (!start_set(fqkey, data, cas, expiry, trail, log_body, data_format))
+  {
+    return Store::Status::ERROR;
+  }
+
+  memcached_store_func f = cas_store_func(fqkey, data, cas, trail);
+
+  return set_data(fqkey,
+                  data,
+                  expiry,
+                  trail,
+                  f);
+}
+
+bool BaseMemcachedStore::start_set(const std::string& fqkey,
+                                   const std::string& data,
+                                   uint64_t cas,
+                                   int expiry,
+                                   SAS::TrailId trail,
+                                   bool log_body,
+                                   Store::Format data_format)
+{
   // Check whether this request is too big.  Note that neither Rogers nor
   // memcached impose a limit on the maximum request length, but there is no
   // legitimate case for needing to store more than this maximum and permitting
@@ -505,7 +906,7 @@ Store::Status TopologyNeutralMemcachedStore::set_data(const std::string& table,
 
     TRC_DEBUG("Attempting to write more than %lu bytes of data -- reject request",
              Store::MAX_DATA_LENGTH);
-    return Store::Status::ERROR;
+    return false;
   }
 
   if (trail != 0)
@@ -521,25 +922,37 @@ Store::Status TopologyNeutralMemcachedStore::set_data(const std::string& table,
       event = SASEvent::MEMCACHED_SET_WITHOUT_DATA_START;
     }
 
-    SAS::Event start(trail, event, 0);
-    start.add_var_param(fqkey);
-    start.add_static_param(cas);
-    start.add_static_param(expiry);
-
-    if (log_body)
+    if (SASEventSampler::should_report(event))
     {
-      // Note that we do this _after_ policing the maximum length which means
-      // that data is less than the maximum 64k supported by SAS.
-      start.add_var_param(data);
-      start.add_static_param(data_format);
-    }
+      SAS::Event start(trail, event, 0);
+      start.add_var_param(fqkey);
+      start.add_static_param(cas);
+      start.add_static_param(expiry);
 
-    SAS::report_event(start);
+      if (log_body)
+      {
+        // Note that we do this _after_ policing the maximum length which means
+        // that data is less than the maximum 64k supported by SAS.
+        start.add_var_param(data);
+        start.add_static_param(data_format);
+      }
+
+      SAS::report_event(start);
+    }
   }
 
-  memcached_store_func f =
-    [&] (ConnectionHandle<memcached_st*>& conn_handle,
-         time_t memcached_expiration) -> memcached_return_t
+  return true;
+}
+
+TopologyNeutralMemcachedStore::memcached_store_func
+TopologyNeutralMemcachedStore::cas_store_func(const std::string& fqkey,
+                                              const std::string& data,
+                                              uint64_t cas,
+                                              SAS::TrailId trail)
+{
+  return [this, &fqkey, &data, cas, trail]
+    (ConnectionHandle<memcached_st*>& conn_handle,
+     time_t memcached_expiration) -> memcached_return_t
   {
     memcached_return_t rc;
 
@@ -577,12 +990,6 @@ Store::Status TopologyNeutralMemcachedStore::set_data(const std::string& table,
     }
     return rc;
   };
-
-  return set_data(fqkey,
-                  data,
-                  expiry,
-                  trail,
-                  f);
 }
 
 Store::Status TopologyNeutralMemcachedStore::set_data_without_cas(const std::string& table,
@@ -611,17 +1018,32 @@ Store::Status TopologyNeutralMemcachedStore::set_data_without_cas(const std::str
       event = SASEvent::MEMCACHED_SET_WITHOUT_DATA_OR_CAS_START;
     }
 
-    SAS::Event start(trail, event, 0);
-    start.add_var_param(fqkey);
-    start.add_static_param(expiry);
-
-    if (log_body)
+    if (SASEventSampler::should_report(event))
     {
-      start.add_var_param(data);
-      start.add_static_param(data_format);
-    }
+      SAS::Event start(trail, event, 0);
+      start.add_var_param(fqkey);
+      start.add_static_param(expiry);
 
-    SAS::report_event(start);
+      if (log_body)
+      {
+        start.add_var_param(data);
+        start.add_static_param(data_format);
+      }
+
+      SAS::report_event(start);
+    }
+  }
+
+  if (_noreply_writes)
+  {
+    MemcachedAsyncClient::Request request;
+    request.opcode = MemcachedAsyncClient::SET;
+    request.key = fqkey;
+    request.value = data;
+    request.expiration = get_memcached_expiration(expiry);
+    request.quiet = true;
+
+    return send_noreply(request, trail);
   }
 
   memcached_store_func f =
@@ -659,20 +1081,8 @@ Store::Status TopologyNeutralMemcachedStore::set_data(const std::string& fqkey,
                                                       SAS::TrailId trail,
                                                       memcached_store_func f)
 {
-  Store::Status status = Store::Status::OK;
+  PROFILE_SPAN("memcached.set");
   std::vector<AddrInfo> targets;
-  memcached_return_t rc;
-
-  // Memcached uses a flexible mechanism for specifying expiration.
-  // - 0 indicates never expire.
-  // - <= MEMCACHED_EXPIRATION_MAXDELTA indicates a relative (delta) time.
-  // - > MEMCACHED_EXPIRATION_MAXDELTA indicates an absolute time.
-  // Absolute time is the only way to force immediate expiry.  Unfortunately,
-  // it's not reliable (e.g. as a result of NTP changes). Instead, we use
-  // relative time for future times (expiry > 0) and the earliest absolute
-  // time for immediate expiry (expiry == 0).
-  time_t memcached_expiration =
-    (time_t)((expiry > 0) ? expiry : MEMCACHED_EXPIRATION_MAXDELTA + 1);
 
   if (!get_targets(targets, trail))
   {
@@ -680,6 +1090,19 @@ Store::Status TopologyNeutralMemcachedStore::set_data(const std::string& fqkey,
     return ERROR;
   }
 
+  return set_data(targets, fqkey, data, expiry, trail, f);
+}
+
+Store::Status TopologyNeutralMemcachedStore::set_data(std::vector<AddrInfo>& targets,
+                                                      const std::string& fqkey,
+                                                      const std::string& data,
+                                                      int expiry,
+                                                      SAS::TrailId trail,
+                                                      memcached_store_func f)
+{
+  memcached_return_t rc;
+  time_t memcached_expiration = get_memcached_expiration(expiry);
+
   // Set to each replica (mechansim determined by the update function), stopping if we
   // get a definitive success/failure response.
   //
@@ -688,7 +1111,28 @@ Store::Status TopologyNeutralMemcachedStore::set_data(const std::string& fqkey,
   memcached_func f1 = std::bind(f,
                                 std::placeholders::_1,
                                 memcached_expiration);
-  rc = iterate_through_targets(targets, trail, f1);
+  MemcachedTargetStats* stats;
+  rc = iterate_through_targets(targets,
+                               trail,
+                               f1,
+                               fqkey.length() + data.length(),
+                               &stats);
+
+  if ((stats != NULL) &&
+      ((rc == MEMCACHED_NOTSTORED) || (rc == MEMCACHED_DATA_EXISTS)))
+  {
+    stats->record_contention();
+  }
+
+  return set_status(fqkey, rc, targets, trail);
+}
+
+Store::Status BaseMemcachedStore::set_status(const std::string& fqkey,
+                                             memcached_return_t rc,
+                                             const std::vector<AddrInfo>& targets,
+                                             SAS::TrailId trail)
+{
+  Store::Status status;
 
   if (memcached_success(rc))
   {
@@ -756,18 +1200,37 @@ Store::Status TopologyNeutralMemcachedStore::delete_data(const std::string& tabl
 
   std::string fqkey = get_fq_key(table, key);
 
-  if (_tombstone_lifetime == 0)
+  if (SASEventSampler::should_report(SASEvent::MEMCACHED_DELETE))
   {
     SAS::Event event(trail, SASEvent::MEMCACHED_DELETE, 0);
     event.add_var_param(fqkey);
+
+    if (_tombstone_lifetime != 0)
+    {
+      event.add_static_param(_tombstone_lifetime);
+    }
+
     SAS::report_event(event);
   }
-  else
+
+  if (_noreply_writes)
   {
-    SAS::Event event(trail, SASEvent::MEMCACHED_DELETE, 0);
-    event.add_var_param(fqkey);
-    event.add_static_param(_tombstone_lifetime);
-    SAS::report_event(event);
+    MemcachedAsyncClient::Request request;
+    request.key = fqkey;
+    request.quiet = true;
+
+    if (_tombstone_lifetime == 0)
+    {
+      request.opcode = MemcachedAsyncClient::DELETE;
+    }
+    else
+    {
+      request.opcode = MemcachedAsyncClient::SET;
+      request.value = TOMBSTONE;
+      request.expiration = _tombstone_lifetime;
+    }
+
+    return send_noreply(request, trail);
   }
 
   if (!get_targets(targets, trail))
@@ -810,7 +1273,7 @@ Store::Status TopologyNeutralMemcachedStore::delete_data(const std::string& tabl
       CW_IO_COMPLETES()
     }
     return rc;
-  });
+  }, fqkey.length());
 
   if (memcached_success(rc))
   {
@@ -834,49 +1297,1300 @@ Store::Status TopologyNeutralMemcachedStore::delete_data(const std::string& tabl
 }
 
 
-bool TopologyNeutralMemcachedStore::can_retry_memcached_rc(memcached_return_t rc)
+void TopologyNeutralMemcachedStore::get_data_multi(const std::string& table,
+                                                   const std::vector<std::string>& keys,
+                                                   std::vector<Store::GetResult>& results,
+                                                   SAS::TrailId trail,
+                                                   bool log_body,
+                                                   Store::Format data_format)
 {
-  return (!memcached_success(rc) &&
-          (rc != MEMCACHED_NOTFOUND) &&
-          (rc != MEMCACHED_NOTSTORED) &&
-          (rc != MEMCACHED_DATA_EXISTS) &&
-          (rc != MEMCACHED_E2BIG));
+  std::vector<AddrInfo> targets;
+  memcached_return_t rc;
+
+  TRC_DEBUG("Start GET from table %s for %d keys", table.c_str(), keys.size());
+
+  results.resize(keys.size());
+  std::vector<std::string> fqkeys;
+
+  for (size_t ii = 0; ii < keys.size(); ++ii)
+  {
+    results[ii].status = Store::Status::ERROR;
+    results[ii].cas = 0;
+    fqkeys.push_back(get_fq_key(table, keys[ii]));
+
+    if ((trail != 0) &&
+        (SASEventSampler::should_report(SASEvent::MEMCACHED_GET_START)))
+    {
+      SAS::Event start(trail, SASEvent::MEMCACHED_GET_START, 0);
+      start.add_var_param(fqkeys.back());
+      SAS::report_event(start);
+    }
+  }
+
+  if (keys.empty())
+  {
+    return;
+  }
+
+  if (!get_targets(targets, trail))
+  {
+    TRC_VERBOSE("Failed to get targets for GET from table %s", table.c_str());
+    return;
+  }
+
+  // Do a multi-GET to each target, stopping if we get a definitive
+  // success/failure response.  Each target is only asked for the keys that
+  // haven't been found on an earlier one.
+  std::map<std::string, std::pair<std::string, uint64_t>> found;
+  size_t keys_length = 0;
+
+  for (const std::string& fqkey : fqkeys)
+  {
+    keys_length += fqkey.length();
+  }
+
+  MemcachedTargetStats* stats;
+  rc = iterate_through_targets(targets, trail,
+                               [&](ConnectionHandle<memcached_st*>& conn_handle) {
+    std::vector<std::string> remaining;
+
+    for (const std::string& fqkey : fqkeys)
+    {
+      if (found.find(fqkey) == found.end())
+      {
+        remaining.push_back(fqkey);
+      }
+    }
+
+    return get_multi_from_replica(conn_handle.get_connection(), remaining, found);
+  }, keys_length, &stats);
+
+  // Records found on earlier targets are counted against the last one, which
+  // is usually the only one.
+  if (stats != NULL)
+  {
+    for (std::map<std::string, std::pair<std::string, uint64_t>>::const_iterator i = found.begin();
+         i != found.end();
+         ++i)
+    {
+      if (i->second.first.empty())
+      {
+        stats->record_tombstone();
+      }
+      else
+      {
+        stats->record_bytes_in(i->second.first.length());
+      }
+    }
+  }
+
+  for (size_t ii = 0; ii < fqkeys.size(); ++ii)
+  {
+    // Keys that weren't returned by a successful request weren't found.
+    memcached_return_t key_rc = rc;
+    std::map<std::string, std::pair<std::string, uint64_t>>::iterator i =
+                                                        found.find(fqkeys[ii]);
+
+    if (i != found.end())
+    {
+      key_rc = MEMCACHED_SUCCESS;
+      results[ii].data = i->second.first;
+      results[ii].cas = i->second.second;
+    }
+    else if (memcached_success(rc))
+    {
+      key_rc = MEMCACHED_NOTFOUND;
+    }
+
+    results[ii].status = get_status(fqkeys[ii],
+                                    key_rc,
+                                    results[ii].data,
+                                    results[ii].cas,
+                                    trail,
+                                    log_body,
+                                    data_format);
+  }
+
+  record_get_result(rc, targets);
 }
 
+void TopologyNeutralMemcachedStore::set_data_multi(const std::string& table,
+                                                   const std::vector<Store::SetRequest>& requests,
+                                                   std::vector<Store::Status>& statuses,
+                                                   SAS::TrailId trail,
+                                                   bool log_body,
+                                                   Store::Format data_format)
+{
+  std::vector<AddrInfo> targets;
+
+  TRC_DEBUG("Writing %d keys to table %s", requests.size(), table.c_str());
 
-bool TopologyNeutralMemcachedStore::get_targets(std::vector<AddrInfo>& targets,
-                                                SAS::TrailId trail)
+  statuses.assign(requests.size(), Store::Status::ERROR);
+
+  if (requests.empty())
+  {
+    return;
+  }
+
+  if (!get_targets(targets, trail))
+  {
+    TRC_VERBOSE("Failed to get targets for SET to table %s", table.c_str());
+    return;
+  }
+
+  for (size_t ii = 0; ii < requests.size(); ++ii)
+  {
+    const Store::SetRequest& request = requests[ii];
+    std::string fqkey = get_fq_key(table, request.key);
+
+    TRC_DEBUG("Writing %d bytes to key %s, CAS = %ld, expiry = %d",
+              request.data.length(), fqkey.c_str(), request.cas, request.expiry);
+
+    if (start_set(fqkey,
+                  request.data,
+                  request.cas,
+                  request.expiry,
+                  trail,
+                  log_body,
+                  data_format))
+    {
+      statuses[ii] = set_data(targets,
+                              fqkey,
+                              request.data,
+                              request.expiry,
+                              trail,
+                              cas_store_func(fqkey, request.data, request.cas, trail));
+    }
+  }
+}
+
+
+//
+// Asynchronous requests.
+//
+
+MemcachedAsyncClient* TopologyNeutralMemcachedStore::async_client()
 {
-  // Resolve the Astaire domain into a list of potential targets.
-  _resolver->resolve(_target_domain, _attempts, targets, trail);
-  TRC_DEBUG("Found %d targets for %s", targets.size(), _target_domain.c_str());
+  pthread_mutex_lock(&_async_lock);
 
-  if (targets.empty())
+  if (_async_client == NULL)
   {
-    TRC_VERBOSE("No targets in domain %s - give up", _target_domain.c_str());
-    SAS::Event event(trail, SASEvent::MEMCACHED_NO_HOSTS, 0);
-    event.add_var_param(_target_domain);
-    SAS::report_event(event);
+    TRC_STATUS("Starting memcached I/O thread for %s", _target_domain.c_str());
+    _async_client = new MemcachedAsyncClient(_poll_timeout_ms, _source_address);
+  }
 
-    if (_comm_monitor != NULL)
+  MemcachedAsyncClient* client = _async_client;
+  pthread_mutex_unlock(&_async_lock);
+
+  return client;
+}
+
+void TopologyNeutralMemcachedStore::get_data_async(const std::string& table,
+                                                   const std::string& key,
+                                                   SAS::TrailId trail,
+                                                   bool log_body,
+                                                   Store::Format data_format,
+                                                   Store::GetCallback callback)
+{
+  TRC_DEBUG("Start asynchronous GET from table %s for key %s",
+            table.c_str(), key.c_str());
+
+  AsyncOperation* op = new AsyncOperation();
+  op->is_get = true;
+  op->fqkey = get_fq_key(table, key);
+  op->cas = 0;
+  op->memcached_expiration = 0;
+  op->trail = trail;
+  op->log_body = log_body;
+  op->data_format = data_format;
+  op->get_callback = callback;
+
+  if ((trail != 0) &&
+      (SASEventSampler::should_report(SASEvent::MEMCACHED_GET_START)))
+  {
+    SAS::Event start(trail, SASEvent::MEMCACHED_GET_START, 0);
+    start.add_var_param(op->fqkey);
+    SAS::report_event(start);
+  }
+
+  start_async_operation(op);
+}
+
+void TopologyNeutralMemcachedStore::set_data_async(const std::string& table,
+                                                   const std::string& key,
+                                                   const std::string& data,
+                                                   uint64_t cas,
+                                                   int expiry,
+                                                   SAS::TrailId trail,
+                                                   bool log_body,
+                                                   Store::Format data_format,
+                                                   Store::SetCallback callback)
+{
+  TRC_DEBUG("Writing %d bytes asynchronously to table %s key %s, CAS = %ld, expiry = %d",
+            data.length(), table.c_str(), key.c_str(), cas, expiry);
+
+  std::string fqkey = get_fq_key(table, key);
+
+  if (!start_set(fqkey, data, cas, expiry, trail, log_body, data_format))
+  {
+    callback(Store::Status::ERROR);
+    return;
+  }
+
+  AsyncOperation* op = new AsyncOperation();
+  op->is_get = false;
+  op->fqkey = fqkey;
+  op->data = data;
+  op->cas = cas;
+  op->memcached_expiration = get_memcached_expiration(expiry);
+  op->trail = trail;
+  op->log_body = log_body;
+  op->data_format = data_format;
+  op->set_callback = callback;
+
+  start_async_operation(op);
+}
+
+void TopologyNeutralMemcachedStore::start_async_operation(AsyncOperation* op)
+{
+  // The targets come from the resolver's cache, so looking them up doesn't
+  // normally block.
+  if (!get_targets(op->targets, op->trail))
+  {
+    TRC_VERBOSE("Failed to get targets for key %s", op->fqkey.c_str());
+
+    if (op->is_get)
     {
-      _comm_monitor->inform_failure();
+      op->get_callback(Store::Status::ERROR, "", 0);
+    }
+    else
+    {
+      op->set_callback(Store::Status::ERROR);
     }
 
-    return false;
+    delete op;
+    return;
   }
 
-  // Always try at least twice even if there is only one target.  This is
-  // because if we have a connection for which the server is no longer working,
-  // libmemcached will fail the request and only fixes the connection up
-  // asynchronously.
-  if (targets.size() == 1)
+  op->target_index = 0;
+  op->rc = MEMCACHED_SUCCESS;
+
+  if ((op->is_get) && (_hedged_reads))
   {
-    TRC_DEBUG("Duplicate target IP=%s, port= %d as it is the only target",
-              targets[0].address.to_string().c_str(),
-              targets[0].port);
-    targets.push_back(targets[0]);
+    start_hedged_get(op);
+  }
+  else
+  {
+    start_async_attempt(op);
   }
+}
 
-  return true;
+Store::Status TopologyNeutralMemcachedStore::send_noreply(
+                                   const MemcachedAsyncClient::Request& request,
+                                   SAS::TrailId trail)
+{
+  std::vector<AddrInfo> targets;
+
+  if (!get_targets(targets, trail))
+  {
+    TRC_INFO("Failed to get targets for quiet write of key %s",
+             request.key.c_str());
+    return ERROR;
+  }
+
+  AddrInfo target = targets[0];
+  std::string fqkey = request.key;
+  bool is_delete = (request.opcode == MemcachedAsyncClient::DELETE);
+
+  TRC_DEBUG("Sending quiet write of key %s to %s",
+            fqkey.c_str(),
+            target.address_and_port_to_string().c_str());
+
+  async_client()->send(target, request,
+                       [this, target, fqkey, is_delete](const MemcachedAsyncClient::Result& result) {
+    if ((memcached_success(result.rc)) ||
+        ((is_delete) && (result.rc == MEMCACHED_NOTFOUND)))
+    {
+      if (_comm_monitor)
+      {
+        _comm_monitor->inform_success();
+      }
+    }
+    else
+    {
+      TRC_INFO("Quiet write of key %s to %s failed with error %s",
+               fqkey.c_str(),
+               target.address_and_port_to_string().c_str(),
+               memcached_strerror(NULL, result.rc));
+
+      if (can_retry_memcached_rc(result.rc))
+      {
+        _resolver->blacklist(target);
+      }
+
+      if (_comm_monitor)
+      {
+        _comm_monitor->inform_failure();
+      }
+    }
+  });
+
+  return OK;
+}
+
+void TopologyNeutralMemcachedStore::start_async_attempt(AsyncOperation* op)
+{
+  if (op->target_index >= op->targets.size())
+  {
+    complete_async_operation(op);
+    return;
+  }
+
+  AddrInfo& target = op->targets[op->target_index];
+
+  TRC_DEBUG("Try server IP %s, port %d",
+            target.address.to_string().c_str(),
+            target.port);
+
+  if (SASEventSampler::should_report(SASEvent::MEMCACHED_TRY_HOST))
+  {
+    SAS::Event attempt(op->trail, SASEvent::MEMCACHED_TRY_HOST, 0);
+    attempt.add_var_param(target.address.to_string());
+    attempt.add_static_param(target.port);
+    SAS::report_event(attempt);
+  }
+
+  op->stopwatch.start();
+  _resolver->request_started(target);
+
+  if (op->is_get)
+  {
+    MemcachedAsyncClient::Request request;
+    request.opcode = MemcachedAsyncClient::GET;
+    request.key = op->fqkey;
+
+    async_client()->send(target, request,
+                         [this, op](const MemcachedAsyncClient::Result& result) {
+      if (memcached_success(result.rc))
+      {
+        op->data = result.value;
+        op->cas = result.cas;
+      }
+
+      finish_async_attempt(op, result.rc);
+    });
+  }
+  else
+  {
+    op->tombstone_cas = 0;
+    async_store(op);
+  }
+}
+
+/// Writes the record to the current target.  As in set_data, a record with a
+/// CAS value of zero is added, overwriting any tombstone already stored, and
+/// other records are written with a CAS check.
+void TopologyNeutralMemcachedStore::async_store(AsyncOperation* op)
+{
+  const AddrInfo& target = op->targets[op->target_index];
+
+  MemcachedAsyncClient::Request request;
+  request.key = op->fqkey;
+  request.value = op->data;
+  request.expiration = op->memcached_expiration;
+
+  if (op->cas != 0)
+  {
+    request.opcode = MemcachedAsyncClient::SET;
+    request.cas = op->cas;
+  }
+  else if (op->tombstone_cas != 0)
+  {
+    TRC_DEBUG("Attempting memcached CAS command (cas = %d)", op->tombstone_cas);
+    request.opcode = MemcachedAsyncClient::SET;
+    request.cas = op->tombstone_cas;
+  }
+  else
+  {
+    TRC_DEBUG("Attempting memcached ADD command");
+    request.opcode = MemcachedAsyncClient::ADD;
+  }
+
+  async_client()->send(target, request,
+                       [this, op](const MemcachedAsyncClient::Result& result) {
+    async_store_complete(op, result);
+  });
+}
+
+void TopologyNeutralMemcachedStore::async_store_complete(
+                                   AsyncOperation* op,
+                                   const MemcachedAsyncClient::Result& result)
+{
+  if ((op->cas != 0) ||
+      ((result.rc != MEMCACHED_DATA_EXISTS) && (result.rc != MEMCACHED_NOTSTORED)))
+  {
+    finish_async_attempt(op, result.rc);
+    return;
+  }
+
+  // A record with this key already exists.  If it is a tombstone, we need to
+  // overwrite it.  Get the record to see what it is.
+  TRC_DEBUG("Existing data prevented the ADD/CAS."
+            "Issue GET to see if we need to overwrite a tombstone");
+  op->store_rc = result.rc;
+
+  MemcachedAsyncClient::Request request;
+  request.opcode = MemcachedAsyncClient::GET;
+  request.key = op->fqkey;
+
+  async_client()->send(op->targets[op->target_index], request,
+                       [this, op](const MemcachedAsyncClient::Result& existing) {
+    if (memcached_success(existing.rc))
+    {
+      if (existing.value != TOMBSTONE)
+      {
+        // The existing record is not a tombstone.  We mustn't overwrite it,
+        // so return the original return code from the ADD/CAS.
+        TRC_DEBUG("Found real data. Give up");
+        finish_async_attempt(op, op->store_rc);
+      }
+      else
+      {
+        TRC_DEBUG("Found a tombstone. Attempt to overwrite");
+
+        if (op->trail != 0)
+        {
+          SAS::Event event(op->trail, SASEvent::MEMCACHED_SET_BLOCKED_BY_TOMBSTONE, 0);
+          event.add_var_param(op->fqkey);
+          event.add_static_param(existing.cas);
+          SAS::report_event(event);
+        }
+
+        op->tombstone_cas = existing.cas;
+        async_store(op);
+      }
+    }
+    else if (existing.rc == MEMCACHED_NOTFOUND)
+    {
+      // The record has gone (it may have been a tombstone that expired), so
+      // try to add it again.
+      TRC_DEBUG("GET failed with NOT_FOUND");
+
+      if (op->trail != 0)
+      {
+        SAS::Event event(op->trail, SASEvent::MEMCACHED_SET_BLOCKED_BY_EXPIRED, 0);
+        event.add_var_param(op->fqkey);
+        SAS::report_event(event);
+      }
+
+      op->tombstone_cas = 0;
+      async_store(op);
+    }
+    else
+    {
+      // The replica failed.  Return the return code from the original ADD/CAS.
+      TRC_DEBUG("GET failed, rc = %d", existing.rc);
+      finish_async_attempt(op, op->store_rc);
+    }
+  });
+}
+
+void TopologyNeutralMemcachedStore::finish_async_attempt(AsyncOperation* op,
+                                                         memcached_return_t rc)
+{
+  AddrInfo& target = op->targets[op->target_index];
+
+  unsigned long latency_us = 0;
+  op->stopwatch.read(latency_us);
+  _resolver->request_completed(target, latency_us);
+
+  TRC_DEBUG("Asynchronous request returned %d", rc);
+  op->rc = rc;
+
+  if ((memcached_success(rc)) || (!can_retry_memcached_rc(rc)))
+  {
+    record_answer(op->target_index);
+    complete_async_operation(op);
+  }
+  else
+  {
+    TRC_DEBUG("Blacklisting target");
+    _resolver->blacklist(target);
+
+    if ((op->target_index + 1 < op->targets.size()) &&
+        (!retry_allowed()))
+    {
+      complete_async_operation(op);
+      return;
+    }
+
+    ++op->target_index;
+    start_async_attempt(op);
+  }
+}
+
+void TopologyNeutralMemcachedStore::complete_async_operation(AsyncOperation* op)
+{
+  report_async_result(op);
+  delete op;
+}
+
+void TopologyNeutralMemcachedStore::report_async_result(AsyncOperation* op)
+{
+  if (op->is_get)
+  {
+    Store::Status status = get_status(op->fqkey,
+                                      op->rc,
+                                      op->data,
+                                      op->cas,
+                                      op->trail,
+                                      op->log_body,
+                                      op->data_format);
+    record_get_result(op->rc, op->targets);
+    op->get_callback(status, op->data, op->cas);
+  }
+  else
+  {
+    op->set_callback(set_status(op->fqkey, op->rc, op->targets, op->trail));
+  }
+}
+
+
+//
+// Hedged reads.
+//
+
+void TopologyNeutralMemcachedStore::set_hedged_reads(bool enabled,
+                                                     double percentile,
+                                                     HedgeMonitor* monitor)
+{
+  _hedge_percentile = percentile;
+  _hedge_monitor = monitor;
+  _hedged_reads = enabled;
+}
+
+unsigned long TopologyNeutralMemcachedStore::hedge_delay_ms()
+{
+  // Don't hedge until there are enough latencies for the percentile to mean
+  // something.
+  static const uint64_t MIN_HEDGE_SAMPLES = 100;
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  unsigned long now_ms = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+  if (now_ms >= _hedge_delay_expiry_ms)
+  {
+    LatencyHistogram::Snapshot snapshot;
+    _get_latency.snapshot(snapshot);
+
+    _hedge_delay_us = (snapshot.count >= MIN_HEDGE_SAMPLES) ?
+                        snapshot.percentile_us(_hedge_percentile) : 0;
+    _hedge_delay_expiry_ms = now_ms + 1000;
+  }
+
+  unsigned long delay_ms = (_hedge_delay_us + 999) / 1000;
+
+  return (delay_ms < (unsigned long)_poll_timeout_ms) ? delay_ms : 0;
+}
+
+/// Starts a hedged GET.  Everything that touches the operation from here on
+/// is done on the client's I/O thread, so that the timer and the responses
+/// don't race.
+void TopologyNeutralMemcachedStore::start_hedged_get(AsyncOperation* op)
+{
+  op->outstanding = 0;
+  op->held = true;
+  op->complete = false;
+  op->hedge_index = op->targets.size();
+
+  async_client()->schedule(0, [this, op]() {
+    send_hedged_get(op);
+
+    unsigned long delay_ms = hedge_delay_ms();
+
+    if ((!op->complete) && (op->targets.size() > 1) && (delay_ms > 0))
+    {
+      // The timer now holds the operation.
+      async_client()->schedule(delay_ms, [this, op]() {
+        hedge_timer_popped(op);
+      });
+    }
+    else
+    {
+      op->held = false;
+      release_hedged_get(op);
+    }
+  });
+}
+
+void TopologyNeutralMemcachedStore::send_hedged_get(AsyncOperation* op)
+{
+  size_t index = op->target_index++;
+  AddrInfo& target = op->targets[index];
+
+  TRC_DEBUG("Try server IP %s, port %d",
+            target.address.to_string().c_str(),
+            target.port);
+
+  if (SASEventSampler::should_report(SASEvent::MEMCACHED_TRY_HOST))
+  {
+    SAS::Event attempt(op->trail, SASEvent::MEMCACHED_TRY_HOST, 0);
+    attempt.add_var_param(target.address.to_string());
+    attempt.add_static_param(target.port);
+    SAS::report_event(attempt);
+  }
+
+  MemcachedAsyncClient::Request request;
+  request.opcode = MemcachedAsyncClient::GET;
+  request.key = op->fqkey;
+
+  Utils::StopWatch stopwatch;
+  stopwatch.start();
+  _resolver->request_started(target);
+  ++op->outstanding;
+
+  async_client()->send(target, request,
+                       [this, op, index, stopwatch](const MemcachedAsyncClient::Result& result) mutable {
+    hedged_get_complete(op, index, stopwatch, result);
+  });
+}
+
+void TopologyNeutralMemcachedStore::hedged_get_complete(
+                                   AsyncOperation* op,
+                                   size_t index,
+                                   Utils::StopWatch& stopwatch,
+                                   const MemcachedAsyncClient::Result& result)
+{
+  AddrInfo& target = op->targets[index];
+
+  unsigned long latency_us = 0;
+  stopwatch.read(latency_us);
+  _resolver->request_completed(target, latency_us);
+  _get_latency.record(latency_us);
+
+  TRC_DEBUG("Hedged GET to %s returned %d",
+            target.address_and_port_to_string().c_str(),
+            result.rc);
+
+  if (op->complete)
+  {
+    // Another target has already answered.
+  }
+  else if ((memcached_success(result.rc)) || (!can_retry_memcached_rc(result.rc)))
+  {
+    if ((index == op->hedge_index) && (_hedge_monitor != NULL))
+    {
+      _hedge_monitor->inform_hedge_won();
+    }
+
+    op->rc = result.rc;
+
+    if (memcached_success(result.rc))
+    {
+      op->data = result.value;
+      op->cas = result.cas;
+    }
+
+    op->complete = true;
+    report_async_result(op);
+  }
+  else
+  {
+    TRC_DEBUG("Blacklisting target");
+    _resolver->blacklist(target);
+    op->rc = result.rc;
+
+    if (op->target_index < op->targets.size())
+    {
+      send_hedged_get(op);
+    }
+    else if (op->outstanding == 1)
+    {
+      // This was the last request, and there are no more targets to try.
+      op->complete = true;
+      report_async_result(op);
+    }
+  }
+
+  // This request only stops holding the operation now, as sending to the
+  // next target may complete it.
+  --op->outstanding;
+  release_hedged_get(op);
+}
+
+void TopologyNeutralMemcachedStore::hedge_timer_popped(AsyncOperation* op)
+{
+  if ((!op->complete) &&
+      (op->outstanding > 0) &&
+      (op->target_index < op->targets.size()))
+  {
+    TRC_DEBUG("No response to GET for key %s yet - hedging", op->fqkey.c_str());
+    op->hedge_index = op->target_index;
+
+    if (_hedge_monitor != NULL)
+    {
+      _hedge_monitor->inform_hedge_sent();
+    }
+
+    send_hedged_get(op);
+  }
+
+  op->held = false;
+  release_hedged_get(op);
+}
+
+void TopologyNeutralMemcachedStore::release_hedged_get(AsyncOperation* op)
+{
+  if ((op->complete) && (op->outstanding == 0) && (!op->held))
+  {
+    delete op;
+  }
+}
+
+
+bool BaseMemcachedStore::can_retry_memcached_rc(memcached_return_t rc)
+{
+  return (!memcached_success(rc) &&
+          (rc != MEMCACHED_NOTFOUND) &&
+          (rc != MEMCACHED_NOTSTORED) &&
+          (rc != MEMCACHED_DATA_EXISTS) &&
+          (rc != MEMCACHED_E2BIG));
+}
+
+
+bool TopologyNeutralMemcachedStore::get_targets(std::vector<AddrInfo>& targets,
+                                                SAS::TrailId trail)
+{
+  // Resolve the Astaire domain into a list of potential targets.
+  _resolver->resolve(_target_domain, _attempts, targets, trail);
+  TRC_DEBUG("Found %d targets for %s", targets.size(), _target_domain.c_str());
+
+  if (targets.empty())
+  {
+    TRC_VERBOSE("No targets in domain %s - give up", _target_domain.c_str());
+    SAS::Event event(trail, SASEvent::MEMCACHED_NO_HOSTS, 0);
+    event.add_var_param(_target_domain);
+    SAS::report_event(event);
+
+    if (_comm_monitor != NULL)
+    {
+      _comm_monitor->inform_failure();
+    }
+
+    return false;
+  }
+
+  // Always try at least twice even if there is only one target.  This is
+  // because if we have a connection for which the server is no longer working,
+  // libmemcached will fail the request and only fixes the connection up
+  // asynchronously.
+  if (targets.size() == 1)
+  {
+    TRC_DEBUG("Duplicate target IP=%s, port= %d as it is the only target",
+              targets[0].address.to_string().c_str(),
+              targets[0].port);
+    targets.push_back(targets[0]);
+  }
+
+  return true;
+}
+
+
+//
+// TopologyAwareMemcachedStore methods
+//
+
+TopologyAwareMemcachedStore::
+TopologyAwareMemcachedStore(MemcachedConfigReader* config_reader,
+                            bool remote_store,
+                            BaseCommunicationMonitor* comm_monitor,
+                            const std::string& source_address) :
+  // Always use binary, as vbuckets need it.
+  BaseMemcachedStore(true, remote_store, comm_monitor, source_address),
+  _config_reader(config_reader),
+  _view(NUM_VBUCKETS, NUM_REPLICAS),
+  _replicas(std::make_shared<const Replicas>()),
+  _conn_pool(60, _options, remote_store),
+  _updater(NULL)
+{
+  // Create an updater to read the config now and on SIGHUP.
+  _updater = new Updater<void, TopologyAwareMemcachedStore>
+                   (this, std::mem_fun(&TopologyAwareMemcachedStore::update_config));
+}
+
+TopologyAwareMemcachedStore::~TopologyAwareMemcachedStore()
+{
+  delete _updater;
+  _updater = NULL;
+}
+
+void TopologyAwareMemcachedStore::update_config()
+{
+  MemcachedConfig config;
+
+  if (!_config_reader->read_config(config))
+  {
+    TRC_ERROR("Failed to read memcached config - keep the current view");
+    return;
+  }
+
+  // Only the updater calls this, so the view doesn't need a lock.
+  _view.update(config);
+
+  std::shared_ptr<Replicas> replicas(new Replicas());
+  replicas->tombstone_lifetime = config.tombstone_lifetime;
+
+  for (int ii = 0; ii < NUM_VBUCKETS; ++ii)
+  {
+    replicas->read[ii] = servers_to_targets(_view.read_replicas(ii));
+    replicas->write[ii] = servers_to_targets(_view.write_replicas(ii));
+  }
+
+  const std::map<int, MemcachedStoreView::ReplicaChange>& moves =
+    _view.calculate_vbucket_moves();
+
+  for (std::map<int, MemcachedStoreView::ReplicaChange>::const_iterator i = moves.begin();
+       i != moves.end();
+       ++i)
+  {
+    replicas->moving[i->first] = true;
+  }
+
+  TRC_STATUS("Memcached view updated: %d servers, %d vbuckets moving",
+             _view.servers().size(), moves.size());
+
+  _replicas.publish(replicas);
+}
+
+bool TopologyAwareMemcachedStore::has_servers()
+{
+  std::shared_ptr<const Replicas> replicas = get_replicas();
+  return ((!replicas->read.empty()) && (!replicas->read[0].empty()));
+}
+
+std::shared_ptr<const TopologyAwareMemcachedStore::Replicas>
+TopologyAwareMemcachedStore::get_replicas()
+{
+  return _replicas.get();
+}
+
+uint16_t TopologyAwareMemcachedStore::vbucket_for_key(const std::string& fqkey)
+{
+  // This must match the hashing used by the rest of the cluster, so that
+  // records written directly are found through the proxies and vice versa.
+  uint32_t hash = memcached_generate_hash_value(fqkey.data(),
+                                                fqkey.length(),
+                                                MEMCACHED_HASH_MD5);
+  return (uint16_t)(hash & (NUM_VBUCKETS - 1));
+}
+
+std::vector<AddrInfo> TopologyAwareMemcachedStore::servers_to_targets(
+                                         const std::vector<std::string>& servers)
+{
+  std::vector<AddrInfo> targets;
+
+  for (const std::string& server : servers)
+  {
+    std::string host;
+    AddrInfo target;
+
+    if ((Utils::split_host_port(server, host, target.port)) &&
+        (Utils::parse_ip_target(host, target.address)))
+    {
+      target.transport = IPPROTO_TCP;
+      targets.push_back(target);
+    }
+    else
+    {
+      TRC_ERROR("Invalid memcached server %s", server.c_str());
+    }
+  }
+
+  return targets;
+}
+
+Store::Status TopologyAwareMemcachedStore::get_data(const std::string& table,
+                                                    const std::string& key,
+                                                    std::string& data,
+                                                    uint64_t& cas,
+                                                    SAS::TrailId trail,
+                                                    bool log_body,
+                                                    Format data_format)
+{
+  Store::Buffer buffer;
+  Store::Status status = get_data(table, key, buffer, cas, trail, log_body, data_format);
+  data = buffer.to_string();
+  return status;
+}
+
+Store::Status TopologyAwareMemcachedStore::get_data(const std::string& table,
+                                                    const std::string& key,
+                                                    Store::Buffer& data,
+                                                    uint64_t& cas,
+                                                    SAS::TrailId trail,
+                                                    bool log_body,
+                                                    Format data_format)
+{
+  PROFILE_SPAN("memcached.get");
+  memcached_return_t rc = MEMCACHED_NO_SERVERS;
+  bool found_nothing = false;
+
+  TRC_DEBUG("Start GET from table %s for key %s", table.c_str(), key.c_str());
+
+  std::string fqkey = get_fq_key(table, key);
+  uint16_t vbucket = vbucket_for_key(fqkey);
+  std::shared_ptr<const Replicas> replicas = get_replicas();
+  const std::vector<AddrInfo>& targets = replicas->read[vbucket];
+
+  if (trail != 0)
+  {
+    SAS::Event start(trail, SASEvent::MEMCACHED_GET_START, 0);
+    start.add_var_param(fqkey);
+    SAS::report_event(start);
+  }
+
+  for (AddrInfo target : targets)
+  {
+    TRC_DEBUG("Try server IP %s, port %d (vbucket %d)",
+              target.address.to_string().c_str(),
+              target.port,
+              vbucket);
+    SAS::Event attempt(trail, SASEvent::MEMCACHED_TRY_HOST, 0);
+    attempt.add_var_param(target.address.to_string());
+    attempt.add_static_param(target.port);
+    SAS::report_event(attempt);
+
+    ConnectionHandle<memcached_st*> conn = _conn_pool.get_connection(target);
+
+    if (!conn.is_valid())
+    {
+      // No connection came free in time - try the next replica.
+      rc = MEMCACHED_TIMEOUT;
+      continue;
+    }
+
+    rc = get_from_replica(conn.get_connection(),
+                          fqkey.data(),
+                          fqkey.length(),
+                          data,
+                          cas);
+
+    if (memcached_success(rc))
+    {
+      break;
+    }
+    else if (rc == MEMCACHED_NOTFOUND)
+    {
+      // A replica that isn't moving has all the vbucket's records, so this is
+      // definitive.  Otherwise carry on, and return NOT_FOUND if no other
+      // replica has the record.
+      found_nothing = true;
+
+      if (!replicas->moving[vbucket])
+      {
+        break;
+      }
+    }
+  }
+
+  if ((!memcached_success(rc)) && (found_nothing))
+  {
+    rc = MEMCACHED_NOTFOUND;
+  }
+
+  Store::Status status = get_status(fqkey, rc, data, cas, trail, log_body, data_format);
+  record_get_result(rc, targets);
+
+  return status;
+}
+
+Store::Status TopologyAwareMemcachedStore::set_data(const std::string& table,
+                                                    const std::string& key,
+                                                    const std::string& data,
+                                                    uint64_t cas,
+                                                    int expiry,
+                                                    SAS::TrailId trail,
+                                                    bool log_body,
+                                                    Store::Format data_format)
+{
+  PROFILE_SPAN("memcached.set");
+  TRC_DEBUG("Writing %d bytes to table %s key %s, CAS = %ld, expiry = %d",
+            data.length(), table.c_str(), key.c_str(), cas, expiry);
+
+  std::string fqkey = get_fq_key(table, key);
+
+  if (!start_set(fqkey, data, cas, expiry, trail, log_body, data_format))
+  {
+    return Store::Status::ERROR;
+  }
+
+  uint16_t vbucket = vbucket_for_key(fqkey);
+  std::shared_ptr<const Replicas> replicas = get_replicas();
+  const std::vector<AddrInfo>& targets = replicas->write[vbucket];
+  time_t memcached_expiration = get_memcached_expiration(expiry);
+  memcached_return_t rc = MEMCACHED_NO_SERVERS;
+  size_t primary;
+
+  // Write to the first replica that gives a definitive answer, with the CAS
+  // check (or adding the record, overwriting any tombstone, if the CAS is
+  // zero).
+  for (primary = 0; primary < targets.size(); ++primary)
+  {
+    ConnectionHandle<memcached_st*> conn = _conn_pool.get_connection(targets[primary]);
+
+    if (!conn.is_valid())
+    {
+      // No connection came free in time - try the next replica.
+      rc = MEMCACHED_TIMEOUT;
+      continue;
+    }
+
+    if (cas == 0)
+    {
+      rc = add_overwriting_tombstone(conn.get_connection(),
+                                     fqkey.data(),
+                                     fqkey.length(),
+                                     vbucket,
+                                     data,
+                                     memcached_expiration,
+                                     0,
+                                     trail);
+    }
+    else
+    {
+      CW_IO_STARTS("Memcached CAS for " + fqkey)
+      {
+        rc = memcached_cas_vb(conn.get_connection(),
+                              fqkey.data(),
+                              fqkey.length(),
+                              vbucket,
+                              data.data(),
+                              data.length(),
+                              memcached_expiration,
+                              0,
+                              cas);
+      }
+      CW_IO_COMPLETES()
+    }
+
+    if ((memcached_success(rc)) || (!can_retry_memcached_rc(rc)))
+    {
+      break;
+    }
+
+    TRC_DEBUG("Write to replica %s failed, rc = %d",
+              targets[primary].address_and_port_to_string().c_str(), rc);
+  }
+
+  if (memcached_success(rc))
+  {
+    // Copy the record to the rest of the replicas.  Failures here don't fail
+    // the write, as the primary has it.
+    std::vector<AddrInfo> backups(targets.begin() + primary + 1, targets.end());
+
+    write_to_replicas(backups, trail,
+                      [&](ConnectionHandle<memcached_st*>& conn_handle) {
+      memcached_return_t rc;
+
+      CW_IO_STARTS("Memcached SET for " + fqkey)
+      {
+        rc = memcached_set_vb(conn_handle.get_connection(),
+                              fqkey.data(),
+                              fqkey.length(),
+                              vbucket,
+                              data.data(),
+                              data.length(),
+                              memcached_expiration,
+                              0);
+      }
+      CW_IO_COMPLETES()
+
+      return rc;
+    });
+  }
+
+  return set_status(fqkey, rc, targets, trail);
+}
+
+Store::Status TopologyAwareMemcachedStore::set_data_without_cas(const std::string& table,
+                                                                const std::string& key,
+                                                                const std::string& data,
+                                                                int expiry,
+                                                                SAS::TrailId trail,
+                                                                bool log_body,
+                                                                Store::Format data_format)
+{
+  PROFILE_SPAN("memcached.set");
+  TRC_DEBUG("Writing %d bytes to table %s key %s, expiry = %d",
+            data.length(), table.c_str(), key.c_str(), expiry);
+
+  std::string fqkey = get_fq_key(table, key);
+
+  if (trail != 0)
+  {
+    int event;
+
+    if (log_body)
+    {
+      event = SASEvent::MEMCACHED_SET_WITHOUT_CAS_START;
+    }
+    else
+    {
+      event = SASEvent::MEMCACHED_SET_WITHOUT_DATA_OR_CAS_START;
+    }
+
+    SAS::Event start(trail, event, 0);
+    start.add_var_param(fqkey);
+    start.add_static_param(expiry);
+
+    if (log_body)
+    {
+      start.add_var_param(data);
+      start.add_static_param(data_format);
+    }
+
+    SAS::report_event(start);
+  }
+
+  uint16_t vbucket = vbucket_for_key(fqkey);
+  std::shared_ptr<const Replicas> replicas = get_replicas();
+  const std::vector<AddrInfo>& targets = replicas->write[vbucket];
+  time_t memcached_expiration = get_memcached_expiration(expiry);
+
+  memcached_return_t rc = write_to_replicas(targets, trail,
+                                            [&](ConnectionHandle<memcached_st*>& conn_handle) {
+    memcached_return_t rc;
+
+    CW_IO_STARTS("Memcached SET for " + fqkey)
+    {
+      rc = memcached_set_vb(conn_handle.get_connection(),
+                            fqkey.data(),
+                            fqkey.length(),
+                            vbucket,
+                            data.data(),
+                            data.length(),
+                            memcached_expiration,
+                            0);
+    }
+    CW_IO_COMPLETES()
+
+    return rc;
+  });
+
+  return set_status(fqkey, rc, targets, trail);
+}
+
+Store::Status TopologyAwareMemcachedStore::delete_data(const std::string& table,
+                                                       const std::string& key,
+                                                       SAS::TrailId trail)
+{
+  TRC_DEBUG("Deleting key %s from table %s", key.c_str(), table.c_str());
+
+  std::string fqkey = get_fq_key(table, key);
+  uint16_t vbucket = vbucket_for_key(fqkey);
+  std::shared_ptr<const Replicas> replicas = get_replicas();
+  const std::vector<AddrInfo>& targets = replicas->write[vbucket];
+  int tombstone_lifetime = replicas->tombstone_lifetime;
+
+  SAS::Event event(trail, SASEvent::MEMCACHED_DELETE, 0);
+  event.add_var_param(fqkey);
+
+  if (tombstone_lifetime != 0)
+  {
+    event.add_static_param(tombstone_lifetime);
+  }
+
+  SAS::report_event(event);
+
+  // Delete the record from (or write a tombstone to) each replica.
+  memcached_return_t rc = write_to_replicas(targets, trail,
+                                            [&](ConnectionHandle<memcached_st*>& conn_handle) {
+    memcached_return_t rc;
+
+    if (tombstone_lifetime == 0)
+    {
+      CW_IO_STARTS("Memcached DELETE for " + fqkey)
+      {
+        rc = memcached_delete(conn_handle.get_connection(), fqkey.data(), fqkey.length(), 0);
+      }
+      CW_IO_COMPLETES()
+    }
+    else
+    {
+      CW_IO_STARTS("Memcached SET for " + fqkey)
+      {
+        rc = memcached_set_vb(conn_handle.get_connection(),
+                              fqkey.data(),
+                              fqkey.length(),
+                              vbucket,
+                              TOMBSTONE.data(),
+                              TOMBSTONE.length(),
+                              tombstone_lifetime,
+                              0);
+      }
+      CW_IO_COMPLETES()
+    }
+
+    return rc;
+  });
+
+  if (memcached_success(rc))
+  {
+    return Store::Status::OK;
+  }
+
+  if (trail != 0)
+  {
+    SAS::Event event(trail, SASEvent::MEMCACHED_DELETE_FAILURE, 0);
+    event.add_var_param(fqkey);
+    event.add_var_param(memcached_strerror(NULL, rc));
+    SAS::report_event(event);
+  }
+
+  TRC_INFO("Delete for %s failed with error %s", fqkey.c_str(), memcached_strerror(NULL, rc));
+  log_targets(targets);
+
+  return Store::Status::ERROR;
+}
+
+memcached_return_t TopologyAwareMemcachedStore::write_to_replicas(
+                                          const std::vector<AddrInfo>& replicas,
+                                          SAS::TrailId trail,
+                                          memcached_func fn)
+{
+  memcached_return_t rc = MEMCACHED_NO_SERVERS;
+  bool succeeded = false;
+
+  for (AddrInfo target : replicas)
+  {
+    TRC_DEBUG("Write to server IP %s, port %d",
+              target.address.to_string().c_str(),
+              target.port);
+    SAS::Event attempt(trail, SASEvent::MEMCACHED_TRY_HOST, 0);
+    attempt.add_var_param(target.address.to_string());
+    attempt.add_static_param(target.port);
+    SAS::report_event(attempt);
+
+    ConnectionHandle<memcached_st*> conn = _conn_pool.get_connection(target);
+    memcached_return_t replica_rc = conn.is_valid() ? fn(conn) : MEMCACHED_TIMEOUT;
+
+    if (memcached_success(replica_rc))
+    {
+      succeeded = true;
+      rc = replica_rc;
+    }
+    else
+    {
+      TRC_DEBUG("Write to replica %s failed, rc = %d",
+                target.address_and_port_to_string().c_str(), replica_rc);
+
+      if (!succeeded)
+      {
+        rc = replica_rc;
+      }
+    }
+  }
+
+  return rc;
 }
@@ -30,7 +30,12 @@ MemcachedStoreView::MemcachedStoreView(int vbuckets, int replicas) :
   _replicas(replicas),
   _vbuckets(vbuckets),
   _read_set(vbuckets),
-  _write_set(vbuckets)
+  _write_set(vbuckets),
+  _read_ids(vbuckets),
+  _write_ids(vbuckets),
+  _current_ids(vbuckets),
+  _new_ids(vbuckets),
+  _updated(false)
 {
 }
 
@@ -50,76 +55,94 @@ std::vector<std::string> MemcachedStoreView::merge_servers(const std::vector<std
   return ret;
 }
 
-std::vector<std::string> MemcachedStoreView::
-  server_ids_to_names(const std::vector<int>& ids,
-                      const std::vector<std::string>& lookup_table)
+std::vector<int> MemcachedStoreView::intern_servers(const std::vector<std::string>& servers)
 {
-  std::vector<std::string> names;
+  std::vector<int> ids;
+  ids.reserve(servers.size());
 
-  for (std::vector<int>::const_iterator it = ids.begin();
-       it != ids.end();
+  for (std::vector<std::string>::const_iterator it = servers.begin();
+       it != servers.end();
        ++it)
   {
-    names.push_back(lookup_table[*it]);
+    std::map<std::string, int>::const_iterator id = _server_ids.find(*it);
+
+    if (id != _server_ids.end())
+    {
+      ids.push_back(id->second);
+    }
+    else
+    {
+      int new_id = _server_names.size();
+      _server_names.push_back(*it);
+      _server_ids[*it] = new_id;
+      ids.push_back(new_id);
+    }
   }
 
-  return names;
+  return ids;
 }
 
-void MemcachedStoreView::generate_ring_from_stable_servers()
+const std::vector<std::vector<int> >& MemcachedStoreView::ring_nodes(int nodes,
+                                                                     int replicas)
 {
-    // Only need to generate a single ring.
+  std::pair<int, int> key(nodes, replicas);
+  std::map<std::pair<int, int>, std::vector<std::vector<int> > >::iterator it =
+    _ring_nodes.find(key);
+
+  if (it == _ring_nodes.end())
+  {
+    TRC_DEBUG("Generate ring for %d nodes and %d replicas", nodes, replicas);
     Ring ring(_vbuckets);
-    ring.update(_servers.size());
+    ring.update(nodes);
 
-    int replicas = _replicas;
-    if (replicas > (int)_servers.size())
-    {
-      // Not enough servers for the required level of replication.
-      replicas = _servers.size();
-    }
+    std::vector<std::vector<int> > vbucket_nodes(_vbuckets);
 
-    // Generate the read and write replica sets from the rings.
     for (int ii = 0; ii < _vbuckets; ++ii)
     {
-      std::vector<int> server_indexes = ring.get_nodes(ii, replicas);
-      for (size_t jj = 0; jj < server_indexes.size(); jj++)
-      {
-        int idx = server_indexes[jj];
-        _read_set[ii].push_back(_servers[idx]);
-      }
-      _write_set[ii] = _read_set[ii];
-
-      // There is no resize in progress, so the current replicas is the same as
-      // the read set.
-      _current_replicas[ii] = _read_set[ii];
+      vbucket_nodes[ii] = ring.get_nodes(ii, replicas);
     }
 
+    it = _ring_nodes.insert(std::make_pair(key, vbucket_nodes)).first;
+  }
+
+  return it->second;
 }
 
-/// Updates the view for new current and target server lists.
-void MemcachedStoreView::update(const MemcachedConfig& config)
+bool MemcachedStoreView::set_replicas(std::vector<int>& ids,
+                                      ReplicaList& names,
+                                      const std::vector<int>& new_ids)
 {
-  // Clear out any state from the old view.
-  _changes.clear();
-  _current_replicas.clear();
-  _new_replicas.clear();
+  if ((ids == new_ids) && (names.size() == ids.size()))
+  {
+    return false;
+  }
 
-  for (int ii = 0; ii < _vbuckets; ++ii)
+  ids = new_ids;
+  names.clear();
+
+  for (std::vector<int>::const_iterator it = ids.begin(); it != ids.end(); ++it)
   {
-    _read_set[ii].clear();
-    _write_set[ii].clear();
+    names.push_back(_server_names[*it]);
   }
 
-  // Generate the appropriate rings and the resulting vbuckets arrays.
+  return true;
+}
+
+/// Updates the view for new current and target server lists.  Only the
+/// vbuckets whose replicas change are updated.
+void MemcachedStoreView::update(const MemcachedConfig& config)
+{
+  // Work out which servers own the vbuckets now, and whether they're moving
+  // to other servers.
+  const std::vector<std::string>* current_servers = &config.servers;
+  bool resizing = false;
+
   if (config.new_servers.empty())
   {
     // Stable configuration.
     TRC_DEBUG("View is stable with %d nodes", config.servers.size());
     CL_MEMCACHED_CLUSTER_UPDATE_STABLE.log(config.servers.size(),
                                            config.filename.c_str());
-    _servers = config.servers;
-    generate_ring_from_stable_servers();
   }
   else if (config.servers.empty())
   {
@@ -128,8 +151,7 @@ void MemcachedStoreView::update(const MemcachedConfig& config)
     CL_MEMCACHED_CLUSTER_UPDATE_RESIZE.log(0,
                                            config.new_servers.size(),
                                            config.filename.c_str());
-    _servers = config.new_servers;
-    generate_ring_from_stable_servers();
+    current_servers = &config.new_servers;
   }
   else
   {
@@ -139,52 +161,105 @@ void MemcachedStoreView::update(const MemcachedConfig& config)
     CL_MEMCACHED_CLUSTER_UPDATE_RESIZE.log(config.servers.size(),
                                            config.new_servers.size(),
                                            config.filename.c_str());
+    resizing = true;
+  }
 
-    // _servers should contain all the servers we might want to store
-    // data on, so combine the old and new server lists, removing any overlap.
-    _servers = merge_servers(config.servers, config.new_servers);
+  if ((_updated) &&
+      (config.servers == _config_servers) &&
+      (config.new_servers == _config_new_servers))
+  {
+    TRC_DEBUG("Servers are unchanged, so the view is unchanged");
+    return;
+  }
 
-    // Calculate the two rings needed to generate the vbucket replica sets
-    Ring current_ring(_vbuckets);
-    current_ring.update(config.servers.size());
-    Ring new_ring(_vbuckets);
-    new_ring.update(config.new_servers.size());
+  _updated = true;
+  _config_servers = config.servers;
+  _config_new_servers = config.new_servers;
+
+  // _servers should contain all the servers we might want to store data on,
+  // so when resizing combine the old and new server lists, removing any
+  // overlap.
+  _servers = resizing ?
+               merge_servers(config.servers, config.new_servers) :
+               *current_servers;
+
+  std::vector<int> current_ids = intern_servers(*current_servers);
+  std::vector<int> new_ids = resizing ?
+                               intern_servers(config.new_servers) :
+                               std::vector<int>();
+
+  // In a stable configuration there may not be enough servers for the
+  // required level of replication.  When resizing, the rings fill any missing
+  // replicas with the first node.
+  std::pair<int, int> current_key(current_servers->size(),
+                                  resizing ?
+                                    _replicas :
+                                    std::min(_replicas, (int)current_servers->size()));
+  std::pair<int, int> new_key(config.new_servers.size(), _replicas);
+
+  const std::vector<std::vector<int> >& current_ring =
+    ring_nodes(current_key.first, current_key.second);
+  const std::vector<std::vector<int> >* new_ring =
+    resizing ? &ring_nodes(new_key.first, new_key.second) : NULL;
+
+  int changed_vbuckets = 0;
+  std::vector<int> current_nodes;
+  std::vector<int> new_nodes;
+  std::vector<int> replica_set;
 
-    for (int ii = 0; ii < _vbuckets; ++ii)
+  for (int ii = 0; ii < _vbuckets; ++ii)
+  {
+    current_nodes.clear();
+
+    for (size_t jj = 0; jj < current_ring[ii].size(); ++jj)
+    {
+      current_nodes.push_back(current_ids[current_ring[ii][jj]]);
+    }
+
+    bool changed = set_replicas(_current_ids[ii], _current_replicas[ii], current_nodes);
+
+    if (!resizing)
     {
-      // Keep track of which nodes are in the replica sets to avoid duplicates.
-      std::map<std::string, bool> in_set;
-
-      // Calculate the read and write replica sets for this bucket for both
-      // current and target node sets.
-      std::vector<std::string> current_nodes =
-        server_ids_to_names(current_ring.get_nodes(ii, _replicas),
-                            config.servers);
-      std::vector<std::string> new_nodes =
-        server_ids_to_names(new_ring.get_nodes(ii, _replicas),
-                            config.new_servers);
-
-      // Firstly, store off the replicas for this vbucket.
-      _current_replicas[ii] = current_nodes;
-      _new_replicas[ii] = new_nodes;
-
-      // Determine if the set of nodes has changed by sorting the above two
-      // vectors and comparing.
-      std::vector<std::string> current_nodes_sorted = current_nodes;
-      std::vector<std::string> new_nodes_sorted = new_nodes;
-      std::sort(current_nodes_sorted.begin(), current_nodes_sorted.end());
-      std::sort(new_nodes_sorted.begin(), new_nodes_sorted.end());
-
-      if (current_nodes_sorted != new_nodes_sorted)
+      // There is no resize in progress, so the current replicas are the read
+      // and write sets.
+      if (!_new_ids[ii].empty())
+      {
+        _new_ids[ii].clear();
+        _new_replicas.erase(ii);
+        _changes.erase(ii);
+        changed = true;
+      }
+
+      replica_set = current_nodes;
+    }
+    else
+    {
+      new_nodes.clear();
+
+      for (size_t jj = 0; jj < (*new_ring)[ii].size(); ++jj)
+      {
+        new_nodes.push_back(new_ids[(*new_ring)[ii][jj]]);
+      }
+
+      changed = set_replicas(_new_ids[ii], _new_replicas[ii], new_nodes) || changed;
+
+      if (changed)
       {
-        // Lists are different, add an entry to _changes to indicate this.
-        //
-        // Build the structure from the inside out (build both replica lists,
-        // create a pair from them then add to the _changes map under the
-        // vbucket index.
-        std::pair<std::vector<std::string>, std::vector<std::string>>
-          change_entry(current_nodes, new_nodes);
-        _changes[ii] = change_entry;
+        // Determine if the set of nodes is moving by sorting the two lists
+        // and comparing.
+        std::vector<int> current_nodes_sorted = current_nodes;
+        std::vector<int> new_nodes_sorted = new_nodes;
+        std::sort(current_nodes_sorted.begin(), current_nodes_sorted.end());
+        std::sort(new_nodes_sorted.begin(), new_nodes_sorted.end());
+
+        if (current_nodes_sorted != new_nodes_sorted)
+        {
+          _changes[ii] = ReplicaChange(_current_replicas[ii], _new_replicas[ii]);
+        }
+        else
+        {
+          _changes.erase(ii);
+        }
       }
 
       // The read and write replicas both consist of all the current primary,
@@ -199,37 +274,56 @@ void MemcachedStoreView::update(const MemcachedConfig& config)
       // This means that we do up to twice as many writes when scaling up/down.
       // This isn't really an issue because scaling is fast now that we have
       // Astaire.
-      std::string server = current_nodes[0];
-      _read_set[ii].push_back(server);
-      _write_set[ii].push_back(server);
-      in_set[server] = true;
+      replica_set.clear();
+      replica_set.push_back(current_nodes[0]);
 
       for (int jj = 0; jj < _replicas; ++jj)
       {
-        std::string server = new_nodes[jj];
-        if (!in_set[server])
+        if (std::find(replica_set.begin(), replica_set.end(), new_nodes[jj]) ==
+            replica_set.end())
         {
-          _read_set[ii].push_back(server);
-          _write_set[ii].push_back(server);
-          in_set[server] = true;
+          replica_set.push_back(new_nodes[jj]);
         }
       }
 
       for (int jj = 1; jj < _replicas; ++jj)
       {
-        std::string server = current_nodes[jj];
-        if (!in_set[server])
+        if (std::find(replica_set.begin(), replica_set.end(), current_nodes[jj]) ==
+            replica_set.end())
         {
-          _read_set[ii].push_back(server);
-          _write_set[ii].push_back(server);
-          in_set[server] = true;
+          replica_set.push_back(current_nodes[jj]);
         }
       }
+    }
+
+    changed = set_replicas(_read_ids[ii], _read_set[ii], replica_set) || changed;
+    changed = set_replicas(_write_ids[ii], _write_set[ii], replica_set) || changed;
 
+    if (changed)
+    {
+      ++changed_vbuckets;
     }
   }
 
-  if (!(config.servers.empty() && config.new_servers.empty()))
+  // Only keep the rings that this view uses.
+  for (std::map<std::pair<int, int>, std::vector<std::vector<int> > >::iterator it =
+         _ring_nodes.begin();
+       it != _ring_nodes.end();)
+  {
+    if ((it->first == current_key) || ((resizing) && (it->first == new_key)))
+    {
+      ++it;
+    }
+    else
+    {
+      _ring_nodes.erase(it++);
+    }
+  }
+
+  TRC_DEBUG("%d of %d vbuckets changed", changed_vbuckets, _vbuckets);
+
+  if ((changed_vbuckets > 0) &&
+      (!(config.servers.empty() && config.new_servers.empty())))
   {
     TRC_DEBUG("New view -\n%s", view_to_string().c_str());
   }
@@ -0,0 +1,138 @@
+/**
+ * @file memory_accounting.cpp  Counts the memory used by each subsystem.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <new>
+
+#include "memory_accounting.h"
+
+const char* const MemoryAccount::DNS_CACHE = "dns_cache";
+const char* const MemoryAccount::TTL_CACHE = "ttl_cache";
+const char* const MemoryAccount::CONNECTION_POOL = "connection_pool";
+const char* const MemoryAccount::RAM_RECORDER = "ram_recorder";
+const char* const MemoryAccount::SNMP_ROWS = "snmp_rows";
+const char* const MemoryAccount::HTTP_REQUESTS = "http_requests";
+
+// The accounts.  Subsystems look theirs up once and keep the pointer, so
+// this is only locked when an account is first used.  It is never freed, as
+// accounts may be charged while the process exits.
+static pthread_mutex_t accounts_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<MemoryAccount*>* accounts = NULL;
+
+const int MemoryAccount::NUM_SHARDS;
+
+MemoryAccount::MemoryAccount(const std::string& name) :
+  _name(name),
+  _shards(NULL),
+  _peak_bytes(0)
+{
+  void* memory;
+  if (posix_memalign(&memory, CACHE_LINE_SIZE, NUM_SHARDS * sizeof(Shard)) != 0)
+  {
+    throw std::bad_alloc(); // LCOV_EXCL_LINE
+  }
+
+  _shards = (Shard*)memory;
+
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    Shard* shard = new (&_shards[ii]) Shard();
+    shard->bytes = 0;
+    shard->objects = 0;
+  }
+}
+
+int MemoryAccount::next_shard_index()
+{
+  static std::atomic<unsigned int> next_index(0);
+  return next_index++ % NUM_SHARDS;
+}
+
+MemoryAccount* MemoryAccount::get(const std::string& name)
+{
+  MemoryAccount* account = NULL;
+
+  pthread_mutex_lock(&accounts_lock);
+
+  if (accounts == NULL)
+  {
+    accounts = new std::vector<MemoryAccount*>();
+  }
+
+  for (std::vector<MemoryAccount*>::const_iterator it = accounts->begin();
+       it != accounts->end();
+       ++it)
+  {
+    if ((*it)->name() == name)
+    {
+      account = *it;
+      break;
+    }
+  }
+
+  if (account == NULL)
+  {
+    account = new MemoryAccount(name);
+    accounts->push_back(account);
+  }
+
+  pthread_mutex_unlock(&accounts_lock);
+
+  return account;
+}
+
+std::vector<MemoryAccount::Snapshot> MemoryAccount::snapshot_all()
+{
+  std::vector<Snapshot> snapshots;
+
+  pthread_mutex_lock(&accounts_lock);
+
+  if (accounts != NULL)
+  {
+    for (std::vector<MemoryAccount*>::const_iterator it = accounts->begin();
+         it != accounts->end();
+         ++it)
+    {
+      snapshots.push_back((*it)->snapshot());
+    }
+  }
+
+  pthread_mutex_unlock(&accounts_lock);
+
+  return snapshots;
+}
+
+MemoryAccount::Snapshot MemoryAccount::snapshot() const
+{
+  Snapshot snapshot;
+  snapshot.name = _name;
+  snapshot.bytes = 0;
+  snapshot.objects = 0;
+
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    snapshot.bytes += _shards[ii].bytes.load(std::memory_order_relaxed);
+    snapshot.objects += _shards[ii].objects.load(std::memory_order_relaxed);
+  }
+
+  int64_t peak = _peak_bytes.load(std::memory_order_relaxed);
+
+  while ((snapshot.bytes > peak) &&
+         (!_peak_bytes.compare_exchange_weak(peak, snapshot.bytes, std::memory_order_relaxed)))
+  {
+  }
+
+  snapshot.peak_bytes = std::max(peak, snapshot.bytes);
+  return snapshot;
+}
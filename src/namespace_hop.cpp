@@ -15,6 +15,8 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <unistd.h>
+#include <algorithm>
 #include <string>
 
 #include "namespace_hop.h"
@@ -118,6 +120,7 @@ int create_connection_in_namespace(const char* host,
               err,
               err,
               strerror(err));
+    close(fd);
     return -1;
   }
 
@@ -129,10 +132,15 @@ int create_connection_in_namespace(const char* host,
               target.c_str(),
               socket_factory_path,
               strerror(errno));
+    close(fd);
     return -2;
   }
 
-  return recv_file_descriptor(fd);
+  // The factory only handles one request per connection, so close it once
+  // we've got the new socket.
+  int new_fd = recv_file_descriptor(fd);
+  close(fd);
+  return new_fd;
 }
 
 
@@ -151,3 +159,290 @@ int create_connection_in_management_namespace(const char* host,
                                         port,
                                         "/tmp/clearwater_management_namespace_socket");
 }
+
+const int NamespaceConnectionPool::MAX_IDLE_S;
+const int NamespaceConnectionPool::RETRY_INTERVAL_MS;
+
+static uint64_t now_ms()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((uint64_t)now.tv_sec * 1000) + (now.tv_nsec / 1000000);
+}
+
+// Returns whether a pooled connection can still be used - i.e. the far end
+// hasn't closed it and it hasn't errored.
+static bool connection_usable(int fd)
+{
+  char c;
+  ssize_t rc = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  return ((rc > 0) ||
+          ((rc < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))));
+}
+
+NamespaceConnectionPool::NamespaceConnectionPool(const std::string& socket_factory_path,
+                                                 int connections_per_target) :
+  _socket_factory_path(socket_factory_path),
+  _connections_per_target(std::max(connections_per_target, 1)),
+  _targets(),
+  _async_requests(),
+  _terminated(false)
+{
+  pthread_mutex_init(&_lock, NULL);
+
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  pthread_create(&_background_thread, NULL, background_thread_fn, this);
+}
+
+NamespaceConnectionPool::~NamespaceConnectionPool()
+{
+  pthread_mutex_lock(&_lock);
+  _terminated = true;
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_lock);
+  pthread_join(_background_thread, NULL);
+
+  for (std::map<std::string, Target>::iterator it = _targets.begin();
+       it != _targets.end();
+       ++it)
+  {
+    close_connections(it->second.connections);
+  }
+
+  // Fail any async requests that haven't been handled.
+  for (std::deque<AsyncRequest>::iterator it = _async_requests.begin();
+       it != _async_requests.end();
+       ++it)
+  {
+    it->callback(-1);
+  }
+
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+void NamespaceConnectionPool::add_target(const std::string& host,
+                                         const std::string& port)
+{
+  pthread_mutex_lock(&_lock);
+  _targets[host + ":" + port];
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_lock);
+}
+
+void NamespaceConnectionPool::remove_target(const std::string& host,
+                                            const std::string& port)
+{
+  pthread_mutex_lock(&_lock);
+  std::map<std::string, Target>::iterator it = _targets.find(host + ":" + port);
+
+  if (it != _targets.end())
+  {
+    close_connections(it->second.connections);
+    _targets.erase(it);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+int NamespaceConnectionPool::get_connection(const std::string& host,
+                                            const std::string& port)
+{
+  pthread_mutex_lock(&_lock);
+  int fd = take_pooled_connection(host + ":" + port);
+  pthread_mutex_unlock(&_lock);
+
+  if (fd < 0)
+  {
+    TRC_DEBUG("No pooled connection to %s:%s", host.c_str(), port.c_str());
+    fd = connect(host, port);
+  }
+
+  return fd;
+}
+
+void NamespaceConnectionPool::get_connection_async(const std::string& host,
+                                                   const std::string& port,
+                                                   Callback callback)
+{
+  pthread_mutex_lock(&_lock);
+  int fd = take_pooled_connection(host + ":" + port);
+
+  if (fd < 0)
+  {
+    AsyncRequest request;
+    request.host = host;
+    request.port = port;
+    request.callback = callback;
+    _async_requests.push_back(request);
+    pthread_cond_signal(&_cond);
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  if (fd >= 0)
+  {
+    callback(fd);
+  }
+}
+
+int NamespaceConnectionPool::take_pooled_connection(const std::string& key)
+{
+  std::map<std::string, Target>::iterator it = _targets.find(key);
+
+  if (it == _targets.end())
+  {
+    return -1;
+  }
+
+  std::deque<PooledConnection>& connections = it->second.connections;
+  int fd = -1;
+
+  // Take the newest connections first, as they're the least likely to have
+  // been closed.
+  while ((fd < 0) && (!connections.empty()))
+  {
+    fd = connections.back().fd;
+    connections.pop_back();
+
+    if (!connection_usable(fd))
+    {
+      TRC_DEBUG("Pooled connection to %s has been closed", key.c_str());
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  // Get the background thread to top the pool up again.
+  pthread_cond_signal(&_cond);
+
+  return fd;
+}
+
+void NamespaceConnectionPool::close_connections(std::deque<PooledConnection>& connections)
+{
+  for (std::deque<PooledConnection>::iterator it = connections.begin();
+       it != connections.end();
+       ++it)
+  {
+    close(it->fd);
+  }
+
+  connections.clear();
+}
+
+int NamespaceConnectionPool::connect(const std::string& host,
+                                     const std::string& port)
+{
+  return create_connection_in_namespace(host.c_str(),
+                                        port.c_str(),
+                                        _socket_factory_path.c_str());
+}
+
+void* NamespaceConnectionPool::background_thread_fn(void* pool)
+{
+  ((NamespaceConnectionPool*)pool)->background_thread_fn();
+  return NULL;
+}
+
+void NamespaceConnectionPool::background_thread_fn()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (!_terminated)
+  {
+    bool busy = false;
+
+    if (!_async_requests.empty())
+    {
+      AsyncRequest request = _async_requests.front();
+      _async_requests.pop_front();
+
+      pthread_mutex_unlock(&_lock);
+      request.callback(connect(request.host, request.port));
+      pthread_mutex_lock(&_lock);
+
+      busy = true;
+    }
+    else
+    {
+      // Make at most one connection per pass, so that async requests aren't
+      // held up by refilling the pools.
+      time_t now = time(NULL);
+      uint64_t now_time_ms = now_ms();
+      std::string refill_key;
+
+      for (std::map<std::string, Target>::iterator it = _targets.begin();
+           it != _targets.end();
+           ++it)
+      {
+        Target& target = it->second;
+
+        // The oldest connections are at the front.
+        while ((!target.connections.empty()) &&
+               (now - target.connections.front().opened >= MAX_IDLE_S))
+        {
+          close(target.connections.front().fd);
+          target.connections.pop_front();
+        }
+
+        if ((target.connections.size() < _connections_per_target) &&
+            (now_time_ms >= target.retry_after_ms))
+        {
+          refill_key = it->first;
+          break;
+        }
+      }
+
+      if (!refill_key.empty())
+      {
+        size_t colon = refill_key.rfind(':');
+
+        pthread_mutex_unlock(&_lock);
+        int fd = connect(refill_key.substr(0, colon), refill_key.substr(colon + 1));
+        pthread_mutex_lock(&_lock);
+
+        // The target may have been removed while we weren't holding the lock.
+        std::map<std::string, Target>::iterator it = _targets.find(refill_key);
+
+        if (it == _targets.end())
+        {
+          if (fd >= 0)
+          {
+            close(fd);
+          }
+        }
+        else if (fd >= 0)
+        {
+          PooledConnection connection = {fd, time(NULL)};
+          it->second.connections.push_back(connection);
+        }
+        else
+        {
+          TRC_DEBUG("Failed to pool a connection to %s - retry in %dms",
+                    refill_key.c_str(), RETRY_INTERVAL_MS);
+          it->second.retry_after_ms = now_ms() + RETRY_INTERVAL_MS;
+        }
+
+        busy = true;
+      }
+    }
+
+    if ((!busy) && (!_terminated))
+    {
+      // Wake up periodically to replace idle connections and retry failed
+      // targets.
+      struct timespec end_wait;
+      clock_gettime(CLOCK_MONOTONIC, &end_wait);
+      end_wait.tv_sec += 1;
+      pthread_cond_timedwait(&_cond, &_lock, &end_wait);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
@@ -0,0 +1,322 @@
+/**
+ * @file pdlog.cpp Rate limiting and background emission of PDLogs
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <pthread.h>
+#include <time.h>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "pdlog.h"
+
+namespace
+{
+  // The most logs that can be waiting for the emitter.  Any more are
+  // suppressed.
+  const size_t MAX_QUEUED_LOGS = 1000;
+
+  // The state of a log id.
+  struct LogIdState
+  {
+    LogIdState() :
+      has_limits(false),
+      limits(),
+      tokens(-1),
+      last_refill_ms(0),
+      severity(LOG_ERR),
+      suppressed(0),
+      suppressed_since_summary(0)
+    {}
+
+    bool has_limits;
+    PDLogBase::Limits limits;
+
+    // The token bucket.  A negative count means it hasn't been filled yet.
+    double tokens;
+    uint64_t last_refill_ms;
+
+    int severity;
+    uint64_t suppressed;
+    uint64_t suppressed_since_summary;
+  };
+
+  // A log waiting to be written by the emitter.
+  struct QueuedLog
+  {
+    int log_id;
+    int severity;
+    std::string text;
+  };
+
+  // Everything is protected by this lock.  Logs are rare outside a failure
+  // storm, and during one most are rejected by the token bucket, so a single
+  // lock is cheap enough.
+  pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  PDLogBase::Limits default_limits;
+  std::map<int, LogIdState> states;
+
+  bool emitter_running = false;
+  bool emitter_terminated = false;
+  unsigned int summary_interval_s = 60;
+  pthread_t emitter_thread;
+  pthread_cond_t emitter_cond;
+  std::deque<QueuedLog> queue;
+
+  uint64_t now_ms()
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000) + (now.tv_nsec / 1000000);
+  }
+
+  // Logs a summary of the log ids that have been suppressed since the last
+  // summary.  Must be called with the lock held, which is released while
+  // writing to syslog.
+  void log_summaries()
+  {
+    std::vector<std::pair<int, std::pair<int, uint64_t> > > summaries;
+
+    for (std::map<int, LogIdState>::iterator it = states.begin();
+         it != states.end();
+         ++it)
+    {
+      if (it->second.suppressed_since_summary > 0)
+      {
+        summaries.push_back(std::make_pair(it->first,
+                              std::make_pair(it->second.severity,
+                                             it->second.suppressed_since_summary)));
+        it->second.suppressed_since_summary = 0;
+      }
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    for (std::vector<std::pair<int, std::pair<int, uint64_t> > >::iterator it = summaries.begin();
+         it != summaries.end();
+         ++it)
+    {
+      syslog(it->second.first,
+             "%d - Occurred %lu more times in the last %u seconds (not logged)",
+             it->first,
+             (unsigned long)it->second.second,
+             summary_interval_s);
+    }
+
+    pthread_mutex_lock(&lock);
+  }
+
+  void* emitter_fn(void*)
+  {
+    struct timespec next_summary;
+    clock_gettime(CLOCK_MONOTONIC, &next_summary);
+    next_summary.tv_sec += summary_interval_s;
+
+    pthread_mutex_lock(&lock);
+
+    while (true)
+    {
+      while (!queue.empty())
+      {
+        QueuedLog log;
+        std::swap(log, queue.front());
+        queue.pop_front();
+
+        // Don't hold the lock while writing to syslog.
+        pthread_mutex_unlock(&lock);
+        syslog(log.severity, "%d - %s", log.log_id, log.text.c_str());
+        pthread_mutex_lock(&lock);
+      }
+
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+
+      if ((emitter_terminated) ||
+          (now.tv_sec > next_summary.tv_sec) ||
+          ((now.tv_sec == next_summary.tv_sec) &&
+           (now.tv_nsec >= next_summary.tv_nsec)))
+      {
+        log_summaries();
+        next_summary = now;
+        next_summary.tv_sec += summary_interval_s;
+      }
+
+      if ((emitter_terminated) && (queue.empty()))
+      {
+        break;
+      }
+
+      if (queue.empty())
+      {
+        pthread_cond_timedwait(&emitter_cond, &lock, &next_summary);
+      }
+    }
+
+    pthread_mutex_unlock(&lock);
+    return NULL;
+  }
+}
+
+void PDLogBase::set_default_limits(const Limits& limits)
+{
+  pthread_mutex_lock(&lock);
+  default_limits = limits;
+  pthread_mutex_unlock(&lock);
+}
+
+void PDLogBase::set_limits(int log_id, const Limits& limits)
+{
+  pthread_mutex_lock(&lock);
+  LogIdState& state = states[log_id];
+  state.has_limits = true;
+  state.limits = limits;
+  state.tokens = -1;
+  pthread_mutex_unlock(&lock);
+}
+
+void PDLogBase::start_emitter(unsigned int interval_s)
+{
+  pthread_mutex_lock(&lock);
+
+  if (!emitter_running)
+  {
+    summary_interval_s = std::max(interval_s, 1u);
+    emitter_terminated = false;
+
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&emitter_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    emitter_running = (pthread_create(&emitter_thread, NULL, emitter_fn, NULL) == 0);
+
+    if (!emitter_running)
+    {
+      pthread_cond_destroy(&emitter_cond); // LCOV_EXCL_LINE
+    }
+  }
+
+  pthread_mutex_unlock(&lock);
+}
+
+void PDLogBase::stop_emitter()
+{
+  pthread_mutex_lock(&lock);
+
+  if (!emitter_running)
+  {
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+
+  emitter_terminated = true;
+  pthread_cond_signal(&emitter_cond);
+  pthread_mutex_unlock(&lock);
+
+  pthread_join(emitter_thread, NULL);
+
+  pthread_mutex_lock(&lock);
+  emitter_running = false;
+  pthread_cond_destroy(&emitter_cond);
+  pthread_mutex_unlock(&lock);
+}
+
+uint64_t PDLogBase::suppressed_count(int log_id)
+{
+  uint64_t suppressed = 0;
+
+  pthread_mutex_lock(&lock);
+  std::map<int, LogIdState>::const_iterator it = states.find(log_id);
+
+  if (it != states.end())
+  {
+    suppressed = it->second.suppressed;
+  }
+
+  pthread_mutex_unlock(&lock);
+  return suppressed;
+}
+
+bool PDLogBase::should_log(int log_id, int severity)
+{
+  pthread_mutex_lock(&lock);
+
+  LogIdState& state = states[log_id];
+  state.severity = severity;
+  const Limits& limits = state.has_limits ? state.limits : default_limits;
+  bool log = true;
+
+  if (limits.rate_per_sec > 0)
+  {
+    uint64_t now = now_ms();
+
+    if (state.tokens < 0)
+    {
+      state.tokens = limits.burst;
+    }
+    else
+    {
+      state.tokens = std::min((double)limits.burst,
+                              state.tokens +
+                                ((now - state.last_refill_ms) * limits.rate_per_sec / 1000));
+    }
+
+    state.last_refill_ms = now;
+
+    if (state.tokens >= 1)
+    {
+      state.tokens -= 1;
+    }
+    else
+    {
+      log = false;
+    }
+  }
+
+  if ((log) && (emitter_running) && (queue.size() >= MAX_QUEUED_LOGS))
+  {
+    // The emitter has fallen behind, so there's no point formatting this.
+    log = false;
+  }
+
+  if (!log)
+  {
+    ++state.suppressed;
+    ++state.suppressed_since_summary;
+  }
+
+  pthread_mutex_unlock(&lock);
+  return log;
+}
+
+bool PDLogBase::queue_log(int log_id, int severity, const char* buf)
+{
+  bool queued = false;
+
+  pthread_mutex_lock(&lock);
+
+  if ((emitter_running) && (!emitter_terminated))
+  {
+    QueuedLog log;
+    log.log_id = log_id;
+    log.severity = severity;
+    log.text = buf;
+    queue.push_back(log);
+    pthread_cond_signal(&emitter_cond);
+    queued = true;
+  }
+
+  pthread_mutex_unlock(&lock);
+  return queued;
+}
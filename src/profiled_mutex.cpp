@@ -0,0 +1,99 @@
+/**
+ * @file profiled_mutex.cpp  A mutex that measures how long it is waited for
+ * and held.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string.h>
+
+#include <vector>
+
+#include "profiled_mutex.h"
+#include "snmp_latency_histogram_table.h"
+
+namespace LockProfiling
+{
+  std::atomic<bool> _enabled(false);
+
+  namespace
+  {
+    // Locks are created during static initialisation (e.g. the Logger's), so
+    // the registry is only built on first use.
+    pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+    std::vector<LockStats*>* registry = NULL;
+    SNMP::LatencyHistogramTable* registry_wait_table = NULL;
+    SNMP::LatencyHistogramTable* registry_hold_table = NULL;
+
+    void add_to_tables(LockStats* stats)
+    {
+      if (registry_wait_table != NULL)
+      {
+        registry_wait_table->add_histogram(stats->name, &stats->wait);
+      }
+
+      if (registry_hold_table != NULL)
+      {
+        registry_hold_table->add_histogram(stats->name, &stats->hold);
+      }
+    }
+  }
+
+  void set_enabled(bool enabled)
+  {
+    _enabled.store(enabled, std::memory_order_relaxed);
+  }
+
+  LockStats* stats(const char* name)
+  {
+    LockStats* stats = NULL;
+    pthread_mutex_lock(&registry_lock);
+
+    if (registry == NULL)
+    {
+      registry = new std::vector<LockStats*>();
+    }
+
+    for (LockStats* existing : *registry)
+    {
+      if (strcmp(existing->name, name) == 0)
+      {
+        stats = existing;
+        break;
+      }
+    }
+
+    if (stats == NULL)
+    {
+      stats = new LockStats(name);
+      registry->push_back(stats);
+      add_to_tables(stats);
+    }
+
+    pthread_mutex_unlock(&registry_lock);
+    return stats;
+  }
+
+  void set_statistics_tables(SNMP::LatencyHistogramTable* wait_table,
+                             SNMP::LatencyHistogramTable* hold_table)
+  {
+    pthread_mutex_lock(&registry_lock);
+    registry_wait_table = wait_table;
+    registry_hold_table = hold_table;
+
+    if (registry != NULL)
+    {
+      for (LockStats* stats : *registry)
+      {
+        add_to_tables(stats);
+      }
+    }
+
+    pthread_mutex_unlock(&registry_lock);
+  }
+}
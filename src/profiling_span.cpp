@@ -0,0 +1,292 @@
+/**
+ * @file profiling_span.cpp  Lightweight timing of spans within a request.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "json_writer.h"
+#include "profiling_span.h"
+#include "utils.h"
+
+namespace Profiling
+{
+  std::atomic<uint64_t> _sample_threshold(0);
+
+  namespace
+  {
+    const uint64_t SAMPLE_ALL = (uint64_t)1 << 32;
+
+    // A thread's recorded spans.  The lock is only contended when the spans
+    // are being read out.  A ring outlives its thread, and is reused by the
+    // next thread to start recording, so the spans of threads that have
+    // exited can still be read.
+    struct Ring
+    {
+      pthread_mutex_t lock;
+      pid_t tid;
+      bool in_use;
+
+      // The number of spans ever added, so the next is at
+      // (written % RING_SIZE).
+      uint64_t written;
+
+      SpanRecord records[RING_SIZE];
+    };
+
+    pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+    std::vector<Ring*> rings;
+
+    pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+    pthread_key_t ring_key;
+
+    // Called when a thread that has a ring exits.
+    void release_ring(void* ring_ptr)
+    {
+      Ring* ring = (Ring*)ring_ptr;
+      pthread_mutex_lock(&rings_lock);
+      ring->in_use = false;
+      pthread_mutex_unlock(&rings_lock);
+    }
+
+    void create_ring_key()
+    {
+      pthread_key_create(&ring_key, release_ring);
+    }
+
+    Ring* thread_ring()
+    {
+      static thread_local Ring* ring = NULL;
+
+      if (ring == NULL)
+      {
+        pthread_once(&ring_key_once, create_ring_key);
+        pthread_mutex_lock(&rings_lock);
+
+        for (Ring* unused : rings)
+        {
+          if (!unused->in_use)
+          {
+            ring = unused;
+            break;
+          }
+        }
+
+        if (ring == NULL)
+        {
+          ring = new Ring();
+          pthread_mutex_init(&ring->lock, NULL);
+          ring->written = 0;
+          rings.push_back(ring);
+        }
+
+        // The ring's spans from a previous thread are kept (until they're
+        // overwritten), but are now reported under this thread's ID.
+        ring->in_use = true;
+        ring->tid = syscall(SYS_gettid);
+        pthread_mutex_unlock(&rings_lock);
+
+        pthread_setspecific(ring_key, ring);
+      }
+
+      return ring;
+    }
+
+    // The recorded spans of one thread, oldest first.
+    struct ThreadSpans
+    {
+      pid_t tid;
+      std::vector<SpanRecord> spans;
+    };
+
+    void copy_spans(std::vector<ThreadSpans>& copies)
+    {
+      pthread_mutex_lock(&rings_lock);
+
+      for (Ring* ring : rings)
+      {
+        ThreadSpans copy;
+        pthread_mutex_lock(&ring->lock);
+        copy.tid = ring->tid;
+        uint64_t first = (ring->written > RING_SIZE) ? ring->written - RING_SIZE : 0;
+
+        for (uint64_t ii = first; ii < ring->written; ++ii)
+        {
+          copy.spans.push_back(ring->records[ii % RING_SIZE]);
+        }
+
+        pthread_mutex_unlock(&ring->lock);
+
+        if (!copy.spans.empty())
+        {
+          copies.push_back(std::move(copy));
+        }
+      }
+
+      pthread_mutex_unlock(&rings_lock);
+    }
+
+    // Orders spans by start time, with enclosing spans before the spans
+    // nested in them.
+    bool starts_before(const SpanRecord& lhs, const SpanRecord& rhs)
+    {
+      return (lhs.start_ns < rhs.start_ns) ||
+             ((lhs.start_ns == rhs.start_ns) && (lhs.depth < rhs.depth));
+    }
+  }
+
+  void set_sample_rate(double rate)
+  {
+    rate = std::min(std::max(rate, 0.0), 1.0);
+    _sample_threshold.store((uint64_t)(rate * SAMPLE_ALL), std::memory_order_relaxed);
+  }
+
+  double sample_rate()
+  {
+    return (double)_sample_threshold.load(std::memory_order_relaxed) / SAMPLE_ALL;
+  }
+
+  bool _sample_root()
+  {
+    return ((Utils::ThreadRandom::next() >> 32) <
+            _sample_threshold.load(std::memory_order_relaxed));
+  }
+
+  void _record(const char* name, uint64_t start_ns, uint64_t end_ns, uint32_t depth)
+  {
+    Ring* ring = thread_ring();
+    pthread_mutex_lock(&ring->lock);
+    SpanRecord& record = ring->records[ring->written % RING_SIZE];
+    record.name = name;
+    record.start_ns = start_ns;
+    record.duration_ns = (end_ns > start_ns) ? end_ns - start_ns : 0;
+    record.depth = depth;
+    ++ring->written;
+    pthread_mutex_unlock(&ring->lock);
+  }
+
+  void write_chrome_trace(std::string& json)
+  {
+    std::vector<ThreadSpans> threads;
+    copy_spans(threads);
+    pid_t pid = getpid();
+
+    JsonStringStream stream(json);
+    JsonStringWriter writer(stream);
+    writer.StartObject();
+    writer.String("traceEvents");
+    writer.StartArray();
+
+    for (const ThreadSpans& thread : threads)
+    {
+      for (const SpanRecord& span : thread.spans)
+      {
+        // Complete ("X") events, timed in microseconds.
+        writer.StartObject();
+        writer.String("name");
+        writer.String(span.name);
+        writer.String("ph");
+        writer.String("X");
+        writer.String("ts");
+        writer.Double(span.start_ns / 1000.0);
+        writer.String("dur");
+        writer.Double(span.duration_ns / 1000.0);
+        writer.String("pid");
+        writer.Int(pid);
+        writer.String("tid");
+        writer.Int(thread.tid);
+        writer.EndObject();
+      }
+    }
+
+    writer.EndArray();
+    writer.String("displayTimeUnit");
+    writer.String("ns");
+    writer.EndObject();
+  }
+
+  void write_folded_stacks(std::string& out)
+  {
+    std::vector<ThreadSpans> threads;
+    copy_spans(threads);
+    std::map<std::string, uint64_t> self_ns;
+
+    for (ThreadSpans& thread : threads)
+    {
+      // Rebuild the nesting of the spans from their start and end times.
+      // Each span's own time is its duration less that of the spans directly
+      // inside it.
+      std::vector<SpanRecord>& spans = thread.spans;
+      std::sort(spans.begin(), spans.end(), starts_before);
+      std::vector<uint64_t> own_ns(spans.size());
+      std::vector<std::string> stacks(spans.size());
+      std::vector<size_t> open;
+
+      for (size_t ii = 0; ii < spans.size(); ++ii)
+      {
+        const SpanRecord& span = spans[ii];
+
+        while (!open.empty())
+        {
+          const SpanRecord& outer = spans[open.back()];
+
+          if ((outer.depth < span.depth) &&
+              (outer.start_ns + outer.duration_ns >= span.start_ns + span.duration_ns))
+          {
+            break;
+          }
+
+          open.pop_back();
+        }
+
+        own_ns[ii] = span.duration_ns;
+        stacks[ii] = span.name;
+
+        if (!open.empty())
+        {
+          size_t outer = open.back();
+          own_ns[outer] -= std::min(own_ns[outer], span.duration_ns);
+          stacks[ii] = stacks[outer] + ";" + span.name;
+        }
+
+        open.push_back(ii);
+      }
+
+      for (size_t ii = 0; ii < spans.size(); ++ii)
+      {
+        self_ns[stacks[ii]] += own_ns[ii];
+      }
+    }
+
+    for (const std::pair<const std::string, uint64_t>& stack : self_ns)
+    {
+      out += stack.first + " " + std::to_string(stack.second / 1000) + "\n";
+    }
+  }
+
+  void clear()
+  {
+    pthread_mutex_lock(&rings_lock);
+
+    for (Ring* ring : rings)
+    {
+      pthread_mutex_lock(&ring->lock);
+      ring->written = 0;
+      pthread_mutex_unlock(&ring->lock);
+    }
+
+    pthread_mutex_unlock(&rings_lock);
+  }
+}
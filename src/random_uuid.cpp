@@ -0,0 +1,50 @@
+/**
+ * @file random_uuid.cpp Random UUID generator
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string.h>
+
+#include "random_uuid.h"
+#include "utils.h"
+
+const size_t RandomUUIDGenerator::STRING_LENGTH;
+
+boost::uuids::uuid RandomUUIDGenerator::generate()
+{
+  uint64_t random[2] = {Utils::ThreadRandom::next(),
+                        Utils::ThreadRandom::next()};
+
+  boost::uuids::uuid uuid;
+  memcpy(uuid.data, random, sizeof(uuid.data));
+
+  // Set the version (4 - random) and the variant (RFC 4122).
+  uuid.data[6] = (uuid.data[6] & 0x0F) | 0x40;
+  uuid.data[8] = (uuid.data[8] & 0x3F) | 0x80;
+
+  return uuid;
+}
+
+void RandomUUIDGenerator::format_to(const boost::uuids::uuid& uuid, char* buf)
+{
+  static const char* const hex_lookup = "0123456789abcdef";
+
+  for (size_t ii = 0; ii < sizeof(uuid.data); ++ii)
+  {
+    if ((ii == 4) || (ii == 6) || (ii == 8) || (ii == 10))
+    {
+      *buf++ = '-';
+    }
+
+    *buf++ = hex_lookup[uuid.data[ii] >> 4];
+    *buf++ = hex_lookup[uuid.data[ii] & 0x0F];
+  }
+
+  *buf = '\0';
+}
@@ -11,21 +11,32 @@
 
 #include "realmmanager.h"
 #include "utils.h"
+#include "fast_clock.h"
 #include "cpp_common_pd_definitions.h"
 
 #include <boost/algorithm/string/replace.hpp>
 
+// A candidate peer counts as more loaded than the others with the same
+// routing score if its load is more than this multiple of the lightest.
+static const uint64_t LOAD_IMBALANCE_FACTOR = 2;
+
 RealmManager::RealmManager(Diameter::Stack* stack,
                            std::string realm,
                            std::string host,
                            int max_peers,
-                           DiameterResolver* resolver) :
+                           DiameterResolver* resolver,
+                           int max_pending_connections,
+                           SNMP::LatencyHistogramTable* connect_latency_table) :
                            _stack(stack),
                            _realm(realm),
                            _host(host),
                            _max_peers(max_peers),
                            _resolver(resolver),
-                           _terminating(false)
+                           _terminating(false),
+                           _peer_failed(false),
+                           _peer_connected(false),
+                           _max_pending_connections(max_pending_connections),
+                           _connect_latency_table(connect_latency_table)
 {
   pthread_mutex_init(&_main_thread_lock, NULL);
   pthread_condattr_t cond_attr;
@@ -52,6 +63,16 @@ void RealmManager::start()
                              std::bind(&RealmManager::srv_priority_cb,
                                        this,
                                        _1));
+
+  // Latency is only worth tracking if the resolver uses it to choose peers.
+  if (_resolver->latency_aware_selection())
+  {
+    _stack->register_tsx_latency_cb("realmmanager",
+                                    std::bind(&RealmManager::tsx_latency_cb,
+                                              this,
+                                              _1,
+                                              _2));
+  }
 }
 
 RealmManager::~RealmManager()
@@ -60,6 +81,13 @@ RealmManager::~RealmManager()
   pthread_cond_destroy(&_cond);
 
   pthread_rwlock_destroy(&_peers_lock);
+
+  for (std::map<std::string, LatencyHistogram*>::iterator ii = _connect_latencies.begin();
+       ii != _connect_latencies.end();
+       ii++)
+  {
+    delete ii->second;
+  }
 }
 
 void RealmManager::stop()
@@ -71,6 +99,7 @@ void RealmManager::stop()
   pthread_join(_thread, NULL);
   _stack->unregister_peer_hook_hdlr("realmmanager");
   _stack->unregister_rt_out_cb("realmmanager");
+  _stack->unregister_tsx_latency_cb("realmmanager");
 }
 
 void RealmManager::peer_connection_cb(bool connection_success,
@@ -94,6 +123,21 @@ void RealmManager::peer_connection_cb(bool connection_success,
         pthread_rwlock_unlock(&_peers_lock);
         pthread_rwlock_wrlock(&_peers_lock);
         peer->set_connected();
+
+        std::map<std::string, uint64_t>::iterator jj = _connect_start_us.find(host);
+        if (jj != _connect_start_us.end())
+        {
+          record_connect_latency(host, jj->second);
+          _connect_start_us.erase(jj);
+        }
+
+        // If the number of pending connections is limited, this one finishing
+        // lets another start.
+        if (_max_pending_connections > 0)
+        {
+          _peer_connected = true;
+          pthread_cond_signal(&_cond);
+        }
       }
       else
       {
@@ -107,7 +151,9 @@ void RealmManager::peer_connection_cb(bool connection_success,
         pthread_rwlock_wrlock(&_peers_lock);
         delete peer;
         _peers.erase(ii);
+        _connect_start_us.erase(host);
 
+        _peer_failed = true;
         pthread_cond_signal(&_cond);
       }
     }
@@ -119,7 +165,9 @@ void RealmManager::peer_connection_cb(bool connection_success,
       pthread_rwlock_wrlock(&_peers_lock);
       delete peer;
       _peers.erase(ii);
+      _connect_start_us.erase(host);
 
+      _peer_failed = true;
       pthread_cond_signal(&_cond);
     }
   }
@@ -179,9 +227,102 @@ void RealmManager::srv_priority_cb(struct fd_list* candidates)
   }
 
   pthread_rwlock_unlock(&_peers_lock);
+
+  bias_by_load(candidates);
   return;
 }
 
+void RealmManager::bias_by_load(struct fd_list* candidates)
+{
+  // Find the load on each candidate, and the lightest load for each score.
+  std::vector<std::pair<struct rtd_candidate*, uint64_t>> loads;
+  std::map<int, uint64_t> lightest;
+
+  for (struct fd_list* li = candidates->next; li != candidates; li = li->next)
+  {
+    struct rtd_candidate* candidate = (struct rtd_candidate*)li;
+
+    if (candidate->score > 0)
+    {
+      // Peers we haven't sent anything to yet count as unloaded.
+      Diameter::PeerLoad* load =
+        _stack->find_peer_load(std::string(candidate->cfg_diamid,
+                                           candidate->cfg_diamidlen));
+      uint64_t load_value = (load != NULL) ? load->load() : 0;
+      loads.push_back(std::make_pair(candidate, load_value));
+
+      std::map<int, uint64_t>::iterator jj = lightest.find(candidate->score);
+      if ((jj == lightest.end()) || (load_value < jj->second))
+      {
+        lightest[candidate->score] = load_value;
+      }
+    }
+  }
+
+  if (loads.size() < 2)
+  {
+    return;
+  }
+
+  // Double every score, and take one off the candidates that are much more
+  // loaded than the lightest with the same score.  This puts them below the
+  // others with their score, but still above any candidate that scored lower
+  // (e.g. because of its SRV priority).
+  for (std::vector<std::pair<struct rtd_candidate*, uint64_t>>::iterator ii = loads.begin();
+       ii != loads.end();
+       ++ii)
+  {
+    struct rtd_candidate* candidate = ii->first;
+    int new_score = candidate->score * 2;
+
+    if (ii->second > lightest[candidate->score] * LOAD_IMBALANCE_FACTOR)
+    {
+      new_score--;
+    }
+
+    TRC_DEBUG("freeDiameter routing score for candidate %.*s (load %lu) is changing from %d to %d",
+              candidate->cfg_diamidlen,
+              candidate->cfg_diamid,
+              ii->second,
+              candidate->score,
+              new_score);
+    candidate->score = new_score;
+  }
+}
+
+void RealmManager::tsx_latency_cb(const std::string& host,
+                                  unsigned long duration_us)
+{
+  pthread_rwlock_rdlock(&_peers_lock);
+
+  std::map<std::string, Diameter::Peer*>::iterator ii = _peers.find(host);
+  if (ii != _peers.end())
+  {
+    _resolver->record_latency((ii->second)->addr_info(), duration_us);
+  }
+
+  pthread_rwlock_unlock(&_peers_lock);
+}
+
+void RealmManager::record_connect_latency(const std::string& host,
+                                          uint64_t start_us)
+{
+  uint64_t latency_us = FastClock::now_us() - start_us;
+  TRC_INFO("Connecting to %s took %lu us", host.c_str(), latency_us);
+
+  LatencyHistogram*& histogram = _connect_latencies[host];
+  if (histogram == NULL)
+  {
+    histogram = new LatencyHistogram();
+    if (_connect_latency_table != NULL)
+    {
+      _connect_latency_table->add_histogram(host, histogram);
+    }
+  }
+
+  histogram->record(latency_us);
+}
+
 void* RealmManager::thread_function(void* realm_manager_ptr)
 {
   ((RealmManager*)realm_manager_ptr)->thread_function();
@@ -191,25 +332,61 @@ void* RealmManager::thread_function(void* realm_manager_ptr)
 // There is a thread running in this function the whole time that
 // the program is running. It calls into a function that is responsible
 // for managing Diameter connections every time the thread is woken up.
+//
+// The realm is only resolved again when the TTL of the DNS entries expires
+// or a peer fails, and is resolved without the main thread lock, so a slow
+// DNS query doesn't hold up the peer connection callbacks.
 void RealmManager::thread_function()
 {
-  int ttl = 0;
-  struct timespec ts;
+  std::vector<AddrInfo> targets;
+  bool resolve = true;
+  struct timespec resolve_ts = {0, 0};
 
   pthread_mutex_lock(&_main_thread_lock);
 
   do
   {
-    manage_connections(ttl);
+    if (resolve)
+    {
+      int ttl = 0;
+      targets.clear();
+
+      pthread_mutex_unlock(&_main_thread_lock);
+      _resolver->resolve(_realm, _host, _max_peers, targets, ttl);
+      pthread_mutex_lock(&_main_thread_lock);
+
+      // We impose sensible max and min values for the TTL.
+      ttl = std::max(5, ttl);
+      ttl = std::min(300, ttl);
+      clock_gettime(CLOCK_MONOTONIC, &resolve_ts);
+      resolve_ts.tv_sec += ttl;
+    }
+
+    if (_terminating)
+    {
+      break;
+    }
+
+    manage_connections(targets);
 
     // Call pthread_cond_timedwait to pause the thread until either the
-    // TTL of one of the DNS entries expires, we get called by a
-    // failure to connect to one of the peers, or the program is
-    // terminating. In the latter case we exit the loop and tidy up the
-    // connections.
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    ts.tv_sec += ttl;
-    pthread_cond_timedwait(&_cond, &_main_thread_lock, &ts);
+    // TTL of one of the DNS entries expires, we get called by a peer
+    // connecting or failing to connect, or the program is terminating. In
+    // the latter case we exit the loop and tidy up the connections.  Any of
+    // these that happened while we weren't waiting are already flagged.
+    if ((!_peer_failed) && (!_peer_connected) && (!_terminating))
+    {
+      pthread_cond_timedwait(&_cond, &_main_thread_lock, &resolve_ts);
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    resolve = (_peer_failed) ||
+              (now.tv_sec > resolve_ts.tv_sec) ||
+              ((now.tv_sec == resolve_ts.tv_sec) &&
+               (now.tv_nsec >= resolve_ts.tv_nsec));
+    _peer_failed = false;
+    _peer_connected = false;
 
   } while (!_terminating);
 
@@ -224,6 +401,7 @@ void RealmManager::thread_function()
 
   // This _peers map contains rubbish at this point, don't use it.
   _peers.clear();
+  _connect_start_us.clear();
 
   pthread_mutex_unlock(&_main_thread_lock);
 }
@@ -235,9 +413,8 @@ void RealmManager::thread_function()
 // flows in this function and how these lists are used. These can be
 // cross referenced with the numbered comments below.
 //
-// 1. Call resolve to perform a DNS resolution on the given realm and
-//    populate targets with a list of potential peers to connect to. This
-//    also returns a minimum TTL for the DNS entries.
+// 1. The targets are the potential peers to connect to, from the last
+//    DNS resolution of the given realm (see thread_function).
 // 2. Create a list of hostnames from the list of targets. This is
 //    new_peers and it is used to compare hostnames with existing
 //    connections.
@@ -257,7 +434,10 @@ void RealmManager::thread_function()
 //    (as per step 4). We don't tear down any connections until we're sure
 //    we have _max_peers connections. The only exception to this is
 //    when resolve contains fewer than _max_peers entries which means we
-//    sure we should have fewer than _max_peers connections.
+//    sure we should have fewer than _max_peers connections.  If the number
+//    of pending connections is limited, we only start connecting to as many
+//    peers as that allows - the rest are connected to as the pending
+//    connections finish.
 // 6. Tell the stack the number of peers we are aware of, and the number of
 //    peers we're connected to. This is so that the stack can raise appropriate
 //    logs when we have no connections and routing messages inevitably fails.
@@ -266,9 +446,8 @@ void RealmManager::thread_function()
 // On the first run through this function, a lot of this processing is
 // irrelevant since we just get a list of targets and try to connect to
 // them.
-void RealmManager::manage_connections(int& ttl)
+void RealmManager::manage_connections(const std::vector<AddrInfo>& targets)
 {
-  std::vector<AddrInfo> targets;
   std::vector<std::string> new_peers;
   std::vector<Diameter::Peer*> connected_peers;
   bool ret;
@@ -281,15 +460,8 @@ void RealmManager::manage_connections(int& ttl)
   std::map<std::string, Diameter::Peer*> locked_peers = _peers;
   pthread_rwlock_unlock(&_peers_lock);
 
-  // 1.
-  _resolver->resolve(_realm, _host, _max_peers, targets, ttl);
-
-  // We impose sensible max and min values for the TTL.
-  ttl = std::max(5, ttl);
-  ttl = std::min(300, ttl);
-
   // 2.
-  for (std::vector<AddrInfo>::iterator ii = targets.begin();
+  for (std::vector<AddrInfo>::const_iterator ii = targets.begin();
        ii != targets.end();
        ii++)
   {
@@ -339,7 +511,9 @@ void RealmManager::manage_connections(int& ttl)
 
   // 5.
   int zombies = 0;
-  for (std::vector<AddrInfo>::iterator ii = targets.begin();
+  int deferred = 0;
+  int pending = locked_peers.size() - connected_peers.size();
+  for (std::vector<AddrInfo>::const_iterator ii = targets.begin();
        ii != targets.end();
        ii++)
   {
@@ -349,14 +523,26 @@ void RealmManager::manage_connections(int& ttl)
     // isn't, add it.
     std::map<std::string, Diameter::Peer*>::iterator jj =
                                                     locked_peers.find(hostname);
-    if (jj == locked_peers.end())
+    if ((jj == locked_peers.end()) &&
+        (_max_pending_connections > 0) &&
+        (pending >= _max_pending_connections))
+    {
+      TRC_DEBUG("Deferring peer %s - already connecting to %d peers",
+                hostname.c_str(),
+                pending);
+      deferred++;
+    }
+    else if (jj == locked_peers.end())
     {
       Diameter::Peer* peer = new Diameter::Peer(*ii, hostname, _realm, 0);
       TRC_STATUS("Adding peer: %s", hostname.c_str());
+      uint64_t start_us = FastClock::now_us();
       ret = _stack->add(peer);
       if (ret)
       {
         locked_peers[hostname] = peer;
+        _connect_start_us[hostname] = start_us;
+        pending++;
       }
       else
       {
@@ -379,10 +565,11 @@ void RealmManager::manage_connections(int& ttl)
   }
 
   // 6. Tell the stack the number of peers we're currently managing (including
-  // any peers we are waiting to be able to add, but can't because of delayed
-  // zombie cleanup in freeDiameter), and the number of peers we're actually
-  // connected to.
-  _stack->peer_count(locked_peers.size() + zombies, connected_peers.size());
+  // any peers we are waiting to be able to add, either because of delayed
+  // zombie cleanup in freeDiameter or because of the limit on pending
+  // connections), and the number of peers we're actually connected to.
+  _stack->peer_count(locked_peers.size() + zombies + deferred,
+                     connected_peers.size());
 
   // 7. Update the stored _peers map.
   pthread_rwlock_wrlock(&_peers_lock);
@@ -0,0 +1,430 @@
+/**
+ * @file replicated_store.cpp Store that replicates writes to remote sites in
+ * the background.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <errno.h>
+#include <time.h>
+
+#include <algorithm>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "log.h"
+#include "fast_clock.h"
+#include "replicated_store.h"
+
+const size_t ReplicatedStore::DEFAULT_MAX_QUEUE;
+const size_t ReplicatedStore::DEFAULT_MAX_BATCH;
+const int ReplicatedStore::DEFAULT_MAX_RETRIES;
+const int ReplicatedStore::DEFAULT_RETRY_DELAY_MS;
+
+ReplicatedStore::ReplicatedStore(Store* local_store,
+                                 const std::vector<Store*>& remote_stores,
+                                 size_t max_queue,
+                                 size_t max_batch,
+                                 int max_retries,
+                                 int retry_delay_ms) :
+  _local_store(local_store),
+  _sites(),
+  _max_queue(max_queue),
+  _max_batch(std::max(max_batch, (size_t)1)),
+  _max_retries(max_retries),
+  _retry_delay_ms(retry_delay_ms),
+  _terminated(false)
+{
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+
+  for (size_t ii = 0; ii < remote_stores.size(); ++ii)
+  {
+    Site* site = new Site();
+    site->replicated_store = this;
+    site->store = remote_stores[ii];
+    site->index = ii;
+    site->dropped = 0;
+    site->failed = 0;
+    pthread_mutex_init(&site->lock, NULL);
+    pthread_cond_init(&site->cond, &cond_attr);
+    _sites.push_back(site);
+  }
+
+  pthread_condattr_destroy(&cond_attr);
+
+  // Only start the threads once all the sites exist.
+  for (Site* site : _sites)
+  {
+    pthread_create(&site->thread, NULL, replication_thread_fn, site);
+  }
+
+  TRC_DEBUG("Created replicated store with %lu remote sites", _sites.size());
+}
+
+ReplicatedStore::~ReplicatedStore()
+{
+  for (Site* site : _sites)
+  {
+    pthread_mutex_lock(&site->lock);
+  }
+
+  _terminated = true;
+
+  for (Site* site : _sites)
+  {
+    pthread_cond_signal(&site->cond);
+    pthread_mutex_unlock(&site->lock);
+  }
+
+  for (Site* site : _sites)
+  {
+    pthread_join(site->thread, NULL);
+
+    if (!site->queue.empty())
+    {
+      TRC_WARNING("Dropping %lu writes that weren't replicated to remote site %lu",
+                  site->queue.size(), site->index);
+    }
+
+    pthread_cond_destroy(&site->cond);
+    pthread_mutex_destroy(&site->lock);
+    delete site;
+  }
+}
+
+Store::Status ReplicatedStore::get_data(const std::string& table,
+                                        const std::string& key,
+                                        std::string& data,
+                                        uint64_t& cas,
+                                        SAS::TrailId trail,
+                                        bool log_body,
+                                        Store::Format data_format)
+{
+  return _local_store->get_data(table, key, data, cas, trail, log_body, data_format);
+}
+
+Store::Status ReplicatedStore::get_data(const std::string& table,
+                                        const std::string& key,
+                                        Store::Buffer& data,
+                                        uint64_t& cas,
+                                        SAS::TrailId trail,
+                                        bool log_body,
+                                        Store::Format data_format)
+{
+  return _local_store->get_data(table, key, data, cas, trail, log_body, data_format);
+}
+
+Store::Status ReplicatedStore::set_data(const std::string& table,
+                                        const std::string& key,
+                                        const std::string& data,
+                                        uint64_t cas,
+                                        int expiry,
+                                        SAS::TrailId trail,
+                                        bool log_body,
+                                        Store::Format data_format)
+{
+  Store::Status status = _local_store->set_data(table,
+                                                key,
+                                                data,
+                                                cas,
+                                                expiry,
+                                                trail,
+                                                log_body,
+                                                data_format);
+
+  if (status == Store::Status::OK)
+  {
+    replicate(table, key, data, expiry, false);
+  }
+
+  return status;
+}
+
+Store::Status ReplicatedStore::set_data_without_cas(const std::string& table,
+                                                    const std::string& key,
+                                                    const std::string& data,
+                                                    int expiry,
+                                                    SAS::TrailId trail,
+                                                    bool log_body,
+                                                    Store::Format data_format)
+{
+  Store::Status status = _local_store->set_data_without_cas(table,
+                                                            key,
+                                                            data,
+                                                            expiry,
+                                                            trail,
+                                                            log_body,
+                                                            data_format);
+
+  if (status == Store::Status::OK)
+  {
+    replicate(table, key, data, expiry, false);
+  }
+
+  return status;
+}
+
+Store::Status ReplicatedStore::delete_data(const std::string& table,
+                                           const std::string& key,
+                                           SAS::TrailId trail)
+{
+  Store::Status status = _local_store->delete_data(table, key, trail);
+
+  // The record may still exist at the remote sites even if it didn't here.
+  if ((status == Store::Status::OK) || (status == Store::Status::NOT_FOUND))
+  {
+    replicate(table, key, std::string(), 0, true);
+  }
+
+  return status;
+}
+
+void ReplicatedStore::get_data_multi(const std::string& table,
+                                     const std::vector<std::string>& keys,
+                                     std::vector<Store::GetResult>& results,
+                                     SAS::TrailId trail,
+                                     bool log_body,
+                                     Store::Format data_format)
+{
+  _local_store->get_data_multi(table, keys, results, trail, log_body, data_format);
+}
+
+void ReplicatedStore::set_data_multi(const std::string& table,
+                                     const std::vector<Store::SetRequest>& requests,
+                                     std::vector<Store::Status>& statuses,
+                                     SAS::TrailId trail,
+                                     bool log_body,
+                                     Store::Format data_format)
+{
+  _local_store->set_data_multi(table,
+                               requests,
+                               statuses,
+                               trail,
+                               log_body,
+                               data_format);
+
+  for (size_t ii = 0; ii < requests.size(); ++ii)
+  {
+    if (statuses[ii] == Store::Status::OK)
+    {
+      replicate(table, requests[ii].key, requests[ii].data, requests[ii].expiry, false);
+    }
+  }
+}
+
+void ReplicatedStore::get_data_async(const std::string& table,
+                                     const std::string& key,
+                                     SAS::TrailId trail,
+                                     bool log_body,
+                                     Store::Format data_format,
+                                     Store::GetCallback callback)
+{
+  _local_store->get_data_async(table, key, trail, log_body, data_format, callback);
+}
+
+void ReplicatedStore::set_data_async(const std::string& table,
+                                     const std::string& key,
+                                     const std::string& data,
+                                     uint64_t cas,
+                                     int expiry,
+                                     SAS::TrailId trail,
+                                     bool log_body,
+                                     Store::Format data_format,
+                                     Store::SetCallback callback)
+{
+  _local_store->set_data_async(table, key, data, cas, expiry, trail, log_body, data_format,
+                               [this, table, key, data, expiry, callback](Store::Status status) {
+    if (status == Store::Status::OK)
+    {
+      replicate(table, key, data, expiry, false);
+    }
+
+    callback(status);
+  });
+}
+
+ReplicatedStore::ReplicationStats ReplicatedStore::replication_stats(size_t site_index) const
+{
+  Site* site = _sites[site_index];
+  ReplicationStats stats;
+
+  pthread_mutex_lock(&site->lock);
+  stats.backlog = site->queue.size();
+  stats.lag_ms = site->queue.empty() ?
+                   0 : (FastClock::now_us() - site->queue.front().queued_us) / 1000;
+  pthread_mutex_unlock(&site->lock);
+
+  stats.dropped = site->dropped;
+  stats.failed = site->failed;
+  return stats;
+}
+
+void ReplicatedStore::replicate(const std::string& table,
+                                const std::string& key,
+                                const std::string& data,
+                                int expiry,
+                                bool is_delete)
+{
+  if (_sites.empty())
+  {
+    return;
+  }
+
+  Write write = {table, key, data, expiry, is_delete, FastClock::now_us(), 0};
+
+  for (Site* site : _sites)
+  {
+    pthread_mutex_lock(&site->lock);
+
+    if (site->queue.size() < _max_queue)
+    {
+      site->queue.push_back(write);
+      pthread_cond_signal(&site->cond);
+      pthread_mutex_unlock(&site->lock);
+    }
+    else
+    {
+      pthread_mutex_unlock(&site->lock);
+
+      // Only log the first drop, rather than one for every write while the
+      // site is unreachable.
+      if (site->dropped++ == 0)
+      {
+        TRC_WARNING("Replication queue for remote site %lu is full, dropping writes",
+                    site->index);
+      }
+    }
+  }
+}
+
+void* ReplicatedStore::replication_thread_fn(void* site)
+{
+  ((Site*)site)->replicated_store->replication_thread_fn((Site*)site);
+  return NULL;
+}
+
+void ReplicatedStore::replication_thread_fn(Site* site)
+{
+  std::vector<Write> batch;
+  std::vector<Write> retries;
+
+  pthread_mutex_lock(&site->lock);
+
+  while (!_terminated)
+  {
+    if (site->queue.empty())
+    {
+      pthread_cond_wait(&site->cond, &site->lock);
+      continue;
+    }
+
+    size_t batch_size = std::min(site->queue.size(), _max_batch);
+    batch.assign(std::make_move_iterator(site->queue.begin()),
+                 std::make_move_iterator(site->queue.begin() + batch_size));
+    site->queue.erase(site->queue.begin(), site->queue.begin() + batch_size);
+    pthread_mutex_unlock(&site->lock);
+
+    retries.clear();
+    apply_batch(site, batch, retries);
+
+    pthread_mutex_lock(&site->lock);
+
+    if (!retries.empty())
+    {
+      // Retry the failed writes first, as later writes of the same keys must
+      // be applied after them, but give the site a while to recover.
+      site->queue.insert(site->queue.begin(),
+                         std::make_move_iterator(retries.begin()),
+                         std::make_move_iterator(retries.end()));
+
+      struct timespec wake;
+      clock_gettime(CLOCK_MONOTONIC, &wake);
+      wake.tv_sec += _retry_delay_ms / 1000;
+      wake.tv_nsec += (_retry_delay_ms % 1000) * 1000000;
+
+      if (wake.tv_nsec >= 1000000000)
+      {
+        wake.tv_sec++;
+        wake.tv_nsec -= 1000000000;
+      }
+
+      while ((!_terminated) &&
+             (pthread_cond_timedwait(&site->cond, &site->lock, &wake) != ETIMEDOUT))
+      {
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&site->lock);
+}
+
+void ReplicatedStore::apply_batch(Site* site,
+                                  std::vector<Write>& batch,
+                                  std::vector<Write>& retries)
+{
+  // Only the latest write of each key in the batch needs to be applied, so
+  // work back from the end of the batch.
+  std::set<std::pair<std::string, std::string>> written;
+  std::vector<Write*> to_apply;
+
+  for (std::vector<Write>::reverse_iterator it = batch.rbegin();
+       it != batch.rend();
+       ++it)
+  {
+    if (written.insert(std::make_pair(it->table, it->key)).second)
+    {
+      to_apply.push_back(&(*it));
+    }
+  }
+
+  TRC_DEBUG("Replicating %lu writes (of a batch of %lu) to remote site %lu",
+            to_apply.size(), batch.size(), site->index);
+
+  for (std::vector<Write*>::reverse_iterator it = to_apply.rbegin();
+       it != to_apply.rend();
+       ++it)
+  {
+    Write* write = *it;
+    Store::Status status;
+
+    if (write->is_delete)
+    {
+      status = site->store->delete_data(write->table, write->key, 0);
+    }
+    else
+    {
+      status = site->store->set_data_without_cas(write->table,
+                                                 write->key,
+                                                 write->data,
+                                                 write->expiry,
+                                                 0,
+                                                 false);
+    }
+
+    if ((status == Store::Status::OK) ||
+        ((write->is_delete) && (status == Store::Status::NOT_FOUND)))
+    {
+      site->lag.record(FastClock::now_us() - write->queued_us);
+    }
+    else if (write->attempts++ < _max_retries)
+    {
+      TRC_DEBUG("Failed to replicate key %s to remote site %lu, will retry",
+                write->key.c_str(), site->index);
+      retries.push_back(std::move(*write));
+    }
+    else
+    {
+      TRC_WARNING("Failed to replicate key %s to remote site %lu",
+                  write->key.c_str(), site->index);
+      ++site->failed;
+    }
+  }
+}
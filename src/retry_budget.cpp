@@ -0,0 +1,63 @@
+/**
+ * @file retry_budget.cpp  Limits retries to a fraction of successful requests.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+
+#include "retry_budget.h"
+#include "snmp_counter_table.h"
+#include "log.h"
+
+const int64_t RetryBudget::TOKEN;
+
+RetryBudget::RetryBudget(float retry_ratio,
+                         unsigned int max_retries,
+                         SNMP::CounterTable* denied_table) :
+  _deposit((int64_t)(retry_ratio * TOKEN)),
+  _capacity(max_retries * TOKEN),
+  _balance(max_retries * TOKEN),
+  _denied(0),
+  _denied_table(denied_table)
+{
+}
+
+void RetryBudget::first_attempt_succeeded()
+{
+  int64_t balance = _balance.load(std::memory_order_relaxed);
+
+  while ((balance < _capacity) &&
+         (!_balance.compare_exchange_weak(balance,
+                                          std::min(balance + _deposit, _capacity),
+                                          std::memory_order_relaxed)))
+  {
+  }
+}
+
+bool RetryBudget::try_retry()
+{
+  // Take the token optimistically, and put it back if there wasn't one.  The
+  // balance can briefly go negative, but never by more than a token per
+  // concurrent caller.
+  if (_balance.fetch_sub(TOKEN, std::memory_order_relaxed) >= TOKEN)
+  {
+    return true;
+  }
+
+  _balance.fetch_add(TOKEN, std::memory_order_relaxed);
+  _denied.fetch_add(1, std::memory_order_relaxed);
+
+  if (_denied_table != NULL)
+  {
+    _denied_table->increment();
+  }
+
+  TRC_DEBUG("Retry budget exhausted - not retrying");
+  return false;
+}
@@ -0,0 +1,151 @@
+/**
+ * @file rotating_bloom_filter.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+
+#include "rotating_bloom_filter.h"
+#include "fast_clock.h"
+#include "log.h"
+
+RotatingBloomFilter* RotatingBloomFilter::create(uint64_t entries_per_generation,
+                                                 double fp_prob,
+                                                 uint32_t generations,
+                                                 uint64_t generation_ms,
+                                                 BloomFilter::Layout layout)
+{
+  if ((generations < 2) || (generation_ms == 0))
+  {
+    TRC_WARNING("Bad rotating bloom filter with %u generations of %lums, "
+                "must have at least 2 generations of >0ms",
+                generations, generation_ms);
+    return nullptr;
+  }
+
+  // An item is checked against every generation, so the chance of a false
+  // positive is (roughly) the sum of each generation's.
+  BloomFilter* first_generation =
+    BloomFilter::for_num_entries_and_fp_prob(entries_per_generation,
+                                             fp_prob / generations,
+                                             layout);
+
+  if (first_generation == nullptr)
+  {
+    return nullptr;
+  }
+
+  return new RotatingBloomFilter(first_generation, generations, generation_ms);
+}
+
+RotatingBloomFilter::RotatingBloomFilter(BloomFilter* first_generation,
+                                         uint32_t generations,
+                                         uint64_t generation_ms) :
+  _generations(),
+  _newest(0),
+  _generation_us(generation_ms * 1000),
+  _next_rotation_us(FastClock::cached_monotonic_us() + _generation_us)
+{
+  _generations.emplace_back(first_generation);
+
+  for (uint32_t ii = 1; ii < generations; ++ii)
+  {
+    _generations.emplace_back(new BloomFilter(*first_generation));
+  }
+}
+
+void RotatingBloomFilter::add(const std::string& item)
+{
+  maybe_rotate();
+  _generations[_newest.load(std::memory_order_acquire)]->add(item);
+}
+
+void RotatingBloomFilter::add(const std::vector<std::string>& items)
+{
+  maybe_rotate();
+  _generations[_newest.load(std::memory_order_acquire)]->add(items);
+}
+
+bool RotatingBloomFilter::check(const std::string& item)
+{
+  maybe_rotate();
+
+  uint64_t hash0;
+  uint64_t hash1;
+  _generations[0]->calculate_sip_hash_values(item, hash0, hash1);
+
+  // Check the newest generations first, as recently added items are the most
+  // likely to be checked.
+  uint32_t newest = _newest.load(std::memory_order_acquire);
+  uint32_t num_generations = _generations.size();
+  bool present = false;
+
+  for (uint32_t ii = 0; (ii < num_generations) && (!present); ++ii)
+  {
+    BloomFilter* generation =
+      _generations[(newest + num_generations - ii) % num_generations].get();
+    present = generation->check_hash_values(hash0, hash1);
+  }
+
+  TRC_DEBUG("%s is %sin rotating bloom filter", item.c_str(), present ? "" : "not ");
+  return present;
+}
+
+BloomFilter* RotatingBloomFilter::snapshot()
+{
+  maybe_rotate();
+
+  BloomFilter* filter = new BloomFilter(*_generations[0]);
+
+  for (uint32_t ii = 1; ii < _generations.size(); ++ii)
+  {
+    filter->merge(*_generations[ii]);
+  }
+
+  return filter;
+}
+
+void RotatingBloomFilter::maybe_rotate()
+{
+  uint64_t now_us = FastClock::cached_monotonic_us();
+  uint64_t next_rotation_us = _next_rotation_us.load(std::memory_order_relaxed);
+
+  if (now_us < next_rotation_us)
+  {
+    return;
+  }
+
+  // If the filter hasn't been used for several intervals, rotate once for
+  // each of them (but there's no point rotating more than once per
+  // generation).  Whichever thread moves the next rotation time on does the
+  // rotating.
+  uint64_t intervals = ((now_us - next_rotation_us) / _generation_us) + 1;
+
+  if (!_next_rotation_us.compare_exchange_strong(next_rotation_us,
+                                                 next_rotation_us +
+                                                   (intervals * _generation_us)))
+  {
+    return;
+  }
+
+  uint32_t num_generations = _generations.size();
+  uint32_t rotations = std::min(intervals, (uint64_t)num_generations);
+
+  TRC_DEBUG("Rotate %u generations of rotating bloom filter", rotations);
+
+  for (uint32_t ii = 0; ii < rotations; ++ii)
+  {
+    // Clear the oldest generation before it becomes the newest.  Checks
+    // against it while it's being cleared may still find its expired items,
+    // which is harmless.
+    uint32_t oldest = (_newest.load(std::memory_order_relaxed) + 1) % num_generations;
+    _generations[oldest]->clear();
+    _newest.store(oldest, std::memory_order_release);
+  }
+}
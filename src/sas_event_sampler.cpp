@@ -0,0 +1,209 @@
+/**
+ * @file sas_event_sampler.cpp  Per-event sampling and rate limiting of SAS
+ * events.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <pthread.h>
+#include <time.h>
+
+#include "log.h"
+#include "sas_event_sampler.h"
+
+namespace SASEventSampler
+{
+  std::atomic<bool> configured(false);
+
+  // The configuration and statistics for an event ID.  Rules are only ever
+  // added (under rules_lock), and their event IDs never change once they are
+  // in use, so should_report() can read them without taking the lock.
+  struct Rule
+  {
+    std::atomic<int> event_id;
+    std::atomic<uint32_t> one_in;
+    std::atomic<uint32_t> max_per_second;
+
+    // The number of events seen, for sampling.
+    std::atomic<uint64_t> seen;
+
+    // The second the rate limit is being applied to (in the top 32 bits) and
+    // the number of events reported in it (in the bottom 32 bits), kept in
+    // one word so they can be updated together.
+    std::atomic<uint64_t> window;
+
+    std::atomic<uint64_t> suppressed;
+  };
+
+  static Rule rules[MAX_EVENTS];
+  static std::atomic<int> num_rules(0);
+  static pthread_mutex_t rules_lock = PTHREAD_MUTEX_INITIALIZER;
+
+  // Returns the rule for an event ID, or NULL if there isn't one.
+  static Rule* find_rule(int event_id)
+  {
+    int count = num_rules.load(std::memory_order_acquire);
+
+    for (int ii = 0; ii < count; ++ii)
+    {
+      if (rules[ii].event_id.load(std::memory_order_relaxed) == event_id)
+      {
+        return &rules[ii];
+      }
+    }
+
+    return NULL;
+  }
+
+  // Returns the rule for an event ID, adding one if required.  Must be
+  // called with rules_lock held.
+  static Rule* find_or_add_rule(int event_id)
+  {
+    Rule* rule = find_rule(event_id);
+
+    if (rule == NULL)
+    {
+      int count = num_rules.load(std::memory_order_relaxed);
+
+      if (count == MAX_EVENTS)
+      {
+        TRC_WARNING("Can't configure sampling of SAS event %d - %d events are already configured",
+                    event_id, MAX_EVENTS);
+        return NULL;
+      }
+
+      rule = &rules[count];
+      rule->event_id.store(event_id, std::memory_order_relaxed);
+      rule->one_in.store(1, std::memory_order_relaxed);
+      rule->max_per_second.store(0, std::memory_order_relaxed);
+      rule->seen.store(0, std::memory_order_relaxed);
+      rule->window.store(0, std::memory_order_relaxed);
+      rule->suppressed.store(0, std::memory_order_relaxed);
+      num_rules.store(count + 1, std::memory_order_release);
+    }
+
+    configured.store(true, std::memory_order_relaxed);
+    return rule;
+  }
+
+  // Returns whether an event is within its rule's rate limit, counting it if
+  // so.
+  static bool within_rate_limit(Rule* rule, uint32_t max_per_second)
+  {
+    // The coarse clock is plenty accurate enough for this, and much cheaper.
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    uint64_t second = (uint64_t)(uint32_t)now.tv_sec << 32;
+
+    uint64_t window = rule->window.load(std::memory_order_relaxed);
+
+    while (true)
+    {
+      uint64_t reported = ((window & 0xFFFFFFFF00000000ULL) == second) ?
+                          (window & 0xFFFFFFFFULL) : 0;
+
+      if (reported >= max_per_second)
+      {
+        return false;
+      }
+
+      if (rule->window.compare_exchange_weak(window,
+                                             second | (reported + 1),
+                                             std::memory_order_relaxed))
+      {
+        return true;
+      }
+    }
+  }
+
+  bool _should_report(int event_id)
+  {
+    Rule* rule = find_rule(event_id);
+
+    if (rule == NULL)
+    {
+      return true;
+    }
+
+    uint32_t one_in = rule->one_in.load(std::memory_order_relaxed);
+    uint32_t max_per_second = rule->max_per_second.load(std::memory_order_relaxed);
+    bool report = true;
+
+    if ((one_in > 1) &&
+        (rule->seen.fetch_add(1, std::memory_order_relaxed) % one_in != 0))
+    {
+      report = false;
+    }
+    else if ((max_per_second > 0) &&
+             (!within_rate_limit(rule, max_per_second)))
+    {
+      report = false;
+    }
+
+    if (!report)
+    {
+      rule->suppressed.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    return report;
+  }
+
+  bool set_sample_rate(int event_id, uint32_t one_in)
+  {
+    pthread_mutex_lock(&rules_lock);
+    Rule* rule = find_or_add_rule(event_id);
+
+    if (rule != NULL)
+    {
+      TRC_STATUS("Reporting 1 in %u SAS events with ID %d", one_in, event_id);
+      rule->one_in.store(one_in, std::memory_order_relaxed);
+    }
+
+    pthread_mutex_unlock(&rules_lock);
+    return (rule != NULL);
+  }
+
+  bool set_rate_limit(int event_id, uint32_t max_per_second)
+  {
+    pthread_mutex_lock(&rules_lock);
+    Rule* rule = find_or_add_rule(event_id);
+
+    if (rule != NULL)
+    {
+      TRC_STATUS("Reporting at most %u SAS events with ID %d per second",
+                 max_per_second, event_id);
+      rule->max_per_second.store(max_per_second, std::memory_order_relaxed);
+    }
+
+    pthread_mutex_unlock(&rules_lock);
+    return (rule != NULL);
+  }
+
+  void clear(int event_id)
+  {
+    pthread_mutex_lock(&rules_lock);
+    Rule* rule = find_rule(event_id);
+
+    if (rule != NULL)
+    {
+      // Leave the rule in place (so its statistics are kept), but let every
+      // event through.
+      TRC_STATUS("Reporting all SAS events with ID %d", event_id);
+      rule->one_in.store(1, std::memory_order_relaxed);
+      rule->max_per_second.store(0, std::memory_order_relaxed);
+    }
+
+    pthread_mutex_unlock(&rules_lock);
+  }
+
+  uint64_t suppressed(int event_id)
+  {
+    Rule* rule = find_rule(event_id);
+    return (rule != NULL) ? rule->suppressed.load(std::memory_order_relaxed) : 0;
+  }
+}
@@ -18,6 +18,7 @@
 
 #include "cpp_common_pd_definitions.h"
 #include "json_parse_utils.h"
+#include "json_writer.h"
 #include "namespace_hop.h"
 #include "sasevent.h"
 #include "log.h"
@@ -103,14 +104,15 @@ void SasService::extract_config()
     }
 
     // We have a valid rapidjson object.  Write this to the _sas_servers member
-    rapidjson::StringBuffer buffer;
-    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    std::string sas_servers_json;
+    JsonStringStream stream(sas_servers_json);
+    JsonStringWriter writer(stream);
     sas_servers.Accept(writer);
 
-    TRC_DEBUG("New _sas_servers config:  %s", buffer.GetString());
+    TRC_DEBUG("New _sas_servers config:  %s", sas_servers_json.c_str());
 
     boost::lock_guard<boost::shared_mutex> write_lock(_sas_server_lock);
-    _sas_servers = buffer.GetString();
+    _sas_servers.swap(sas_servers_json);
   }
   catch (JsonFormatError err)
   {
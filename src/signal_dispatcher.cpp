@@ -0,0 +1,279 @@
+/**
+ * @file signal_dispatcher.cpp  Dispatches UNIX signals to callbacks through
+ * a signalfd.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "signal_dispatcher.h"
+
+SignalDispatcher::SignalDispatcher() :
+  _callbacks(),
+  _fd(-1),
+  _stop_fd(-1),
+  _thread_running(false)
+{
+  pthread_mutex_init(&_lock, NULL);
+  sigemptyset(&_mask);
+}
+
+SignalDispatcher::~SignalDispatcher()
+{
+  if (_thread_running)
+  {
+    uint64_t value = 1;
+
+    if (write(_stop_fd, &value, sizeof(value)) < 0)
+    {
+      TRC_WARNING("Failed to stop signal dispatcher thread: %d", errno); // LCOV_EXCL_LINE
+    }
+
+    pthread_join(_thread, NULL);
+  }
+
+  if (_stop_fd >= 0)
+  {
+    close(_stop_fd);
+  }
+
+  if (_fd >= 0)
+  {
+    close(_fd);
+  }
+
+  pthread_mutex_destroy(&_lock);
+}
+
+bool SignalDispatcher::add_handler(int signum, Callback callback)
+{
+  bool success = true;
+
+  pthread_mutex_lock(&_lock);
+
+  if (!sigismember(&_mask, signum))
+  {
+    sigset_t mask = _mask;
+    sigaddset(&mask, signum);
+
+    // Block the signal before adding it to the signalfd, so that it isn't
+    // delivered to its old handler in between.
+    sigset_t signal_only;
+    sigemptyset(&signal_only);
+    sigaddset(&signal_only, signum);
+    pthread_sigmask(SIG_BLOCK, &signal_only, NULL);
+
+    int fd = signalfd(_fd, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    if (fd < 0)
+    {
+      TRC_ERROR("Failed to add signal %d to signalfd: %d", signum, errno);
+      pthread_sigmask(SIG_UNBLOCK, &signal_only, NULL);
+      success = false;
+    }
+    else
+    {
+      _fd = fd;
+      _mask = mask;
+    }
+  }
+
+  if (success)
+  {
+    TRC_DEBUG("Added handler for signal %d", signum);
+    _callbacks[signum].push_back(callback);
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  return success;
+}
+
+void SignalDispatcher::dispatch()
+{
+  struct signalfd_siginfo info;
+
+  while (read(_fd, &info, sizeof(info)) == sizeof(info))
+  {
+    int signum = info.ssi_signo;
+    TRC_DEBUG("Signal %d raised", signum);
+
+    std::vector<Callback> callbacks;
+
+    pthread_mutex_lock(&_lock);
+    std::map<int, std::vector<Callback> >::const_iterator it = _callbacks.find(signum);
+
+    if (it != _callbacks.end())
+    {
+      callbacks = it->second;
+    }
+
+    pthread_mutex_unlock(&_lock);
+
+    for (std::vector<Callback>::const_iterator callback = callbacks.begin();
+         callback != callbacks.end();
+         ++callback)
+    {
+      (*callback)(signum, info);
+    }
+  }
+}
+
+bool SignalDispatcher::start()
+{
+  if (_thread_running)
+  {
+    TRC_WARNING("Signal dispatcher thread already started");
+    return true;
+  }
+
+  if (_fd < 0)
+  {
+    TRC_ERROR("Can't start signal dispatcher with no handlers");
+    return false;
+  }
+
+  _stop_fd = eventfd(0, EFD_CLOEXEC);
+
+  if (_stop_fd < 0)
+  {
+    TRC_ERROR("Failed to create signal dispatcher eventfd: %d", errno); // LCOV_EXCL_LINE
+    return false; // LCOV_EXCL_LINE
+  }
+
+  int rc = pthread_create(&_thread, NULL, dispatcher_thread, this);
+
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to create signal dispatcher thread: %d", rc);
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  _thread_running = true;
+  return true;
+}
+
+void* SignalDispatcher::dispatcher_thread(void* dispatcher)
+{
+  ((SignalDispatcher*)dispatcher)->dispatcher_thread();
+  return NULL;
+}
+
+void SignalDispatcher::dispatcher_thread()
+{
+  while (true)
+  {
+    struct pollfd fds[2];
+    fds[0].fd = _fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = _stop_fd;
+    fds[1].events = POLLIN;
+
+    int rc = poll(fds, 2, -1);
+
+    if (rc < 0)
+    {
+      if (errno != EINTR)
+      {
+        TRC_WARNING("Failed to poll signalfd: %d", errno); // LCOV_EXCL_LINE
+      }
+
+      continue;
+    }
+
+    if (fds[1].revents != 0)
+    {
+      break;
+    }
+
+    if (fds[0].revents != 0)
+    {
+      dispatch();
+    }
+  }
+}
+
+DispatchedSignalWaiter::State::State() :
+  raised(0)
+{
+  pthread_mutex_init(&mutex, NULL);
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+}
+
+DispatchedSignalWaiter::State::~State()
+{
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&mutex);
+}
+
+DispatchedSignalWaiter::DispatchedSignalWaiter(SignalDispatcher* dispatcher,
+                                               int signum) :
+  _state(new State())
+{
+  std::shared_ptr<State> state = _state;
+
+  bool added = dispatcher->add_handler(signum,
+                                       [state](int, const struct signalfd_siginfo&)
+                                       {
+                                         pthread_mutex_lock(&state->mutex);
+                                         ++state->raised;
+                                         pthread_cond_broadcast(&state->cond);
+                                         pthread_mutex_unlock(&state->mutex);
+                                       });
+
+  if (!added)
+  {
+    // The waiter still works, but always times out.
+    TRC_ERROR("Failed to wait for signal %d - it will never be reported", signum);
+  }
+}
+
+bool DispatchedSignalWaiter::wait_for_signal()
+{
+  // Wait for either the signal to be raised or timeout, as
+  // SignalHandler::wait_for_signal does.  Counting the signals means a
+  // spurious wakeup isn't mistaken for one.
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#ifndef UNIT_TEST
+  ts.tv_sec += 1;
+#else
+  ts.tv_nsec += 1000000;
+  if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec += 1;
+      ts.tv_nsec -= 1000000000;
+  }
+#endif
+
+  pthread_mutex_lock(&_state->mutex);
+  uint64_t raised = _state->raised;
+  int rc = 0;
+
+  while ((_state->raised == raised) && (rc != ETIMEDOUT))
+  {
+    rc = pthread_cond_timedwait(&_state->cond, &_state->mutex, &ts);
+  }
+
+  bool signalled = (_state->raised != raised);
+  pthread_mutex_unlock(&_state->mutex);
+
+  return signalled;
+}
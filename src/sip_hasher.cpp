@@ -0,0 +1,269 @@
+/**
+ * @file sip_hasher.cpp  Optimised SipHash implementation.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <endian.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "sip_hasher.h"
+
+const size_t SipHasher::BATCH_SIZE;
+
+namespace
+{
+  inline uint64_t rotl(uint64_t x, int b)
+  {
+    return (x << b) | (x >> (64 - b));
+  }
+
+  // A SipHash state.
+  struct State
+  {
+    uint64_t v0;
+    uint64_t v1;
+    uint64_t v2;
+    uint64_t v3;
+
+    inline void round()
+    {
+      v0 += v1;
+      v1 = rotl(v1, 13);
+      v1 ^= v0;
+      v0 = rotl(v0, 32);
+      v2 += v3;
+      v3 = rotl(v3, 16);
+      v3 ^= v2;
+      v0 += v3;
+      v3 = rotl(v3, 21);
+      v3 ^= v0;
+      v2 += v1;
+      v1 = rotl(v1, 17);
+      v1 ^= v2;
+      v2 = rotl(v2, 32);
+    }
+
+    template <int ROUNDS>
+    inline void compress(uint64_t m)
+    {
+      v3 ^= m;
+
+      for (int ii = 0; ii < ROUNDS; ++ii)
+      {
+        round();
+      }
+
+      v0 ^= m;
+    }
+
+    template <int ROUNDS>
+    inline uint64_t finalize()
+    {
+      v2 ^= 0xff;
+
+      for (int ii = 0; ii < ROUNDS; ++ii)
+      {
+        round();
+      }
+
+      return v0 ^ v1 ^ v2 ^ v3;
+    }
+  };
+
+  // Reads a little-endian word.
+  inline uint64_t read_word(const uint8_t* p)
+  {
+    uint64_t m;
+    memcpy(&m, p, sizeof(m));
+    return le64toh(m);
+  }
+
+  // Returns the last block of an item: its remaining (up to 7) bytes, with
+  // the bottom byte of its length in the top byte.
+  inline uint64_t last_block(const uint8_t* data, size_t length)
+  {
+    const uint8_t* in = data + (length & ~(size_t)7);
+    uint64_t b = (uint64_t)length << 56;
+
+    // Avoid a variable length memcpy, which would be a function call.
+    switch (length & 7)
+    {
+    case 7:
+      b |= ((uint64_t)in[6]) << 48;
+      // Fall through
+    case 6:
+      b |= ((uint64_t)in[5]) << 40;
+      // Fall through
+    case 5:
+      b |= ((uint64_t)in[4]) << 32;
+      // Fall through
+    case 4:
+      b |= ((uint64_t)in[3]) << 24;
+      // Fall through
+    case 3:
+      b |= ((uint64_t)in[2]) << 16;
+      // Fall through
+    case 2:
+      b |= ((uint64_t)in[1]) << 8;
+      // Fall through
+    case 1:
+      b |= ((uint64_t)in[0]);
+      break;
+    default:
+      break;
+    }
+
+    return b;
+  }
+
+  // Does a round on each of a batch of states, interleaving them. Batches are
+  // kept small enough that all the states fit in registers.
+  static_assert(SipHasher::BATCH_SIZE == 2, "round_all assumes batches of 2");
+
+  inline void round_all(State (&s)[SipHasher::BATCH_SIZE])
+  {
+    s[0].round();
+    s[1].round();
+  }
+
+  template <int ROUNDS>
+  inline void compress_all(State (&s)[SipHasher::BATCH_SIZE], const uint64_t (&m)[SipHasher::BATCH_SIZE])
+  {
+    for (size_t jj = 0; jj < SipHasher::BATCH_SIZE; ++jj)
+    {
+      s[jj].v3 ^= m[jj];
+    }
+
+    for (int ii = 0; ii < ROUNDS; ++ii)
+    {
+      round_all(s);
+    }
+
+    for (size_t jj = 0; jj < SipHasher::BATCH_SIZE; ++jj)
+    {
+      s[jj].v0 ^= m[jj];
+    }
+  }
+
+  template <int C_ROUNDS, int D_ROUNDS>
+  inline uint64_t sip_hash(State s, const void* data, size_t length)
+  {
+    const uint8_t* in = (const uint8_t*)data;
+    const uint8_t* end = in + (length & ~(size_t)7);
+
+    for (; in != end; in += 8)
+    {
+      s.compress<C_ROUNDS>(read_word(in));
+    }
+
+    s.compress<C_ROUNDS>(last_block((const uint8_t*)data, length));
+    return s.finalize<D_ROUNDS>();
+  }
+}
+
+SipHasher::SipHasher() :
+  SipHasher(0, 0)
+{
+}
+
+SipHasher::SipHasher(uint64_t k0, uint64_t k1) :
+  _v0(0x736f6d6570736575ULL ^ k0),
+  _v1(0x646f72616e646f6dULL ^ k1),
+  _v2(0x6c7967656e657261ULL ^ k0),
+  _v3(0x7465646279746573ULL ^ k1)
+{
+}
+
+uint64_t SipHasher::hash(const void* data, size_t length) const
+{
+  State s = {_v0, _v1, _v2, _v3};
+  return sip_hash<2, 4>(s, data, length);
+}
+
+uint64_t SipHasher::hash_1_3(const void* data, size_t length) const
+{
+  State s = {_v0, _v1, _v2, _v3};
+  return sip_hash<1, 3>(s, data, length);
+}
+
+void SipHasher::hash_many(const void* const* data,
+                          const size_t* lengths,
+                          size_t count,
+                          uint64_t* out) const
+{
+  size_t ii = 0;
+
+  for (; ii + BATCH_SIZE <= count; ii += BATCH_SIZE)
+  {
+    State s[BATCH_SIZE];
+    const uint8_t* in[BATCH_SIZE];
+    size_t words = SIZE_MAX;
+
+    for (size_t jj = 0; jj < BATCH_SIZE; ++jj)
+    {
+      s[jj] = {_v0, _v1, _v2, _v3};
+      in[jj] = (const uint8_t*)data[ii + jj];
+      words = std::min(words, lengths[ii + jj] / 8);
+    }
+
+    // Hash the words that all the items have together, then the rest of
+    // each item separately.
+    uint64_t m[BATCH_SIZE];
+
+    for (size_t word = 0; word < words; ++word)
+    {
+      for (size_t jj = 0; jj < BATCH_SIZE; ++jj)
+      {
+        m[jj] = read_word(in[jj] + (word * 8));
+      }
+
+      compress_all<2>(s, m);
+    }
+
+    for (size_t jj = 0; jj < BATCH_SIZE; ++jj)
+    {
+      for (size_t word = words; word < lengths[ii + jj] / 8; ++word)
+      {
+        s[jj].compress<2>(read_word(in[jj] + (word * 8)));
+      }
+    }
+
+    // The last block and finalization are most of the work for short items,
+    // so do those together too.
+    for (size_t jj = 0; jj < BATCH_SIZE; ++jj)
+    {
+      m[jj] = last_block(in[jj], lengths[ii + jj]);
+    }
+
+    compress_all<2>(s, m);
+
+    for (size_t jj = 0; jj < BATCH_SIZE; ++jj)
+    {
+      s[jj].v2 ^= 0xff;
+    }
+
+    for (int round = 0; round < 4; ++round)
+    {
+      round_all(s);
+    }
+
+    for (size_t jj = 0; jj < BATCH_SIZE; ++jj)
+    {
+      out[ii + jj] = s[jj].v0 ^ s[jj].v1 ^ s[jj].v2 ^ s[jj].v3;
+    }
+  }
+
+  for (; ii < count; ++ii)
+  {
+    out[ii] = hash(data[ii], lengths[ii]);
+  }
+}
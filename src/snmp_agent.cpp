@@ -9,10 +9,19 @@
  * Metaswitch Networks in a separate written agreement.
  */
 
+#include <ctype.h>
+#include <errno.h>
 #include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <algorithm>
+#include <vector>
 #include <net-snmp/library/large_fd_set.h>
 #include "snmp_internal/snmp_includes.h"
 #include "snmp_agent.h"
+#include "snmp_row.h"
 #include "log.h"
 
 namespace SNMP
@@ -35,6 +44,14 @@ void Agent::deinstantiate()
 
 Agent::Agent(std::string name) : _name(name)
 {
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&_snapshot_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+  pthread_cond_init(&_changes_cond, NULL);
+  _changes_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
   pthread_mutex_lock(&_netsnmp_lock);
 
   // Make sure we start as a subagent, not a master agent.
@@ -77,6 +94,24 @@ Agent::~Agent()
 {
   snmp_unregister_callback(SNMP_CALLBACK_LIBRARY, SNMP_CALLBACK_LOGGING, logging_callback, NULL, 1);
   netsnmp_container_free_list();
+  pthread_cond_destroy(&_snapshot_cond);
+  pthread_cond_destroy(&_changes_cond);
+  close(_changes_fd);
+}
+
+void Agent::enable_snapshots(unsigned int interval_s)
+{
+  _snapshot_interval_s = interval_s;
+}
+
+void Agent::enable_open_metrics()
+{
+  _open_metrics = true;
+}
+
+std::shared_ptr<const std::string> Agent::get_open_metrics() const
+{
+  return std::atomic_load(&_open_metrics_text);
 }
 
 void Agent::start(void)
@@ -90,13 +125,45 @@ void Agent::start(void)
   {
     throw rc;
   }
+
+  pthread_mutex_lock(&_changes_lock);
+  _thread_running = true;
+  pthread_mutex_unlock(&_changes_lock);
+
+  if (_snapshot_interval_s > 0)
+  {
+    _snapshot_terminated = false;
+    rc = pthread_create(&_snapshot_thread, NULL, snapshot_thread_fn, this);
+    if (rc != 0)
+    {
+      throw rc;
+    }
+    _snapshot_thread_running = true;
+  }
 }
 
 void Agent::stop(void)
 {
+  if (_snapshot_thread_running)
+  {
+    pthread_mutex_lock(&_snapshot_lock);
+    _snapshot_terminated = true;
+    pthread_cond_broadcast(&_snapshot_cond);
+    pthread_mutex_unlock(&_snapshot_lock);
+    pthread_join(_snapshot_thread, NULL);
+    _snapshot_thread_running = false;
+  }
+
   pthread_cancel(_thread);
   pthread_join(_thread, NULL);
 
+  // Make any changes the agent thread didn't get to, and wake anyone waiting
+  // for them.
+  pthread_mutex_lock(&_changes_lock);
+  _thread_running = false;
+  pthread_mutex_unlock(&_changes_lock);
+  make_changes();
+
   pthread_mutex_lock(&_netsnmp_lock);
   snmp_shutdown(_name.c_str());
   netsnmp_container_free_list();
@@ -105,16 +172,225 @@ void Agent::stop(void)
 
 void Agent::add_row_to_table(netsnmp_tdata* table, netsnmp_tdata_row* row)
 {
-  pthread_mutex_lock(&_netsnmp_lock);
-  netsnmp_tdata_add_row(table, row);
-  pthread_mutex_unlock(&_netsnmp_lock);
+  pthread_mutex_lock(&_snapshot_lock);
+  _rows[static_cast<Row*>(row->data)] = table;
+  pthread_mutex_unlock(&_snapshot_lock);
+
+  RowChange change = {true, table, row, NULL};
+
+  if (queue_change(change) == 0)
+  {
+    make_changes();
+  }
 }
 
 void Agent::remove_row_from_table(netsnmp_tdata* table, netsnmp_tdata_row* row)
 {
-  pthread_mutex_lock(&_netsnmp_lock);
-  netsnmp_tdata_remove_row(table, row);
-  pthread_mutex_unlock(&_netsnmp_lock);
+  RowChange change = {false, table, row, NULL};
+  wait_for_change(queue_change(change));
+
+  // The row is about to be deleted, so wait for the snapshot thread to
+  // finish with it.
+  forget_row(static_cast<Row*>(row->data));
+}
+
+void Agent::remove_and_delete_row(netsnmp_tdata* table, Row* row)
+{
+  RowChange change = {false, table, row->get_netsnmp_row(), row};
+
+  if (queue_change(change) == 0)
+  {
+    make_changes();
+  }
+}
+
+void Agent::wait_for_changes()
+{
+  pthread_mutex_lock(&_changes_lock);
+  uint64_t seq = _thread_running ? _changes_queued : 0;
+  pthread_mutex_unlock(&_changes_lock);
+
+  wait_for_change(seq);
+}
+
+void Agent::wait_for_change(uint64_t seq)
+{
+  if (seq != 0)
+  {
+    // Wait for the agent thread to make the change (or to stop, leaving the
+    // change to us).
+    pthread_mutex_lock(&_changes_lock);
+
+    while ((_thread_running) && (_changes_made < seq))
+    {
+      pthread_cond_wait(&_changes_cond, &_changes_lock);
+    }
+
+    seq = (_changes_made < seq) ? 0 : seq;
+    pthread_mutex_unlock(&_changes_lock);
+  }
+
+  if (seq == 0)
+  {
+    make_changes();
+  }
+}
+
+uint64_t Agent::queue_change(const RowChange& change)
+{
+  pthread_mutex_lock(&_changes_lock);
+  _changes.push_back(change);
+  uint64_t seq = ++_changes_queued;
+  bool running = _thread_running;
+  pthread_mutex_unlock(&_changes_lock);
+
+  if (!running)
+  {
+    return 0;
+  }
+
+  // Wake the agent thread.  Several wake-ups before it next runs are merged
+  // into one.
+  uint64_t wake = 1;
+  if (write(_changes_fd, &wake, sizeof(wake)) < 0)
+  {
+    TRC_DEBUG("Failed to wake SNMP agent thread (errno %d)", errno);
+  }
+
+  return seq;
+}
+
+void Agent::make_changes()
+{
+  pthread_mutex_lock(&_apply_lock);
+
+  pthread_mutex_lock(&_changes_lock);
+  std::vector<RowChange> changes;
+  changes.swap(_changes);
+  uint64_t seq = _changes_queued;
+  pthread_mutex_unlock(&_changes_lock);
+
+  if (!changes.empty())
+  {
+    pthread_mutex_lock(&_netsnmp_lock);
+
+    for (std::vector<RowChange>::iterator it = changes.begin();
+         it != changes.end();
+         ++it)
+    {
+      if (it->add)
+      {
+        netsnmp_tdata_add_row(it->table, it->row);
+      }
+      else
+      {
+        netsnmp_tdata_remove_row(it->table, it->row);
+      }
+    }
+
+    pthread_mutex_unlock(&_netsnmp_lock);
+
+    // Now the rows to be deleted can't be reached from an SNMP request, wait
+    // for the snapshot thread to finish with them and delete them.
+    for (std::vector<RowChange>::iterator it = changes.begin();
+         it != changes.end();
+         ++it)
+    {
+      if (it->to_delete != NULL)
+      {
+        forget_row(it->to_delete);
+        delete it->to_delete;
+      }
+    }
+  }
+
+  pthread_mutex_lock(&_changes_lock);
+  _changes_made = std::max(_changes_made, seq);
+  pthread_cond_broadcast(&_changes_cond);
+  pthread_mutex_unlock(&_changes_lock);
+
+  pthread_mutex_unlock(&_apply_lock);
+}
+
+void Agent::forget_row(Row* row)
+{
+  pthread_mutex_lock(&_snapshot_lock);
+  _rows.erase(row);
+
+  while (_snapshotting == row)
+  {
+    pthread_cond_wait(&_snapshot_cond, &_snapshot_lock);
+  }
+
+  pthread_mutex_unlock(&_snapshot_lock);
+}
+
+void* Agent::snapshot_thread_fn(void* snmp_agent)
+{
+  ((Agent*)snmp_agent)->snapshot_thread_fn();
+  return NULL;
+}
+
+void Agent::snapshot_thread_fn()
+{
+  struct timespec next_snapshot;
+  clock_gettime(CLOCK_MONOTONIC, &next_snapshot);
+
+  pthread_mutex_lock(&_snapshot_lock);
+
+  while (!_snapshot_terminated)
+  {
+    // Snapshot a copy of the set of rows, as rows may be added and removed
+    // while the lock is released.  Rows are snapshotted one at a time
+    // without the lock held, so reading a row doesn't hold up changes to
+    // other rows.
+    std::vector<Row*> rows;
+    rows.reserve(_rows.size());
+
+    for (std::map<Row*, netsnmp_tdata*>::iterator it = _rows.begin();
+         it != _rows.end();
+         ++it)
+    {
+      rows.push_back(it->first);
+    }
+
+    for (std::vector<Row*>::iterator it = rows.begin();
+         (it != rows.end()) && (!_snapshot_terminated);
+         ++it)
+    {
+      if (_rows.find(*it) == _rows.end())
+      {
+        // The row has been removed since we copied the set.
+        continue;
+      }
+
+      _snapshotting = *it;
+      pthread_mutex_unlock(&_snapshot_lock);
+
+      (*it)->take_snapshot();
+
+      pthread_mutex_lock(&_snapshot_lock);
+      _snapshotting = NULL;
+      pthread_cond_broadcast(&_snapshot_cond);
+    }
+
+    if ((_open_metrics) && (!_snapshot_terminated))
+    {
+      render_open_metrics();
+    }
+
+    next_snapshot.tv_sec += _snapshot_interval_s;
+
+    while ((!_snapshot_terminated) &&
+           (pthread_cond_timedwait(&_snapshot_cond,
+                                   &_snapshot_lock,
+                                   &next_snapshot) != ETIMEDOUT))
+    {
+      // Woken early (by a row being removed, or spuriously) - keep waiting.
+    }
+  }
+
+  pthread_mutex_unlock(&_snapshot_lock);
 }
 
 void* Agent::thread_fn(void* snmp_agent)
@@ -133,6 +409,13 @@ void Agent::thread_fn()
 
   while (1)
   {
+    // Make the queued changes to the tables between requests, with
+    // cancellation disabled so that stop() can't leave a change half made.
+    int cancel_state;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+    make_changes();
+    pthread_setcancelstate(cancel_state, NULL);
+
     // Set up some variables and call into Net-SNMP to initialize them ready
     // for the select call.
     num_fds = 0;
@@ -144,18 +427,36 @@ void Agent::thread_fn()
     snmp_select_info2(&num_fds, &read_fds, &timeout, &block);
     pthread_mutex_unlock(&_netsnmp_lock);
 
+    // Also wake up when changes are queued.
+    NETSNMP_LARGE_FD_SET(_changes_fd, &read_fds);
+    num_fds = std::max(num_fds, _changes_fd + 1);
+
     // Wait for some SNMP work or the timeout to expire, and then process.
     int select_rc = netsnmp_large_fd_set_select(num_fds, &read_fds, NULL, NULL, (!block) ? &timeout : NULL);
+    bool changes_queued = false;
+
+    if ((select_rc > 0) && (NETSNMP_LARGE_FD_ISSET(_changes_fd, &read_fds)))
+    {
+      uint64_t wakes;
+      if (read(_changes_fd, &wakes, sizeof(wakes)) < 0)
+      {
+        TRC_DEBUG("Failed to clear SNMP agent wake-up (errno %d)", errno);
+      }
+      changes_queued = true;
+      NETSNMP_LARGE_FD_CLR(_changes_fd, &read_fds);
+      select_rc--;
+    }
 
     if (select_rc >= 0)
     {
-      // Pass the work or the timeout indication to Net-SNMP.
+      // Pass the work or the timeout indication to Net-SNMP.  Being woken
+      // for queued changes isn't a timeout.
       pthread_mutex_lock(&_netsnmp_lock);
       if (select_rc > 0)
       {
         snmp_read2(&read_fds);
       }
-      else if (select_rc == 0)
+      else if (!changes_queued)
       {
         snmp_timeout();
       }
@@ -176,6 +477,134 @@ void Agent::thread_fn()
   }
 };
 
+// Converts a table name into a valid metric name.
+static std::string metric_name(const char* table_name)
+{
+  std::string name = (table_name != NULL) ? table_name : "";
+
+  for (std::string::iterator it = name.begin(); it != name.end(); ++it)
+  {
+    if (!isalnum((unsigned char)*it) && (*it != '_'))
+    {
+      *it = '_';
+    }
+  }
+
+  if (name.empty() || isdigit((unsigned char)name[0]))
+  {
+    name.insert(0, "_");
+  }
+
+  return name;
+}
+
+void Agent::render_open_metrics()
+{
+  // A row to render, with its table's metric name and its index.
+  struct RenderRow
+  {
+    std::string name;
+    std::string index;
+    std::shared_ptr<const ColumnData> columns;
+
+    bool operator<(const RenderRow& other) const
+    {
+      return (name < other.name) || ((name == other.name) && (index < other.index));
+    }
+  };
+
+  // Gather the rows' snapshots with the lock held, so the rows can't be
+  // deleted, then render them without it.
+  std::vector<RenderRow> render_rows;
+  render_rows.reserve(_rows.size());
+
+  for (std::map<Row*, netsnmp_tdata*>::iterator it = _rows.begin();
+       it != _rows.end();
+       ++it)
+  {
+    RenderRow render_row;
+    render_row.columns = it->first->get_snapshot();
+
+    if (!render_row.columns)
+    {
+      continue;
+    }
+
+    render_row.name = metric_name(it->second->name);
+
+    netsnmp_tdata_row* row = it->first->get_netsnmp_row();
+    char oid_buf[16];
+
+    for (size_t ii = 0; ii < row->oid_index.len; ++ii)
+    {
+      snprintf(oid_buf, sizeof(oid_buf), (ii == 0) ? "%lu" : ".%lu",
+               (unsigned long)row->oid_index.oids[ii]);
+      render_row.index.append(oid_buf);
+    }
+
+    render_rows.push_back(render_row);
+  }
+
+  pthread_mutex_unlock(&_snapshot_lock);
+
+  std::sort(render_rows.begin(), render_rows.end());
+
+  std::string* text = new std::string();
+  text->reserve(render_rows.size() * 256);
+  const std::string* name = NULL;
+
+  for (std::vector<RenderRow>::iterator it = render_rows.begin();
+       it != render_rows.end();
+       ++it)
+  {
+    if ((name == NULL) || (*name != it->name))
+    {
+      name = &it->name;
+      text->append("# TYPE ").append(*name).append(" unknown\n");
+    }
+
+    for (ColumnData::const_iterator column = it->columns->begin();
+         column != it->columns->end();
+         ++column)
+    {
+      // Only numeric values are exposed - strings (e.g. addresses) are
+      // already part of the row index.
+      const Value& value = column->second;
+      char value_buf[32];
+
+      if ((value.type == ASN_INTEGER) && (value.size == sizeof(int32_t)))
+      {
+        int32_t integer;
+        memcpy(&integer, value.value, sizeof(integer));
+        snprintf(value_buf, sizeof(value_buf), "%d", integer);
+      }
+      else if (((value.type == ASN_UNSIGNED) ||
+                (value.type == ASN_COUNTER) ||
+                (value.type == ASN_TIMETICKS)) &&
+               (value.size == sizeof(uint32_t)))
+      {
+        uint32_t uinteger;
+        memcpy(&uinteger, value.value, sizeof(uinteger));
+        snprintf(value_buf, sizeof(value_buf), "%u", uinteger);
+      }
+      else
+      {
+        continue;
+      }
+
+      text->append(*name)
+           .append("{index=\"").append(it->index)
+           .append("\",column=\"").append(std::to_string(column->first))
+           .append("\"} ").append(value_buf).append("\n");
+    }
+  }
+
+  text->append("# EOF\n");
+  std::atomic_store(&_open_metrics_text, std::shared_ptr<const std::string>(text));
+
+  pthread_mutex_lock(&_snapshot_lock);
+}
+
 int Agent::logging_callback(int majorID, int minorID, void* serverarg, void* clientarg)
 {
   snmp_log_message* log_message = (snmp_log_message*)serverarg;
@@ -243,10 +672,11 @@ int snmp_setup(const char* name)
 }
 
 // Set up the SNMP handling threads. Returns 0 if it succeeds.
-int init_snmp_handler_threads(const char* name)
+int init_snmp_handler_threads(const char* name, unsigned int snapshot_interval_s)
 {
   try
   {
+    SNMP::Agent::instance()->enable_snapshots(snapshot_interval_s);
     SNMP::Agent::instance()->start();
     return 0;
   }
@@ -0,0 +1,104 @@
+/**
+ * @file snmp_cassandra_request_table.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "snmp_internal/snmp_includes.h"
+#include "snmp_internal/snmp_table.h"
+#include "snmp_cassandra_request_table.h"
+#include "log.h"
+
+namespace SNMP
+{
+
+// Row that reports the stats of one column family and request type.
+class CassandraRequestRow : public Row
+{
+public:
+  CassandraRequestRow(const CassandraRequestStats* stats) :
+    Row(),
+    _name(stats->name()),
+    _stats(stats)
+  {
+    netsnmp_tdata_row_add_index(_row,
+                                ASN_OCTET_STR,
+                                _name.c_str(),
+                                _name.length());
+  };
+
+  ColumnData get_columns()
+  {
+    CassandraRequestStats::Snapshot snapshot;
+    _stats->snapshot(snapshot);
+
+    ColumnData ret;
+    ret[1] = Value(ASN_OCTET_STR,
+                   (unsigned char*)(_name.c_str()),
+                   _name.size());
+    ret[2] = counter(snapshot.requests);
+    ret[3] = counter(snapshot.failures);
+    ret[4] = counter(snapshot.retries);
+    ret[5] = counter(snapshot.fallbacks);
+    return ret;
+  }
+
+private:
+  // The counts are Counter32s, so wrap as any other counter would.
+  static Value counter(uint64_t count)
+  {
+    uint32_t count32 = (uint32_t)count;
+    return Value(ASN_COUNTER, (unsigned char*)&count32, sizeof(uint32_t));
+  }
+
+  std::string _name;
+  const CassandraRequestStats* _stats;
+};
+
+class CassandraRequestTableImpl : public ManagedTable<CassandraRequestRow, std::string>,
+                                  public CassandraRequestTable
+{
+public:
+  CassandraRequestTableImpl(std::string name, std::string tbl_oid) :
+    ManagedTable<CassandraRequestRow, std::string>(name,
+                                                   tbl_oid,
+                                                   2,
+                                                   5,
+                                                   { ASN_OCTET_STR })
+  {
+    TRC_INFO("Created table with name %s, OID %s", name.c_str(), tbl_oid.c_str());
+    pthread_mutex_init(&_table_lock, NULL);
+  }
+
+  ~CassandraRequestTableImpl()
+  {
+    TRC_INFO("Destroying table with name %s", _name.c_str());
+    pthread_mutex_destroy(&_table_lock);
+  }
+
+  void add_request_type(const CassandraRequestStats* stats)
+  {
+    pthread_mutex_lock(&_table_lock);
+    this->add(stats->name(), new CassandraRequestRow(stats));
+    pthread_mutex_unlock(&_table_lock);
+  }
+
+private:
+  CassandraRequestRow* new_row(std::string name) { return NULL; };
+
+  // Lock to protect the rows map.
+  pthread_mutex_t _table_lock;
+};
+
+CassandraRequestTable* CassandraRequestTable::create(std::string name,
+                                                     std::string oid)
+{
+  return new CassandraRequestTableImpl(name, oid);
+}
+
+}
@@ -9,6 +9,7 @@
  * Metaswitch Networks in a separate written agreement.
  */
 
+#include "fast_clock.h"
 #include "snmp_statistics_structures.h"
 #include "snmp_internal/snmp_time_period_table.h"
 #include "snmp_continuous_accumulator_table.h"
@@ -24,6 +25,164 @@ public:
   ColumnData get_columns();
 };
 
+// ContinuousStatistics split across shards, for tables accumulated into by
+// many threads at once.  The count and water marks are kept per shard, along
+// with the shard's latest sample.  The time-weighted sum and sum of squares
+// are kept in `integrated`, which is only written the first time each tick of
+// the clock is seen, using the latest sample in any shard as the value held
+// since the last update.
+struct ShardedContinuousStatistics
+{
+  static const int NUM_SHARDS = 16;
+
+  struct Shard
+  {
+    Shard() : count(0), lwm(ULONG_MAX), hwm(0), value(0), time_ms(0) {}
+
+    // Keeps each shard in its own cache line.
+    char _padding[64];
+    std::atomic_uint_fast64_t count;
+    std::atomic_uint_fast64_t lwm;
+    std::atomic_uint_fast64_t hwm;
+    std::atomic_uint_fast64_t value;
+
+    // The time of the latest sample, or 0 if there hasn't been one this period.
+    std::atomic_uint_fast64_t time_ms;
+  };
+
+  Shard shards[NUM_SHARDS];
+  char _padding[64];
+
+  // Only the value, times, sum and sum of squares are used.  The count and
+  // water marks hold those carried over from the previous period.
+  ContinuousStatistics integrated;
+
+  void accumulate(uint32_t sample, uint64_t time_now_ms)
+  {
+    Shard& shard = shards[shard_index()];
+    shard.count.fetch_add(1, std::memory_order_relaxed);
+
+    uint_fast64_t lwm = shard.lwm.load(std::memory_order_relaxed);
+    while ((sample < lwm) &&
+           (!shard.lwm.compare_exchange_weak(lwm, sample)))
+    {
+      // Do nothing.
+    }
+    uint_fast64_t hwm = shard.hwm.load(std::memory_order_relaxed);
+    while ((sample > hwm) &&
+           (!shard.hwm.compare_exchange_weak(hwm, sample)))
+    {
+      // Do nothing.
+    }
+
+    // The first sample in a new tick integrates the value held since the
+    // last update.  This is done before the sample is stored, so a shard's
+    // sample is never later than the last update.
+    uint_fast64_t time_last_update_ms = integrated.time_last_update_ms.load();
+    if ((time_now_ms > time_last_update_ms) &&
+        (integrated.time_last_update_ms.compare_exchange_strong(time_last_update_ms,
+                                                                time_now_ms)))
+    {
+      uint64_t current_value = latest_value();
+      uint64_t time_since_last_update = time_now_ms - time_last_update_ms;
+      integrated.sum += current_value * time_since_last_update;
+      integrated.sqsum += current_value * current_value * time_since_last_update;
+      integrated.current_value = current_value;
+    }
+
+    shard.value.store(sample, std::memory_order_relaxed);
+    shard.time_ms.store(time_now_ms, std::memory_order_release);
+  }
+
+  // Returns the latest sample in any shard, or the value carried over from
+  // the previous period if there haven't been any.
+  uint64_t latest_value()
+  {
+    uint64_t value = integrated.current_value.load();
+    uint64_t latest_ms = 0;
+
+    for (int ii = 0; ii < NUM_SHARDS; ++ii)
+    {
+      uint64_t time_ms = shards[ii].time_ms.load(std::memory_order_acquire);
+      if (time_ms > latest_ms)
+      {
+        latest_ms = time_ms;
+        value = shards[ii].value.load(std::memory_order_relaxed);
+      }
+    }
+
+    return value;
+  }
+
+  uint64_t count()
+  {
+    uint64_t count = integrated.count.load();
+    for (int ii = 0; ii < NUM_SHARDS; ++ii)
+    {
+      count += shards[ii].count.load(std::memory_order_relaxed);
+    }
+    return count;
+  }
+
+  uint64_t lwm()
+  {
+    uint64_t lwm = integrated.lwm.load();
+    for (int ii = 0; ii < NUM_SHARDS; ++ii)
+    {
+      lwm = std::min(lwm, (uint64_t)shards[ii].lwm.load(std::memory_order_relaxed));
+    }
+    return lwm;
+  }
+
+  uint64_t hwm()
+  {
+    uint64_t hwm = integrated.hwm.load();
+    for (int ii = 0; ii < NUM_SHARDS; ++ii)
+    {
+      hwm = std::max(hwm, (uint64_t)shards[ii].hwm.load(std::memory_order_relaxed));
+    }
+    return hwm;
+  }
+
+  void reset(uint64_t periodstart_ms, ShardedContinuousStatistics* previous = NULL)
+  {
+    // Fold the previous period's latest sample in before clearing the shards,
+    // as previous may be this.
+    if (previous != NULL)
+    {
+      previous->integrated.current_value = previous->latest_value();
+    }
+
+    for (int ii = 0; ii < NUM_SHARDS; ++ii)
+    {
+      shards[ii].count = 0;
+      shards[ii].lwm = ULONG_MAX;
+      shards[ii].hwm = 0;
+      shards[ii].value = 0;
+      shards[ii].time_ms = 0;
+    }
+
+    integrated.reset(periodstart_ms,
+                     (previous != NULL) ? &previous->integrated : NULL);
+  }
+
+private:
+  // Threads are spread across the shards round robin.
+  static int shard_index()
+  {
+    static std::atomic<int> next_shard(0);
+    static thread_local int shard = next_shard++ % NUM_SHARDS;
+    return shard;
+  }
+};
+
+class ShardedContinuousAccumulatorRow: public TimeBasedRow<ShardedContinuousStatistics>
+{
+public:
+  ShardedContinuousAccumulatorRow(int index, View* view): TimeBasedRow<ShardedContinuousStatistics>(index, view) {};
+  ColumnData get_columns();
+};
+
 class ContinuousAccumulatorTableImpl: public ManagedTable<ContinuousAccumulatorRow, int>,
                                       public ContinuousAccumulatorTable
 {
@@ -76,7 +235,7 @@ private:
   void accumulate_internal(CurrentAndPrevious<ContinuousStatistics>& data, uint32_t sample)
   {
     struct timespec now;
-    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    FastClock::cached_realtime(now);
 
     ContinuousStatistics* current_data = data.get_current(now);
 
@@ -122,27 +281,83 @@ private:
   CurrentAndPrevious<ContinuousStatistics> five_minute;
 };
 
-ColumnData ContinuousAccumulatorRow::get_columns()
+class ShardedContinuousAccumulatorTableImpl: public ManagedTable<ShardedContinuousAccumulatorRow, int>,
+                                             public ContinuousAccumulatorTable
 {
-  struct timespec now;
-  clock_gettime(CLOCK_REALTIME_COARSE, &now);
+public:
+  ShardedContinuousAccumulatorTableImpl(std::string name,
+                                        std::string tbl_oid):
+                                        ManagedTable<ShardedContinuousAccumulatorRow,int>
+                                              (name,
+                                               tbl_oid,
+                                               2,
+                                               6, // Columns 2-6 should be visible
+                                               { ASN_INTEGER }), // Type of the index column
+    five_second(5000),
+    five_minute(300000)
+  {
+    // We have a fixed number of rows, so create them in the constructor.
+    add(TimePeriodIndexes::scopePrevious5SecondPeriod);
+    add(TimePeriodIndexes::scopeCurrent5MinutePeriod);
+    add(TimePeriodIndexes::scopePrevious5MinutePeriod);
+  }
 
-  ContinuousStatistics* accumulated = _view->get_data(now);
-  uint32_t interval_ms = _view->get_interval_ms();
+  // Accumulate a sample into the underlying statistics.
+  void accumulate(uint32_t sample)
+  {
+    struct timespec now;
+    FastClock::cached_realtime(now);
+    uint64_t time_now_ms = (now.tv_sec * 1000) + (now.tv_nsec / 1000000);
 
-  uint_fast32_t count = accumulated->count.load();
+    five_second.get_current(now)->accumulate(sample, time_now_ms);
+    five_minute.get_current(now)->accumulate(sample, time_now_ms);
+  }
+
+private:
+  // Map row indexes to the view of the underlying data they should expose
+  ShardedContinuousAccumulatorRow* new_row(int index)
+  {
+    ShardedContinuousAccumulatorRow::View* view = NULL;
+    switch (index)
+    {
+      case TimePeriodIndexes::scopePrevious5SecondPeriod:
+        view = new ShardedContinuousAccumulatorRow::PreviousView(&five_second);
+        break;
+      case TimePeriodIndexes::scopeCurrent5MinutePeriod:
+        view = new ShardedContinuousAccumulatorRow::CurrentView(&five_minute);
+        break;
+      case TimePeriodIndexes::scopePrevious5MinutePeriod:
+        view = new ShardedContinuousAccumulatorRow::PreviousView(&five_minute);
+        break;
+    }
+    return new ShardedContinuousAccumulatorRow(index, view);
+  }
+
+  CurrentAndPrevious<ShardedContinuousStatistics> five_second;
+  CurrentAndPrevious<ShardedContinuousStatistics> five_minute;
+};
+
+// Calculates the columns for a row from the accumulated statistics, bringing
+// the sum and sum of squares up to date with the current time (or the end of
+// the period).
+static ColumnData continuous_accumulator_columns(int index,
+                                                 ContinuousStatistics* accumulated,
+                                                 uint_fast64_t count,
+                                                 uint_fast64_t lwm,
+                                                 uint_fast64_t hwm,
+                                                 uint32_t interval_ms,
+                                                 struct timespec now)
+{
   uint_fast32_t current_value = accumulated->current_value.load();
 
   uint_fast64_t avg = current_value;
   uint_fast64_t variance = 0;
-  uint_fast32_t lwm = accumulated->lwm.load();
   // If LWM is still ULONG_MAX, then report as 0, as no results
   // have been entered (and HWM will be reported as 0)
   if (lwm == ULONG_MAX)
   {
     lwm = 0;
   }
-  uint_fast32_t hwm = accumulated->hwm.load();
   uint_fast64_t time_last_update_ms = accumulated->time_last_update_ms.load();
   uint_fast64_t time_period_start_ms = accumulated->time_period_start_ms.load();
   uint_fast64_t sum = accumulated->sum.load();
@@ -179,7 +394,7 @@ ColumnData ContinuousAccumulatorRow::get_columns()
 
   // Construct and return a ColumnData with the appropriate values
   ColumnData ret;
-  ret[1] = Value::integer(_index);
+  ret[1] = Value::integer(index);
   ret[2] = Value::uint(avg);
   ret[3] = Value::uint(variance);
   ret[4] = Value::uint(hwm);
@@ -188,9 +403,50 @@ ColumnData ContinuousAccumulatorRow::get_columns()
   return ret;
 }
 
+ColumnData ContinuousAccumulatorRow::get_columns()
+{
+  struct timespec now;
+  FastClock::cached_realtime(now);
+
+  ContinuousStatistics* accumulated = _view->get_data(now);
+
+  return continuous_accumulator_columns(_index,
+                                        accumulated,
+                                        accumulated->count.load(),
+                                        accumulated->lwm.load(),
+                                        accumulated->hwm.load(),
+                                        _view->get_interval_ms(),
+                                        now);
+}
+
+ColumnData ShardedContinuousAccumulatorRow::get_columns()
+{
+  struct timespec now;
+  FastClock::cached_realtime(now);
+
+  ShardedContinuousStatistics* accumulated = _view->get_data(now);
+
+  // The value held since the last update is the latest sample in any shard.
+  accumulated->integrated.current_value = accumulated->latest_value();
+
+  return continuous_accumulator_columns(_index,
+                                        &accumulated->integrated,
+                                        accumulated->count(),
+                                        accumulated->lwm(),
+                                        accumulated->hwm(),
+                                        _view->get_interval_ms(),
+                                        now);
+}
+
 ContinuousAccumulatorTable* ContinuousAccumulatorTable::create(std::string name,
                                                                std::string oid)
 {
   return new ContinuousAccumulatorTableImpl(name, oid);
 }
+
+ContinuousAccumulatorTable* ContinuousAccumulatorTable::create_sharded(std::string name,
+                                                                       std::string oid)
+{
+  return new ShardedContinuousAccumulatorTableImpl(name, oid);
+}
 }
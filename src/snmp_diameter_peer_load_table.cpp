@@ -0,0 +1,101 @@
+/**
+ * @file snmp_diameter_peer_load_table.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "snmp_internal/snmp_includes.h"
+#include "snmp_internal/snmp_table.h"
+#include "snmp_diameter_peer_load_table.h"
+#include "log.h"
+
+namespace SNMP
+{
+
+// Row that reports the load on one peer.
+class DiameterPeerLoadRow : public Row
+{
+public:
+  DiameterPeerLoadRow(const Diameter::PeerLoad* load) :
+    Row(),
+    _host(load->host()),
+    _load(load)
+  {
+    netsnmp_tdata_row_add_index(_row,
+                                ASN_OCTET_STR,
+                                _host.c_str(),
+                                _host.length());
+  };
+
+  ColumnData get_columns()
+  {
+    int outstanding = _load->outstanding();
+    uint32_t outstanding32 = (outstanding > 0) ? (uint32_t)outstanding : 0;
+    uint64_t latency_us = _load->latency_us();
+    uint32_t latency32 = (latency_us > UINT32_MAX) ? UINT32_MAX : (uint32_t)latency_us;
+    uint32_t requests32 = (uint32_t)_load->requests();
+    uint32_t timeouts32 = (uint32_t)_load->timeouts();
+
+    ColumnData ret;
+    ret[1] = Value(ASN_OCTET_STR,
+                   (unsigned char*)(_host.c_str()),
+                   _host.size());
+    ret[2] = Value(ASN_GAUGE, (unsigned char*)&outstanding32, sizeof(uint32_t));
+    ret[3] = Value(ASN_GAUGE, (unsigned char*)&latency32, sizeof(uint32_t));
+    ret[4] = Value(ASN_COUNTER, (unsigned char*)&requests32, sizeof(uint32_t));
+    ret[5] = Value(ASN_COUNTER, (unsigned char*)&timeouts32, sizeof(uint32_t));
+    return ret;
+  }
+
+private:
+  std::string _host;
+  const Diameter::PeerLoad* _load;
+};
+
+class DiameterPeerLoadTableImpl : public ManagedTable<DiameterPeerLoadRow, std::string>,
+                                  public DiameterPeerLoadTable
+{
+public:
+  DiameterPeerLoadTableImpl(std::string name, std::string tbl_oid) :
+    ManagedTable<DiameterPeerLoadRow, std::string>(name,
+                                                   tbl_oid,
+                                                   2,
+                                                   5,
+                                                   { ASN_OCTET_STR })
+  {
+    TRC_INFO("Created table with name %s, OID %s", name.c_str(), tbl_oid.c_str());
+    pthread_mutex_init(&_table_lock, NULL);
+  }
+
+  ~DiameterPeerLoadTableImpl()
+  {
+    TRC_INFO("Destroying table with name %s", _name.c_str());
+    pthread_mutex_destroy(&_table_lock);
+  }
+
+  void add_peer(const Diameter::PeerLoad* load)
+  {
+    pthread_mutex_lock(&_table_lock);
+    this->add(load->host(), new DiameterPeerLoadRow(load));
+    pthread_mutex_unlock(&_table_lock);
+  }
+
+private:
+  DiameterPeerLoadRow* new_row(std::string host) { return NULL; };
+
+  // Lock to protect the rows map.
+  pthread_mutex_t _table_lock;
+};
+
+DiameterPeerLoadTable* DiameterPeerLoadTable::create(std::string name,
+                                                     std::string oid)
+{
+  return new DiameterPeerLoadTableImpl(name, oid);
+}
+
+}
@@ -19,24 +19,27 @@
 namespace SNMP
 {
 
-// A TimeAndScopeBasedRow that maps the data from EventStatisticAccumulator into the right five columns.
-class EventAccumulatorByScopeRow: public TimeAndScopeBasedRow<EventStatisticAccumulator>
+// A TimeAndScopeBasedRow that maps the data from EventStatisticAccumulator
+// into the right five columns (plus three percentile columns, if the
+// accumulator tracks them).
+template <class T> class EventAccumulatorByScopeRow: public TimeAndScopeBasedRow<T>
 {
 public:
-  EventAccumulatorByScopeRow(int time_index, std::string scope_index, View* view): TimeAndScopeBasedRow<EventStatisticAccumulator>(time_index, scope_index, view) {};
+  EventAccumulatorByScopeRow(int time_index, std::string scope_index, typename TimeAndScopeBasedRow<T>::View* view): TimeAndScopeBasedRow<T>(time_index, scope_index, view) {};
   ColumnData get_columns();
 };
 
-class EventAccumulatorByScopeTableImpl: public ManagedTable<EventAccumulatorByScopeRow, int>, public EventAccumulatorByScopeTable
+template <class T> class EventAccumulatorByScopeTableImpl: public ManagedTable<EventAccumulatorByScopeRow<T>, int>, public EventAccumulatorByScopeTable
 {
 public:
   EventAccumulatorByScopeTableImpl(std::string name,
-                                   std::string tbl_oid):
-    ManagedTable<EventAccumulatorByScopeRow, int>(name,
-                                                  tbl_oid,
-                                                  3,
-                                                  7, // Columns 3-7 should be visible
-                                                  { ASN_INTEGER , ASN_OCTET_STR }), // Type of the index column
+                                   std::string tbl_oid,
+                                   int max_column):
+    ManagedTable<EventAccumulatorByScopeRow<T>, int>(name,
+                                                     tbl_oid,
+                                                     3,
+                                                     max_column, // Columns 3 onwards should be visible
+                                                     { ASN_INTEGER , ASN_OCTET_STR }), // Type of the index column
     five_second(5000),
     five_minute(300000)
   {
@@ -58,47 +61,64 @@ public:
 
 private:
   // Map row indexes to the view of the underlying data they should expose
-  EventAccumulatorByScopeRow* new_row(int index)
+  EventAccumulatorByScopeRow<T>* new_row(int index)
   {
-    EventAccumulatorByScopeRow::View* view = NULL;
+    typename EventAccumulatorByScopeRow<T>::View* view = NULL;
     switch (index)
     {
       case TimePeriodIndexes::scopePrevious5SecondPeriod:
-        view = new EventAccumulatorByScopeRow::PreviousView(&five_second);
+        view = new typename EventAccumulatorByScopeRow<T>::PreviousView(&five_second);
         break;
       case TimePeriodIndexes::scopeCurrent5MinutePeriod:
-        view = new EventAccumulatorByScopeRow::CurrentView(&five_minute);
+        view = new typename EventAccumulatorByScopeRow<T>::CurrentView(&five_minute);
         break;
       case TimePeriodIndexes::scopePrevious5MinutePeriod:
-        view = new EventAccumulatorByScopeRow::PreviousView(&five_minute);
+        view = new typename EventAccumulatorByScopeRow<T>::PreviousView(&five_minute);
         break;
     }
 
-    return new EventAccumulatorByScopeRow(index, "node", view);
+    return new EventAccumulatorByScopeRow<T>(index, "node", view);
   }
 
-  void accumulate_internal(CurrentAndPrevious<EventStatisticAccumulator>& data, uint32_t sample)
+  void accumulate_internal(CurrentAndPrevious<T>& data, uint32_t sample)
   {
     struct timespec now;
     clock_gettime(CLOCK_REALTIME_COARSE, &now);
 
-    EventStatisticAccumulator* current = data.get_current(now);
+    T* current = data.get_current(now);
     current->accumulate(sample);
   };
 
   int n;
 
-  CurrentAndPrevious<EventStatisticAccumulator> five_second;
-  CurrentAndPrevious<EventStatisticAccumulator> five_minute;
+  CurrentAndPrevious<T> five_second;
+  CurrentAndPrevious<T> five_minute;
 };
 
-ColumnData EventAccumulatorByScopeRow::get_columns()
+// Accumulators without a histogram have no percentile columns.
+static void add_percentile_columns(EventStatisticAccumulator* accumulated,
+                                   ColumnData& columns)
+{
+}
+
+static void add_percentile_columns(EventPercentileAccumulator* accumulated,
+                                   ColumnData& columns)
+{
+  EventPercentiles percentiles;
+  accumulated->get_percentiles(percentiles);
+
+  columns[8] = Value::uint(percentiles.p50);
+  columns[9] = Value::uint(percentiles.p90);
+  columns[10] = Value::uint(percentiles.p99);
+}
+
+template <class T> ColumnData EventAccumulatorByScopeRow<T>::get_columns()
 {
   struct timespec now;
   clock_gettime(CLOCK_REALTIME_COARSE, &now);
   EventStatistics statistics;
 
-  EventStatisticAccumulator* accumulated = _view->get_data(now);
+  T* accumulated = this->_view->get_data(now);
   accumulated->get_stats(statistics);
 
   // Construct and return a ColumnData with the appropriate values
@@ -108,13 +128,19 @@ ColumnData EventAccumulatorByScopeRow::get_columns()
   ret[5] = Value::uint(statistics.hwm);
   ret[6] = Value::uint(statistics.lwm);
   ret[7] = Value::uint(statistics.count);
+  add_percentile_columns(accumulated, ret);
 
   return ret;
 }
 
 EventAccumulatorByScopeTable* EventAccumulatorByScopeTable::create(std::string name, std::string oid)
 {
-  return new EventAccumulatorByScopeTableImpl(name, oid);
+  return new EventAccumulatorByScopeTableImpl<EventStatisticAccumulator>(name, oid, 7);
+}
+
+EventAccumulatorByScopeTable* EventAccumulatorByScopeTable::create_with_percentiles(std::string name, std::string oid)
+{
+  return new EventAccumulatorByScopeTableImpl<EventPercentileAccumulator>(name, oid, 10);
 }
 
 }
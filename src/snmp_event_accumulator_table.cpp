@@ -9,6 +9,7 @@
  * Metaswitch Networks in a separate written agreement.
  */
 
+#include "fast_clock.h"
 #include "snmp_internal/snmp_time_period_table.h"
 #include "snmp_event_accumulator_table.h"
 #include "event_statistic_accumulator.h"
@@ -17,31 +18,34 @@
 namespace SNMP
 {
 
-// Just a TimeBasedRow that maps the data from EventStatisticAccumulator into the right five columns.
-class EventAccumulatorRow: public TimeBasedRow<EventStatisticAccumulator>
+// Just a TimeBasedRow that maps the data from EventStatisticAccumulator into
+// the right five columns (plus three percentile columns, if the accumulator
+// tracks them).
+template <class T> class EventAccumulatorRow: public TimeBasedRow<T>
 {
 public:
-  EventAccumulatorRow(int index, View* view): TimeBasedRow<EventStatisticAccumulator>(index, view) {};
+  EventAccumulatorRow(int index, typename TimeBasedRow<T>::View* view): TimeBasedRow<T>(index, view) {};
   ColumnData get_columns();
 };
 
-class EventAccumulatorTableImpl: public ManagedTable<EventAccumulatorRow, int>, public EventAccumulatorTable
+template <class T> class EventAccumulatorTableImpl: public ManagedTable<EventAccumulatorRow<T>, int>, public EventAccumulatorTable
 {
 public:
   EventAccumulatorTableImpl(std::string name,
-                       std::string tbl_oid):
-    ManagedTable<EventAccumulatorRow, int>(name,
-                                      tbl_oid,
-                                      2,
-                                      6, // Columns 2-6 should be visible
-                                      { ASN_INTEGER }), // Type of the index column
+                            std::string tbl_oid,
+                            int max_column):
+    ManagedTable<EventAccumulatorRow<T>, int>(name,
+                                              tbl_oid,
+                                              2,
+                                              max_column, // Columns 2 onwards should be visible
+                                              { ASN_INTEGER }), // Type of the index column
     five_second(5000),
     five_minute(300000)
   {
     // We have a fixed number of rows, so create them in the constructor.
-    add(TimePeriodIndexes::scopePrevious5SecondPeriod);
-    add(TimePeriodIndexes::scopeCurrent5MinutePeriod);
-    add(TimePeriodIndexes::scopePrevious5MinutePeriod);
+    this->add(TimePeriodIndexes::scopePrevious5SecondPeriod);
+    this->add(TimePeriodIndexes::scopeCurrent5MinutePeriod);
+    this->add(TimePeriodIndexes::scopePrevious5MinutePeriod);
   }
 
   // Accumulate a sample into the underlying statistics.
@@ -54,62 +58,84 @@ public:
 
 private:
   // Map row indexes to the view of the underlying data they should expose
-  EventAccumulatorRow* new_row(int index)
+  EventAccumulatorRow<T>* new_row(int index)
   {
-    EventAccumulatorRow::View* view = NULL;
+    typename EventAccumulatorRow<T>::View* view = NULL;
     switch (index)
     {
       case TimePeriodIndexes::scopePrevious5SecondPeriod:
-        view = new EventAccumulatorRow::PreviousView(&five_second);
+        view = new typename EventAccumulatorRow<T>::PreviousView(&five_second);
         break;
       case TimePeriodIndexes::scopeCurrent5MinutePeriod:
-        view = new EventAccumulatorRow::CurrentView(&five_minute);
+        view = new typename EventAccumulatorRow<T>::CurrentView(&five_minute);
         break;
       case TimePeriodIndexes::scopePrevious5MinutePeriod:
-        view = new EventAccumulatorRow::PreviousView(&five_minute);
+        view = new typename EventAccumulatorRow<T>::PreviousView(&five_minute);
         break;
     }
-    return new EventAccumulatorRow(index, view);
+    return new EventAccumulatorRow<T>(index, view);
   }
 
-  void accumulate_internal(CurrentAndPrevious<EventStatisticAccumulator>& data, uint32_t sample)
+  void accumulate_internal(CurrentAndPrevious<T>& data, uint32_t sample)
   {
     struct timespec now;
-    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    FastClock::cached_realtime(now);
 
-    EventStatisticAccumulator* current = data.get_current(now);
+    T* current = data.get_current(now);
     current->accumulate(sample);
   };
 
 
-  CurrentAndPrevious<EventStatisticAccumulator> five_second;
-  CurrentAndPrevious<EventStatisticAccumulator> five_minute;
+  CurrentAndPrevious<T> five_second;
+  CurrentAndPrevious<T> five_minute;
 };
 
+// Accumulators without a histogram have no percentile columns.
+static void add_percentile_columns(EventStatisticAccumulator* accumulated,
+                                   ColumnData& columns)
+{
+}
 
-ColumnData EventAccumulatorRow::get_columns()
+static void add_percentile_columns(EventPercentileAccumulator* accumulated,
+                                   ColumnData& columns)
+{
+  EventPercentiles percentiles;
+  accumulated->get_percentiles(percentiles);
+
+  columns[7] = Value::uint(percentiles.p50);
+  columns[8] = Value::uint(percentiles.p90);
+  columns[9] = Value::uint(percentiles.p99);
+}
+
+template <class T> ColumnData EventAccumulatorRow<T>::get_columns()
 {
   struct timespec now;
-  clock_gettime(CLOCK_REALTIME_COARSE, &now);
+  FastClock::cached_realtime(now);
   EventStatistics statistics;
 
-  EventStatisticAccumulator* accumulated = _view->get_data(now);
+  T* accumulated = this->_view->get_data(now);
   accumulated->get_stats(statistics);
 
   // Construct and return a ColumnData with the appropriate values
   ColumnData ret;
-  ret[1] = Value::integer(_index);
+  ret[1] = Value::integer(this->_index);
   ret[2] = Value::uint(statistics.mean);
   ret[3] = Value::uint(statistics.variance);
   ret[4] = Value::uint(statistics.hwm);
   ret[5] = Value::uint(statistics.lwm);
   ret[6] = Value::uint(statistics.count);
+  add_percentile_columns(accumulated, ret);
   return ret;
 }
 
 EventAccumulatorTable* EventAccumulatorTable::create(std::string name, std::string oid)
 {
-  return new EventAccumulatorTableImpl(name, oid);
+  return new EventAccumulatorTableImpl<EventStatisticAccumulator>(name, oid, 6);
+}
 
+EventAccumulatorTable* EventAccumulatorTable::create_with_percentiles(std::string name, std::string oid)
+{
+  return new EventAccumulatorTableImpl<EventPercentileAccumulator>(name, oid, 9);
 }
+
 }
@@ -12,6 +12,8 @@
 #include <string>
 #include <algorithm>
 #include <memory>
+#include <map>
+#include <vector>
 
 #include "snmp_infinite_base_table.h"
 #include "snmp_internal/snmp_includes.h"
@@ -77,6 +79,15 @@ int InfiniteBaseTable::netsnmp_table_handler_fn(netsnmp_mib_handler *handler,
   // Scratch space for logging.
   char buf[SCRATCH_BUF_LEN];
 
+  // Get the time we will process these requests at, so all of the requests
+  // see the same snapshot of the table.
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME_COARSE, &now);
+
+  // The rows read so far while handling these requests, indexed by tag and
+  // row.
+  std::map<std::pair<std::string, uint32_t>, std::vector<Value>> row_cache;
+
   for (; requests != NULL; requests = requests->next)
   {
     try
@@ -109,10 +120,6 @@ int InfiniteBaseTable::netsnmp_table_handler_fn(netsnmp_mib_handler *handler,
       // We can set a default value of 0 unless we find a valid result
       Value result = Value::uint(0);
 
-      // Get the time we will process this request at
-      struct timespec now;
-      clock_gettime(CLOCK_REALTIME_COARSE, &now);
-
       // Fix up the reqested pointer to resolve GET_NEXT requests (or to normalize
       // GET requests) and store the result in `fixed_oid`.
       std::unique_ptr<oid[]> fixed_oid(nullptr);
@@ -167,7 +174,24 @@ int InfiniteBaseTable::netsnmp_table_handler_fn(netsnmp_mib_handler *handler,
       TRC_DEBUG("Parsed SNMP request to OID %s with tag %s and cell (%d, %d)",
                 buf, tag.c_str(), row, column);
 
-      result = get_value(tag, column, row, now);
+      if (column >= FIRST_COLUMN)
+      {
+        std::pair<std::string, uint32_t> row_key(tag, row);
+        std::map<std::pair<std::string, uint32_t>, std::vector<Value>>::iterator cached =
+          row_cache.find(row_key);
+
+        if (cached == row_cache.end())
+        {
+          cached = row_cache.insert(std::make_pair(row_key, std::vector<Value>())).first;
+          get_row(tag, row, now, cached->second);
+        }
+
+        result = cached->second[column - FIRST_COLUMN];
+      }
+      else
+      {
+        result = get_value(tag, column, row, now);
+      }
 
       snmp_set_var_objid(var,
                          fixed_oid.get(),
@@ -190,6 +214,20 @@ int InfiniteBaseTable::netsnmp_table_handler_fn(netsnmp_mib_handler *handler,
   return SNMP_ERR_NOERROR;
 }
 
+void InfiniteBaseTable::get_row(std::string tag,
+                                uint32_t row,
+                                timespec now,
+                                std::vector<Value>& values)
+{
+  values.clear();
+  values.reserve(_max_column - FIRST_COLUMN + 1);
+
+  for (uint32_t column = FIRST_COLUMN; column <= _max_column; ++column)
+  {
+    values.push_back(get_value(tag, column, row, now));
+  }
+}
+
 // Check that a given OID points directly to a valid cell in the table.  An
 // OID that passes this function can be safely parsed by parse_oid().
 //
@@ -0,0 +1,167 @@
+/**
+ * @file snmp_infinite_counter_table.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <atomic>
+
+#include "snmp_infinite_counter_table.h"
+#include "current_and_previous.h"
+#include "snmp_types.h"
+#include "snmp_row.h"
+#include "snmp_infinite_base_table.h"
+
+#include "log.h"
+#include "logger.h"
+
+namespace SNMP
+{
+  const uint32_t InfiniteCounterTable::MAX_SCOPES;
+  const uint32_t InfiniteCounterTable::NO_SCOPE;
+
+  // The counts for every scope in one time period, indexed by scope ID.
+  struct ScopedCounts
+  {
+    std::atomic_uint_fast64_t counts[InfiniteCounterTable::MAX_SCOPES];
+
+    void reset(uint64_t time_periodstart, ScopedCounts* previous = NULL)
+    {
+      for (uint32_t ii = 0; ii < InfiniteCounterTable::MAX_SCOPES; ++ii)
+      {
+        counts[ii].store(0, std::memory_order_relaxed);
+      }
+    }
+  };
+
+  class InfiniteCounterTableImpl : public InfiniteCounterTable, public InfiniteBaseTable
+  {
+  public:
+    InfiniteCounterTableImpl(std::string name, // Name of this table, for logging
+                             std::string tbl_oid) : // Root OID of this table
+      InfiniteBaseTable(name, tbl_oid, max_row, max_column),
+      five_second(5000),
+      five_minute(300000)
+    {}
+
+    virtual ~InfiniteCounterTableImpl() {};
+
+    uint32_t scope_id(const std::string& scope)
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      std::map<std::string, uint32_t>::iterator it = _scope_ids.find(scope);
+
+      if (it != _scope_ids.end())
+      {
+        return it->second;
+      }
+
+      if (_scope_ids.size() >= MAX_SCOPES)
+      {
+        TRC_WARNING("Can't count scope %s - %u scopes are already in use",
+                    scope.c_str(), MAX_SCOPES);
+        return NO_SCOPE;
+      }
+
+      uint32_t id = _scope_ids.size();
+      _scope_ids[scope] = id;
+      return id;
+    }
+
+    void increment(uint32_t scope_id, uint32_t count)
+    {
+      if (scope_id >= MAX_SCOPES)
+      {
+        return;
+      }
+
+      struct timespec now;
+      clock_gettime(CLOCK_REALTIME_COARSE, &now);
+
+      five_second.get_current(now)->counts[scope_id].fetch_add(count, std::memory_order_relaxed);
+      five_minute.get_current(now)->counts[scope_id].fetch_add(count, std::memory_order_relaxed);
+    }
+
+    void increment(const std::string& scope, uint32_t count)
+    {
+      increment(scope_id(scope), count);
+    }
+
+  protected:
+    static const uint32_t max_row = 3;
+    static const uint32_t max_column = 2;
+
+  private:
+    // Look up a scope's ID without assigning one, returning NO_SCOPE if it
+    // has never been counted.
+    uint32_t find_scope_id(const std::string& scope)
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      std::map<std::string, uint32_t>::const_iterator it = _scope_ids.find(scope);
+      return (it != _scope_ids.end()) ? it->second : NO_SCOPE;
+    }
+
+    Value get_value(std::string tag,
+                    uint32_t column,
+                    uint32_t row,
+                    timespec now)
+    {
+      if (column != 2)
+      {
+        // This should never happen - find_next_oid should police this.
+        TRC_DEBUG("Internal MIB error - column %d is out of bounds",
+                  column);
+        return Value::uint(0);
+      }
+
+      uint32_t id = find_scope_id(tag);
+      ScopedCounts* counts = NULL;
+
+      switch (row)
+      {
+        case TimePeriodIndexes::scopePrevious5SecondPeriod:
+          counts = five_second.get_previous(now);
+          break;
+        case TimePeriodIndexes::scopeCurrent5MinutePeriod:
+          counts = five_minute.get_current(now);
+          break;
+        case TimePeriodIndexes::scopePrevious5MinutePeriod:
+          counts = five_minute.get_previous(now);
+          break;
+      }
+
+      Value result = Value::uint(0);
+
+      if ((id != NO_SCOPE) && (counts != NULL))
+      {
+        result = Value::uint(counts->counts[id].load(std::memory_order_relaxed));
+      }
+
+      TRC_DEBUG("Got value %u for tag %s cell (%d, %d)",
+                *result.value, tag.c_str(), row, column);
+
+      return result;
+    }
+
+    // Scope IDs are assigned in order and never reused, so the IDs in use are
+    // always the first _scope_ids.size() entries of each period's counts.
+    std::map<std::string, uint32_t> _scope_ids;
+    std::mutex _mutex;
+
+    CurrentAndPrevious<ScopedCounts> five_second;
+    CurrentAndPrevious<ScopedCounts> five_minute;
+  };
+
+  InfiniteCounterTable* InfiniteCounterTable::create(std::string name, std::string oid)
+  {
+    return new InfiniteCounterTableImpl(name, oid);
+  };
+}
@@ -67,6 +67,25 @@ namespace SNMP
       return result;
     }
 
+    // All the columns come from the same statistics, so only calculate them
+    // once for the row.
+    void get_row(std::string tag,
+                 uint32_t row,
+                 timespec now,
+                 std::vector<Value>& values)
+    {
+      SimpleStatistics stats;
+      _timer_counters[tag].get_statistics(row, now, &stats);
+
+      values.clear();
+      values.reserve(max_column - FIRST_COLUMN + 1);
+
+      for (uint32_t column = FIRST_COLUMN; column <= max_column; ++column)
+      {
+        values.push_back(read_column(&stats, tag, column, now));
+      }
+    }
+
     Value read_column(SimpleStatistics* data,
                        std::string tag,
                        uint32_t column,
@@ -10,6 +10,8 @@
  */
 
 #include <atomic>
+#include <sched.h>
+#include <vector>
 
 #include "snmp_internal/snmp_table.h"
 #include "snmp_internal/snmp_includes.h"
@@ -18,6 +20,7 @@
 #include "snmp_types.h"
 #include "snmp_ip_row.h"
 #include "snmp_ip_time_based_counter_table.h"
+#include "utils.h"
 
 namespace SNMP
 {
@@ -83,14 +86,18 @@ class IPTimeBasedCounterTableImpl : public IPTimeBasedCounterTable,
 public:
   IPTimeBasedCounterTableImpl(std::string name, std::string tbl_oid) :
     ManagedTable<IPTimeBasedCounterRow, IPTimeBasedCounterIndex>(
-      name, tbl_oid, 4, 4, { ASN_INTEGER, ASN_OCTET_STR, ASN_INTEGER })
+      name, tbl_oid, 4, 4, { ASN_INTEGER, ASN_OCTET_STR, ASN_INTEGER }),
+    _index(new IPIndex(MIN_INDEX_CAPACITY)),
+    _epoch(0)
   {
-    pthread_rwlock_init(&_table_lock, NULL);
+    pthread_mutex_init(&_write_lock, NULL);
   }
 
   ~IPTimeBasedCounterTableImpl()
   {
-    pthread_rwlock_destroy(&_table_lock);
+    pthread_mutex_destroy(&_write_lock);
+
+    delete _index.load(); _index = NULL;
 
     for(std::map<std::string, IPEntry*>::iterator it = _counters_by_ip.begin();
         it != _counters_by_ip.end();
@@ -104,7 +111,7 @@ public:
   {
     // Add an IP address. We might be about to mutate the counter map, so grab
     // the write lock.
-    pthread_rwlock_wrlock(&_table_lock);
+    pthread_mutex_lock(&_write_lock);
 
     std::map<std::string, uint32_t>::iterator ref_entry = _ref_count_by_ip.find(ip);
 
@@ -121,6 +128,7 @@ public:
         TRC_DEBUG("Adding IP rows for: %s", ip.c_str());
 
         _counters_by_ip[ip] = new IPEntry();
+        update_index(NULL);
         add(std::make_pair(ip, TimePeriodIndexes::scopePrevious5SecondPeriod));
         add(std::make_pair(ip, TimePeriodIndexes::scopeCurrent5MinutePeriod));
         add(std::make_pair(ip, TimePeriodIndexes::scopePrevious5MinutePeriod));
@@ -136,14 +144,14 @@ public:
       ref_entry->second++;
     }
 
-    pthread_rwlock_unlock(&_table_lock);
+    pthread_mutex_unlock(&_write_lock);
   }
 
   void remove_ip(const std::string& ip)
   {
     // Remove an IP address. We might be about to mutate the counter map, so
     // grab the write lock.
-    pthread_rwlock_wrlock(&_table_lock);
+    pthread_mutex_lock(&_write_lock);
 
     std::map<std::string, uint32_t>::iterator ref_entry = _ref_count_by_ip.find(ip);
 
@@ -165,11 +173,13 @@ public:
         if (entry != _counters_by_ip.end())
         {
           // IP address already exists - remove the entry from the counts map and
-          // delete the associated SNMP rows.
+          // delete the associated SNMP rows.  The entry may still be in use by
+          // readers of the old index, so it's freed along with it.
           TRC_DEBUG("Removing IP rows for %s", ip.c_str());
 
-          delete entry->second; entry->second = NULL;
+          IPEntry* removed = entry->second;
           _counters_by_ip.erase(entry);
+          update_index(removed);
           remove(std::make_pair(ip, TimePeriodIndexes::scopePrevious5SecondPeriod));
           remove(std::make_pair(ip, TimePeriodIndexes::scopeCurrent5MinutePeriod));
           remove(std::make_pair(ip, TimePeriodIndexes::scopePrevious5MinutePeriod));
@@ -182,25 +192,32 @@ public:
       }
     }
 
-    pthread_rwlock_unlock(&_table_lock);
+    pthread_mutex_unlock(&_write_lock);
   }
 
   void increment(const std::string& ip)
   {
-    // Increment the count for the specified IP. This cannot mutate the counts
-    // map (only the counts stored within it, which are atomic), so we only need
-    // the read lock.
-    pthread_rwlock_rdlock(&_table_lock);
+    IP46Address address;
 
-    std::map<std::string, IPEntry*>::iterator entry = _counters_by_ip.find(ip);
-    if (entry != _counters_by_ip.end())
+    if (Utils::parse_ip_target(ip, address))
     {
-      TRC_DEBUG("Incrementing counter for %s", ip.c_str());
-      entry->second->five_sec.get_current()->counter++;
-      entry->second->five_min.get_current()->counter++;
+      increment(address);
     }
+  }
+
+  void increment(const IP46Address& ip)
+  {
+    // Increment the count for the specified IP. This cannot mutate the index
+    // (only the counts stored within it, which are atomic), so we only need to
+    // count ourselves as a reader of it.
+    IndexReader reader(this);
 
-    pthread_rwlock_unlock(&_table_lock);
+    IPEntry* entry = reader.index()->find(ip);
+    if (entry != NULL)
+    {
+      entry->five_sec.get_current()->counter++;
+      entry->five_min.get_current()->counter++;
+    }
   }
 
   uint32_t get_count(const std::string& ip, TimePeriodIndexes time_period)
@@ -208,26 +225,33 @@ public:
     TRC_DEBUG("Get count for IP: %s, time period: %d", ip.c_str(), time_period);
 
     uint32_t count = 0;
+    IP46Address address;
 
-    // Reading a count cannot mutate the counts map (only the counts stored
-    // within it which are atomic), so we only need the read lock.
-    pthread_rwlock_rdlock(&_table_lock);
+    if (!Utils::parse_ip_target(ip, address))
+    {
+      return count; // LCOV_EXCL_LINE
+    }
+
+    // Reading a count cannot mutate the index (only the counts stored within
+    // it which are atomic), so we only need to count ourselves as a reader of
+    // it.
+    IndexReader reader(this);
 
-    std::map<std::string, IPEntry*>::iterator entry = _counters_by_ip.find(ip);
-    if (entry != _counters_by_ip.end())
+    IPEntry* entry = reader.index()->find(address);
+    if (entry != NULL)
     {
       switch (time_period)
       {
       case TimePeriodIndexes::scopePrevious5SecondPeriod:
-        count = entry->second->five_sec.get_previous()->counter;
+        count = entry->five_sec.get_previous()->counter;
         break;
 
       case TimePeriodIndexes::scopeCurrent5MinutePeriod:
-        count = entry->second->five_min.get_current()->counter;
+        count = entry->five_min.get_current()->counter;
         break;
 
       case TimePeriodIndexes::scopePrevious5MinutePeriod:
-        count = entry->second->five_min.get_previous()->counter;
+        count = entry->five_min.get_previous()->counter;
         break;
 
       default:
@@ -239,8 +263,6 @@ public:
       }
     }
 
-    pthread_rwlock_unlock(&_table_lock);
-
     TRC_DEBUG("Counter is %d", count);
     return count;
   }
@@ -292,15 +314,181 @@ private:
     CurrentAndPrevious<Counter> five_min;
   };
 
-  // A container of counts indexed by IP address. This can be accessed on
-  // multiple threads, and so is protected by _table_lock.
+  static const size_t MIN_INDEX_CAPACITY = 16;
+
+  // An open addressed hash table from binary IP address to entry, which is
+  // never changed once it's published.  Adding or removing an IP address
+  // builds a new one.  The capacity is a power of two at least twice the
+  // number of entries, so probes are short and always find an empty slot.
+  struct IPIndex
+  {
+    IPIndex(size_t capacity) : mask(capacity - 1), slots(capacity) {}
+
+    struct Slot
+    {
+      Slot() : entry(NULL) {}
+      IP46Address address;
+      IPEntry* entry;
+    };
+
+    size_t mask;
+    std::vector<Slot> slots;
+
+    static size_t hash(const IP46Address& address)
+    {
+      uint64_t h;
+
+      if (address.af == AF_INET)
+      {
+        h = address.addr.ipv4.s_addr;
+      }
+      else
+      {
+        const uint32_t* words = (const uint32_t*)&address.addr.ipv6;
+        h = ((uint64_t)(words[0] ^ words[2]) << 32) | (words[1] ^ words[3]);
+      }
+
+      // Fibonacci hashing spreads addresses that differ only in their low
+      // bits across the table.
+      return (size_t)((h * 0x9E3779B97F4A7C15ULL) >> 32);
+    }
+
+    void insert(const IP46Address& address, IPEntry* entry)
+    {
+      size_t ii = hash(address) & mask;
+      while (slots[ii].entry != NULL)
+      {
+        ii = (ii + 1) & mask;
+      }
+      slots[ii].address = address;
+      slots[ii].entry = entry;
+    }
+
+    IPEntry* find(const IP46Address& address) const
+    {
+      size_t ii = hash(address) & mask;
+      while (slots[ii].entry != NULL)
+      {
+        if (slots[ii].address.compare(address) == 0)
+        {
+          return slots[ii].entry;
+        }
+        ii = (ii + 1) & mask;
+      }
+      return NULL;
+    }
+  };
+
+  // Counts the calling thread as a reader of the index for its lifetime, so
+  // that neither the index nor its entries are freed while it's in use.  Each
+  // thread counts itself in its own (cache line padded) shard, in the half of
+  // the counts selected by the current epoch.
+  class IndexReader
+  {
+  public:
+    IndexReader(IPTimeBasedCounterTableImpl* table) :
+      _readers(&table->_readers[shard_index()].readers[table->_epoch.load() & 1])
+    {
+      // The index must be loaded after we're counted as a reader, which the
+      // sequentially consistent atomics guarantee.
+      ++(*_readers);
+      _index = table->_index.load();
+    }
+
+    ~IndexReader() { --(*_readers); }
+
+    const IPIndex* index() const { return _index; }
+
+  private:
+    std::atomic<int>* _readers;
+    const IPIndex* _index;
+  };
+
+  static const int NUM_SHARDS = 16;
+
+  struct ReaderShard
+  {
+    ReaderShard() { readers[0] = 0; readers[1] = 0; }
+
+    // Keeps each shard in its own cache line.
+    char _padding[64];
+    std::atomic<int> readers[2];
+  };
+
+  // Threads are spread across the reader shards round robin.
+  static int shard_index()
+  {
+    static std::atomic<int> next_shard(0);
+    static thread_local int shard = next_shard++ % NUM_SHARDS;
+    return shard;
+  }
+
+  // Publishes a new index built from the counts map, then waits until no
+  // threads can still be using the old one before freeing it (and the
+  // removed entry, if any).  Must be called with the write lock held.
+  void update_index(IPEntry* removed)
+  {
+    size_t capacity = MIN_INDEX_CAPACITY;
+    while (capacity < _counters_by_ip.size() * 2)
+    {
+      capacity *= 2;
+    }
+
+    IPIndex* index = new IPIndex(capacity);
+
+    for(std::map<std::string, IPEntry*>::iterator it = _counters_by_ip.begin();
+        it != _counters_by_ip.end();
+        ++it)
+    {
+      IP46Address address;
+      if (Utils::parse_ip_target(it->first, address))
+      {
+        index->insert(address, it->second);
+      }
+    }
+
+    IPIndex* old_index = _index.exchange(index);
+
+    // A reader may have picked its half of the counts just before the epoch
+    // changes, and so could be counted in either half - wait for both to
+    // drain in turn.
+    for (int ii = 0; ii < 2; ++ii)
+    {
+      int old_epoch = _epoch++;
+      wait_for_readers(old_epoch & 1);
+    }
+
+    delete old_index;
+    delete removed;
+  }
+
+  void wait_for_readers(int half)
+  {
+    for (int ii = 0; ii < NUM_SHARDS; ++ii)
+    {
+      while (_readers[ii].readers[half].load() != 0)
+      {
+        sched_yield();
+      }
+    }
+  }
+
+  // The index used to find the counts for an IP address.  This is read
+  // without any locks - see IndexReader.
+  std::atomic<IPIndex*> _index;
+  std::atomic<int> _epoch;
+  ReaderShard _readers[NUM_SHARDS];
+
+  // A container of counts indexed by IP address, which the index is built
+  // from.  This is only used when adding and removing IP addresses, and is
+  // protected by _write_lock.
   std::map<std::string, IPEntry*> _counters_by_ip;
 
   // A reference count for each IP address, keeping track of how many times
-  // it's been added and removed. This is protected by _table_lock.
+  // it's been added and removed. This is protected by _write_lock.
   std::map<std::string, uint32_t> _ref_count_by_ip;
 
-  pthread_rwlock_t _table_lock;
+  pthread_mutex_t _write_lock;
 };
 
 
@@ -0,0 +1,120 @@
+/**
+ * @file snmp_latency_histogram_table.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "snmp_internal/snmp_includes.h"
+#include "snmp_internal/snmp_table.h"
+#include "snmp_latency_histogram_table.h"
+#include "log.h"
+
+namespace SNMP
+{
+
+// Row that reports one bucket of a histogram.
+class LatencyHistogramRow : public Row
+{
+public:
+  LatencyHistogramRow(std::string string_index,
+                      int bucket,
+                      const LatencyHistogram* histogram) :
+    Row(),
+    _string_index(string_index),
+    _bucket(bucket),
+    _histogram(histogram)
+  {
+    netsnmp_tdata_row_add_index(_row,
+                                ASN_OCTET_STR,
+                                _string_index.c_str(),
+                                _string_index.length());
+
+    netsnmp_tdata_row_add_index(_row,
+                                ASN_INTEGER,
+                                &_bucket,
+                                sizeof(int));
+  };
+
+  ColumnData get_columns()
+  {
+    // The last bucket has no upper bound, which is reported as the largest
+    // value that fits in the column.
+    uint64_t limit_us = LatencyHistogram::bucket_limit_us(_bucket);
+    uint32_t limit_col = (limit_us > UINT32_MAX) ? UINT32_MAX : limit_us;
+
+    // The count is a Counter32, so wraps as it would for any other counter.
+    uint32_t count = (uint32_t)_histogram->bucket_count(_bucket);
+
+    ColumnData ret;
+    ret[1] = Value(ASN_OCTET_STR,
+                   (unsigned char*)(_string_index.c_str()),
+                   _string_index.size());
+    ret[2] = Value::integer(_bucket);
+    ret[3] = Value::uint(limit_col);
+    ret[4] = Value(ASN_COUNTER, (unsigned char*)&count, sizeof(uint32_t));
+    return ret;
+  }
+
+private:
+  std::string _string_index;
+  int _bucket;
+  const LatencyHistogram* _histogram;
+};
+
+class LatencyHistogramTableImpl : public ManagedTable<LatencyHistogramRow, int>,
+                                  public LatencyHistogramTable
+{
+public:
+  LatencyHistogramTableImpl(std::string name, std::string tbl_oid) :
+    ManagedTable<LatencyHistogramRow, int>(name,
+                                           tbl_oid,
+                                           3,
+                                           4,
+                                           { ASN_OCTET_STR, ASN_INTEGER }),
+    _table_rows(0)
+  {
+    TRC_INFO("Created table with name %s, OID %s", name.c_str(), tbl_oid.c_str());
+    pthread_mutex_init(&_table_lock, NULL);
+  }
+
+  ~LatencyHistogramTableImpl()
+  {
+    TRC_INFO("Destroying table with name %s", _name.c_str());
+    pthread_mutex_destroy(&_table_lock);
+  }
+
+  void add_histogram(std::string string_index, const LatencyHistogram* histogram)
+  {
+    // Add a row for each bucket. The rows are keyed by an arbitrary (but
+    // unique) key, as they are never looked up or removed.
+    pthread_mutex_lock(&_table_lock);
+
+    for (int bucket = 0; bucket < LatencyHistogram::NUM_BUCKETS; ++bucket)
+    {
+      this->add(_table_rows++, new LatencyHistogramRow(string_index, bucket, histogram));
+    }
+
+    pthread_mutex_unlock(&_table_lock);
+  }
+
+private:
+  LatencyHistogramRow* new_row(int indexes) { return NULL; };
+
+  // The number of rows in the table -- used to assign a unique (but arbitrary)
+  // key to each row -- and a lock to protect the rows map.
+  int _table_rows;
+  pthread_mutex_t _table_lock;
+};
+
+LatencyHistogramTable* LatencyHistogramTable::create(std::string name,
+                                                     std::string oid)
+{
+  return new LatencyHistogramTableImpl(name, oid);
+}
+
+}
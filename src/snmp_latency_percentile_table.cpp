@@ -0,0 +1,133 @@
+/**
+ * @file snmp_latency_percentile_table.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "snmp_internal/snmp_includes.h"
+#include "snmp_internal/snmp_table.h"
+#include "snmp_latency_percentile_table.h"
+#include "log.h"
+
+namespace SNMP
+{
+
+// Row that reports one percentile of a histogram.
+class LatencyPercentileRow : public Row
+{
+public:
+  LatencyPercentileRow(std::string string_index,
+                       double percentile,
+                       const LatencyHistogram* histogram) :
+    Row(),
+    _string_index(string_index),
+    _percentile(percentile),
+    _percentile_index((uint32_t)(percentile * 1000 + 0.5)),
+    _histogram(histogram)
+  {
+    netsnmp_tdata_row_add_index(_row,
+                                ASN_OCTET_STR,
+                                _string_index.c_str(),
+                                _string_index.length());
+
+    netsnmp_tdata_row_add_index(_row,
+                                ASN_UNSIGNED,
+                                &_percentile_index,
+                                sizeof(uint32_t));
+  };
+
+  ColumnData get_columns()
+  {
+    LatencyHistogram::Snapshot snapshot;
+    _histogram->snapshot(snapshot);
+
+    // A percentile in the last bucket has no upper bound, which is reported
+    // as the largest value that fits in the column.
+    uint64_t latency_us = snapshot.percentile_us(_percentile);
+    uint32_t latency_col = (latency_us > UINT32_MAX) ? UINT32_MAX : latency_us;
+
+    // The count is a Counter32, so wraps as it would for any other counter.
+    uint32_t count = (uint32_t)snapshot.count;
+
+    ColumnData ret;
+    ret[1] = Value(ASN_OCTET_STR,
+                   (unsigned char*)(_string_index.c_str()),
+                   _string_index.size());
+    ret[2] = Value::uint(_percentile_index);
+    ret[3] = Value::uint(latency_col);
+    ret[4] = Value(ASN_COUNTER, (unsigned char*)&count, sizeof(uint32_t));
+    return ret;
+  }
+
+private:
+  std::string _string_index;
+  double _percentile;
+  uint32_t _percentile_index;
+  const LatencyHistogram* _histogram;
+};
+
+class LatencyPercentileTableImpl : public ManagedTable<LatencyPercentileRow, int>,
+                                   public LatencyPercentileTable
+{
+public:
+  LatencyPercentileTableImpl(std::string name,
+                             std::string tbl_oid,
+                             const std::vector<double>& percentiles) :
+    ManagedTable<LatencyPercentileRow, int>(name,
+                                            tbl_oid,
+                                            3,
+                                            4,
+                                            { ASN_OCTET_STR, ASN_UNSIGNED }),
+    _percentiles(percentiles),
+    _table_rows(0)
+  {
+    TRC_INFO("Created table with name %s, OID %s", name.c_str(), tbl_oid.c_str());
+    pthread_mutex_init(&_table_lock, NULL);
+  }
+
+  ~LatencyPercentileTableImpl()
+  {
+    TRC_INFO("Destroying table with name %s", _name.c_str());
+    pthread_mutex_destroy(&_table_lock);
+  }
+
+  void add_histogram(std::string string_index, const LatencyHistogram* histogram)
+  {
+    // Add a row for each percentile. The rows are keyed by an arbitrary (but
+    // unique) key, as they are never looked up or removed.
+    pthread_mutex_lock(&_table_lock);
+
+    for (std::vector<double>::const_iterator it = _percentiles.begin();
+         it != _percentiles.end();
+         ++it)
+    {
+      this->add(_table_rows++, new LatencyPercentileRow(string_index, *it, histogram));
+    }
+
+    pthread_mutex_unlock(&_table_lock);
+  }
+
+private:
+  LatencyPercentileRow* new_row(int indexes) { return NULL; };
+
+  const std::vector<double> _percentiles;
+
+  // The number of rows in the table -- used to assign a unique (but arbitrary)
+  // key to each row -- and a lock to protect the rows map.
+  int _table_rows;
+  pthread_mutex_t _table_lock;
+};
+
+LatencyPercentileTable* LatencyPercentileTable::create(std::string name,
+                                                       std::string oid,
+                                                       const std::vector<double>& percentiles)
+{
+  return new LatencyPercentileTableImpl(name, oid, percentiles);
+}
+
+}
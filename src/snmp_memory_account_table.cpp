@@ -0,0 +1,104 @@
+/**
+ * @file snmp_memory_account_table.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "snmp_internal/snmp_includes.h"
+#include "snmp_internal/snmp_table.h"
+#include "snmp_memory_account_table.h"
+#include "log.h"
+
+namespace SNMP
+{
+
+// Row that reports the counts of one memory account.
+class MemoryAccountRow : public Row
+{
+public:
+  MemoryAccountRow(const MemoryAccount* account) :
+    Row(),
+    _name(account->name()),
+    _account(account)
+  {
+    netsnmp_tdata_row_add_index(_row,
+                                ASN_OCTET_STR,
+                                _name.c_str(),
+                                _name.length());
+  };
+
+  ColumnData get_columns()
+  {
+    MemoryAccount::Snapshot snapshot = _account->snapshot();
+
+    ColumnData ret;
+    ret[1] = Value(ASN_OCTET_STR,
+                   (unsigned char*)(_name.c_str()),
+                   _name.size());
+    ret[2] = gauge(snapshot.bytes / 1024);
+    ret[3] = gauge(snapshot.objects);
+    ret[4] = gauge(snapshot.peak_bytes / 1024);
+    return ret;
+  }
+
+private:
+  // Clamp the counts to what a Gauge32 can hold (they can only be negative
+  // if a subsystem credits more than it charged).
+  static Value gauge(int64_t count)
+  {
+    uint32_t count32 = (count < 0) ? 0 :
+                       (count > UINT32_MAX) ? UINT32_MAX : (uint32_t)count;
+    return Value(ASN_GAUGE, (unsigned char*)&count32, sizeof(uint32_t));
+  }
+
+  std::string _name;
+  const MemoryAccount* _account;
+};
+
+class MemoryAccountTableImpl : public ManagedTable<MemoryAccountRow, std::string>,
+                               public MemoryAccountTable
+{
+public:
+  MemoryAccountTableImpl(std::string name, std::string tbl_oid) :
+    ManagedTable<MemoryAccountRow, std::string>(name,
+                                                tbl_oid,
+                                                2,
+                                                4,
+                                                { ASN_OCTET_STR })
+  {
+    TRC_INFO("Created table with name %s, OID %s", name.c_str(), tbl_oid.c_str());
+    pthread_mutex_init(&_table_lock, NULL);
+  }
+
+  ~MemoryAccountTableImpl()
+  {
+    TRC_INFO("Destroying table with name %s", _name.c_str());
+    pthread_mutex_destroy(&_table_lock);
+  }
+
+  void add_account(const MemoryAccount* account)
+  {
+    pthread_mutex_lock(&_table_lock);
+    this->add(account->name(), new MemoryAccountRow(account));
+    pthread_mutex_unlock(&_table_lock);
+  }
+
+private:
+  MemoryAccountRow* new_row(std::string name) { return NULL; };
+
+  // Lock to protect the rows map.
+  pthread_mutex_t _table_lock;
+};
+
+MemoryAccountTable* MemoryAccountTable::create(std::string name,
+                                               std::string oid)
+{
+  return new MemoryAccountTableImpl(name, oid);
+}
+
+}
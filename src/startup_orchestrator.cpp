@@ -0,0 +1,472 @@
+/**
+ * @file startup_orchestrator.cpp  Runs a process's startup steps
+ * concurrently, in dependency order, and times them.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <time.h>
+
+#include <algorithm>
+#include <exception>
+
+#include "log.h"
+#include "json_writer.h"
+#include "snmp_scalar.h"
+#include "startup_orchestrator.h"
+
+StartupOrchestrator::StartupOrchestrator() :
+  _steps(),
+  _step_indexes(),
+  _duplicate_names(false),
+  _ready(),
+  _incomplete(0),
+  _run_start_us(0),
+  _time_to_ready_us(0),
+  _time_to_ready_scalar(NULL)
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_cond, NULL);
+}
+
+StartupOrchestrator::~StartupOrchestrator()
+{
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+void StartupOrchestrator::add_step(const std::string& name,
+                                   StepFn fn,
+                                   const std::vector<std::string>& depends_on)
+{
+  Step step;
+  step.name = name;
+  step.fn = fn;
+  step.depends_on = depends_on;
+  step.pending = depends_on.size();
+  step.blocked = false;
+  step.outcome = NOT_RUN;
+  step.start_us = 0;
+  step.end_us = 0;
+
+  if (!_step_indexes.insert(std::make_pair(name, _steps.size())).second)
+  {
+    // Keep the step, so that run() can see there's a duplicate.
+    TRC_ERROR("Startup step %s has been added more than once", name.c_str());
+    _duplicate_names = true;
+  }
+
+  _steps.push_back(step);
+}
+
+bool StartupOrchestrator::run(unsigned int num_threads)
+{
+  _run_start_us = now_us();
+
+  if (!link_steps())
+  {
+    return false;
+  }
+
+  TRC_STATUS("Running %lu startup steps on up to %u threads",
+             _steps.size(),
+             num_threads);
+
+  _incomplete = _steps.size();
+
+  for (size_t ii = 0; ii < _steps.size(); ++ii)
+  {
+    if (_steps[ii].pending == 0)
+    {
+      _ready.push_back(ii);
+    }
+  }
+
+  size_t num_workers = std::min((size_t)std::max(num_threads, 1u), _steps.size());
+  std::vector<pthread_t> workers;
+
+  for (size_t ii = 0; ii < num_workers; ++ii)
+  {
+    pthread_t worker;
+    int rc = pthread_create(&worker, NULL, worker_thread_fn, this);
+
+    if (rc == 0)
+    {
+      workers.push_back(worker);
+    }
+    else
+    {
+      TRC_WARNING("Failed to create startup thread: %d", rc); // LCOV_EXCL_LINE
+    }
+  }
+
+  if (workers.empty())
+  {
+    // Run the steps on this thread instead.
+    worker_thread_fn(); // LCOV_EXCL_LINE
+  }
+
+  for (std::vector<pthread_t>::iterator it = workers.begin();
+       it != workers.end();
+       ++it)
+  {
+    pthread_join(*it, NULL);
+  }
+
+  _time_to_ready_us = now_us() - _run_start_us;
+
+  if (_time_to_ready_scalar != NULL)
+  {
+    _time_to_ready_scalar->value = _time_to_ready_us / 1000;
+  }
+
+  log_timings();
+
+  for (std::vector<Step>::const_iterator it = _steps.begin();
+       it != _steps.end();
+       ++it)
+  {
+    if (it->outcome != SUCCEEDED)
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+std::vector<StartupOrchestrator::StepTiming> StartupOrchestrator::timings() const
+{
+  std::vector<StepTiming> timings;
+
+  for (std::vector<Step>::const_iterator it = _steps.begin();
+       it != _steps.end();
+       ++it)
+  {
+    StepTiming timing;
+    timing.name = it->name;
+    timing.outcome = it->outcome;
+    timing.start_us = it->start_us;
+    timing.end_us = it->end_us;
+    timings.push_back(timing);
+  }
+
+  return timings;
+}
+
+std::string StartupOrchestrator::timings_json() const
+{
+  std::string json;
+  JsonStringStream stream(json);
+  JsonStringWriter writer(stream);
+
+  writer.StartObject();
+  writer.String("time_to_ready_us");
+  writer.Uint64(_time_to_ready_us);
+
+  writer.String("steps");
+  writer.StartArray();
+
+  for (std::vector<Step>::const_iterator it = _steps.begin();
+       it != _steps.end();
+       ++it)
+  {
+    writer.StartObject();
+    writer.String("name");
+    writer.String(it->name.c_str());
+    writer.String("outcome");
+    writer.String(outcome_str(it->outcome));
+    writer.String("start_us");
+    writer.Uint64(it->start_us);
+    writer.String("duration_us");
+    writer.Uint64(it->end_us - it->start_us);
+    writer.EndObject();
+  }
+
+  writer.EndArray();
+
+  writer.String("critical_path");
+  writer.StartArray();
+  std::vector<size_t> path = critical_path();
+
+  for (std::vector<size_t>::const_iterator it = path.begin();
+       it != path.end();
+       ++it)
+  {
+    writer.String(_steps[*it].name.c_str());
+  }
+
+  writer.EndArray();
+  writer.EndObject();
+
+  return json;
+}
+
+bool StartupOrchestrator::link_steps()
+{
+  if (_duplicate_names)
+  {
+    TRC_ERROR("Startup steps must have unique names");
+    return false;
+  }
+
+  for (size_t ii = 0; ii < _steps.size(); ++ii)
+  {
+    for (std::vector<std::string>::const_iterator it = _steps[ii].depends_on.begin();
+         it != _steps[ii].depends_on.end();
+         ++it)
+    {
+      std::map<std::string, size_t>::const_iterator dependency = _step_indexes.find(*it);
+
+      if (dependency == _step_indexes.end())
+      {
+        TRC_ERROR("Startup step %s depends on unknown step %s",
+                  _steps[ii].name.c_str(),
+                  it->c_str());
+        return false;
+      }
+
+      _steps[dependency->second].dependents.push_back(ii);
+    }
+  }
+
+  // Check there's no cycle by completing the steps in dependency order
+  // without running them - any that are never ready are in (or wait on) a
+  // cycle.
+  std::vector<size_t> pending(_steps.size());
+  std::vector<size_t> ready;
+
+  for (size_t ii = 0; ii < _steps.size(); ++ii)
+  {
+    pending[ii] = _steps[ii].pending;
+
+    if (pending[ii] == 0)
+    {
+      ready.push_back(ii);
+    }
+  }
+
+  size_t completed = 0;
+
+  while (!ready.empty())
+  {
+    size_t index = ready.back();
+    ready.pop_back();
+    ++completed;
+
+    for (std::vector<size_t>::const_iterator it = _steps[index].dependents.begin();
+         it != _steps[index].dependents.end();
+         ++it)
+    {
+      if (--pending[*it] == 0)
+      {
+        ready.push_back(*it);
+      }
+    }
+  }
+
+  if (completed != _steps.size())
+  {
+    TRC_ERROR("The dependencies of the startup steps form a cycle");
+    return false;
+  }
+
+  return true;
+}
+
+void* StartupOrchestrator::worker_thread_fn(void* orchestrator)
+{
+  ((StartupOrchestrator*)orchestrator)->worker_thread_fn();
+  return NULL;
+}
+
+void StartupOrchestrator::worker_thread_fn()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (true)
+  {
+    while ((_ready.empty()) && (_incomplete > 0))
+    {
+      pthread_cond_wait(&_cond, &_lock);
+    }
+
+    if (_ready.empty())
+    {
+      break;
+    }
+
+    size_t index = _ready.front();
+    _ready.pop_front();
+    Step& step = _steps[index];
+    pthread_mutex_unlock(&_lock);
+
+    TRC_STATUS("Starting startup step %s", step.name.c_str());
+    step.start_us = now_us() - _run_start_us;
+    bool succeeded = false;
+
+    try
+    {
+      succeeded = step.fn();
+    }
+    catch (const std::exception& e)
+    {
+      TRC_ERROR("Startup step %s threw: %s", step.name.c_str(), e.what());
+    }
+    catch (...)
+    {
+      TRC_ERROR("Startup step %s threw", step.name.c_str());
+    }
+
+    step.end_us = now_us() - _run_start_us;
+
+    TRC_STATUS("Startup step %s %s in %lu ms",
+               step.name.c_str(),
+               succeeded ? "succeeded" : "failed",
+               (step.end_us - step.start_us) / 1000);
+
+    pthread_mutex_lock(&_lock);
+    step.outcome = succeeded ? SUCCEEDED : FAILED;
+    step_complete(index);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void StartupOrchestrator::step_complete(size_t index)
+{
+  const Step& step = _steps[index];
+  --_incomplete;
+
+  for (std::vector<size_t>::const_iterator it = step.dependents.begin();
+       it != step.dependents.end();
+       ++it)
+  {
+    Step& dependent = _steps[*it];
+    dependent.blocked = dependent.blocked || (step.outcome != SUCCEEDED);
+
+    if (--dependent.pending == 0)
+    {
+      if (dependent.blocked)
+      {
+        TRC_WARNING("Skipping startup step %s as a step it depends on failed",
+                    dependent.name.c_str());
+        dependent.outcome = SKIPPED;
+        dependent.start_us = step.end_us;
+        dependent.end_us = step.end_us;
+        step_complete(*it);
+      }
+      else
+      {
+        _ready.push_back(*it);
+      }
+    }
+  }
+
+  pthread_cond_broadcast(&_cond);
+}
+
+std::vector<size_t> StartupOrchestrator::critical_path() const
+{
+  std::vector<size_t> path;
+
+  if (_steps.empty())
+  {
+    return path;
+  }
+
+  // Start from the last step to finish, and work back through whichever of
+  // each step's dependencies finished last.
+  size_t index = 0;
+
+  for (size_t ii = 1; ii < _steps.size(); ++ii)
+  {
+    if (_steps[ii].end_us > _steps[index].end_us)
+    {
+      index = ii;
+    }
+  }
+
+  while (true)
+  {
+    path.push_back(index);
+
+    const std::vector<std::string>& depends_on = _steps[index].depends_on;
+
+    if (depends_on.empty())
+    {
+      break;
+    }
+
+    size_t latest = _step_indexes.find(depends_on[0])->second;
+
+    for (std::vector<std::string>::const_iterator it = depends_on.begin() + 1;
+         it != depends_on.end();
+         ++it)
+    {
+      size_t dependency = _step_indexes.find(*it)->second;
+
+      if (_steps[dependency].end_us > _steps[latest].end_us)
+      {
+        latest = dependency;
+      }
+    }
+
+    index = latest;
+  }
+
+  std::reverse(path.begin(), path.end());
+  return path;
+}
+
+void StartupOrchestrator::log_timings() const
+{
+  std::string path_str;
+  std::vector<size_t> path = critical_path();
+
+  for (std::vector<size_t>::const_iterator it = path.begin();
+       it != path.end();
+       ++it)
+  {
+    const Step& step = _steps[*it];
+
+    if (!path_str.empty())
+    {
+      path_str.append(" -> ");
+    }
+
+    path_str.append(step.name)
+            .append(" (")
+            .append(std::to_string((step.end_us - step.start_us) / 1000))
+            .append(" ms)");
+  }
+
+  TRC_STATUS("Startup took %lu ms, critical path: %s",
+             _time_to_ready_us / 1000,
+             path_str.c_str());
+}
+
+const char* StartupOrchestrator::outcome_str(Outcome outcome)
+{
+  switch (outcome)
+  {
+  case NOT_RUN: return "not run";
+  case SUCCEEDED: return "succeeded";
+  case FAILED: return "failed";
+  case SKIPPED: return "skipped";
+  }
+
+  return "unknown"; // LCOV_EXCL_LINE
+}
+
+uint64_t StartupOrchestrator::now_us() const
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
@@ -15,6 +15,8 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <poll.h>
+#include <unistd.h>
+#include <string.h>
 
 #include <sstream>
 #include <iomanip>
@@ -39,18 +41,112 @@ StaticDnsCache::StaticDnsCache(std::string filename) :
 
 StaticDnsCache::~StaticDnsCache()
 {
-  // Clean up any static_records.
-  for (const std::pair<std::string, std::vector<DnsRRecord*>>& entry : _static_records)
+}
+
+// Loads static DNS records from the _dns_config_file, which is either a JSON
+// file (see parse_json_records()) or an index compiled from one.  If the file
+// can't be loaded, the previous records are kept.
+void StaticDnsCache::reload_static_records()
+{
+  if (_dns_config_file == "")
+  {
+    // No config file specified, just return
+    return;
+  }
+
+  if (access(_dns_config_file.c_str(), R_OK) != 0)
+  {
+    TRC_ERROR("DNS config file %s missing", _dns_config_file.c_str());
+    CL_DNS_FILE_MISSING.log();
+    return;
+  }
+
+  TRC_STATUS("Loading static DNS records from %s",
+             _dns_config_file.c_str());
+
+  StaticDnsIndexPtr new_index;
+
+  if (StaticDnsIndex::is_index_file(_dns_config_file))
+  {
+    new_index = StaticDnsIndex::open(_dns_config_file);
+
+    if (!new_index)
+    {
+      CL_DNS_FILE_MALFORMED.log();
+      return;
+    }
+  }
+  else
   {
-    for (DnsRRecord *record : entry.second)
+    std::map<std::string, std::vector<DnsRRecord*>> static_records;
+
+    if (!parse_json_records(_dns_config_file, static_records))
+    {
+      return;
+    }
+
+    new_index = StaticDnsIndex::build(static_records);
+    free_records(static_records);
+
+    if (!new_index)
+    {
+      // LCOV_EXCL_START
+      CL_DNS_FILE_MALFORMED.log();
+      return;
+      // LCOV_EXCL_STOP
+    }
+  }
+
+  // Now publish the new index.  The old one is freed once any lookups using
+  // it have finished.
+  _index.publish(new_index);
+
+  TRC_STATUS("Loaded %d static DNS records from %s",
+             (int)new_index->size(),
+             _dns_config_file.c_str());
+}
+
+bool StaticDnsCache::compile_static_records(const std::string& json_file,
+                                            const std::string& index_file)
+{
+  std::map<std::string, std::vector<DnsRRecord*>> static_records;
+
+  if (!parse_json_records(json_file, static_records))
+  {
+    return false;
+  }
+
+  StaticDnsIndexPtr index = StaticDnsIndex::build(static_records);
+  free_records(static_records);
+
+  return ((index) && (index->write(index_file)));
+}
+
+int StaticDnsCache::size()
+{
+  StaticDnsIndexPtr static_index = index();
+  return (static_index) ? static_index->size() : 0;
+}
+
+StaticDnsIndexPtr StaticDnsCache::index()
+{
+  return _index.get();
+}
+
+void StaticDnsCache::free_records(std::map<std::string, std::vector<DnsRRecord*>>& records)
+{
+  for (const std::pair<const std::string, std::vector<DnsRRecord*>>& entry : records)
+  {
+    for (DnsRRecord* record : entry.second)
     {
       delete record;
     }
   }
-  _static_records.clear();
+
+  records.clear();
 }
 
-// Reads static dns records from the specified _dns_config_file.
+// Reads static dns records from a JSON DNS config file.
 // The file has the format:
 //
 // {
@@ -74,26 +170,18 @@ StaticDnsCache::~StaticDnsCache()
 //   "rrtype": "A",
 //   "targets": [<target1>, <target2>, ...]
 // }
-void StaticDnsCache::reload_static_records()
+bool StaticDnsCache::parse_json_records(const std::string& filename,
+                                        std::map<std::string, std::vector<DnsRRecord*>>& records)
 {
-  if (_dns_config_file == "")
-  {
-    // No config file specified, just return
-    return;
-  }
-
-  std::ifstream fs(_dns_config_file.c_str());
+  std::ifstream fs(filename.c_str());
 
   if (!fs)
   {
-    TRC_ERROR("DNS config file %s missing", _dns_config_file.c_str());
+    TRC_ERROR("DNS config file %s missing", filename.c_str());
     CL_DNS_FILE_MISSING.log();
-    return;
+    return false;
   }
 
-  TRC_STATUS("Loading static DNS records from %s",
-             _dns_config_file.c_str());
-
   // File exists and is ready
   std::string dns_config((std::istreambuf_iterator<char>(fs)),
                          std::istreambuf_iterator<char>());
@@ -107,7 +195,7 @@ void StaticDnsCache::reload_static_records()
               dns_config.c_str(),
               rapidjson::GetParseError_En(doc.GetParseError()));
     CL_DNS_FILE_MALFORMED.log();
-    return;
+    return false;
   }
 
   try
@@ -218,7 +306,7 @@ void StaticDnsCache::reload_static_records()
           {
             TRC_ERROR("Bad DNS record specified for hostname %s in DNS config file %s",
                       hostname.c_str(),
-                      _dns_config_file.c_str());
+                      filename.c_str());
             CL_DNS_FILE_BAD_ENTRY.log();
           }
         }
@@ -229,65 +317,62 @@ void StaticDnsCache::reload_static_records()
       {
         TRC_ERROR("Malformed entry in DNS config file %s. Each entry must have "
                   "a \"name\" and \"records\" member",
-                  _dns_config_file.c_str());
+                  filename.c_str());
         CL_DNS_FILE_BAD_ENTRY.log();
       }
     }
 
-    // Now swap out the old _static_records for the new one.
-    std::swap(_static_records, static_records);
-    TRC_STATUS("Loaded %d static DNS records from %s",
-               _static_records.size(),
-               _dns_config_file.c_str());
-
-    // Finally, clean up the now unused records
-    for (const std::pair<std::string, std::vector<DnsRRecord*>>& entry : static_records)
-    {
-      for (DnsRRecord* record : entry.second)
-      {
-        delete record;
-      }
-    }
+    // Now hand back the new records.
+    std::swap(records, static_records);
+    return true;
   }
   catch (JsonFormatError err)
   {
-    TRC_ERROR("Error parsing dns config file %s.", _dns_config_file.c_str());
+    TRC_ERROR("Error parsing dns config file %s.", filename.c_str());
     CL_DNS_FILE_MALFORMED.log();
+    return false;
   }
 }
 
-DnsResult StaticDnsCache::get_static_dns_records(std::string domain,
+DnsResult StaticDnsCache::get_static_dns_records(const std::string& domain,
                                                  int dns_type)
 {
   std::vector<DnsRRecord*> found_records;
+  StaticDnsIndexPtr static_index = index();
+  const StaticDnsIndex::Record* records;
+  size_t count;
 
   // There may be multiple records that match our query, so we iterate over
   // them all.
-  std::map<std::string, std::vector<DnsRRecord*>>::const_iterator map_iter =
-                                                                      _static_records.find(domain);
-  if (map_iter != _static_records.end())
+  if ((static_index) && (static_index->find(domain, records, count)))
   {
     TRC_DEBUG("Found records for domain %s", domain.c_str());
-    for (DnsRRecord* record : map_iter->second)
+    for (size_t ii = 0; ii < count; ++ii)
     {
-      if (record->rrtype() != dns_type)
+      if ((int)records[ii].rrtype != dns_type)
       {
         // These are not the DNS records you are looking for.
         continue;
       }
 
       // Currently only A and CNAME records are supported.
-      if (record->rrtype() == ns_t_a)
+      if (records[ii].rrtype == ns_t_a)
       {
-        DnsARecord* a_record = (DnsARecord*)record;
+        struct in_addr address;
+        memcpy(&address, static_index->data(records[ii]), sizeof(address));
+        DnsARecord* a_record = new DnsARecord(domain, 0, address);
         TRC_VERBOSE("Static A record found: %s -> %s",
                     domain.c_str(),
                     a_record->to_string().c_str());
         found_records.push_back(a_record);
       }
-      else if (record->rrtype() == ns_t_cname)
+      else if (records[ii].rrtype == ns_t_cname)
       {
-        DnsCNAMERecord* cname_record = (DnsCNAMERecord*)record;
+        DnsCNAMERecord* cname_record =
+          new DnsCNAMERecord(domain,
+                             0,
+                             std::string(static_index->data(records[ii]),
+                                         records[ii].length));
         TRC_VERBOSE("Static CNAME record found: %s -> %s",
                     domain.c_str(),
                     cname_record->target().c_str());
@@ -303,28 +388,42 @@ DnsResult StaticDnsCache::get_static_dns_records(std::string domain,
     TRC_DEBUG("No static records found matching %s", domain.c_str());
   }
 
-  // In the case where we didn't find anything that matches, found_records will
-  // be empty.
-  return DnsResult(domain, dns_type, found_records, 0);
+  // In the case where we didn't find anything that matches, the result is
+  // empty.
+  if (found_records.empty())
+  {
+    return DnsResult(domain, dns_type, 0);
+  }
+
+  DnsRecordSetPtr record_set(new DnsRecordSet(std::move(found_records)));
+  return DnsResult(domain, dns_type, record_set, 0);
 }
 
 // If a valid CNAME record is found in the static cache, we return that value.
-// Otherwise, return the domain that was passed in.
-std::string StaticDnsCache::get_canonical_name(std::string domain)
+// Otherwise, return the domain that was passed in.  This reads the target
+// straight from the index, without creating a record.
+std::string StaticDnsCache::get_canonical_name(const std::string& domain)
 {
-  DnsResult static_result = get_static_dns_records(domain, ns_t_cname);
-  if (!static_result.records().empty())
-  {
-    // We've found a CNAME record in the static cache - let's use that.
-    DnsCNAMERecord *cname_record = (DnsCNAMERecord*)static_result.records().front();
-    TRC_VERBOSE("Found matching CNAME record in static cache", cname_record->target().c_str());
-    return cname_record->target();
-  }
-  else
+  StaticDnsIndexPtr static_index = index();
+  const StaticDnsIndex::Record* records;
+  size_t count;
+
+  if ((static_index) && (static_index->find(domain, records, count)))
   {
-    // There's no valid CNAME record in the cache, so just use the passed in
-    // domain name.
-    TRC_VERBOSE("No matching CNAME record found in static cache");
-    return domain;
+    for (size_t ii = 0; ii < count; ++ii)
+    {
+      if (records[ii].rrtype == ns_t_cname)
+      {
+        // We've found a CNAME record in the static cache - let's use that.
+        std::string target(static_index->data(records[ii]), records[ii].length);
+        TRC_VERBOSE("Found matching CNAME record in static cache: %s", target.c_str());
+        return target;
+      }
+    }
   }
+
+  // There's no valid CNAME record in the cache, so just use the passed in
+  // domain name.
+  TRC_VERBOSE("No matching CNAME record found in static cache");
+  return domain;
 }
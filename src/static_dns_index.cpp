@@ -0,0 +1,471 @@
+/**
+ * @file static_dns_index.cpp  Compiled, read-only index of static DNS records.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/nameser.h>
+
+#include <algorithm>
+#include <fstream>
+
+#include "log.h"
+#include "siphash.h"
+#include "static_dns_index.h"
+
+const uint32_t StaticDnsIndex::MAGIC;
+const uint32_t StaticDnsIndex::VERSION;
+const uint32_t StaticDnsIndex::EMPTY_SLOT;
+const uint32_t StaticDnsIndex::NAMES_PER_BUCKET;
+
+StaticDnsIndex::StaticDnsIndex(char* data, size_t mapped_length) :
+  _data(data),
+  _mapped_length(mapped_length)
+{
+}
+
+StaticDnsIndex::~StaticDnsIndex()
+{
+  if (_mapped_length > 0)
+  {
+    munmap(_data, _mapped_length);
+  }
+  else
+  {
+    ::operator delete(_data);
+  }
+}
+
+StaticDnsIndexPtr StaticDnsIndex::build(const std::map<std::string, std::vector<DnsRRecord*>>& records)
+{
+  std::vector<std::string> names;
+  names.reserve(records.size());
+
+  for (const std::pair<const std::string, std::vector<DnsRRecord*>>& entry : records)
+  {
+    names.push_back(entry.first);
+  }
+
+  uint32_t num_names = names.size();
+  uint32_t num_buckets = std::max((num_names + NAMES_PER_BUCKET - 1) / NAMES_PER_BUCKET, 1u);
+
+  // Keep the table no more than 80% full, so that most buckets are placed at
+  // one of their first few displacements.
+  uint32_t num_slots = 1;
+  while (num_slots < num_names + num_names / 4)
+  {
+    num_slots <<= 1;
+  }
+
+  std::vector<uint32_t> displacements;
+  std::vector<uint32_t> slot_names;
+  uint64_t seed = 0;
+  bool placed = false;
+
+  for (int ii = 0; (ii < MAX_SEEDS) && (!placed); ++ii)
+  {
+    seed = 0x9e3779b97f4a7c15ULL * (ii + 1);
+    placed = place_names(names, seed, num_buckets, num_slots, displacements, slot_names);
+  }
+
+  if (!placed)
+  {
+    // LCOV_EXCL_START - only happens if hostnames' hashes collide for every
+    // seed.
+    TRC_ERROR("Unable to build an index of %d static DNS hostnames", num_names);
+    return NULL;
+    // LCOV_EXCL_STOP
+  }
+
+  // Lay out the hostnames, the records and their data, in hostname order.
+  std::string strings;
+  std::vector<Record> index_records;
+  std::vector<Slot> name_slots;
+  name_slots.reserve(num_names);
+
+  for (const std::pair<const std::string, std::vector<DnsRRecord*>>& entry : records)
+  {
+    Slot slot;
+    slot.name_offset = strings.size();
+    slot.name_length = entry.first.size();
+    slot.first_record = index_records.size();
+    strings.append(entry.first);
+
+    for (DnsRRecord* record : entry.second)
+    {
+      Record index_record;
+      index_record.rrtype = record->rrtype();
+      index_record.offset = strings.size();
+
+      if (record->rrtype() == ns_t_a)
+      {
+        const struct in_addr& address = ((DnsARecord*)record)->address();
+        strings.append((const char*)&address, sizeof(address));
+      }
+      else if (record->rrtype() == ns_t_cname)
+      {
+        strings.append(((DnsCNAMERecord*)record)->target());
+      }
+      else
+      {
+        continue;
+      }
+
+      index_record.length = strings.size() - index_record.offset;
+      index_records.push_back(index_record);
+    }
+
+    slot.record_count = index_records.size() - slot.first_record;
+    name_slots.push_back(slot);
+  }
+
+  uint64_t displacements_offset = sizeof(Header);
+  uint64_t slots_offset = displacements_offset + num_buckets * sizeof(uint32_t);
+  uint64_t records_offset = slots_offset + (uint64_t)num_slots * sizeof(Slot);
+  uint64_t strings_offset = records_offset + index_records.size() * sizeof(Record);
+  uint64_t total_length = strings_offset + strings.size();
+
+  if (total_length > UINT32_MAX)
+  {
+    TRC_ERROR("Static DNS records too large to index (%lu bytes)", total_length);
+    return NULL;
+  }
+
+  char* data = (char*)::operator new(total_length);
+  StaticDnsIndexPtr index(new StaticDnsIndex(data, 0));
+
+  Header* header = (Header*)data;
+  header->magic = MAGIC;
+  header->version = VERSION;
+  header->seed_lo = (uint32_t)seed;
+  header->seed_hi = (uint32_t)(seed >> 32);
+  header->num_names = num_names;
+  header->num_buckets = num_buckets;
+  header->num_slots = num_slots;
+  header->num_records = index_records.size();
+  header->displacements_offset = displacements_offset;
+  header->slots_offset = slots_offset;
+  header->records_offset = records_offset;
+  header->strings_offset = strings_offset;
+  header->strings_length = strings.size();
+  header->total_length = total_length;
+
+  memcpy(data + displacements_offset,
+         displacements.data(),
+         num_buckets * sizeof(uint32_t));
+
+  Slot* slots = (Slot*)(data + slots_offset);
+  for (uint32_t ii = 0; ii < num_slots; ++ii)
+  {
+    if (slot_names[ii] == EMPTY_SLOT)
+    {
+      Slot empty = {EMPTY_SLOT, 0, 0, 0};
+      slots[ii] = empty;
+    }
+    else
+    {
+      slots[ii] = name_slots[slot_names[ii]];
+    }
+  }
+
+  if (!index_records.empty())
+  {
+    memcpy(data + records_offset,
+           index_records.data(),
+           index_records.size() * sizeof(Record));
+  }
+
+  memcpy(data + strings_offset, strings.data(), strings.size());
+
+  return index;
+}
+
+StaticDnsIndexPtr StaticDnsIndex::open(const std::string& filename)
+{
+  int fd = ::open(filename.c_str(), O_RDONLY);
+
+  if (fd < 0)
+  {
+    TRC_ERROR("Unable to open static DNS index %s: %s",
+              filename.c_str(),
+              strerror(errno));
+    return NULL;
+  }
+
+  struct stat st;
+  if ((fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(Header)))
+  {
+    TRC_ERROR("Static DNS index %s is too short", filename.c_str());
+    ::close(fd);
+    return NULL;
+  }
+
+  void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+
+  if (data == MAP_FAILED)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Unable to map static DNS index %s: %s",
+              filename.c_str(),
+              strerror(errno));
+    return NULL;
+    // LCOV_EXCL_STOP
+  }
+
+  if (!validate((const char*)data, st.st_size))
+  {
+    TRC_ERROR("Static DNS index %s is corrupt", filename.c_str());
+    munmap(data, st.st_size);
+    return NULL;
+  }
+
+  return StaticDnsIndexPtr(new StaticDnsIndex((char*)data, st.st_size));
+}
+
+bool StaticDnsIndex::is_index_file(const std::string& filename)
+{
+  std::ifstream fs(filename.c_str(), std::ios::binary);
+  uint32_t magic = 0;
+  fs.read((char*)&magic, sizeof(magic));
+  return ((fs) && (magic == MAGIC));
+}
+
+bool StaticDnsIndex::write(const std::string& filename) const
+{
+  std::string tmp_filename = filename + ".tmp";
+
+  {
+    std::ofstream fs(tmp_filename.c_str(), std::ios::binary | std::ios::trunc);
+    fs.write(_data, header()->total_length);
+    fs.close();
+
+    if (!fs)
+    {
+      TRC_ERROR("Unable to write static DNS index %s", tmp_filename.c_str());
+      unlink(tmp_filename.c_str());
+      return false;
+    }
+  }
+
+  if (rename(tmp_filename.c_str(), filename.c_str()) != 0)
+  {
+    TRC_ERROR("Unable to rename static DNS index to %s: %s",
+              filename.c_str(),
+              strerror(errno));
+    unlink(tmp_filename.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+bool StaticDnsIndex::find(const std::string& domain,
+                          const Record*& found_records,
+                          size_t& count) const
+{
+  const Header* hdr = header();
+
+  if (hdr->num_names == 0)
+  {
+    return false;
+  }
+
+  uint64_t seed = ((uint64_t)hdr->seed_hi << 32) | hdr->seed_lo;
+  uint64_t h1;
+  uint64_t h2;
+  hash(domain.data(), domain.size(), seed, h1, h2);
+
+  uint32_t bucket = (uint32_t)(h2 >> 32) % hdr->num_buckets;
+  uint64_t displacement = displacements()[bucket];
+  const Slot& slot = slots()[(h1 + displacement * h2) & (hdr->num_slots - 1)];
+
+  // The hash maps every hostname to a different slot, but other names can
+  // map to any slot, so check the name matches.
+  if ((slot.name_offset == EMPTY_SLOT) ||
+      (slot.name_length != domain.size()) ||
+      (memcmp(strings() + slot.name_offset, domain.data(), domain.size()) != 0))
+  {
+    return false;
+  }
+
+  found_records = records() + slot.first_record;
+  count = slot.record_count;
+  return true;
+}
+
+bool StaticDnsIndex::validate(const char* data, size_t length)
+{
+  const Header* hdr = (const Header*)data;
+
+  if ((hdr->magic != MAGIC) ||
+      (hdr->version != VERSION) ||
+      (hdr->total_length != length) ||
+      (hdr->num_buckets == 0) ||
+      (hdr->num_slots == 0) ||
+      ((hdr->num_slots & (hdr->num_slots - 1)) != 0))
+  {
+    return false;
+  }
+
+  // Check each table is aligned and lies within the block.  The sizes are
+  // calculated in 64 bits so can't overflow.
+  if ((hdr->displacements_offset % sizeof(uint32_t) != 0) ||
+      (hdr->slots_offset % sizeof(uint32_t) != 0) ||
+      (hdr->records_offset % sizeof(uint32_t) != 0) ||
+      (hdr->displacements_offset < sizeof(Header)) ||
+      (hdr->displacements_offset + (uint64_t)hdr->num_buckets * sizeof(uint32_t) > length) ||
+      (hdr->slots_offset + (uint64_t)hdr->num_slots * sizeof(Slot) > length) ||
+      (hdr->records_offset + (uint64_t)hdr->num_records * sizeof(Record) > length) ||
+      ((uint64_t)hdr->strings_offset + hdr->strings_length > length))
+  {
+    return false;
+  }
+
+  const Slot* slots = (const Slot*)(data + hdr->slots_offset);
+  uint32_t num_names = 0;
+
+  for (uint32_t ii = 0; ii < hdr->num_slots; ++ii)
+  {
+    if (slots[ii].name_offset == EMPTY_SLOT)
+    {
+      continue;
+    }
+
+    if (((uint64_t)slots[ii].name_offset + slots[ii].name_length > hdr->strings_length) ||
+        ((uint64_t)slots[ii].first_record + slots[ii].record_count > hdr->num_records))
+    {
+      return false;
+    }
+
+    ++num_names;
+  }
+
+  const Record* records = (const Record*)(data + hdr->records_offset);
+
+  for (uint32_t ii = 0; ii < hdr->num_records; ++ii)
+  {
+    if (((uint64_t)records[ii].offset + records[ii].length > hdr->strings_length) ||
+        ((records[ii].rrtype == ns_t_a) && (records[ii].length != sizeof(struct in_addr))))
+    {
+      return false;
+    }
+  }
+
+  return (num_names == hdr->num_names);
+}
+
+void StaticDnsIndex::hash(const char* name,
+                          size_t length,
+                          uint64_t seed,
+                          uint64_t& h1,
+                          uint64_t& h2)
+{
+  uint8_t key[16] = {0};
+  memcpy(key, &seed, sizeof(seed));
+
+  uint8_t out[16];
+  siphash((const uint8_t*)name, length, key, out, sizeof(out));
+
+  memcpy(&h1, out, sizeof(h1));
+  memcpy(&h2, out + sizeof(h1), sizeof(h2));
+  h2 |= 1;
+}
+
+bool StaticDnsIndex::place_names(const std::vector<std::string>& names,
+                                 uint64_t seed,
+                                 uint32_t num_buckets,
+                                 uint32_t num_slots,
+                                 std::vector<uint32_t>& displacements,
+                                 std::vector<uint32_t>& slot_names)
+{
+  std::vector<uint64_t> h1s(names.size());
+  std::vector<uint64_t> h2s(names.size());
+  std::vector<std::vector<uint32_t>> buckets(num_buckets);
+
+  for (uint32_t ii = 0; ii < names.size(); ++ii)
+  {
+    hash(names[ii].data(), names[ii].size(), seed, h1s[ii], h2s[ii]);
+    buckets[(uint32_t)(h2s[ii] >> 32) % num_buckets].push_back(ii);
+  }
+
+  std::vector<uint32_t> order(num_buckets);
+  for (uint32_t ii = 0; ii < num_buckets; ++ii)
+  {
+    order[ii] = ii;
+  }
+
+  std::stable_sort(order.begin(),
+                   order.end(),
+                   [&buckets](uint32_t a, uint32_t b)
+                   {
+                     return buckets[a].size() > buckets[b].size();
+                   });
+
+  displacements.assign(num_buckets, 0);
+  slot_names.assign(num_slots, EMPTY_SLOT);
+  std::vector<uint32_t> bucket_slots;
+
+  for (uint32_t bucket : order)
+  {
+    const std::vector<uint32_t>& bucket_names = buckets[bucket];
+
+    if (bucket_names.empty())
+    {
+      // The buckets are in size order, so the rest are empty too.
+      break;
+    }
+
+    bool found = false;
+
+    for (uint64_t d = 0; (d < num_slots) && (!found); ++d)
+    {
+      // Check that every name in the bucket lands in a different, empty slot
+      // with this displacement.
+      bucket_slots.clear();
+      found = true;
+
+      for (uint32_t name : bucket_names)
+      {
+        uint32_t slot = (h1s[name] + d * h2s[name]) & (num_slots - 1);
+
+        if ((slot_names[slot] != EMPTY_SLOT) ||
+            (std::find(bucket_slots.begin(), bucket_slots.end(), slot) != bucket_slots.end()))
+        {
+          found = false;
+          break;
+        }
+
+        bucket_slots.push_back(slot);
+      }
+
+      if (found)
+      {
+        displacements[bucket] = d;
+
+        for (size_t ii = 0; ii < bucket_names.size(); ++ii)
+        {
+          slot_names[bucket_slots[ii]] = bucket_names[ii];
+        }
+      }
+    }
+
+    if (!found)
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
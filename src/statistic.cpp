@@ -13,12 +13,157 @@
 #include "zmq_lvc.h"
 #include "log.h"
 
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
 #include <string>
 
+const size_t Statistic::MAX_VALUES;
+
+/// The thread that publishes every statistic's values.  Statistics with a
+/// value to publish are queued for it, each at most once however often it
+/// is reported, so a burst of reports of one statistic costs one publish.
+/// The thread runs while any statistics exist.
+///
+/// Statistics may be constructed during static initialisation, so this only
+/// has constant-initialised members.
+class StatisticReporter
+{
+public:
+  static void add_statistic()
+  {
+    pthread_mutex_lock(&_lock);
+
+    if (_queue == NULL)
+    {
+      _queue = new std::deque<Statistic*>();
+    }
+
+    // Wait for a thread that's stopping to exit before starting another.
+    while (_stopping)
+    {
+      pthread_cond_wait(&_published_cond, &_lock);
+    }
+
+    if (_statistics++ == 0)
+    {
+      _terminated = false;
+      int rc = pthread_create(&_thread, NULL, &reporter_thread, NULL);
+
+      if (rc != 0)
+      {
+        // LCOV_EXCL_START
+        TRC_ERROR("Error creating statistic reporter thread: %d", rc);
+        // LCOV_EXCL_STOP
+      }
+    }
+
+    pthread_mutex_unlock(&_lock);
+  }
+
+  // Publishes the statistic's pending value (if any), and stops the thread
+  // if this was the last statistic.
+  static void remove_statistic(Statistic* statistic)
+  {
+    pthread_mutex_lock(&_lock);
+
+    while ((_publishing == statistic) ||
+           (std::find(_queue->begin(), _queue->end(), statistic) != _queue->end()))
+    {
+      pthread_cond_wait(&_published_cond, &_lock);
+    }
+
+    bool stop = (--_statistics == 0);
+
+    if (stop)
+    {
+      _terminated = true;
+      _stopping = true;
+      pthread_cond_signal(&_queued_cond);
+    }
+
+    pthread_mutex_unlock(&_lock);
+
+    if (stop)
+    {
+      pthread_join(_thread, NULL);
+
+      pthread_mutex_lock(&_lock);
+      _stopping = false;
+      pthread_cond_broadcast(&_published_cond);
+      pthread_mutex_unlock(&_lock);
+    }
+  }
+
+  static void queue(Statistic* statistic)
+  {
+    pthread_mutex_lock(&_lock);
+    _queue->push_back(statistic);
+    pthread_cond_signal(&_queued_cond);
+    pthread_mutex_unlock(&_lock);
+  }
+
+private:
+  static void* reporter_thread(void* p)
+  {
+    TRC_DEBUG("Starting statistic reporter");
+    pthread_mutex_lock(&_lock);
+
+    while (true)
+    {
+      while ((_queue->empty()) && (!_terminated))
+      {
+        pthread_cond_wait(&_queued_cond, &_lock);
+      }
+
+      if (_queue->empty())
+      {
+        break;
+      }
+
+      _publishing = _queue->front();
+      _queue->pop_front();
+      pthread_mutex_unlock(&_lock);
+
+      _publishing->publish();
+
+      pthread_mutex_lock(&_lock);
+      _publishing = NULL;
+      pthread_cond_broadcast(&_published_cond);
+    }
+
+    pthread_mutex_unlock(&_lock);
+    return NULL;
+  }
+
+  static pthread_mutex_t _lock;
+  static pthread_cond_t _queued_cond;
+  static pthread_cond_t _published_cond;
+  static pthread_t _thread;
+  static int _statistics;
+  static bool _terminated;
+  static bool _stopping;
+  static std::deque<Statistic*>* _queue;
+  static Statistic* _publishing;
+};
+
+pthread_mutex_t StatisticReporter::_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t StatisticReporter::_queued_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t StatisticReporter::_published_cond = PTHREAD_COND_INITIALIZER;
+pthread_t StatisticReporter::_thread;
+int StatisticReporter::_statistics = 0;
+bool StatisticReporter::_terminated = false;
+bool StatisticReporter::_stopping = false;
+std::deque<Statistic*>* StatisticReporter::_queue = NULL;
+Statistic* StatisticReporter::_publishing = NULL;
+
 Statistic::Statistic(std::string statname, LastValueCache* lvc) :
   _statname(statname),
   _publisher(NULL),
-  _stat_q(MAX_Q_DEPTH)
+  _pending(false),
+  _numeric(false),
+  _num_values(0)
 {
   TRC_DEBUG("Creating %s statistic reporter", _statname.c_str());
 
@@ -28,84 +173,120 @@ Statistic::Statistic(std::string statname, LastValueCache* lvc) :
     _publisher = lvc->get_internal_publisher(statname);
   }
 
-  // Spawn a thread to handle the statistic reporting
-  int rc = pthread_create(&_reporter, NULL, &reporter_thread, (void*)this);
-
-  if (rc < 0)
-  {
-    // LCOV_EXCL_START
-    TRC_ERROR("Error creating statistic thread for %s", _statname.c_str());
-    // LCOV_EXCL_STOP
-  }
+  pthread_mutex_init(&_lock, NULL);
+  StatisticReporter::add_statistic();
 }
 
 
 Statistic::~Statistic()
 {
-  // Signal the reporting thread.
-  _stat_q.terminate();
-
-  // Wait for the reporting thread to exit.
-  pthread_join(_reporter, NULL);
+  StatisticReporter::remove_statistic(this);
+  pthread_mutex_destroy(&_lock);
 }
 
 
 /// Report the latest value of a statistic. Safe to be called by
-/// multiple threads, no lock required.
-void Statistic::report_change(std::vector<std::string> new_value)
+/// multiple threads.
+void Statistic::report_change(const std::vector<std::string>& new_value)
 {
-  if (!_stat_q.push_noblock(new_value))
+  pthread_mutex_lock(&_lock);
+  _strings = new_value;
+  _numeric = false;
+  bool queue = !_pending;
+  _pending = true;
+  pthread_mutex_unlock(&_lock);
+
+  if (queue)
+  {
+    StatisticReporter::queue(this);
+  }
+}
+
+
+void Statistic::report_change(const uint64_t* new_value, size_t count)
+{
+  if (count > MAX_VALUES)
   {
     // LCOV_EXCL_START
-    TRC_DEBUG("Statistic %s queue overflowed", _statname.c_str());
+    TRC_ERROR("Statistic %s has %d values - only the first %d are reported",
+              _statname.c_str(), count, MAX_VALUES);
+    count = MAX_VALUES;
     // LCOV_EXCL_STOP
   }
+
+  pthread_mutex_lock(&_lock);
+  memcpy(_values, new_value, count * sizeof(uint64_t));
+  _num_values = count;
+  _numeric = true;
+  bool queue = !_pending;
+  _pending = true;
+  pthread_mutex_unlock(&_lock);
+
+  if (queue)
+  {
+    StatisticReporter::queue(this);
+  }
 }
 
 
-void Statistic::reporter()
+void Statistic::publish()
 {
-  TRC_DEBUG("Initializing inproc://%s statistic reporter", _statname.c_str());
+  std::string status = "OK";
+  uint64_t values[MAX_VALUES];
+  size_t num_values = 0;
+
+  pthread_mutex_lock(&_lock);
+
+  if (!_pending)
+  {
+    // LCOV_EXCL_START
+    pthread_mutex_unlock(&_lock);
+    return;
+    // LCOV_EXCL_STOP
+  }
+
+  // Take the latest value, leaving the slot free for the next one.
+  bool numeric = _numeric;
+
+  if (numeric)
+  {
+    num_values = _num_values;
+    memcpy(values, _values, num_values * sizeof(uint64_t));
+  }
+  else
+  {
+    _published_strings.swap(_strings);
+    num_values = _published_strings.size();
+  }
 
-  std::vector<std::string> new_value;
+  _pending = false;
+  pthread_mutex_unlock(&_lock);
 
-  while (_stat_q.pop(new_value))
+  if (_publisher != NULL)
   {
-    if (_publisher != NULL)
+    TRC_DEBUG("Send new value for statistic %s, size %d",
+              _statname.c_str(),
+              num_values);
+
+    // Send the envelope and status line, then the body (if there is one),
+    // remembering to set SNDMORE on all but the last section.
+    zmq_send(_publisher, _statname.c_str(), _statname.length(), ZMQ_SNDMORE);
+    zmq_send(_publisher, status.c_str(), status.length(), (num_values > 0) ? ZMQ_SNDMORE : 0);
+
+    for (size_t ii = 0; ii < num_values; ++ii)
     {
-      TRC_DEBUG("Send new value for statistic %s, size %d",
-                _statname.c_str(),
-                new_value.size());
-      std::string status = "OK";
+      int flags = (ii + 1 < num_values) ? ZMQ_SNDMORE : 0;
 
-      // If there's no message, just send the envelope and status line.
-      if (new_value.empty())
+      if (numeric)
       {
-        zmq_send(_publisher, _statname.c_str(), _statname.length(), ZMQ_SNDMORE);
-        zmq_send(_publisher, status.c_str(), status.length(), 0);
+        char buf[24];
+        int len = snprintf(buf, sizeof(buf), "%llu", (unsigned long long)values[ii]);
+        zmq_send(_publisher, buf, len, flags);
       }
       else
       {
-        // Otherwise send the envelope, status line, and body, remembering to
-        // set SNDMORE on all but the last section.
-        zmq_send(_publisher, _statname.c_str(), _statname.length(), ZMQ_SNDMORE);
-        zmq_send(_publisher, status.c_str(), status.length(), ZMQ_SNDMORE);
-        std::vector<std::string>::iterator it;
-        for (it = new_value.begin(); it + 1 != new_value.end(); ++it)
-        {
-          zmq_send(_publisher, it->c_str(), it->length(), ZMQ_SNDMORE); //LCOV_EXCL_LINE
-        }
-        zmq_send(_publisher, it->c_str(), it->length(), 0);
+        zmq_send(_publisher, _published_strings[ii].c_str(), _published_strings[ii].length(), flags);
       }
     }
   }
 }
-
-
-void* Statistic::reporter_thread(void* p)
-{
-  ((Statistic*)p)->reporter();
-  return NULL;
-}
-
-
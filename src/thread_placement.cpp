@@ -0,0 +1,229 @@
+/**
+ * @file thread_placement.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+
+#include <fstream>
+#include <string>
+
+#include "thread_placement.h"
+#include "utils.h"
+#include "log.h"
+
+ThreadPlacementPolicy::ThreadPlacementPolicy() :
+  _mode(NONE),
+  _cores(),
+  _nodes(),
+  _stack_size(0)
+{
+}
+
+ThreadPlacementPolicy::ThreadPlacementPolicy(Mode mode,
+                                             const std::vector<int>& cores) :
+  _mode(mode),
+  _cores(cores),
+  _nodes(),
+  _stack_size(0)
+{
+  if ((_mode == NUMA_PARTITIONED) || (_mode == SPREAD))
+  {
+    _nodes = read_numa_nodes();
+  }
+}
+
+ThreadPlacementPolicy ThreadPlacementPolicy::no_placement()
+{
+  return ThreadPlacementPolicy();
+}
+
+ThreadPlacementPolicy ThreadPlacementPolicy::pin_to_cores(const std::vector<int>& cores)
+{
+  return ThreadPlacementPolicy(cores.empty() ? NONE : PIN_TO_CORES, cores);
+}
+
+ThreadPlacementPolicy ThreadPlacementPolicy::numa_partitioned()
+{
+  return ThreadPlacementPolicy(NUMA_PARTITIONED, std::vector<int>());
+}
+
+ThreadPlacementPolicy ThreadPlacementPolicy::spread()
+{
+  return ThreadPlacementPolicy(SPREAD, std::vector<int>());
+}
+
+void ThreadPlacementPolicy::set_stack_size(size_t stack_size)
+{
+  _stack_size = stack_size;
+}
+
+bool ThreadPlacementPolicy::set_attributes(pthread_attr_t* attr,
+                                           unsigned int index,
+                                           unsigned int num_threads) const
+{
+  bool success = true;
+
+  if (_stack_size != 0)
+  {
+    int rc = pthread_attr_setstacksize(attr, _stack_size);
+    if (rc != 0)
+    {
+      TRC_WARNING("Failed to set thread stack size to %zu: %d",
+                  _stack_size, rc);
+      success = false;
+    }
+  }
+
+  cpu_set_t cpus;
+  if (get_cpu_set(index, num_threads, &cpus))
+  {
+    int rc = pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus);
+    if (rc != 0)
+    {
+      TRC_WARNING("Failed to set affinity for thread %u: %d", index, rc);
+      success = false;
+    }
+  }
+
+  return success;
+}
+
+bool ThreadPlacementPolicy::apply_to_current_thread(unsigned int index,
+                                                    unsigned int num_threads) const
+{
+  bool success = true;
+
+  cpu_set_t cpus;
+  if (get_cpu_set(index, num_threads, &cpus))
+  {
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (rc != 0)
+    {
+      TRC_WARNING("Failed to set affinity for thread %u: %d", index, rc);
+      success = false;
+    }
+  }
+
+  return success;
+}
+
+bool ThreadPlacementPolicy::get_cpu_set(unsigned int index,
+                                        unsigned int num_threads,
+                                        cpu_set_t* cpus) const
+{
+  CPU_ZERO(cpus);
+
+  switch (_mode)
+  {
+    case PIN_TO_CORES:
+      CPU_SET(_cores[index % _cores.size()], cpus);
+      return true;
+
+    case NUMA_PARTITIONED:
+    {
+      if (_nodes.empty() || (num_threads == 0))
+      {
+        return false;
+      }
+
+      // Give each node a contiguous block of threads.
+      size_t node = ((size_t)(index % num_threads) * _nodes.size()) / num_threads;
+      for (int core : _nodes[node])
+      {
+        CPU_SET(core, cpus);
+      }
+      return true;
+    }
+
+    case SPREAD:
+    {
+      if (_nodes.empty())
+      {
+        return false;
+      }
+
+      // Take a core from each node in turn.
+      const std::vector<int>& cores = _nodes[index % _nodes.size()];
+      CPU_SET(cores[(index / _nodes.size()) % cores.size()], cpus);
+      return true;
+    }
+
+    case NONE:
+    default:
+      return false;
+  }
+}
+
+std::vector<std::vector<int>> ThreadPlacementPolicy::read_numa_nodes()
+{
+  std::vector<std::vector<int>> nodes;
+
+  for (int node = 0; ; ++node)
+  {
+    std::ifstream file("/sys/devices/system/node/node" +
+                       std::to_string(node) +
+                       "/cpulist");
+    if (!file.is_open())
+    {
+      break;
+    }
+
+    std::string list;
+    std::getline(file, list);
+    std::vector<int> cores = parse_cpu_list(list);
+
+    // Nodes with memory but no cores are no use for placing threads.
+    if (!cores.empty())
+    {
+      nodes.push_back(cores);
+    }
+  }
+
+  if (nodes.empty())
+  {
+    TRC_DEBUG("No NUMA topology available - treating all cores as one node");
+    std::vector<int> cores;
+    long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    for (long core = 0; core < num_cores; ++core)
+    {
+      cores.push_back((int)core);
+    }
+
+    if (!cores.empty())
+    {
+      nodes.push_back(cores);
+    }
+  }
+
+  return nodes;
+}
+
+std::vector<int> ThreadPlacementPolicy::parse_cpu_list(const std::string& list)
+{
+  std::vector<int> cores;
+  std::vector<std::string> ranges;
+  Utils::split_string(list, ',', ranges, 0, true);
+
+  for (const std::string& range : ranges)
+  {
+    size_t dash = range.find('-');
+    int first = atoi(range.substr(0, dash).c_str());
+    int last = (dash == std::string::npos) ?
+                 first : atoi(range.substr(dash + 1).c_str());
+
+    for (int core = first; (core <= last) && (core < CPU_SETSIZE); ++core)
+    {
+      cores.push_back(core);
+    }
+  }
+
+  return cores;
+}
@@ -10,6 +10,7 @@
  */
 
 #include "current_and_previous.h"
+#include "fast_clock.h"
 #include "timer_counter.h"
 #include "limits.h"
 
@@ -18,7 +19,7 @@ TimerCounter::TimerCounter():
   five_minute(300000)
 {
   timespec now;
-  clock_gettime(CLOCK_REALTIME_COARSE, &now);
+  FastClock::cached_realtime(now);
 
   write_statistics(five_second.get_current(now), 0);
   write_statistics(five_second.get_previous(now), 0);
@@ -31,26 +32,26 @@ TimerCounter::~TimerCounter() {}
 
 void TimerCounter::increment(uint32_t count)
 {
-  timespec now;
-  clock_gettime(CLOCK_REALTIME_COARSE, &now);
-
-  refresh_statistics(five_second.get_current(now), now, five_second.get_interval_ms());
-  write_statistics(five_second.get_current(now), count);
-
-  refresh_statistics(five_minute.get_current(now), now, five_minute.get_interval_ms());
-  write_statistics(five_minute.get_current(now), count);
+  apply_delta(count);
 }
 
 void TimerCounter::decrement(uint32_t count)
+{
+  apply_delta(-(int64_t)count);
+}
+
+void TimerCounter::apply_delta(int64_t delta)
 {
   timespec now;
-  clock_gettime(CLOCK_REALTIME_COARSE, &now);
+  FastClock::cached_realtime(now);
 
-  refresh_statistics(five_second.get_current(now), now, five_second.get_interval_ms());
-  write_statistics(five_second.get_current(now), -count);
+  SNMP::ContinuousStatistics* data = five_second.get_current(now);
+  refresh_statistics(data, now, five_second.get_interval_ms());
+  write_statistics(data, delta);
 
-  refresh_statistics(five_minute.get_current(now), now, five_minute.get_interval_ms());
-  write_statistics(five_minute.get_current(now), -count);
+  data = five_minute.get_current(now);
+  refresh_statistics(data, now, five_minute.get_interval_ms());
+  write_statistics(data, delta);
 }
 
 void TimerCounter::get_statistics(int index, timespec now, SNMP::SimpleStatistics* stats)
@@ -94,16 +95,26 @@ void TimerCounter::refresh_statistics(SNMP::ContinuousStatistics* data, timespec
   uint64_t time_period_end_ms = ((time_period_start_ms + interval_ms) / interval_ms) * interval_ms;
   uint64_t time_now_ms = (now.tv_sec * 1000) + (now.tv_nsec / 1000000);
   uint64_t time_comes_first_ms = std::min(time_period_end_ms, time_now_ms);
-  uint64_t time_since_last_update = time_comes_first_ms - data->time_last_update_ms.load();
+  uint64_t time_last_update_ms = data->time_last_update_ms.load();
+
+  // Only one thread accounts for each interval, and there's nothing to do
+  // if the time hasn't moved on since the last update (which is common when
+  // timers are added or popped in bursts).
+  if ((time_comes_first_ms <= time_last_update_ms) ||
+      (!data->time_last_update_ms.compare_exchange_strong(time_last_update_ms,
+                                                          time_comes_first_ms)))
+  {
+    return;
+  }
 
+  uint64_t time_since_last_update = time_comes_first_ms - time_last_update_ms;
   uint64_t current_value = data->current_value.load();
 
   data->sum += current_value * time_since_last_update;
   data->sqsum += current_value * current_value * time_since_last_update;
-  data->time_last_update_ms.store(time_comes_first_ms);
 }
 
-void TimerCounter::write_statistics(SNMP::ContinuousStatistics* data, int value_delta)
+void TimerCounter::write_statistics(SNMP::ContinuousStatistics* data, int64_t value_delta)
 {
   if (data == NULL)
   {
@@ -0,0 +1,268 @@
+/**
+ * @file timer_service.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <time.h>
+
+#include <algorithm>
+
+#include "log.h"
+#include "timer_service.h"
+
+const size_t TimerService::DEFAULT_MAX_BATCH;
+
+TimerService::TimerService(unsigned int num_shards,
+                           FunctorThreadPool* pool,
+                           PopCallback pop_callback,
+                           RemovedCallback removed_callback,
+                           size_t max_batch,
+                           const ThreadPlacementPolicy& placement) :
+  _shards(),
+  _pool(pool),
+  _pop_callback(pop_callback),
+  _removed_callback(removed_callback),
+  _max_batch(std::max(max_batch, (size_t)1)),
+  _terminated(false)
+{
+  num_shards = std::max(num_shards, 1u);
+
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+
+  for (unsigned int ii = 0; ii < num_shards; ++ii)
+  {
+    Shard* shard = new Shard();
+    shard->service = this;
+    shard->index = ii;
+    shard->size = 0;
+    pthread_mutex_init(&shard->lock, NULL);
+    pthread_cond_init(&shard->cond, &cond_attr);
+    _shards.push_back(shard);
+  }
+
+  pthread_condattr_destroy(&cond_attr);
+
+  for (Shard* shard : _shards)
+  {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+
+    if (!placement.set_attributes(&attr, shard->index, num_shards))
+    {
+      TRC_WARNING("Failed to place timer pop thread %u", shard->index);
+    }
+
+    int rc = pthread_create(&shard->thread, &attr, pop_thread_fn, shard);
+    pthread_attr_destroy(&attr);
+
+    if (rc != 0)
+    {
+      // Fall back to the default attributes, in case it was the placement
+      // that failed.
+      pthread_create(&shard->thread, NULL, pop_thread_fn, shard);
+    }
+  }
+
+  TRC_DEBUG("Created timer service with %u shards", num_shards);
+}
+
+TimerService::~TimerService()
+{
+  for (Shard* shard : _shards)
+  {
+    pthread_mutex_lock(&shard->lock);
+  }
+
+  _terminated = true;
+
+  for (Shard* shard : _shards)
+  {
+    pthread_cond_signal(&shard->cond);
+    pthread_mutex_unlock(&shard->lock);
+  }
+
+  for (Shard* shard : _shards)
+  {
+    pthread_join(shard->thread, NULL);
+    pthread_cond_destroy(&shard->cond);
+    pthread_mutex_destroy(&shard->lock);
+    delete shard;
+  }
+}
+
+void TimerService::insert(uint64_t id, HeapableTimer* timer)
+{
+  queue_command(id, INSERT, timer);
+}
+
+void TimerService::rebalance(uint64_t id, HeapableTimer* timer)
+{
+  queue_command(id, REBALANCE, timer);
+}
+
+void TimerService::remove(uint64_t id, HeapableTimer* timer)
+{
+  queue_command(id, REMOVE, timer);
+}
+
+size_t TimerService::size() const
+{
+  size_t size = 0;
+
+  for (Shard* shard : _shards)
+  {
+    pthread_mutex_lock(&shard->lock);
+    size += shard->size;
+    pthread_mutex_unlock(&shard->lock);
+  }
+
+  return size;
+}
+
+TimerService::Shard* TimerService::shard_for(uint64_t id) const
+{
+  // Mix the ID's bits, as IDs are often sequential or share low bits.
+  id ^= id >> 33;
+  id *= 0xff51afd7ed558ccdULL;
+  id ^= id >> 33;
+  return _shards[id % _shards.size()];
+}
+
+void TimerService::queue_command(uint64_t id, Operation operation, HeapableTimer* timer)
+{
+  Shard* shard = shard_for(id);
+  Command command = {operation, timer};
+
+  pthread_mutex_lock(&shard->lock);
+  shard->commands.push_back(command);
+
+  // The pop thread takes all the commands at once, so it only needs waking
+  // for the first.
+  if (shard->commands.size() == 1)
+  {
+    pthread_cond_signal(&shard->cond);
+  }
+
+  pthread_mutex_unlock(&shard->lock);
+}
+
+void* TimerService::pop_thread_fn(void* shard)
+{
+  ((Shard*)shard)->service->pop_thread_fn((Shard*)shard);
+  return NULL;
+}
+
+void TimerService::pop_thread_fn(Shard* shard)
+{
+  std::vector<Command> commands;
+
+  pthread_mutex_lock(&shard->lock);
+
+  while (!_terminated)
+  {
+    commands.swap(shard->commands);
+    pthread_mutex_unlock(&shard->lock);
+
+    apply_commands(shard, commands);
+    commands.clear();
+
+    uint64_t now = now_ms();
+    pop_timers(shard, now);
+
+    HeapableTimer* next = shard->heap.get_next_timer();
+
+    pthread_mutex_lock(&shard->lock);
+    shard->size = shard->heap.size();
+
+    if ((!_terminated) && (shard->commands.empty()))
+    {
+      if (next == nullptr)
+      {
+        pthread_cond_wait(&shard->cond, &shard->lock);
+      }
+      else
+      {
+        uint64_t pop_time = next->get_pop_time();
+        uint64_t wait_ms = (pop_time > now) ? pop_time - now : 0;
+
+        if (wait_ms > 0)
+        {
+          struct timespec wake;
+          clock_gettime(CLOCK_MONOTONIC, &wake);
+          wake.tv_sec += wait_ms / 1000;
+          wake.tv_nsec += (wait_ms % 1000) * 1000000;
+
+          if (wake.tv_nsec >= 1000000000)
+          {
+            wake.tv_sec++;
+            wake.tv_nsec -= 1000000000;
+          }
+
+          pthread_cond_timedwait(&shard->cond, &shard->lock, &wake);
+        }
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&shard->lock);
+}
+
+void TimerService::apply_commands(Shard* shard, std::vector<Command>& commands)
+{
+  for (const Command& command : commands)
+  {
+    switch (command.operation)
+    {
+    case INSERT:
+      shard->heap.insert(command.timer);
+      break;
+
+    case REBALANCE:
+      shard->heap.rebalance(command.timer);
+      break;
+
+    case REMOVE:
+      if ((shard->heap.remove(command.timer)) && (_removed_callback))
+      {
+        _removed_callback(command.timer);
+      }
+      break;
+    }
+  }
+}
+
+void TimerService::pop_timers(Shard* shard, uint64_t now_ms)
+{
+  HeapableTimer* timer = shard->heap.pop_next(now_ms);
+
+  while (timer != nullptr)
+  {
+    std::vector<HeapableTimer*> batch;
+
+    while ((timer != nullptr) && (batch.size() < _max_batch))
+    {
+      batch.push_back(timer);
+      timer = shard->heap.pop_next(now_ms);
+    }
+
+    TRC_DEBUG("%lu timers popped on shard %u", batch.size(), shard->index);
+
+    PopCallback callback = _pop_callback;
+    _pool->add_work([callback, batch]() mutable { callback(batch); });
+  }
+}
+
+uint64_t TimerService::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
@@ -0,0 +1,240 @@
+/**
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string.h>
+
+#include "timer_wheel.h"
+
+const int TimerWheel::SLOT_BITS;
+const int TimerWheel::NUM_SLOTS;
+const int TimerWheel::NUM_LEVELS;
+const int TimerWheel::OVERFLOW_LEVEL;
+
+TimerWheel::TimerWheel(uint64_t resolution) :
+  _resolution((resolution > 0) ? resolution : 1),
+  _current(0),
+  _size(0)
+{
+  memset(_slots, 0, sizeof(_slots));
+  memset(_occupied, 0, sizeof(_occupied));
+}
+
+void TimerWheel::insert(WheelableTimer* t)
+{
+  if (t->_wheel != this)
+  {
+    place(t);
+    t->_wheel = this;
+    ++_size;
+  }
+}
+
+bool TimerWheel::remove(WheelableTimer* t)
+{
+  if (t->_wheel == this)
+  {
+    unlink(t);
+    t->_wheel = nullptr;
+    --_size;
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+}
+
+void TimerWheel::rebalance(WheelableTimer* t)
+{
+  if (t->_wheel == this)
+  {
+    unlink(t);
+    place(t);
+  }
+}
+
+WheelableTimer* TimerWheel::get_next_timer()
+{
+  if (_size == 0)
+  {
+    return nullptr;
+  }
+
+  while (true)
+  {
+    // Timers on the bottom level are in the same range of 256 ticks as the
+    // current tick, so the first occupied slot from here holds the next one.
+    int slot = find_slot(0, _current & (NUM_SLOTS - 1));
+
+    if (slot >= 0)
+    {
+      // The timers in a slot aren't sorted, so find the earliest.
+      WheelableTimer* next = _slots[0][slot];
+
+      for (WheelableTimer* t = next->_wheel_next; t != nullptr; t = t->_wheel_next)
+      {
+        if (t->get_pop_time() < next->get_pop_time())
+        {
+          next = t;
+        }
+      }
+
+      return next;
+    }
+
+    // There's nothing more on the bottom level, so move on to the next
+    // occupied slot on the lowest level that has one, and spread its timers
+    // out over the levels below.
+    bool cascaded = false;
+
+    for (int level = 1; (level < NUM_LEVELS) && (!cascaded); ++level)
+    {
+      int shift = level * SLOT_BITS;
+      int from = ((_current >> shift) & (NUM_SLOTS - 1)) + 1;
+      slot = (from < NUM_SLOTS) ? find_slot(level, from) : -1;
+
+      if (slot >= 0)
+      {
+        _current = ((_current >> (shift + SLOT_BITS)) << (shift + SLOT_BITS)) |
+                   ((uint64_t)slot << shift);
+        cascade(level, slot);
+        cascaded = true;
+      }
+    }
+
+    if (!cascaded)
+    {
+      // The wheel is empty apart from the overflow list, so move on to its
+      // earliest timer.
+      uint64_t earliest = UINT64_MAX;
+
+      for (WheelableTimer* t = _slots[OVERFLOW_LEVEL][0];
+           t != nullptr;
+           t = t->_wheel_next)
+      {
+        uint64_t t_tick = tick(t);
+        earliest = (t_tick < earliest) ? t_tick : earliest;
+      }
+
+      _current = earliest;
+      cascade(OVERFLOW_LEVEL, 0);
+    }
+  }
+}
+
+WheelableTimer* TimerWheel::pop_next(uint64_t now)
+{
+  WheelableTimer* next = get_next_timer();
+
+  if ((next != nullptr) && (next->get_pop_time() <= now))
+  {
+    remove(next);
+    return next;
+  }
+
+  return nullptr;
+}
+
+void TimerWheel::place(WheelableTimer* t)
+{
+  uint64_t t_tick = tick(t);
+  t_tick = (t_tick > _current) ? t_tick : _current;
+
+  uint64_t diff = t_tick ^ _current;
+  int level = (diff == 0) ? 0 : ((63 - __builtin_clzll(diff)) / SLOT_BITS);
+  int slot = 0;
+
+  if (level >= NUM_LEVELS)
+  {
+    level = OVERFLOW_LEVEL;
+  }
+  else
+  {
+    slot = (t_tick >> (level * SLOT_BITS)) & (NUM_SLOTS - 1);
+    _occupied[level][slot / 64] |= (1ULL << (slot % 64));
+  }
+
+  WheelableTimer*& head = _slots[level][slot];
+  t->_wheel_level = level;
+  t->_wheel_slot = slot;
+  t->_wheel_prev = nullptr;
+  t->_wheel_next = head;
+
+  if (head != nullptr)
+  {
+    head->_wheel_prev = t;
+  }
+
+  head = t;
+}
+
+void TimerWheel::unlink(WheelableTimer* t)
+{
+  WheelableTimer*& head = _slots[t->_wheel_level][t->_wheel_slot];
+
+  if (t->_wheel_prev != nullptr)
+  {
+    t->_wheel_prev->_wheel_next = t->_wheel_next;
+  }
+  else
+  {
+    head = t->_wheel_next;
+  }
+
+  if (t->_wheel_next != nullptr)
+  {
+    t->_wheel_next->_wheel_prev = t->_wheel_prev;
+  }
+
+  if ((head == nullptr) && (t->_wheel_level != OVERFLOW_LEVEL))
+  {
+    _occupied[t->_wheel_level][t->_wheel_slot / 64] &= ~(1ULL << (t->_wheel_slot % 64));
+  }
+
+  t->_wheel_prev = nullptr;
+  t->_wheel_next = nullptr;
+}
+
+int TimerWheel::find_slot(int level, int from) const
+{
+  for (int word = from / 64; word < NUM_SLOTS / 64; ++word)
+  {
+    uint64_t bits = _occupied[level][word];
+
+    if (word == from / 64)
+    {
+      bits &= (~0ULL << (from % 64));
+    }
+
+    if (bits != 0)
+    {
+      return (word * 64) + __builtin_ctzll(bits);
+    }
+  }
+
+  return -1;
+}
+
+void TimerWheel::cascade(int level, int slot)
+{
+  WheelableTimer* t = _slots[level][slot];
+  _slots[level][slot] = nullptr;
+
+  if (level != OVERFLOW_LEVEL)
+  {
+    _occupied[level][slot / 64] &= ~(1ULL << (slot % 64));
+  }
+
+  while (t != nullptr)
+  {
+    WheelableTimer* next = t->_wheel_next;
+    place(t);
+    t = next;
+  }
+}
@@ -19,28 +19,57 @@
 #include <list>
 #include <queue>
 #include <string>
+#include <atomic>
 #include <arpa/inet.h>
 
 #include <stdio.h>
 #include <unistd.h>
+#include <sys/syscall.h>
 #include <sys/file.h>
 #include <signal.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <syslog.h>
 #include <boost/algorithm/string.hpp>
-#include <boost/regex.hpp>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "utils.h"
 #include "log.h"
 
+const size_t IP46Address::MAX_STRING_SIZE;
+const size_t AddrInfo::MAX_ADDRESS_AND_PORT_SIZE;
+
 bool Utils::parse_http_url(
     const std::string& url,
     std::string& scheme,
     std::string& server,
     std::string& path)
+{
+  boost::string_ref scheme_ref;
+  boost::string_ref server_ref;
+  boost::string_ref path_ref;
+
+  if (!parse_http_url(url, scheme_ref, server_ref, path_ref))
+  {
+    return false;
+  }
+
+  scheme.assign(scheme_ref.data(), scheme_ref.size());
+  server.assign(server_ref.data(), server_ref.size());
+  path.assign(path_ref.data(), path_ref.size());
+  return true;
+}
+
+bool Utils::parse_http_url(
+    boost::string_ref url,
+    boost::string_ref& scheme,
+    boost::string_ref& server,
+    boost::string_ref& path)
 {
   size_t colon_pos = url.find(':');
-  if (colon_pos == std::string::npos)
+  if (colon_pos == boost::string_ref::npos)
   {
     // No colon - no good!
     return false;
@@ -52,201 +81,393 @@ bool Utils::parse_http_url(
     // Not HTTP or HTTPS.
     return false;
   }
-  size_t slash_slash_pos = url.find("//", colon_pos + 1);
-  if (slash_slash_pos != colon_pos + 1)
+
+  boost::string_ref rest = url.substr(colon_pos + 1);
+  if (!rest.starts_with("//"))
   {
     // Not full URL.
     return false;
   }
-  size_t slash_pos = url.find('/', slash_slash_pos + 2);
-  if (slash_pos == std::string::npos)
+
+  rest.remove_prefix(2);
+  size_t slash_pos = rest.find('/');
+  if (slash_pos == boost::string_ref::npos)
   {
     // No path.
-    server = url.substr(slash_slash_pos + 2);
+    server = rest;
     path = "/";
   }
   else
   {
-    server = url.substr(slash_slash_pos + 2, slash_pos - (slash_slash_pos + 2));
-    path = url.substr(slash_pos);
+    server = rest.substr(0, slash_pos);
+    path = rest.substr(slash_pos);
   }
   return true;
 }
 
-#define REPLACE(CHAR1, CHAR2, RESULT) if ((s[(ii+1)] == CHAR1) && (s[(ii+2)] == CHAR2)) { r.append(RESULT); ii = ii+2; continue; }
+// The characters that url_unescape decodes.  The first set are reserved, so
+// must be percent-encoded per http://en.wikipedia.org/wiki/Percent-encoding#Percent-encoding_reserved_characters,
+// and the rest are commonly percent-encoded per http://en.wikipedia.org/wiki/Percent-encoding#Character_data
+static const char UNESCAPED_CHARS[] = "!#$&'()*+,/:;=?@[]"
+                                      " \"%-.<>\\^_`{|}~";
+
+// Returns the value of an (upper case) hex digit, or -1 if it isn't one.
+static inline int unescape_hex_digit(char c)
+{
+  if ((c >= '0') && (c <= '9'))
+  {
+    return c - '0';
+  }
+  else if ((c >= 'A') && (c <= 'F'))
+  {
+    return c - 'A' + 10;
+  }
+
+  return -1;
+}
 
 std::string Utils::url_unescape(const std::string& s)
 {
-  std::string r;
-  r.reserve(s.length());  // Reserve enough space to avoid continually reallocating.
-
-  for (size_t ii = 0; ii < s.length(); ++ii)
-  {
-    if (((ii + 2) < s.length()) && (s[ii] == '%'))
-    {
-      // The following characters are reserved, so must be percent-encoded per http://en.wikipedia.org/wiki/Percent-encoding#Percent-encoding_reserved_characters
-      REPLACE('2', '1', "!");
-      REPLACE('2', '3', "#");
-      REPLACE('2', '4', "$");
-      REPLACE('2', '6', "&");
-      REPLACE('2', '7', "'");
-      REPLACE('2', '8', "(");
-      REPLACE('2', '9', ")");
-      REPLACE('2', 'A', "*");
-      REPLACE('2', 'B', "+");
-      REPLACE('2', 'C', ",");
-      REPLACE('2', 'F', "/");
-      REPLACE('3', 'A', ":");
-      REPLACE('3', 'B', ";");
-      REPLACE('3', 'D', "=");
-      REPLACE('3', 'F', "?");
-      REPLACE('4', '0', "@");
-      REPLACE('5', 'B', "[");
-      REPLACE('5', 'D', "]");
-
-      // The following characters are commonly percent-encoded per http://en.wikipedia.org/wiki/Percent-encoding#Character_data
-      REPLACE('2', '0', " ");
-      REPLACE('2', '2', "\"");
-      REPLACE('2', '5', "%");
-      REPLACE('2', 'D', "-");
-      REPLACE('2', 'E', ".");
-      REPLACE('3', 'C', "<");
-      REPLACE('3', 'E', ">");
-      REPLACE('5', 'C', "\\");
-      REPLACE('5', 'E', "^");
-      REPLACE('5', 'F', "_");
-      REPLACE('6', '0', "`");
-      REPLACE('7', 'B', "{");
-      REPLACE('7', 'C', "|");
-      REPLACE('7', 'D', "}");
-      REPLACE('7', 'E', "~");
-
-    }
-    r.push_back(s[ii]);
+  if (memchr(s.data(), '%', s.length()) == NULL)
+  {
+    // Nothing to unescape.
+    return s;
   }
+
+  std::string r(s.length(), '\0');
+  r.resize(url_unescape(s, &r[0]));
   return r;
 }
 
-// The following function quotes strings in SIP headers as described by RFC 3261
-// Section 25.1
-std::string Utils::quote_string(const std::string& s)
+size_t Utils::url_unescape(boost::string_ref s, char* out)
 {
-  std::string r = "\"";
-  r.reserve((2*s.length()) + 2); // Reserve enough space to avoid continually reallocating.
+  const char* data = s.data();
+  size_t len = s.length();
+  char* r = out;
+  size_t ii = 0;
 
-  for (size_t ii = 0; ii < s.length(); ++ii)
+  while (ii < len)
   {
-    char unquot = s[ii];
-    switch (unquot)
+    // Copy everything up to the next '%' in one go.
+    const char* percent = (const char*)memchr(data + ii, '%', len - ii);
+    size_t run_end = (percent != NULL) ? (percent - data) : len;
+    memcpy(r, data + ii, run_end - ii);
+    r += run_end - ii;
+    ii = run_end;
+
+    if (ii == len)
     {
-      case '"':
-      case '\\':
-        r.push_back('\\');
-        break;
+      break;
+    }
 
-      default:
-        break;
+    if ((ii + 2) < len)
+    {
+      int high = unescape_hex_digit(data[ii + 1]);
+      int low = unescape_hex_digit(data[ii + 2]);
+
+      if ((high >= 0) && (low >= 0))
+      {
+        char c = (char)((high << 4) | low);
+
+        if ((c != '\0') &&
+            (memchr(UNESCAPED_CHARS, c, sizeof(UNESCAPED_CHARS) - 1) != NULL))
+        {
+          *r++ = c;
+          ii += 3;
+          continue;
+        }
+      }
     }
 
-    r.push_back(unquot);
+    *r++ = data[ii++];
   }
 
-  r.push_back('"');
+  return r - out;
+}
 
-  return r;
+// The escaping functions below share the same approach.  They scan for the
+// next character that needs escaping (16 bytes at a time where SSE2 is
+// available), copying the runs of characters between them in one go.  The
+// length of the output is worked out first, so that it's only allocated
+// once.
+//
+// Each escaper has:
+// -  match(c), which returns whether c needs escaping
+// -  match16(v), which returns a bitmask of the bytes in v that need escaping
+// -  length(c), the length of the escaped form of c
+// -  append(c, r), which appends the escaped form of c to r.
+
+#ifdef __SSE2__
+// Returns a mask of the bytes in v that are between lo and hi (inclusive).
+// The unsigned comparison (v - lo) <= (hi - lo) is done as a signed one by
+// flipping the top bits.
+static inline __m128i bytes_in_range(__m128i v, char lo, char hi)
+{
+  __m128i offset = _mm_xor_si128(_mm_sub_epi8(v, _mm_set1_epi8(lo)),
+                                 _mm_set1_epi8((char)0x80));
+  return _mm_cmplt_epi8(offset, _mm_set1_epi8((char)((hi - lo + 1) ^ 0x80)));
 }
 
-std::string Utils::url_escape(const std::string& s)
+static inline __m128i bytes_equal(__m128i v, char c)
 {
-  std::string r;
-  r.reserve(2*s.length());  // Reserve enough space to avoid continually reallocating.
-
-  for (size_t ii = 0; ii < s.length(); ++ii)
-  {
-    switch (s[ii])
-    {
-      // The following characters are reserved, so must be percent-encoded per http://en.wikipedia.org/wiki/Percent-encoding#Percent-encoding_reserved_characters
-      case 0x21: r.append("%21"); break; // !
-      case 0x23: r.append("%23"); break; // #
-      case 0x24: r.append("%24"); break; // $
-      case 0x25: r.append("%25"); break; // %
-      case 0x26: r.append("%26"); break; // &
-      case 0x27: r.append("%27"); break; // '
-      case 0x28: r.append("%28"); break; // (
-      case 0x29: r.append("%29"); break; // )
-      case 0x2a: r.append("%2A"); break; // *
-      case 0x2b: r.append("%2B"); break; // +
-      case 0x2c: r.append("%2C"); break; // ,
-      case 0x2f: r.append("%2F"); break; // forward slash
-      case 0x3a: r.append("%3A"); break; // :
-      case 0x3b: r.append("%3B"); break; // ;
-      case 0x3d: r.append("%3D"); break; // =
-      case 0x3f: r.append("%3F"); break; // ?
-      case 0x40: r.append("%40"); break; // @
-      case 0x5b: r.append("%5B"); break; // [
-      case 0x5d: r.append("%5D"); break; // ]
-
-      // We don't have to percent-encode these characters, but it's
-      // common to do so
-      case 0x20: r.append("%20"); break; // space
-      case 0x22: r.append("%22"); break; // "
-      case 0x3c: r.append("%3C"); break; // <
-      case 0x3e: r.append("%3E"); break; // >
-      case 0x5c: r.append("%5C"); break; // backslash
-      case 0x5e: r.append("%5E"); break; // ^
-      case 0x60: r.append("%60"); break; // `
-      case 0x7b: r.append("%7B"); break; // {
-      case 0x7c: r.append("%7C"); break; // |
-      case 0x7d: r.append("%7D"); break; // }
-      case 0x7e: r.append("%7E"); break; // ~
-
-      // Otherwise, append the literal character
-      default: r.push_back(s[ii]); break;
-    }
-  }
-  return r;
+  return _mm_cmpeq_epi8(v, _mm_set1_epi8(c));
 }
+#endif
+
+// Escapes characters in SIP quoted strings as described by RFC 3261 Section
+// 25.1.
+struct QuoteEscaper
+{
+  static inline bool match(char c)
+  {
+    return ((c == '"') || (c == '\\'));
+  }
+
+#ifdef __SSE2__
+  static inline int match16(__m128i v)
+  {
+    return _mm_movemask_epi8(_mm_or_si128(bytes_equal(v, '"'),
+                                          bytes_equal(v, '\\')));
+  }
+#endif
 
+  static inline size_t length(char)
+  {
+    return 2;
+  }
 
-std::string Utils::xml_escape(const std::string& s)
+  static inline void append(char c, std::string& r)
+  {
+    r.push_back('\\');
+    r.push_back(c);
+  }
+};
+
+// Percent-encodes the reserved characters, per http://en.wikipedia.org/wiki/Percent-encoding#Percent-encoding_reserved_characters,
+// and those that it's common to encode even though we don't have to, per
+// http://en.wikipedia.org/wiki/Percent-encoding#Character_data.  These are
+// all of:
+// -  space !"#$%&'()*+,  (0x20 to 0x2C)
+// -  /                   (0x2F)
+// -  :;<=>?@             (0x3A to 0x40)
+// -  [\]^                (0x5B to 0x5E)
+// -  `                   (0x60)
+// -  {|}~                (0x7B to 0x7E).
+struct UrlEscaper
 {
-  std::string r;
-  r.reserve(2*s.length());  // Reserve enough space to avoid continually reallocating.
+  static inline bool match(char c)
+  {
+    return (((c >= 0x20) && (c <= 0x2C)) ||
+            (c == 0x2F) ||
+            ((c >= 0x3A) && (c <= 0x40)) ||
+            ((c >= 0x5B) && (c <= 0x5E)) ||
+            (c == 0x60) ||
+            ((c >= 0x7B) && (c <= 0x7E)));
+  }
 
-  for (size_t ii = 0; ii < s.length(); ++ii)
+#ifdef __SSE2__
+  static inline int match16(__m128i v)
   {
-    switch (s[ii])
+    __m128i m = _mm_or_si128(bytes_in_range(v, 0x20, 0x2C),
+                             bytes_equal(v, 0x2F));
+    m = _mm_or_si128(m, bytes_in_range(v, 0x3A, 0x40));
+    m = _mm_or_si128(m, bytes_in_range(v, 0x5B, 0x5E));
+    m = _mm_or_si128(m, bytes_equal(v, 0x60));
+    m = _mm_or_si128(m, bytes_in_range(v, 0x7B, 0x7E));
+    return _mm_movemask_epi8(m);
+  }
+#endif
+
+  static inline size_t length(char)
+  {
+    return 3;
+  }
+
+  static inline void append(char c, std::string& r)
+  {
+    static const char HEX[] = "0123456789ABCDEF";
+    r.push_back('%');
+    r.push_back(HEX[(c >> 4) & 0xF]);
+    r.push_back(HEX[c & 0xF]);
+  }
+};
+
+struct XmlEscaper
+{
+  static inline bool match(char c)
+  {
+    return ((c == '&') ||
+            (c == '"') ||
+            (c == '\'') ||
+            (c == '<') ||
+            (c == '>'));
+  }
+
+#ifdef __SSE2__
+  static inline int match16(__m128i v)
+  {
+    __m128i m = _mm_or_si128(bytes_equal(v, '&'), bytes_equal(v, '"'));
+    m = _mm_or_si128(m, bytes_equal(v, '\''));
+    m = _mm_or_si128(m, bytes_equal(v, '<'));
+    m = _mm_or_si128(m, bytes_equal(v, '>'));
+    return _mm_movemask_epi8(m);
+  }
+#endif
+
+  static inline const char* escaped(char c)
+  {
+    switch (c)
     {
-      case '&':  r.append("&amp;"); break;
-      case '\"': r.append("&quot;"); break;
-      case '\'': r.append("&apos;"); break;
-      case '<':  r.append("&lt;"); break;
-      case '>':  r.append("&gt;"); break;
+      case '&':  return "&amp;";
+      case '"':  return "&quot;";
+      case '\'': return "&apos;";
+      case '<':  return "&lt;";
+      default:   return "&gt;";
+    }
+  }
+
+  static inline size_t length(char c)
+  {
+    return strlen(escaped(c));
+  }
 
-      // Otherwise, append the literal character
-      default: r.push_back(s[ii]); break;
+  static inline void append(char c, std::string& r)
+  {
+    r.append(escaped(c));
+  }
+};
+
+// Returns the position of the next character at or after pos that needs
+// escaping, or len if there isn't one.
+template <class Escaper>
+static inline size_t next_escape(const char* s, size_t len, size_t pos)
+{
+#ifdef __SSE2__
+  while (pos + 16 <= len)
+  {
+    int mask = Escaper::match16(_mm_loadu_si128((const __m128i*)(s + pos)));
+
+    if (mask != 0)
+    {
+      return pos + __builtin_ctz(mask);
     }
+
+    pos += 16;
   }
-  return r;
+#endif
+
+  while ((pos < len) && (!Escaper::match(s[pos])))
+  {
+    ++pos;
+  }
+
+  return pos;
 }
 
-std::string Utils::strip_uri_scheme(const std::string& uri)
+// Escapes a string, surrounding it with the (possibly empty) strings open
+// and close.
+template <class Escaper>
+static std::string escape(const std::string& s,
+                          const char* open,
+                          const char* close)
 {
-  std::string s(uri);
-  size_t colon = s.find(':');
+  const char* data = s.data();
+  size_t len = s.length();
+  size_t open_len = strlen(open);
+  size_t close_len = strlen(close);
+  size_t pos = next_escape<Escaper>(data, len, 0);
+
+  if ((pos == len) && (open_len == 0) && (close_len == 0))
+  {
+    // Nothing to escape.
+    return s;
+  }
 
-  if (colon != std::string::npos)
+  size_t escaped_len = open_len + len + close_len;
+
+  for (size_t ii = pos; ii < len; ii = next_escape<Escaper>(data, len, ii + 1))
   {
-    s.erase(0, colon + 1);
+    escaped_len += Escaper::length(data[ii]) - 1;
   }
 
-  return s;
+  std::string r;
+  r.reserve(escaped_len);
+  r.append(open, open_len);
+
+  size_t run_start = 0;
+
+  while (pos < len)
+  {
+    r.append(data + run_start, pos - run_start);
+    Escaper::append(data[pos], r);
+    run_start = pos + 1;
+    pos = next_escape<Escaper>(data, len, run_start);
+  }
+
+  r.append(data + run_start, len - run_start);
+  r.append(close, close_len);
+
+  return r;
+}
+
+// The following function quotes strings in SIP headers as described by RFC 3261
+// Section 25.1
+std::string Utils::quote_string(const std::string& s)
+{
+  return escape<QuoteEscaper>(s, "\"", "\"");
+}
+
+std::string Utils::url_escape(const std::string& s)
+{
+  return escape<UrlEscaper>(s, "", "");
+}
+
+std::string Utils::xml_escape(const std::string& s)
+{
+  return escape<XmlEscaper>(s, "", "");
+}
+
+std::string Utils::strip_uri_scheme(const std::string& uri)
+{
+  boost::string_ref stripped;
+  strip_uri_scheme(uri, stripped);
+  return std::string(stripped.data(), stripped.size());
+}
+
+void Utils::strip_uri_scheme(boost::string_ref uri, boost::string_ref& stripped)
+{
+  size_t colon = uri.find(':');
+  stripped = (colon != boost::string_ref::npos) ? uri.substr(colon + 1) : uri;
 }
 
 std::string Utils::remove_visual_separators(const std::string& number)
 {
-  static const boost::regex CHARS_TO_STRIP = boost::regex("[.)(-]");
-  return boost::regex_replace(number, CHARS_TO_STRIP, std::string(""));
+  std::string r(number.length(), '\0');
+  r.resize(remove_visual_separators(number, &r[0]));
+  return r;
+}
+
+size_t Utils::remove_visual_separators(boost::string_ref number, char* out)
+{
+  char* r = out;
+
+  for (size_t ii = 0; ii < number.length(); ++ii)
+  {
+    switch (number[ii])
+    {
+      case '.':
+      case ')':
+      case '(':
+      case '-':
+        break;
+
+      default:
+        *r++ = number[ii];
+        break;
+    }
+  }
+
+  return r - out;
 }
 
 bool Utils::is_user_numeric(const std::string& user)
@@ -319,18 +540,81 @@ std::string Utils::ip_addr_to_arpa(IP46Address ip_addr)
   return hostname;
 }
 
+namespace
+{
+  // Random bytes for create_random_token, read from the kernel in batches so
+  // that most tokens don't need a system call.
+  struct RandomTokenBytes
+  {
+    RandomTokenBytes() : used(sizeof(bytes)) {}
+
+    uint8_t bytes[512];
+    size_t used;
+
+    void refill()
+    {
+      ssize_t got = -1;
+#ifdef SYS_getrandom
+      // Don't block if the kernel's pool isn't initialized yet (only possible
+      // very early in boot).
+      got = syscall(SYS_getrandom, bytes, sizeof(bytes), 1 /* GRND_NONBLOCK */);
+#endif
+
+      if (got != (ssize_t)sizeof(bytes))
+      {
+        // LCOV_EXCL_START - getrandom is always available in UT
+        TRC_DEBUG("getrandom failed, using the thread's generator for tokens");
+
+        for (size_t ii = 0; ii < sizeof(bytes); ii += sizeof(uint64_t))
+        {
+          uint64_t r = Utils::ThreadRandom::next();
+          memcpy(bytes + ii, &r, sizeof(r));
+        }
+        // LCOV_EXCL_STOP
+      }
+
+      used = 0;
+    }
+  };
+
+  thread_local RandomTokenBytes random_token_bytes;
+}
+
 /// Generate a random token that only contains valid base64
 /// charaters (but doesn't necessarily produce a valid
 /// base 64 string as it doesn't check the length and
 /// do any padding.
+///
+/// Each character uses the bottom 6 bits of a random byte, so every character
+/// in the alphabet is equally likely.
 void Utils::create_random_token(size_t length,       //< Number of characters.
                                 std::string& token)  //< Destination. Must be empty.
 {
-  token.reserve(length);
+  size_t start = token.size();
+  token.resize(start + length);
+  char* out = &token[0] + start;
+  RandomTokenBytes& random = random_token_bytes;
 
-  for (size_t ii = 0; ii < length; ++ii)
+  while (length > 0)
   {
-    token += _b64[rand() % 64];
+    if (random.used == sizeof(random.bytes))
+    {
+      random.refill();
+    }
+
+    size_t chunk = std::min(length, sizeof(random.bytes) - random.used);
+    const uint8_t* in = random.bytes + random.used;
+
+    for (size_t ii = 0; ii < chunk; ++ii)
+    {
+      out[ii] = _b64[in[ii] & 0x3F];
+    }
+
+    // Don't leave the bytes used for this token lying around to be reused.
+    memset(random.bytes + random.used, 0, chunk);
+    random.used += chunk;
+    out += chunk;
+    length -= chunk;
   }
 }
 
@@ -384,54 +668,90 @@ void Utils::hashToHex(unsigned char *hash_char, unsigned char *hex_char)
 }
 // LCOV_EXCL_STOP
 
-bool Utils::StopWatch::_already_logged = false;
-
 bool Utils::split_host_port(const std::string& host_port,
                             std::string& host,
                             int& port)
+{
+  boost::string_ref host_ref;
+
+  if (!split_host_port(boost::string_ref(host_port), host_ref, port))
+  {
+    return false;
+  }
+
+  host.assign(host_ref.data(), host_ref.size());
+  return true;
+}
+
+bool Utils::split_host_port(boost::string_ref host_port,
+                            boost::string_ref& host,
+                            int& port)
 {
   // The address is specified as either <hostname>:<port>, <IPv4 address>:<port>
   // or [<IPv6 address>]:<port>.  Look for square brackets to determine whether
   // this is an IPv6 address.
-  std::vector<std::string> host_port_parts;
-  size_t close_bracket = host_port.find(']');
+  boost::string_ref host_port_parts[3];
+  int num_parts = 0;
 
-  if (close_bracket == host_port.npos)
+  if (host_port.find(']') == boost::string_ref::npos)
   {
     // IPv4 connection.  Split the string on the colon.
-    Utils::split_string(host_port, ':', host_port_parts, 0, false, false, true);
-    if (host_port_parts.size() != 2)
+    StringTokenizer tokenizer(host_port, ':', false, true);
+    while ((num_parts < 3) && (tokenizer.next(host_port_parts[num_parts])))
     {
-      TRC_DEBUG("Malformed host/port %s", host_port.c_str());
+      num_parts++;
+    }
+
+    if (num_parts != 2)
+    {
+      TRC_DEBUG("Malformed host/port %.*s", (int)host_port.size(), host_port.data());
       return false;
     }
   }
   else
   {
-    // IPv6 connection.  Split the string on ']', which removes any white
-    // space from the start and the end, then remove the '[' from the
-    // start of the IP address string and the start of the ':' from the start
-    // of the port string.
-    Utils::split_string(host_port, ']', host_port_parts);
-    if ((host_port_parts.size() != 2) ||
+    // IPv6 connection.  Split the string on ']', then remove the '[' from the
+    // start of the IP address string and the ':' from the start of the port
+    // string.
+    StringTokenizer tokenizer(host_port, ']');
+    while ((num_parts < 3) && (tokenizer.next(host_port_parts[num_parts])))
+    {
+      num_parts++;
+    }
+
+    if ((num_parts != 2) ||
         (host_port_parts[0][0] != '[') ||
         (host_port_parts[1][0] != ':'))
     {
-      TRC_DEBUG("Malformed host/port %s", host_port.c_str());
+      TRC_DEBUG("Malformed host/port %.*s", (int)host_port.size(), host_port.data());
       return false;
     }
 
-    host_port_parts[0].erase(host_port_parts[0].begin());
-    host_port_parts[1].erase(host_port_parts[1].begin());
+    host_port_parts[0].remove_prefix(1);
+    host_port_parts[1].remove_prefix(1);
+  }
+
+  // Check the port was parsed correctly, by checking it prints the same way.
+  // This can't be true of a port too long for the buffer.
+  char port_str[16];
+  char parsed_port_str[16];
+  boost::string_ref port_part = host_port_parts[1];
+
+  if (port_part.size() >= sizeof(port_str))
+  {
+    TRC_DEBUG("Malformed port %.*s", (int)port_part.size(), port_part.data());
+    return false;
   }
 
-  port = atoi(host_port_parts[1].c_str());
+  memcpy(port_str, port_part.data(), port_part.size());
+  port_str[port_part.size()] = '\0';
+  port = atoi(port_str);
   host = host_port_parts[0];
 
-  // Check the port was parsed correctly.
-  if (std::to_string(port) != host_port_parts[1])
+  snprintf(parsed_port_str, sizeof(parsed_port_str), "%d", port);
+  if (strcmp(parsed_port_str, port_str) != 0)
   {
-    TRC_DEBUG("Malformed port %s", host_port_parts[1].c_str());
+    TRC_DEBUG("Malformed port %s", port_str);
     return false;
   }
 
@@ -446,18 +766,41 @@ bool Utils::parse_ip_target(const std::string& target, IP46Address& address)
   TRC_DEBUG("Attempt to parse %s as IP address", target.c_str());
   bool rc = false;
 
-  // Strip start and end white-space, and any brackets if this is an IPv6
-  // address
-  std::string ip_target = Utils::remove_brackets_from_ip(target);
-  Utils::trim(ip_target);
+  // Strip any brackets if this is an IPv6 address, and start and end
+  // white-space.
+  boost::string_ref ip_target(target);
 
-  if (inet_pton(AF_INET6, ip_target.c_str(), &address.addr.ipv6) == 1)
+  if (is_bracketed_address(ip_target))
   {
-    // Parsed the address as a valid IPv6 address.
-    address.af = AF_INET6;
-    rc = true;
+    ip_target = ip_target.substr(1, ip_target.size() - 2);
+  }
+
+  ip_target = Utils::trim(ip_target);
+
+  // inet_pton needs a null-terminated string.  Anything too long for the
+  // buffer can't be an IP address.
+  char ip_str[INET6_ADDRSTRLEN + 1];
+
+  if (ip_target.size() >= sizeof(ip_str))
+  {
+    return false;
+  }
+
+  memcpy(ip_str, ip_target.data(), ip_target.size());
+  ip_str[ip_target.size()] = '\0';
+
+  // Only IPv6 addresses contain colons, so only try to parse the address as
+  // the type it could be.
+  if (ip_target.find(':') != boost::string_ref::npos)
+  {
+    if (inet_pton(AF_INET6, ip_str, &address.addr.ipv6) == 1)
+    {
+      // Parsed the address as a valid IPv6 address.
+      address.af = AF_INET6;
+      rc = true;
+    }
   }
-  else if (inet_pton(AF_INET, ip_target.c_str(), &address.addr.ipv4) == 1)
+  else if (inet_pton(AF_INET, ip_str, &address.addr.ipv4) == 1)
   {
     // Parsed the address as a valid IPv4 address.
     address.af = AF_INET;
@@ -762,7 +1105,7 @@ void Utils::daemon_log_setup(int argc,
   TRC_STATUS("Log level set to %d", log_level);
 }
 
-bool Utils::is_bracketed_address(const std::string& address)
+bool Utils::is_bracketed_address(boost::string_ref address)
 {
   return ((address.size() >= 2) &&
           (address[0] == '[') &&
@@ -776,40 +1119,61 @@ std::string Utils::remove_brackets_from_ip(std::string address)
                      address;
 }
 
-std::string Utils::uri_address(std::string address, int default_port)
+std::string Utils::uri_address(const std::string& address, int default_port)
 {
   Utils::IPAddressType addrtype = parse_ip_address(address);
+  bool bracket = (addrtype == IPAddressType::IPV6_ADDRESS);
+  std::string uri;
 
   if (default_port == 0)
   {
-    if (addrtype == IPAddressType::IPV6_ADDRESS)
+    if (!bracket)
     {
-      address = "[" + address + "]";
+      return address;
     }
+
+    uri.reserve(address.size() + 2);
+    uri.push_back('[');
+    uri.append(address);
+    uri.push_back(']');
   }
   else
   {
-    std::string port = std::to_string(default_port);
+    if ((!bracket) &&
+        (addrtype != IPAddressType::IPV4_ADDRESS) &&
+        (addrtype != IPAddressType::IPV6_ADDRESS_BRACKETED) &&
+        (addrtype != IPAddressType::INVALID))
+    {
+      // The address already has a port.
+      return address;
+    }
 
-    if (addrtype == IPAddressType::IPV4_ADDRESS ||
-        addrtype == IPAddressType::IPV6_ADDRESS_BRACKETED ||
-        addrtype == IPAddressType::INVALID)
+    char port[16];
+    int port_len = snprintf(port, sizeof(port), ":%d", default_port);
+
+    uri.reserve(address.size() + 2 + port_len);
+
+    if (bracket)
     {
-      address = address + ":" + port;
+      uri.push_back('[');
+      uri.append(address);
+      uri.push_back(']');
     }
-    else if (addrtype == IPAddressType::IPV6_ADDRESS)
+    else
     {
-      address = "[" + address + "]:" + port;
+      uri.append(address);
     }
+
+    uri.append(port, port_len);
   }
 
-  return address;
+  return uri;
 }
 
-Utils::IPAddressType Utils::parse_ip_address(std::string address)
+Utils::IPAddressType Utils::parse_ip_address(boost::string_ref address)
 {
   // Check if we have a port
-  std::string host;
+  boost::string_ref host;
   int port;
   bool with_port = Utils::split_host_port(address, host, port);
 
@@ -819,18 +1183,32 @@ Utils::IPAddressType Utils::parse_ip_address(std::string address)
   // Check if we're surrounded by []
   bool with_brackets = is_bracketed_address(host);
 
-  host = with_brackets ? host.substr(1, host.size() - 2) : host;
+  if (with_brackets)
+  {
+    host = host.substr(1, host.size() - 2);
+  }
+
+  // inet_pton needs a null-terminated string.  Anything too long for the
+  // buffer can't be an IP address.
+  char host_str[INET6_ADDRSTRLEN + 1];
+  bool fits = (host.size() < sizeof(host_str));
+
+  if (fits)
+  {
+    memcpy(host_str, host.data(), host.size());
+    host_str[host.size()] = '\0';
+  }
 
   // Check if we're IPv4/IPv6/invalid
   struct in_addr dummy_ipv4_addr;
   struct in6_addr dummy_ipv6_addr;
 
-  if (inet_pton(AF_INET, host.c_str(), &dummy_ipv4_addr) == 1)
+  if ((fits) && (inet_pton(AF_INET, host_str, &dummy_ipv4_addr) == 1))
   {
     return (with_port) ? IPAddressType::IPV4_ADDRESS_WITH_PORT :
                          IPAddressType::IPV4_ADDRESS;
   }
-  else if (inet_pton(AF_INET6, host.c_str(), &dummy_ipv6_addr) == 1)
+  else if ((fits) && (inet_pton(AF_INET6, host_str, &dummy_ipv6_addr) == 1))
   {
     return (with_port) ? IPAddressType::IPV6_ADDRESS_WITH_PORT :
                          ((with_brackets) ? IPAddressType::IPV6_ADDRESS_BRACKETED :
@@ -931,3 +1309,79 @@ void Utils::IOMonitor::set_thread_allows_covert_io(bool allowed)
 
 thread_local int Utils::IOMonitor::_overt_io_depth = 0;
 thread_local bool Utils::IOMonitor::_covert_io_allowed = true;
+
+uint64_t Utils::ThreadRandom::next()
+{
+  uint64_t* s = _state;
+
+  if (!_seeded)
+  {
+    seed(s);
+    _seeded = true;
+  }
+
+  uint64_t r = s[1] * 5;
+  r = ((r << 7) | (r >> 57)) * 9;
+  uint64_t t = s[1] << 17;
+
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = (s[3] << 45) | (s[3] >> 19);
+
+  return r;
+}
+
+void Utils::ThreadRandom::seed(uint64_t* state)
+{
+  // Seed from /dev/urandom, so that generators in different processes (and on
+  // different hosts) don't produce the same numbers.  This is only done once
+  // per thread, so the cost of opening the file doesn't matter.
+  uint64_t entropy[4] = {0, 0, 0, 0};
+  FILE* urandom = fopen("/dev/urandom", "rb");
+
+  if (urandom != NULL)
+  {
+    if (fread(entropy, sizeof(entropy), 1, urandom) != 1)
+    {
+      TRC_WARNING("Failed to read from /dev/urandom"); // LCOV_EXCL_LINE
+    }
+
+    fclose(urandom);
+  }
+  else
+  {
+    TRC_WARNING("Failed to open /dev/urandom: %s", strerror(errno)); // LCOV_EXCL_LINE
+  }
+
+  // Mix that with the time, the process, the thread and a count of the
+  // generators seeded so far using splitmix64, which is the recommended way
+  // of seeding xoshiro.  This still gives each thread a different sequence if
+  // /dev/urandom isn't available.
+  static std::atomic<uint64_t> generators(0);
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  uint64_t x = ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec) ^
+               ((uint64_t)pthread_self() << 1) ^
+               ((uint64_t)getpid() << 32) ^
+               (generators++ * 0x9e3779b97f4a7c15);
+
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    uint64_t z = (x += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    state[ii] = (z ^ (z >> 31)) ^ entropy[ii];
+  }
+
+  if ((state[0] | state[1] | state[2] | state[3]) == 0)
+  {
+    // The all-zero state only ever produces zeros.
+    state[0] = 1; // LCOV_EXCL_LINE
+  }
+}
+
+thread_local uint64_t Utils::ThreadRandom::_state[4];
+thread_local bool Utils::ThreadRandom::_seeded = false;
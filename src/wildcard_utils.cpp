@@ -9,13 +9,62 @@
  * Metaswitch Networks in a separate written agreement.
  */
 
-#include <vector>
+#include <algorithm>
 #include <boost/regex.hpp>
 #include "wildcard_utils.h"
+#include "sharded_lru_cache.h"
 #include "utils.h"
 #include "log.h"
 
-bool WildcardUtils::is_wildcard_uri(const std::string& possible_wildcard)
+namespace
+{
+  // The memory the cache of compiled wildcards may use, and how long entries
+  // are kept for.  Wildcards never change, so the TTL just stops unused ones
+  // staying in the cache indefinitely.
+  const size_t WILDCARD_CACHE_BYTES = 1024 * 1024;
+  const int WILDCARD_CACHE_TTL_S = 3600;
+
+  // Roughly how much memory a compiled regex uses.
+  const size_t REGEX_SIZE = 1024;
+
+  typedef ShardedLruCache<std::string, WildcardUtils::CompiledWildcard> WildcardCache;
+
+  WildcardCache& wildcard_cache()
+  {
+    static WildcardCache cache(WILDCARD_CACHE_BYTES,
+                               [](const std::string& key,
+                                  const WildcardUtils::CompiledWildcard& wildcard)
+                               {
+                                 return key.size() + wildcard.size();
+                               });
+    return cache;
+  }
+
+  // Returns the first non-empty part of a string split on a delimiter (which
+  // is what the first token of Utils::split_string is), or an empty string if
+  // there isn't one.
+  boost::string_ref first_part(boost::string_ref str, char delimiter)
+  {
+    Utils::StringTokenizer tokenizer(str, delimiter);
+    boost::string_ref part;
+
+    if (!tokenizer.next(part))
+    {
+      part.clear();
+    }
+
+    return part;
+  }
+
+  // Returns whether a regex has any special characters, or only matches
+  // itself.
+  bool is_literal_regex(boost::string_ref regex)
+  {
+    return (regex.find_first_of(".[]{}()\\*+?|^$") == boost::string_ref::npos);
+  }
+}
+
+bool WildcardUtils::is_wildcard_uri(boost::string_ref possible_wildcard)
 {
   // This function counts how many !s there are in the URI string
   // before the @ - note, this only checks whether the URI string
@@ -26,15 +75,12 @@ bool WildcardUtils::is_wildcard_uri(const std::string& possible_wildcard)
   // using PJSIP, as we don't know if this actually corresponds to a
   // valid URI, and adding more validation to the URI would be too
   // heavyweight.
-  std::vector<std::string> wildcard_parts;
-  Utils::split_string(possible_wildcard, '@', wildcard_parts, 0, false);
-  return (std::count(wildcard_parts[0].begin(),
-                     wildcard_parts[0].end(),
-                     '!') >= 2);
+  boost::string_ref user = first_part(possible_wildcard, '@');
+  return (std::count(user.begin(), user.end(), '!') >= 2);
 }
 
-bool WildcardUtils::check_users_equivalent(const std::string& wildcard_user,
-                                           const std::string& specific_user)
+bool WildcardUtils::check_users_equivalent(boost::string_ref wildcard_user,
+                                           boost::string_ref specific_user)
 {
   if (wildcard_user == specific_user)
   {
@@ -42,7 +88,7 @@ bool WildcardUtils::check_users_equivalent(const std::string& wildcard_user,
     // wildcards.
     return true;
   }
-  else if ((wildcard_user == "") || (specific_user == ""))
+  else if ((wildcard_user.empty()) || (specific_user.empty()))
   {
     // Check if either string is empty (where we've caught the case where
     // they're both empty at the start) as this definitely won't match, and
@@ -53,74 +99,137 @@ bool WildcardUtils::check_users_equivalent(const std::string& wildcard_user,
   // We don't match on any parameters in the URI, so strip them out before
   // doing anymore processing. Then check again if the identities are the same
   // now that we don't have any parameters.
-  std::vector<std::string> wildcard_user_parts;
-  std::vector<std::string> specific_user_parts;
-  Utils::split_string(wildcard_user, ';', wildcard_user_parts, 0, false);
-  Utils::split_string(specific_user, ';', specific_user_parts, 0, false);
+  boost::string_ref wildcard = first_part(wildcard_user, ';');
+  boost::string_ref specific = first_part(specific_user, ';');
 
-  if (wildcard_user_parts[0] == specific_user_parts[0])
+  if (wildcard == specific)
   {
     return true;
   }
 
-  // Only chance to match now is if the wildcard_user is a wildcard. The wildcard
-  // has the format:
+  // Only chance to match now is if the wildcard_user is a wildcard, which
+  // needs two !s.  Check that before going to the cache, so that it only
+  // holds wildcards.
+  size_t wildcard_start = wildcard.find('!');
+
+  if ((wildcard_start == boost::string_ref::npos) ||
+      (wildcard.rfind('!') == wildcard_start))
+  {
+    // The wildcard_user isn't a wildcard
+    return false;
+  }
+
+  return compile(wildcard)->matches(specific);
+}
+
+std::shared_ptr<const WildcardUtils::CompiledWildcard>
+  WildcardUtils::compile(boost::string_ref wildcard_user)
+{
+  std::string key(wildcard_user.data(), wildcard_user.size());
+  WildcardCache& cache = wildcard_cache();
+  std::shared_ptr<const CompiledWildcard> wildcard = cache.get(key);
+
+  if (!wildcard)
+  {
+    wildcard = std::make_shared<const CompiledWildcard>(wildcard_user);
+    cache.put(key, wildcard, WILDCARD_CACHE_TTL_S);
+  }
+
+  return wildcard;
+}
+
+WildcardUtils::CompiledWildcard::CompiledWildcard(boost::string_ref wildcard_user) :
+  _prefix(),
+  _suffix(),
+  _middle(),
+  _type(NOT_WILDCARD),
+  _regex()
+{
+  // The wildcard has the format:
   //
   //    <non wildcard part>!<regex>!<non wildcard part>
   //
   // Either of the wildcard parts or the regex can be empty.
-  // We have to split out the three parts of the wildcard, then check the first
-  // part directly matches the start of the specific_user string, the end part
-  // directly matches the end of the specific_user string, and the regex matches
-  // against whatever's left of the specific_user string.
-  std::size_t wildcard_start = wildcard_user_parts[0].find_first_of("!");
-  std::size_t wildcard_end = wildcard_user_parts[0].find_last_of("!");
-
-  if ((wildcard_start == std::string::npos) ||
-      (wildcard_end == std::string::npos) ||
+  size_t wildcard_start = wildcard_user.find('!');
+  size_t wildcard_end = wildcard_user.rfind('!');
+
+  if ((wildcard_start == boost::string_ref::npos) ||
       (wildcard_start == wildcard_end))
   {
-    // The wildcard_user isn't a wildcard
-    return false;
+    // The wildcard_user isn't a wildcard, so only matches itself.
+    _prefix.assign(wildcard_user.data(), wildcard_user.size());
+    return;
   }
 
-  // Check the start and end parts
-  std::string wildcard_start_str = wildcard_user_parts[0].substr(0, wildcard_start);
-  std::string wildcard_end_str = wildcard_user_parts[0].substr(wildcard_end + 1);
-  std::string specific_start_str = specific_user_parts[0].substr(0, wildcard_start);
-  std::string specific_end_str = specific_user_parts[0].substr(specific_start_str.size());
-  specific_end_str = (specific_end_str.size() >= wildcard_end_str.size()) ?
-   specific_end_str.substr(specific_end_str.size() - wildcard_end_str.size()) :
-   specific_end_str;
+  boost::string_ref prefix = wildcard_user.substr(0, wildcard_start);
+  boost::string_ref suffix = wildcard_user.substr(wildcard_end + 1);
+  boost::string_ref middle = wildcard_user.substr(wildcard_start + 1,
+                                                  wildcard_end - wildcard_start - 1);
+  _prefix.assign(prefix.data(), prefix.size());
+  _suffix.assign(suffix.data(), suffix.size());
+  _middle.assign(middle.data(), middle.size());
 
-  if ((specific_start_str != wildcard_start_str) ||
-      (specific_end_str != wildcard_end_str))
+  if (_middle == ".*")
   {
-    // Either the start or end of the wildcard didn't directly match the
-    // specific_user string
-    return false;
+    _type = ANY;
+  }
+  else if (is_literal_regex(_middle))
+  {
+    _type = LITERAL;
   }
+  else
+  {
+    _regex = boost::regex(_middle, boost::regex_constants::no_except);
+    _type = (_regex.status() == 0) ? REGEX : INVALID_REGEX;
+  }
+}
 
-  // Finally, check against the regex.
-  std::string wildcard_part = wildcard_user_parts[0].substr(wildcard_start + 1,
-                                                            (wildcard_end -
-                                                             wildcard_start -
-                                                             1));
-  std::string specific_part = specific_user_parts[0].substr(
-                                                specific_start_str.size(),
-                                                (specific_user_parts[0].size() -
-                                                 specific_end_str.size() -
-                                                 specific_start_str.size()));
-  boost::regex wildcard_regex = boost::regex(wildcard_part,
-                                             boost::regex_constants::no_except);
+bool WildcardUtils::CompiledWildcard::matches(boost::string_ref specific_user) const
+{
+  if (_type == NOT_WILDCARD)
+  {
+    return (specific_user == _prefix);
+  }
 
-  if ((!wildcard_regex.status()) &&
-      (boost::regex_match(specific_part, wildcard_regex)))
+  // Check the start of the wildcard directly matches the start of the
+  // specific user, and the end of the wildcard directly matches the end of
+  // whatever's left.
+  if (!specific_user.starts_with(_prefix))
   {
-    return true;
+    return false;
   }
-  else
+
+  boost::string_ref rest = specific_user.substr(_prefix.size());
+
+  if (!rest.ends_with(_suffix))
   {
     return false;
   }
+
+  // Finally, check what's left against the regex.
+  boost::string_ref specific_part = rest.substr(0, rest.size() - _suffix.size());
+
+  switch (_type)
+  {
+    case ANY:
+      return true;
+
+    case LITERAL:
+      return (specific_part == _middle);
+
+    case REGEX:
+      return boost::regex_match(specific_part.begin(), specific_part.end(), _regex);
+
+    default:
+      return false;
+  }
+}
+
+size_t WildcardUtils::CompiledWildcard::size() const
+{
+  return (sizeof(*this) +
+          _prefix.size() +
+          _suffix.size() +
+          _middle.size() +
+          ((_type == REGEX) ? REGEX_SIZE : 0));
 }
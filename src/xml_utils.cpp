@@ -14,22 +14,47 @@
 #include "xml_utils.h"
 #include "log.h"
 
+namespace
+{
+  // Gets the first child node of "node" with name "name", without needing a
+  // null-terminated name.  rapidxml treats a zero length as meaning the name
+  // is null-terminated, so an empty name is passed as "".
+  xml_node<>* first_child(xml_node<>* node, boost::string_ref name)
+  {
+    return node->first_node(name.empty() ? "" : name.data(), name.size());
+  }
+
+  // The calling thread's document for PooledDocuments, and whether one is
+  // using it.
+  thread_local std::unique_ptr<xml_document<>> thread_doc;
+  thread_local bool thread_doc_in_use = false;
+}
+
 namespace XMLUtils
 {
 
 // Gets the first child node of "node" with name "name". Returns an empty string
 // if there is no such node, otherwise returns its value (which is the empty
 // string if it has no value).
-std::string get_first_node_value(xml_node<>* node, std::string name)
+std::string get_first_node_value(xml_node<>* node, boost::string_ref name)
 {
-  xml_node<>* first_node = node->first_node(name.c_str());
+  boost::string_ref value;
+  get_first_node_value(node, name, value);
+  return std::string(value.data(), value.size());
+}
+
+void get_first_node_value(xml_node<>* node,
+                          boost::string_ref name,
+                          boost::string_ref& value)
+{
+  xml_node<>* first_node = first_child(node, name);
   if (!first_node)
   {
-    return "";
+    value.clear();
   }
   else
   {
-    return get_text_or_cdata(first_node);
+    get_text_or_cdata(first_node, value);
   }
 }
 
@@ -40,32 +65,73 @@ std::string get_first_node_value(xml_node<>* node, std::string name)
 // of the first data node, not the first CDATA node.
 // The CDATA interactions aren't tested in the UTs.
 std::string get_text_or_cdata(xml_node<>* node)
+{
+  boost::string_ref value;
+  get_text_or_cdata(node, value);
+  return std::string(value.data(), value.size());
+}
+
+void get_text_or_cdata(xml_node<>* node, boost::string_ref& value)
 {
   xml_node<>* first_data_node = node->first_node();
   if ((first_data_node) &&
       ((first_data_node->type() != node_cdata) ||
        (first_data_node->type() != node_data))) // LCOV_EXCL_LINE
   {
-    return first_data_node->value();
+    value = boost::string_ref(first_data_node->value(),
+                              first_data_node->value_size());
   }
   // LCOV_EXCL_START
   else
   {
-    return "";
+    value.clear();
   }
   // LCOV_EXCL_STOP
 }
 
-bool does_child_node_exist(xml_node<>* parent_node, std::string child_node_name)
+bool does_child_node_exist(xml_node<>* parent_node, boost::string_ref child_node_name)
 {
-  xml_node<>* child_node = parent_node->first_node(child_node_name.c_str());
+  xml_node<>* child_node = first_child(parent_node, child_node_name);
   return (child_node != NULL);
 }
 
+PooledDocument::PooledDocument() :
+  _own(),
+  _doc(NULL)
+{
+  if (!thread_doc_in_use)
+  {
+    if (!thread_doc)
+    {
+      thread_doc.reset(new xml_document<>());
+    }
+
+    thread_doc_in_use = true;
+    _doc = thread_doc.get();
+  }
+  else
+  {
+    _own.reset(new xml_document<>());
+    _doc = _own.get();
+  }
+}
+
+PooledDocument::~PooledDocument()
+{
+  // Remove the nodes and free any memory the pool allocated beyond its
+  // built-in memory, ready for the next parse.
+  _doc->clear();
+
+  if (_doc == thread_doc.get())
+  {
+    thread_doc_in_use = false;
+  }
+}
+
 // Attempt to parse the content of the node as a bounded integer
 // returning the result or throwing.
 long parse_integer(xml_node<>* node,
-                   std::string description,
+                   const std::string& description,
                    long min_value,
                    long max_value)
 {
@@ -92,7 +158,7 @@ long parse_integer(xml_node<>* node,
 }
 
 /// Parse an xs:boolean value.
-bool parse_bool(xml_node<>* node, std::string description)
+bool parse_bool(xml_node<>* node, const std::string& description)
 {
   if (!node)
   {
@@ -18,6 +18,7 @@
 #include <assert.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <arpa/inet.h>
 
 /*
  * LastValueCache
@@ -29,6 +30,8 @@
  *
  * This proxy also caches the last known value for a statistic and re-publishes it when a
  * subscriber registers interest.  This allows a client to poll the last known value easily.
+ * A subscriber can also fetch every cached value at once by subscribing to
+ * ZMQ_DUMP_ALL_TOPIC.
  */
 LastValueCache::LastValueCache(int statcount,
                                const std::string *statnames,
@@ -145,25 +148,43 @@ void LastValueCache::run()
       if (items[ii].revents & ZMQ_POLLIN)
       {
         TRC_DEBUG("Update to %s statistic", _statnames[ii].c_str());
-        clear_cache(_subscriber[ii]);
+
+        // Copy the new value over the cached one, reusing the cached
+        // messages - a statistic's values usually have the same number of
+        // parts each time, so this doesn't need to allocate.
+        std::vector<zmq_msg_t *>& cached_messages = _cache[_subscriber[ii]];
+        size_t parts = 0;
+
         while (1)
         {
           zmq_msg_t message;
-          zmq_msg_t *cached_message = (zmq_msg_t *)malloc(sizeof(zmq_msg_t));
           int more;
           size_t more_size = sizeof (more);
 
+          if (parts == cached_messages.size())
+          {
+            zmq_msg_t *cached_message = (zmq_msg_t *)malloc(sizeof(zmq_msg_t));
+            zmq_msg_init(cached_message);
+            cached_messages.push_back(cached_message);
+          }
+
           zmq_msg_init(&message);
-          zmq_msg_init(cached_message);
           zmq_msg_recv(&message, _subscriber[ii], 0);
-          zmq_msg_copy(cached_message, &message);
-          _cache[_subscriber[ii]].push_back(cached_message);
+          zmq_msg_copy(cached_messages[parts++], &message);
           zmq_getsockopt(_subscriber[ii], ZMQ_RCVMORE, &more, &more_size);
           zmq_msg_send(&message, _publisher, more ? ZMQ_SNDMORE : 0);
           zmq_msg_close(&message);
           if (!more)
             break;      //  Last message frame
         }
+
+        // Drop any parts left over from a longer previous value.
+        while (cached_messages.size() > parts)
+        {
+          zmq_msg_close(cached_messages.back());
+          free(cached_messages.back());
+          cached_messages.pop_back();
+        }
       }
     }
 
@@ -181,6 +202,12 @@ void LastValueCache::run()
         TRC_DEBUG("New subscription for %s", topic.c_str());
         bool recognized = false;
 
+        if (topic == ZMQ_DUMP_ALL_TOPIC)
+        {
+          recognized = true;
+          dump_cache();
+        }
+
         for (int ii = 0; ii < _statcount; ii++)
         {
           if (topic == _statnames[ii])
@@ -271,6 +298,56 @@ void LastValueCache::replay_cache(void *entry)
   }
 }
 
+// Appends a part of a statistic to a dump, in the encoding described with
+// ZMQ_DUMP_ALL_TOPIC.
+static void append_part(std::string& dump, const char* data, size_t length)
+{
+  uint32_t length_n = htonl(length);
+  dump.append((const char*)&length_n, sizeof(length_n));
+  dump.append(data, length);
+}
+
+static void append_count(std::string& dump, size_t count)
+{
+  uint16_t count_n = htons(count);
+  dump.append((const char*)&count_n, sizeof(count_n));
+}
+
+void LastValueCache::dump_cache()
+{
+  TRC_DEBUG("Dumping cache of %d statistics", _statcount);
+  std::string dump;
+
+  for (int ii = 0; ii < _statcount; ii++)
+  {
+    std::map<void *, std::vector<zmq_msg_t *>>::iterator entry =
+                                                   _cache.find(_subscriber[ii]);
+
+    if ((entry != _cache.end()) && (!entry->second.empty()))
+    {
+      append_count(dump, entry->second.size());
+
+      for (zmq_msg_t* message : entry->second)
+      {
+        append_part(dump, (const char*)zmq_msg_data(message), zmq_msg_size(message));
+      }
+    }
+    else
+    {
+      std::string status = "OK";
+      append_count(dump, 2);
+      append_part(dump, _statnames[ii].c_str(), _statnames[ii].length());
+      append_part(dump, status.c_str(), status.length());
+    }
+  }
+
+  std::string topic = ZMQ_DUMP_ALL_TOPIC;
+  std::string status = "OK";
+  zmq_send(_publisher, topic.c_str(), topic.length(), ZMQ_SNDMORE);
+  zmq_send(_publisher, status.c_str(), status.length(), ZMQ_SNDMORE);
+  zmq_send(_publisher, dump.data(), dump.length(), 0);
+}
+
 void* LastValueCache::last_value_cache_entry_func(void *lvc)
 {
   ((LastValueCache *)lvc)->run();
@@ -74,6 +74,31 @@ HTTPCode FakeChronosConnection::send_put(std::string& put_identity,
   return status;
 }
 
+void FakeChronosConnection::send_batch_async(std::vector<TimerOperation> operations,
+                                            SAS::TrailId trail,
+                                            BatchCallback callback)
+{
+  for (std::vector<TimerOperation>::iterator it = operations.begin();
+       it != operations.end();
+       ++it)
+  {
+    if (it->type == HttpClient::RequestType::DELETE)
+    {
+      it->rc = send_delete(it->identity, trail);
+    }
+    else if (it->type == HttpClient::RequestType::PUT)
+    {
+      it->rc = send_put(it->identity, it->interval, it->callback_uri, it->opaque_data, trail, it->tags);
+    }
+    else
+    {
+      it->rc = send_post(it->identity, it->interval, it->callback_uri, it->opaque_data, trail, it->tags);
+    }
+  }
+
+  callback(operations);
+}
+
 HTTPCode FakeChronosConnection::get_result(std::string identity)
 {
   std::map<std::string, HTTPCode>::const_iterator i = _results.find(identity);
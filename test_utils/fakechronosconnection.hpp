@@ -43,5 +43,8 @@ private:
                     const std::string& opaque_data,
                     SAS::TrailId trail,
                     const std::map<std::string, uint32_t>& tags);
+  void send_batch_async(std::vector<TimerOperation> operations,
+                        SAS::TrailId trail,
+                        BatchCallback callback);
   HTTPCode get_result(std::string identity);
 };
@@ -56,6 +56,8 @@ public:
   MOCK_METHOD7(send_post, HTTPCode(std::string&, uint32_t, uint32_t, const std::string&, const std::string&, SAS::TrailId, const std::map<std::string, uint32_t>&));
   MOCK_METHOD6(send_put, HTTPCode(std::string&, uint32_t, const std::string&, const std::string&, SAS::TrailId, const std::map<std::string, uint32_t>&));
   MOCK_METHOD6(send_post, HTTPCode(std::string&, uint32_t, const std::string&, const std::string&, SAS::TrailId, const std::map<std::string, uint32_t>&));
+  MOCK_METHOD2(send_batch, void(std::vector<TimerOperation>&, SAS::TrailId));
+  MOCK_METHOD3(send_batch_async, void(std::vector<TimerOperation>, SAS::TrailId, BatchCallback));
 };
 
 #endif
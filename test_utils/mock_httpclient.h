@@ -97,6 +97,7 @@ public:
                                   std::map<std::string, std::string>* response_headers,
                                   int allowed_host_state));
   MOCK_METHOD1(send_request, HttpResponse(const HttpRequest&));
+  MOCK_METHOD2(send_request_async, void(const HttpRequest&, ResponseCallback));
 };
 
 #endif
@@ -20,6 +20,7 @@ public:
   MOCK_METHOD1(add_ip, void(const std::string&));
   MOCK_METHOD1(remove_ip, void(const std::string&));
   MOCK_METHOD1(increment, void(const std::string&));
+  MOCK_METHOD1(increment, void(const IP46Address&));
 };
 
 #endif
@@ -92,6 +92,20 @@ public:
   MOCK_METHOD3(delete_data, Status(const std::string& table,
                                    const std::string& key,
                                    SAS::TrailId trail));
+  MOCK_METHOD6(get_data_multi,
+               void(const std::string& table,
+                    const std::vector<std::string>& keys,
+                    std::vector<GetResult>& results,
+                    SAS::TrailId trail,
+                    bool log_body,
+                    Format data_format));
+  MOCK_METHOD6(set_data_multi,
+               void(const std::string& table,
+                    const std::vector<SetRequest>& requests,
+                    std::vector<Status>& statuses,
+                    SAS::TrailId trail,
+                    bool log_body,
+                    Format data_format));
 };
 
 #endif
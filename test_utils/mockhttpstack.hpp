@@ -54,6 +54,10 @@ public:
                                                     1, 1);
       evhtp_headers_add_header(_req->headers_in, new_header);
     }
+    void add_path_param(const std::string& name, const std::string& value)
+    {
+      _path_params.push_back(std::make_pair(name, value));
+    }
 
   private:
     static evhtp_request_t* evhtp_request(std::string path, std::string file, std::string query = "")
@@ -80,6 +84,7 @@ public:
                                      unsigned short port));
   MOCK_METHOD1(bind_unix_socket, void(const std::string& bind_path));
   MOCK_METHOD2(register_handler, void(const char*, HandlerInterface*));
+  MOCK_METHOD2(register_route, void(const std::string&, HandlerInterface*));
   MOCK_METHOD1(start, void(evhtp_thread_init_cb));
   MOCK_METHOD0(stop, void());
   MOCK_METHOD0(wait_stopped, void());
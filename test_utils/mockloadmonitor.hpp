@@ -22,11 +22,20 @@ public:
   virtual ~MockLoadMonitor() {}
 
   MOCK_METHOD2(admit_request, bool(SAS::TrailId id, bool admit_anyway));
+  MOCK_METHOD3(admit_weighted_request, bool(SAS::TrailId id,
+                                            float cost,
+                                            bool admit_anyway));
+  MOCK_METHOD4(admit_priority_request, bool(SAS::TrailId id,
+                                            SIPEventPriorityLevel priority,
+                                            float cost,
+                                            bool admit_anyway));
   MOCK_METHOD0(incr_penalties, void());
   MOCK_METHOD2(request_complete, void(uint64_t latency,
                                       SAS::TrailId id));
   MOCK_METHOD0(get_target_latency_us, int());
-  MOCK_METHOD0(update_statistics, void());
+  MOCK_METHOD3(update_statistics, void(uint64_t smoothed_latency_us,
+                                       uint64_t percentile_latency_us,
+                                       int penalties));
 };
 
 #endif